@@ -1,28 +1,72 @@
 set(spv_version vulkan1.3)
 
+# Compiles the shaders of the target and embeds their SPIR-V into it, see GetEmbeddedShader in
+# vulkan_shader.h. The shaders are looked up by their paths relative to src, so the target should
+# be named after its folder.
 function(target_shaders target)
     set(shader_files ${ARGN})
+    set(output_dir ${CMAKE_BINARY_DIR}/shaders/${target})
 
     foreach(shader ${shader_files})
-        get_filename_component(file_name ${shader} NAME)
         get_filename_component(full_path ${shader} ABSOLUTE)
 
-        set(output_dir ${CMAKE_BINARY_DIR}/shaders)
-        set(output_file ${output_dir}/${target}/${shader}.spv)
+        # A C header of an array named after the path
+        set(output_file ${output_dir}/${shader}.spv.h)
+        get_filename_component(output_file_dir ${output_file} DIRECTORY)
+        string(MAKE_C_IDENTIFIER "${target}/${shader}" variable_name)
 
         set(compiled_shaders ${compiled_shaders} ${output_file})
         set(compiled_shaders ${compiled_shaders} PARENT_SCOPE)
+        set(embedded_includes "${embedded_includes}#include \"${output_file}\"\n")
+        set(embedded_entries
+            "${embedded_entries}    {u8\"${target}/${shader}\", ${variable_name}},\n")
         message(STATUS "Output spv shader: ${output_file}")
         set_source_files_properties(${shader} PROPERTIES HEADER_FILE_ONLY TRUE)
 
         add_custom_command(
             OUTPUT ${output_file}
-            COMMAND ${CMAKE_COMMAND} -E make_directory ${output_dir}
-            COMMAND ${Vulkan_GLSLANG_VALIDATOR_EXECUTABLE} $<$<CONFIG:Debug>:-g> -I${PROJECT_SOURCE_DIR}/src --target-env ${spv_version} -V ${full_path} -o ${output_file}
+            COMMAND ${CMAKE_COMMAND} -E make_directory ${output_file_dir}
+            COMMAND ${Vulkan_GLSLANG_VALIDATOR_EXECUTABLE} $<$<CONFIG:Debug>:-g> -I${PROJECT_SOURCE_DIR}/src --target-env ${spv_version} -V ${full_path} --vn ${variable_name} -o ${output_file}
             DEPENDS ${full_path}
         )
     endforeach()
 
+    # Only written when the shaders change, so that configuring again does not rebuild it
+    set(embedded_file ${output_dir}/embedded_shaders.cpp)
+    file(GENERATE OUTPUT ${embedded_file} CONTENT "// Generated by target_shaders, do not edit.
+
+#include <span>
+#include <stdint.h> // For the arrays of glslangValidator
+#include <string_view>
+${embedded_includes}#include \"core/vulkan/vulkan_shader.h\"
+
+namespace Renderer {
+
+namespace {
+
+struct EmbeddedShader {
+    std::u8string_view path;
+    std::span<const u32> code;
+};
+
+constexpr EmbeddedShader EmbeddedShaders[] = {
+${embedded_entries}};
+
+} // namespace
+
+std::span<const u32> GetEmbeddedShader(std::u8string_view path) {
+    for (const auto& shader : EmbeddedShaders) {
+        if (shader.path == path) {
+            return shader.code;
+        }
+    }
+    return {};
+}
+
+} // namespace Renderer
+")
+    target_sources(${target} PRIVATE ${embedded_file})
+
     add_custom_target(
         ${target}_shaders
         DEPENDS ${compiled_shaders}
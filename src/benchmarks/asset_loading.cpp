@@ -0,0 +1,379 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <fmt/format.h>
+#include "benchmarks/benchmarks.h"
+#include "common/index_conversion.h"
+#include "common/thread_pool.h"
+#include "core/gltf/accessor_decoder.h"
+#include "core/gltf/gltf.h"
+#include "core/gltf/gltf_container.h"
+#include "core/gltf/json_helpers.hpp"
+#include "core/image_decoder.h"
+#include "core/mikkt.h"
+#include "core/scene.h"
+#include "core/vulkan/vulkan_texture.h"
+
+// The benchmarks of scene_loading.cpp on the data of a glTF file, which is read up front
+
+namespace Benchmarks {
+
+namespace {
+
+// Enters the directory of the glTF, as relative URIs are relative to it like when loading
+class DirectoryScope : NonCopyable {
+public:
+    explicit DirectoryScope(const std::filesystem::path& path)
+        : prev_current_path(std::filesystem::current_path()) {
+        if (path.has_parent_path()) {
+            std::filesystem::current_path(path.parent_path());
+        }
+    }
+    ~DirectoryScope() {
+        std::filesystem::current_path(prev_current_path);
+    }
+
+private:
+    std::filesystem::path prev_current_path;
+};
+
+struct Asset : NonCopyable {
+    explicit Asset(const std::filesystem::path& path_) : path(path_), container(path) {
+        // With a parser of its own, as the strings of the glTF point into it
+        json = parser.iterate(container.json_data.data(), GetJSONSize(),
+                              container.json_data.size());
+        gltf = JSON::Deserialize<GLTF::GLTF>(json.get_value());
+
+        const DirectoryScope directory_scope{path};
+        for (const auto& buffer : gltf.buffers) {
+            if (!buffer.uri.has_value()) { // The BIN chunk of a GLB
+                buffers.emplace_back(container.extra_buffer.value_or(std::span<const u8>{}));
+                continue;
+            }
+            buffer_files.emplace_back(std::make_unique<Renderer::BufferFile>(*buffer.uri));
+            buffers.emplace_back(buffer_files.back()->GetSpan());
+        }
+    }
+
+    std::size_t GetJSONSize() const {
+        return container.json_data.size() - simdjson::SIMDJSON_PADDING;
+    }
+
+    // Of the elements of the accessor to the end of its view, empty if they are not stored in
+    // the buffers as they are (e.g. they are compressed)
+    std::span<const u8> GetAccessorData(const GLTF::Accessor& accessor) const {
+        if (!accessor.buffer_view.has_value() || accessor.count == 0) {
+            return {};
+        }
+        const auto& buffer_view = gltf.buffer_views[*accessor.buffer_view];
+        if (buffer_view.extensions.has_value() &&
+            buffer_view.extensions->meshopt_compression.has_value()) {
+            return {};
+        }
+        const auto& buffer = buffers[buffer_view.buffer];
+        const std::size_t view_end = buffer_view.byte_offset + buffer_view.byte_length;
+        const std::size_t offset = buffer_view.byte_offset + accessor.byte_offset;
+        if (buffer.size() < view_end || offset > view_end) {
+            return {};
+        }
+        return buffer.subspan(offset, view_end - offset);
+    }
+
+    // 0 if tightly packed, like DecodeFloatAccessor takes it
+    std::size_t GetByteStride(const GLTF::Accessor& accessor) const {
+        return gltf.buffer_views[*accessor.buffer_view].byte_stride.value_or(0);
+    }
+
+    std::filesystem::path path;
+    GLTF::Container container;
+    simdjson::ondemand::parser parser;
+    simdjson::ondemand::document json;
+    GLTF::GLTF gltf;
+    std::vector<std::unique_ptr<Renderer::BufferFile>> buffer_files;
+    std::vector<std::span<const u8>> buffers; // Of each buffer of the glTF
+};
+
+// Of a triangle list primitive with positions, normals and texcoords, as the loader hands it to
+// MikkTSpace
+struct TangentInput {
+    std::vector<Renderer::MikkT::Vertex> vertices;
+    std::vector<u32> indices;
+};
+
+} // Anonymous namespace
+
+static std::vector<float> DecodeAttribute(const Asset& asset, std::size_t accessor_idx) {
+    const auto& accessor = asset.gltf.accessors[accessor_idx];
+    std::vector<float> values(accessor.count * GLTF::GetComponentCount(accessor.type));
+    GLTF::DecodeFloatAccessor(asset.GetAccessorData(accessor), asset.GetByteStride(accessor),
+                              accessor, values);
+    return values;
+}
+
+static std::vector<TangentInput> GetTangentInputs(const Asset& asset) {
+    std::vector<TangentInput> inputs;
+    for (const auto& mesh : asset.gltf.meshes) {
+        for (const auto& primitive : mesh.primitives) {
+            const auto& attributes = primitive.attributes;
+            if (primitive.mode != GLTF::Mesh::Primitive::Mode::Triangles ||
+                !attributes.position.has_value() || !attributes.normal.has_value() ||
+                !attributes.texcoord_0.has_value()) {
+                continue;
+            }
+            const auto has_data = [&asset](std::optional<std::size_t> accessor_idx) {
+                return !accessor_idx.has_value() ||
+                       !asset.GetAccessorData(asset.gltf.accessors[*accessor_idx]).empty();
+            };
+            if (!has_data(attributes.position) || !has_data(attributes.normal) ||
+                !has_data(attributes.texcoord_0) || !has_data(primitive.indices)) {
+                continue;
+            }
+
+            auto& input = inputs.emplace_back();
+            const auto positions = DecodeAttribute(asset, *attributes.position);
+            const auto normals = DecodeAttribute(asset, *attributes.normal);
+            const auto texcoords = DecodeAttribute(asset, *attributes.texcoord_0);
+            input.vertices.resize(asset.gltf.accessors[*attributes.position].count);
+            for (std::size_t i = 0; i < input.vertices.size(); ++i) {
+                auto& vertex = input.vertices[i];
+                vertex.position = {positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2]};
+                vertex.normal = {normals[i * 3], normals[i * 3 + 1], normals[i * 3 + 2]};
+                vertex.texcoord_0 = {texcoords[i * 2], texcoords[i * 2 + 1]};
+            }
+            if (primitive.indices.has_value()) {
+                const auto& accessor = asset.gltf.accessors[*primitive.indices];
+                input.indices.resize(accessor.count);
+                Common::ReadIndices(asset.GetAccessorData(accessor),
+                                    GLTF::GetComponentSize(accessor.component_type),
+                                    input.indices);
+            }
+        }
+    }
+    return inputs;
+}
+
+// Of the images that the decoders can read, at level 0 as RGBA8
+static std::vector<std::unique_ptr<Renderer::DecodedTexture>> DecodeImages(const Asset& asset) {
+    std::vector<std::unique_ptr<Renderer::DecodedTexture>> textures;
+    const DirectoryScope directory_scope{asset.path};
+    for (const auto& image : asset.gltf.images) {
+        std::unique_ptr<Renderer::BufferFile> file;
+        std::span<const u8> file_data;
+        if (image.uri.has_value()) {
+            file = std::make_unique<Renderer::BufferFile>(*image.uri);
+            file_data = file->GetSpan();
+        } else if (image.buffer_view.has_value()) {
+            const auto& buffer_view = asset.gltf.buffer_views[*image.buffer_view];
+            file_data = asset.buffers[buffer_view.buffer].subspan(buffer_view.byte_offset,
+                                                                  buffer_view.byte_length);
+        }
+        const auto decoders = Renderer::GetImageDecoders();
+        const auto decoder = std::ranges::find_if(
+            decoders, [file_data](const auto* decoder) { return decoder->Accepts(file_data); });
+        if (decoder == decoders.end()) {
+            continue;
+        }
+        const auto [width, height] = (*decoder)->GetInfo(file_data);
+        std::vector<u8> pixels(std::size_t{width} * height * 4);
+        (*decoder)->Decode(file_data, pixels);
+        const std::array<std::span<const u8>, 1> levels{pixels};
+        textures.emplace_back(std::make_unique<Renderer::DecodedTexture>(
+            width, height, static_cast<u32>(std::bit_width(std::max(width, height))),
+            vk::Format::eR8G8B8A8Srgb, vk::ComponentMapping{}, levels, nullptr));
+    }
+    return textures;
+}
+
+static void BM_DeserializeGLTF(benchmark::State& state, std::shared_ptr<const Asset> asset) {
+    const auto& json_data = asset->container.json_data;
+    simdjson::ondemand::parser parser;
+    for (auto _ : state) {
+        simdjson::ondemand::document document =
+            parser.iterate(json_data.data(), asset->GetJSONSize(), json_data.size());
+        auto gltf = JSON::Deserialize<GLTF::GLTF>(document.get_value());
+        benchmark::DoNotOptimize(gltf);
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * asset->GetJSONSize()));
+}
+
+// Of the external files and data URIs, read or decoded in whole
+static void BM_BufferFileRead(benchmark::State& state, std::shared_ptr<const Asset> asset) {
+    const DirectoryScope directory_scope{asset->path};
+    std::size_t total_size{};
+    for (auto _ : state) {
+        total_size = 0;
+        for (const auto& buffer : asset->gltf.buffers) {
+            if (!buffer.uri.has_value()) {
+                continue;
+            }
+            const Renderer::BufferFile buffer_file{*buffer.uri};
+            const auto span = buffer_file.GetSpan();
+            benchmark::DoNotOptimize(std::accumulate(span.begin(), span.end(), u64{}));
+            total_size += span.size();
+        }
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * total_size));
+}
+
+// Of every accessor, as CPUAccessor reads them
+static void BM_GatherAccessor(benchmark::State& state, std::shared_ptr<const Asset> asset) {
+    std::vector<u8> dst;
+    std::size_t total_size{};
+    for (auto _ : state) {
+        total_size = 0;
+        for (const auto& accessor : asset->gltf.accessors) {
+            const auto data = asset->GetAccessorData(accessor);
+            if (data.empty()) {
+                continue;
+            }
+            dst.resize(GLTF::GetTotalSize(accessor));
+            GLTF::GatherAccessor(data, asset->GetByteStride(accessor), accessor, dst);
+            benchmark::ClobberMemory();
+            total_size += dst.size();
+        }
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * total_size));
+}
+
+// Of the u8 accessors, whose indices the loader widens
+static void BM_WidenIndicesU8ToU16(benchmark::State& state, std::shared_ptr<const Asset> asset) {
+    std::vector<u16> dst;
+    std::size_t total_size{};
+    for (auto _ : state) {
+        total_size = 0;
+        for (const auto& accessor : asset->gltf.accessors) {
+            const auto data = asset->GetAccessorData(accessor);
+            if (data.empty() ||
+                accessor.component_type != GLTF::Accessor::ComponentType::UnsignedByte) {
+                continue;
+            }
+            dst.resize(accessor.count);
+            Common::WidenIndicesU8ToU16(data.first(accessor.count), dst.data());
+            benchmark::ClobberMemory();
+            total_size += accessor.count;
+        }
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * total_size));
+}
+
+static std::size_t GetNumTriangles(const std::vector<TangentInput>& inputs) {
+    std::size_t num_triangles{};
+    for (const auto& input : inputs) {
+        num_triangles += (input.indices.empty() ? input.vertices.size() : input.indices.size()) / 3;
+    }
+    return num_triangles;
+}
+
+static void BM_MikkTSpace(benchmark::State& state,
+                          std::shared_ptr<const std::vector<TangentInput>> inputs) {
+    for (auto _ : state) {
+        for (const auto& input : *inputs) {
+            Renderer::MikkT::UserData user_data{.vertices = input.vertices,
+                                                .indices = input.indices};
+            Renderer::MikkT::GenerateTangents(user_data);
+            benchmark::DoNotOptimize(user_data.out.data());
+        }
+    }
+    state.SetItemsProcessed(static_cast<s64>(state.iterations() * GetNumTriangles(*inputs)));
+}
+
+// With the thread pool, as the loader does
+static void BM_WeldCorners(benchmark::State& state,
+                           std::shared_ptr<const std::vector<TangentInput>> inputs) {
+    std::vector<Renderer::MikkT::UserData> user_data;
+    for (const auto& input : *inputs) {
+        auto& data = user_data.emplace_back(
+            Renderer::MikkT::UserData{.vertices = input.vertices, .indices = input.indices});
+        Renderer::MikkT::GenerateTangents(data);
+    }
+    static Common::ThreadPool thread_pool;
+
+    std::vector<Renderer::MikkT::Vertex> vertices;
+    std::vector<u32_le> indices;
+    for (auto _ : state) {
+        for (const auto& data : user_data) {
+            vertices.clear();
+            indices.clear();
+            Renderer::MikkT::WeldCorners(data, vertices, indices, &thread_pool);
+            benchmark::DoNotOptimize(vertices.data());
+        }
+    }
+    state.SetItemsProcessed(static_cast<s64>(state.iterations() * GetNumTriangles(*inputs) * 3));
+}
+
+static void BM_GenerateMipmaps(
+    benchmark::State& state,
+    std::shared_ptr<const std::vector<std::unique_ptr<Renderer::DecodedTexture>>> textures) {
+    std::size_t total_size{};
+    for (const auto& texture : *textures) {
+        total_size += texture->GetLevel(0).size();
+    }
+    for (auto _ : state) {
+        for (const auto& texture : *textures) {
+            state.PauseTiming(); // Copies level 0
+            const std::array<std::span<const u8>, 1> levels{texture->GetLevel(0)};
+            Renderer::DecodedTexture copy{texture->width,      texture->height,
+                                          texture->num_levels, texture->format,
+                                          texture->components, levels,
+                                          nullptr};
+            state.ResumeTiming();
+            copy.GenerateMipmaps();
+            benchmark::DoNotOptimize(copy.mip_levels.back().get());
+        }
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * total_size));
+}
+
+void RegisterAssetBenchmarks(const std::filesystem::path& path) {
+    const auto asset = std::make_shared<const Asset>(path);
+    const auto register_benchmark = [&path](std::string_view name, auto func, auto data) {
+        const auto full_name = fmt::format("{}/{}", name, path.filename().string());
+        return benchmark::RegisterBenchmark(full_name.c_str(), func, std::move(data));
+    };
+
+    register_benchmark("BM_DeserializeGLTF", BM_DeserializeGLTF, asset);
+    if (std::ranges::any_of(asset->gltf.buffers,
+                            [](const GLTF::Buffer& buffer) { return buffer.uri.has_value(); })) {
+        register_benchmark("BM_BufferFileRead", BM_BufferFileRead, asset);
+    }
+    const auto has_data = [&asset](const GLTF::Accessor& accessor) {
+        return !asset->GetAccessorData(accessor).empty();
+    };
+    if (std::ranges::any_of(asset->gltf.accessors, has_data)) {
+        register_benchmark("BM_GatherAccessor", BM_GatherAccessor, asset);
+    }
+    if (std::ranges::any_of(asset->gltf.accessors, [&has_data](const GLTF::Accessor& accessor) {
+            return accessor.component_type == GLTF::Accessor::ComponentType::UnsignedByte &&
+                   has_data(accessor);
+        })) {
+        register_benchmark("BM_WidenIndicesU8ToU16", BM_WidenIndicesU8ToU16, asset);
+    }
+
+    const auto tangent_inputs =
+        std::make_shared<const std::vector<TangentInput>>(GetTangentInputs(*asset));
+    if (!tangent_inputs->empty()) {
+        register_benchmark("BM_MikkTSpace", BM_MikkTSpace, tangent_inputs)
+            ->Unit(benchmark::kMillisecond);
+        register_benchmark("BM_WeldCorners", BM_WeldCorners, tangent_inputs)
+            ->Unit(benchmark::kMillisecond);
+    }
+
+    const auto textures =
+        std::make_shared<const std::vector<std::unique_ptr<Renderer::DecodedTexture>>>(
+            DecodeImages(*asset));
+    if (!textures->empty()) {
+        register_benchmark("BM_GenerateMipmaps", BM_GenerateMipmaps, textures)
+            ->Unit(benchmark::kMillisecond);
+    }
+}
+
+} // namespace Benchmarks
@@ -0,0 +1,15 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <filesystem>
+
+namespace Benchmarks {
+
+// Registers the benchmarks of the CPU hot paths of scene loading (see scene_loading.cpp) on the
+// data of the glTF file, prefixed with its name. Those without any data in it are skipped.
+void RegisterAssetBenchmarks(const std::filesystem::path& path);
+
+} // namespace Benchmarks
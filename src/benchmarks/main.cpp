@@ -0,0 +1,30 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <exception>
+#include <benchmark/benchmark.h>
+#include <spdlog/spdlog.h>
+#include "benchmarks/benchmarks.h"
+#include "common/log.h"
+
+// Micro-benchmarks of the CPU hot paths of the renderer, on synthetic data and on the glTF
+// files given after the Google Benchmark flags, e.g.
+//     benchmarks --benchmark_filter=Mikk scene.gltf
+
+int main(int argc, char* argv[]) {
+    Common::InitializeLogging();
+
+    benchmark::Initialize(&argc, argv);
+    for (int i = 1; i < argc; ++i) {
+        try {
+            Benchmarks::RegisterAssetBenchmarks(argv[i]);
+        } catch (const std::exception& e) {
+            SPDLOG_CRITICAL("Could not load {}: {}", argv[i], e.what());
+            return 1;
+        }
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
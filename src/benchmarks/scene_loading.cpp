@@ -0,0 +1,242 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <array>
+#include <bit>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <fmt/format.h>
+#include <libbase64.h>
+#include "common/index_conversion.h"
+#include "common/thread_pool.h"
+#include "core/gltf/accessor_decoder.h"
+#include "core/gltf/gltf.h"
+#include "core/gltf/json_helpers.hpp"
+#include "core/gltf/simdjson.h"
+#include "core/mikkt.h"
+#include "core/scene.h"
+#include "core/vulkan/vulkan_texture.h"
+
+// The CPU hot paths of scene loading on synthetic data, of sizes given by the argument
+
+namespace Benchmarks {
+
+static std::vector<u8> RandomBytes(std::size_t size) {
+    std::mt19937 engine{static_cast<u32>(size)};
+    std::uniform_int_distribution<u32> distribution{0, 255};
+    std::vector<u8> bytes(size);
+    for (auto& byte : bytes) {
+        byte = static_cast<u8>(distribution(engine));
+    }
+    return bytes;
+}
+
+// Of as many nodes, each with a mesh of its own
+static std::string MakeGLTFJSON(std::size_t num_nodes) {
+    std::string json = R"({"asset":{"version":"2.0"},"buffers":[{"byteLength":36}],)"
+                       R"("bufferViews":[{"buffer":0,"byteLength":36}],"accessors":[)";
+    auto out = std::back_inserter(json);
+    for (std::size_t i = 0; i < num_nodes; ++i) {
+        fmt::format_to(out,
+                       R"({}{{"bufferView":0,"componentType":5126,"count":3,"type":"VEC3",)"
+                       R"("min":[0,0,0],"max":[1,1,0]}})",
+                       i == 0 ? "" : ",");
+    }
+    json += R"(],"meshes":[)";
+    for (std::size_t i = 0; i < num_nodes; ++i) {
+        fmt::format_to(out, R"({}{{"primitives":[{{"attributes":{{"POSITION":{}}}}}]}})",
+                       i == 0 ? "" : ",", i);
+    }
+    json += R"(],"nodes":[)";
+    for (std::size_t i = 0; i < num_nodes; ++i) {
+        fmt::format_to(out, R"({}{{"name":"Node {}","mesh":{},"translation":[{},0,0]}})",
+                       i == 0 ? "" : ",", i, i, i);
+    }
+    json += R"(],"scenes":[{"nodes":[)";
+    for (std::size_t i = 0; i < num_nodes; ++i) {
+        fmt::format_to(out, "{}{}", i == 0 ? "" : ",", i);
+    }
+    json += "]}]}";
+    return json;
+}
+
+static void BM_DeserializeGLTF(benchmark::State& state) {
+    const simdjson::padded_string json{MakeGLTFJSON(static_cast<std::size_t>(state.range(0)))};
+    simdjson::ondemand::parser parser;
+    for (auto _ : state) {
+        simdjson::ondemand::document document = parser.iterate(json);
+        auto gltf = JSON::Deserialize<GLTF::GLTF>(document.get_value());
+        benchmark::DoNotOptimize(gltf);
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * json.size()));
+}
+BENCHMARK(BM_DeserializeGLTF)->RangeMultiplier(8)->Range(64, 32768);
+
+// Maps the file and reads all of it through the BufferFile, as accessors are read
+static void BM_BufferFileRead(benchmark::State& state) {
+    const auto size = static_cast<std::size_t>(state.range(0));
+    const auto path = std::filesystem::temp_directory_path() / "border_collie_benchmark.bin";
+    {
+        const auto bytes = RandomBytes(size);
+        std::ofstream file{path, std::ios::binary};
+        file.write(reinterpret_cast<const char*>(bytes.data()),
+                   static_cast<std::streamsize>(bytes.size()));
+    }
+    for (auto _ : state) {
+        const Renderer::BufferFile buffer_file{path.string()};
+        const auto span = buffer_file.GetSpan();
+        benchmark::DoNotOptimize(std::accumulate(span.begin(), span.end(), u64{}));
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * size));
+    std::filesystem::remove(path);
+}
+BENCHMARK(BM_BufferFileRead)->RangeMultiplier(16)->Range(1 << 16, 1 << 26);
+
+// Decodes all of a data URI of that many bytes
+static void BM_Base64Decode(benchmark::State& state) {
+    const auto bytes = RandomBytes(static_cast<std::size_t>(state.range(0)));
+    std::string uri = "data:application/octet-stream;base64,";
+    const std::size_t prefix_size = uri.size();
+    uri.resize(prefix_size + (bytes.size() + 2) / 3 * 4);
+    std::size_t encoded_size{};
+    base64_encode(reinterpret_cast<const char*>(bytes.data()), bytes.size(),
+                  uri.data() + prefix_size, &encoded_size, 0);
+    uri.resize(prefix_size + encoded_size);
+
+    for (auto _ : state) {
+        const Renderer::BufferFile buffer_file{uri};
+        benchmark::DoNotOptimize(buffer_file.GetSpan().data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * bytes.size()));
+}
+BENCHMARK(BM_Base64Decode)->RangeMultiplier(16)->Range(1 << 12, 1 << 26);
+
+static void BM_WidenIndicesU8ToU16(benchmark::State& state) {
+    const auto src = RandomBytes(static_cast<std::size_t>(state.range(0)));
+    std::vector<u16> dst(src.size());
+    for (auto _ : state) {
+        Common::WidenIndicesU8ToU16(src, dst.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * src.size()));
+}
+BENCHMARK(BM_WidenIndicesU8ToU16)->RangeMultiplier(16)->Range(1 << 8, 1 << 24);
+
+// Of the float3 positions of interleaved vertices of 32 bytes, as CPUAccessor reads them, and
+// of packed ones
+static void BM_GatherAccessor(benchmark::State& state) {
+    const auto count = static_cast<std::size_t>(state.range(0));
+    const auto byte_stride = static_cast<std::size_t>(state.range(1));
+    GLTF::Accessor accessor{};
+    accessor.component_type.value = GLTF::Accessor::ComponentType::Float;
+    accessor.count.value = count;
+    static_cast<std::string_view&>(accessor.type) = "VEC3";
+    const auto src = RandomBytes(count * byte_stride);
+    std::vector<u8> dst(count * 3 * sizeof(float));
+    for (auto _ : state) {
+        GLTF::GatherAccessor(src, byte_stride, accessor, dst);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * dst.size()));
+}
+BENCHMARK(BM_GatherAccessor)
+    ->ArgsProduct({benchmark::CreateRange(1 << 10, 1 << 22, 32), {12, 32}});
+
+// Of the two triangles of a quad
+static constexpr std::array<std::pair<std::size_t, std::size_t>, 6> QuadCorners{{
+    {0, 0},
+    {1, 0},
+    {1, 1},
+    {0, 0},
+    {1, 1},
+    {0, 1},
+}};
+
+// An unindexed grid of n by n quads, as the loader hands primitives to MikkTSpace
+static std::vector<Renderer::MikkT::Vertex> MakeGrid(std::size_t n) {
+    std::vector<Renderer::MikkT::Vertex> vertices;
+    vertices.reserve(n * n * 6);
+    const auto vertex = [n](std::size_t x, std::size_t y) {
+        const glm::vec2 uv = glm::vec2{x, y} / static_cast<float>(n);
+        return Renderer::MikkT::Vertex{
+            // A little wavy, so that the normals and tangents differ
+            .position = {uv.x, 0.1f * std::sin(uv.x * 20.0f + uv.y * 10.0f), uv.y},
+            .normal = glm::normalize(glm::vec3{-std::cos(uv.x * 20.0f), 1.0f, 0.0f}),
+            .texcoord_0 = uv,
+        };
+    };
+    for (std::size_t y = 0; y < n; ++y) {
+        for (std::size_t x = 0; x < n; ++x) {
+            for (const auto& [dx, dy] : QuadCorners) {
+                vertices.emplace_back(vertex(x + dx, y + dy));
+            }
+        }
+    }
+    return vertices;
+}
+
+static void BM_MikkTSpace(benchmark::State& state) {
+    const auto vertices = MakeGrid(static_cast<std::size_t>(state.range(0)));
+    const std::vector<u32> indices;
+    for (auto _ : state) {
+        Renderer::MikkT::UserData user_data{.vertices = vertices, .indices = indices};
+        Renderer::MikkT::GenerateTangents(user_data);
+        benchmark::DoNotOptimize(user_data.out.data());
+    }
+    state.SetItemsProcessed(static_cast<s64>(state.iterations() * vertices.size() / 3));
+}
+BENCHMARK(BM_MikkTSpace)->RangeMultiplier(4)->Range(8, 512)->Unit(benchmark::kMillisecond);
+
+// Of the corners of the grid with their tangents back into vertices, with the thread pool of
+// the loader when the second argument is set (which only gets used past SortedWeldThreshold)
+static void BM_WeldCorners(benchmark::State& state) {
+    const auto vertices = MakeGrid(static_cast<std::size_t>(state.range(0)));
+    const std::vector<u32> indices;
+    Renderer::MikkT::UserData user_data{.vertices = vertices, .indices = indices};
+    Renderer::MikkT::GenerateTangents(user_data);
+    static Common::ThreadPool thread_pool;
+
+    std::vector<Renderer::MikkT::Vertex> welded_vertices;
+    std::vector<u32_le> welded_indices;
+    for (auto _ : state) {
+        welded_vertices.clear();
+        welded_indices.clear();
+        Renderer::MikkT::WeldCorners(user_data, welded_vertices, welded_indices,
+                                     state.range(1) ? &thread_pool : nullptr);
+        benchmark::DoNotOptimize(welded_vertices.data());
+    }
+    state.SetItemsProcessed(static_cast<s64>(state.iterations() * vertices.size()));
+}
+BENCHMARK(BM_WeldCorners)
+    ->ArgsProduct({benchmark::CreateRange(8, 512, 4), {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+// Of a whole chain of an sRGB RGBA8 image of that extent, downsampled with stb_image_resize
+static void BM_GenerateMipmaps(benchmark::State& state) {
+    const auto extent = static_cast<u32>(state.range(0));
+    const auto pixels = RandomBytes(std::size_t{extent} * extent * 4);
+    const std::array<std::span<const u8>, 1> levels{pixels};
+    const auto num_levels = static_cast<u32>(std::bit_width(extent));
+    for (auto _ : state) {
+        state.PauseTiming(); // Copies level 0
+        Renderer::DecodedTexture texture{extent, extent, num_levels, vk::Format::eR8G8B8A8Srgb,
+                                         {},     levels, nullptr};
+        state.ResumeTiming();
+        texture.GenerateMipmaps();
+        benchmark::DoNotOptimize(texture.mip_levels.back().get());
+    }
+    state.SetBytesProcessed(static_cast<s64>(state.iterations() * pixels.size()));
+}
+BENCHMARK(BM_GenerateMipmaps)->RangeMultiplier(4)->Range(64, 4096)->Unit(benchmark::kMillisecond);
+
+} // namespace Benchmarks
@@ -0,0 +1,100 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "common/thread_pool.h"
+
+// Scheduling overheads of Common::ThreadPool, with as many workers as the argument
+
+namespace Benchmarks {
+
+static void BM_ThreadPoolSubmit(benchmark::State& state) {
+    Common::ThreadPool thread_pool{static_cast<std::size_t>(state.range(0))};
+    std::vector<std::future<void>> futures;
+    for (auto _ : state) {
+        for (std::size_t i = 0; i < 1024; ++i) {
+            futures.emplace_back(thread_pool.Submit([] {}));
+        }
+        thread_pool.WaitAll(futures);
+    }
+    state.SetItemsProcessed(static_cast<s64>(state.iterations() * 1024));
+}
+BENCHMARK(BM_ThreadPoolSubmit)->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+static void BM_ThreadPoolParallelFor(benchmark::State& state) {
+    Common::ThreadPool thread_pool{static_cast<std::size_t>(state.range(0))};
+    std::vector<u32> values(1 << 16);
+    for (auto _ : state) {
+        thread_pool.ParallelFor(0, values.size(), [&values](std::size_t i) { ++values[i]; });
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<s64>(state.iterations() * values.size()));
+}
+BENCHMARK(BM_ThreadPoolParallelFor)->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+// Latency of a continuation, which is polled once the task that it waits on completes
+static void BM_ThreadPoolSubmitAfter(benchmark::State& state) {
+    Common::ThreadPool thread_pool{static_cast<std::size_t>(state.range(0))};
+    for (auto _ : state) {
+        std::vector<std::shared_future<void>> dependencies{thread_pool.Submit([] {}).share()};
+        auto future = thread_pool.SubmitAfter(std::move(dependencies), [] {});
+        thread_pool.Wait(future);
+    }
+}
+BENCHMARK(BM_ThreadPoolSubmitAfter)->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+// Latency of a deferred task whose condition is set by another thread, which calls Notify if
+// the second argument is set, and otherwise leaves it to the polling. The task has been
+// deferred a while before that, as by then the poller backs off.
+static void BM_ThreadPoolSubmitWhen(benchmark::State& state) {
+    Common::ThreadPool thread_pool{static_cast<std::size_t>(state.range(0))};
+    const bool notify = state.range(1) != 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::atomic<bool> ready{false};
+        auto future =
+            thread_pool.SubmitWhen([&ready] { return ready.load(std::memory_order_acquire); },
+                                   [] {});
+        std::this_thread::sleep_for(std::chrono::milliseconds{2});
+        state.ResumeTiming();
+
+        ready.store(true, std::memory_order_release);
+        if (notify) {
+            thread_pool.Notify();
+        }
+        future.wait();
+    }
+}
+BENCHMARK(BM_ThreadPoolSubmitWhen)
+    ->ArgsProduct({{1, 4, 16}, {0, 1}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+// Of the other workers while a deferred task is pending, which only the poller polls
+static void BM_ThreadPoolSubmitWhileDeferred(benchmark::State& state) {
+    Common::ThreadPool thread_pool{static_cast<std::size_t>(state.range(0))};
+    std::atomic<bool> ready{false};
+    auto deferred = thread_pool.SubmitWhen(
+        [&ready] { return ready.load(std::memory_order_acquire); }, [] {});
+    std::vector<std::future<void>> futures;
+    for (auto _ : state) {
+        for (std::size_t i = 0; i < 1024; ++i) {
+            futures.emplace_back(thread_pool.Submit([] {}));
+        }
+        thread_pool.WaitAll(futures);
+    }
+    state.SetItemsProcessed(static_cast<s64>(state.iterations() * 1024));
+
+    ready.store(true, std::memory_order_release);
+    thread_pool.Notify();
+    deferred.wait();
+}
+BENCHMARK(BM_ThreadPoolSubmitWhileDeferred)->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+} // namespace Benchmarks
@@ -0,0 +1,95 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <cstdlib>
+#include <new>
+#include "common/allocation_counter.h"
+
+namespace Common {
+
+#ifdef ENABLE_ALLOCATION_COUNTER
+
+static thread_local u64 g_allocation_count{};
+
+u64 GetAllocationCount() noexcept {
+    return g_allocation_count;
+}
+
+#else
+
+u64 GetAllocationCount() noexcept {
+    return 0;
+}
+
+#endif
+
+} // namespace Common
+
+#ifdef ENABLE_ALLOCATION_COUNTER
+
+// Replacements of the global operator new and delete. The versions for arrays, and the nothrow
+// deletes, forward to these by default.
+
+static void* Allocate(std::size_t size, std::size_t alignment) noexcept {
+    ++Common::g_allocation_count;
+    size = size == 0 ? 1 : size;
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        return std::malloc(size);
+    }
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+}
+
+static void Free(void* ptr, [[maybe_unused]] std::size_t alignment) noexcept {
+#ifdef _WIN32
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        _aligned_free(ptr);
+        return;
+    }
+#endif
+    std::free(ptr);
+}
+
+void* operator new(std::size_t size) {
+    if (void* ptr = Allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (void* ptr = Allocate(size, static_cast<std::size_t>(alignment))) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return Allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return Allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept {
+    Free(ptr, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void* ptr, std::align_val_t alignment) noexcept {
+    Free(ptr, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    Free(ptr, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t alignment) noexcept {
+    Free(ptr, static_cast<std::size_t>(alignment));
+}
+
+#endif
@@ -0,0 +1,19 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include "common/common_types.h"
+
+namespace Common {
+
+/**
+ * Heap allocations made through the global operator new by the calling thread so far. Only
+ * counted when built with ENABLE_ALLOCATION_COUNTER, which replaces the global operator new for
+ * that; always 0 otherwise. Memory that libraries allocate with malloc directly (e.g. drivers) is
+ * not counted.
+ */
+u64 GetAllocationCount() noexcept;
+
+} // namespace Common
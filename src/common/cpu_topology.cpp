@@ -0,0 +1,155 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <thread>
+#include "common/cpu_topology.h"
+
+namespace Common {
+
+std::size_t CpuTopology::GetNumCpus() const noexcept {
+    std::size_t count = 0;
+    for (const auto& node : nodes) {
+        count += node.cpus.size();
+    }
+    return count;
+}
+
+#ifdef __linux__
+// Of a list like "0-15,32-47"
+static std::vector<u32> ParseCpuList(const std::string& list) {
+    std::vector<u32> cpus;
+    std::size_t pos = 0;
+    while (pos < list.size()) {
+        std::size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        const std::string range = list.substr(pos, end - pos);
+        const std::size_t dash = range.find('-');
+        try {
+            const auto first = static_cast<u32>(std::stoul(range.substr(0, dash)));
+            const auto last = dash == std::string::npos
+                                  ? first
+                                  : static_cast<u32>(std::stoul(range.substr(dash + 1)));
+            for (u32 cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch (...) { // Blank, e.g. the trailing newline
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+#endif
+
+static CpuTopology ReadCpuTopology() {
+    CpuTopology topology;
+#ifdef _WIN32
+    DWORD length = 0;
+    GetLogicalProcessorInformationEx(RelationNumaNode, nullptr, &length);
+    std::vector<u8> buffer(length);
+    if (length != 0 &&
+        GetLogicalProcessorInformationEx(
+            RelationNumaNode,
+            reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data()), &length)) {
+        for (DWORD offset = 0; offset < length;) {
+            const auto* info =
+                reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(&buffer[offset]);
+            offset += info->Size;
+            const auto& mask = info->NumaNode.GroupMask;
+            CpuTopology::Node node{.id = info->NumaNode.NodeNumber};
+            for (u32 i = 0; i < 64; ++i) {
+                if (mask.Mask & (KAFFINITY{1} << i)) {
+                    node.cpus.push_back(u32{mask.Group} * 64 + i);
+                }
+            }
+            if (!node.cpus.empty()) {
+                topology.nodes.emplace_back(std::move(node));
+            }
+        }
+    }
+#elif defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool has_affinity = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    std::error_code ec;
+    for (const auto& entry :
+         std::filesystem::directory_iterator{"/sys/devices/system/node", ec}) {
+        const std::string name = entry.path().filename().string();
+        const auto IsDigit = [](char c) { return c >= '0' && c <= '9'; };
+        if (!name.starts_with("node") || name.size() == 4 ||
+            !std::all_of(name.begin() + 4, name.end(), IsDigit)) {
+            continue;
+        }
+        std::ifstream file{entry.path() / "cpulist"};
+        std::string list;
+        std::getline(file, list);
+        CpuTopology::Node node{.id = static_cast<u32>(std::stoul(name.substr(4)))};
+        for (const u32 cpu : ParseCpuList(list)) {
+            if (!has_affinity || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+                node.cpus.push_back(cpu);
+            }
+        }
+        if (!node.cpus.empty()) {
+            topology.nodes.emplace_back(std::move(node));
+        }
+    }
+    std::ranges::sort(topology.nodes, {}, &CpuTopology::Node::id);
+#endif
+    if (topology.nodes.empty()) {
+        CpuTopology::Node node;
+        for (u32 i = 0; i < std::max(std::thread::hardware_concurrency(), 1u); ++i) {
+            node.cpus.push_back(i);
+        }
+        topology.nodes.emplace_back(std::move(node));
+    }
+    return topology;
+}
+
+const CpuTopology& GetCpuTopology() {
+    static const CpuTopology topology = ReadCpuTopology();
+    return topology;
+}
+
+bool PinCurrentThread([[maybe_unused]] const CpuTopology::Node& node) {
+#ifdef _WIN32
+    // The CPUs of a node are within one group
+    if (node.cpus.empty()) {
+        return false;
+    }
+    GROUP_AFFINITY affinity{.Group = static_cast<WORD>(node.cpus.front() / 64)};
+    for (const u32 cpu : node.cpus) {
+        if (cpu / 64 == affinity.Group) {
+            affinity.Mask |= KAFFINITY{1} << (cpu % 64);
+        }
+    }
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const u32 cpu : node.cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+} // namespace Common
@@ -0,0 +1,35 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <vector>
+#include "common/common_types.h"
+
+namespace Common {
+
+/**
+ * The NUMA nodes of the machine, with the logical CPUs of each that the process may run on, as
+ * the OS reports them (sysfs on Linux, the processor groups on Windows). Machines without NUMA,
+ * and other platforms, have a single node of all CPUs.
+ */
+struct CpuTopology {
+    struct Node {
+        u32 id{};
+        // Numbered as by the OS. On Windows, the processor group times 64 plus the number within
+        // the group.
+        std::vector<u32> cpus;
+    };
+    std::vector<Node> nodes; // Those without CPUs the process may run on are left out
+
+    std::size_t GetNumCpus() const noexcept;
+};
+
+// Read once on first use. Thread safe.
+const CpuTopology& GetCpuTopology();
+// Restricts the calling thread to the CPUs of the node, so that the memory it touches first is
+// allocated local to them. Returns false where that is unsupported or fails.
+bool PinCurrentThread(const CpuTopology::Node& node);
+
+} // namespace Common
@@ -0,0 +1,249 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <spdlog/spdlog.h>
+#include "common/exr.h"
+#include "common/file_util.h"
+
+namespace Common {
+
+// OpenEXR files are little endian, like the hosts this runs on
+namespace {
+
+constexpr u32 Magic = 20000630;
+constexpr u32 Version = 2;
+// Flags of the version field, of files that are not single part scanline images
+constexpr u32 TiledFlag = 0x200;
+constexpr u32 NonImageFlag = 0x800;
+constexpr u32 MultipartFlag = 0x1000;
+constexpr u32 PixelTypeFloat = 2;
+
+template <typename T>
+void Append(std::vector<u8>& out, const T& value) {
+    const auto* bytes = reinterpret_cast<const u8*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void AppendString(std::vector<u8>& out, std::string_view str) {
+    out.insert(out.end(), str.begin(), str.end());
+    out.push_back(0);
+}
+
+// Appends the name and type of the attribute, and the size of the value append_value appends
+template <typename F>
+void AppendAttribute(std::vector<u8>& out, std::string_view name, std::string_view type,
+                     F&& append_value) {
+    AppendString(out, name);
+    AppendString(out, type);
+    const std::size_t size_pos = out.size();
+    Append<u32>(out, 0);
+    append_value();
+    const auto size = static_cast<u32>(out.size() - size_pos - sizeof(u32));
+    std::memcpy(out.data() + size_pos, &size, sizeof(size));
+}
+
+class Reader {
+public:
+    explicit Reader(std::span<const u8> data_, const std::filesystem::path& path_)
+        : data(data_), path(path_) {}
+
+    template <typename T>
+    T Read() {
+        T value;
+        std::memcpy(&value, ReadBytes(sizeof(T)).data(), sizeof(T));
+        return value;
+    }
+
+    std::span<const u8> ReadBytes(std::size_t size) {
+        if (size > data.size() - pos) {
+            Fail("Unexpected end of file");
+        }
+        const auto bytes = data.subspan(pos, size);
+        pos += size;
+        return bytes;
+    }
+
+    std::string ReadString() {
+        const auto end = std::find(data.begin() + pos, data.end(), u8{0});
+        if (end == data.end()) {
+            Fail("Unterminated string");
+        }
+        std::string str(data.begin() + pos, end);
+        pos = static_cast<std::size_t>(end - data.begin()) + 1;
+        return str;
+    }
+
+    void Seek(std::size_t pos_) {
+        if (pos_ > data.size()) {
+            Fail("Offset out of range");
+        }
+        pos = pos_;
+    }
+
+    [[noreturn]] void Fail(std::string_view reason) const {
+        SPDLOG_ERROR("Invalid EXR file {}: {}", path.string(), reason);
+        throw std::runtime_error("Invalid EXR file");
+    }
+
+private:
+    std::span<const u8> data;
+    const std::filesystem::path& path;
+    std::size_t pos = 0;
+};
+
+} // namespace
+
+void WriteEXR(const std::filesystem::path& path, const FloatImage& image) {
+    const std::size_t num_channels = image.channels.size();
+    if (image.width == 0 || image.height == 0 || num_channels == 0 ||
+        image.pixels.size() != std::size_t{image.width} * image.height * num_channels ||
+        !std::is_sorted(image.channels.begin(), image.channels.end())) {
+        SPDLOG_ERROR("Invalid image for EXR file {}", path.string());
+        throw std::runtime_error("Invalid image for EXR file");
+    }
+
+    std::vector<u8> out;
+    Append(out, Magic);
+    Append(out, Version);
+    AppendAttribute(out, "channels", "chlist", [&] {
+        for (const auto& channel : image.channels) {
+            AppendString(out, channel);
+            Append(out, PixelTypeFloat);
+            Append<u32>(out, 0); // Not perceptually linear, and reserved
+            Append<s32>(out, 1); // Sampling in x and y
+            Append<s32>(out, 1);
+        }
+        out.push_back(0);
+    });
+    AppendAttribute(out, "compression", "compression", [&] { out.push_back(0); });
+    const std::array<s32, 4> window{0, 0, static_cast<s32>(image.width) - 1,
+                                    static_cast<s32>(image.height) - 1};
+    AppendAttribute(out, "dataWindow", "box2i", [&] { Append(out, window); });
+    AppendAttribute(out, "displayWindow", "box2i", [&] { Append(out, window); });
+    AppendAttribute(out, "lineOrder", "lineOrder", [&] { out.push_back(0); }); // Increasing y
+    AppendAttribute(out, "pixelAspectRatio", "float", [&] { Append(out, 1.0f); });
+    AppendAttribute(out, "screenWindowCenter", "v2f",
+                    [&] { Append(out, std::array<float, 2>{0.0f, 0.0f}); });
+    AppendAttribute(out, "screenWindowWidth", "float", [&] { Append(out, 1.0f); });
+    out.push_back(0);
+
+    // Each line is a block of its own: its y, size and the values of each channel in turn
+    const std::size_t line_size = std::size_t{image.width} * num_channels * sizeof(float);
+    const std::size_t block_size = sizeof(s32) + sizeof(u32) + line_size;
+    const u64 first_block = out.size() + std::size_t{image.height} * sizeof(u64);
+    for (u32 y = 0; y < image.height; ++y) {
+        Append<u64>(out, first_block + u64{y} * block_size);
+    }
+    out.reserve(out.size() + std::size_t{image.height} * block_size);
+    for (u32 y = 0; y < image.height; ++y) {
+        Append(out, static_cast<s32>(y));
+        Append(out, static_cast<u32>(line_size));
+        const float* row = image.pixels.data() + std::size_t{y} * image.width * num_channels;
+        for (std::size_t channel = 0; channel < num_channels; ++channel) {
+            for (u32 x = 0; x < image.width; ++x) {
+                Append(out, row[x * num_channels + channel]);
+            }
+        }
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(out.data()), out.size());
+    if (!file) {
+        SPDLOG_ERROR("Failed to write EXR file {}", path.string());
+        throw std::runtime_error("Failed to write EXR file");
+    }
+}
+
+FloatImage ReadEXR(const std::filesystem::path& path) {
+    const auto contents = ReadFileContents(path);
+    if (contents.empty()) {
+        throw std::runtime_error("Failed to read EXR file");
+    }
+    Reader reader{contents, path};
+    if (reader.Read<u32>() != Magic) {
+        reader.Fail("Not an OpenEXR file");
+    }
+    const u32 version = reader.Read<u32>();
+    if ((version & 0xff) != Version || (version & (TiledFlag | NonImageFlag | MultipartFlag))) {
+        reader.Fail("Only single part scanline images are supported");
+    }
+
+    FloatImage image;
+    std::array<s32, 4> window{};
+    bool has_window = false;
+    while (true) {
+        const auto name = reader.ReadString();
+        if (name.empty()) {
+            break;
+        }
+        reader.ReadString(); // The type, implied by the name
+        const auto value = reader.ReadBytes(reader.Read<u32>());
+        if (name == "channels") {
+            Reader channels{value, path};
+            while (true) {
+                auto channel = channels.ReadString();
+                if (channel.empty()) {
+                    break;
+                }
+                const u32 pixel_type = channels.Read<u32>();
+                channels.Read<u32>();
+                const s32 x_sampling = channels.Read<s32>();
+                const s32 y_sampling = channels.Read<s32>();
+                if (pixel_type != PixelTypeFloat || x_sampling != 1 || y_sampling != 1) {
+                    reader.Fail("Only 32-bit float channels are supported");
+                }
+                image.channels.emplace_back(std::move(channel));
+            }
+        } else if (name == "compression") {
+            if (value.empty() || value[0] != 0) {
+                reader.Fail("Only uncompressed files are supported");
+            }
+        } else if (name == "dataWindow") {
+            if (value.size() != sizeof(window)) {
+                reader.Fail("Invalid data window");
+            }
+            std::memcpy(window.data(), value.data(), sizeof(window));
+            has_window = true;
+        }
+    }
+    if (!has_window || image.channels.empty() || window[2] < window[0] || window[3] < window[1]) {
+        reader.Fail("Missing channels or data window");
+    }
+    image.width = static_cast<u32>(window[2] - window[0] + 1);
+    image.height = static_cast<u32>(window[3] - window[1] + 1);
+
+    const std::size_t num_channels = image.channels.size();
+    const std::size_t line_size = std::size_t{image.width} * num_channels * sizeof(float);
+    image.pixels.resize(std::size_t{image.width} * image.height * num_channels);
+    std::vector<u64> offsets(image.height);
+    for (auto& offset : offsets) {
+        offset = reader.Read<u64>();
+    }
+    // The lines may be stored in any order
+    std::vector<float> values(std::size_t{image.width} * num_channels);
+    for (const u64 offset : offsets) {
+        reader.Seek(static_cast<std::size_t>(offset));
+        const s32 y = reader.Read<s32>() - window[1];
+        if (y < 0 || static_cast<u32>(y) >= image.height || reader.Read<u32>() != line_size) {
+            reader.Fail("Invalid scanline");
+        }
+        std::memcpy(values.data(), reader.ReadBytes(line_size).data(), line_size);
+        float* row = image.pixels.data() + static_cast<std::size_t>(y) * values.size();
+        for (std::size_t channel = 0; channel < num_channels; ++channel) {
+            for (u32 x = 0; x < image.width; ++x) {
+                row[x * num_channels + channel] = values[channel * image.width + x];
+            }
+        }
+    }
+    return image;
+}
+
+} // namespace Common
@@ -0,0 +1,29 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "common/common_types.h"
+
+namespace Common {
+
+/**
+ * Image of 32-bit float channels, as stored in OpenEXR files. Only uncompressed scanline files
+ * of such channels are written and read, which is what the renders are exported as. Both
+ * functions throw std::runtime_error on failure.
+ */
+struct FloatImage {
+    u32 width{};
+    u32 height{};
+    std::vector<std::string> channels; // Sorted by name, like OpenEXR stores them
+    std::vector<float> pixels;         // Channels of each pixel interleaved, top row first
+};
+
+void WriteEXR(const std::filesystem::path& path, const FloatImage& image);
+FloatImage ReadEXR(const std::filesystem::path& path);
+
+} // namespace Common
@@ -0,0 +1,45 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+#include "common/common_types.h"
+
+namespace Common {
+
+/**
+ * Linear allocator for the transient arrays of a frame, used through std::pmr containers. Memory
+ * is bumped out of a block allocated once, and returned all at once by Reset, which must come
+ * after whatever was allocated is gone. Only once the block is exhausted does it fall back to
+ * the heap, until the next Reset. Not thread safe.
+ */
+class FrameArena : NonCopyable {
+public:
+    explicit FrameArena(std::size_t size)
+        : block(std::make_unique<std::byte[]>(size)), resource(block.get(), size) {}
+    ~FrameArena() = default;
+
+    void Reset() noexcept {
+        resource.release();
+    }
+
+    std::pmr::memory_resource* GetResource() noexcept {
+        return &resource;
+    }
+
+    template <typename T>
+    std::pmr::vector<T> MakeVector() {
+        return std::pmr::vector<T>(&resource);
+    }
+
+private:
+    std::unique_ptr<std::byte[]> block;
+    std::pmr::monotonic_buffer_resource resource;
+};
+
+} // namespace Common
@@ -0,0 +1,205 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <cstring>
+#include "common/assert.h"
+#include "common/index_conversion.h"
+#include "common/swap.h"
+
+#if COMMON_LITTLE_ENDIAN && (defined(__x86_64__) || defined(_M_X64))
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define INDEX_CONVERSION_SSE2 1
+#elif COMMON_LITTLE_ENDIAN && (defined(__aarch64__) || defined(_M_ARM64))
+#include <arm_neon.h>
+#define INDEX_CONVERSION_NEON 1
+#endif
+
+namespace Common {
+
+#if INDEX_CONVERSION_SSE2
+
+// SSE2 is the x86-64 baseline. The AVX2 paths are compiled for AVX2 regardless of the build flags
+// and picked at runtime. (MSVC allows AVX2 intrinsics in any function.)
+#if defined(__GNUC__) || defined(__clang__)
+#define INDEX_CONVERSION_AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define INDEX_CONVERSION_AVX2_TARGET
+#endif
+
+static bool DetectAVX2() {
+#ifdef __AVX2__
+    return true;
+#elif defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    // The OS must also save the YMM registers (OSXSAVE and AVX, then XCR0 bits 1 and 2)
+    __cpuid(info, 1);
+    constexpr int OSXSAVEAndAVX = (1 << 27) | (1 << 28);
+    if ((info[2] & OSXSAVEAndAVX) != OSXSAVEAndAVX || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#endif
+}
+
+static const bool has_avx2 = DetectAVX2();
+
+// The AVX2 loops return the number of indices they converted, leaving the rest to the scalar tail.
+
+INDEX_CONVERSION_AVX2_TARGET static std::size_t WidenIndicesU8ToU16AVX2(const u8* src, u8* out,
+                                                                         std::size_t count) {
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i), _mm256_cvtepu8_epi16(v));
+    }
+    return i;
+}
+
+INDEX_CONVERSION_AVX2_TARGET static std::size_t ReadIndicesU8AVX2(const u8* src, u32* dst,
+                                                                   std::size_t count) {
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_cvtepu8_epi32(v));
+    }
+    return i;
+}
+
+INDEX_CONVERSION_AVX2_TARGET static std::size_t ReadIndicesU16AVX2(const u8* src, u32* dst,
+                                                                    std::size_t count) {
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_cvtepu16_epi32(v));
+    }
+    return i;
+}
+
+#endif
+
+void WidenIndicesU8ToU16(std::span<const u8> src, void* dst) {
+    auto* out = static_cast<u8*>(dst);
+    const std::size_t count = src.size();
+    std::size_t i = 0;
+#if INDEX_CONVERSION_SSE2
+    if (has_avx2) {
+        i = WidenIndicesU8ToU16AVX2(src.data(), out, count);
+    } else {
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= count; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src.data() + i));
+            auto* out_vec = reinterpret_cast<__m128i*>(out + 2 * i);
+            _mm_storeu_si128(out_vec, _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128(out_vec + 1, _mm_unpackhi_epi8(v, zero));
+        }
+    }
+#elif INDEX_CONVERSION_NEON
+    for (; i + 16 <= count; i += 16) {
+        const uint8x16_t v = vld1q_u8(src.data() + i);
+        // Store as bytes, as dst may not be aligned for u16
+        vst1q_u8(out + 2 * i, vreinterpretq_u8_u16(vmovl_u8(vget_low_u8(v))));
+        vst1q_u8(out + 2 * i + 16, vreinterpretq_u8_u16(vmovl_u8(vget_high_u8(v))));
+    }
+#endif
+    for (; i < count; ++i) {
+        out[2 * i] = src[i];
+        out[2 * i + 1] = 0;
+    }
+}
+
+static void ReadIndicesU8(const u8* src, std::span<u32> dst) {
+    const std::size_t count = dst.size();
+    std::size_t i = 0;
+#if INDEX_CONVERSION_SSE2
+    if (has_avx2) {
+        i = ReadIndicesU8AVX2(src, dst.data(), count);
+    } else {
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= count; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            const __m128i lo = _mm_unpacklo_epi8(v, zero);
+            const __m128i hi = _mm_unpackhi_epi8(v, zero);
+            auto* out = reinterpret_cast<__m128i*>(dst.data() + i);
+            _mm_storeu_si128(out, _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi, zero));
+        }
+    }
+#elif INDEX_CONVERSION_NEON
+    for (; i + 8 <= count; i += 8) {
+        const uint16x8_t v = vmovl_u8(vld1_u8(src + i));
+        vst1q_u32(dst.data() + i, vmovl_u16(vget_low_u16(v)));
+        vst1q_u32(dst.data() + i + 4, vmovl_u16(vget_high_u16(v)));
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[i] = src[i];
+    }
+}
+
+static void ReadIndicesU16(const u8* src, std::span<u32> dst) {
+    const std::size_t count = dst.size();
+    std::size_t i = 0;
+#if INDEX_CONVERSION_SSE2
+    if (has_avx2) {
+        i = ReadIndicesU16AVX2(src, dst.data(), count);
+    } else {
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= count; i += 8) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+            auto* out = reinterpret_cast<__m128i*>(dst.data() + i);
+            _mm_storeu_si128(out, _mm_unpacklo_epi16(v, zero));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(v, zero));
+        }
+    }
+#elif INDEX_CONVERSION_NEON
+    for (; i + 8 <= count; i += 8) {
+        const uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8(src + 2 * i));
+        vst1q_u32(dst.data() + i, vmovl_u16(vget_low_u16(v)));
+        vst1q_u32(dst.data() + i + 4, vmovl_u16(vget_high_u16(v)));
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[i] = src[2 * i] | (static_cast<u32>(src[2 * i + 1]) << 8);
+    }
+}
+
+static void ReadIndicesU32(const u8* src, std::span<u32> dst) {
+#if COMMON_BIG_ENDIAN
+    SwapBytes32(dst.data(), src, dst.size());
+#else
+    std::memcpy(dst.data(), src, dst.size_bytes());
+#endif
+}
+
+void ReadIndices(std::span<const u8> src, std::size_t index_size, std::span<u32> dst) {
+    ASSERT_MSG(src.size() >= dst.size() * index_size, "Index data is too small");
+    switch (index_size) {
+    case 1:
+        ReadIndicesU8(src.data(), dst);
+        break;
+    case 2:
+        ReadIndicesU16(src.data(), dst);
+        break;
+    case 4:
+        ReadIndicesU32(src.data(), dst);
+        break;
+    default:
+        UNREACHABLE_MSG("Invalid index size {}", index_size);
+    }
+}
+
+} // namespace Common
@@ -0,0 +1,25 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include "common/common_types.h"
+
+/**
+ * Conversion of glTF index data, which is little endian and may use 8-bit indices that Vulkan
+ * index buffers (without extensions) do not support. Vectorized with SSE2 (AVX2 if the CPU has
+ * it) or NEON, with a scalar fallback for other and big endian hosts.
+ */
+namespace Common {
+
+// Widens the 8-bit indices to little endian 16-bit ones. dst must hold src.size() indices and
+// need not be aligned (e.g. mapped staging memory).
+void WidenIndicesU8ToU16(std::span<const u8> src, void* dst);
+
+// Reads dst.size() little endian indices of index_size (1, 2 or 4) bytes from src into native
+// 32-bit integers.
+void ReadIndices(std::span<const u8> src, std::size_t index_size, std::span<u32> dst);
+
+} // namespace Common
@@ -0,0 +1,503 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include "common/jpeg.h"
+
+namespace Common {
+
+namespace {
+
+// Markers, following 0xFF
+constexpr u8 SOI = 0xD8;
+constexpr u8 EOI = 0xD9;
+constexpr u8 SOF0 = 0xC0; // Baseline
+constexpr u8 SOF1 = 0xC1; // Extended sequential, Huffman coded
+constexpr u8 DHT = 0xC4;
+constexpr u8 DQT = 0xDB;
+constexpr u8 DRI = 0xDD;
+constexpr u8 SOS = 0xDA;
+constexpr u8 APP14 = 0xEE;
+constexpr u8 RST0 = 0xD0;
+constexpr u8 RST7 = 0xD7;
+
+constexpr u32 MaxComponents = 3;
+constexpr u32 MaxSampling = 2;
+constexpr u32 MaxBlocksPerMCU = 10; // Of the standard
+
+// Frequency index (row order) of each position of the zigzag order
+constexpr std::array<u8, 64> ZigZag{{
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48,
+    41, 34, 27, 20, 13, 6,  7,  14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23,
+    30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+}};
+
+[[noreturn]] void Fail(const char* message) {
+    throw std::runtime_error(message);
+}
+
+// Canonical Huffman table, decoding codes of up to FastBits bits with a single lookup
+class HuffmanTable {
+public:
+    static constexpr u32 FastBits = 9;
+
+    void Build(std::span<const u8, 16> counts, std::span<const u8> values_) {
+        values.assign(values_.begin(), values_.end());
+        sizes.clear();
+        fast.fill(NoSymbol);
+
+        u32 code = 0;
+        for (u32 size = 1; size <= 16; ++size) {
+            delta[size] = static_cast<s32>(sizes.size()) - static_cast<s32>(code);
+            for (u32 i = 0; i < counts[size - 1]; ++i) {
+                if (size <= FastBits) {
+                    const u32 first = code << (FastBits - size);
+                    std::fill_n(fast.begin() + first, 1u << (FastBits - size),
+                                static_cast<u16>(sizes.size()));
+                }
+                sizes.push_back(static_cast<u8>(size));
+                ++code;
+            }
+            if (code > (1u << size)) {
+                Fail("Invalid Huffman table");
+            }
+            // Left aligned to 16 bits, codes of the size are below it
+            max_code[size] = code << (16 - size);
+            code <<= 1;
+        }
+        max_code[17] = std::numeric_limits<u32>::max();
+        defined = true;
+    }
+
+    bool defined{};
+
+private:
+    friend class BitReader;
+    static constexpr u16 NoSymbol = 0xFFFF;
+
+    std::vector<u8> values;
+    std::vector<u8> sizes; // Of the code of each symbol
+    std::array<u16, 1 << FastBits> fast{};
+    std::array<u32, 18> max_code{};
+    std::array<s32, 17> delta{}; // From the code to the symbol index, of each size
+};
+
+// Reads the entropy coded data of a scan, removing the stuffed zero bytes. Once it reaches a
+// marker it reads zeros, which is how truncated files decode.
+class BitReader {
+public:
+    explicit BitReader(std::span<const u8> data_, std::size_t pos_) : data(data_), pos(pos_) {}
+
+    // n in [0, 16]
+    u32 Get(u32 n) {
+        if (n == 0) {
+            return 0;
+        }
+        Fill();
+        const u32 value = bits >> (32 - n);
+        bits <<= n;
+        num_bits -= n;
+        return value;
+    }
+
+    // The value of the n bits, which code the magnitude category n
+    s32 GetSigned(u32 n) {
+        const u32 value = Get(n);
+        if (n == 0) {
+            return 0;
+        }
+        return value < (1u << (n - 1)) ? static_cast<s32>(value) - (1 << n) + 1
+                                       : static_cast<s32>(value);
+    }
+
+    u8 Decode(const HuffmanTable& table) {
+        Fill();
+        u16 symbol = table.fast[bits >> (32 - HuffmanTable::FastBits)];
+        u32 size{};
+        if (symbol != HuffmanTable::NoSymbol) {
+            size = table.sizes[symbol];
+        } else {
+            const u32 code = bits >> 16;
+            size = HuffmanTable::FastBits + 1;
+            while (code >= table.max_code[size]) {
+                ++size;
+            }
+            if (size > 16) {
+                Fail("Invalid Huffman code");
+            }
+            symbol = static_cast<u16>(static_cast<s32>(bits >> (32 - size)) + table.delta[size]);
+        }
+        if (symbol >= table.values.size()) {
+            Fail("Invalid Huffman code");
+        }
+        bits <<= size;
+        num_bits -= size;
+        return table.values[symbol];
+    }
+
+    // Skips the restart marker the data should be at, realigning to bytes
+    void Restart() {
+        bits = 0;
+        num_bits = 0;
+        at_marker = false;
+        while (pos + 1 < data.size() &&
+               !(data[pos] == 0xFF && data[pos + 1] >= RST0 && data[pos + 1] <= RST7)) {
+            ++pos;
+        }
+        pos = std::min(pos + 2, data.size());
+    }
+
+private:
+    void Fill() {
+        while (num_bits <= 24) {
+            u32 byte = 0;
+            if (!at_marker && pos < data.size()) {
+                byte = data[pos];
+                if (byte != 0xFF) {
+                    ++pos;
+                } else if (pos + 1 < data.size() && data[pos + 1] == 0) {
+                    pos += 2;
+                } else {
+                    at_marker = true;
+                    byte = 0;
+                }
+            }
+            bits |= byte << (24 - num_bits);
+            num_bits += 8;
+        }
+    }
+
+    std::span<const u8> data;
+    std::size_t pos{};
+    u32 bits{}; // Left aligned
+    u32 num_bits{};
+    bool at_marker{};
+};
+
+struct FrameComponent {
+    u8 id{};
+    u32 h_sampling{};
+    u32 v_sampling{};
+    u32 quant_table{};
+};
+
+class Decoder {
+public:
+    explicit Decoder(std::span<const u8> data_) : data(data_) {}
+
+    JPEGCoefficients Decode() {
+        if (!IsJPEG(data)) {
+            Fail("Not a JPEG file");
+        }
+        pos = 2;
+        while (true) {
+            const u8 marker = NextMarker();
+            if (marker == EOI) {
+                Fail("JPEG file has no scan");
+            }
+            const std::span<const u8> segment = ReadSegment();
+            switch (marker) {
+            case SOF0:
+            case SOF1:
+                ReadFrame(segment);
+                break;
+            case DHT:
+                ReadHuffmanTables(segment);
+                break;
+            case DQT:
+                ReadQuantTables(segment);
+                break;
+            case DRI:
+                if (segment.size() < 2) {
+                    Fail("Invalid JPEG restart interval");
+                }
+                restart_interval = ReadU16(segment, 0);
+                break;
+            case APP14:
+                // "Adobe", version, flags0, flags1, then the color transform
+                if (segment.size() >= 12 && std::memcmp(segment.data(), "Adobe", 5) == 0) {
+                    adobe_transform = segment[11];
+                }
+                break;
+            case SOS:
+                ReadScan(segment);
+                return std::move(result);
+            default:
+                // Other frame types: progressive, lossless, hierarchical or arithmetic coded
+                if ((marker >= 0xC2 && marker <= 0xCF && marker != DHT && marker != 0xC8) ||
+                    marker == 0xDC) {
+                    Fail("Unsupported JPEG coding");
+                }
+                break; // Application data, comments...
+            }
+        }
+    }
+
+private:
+    static u32 ReadU16(std::span<const u8> segment, std::size_t offset) {
+        return (u32{segment[offset]} << 8) | segment[offset + 1];
+    }
+
+    u8 NextMarker() {
+        // Fill bytes may precede markers
+        while (pos + 1 < data.size() && (data[pos] != 0xFF || data[pos + 1] == 0xFF)) {
+            ++pos;
+        }
+        if (pos + 1 >= data.size()) {
+            Fail("Truncated JPEG file");
+        }
+        pos += 2;
+        return data[pos - 1];
+    }
+
+    std::span<const u8> ReadSegment() {
+        if (pos + 2 > data.size()) {
+            Fail("Truncated JPEG file");
+        }
+        const u32 length = ReadU16(data, pos);
+        if (length < 2 || pos + length > data.size()) {
+            Fail("Truncated JPEG file");
+        }
+        const auto segment = data.subspan(pos + 2, length - 2);
+        pos += length;
+        return segment;
+    }
+
+    void ReadFrame(std::span<const u8> segment) {
+        if (!frame.empty()) {
+            Fail("JPEG file has several frames");
+        }
+        if (segment.size() < 6 || segment[0] != 8) {
+            Fail("Unsupported JPEG precision");
+        }
+        result.height = ReadU16(segment, 1);
+        result.width = ReadU16(segment, 3);
+        const u32 num_components = segment[5];
+        if (result.width == 0 || result.height == 0) {
+            Fail("Unsupported JPEG extent"); // Defined by a DNL marker after the scan
+        }
+        if ((num_components != 1 && num_components != MaxComponents) ||
+            segment.size() < 6 + num_components * 3) {
+            Fail("Unsupported JPEG components");
+        }
+        for (u32 i = 0; i < num_components; ++i) {
+            const auto* component = segment.data() + 6 + i * 3;
+            frame.push_back({
+                .id = component[0],
+                .h_sampling = static_cast<u32>(component[1] >> 4),
+                .v_sampling = static_cast<u32>(component[1] & 15),
+                .quant_table = component[2],
+            });
+            const auto& added = frame.back();
+            if (added.h_sampling == 0 || added.h_sampling > MaxSampling ||
+                added.v_sampling == 0 || added.v_sampling > MaxSampling ||
+                added.quant_table >= quant_tables.size()) {
+                Fail("Unsupported JPEG sampling");
+            }
+        }
+        if (num_components == 1) { // Not interleaved
+            frame[0].h_sampling = frame[0].v_sampling = 1;
+        }
+    }
+
+    void ReadHuffmanTables(std::span<const u8> segment) {
+        std::size_t offset = 0;
+        while (offset + 17 <= segment.size()) {
+            const u32 table_class = segment[offset] >> 4;
+            const u32 index = segment[offset] & 15;
+            if (table_class > 1 || index > 3) {
+                Fail("Invalid JPEG Huffman table");
+            }
+            const std::span<const u8, 16> counts{segment.data() + offset + 1, 16};
+            std::size_t num_values = 0;
+            for (const u8 count : counts) {
+                num_values += count;
+            }
+            offset += 17;
+            if (num_values > 256 || offset + num_values > segment.size()) {
+                Fail("Invalid JPEG Huffman table");
+            }
+            (table_class == 0 ? dc_tables : ac_tables)[index].Build(
+                counts, segment.subspan(offset, num_values));
+            offset += num_values;
+        }
+    }
+
+    void ReadQuantTables(std::span<const u8> segment) {
+        std::size_t offset = 0;
+        while (offset < segment.size()) {
+            const u32 precision = segment[offset] >> 4;
+            const u32 index = segment[offset] & 15;
+            const std::size_t size = precision == 0 ? 64 : 128;
+            ++offset;
+            if (precision > 1 || index > 3 || offset + size > segment.size()) {
+                Fail("Invalid JPEG quantization table");
+            }
+            auto& table = quant_tables[index];
+            for (std::size_t i = 0; i < 64; ++i) {
+                table[i] = precision == 0 ? segment[offset + i]
+                                          : static_cast<u16>(ReadU16(segment, offset + i * 2));
+            }
+            offset += size;
+        }
+    }
+
+    void ReadScan(std::span<const u8> segment) {
+        if (frame.empty()) {
+            Fail("JPEG scan before the frame");
+        }
+        const u32 num_components = segment.empty() ? 0 : segment[0];
+        if (num_components != frame.size() || segment.size() < 4 + num_components * 2) {
+            Fail("Unsupported JPEG scan"); // Components in separate scans
+        }
+        const auto* spectral = segment.data() + 1 + num_components * 2;
+        if (spectral[0] != 0 || spectral[1] != 63 || spectral[2] != 0) {
+            Fail("Unsupported JPEG scan");
+        }
+
+        struct ScanComponent {
+            const HuffmanTable* dc_table{};
+            const HuffmanTable* ac_table{};
+            const std::array<u16, 64>* quant_table{};
+            u32 h_sampling{};
+            u32 v_sampling{};
+            s32 dc_prediction{};
+        };
+        std::array<ScanComponent, MaxComponents> components{};
+        u32 max_h = 1, max_v = 1;
+        u32 blocks_per_mcu = 0;
+        for (u32 i = 0; i < num_components; ++i) {
+            // Scan components follow the order of the frame
+            const u8 id = segment[1 + i * 2];
+            const u32 dc_index = segment[2 + i * 2] >> 4;
+            const u32 ac_index = segment[2 + i * 2] & 15;
+            if (id != frame[i].id || dc_index > 3 || ac_index > 3 ||
+                !dc_tables[dc_index].defined || !ac_tables[ac_index].defined) {
+                Fail("Invalid JPEG scan");
+            }
+            components[i] = {
+                .dc_table = &dc_tables[dc_index],
+                .ac_table = &ac_tables[ac_index],
+                .quant_table = &quant_tables[frame[i].quant_table],
+                .h_sampling = frame[i].h_sampling,
+                .v_sampling = frame[i].v_sampling,
+            };
+            max_h = std::max(max_h, frame[i].h_sampling);
+            max_v = std::max(max_v, frame[i].v_sampling);
+            blocks_per_mcu += frame[i].h_sampling * frame[i].v_sampling;
+            result.components.push_back({
+                .h_sampling = frame[i].h_sampling,
+                .v_sampling = frame[i].v_sampling,
+            });
+        }
+        if (blocks_per_mcu > MaxBlocksPerMCU) {
+            Fail("Invalid JPEG sampling");
+        }
+        result.rgb = num_components == 3 &&
+                     (adobe_transform == 0 ||
+                      (frame[0].id == 'R' && frame[1].id == 'G' && frame[2].id == 'B'));
+
+        result.mcus_x = (result.width + max_h * 8 - 1) / (max_h * 8);
+        result.mcus_y = (result.height + max_v * 8 - 1) / (max_v * 8);
+        const std::size_t num_blocks = std::size_t{result.mcus_x} * result.mcus_y * blocks_per_mcu;
+        if (num_blocks >= std::numeric_limits<u32>::max() / 64) {
+            Fail("JPEG image too large");
+        }
+        result.block_offsets.reserve(num_blocks + 1);
+        // Typical photos keep around a tenth of their coefficients
+        result.coefficients.reserve(num_blocks * 8);
+
+        BitReader reader{data, pos};
+        const u32 num_mcus = result.mcus_x * result.mcus_y;
+        for (u32 mcu = 0; mcu < num_mcus; ++mcu) {
+            if (restart_interval != 0 && mcu != 0 && mcu % restart_interval == 0) {
+                reader.Restart();
+                for (auto& component : components) {
+                    component.dc_prediction = 0;
+                }
+            }
+            for (u32 i = 0; i < num_components; ++i) {
+                auto& component = components[i];
+                for (u32 block = 0; block < component.h_sampling * component.v_sampling;
+                     ++block) {
+                    DecodeBlock(reader, component.dc_table, component.ac_table,
+                                *component.quant_table, component.dc_prediction);
+                }
+            }
+        }
+        result.block_offsets.push_back(static_cast<u32>(result.coefficients.size()));
+    }
+
+    void DecodeBlock(BitReader& reader, const HuffmanTable* dc_table,
+                     const HuffmanTable* ac_table, const std::array<u16, 64>& quant_table,
+                     s32& dc_prediction) {
+        result.block_offsets.push_back(static_cast<u32>(result.coefficients.size()));
+        const auto Add = [this](u32 index, s32 value) {
+            value = std::clamp(value, s32{std::numeric_limits<s16>::min()},
+                               s32{std::numeric_limits<s16>::max()});
+            result.coefficients.push_back((index << 16) | (static_cast<u32>(value) & 0xFFFF));
+        };
+
+        const u32 dc_size = reader.Decode(*dc_table);
+        if (dc_size > 11) {
+            Fail("Invalid JPEG DC coefficient");
+        }
+        dc_prediction += reader.GetSigned(dc_size);
+        if (dc_prediction != 0) {
+            Add(0, dc_prediction * quant_table[0]);
+        }
+        for (u32 k = 1; k < 64;) {
+            const u8 run_size = reader.Decode(*ac_table);
+            const u32 run = run_size >> 4;
+            const u32 size = run_size & 15;
+            if (size == 0) {
+                if (run != 15) {
+                    break; // End of block
+                }
+                k += 16;
+                continue;
+            }
+            k += run;
+            if (k > 63) {
+                Fail("Invalid JPEG AC coefficient");
+            }
+            Add(ZigZag[k], reader.GetSigned(size) * quant_table[k]);
+            ++k;
+        }
+    }
+
+    std::span<const u8> data;
+    std::size_t pos{};
+    JPEGCoefficients result;
+    std::vector<FrameComponent> frame;
+    std::array<HuffmanTable, 4> dc_tables;
+    std::array<HuffmanTable, 4> ac_tables;
+    std::array<std::array<u16, 64>, 4> quant_tables{}; // In zigzag order
+    u32 restart_interval{};
+    s32 adobe_transform = -1;
+};
+
+} // namespace
+
+u32 JPEGCoefficients::GetBlocksPerMCU() const noexcept {
+    u32 blocks = 0;
+    for (const auto& component : components) {
+        blocks += component.h_sampling * component.v_sampling;
+    }
+    return blocks;
+}
+
+bool IsJPEG(std::span<const u8> data) noexcept {
+    return data.size() >= 3 && data[0] == 0xFF && data[1] == SOI && data[2] == 0xFF;
+}
+
+JPEGCoefficients DecodeJPEGCoefficients(std::span<const u8> data) {
+    return Decoder{data}.Decode();
+}
+
+} // namespace Common
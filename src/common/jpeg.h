@@ -0,0 +1,50 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include <vector>
+#include "common/common_types.h"
+
+namespace Common {
+
+/**
+ * JPEG image decoded up to its dequantized DCT coefficients, leaving the inverse DCT and the
+ * color conversion to the GPU (see jpeg_decode.comp). Only baseline (and extended sequential
+ * 8-bit) Huffman coded files are read, of 1 or 3 components in a single scan, with sampling
+ * factors of 1 or 2: what cameras and image editors write. DecodeJPEGCoefficients throws
+ * std::runtime_error on anything else (progressive, arithmetic coded, CMYK...) and on corrupt
+ * files, which are left to a full decoder.
+ */
+struct JPEGCoefficients {
+    // Of each component, in the order of the frame. Single component images are not
+    // interleaved, so their blocks are in plain rows whatever their sampling factors are.
+    struct Component {
+        u32 h_sampling = 1;
+        u32 v_sampling = 1;
+    };
+
+    u32 width{};
+    u32 height{};
+    u32 mcus_x{}; // Minimum coded units, of max sampling factors * 8 pixels on each side
+    u32 mcus_y{};
+    std::vector<Component> components;
+    bool rgb{}; // Whether the 3 components are RGB (Adobe transform 0) rather than YCbCr
+    // Start of the coefficients of each block in coefficients, and their end after the last
+    // block. Blocks are in the order of the scan: the blocks of each component of an MCU in
+    // turn, in rows of h_sampling, MCUs in rows of mcus_x.
+    std::vector<u32> block_offsets;
+    // The nonzero coefficients of each block: the index of the frequency (v * 8 + u) in the
+    // upper 16 bits, the dequantized value (clamped to 16 bits) in the lower 16 bits.
+    std::vector<u32> coefficients;
+
+    u32 GetBlocksPerMCU() const noexcept;
+};
+
+// Whether the data starts with the JPEG start of image marker
+bool IsJPEG(std::span<const u8> data) noexcept;
+JPEGCoefficients DecodeJPEGCoefficients(std::span<const u8> data);
+
+} // namespace Common
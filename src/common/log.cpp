@@ -2,11 +2,32 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <cstdlib>
+#include <spdlog/async.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
 #include "common/log.h"
 
 namespace Common {
+
+namespace {
+
+// Messages queued at once, beyond which the oldest are overwritten
+constexpr std::size_t QueueSize = 8192;
+
+std::atomic<LogRateLimiter*> g_rate_limiters{};
+std::atomic<LogTally*> g_tallies{};
+
+template <typename T>
+void Register(std::atomic<T*>& head, T* item, T*& next) {
+    next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(next, item, std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+    }
+}
+
+} // namespace
+
 void InitializeLogging() {
     auto* sink = spdlog::default_logger()->sinks().front().get();
     if (auto* color_sink = dynamic_cast<spdlog::sinks::stdout_color_sink_mt*>(sink)) {
@@ -17,6 +38,70 @@ void InitializeLogging() {
 #endif
     }
 
+    spdlog::init_thread_pool(QueueSize, 1);
+    const auto& sinks = spdlog::default_logger()->sinks();
+    auto logger = std::make_shared<spdlog::async_logger>(
+        "", sinks.begin(), sinks.end(), spdlog::thread_pool(),
+        spdlog::async_overflow_policy::overrun_oldest);
+    logger->set_level(spdlog::default_logger()->level());
+    logger->flush_on(spdlog::level::err);
+    spdlog::set_default_logger(std::move(logger));
+
     spdlog::set_pattern("%^[%T.%e] [%l] %@:%!: %v%$");
+    std::atexit([] {
+        FlushLogSummaries();
+        spdlog::shutdown();
+    });
 }
+
+void FlushLogSummaries() {
+    for (auto* tally = g_tallies.load(std::memory_order_acquire); tally; tally = tally->next) {
+        tally->Flush();
+    }
+    for (auto* limiter = g_rate_limiters.load(std::memory_order_acquire); limiter;
+         limiter = limiter->next) {
+        limiter->Flush();
+    }
+}
+
+bool LogRateLimiter::Acquire() noexcept {
+    const s64 now = std::chrono::steady_clock::now().time_since_epoch().count();
+    s64 start = window_start.load(std::memory_order_relaxed);
+    if (now - start >= std::chrono::steady_clock::duration{Interval}.count() &&
+        window_start.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+        window_count.store(0, std::memory_order_relaxed);
+    }
+    if (window_count.fetch_add(1, std::memory_order_relaxed) >= Burst) {
+        if (!registered.exchange(true, std::memory_order_relaxed)) {
+            Register(g_rate_limiters, this, next);
+        }
+        suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    Flush();
+    return true;
+}
+
+void LogRateLimiter::Flush() noexcept {
+    if (const u64 count = suppressed.exchange(0, std::memory_order_relaxed)) {
+        SPDLOG_INFO("{} messages suppressed at {}:{}", count, file, line);
+    }
+}
+
+void LogTally::Add(u64 count) noexcept {
+    if (!registered.exchange(true, std::memory_order_relaxed)) {
+        Register(g_tallies, this, next);
+    }
+    total.fetch_add(count, std::memory_order_relaxed);
+    events.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LogTally::Flush() noexcept {
+    const u64 num_events = events.exchange(0, std::memory_order_relaxed);
+    const u64 sum = total.exchange(0, std::memory_order_relaxed);
+    if (num_events) {
+        SPDLOG_INFO("{}: {} of {} {}", description, sum, num_events, unit);
+    }
+}
+
 } // namespace Common
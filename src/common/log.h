@@ -4,8 +4,89 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include "common/common_types.h"
+
 namespace Common {
 
+// Makes the default logger asynchronous: messages are formatted on the calling thread, then
+// queued in a bounded ring buffer and written by a thread of its own. A full queue overwrites
+// its oldest messages rather than blocking the caller. The queue is drained at exit, after
+// FlushLogSummaries.
 void InitializeLogging();
 
-}
+// Logs the tallies and the messages suppressed by rate limiters since last called, see
+// LOG_TALLY and LOG_RATE_LIMITED.
+void FlushLogSummaries();
+
+/**
+ * Lets through at most Burst messages of its call site per Interval, counting the rest, which
+ * are reported with the next message let through or by FlushLogSummaries. Constant initialized
+ * and trivially destructible, so that it can be a static of any call site and stays valid until
+ * the logging is shut down. Thread safe.
+ */
+class LogRateLimiter {
+public:
+    static constexpr u32 Burst = 8;
+    static constexpr std::chrono::seconds Interval{1};
+
+    constexpr LogRateLimiter(const char* file_, int line_) noexcept : file(file_), line(line_) {}
+
+    // Returns whether to log the message
+    bool Acquire() noexcept;
+    void Flush() noexcept;
+
+private:
+    friend void FlushLogSummaries();
+
+    const char* file;
+    int line;
+    std::atomic<s64> window_start{}; // In ticks of the steady clock
+    std::atomic<u32> window_count{};
+    std::atomic<u64> suppressed{};
+    std::atomic_bool registered{};
+    LogRateLimiter* next{}; // Of the registered ones
+};
+
+/**
+ * Sums the counts of many events of its call site, e.g. the mip levels generated for each
+ * texture, into one message logged by FlushLogSummaries: "<description>: <total> of <events>
+ * <unit>". Constant initialized and trivially destructible like LogRateLimiter. Thread safe.
+ */
+class LogTally {
+public:
+    constexpr LogTally(const char* description_, const char* unit_) noexcept
+        : description(description_), unit(unit_) {}
+
+    void Add(u64 count) noexcept;
+    void Flush() noexcept;
+
+private:
+    friend void FlushLogSummaries();
+
+    const char* description;
+    const char* unit;
+    std::atomic<u64> total{};
+    std::atomic<u64> events{};
+    std::atomic_bool registered{};
+    LogTally* next{}; // Of the registered ones
+};
+
+} // namespace Common
+
+// Like SPDLOG_<level>(...), but rate limited per call site, see Common::LogRateLimiter
+#define LOG_RATE_LIMITED(level, ...)                                                              \
+    do {                                                                                          \
+        static constinit ::Common::LogRateLimiter log_rate_limiter_{__FILE__, __LINE__};          \
+        if (log_rate_limiter_.Acquire()) {                                                        \
+            SPDLOG_##level(__VA_ARGS__);                                                          \
+        }                                                                                         \
+    } while (0)
+
+// Adds count to the tally of the call site, see Common::LogTally
+#define LOG_TALLY(description, unit, count)                                                       \
+    do {                                                                                          \
+        static constinit ::Common::LogTally log_tally_{description, unit};                        \
+        log_tally_.Add(count);                                                                    \
+    } while (0)
@@ -0,0 +1,134 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <stdexcept>
+#include <spdlog/spdlog.h>
+#include "common/mapped_file.h"
+
+namespace Common {
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::filesystem::path& path) {
+    file_handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        file_handle = nullptr;
+        SPDLOG_ERROR("Failed to open file {}", path.string());
+        throw std::runtime_error("Failed to open file");
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size)) {
+        CloseHandle(file_handle);
+        SPDLOG_ERROR("Failed to get size of file {}", path.string());
+        throw std::runtime_error("Failed to get file size");
+    }
+    length = static_cast<std::size_t>(file_size.QuadPart);
+    if (length == 0) { // Empty files cannot be mapped
+        return;
+    }
+
+    mapping_handle = CreateFileMappingW(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_handle) {
+        CloseHandle(file_handle);
+        SPDLOG_ERROR("Failed to create file mapping {}", path.string());
+        throw std::runtime_error("Failed to create file mapping");
+    }
+
+    base = reinterpret_cast<const u8*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+    if (!base) {
+        CloseHandle(mapping_handle);
+        CloseHandle(file_handle);
+        SPDLOG_ERROR("Failed to map view of file {}", path.string());
+        throw std::runtime_error("Failed to map view of file");
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (base) {
+        UnmapViewOfFile(base);
+    }
+    if (mapping_handle) {
+        CloseHandle(mapping_handle);
+    }
+    if (file_handle) {
+        CloseHandle(file_handle);
+    }
+}
+
+void PrefetchMemory(std::span<const u8> data) noexcept {
+    if (data.empty()) {
+        return;
+    }
+    WIN32_MEMORY_RANGE_ENTRY range{
+        .VirtualAddress = const_cast<u8*>(data.data()),
+        .NumberOfBytes = data.size(),
+    };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+#else
+
+MappedFile::MappedFile(const std::filesystem::path& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        SPDLOG_ERROR("Failed to open file {}", path.string());
+        throw std::runtime_error("Failed to open file");
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        SPDLOG_ERROR("Failed to stat file {}", path.string());
+        throw std::runtime_error("Failed to stat file");
+    }
+    length = static_cast<std::size_t>(file_stat.st_size);
+    if (length == 0) { // Empty files cannot be mapped
+        close(fd);
+        return;
+    }
+
+    void* ptr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        SPDLOG_ERROR("Failed to map file {}", path.string());
+        throw std::runtime_error("Failed to map file");
+    }
+    base = reinterpret_cast<const u8*>(ptr);
+}
+
+MappedFile::~MappedFile() {
+    if (base) {
+        munmap(const_cast<u8*>(base), length);
+    }
+}
+
+void PrefetchMemory(std::span<const u8> data) noexcept {
+    if (data.empty()) {
+        return;
+    }
+    // madvise takes whole pages
+    static const auto page_size = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+    const auto begin = reinterpret_cast<std::uintptr_t>(data.data()) & ~(page_size - 1);
+    const auto end = reinterpret_cast<std::uintptr_t>(data.data() + data.size());
+    madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+}
+
+#endif
+
+} // namespace Common
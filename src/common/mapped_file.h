@@ -0,0 +1,49 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <filesystem>
+#include <span>
+#include "common/common_types.h"
+
+namespace Common {
+
+/**
+ * Read-only memory mapping of an entire file. Uses mmap on POSIX systems and
+ * MapViewOfFile on Windows. Throws std::runtime_error if the file cannot be mapped.
+ */
+class MappedFile : NonCopyable {
+public:
+    explicit MappedFile(const std::filesystem::path& path);
+    ~MappedFile();
+
+    const u8* data() const noexcept {
+        return base;
+    }
+
+    std::size_t size() const noexcept {
+        return length;
+    }
+
+    std::span<const u8> GetSpan() const noexcept {
+        return {base, length};
+    }
+
+private:
+    const u8* base{};
+    std::size_t length{};
+
+#ifdef _WIN32
+    void* file_handle{};
+    void* mapping_handle{};
+#endif
+};
+
+// Starts reading the pages of the memory mapped data in the background (MADV_WILLNEED,
+// PrefetchVirtualMemory on Windows), so that touching them later does not block on I/O. Only a
+// hint, failures are ignored.
+void PrefetchMemory(std::span<const u8> data) noexcept;
+
+} // namespace Common
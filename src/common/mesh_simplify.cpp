@@ -0,0 +1,264 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <unordered_map>
+#include "common/mesh_simplify.h"
+#include "common/vertex_weld.h"
+
+namespace Common {
+
+namespace {
+
+using Vec3 = std::array<double, 3>;
+
+Vec3 Sub(const Vec3& a, const Vec3& b) {
+    return {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+}
+
+Vec3 Cross(const Vec3& a, const Vec3& b) {
+    return {a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]};
+}
+
+double Dot(const Vec3& a, const Vec3& b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// Sum of the squared distances to a set of planes, weighted by the areas of their triangles.
+// The upper triangle of the symmetric 4x4 matrix.
+struct Quadric {
+    double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+    double weight;
+
+    static Quadric FromPlane(const Vec3& n, double d, double weight) {
+        return {
+            weight * n[0] * n[0], weight * n[0] * n[1], weight * n[0] * n[2], weight * n[0] * d,
+            weight * n[1] * n[1], weight * n[1] * n[2], weight * n[1] * d,    weight * n[2] * n[2],
+            weight * n[2] * d,    weight * d * d,       weight,
+        };
+    }
+
+    Quadric& operator+=(const Quadric& o) {
+        a00 += o.a00;
+        a01 += o.a01;
+        a02 += o.a02;
+        a03 += o.a03;
+        a11 += o.a11;
+        a12 += o.a12;
+        a13 += o.a13;
+        a22 += o.a22;
+        a23 += o.a23;
+        a33 += o.a33;
+        weight += o.weight;
+        return *this;
+    }
+
+    // Mean squared distance of the point to the planes
+    double Error(const Vec3& p) const {
+        if (weight == 0) {
+            return 0;
+        }
+        const double x = p[0], y = p[1], z = p[2];
+        const double error = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x +
+                             a11 * y * y + 2 * a12 * y * z + 2 * a13 * y + a22 * z * z +
+                             2 * a23 * z + a33;
+        return std::max(error, 0.0) / weight;
+    }
+};
+
+struct Collapse {
+    u32 from;
+    u32 to;
+    double cost;
+};
+
+u64 EdgeKey(u32 a, u32 b) {
+    return (static_cast<u64>(std::min(a, b)) << 32) | std::max(a, b);
+}
+
+} // namespace
+
+SimplifiedMesh SimplifyMesh(std::span<const float> positions, std::span<const u32> indices_,
+                            std::size_t target_index_count, float max_error) {
+    const std::size_t num_vertices = positions.size() / 3;
+    std::vector<u32> indices(indices_.begin(), indices_.end() - indices_.size() % 3);
+    const auto GetPosition = [positions](u32 v) -> Vec3 {
+        return {positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2]};
+    };
+
+    // Vertices at the same position, which are split by other attributes
+    std::vector<std::array<float, 3>> unique_positions;
+    std::vector<u32> position_ids;
+    WeldVertices(
+        num_vertices,
+        [positions](std::size_t i) {
+            return std::array<float, 3>{positions[i * 3], positions[i * 3 + 1],
+                                        positions[i * 3 + 2]};
+        },
+        unique_positions, position_ids);
+    std::vector<u32> position_count(unique_positions.size());
+    for (const u32 id : position_ids) {
+        ++position_count[id];
+    }
+
+    // Edges of less (or more) than two triangles are on a border
+    std::unordered_map<u64, u32> edge_triangles;
+    for (std::size_t i = 0; i < indices.size(); i += 3) {
+        for (std::size_t j = 0; j < 3; ++j) {
+            ++edge_triangles[EdgeKey(position_ids[indices[i + j]],
+                                     position_ids[indices[i + (j + 1) % 3]])];
+        }
+    }
+    std::vector<u8> locked(num_vertices);
+    std::vector<u8> locked_positions(unique_positions.size());
+    for (const auto& [key, count] : edge_triangles) {
+        if (count != 2) {
+            locked_positions[key >> 32] = locked_positions[key & 0xFFFFFFFF] = 1;
+        }
+    }
+    for (std::size_t v = 0; v < num_vertices; ++v) {
+        locked[v] = locked_positions[position_ids[v]] || position_count[position_ids[v]] > 1;
+    }
+
+    std::vector<Quadric> quadrics(num_vertices);
+    for (std::size_t i = 0; i < indices.size(); i += 3) {
+        const Vec3 p0 = GetPosition(indices[i]);
+        const Vec3 normal = Cross(Sub(GetPosition(indices[i + 1]), p0),
+                                  Sub(GetPosition(indices[i + 2]), p0));
+        const double length = std::sqrt(Dot(normal, normal));
+        if (length == 0) {
+            continue;
+        }
+        const Vec3 n{normal[0] / length, normal[1] / length, normal[2] / length};
+        const auto quadric = Quadric::FromPlane(n, -Dot(n, p0), length * 0.5);
+        for (std::size_t j = 0; j < 3; ++j) {
+            quadrics[indices[i + j]] += quadric;
+        }
+    }
+
+    static constexpr double Infinity = std::numeric_limits<double>::infinity();
+    const double max_cost = static_cast<double>(max_error) * max_error;
+    double error = 0;
+    std::vector<u32> first_triangles(num_vertices + 1);
+    std::vector<u32> vertex_triangles;
+    std::vector<u32> remap(num_vertices);
+    std::vector<u8> touched(num_vertices);
+    std::vector<u64> edges;
+    std::vector<Collapse> collapses;
+    while (indices.size() > target_index_count) {
+        // Triangles around each vertex
+        std::ranges::fill(first_triangles, 0);
+        for (const u32 v : indices) {
+            ++first_triangles[v + 1];
+        }
+        std::partial_sum(first_triangles.begin(), first_triangles.end(), first_triangles.begin());
+        vertex_triangles.resize(indices.size());
+        std::vector<u32> pos(first_triangles.begin(), first_triangles.end() - 1);
+        for (std::size_t i = 0; i < indices.size(); ++i) {
+            vertex_triangles[pos[indices[i]]++] = static_cast<u32>(i / 3);
+        }
+
+        edges.clear();
+        for (std::size_t i = 0; i < indices.size(); i += 3) {
+            for (std::size_t j = 0; j < 3; ++j) {
+                edges.emplace_back(EdgeKey(indices[i + j], indices[i + (j + 1) % 3]));
+            }
+        }
+        std::ranges::sort(edges);
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        // Collapse each edge in the cheaper direction that moves an unlocked vertex
+        collapses.clear();
+        for (const u64 edge : edges) {
+            const auto a = static_cast<u32>(edge >> 32);
+            const auto b = static_cast<u32>(edge & 0xFFFFFFFF);
+            if (a == b || (locked[a] && locked[b])) {
+                continue;
+            }
+            Quadric quadric = quadrics[a];
+            quadric += quadrics[b];
+            const double cost_ab = locked[a] ? Infinity : quadric.Error(GetPosition(b));
+            const double cost_ba = locked[b] ? Infinity : quadric.Error(GetPosition(a));
+            if (cost_ab <= cost_ba) {
+                collapses.push_back({a, b, cost_ab});
+            } else {
+                collapses.push_back({b, a, cost_ba});
+            }
+        }
+        std::ranges::sort(collapses, {}, &Collapse::cost);
+
+        // Whether replacing from by to turns any of its triangles over
+        const auto FlipsTriangle = [&](u32 from, u32 to) {
+            for (u32 t = first_triangles[from]; t < first_triangles[from + 1]; ++t) {
+                const u32* triangle = &indices[vertex_triangles[t] * 3];
+                if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+                    continue; // Removed
+                }
+                std::array<Vec3, 3> corners;
+                std::array<Vec3, 3> new_corners;
+                for (std::size_t j = 0; j < 3; ++j) {
+                    corners[j] = GetPosition(triangle[j]);
+                    new_corners[j] = triangle[j] == from ? GetPosition(to) : corners[j];
+                }
+                const Vec3 normal =
+                    Cross(Sub(corners[1], corners[0]), Sub(corners[2], corners[0]));
+                const Vec3 new_normal = Cross(Sub(new_corners[1], new_corners[0]),
+                                              Sub(new_corners[2], new_corners[0]));
+                if (Dot(normal, new_normal) <= 0) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        // Collapses of a pass must not share triangles, so that the adjacency stays valid.
+        // Each one removes about two triangles.
+        const std::size_t max_removed = (indices.size() - target_index_count) / 3;
+        std::size_t removed = 0;
+        std::iota(remap.begin(), remap.end(), 0);
+        std::ranges::fill(touched, 0);
+        for (const auto& [from, to, cost] : collapses) {
+            if (cost > max_cost || removed >= max_removed) {
+                break;
+            }
+            if (touched[from] || touched[to] || FlipsTriangle(from, to)) {
+                continue;
+            }
+            for (u32 t = first_triangles[from]; t < first_triangles[from + 1]; ++t) {
+                const u32* triangle = &indices[vertex_triangles[t] * 3];
+                removed += triangle[0] == to || triangle[1] == to || triangle[2] == to;
+                touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = 1;
+            }
+            remap[from] = to;
+            quadrics[to] += quadrics[from];
+            error = std::max(error, cost);
+        }
+        if (removed == 0) {
+            break;
+        }
+
+        // Targets are touched and so never collapsed themselves in the same pass
+        std::size_t num_indices = 0;
+        for (std::size_t i = 0; i < indices.size(); i += 3) {
+            const u32 v0 = remap[indices[i]], v1 = remap[indices[i + 1]],
+                      v2 = remap[indices[i + 2]];
+            if (v0 != v1 && v1 != v2 && v2 != v0) {
+                indices[num_indices++] = v0;
+                indices[num_indices++] = v1;
+                indices[num_indices++] = v2;
+            }
+        }
+        indices.resize(num_indices);
+    }
+    return {
+        .indices = std::move(indices),
+        .error = static_cast<float>(std::sqrt(error)),
+    };
+}
+
+} // namespace Common
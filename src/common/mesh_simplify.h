@@ -0,0 +1,31 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include <vector>
+#include "common/common_types.h"
+
+/**
+ * Triangle mesh simplification with quadric error metrics (Garland and Heckbert), for
+ * generating levels of detail. Vertices are only collapsed onto their neighbours, so the
+ * simplified index list refers to the same vertices and can share their buffers.
+ * Vertices on borders and attribute seams (sharing their position with other vertices) are
+ * never moved, which keeps the outline and texture seams of the mesh intact.
+ */
+namespace Common {
+
+struct SimplifiedMesh {
+    std::vector<u32> indices;
+    // Of the collapses made, roughly the largest distance the surface has moved
+    float error{};
+};
+
+// Simplifies the triangle list down to about target_index_count indices, or fewer collapses
+// if they would move the surface by more than max_error. positions are XYZ triples.
+SimplifiedMesh SimplifyMesh(std::span<const float> positions, std::span<const u32> indices,
+                            std::size_t target_index_count, float max_error);
+
+} // namespace Common
@@ -0,0 +1,147 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "common/assert.h"
+#include "common/meshlet_builder.h"
+
+namespace Common {
+
+namespace {
+
+using Vec3 = std::array<float, 3>;
+
+Vec3 Sub(const Vec3& a, const Vec3& b) {
+    return {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+}
+
+Vec3 Cross(const Vec3& a, const Vec3& b) {
+    return {a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]};
+}
+
+float Dot(const Vec3& a, const Vec3& b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// Cones wider than this are hardly ever culled, so they are not worth testing
+constexpr float MinConeDot = 0.1f;
+
+constexpr u32 Unused = std::numeric_limits<u32>::max();
+
+} // namespace
+
+MeshletMesh BuildMeshlets(std::span<const float> positions, std::span<const u32> indices,
+                          std::size_t max_vertices, std::size_t max_triangles) {
+    ASSERT_MSG(max_vertices <= 256 && max_triangles > 0, "Invalid meshlet limits");
+
+    const auto GetPosition = [positions](u32 v) -> Vec3 {
+        return {positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2]};
+    };
+
+    MeshletMesh mesh;
+    // Index of each mesh vertex in the current meshlet
+    std::vector<u32> local_indices(positions.size() / 3, Unused);
+    Meshlet meshlet;
+
+    const auto Finish = [&] {
+        if (meshlet.triangle_count == 0) {
+            return;
+        }
+        const std::span<const u32> vertices{mesh.vertices.data() + meshlet.first_vertex,
+                                            meshlet.vertex_count};
+
+        // Sphere around the center of the bounding box
+        Vec3 min_point{std::numeric_limits<float>::infinity(),
+                       std::numeric_limits<float>::infinity(),
+                       std::numeric_limits<float>::infinity()};
+        Vec3 max_point{-min_point[0], -min_point[1], -min_point[2]};
+        for (const u32 v : vertices) {
+            const Vec3 p = GetPosition(v);
+            for (std::size_t j = 0; j < 3; ++j) {
+                min_point[j] = std::min(min_point[j], p[j]);
+                max_point[j] = std::max(max_point[j], p[j]);
+            }
+        }
+        for (std::size_t j = 0; j < 3; ++j) {
+            meshlet.center[j] = (min_point[j] + max_point[j]) * 0.5f;
+        }
+        float radius_squared = 0;
+        for (const u32 v : vertices) {
+            const Vec3 d = Sub(GetPosition(v), meshlet.center);
+            radius_squared = std::max(radius_squared, Dot(d, d));
+        }
+        meshlet.radius = std::sqrt(radius_squared);
+
+        // Cone around the average of the triangle normals
+        std::vector<Vec3> normals;
+        Vec3 axis{};
+        for (u32 t = 0; t < meshlet.triangle_count; ++t) {
+            const u32 packed = mesh.triangles[meshlet.first_triangle + t];
+            const Vec3 p0 = GetPosition(vertices[packed & 0xFF]);
+            const Vec3 normal = Cross(Sub(GetPosition(vertices[(packed >> 8) & 0xFF]), p0),
+                                      Sub(GetPosition(vertices[(packed >> 16) & 0xFF]), p0));
+            const float length = std::sqrt(Dot(normal, normal));
+            if (length == 0) { // Degenerate triangles face nowhere
+                continue;
+            }
+            const Vec3 n{normal[0] / length, normal[1] / length, normal[2] / length};
+            normals.emplace_back(n);
+            for (std::size_t j = 0; j < 3; ++j) {
+                axis[j] += n[j];
+            }
+        }
+        const float axis_length = std::sqrt(Dot(axis, axis));
+        if (axis_length > 0) {
+            for (std::size_t j = 0; j < 3; ++j) {
+                meshlet.cone_axis[j] = axis[j] / axis_length;
+            }
+            float min_dot = 1;
+            for (const auto& n : normals) {
+                min_dot = std::min(min_dot, Dot(n, meshlet.cone_axis));
+            }
+            // The sine of the angle between the axis and the furthest normal
+            meshlet.cone_cutoff =
+                min_dot < MinConeDot ? 1.0f : std::sqrt(std::max(1 - min_dot * min_dot, 0.0f));
+        }
+
+        for (const u32 v : vertices) {
+            local_indices[v] = Unused;
+        }
+        mesh.meshlets.emplace_back(meshlet);
+        meshlet = {
+            .first_vertex = static_cast<u32>(mesh.vertices.size()),
+            .first_triangle = static_cast<u32>(mesh.triangles.size()),
+        };
+    };
+
+    for (std::size_t i = 0; i + 2 < indices.size(); i += 3) {
+        const std::array<u32, 3> triangle{indices[i], indices[i + 1], indices[i + 2]};
+        u32 new_vertices = local_indices[triangle[0]] == Unused;
+        new_vertices += local_indices[triangle[1]] == Unused && triangle[1] != triangle[0];
+        new_vertices += local_indices[triangle[2]] == Unused && triangle[2] != triangle[0] &&
+                        triangle[2] != triangle[1];
+        if (meshlet.vertex_count + new_vertices > max_vertices ||
+            meshlet.triangle_count == max_triangles) {
+            Finish();
+        }
+
+        u32 packed = 0;
+        for (std::size_t j = 0; j < 3; ++j) {
+            auto& local_index = local_indices[triangle[j]];
+            if (local_index == Unused) {
+                local_index = meshlet.vertex_count++;
+                mesh.vertices.emplace_back(triangle[j]);
+            }
+            packed |= local_index << (j * 8);
+        }
+        mesh.triangles.emplace_back(packed);
+        ++meshlet.triangle_count;
+    }
+    Finish();
+    return mesh;
+}
+
+} // namespace Common
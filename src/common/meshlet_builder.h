@@ -0,0 +1,43 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <span>
+#include <vector>
+#include "common/common_types.h"
+
+/**
+ * Splits triangle meshes into meshlets, small clusters of triangles that a mesh shader
+ * workgroup emits at once. Triangles are added greedily in index order, which keeps them
+ * local for meshes already optimized for the vertex cache. Each meshlet has a bounding sphere
+ * and a cone bounding the normals of its triangles, for culling it as a whole.
+ */
+namespace Common {
+
+struct Meshlet {
+    u32 first_vertex{};   // In MeshletMesh::vertices
+    u32 first_triangle{}; // In MeshletMesh::triangles
+    u32 vertex_count{};
+    u32 triangle_count{};
+    std::array<float, 3> center{};
+    float radius{};
+    // All triangles face away from a camera at c if dot(center - c, cone_axis) >=
+    // cone_cutoff * length(center - c) + radius. 1 if the normals are too far apart.
+    std::array<float, 3> cone_axis{};
+    float cone_cutoff = 1.0f;
+};
+
+struct MeshletMesh {
+    std::vector<Meshlet> meshlets;
+    std::vector<u32> vertices;  // Indices of the mesh vertices each meshlet uses
+    std::vector<u32> triangles; // Three 8-bit indices into the meshlet vertices each
+};
+
+// positions are XYZ triples. max_vertices must be at most 256.
+MeshletMesh BuildMeshlets(std::span<const float> positions, std::span<const u32> indices,
+                          std::size_t max_vertices, std::size_t max_triangles);
+
+} // namespace Common
@@ -0,0 +1,221 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cmath>
+#include "common/assert.h"
+#include "common/opacity_micromap.h"
+
+namespace Common {
+
+namespace {
+
+using Vec2 = std::array<float, 2>;
+
+enum MicroTriangleState : u8 {
+    Transparent = 0,
+    Opaque = 1,
+    UnknownTransparent = 2,
+    UnknownOpaque = 3,
+};
+
+// Of VkOpacityMicromapFormatEXT
+constexpr u16 Format4State = 2;
+
+// Footprints of more texels than this are not scanned, but left unknown
+constexpr s64 MaxFootprintTexels = 64 * 64;
+
+// Discrete barycentrics of the micro-triangle at a distance along the bird curve, see the
+// VK_EXT_opacity_micromap specification
+u32 ExtractEvenBits(u32 x) {
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0f0f0f0f;
+    x = (x | (x >> 4)) & 0x00ff00ff;
+    x = (x | (x >> 8)) & 0x0000ffff;
+    return x;
+}
+
+// Exclusive prefix XOR
+u32 PrefixEor(u32 x) {
+    x ^= (x >> 1) & 0x7fff7fff;
+    x ^= (x >> 2) & 0x3fff3fff;
+    x ^= (x >> 4) & 0x0fff0fff;
+    x ^= (x >> 8) & 0x00ff00ff;
+    return x;
+}
+
+// Barycentrics (of the second and third vertex) of the corners of the micro-triangle
+std::array<Vec2, 3> GetMicroTriangle(u32 index, u32 level) {
+    const u32 b0 = ExtractEvenBits(index);
+    const u32 b1 = ExtractEvenBits(index >> 1);
+    const u32 fx = PrefixEor(b0);
+    const u32 fy = PrefixEor(b0 & ~b1);
+    const u32 t = fy ^ b1;
+    const u32 mask = (1u << level) - 1;
+    u32 iu = ((fx & ~t) | (b0 & ~t) | (~b0 & ~fx & t)) & mask;
+    u32 iv = (fy ^ b0) & mask;
+    const u32 iw = ((~fx & ~t) | (b0 & ~t) | (~b0 & fx & t)) & mask;
+
+    const bool upright = ((iu ^ iv ^ iw) & 1) != 0;
+    if (!upright) {
+        iu++;
+        iv++;
+    }
+    const float scale = std::ldexp(1.0f, -static_cast<int>(level));
+    const float step = upright ? scale : -scale;
+    const float u = static_cast<float>(iu) * scale;
+    const float v = static_cast<float>(iv) * scale;
+    return {{{u, v}, {u + step, v}, {u, v + step}}};
+}
+
+s64 WrapTexel(s64 texel, s64 size, AlphaMask::Wrap wrap) {
+    switch (wrap) {
+    case AlphaMask::Wrap::Repeat:
+        return ((texel % size) + size) % size;
+    case AlphaMask::Wrap::MirroredRepeat: {
+        const s64 period = ((texel % (2 * size)) + 2 * size) % (2 * size);
+        return period < size ? period : 2 * size - 1 - period;
+    }
+    default:
+        return std::clamp<s64>(texel, 0, size - 1);
+    }
+}
+
+class Classifier {
+public:
+    explicit Classifier(const AlphaMask& mask_) : mask(mask_) {
+        // Compared as bytes, rounding up so that only texels of at least the cutoff pass
+        threshold = std::ceil(mask.cutoff * 255.0f);
+    }
+
+    bool IsOpaque(s64 x, s64 y) const {
+        x = WrapTexel(x, mask.width, mask.wrap_s);
+        y = WrapTexel(y, mask.height, mask.wrap_t);
+        return mask.alpha[static_cast<std::size_t>(y * mask.width + x)] >= threshold;
+    }
+
+    // The state of the triangle of the texcoords, over the texels bilinear filtering reads
+    MicroTriangleState Classify(const std::array<Vec2, 3>& uvs) const {
+        float min_x = uvs[0][0], max_x = uvs[0][0];
+        float min_y = uvs[0][1], max_y = uvs[0][1];
+        for (const auto& uv : uvs) {
+            min_x = std::min(min_x, uv[0]);
+            max_x = std::max(max_x, uv[0]);
+            min_y = std::min(min_y, uv[1]);
+            max_y = std::max(max_y, uv[1]);
+        }
+        // Texel centers are at half texels
+        const auto ToTexel = [](float uv, u32 size) {
+            return static_cast<double>(uv) * size - 0.5;
+        };
+        const double x0 = std::floor(ToTexel(min_x, mask.width));
+        const double x1 = std::floor(ToTexel(max_x, mask.width)) + 1;
+        const double y0 = std::floor(ToTexel(min_y, mask.height));
+        const double y1 = std::floor(ToTexel(max_y, mask.height)) + 1;
+
+        const auto center_x = (uvs[0][0] + uvs[1][0] + uvs[2][0]) / 3.0f;
+        const auto center_y = (uvs[0][1] + uvs[1][1] + uvs[2][1]) / 3.0f;
+        const bool center_opaque =
+            IsOpaque(static_cast<s64>(std::floor(static_cast<double>(center_x) * mask.width)),
+                     static_cast<s64>(std::floor(static_cast<double>(center_y) * mask.height)));
+        const auto unknown = center_opaque ? UnknownOpaque : UnknownTransparent;
+        if (!std::isfinite(x0) || !std::isfinite(x1) || !std::isfinite(y0) ||
+            !std::isfinite(y1) || (x1 - x0 + 1) * (y1 - y0 + 1) > MaxFootprintTexels) {
+            return unknown;
+        }
+
+        bool any_opaque = false;
+        bool any_transparent = false;
+        for (auto y = static_cast<s64>(y0); y <= static_cast<s64>(y1); ++y) {
+            for (auto x = static_cast<s64>(x0); x <= static_cast<s64>(x1); ++x) {
+                (IsOpaque(x, y) ? any_opaque : any_transparent) = true;
+                if (any_opaque && any_transparent) {
+                    return unknown;
+                }
+            }
+        }
+        return any_opaque ? Opaque : Transparent;
+    }
+
+private:
+    const AlphaMask& mask;
+    float threshold{};
+};
+
+} // namespace
+
+OpacityMicromap BakeOpacityMicromap(std::span<const std::array<float, 6>> texcoords,
+                                    const AlphaMask& mask, u32 max_level) {
+    ASSERT_MSG(mask.width != 0 && mask.height != 0, "Alpha mask is empty");
+    max_level = std::clamp<u32>(max_level, 1, MaxOpacityMicromapLevel);
+
+    OpacityMicromap out;
+    out.indices.reserve(texcoords.size());
+
+    const Classifier classifier{mask};
+    std::vector<MicroTriangleState> states;
+    for (const auto& uv : texcoords) {
+        const Vec2 t0{uv[0], uv[1]};
+        const Vec2 e1{uv[2] - uv[0], uv[3] - uv[1]};
+        const Vec2 e2{uv[4] - uv[0], uv[5] - uv[1]};
+        const auto GetUV = [&](const Vec2& bary) -> Vec2 {
+            return {t0[0] + e1[0] * bary[0] + e2[0] * bary[1],
+                    t0[1] + e1[1] * bary[0] + e2[1] * bary[1]};
+        };
+
+        // Uniform as a whole
+        const auto whole = classifier.Classify({{t0, GetUV({1, 0}), GetUV({0, 1})}});
+        if (whole == Transparent || whole == Opaque) {
+            out.indices.emplace_back(whole == Opaque ? OpacityMicromapFullyOpaque
+                                                     : OpacityMicromapFullyTransparent);
+            continue;
+        }
+
+        // Micro-triangles of about a texel each
+        const double texel_area = std::abs(static_cast<double>(e1[0]) * e2[1] -
+                                           static_cast<double>(e1[1]) * e2[0]) *
+                                  0.5 * mask.width * mask.height;
+        const double ideal_level = 0.5 * std::log2(std::max(texel_area, 1.0));
+        const u32 level = std::clamp<u32>(static_cast<u32>(std::ceil(ideal_level)), 1, max_level);
+
+        const u32 num_micro_triangles = 1u << (2 * level);
+        states.resize(num_micro_triangles);
+        bool all_transparent = true;
+        bool all_opaque = true;
+        for (u32 i = 0; i < num_micro_triangles; ++i) {
+            const auto bary = GetMicroTriangle(i, level);
+            states[i] = classifier.Classify({{GetUV(bary[0]), GetUV(bary[1]), GetUV(bary[2])}});
+            all_transparent &= states[i] == Transparent;
+            all_opaque &= states[i] == Opaque;
+        }
+        if (all_transparent || all_opaque) {
+            out.indices.emplace_back(all_opaque ? OpacityMicromapFullyOpaque
+                                                : OpacityMicromapFullyTransparent);
+            continue;
+        }
+
+        const auto data_offset = static_cast<u32>(out.data.size());
+        out.data.resize(out.data.size() + num_micro_triangles / 4);
+        for (u32 i = 0; i < num_micro_triangles; ++i) {
+            out.data[data_offset + i / 4] |= static_cast<u8>(states[i] << (2 * (i % 4)));
+        }
+        out.indices.emplace_back(static_cast<s32>(out.triangles.size()));
+        out.triangles.push_back({
+            .data_offset = data_offset,
+            .subdivision_level = static_cast<u16>(level),
+            .format = Format4State,
+        });
+        out.level_counts[level]++;
+    }
+    if (out.triangles.empty()) {
+        // Micromaps cannot be empty, so one gets a triangle that is never referenced
+        out.data.assign(1, 0);
+        out.triangles.push_back({.subdivision_level = 1, .format = Format4State});
+        out.level_counts[1]++;
+    }
+    return out;
+}
+
+} // namespace Common
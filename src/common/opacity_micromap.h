@@ -0,0 +1,72 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <span>
+#include <vector>
+#include "common/common_types.h"
+
+/**
+ * Bakes the opacity micromap (VK_EXT_opacity_micromap) of an alpha tested triangle mesh: each
+ * triangle is subdivided into 4^level micro-triangles in bird curve order, and each of those is
+ * classified against the cutoff over the texels its texcoords cover (grown by a texel for the
+ * filtering). Those entirely on one side of it are transparent or opaque, which traversal
+ * resolves without invoking any-hit shaders. The others are unknown, and left to them. Triangles
+ * that are uniform as a whole take a special index instead of micro-triangles.
+ */
+namespace Common {
+
+// The alpha channel of the texture sampled by the mesh, with the wrapping of its sampler
+struct AlphaMask {
+    enum class Wrap {
+        Repeat,
+        MirroredRepeat,
+        ClampToEdge,
+    };
+    u32 width{};
+    u32 height{};
+    std::span<const u8> alpha; // A byte per texel, row by row
+    Wrap wrap_s = Wrap::Repeat;
+    Wrap wrap_t = Wrap::Repeat;
+    // Texels of an alpha (divided by 255) of at least this are opaque
+    float cutoff = 0.5f;
+};
+
+// Per triangle of the mesh instead of the index of its micromap triangle, see
+// VkOpacityMicromapSpecialIndexEXT
+constexpr s32 OpacityMicromapFullyTransparent = -1;
+constexpr s32 OpacityMicromapFullyOpaque = -2;
+
+// Beyond which the micro-triangles of a triangle take more memory than they save any-hit shaders
+constexpr u32 MaxOpacityMicromapLevel = 6;
+
+struct OpacityMicromap {
+    // Of VkMicromapTriangleEXT
+    struct Triangle {
+        u32 data_offset{}; // In data
+        u16 subdivision_level{};
+        u16 format{}; // Always VK_OPACITY_MICROMAP_FORMAT_4_STATE_EXT
+    };
+    static_assert(sizeof(Triangle) == 8);
+
+    // 2 bits per micro-triangle (0 = transparent, 1 = opaque, 2 = unknown transparent,
+    // 3 = unknown opaque), in bird curve order. The data of each triangle starts on a byte.
+    std::vector<u8> data;
+    std::vector<Triangle> triangles;
+    // Per triangle of the mesh, the index in triangles or a special index
+    std::vector<s32> indices;
+    // Of the triangles of each subdivision level, for the usage counts of the builds. There is
+    // always at least one triangle.
+    std::array<u32, MaxOpacityMicromapLevel + 1> level_counts{};
+};
+
+// texcoords are the UVs of the three vertices of each triangle, and the mask must not be empty.
+// Levels are picked so that the micro-triangles cover about a texel, up to max_level.
+OpacityMicromap BakeOpacityMicromap(std::span<const std::array<float, 6>> texcoords,
+                                    const AlphaMask& mask,
+                                    u32 max_level = MaxOpacityMicromapLevel);
+
+} // namespace Common
@@ -0,0 +1,50 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#include <psapi.h>
+#else
+#include <fstream>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#endif
+
+#include "common/process_memory.h"
+
+namespace Common {
+
+std::size_t GetResidentMemory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.WorkingSetSize;
+#else
+    // Total and resident pages, on Linux
+    std::ifstream statm("/proc/self/statm");
+    std::size_t total_pages{}, resident_pages{};
+    if (!(statm >> total_pages >> resident_pages)) {
+        return 0;
+    }
+    return resident_pages * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+void TrimHeap() {
+#ifdef _WIN32
+    _heapmin();
+#elif defined(__GLIBC__)
+    // Also trims the arenas of the other threads, e.g. those of the thread pool
+    malloc_trim(0);
+#endif
+}
+
+} // namespace Common
@@ -0,0 +1,25 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace Common {
+
+// Bytes of physical memory the process occupies (its resident set / working set), 0 if unknown
+std::size_t GetResidentMemory();
+
+// Returns the free memory of the heap to the system where the C runtime supports it, e.g. once
+// large temporaries have been released. The runtime would otherwise keep it for reuse.
+void TrimHeap();
+
+// Bytes the vector holds on the heap, including its spare capacity
+template <typename T, typename Allocator>
+std::size_t GetHeapSize(const std::vector<T, Allocator>& vec) noexcept {
+    return vec.capacity() * sizeof(T);
+}
+
+} // namespace Common
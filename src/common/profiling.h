@@ -0,0 +1,39 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+/**
+ * Instrumentation for the Tracy profiler, built with ENABLE_TRACY (see the CMake option of the
+ * same name) and compiled out otherwise. CPU zones, frame marks, device memory and lock
+ * contention go to one timeline, along with the GPU zones of Renderer::VulkanProfiler.
+ */
+
+#ifdef ENABLE_TRACY
+
+#include <tracy/Tracy.hpp>
+
+// Zone of the enclosing block, named after the function or the string literal
+#define PROFILE_FUNCTION() ZoneScoped
+#define PROFILE_SCOPE(name) ZoneScopedN(name)
+// Ends the frame, as it is presented
+#define PROFILE_FRAME() FrameMark
+#define PROFILE_THREAD_NAME(name) tracy::SetThreadName(name)
+// Memory of the named pool (a string literal), identified by the pointer
+#define PROFILE_ALLOC(ptr, size, pool) TracyAllocN(ptr, size, pool)
+#define PROFILE_FREE(ptr, pool) TracyFreeN(ptr, pool)
+// Declares a mutex whose contention is shown. Those waited on by condition variables cannot be.
+#define PROFILE_MUTEX(type, name) TracyLockable(type, name)
+
+#else
+
+#define PROFILE_FUNCTION()
+#define PROFILE_SCOPE(name)
+#define PROFILE_FRAME()
+#define PROFILE_THREAD_NAME(name)
+#define PROFILE_ALLOC(ptr, size, pool)
+#define PROFILE_FREE(ptr, pool)
+#define PROFILE_MUTEX(type, name) type name
+
+#endif
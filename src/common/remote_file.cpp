@@ -0,0 +1,433 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <city.h>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/remote_file.h"
+#include "common/scope_exit.h"
+
+#ifdef ENABLE_REMOTE_SCENES
+#include <curl/curl.h>
+#endif
+
+namespace Common {
+
+bool IsRemoteURI(std::string_view uri) noexcept {
+    return uri.starts_with("https://") || uri.starts_with("http://") || uri.starts_with("s3://");
+}
+
+std::string ResolveRemoteURI(std::string_view base, std::string_view reference) {
+    if (reference.starts_with("data:") || reference.find("://") != std::string_view::npos) {
+        return std::string{reference};
+    }
+    // Scheme and authority, followed by the path
+    const std::size_t scheme_end = base.find("://");
+    const std::size_t path_begin =
+        scheme_end == std::string_view::npos ? 0 : base.find('/', scheme_end + 3);
+    const auto root = base.substr(0, std::min(path_begin, base.size()));
+
+    std::vector<std::string_view> segments;
+    const auto AddSegments = [&segments](std::string_view path) {
+        while (!path.empty()) {
+            const std::size_t end = std::min(path.find('/'), path.size());
+            const auto segment = path.substr(0, end);
+            if (segment == "..") {
+                if (!segments.empty()) {
+                    segments.pop_back();
+                }
+            } else if (!segment.empty() && segment != ".") {
+                segments.push_back(segment);
+            }
+            path.remove_prefix(std::min(end + 1, path.size()));
+        }
+    };
+    if (!reference.starts_with('/') && path_begin < base.size()) {
+        // The directory of the base, without its file name
+        const auto path = base.substr(path_begin);
+        AddSegments(path.substr(0, path.rfind('/')));
+    }
+    const bool directory = reference.ends_with('/');
+    AddSegments(reference);
+
+    std::string resolved{root};
+    for (const auto segment : segments) {
+        resolved.append("/").append(segment);
+    }
+    if (directory || segments.empty()) {
+        resolved.push_back('/');
+    }
+    return resolved;
+}
+
+static std::filesystem::path g_cache_directory;
+
+void RemoteFile::SetCacheDirectory(std::filesystem::path directory) {
+    g_cache_directory = std::move(directory);
+}
+
+std::filesystem::path RemoteFile::GetCachePath(std::size_t block) const {
+    // The ETag identifies the contents, and the block size their split
+    const auto key = fmt::format("{}\n{}\n{}\n{}", version, uri, BlockSize, block);
+    const auto hash = CityHash128(key.data(), key.size());
+    return g_cache_directory / fmt::format("{:016x}{:016x}", Uint128High64(hash),
+                                           Uint128Low64(hash));
+}
+
+#ifdef ENABLE_REMOTE_SCENES
+
+struct CurlDeleter {
+    void operator()(CURL* curl) const noexcept {
+        curl_easy_cleanup(curl);
+    }
+};
+using CurlHandle = std::unique_ptr<CURL, CurlDeleter>;
+
+struct CurlMultiDeleter {
+    void operator()(CURLM* multi) const noexcept {
+        curl_multi_cleanup(multi);
+    }
+};
+
+static std::string GetEnvironment(const char* name) {
+    const char* value = std::getenv(name);
+    return value ? value : "";
+}
+
+// Credentials of s3:// requests, from the environment like the AWS CLI
+struct S3Settings {
+    std::string region;
+    std::string endpoint; // Path style, if set
+    std::string sigv4;    // Empty for anonymous requests
+    std::string user_password;
+    curl_slist* headers{};
+
+    explicit S3Settings() {
+        region = GetEnvironment("AWS_REGION");
+        if (region.empty()) {
+            region = GetEnvironment("AWS_DEFAULT_REGION");
+        }
+        if (region.empty()) {
+            region = "us-east-1";
+        }
+        endpoint = GetEnvironment("AWS_ENDPOINT_URL");
+        while (endpoint.ends_with('/')) {
+            endpoint.pop_back();
+        }
+        const auto access_key = GetEnvironment("AWS_ACCESS_KEY_ID");
+        const auto secret_key = GetEnvironment("AWS_SECRET_ACCESS_KEY");
+        if (!access_key.empty() && !secret_key.empty()) {
+            sigv4 = fmt::format("aws:amz:{}:s3", region);
+            user_password = fmt::format("{}:{}", access_key, secret_key);
+            if (const auto token = GetEnvironment("AWS_SESSION_TOKEN"); !token.empty()) {
+                headers = curl_slist_append(headers,
+                                            fmt::format("x-amz-security-token: {}", token).c_str());
+            }
+        }
+    }
+    ~S3Settings() {
+        curl_slist_free_all(headers);
+    }
+};
+
+static const S3Settings& GetS3Settings() {
+    static const S3Settings settings;
+    return settings;
+}
+
+static std::string GetRequestURL(std::string_view uri) {
+    if (!uri.starts_with("s3://")) {
+        return std::string{uri};
+    }
+    const auto path = uri.substr(5);
+    const std::size_t slash = std::min(path.find('/'), path.size());
+    const auto bucket = path.substr(0, slash);
+    const auto key = path.substr(std::min(slash + 1, path.size()));
+    const auto& settings = GetS3Settings();
+    if (!settings.endpoint.empty()) {
+        return fmt::format("{}/{}/{}", settings.endpoint, bucket, key);
+    }
+    return fmt::format("https://{}.s3.{}.amazonaws.com/{}", bucket, settings.region, key);
+}
+
+static CurlHandle CreateRequest(const std::string& uri, const std::string& url) {
+    CurlHandle curl{curl_easy_init()};
+    if (!curl) {
+        throw std::runtime_error("Failed to create request");
+    }
+    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl.get(), CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl.get(), CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl.get(), CURLOPT_CONNECTTIMEOUT, 30L);
+    if (uri.starts_with("s3://")) {
+        const auto& settings = GetS3Settings();
+        if (!settings.sigv4.empty()) {
+            curl_easy_setopt(curl.get(), CURLOPT_AWS_SIGV4, settings.sigv4.c_str());
+            curl_easy_setopt(curl.get(), CURLOPT_USERPWD, settings.user_password.c_str());
+            curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, settings.headers);
+        }
+    }
+    return curl;
+}
+
+struct ObjectHeaders {
+    std::string etag;
+    std::string last_modified;
+};
+
+static std::size_t OnHeader(char* buffer, std::size_t size, std::size_t count, void* user) {
+    auto& headers = *static_cast<ObjectHeaders*>(user);
+    const std::string_view line{buffer, size * count};
+    const std::size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+        return size * count;
+    }
+    std::string name{line.substr(0, colon)};
+    std::ranges::transform(name, name.begin(), [](char c) {
+        return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    });
+    auto value = line.substr(colon + 1);
+    const auto IsSpace = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; };
+    while (!value.empty() && IsSpace(value.front())) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && IsSpace(value.back())) {
+        value.remove_suffix(1);
+    }
+    if (name == "etag") {
+        headers.etag = value;
+    } else if (name == "last-modified") {
+        headers.last_modified = value;
+    }
+    return size * count;
+}
+
+// Of a block, written straight into the memory of the file
+struct BlockRequest {
+    CurlHandle curl;
+    std::size_t block{};
+    u8* out{};
+    std::size_t size{};
+    std::size_t written{};
+    std::string range;
+};
+
+static std::size_t OnBlockData(char* data, std::size_t size, std::size_t count, void* user) {
+    auto& request = *static_cast<BlockRequest*>(user);
+    const std::size_t bytes = size * count;
+    if (bytes > request.size - request.written) { // Not the range, fails the request
+        return 0;
+    }
+    std::memcpy(request.out + request.written, data, bytes);
+    request.written += bytes;
+    return bytes;
+}
+
+RemoteFile::RemoteFile(std::string uri_) : uri(std::move(uri_)), url(GetRequestURL(uri)) {
+    static std::once_flag curl_initialized;
+    std::call_once(curl_initialized, [] {
+        if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+            throw std::runtime_error("Failed to initialize libcurl");
+        }
+    });
+
+    const auto curl = CreateRequest(uri, url);
+    ObjectHeaders headers;
+    curl_easy_setopt(curl.get(), CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl.get(), CURLOPT_HEADERFUNCTION, OnHeader);
+    curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, &headers);
+    const auto result = curl_easy_perform(curl.get());
+    long status{};
+    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &status);
+    curl_off_t content_length = -1;
+    curl_easy_getinfo(curl.get(), CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+    if (result != CURLE_OK || status != 200 || content_length < 0) {
+        SPDLOG_ERROR("Failed to open remote file {}: {} (HTTP {})", uri,
+                     curl_easy_strerror(result), status);
+        throw std::runtime_error("Failed to open remote file");
+    }
+    length = static_cast<std::size_t>(content_length);
+    if (!headers.etag.empty()) {
+        version = headers.etag;
+    } else if (!headers.last_modified.empty()) {
+        version = fmt::format("{} {}", length, headers.last_modified);
+    }
+
+    data.reset(new u8[length]);
+    block_states.resize(DivideCeil(length, BlockSize), BlockState::Missing);
+    SPDLOG_INFO("Opened remote file {} of {:.1f} MiB", uri, length / 1048576.0);
+}
+
+void RemoteFile::FetchBlocks(const std::vector<std::size_t>& blocks) const {
+    const bool cached = !g_cache_directory.empty() && !version.empty();
+    std::vector<std::unique_ptr<BlockRequest>> requests;
+    for (const std::size_t block : blocks) {
+        const std::size_t offset = block * BlockSize;
+        const std::size_t size = std::min(BlockSize, length - offset);
+        if (cached) {
+            std::ifstream file(GetCachePath(block), std::ios::binary);
+            if (file.read(reinterpret_cast<char*>(data.get() + offset), size) &&
+                file.peek() == std::ifstream::traits_type::eof()) {
+                continue;
+            }
+        }
+        auto& request = requests.emplace_back(std::make_unique<BlockRequest>(BlockRequest{
+            .curl = CreateRequest(uri, url),
+            .block = block,
+            .out = data.get() + offset,
+            .size = size,
+            .range = fmt::format("{}-{}", offset, offset + size - 1),
+        }));
+        curl_easy_setopt(request->curl.get(), CURLOPT_RANGE, request->range.c_str());
+        curl_easy_setopt(request->curl.get(), CURLOPT_WRITEFUNCTION, OnBlockData);
+        curl_easy_setopt(request->curl.get(), CURLOPT_WRITEDATA, request.get());
+        curl_easy_setopt(request->curl.get(), CURLOPT_PRIVATE, request.get());
+    }
+    if (requests.empty()) {
+        return;
+    }
+
+    // The connections are reused by the requests queued after the first ones
+    const std::unique_ptr<CURLM, CurlMultiDeleter> multi{curl_multi_init()};
+    if (!multi) {
+        throw std::runtime_error("Failed to create requests");
+    }
+    curl_multi_setopt(multi.get(), CURLMOPT_MAX_TOTAL_CONNECTIONS, MaxParallelRequests);
+    for (const auto& request : requests) {
+        curl_multi_add_handle(multi.get(), request->curl.get());
+    }
+    SCOPE_EXIT({
+        for (const auto& request : requests) {
+            curl_multi_remove_handle(multi.get(), request->curl.get());
+        }
+    });
+    int running = 0;
+    do {
+        if (curl_multi_perform(multi.get(), &running) != CURLM_OK) {
+            throw std::runtime_error("Failed to perform requests");
+        }
+        if (running > 0) {
+            curl_multi_poll(multi.get(), nullptr, 0, 1000, nullptr);
+        }
+    } while (running > 0);
+
+    int queued = 0;
+    while (const CURLMsg* message = curl_multi_info_read(multi.get(), &queued)) {
+        if (message->msg != CURLMSG_DONE) {
+            continue;
+        }
+        BlockRequest* request{};
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &request);
+        long status{};
+        curl_easy_getinfo(message->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+        // A whole object may come back as it is, for a range covering it
+        const bool whole = status == 200 && request->size == length;
+        if (message->data.result != CURLE_OK || (status != 206 && !whole) ||
+            request->written != request->size) {
+            SPDLOG_ERROR("Failed to fetch range {} of remote file {}: {} (HTTP {})",
+                         request->range, uri, curl_easy_strerror(message->data.result), status);
+            throw std::runtime_error("Failed to fetch remote file");
+        }
+    }
+
+    if (!cached) {
+        return;
+    }
+    std::error_code error;
+    std::filesystem::create_directories(g_cache_directory, error);
+    for (const auto& request : requests) {
+        // Written aside and renamed, so that other processes never read partial blocks
+        const auto path = GetCachePath(request->block);
+        auto part_path = path;
+        part_path += ".part";
+        {
+            std::ofstream file(part_path, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(request->out), request->size);
+            if (!file) {
+                SPDLOG_WARN("Failed to write remote file cache {}", part_path.string());
+                continue;
+            }
+        }
+        std::filesystem::rename(part_path, path, error);
+    }
+}
+
+#else
+
+RemoteFile::RemoteFile(std::string uri_) : uri(std::move(uri_)) {
+    SPDLOG_ERROR("Cannot open remote file {}, built without ENABLE_REMOTE_SCENES", uri);
+    throw std::runtime_error("Built without remote file support");
+}
+
+void RemoteFile::FetchBlocks(const std::vector<std::size_t>&) const {
+    throw std::runtime_error("Built without remote file support");
+}
+
+#endif
+
+RemoteFile::~RemoteFile() = default;
+
+std::span<const u8> RemoteFile::GetSpan(std::size_t offset, std::size_t size) const {
+    if (offset > length || size > length - offset) {
+        SPDLOG_ERROR("Range [{}, {}) out of bounds (size {})", offset, offset + size, length);
+        throw std::runtime_error("Remote file range out of bounds");
+    }
+    if (size == 0) {
+        return {};
+    }
+    const std::size_t first_block = offset / BlockSize;
+    const std::size_t end_block = DivideCeil(offset + size, BlockSize);
+
+    // Claims the missing blocks, then waits for those that other threads are fetching
+    std::vector<std::size_t> claimed;
+    {
+        std::lock_guard lock{mutex};
+        for (std::size_t block = first_block; block < end_block; ++block) {
+            if (block_states[block] == BlockState::Missing) {
+                block_states[block] = BlockState::Fetching;
+                claimed.push_back(block);
+            }
+        }
+    }
+    if (!claimed.empty()) {
+        try {
+            FetchBlocks(claimed);
+        } catch (...) {
+            {
+                std::lock_guard lock{mutex};
+                for (const std::size_t block : claimed) {
+                    block_states[block] = BlockState::Missing;
+                }
+            }
+            fetched.notify_all();
+            throw;
+        }
+        {
+            std::lock_guard lock{mutex};
+            for (const std::size_t block : claimed) {
+                block_states[block] = BlockState::Fetched;
+            }
+        }
+        fetched.notify_all();
+    }
+
+    std::unique_lock lock{mutex};
+    for (std::size_t block = first_block; block < end_block; ++block) {
+        fetched.wait(lock, [this, block] { return block_states[block] != BlockState::Fetching; });
+        if (block_states[block] != BlockState::Fetched) { // Another thread failed to fetch it
+            lock.unlock();
+            return GetSpan(offset, size);
+        }
+    }
+    return {data.get() + offset, size};
+}
+
+} // namespace Common
@@ -0,0 +1,90 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "common/common_types.h"
+
+namespace Common {
+
+// Whether the URI is of a remote object, https://, http:// or s3://
+bool IsRemoteURI(std::string_view uri) noexcept;
+// Resolves the URI reference of a glTF against the URI of the remote file referencing it.
+// Absolute and data URIs are returned as is.
+std::string ResolveRemoteURI(std::string_view base, std::string_view reference);
+
+/**
+ * Read-only view of an object in S3-compatible storage (s3://bucket/key) or on an HTTP server,
+ * fetched lazily with range requests. The object is split into blocks, and each range that is
+ * read fetches the blocks it covers that are not fetched yet, in parallel requests. Blocks are
+ * kept in memory (reserved for the whole object, but only the fetched pages become resident),
+ * and in a content addressed disk cache keyed by the ETag of the object, so that later runs
+ * fetch only what changed. Thread safe.
+ *
+ * s3:// URIs are requested from AWS_ENDPOINT_URL (path style) if set, and from the virtual hosted
+ * bucket of AWS_REGION otherwise, signed with AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY if
+ * set (and AWS_SESSION_TOKEN). Needs ENABLE_REMOTE_SCENES, otherwise the constructor throws.
+ */
+class RemoteFile : NonCopyable {
+public:
+    static constexpr std::size_t BlockSize = 4 * 1024 * 1024;
+    // Requests in flight at once, of all the ranges being read
+    static constexpr long MaxParallelRequests = 16;
+
+    // Requests the size and version of the object. Throws if it cannot be found.
+    explicit RemoteFile(std::string uri);
+    ~RemoteFile();
+
+    // Sets directory of the disk cache of all remote files, empty (default) disables it. Must be
+    // called before remote files are created.
+    static void SetCacheDirectory(std::filesystem::path directory);
+
+    const std::string& GetURI() const noexcept {
+        return uri;
+    }
+    std::size_t size() const noexcept {
+        return length;
+    }
+    // ETag of the object, or its size and modification time without one. Empty if the server
+    // returned neither, and the blocks are then not cached on disk.
+    const std::string& GetVersion() const noexcept {
+        return version;
+    }
+
+    // Returns the bytes in [offset, offset + size), fetching what is not fetched yet. Throws if
+    // out of range or if a request fails.
+    std::span<const u8> GetSpan(std::size_t offset, std::size_t size) const;
+
+private:
+    enum class BlockState : u8 {
+        Missing,
+        Fetching, // By a thread that notifies fetched once done
+        Fetched,
+    };
+
+    // Fills the blocks from the disk cache, or with parallel range requests
+    void FetchBlocks(const std::vector<std::size_t>& blocks) const;
+    std::filesystem::path GetCachePath(std::size_t block) const;
+
+    std::string uri;
+    std::string url; // Of the requests, which s3:// URIs are mapped to
+    std::string version;
+    std::size_t length{};
+    // Not value-initialized, so that only the pages of fetched blocks become resident
+    std::unique_ptr<u8[]> data;
+
+    mutable std::mutex mutex;
+    mutable std::condition_variable fetched;
+    mutable std::vector<BlockState> block_states;
+};
+
+} // namespace Common
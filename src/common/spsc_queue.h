@@ -0,0 +1,64 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "common/common_types.h"
+
+namespace Common {
+
+/**
+ * Bounded lock-free queue of one producer thread and one consumer thread, a ring buffer of
+ * Capacity slots (a power of two). Neither side ever blocks: pushing into a full queue and
+ * popping from an empty one fail instead. The indices only grow, each written by one side, and
+ * are kept on cache lines of their own so that the two sides do not contend.
+ */
+template <typename T, std::size_t Capacity>
+class SPSCQueue : NonCopyable {
+    static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of two");
+    static_assert(std::is_nothrow_move_assignable_v<T> && std::is_default_constructible_v<T>);
+
+public:
+    SPSCQueue() = default;
+    ~SPSCQueue() = default;
+
+    // Producer only. Returns false, leaving the value as it is, if the queue is full.
+    bool Push(T& value) {
+        const std::size_t tail = write_index.load(std::memory_order_relaxed);
+        if (tail - read_index.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        slots[tail & (Capacity - 1)] = std::move(value);
+        write_index.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns nothing if the queue is empty.
+    std::optional<T> Pop() {
+        const std::size_t head = read_index.load(std::memory_order_relaxed);
+        if (head == write_index.load(std::memory_order_acquire)) {
+            return std::nullopt;
+        }
+        std::optional<T> value{std::move(slots[head & (Capacity - 1)])};
+        read_index.store(head + 1, std::memory_order_release);
+        return value;
+    }
+
+private:
+    // Of a cache line, which hardware_destructive_interference_size is not reliably defined as
+    static constexpr std::size_t CacheLineSize = 64;
+
+    alignas(CacheLineSize) std::atomic<std::size_t> write_index{};
+    alignas(CacheLineSize) std::atomic<std::size_t> read_index{};
+    alignas(CacheLineSize) std::array<T, Capacity> slots{};
+};
+
+} // namespace Common
@@ -0,0 +1,127 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <cstring>
+#include "common/swap.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define SWAP_SSE2 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SWAP_NEON 1
+#endif
+
+namespace Common {
+
+#if SWAP_SSE2
+// Swaps the bytes of each 16-bit lane
+static __m128i SwapLanes16(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+#endif
+
+// The tails are converted a value at a time, through copies as the pointers may be unaligned
+template <typename T, T (*Swap)(T)>
+static void SwapTail(u8* out, const u8* in, std::size_t begin, std::size_t count) {
+    for (std::size_t i = begin; i < count; ++i) {
+        T value;
+        std::memcpy(&value, in + i * sizeof(T), sizeof(T));
+        value = Swap(value);
+        std::memcpy(out + i * sizeof(T), &value, sizeof(T));
+    }
+}
+
+static u16 Swap16(u16 value) {
+    return swap16(value);
+}
+static u32 Swap32(u32 value) {
+    return swap32(value);
+}
+static u64 Swap64(u64 value) {
+    return swap64(value);
+}
+
+void SwapBytes16(void* dst, const void* src, std::size_t count) noexcept {
+    auto* out = static_cast<u8*>(dst);
+    const auto* in = static_cast<const u8*>(src);
+    std::size_t i = 0;
+#if SWAP_SSE2
+#ifdef __AVX2__
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 16 <= count; i += 16) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i), _mm256_shuffle_epi8(v, mask));
+    }
+#endif
+    for (; i + 8 <= count; i += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i), SwapLanes16(v));
+    }
+#elif SWAP_NEON
+    for (; i + 8 <= count; i += 8) {
+        vst1q_u8(out + 2 * i, vrev16q_u8(vld1q_u8(in + 2 * i)));
+    }
+#endif
+    SwapTail<u16, &Swap16>(out, in, i, count);
+}
+
+void SwapBytes32(void* dst, const void* src, std::size_t count) noexcept {
+    auto* out = static_cast<u8*>(dst);
+    const auto* in = static_cast<const u8*>(src);
+    std::size_t i = 0;
+#if SWAP_SSE2
+#ifdef __AVX2__
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (; i + 8 <= count; i += 8) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 4 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 4 * i), _mm256_shuffle_epi8(v, mask));
+    }
+#endif
+    // Swap the 16-bit halves of each value, then the bytes of each half
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 4 * i));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)),
+                                _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * i), SwapLanes16(v));
+    }
+#elif SWAP_NEON
+    for (; i + 4 <= count; i += 4) {
+        vst1q_u8(out + 4 * i, vrev32q_u8(vld1q_u8(in + 4 * i)));
+    }
+#endif
+    SwapTail<u32, &Swap32>(out, in, i, count);
+}
+
+void SwapBytes64(void* dst, const void* src, std::size_t count) noexcept {
+    auto* out = static_cast<u8*>(dst);
+    const auto* in = static_cast<const u8*>(src);
+    std::size_t i = 0;
+#if SWAP_SSE2
+#ifdef __AVX2__
+    const __m256i mask = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    for (; i + 4 <= count; i += 4) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 8 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 8 * i), _mm256_shuffle_epi8(v, mask));
+    }
+#endif
+    // Reverse the 16-bit quarters of each value, then the bytes of each quarter
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8 * i));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3)),
+                                _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8 * i), SwapLanes16(v));
+    }
+#elif SWAP_NEON
+    for (; i + 2 <= count; i += 2) {
+        vst1q_u8(out + 8 * i, vrev64q_u8(vld1q_u8(in + 8 * i)));
+    }
+#endif
+    SwapTail<u64, &Swap64>(out, in, i, count);
+}
+
+} // namespace Common
@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <span>
 #include <type_traits>
 
 #if defined(_MSC_VER)
@@ -123,6 +124,13 @@ namespace Common {
     return f;
 }
 
+// Reverses the bytes of each of count 16, 32 or 64-bit values from src into dst, vectorized with
+// SSE2 (AVX2 if the build enables it) or NEON. Neither needs to be aligned. They may be the same,
+// but must not otherwise overlap.
+void SwapBytes16(void* dst, const void* src, std::size_t count) noexcept;
+void SwapBytes32(void* dst, const void* src, std::size_t count) noexcept;
+void SwapBytes64(void* dst, const void* src, std::size_t count) noexcept;
+
 } // Namespace Common
 
 template <typename T, typename F>
@@ -716,3 +724,58 @@ using enum_be = std::enable_if_t<std::is_enum_v<T>, typename AddEndian<T, BETag>
 
 using float_be = AddEndian<float, BETag>::type;
 using double_be = AddEndian<double, BETag>::type;
+
+namespace Common {
+
+namespace detail {
+
+template <typename Dst, typename Src>
+void CopyLE(std::span<Dst> dst, std::span<const Src> src) noexcept {
+    static_assert(sizeof(Dst) == sizeof(Src));
+    if (src.empty()) {
+        return;
+    }
+#if COMMON_LITTLE_ENDIAN
+    std::memcpy(dst.data(), src.data(), src.size_bytes());
+#else
+    if constexpr (sizeof(Src) == 2) {
+        SwapBytes16(dst.data(), src.data(), src.size());
+    } else if constexpr (sizeof(Src) == 4) {
+        SwapBytes32(dst.data(), src.data(), src.size());
+    } else {
+        SwapBytes64(dst.data(), src.data(), src.size());
+    }
+#endif
+}
+
+} // namespace detail
+
+// Bulk conversions of the first src.size() elements of dst between native and little endian
+// values, instead of one swap_struct_t at a time. Plain copies on little endian hosts.
+inline void CopyToLE(std::span<u16_le> dst, std::span<const u16> src) noexcept {
+    detail::CopyLE(dst, src);
+}
+inline void CopyToLE(std::span<u32_le> dst, std::span<const u32> src) noexcept {
+    detail::CopyLE(dst, src);
+}
+inline void CopyToLE(std::span<u64_le> dst, std::span<const u64> src) noexcept {
+    detail::CopyLE(dst, src);
+}
+inline void CopyToLE(std::span<float_le> dst, std::span<const float> src) noexcept {
+    detail::CopyLE(dst, src);
+}
+
+inline void CopyFromLE(std::span<u16> dst, std::span<const u16_le> src) noexcept {
+    detail::CopyLE(dst, src);
+}
+inline void CopyFromLE(std::span<u32> dst, std::span<const u32_le> src) noexcept {
+    detail::CopyLE(dst, src);
+}
+inline void CopyFromLE(std::span<u64> dst, std::span<const u64_le> src) noexcept {
+    detail::CopyLE(dst, src);
+}
+inline void CopyFromLE(std::span<float> dst, std::span<const float_le> src) noexcept {
+    detail::CopyLE(dst, src);
+}
+
+} // namespace Common
@@ -0,0 +1,249 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <spdlog/spdlog.h>
+#include "common/cpu_topology.h"
+#include "common/thread_pool.h"
+
+namespace Common {
+
+// Worker the current thread belongs to, if any
+static thread_local const ThreadPool* g_current_pool{};
+static thread_local std::size_t g_current_worker{};
+
+ThreadPool::ThreadPool(std::size_t num_threads) {
+    num_threads = std::max<std::size_t>(num_threads, 1);
+    for (std::size_t i = 0; i < num_threads; ++i) {
+        workers.emplace_back(std::make_unique<Worker>());
+    }
+
+    // Worker i takes the node of the CPU at i / num_threads of them all, in node order
+    const auto& topology = GetCpuTopology();
+    pinned = topology.nodes.size() > 1;
+    if (pinned) {
+        num_nodes = topology.nodes.size();
+        const std::size_t num_cpus = topology.GetNumCpus();
+        for (std::size_t i = 0; i < num_threads; ++i) {
+            std::size_t cpu = i * num_cpus / num_threads;
+            std::size_t node = 0;
+            while (cpu >= topology.nodes[node].cpus.size()) {
+                cpu -= topology.nodes[node].cpus.size();
+                ++node;
+            }
+            workers[i]->node = node;
+        }
+        SPDLOG_INFO("Spreading {} worker threads over {} NUMA nodes", num_threads, num_nodes);
+    }
+    for (std::size_t i = 0; i < num_threads; ++i) {
+        auto& steal_order = workers[i]->steal_order;
+        for (std::size_t j = 0; j < num_threads; ++j) {
+            steal_order.push_back((i + j) % num_threads);
+        }
+        std::ranges::stable_partition(steal_order, [this, i](std::size_t j) {
+            return workers[j]->node == workers[i]->node;
+        });
+    }
+    for (std::size_t i = 0; i < num_threads; ++i) {
+        workers[i]->thread = std::thread([this, i] { WorkerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::scoped_lock lock{wake_mutex};
+        stop_requested = true;
+    }
+    wake_cv.notify_all();
+    for (auto& worker : workers) {
+        worker->thread.join();
+    }
+}
+
+void ThreadPool::Push(Task task) {
+    // Tasks spawned by a worker stay local to it, others are distributed round robin
+    const std::size_t index = g_current_pool == this
+                                  ? g_current_worker
+                                  : next_worker.fetch_add(1, std::memory_order_relaxed) %
+                                        workers.size();
+    bool wake_poller{};
+    {
+        std::scoped_lock lock{wake_mutex};
+        num_pending.fetch_add(1, std::memory_order_relaxed);
+        // Unless no other worker is idle, the poller keeps polling
+        wake_poller = num_sleeping == 0 && has_poller;
+    }
+    {
+        std::scoped_lock lock{workers[index]->mutex};
+        workers[index]->tasks.emplace_back(std::move(task));
+    }
+    if (wake_poller) {
+        poll_cv.notify_one();
+    } else {
+        wake_cv.notify_one();
+    }
+}
+
+void ThreadPool::Defer(std::function<bool()> ready, Task task) {
+    // Counted first like pending tasks, so that sleeping workers do not miss it
+    {
+        std::scoped_lock lock{wake_mutex};
+        num_deferred.fetch_add(1, std::memory_order_relaxed);
+    }
+    {
+        std::scoped_lock lock{deferred_mutex};
+        deferred_tasks.push_back({.ready = std::move(ready), .task = std::move(task)});
+    }
+    // Wakes a worker to become the poller if there is none, and the poller otherwise
+    Notify();
+    wake_cv.notify_one();
+}
+
+void ThreadPool::Notify() {
+    {
+        std::scoped_lock lock{wake_mutex};
+        ++num_notifies;
+    }
+    poll_backoff.store(0, std::memory_order_relaxed);
+    poll_cv.notify_one();
+}
+
+bool ThreadPool::PollDeferred() {
+    if (num_deferred.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    std::vector<Task> ready_tasks;
+    {
+        std::unique_lock lock{deferred_mutex, std::try_to_lock};
+        if (!lock.owns_lock()) {
+            return false;
+        }
+        const auto [first, last] =
+            std::ranges::remove_if(deferred_tasks, [&ready_tasks](DeferredTask& deferred) {
+                if (!deferred.ready()) {
+                    return false;
+                }
+                ready_tasks.emplace_back(std::move(deferred.task));
+                return true;
+            });
+        deferred_tasks.erase(first, last);
+    }
+    if (ready_tasks.empty()) {
+        return false;
+    }
+    poll_backoff.store(0, std::memory_order_relaxed);
+    // Pushed before they stop counting as deferred, so that the pool is not destroyed meanwhile
+    for (auto& task : ready_tasks) {
+        Push(std::move(task));
+    }
+    if (num_deferred.fetch_sub(ready_tasks.size(), std::memory_order_relaxed) ==
+        ready_tasks.size()) {
+        // Workers of a stopping pool wait for the last one, see WorkerLoop
+        std::scoped_lock lock{wake_mutex};
+        wake_cv.notify_all();
+    }
+    return true;
+}
+
+bool ThreadPool::PopTask(Task& out) {
+    const std::size_t self = g_current_pool == this ? g_current_worker : 0;
+
+    // Own deque first (newest task), then steal from the others (oldest task), those of the
+    // same node first
+    const auto& steal_order = workers[self]->steal_order;
+    for (std::size_t i = 0; i < steal_order.size(); ++i) {
+        auto& worker = *workers[steal_order[i]];
+        std::scoped_lock lock{worker.mutex};
+        if (worker.tasks.empty()) {
+            continue;
+        }
+        if (i == 0 && g_current_pool == this) {
+            out = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+        } else {
+            out = std::move(worker.tasks.front());
+            worker.tasks.pop_front();
+        }
+        num_pending.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+bool ThreadPool::RunPendingTask() {
+    Task task;
+    if (!PopTask(task) && !(PollDeferred() && PopTask(task))) {
+        return false;
+    }
+    task();
+    // Deferred tasks may wait on it, see SubmitAfter
+    if (num_deferred.load(std::memory_order_relaxed) > 0) {
+        Notify();
+    }
+    return true;
+}
+
+void ThreadPool::PollLoop(std::unique_lock<std::mutex>& lock) {
+    has_poller = true;
+    while (num_pending.load(std::memory_order_relaxed) == 0 &&
+           num_deferred.load(std::memory_order_relaxed) > 0) {
+        // Their conditions do not notify, so they are polled less often the longer none is ready
+        const u64 notifies = num_notifies;
+        const u32 backoff = poll_backoff.load(std::memory_order_relaxed);
+        poll_cv.wait_for(lock, MinPollInterval * (1u << backoff), [this, notifies] {
+            return num_pending.load(std::memory_order_relaxed) > 0 || num_notifies != notifies;
+        });
+        if (num_pending.load(std::memory_order_relaxed) > 0) {
+            break;
+        }
+        lock.unlock();
+        const bool any_ready = PollDeferred();
+        lock.lock();
+        if (!any_ready && num_notifies == notifies) {
+            poll_backoff.store(std::min(backoff + 1, MaxPollBackoff), std::memory_order_relaxed);
+        }
+    }
+    has_poller = false;
+    // Another idle worker takes over while this one runs the tasks
+    if (num_deferred.load(std::memory_order_relaxed) > 0) {
+        wake_cv.notify_one();
+    }
+}
+
+void ThreadPool::WorkerLoop(std::size_t index) {
+    g_current_pool = this;
+    g_current_worker = index;
+    PROFILE_THREAD_NAME("Thread pool worker");
+    if (pinned && !PinCurrentThread(GetCpuTopology().nodes[workers[index]->node])) {
+        SPDLOG_WARN("Could not pin worker thread {} to its NUMA node", index);
+    }
+
+    while (true) {
+        if (RunPendingTask()) {
+            continue;
+        }
+
+        std::unique_lock lock{wake_mutex};
+        // One worker polls the deferred tasks, the others sleep until there are tasks to run
+        if (num_deferred.load(std::memory_order_relaxed) > 0 && !has_poller) {
+            PollLoop(lock);
+            continue;
+        }
+        ++num_sleeping;
+        wake_cv.wait(lock, [this] {
+            if (num_pending.load(std::memory_order_relaxed) > 0) {
+                return true;
+            }
+            // Stopping waits for the deferred tasks
+            return num_deferred.load(std::memory_order_relaxed) > 0 ? !has_poller
+                                                                     : stop_requested;
+        });
+        --num_sleeping;
+        if (stop_requested && num_pending.load(std::memory_order_relaxed) == 0 &&
+            num_deferred.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+    }
+}
+
+} // namespace Common
@@ -0,0 +1,194 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "common/common_types.h"
+#include "common/profiling.h"
+
+namespace Common {
+
+/**
+ * Work stealing thread pool. Each worker owns a deque: tasks submitted from a worker go to its
+ * own deque and are popped LIFO, while idle workers steal FIFO from the others.
+ * Tasks may wait on other tasks with Wait(), which keeps running pending work meanwhile, or be
+ * deferred until other tasks or external work (e.g. a Vulkan fence or timeline semaphore, or I/O
+ * completions) are done with SubmitWhen and SubmitAfter, so that no thread blocks on them.
+ *
+ * On machines of several NUMA nodes (see GetCpuTopology), the workers are spread over the nodes
+ * in proportion to their CPUs and pinned to them, so that the memory each allocates and touches
+ * first, e.g. its scratch buffers, is local to it. Idle workers steal from those of their own
+ * node before the others, so that tasks spawned by a task and the data they share tend to stay on
+ * one node.
+ */
+class ThreadPool : NonCopyable {
+public:
+    explicit ThreadPool(std::size_t num_threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    template <typename F>
+    auto Submit(F&& func) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+        using Result = std::invoke_result_t<std::decay_t<F>>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(func));
+        auto future = task->get_future();
+        Push([task = std::move(task)] { (*task)(); });
+        return future;
+    }
+
+    // Runs the function like Submit once ready() returns true. The condition is polled by one
+    // idle worker at a time (and by threads in Wait), from any of them, so it must be cheap and
+    // thread safe, e.g. a fence status or a timeline semaphore value. It is polled again whenever
+    // a task of the pool completes or Notify is called, and otherwise at intervals that grow
+    // while no deferred task is ready. The pool is not destroyed until the deferred tasks are
+    // run.
+    template <typename F>
+    auto SubmitWhen(std::function<bool()> ready, F&& func)
+        -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+        using Result = std::invoke_result_t<std::decay_t<F>>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(func));
+        auto future = task->get_future();
+        Defer(std::move(ready), [task = std::move(task)] { (*task)(); });
+        return future;
+    }
+
+    // Runs the function like Submit once the futures are ready, the continuation of the tasks
+    // they are of. It is run even if they threw, which it can rethrow by getting them.
+    template <typename T, typename F>
+    auto SubmitAfter(std::vector<std::shared_future<T>> dependencies, F&& func)
+        -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+        return SubmitWhen(
+            [dependencies = std::move(dependencies)] {
+                return std::ranges::all_of(dependencies, [](const std::shared_future<T>& future) {
+                    return future.wait_for(std::chrono::seconds{0}) == std::future_status::ready;
+                });
+            },
+            std::forward<F>(func));
+    }
+
+    // Has the deferred tasks polled now, e.g. once external work that some of them wait on has
+    // been submitted or completed, rather than at the next polling interval.
+    void Notify();
+
+    // Blocks until the future is ready, running other tasks in the meantime.
+    template <typename T>
+    void Wait(const std::future<T>& future) {
+        while (future.wait_for(std::chrono::seconds{0}) != std::future_status::ready) {
+            if (!RunPendingTask()) {
+                future.wait_for(std::chrono::microseconds{100});
+            }
+        }
+    }
+
+    // Waits for all futures and rethrows the first exception, if any.
+    template <typename T>
+    void WaitAll(std::vector<std::future<T>>& futures) {
+        for (auto& future : futures) {
+            Wait(future);
+        }
+        for (auto& future : futures) {
+            future.get();
+        }
+        futures.clear();
+    }
+
+    // Calls func(i) for i in [begin, end), split into chunks across the workers.
+    template <typename F>
+    void ParallelFor(std::size_t begin, std::size_t end, F&& func) {
+        if (begin >= end) {
+            return;
+        }
+        const std::size_t num_chunks = std::min(end - begin, workers.size() * 4);
+        const std::size_t chunk_size = (end - begin + num_chunks - 1) / num_chunks;
+
+        std::vector<std::future<void>> futures;
+        for (std::size_t start = begin; start < end; start += chunk_size) {
+            futures.emplace_back(Submit([&func, start, stop = std::min(start + chunk_size, end)] {
+                for (std::size_t i = start; i < stop; ++i) {
+                    func(i);
+                }
+            }));
+        }
+        WaitAll(futures);
+    }
+
+    std::size_t GetNumThreads() const noexcept {
+        return workers.size();
+    }
+    // That the workers are spread over, 1 unless they are pinned
+    std::size_t GetNumNodes() const noexcept {
+        return num_nodes;
+    }
+
+private:
+    using Task = std::function<void()>;
+
+    // The deques are locked rather than lock-free (e.g. Chase-Lev). Besides its owner, a worker's
+    // lock is only taken by threads outside the pool submitting to it and by thieves, which steal
+    // when they run out of tasks, and the tasks are coarse (asset loads, mipmaps, encodes,
+    // ParallelFor chunks). Submitting a task heap-allocates it and takes wake_mutex for the sleep
+    // protocol regardless, which a lock-free deque would not remove. See the thread pool
+    // benchmarks before changing this.
+    struct Worker {
+        PROFILE_MUTEX(std::mutex, mutex);
+        std::deque<Task> tasks;
+        std::thread thread;
+        std::size_t node{}; // Index into the nodes of the topology, if pinned
+        // Workers to pop from, itself first, then those of its node
+        std::vector<std::size_t> steal_order;
+    };
+
+    struct DeferredTask {
+        std::function<bool()> ready;
+        Task task;
+    };
+
+    void Push(Task task);
+    void Defer(std::function<bool()> ready, Task task);
+    // Pushes the deferred tasks that are ready, unless another thread is polling them. Returns
+    // whether any was.
+    bool PollDeferred();
+    bool PopTask(Task& out);
+    bool RunPendingTask();
+    // Polls the deferred tasks as the poller, until there are tasks to run or none is deferred.
+    // Called and returns with the wake mutex locked.
+    void PollLoop(std::unique_lock<std::mutex>& lock);
+    void WorkerLoop(std::size_t index);
+
+    // Of the poller, doubling from the first while no deferred task gets ready
+    static constexpr std::chrono::microseconds MinPollInterval{50};
+    static constexpr u32 MaxPollBackoff = 7; // MinPollInterval << 7, 6.4 ms
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::size_t num_nodes = 1;
+    bool pinned = false;
+    std::atomic<std::size_t> next_worker{0};
+    std::atomic<std::size_t> num_pending{0};
+
+    std::mutex deferred_mutex;
+    std::vector<DeferredTask> deferred_tasks;
+    std::atomic<std::size_t> num_deferred{0};
+    std::atomic<u32> poll_backoff{0}; // Of the poll interval, reset when a deferred task is ready
+
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv; // Of the sleeping workers
+    std::condition_variable poll_cv; // Of the poller
+    std::size_t num_sleeping = 0;
+    bool has_poller = false; // Whether an idle worker is polling the deferred tasks
+    u64 num_notifies = 0;
+    bool stop_requested = false;
+};
+
+} // namespace Common
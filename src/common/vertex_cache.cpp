@@ -0,0 +1,284 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include "common/assert.h"
+#include "common/vertex_cache.h"
+
+namespace Common {
+
+std::vector<u32> OptimizeVertexCache(std::span<const u32> indices, std::size_t num_vertices,
+                                     std::vector<std::size_t>* clusters) {
+    const std::size_t num_triangles = indices.size() / 3;
+    if (clusters) {
+        clusters->clear();
+    }
+
+    // Triangles of each vertex
+    std::vector<u32> live(num_vertices);
+    for (std::size_t i = 0; i < num_triangles * 3; ++i) {
+        ASSERT_MSG(indices[i] < num_vertices, "Index out of range");
+        live[indices[i]]++;
+    }
+    std::vector<std::size_t> offsets(num_vertices + 1);
+    std::inclusive_scan(live.begin(), live.end(), offsets.begin() + 1, std::plus<>{},
+                        std::size_t{0});
+    std::vector<u32> adjacency(offsets.back());
+    {
+        std::vector<std::size_t> cursors(offsets.begin(), offsets.end() - 1);
+        for (std::size_t i = 0; i < num_triangles * 3; ++i) {
+            adjacency[cursors[indices[i]]++] = static_cast<u32>(i / 3);
+        }
+    }
+
+    std::vector<u32> out;
+    out.reserve(num_triangles * 3);
+    std::vector<bool> emitted(num_triangles);
+    // Time each vertex last entered the cache, which it has left once the time is over
+    // VertexCacheSize behind
+    std::vector<std::size_t> cache_time(num_vertices);
+    std::size_t time = VertexCacheSize + 1;
+    std::vector<u32> dead_ends;
+    std::vector<u32> candidates;
+    std::size_t next_vertex = 0; // For when the dead end stack has nothing live either
+
+    const auto SkipDeadEnd = [&]() -> std::size_t {
+        while (!dead_ends.empty()) {
+            const auto vertex = dead_ends.back();
+            dead_ends.pop_back();
+            if (live[vertex] > 0) {
+                return vertex;
+            }
+        }
+        for (; next_vertex < num_vertices; ++next_vertex) {
+            if (live[next_vertex] > 0) {
+                return next_vertex;
+            }
+        }
+        return num_vertices;
+    };
+
+    std::size_t fanning = num_triangles == 0 ? num_vertices : indices[0];
+    bool dead_end = true;
+    while (fanning < num_vertices) {
+        if (dead_end && clusters) {
+            clusters->emplace_back(out.size());
+        }
+
+        candidates.clear();
+        for (std::size_t i = offsets[fanning]; i < offsets[fanning + 1]; ++i) {
+            const auto triangle = adjacency[i];
+            if (emitted[triangle]) {
+                continue;
+            }
+            emitted[triangle] = true;
+            for (std::size_t j = 0; j < 3; ++j) {
+                const auto vertex = indices[triangle * 3 + j];
+                out.emplace_back(vertex);
+                dead_ends.emplace_back(vertex);
+                candidates.emplace_back(vertex);
+                live[vertex]--;
+                if (time - cache_time[vertex] > VertexCacheSize) {
+                    cache_time[vertex] = time++;
+                }
+            }
+        }
+
+        // The candidate that stays in the cache the longest while its triangles are emitted
+        // (each may bring in two new vertices), or the oldest one that will not
+        std::size_t best = num_vertices;
+        std::size_t best_priority = 0;
+        for (const auto vertex : candidates) {
+            if (live[vertex] == 0) {
+                continue;
+            }
+            std::size_t priority = 0;
+            if (time - cache_time[vertex] + 2 * live[vertex] <= VertexCacheSize) {
+                priority = time - cache_time[vertex];
+            }
+            if (best == num_vertices || priority > best_priority) {
+                best = vertex;
+                best_priority = priority;
+            }
+        }
+        dead_end = best == num_vertices;
+        fanning = dead_end ? SkipDeadEnd() : best;
+    }
+    return out;
+}
+
+void OptimizeOverdraw(std::span<u32> indices, std::span<const float> positions,
+                      std::span<const std::size_t> clusters) {
+    if (clusters.size() < 2) {
+        return;
+    }
+
+    using Vec3 = std::array<double, 3>;
+    const auto Load = [positions](u32 vertex) {
+        return Vec3{positions[vertex * 3], positions[vertex * 3 + 1], positions[vertex * 3 + 2]};
+    };
+
+    struct Cluster {
+        std::size_t begin{};
+        std::size_t end{};
+        Vec3 centroid{};
+        Vec3 normal{}; // Area weighted
+    };
+    std::vector<Cluster> sorted(clusters.size());
+    Vec3 mesh_centroid{};
+    double mesh_area = 0;
+    for (std::size_t i = 0; i < clusters.size(); ++i) {
+        auto& cluster = sorted[i];
+        cluster.begin = clusters[i];
+        cluster.end = i + 1 < clusters.size() ? clusters[i + 1] : indices.size() / 3 * 3;
+
+        double area = 0;
+        for (std::size_t j = cluster.begin; j < cluster.end; j += 3) {
+            const auto a = Load(indices[j]);
+            const auto b = Load(indices[j + 1]);
+            const auto c = Load(indices[j + 2]);
+            const Vec3 ab{b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+            const Vec3 ac{c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+            const Vec3 normal{ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2],
+                              ab[0] * ac[1] - ab[1] * ac[0]};
+            const double triangle_area = std::hypot(normal[0], normal[1], normal[2]);
+            for (std::size_t k = 0; k < 3; ++k) {
+                cluster.centroid[k] += (a[k] + b[k] + c[k]) / 3 * triangle_area;
+                cluster.normal[k] += normal[k];
+            }
+            area += triangle_area;
+        }
+        for (std::size_t k = 0; k < 3; ++k) {
+            mesh_centroid[k] += cluster.centroid[k];
+            cluster.centroid[k] = area > 0 ? cluster.centroid[k] / area : 0;
+        }
+        mesh_area += area;
+    }
+    if (mesh_area <= 0) {
+        return;
+    }
+    for (auto& component : mesh_centroid) {
+        component /= mesh_area;
+    }
+
+    const auto Facing = [&mesh_centroid](const Cluster& cluster) {
+        double facing = 0;
+        for (std::size_t k = 0; k < 3; ++k) {
+            facing += (cluster.centroid[k] - mesh_centroid[k]) * cluster.normal[k];
+        }
+        return facing;
+    };
+    std::ranges::stable_sort(sorted, std::greater<>{}, Facing);
+
+    std::vector<u32> out;
+    out.reserve(indices.size());
+    for (const auto& cluster : sorted) {
+        out.insert(out.end(), indices.begin() + cluster.begin, indices.begin() + cluster.end);
+    }
+    std::ranges::copy(out, indices.begin());
+}
+
+// Spreads the low 10 bits of the value to every third bit
+static u32 SpreadBits(u32 value) {
+    value = (value | (value << 16)) & 0x030000FF;
+    value = (value | (value << 8)) & 0x0300F00F;
+    value = (value | (value << 4)) & 0x030C30C3;
+    value = (value | (value << 2)) & 0x09249249;
+    return value;
+}
+
+u32 GetMortonCode(float x, float y, float z) noexcept {
+    const auto Quantize = [](float value) {
+        // NaNs go to 0 as well
+        return value > 0 ? static_cast<u32>(std::min(value, 1.0f) * 1023.0f) : 0u;
+    };
+    return (SpreadBits(Quantize(x)) << 2) | (SpreadBits(Quantize(y)) << 1) |
+           SpreadBits(Quantize(z));
+}
+
+void SortClustersSpatially(std::span<u32> indices, std::span<const float> positions,
+                           std::span<const std::size_t> clusters) {
+    const std::size_t end = indices.size() / 3 * 3;
+    const std::size_t num_clusters = clusters.empty() ? end / 3 : clusters.size();
+    if (num_clusters < 2) {
+        return;
+    }
+
+    struct Cluster {
+        std::size_t begin{};
+        std::size_t end{};
+        std::array<float, 3> centroid{};
+        u32 code{};
+    };
+    std::vector<Cluster> sorted(num_clusters);
+    std::array<float, 3> min_point;
+    std::array<float, 3> max_point;
+    min_point.fill(std::numeric_limits<float>::infinity());
+    max_point.fill(-std::numeric_limits<float>::infinity());
+    for (std::size_t i = 0; i < num_clusters; ++i) {
+        auto& cluster = sorted[i];
+        if (clusters.empty()) {
+            cluster.begin = i * 3;
+            cluster.end = cluster.begin + 3;
+        } else {
+            cluster.begin = clusters[i];
+            cluster.end = i + 1 < clusters.size() ? clusters[i + 1] : end;
+        }
+        // Of the corners, which is close enough to that of the triangles for ordering
+        for (std::size_t j = cluster.begin; j < cluster.end; ++j) {
+            for (std::size_t k = 0; k < 3; ++k) {
+                cluster.centroid[k] += positions[indices[j] * 3 + k];
+            }
+        }
+        const auto num_corners =
+            static_cast<float>(std::max<std::size_t>(cluster.end - cluster.begin, 1));
+        for (std::size_t k = 0; k < 3; ++k) {
+            cluster.centroid[k] /= num_corners;
+            min_point[k] = std::min(min_point[k], cluster.centroid[k]);
+            max_point[k] = std::max(max_point[k], cluster.centroid[k]);
+        }
+    }
+
+    // Scaled uniformly, so that the cells of the curve stay cubes in long or flat meshes
+    float extent = 0;
+    for (std::size_t k = 0; k < 3; ++k) {
+        extent = std::max(extent, max_point[k] - min_point[k]);
+    }
+    if (!(extent > 0) || !std::isfinite(extent)) {
+        return;
+    }
+    for (auto& cluster : sorted) {
+        cluster.code = GetMortonCode((cluster.centroid[0] - min_point[0]) / extent,
+                                     (cluster.centroid[1] - min_point[1]) / extent,
+                                     (cluster.centroid[2] - min_point[2]) / extent);
+    }
+    std::ranges::stable_sort(sorted, {}, &Cluster::code);
+
+    std::vector<u32> out;
+    out.reserve(end);
+    for (const auto& cluster : sorted) {
+        out.insert(out.end(), indices.begin() + cluster.begin, indices.begin() + cluster.end);
+    }
+    std::ranges::copy(out, indices.begin());
+}
+
+std::vector<u32> OptimizeVertexFetch(std::span<u32> indices, std::size_t num_vertices) {
+    std::vector<u32> remap(num_vertices, std::numeric_limits<u32>::max());
+    std::vector<u32> old_vertices;
+    for (auto& index : indices) {
+        ASSERT_MSG(index < num_vertices, "Index out of range");
+        if (remap[index] == std::numeric_limits<u32>::max()) {
+            remap[index] = static_cast<u32>(old_vertices.size());
+            old_vertices.emplace_back(index);
+        }
+        index = remap[index];
+    }
+    return old_vertices;
+}
+
+} // namespace Common
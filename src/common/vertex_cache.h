@@ -0,0 +1,51 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include <vector>
+#include "common/common_types.h"
+
+/**
+ * Reordering of triangle lists for the GPU: Tipsify (Sander, Nehab and Barczak) for the
+ * post-transform vertex cache, followed by sorting its clusters so that those facing outwards
+ * are drawn first to reduce overdraw, and renumbering the vertices in the order they are first
+ * used to improve vertex fetch. The clusters can also be sorted along a space filling curve
+ * instead, for the coherence of ray tracing. Triangles keep their winding, and the same input
+ * always gives the same output.
+ */
+namespace Common {
+
+// Of the post-transform vertex cache that Tipsify models, in vertices
+constexpr u32 VertexCacheSize = 16;
+
+// Reorders the triangles of the list for the vertex cache. Indices must be less than
+// num_vertices. If clusters is not null, it receives the first index of each run of triangles
+// that Tipsify emitted without a dead end, which may be reordered freely (see OptimizeOverdraw).
+std::vector<u32> OptimizeVertexCache(std::span<const u32> indices, std::size_t num_vertices,
+                                     std::vector<std::size_t>* clusters = nullptr);
+
+// Sorts the clusters of the triangle list (see OptimizeVertexCache) so that the clusters
+// facing away from the center of the mesh come first, as they tend to occlude the others.
+// positions are XYZ triples.
+void OptimizeOverdraw(std::span<u32> indices, std::span<const float> positions,
+                      std::span<const std::size_t> clusters);
+
+// Interleaves the bits of the coordinates, each in [0, 1] and quantized to 10 bits, so that
+// sorting by the codes orders the points along a Morton (Z-order) curve.
+u32 GetMortonCode(float x, float y, float z) noexcept;
+
+// Sorts the clusters of the triangle list (see OptimizeVertexCache), or each of its triangles
+// if there are none, along a Morton curve through their centroids, so that triangles close in
+// space are close in the list too. Acceleration structures build better over such lists, and
+// their traversal fetches the triangles more coherently. positions are XYZ triples.
+void SortClustersSpatially(std::span<u32> indices, std::span<const float> positions,
+                           std::span<const std::size_t> clusters);
+
+// Renumbers the vertices in the order the triangle list first uses them. Returns the old
+// index of each new vertex, which leaves out those that are not used.
+std::vector<u32> OptimizeVertexFetch(std::span<u32> indices, std::size_t num_vertices);
+
+} // namespace Common
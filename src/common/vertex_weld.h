@@ -0,0 +1,238 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#include "common/assert.h"
+#include "common/common_types.h"
+#include "common/thread_pool.h"
+
+/**
+ * Vertex welding: merges identical vertices of an unindexed vertex stream and produces an
+ * index buffer referencing the unique ones. Vertices are compared and hashed as raw bytes, so
+ * their type must be trivially copyable and free of padding.
+ *
+ * get_vertex(i) returns the i-th vertex of the stream. It may be called several times for the
+ * same i, and concurrently when a thread pool is used.
+ * Unique vertices are output in the order of their first occurrence, so both variants give the
+ * same result.
+ */
+namespace Common {
+
+namespace Weld {
+
+constexpr u64 Mix(u64 x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+template <typename T>
+u64 Hash(const T& vertex) {
+    std::array<u8, sizeof(T)> bytes;
+    std::memcpy(bytes.data(), &vertex, sizeof(T));
+
+    u64 hash = 0x9e3779b97f4a7c15ULL ^ sizeof(T);
+    std::size_t i = 0;
+    for (; i + sizeof(u64) <= sizeof(T); i += sizeof(u64)) {
+        u64 word;
+        std::memcpy(&word, bytes.data() + i, sizeof(u64));
+        hash = (hash ^ Mix(word)) * 0x9e3779b97f4a7c15ULL;
+    }
+    if (i < sizeof(T)) {
+        u64 word{};
+        std::memcpy(&word, bytes.data() + i, sizeof(T) - i);
+        hash = (hash ^ Mix(word)) * 0x9e3779b97f4a7c15ULL;
+    }
+    return Mix(hash);
+}
+
+template <typename T>
+bool Equal(const T& a, const T& b) {
+    return std::memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+} // namespace Weld
+
+// Single threaded, with an open addressing hash table sized up front.
+template <typename T, typename Index, typename F>
+void WeldVerticesHashed(std::size_t count, const F& get_vertex, std::vector<T>& out_vertices,
+                        std::vector<Index>& out_indices) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    ASSERT_MSG(count <= std::numeric_limits<u32>::max(), "Too many vertices to weld");
+
+    struct Slot {
+        u32 tag; // Upper bits of the hash, to skip most byte comparisons
+        u32 index = std::numeric_limits<u32>::max();
+    };
+    // At most half full
+    const std::size_t capacity = std::bit_ceil(std::max<std::size_t>(count * 2, 16));
+    const std::size_t mask = capacity - 1;
+    std::vector<Slot> table(capacity);
+
+    out_vertices.clear();
+    out_indices.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const T vertex = get_vertex(i);
+        const u64 hash = Weld::Hash(vertex);
+        const auto tag = static_cast<u32>(hash >> 32);
+
+        std::size_t pos = static_cast<std::size_t>(hash) & mask;
+        while (true) {
+            auto& slot = table[pos];
+            if (slot.index == std::numeric_limits<u32>::max()) {
+                slot = {.tag = tag, .index = static_cast<u32>(out_vertices.size())};
+                out_vertices.emplace_back(vertex);
+                break;
+            }
+            if (slot.tag == tag && Weld::Equal(out_vertices[slot.index], vertex)) {
+                break;
+            }
+            pos = (pos + 1) & mask;
+        }
+        out_indices[i] = static_cast<Index>(table[pos].index);
+    }
+}
+
+// Multi threaded: sorts the vertices by hash with a parallel radix sort, then merges runs of
+// equal vertices. Faster than the hash table for very large streams.
+template <typename T, typename Index, typename F>
+void WeldVerticesSorted(std::size_t count, const F& get_vertex, std::vector<T>& out_vertices,
+                        std::vector<Index>& out_indices, ThreadPool& thread_pool) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    ASSERT_MSG(count <= std::numeric_limits<u32>::max(), "Too many vertices to weld");
+
+    static constexpr std::size_t RadixBits = 8;
+    static constexpr std::size_t RadixSize = std::size_t{1} << RadixBits;
+
+    const std::size_t num_chunks = std::max<std::size_t>(thread_pool.GetNumThreads() * 4, 1);
+    const std::size_t chunk_size = (count + num_chunks - 1) / num_chunks;
+    const auto for_each_chunk = [&](const auto& func) {
+        thread_pool.ParallelFor(0, num_chunks, [&](std::size_t chunk) {
+            const std::size_t begin = std::min(chunk * chunk_size, count);
+            func(chunk, begin, std::min(begin + chunk_size, count));
+        });
+    };
+
+    std::vector<u32> keys(count), indices(count);
+    for_each_chunk([&](std::size_t, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            keys[i] = static_cast<u32>(Weld::Hash(get_vertex(i)));
+            indices[i] = static_cast<u32>(i);
+        }
+    });
+
+    // LSD radix sort. Each pass is stable, so equal keys stay ordered by vertex index.
+    std::vector<u32> keys_temp(count), indices_temp(count);
+    std::vector<std::array<std::size_t, RadixSize>> offsets(num_chunks);
+    for (std::size_t shift = 0; shift < 32; shift += RadixBits) {
+        for_each_chunk([&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            auto& histogram = offsets[chunk];
+            histogram.fill(0);
+            for (std::size_t i = begin; i < end; ++i) {
+                ++histogram[(keys[i] >> shift) & (RadixSize - 1)];
+            }
+        });
+        std::size_t total = 0;
+        for (std::size_t digit = 0; digit < RadixSize; ++digit) {
+            for (auto& histogram : offsets) {
+                const std::size_t digit_count = histogram[digit];
+                histogram[digit] = total;
+                total += digit_count;
+            }
+        }
+        for_each_chunk([&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            auto& offset = offsets[chunk];
+            for (std::size_t i = begin; i < end; ++i) {
+                const std::size_t pos = offset[(keys[i] >> shift) & (RadixSize - 1)]++;
+                keys_temp[pos] = keys[i];
+                indices_temp[pos] = indices[i];
+            }
+        });
+        keys.swap(keys_temp);
+        indices.swap(indices_temp);
+    }
+    keys_temp = {};
+    indices_temp = {};
+
+    // Map each vertex to the first identical one. Chunks are moved to start on a run boundary.
+    std::vector<u32> representatives(count);
+    for_each_chunk([&](std::size_t, std::size_t begin, std::size_t end) {
+        const auto align = [&](std::size_t pos) {
+            while (pos > 0 && pos < count && keys[pos] == keys[pos - 1]) {
+                ++pos;
+            }
+            return pos;
+        };
+        std::vector<T> unique;
+        std::vector<u32> unique_indices;
+        for (std::size_t run_begin = align(begin); run_begin < align(end);) {
+            std::size_t run_end = run_begin + 1;
+            while (run_end < count && keys[run_end] == keys[run_begin]) {
+                ++run_end;
+            }
+
+            // Runs are normally a single vertex, or a few copies of it
+            unique.clear();
+            unique_indices.clear();
+            for (std::size_t pos = run_begin; pos < run_end; ++pos) {
+                const T vertex = get_vertex(indices[pos]);
+                const auto it = std::find_if(unique.begin(), unique.end(), [&](const T& other) {
+                    return Weld::Equal(vertex, other);
+                });
+                if (it == unique.end()) {
+                    unique.emplace_back(vertex);
+                    unique_indices.emplace_back(indices[pos]);
+                    representatives[indices[pos]] = indices[pos];
+                } else {
+                    representatives[indices[pos]] = unique_indices[it - unique.begin()];
+                }
+            }
+            run_begin = run_end;
+        }
+    });
+    keys = {};
+
+    // Number the unique vertices in order of first occurrence
+    std::vector<u32>& new_indices = indices;
+    out_vertices.clear();
+    for (std::size_t i = 0; i < count; ++i) {
+        if (representatives[i] == i) {
+            new_indices[i] = static_cast<u32>(out_vertices.size());
+            out_vertices.emplace_back(get_vertex(i));
+        }
+    }
+
+    out_indices.resize(count);
+    for_each_chunk([&](std::size_t, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            out_indices[i] = static_cast<Index>(new_indices[representatives[i]]);
+        }
+    });
+}
+
+// Streams at least this long use the sorted variant when a thread pool is available.
+constexpr std::size_t SortedWeldThreshold = 1 << 20;
+
+template <typename T, typename Index, typename F>
+void WeldVertices(std::size_t count, const F& get_vertex, std::vector<T>& out_vertices,
+                  std::vector<Index>& out_indices, ThreadPool* thread_pool = nullptr) {
+    if (thread_pool && thread_pool->GetNumThreads() > 1 && count >= SortedWeldThreshold) {
+        WeldVerticesSorted(count, get_vertex, out_vertices, out_indices, *thread_pool);
+    } else {
+        WeldVerticesHashed(count, get_vertex, out_vertices, out_indices);
+    }
+}
+
+} // namespace Common
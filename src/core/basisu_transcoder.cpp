@@ -0,0 +1,91 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <spdlog/spdlog.h>
+#include "core/basisu_transcoder.h"
+
+#ifdef ENABLE_BASISU
+#include <basisu_transcoder.h>
+#endif
+
+namespace Renderer::BasisU {
+
+#ifdef ENABLE_BASISU
+
+static basist::transcoder_texture_format GetTranscoderFormat(TargetFormat format) {
+    switch (format) {
+    case TargetFormat::BC7:
+        return basist::transcoder_texture_format::cTFBC7_RGBA;
+    case TargetFormat::ASTC4x4:
+        return basist::transcoder_texture_format::cTFASTC_4x4_RGBA;
+    case TargetFormat::ETC2:
+        return basist::transcoder_texture_format::cTFETC2_RGBA;
+    case TargetFormat::RGBA8:
+        return basist::transcoder_texture_format::cTFRGBA32;
+    }
+    throw std::runtime_error("Invalid target format");
+}
+
+// Initializes the tables of the transcoder once, which may be on any thread
+static void InitTranscoder() {
+    static std::once_flag init_flag;
+    std::call_once(init_flag, [] { basist::basisu_transcoder_init(); });
+}
+
+bool CanTranscode(std::span<const u8> file_data) {
+    InitTranscoder();
+    // Fails for the supercompression schemes the transcoder was built without
+    basist::ktx2_transcoder transcoder;
+    return transcoder.init(file_data.data(), static_cast<u32>(file_data.size()));
+}
+
+std::vector<std::vector<u8>> Transcode(std::span<const u8> file_data, TargetFormat format) {
+    InitTranscoder();
+    basist::ktx2_transcoder transcoder;
+    if (!transcoder.init(file_data.data(), static_cast<u32>(file_data.size())) ||
+        !transcoder.start_transcoding()) {
+        SPDLOG_ERROR("Failed to read Basis Universal KTX2 file");
+        throw std::runtime_error("Failed to read Basis Universal KTX2 file");
+    }
+
+    const auto transcoder_format = GetTranscoderFormat(format);
+    const u32 unit_size = basist::basis_get_bytes_per_block_or_pixel(transcoder_format);
+    std::vector<std::vector<u8>> levels;
+    for (u32 level = 0; level < std::max(transcoder.get_levels(), 1u); ++level) {
+        basist::ktx2_image_level_info info;
+        if (!transcoder.get_image_level_info(info, level, 0, 0)) {
+            SPDLOG_ERROR("Basis Universal KTX2 file has no level {}", level);
+            throw std::runtime_error("Basis Universal KTX2 file is truncated");
+        }
+        // Blocks, or texels of RGBA8
+        const u32 num_units = format == TargetFormat::RGBA8
+                                  ? info.m_orig_width * info.m_orig_height
+                                  : info.m_total_blocks;
+        std::vector<u8> data(std::size_t{num_units} * unit_size);
+        if (!transcoder.transcode_image_level(level, 0, 0, data.data(), num_units,
+                                              transcoder_format)) {
+            SPDLOG_ERROR("Failed to transcode level {} of Basis Universal KTX2 file", level);
+            throw std::runtime_error("Failed to transcode Basis Universal KTX2 file");
+        }
+        levels.emplace_back(std::move(data));
+    }
+    return levels;
+}
+
+#else
+
+bool CanTranscode(std::span<const u8>) {
+    return false;
+}
+
+std::vector<std::vector<u8>> Transcode(std::span<const u8>, TargetFormat) {
+    throw std::runtime_error("Built without ENABLE_BASISU");
+}
+
+#endif
+
+} // namespace Renderer::BasisU
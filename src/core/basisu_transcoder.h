@@ -0,0 +1,34 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include <vector>
+#include "common/common_types.h"
+
+/**
+ * Transcoder of the Basis Universal payloads of KTX2 files (ETC1S with BasisLZ, or UASTC), as
+ * KHR_texture_basisu has them, with the transcoder of Basis Universal (ENABLE_BASISU). UASTC
+ * supercompressed with zstd also needs ENABLE_ZSTD. Without it, CanTranscode is false and
+ * Transcode throws.
+ */
+namespace Renderer::BasisU {
+
+// All of 16 byte blocks of 4x4 texels, but the uncompressed RGBA8
+enum class TargetFormat {
+    BC7,
+    ASTC4x4,
+    ETC2, // RGBA8, with EAC alpha
+    RGBA8,
+};
+
+// Whether the KTX2 file is a Basis Universal payload this build can transcode, by its header
+bool CanTranscode(std::span<const u8> file_data);
+
+// Every level of the first layer and face, largest first, as tightly packed blocks (or texels)
+// of the format. Throws std::runtime_error if the file cannot be transcoded.
+std::vector<std::vector<u8>> Transcode(std::span<const u8> file_data, TargetFormat format);
+
+} // namespace Renderer::BasisU
@@ -0,0 +1,159 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <spdlog/spdlog.h>
+#include "common/swap.h"
+#include "core/gltf/accessor_decoder.h"
+
+namespace GLTF {
+
+template <typename T, bool Normalized>
+static float ConvertComponent(const u8* src) {
+    using LE = typename AddEndian<T, LETag>::type;
+    LE value;
+    std::memcpy(&value, src, sizeof(value)); // May not be aligned
+    const float f = static_cast<T>(value);
+    if constexpr (!Normalized || std::is_floating_point_v<T>) {
+        return f;
+    } else if constexpr (std::is_signed_v<T>) {
+        return std::max(f / std::numeric_limits<T>::max(), -1.0f);
+    } else {
+        return f / std::numeric_limits<T>::max();
+    }
+}
+
+// The loops are free of branches on the type, so that they can be vectorized
+template <typename T, bool Normalized>
+static void DecodeComponents(const u8* src, std::size_t count, std::size_t components,
+                             std::size_t byte_stride, float* out) {
+    if (byte_stride == components * sizeof(T)) {
+        for (std::size_t i = 0; i < count * components; ++i) {
+            out[i] = ConvertComponent<T, Normalized>(src + i * sizeof(T));
+        }
+        return;
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        const u8* element = src + i * byte_stride;
+        for (std::size_t j = 0; j < components; ++j) {
+            out[i * components + j] = ConvertComponent<T, Normalized>(element + j * sizeof(T));
+        }
+    }
+}
+
+template <typename T>
+static void DecodeComponents(const u8* src, std::size_t count, std::size_t components,
+                             std::size_t byte_stride, bool normalized, float* out) {
+    if (normalized) {
+        DecodeComponents<T, true>(src, count, components, byte_stride, out);
+    } else {
+        DecodeComponents<T, false>(src, count, components, byte_stride, out);
+    }
+}
+
+void DecodeFloatAccessor(std::span<const u8> data, std::size_t byte_stride,
+                         const Accessor& accessor, std::span<float> out) {
+    const std::size_t count = accessor.count;
+    const std::size_t components = GetComponentCount(accessor.type);
+    const std::size_t element_size = GetComponentSize(accessor.component_type) * components;
+    if (byte_stride == 0) {
+        byte_stride = element_size;
+    }
+    if (out.size() != count * components) {
+        SPDLOG_ERROR("Output size {} does not match accessor", out.size());
+        throw std::runtime_error("Output size does not match accessor");
+    }
+    if (count == 0) {
+        return;
+    }
+    if (data.size() < (count - 1) * byte_stride + element_size) {
+        SPDLOG_ERROR("Accessor data is too small");
+        throw std::runtime_error("Accessor data is too small");
+    }
+
+    const bool normalized = accessor.normalized;
+    const Accessor::ComponentType component_type = accessor.component_type;
+    switch (component_type) {
+    case Accessor::ComponentType::Byte:
+        DecodeComponents<s8>(data.data(), count, components, byte_stride, normalized, out.data());
+        break;
+    case Accessor::ComponentType::UnsignedByte:
+        DecodeComponents<u8>(data.data(), count, components, byte_stride, normalized, out.data());
+        break;
+    case Accessor::ComponentType::Short:
+        DecodeComponents<s16>(data.data(), count, components, byte_stride, normalized, out.data());
+        break;
+    case Accessor::ComponentType::UnsignedShort:
+        DecodeComponents<u16>(data.data(), count, components, byte_stride, normalized, out.data());
+        break;
+    case Accessor::ComponentType::Float:
+        DecodeComponents<float>(data.data(), count, components, byte_stride, false, out.data());
+        break;
+    default:
+        SPDLOG_ERROR("Invalid component type {}", static_cast<int>(component_type));
+        throw std::runtime_error("Invalid component type");
+    }
+}
+
+void GatherAccessor(std::span<const u8> data, std::size_t byte_stride, const Accessor& accessor,
+                    std::span<u8> out) {
+    const std::size_t count = accessor.count;
+    const std::size_t element_size =
+        GetComponentSize(accessor.component_type) * GetComponentCount(accessor.type);
+    if (byte_stride == 0) {
+        byte_stride = element_size;
+    }
+    if (out.size() != count * element_size) {
+        SPDLOG_ERROR("Output size {} does not match accessor", out.size());
+        throw std::runtime_error("Output size does not match accessor");
+    }
+    if (count == 0) {
+        return;
+    }
+    if (data.size() < (count - 1) * byte_stride + element_size) {
+        SPDLOG_ERROR("Accessor data is too small");
+        throw std::runtime_error("Accessor data is too small");
+    }
+
+    if (byte_stride == element_size) {
+        std::memcpy(out.data(), data.data(), out.size());
+        return;
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        std::memcpy(out.data() + i * element_size, data.data() + i * byte_stride, element_size);
+    }
+}
+
+template <typename T>
+static float ConvertBound(double value) {
+    const float f = static_cast<float>(value);
+    if constexpr (std::is_signed_v<T>) {
+        return std::max(f / std::numeric_limits<T>::max(), -1.0f);
+    } else {
+        return f / std::numeric_limits<T>::max();
+    }
+}
+
+float DecodeFloatBound(double value, const Accessor& accessor) {
+    if (!accessor.normalized) {
+        return static_cast<float>(value);
+    }
+    switch (accessor.component_type) {
+    case Accessor::ComponentType::Byte:
+        return ConvertBound<s8>(value);
+    case Accessor::ComponentType::UnsignedByte:
+        return ConvertBound<u8>(value);
+    case Accessor::ComponentType::Short:
+        return ConvertBound<s16>(value);
+    case Accessor::ComponentType::UnsignedShort:
+        return ConvertBound<u16>(value);
+    default:
+        return static_cast<float>(value);
+    }
+}
+
+} // namespace GLTF
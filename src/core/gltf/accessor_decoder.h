@@ -0,0 +1,34 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include "common/common_types.h"
+#include "core/gltf/gltf.h"
+
+/**
+ * Decoding of whole accessors into floats for CPU-side consumers (e.g. tangent generation),
+ * so that the component type is dispatched on once per accessor rather than per component, and
+ * gathering of their elements as they are.
+ */
+namespace GLTF {
+
+// Converts the accessor's elements in data (its bytes starting at the accessor's offset, with
+// byte_stride between elements or tightly packed if 0) into out, one element after another.
+// out must hold accessor.count * GetComponentCount(accessor.type) floats.
+// Normalized integers are mapped to [0, 1] or [-1, 1]; other integers (KHR_mesh_quantization)
+// are converted as is. Throws if the component type cannot be a float attribute.
+void DecodeFloatAccessor(std::span<const u8> data, std::size_t byte_stride,
+                         const Accessor& accessor, std::span<float> out);
+
+// Copies the accessor's elements in data (laid out as for DecodeFloatAccessor) into out,
+// tightly packed and unconverted. out must hold accessor.count elements.
+void GatherAccessor(std::span<const u8> data, std::size_t byte_stride, const Accessor& accessor,
+                    std::span<u8> out);
+
+// Converts a component of accessor.min or accessor.max like DecodeFloatAccessor would.
+float DecodeFloatBound(double value, const Accessor& accessor);
+
+} // namespace GLTF
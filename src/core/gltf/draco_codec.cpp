@@ -0,0 +1,103 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <stdexcept>
+#include <spdlog/spdlog.h>
+#include "core/gltf/draco_codec.h"
+
+#ifdef ENABLE_DRACO
+#include <draco/compression/decode.h>
+#include <draco/mesh/mesh.h>
+#else
+// Never created, but destroyed by DecodedMesh
+namespace draco {
+class Mesh {};
+} // namespace draco
+#endif
+
+namespace GLTF::Draco {
+
+#ifdef ENABLE_DRACO
+
+bool IsSupported() noexcept {
+    return true;
+}
+
+DecodedMesh::DecodedMesh(std::span<const u8> data) {
+    draco::DecoderBuffer buffer;
+    buffer.Init(reinterpret_cast<const char*>(data.data()), data.size());
+    if (const auto type = draco::Decoder::GetEncodedGeometryType(&buffer);
+        !type.ok() || type.value() != draco::EncodedGeometryType::TRIANGULAR_MESH) {
+        SPDLOG_ERROR("Draco compressed data is not a mesh");
+        throw std::runtime_error("Draco compressed data is not a mesh");
+    }
+    draco::Decoder decoder;
+    auto result = decoder.DecodeMeshFromBuffer(&buffer);
+    if (!result.ok()) {
+        SPDLOG_ERROR("Failed to decode Draco mesh: {}", result.status().error_msg_string());
+        throw std::runtime_error("Failed to decode Draco mesh");
+    }
+    mesh = std::move(result).value();
+}
+
+std::size_t DecodedMesh::GetNumPoints() const noexcept {
+    return mesh->num_points();
+}
+
+std::vector<u32> DecodedMesh::GetIndices() const {
+    std::vector<u32> indices(std::size_t{mesh->num_faces()} * 3);
+    for (u32 i = 0; i < mesh->num_faces(); ++i) {
+        const auto& face = mesh->face(draco::FaceIndex{i});
+        for (std::size_t j = 0; j < 3; ++j) {
+            indices[i * 3 + j] = face[j].value();
+        }
+    }
+    return indices;
+}
+
+std::vector<float> DecodedMesh::GetAttribute(u32 id, u32 num_components) const {
+    const draco::PointAttribute* attribute = mesh->GetAttributeByUniqueId(id);
+    if (!attribute) {
+        SPDLOG_ERROR("Draco mesh has no attribute {}", id);
+        throw std::runtime_error("Draco mesh has no such attribute");
+    }
+    std::vector<float> values(GetNumPoints() * num_components);
+    for (u32 i = 0; i < mesh->num_points(); ++i) {
+        if (!attribute->ConvertValue<float>(attribute->mapped_index(draco::PointIndex{i}),
+                                            static_cast<s8>(num_components),
+                                            values.data() + std::size_t{i} * num_components)) {
+            SPDLOG_ERROR("Failed to convert Draco attribute {}", id);
+            throw std::runtime_error("Failed to convert Draco attribute");
+        }
+    }
+    return values;
+}
+
+#else
+
+bool IsSupported() noexcept {
+    return false;
+}
+
+DecodedMesh::DecodedMesh(std::span<const u8>) {
+    throw std::runtime_error("Built without ENABLE_DRACO");
+}
+
+std::size_t DecodedMesh::GetNumPoints() const noexcept {
+    return 0;
+}
+
+std::vector<u32> DecodedMesh::GetIndices() const {
+    return {};
+}
+
+std::vector<float> DecodedMesh::GetAttribute(u32, u32) const {
+    return {};
+}
+
+#endif
+
+DecodedMesh::~DecodedMesh() = default;
+
+} // namespace GLTF::Draco
@@ -0,0 +1,43 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <span>
+#include <vector>
+#include "common/common_types.h"
+
+namespace draco {
+class Mesh;
+}
+
+/**
+ * Decoder of primitives compressed with KHR_draco_mesh_compression, with the Draco library
+ * (ENABLE_DRACO). Without it, IsSupported is false and DecodedMesh throws.
+ */
+namespace GLTF::Draco {
+
+bool IsSupported() noexcept;
+
+class DecodedMesh : NonCopyable {
+public:
+    // Decodes the contents of the buffer view of the extension. Throws std::runtime_error if
+    // they are malformed, or are a point cloud rather than a mesh.
+    explicit DecodedMesh(std::span<const u8> data);
+    ~DecodedMesh();
+
+    std::size_t GetNumPoints() const noexcept;
+    // Of the triangles, into the points
+    std::vector<u32> GetIndices() const;
+    // The values of the attribute of the unique ID (of the attributes of the extension) of each
+    // point, num_components floats each. Normalized integers are converted as glTF reads them,
+    // missing components are 0. Throws std::runtime_error if there is no such attribute.
+    std::vector<float> GetAttribute(u32 id, u32 num_components) const;
+
+private:
+    std::unique_ptr<draco::Mesh> mesh;
+};
+
+} // namespace GLTF::Draco
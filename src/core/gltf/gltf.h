@@ -22,6 +22,21 @@ struct BufferView {
     JSON::Field<std::size_t, "byteOffset", 0> byte_offset;
     JSON::RequiredField<std::size_t, "byteLength"> byte_length;
     JSON::Field<std::size_t, "byteStride"> byte_stride;
+
+    struct Extensions {
+        // The view's own buffer is then a fallback, typically without data
+        struct MeshoptCompression {
+            JSON::RequiredField<std::size_t, "buffer"> buffer;
+            JSON::Field<std::size_t, "byteOffset", 0> byte_offset;
+            JSON::RequiredField<std::size_t, "byteLength"> byte_length;
+            JSON::RequiredField<std::size_t, "byteStride"> byte_stride;
+            JSON::RequiredField<std::size_t, "count"> count;
+            JSON::RequiredField<std::string_view, "mode"> mode;
+            JSON::Field<std::string_view, "filter", JSON::StringLiteral{"NONE"}> filter;
+        };
+        JSON::Field<MeshoptCompression, "EXT_meshopt_compression"> meshopt_compression;
+    };
+    JSON::Field<Extensions, "extensions"> extensions;
 };
 
 struct Accessor {
@@ -42,6 +57,9 @@ struct Accessor {
     JSON::Field<bool, "normalized", false> normalized;
     JSON::RequiredField<std::size_t, "count"> count;
     JSON::RequiredField<std::string_view, "type"> type;
+    // Per component, stored like the components (so not normalized)
+    JSON::Array<double, "min"> min;
+    JSON::Array<double, "max"> max;
 };
 
 constexpr std::size_t GetComponentSize(Accessor::ComponentType component_type) {
@@ -111,15 +129,34 @@ inline vk::Format GetVertexInputFormat(Accessor::ComponentType component_type,
             {{Accessor::ComponentType::UnsignedShort, "VEC4"}, vk::Format::eR16G16B16A16Unorm},
             {{Accessor::ComponentType::Float, "VEC4"}, vk::Format::eR32G32B32A32Sfloat},
         };
-    if (!FormatMap.count({component_type, type})) {
+    // Non-normalized integers (KHR_mesh_quantization) are converted to floats as is
+    static const std::map<std::pair<Accessor::ComponentType, std::string_view>, vk::Format>
+        ScaledFormatMap{
+            {{Accessor::ComponentType::Byte, "SCALAR"}, vk::Format::eR8Sscaled},
+            {{Accessor::ComponentType::UnsignedByte, "SCALAR"}, vk::Format::eR8Uscaled},
+            {{Accessor::ComponentType::Short, "SCALAR"}, vk::Format::eR16Sscaled},
+            {{Accessor::ComponentType::UnsignedShort, "SCALAR"}, vk::Format::eR16Uscaled},
+            {{Accessor::ComponentType::Byte, "VEC2"}, vk::Format::eR8G8Sscaled},
+            {{Accessor::ComponentType::UnsignedByte, "VEC2"}, vk::Format::eR8G8Uscaled},
+            {{Accessor::ComponentType::Short, "VEC2"}, vk::Format::eR16G16Sscaled},
+            {{Accessor::ComponentType::UnsignedShort, "VEC2"}, vk::Format::eR16G16Uscaled},
+            {{Accessor::ComponentType::Byte, "VEC3"}, vk::Format::eR8G8B8Sscaled},
+            {{Accessor::ComponentType::UnsignedByte, "VEC3"}, vk::Format::eR8G8B8Uscaled},
+            {{Accessor::ComponentType::Short, "VEC3"}, vk::Format::eR16G16B16Sscaled},
+            {{Accessor::ComponentType::UnsignedShort, "VEC3"}, vk::Format::eR16G16B16Uscaled},
+            {{Accessor::ComponentType::Byte, "VEC4"}, vk::Format::eR8G8B8A8Sscaled},
+            {{Accessor::ComponentType::UnsignedByte, "VEC4"}, vk::Format::eR8G8B8A8Uscaled},
+            {{Accessor::ComponentType::Short, "VEC4"}, vk::Format::eR16G16B16A16Sscaled},
+            {{Accessor::ComponentType::UnsignedShort, "VEC4"}, vk::Format::eR16G16B16A16Uscaled},
+        };
+    const auto& format_map =
+        component_type != Accessor::ComponentType::Float && !normalized ? ScaledFormatMap
+                                                                        : FormatMap;
+    if (!format_map.count({component_type, type})) {
         SPDLOG_ERROR("Invalid vertex input accessor {} {}", static_cast<int>(component_type), type);
         throw std::runtime_error("Invalid vertex input accessor");
     }
-    if (component_type != Accessor::ComponentType::Float && !normalized) {
-        SPDLOG_ERROR("Integer vertex input accessors must be normalized");
-        throw std::runtime_error("Integer vertex input accessors must be normalized");
-    }
-    return FormatMap.at({component_type, type});
+    return format_map.at({component_type, type});
 }
 
 constexpr vk::IndexType GetIndexType(Accessor::ComponentType component_type) {
@@ -227,10 +264,18 @@ struct Image {
 struct Texture {
     JSON::Field<std::string_view, "name"> name;
 
-    // Note: This is not a required field, but behavior is undefined if unspecified
-    JSON::RequiredField<std::size_t, "source"> source;
+    // Note: Behavior is undefined if neither this nor an extension source is specified
+    JSON::Field<std::size_t, "source"> source;
 
     JSON::Field<std::size_t, "sampler"> sampler;
+
+    struct Extensions {
+        struct TextureBasisu {
+            JSON::RequiredField<std::size_t, "source"> source; // A KTX2 image
+        };
+        JSON::Field<TextureBasisu, "KHR_texture_basisu"> texture_basisu;
+    };
+    JSON::Field<Extensions, "extensions"> extensions;
 };
 
 struct TextureInfo {
@@ -283,6 +328,9 @@ struct Mesh {
             JSON::Field<std::size_t, "TEXCOORD_0"> texcoord_0;
             JSON::Field<std::size_t, "TEXCOORD_1"> texcoord_1;
             JSON::Field<std::size_t, "COLOR_0"> color_0;
+            // Of a skin, four joints and their weights per vertex
+            JSON::Field<std::size_t, "JOINTS_0"> joints_0;
+            JSON::Field<std::size_t, "WEIGHTS_0"> weights_0;
         };
         JSON::RequiredField<Attributes, "attributes"> attributes;
         JSON::Field<std::size_t, "indices"> indices;
@@ -298,8 +346,29 @@ struct Mesh {
             TriangleFan,
         };
         JSON::Field<Mode, "mode", Mode::Triangles> mode;
+
+        // Displacements of the attributes, added to them by the weights of the mesh or node
+        struct MorphTarget {
+            JSON::Field<std::size_t, "POSITION"> position;
+            JSON::Field<std::size_t, "NORMAL"> normal;
+            JSON::Field<std::size_t, "TANGENT"> tangent;
+        };
+        JSON::Array<MorphTarget, "targets"> targets;
+
+        struct Extensions {
+            // Decoded with ENABLE_DRACO (see draco_codec.h), loaded from the fallback data of
+            // the accessors otherwise. The attributes are the unique IDs of the compressed ones.
+            struct DracoMeshCompression {
+                JSON::RequiredField<std::size_t, "bufferView"> buffer_view;
+                JSON::RequiredField<Attributes, "attributes"> attributes;
+            };
+            JSON::Field<DracoMeshCompression, "KHR_draco_mesh_compression"> draco_mesh_compression;
+        };
+        JSON::Field<Extensions, "extensions"> extensions;
     };
     JSON::Array<Primitive, "primitives"> primitives;
+    // Of the morph targets, unless the node instancing the mesh has its own
+    JSON::Array<double, "weights"> weights;
 };
 
 struct Camera {
@@ -334,6 +403,45 @@ struct Node {
     JSON::Array<std::size_t, "children"> children;
     JSON::Field<std::size_t, "camera"> camera;
     JSON::Field<std::size_t, "mesh"> mesh;
+    JSON::Field<std::size_t, "skin"> skin;
+    JSON::Array<double, "weights"> weights;
+
+    struct Extensions {
+        // The mesh is instanced once per element of the accessors instead, each transformed by
+        // its own TRS and then by the node
+        struct MeshGPUInstancing {
+            struct Attributes {
+                JSON::Field<std::size_t, "TRANSLATION"> translation;
+                JSON::Field<std::size_t, "ROTATION"> rotation;
+                JSON::Field<std::size_t, "SCALE"> scale;
+            };
+            JSON::RequiredField<Attributes, "attributes"> attributes;
+        };
+        JSON::Field<MeshGPUInstancing, "EXT_mesh_gpu_instancing"> mesh_gpu_instancing;
+
+        // Placed at the node, pointing down its -Z
+        struct LightsPunctual {
+            JSON::RequiredField<std::size_t, "light"> light;
+        };
+        JSON::Field<LightsPunctual, "KHR_lights_punctual"> lights_punctual;
+    };
+    JSON::Field<Extensions, "extensions"> extensions;
+};
+
+// KHR_lights_punctual
+struct Light {
+    JSON::Field<std::string_view, "name"> name;
+    JSON::Field<glm::vec3, "color", glm::vec3{1, 1, 1}> color;
+    // Candela for point and spot lights, lux for directional ones
+    JSON::Field<double, "intensity", 1.0> intensity;
+    JSON::RequiredField<std::string_view, "type"> type; // directional, point or spot
+    JSON::Field<double, "range"> range;                 // Infinite by default
+
+    struct Spot {
+        JSON::Field<double, "innerConeAngle", 0.0> inner_cone_angle;
+        JSON::Field<double, "outerConeAngle", 0.7853981633974483> outer_cone_angle;
+    };
+    JSON::Field<Spot, "spot"> spot;
 };
 
 struct Scene {
@@ -341,6 +449,36 @@ struct Scene {
     JSON::Array<std::size_t, "nodes"> nodes;
 };
 
+// Deforms the meshes of the nodes that reference it by the transforms of its joints
+struct Skin {
+    JSON::Field<std::string_view, "name"> name;
+    JSON::Field<std::size_t, "inverseBindMatrices"> inverse_bind_matrices; // Identity by default
+    JSON::Field<std::size_t, "skeleton"> skeleton;
+    JSON::Array<std::size_t, "joints"> joints; // Nodes
+};
+
+struct Animation {
+    JSON::Field<std::string_view, "name"> name;
+
+    struct Channel {
+        JSON::RequiredField<std::size_t, "sampler"> sampler;
+        struct Target {
+            JSON::Field<std::size_t, "node"> node;
+            // translation, rotation, scale or weights
+            JSON::RequiredField<std::string_view, "path"> path;
+        };
+        JSON::RequiredField<Target, "target"> target;
+    };
+    JSON::Array<Channel, "channels"> channels;
+
+    struct Sampler {
+        JSON::RequiredField<std::size_t, "input"> input; // Times in seconds
+        JSON::Field<std::string_view, "interpolation"> interpolation; // LINEAR by default
+        JSON::RequiredField<std::size_t, "output"> output;
+    };
+    JSON::Array<Sampler, "samplers"> samplers;
+};
+
 struct GLTF {
     struct Asset {
         JSON::RequiredField<std::string_view, "version"> version;
@@ -348,6 +486,8 @@ struct GLTF {
     };
     JSON::RequiredField<Asset, "asset"> asset;
 
+    JSON::Array<std::string_view, "extensionsRequired"> extensions_required;
+
     JSON::Array<Buffer, "buffers"> buffers;
     JSON::Array<BufferView, "bufferViews"> buffer_views;
     JSON::Array<Accessor, "accessors"> accessors;
@@ -360,6 +500,16 @@ struct GLTF {
     JSON::Array<Node, "nodes"> nodes;
     JSON::Array<Scene, "scenes"> scenes;
     JSON::Field<std::size_t, "scene"> scene;
+    JSON::Array<Animation, "animations"> animations;
+    JSON::Array<Skin, "skins"> skins;
+
+    struct Extensions {
+        struct LightsPunctual {
+            JSON::Array<Light, "lights"> lights;
+        };
+        JSON::Field<LightsPunctual, "KHR_lights_punctual"> lights_punctual;
+    };
+    JSON::Field<Extensions, "extensions"> extensions;
 };
 
 constexpr int MajorVersion = 2;
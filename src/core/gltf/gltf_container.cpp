@@ -2,8 +2,11 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <cstring>
+#include <fstream>
 #include <spdlog/spdlog.h>
 #include "common/alignment.h"
+#include "common/remote_file.h"
 #include "common/swap.h"
 #include "core/gltf/gltf_container.h"
 
@@ -32,6 +35,12 @@ static constexpr u32 JSONChunkMagic = MakeMagic('J', 'S', 'O', 'N');
 static constexpr u32 BINChunkMagic = MakeMagic('B', 'I', 'N', 0);
 
 Container::Container(const std::filesystem::path& path_) : path(path_) {
+    if (Common::IsRemoteURI(path.generic_string())) {
+        uri = path.generic_string();
+        LoadRemote();
+        return;
+    }
+
     std::ifstream file(path, std::ios::binary);
     if (!file) {
         SPDLOG_ERROR("Failed to open file {}", path.string());
@@ -68,8 +77,16 @@ Container::Container(const std::filesystem::path& path_) : path(path_) {
         GLBChunkHeader bin_header;
         file.read(reinterpret_cast<char*>(&bin_header), sizeof(bin_header));
         if (file && bin_header.type == BINChunkMagic) {
-            extra_buffer_offset = file.tellg();
-            extra_buffer_file = std::move(file);
+            const std::size_t bin_offset = file.tellg();
+            file.close();
+
+            // Map the file so that accessors can be copied straight out of the BIN chunk
+            mapped_file = std::make_unique<Common::MappedFile>(path);
+            if (bin_offset + bin_header.length > mapped_file->size()) {
+                SPDLOG_ERROR("BIN chunk exceeds file size {}", path.string());
+                throw std::runtime_error("BIN chunk exceeds file size");
+            }
+            extra_buffer = mapped_file->GetSpan().subspan(bin_offset, bin_header.length);
         } else {
             SPDLOG_WARN("No valid BIN chunk {}", path.string());
         }
@@ -89,6 +106,63 @@ Container::Container(const std::filesystem::path& path_) : path(path_) {
     }
 }
 
+void Container::LoadRemote() {
+    remote_file = std::make_shared<const Common::RemoteFile>(uri);
+    const auto Read = [this](std::size_t offset, auto& value) {
+        if (offset + sizeof(value) > remote_file->size()) {
+            return false;
+        }
+        std::memcpy(&value, remote_file->GetSpan(offset, sizeof(value)).data(), sizeof(value));
+        return true;
+    };
+
+    GLBHeader header;
+    if (!Read(0, header)) {
+        SPDLOG_ERROR("Failed to read header {}", uri);
+        throw std::runtime_error("Failed to read header");
+    }
+    if (header.magic != GLBMagic) { // Read as JSON
+        const std::size_t json_size = remote_file->size();
+        json_data.resize(json_size + simdjson::SIMDJSON_PADDING);
+        std::memcpy(json_data.data(), remote_file->GetSpan(0, json_size).data(), json_size);
+        json = parser.iterate(json_data.data(), json_size, json_data.size());
+        return;
+    }
+
+    if (header.version != GLBVersion) {
+        SPDLOG_ERROR("GLB is of unsupported version {}", header.version);
+        throw std::runtime_error("GLB unsupported version");
+    }
+    GLBChunkHeader json_header;
+    if (!Read(sizeof(header), json_header) || json_header.type != JSONChunkMagic) {
+        SPDLOG_ERROR("First chunk of GLB is not JSON {}", uri);
+        throw std::runtime_error("First chunk of GLB should be JSON");
+    }
+    const std::size_t json_offset = sizeof(header) + sizeof(json_header);
+    const std::size_t json_chunk_size = Common::AlignUp(json_header.length, 4);
+    if (json_offset + json_chunk_size > remote_file->size()) {
+        SPDLOG_ERROR("JSON chunk exceeds file size {}", uri);
+        throw std::runtime_error("JSON chunk exceeds file size");
+    }
+    json_data.resize(json_chunk_size + simdjson::SIMDJSON_PADDING);
+    std::memcpy(json_data.data(), remote_file->GetSpan(json_offset, json_chunk_size).data(),
+                json_chunk_size);
+    json = parser.iterate(json_data.data(), json_chunk_size, json_data.size());
+
+    GLBChunkHeader bin_header;
+    const std::size_t bin_header_offset = json_offset + json_chunk_size;
+    if (Read(bin_header_offset, bin_header) && bin_header.type == BINChunkMagic) {
+        remote_buffer_offset = bin_header_offset + sizeof(bin_header);
+        if (remote_buffer_offset + bin_header.length > remote_file->size()) {
+            SPDLOG_ERROR("BIN chunk exceeds file size {}", uri);
+            throw std::runtime_error("BIN chunk exceeds file size");
+        }
+        remote_buffer_size = bin_header.length;
+    } else {
+        SPDLOG_WARN("No valid BIN chunk {}", uri);
+    }
+}
+
 Container::~Container() = default;
 
 } // namespace GLTF
@@ -5,23 +5,44 @@
 #pragma once
 
 #include <filesystem>
-#include <fstream>
+#include <memory>
 #include <optional>
+#include <span>
+#include <vector>
+#include <string>
+#include "common/mapped_file.h"
 #include "core/gltf/simdjson.h"
 
+namespace Common {
+class RemoteFile;
+}
+
 namespace GLTF {
 
 class Container {
 public:
+    // The path may be a remote URI instead, see Common::IsRemoteURI
     explicit Container(const std::filesystem::path& path);
     ~Container();
 
     std::filesystem::path path;
+    // Remote only, the URI that relative URIs of the glTF are resolved against
+    std::string uri;
     simdjson::ondemand::parser parser;
     std::vector<char> json_data;
     simdjson::ondemand::document json;
-    std::optional<std::ifstream> extra_buffer_file;
-    std::size_t extra_buffer_offset{};
+    // GLB only: mapping of the whole file and the BIN chunk inside it
+    std::unique_ptr<Common::MappedFile> mapped_file;
+    std::optional<std::span<const u8>> extra_buffer;
+    // Remote GLB only: the file and its BIN chunk, which is fetched as it is read rather than
+    // being an extra_buffer
+    std::shared_ptr<const Common::RemoteFile> remote_file;
+    std::size_t remote_buffer_offset{};
+    std::optional<std::size_t> remote_buffer_size;
+
+private:
+    // Fetches the JSON, and the header of the BIN chunk of GLB files
+    void LoadRemote();
 };
 
 } // namespace GLTF
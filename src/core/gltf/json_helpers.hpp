@@ -5,9 +5,13 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <bit>
 #include <optional>
+#include <stdexcept>
 #include <string_view>
 #include <type_traits>
+#include <utility>
 #include <vector>
 #include <boost/pfr.hpp>
 #include <glm/glm.hpp>
@@ -144,19 +148,30 @@ struct Field<T, Name, std::nullopt> : std::optional<T> {};
 
 namespace detail {
 
+// Fields are reset to what they are when missing, then deserialized from their values if found.
+template <typename T, StringLiteral Name, auto DefaultValue>
+void ResetField(Field<T, Name, DefaultValue>& out) {
+    static_cast<T&>(out) = DefaultValue;
+}
+
 template <typename T, StringLiteral Name, auto DefaultValue>
 void DeserializeField(Field<T, Name, DefaultValue>& out,
-                      simdjson::simdjson_result<simdjson::ondemand::value> parent_obj) {
-    if (!DeserializeValue(static_cast<T&>(out), parent_obj[Name.value])) {
+                      simdjson::simdjson_result<simdjson::ondemand::value> json) {
+    if (!DeserializeValue(static_cast<T&>(out), std::move(json))) {
         static_cast<T&>(out) = DefaultValue;
     }
 }
 
+template <typename T, StringLiteral Name>
+void ResetField(Field<T, Name, std::nullopt>& out) {
+    out.std::optional<T>::operator=(std::nullopt);
+}
+
 template <typename T, StringLiteral Name>
 void DeserializeField(Field<T, Name, std::nullopt>& out,
-                      simdjson::simdjson_result<simdjson::ondemand::value> parent_obj) {
+                      simdjson::simdjson_result<simdjson::ondemand::value> json) {
     T object{};
-    if (DeserializeValue(object, parent_obj[Name.value])) {
+    if (DeserializeValue(object, std::move(json))) {
         out.std::optional<T>::operator=(std::move(object));
     } else {
         out.std::optional<T>::operator=(std::nullopt);
@@ -171,10 +186,13 @@ struct RequiredField : Field<T, Name, nullptr> {};
 
 namespace detail {
 
+template <typename T, StringLiteral Name>
+void ResetField(RequiredField<T, Name>&) {}
+
 template <typename T, StringLiteral Name>
 void DeserializeField(RequiredField<T, Name>& out,
-                      simdjson::simdjson_result<simdjson::ondemand::value> parent_obj) {
-    if (!DeserializeValue(static_cast<T&>(out), parent_obj[Name.value])) {
+                      simdjson::simdjson_result<simdjson::ondemand::value> json) {
+    if (!DeserializeValue(static_cast<T&>(out), std::move(json))) {
         SPDLOG_CRITICAL("Could not deserialize required field {}", std::string_view{Name});
         throw std::runtime_error("Could not deserialize a required field");
     }
@@ -187,28 +205,146 @@ struct Array : std::vector<T> {};
 
 namespace detail {
 
+template <typename T, StringLiteral Name>
+void ResetField(Array<T, Name>& out) {
+    out.clear();
+}
+
 template <typename T, StringLiteral Name>
 void DeserializeField(Array<T, Name>& out,
-                      simdjson::simdjson_result<simdjson::ondemand::value> parent_obj) {
+                      simdjson::simdjson_result<simdjson::ondemand::value> json) {
     out.clear();
 
-    auto sub_obj = parent_obj[Name.value];
-    if (!sub_obj.error()) {
-        for (auto obj : sub_obj.get_array()) {
-            out.emplace_back();
-            DeserializeValue(out.back(), std::move(obj));
+    simdjson::ondemand::array array;
+    if (json.get(array)) {
+        return;
+    }
+    // Counting skips over the elements without parsing them, and rewinds the array
+    std::size_t count{};
+    if (!array.count_elements().get(count)) {
+        out.reserve(count);
+    }
+    for (auto element : array) {
+        out.emplace_back();
+        DeserializeValue(out.back(), std::move(element));
+    }
+}
+
+// Name of the key of a field, and whether it is required
+template <typename F>
+struct FieldTraits;
+
+template <typename T, StringLiteral Name, auto DefaultValue>
+struct FieldTraits<Field<T, Name, DefaultValue>> {
+    static constexpr std::string_view name{Name.value}; // Without the terminator
+    static constexpr bool required = false;
+};
+
+template <typename T, StringLiteral Name>
+struct FieldTraits<RequiredField<T, Name>> {
+    static constexpr std::string_view name{Name.value};
+    static constexpr bool required = true;
+};
+
+template <typename T, StringLiteral Name>
+struct FieldTraits<Array<T, Name>> {
+    static constexpr std::string_view name{Name.value};
+    static constexpr bool required = false;
+};
+
+// FNV-1a, starting from the seed
+constexpr u32 HashKey(std::string_view key, u32 seed) noexcept {
+    u32 hash = 2166136261u ^ seed;
+    for (const char c : key) {
+        hash = (hash ^ static_cast<u8>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+// Perfect hash of the field names of a struct, found at compile time by trying seeds until
+// no two names share a slot. Slots hold the field index + 1, or 0 for none.
+template <std::size_t N>
+struct FieldTable {
+    static constexpr std::size_t Size = std::bit_ceil(std::max<std::size_t>(N * 4, 1));
+
+    u32 seed{};
+    std::array<u8, Size> slots{};
+
+    constexpr std::size_t GetSlot(std::string_view key) const noexcept {
+        return HashKey(key, seed) & (Size - 1);
+    }
+};
+
+template <std::size_t N>
+constexpr FieldTable<N> MakeFieldTable(const std::array<std::string_view, N>& names) {
+    static_assert(N < 256, "Too many fields for the slots");
+    for (u32 seed = 0;; ++seed) {
+        FieldTable<N> table{.seed = seed};
+        bool collided = false;
+        for (std::size_t i = 0; i < N && !collided; ++i) {
+            auto& slot = table.slots[table.GetSlot(names[i])];
+            collided = slot != 0;
+            slot = static_cast<u8>(i + 1);
+        }
+        if (!collided) {
+            return table;
         }
     }
 }
 
-} // namespace detail
+template <typename T, std::size_t Idx>
+using FieldType = std::remove_cvref_t<boost::pfr::tuple_element_t<Idx, T>>;
 
-namespace detail {
+template <typename T, std::size_t Idx>
+void DeserializeFieldAt(T& out, simdjson::simdjson_result<simdjson::ondemand::value> json) {
+    DeserializeField(boost::pfr::get<Idx, T>(out), std::move(json));
+}
 
+/**
+ * Iterates the members of the object once, in the order they are in, dispatching each key
+ * to its field through a perfect hash of the names. Looking the fields up by name instead
+ * would scan the object for each of them, and rewind it whenever they are out of order.
+ * Unknown keys are skipped, and duplicate keys are deserialized again, the last one winning.
+ */
 template <typename T, std::size_t... Idxs>
 void DeserializeStructImpl(T& out, simdjson::simdjson_result<simdjson::ondemand::value> json,
                            std::index_sequence<Idxs...>) {
-    (..., DeserializeField(boost::pfr::get<Idxs, T>(out), json));
+    static constexpr std::size_t NumFields = sizeof...(Idxs);
+    static_assert(NumFields <= 64, "Too many fields for the mask of those found");
+    static constexpr std::array<std::string_view, NumFields> Names{
+        FieldTraits<FieldType<T, Idxs>>::name...};
+    static constexpr auto Table = MakeFieldTable(Names);
+    using Deserializer = void (*)(T&, simdjson::simdjson_result<simdjson::ondemand::value>);
+    static constexpr std::array<Deserializer, NumFields> Deserializers{
+        &DeserializeFieldAt<T, Idxs>...};
+    static constexpr u64 RequiredMask =
+        (u64{0} | ... | (u64{FieldTraits<FieldType<T, Idxs>>::required} << Idxs));
+
+    (..., ResetField(boost::pfr::get<Idxs, T>(out)));
+
+    u64 found{};
+    simdjson::ondemand::object object;
+    if (!json.get(object)) {
+        for (auto member : object) {
+            std::string_view key;
+            if (member.unescaped_key().get(key)) {
+                SPDLOG_CRITICAL("Could not read key of JSON object");
+                throw std::runtime_error("Could not read a key of a JSON object");
+            }
+            const std::size_t slot = Table.slots[Table.GetSlot(key)];
+            if (slot == 0 || Names[slot - 1] != key) {
+                continue;
+            }
+            Deserializers[slot - 1](out, member.value());
+            found |= u64{1} << (slot - 1);
+        }
+    }
+
+    if ((found & RequiredMask) != RequiredMask) {
+        const auto missing = static_cast<std::size_t>(std::countr_zero(RequiredMask & ~found));
+        SPDLOG_CRITICAL("Could not deserialize required field {}", Names[missing]);
+        throw std::runtime_error("Could not deserialize a required field");
+    }
 }
 
 template <typename T>
@@ -226,4 +362,72 @@ T Deserialize(simdjson::simdjson_result<simdjson::ondemand::value> json) {
     return out;
 }
 
+namespace detail {
+
+template <typename T>
+bool EqualStruct(const T& a, const T& b);
+
+template <typename T>
+    requires(std::is_scalar_v<T>) bool
+EqualValue(const T& a, const T& b) {
+    return a == b;
+}
+
+template <typename T>
+    requires(!std::is_scalar_v<T>) bool
+EqualValue(const T& a, const T& b) {
+    return EqualStruct(a, b);
+}
+
+template <>
+inline bool EqualValue(const std::string_view& a, const std::string_view& b) {
+    return a == b;
+}
+
+template <glm::length_t L, typename T, glm::qualifier Q>
+bool EqualValue(const glm::vec<L, T, Q>& a, const glm::vec<L, T, Q>& b) {
+    return a == b;
+}
+
+template <glm::length_t C, glm::length_t R, typename T, glm::qualifier Q>
+bool EqualValue(const glm::mat<C, R, T, Q>& a, const glm::mat<C, R, T, Q>& b) {
+    return a == b;
+}
+
+template <typename T, StringLiteral Name, auto DefaultValue>
+bool EqualField(const Field<T, Name, DefaultValue>& a, const Field<T, Name, DefaultValue>& b) {
+    return EqualValue(static_cast<const T&>(a), static_cast<const T&>(b));
+}
+
+template <typename T, StringLiteral Name>
+bool EqualField(const Field<T, Name, std::nullopt>& a, const Field<T, Name, std::nullopt>& b) {
+    if (a.has_value() != b.has_value()) {
+        return false;
+    }
+    return !a.has_value() || EqualValue(*a, *b);
+}
+
+template <typename T, StringLiteral Name>
+bool EqualField(const Array<T, Name>& a, const Array<T, Name>& b) {
+    return std::ranges::equal(a, b, [](const T& x, const T& y) { return EqualValue(x, y); });
+}
+
+template <typename T, std::size_t... Idxs>
+bool EqualStructImpl(const T& a, const T& b, std::index_sequence<Idxs...>) {
+    return (... && EqualField(boost::pfr::get<Idxs, T>(a), boost::pfr::get<Idxs, T>(b)));
+}
+
+template <typename T>
+bool EqualStruct(const T& a, const T& b) {
+    return EqualStructImpl(a, b, std::make_index_sequence<boost::pfr::tuple_size_v<T>>());
+}
+
+} // namespace detail
+
+// Whether two deserialized structs have the same fields, recursively
+template <typename T>
+bool Equal(const T& a, const T& b) {
+    return detail::EqualStruct(a, b);
+}
+
 } // namespace JSON
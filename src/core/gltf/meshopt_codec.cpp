@@ -0,0 +1,484 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "core/gltf/meshopt_codec.h"
+
+namespace GLTF::Meshopt {
+
+Mode ParseMode(std::string_view mode) {
+    if (mode == "ATTRIBUTES") {
+        return Mode::Attributes;
+    } else if (mode == "TRIANGLES") {
+        return Mode::Triangles;
+    } else if (mode == "INDICES") {
+        return Mode::Indices;
+    }
+    SPDLOG_ERROR("Unknown meshopt compression mode {}", mode);
+    throw std::runtime_error("Unknown meshopt compression mode");
+}
+
+Filter ParseFilter(std::string_view filter) {
+    if (filter == "NONE") {
+        return Filter::None;
+    } else if (filter == "OCTAHEDRAL") {
+        return Filter::Octahedral;
+    } else if (filter == "QUATERNION") {
+        return Filter::Quaternion;
+    } else if (filter == "EXPONENTIAL") {
+        return Filter::Exponential;
+    }
+    SPDLOG_ERROR("Unknown meshopt compression filter {}", filter);
+    throw std::runtime_error("Unknown meshopt compression filter");
+}
+
+namespace {
+
+[[noreturn]] void ThrowMalformed() {
+    throw std::runtime_error("Malformed meshopt compressed data");
+}
+
+// Bounds checked cursor over the compressed data
+class Reader {
+public:
+    explicit Reader(const u8* begin_, const u8* end_) : pos(begin_), end(end_) {}
+
+    u8 Read() {
+        if (pos >= end) {
+            ThrowMalformed();
+        }
+        return *pos++;
+    }
+
+    const u8* Take(std::size_t size) {
+        if (static_cast<std::size_t>(end - pos) < size) {
+            ThrowMalformed();
+        }
+        return std::exchange(pos, pos + size);
+    }
+
+    u32 ReadVByte() {
+        const u8 lead = Read();
+        if (lead < 128) {
+            return lead;
+        }
+        u32 result = lead & 127;
+        for (u32 shift = 7; shift < 35; shift += 7) {
+            const u8 group = Read();
+            result |= static_cast<u32>(group & 127) << shift;
+            if (group < 128) {
+                break;
+            }
+        }
+        return result;
+    }
+
+    // Zigzag encoded delta from last
+    u32 ReadIndex(u32 last) {
+        const u32 v = ReadVByte();
+        return last + ((v >> 1) ^ (0u - (v & 1)));
+    }
+
+    const u8* pos{};
+    const u8* end{};
+};
+
+namespace Vertex {
+
+constexpr u8 Header = 0xa0;
+constexpr std::size_t BlockSizeBytes = 8192;
+constexpr std::size_t BlockMaxSize = 256;
+constexpr std::size_t GroupSize = 16;
+constexpr std::size_t TailMaxSize = 32;
+
+constexpr std::size_t GetBlockSize(std::size_t vertex_size) {
+    return std::min((BlockSizeBytes / vertex_size) & ~(GroupSize - 1), BlockMaxSize);
+}
+
+// A group of 16 deltas, packed with 0, 2, 4 or 8 bits each. Packed values with all bits set
+// are escapes: the actual byte follows after the packed bits.
+void DecodeGroup(Reader& reader, u8* out, u32 bits_log2) {
+    if (bits_log2 == 0) {
+        std::fill_n(out, GroupSize, u8{0});
+        return;
+    }
+    if (bits_log2 == 3) {
+        std::memcpy(out, reader.Take(GroupSize), GroupSize);
+        return;
+    }
+
+    const u32 bits = bits_log2 == 1 ? 2 : 4;
+    const u32 escape = (1u << bits) - 1;
+    const u8* packed = reader.Take(GroupSize * bits / 8);
+    for (std::size_t i = 0; i < GroupSize; ++i) {
+        // Most significant bits first
+        const u32 bit_pos = static_cast<u32>(i) * bits;
+        const u32 value = (packed[bit_pos / 8] >> (8 - bits - bit_pos % 8)) & escape;
+        out[i] = value == escape ? reader.Read() : static_cast<u8>(value);
+    }
+}
+
+void DecodeBytes(Reader& reader, std::span<u8> out) {
+    const std::size_t num_groups = out.size() / GroupSize;
+    const u8* header = reader.Take((num_groups + 3) / 4);
+    for (std::size_t i = 0; i < num_groups; ++i) {
+        const u32 bits_log2 = (header[i / 4] >> ((i % 4) * 2)) & 3;
+        DecodeGroup(reader, out.data() + i * GroupSize, bits_log2);
+    }
+}
+
+void Decode(std::span<u8> out, std::size_t count, std::size_t vertex_size,
+            std::span<const u8> data) {
+    if (vertex_size == 0 || vertex_size > 256 || vertex_size % 4 != 0) {
+        SPDLOG_ERROR("Invalid meshopt vertex size {}", vertex_size);
+        throw std::runtime_error("Invalid meshopt vertex size");
+    }
+    const std::size_t tail_size = std::max(vertex_size, TailMaxSize);
+    if (data.size() < 1 + tail_size || data[0] != Header) {
+        ThrowMalformed();
+    }
+
+    // The tail holds the baseline the first vertex is delta encoded against
+    std::array<u8, 256> last_vertex;
+    std::memcpy(last_vertex.data(), data.data() + data.size() - vertex_size, vertex_size);
+
+    Reader reader{data.data() + 1, data.data() + data.size() - tail_size};
+    const std::size_t block_size = GetBlockSize(vertex_size);
+    std::array<u8, BlockMaxSize> deltas;
+    for (std::size_t begin = 0; begin < count; begin += block_size) {
+        const std::size_t block_count = std::min(block_size, count - begin);
+        const std::size_t aligned_count = (block_count + GroupSize - 1) & ~(GroupSize - 1);
+        u8* block = out.data() + begin * vertex_size;
+
+        // Bytes are stored transposed: byte k of every vertex, then byte k + 1...
+        for (std::size_t k = 0; k < vertex_size; ++k) {
+            DecodeBytes(reader, {deltas.data(), aligned_count});
+            u8 previous = last_vertex[k];
+            for (std::size_t i = 0; i < block_count; ++i) {
+                const u8 delta = deltas[i];
+                previous += static_cast<u8>((0u - (delta & 1)) ^ (delta >> 1));
+                block[i * vertex_size + k] = previous;
+            }
+        }
+        std::memcpy(last_vertex.data(), block + (block_count - 1) * vertex_size, vertex_size);
+    }
+    if (reader.pos != reader.end) {
+        ThrowMalformed();
+    }
+}
+
+} // namespace Vertex
+
+template <typename T>
+void WriteIndex(std::span<u8> out, std::size_t i, u32 index) {
+    const auto value = static_cast<T>(index);
+    std::memcpy(out.data() + i * sizeof(T), &value, sizeof(T));
+}
+
+void WriteIndex(std::span<u8> out, std::size_t byte_stride, std::size_t i, u32 index) {
+    if (byte_stride == 2) {
+        WriteIndex<u16>(out, i, index);
+    } else {
+        WriteIndex<u32>(out, i, index);
+    }
+}
+
+void CheckIndexStride(std::size_t byte_stride) {
+    if (byte_stride != 2 && byte_stride != 4) {
+        SPDLOG_ERROR("Invalid meshopt index size {}", byte_stride);
+        throw std::runtime_error("Invalid meshopt index size");
+    }
+}
+
+namespace Triangles {
+
+constexpr u8 Header = 0xe0;
+
+class Fifos {
+public:
+    Fifos() {
+        for (auto& edge : edges) {
+            edge = {~0u, ~0u};
+        }
+        vertices.fill(~0u);
+    }
+
+    std::pair<u32, u32> GetEdge(u32 distance) const {
+        return edges[(edge_offset - 1 - distance) & 15];
+    }
+    // Distance counted from the next insertion point
+    u32 GetVertex(u32 distance) const {
+        return vertices[(vertex_offset - distance) & 15];
+    }
+
+    void PushEdge(u32 a, u32 b) {
+        edges[edge_offset] = {a, b};
+        edge_offset = (edge_offset + 1) & 15;
+    }
+    void PushVertex(u32 v, bool cond = true) {
+        vertices[vertex_offset] = v;
+        vertex_offset = (vertex_offset + cond) & 15;
+    }
+
+private:
+    std::array<std::pair<u32, u32>, 16> edges;
+    std::array<u32, 16> vertices;
+    u32 edge_offset{};
+    u32 vertex_offset{};
+};
+
+void Decode(std::span<u8> out, std::size_t count, std::size_t byte_stride,
+            std::span<const u8> data) {
+    CheckIndexStride(byte_stride);
+    if (count % 3 != 0) {
+        SPDLOG_ERROR("Triangle index count {} is not a multiple of 3", count);
+        throw std::runtime_error("Triangle index count is not a multiple of 3");
+    }
+    const std::size_t num_triangles = count / 3;
+    if (data.size() < 1 + num_triangles + 16 || (data[0] & 0xf0) != Header ||
+        (data[0] & 0x0f) > 1) {
+        ThrowMalformed();
+    }
+    const u32 version = data[0] & 0x0f;
+
+    // One code byte per triangle, then the extra data, and a table of 16 auxiliary codes
+    const u8* codes = data.data() + 1;
+    const u8* codeaux_table = data.data() + data.size() - 16;
+    Reader reader{codes + num_triangles, codeaux_table};
+
+    Fifos fifos;
+    u32 next = 0, last = 0;
+    const u32 fecmax = version >= 1 ? 13 : 15;
+    const auto WriteTriangle = [&](std::size_t i, u32 a, u32 b, u32 c) {
+        WriteIndex(out, byte_stride, i * 3, a);
+        WriteIndex(out, byte_stride, i * 3 + 1, b);
+        WriteIndex(out, byte_stride, i * 3 + 2, c);
+    };
+    for (std::size_t i = 0; i < num_triangles; ++i) {
+        const u8 codetri = codes[i];
+        if (codetri < 0xf0) { // Triangle sharing an edge with a recent one
+            const auto [a, b] = fifos.GetEdge(codetri >> 4);
+            const u32 fec = codetri & 15;
+            u32 c{};
+            if (fec < fecmax) {
+                c = fec == 0 ? next : fifos.GetVertex(fec + 1);
+                next += fec == 0;
+                WriteTriangle(i, a, b, c);
+                fifos.PushVertex(c, fec == 0);
+            } else {
+                // 13 and 14 are -1 and +1 from the last free index, 15 a full delta
+                last = c = fec != 15 ? last + (fec - (fec ^ 3)) : reader.ReadIndex(last);
+                WriteTriangle(i, a, b, c);
+                fifos.PushVertex(c);
+            }
+            fifos.PushEdge(c, b);
+            fifos.PushEdge(a, c);
+            continue;
+        }
+
+        u32 a{}, b{}, c{};
+        u32 feb{}, fec{};
+        if (codetri < 0xfe) { // New triangle, vertex references from the table
+            const u8 codeaux = codeaux_table[codetri & 15];
+            feb = codeaux >> 4;
+            fec = codeaux & 15;
+
+            a = next++;
+            b = feb == 0 ? next : fifos.GetVertex(feb);
+            next += feb == 0;
+            c = fec == 0 ? next : fifos.GetVertex(fec);
+            next += fec == 0;
+        } else { // New triangle, explicit vertex references
+            const u8 codeaux = reader.Read();
+            const u32 fea = codetri == 0xfe ? 0 : 15;
+            feb = codeaux >> 4;
+            fec = codeaux & 15;
+            if (codeaux == 0) {
+                next = 0;
+            }
+
+            a = fea == 0 ? next++ : 0;
+            b = feb == 0 ? next++ : fifos.GetVertex(feb);
+            c = fec == 0 ? next++ : fifos.GetVertex(fec);
+            if (fea == 15) {
+                last = a = reader.ReadIndex(last);
+            }
+            if (feb == 15) {
+                last = b = reader.ReadIndex(last);
+            }
+            if (fec == 15) {
+                last = c = reader.ReadIndex(last);
+            }
+        }
+        WriteTriangle(i, a, b, c);
+        fifos.PushVertex(a);
+        fifos.PushVertex(b, feb == 0 || feb == 15);
+        fifos.PushVertex(c, fec == 0 || fec == 15);
+        fifos.PushEdge(b, a);
+        fifos.PushEdge(c, b);
+        fifos.PushEdge(a, c);
+    }
+    if (reader.pos != reader.end) {
+        ThrowMalformed();
+    }
+}
+
+} // namespace Triangles
+
+namespace Indices {
+
+constexpr u8 Header = 0xd0;
+
+void Decode(std::span<u8> out, std::size_t count, std::size_t byte_stride,
+            std::span<const u8> data) {
+    CheckIndexStride(byte_stride);
+    if (data.size() < 1 + count + 4 || (data[0] & 0xf0) != Header || (data[0] & 0x0f) > 1) {
+        ThrowMalformed();
+    }
+
+    // Two streams of deltas, selected by the low bit
+    Reader reader{data.data() + 1, data.data() + data.size() - 4};
+    std::array<u32, 2> last{};
+    for (std::size_t i = 0; i < count; ++i) {
+        u32 v = reader.ReadVByte();
+        const u32 current = v & 1;
+        v >>= 1;
+        last[current] += (v >> 1) ^ (0u - (v & 1));
+        WriteIndex(out, byte_stride, i, last[current]);
+    }
+    if (reader.pos != reader.end) {
+        ThrowMalformed();
+    }
+}
+
+} // namespace Indices
+
+template <typename T>
+void ApplyOctahedralFilter(std::span<u8> data) {
+    const float max = static_cast<float>((1 << (sizeof(T) * 8 - 1)) - 1);
+    std::array<T, 4> v;
+    for (std::size_t offset = 0; offset < data.size(); offset += sizeof(v)) {
+        std::memcpy(v.data(), data.data() + offset, sizeof(v));
+
+        // Z is stored as 1.0 at the same bit count, fix up the coordinates for z < 0
+        float x = static_cast<float>(v[0]);
+        float y = static_cast<float>(v[1]);
+        const float z = static_cast<float>(v[2]) - std::abs(x) - std::abs(y);
+        const float t = std::min(z, 0.0f);
+        x += x >= 0.0f ? t : -t;
+        y += y >= 0.0f ? t : -t;
+
+        const float scale = max / std::sqrt(x * x + y * y + z * z);
+        v[0] = static_cast<T>(std::lround(x * scale));
+        v[1] = static_cast<T>(std::lround(y * scale));
+        v[2] = static_cast<T>(std::lround(z * scale));
+        std::memcpy(data.data() + offset, v.data(), sizeof(v));
+    }
+}
+
+void ApplyQuaternionFilter(std::span<u8> data) {
+    std::array<s16, 4> v;
+    for (std::size_t offset = 0; offset < data.size(); offset += sizeof(v)) {
+        std::memcpy(v.data(), data.data() + offset, sizeof(v));
+
+        // The largest component is dropped, its index is in the low bits of the last one and
+        // the scale in the rest
+        const float scale = 1.0f / std::sqrt(2.0f) / static_cast<float>(v[3] | 3);
+        const float x = static_cast<float>(v[0]) * scale;
+        const float y = static_cast<float>(v[1]) * scale;
+        const float z = static_cast<float>(v[2]) * scale;
+        const float w = std::sqrt(std::max(1.0f - x * x - y * y - z * z, 0.0f));
+
+        const int max_component = v[3] & 3;
+        const std::array<s16, 4> components{
+            static_cast<s16>(std::lround(w * 32767.0f)),
+            static_cast<s16>(std::lround(x * 32767.0f)),
+            static_cast<s16>(std::lround(y * 32767.0f)),
+            static_cast<s16>(std::lround(z * 32767.0f)),
+        };
+        for (int i = 0; i < 4; ++i) {
+            v[(max_component + i) & 3] = components[i];
+        }
+        std::memcpy(data.data() + offset, v.data(), sizeof(v));
+    }
+}
+
+void ApplyExponentialFilter(std::span<u8> data) {
+    for (std::size_t offset = 0; offset < data.size(); offset += sizeof(u32)) {
+        u32 v;
+        std::memcpy(&v, data.data() + offset, sizeof(v));
+
+        // 24 bit signed mantissa, 8 bit signed exponent
+        const s32 mantissa = static_cast<s32>(v << 8) >> 8;
+        const s32 exponent = static_cast<s32>(v) >> 24;
+        const float value = std::ldexp(static_cast<float>(mantissa), exponent);
+        std::memcpy(data.data() + offset, &value, sizeof(value));
+    }
+}
+
+void ApplyFilter(std::span<u8> data, std::size_t byte_stride, Filter filter) {
+    switch (filter) {
+    case Filter::None:
+        return;
+    case Filter::Octahedral:
+        if (byte_stride == 4) {
+            ApplyOctahedralFilter<s8>(data);
+            return;
+        } else if (byte_stride == 8) {
+            ApplyOctahedralFilter<s16>(data);
+            return;
+        }
+        break;
+    case Filter::Quaternion:
+        if (byte_stride == 8) {
+            ApplyQuaternionFilter(data);
+            return;
+        }
+        break;
+    case Filter::Exponential:
+        if (byte_stride % 4 == 0) {
+            ApplyExponentialFilter(data);
+            return;
+        }
+        break;
+    }
+    SPDLOG_ERROR("Invalid byte stride {} for meshopt filter", byte_stride);
+    throw std::runtime_error("Invalid byte stride for meshopt filter");
+}
+
+} // namespace
+
+void Decode(std::span<u8> out, std::size_t count, std::size_t byte_stride,
+            std::span<const u8> data, Mode mode, Filter filter) {
+    if (out.size() != count * byte_stride) {
+        SPDLOG_ERROR("Output size {} does not match {} elements of {} bytes", out.size(), count,
+                     byte_stride);
+        throw std::runtime_error("Invalid meshopt output size");
+    }
+    if (count == 0) {
+        return;
+    }
+
+    switch (mode) {
+    case Mode::Attributes:
+        Vertex::Decode(out, count, byte_stride, data);
+        ApplyFilter(out, byte_stride, filter);
+        return;
+    case Mode::Triangles:
+        Triangles::Decode(out, count, byte_stride, data);
+        return;
+    case Mode::Indices:
+        Indices::Decode(out, count, byte_stride, data);
+        return;
+    }
+}
+
+} // namespace GLTF::Meshopt
@@ -0,0 +1,38 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include <string_view>
+#include "common/common_types.h"
+
+/**
+ * Decoders for buffer views compressed with EXT_meshopt_compression (bitstream version 0 for
+ * attributes, version 1 for indices), including the attribute filters.
+ */
+namespace GLTF::Meshopt {
+
+enum class Mode {
+    Attributes,
+    Triangles,
+    Indices,
+};
+
+enum class Filter {
+    None,
+    Octahedral,
+    Quaternion,
+    Exponential,
+};
+
+Mode ParseMode(std::string_view mode);
+Filter ParseFilter(std::string_view filter);
+
+// Decodes count elements of byte_stride bytes into out, which must be count * byte_stride
+// bytes. Throws if the data is malformed.
+void Decode(std::span<u8> out, std::size_t count, std::size_t byte_stride,
+            std::span<const u8> data, Mode mode, Filter filter);
+
+} // namespace GLTF::Meshopt
@@ -0,0 +1,209 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include "common/process_memory.h"
+#include "common/remote_file.h"
+#include "common/scope_exit.h"
+#include "core/gltf/gltf_container.h"
+#include "core/gltf/json_helpers.hpp"
+#include "core/hot_reload.h"
+#include "core/scene.h"
+
+namespace Renderer {
+
+// Remote files are compared by their versions, rather than being fetched whole
+static SceneCache::Key HashRemoteFile(const Common::RemoteFile& file) {
+    if (file.GetVersion().empty()) {
+        return SceneCache::Hasher{"hot_reload"}.Add(file.GetSpan(0, file.size())).Get();
+    }
+    const auto& version = file.GetVersion();
+    return SceneCache::Hasher{"hot_reload_remote"}
+        .Add({reinterpret_cast<const u8*>(version.data()), version.size()})
+        .Get();
+}
+
+static SceneCache::Key HashFile(std::string_view uri, const GLTF::Container& container) {
+    if (uri.starts_with("data:")) { // Compared as part of the JSON
+        return {};
+    }
+    if (!container.uri.empty()) {
+        return HashRemoteFile(Common::RemoteFile{Common::ResolveRemoteURI(container.uri, uri)});
+    }
+    const BufferFile file{uri};
+    return SceneCache::Hasher{"hot_reload"}.Add(file.GetSpan()).Get();
+}
+
+GLTFSnapshot::GLTFSnapshot(const GLTF::Container& container)
+    : json_data(container.json_data) {
+
+    json = parser.iterate(json_data.data(), json_data.size() - simdjson::SIMDJSON_PADDING,
+                          json_data.size());
+    gltf = JSON::Deserialize<GLTF::GLTF>(json.get_value());
+
+    // Relative URIs are relative to the glTF
+    const auto prev_current_path = std::filesystem::current_path();
+    if (container.uri.empty() && container.path.has_parent_path()) {
+        std::filesystem::current_path(container.path.parent_path());
+    }
+    SCOPE_EXIT({ std::filesystem::current_path(prev_current_path); });
+
+    for (const auto& buffer : gltf.buffers) {
+        if (buffer.uri.has_value()) {
+            buffer_hashes.emplace_back(HashFile(*buffer.uri, container));
+        } else if (container.remote_buffer_size.has_value()) {
+            buffer_hashes.emplace_back(HashRemoteFile(*container.remote_file));
+        } else if (container.extra_buffer.has_value()) {
+            buffer_hashes.emplace_back(
+                SceneCache::Hasher{"hot_reload"}.Add(*container.extra_buffer).Get());
+        } else {
+            buffer_hashes.emplace_back();
+        }
+    }
+    for (const auto& image : gltf.images) {
+        image_hashes.emplace_back(image.uri.has_value() ? HashFile(*image.uri, container)
+                                                        : SceneCache::Key{});
+    }
+}
+
+GLTFSnapshot::~GLTFSnapshot() = default;
+
+std::size_t GLTFSnapshot::GetHostSize() const noexcept {
+    // The parser has a structural index of 4 bytes per byte of JSON, and a string buffer of 5/3
+    const std::size_t parser_size = parser.capacity() * sizeof(u32) + parser.capacity() * 5 / 3;
+    return json_data.capacity() + parser_size + Common::GetHeapSize(buffer_hashes) +
+           Common::GetHeapSize(image_hashes);
+}
+
+SceneCache::Key GLTFSnapshot::GetHash() const {
+    return SceneCache::Hasher{"gltf_snapshot"}
+        .Add({reinterpret_cast<const u8*>(json_data.data()),
+              json_data.size() - simdjson::SIMDJSON_PADDING})
+        .AddVector(buffer_hashes)
+        .AddVector(image_hashes)
+        .Get();
+}
+
+template <typename T>
+static bool ArraysEqual(const std::vector<T>& a, const std::vector<T>& b) {
+    return std::ranges::equal(a, b, [](const T& x, const T& y) { return JSON::Equal(x, y); });
+}
+
+// The textures and texture coordinates a material samples, which decide the image usages and
+// texture indices of the loaded scene.
+static auto GetTextureReferences(const GLTF::Material& material) {
+    using Reference = std::optional<std::pair<std::size_t, std::size_t>>;
+    const auto GetReference = [](const auto& texture_info) -> Reference {
+        if (!texture_info.has_value()) {
+            return std::nullopt;
+        }
+        return std::pair<std::size_t, std::size_t>{texture_info->index, texture_info->texcoord};
+    };
+    const auto& pbr = material.pbr;
+    return std::make_tuple(pbr.has_value(),
+                           pbr.has_value() ? GetReference(pbr->base_color_texture) : Reference{},
+                           pbr.has_value() ? GetReference(pbr->metallic_roughness_texture)
+                                           : Reference{},
+                           GetReference(material.normal_texture),
+                           GetReference(material.occlusion_texture),
+                           GetReference(material.emissive_texture));
+}
+
+// Whether the nodes form the same hierarchy, referencing the same meshes, skins and cameras with
+// the same GPU instances and morph target weights.
+static bool NodeStructureEqual(const GLTF::Node& a, const GLTF::Node& b) {
+    return std::ranges::equal(a.children, b.children) && a.camera == b.camera &&
+           a.mesh == b.mesh && a.skin == b.skin && std::ranges::equal(a.weights, b.weights) &&
+           a.extensions.has_value() == b.extensions.has_value() &&
+           (!a.extensions.has_value() || JSON::Equal(*a.extensions, *b.extensions));
+}
+
+static bool NodeTransformEqual(const GLTF::Node& a, const GLTF::Node& b) {
+    return a.matrix == b.matrix && a.rotation == b.rotation && a.scale == b.scale &&
+           a.translation == b.translation;
+}
+
+SceneChanges DiffGLTF(const GLTFSnapshot& from_snapshot, const GLTFSnapshot& to_snapshot) {
+    const auto& from = from_snapshot.gltf;
+    const auto& to = to_snapshot.gltf;
+
+    SceneChanges changes;
+    changes.resources =
+        from_snapshot.buffer_hashes != to_snapshot.buffer_hashes ||
+        from_snapshot.image_hashes != to_snapshot.image_hashes ||
+        !std::ranges::equal(from.extensions_required, to.extensions_required) ||
+        !ArraysEqual(from.buffers, to.buffers) ||
+        !ArraysEqual(from.buffer_views, to.buffer_views) ||
+        !ArraysEqual(from.accessors, to.accessors) || !ArraysEqual(from.samplers, to.samplers) ||
+        !ArraysEqual(from.images, to.images) || !ArraysEqual(from.textures, to.textures) ||
+        !ArraysEqual(from.meshes, to.meshes) || !ArraysEqual(from.scenes, to.scenes) ||
+        !ArraysEqual(from.animations, to.animations) || !ArraysEqual(from.skins, to.skins) ||
+        from.scene != to.scene ||
+        from.materials.size() != to.materials.size() ||
+        from.nodes.size() != to.nodes.size() || from.cameras.size() != to.cameras.size();
+    if (changes.resources) {
+        return changes;
+    }
+
+    for (std::size_t i = 0; i < from.materials.size(); ++i) {
+        if (GetTextureReferences(from.materials[i]) != GetTextureReferences(to.materials[i])) {
+            changes.resources = true;
+            return changes;
+        }
+        changes.materials |= !JSON::Equal(from.materials[i], to.materials[i]);
+    }
+    for (std::size_t i = 0; i < from.nodes.size(); ++i) {
+        if (!NodeStructureEqual(from.nodes[i], to.nodes[i])) {
+            changes.resources = true;
+            return changes;
+        }
+        changes.transforms |= !NodeTransformEqual(from.nodes[i], to.nodes[i]);
+    }
+    changes.transforms |= !ArraysEqual(from.cameras, to.cameras);
+    // The lights are placed again with the transforms, from their glTF
+    changes.transforms |= from.extensions.has_value() != to.extensions.has_value() ||
+                          (from.extensions.has_value() &&
+                           !JSON::Equal(*from.extensions, *to.extensions));
+    return changes;
+}
+
+bool UpdateScene(Scene& scene, const SceneChanges& changes, const GLTF::GLTF& gltf,
+                 Common::ThreadPool* thread_pool) {
+    if (changes.materials) {
+        std::unordered_map<std::size_t, std::pair<GLSL::PackedMaterial, bool>> updated;
+        for (const auto& [gltf_idx, idx] : scene.material_indices) {
+            Material material{scene.materials[idx]->name, scene.materials[idx]->glsl_material};
+            material.UpdateFactors(gltf.materials[gltf_idx]);
+            const std::pair value{material.GetPackedMaterial(), material.double_sided};
+            const auto [it, inserted] = updated.try_emplace(idx, value);
+            if (!inserted && (it->second.second != value.second ||
+                              std::memcmp(&it->second.first, &value.first,
+                                          sizeof(GLSL::PackedMaterial)) != 0)) {
+                return false;
+            }
+        }
+        for (const auto& [gltf_idx, idx] : scene.material_indices) {
+            scene.materials[idx]->UpdateFactors(gltf.materials[gltf_idx]);
+        }
+    }
+    if (changes.transforms) {
+        if (!scene.rest_poses.empty()) {
+            for (std::size_t i = 0; i < gltf.nodes.size(); ++i) {
+                scene.rest_poses[i] = NodePose{gltf.nodes[i]};
+            }
+        }
+        for (const auto& sub_scene : scene.sub_scenes) {
+            sub_scene->UpdateTransforms(gltf, scene, thread_pool);
+        }
+    }
+    return true;
+}
+
+} // namespace Renderer
@@ -0,0 +1,71 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <vector>
+#include "common/common_types.h"
+#include "core/gltf/gltf.h"
+#include "core/gltf/simdjson.h"
+#include "core/scene_cache.h"
+
+namespace Common {
+class ThreadPool;
+}
+
+namespace GLTF {
+class Container;
+}
+
+namespace Renderer {
+
+struct Scene;
+
+/**
+ * What a loaded glTF is compared against when it is hot reloaded: its own copy of the JSON
+ * description, and hashes of the external files and GLB chunk that data URIs do not cover.
+ * Reading them from the new files is much cheaper than decoding and uploading everything again.
+ */
+class GLTFSnapshot : NonCopyable {
+public:
+    explicit GLTFSnapshot(const GLTF::Container& container);
+    ~GLTFSnapshot();
+
+    // Bytes of the JSON, the buffers of its parser and the hashes, approximately
+    std::size_t GetHostSize() const noexcept;
+    // Of the JSON and the hashes, identifying this version of the glTF on any machine
+    SceneCache::Key GetHash() const;
+
+    // String views refer to the snapshot
+    GLTF::GLTF gltf;
+    // Indexed like the buffers and images. Zero for embedded ones, which the JSON covers.
+    std::vector<SceneCache::Key> buffer_hashes;
+    std::vector<SceneCache::Key> image_hashes;
+
+private:
+    std::vector<char> json_data;
+    simdjson::ondemand::parser parser;
+    simdjson::ondemand::document json;
+};
+
+// What differs between two versions of a glTF
+struct SceneChanges {
+    bool materials{};  // Factors of the materials, which still reference the same textures
+    bool transforms{}; // Transforms of the nodes, and cameras
+    bool resources{};  // Anything else, which requires loading the scene again
+
+    bool Any() const noexcept {
+        return materials || transforms || resources;
+    }
+};
+SceneChanges DiffGLTF(const GLTFSnapshot& from, const GLTFSnapshot& to);
+
+// Applies the material and transform changes to the scene loaded from the previous version.
+// The renderer still has to update the GPU copies. thread_pool may be null. Returns false,
+// changing nothing, if glTF materials merged while loading no longer are the same, so that the
+// scene has to be loaded again instead.
+bool UpdateScene(Scene& scene, const SceneChanges& changes, const GLTF::GLTF& gltf,
+                 Common::ThreadPool* thread_pool);
+
+} // namespace Renderer
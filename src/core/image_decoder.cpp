@@ -0,0 +1,257 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <stb_image.h>
+#include "common/jpeg.h"
+#include "core/image_decoder.h"
+
+#ifdef ENABLE_LIBJPEG_TURBO
+// jpeglib.h needs the definitions of stdio.h first
+#include <jpeglib.h>
+#ifndef JCS_EXTENSIONS
+#error "libjpeg-turbo is required for RGBA output"
+#endif
+#endif
+
+#ifdef ENABLE_SPNG
+#include <spng.h>
+#endif
+
+namespace Renderer {
+
+namespace {
+
+constexpr std::array<u8, 8> PNGSignature{{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'}};
+
+bool IsPNG(std::span<const u8> data) noexcept {
+    return data.size() >= PNGSignature.size() &&
+           std::memcmp(data.data(), PNGSignature.data(), PNGSignature.size()) == 0;
+}
+
+void CheckSize(const ImageDecoder::Info& info, std::span<u8> pixels) {
+    if (pixels.size() != std::size_t{info.width} * info.height * 4) {
+        throw std::runtime_error("Pixels have incorrect size");
+    }
+}
+
+#ifdef ENABLE_LIBJPEG_TURBO
+// libjpeg reports errors by jumping out of its calls with longjmp
+struct JPEGErrorManager {
+    jpeg_error_mgr manager; // First, as libjpeg only knows of it
+    std::jmp_buf jump_buffer;
+    std::array<char, JMSG_LENGTH_MAX> message;
+};
+
+[[noreturn]] void ExitOnJPEGError(j_common_ptr info) {
+    auto* error = reinterpret_cast<JPEGErrorManager*>(info->err);
+    (*info->err->format_message)(info, error->message.data());
+    std::longjmp(error->jump_buffer, 1);
+}
+
+// Warnings of corrupt data, which is decoded anyway
+void IgnoreJPEGMessage(j_common_ptr) {}
+
+/**
+ * Decodes with the SIMD IDCT, upsampling and color conversion of libjpeg-turbo, straight into
+ * the rows of the pixels. Only reads the header when pixels is empty.
+ * Fails with the message rather than throwing, as nothing between setjmp and longjmp may have a
+ * destructor (and libjpeg may not be unwound through).
+ */
+bool DecodeWithLibJPEG(std::span<const u8> data, std::span<u8> pixels, ImageDecoder::Info& info,
+                       std::array<char, JMSG_LENGTH_MAX>& message) {
+    jpeg_decompress_struct decompress;
+    JPEGErrorManager error;
+    decompress.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = ExitOnJPEGError;
+    error.manager.output_message = IgnoreJPEGMessage;
+    if (setjmp(error.jump_buffer)) {
+        jpeg_destroy_decompress(&decompress);
+        message = error.message;
+        return false;
+    }
+
+    jpeg_create_decompress(&decompress);
+    jpeg_mem_src(&decompress, const_cast<u8*>(data.data()),
+                 static_cast<unsigned long>(data.size()));
+    jpeg_read_header(&decompress, TRUE);
+    info = {.width = decompress.image_width, .height = decompress.image_height};
+    if (!pixels.empty()) {
+        if (pixels.size() != std::size_t{info.width} * info.height * 4) {
+            jpeg_destroy_decompress(&decompress);
+            std::snprintf(message.data(), message.size(), "Pixels have incorrect size");
+            return false;
+        }
+        decompress.out_color_space = JCS_EXT_RGBA;
+        jpeg_start_decompress(&decompress);
+        const std::size_t stride = std::size_t{decompress.output_width} * 4;
+        std::array<JSAMPROW, 16> rows;
+        while (decompress.output_scanline < decompress.output_height) {
+            const u32 count = std::min<u32>(static_cast<u32>(rows.size()),
+                                            decompress.output_height - decompress.output_scanline);
+            for (u32 i = 0; i < count; ++i) {
+                rows[i] = pixels.data() + (decompress.output_scanline + i) * stride;
+            }
+            jpeg_read_scanlines(&decompress, rows.data(), count);
+        }
+        jpeg_finish_decompress(&decompress);
+    }
+    jpeg_destroy_decompress(&decompress);
+    return true;
+}
+
+class LibJPEGTurboDecoder final : public ImageDecoder {
+public:
+    const char* GetName() const noexcept override {
+        return "libjpeg-turbo";
+    }
+
+    bool Accepts(std::span<const u8> file_data) const noexcept override {
+        return Common::IsJPEG(file_data);
+    }
+
+    Info GetInfo(std::span<const u8> file_data) const override {
+        Info info;
+        Run(file_data, {}, info);
+        return info;
+    }
+
+    void Decode(std::span<const u8> file_data, std::span<u8> pixels) const override {
+        Info info;
+        Run(file_data, pixels, info);
+    }
+
+private:
+    static void Run(std::span<const u8> file_data, std::span<u8> pixels, Info& info) {
+        std::array<char, JMSG_LENGTH_MAX> message{};
+        if (!DecodeWithLibJPEG(file_data, pixels, info, message)) {
+            throw std::runtime_error(message.data());
+        }
+    }
+};
+#endif
+
+#ifdef ENABLE_SPNG
+// Decodes with the SIMD filters of spng (and the inflate of the zlib it is built with)
+class SPNGDecoder final : public ImageDecoder {
+public:
+    const char* GetName() const noexcept override {
+        return "spng";
+    }
+
+    bool Accepts(std::span<const u8> file_data) const noexcept override {
+        return IsPNG(file_data);
+    }
+
+    Info GetInfo(std::span<const u8> file_data) const override {
+        const auto context = CreateContext(file_data);
+        spng_ihdr header;
+        Check(spng_get_ihdr(context.get(), &header));
+        return {.width = header.width, .height = header.height};
+    }
+
+    void Decode(std::span<const u8> file_data, std::span<u8> pixels) const override {
+        const auto context = CreateContext(file_data);
+        std::size_t size;
+        Check(spng_decoded_image_size(context.get(), SPNG_FMT_RGBA8, &size));
+        if (size != pixels.size()) {
+            throw std::runtime_error("Pixels have incorrect size");
+        }
+        // Applies the transparency chunk, like stb_image, but not the gamma
+        Check(spng_decode_image(context.get(), pixels.data(), pixels.size(), SPNG_FMT_RGBA8,
+                                SPNG_DECODE_TRNS));
+    }
+
+private:
+    using Context = std::unique_ptr<spng_ctx, decltype(&spng_ctx_free)>;
+
+    static void Check(int result) {
+        if (result != 0) {
+            throw std::runtime_error(spng_strerror(result));
+        }
+    }
+
+    static Context CreateContext(std::span<const u8> file_data) {
+        Context context{spng_ctx_new(0), &spng_ctx_free};
+        if (!context) {
+            throw std::runtime_error("Failed to create spng context");
+        }
+        Check(spng_set_png_buffer(context.get(), file_data.data(), file_data.size()));
+        return context;
+    }
+};
+#endif
+
+class StbImageDecoder final : public ImageDecoder {
+public:
+    const char* GetName() const noexcept override {
+        return "stb_image";
+    }
+
+    bool Accepts(std::span<const u8>) const noexcept override {
+        return true;
+    }
+
+    Info GetInfo(std::span<const u8> file_data) const override {
+        int width, height, channels_in_file;
+        if (!stbi_info_from_memory(file_data.data(), static_cast<int>(file_data.size()), &width,
+                                   &height, &channels_in_file)) {
+            throw std::runtime_error(stbi_failure_reason());
+        }
+        return {.width = static_cast<u32>(width), .height = static_cast<u32>(height)};
+    }
+
+    // stb_image allocates the pixels itself, which are copied
+    void Decode(std::span<const u8> file_data, std::span<u8> pixels) const override {
+        int width, height, channels_in_file;
+        const std::unique_ptr<stbi_uc, decltype(&stbi_image_free)> decoded{
+            stbi_load_from_memory(file_data.data(), static_cast<int>(file_data.size()), &width,
+                                  &height, &channels_in_file, STBI_rgb_alpha),
+            &stbi_image_free};
+        if (!decoded) {
+            throw std::runtime_error(stbi_failure_reason());
+        }
+        CheckSize({.width = static_cast<u32>(width), .height = static_cast<u32>(height)}, pixels);
+        std::memcpy(pixels.data(), decoded.get(), pixels.size());
+    }
+};
+
+} // namespace
+
+std::span<const ImageDecoder* const> GetImageDecoders() {
+    static const std::vector<const ImageDecoder*> decoders = [] {
+        std::vector<const ImageDecoder*> result;
+#ifdef ENABLE_LIBJPEG_TURBO
+        static const LibJPEGTurboDecoder libjpeg_turbo;
+        result.push_back(&libjpeg_turbo);
+#endif
+#ifdef ENABLE_SPNG
+        static const SPNGDecoder spng;
+        result.push_back(&spng);
+#endif
+        static const StbImageDecoder stb_image;
+        result.push_back(&stb_image);
+        return result;
+    }();
+    return decoders;
+}
+
+LoadProfiler::Stage GetImageDecodeStage(std::span<const u8> file_data) noexcept {
+    if (Common::IsJPEG(file_data)) {
+        return LoadProfiler::Stage::JPEGDecode;
+    }
+    if (IsPNG(file_data)) {
+        return LoadProfiler::Stage::PNGDecode;
+    }
+    return LoadProfiler::Stage::OtherImageDecode;
+}
+
+} // namespace Renderer
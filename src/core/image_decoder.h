@@ -0,0 +1,43 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include "common/common_types.h"
+#include "core/load_profiler.h"
+
+namespace Renderer {
+
+/**
+ * Decoder of image files to RGBA8, writing the pixels into memory provided by the caller.
+ * GetImageDecoders lists the decoders of the optional SIMD libraries first (libjpeg-turbo with
+ * ENABLE_LIBJPEG_TURBO, spng with ENABLE_SPNG), then stb_image, which reads any format it
+ * supports but decodes into memory of its own and is copied from. Thread safe.
+ */
+class ImageDecoder : NonCopyable {
+public:
+    struct Info {
+        u32 width{};
+        u32 height{};
+    };
+
+    virtual ~ImageDecoder() = default;
+
+    virtual const char* GetName() const noexcept = 0;
+    // Whether the file is of a format of the decoder, from its signature
+    virtual bool Accepts(std::span<const u8> file_data) const noexcept = 0;
+    // Reads the extent of the image from its header. Throws std::runtime_error on failure.
+    virtual Info GetInfo(std::span<const u8> file_data) const = 0;
+    // Decodes the image into pixels, of the width * height * 4 bytes of GetInfo.
+    // Throws std::runtime_error on failure, leaving the pixels undefined.
+    virtual void Decode(std::span<const u8> file_data, std::span<u8> pixels) const = 0;
+};
+
+// In the order to try them in
+std::span<const ImageDecoder* const> GetImageDecoders();
+// Of the format of the file (JPEGDecode, PNGDecode or OtherImageDecode), for the load profile
+LoadProfiler::Stage GetImageDecodeStage(std::span<const u8> file_data) noexcept;
+
+} // namespace Renderer
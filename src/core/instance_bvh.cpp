@@ -0,0 +1,162 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include "common/process_memory.h"
+#include "core/instance_bvh.h"
+
+namespace Renderer {
+
+Frustum::Frustum(const glm::mat4& view_proj) {
+    const glm::mat4 m = glm::transpose(view_proj);
+    const std::array<glm::vec4, 5> planes{{
+        m[3] + m[0],
+        m[3] - m[0],
+        m[3] + m[1],
+        m[3] - m[1],
+        m[3] + m[2],
+    }};
+    for (std::size_t i = 0; i < NumLanes; ++i) {
+        const glm::vec4 plane = i < planes.size() ? planes[i] : glm::vec4{0, 0, 0, 1};
+        x[i] = plane.x;
+        y[i] = plane.y;
+        z[i] = plane.z;
+        w[i] = plane.w;
+    }
+}
+
+Frustum::Result Frustum::Test(const GLSL::AABB& bounds) const noexcept {
+    const glm::vec3& min_point = bounds.min_point;
+    const glm::vec3& max_point = bounds.max_point;
+    bool outside = false;
+    bool intersecting = false;
+    for (std::size_t i = 0; i < NumLanes; ++i) {
+        // The corners furthest along and against the normal
+        const float far_dist = x[i] * (x[i] >= 0 ? max_point.x : min_point.x) +
+                               y[i] * (y[i] >= 0 ? max_point.y : min_point.y) +
+                               z[i] * (z[i] >= 0 ? max_point.z : min_point.z) + w[i];
+        const float near_dist = x[i] * (x[i] >= 0 ? min_point.x : max_point.x) +
+                                y[i] * (y[i] >= 0 ? min_point.y : max_point.y) +
+                                z[i] * (z[i] >= 0 ? min_point.z : max_point.z) + w[i];
+        outside |= far_dist < 0;
+        intersecting |= near_dist < 0;
+    }
+    return outside ? Result::Outside : intersecting ? Result::Intersecting : Result::Inside;
+}
+
+static bool IsFinite(const GLSL::AABB& bounds) {
+    return !glm::any(glm::isinf(bounds.min_point)) && !glm::any(glm::isinf(bounds.max_point));
+}
+
+static GLSL::AABB Merge(const GLSL::AABB& a, const GLSL::AABB& b) {
+    return {
+        .min_point = glm::min(a.min_point, b.min_point),
+        .max_point = glm::max(a.max_point, b.max_point),
+    };
+}
+
+InstanceBVH::InstanceBVH(std::span<const GLSL::AABB> instance_bounds) {
+    for (u32 i = 0; i < instance_bounds.size(); ++i) {
+        (IsFinite(instance_bounds[i]) ? items : unbounded).emplace_back(i);
+    }
+    if (items.empty()) {
+        return;
+    }
+
+    nodes.reserve(2 * (items.size() / MaxLeafSize + 1));
+    nodes.emplace_back();
+    Build(0, 0, static_cast<u32>(items.size()), instance_bounds);
+
+    item_bounds.reserve(items.size());
+    for (const u32 item : items) {
+        item_bounds.emplace_back(instance_bounds[item]);
+    }
+}
+
+InstanceBVH::~InstanceBVH() = default;
+
+void InstanceBVH::Build(u32 node_idx, u32 begin, u32 end,
+                        std::span<const GLSL::AABB> instance_bounds) {
+    const auto Centroid = [&instance_bounds](u32 item) {
+        return (instance_bounds[item].min_point + instance_bounds[item].max_point) * 0.5f;
+    };
+
+    GLSL::AABB bounds = instance_bounds[items[begin]];
+    glm::vec3 centroid_min = Centroid(items[begin]);
+    glm::vec3 centroid_max = centroid_min;
+    for (u32 i = begin + 1; i < end; ++i) {
+        bounds = Merge(bounds, instance_bounds[items[i]]);
+        centroid_min = glm::min(centroid_min, Centroid(items[i]));
+        centroid_max = glm::max(centroid_max, Centroid(items[i]));
+    }
+    if (end - begin <= MaxLeafSize) {
+        nodes[node_idx] = {
+            .bounds = bounds,
+            .begin = begin,
+            .end = end,
+        };
+        return;
+    }
+
+    // Split at the median along the longest axis of the centroids
+    const glm::vec3 extent = centroid_max - centroid_min;
+    const int axis =
+        extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    const u32 mid = begin + (end - begin) / 2;
+    std::nth_element(
+        items.begin() + begin, items.begin() + mid, items.begin() + end,
+        [&Centroid, axis](u32 a, u32 b) { return Centroid(a)[axis] < Centroid(b)[axis]; });
+
+    const auto first_child = static_cast<u32>(nodes.size());
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[node_idx] = {
+        .bounds = bounds,
+        .first_child = first_child,
+        .begin = begin,
+        .end = end,
+    };
+    Build(first_child, begin, mid, instance_bounds);
+    Build(first_child + 1, mid, end, instance_bounds);
+}
+
+void InstanceBVH::Cull(const Frustum& frustum, std::vector<u32>& visible) const {
+    visible.insert(visible.end(), unbounded.begin(), unbounded.end());
+    if (nodes.empty()) {
+        return;
+    }
+
+    // Median splits keep the depth logarithmic
+    std::array<u32, 64> stack;
+    std::size_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        const Node& node = nodes[stack[--stack_size]];
+        const auto result = frustum.Test(node.bounds);
+        if (result == Frustum::Result::Outside) {
+            continue;
+        }
+        if (result == Frustum::Result::Inside) {
+            visible.insert(visible.end(), items.begin() + node.begin, items.begin() + node.end);
+            continue;
+        }
+        if (node.first_child != 0) {
+            stack[stack_size++] = node.first_child;
+            stack[stack_size++] = node.first_child + 1;
+            continue;
+        }
+        for (u32 i = node.begin; i < node.end; ++i) {
+            if (frustum.Test(item_bounds[i]) != Frustum::Result::Outside) {
+                visible.emplace_back(items[i]);
+            }
+        }
+    }
+}
+
+std::size_t InstanceBVH::GetHostSize() const noexcept {
+    return Common::GetHeapSize(nodes) + Common::GetHeapSize(items) +
+           Common::GetHeapSize(item_bounds) + Common::GetHeapSize(unbounded);
+}
+
+} // namespace Renderer
@@ -0,0 +1,73 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <span>
+#include <vector>
+#include <glm/glm.hpp>
+#include "common/common_types.h"
+#include "core/shaders/scene_glsl.h"
+
+namespace Renderer {
+
+// The side and near planes of a view frustum, like the culling pass of the rasterizer tests.
+// The far plane is left out, as the projection may be infinite.
+class Frustum {
+public:
+    explicit Frustum(const glm::mat4& view_proj);
+
+    enum class Result {
+        Outside,
+        Intersecting,
+        Inside,
+    };
+    Result Test(const GLSL::AABB& bounds) const noexcept;
+
+private:
+    // As a structure of arrays, padded with planes that pass everything, to be vectorized
+    static constexpr std::size_t NumLanes = 8;
+    std::array<float, NumLanes> x{};
+    std::array<float, NumLanes> y{};
+    std::array<float, NumLanes> z{};
+    std::array<float, NumLanes> w{};
+};
+
+/**
+ * Bounding volume hierarchy over the world space bounds of the instances of a sub scene, for
+ * culling them on the CPU. Built top down with median splits, so that the instances of every
+ * subtree are contiguous. Instances with infinite bounds are kept out of the tree and are
+ * always visible.
+ */
+class InstanceBVH : NonCopyable {
+public:
+    static constexpr std::size_t MaxLeafSize = 4;
+
+    explicit InstanceBVH(std::span<const GLSL::AABB> instance_bounds);
+    ~InstanceBVH();
+
+    // Appends the instances that may be visible, in no particular order.
+    void Cull(const Frustum& frustum, std::vector<u32>& visible) const;
+
+    // Bytes of the tree on the heap
+    std::size_t GetHostSize() const noexcept;
+
+private:
+    struct Node {
+        GLSL::AABB bounds;
+        u32 first_child{}; // The second one follows it. Zero for leaves, as the root is 0.
+        u32 begin{};       // Range of the subtree in items
+        u32 end{};
+    };
+
+    void Build(u32 node_idx, u32 begin, u32 end, std::span<const GLSL::AABB> instance_bounds);
+
+    std::vector<Node> nodes;
+    std::vector<u32> items;              // Instance indices
+    std::vector<GLSL::AABB> item_bounds; // Indexed like items, for the leaves
+    std::vector<u32> unbounded;          // Instances with infinite bounds
+};
+
+} // namespace Renderer
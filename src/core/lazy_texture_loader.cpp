@@ -0,0 +1,176 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <iterator>
+#include <span>
+#include <spdlog/spdlog.h>
+#include "core/lazy_texture_loader.h"
+#include "core/scene.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_texture_streamer.h"
+#include "core/vulkan/vulkan_upload_ring.h"
+
+namespace Renderer {
+
+LazyTextureLoader::LazyTextureLoader(VulkanDevice& device_)
+    : device(device_), upload_batch(std::make_unique<VulkanTextureUploadBatch>(device)) {
+
+    // Indexed by Placeholder
+    static constexpr std::array<std::array<u8, 4>, 3> PlaceholderTexels{{
+        {128, 128, 128, 255},
+        {128, 128, 255, 255},
+        {255, 255, 0, 255},
+    }};
+    for (std::size_t i = 0; i < placeholders.size(); ++i) {
+        const std::array<std::span<const u8>, 1> levels{PlaceholderTexels[i]};
+        placeholders[i] = std::make_unique<VulkanTexture>(
+            device,
+            std::make_unique<DecodedTexture>(1, 1, 1, vk::Format::eR8G8B8A8Unorm,
+                                             vk::ComponentMapping{}, levels, nullptr),
+            *upload_batch);
+    }
+    upload_batch->Flush();
+}
+
+LazyTextureLoader::~LazyTextureLoader() = default;
+
+const VulkanTexture& LazyTextureLoader::GetPlaceholder(Placeholder placeholder) const {
+    return *placeholders[static_cast<std::size_t>(placeholder)];
+}
+
+void LazyTextureLoader::Add(Image& image, DecodeFunc decode, std::size_t size) {
+    std::scoped_lock lock{mutex};
+    pending.push_back({
+        .image = &image,
+        .decode = std::move(decode),
+        .size = size,
+    });
+    pending_size += size;
+}
+
+void LazyTextureLoader::Start(const Scene& scene) {
+    for (std::size_t i = 0; i < scene.textures.size(); ++i) {
+        Image* image = scene.textures[i]->image.get();
+        image_textures[image].emplace_back(i);
+    }
+    remaining = pending.size();
+    worker = std::jthread{[this](std::stop_token stop_token) { WorkerThread(stop_token); }};
+}
+
+void LazyTextureLoader::WorkerThread(std::stop_token stop_token) {
+    while (true) {
+        Image* image{};
+        DecodeFunc decode;
+        std::size_t size{};
+        {
+            std::unique_lock lock{mutex};
+            if (!cv.wait(lock, stop_token, [this] {
+                    return !pending.empty() && decoded.size() < MaxDecodedImages;
+                })) {
+                return; // Stop requested
+            }
+            // Sampled images by when they were first sampled, then the rest in order
+            const auto it = std::ranges::min_element(pending, {}, &Entry::first_sampled);
+            image = it->image;
+            decode = std::move(it->decode);
+            size = it->size;
+            pending.erase(it);
+        }
+
+        std::unique_ptr<DecodedTexture> data;
+        try {
+            data = decode();
+        } catch (const std::exception& e) {
+            SPDLOG_ERROR("Failed to load image {}: {}", image->name, e.what());
+        }
+        decode = {}; // Releases the encoded image
+        pending_size -= size;
+
+        std::scoped_lock lock{mutex};
+        decoded.push_back({
+            .image = image,
+            .data = std::move(data),
+        });
+    }
+}
+
+std::vector<std::size_t> LazyTextureLoader::Poll(const VulkanTextureStreamer& streamer) {
+    ++poll_count;
+
+    std::vector<std::size_t> changed;
+    std::erase_if(uploading, [this, &changed](Uploading& upload) {
+        if (!device.upload_ring->IsComplete(upload.timeline_value)) {
+            return false;
+        }
+        upload.image->texture = std::move(upload.texture);
+        const auto& textures = image_textures[upload.image];
+        changed.insert(changed.end(), textures.begin(), textures.end());
+        --remaining;
+        return true;
+    });
+
+    std::vector<Decoded> to_upload;
+    {
+        std::scoped_lock lock{mutex};
+        for (auto& entry : pending) {
+            if (entry.first_sampled != std::numeric_limits<u64>::max()) {
+                continue;
+            }
+            const auto& textures = image_textures[entry.image];
+            if (std::ranges::any_of(textures, [&streamer](std::size_t texture_idx) {
+                    return streamer.WasSampled(texture_idx);
+                })) {
+                entry.first_sampled = poll_count;
+            }
+        }
+
+        // Limit the uploads recorded per frame, but always make progress
+        std::size_t upload_size = 0;
+        auto it = decoded.begin();
+        for (; it != decoded.end(); ++it) {
+            const std::size_t size = it->data ? it->data->GetTotalSize() : 0;
+            if (upload_size != 0 && upload_size + size > MaxUploadPerPoll) {
+                break;
+            }
+            upload_size += size;
+        }
+        std::move(decoded.begin(), it, std::back_inserter(to_upload));
+        decoded.erase(decoded.begin(), it);
+    }
+    if (to_upload.empty()) {
+        return changed;
+    }
+    cv.notify_one();
+
+    std::vector<Uploading> uploads;
+    for (auto& [image, data] : to_upload) {
+        if (!data) { // Keeps the placeholder
+            --remaining;
+            continue;
+        }
+        uploads.push_back({
+            .image = image,
+            .texture = std::make_unique<VulkanTexture>(device, std::move(data), *upload_batch),
+        });
+    }
+    upload_batch->Flush();
+    const u64 timeline_value = device.upload_ring->Flush();
+    for (auto& upload : uploads) {
+        upload.timeline_value = timeline_value;
+        uploading.emplace_back(std::move(upload));
+    }
+    return changed;
+}
+
+bool LazyTextureLoader::IsDone() const {
+    return remaining == 0;
+}
+
+std::size_t LazyTextureLoader::GetPendingSize() const noexcept {
+    return pending_size;
+}
+
+} // namespace Renderer
@@ -0,0 +1,111 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class DecodedTexture;
+class Image;
+class VulkanDevice;
+class VulkanTexture;
+class VulkanTextureStreamer;
+class VulkanTextureUploadBatch;
+struct Scene;
+
+/**
+ * Loads images in the background after the rest of the scene, so that rendering can start
+ * right away. Until then, their descriptors point to a 1x1 placeholder.
+ *
+ * Images are decoded on a worker thread, those sampled on screen first (according to the
+ * texture streaming feedback) and the others in the order they were referenced. The render
+ * thread uploads them, and once the uploads have completed, installs them into their Image so
+ * that the renderer can patch the descriptors.
+ */
+class LazyTextureLoader : NonCopyable {
+public:
+    // Roughly what the image is expected to contain, to pick an unobtrusive placeholder
+    enum class Placeholder {
+        Color,  // Mid grey
+        Normal, // Flat normal
+        Data,   // No occlusion, rough, not metallic
+    };
+    using DecodeFunc = std::function<std::unique_ptr<DecodedTexture>()>;
+
+    // Decoded images waiting for an upload
+    static constexpr std::size_t MaxDecodedImages = 4;
+    static constexpr std::size_t MaxUploadPerPoll = 64 * 1024 * 1024;
+
+    explicit LazyTextureLoader(VulkanDevice& device);
+    ~LazyTextureLoader();
+
+    const VulkanTexture& GetPlaceholder(Placeholder placeholder) const;
+
+    // Queues the image, which samples its placeholder until loaded. decode runs on the worker
+    // thread and must not refer to the SceneLoader. size is that of the encoded image it holds.
+    // Thread safe.
+    void Add(Image& image, DecodeFunc decode, std::size_t size);
+    // Starts decoding, once the scene has been loaded.
+    void Start(const Scene& scene);
+
+    // Called by the render thread before recording each frame. Uploads decoded images, and
+    // installs those whose uploads have completed. Returns the indices of the scene
+    // textures whose images have changed.
+    std::vector<std::size_t> Poll(const VulkanTextureStreamer& streamer);
+    // Whether every image has been installed
+    bool IsDone() const;
+    // Bytes of the encoded images that are still to be decoded
+    std::size_t GetPendingSize() const noexcept;
+
+private:
+    struct Entry {
+        Image* image{};
+        DecodeFunc decode;
+        std::size_t size{};
+        u64 first_sampled = std::numeric_limits<u64>::max(); // Poll count, for the priority
+    };
+    struct Decoded {
+        Image* image{};
+        std::unique_ptr<DecodedTexture> data; // Null if decoding failed
+    };
+    struct Uploading {
+        Image* image{};
+        std::unique_ptr<VulkanTexture> texture;
+        u64 timeline_value{};
+    };
+
+    void WorkerThread(std::stop_token stop_token);
+
+    VulkanDevice& device;
+    std::unique_ptr<VulkanTextureUploadBatch> upload_batch;
+    std::array<std::unique_ptr<VulkanTexture>, 3> placeholders;
+
+    // Scene textures of each image
+    std::unordered_map<const Image*, std::vector<std::size_t>> image_textures;
+    std::vector<Uploading> uploading;
+    u64 poll_count{};
+    std::size_t remaining{}; // Neither installed nor failed
+
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    std::vector<Entry> pending; // In the order added
+    std::atomic<std::size_t> pending_size{};
+    std::vector<Decoded> decoded;
+
+    std::jthread worker; // Declared last to stop before the rest is destroyed
+};
+
+} // namespace Renderer
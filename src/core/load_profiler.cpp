@@ -0,0 +1,163 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <array>
+#include <spdlog/spdlog.h>
+#include "common/log.h"
+#include "core/load_profiler.h"
+
+namespace Renderer {
+
+// Indexed by Stage
+static constexpr std::array<const char*, static_cast<std::size_t>(LoadProfiler::Stage::Count)>
+    StageNames{{
+        "json_parse",
+        "node_traversal",
+        "buffer_io",
+        "draco_decode",
+        "image_decode",
+        "jpeg_decode",
+        "png_decode",
+        "other_image_decode",
+        "mip_generation",
+        "texture_compression",
+        "tangent_generation",
+        "lod_generation",
+        "meshlet_building",
+        "index_optimization",
+        "opacity_micromap_baking",
+        "upload_submit",
+        "blas_build",
+        "blas_compaction",
+        "tlas_build",
+    }};
+
+static std::atomic<const char*> g_last_stage{};
+static std::atomic<u64> g_completed_scopes{};
+
+#ifdef ENABLE_TRACY
+// Zones need source locations of static storage
+static constexpr auto StageLocations = [] {
+    std::array<tracy::SourceLocationData, StageNames.size()> locations{};
+    for (std::size_t i = 0; i < StageNames.size(); ++i) {
+        locations[i] = {
+            .name = StageNames[i],
+            .function = "LoadProfiler::Scope",
+            .file = __FILE__,
+            .line = static_cast<uint32_t>(__LINE__),
+        };
+    }
+    return locations;
+}();
+#endif
+
+// CPU time consumed by the calling thread
+static std::chrono::nanoseconds GetThreadCPUTime() {
+#ifdef _WIN32
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time,
+                        &user_time)) {
+        return {};
+    }
+    const auto ToTicks = [](const FILETIME& time) {
+        return (static_cast<u64>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+    };
+    // In units of 100ns
+    return std::chrono::nanoseconds{(ToTicks(kernel_time) + ToTicks(user_time)) * 100};
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0) {
+        return {};
+    }
+    return std::chrono::seconds{time.tv_sec} + std::chrono::nanoseconds{time.tv_nsec};
+#endif
+}
+
+LoadProfiler::Scope::Scope(LoadProfiler* profiler_, Stage stage_, u64 bytes_)
+    : profiler(profiler_), stage(stage_), bytes(bytes_) {
+#ifdef ENABLE_TRACY
+    zone.emplace(&StageLocations[static_cast<std::size_t>(stage)]);
+#endif
+    if (profiler) {
+        wall_start = std::chrono::steady_clock::now();
+        cpu_start = GetThreadCPUTime();
+        g_last_stage.store(StageNames[static_cast<std::size_t>(stage)],
+                           std::memory_order_relaxed);
+    }
+}
+
+LoadProfiler::Scope::~Scope() {
+    if (!profiler) {
+        return;
+    }
+    const auto wall_time = std::chrono::steady_clock::now() - wall_start;
+    const auto cpu_time = GetThreadCPUTime() - cpu_start;
+
+    auto& stats = profiler->stages[static_cast<std::size_t>(stage)];
+    stats.count.fetch_add(1, std::memory_order_relaxed);
+    stats.wall_ns.fetch_add(
+        static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(wall_time).count()),
+        std::memory_order_relaxed);
+    stats.cpu_ns.fetch_add(static_cast<u64>(cpu_time.count()), std::memory_order_relaxed);
+    stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    g_completed_scopes.fetch_add(1, std::memory_order_relaxed);
+}
+
+LoadProfiler::LoadProfiler() : start(std::chrono::steady_clock::now()) {}
+
+LoadProfiler::~LoadProfiler() = default;
+
+LoadProfiler::Progress LoadProfiler::GetProgress() noexcept {
+    return {
+        .stage = g_last_stage.load(std::memory_order_relaxed),
+        .completed = g_completed_scopes.load(std::memory_order_relaxed),
+    };
+}
+
+void LoadProfiler::AddBytes(Stage stage, u64 bytes) {
+    stages[static_cast<std::size_t>(stage)].bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void LoadProfiler::AddGPUTime(Stage stage, std::chrono::nanoseconds time) {
+    stages[static_cast<std::size_t>(stage)].gpu_ns.fetch_add(static_cast<u64>(time.count()),
+                                                             std::memory_order_relaxed);
+}
+
+std::string LoadProfiler::GetReport() const {
+    const auto ToMilliseconds = [](u64 ns) { return static_cast<double>(ns) / 1e6; };
+
+    const auto total_time = std::chrono::steady_clock::now() - start;
+    std::string report = fmt::format(
+        R"({{"wall_ms":{:.3f},"stages":{{)",
+        std::chrono::duration<double, std::milli>{total_time}.count());
+    bool first = true;
+    for (std::size_t i = 0; i < stages.size(); ++i) {
+        const auto& stats = stages[i];
+        if (stats.count == 0 && stats.gpu_ns == 0) {
+            continue;
+        }
+        report += fmt::format(
+            R"({}"{}":{{"count":{},"wall_ms":{:.3f},"cpu_ms":{:.3f},"gpu_ms":{:.3f},"bytes":{}}})",
+            first ? "" : ",", StageNames[i], stats.count.load(), ToMilliseconds(stats.wall_ns),
+            ToMilliseconds(stats.cpu_ns), ToMilliseconds(stats.gpu_ns), stats.bytes.load());
+        first = false;
+    }
+    report += "}}";
+    return report;
+}
+
+void LoadProfiler::Report() const {
+    Common::FlushLogSummaries();
+    SPDLOG_INFO("Load profile: {}", GetReport());
+}
+
+} // namespace Renderer
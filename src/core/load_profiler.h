@@ -0,0 +1,104 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <string>
+#include "common/common_types.h"
+#include "common/profiling.h"
+
+namespace Renderer {
+
+/**
+ * Timing breakdown of scene loading by stage, reported as a JSON summary once loading is
+ * done so that it can be compared across asset versions.
+ *
+ * For each stage, wall and CPU time are summed over every scope that ran it. Stages running
+ * as tasks on the loader thread pool overlap, so their wall times may add up to more than the
+ * total. GPU time comes from timestamp queries, where available. Thread safe.
+ */
+class LoadProfiler : NonCopyable {
+public:
+    // JPEGDecode, PNGDecode and OtherImageDecode time the decoding of the image files within
+    // ImageDecode by format, with the bytes they decode, so that their throughput can be
+    // compared. The hot loops of the other stages are covered by the benchmarks instead (see
+    // src/benchmarks), as scopes of their own would cost more than them on small inputs.
+    enum class Stage : std::size_t {
+        JSONParse,
+        NodeTraversal,
+        BufferIO,
+        DracoDecode,
+        ImageDecode,
+        JPEGDecode,
+        PNGDecode,
+        OtherImageDecode,
+        MipGeneration,
+        TextureCompression,
+        TangentGeneration,
+        LODGeneration,
+        MeshletBuilding,
+        IndexOptimization,
+        OpacityMicromapBaking,
+        UploadSubmit,
+        BLASBuild,
+        BLASCompaction,
+        TLASBuild,
+        Count,
+    };
+
+    // Times the enclosing block on the calling thread, which is also a Tracy zone of the stage
+    // (see common/profiling.h). Does nothing else if the profiler is null.
+    class Scope : NonCopyable {
+    public:
+        explicit Scope(LoadProfiler* profiler, Stage stage, u64 bytes = 0);
+        ~Scope();
+
+    private:
+        LoadProfiler* profiler{};
+        Stage stage{};
+        u64 bytes{};
+        std::chrono::steady_clock::time_point wall_start;
+        std::chrono::nanoseconds cpu_start{};
+#ifdef ENABLE_TRACY
+        std::optional<tracy::ScopedZone> zone;
+#endif
+    };
+
+    explicit LoadProfiler();
+    ~LoadProfiler();
+
+    // Of all the profilers, for progress reports from other threads while loading
+    struct Progress {
+        const char* stage{}; // Name of the one entered last, null if none has been
+        u64 completed{};     // Scopes exited
+    };
+    static Progress GetProgress() noexcept;
+
+    void AddBytes(Stage stage, u64 bytes);
+    void AddGPUTime(Stage stage, std::chrono::nanoseconds time);
+
+    // The wall time since construction, and the stages that ran
+    std::string GetReport() const;
+    // Logs the report, after the summaries of the messages logged while loading (see
+    // Common::FlushLogSummaries).
+    void Report() const;
+
+private:
+    struct StageStats {
+        std::atomic<u64> count{};
+        std::atomic<u64> wall_ns{};
+        std::atomic<u64> cpu_ns{};
+        std::atomic<u64> gpu_ns{};
+        std::atomic<u64> bytes{};
+    };
+
+    std::chrono::steady_clock::time_point start;
+    std::array<StageStats, static_cast<std::size_t>(Stage::Count)> stages;
+};
+
+} // namespace Renderer
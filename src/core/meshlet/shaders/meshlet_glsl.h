@@ -0,0 +1,53 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef MESHLET_GLSL_H
+#define MESHLET_GLSL_H
+
+#include "core/vulkan/host_glsl_shared.h"
+
+// A primitive of a mesh instance, drawn by task workgroups of up to TaskGroupSize meshlets
+BEGIN_STRUCT(MeshletDraw)
+
+uint instance;      // In the sub scene
+uint material;      // In the scene
+uint first_meshlet; // Of the primitive
+uint num_meshlets;
+uint first_vertex;  // Of the primitive, which its meshlet vertices are relative to
+uint cone_culling;  // Whether back facing meshlets may be culled
+INSERT_PADDING(2)
+
+END_STRUCT(MeshletDraw)
+
+// See Common::Meshlet, with the offsets into the buffers of the whole scene
+BEGIN_STRUCT(MeshletInfo)
+
+uint first_vertex;   // In the meshlet vertex indices
+uint first_triangle; // In the meshlet triangles
+uint vertex_count;
+uint triangle_count;
+vec3 center; // In mesh space
+float radius;
+vec3 cone_axis;
+float cone_cutoff;
+
+END_STRUCT(MeshletInfo)
+
+BEGIN_STRUCT(MeshletUniforms)
+
+mat4 view_proj;
+vec3 camera_position;
+INSERT_PADDING(1)
+
+END_STRUCT(MeshletUniforms)
+
+// Draws are split into more task workgroups than a single dispatch can have
+BEGIN_STRUCT(MeshletPushConstant)
+
+uint first_task_group;
+INSERT_PADDING(3)
+
+END_STRUCT(MeshletPushConstant)
+
+#endif
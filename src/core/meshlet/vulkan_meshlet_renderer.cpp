@@ -0,0 +1,762 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <spdlog/spdlog.h>
+#include "common/profiling.h"
+#include "common/ranges.h"
+#include "common/temp_ptr.h"
+#include "core/instance_bvh.h"
+#include "core/lazy_texture_loader.h"
+#include "core/load_profiler.h"
+#include "core/meshlet/shaders/meshlet_glsl.h"
+#include "core/meshlet/vulkan_meshlet_renderer.h"
+#include "core/scene.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_context.h"
+#include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_frame_allocator.h"
+#include "core/vulkan/vulkan_frames_in_flight.hpp"
+#include "core/vulkan/vulkan_graphics_pipeline.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_profiler.h"
+#include "core/vulkan/vulkan_render_target_heap.h"
+#include "core/vulkan/vulkan_shader.h"
+#include "core/vulkan/vulkan_swapchain.h"
+#include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_texture_streamer.h"
+#include "core/vulkan/vulkan_upload_ring.h"
+
+namespace Renderer {
+
+VulkanMeshletRenderer::VulkanMeshletRenderer(bool enable_validation_layers,
+                                             std::vector<const char*> frontend_required_extensions)
+    : VulkanRenderer(enable_validation_layers, std::move(frontend_required_extensions)) {}
+
+VulkanMeshletRenderer::~VulkanMeshletRenderer() {
+    device->WaitIdle();
+}
+
+VulkanRenderer::OffscreenImageInfo VulkanMeshletRenderer::GetOffscreenImageInfo() const {
+    return {
+        .format = swap_chain->surface_format.format,
+        .usage = vk::ImageUsageFlagBits::eColorAttachment,
+        .dst_stage_mask = vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+        .dst_access_mask = vk::AccessFlagBits2::eColorAttachmentWrite,
+    };
+}
+
+VulkanRenderer::DeviceRequirements VulkanMeshletRenderer::GetDeviceRequirements() const {
+    return {
+        .extensions =
+            {
+                VK_EXT_MESH_SHADER_EXTENSION_NAME,
+                VK_EXT_ROBUSTNESS_2_EXTENSION_NAME,
+            },
+        .features =
+            Helpers::GenericStructureChain{
+                vk::PhysicalDeviceFeatures2{
+                    .features =
+                        {
+                            .samplerAnisotropy = VK_TRUE,
+                            // For the material textures
+                            .shaderSampledImageArrayDynamicIndexing = VK_TRUE,
+                            // For the texture streaming feedback
+                            .fragmentStoresAndAtomics = VK_TRUE,
+                        },
+                },
+                vk::PhysicalDeviceVulkan12Features{
+                    .runtimeDescriptorArray = VK_TRUE,
+                    .timelineSemaphore = VK_TRUE,
+                    // We don't need this in itself, but we enabled it on VMA
+                    .bufferDeviceAddress = VK_TRUE,
+                },
+                vk::PhysicalDeviceVulkan13Features{
+                    .pipelineCreationCacheControl = VK_TRUE,
+                    .synchronization2 = VK_TRUE,
+                },
+                vk::PhysicalDeviceMeshShaderFeaturesEXT{
+                    .taskShader = VK_TRUE,
+                    .meshShader = VK_TRUE,
+                },
+                vk::PhysicalDeviceRobustness2FeaturesEXT{
+                    .nullDescriptor = VK_TRUE,
+                },
+            },
+    };
+}
+
+static vk::Format FindDepthFormat(const vk::raii::PhysicalDevice& physical_device) {
+    static constexpr std::array<vk::Format, 3> Candidates{{
+        vk::Format::eD32Sfloat,
+        vk::Format::eD32SfloatS8Uint,
+        vk::Format::eD24UnormS8Uint,
+    }};
+    for (const auto format : Candidates) {
+        if (physical_device.getFormatProperties(format).optimalTilingFeatures &
+            vk::FormatFeatureFlagBits::eDepthStencilAttachment) {
+            return format;
+        }
+    }
+    throw std::runtime_error("Failed to find depth format!");
+}
+
+void VulkanMeshletRenderer::CreateDepthResources() {
+    // Released first, so that the new one can take over its memory
+    depth_image_view = nullptr;
+    depth_image.reset();
+    // Only ever cleared, so it may stay in tile memory
+    depth_image = std::make_unique<VulkanImage>(
+        *render_target_heap, depth_render_target_slot,
+        vk::ImageCreateInfo{
+            .imageType = vk::ImageType::e2D,
+            .format = depth_format,
+            .extent =
+                {
+                    .width = render_target_extent.width,
+                    .height = render_target_extent.height,
+                    .depth = 1,
+                },
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .usage = vk::ImageUsageFlagBits::eDepthStencilAttachment |
+                     vk::ImageUsageFlagBits::eTransientAttachment,
+            .initialLayout = vk::ImageLayout::eUndefined,
+        });
+    depth_image_view =
+        vk::raii::ImageView{**device,
+                            {
+                                .image = **depth_image,
+                                .viewType = vk::ImageViewType::e2D,
+                                .format = depth_format,
+                                .subresourceRange =
+                                    {
+                                        .aspectMask = vk::ImageAspectFlagBits::eDepth,
+                                        .baseMipLevel = 0,
+                                        .levelCount = 1,
+                                        .baseArrayLayer = 0,
+                                        .layerCount = 1,
+                                    },
+                            }};
+    depth_image->LogCompression("Depth image", vk::ImageAspectFlagBits::eDepth);
+}
+
+void VulkanMeshletRenderer::Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_extent) {
+    VulkanRenderer::Init(surface, actual_extent);
+
+    frames = std::make_unique<VulkanFramesInFlight<Frame>>(*device, num_frames_in_flight);
+    depth_format = FindDepthFormat(device->physical_device);
+
+    const auto properties =
+        device->physical_device
+            .getProperties2<vk::PhysicalDeviceProperties2,
+                            vk::PhysicalDeviceMeshShaderPropertiesEXT>()
+            .get<vk::PhysicalDeviceMeshShaderPropertiesEXT>();
+    max_task_groups = std::min(properties.maxTaskWorkGroupCount[0],
+                               properties.maxTaskWorkGroupTotalCount);
+
+    const std::array<vk::AttachmentDescription, 2> attachments{{
+        {
+            .format = swap_chain->surface_format.format,
+            .loadOp = vk::AttachmentLoadOp::eClear,
+            .storeOp = vk::AttachmentStoreOp::eStore,
+            .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+            .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+            .initialLayout = vk::ImageLayout::eUndefined,
+            .finalLayout = vk::ImageLayout::eGeneral,
+        },
+        {
+            .format = depth_format,
+            .loadOp = vk::AttachmentLoadOp::eClear,
+            .storeOp = vk::AttachmentStoreOp::eDontCare,
+            .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+            .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+            .initialLayout = vk::ImageLayout::eUndefined,
+            .finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+        },
+    }};
+    const std::array<vk::SubpassDependency, 2> dependencies{{
+        {
+            .srcSubpass = VK_SUBPASS_EXTERNAL,
+            .dstSubpass = 0,
+            .srcStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests |
+                            vk::PipelineStageFlagBits::eLateFragmentTests,
+            .dstStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests |
+                            vk::PipelineStageFlagBits::eLateFragmentTests,
+            .srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+            .dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead |
+                             vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+        },
+        {
+            .srcSubpass = VK_SUBPASS_EXTERNAL,
+            .dstSubpass = 0,
+            .srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            .dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            .srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
+            .dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
+        },
+    }};
+    const vk::AttachmentReference color_reference{
+        .attachment = 0,
+        .layout = vk::ImageLayout::eGeneral,
+    };
+    const vk::AttachmentReference depth_reference{
+        .attachment = 1,
+        .layout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+    };
+    render_pass = vk::raii::RenderPass{
+        **device,
+        {
+            .attachmentCount = static_cast<u32>(attachments.size()),
+            .pAttachments = attachments.data(),
+            .subpassCount = 1,
+            .pSubpasses = TempArr<vk::SubpassDescription>{{
+                .pipelineBindPoint = vk::PipelineBindPoint::eGraphics,
+                .colorAttachmentCount = 1,
+                .pColorAttachments = &color_reference,
+                .pDepthStencilAttachment = &depth_reference,
+            }},
+            .dependencyCount = static_cast<u32>(dependencies.size()),
+            .pDependencies = dependencies.data(),
+        }};
+
+    depth_render_target_slot = render_target_heap->AddSlot();
+    CreateDepthResources();
+    CreateFramebuffers();
+}
+
+// Binding 1 of the descriptor set, indexed like the scene textures
+static std::vector<DescriptorBinding::CombinedImageSampler> GetTextureImages(
+    const Scene& scene, const VulkanDevice& device) {
+
+    auto images = Common::VectorFromRange(
+        scene.textures | std::views::transform([&device](const std::unique_ptr<Texture>& texture) {
+            return DescriptorBinding::CombinedImageSampler{
+                .image = *texture->image->GetTexture().image_view,
+                .sampler = texture->sampler ? *texture->sampler->sampler : *device.default_sampler,
+            };
+        }));
+    if (images.empty()) { // Cannot create empty descriptors, but null ones are fine here
+        images.emplace_back(DescriptorBinding::CombinedImageSampler{
+            .image = VK_NULL_HANDLE,
+        });
+    }
+    return images;
+}
+
+void VulkanMeshletRenderer::UploadMaterials() {
+    const auto materials_info = Common::VectorFromRange(
+        scene->materials | std::views::transform([](const std::unique_ptr<Material>& material) {
+            return material->GetPackedMaterial();
+        }));
+    materials_buffer = std::make_unique<VulkanImmUploadBuffer>(
+        *device,
+        VulkanBufferCreateInfo{
+            .size = materials_info.size() * sizeof(GLSL::PackedMaterial),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            .dst_stage_mask = vk::PipelineStageFlagBits2::eFragmentShader,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+        },
+        reinterpret_cast<const u8*>(materials_info.data()));
+}
+
+// Storage buffers cannot be empty, so empty arrays get a single unused element
+template <typename T>
+static std::unique_ptr<VulkanImmUploadBuffer> CreateStorageBuffer(
+    VulkanDevice& device, const std::vector<T>& data, vk::PipelineStageFlags2 dst_stage_mask,
+    MemoryCategory category = MemoryCategory::Other) {
+
+    static const T Empty{};
+    return std::make_unique<VulkanImmUploadBuffer>(
+        device,
+        VulkanBufferCreateInfo{
+            .size = std::max<std::size_t>(data.size(), 1) * sizeof(T),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            .dst_stage_mask = dst_stage_mask,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+            .category = category,
+        },
+        reinterpret_cast<const u8*>(data.empty() ? &Empty : data.data()));
+}
+
+void VulkanMeshletRenderer::LoadScene(GLTF::Container& gltf) {
+    scene = std::make_unique<Scene>();
+
+    // The vertex and index buffers are only used for tangent generation and the like, and
+    // the meshlets are uploaded separately
+    SceneLoader loader{{
+                           .usage = vk::BufferUsageFlagBits::eVertexBuffer,
+                           .dst_stage_mask = vk::PipelineStageFlagBits2::eVertexAttributeInput,
+                           .dst_access_mask = vk::AccessFlagBits2::eVertexAttributeRead,
+                       },
+                       {
+                           .usage = vk::BufferUsageFlagBits::eIndexBuffer,
+                           .dst_stage_mask = vk::PipelineStageFlagBits2::eIndexInput,
+                           .dst_access_mask = vk::AccessFlagBits2::eIndexRead,
+                       },
+                       *scene,
+                       *device,
+                       gltf,
+                       thread_pool.get(),
+                       compress_textures,
+                       texture_budget,
+                       num_frames_in_flight,
+                       lazy_textures,
+                       false,
+                       true,
+                       false,
+                       false,
+                       0,
+                       optimize_indices,
+                       pack_vertices,
+                       false,
+                       TextureQuality{
+                           .max_size = max_texture_size,
+                           .dropped_levels = dropped_texture_levels,
+                           .budget = texture_quality_budget,
+                       },
+                       gpu_tangent_triangles,
+                       spatial_order,
+                       host_cache_budget,
+                       gpu_image_decode};
+    UploadMeshlets();
+    loader.profiler->Report();
+    device->allocator->LogUsage();
+    sub_scene_idx = scene->main_sub_scene;
+
+    UploadMaterials();
+    const auto images = GetTextureImages(*scene, *device);
+    descriptor_set = std::make_unique<VulkanDescriptorSets>(
+        *device, 1,
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eFragment,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**materials_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eCombinedImageSampler,
+                .array_size = static_cast<u32>(images.size()),
+                .stages = vk::ShaderStageFlagBits::eFragment,
+                .value = DescriptorBinding::CombinedImageSamplersValue{{
+                    .images = images,
+                }},
+            },
+        });
+
+    frame_allocator = std::make_unique<VulkanFrameAllocator>(
+        *device, frames->frames_in_flight.size(), sizeof(GLSL::MeshletUniformsBlock));
+    static constexpr auto TaskMesh =
+        vk::ShaderStageFlagBits::eTaskEXT | vk::ShaderStageFlagBits::eMeshEXT;
+    const auto StorageBuffer = [](vk::ShaderStageFlags stages, vk::Buffer buffer = {}) {
+        DescriptorBinding binding{
+            .type = vk::DescriptorType::eStorageBuffer,
+            .stages = stages,
+        };
+        if (buffer) {
+            binding.value = DescriptorBinding::BuffersValue{{
+                .buffers = {{buffer}},
+            }};
+        }
+        return binding;
+    };
+    // The buffers of the draws are written by BuildDrawList
+    draw_descriptor_set = std::make_unique<VulkanDescriptorSets>(
+        *device, frames->frames_in_flight.size(),
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eUniformBufferDynamic,
+                .stages = TaskMesh,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{frame_allocator->GetBuffer()}},
+                    .range = sizeof(GLSL::MeshletUniformsBlock),
+                }},
+            },
+            StorageBuffer(TaskMesh),
+            StorageBuffer(TaskMesh),
+            StorageBuffer(TaskMesh, **meshlets_buffer),
+            StorageBuffer(vk::ShaderStageFlagBits::eMeshEXT, **meshlet_vertices_buffer),
+            StorageBuffer(vk::ShaderStageFlagBits::eMeshEXT, **meshlet_triangles_buffer),
+            StorageBuffer(vk::ShaderStageFlagBits::eMeshEXT, **vertices_buffer),
+            StorageBuffer(vk::ShaderStageFlagBits::eTaskEXT),
+        });
+    BuildDrawList();
+
+    const VulkanShader task_shader{*device, u8"core/meshlet/shaders/meshlet.task"};
+    const VulkanShader mesh_shader{*device, u8"core/meshlet/shaders/meshlet.mesh"};
+    const VulkanShader fragment_shader{*device, u8"core/rasterizer/shaders/rasterizer.frag"};
+    const std::array<vk::PipelineShaderStageCreateInfo, 3> stages{{
+        {
+            .stage = vk::ShaderStageFlagBits::eTaskEXT,
+            .module = *task_shader,
+            .pName = "main",
+        },
+        {
+            .stage = vk::ShaderStageFlagBits::eMeshEXT,
+            .module = *mesh_shader,
+            .pName = "main",
+        },
+        {
+            .stage = vk::ShaderStageFlagBits::eFragment,
+            .module = *fragment_shader,
+            .pName = "main",
+        },
+    }};
+    const std::array<vk::DescriptorSetLayout, 3> set_layouts{{
+        *descriptor_set->descriptor_set_layout,
+        *scene->texture_streamer->descriptor_sets->descriptor_set_layout,
+        *draw_descriptor_set->descriptor_set_layout,
+    }};
+    // Vertex input and input assembly are ignored with mesh shaders
+    pipeline = std::make_unique<VulkanGraphicsPipeline>(
+        *device,
+        vk::GraphicsPipelineCreateInfo{
+            .stageCount = static_cast<u32>(stages.size()),
+            .pStages = stages.data(),
+            .pDepthStencilState = TempPtr{vk::PipelineDepthStencilStateCreateInfo{
+                .depthTestEnable = VK_TRUE,
+                .depthWriteEnable = VK_TRUE,
+                .depthCompareOp = vk::CompareOp::eLess,
+            }},
+            .renderPass = *render_pass,
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = static_cast<u32>(set_layouts.size()),
+            .pSetLayouts = set_layouts.data(),
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::MeshletPushConstant>(vk::ShaderStageFlagBits::eTaskEXT),
+            }},
+        });
+}
+
+void VulkanMeshletRenderer::UploadMeshlets() {
+    std::vector<GLSL::MeshletInfo> meshlets;
+    std::vector<u32> meshlet_vertices;
+    std::vector<u32> meshlet_triangles;
+    std::vector<MeshPrimitive::MeshletVertex> vertices;
+    primitive_meshlets.clear();
+    for (const auto& mesh : scene->meshes) {
+        for (const auto& primitive : mesh->primitives) {
+            if (primitive->meshlets.meshlets.empty()) {
+                SPDLOG_WARN("Primitive of mesh {} has no meshlets and will not be drawn",
+                            mesh->name);
+                continue;
+            }
+            primitive_meshlets.emplace(
+                primitive.get(), PrimitiveMeshlets{
+                                     .first_meshlet = static_cast<u32>(meshlets.size()),
+                                     .num_meshlets =
+                                         static_cast<u32>(primitive->meshlets.meshlets.size()),
+                                     .first_vertex = static_cast<u32>(vertices.size()),
+                                 });
+            for (const auto& meshlet : primitive->meshlets.meshlets) {
+                meshlets.push_back({
+                    .first_vertex =
+                        static_cast<u32>(meshlet_vertices.size()) + meshlet.first_vertex,
+                    .first_triangle =
+                        static_cast<u32>(meshlet_triangles.size()) + meshlet.first_triangle,
+                    .vertex_count = meshlet.vertex_count,
+                    .triangle_count = meshlet.triangle_count,
+                    .center = {meshlet.center[0], meshlet.center[1], meshlet.center[2]},
+                    .radius = meshlet.radius,
+                    .cone_axis = {meshlet.cone_axis[0], meshlet.cone_axis[1],
+                                  meshlet.cone_axis[2]},
+                    .cone_cutoff = meshlet.cone_cutoff,
+                });
+            }
+            const auto& data = primitive->meshlets;
+            meshlet_vertices.insert(meshlet_vertices.end(), data.vertices.begin(),
+                                    data.vertices.end());
+            meshlet_triangles.insert(meshlet_triangles.end(), data.triangles.begin(),
+                                     data.triangles.end());
+            vertices.insert(vertices.end(), primitive->meshlet_vertices.begin(),
+                            primitive->meshlet_vertices.end());
+
+            // Only needed for the upload
+            primitive->meshlets = {};
+            primitive->meshlet_vertices = {};
+        }
+    }
+
+    static constexpr auto TaskMesh =
+        vk::PipelineStageFlagBits2::eTaskShaderEXT | vk::PipelineStageFlagBits2::eMeshShaderEXT;
+    meshlets_buffer = CreateStorageBuffer(*device, meshlets, TaskMesh, MemoryCategory::Geometry);
+    meshlet_vertices_buffer =
+        CreateStorageBuffer(*device, meshlet_vertices, vk::PipelineStageFlagBits2::eMeshShaderEXT,
+                            MemoryCategory::Geometry);
+    meshlet_triangles_buffer =
+        CreateStorageBuffer(*device, meshlet_triangles,
+                            vk::PipelineStageFlagBits2::eMeshShaderEXT, MemoryCategory::Geometry);
+    vertices_buffer = CreateStorageBuffer(
+        *device, vertices, vk::PipelineStageFlagBits2::eMeshShaderEXT, MemoryCategory::Geometry);
+}
+
+// Must not be called while the buffers are in use.
+void VulkanMeshletRenderer::BuildDrawList() {
+    const auto& sub_scene = GetSubScene();
+
+    std::vector<GLSL::MeshletDraw> draws;
+    task_groups.clear();
+    instance_first_task_groups.assign(1, 0);
+    for (std::size_t i = 0; i < sub_scene.GetNumInstances(); ++i) {
+        const auto& mesh = *scene->meshes[sub_scene.instance_meshes[i]];
+        for (const auto& primitive : mesh.primitives) {
+            const auto it = primitive_meshlets.find(primitive.get());
+            if (it == primitive_meshlets.end()) {
+                continue;
+            }
+            const auto& ranges = it->second;
+            const auto material_idx = primitive->material == -1
+                                          ? scene->materials.size() - 1
+                                          : static_cast<std::size_t>(primitive->material);
+            for (u32 j = 0; j < ranges.num_meshlets; j += TaskGroupSize) {
+                task_groups.emplace_back(static_cast<u32>(draws.size()), j);
+            }
+            draws.push_back({
+                .instance = static_cast<u32>(i),
+                .material = static_cast<u32>(material_idx),
+                .first_meshlet = ranges.first_meshlet,
+                .num_meshlets = ranges.num_meshlets,
+                .first_vertex = ranges.first_vertex,
+                .cone_culling = scene->materials[material_idx]->double_sided ? 0u : 1u,
+            });
+        }
+        instance_first_task_groups.emplace_back(static_cast<u32>(task_groups.size()));
+    }
+
+    static constexpr auto TaskMesh =
+        vk::PipelineStageFlagBits2::eTaskShaderEXT | vk::PipelineStageFlagBits2::eMeshShaderEXT;
+    draws_buffer = CreateStorageBuffer(*device, draws, TaskMesh);
+    transforms_buffer = CreateStorageBuffer(*device, sub_scene.instance_transforms, TaskMesh);
+    for (auto& frame : frames->frames_in_flight) {
+        frame.extras.visible_task_groups = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = std::max<std::size_t>(task_groups.size(), 1) * sizeof(glm::uvec2),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+    }
+
+    draw_descriptor_set->UpdateDescriptor(1, DescriptorBinding::BuffersValue{{
+                                                 .buffers = {{**draws_buffer}},
+                                             }});
+    draw_descriptor_set->UpdateDescriptor(2, DescriptorBinding::BuffersValue{{
+                                                 .buffers = {{**transforms_buffer}},
+                                             }});
+    // One set per frame in flight
+    std::vector<DescriptorBinding::Buffers> visible_task_groups;
+    for (const auto& frame : frames->frames_in_flight) {
+        visible_task_groups.push_back({.buffers = {{**frame.extras.visible_task_groups}}});
+    }
+    draw_descriptor_set->UpdateDescriptor(7,
+                                          DescriptorBinding::BuffersValue{visible_task_groups});
+}
+
+void VulkanMeshletRenderer::OnSceneUpdated(const SceneChanges& changes) {
+    if (changes.materials) {
+        UploadMaterials();
+        descriptor_set->UpdateDescriptor(0, DescriptorBinding::BuffersValue{{
+                                                .buffers = {{**materials_buffer}},
+                                            }});
+    }
+    // The draws depend on whether the materials are double sided
+    if (changes.materials || changes.transforms) {
+        BuildDrawList();
+    }
+}
+
+void VulkanMeshletRenderer::SetSubScene(std::size_t index) {
+    VulkanRenderer::SetSubScene(index);
+
+    // The buffers may still be in use by the other frame in flight
+    device->WaitQueueIdle(device->graphics_queue);
+    BuildDrawList();
+}
+
+void VulkanMeshletRenderer::DrawFrame(const Camera& external_camera,
+                                      bool force_external_camera) {
+    PROFILE_FUNCTION();
+    const FrameScope frame_scope{*this};
+    if (scene->lazy_texture_loader) {
+        const auto changed = scene->lazy_texture_loader->Poll(*scene->texture_streamer);
+        if (!changed.empty()) {
+            // The descriptor set may still be in use by the other frame in flight
+            device->WaitQueueIdle(device->graphics_queue);
+        }
+        for (const std::size_t texture_idx : changed) {
+            const auto& texture = scene->textures[texture_idx];
+            descriptor_set->UpdateDescriptor(
+                1,
+                DescriptorBinding::CombinedImageSamplersValue{{
+                    .images = {{
+                        .image = *texture->image->GetTexture().image_view,
+                        .sampler = texture->sampler ? *texture->sampler->sampler
+                                                    : *device->default_sampler,
+                    }},
+                }},
+                static_cast<u32>(texture_idx));
+        }
+    }
+    device->upload_ring->Flush();
+
+    auto& frame = frames->AcquireNextFrame();
+    if (const auto time = GetFrameTime(frame.idx)) {
+        UpdateRenderScale(*time);
+    }
+    frames->BeginFrame();
+
+    const auto& cmd = frame.command_buffer;
+    if (gpu_profiler) {
+        gpu_profiler->BeginFrame(cmd, frame.idx);
+    }
+    VulkanTextureStreamer::FrameUpdate streaming_update;
+    {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Uploads"};
+        streaming_update = scene->texture_streamer->BeginFrame(cmd, frame.idx);
+    }
+
+    const auto& sub_scene = GetSubScene();
+    const bool use_external_camera = force_external_camera || sub_scene.cameras.empty();
+    const auto& camera = use_external_camera ? external_camera : *sub_scene.cameras[0];
+
+    const double viewport_aspect_ratio =
+        static_cast<double>(swap_chain->extent.width) / swap_chain->extent.height;
+    const auto display_extent = GetDisplayExtent(camera.GetAspectRatio(viewport_aspect_ratio));
+    const auto render_extent = GetRenderExtent(camera.GetAspectRatio(viewport_aspect_ratio));
+    BeginFrameTimer(cmd, frame.idx, GetRenderScale());
+    const glm::mat4 proj = camera.GetProj(viewport_aspect_ratio);
+    const glm::mat4 view_proj = proj * camera.view;
+    PrefetchStreaming(camera.view, proj, render_extent);
+
+    // Cull whole subtrees of instances on the CPU first, leaving the task shaders to test the
+    // meshlets of the rest
+    visible_instances.clear();
+    sub_scene.instance_bvh->Cull(Frustum{view_proj}, visible_instances);
+    const auto& visible_task_groups = *frame.extras.visible_task_groups;
+    auto* visible_task_groups_data =
+        static_cast<glm::uvec2*>(visible_task_groups.allocation_info.pMappedData);
+    std::size_t num_visible_task_groups = 0;
+    for (const u32 instance : visible_instances) {
+        const u32 begin = instance_first_task_groups[instance];
+        const u32 end = instance_first_task_groups[instance + 1];
+        std::copy(task_groups.begin() + begin, task_groups.begin() + end,
+                  visible_task_groups_data + num_visible_task_groups);
+        num_visible_task_groups += end - begin;
+    }
+    if (num_visible_task_groups > 0) { // No-op for coherent memory
+        vmaFlushAllocation(visible_task_groups.allocator, visible_task_groups.allocation, 0,
+                           num_visible_task_groups * sizeof(glm::uvec2));
+    }
+
+    frame_allocator->BeginFrame(frame.idx);
+    const u32 uniforms_offset = frame_allocator->Push<GLSL::MeshletUniformsBlock>({{
+        .view_proj = view_proj,
+        .camera_position = glm::vec3{glm::inverse(camera.view)[3]},
+    }});
+    frame_allocator->EndFrame();
+
+    const std::array<vk::ClearValue, 2> clear_values{{
+        {.color = {{{0.0f, 0.0f, 0.0f, 0.0f}}}},
+        {.depthStencil = {1.0f, 0}},
+    }};
+    {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Draw"};
+        pipeline->BeginRenderPass(cmd,
+                                  {
+                                      .framebuffer = *frame.extras.framebuffer,
+                                      .renderArea =
+                                          {
+                                              .extent = render_extent,
+                                          },
+                                      .clearValueCount = static_cast<u32>(clear_values.size()),
+                                      .pClearValues = clear_values.data(),
+                                  });
+        cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, **pipeline);
+        VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eGraphics,
+                                   *pipeline->pipeline_layout, 0,
+                                   {
+                                       {*descriptor_set, 0},
+                                       {*scene->texture_streamer->descriptor_sets, frame.idx},
+                                       {*draw_descriptor_set, frame.idx},
+                                   },
+                                   {uniforms_offset});
+        for (std::size_t first = 0; first < num_visible_task_groups; first += max_task_groups) {
+            cmd.pushConstants<GLSL::MeshletPushConstant>(
+                *pipeline->pipeline_layout, vk::ShaderStageFlagBits::eTaskEXT, 0,
+                {{
+                    .first_task_group = static_cast<u32>(first),
+                }});
+            cmd.drawMeshTasksEXT(
+                static_cast<u32>(std::min<std::size_t>(num_visible_task_groups - first,
+                                                       max_task_groups)),
+                1, 1);
+        }
+        pipeline->EndRenderPass(cmd);
+    }
+
+    EndFrameTimer(cmd, frame.idx, vk::PipelineStageFlagBits2::eAllCommands);
+    const auto image_available =
+        RecordPostprocess(cmd, frame.idx, render_extent, display_extent,
+                          vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+                          vk::AccessFlagBits2::eColorAttachmentWrite);
+    scene->texture_streamer->EndFrame(cmd);
+
+    frames->EndFrame();
+
+    // Wait for the memory of the streamed textures to be bound
+    auto wait_semaphores = frame_arena.MakeVector<vk::SemaphoreSubmitInfo>();
+    if (streaming_update.wait_semaphore) {
+        wait_semaphores.push_back({
+            .semaphore = streaming_update.wait_semaphore,
+            .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+        });
+    }
+    if (image_available && image_available->semaphore) {
+        wait_semaphores.push_back(*image_available);
+    }
+    frames->Submit(*frame.command_buffer, wait_semaphores, image_available.has_value());
+    if (!image_available) {
+        throw std::runtime_error("Failed to acquire image, ignoring");
+    }
+    swap_chain->Present(*frame.render_finished_semaphore);
+}
+
+void VulkanMeshletRenderer::CreateFramebuffers() {
+    for (std::size_t i = 0; i < frames->frames_in_flight.size(); ++i) {
+        frames->frames_in_flight[i].extras.framebuffer = vk::raii::Framebuffer{
+            **device,
+            vk::FramebufferCreateInfo{
+                .renderPass = *render_pass,
+                .attachmentCount = 2,
+                .pAttachments =
+                    TempArr<vk::ImageView>{*offscreen_frames[i].image_view,
+                                           *depth_image_view},
+                .width = render_target_extent.width,
+                .height = render_target_extent.height,
+                .layers = 1,
+            }};
+    }
+}
+
+void VulkanMeshletRenderer::OnResized(const vk::Extent2D& actual_extent) {
+    VulkanRenderer::OnResized(actual_extent);
+    if (!render_targets_resized) {
+        return;
+    }
+    CreateDepthResources();
+    CreateFramebuffers();
+}
+
+} // namespace Renderer
@@ -0,0 +1,106 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+#include <vulkan/vulkan_raii.hpp>
+#include "core/vulkan_renderer.h"
+
+namespace Renderer {
+
+class MeshPrimitive;
+class VulkanBuffer;
+class VulkanGraphicsPipeline;
+class VulkanImage;
+class VulkanImmUploadBuffer;
+class VulkanDescriptorSets;
+class VulkanFrameAllocator;
+
+/**
+ * Renders with task and mesh shaders (VK_EXT_mesh_shader) instead of the fixed function vertex
+ * pipeline. Primitives are split into meshlets while loading. Task workgroups cull them
+ * against the frustum and by their normal cones, and the mesh shaders pull the vertices of
+ * the visible ones. Shading is the rasterizer's.
+ */
+class VulkanMeshletRenderer final : public VulkanRenderer {
+public:
+    explicit VulkanMeshletRenderer(bool enable_validation_layers,
+                                   std::vector<const char*> frontend_required_extensions);
+    ~VulkanMeshletRenderer() override;
+
+    void Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_extent) override;
+    void LoadScene(GLTF::Container& gltf) override;
+    void DrawFrame(const Camera& external_camera, bool force_external_camera) override;
+    void OnResized(const vk::Extent2D& actual_extent) override;
+    void SetSubScene(std::size_t index) override;
+
+private:
+    static constexpr u32 TaskGroupSize = 32; // Meshlets culled by each task workgroup
+
+    OffscreenImageInfo GetOffscreenImageInfo() const override;
+    DeviceRequirements GetDeviceRequirements() const override;
+    void OnSceneUpdated(const SceneChanges& changes) override;
+    void UploadMaterials();
+    // Concatenates the meshlets of all primitives into the buffers of the scene, releasing
+    // their CPU copies
+    void UploadMeshlets();
+    void BuildDrawList();
+    void CreateDepthResources();
+    void CreateFramebuffers();
+
+    vk::Format depth_format{};
+    std::size_t depth_render_target_slot{};
+    std::unique_ptr<VulkanImage> depth_image{};
+    vk::raii::ImageView depth_image_view = nullptr;
+    u32 max_task_groups{}; // Per dispatch
+
+    std::unique_ptr<VulkanImmUploadBuffer> materials_buffer;
+    // Binding 0 is the materials, binding 1 the scene textures
+    std::unique_ptr<VulkanDescriptorSets> descriptor_set;
+
+    vk::raii::RenderPass render_pass = nullptr;
+    struct Frame {
+        vk::raii::Framebuffer framebuffer = nullptr;
+        // Task groups of the instances in the frustum, written by the CPU
+        std::unique_ptr<VulkanBuffer> visible_task_groups;
+    };
+    std::unique_ptr<VulkanFramesInFlight<Frame>> frames;
+
+    // Ranges of each primitive in the meshlet buffers
+    struct PrimitiveMeshlets {
+        u32 first_meshlet{};
+        u32 num_meshlets{};
+        u32 first_vertex{};
+    };
+    std::unordered_map<const MeshPrimitive*, PrimitiveMeshlets> primitive_meshlets;
+    std::unique_ptr<VulkanImmUploadBuffer> meshlets_buffer;         // GLSL::MeshletInfo
+    std::unique_ptr<VulkanImmUploadBuffer> meshlet_vertices_buffer; // Vertex indices
+    std::unique_ptr<VulkanImmUploadBuffer> meshlet_triangles_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> vertices_buffer; // MeshPrimitive::MeshletVertex
+
+    // Draws of the current sub scene, one per primitive of each instance, and the task groups
+    // (draw, first meshlet) they are split into. Those of instance i are
+    // task_groups[instance_first_task_groups[i]..instance_first_task_groups[i+1]].
+    std::vector<glm::uvec2> task_groups;
+    std::vector<u32> instance_first_task_groups;
+    std::unique_ptr<VulkanImmUploadBuffer> draws_buffer; // GLSL::MeshletDraw
+    std::unique_ptr<VulkanImmUploadBuffer> transforms_buffer;
+
+    // The uniforms are read at a dynamic offset
+    std::unique_ptr<VulkanFrameAllocator> frame_allocator;
+    // Per frame in flight. Binding 0 is the uniforms, 1 the draws, 2 the instance transforms,
+    // 3 the meshlets, 4 their vertex indices, 5 their triangles, 6 the vertices and 7 the
+    // visible task groups.
+    std::unique_ptr<VulkanDescriptorSets> draw_descriptor_set;
+    std::unique_ptr<VulkanGraphicsPipeline> pipeline;
+
+    // Reused across frames, for culling against the instance BVH
+    std::vector<u32> visible_instances;
+};
+
+} // namespace Renderer
@@ -0,0 +1,98 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <stdexcept>
+#include <mikktspace/mikktspace.h>
+#include "common/log.h"
+#include "common/vertex_weld.h"
+#include "core/mikkt.h"
+
+namespace Renderer::MikkT {
+
+static int GetNumFaces(const SMikkTSpaceContext* context) {
+    const auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
+    if (data.indices.empty()) {
+        return static_cast<int>(data.vertices.size() / 3);
+    }
+    return static_cast<int>(data.indices.size() / 3);
+}
+
+static int GetVertexIndex(const UserData& data, int idx) {
+    if (data.indices.empty()) {
+        return idx;
+    }
+    return data.indices[idx];
+}
+
+static void GetPosition(const SMikkTSpaceContext* context, float out[], int face, int vert) {
+    const auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
+    const int idx = GetVertexIndex(data, face * 3 + vert);
+    for (glm::length_t i = 0; i < 3; ++i) {
+        out[i] = data.vertices[idx].position[i];
+    }
+}
+
+static void GetNormal(const SMikkTSpaceContext* context, float out[], int face, int vert) {
+    const auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
+    const int idx = GetVertexIndex(data, face * 3 + vert);
+    for (glm::length_t i = 0; i < 3; ++i) {
+        out[i] = data.vertices[idx].normal[i];
+    }
+}
+
+static void GetTexCoord(const SMikkTSpaceContext* context, float out[], int face, int vert) {
+    const auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
+    const int idx = GetVertexIndex(data, face * 3 + vert);
+    for (glm::length_t i = 0; i < 2; ++i) {
+        if (data.tex_coord == 0) {
+            out[i] = data.vertices[idx].texcoord_0[i];
+        } else {
+            out[i] = data.vertices[idx].texcoord_1[i];
+        }
+    }
+}
+
+static void SetTSpace(const SMikkTSpaceContext* context, const float tangent[], float sign,
+                      int face, int vert) {
+    auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
+    data.out[face * 3 + vert] = glm::vec4{tangent[0], tangent[1], tangent[2], -sign};
+}
+
+void GenerateTangents(UserData& user_data) {
+    user_data.out.resize(user_data.indices.empty() ? user_data.vertices.size()
+                                                   : user_data.indices.size());
+
+    SMikkTSpaceInterface callbacks{
+        .m_getNumFaces = &GetNumFaces,
+        .m_getNumVerticesOfFace = [](const SMikkTSpaceContext*, int) { return 3; },
+        .m_getPosition = &GetPosition,
+        .m_getNormal = &GetNormal,
+        .m_getTexCoord = &GetTexCoord,
+        .m_setTSpaceBasic = &SetTSpace,
+    };
+    SMikkTSpaceContext context{
+        .m_pInterface = &callbacks,
+        .m_pUserData = &user_data,
+    };
+    if (!genTangSpaceDefault(&context)) {
+        LOG_RATE_LIMITED(ERROR, "Failed to generate tangent space");
+        throw std::runtime_error("Failed to generate tangent space");
+    }
+}
+
+void WeldCorners(const UserData& user_data, std::vector<Vertex>& vertices,
+                 std::vector<u32_le>& indices, Common::ThreadPool* thread_pool) {
+    const auto& old_vertices = user_data.vertices;
+    vertices.reserve(old_vertices.size());
+    Common::WeldVertices(
+        user_data.out.size(),
+        [&old_vertices, &user_data](std::size_t i) {
+            auto vertex = old_vertices.at(GetVertexIndex(user_data, static_cast<int>(i)));
+            vertex.tangent = user_data.out[i];
+            return vertex;
+        },
+        vertices, indices, thread_pool);
+}
+
+} // namespace Renderer::MikkT
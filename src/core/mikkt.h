@@ -0,0 +1,49 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "common/common_types.h"
+#include "common/swap.h"
+
+namespace Common {
+class ThreadPool;
+}
+
+/**
+ * Tangent generation with MikkTSpace on the CPU, for primitives whose material has a normal
+ * texture but no tangents. Tangents are generated for each corner of the triangles, after which
+ * the corners are welded back into indexed vertices.
+ */
+namespace Renderer::MikkT {
+
+// Welded bytewise, so this must not have padding
+struct Vertex {
+    glm::vec3 position{};
+    glm::vec3 normal{};
+    glm::vec2 texcoord_0{};
+    glm::vec2 texcoord_1{};
+    glm::vec4 color{1.0f};
+    glm::vec4 tangent{};
+};
+static_assert(sizeof(Vertex) == 18 * sizeof(float));
+
+struct UserData {
+    const std::vector<Vertex>& vertices;
+    const std::vector<u32>& indices; // Of the triangles, or empty if the vertices are unindexed
+    std::size_t tex_coord{};
+    std::vector<glm::vec4> out; // Of each corner
+};
+
+// Generates the tangents of each corner into out. Throws if MikkTSpace fails.
+void GenerateTangents(UserData& user_data);
+
+// Welds the corners, with the tangents in out, into unique vertices and the indices of the
+// triangles referencing them.
+void WeldCorners(const UserData& user_data, std::vector<Vertex>& vertices,
+                 std::vector<u32_le>& indices, Common::ThreadPool* thread_pool = nullptr);
+
+} // namespace Renderer::MikkT
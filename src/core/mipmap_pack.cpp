@@ -0,0 +1,324 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/mapped_file.h"
+#include "core/mipmap_pack.h"
+
+namespace Renderer {
+
+namespace {
+
+constexpr u32 Magic = 0x4B504D42;       // BMPK
+constexpr u32 RecordMagic = 0x43524D42; // BMRC
+constexpr std::size_t RecordAlignment = 16;
+
+struct Header {
+    u32 magic;
+    u32 version;
+    u32 run; // Of the last time the archive was opened
+    u32 reserved;
+};
+static_assert(sizeof(Header) % RecordAlignment == 0);
+
+struct RecordHeader {
+    u32 magic; // Written last, so that partial records are not valid
+    u32 name_size;
+    u64 data_size;
+    u32 width; // Of level 0
+    u32 height;
+    u32 num_levels;
+    u32 last_used_run;
+    // Followed by the name, then the levels from level 1 packed tightly, starting aligned to
+    // RecordAlignment. Records are padded to RecordAlignment.
+};
+
+u64 GetDataOffset(u64 offset, u32 name_size) {
+    return Common::AlignUp(offset + sizeof(RecordHeader) + name_size, RecordAlignment);
+}
+
+u64 GetLevelsSize(u32 width, u32 height, u32 num_levels) {
+    u64 size = 0;
+    for (u32 i = 1; i < num_levels; ++i) {
+        width = std::max(width / 2, 1u);
+        height = std::max(height / 2, 1u);
+        size += u64{width} * height * 4;
+    }
+    return size;
+}
+
+} // namespace
+
+MipmapPack::MipmapPack(std::filesystem::path path_) : path(std::move(path_)) {
+    Open();
+}
+
+MipmapPack::~MipmapPack() = default;
+
+void MipmapPack::Open() {
+    std::error_code error;
+    file_size = std::filesystem::file_size(path, error);
+    if (error) {
+        file_size = 0;
+    }
+
+    std::unique_ptr<Common::MappedFile> contents;
+    Header header{};
+    if (file_size >= sizeof(Header)) {
+        try {
+            contents = std::make_unique<Common::MappedFile>(path);
+            std::memcpy(&header, contents->data(), sizeof(header));
+        } catch (const std::exception& exception) {
+            SPDLOG_WARN("Could not map mipmap pack {}: {}", path.string(), exception.what());
+        }
+    }
+    if (!contents || header.magic != Magic || header.version != Version) {
+        contents.reset();
+        header = {.magic = Magic, .version = Version};
+        std::ofstream out_file{path, std::ios::binary | std::ios::trunc};
+        out_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (!out_file) {
+            SPDLOG_WARN("Failed to create mipmap pack {}", path.string());
+            return;
+        }
+        file_size = sizeof(Header);
+    }
+    run = header.run + 1;
+
+    // Index the records, later ones of a name replacing the earlier
+    u64 offset = sizeof(Header);
+    u64 live_size = sizeof(Header);
+    if (contents) {
+        const auto data = contents->GetSpan();
+        while (offset + sizeof(RecordHeader) <= data.size()) {
+            RecordHeader record;
+            std::memcpy(&record, data.data() + offset, sizeof(record));
+            const u64 levels_size = GetLevelsSize(record.width, record.height, record.num_levels);
+            if (record.magic != RecordMagic || record.data_size != levels_size) {
+                break; // Torn by a crash
+            }
+            const u64 data_offset = GetDataOffset(offset, record.name_size);
+            const u64 end = Common::AlignUp(data_offset + record.data_size, RecordAlignment);
+            if (end > data.size()) {
+                break;
+            }
+
+            std::string name{reinterpret_cast<const char*>(data.data() + offset) +
+                                 sizeof(RecordHeader),
+                             record.name_size};
+            if (const auto it = entries.find(name); it != entries.end()) {
+                live_size -= it->second.size;
+                entries.erase(it);
+            }
+            if (run - record.last_used_run <= MaxUnusedRuns) {
+                entries.emplace(std::move(name), Entry{
+                                                     .offset = offset,
+                                                     .size = end - offset,
+                                                     .data_offset = data_offset,
+                                                     .data_size = record.data_size,
+                                                     .width = record.width,
+                                                     .height = record.height,
+                                                     .num_levels = record.num_levels,
+                                                     .last_used_run = record.last_used_run,
+                                                 });
+                live_size += end - offset;
+            }
+            offset = end;
+        }
+    }
+
+    // Drop replaced and unused entries once they take up enough of the file, and torn records
+    bool compacted = false;
+    if (contents && static_cast<double>(file_size - live_size) >
+                        MaxDeadFraction * static_cast<double>(file_size)) {
+        compacted = Compact(std::move(contents));
+    }
+    contents.reset();
+    if (!compacted && offset < file_size) {
+        std::filesystem::resize_file(path, offset, error);
+        if (error) {
+            SPDLOG_WARN("Failed to truncate mipmap pack {}: {}", path.string(), error.message());
+        }
+        file_size = offset;
+    }
+
+    file.open(path, std::ios::in | std::ios::out | std::ios::binary);
+    header.run = run;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.flush();
+    if (!file) {
+        SPDLOG_WARN("Failed to open mipmap pack {}", path.string());
+        file.close();
+        entries.clear();
+        return;
+    }
+    if (!entries.empty()) {
+        Remap();
+    }
+}
+
+bool MipmapPack::Compact(std::unique_ptr<Common::MappedFile> contents) {
+    auto temp_path = path;
+    temp_path += u8".tmp";
+
+    auto compacted_entries = entries;
+    u64 offset = sizeof(Header);
+    {
+        std::ofstream out_file{temp_path, std::ios::binary};
+        // The run is written when the archive is opened after
+        out_file.write(reinterpret_cast<const char*>(contents->data()), sizeof(Header));
+        for (auto& [name, entry] : compacted_entries) {
+            out_file.write(reinterpret_cast<const char*>(contents->data() + entry.offset),
+                           static_cast<std::streamsize>(entry.size));
+            // Records stay aligned, so their layout is unchanged
+            entry.data_offset = offset + (entry.data_offset - entry.offset);
+            entry.offset = offset;
+            offset += entry.size;
+        }
+        if (!out_file) {
+            SPDLOG_WARN("Failed to compact mipmap pack {}", path.string());
+            out_file.close();
+            std::error_code error;
+            std::filesystem::remove(temp_path, error);
+            return false;
+        }
+    }
+
+    // Files cannot be replaced while mapped on some systems
+    contents.reset();
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    if (error) {
+        SPDLOG_WARN("Failed to compact mipmap pack {}: {}", path.string(), error.message());
+        std::filesystem::remove(temp_path, error);
+        return false;
+    }
+    SPDLOG_INFO("Compacted mipmap pack from {} to {} bytes", file_size, offset);
+    entries = std::move(compacted_entries);
+    file_size = offset;
+    return true;
+}
+
+void MipmapPack::Remap() {
+    try {
+        mapping = std::make_shared<const Common::MappedFile>(path);
+    } catch (const std::exception& exception) {
+        SPDLOG_WARN("Could not map mipmap pack {}: {}", path.string(), exception.what());
+    }
+}
+
+MipmapPack::Levels MipmapPack::Find(const std::string& name, u32 width, u32 height,
+                                    u32 num_levels) {
+    std::scoped_lock lock{mutex};
+    const auto it = entries.find(name);
+    if (it == entries.end()) {
+        return {};
+    }
+    auto& entry = it->second;
+    if (entry.width != width || entry.height != height || entry.num_levels != num_levels) {
+        return {};
+    }
+    // Entries added since the file was mapped are beyond the mapping
+    if (!mapping || entry.data_offset + entry.data_size > mapping->size()) {
+        Remap();
+        if (!mapping || entry.data_offset + entry.data_size > mapping->size()) {
+            return {};
+        }
+    }
+
+    if (entry.last_used_run != run) {
+        entry.last_used_run = run;
+        file.seekp(static_cast<std::streamoff>(entry.offset +
+                                               offsetof(RecordHeader, last_used_run)));
+        file.write(reinterpret_cast<const char*>(&run), sizeof(run));
+        file.flush();
+        file.clear(); // Only delays garbage collection if it fails
+    }
+
+    Levels levels{.mapping = mapping};
+    u64 offset = entry.data_offset;
+    for (u32 i = 1; i < num_levels; ++i) {
+        width = std::max(width / 2, 1u);
+        height = std::max(height / 2, 1u);
+        const std::size_t size = std::size_t{width} * height * 4;
+        levels.data.emplace_back(mapping->data() + offset, size);
+        offset += size;
+    }
+    return levels;
+}
+
+void MipmapPack::Add(const std::string& name, u32 width, u32 height,
+                     std::span<const std::span<const u8>> levels) {
+    std::scoped_lock lock{mutex};
+    if (!file.is_open()) {
+        return;
+    }
+
+    RecordHeader record{
+        .magic = 0,
+        .name_size = static_cast<u32>(name.size()),
+        .data_size = 0,
+        .width = width,
+        .height = height,
+        .num_levels = static_cast<u32>(levels.size()) + 1,
+        .last_used_run = run,
+    };
+    for (const auto& level : levels) {
+        record.data_size += level.size();
+    }
+    if (record.data_size != GetLevelsSize(width, height, record.num_levels)) {
+        SPDLOG_ERROR("Mip levels of {} have incorrect sizes", name);
+        return;
+    }
+    const u64 offset = file_size;
+    const u64 data_offset = GetDataOffset(offset, record.name_size);
+    const u64 end = Common::AlignUp(data_offset + record.data_size, RecordAlignment);
+
+    static constexpr std::array<char, RecordAlignment> Padding{};
+    file.seekp(static_cast<std::streamoff>(offset));
+    file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    file.write(name.data(), static_cast<std::streamsize>(name.size()));
+    file.write(Padding.data(), static_cast<std::streamsize>(data_offset - offset -
+                                                           sizeof(record) - name.size()));
+    for (const auto& level : levels) {
+        file.write(reinterpret_cast<const char*>(level.data()),
+                   static_cast<std::streamsize>(level.size()));
+    }
+    file.write(Padding.data(),
+               static_cast<std::streamsize>(end - data_offset - record.data_size));
+    file.flush();
+
+    // Commit the record once all of it is written
+    record.magic = RecordMagic;
+    file.seekp(static_cast<std::streamoff>(offset));
+    file.write(reinterpret_cast<const char*>(&record.magic), sizeof(record.magic));
+    file.flush();
+    if (!file) {
+        // The record is overwritten by the next one, or truncated on the next run
+        SPDLOG_WARN("Failed to write mip levels of {} to mipmap pack", name);
+        file.clear();
+        return;
+    }
+
+    entries.insert_or_assign(name, Entry{
+                                       .offset = offset,
+                                       .size = end - offset,
+                                       .data_offset = data_offset,
+                                       .data_size = record.data_size,
+                                       .width = width,
+                                       .height = height,
+                                       .num_levels = record.num_levels,
+                                       .last_used_run = run,
+                                   });
+    file_size = end;
+}
+
+} // namespace Renderer
@@ -0,0 +1,87 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "common/common_types.h"
+
+namespace Common {
+class MappedFile;
+}
+
+namespace Renderer {
+
+/**
+ * Archive of the mip levels generated for images, so that later runs do not generate them again.
+ * The levels of all images are kept in a single file as RGBA8, ready to be uploaded, which is
+ * memory mapped so that loading them is just a copy, without the file system overhead and
+ * decoding of an image file per level.
+ *
+ * Entries are appended with their header committed last, so that entries torn by a crash are
+ * ignored and truncated when the archive is opened again. Entries that were replaced, or not
+ * used in the last MaxUnusedRuns runs, are garbage collected by compacting the file when it is
+ * opened, once they make up more than MaxDeadFraction of it. Thread safe, but the file must not
+ * be used by several processes at once.
+ */
+class MipmapPack : NonCopyable {
+public:
+    // Bump when the layout of the file changes
+    static constexpr u32 Version = 1;
+    static constexpr u32 MaxUnusedRuns = 16;
+    static constexpr double MaxDeadFraction = 0.25;
+
+    // Levels of an entry, kept alive by the mapping
+    struct Levels {
+        std::shared_ptr<const Common::MappedFile> mapping; // Null if there is no entry
+        std::vector<std::span<const u8>> data;             // From level 1
+    };
+
+    // Creates the file if it does not exist or has another version
+    explicit MipmapPack(std::filesystem::path path);
+    ~MipmapPack();
+
+    // Returns the levels of the image of the name, if they were added with the same dimensions
+    // and number of levels (including level 0, which is not stored).
+    Levels Find(const std::string& name, u32 width, u32 height, u32 num_levels);
+    // Appends the levels of the image from level 1 (RGBA8), replacing any entry of the name.
+    // Failures are logged but otherwise ignored, as the archive is only an optimization.
+    void Add(const std::string& name, u32 width, u32 height,
+             std::span<const std::span<const u8>> levels);
+
+private:
+    struct Entry {
+        u64 offset{}; // Of the record
+        u64 size{};   // Of the record, padded
+        u64 data_offset{};
+        u64 data_size{};
+        u32 width{};
+        u32 height{};
+        u32 num_levels{};
+        u32 last_used_run{};
+    };
+
+    void Open();
+    // Rewrites the file of the contents with only the indexed entries. Returns false (leaving
+    // the file and the entries as they were) on failure.
+    bool Compact(std::unique_ptr<Common::MappedFile> contents);
+    void Remap();
+
+    std::filesystem::path path;
+    std::mutex mutex;
+    std::fstream file; // Not open if the archive could not be created
+    std::shared_ptr<const Common::MappedFile> mapping;
+    std::unordered_map<std::string, Entry> entries;
+    u64 file_size{};
+    u32 run{}; // Incremented each time the archive is opened
+};
+
+} // namespace Renderer
@@ -0,0 +1,83 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef PATH_TRACER_COMPUTE_GLSL_H
+#define PATH_TRACER_COMPUTE_GLSL_H
+
+#include "core/vulkan/host_glsl_shared.h"
+
+// A node of the BVHs built by HostBVH, those of all meshes in one array. The children of inner
+// nodes and the items of leaves are indices in the arrays they are uploaded to.
+BEGIN_STRUCT(TraceNode)
+
+vec3 min_point;
+uint first; // The first child, followed by the second, or the first item of a leaf
+vec3 max_point;
+uint count; // Items of a leaf, 0 for inner nodes
+
+END_STRUCT(TraceNode)
+
+// Of the meshes, indexed by the triangles
+BEGIN_STRUCT(TraceVertex)
+
+vec3 position;
+uint color; // Unorm RGBA
+vec3 normal; // Zero if the primitive has none
+INSERT_PADDING(1)
+vec2 texcoord0; // Zero if the primitive has none
+vec2 texcoord1;
+
+END_STRUCT(TraceVertex)
+
+// Set in TraceTriangle::material for double sided materials, whose back faces are not culled
+#define TRACE_DOUBLE_SIDED_BIT 0x80000000u
+
+// Of the meshes, in the order of the leaves of their BVHs
+BEGIN_STRUCT(TraceTriangle)
+
+uvec3 vertices;
+uint material; // With TRACE_DOUBLE_SIDED_BIT
+
+END_STRUCT(TraceTriangle)
+
+// Of the current sub scene, in the order of the leaves of its BVH
+BEGIN_STRUCT(TraceInstance)
+
+mat4 world_to_object;
+mat4 normal_to_world; // Inverse transpose of the transform, in the upper 3x3
+mat4 object_to_world; // Of directions, e.g. for the footprint of ray cones, in the upper 3x3
+uint root;            // Node of the BVH of its mesh
+uint mirrored;        // Whether the transform reverses the winding of the triangles
+INSERT_PADDING(2)
+
+END_STRUCT(TraceInstance)
+
+BEGIN_STRUCT(ComputeTraceUniforms)
+
+mat4 view_inverse;
+mat4 proj_inverse;
+uvec2 render_extent;
+uint first_sample; // Sample index of the first sample of the frame, see SamplerState
+uint samples_per_pixel;
+uint frame; // Since the accumulation started, which the first frame resets
+uint seed;
+uint max_depth;
+uint roulette_depth;
+float russian_roulette;
+float intensity_multiplier;
+float ambient_light;
+float focal_dist;
+float aperture;
+uint num_lights;
+uint num_instances;       // Nothing is hit without any
+float pixel_spread_angle; // Of the ray cones, as PathTracerUniforms
+
+END_STRUCT(ComputeTraceUniforms)
+
+// Of the invocations of trace.comp, one per pixel
+#define TRACE_GROUP_SIZE 8
+// Of the nodes to visit, per level of the traversal. Deeper trees lose nodes beyond it.
+#define TRACE_STACK_SIZE 48
+
+#endif
@@ -0,0 +1,505 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cmath>
+#include <ranges>
+#include <span>
+#include <utility>
+#include <glm/gtc/packing.hpp>
+#include <spdlog/spdlog.h>
+#include "common/file_util.h"
+#include "common/profiling.h"
+#include "common/ranges.h"
+#include "common/temp_ptr.h"
+#include "core/path_tracer_compute/shaders/path_tracer_compute_glsl.h"
+#include "core/path_tracer_compute/vulkan_path_tracer_compute.h"
+#include "core/path_tracer_hw/shaders/path_tracer_glsl.h"
+#include "core/scene.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
+#include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_frames_in_flight.hpp"
+#include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_profiler.h"
+#include "core/vulkan/vulkan_shader.h"
+#include "core/vulkan/vulkan_swapchain.h"
+#include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_upload_ring.h"
+
+namespace Renderer {
+
+VulkanPathTracerCompute::VulkanPathTracerCompute(
+    bool enable_validation_layers, std::vector<const char*> frontend_required_extensions)
+    : VulkanPathTracerCPU(enable_validation_layers, std::move(frontend_required_extensions)) {
+    device_textures = true;
+}
+
+VulkanPathTracerCompute::~VulkanPathTracerCompute() {
+    device->WaitIdle();
+}
+
+VulkanRenderer::DeviceRequirements VulkanPathTracerCompute::GetDeviceRequirements() const {
+    return {
+        .features =
+            Helpers::GenericStructureChain{
+                vk::PhysicalDeviceFeatures2{
+                    .features =
+                        {
+                            .samplerAnisotropy = VK_TRUE,
+                        },
+                },
+                vk::PhysicalDeviceVulkan12Features{
+                    .shaderSampledImageArrayNonUniformIndexing = VK_TRUE,
+                    .runtimeDescriptorArray = VK_TRUE,
+                    .timelineSemaphore = VK_TRUE,
+                    // We don't need this in itself, but we enabled it on VMA
+                    .bufferDeviceAddress = VK_TRUE,
+                },
+                vk::PhysicalDeviceVulkan13Features{
+                    .pipelineCreationCacheControl = VK_TRUE,
+                    .synchronization2 = VK_TRUE,
+                },
+            },
+    };
+}
+
+VulkanRenderer::OffscreenImageInfo VulkanPathTracerCompute::GetOffscreenImageInfo() const {
+    return {
+        // Only the mean of the accumulation, which is kept in a buffer
+        .format = vk::Format::eR32G32B32A32Sfloat,
+        .usage = vk::ImageUsageFlagBits::eStorage,
+        .dst_stage_mask = vk::PipelineStageFlagBits2::eComputeShader,
+        .dst_access_mask = vk::AccessFlagBits2::eShaderStorageWrite,
+    };
+}
+
+// Storage buffers cannot be empty, so empty arrays get a single unused element
+template <typename T>
+static std::unique_ptr<VulkanImmUploadBuffer> CreateStorageBuffer(
+    VulkanDevice& device, const std::vector<T>& data,
+    MemoryCategory category = MemoryCategory::Geometry) {
+
+    static const T Empty{};
+    return std::make_unique<VulkanImmUploadBuffer>(
+        device,
+        VulkanBufferCreateInfo{
+            .size = std::max<std::size_t>(data.size(), 1) * sizeof(T),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            .dst_stage_mask = vk::PipelineStageFlagBits2::eComputeShader,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+            .category = category,
+        },
+        reinterpret_cast<const u8*>(data.empty() ? &Empty : data.data()));
+}
+
+// Appends the nodes of the BVH to those of others, offsetting their children by where they start
+// and their items by first_item
+static void AppendNodes(std::vector<GLSL::TraceNode>& out, const HostBVH& bvh, u32 first_item) {
+    const auto first_node = static_cast<u32>(out.size());
+    for (const auto& node : bvh.GetNodes()) {
+        out.push_back({
+            .min_point = node.bounds.min_point,
+            .first = node.first + (node.count > 0 ? first_item : first_node),
+            .max_point = node.bounds.max_point,
+            .count = node.count,
+        });
+    }
+}
+
+// Levels of the BVH, which the traversal stack of trace.comp must fit
+static u32 GetDepth(std::span<const HostBVH::Node> nodes) {
+    if (nodes.empty()) {
+        return 0;
+    }
+    u32 max_depth = 0;
+    std::vector<std::pair<u32, u32>> stack{{0, 1}}; // Nodes and their depth
+    while (!stack.empty()) {
+        const auto [node_idx, depth] = stack.back();
+        stack.pop_back();
+        max_depth = std::max(max_depth, depth);
+        if (nodes[node_idx].count == 0) {
+            stack.emplace_back(nodes[node_idx].first, depth + 1);
+            stack.emplace_back(nodes[node_idx].first + 1, depth + 1);
+        }
+    }
+    return max_depth;
+}
+
+void VulkanPathTracerCompute::UploadMeshes() {
+    std::vector<GLSL::TraceNode> nodes;
+    std::vector<GLSL::TraceVertex> vertices;
+    std::vector<GLSL::TraceTriangle> triangles;
+    mesh_roots.assign(meshes.size(), 0);
+    for (std::size_t mesh_idx = 0; mesh_idx < meshes.size(); ++mesh_idx) {
+        const auto& mesh = meshes[mesh_idx];
+        if (mesh.triangles.empty()) {
+            continue;
+        }
+        if (const u32 depth = GetDepth(mesh.bvh.GetNodes()); depth > TRACE_STACK_SIZE) {
+            SPDLOG_WARN("BVH of mesh {} has {} levels, more than the traversal stack of {}",
+                        mesh_idx, depth, TRACE_STACK_SIZE);
+        }
+        mesh_roots[mesh_idx] = static_cast<u32>(nodes.size());
+        AppendNodes(nodes, mesh.bvh, static_cast<u32>(triangles.size()));
+
+        const auto first_vertex = static_cast<u32>(vertices.size());
+        for (const auto& vertex : mesh.vertices) {
+            vertices.push_back({
+                .position = vertex.position,
+                .color = glm::packUnorm4x8(vertex.color),
+                .normal = vertex.normal,
+                .texcoord0 = vertex.texcoord_0,
+                .texcoord1 = vertex.texcoord_1,
+            });
+        }
+        for (const u32 item : mesh.bvh.GetItems()) {
+            const auto& triangle = mesh.triangles[item];
+            triangles.push_back({
+                .vertices = glm::uvec3{triangle.vertices[0], triangle.vertices[1],
+                                       triangle.vertices[2]} +
+                            first_vertex,
+                // Double sidedness is not among the factors material updates change
+                .material = triangle.material |
+                            (materials[triangle.material].double_sided ? TRACE_DOUBLE_SIDED_BIT
+                                                                       : 0),
+            });
+        }
+    }
+    mesh_nodes_buffer = CreateStorageBuffer(*device, nodes, MemoryCategory::AccelStructures);
+    vertices_buffer = CreateStorageBuffer(*device, vertices);
+    triangles_buffer = CreateStorageBuffer(*device, triangles);
+}
+
+void VulkanPathTracerCompute::UploadMaterials() {
+    const auto materials_info = Common::VectorFromRange(
+        scene->materials | std::views::transform([](const std::unique_ptr<Material>& material) {
+            return material->GetPackedMaterial();
+        }));
+    materials_buffer = CreateStorageBuffer(*device, materials_info);
+    if (scene_descriptor_set) {
+        scene_descriptor_set->UpdateDescriptor(5, DescriptorBinding::BuffersValue{{
+                                                      .buffers = {{**materials_buffer}},
+                                                  }});
+    }
+}
+
+void VulkanPathTracerCompute::UploadInstances() {
+    std::vector<GLSL::TraceNode> nodes;
+    AppendNodes(nodes, instance_bvh, 0);
+    std::vector<GLSL::TraceInstance> trace_instances;
+    for (const u32 item : instance_bvh.GetItems()) {
+        const auto& instance = instances[item];
+        trace_instances.push_back({
+            .world_to_object = instance.world_to_object,
+            .normal_to_world = glm::mat4{instance.normal_to_world},
+            .object_to_world = glm::mat4{instance.object_to_world},
+            .root = mesh_roots[instance.mesh],
+            .mirrored = instance.mirrored,
+        });
+    }
+    instance_nodes_buffer = CreateStorageBuffer(*device, nodes, MemoryCategory::AccelStructures);
+    instances_buffer = CreateStorageBuffer(*device, trace_instances);
+    lights_buffer = CreateStorageBuffer(*device, lights);
+    num_instances = static_cast<u32>(trace_instances.size());
+    num_lights = static_cast<u32>(lights.size());
+    if (scene_descriptor_set) {
+        scene_descriptor_set->UpdateDescriptor(3, DescriptorBinding::BuffersValue{{
+                                                      .buffers = {{**instance_nodes_buffer}},
+                                                  }});
+        scene_descriptor_set->UpdateDescriptor(4, DescriptorBinding::BuffersValue{{
+                                                      .buffers = {{**instances_buffer}},
+                                                  }});
+        scene_descriptor_set->UpdateDescriptor(6, DescriptorBinding::BuffersValue{{
+                                                      .buffers = {{**lights_buffer}},
+                                                  }});
+    }
+}
+
+// Of the textures of the scene, indexed by the materials. Descriptors cannot be empty, so scenes
+// without any get the placeholder texture, as in VulkanPathTracerHW.
+static std::vector<DescriptorBinding::CombinedImageSampler> GetTextureImages(
+    VulkanDevice& device, const Scene& scene, std::unique_ptr<VulkanTexture>& placeholder) {
+
+    auto images = Common::VectorFromRange(
+        scene.textures | std::views::transform([&device](const std::unique_ptr<Texture>& texture) {
+            return DescriptorBinding::CombinedImageSampler{
+                .image = *texture->image->GetTexture().image_view,
+                .sampler = texture->sampler ? *texture->sampler->sampler : *device.default_sampler,
+            };
+        }));
+    if (images.empty()) {
+        if (!placeholder) {
+            placeholder = std::make_unique<VulkanTexture>(
+                device, Common::ReadFileContents(u8"textures/texture.jpg"));
+        }
+        images.emplace_back(DescriptorBinding::CombinedImageSampler{
+            .image = *placeholder->image_view,
+            .sampler = *device.default_sampler,
+        });
+    }
+    return images;
+}
+
+void VulkanPathTracerCompute::CreateAccumulationBuffer() {
+    const std::size_t num_pixels = render_target_extent.width * render_target_extent.height;
+    accumulation_buffer = std::make_unique<VulkanBuffer>(
+        *device->allocator,
+        vk::BufferCreateInfo{
+            .size = num_pixels * sizeof(GLSL::PixelAccumulation),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Other);
+}
+
+void VulkanPathTracerCompute::CreateTracePipeline() {
+    trace_pipeline = std::make_unique<VulkanComputePipeline>(
+        *device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{*device, u8"core/path_tracer_compute/shaders/trace.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 2,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *scene_descriptor_set->descriptor_set_layout,
+                *frame_descriptor_sets->descriptor_set_layout,
+            }},
+        });
+}
+
+void VulkanPathTracerCompute::LoadScene(GLTF::Container& gltf) {
+    device->WaitIdle(); // The buffers of the previous scene are replaced
+    VulkanPathTracerCPU::LoadScene(gltf);
+
+    if (!frames) {
+        frames = std::make_unique<VulkanFramesInFlight<Frame>>(*device, num_frames_in_flight);
+        for (auto& frame : frames->frames_in_flight) {
+            frame.extras.uniforms_buffer = std::make_unique<VulkanBuffer>(
+                *device->allocator,
+                vk::BufferCreateInfo{
+                    .size = sizeof(GLSL::ComputeTraceUniforms),
+                    .usage = vk::BufferUsageFlagBits::eUniformBuffer,
+                },
+                VmaAllocationCreateInfo{
+                    .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                             VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                    .usage = VMA_MEMORY_USAGE_AUTO,
+                },
+                MemoryCategory::Other);
+        }
+    }
+    if (!accumulation_buffer) {
+        CreateAccumulationBuffer();
+    }
+    scene_descriptor_set.reset();
+    UploadMeshes();
+    UploadMaterials();
+    UploadInstances();
+    const auto images = GetTextureImages(*device, *scene, placeholder_texture);
+
+    const auto StorageBuffer = [](const VulkanBuffer& buffer) {
+        return DescriptorBinding{
+            .type = vk::DescriptorType::eStorageBuffer,
+            .stages = vk::ShaderStageFlagBits::eCompute,
+            .value = DescriptorBinding::BuffersValue{{
+                .buffers = {{*buffer}},
+            }},
+        };
+    };
+    scene_descriptor_set = std::make_unique<VulkanDescriptorSets>(
+        *device, 1,
+        std::initializer_list<DescriptorBinding>{
+            StorageBuffer(*mesh_nodes_buffer),
+            StorageBuffer(*vertices_buffer),
+            StorageBuffer(*triangles_buffer),
+            StorageBuffer(*instance_nodes_buffer),
+            StorageBuffer(*instances_buffer),
+            StorageBuffer(*materials_buffer),
+            StorageBuffer(*lights_buffer),
+            StorageBuffer(*accumulation_buffer),
+            {
+                .type = vk::DescriptorType::eCombinedImageSampler,
+                .array_size = static_cast<u32>(images.size()),
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::CombinedImageSamplersValue{{
+                    .images = images,
+                }},
+            },
+        });
+    if (!frame_descriptor_sets) {
+        std::vector<DescriptorBinding::Buffers> uniform_buffers;
+        for (const auto& frame : frames->frames_in_flight) {
+            uniform_buffers.push_back({.buffers = {{**frame.extras.uniforms_buffer}}});
+        }
+        frame_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+            *device, frames->frames_in_flight.size(),
+            std::initializer_list<DescriptorBinding>{
+                {
+                    .type = vk::DescriptorType::eStorageImage,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
+                    .value = DescriptorBinding::CombinedImageSamplersValue{GetOffscreenImages()},
+                },
+                {
+                    .type = vk::DescriptorType::eUniformBuffer,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
+                    .value = DescriptorBinding::BuffersValue{uniform_buffers},
+                },
+            });
+    }
+    // The layout depends on the number of textures
+    trace_pipeline.reset();
+    CreateTracePipeline();
+    frame_count = 0;
+}
+
+void VulkanPathTracerCompute::DrawFrame(const Camera& external_camera,
+                                        bool force_external_camera) {
+    PROFILE_FUNCTION();
+    const FrameScope frame_scope{*this};
+    StepDefragmentation(true);
+    device->upload_ring->Flush();
+
+    auto& frame = frames->AcquireNextFrame();
+    if (const auto time = GetFrameTime(frame.idx)) {
+        UpdateRenderScale(*time);
+    }
+    frames->BeginFrame();
+
+    const auto& cmd = frame.command_buffer;
+    if (gpu_profiler) {
+        gpu_profiler->BeginFrame(cmd, frame.idx);
+    }
+
+    const auto& sub_scene = GetSubScene();
+    const bool use_external_camera = force_external_camera || sub_scene.cameras.empty();
+    const auto& camera = use_external_camera ? external_camera : *sub_scene.cameras[0];
+    const double viewport_aspect_ratio =
+        static_cast<double>(swap_chain->extent.width) / swap_chain->extent.height;
+    const auto& view = camera.view;
+    const auto& proj = camera.GetProj(viewport_aspect_ratio);
+    const bool camera_moved = view != last_view || proj != last_proj;
+    // Dynamic resolution only while the camera moves, as VulkanPathTracerHW
+    const auto display_extent = GetDisplayExtent(camera.GetAspectRatio(viewport_aspect_ratio));
+    const auto render_extent =
+        GetRenderExtent(camera.GetAspectRatio(viewport_aspect_ratio), camera_moved);
+    if (camera_moved || camera_properties_changed || render_extent != last_render_extent) {
+        frame_count = 0;
+        camera_properties_changed = false;
+    }
+    last_view = view;
+    last_proj = proj;
+    last_render_extent = render_extent;
+    if (frame_count == 0) {
+        accumulated_samples = 0;
+    }
+
+    *static_cast<GLSL::ComputeTraceUniforms*>(
+        frame.extras.uniforms_buffer->allocation_info.pMappedData) = {
+        .view_inverse = glm::inverse(view),
+        .proj_inverse = glm::inverse(proj),
+        .render_extent = {render_extent.width, render_extent.height},
+        .first_sample = sample_stream * SamplesPerStream + accumulated_samples % SamplesPerStream,
+        .samples_per_pixel = samples_per_frame,
+        .frame = frame_count,
+        .seed = sampler_seed,
+        .max_depth = max_depth,
+        .roulette_depth = roulette_depth,
+        .russian_roulette = russian_roulette,
+        .intensity_multiplier = intensity_multiplier,
+        .ambient_light = ambient_light,
+        .focal_dist = focal_dist,
+        .aperture = aperture,
+        .num_lights = num_lights,
+        .num_instances = num_instances,
+        .pixel_spread_angle = std::atan(
+            2.0f / (std::abs(proj[1][1]) * static_cast<float>(render_extent.height))),
+    };
+    vmaFlushAllocation(frame.extras.uniforms_buffer->allocator,
+                       frame.extras.uniforms_buffer->allocation, 0, VK_WHOLE_SIZE);
+
+    BeginFrameTimer(cmd, frame.idx, camera_moved ? GetRenderScale() : 1.0);
+    {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Trace"};
+        // The accumulation written by the previous frame
+        cmd.pipelineBarrier2({
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+                .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+                .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .dstAccessMask = vk::AccessFlagBits2::eShaderStorageRead |
+                                 vk::AccessFlagBits2::eShaderStorageWrite,
+            }}},
+        });
+        cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **trace_pipeline);
+        VulkanDescriptorSets::Bind(
+            cmd, vk::PipelineBindPoint::eCompute, *trace_pipeline->pipeline_layout, 0,
+            {{*scene_descriptor_set, 0}, {*frame_descriptor_sets, frame.idx}});
+        cmd.dispatch((render_extent.width + TRACE_GROUP_SIZE - 1) / TRACE_GROUP_SIZE,
+                     (render_extent.height + TRACE_GROUP_SIZE - 1) / TRACE_GROUP_SIZE, 1);
+    }
+    EndFrameTimer(cmd, frame.idx, vk::PipelineStageFlagBits2::eComputeShader);
+    frame_count++;
+    accumulated_samples += samples_per_frame;
+
+    const auto image_available =
+        RecordPostprocess(cmd, frame.idx, render_extent, display_extent,
+                          vk::PipelineStageFlagBits2::eComputeShader,
+                          vk::AccessFlagBits2::eShaderStorageWrite);
+
+    frames->EndFrame();
+
+    auto wait_semaphores = frame_arena.MakeVector<vk::SemaphoreSubmitInfo>();
+    if (image_available && image_available->semaphore) {
+        wait_semaphores.push_back(*image_available);
+    }
+    frames->Submit(*frame.command_buffer, wait_semaphores, image_available.has_value());
+    if (!image_available) {
+        throw std::runtime_error("Failed to acquire image, ignoring");
+    }
+    swap_chain->Present(*frame.render_finished_semaphore);
+}
+
+void VulkanPathTracerCompute::OnResized(const vk::Extent2D& actual_extent) {
+    VulkanPathTracerCPU::OnResized(actual_extent);
+    if (!render_targets_resized) {
+        return;
+    }
+    CreateAccumulationBuffer();
+    if (scene_descriptor_set) {
+        scene_descriptor_set->UpdateDescriptor(7, DescriptorBinding::BuffersValue{{
+                                                      .buffers = {{**accumulation_buffer}},
+                                                  }});
+    }
+    if (frame_descriptor_sets) {
+        frame_descriptor_sets->UpdateDescriptor(
+            0, DescriptorBinding::CombinedImageSamplersValue{GetOffscreenImages()});
+    }
+}
+
+void VulkanPathTracerCompute::SetSubScene(std::size_t index) {
+    VulkanPathTracerCPU::SetSubScene(index);
+    // The descriptor set may still be in use by the other frame in flight
+    device->WaitQueueIdle(device->graphics_queue);
+    UploadInstances();
+}
+
+void VulkanPathTracerCompute::OnSceneUpdated(const SceneChanges& changes) {
+    VulkanPathTracerCPU::OnSceneUpdated(changes);
+    device->WaitQueueIdle(device->graphics_queue);
+    if (changes.materials) {
+        UploadMaterials();
+    }
+    if (changes.transforms) {
+        UploadInstances();
+    }
+}
+
+} // namespace Renderer
@@ -0,0 +1,87 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include <vulkan/vulkan_raii.hpp>
+#include "core/path_tracer_cpu/vulkan_path_tracer_cpu.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanComputePipeline;
+class VulkanDescriptorSets;
+class VulkanImmUploadBuffer;
+class VulkanTexture;
+
+/**
+ * Traces the paths of VulkanPathTracerCPU in a compute shader, for GPUs without ray tracing
+ * support. The BVHs VulkanPathTracerCPU builds on the host, of the triangles of each mesh and of
+ * the instances of the sub scene, are uploaded to storage buffers with the triangles and the
+ * instances in the order of their leaves, and each invocation traverses them for a pixel with a
+ * stack. The materials are shaded as VulkanPathTracerCPU does, sharing the sampler, BSDF and
+ * texture LOD code of the ray tracing shaders (see surface.glsl), but sampling the device copies
+ * of the textures, which are loaded at the texture quality and not streamed. The samples are
+ * drawn from the same sequences, but the frames are not meant to merge with those of the other
+ * path tracers yet: the filtering of the device textures differs from HostTexture, as do the
+ * tangents of normal maps (of the triangles) from the vertex ones of VulkanPathTracerHW. The
+ * accumulation is kept on the device, as in VulkanPathTracerHW.
+ */
+class VulkanPathTracerCompute final : public VulkanPathTracerCPU {
+public:
+    explicit VulkanPathTracerCompute(bool enable_validation_layers,
+                                     std::vector<const char*> frontend_required_extensions);
+    ~VulkanPathTracerCompute() override;
+
+    void LoadScene(GLTF::Container& gltf) override;
+    void DrawFrame(const Camera& external_camera, bool force_external_camera) override;
+    void OnResized(const vk::Extent2D& actual_extent) override;
+    void SetSubScene(std::size_t index) override;
+
+private:
+    // Those of VulkanPathTracerCPU, and the indexing of the texture descriptors
+    DeviceRequirements GetDeviceRequirements() const override;
+    // Written by the compute shader
+    OffscreenImageInfo GetOffscreenImageInfo() const override;
+    void OnSceneUpdated(const SceneChanges& changes) override;
+    // The vertices, triangles and BVH nodes of the meshes
+    void UploadMeshes();
+    void UploadMaterials();
+    // Of the current sub scene, with its BVH and lights
+    void UploadInstances();
+    // Of the size of the swap chain, which render extents fit in
+    void CreateAccumulationBuffer();
+    void CreateTracePipeline();
+
+    std::unique_ptr<VulkanImmUploadBuffer> mesh_nodes_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> vertices_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> triangles_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> materials_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> instance_nodes_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> instances_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> lights_buffer;
+    std::unique_ptr<VulkanBuffer> accumulation_buffer;
+    std::unique_ptr<VulkanTexture> placeholder_texture; // Bound for scenes without textures
+    std::vector<u32> mesh_roots; // Node of the BVH of each mesh, in mesh_nodes_buffer
+    u32 num_instances{};         // Of instances_buffer
+    u32 num_lights{};
+
+    std::unique_ptr<VulkanDescriptorSets> scene_descriptor_set;
+    // Of each frame in flight, with its offscreen image and uniforms
+    std::unique_ptr<VulkanDescriptorSets> frame_descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> trace_pipeline;
+
+    struct Frame {
+        std::unique_ptr<VulkanBuffer> uniforms_buffer; // Host visible
+    };
+    std::unique_ptr<VulkanFramesInFlight<Frame>> frames;
+    glm::mat4 last_view{};
+    glm::mat4 last_proj{};
+    vk::Extent2D last_render_extent;
+};
+
+} // namespace Renderer
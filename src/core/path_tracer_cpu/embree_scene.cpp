@@ -0,0 +1,203 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "core/path_tracer_cpu/embree_scene.h"
+
+#ifdef ENABLE_EMBREE
+#include <embree4/rtcore.h>
+#endif
+
+namespace Renderer {
+
+#ifdef ENABLE_EMBREE
+
+struct EmbreeScene::Impl {
+    RTCDevice device{};
+    std::vector<RTCScene> meshes;
+    RTCScene instances{}; // Null until the first SetInstances
+};
+
+namespace {
+
+// Of the ray queries, which Embree hands to FilterHits
+struct FilterContext {
+    RTCRayQueryContext context;
+    const EmbreeScene::Filter* filter{};
+};
+
+void FilterHits(const RTCFilterFunctionNArguments* args) {
+    const auto& filter = *reinterpret_cast<const FilterContext*>(args->context)->filter;
+    for (u32 i = 0; i < args->N; ++i) {
+        if (args->valid[i] == 0) {
+            continue;
+        }
+        // The distance of the ray is that of the candidate
+        const EmbreeScene::Hit hit{
+            .t = RTCRayN_tfar(args->ray, args->N, i),
+            .instance = RTCHitN_instID(args->hit, args->N, i, 0),
+            .triangle = RTCHitN_primID(args->hit, args->N, i),
+            .barycentrics = {RTCHitN_u(args->hit, args->N, i), RTCHitN_v(args->hit, args->N, i)},
+        };
+        if (!filter(hit)) {
+            args->valid[i] = 0;
+        }
+    }
+}
+
+void LogError(void*, RTCError error, const char* message) {
+    SPDLOG_ERROR("Embree error {}: {}", static_cast<int>(error), message);
+}
+
+// Argument filters are only called on the geometries of scenes with this flag
+RTCScene NewScene(RTCDevice device) {
+    RTCScene scene = rtcNewScene(device);
+    rtcSetSceneFlags(scene, RTC_SCENE_FLAG_FILTER_FUNCTION_IN_ARGUMENTS);
+    return scene;
+}
+
+} // namespace
+
+bool EmbreeScene::IsSupported() noexcept {
+    return true;
+}
+
+EmbreeScene::EmbreeScene() : impl(std::make_unique<Impl>()) {
+    impl->device = rtcNewDevice(nullptr);
+    if (!impl->device) {
+        SPDLOG_ERROR("Failed to create Embree device: error {}",
+                     static_cast<int>(rtcGetDeviceError(nullptr)));
+        throw std::runtime_error("Failed to create Embree device");
+    }
+    rtcSetDeviceErrorFunction(impl->device, LogError, nullptr);
+}
+
+EmbreeScene::~EmbreeScene() {
+    if (impl->instances) {
+        rtcReleaseScene(impl->instances);
+    }
+    for (RTCScene scene : impl->meshes) {
+        rtcReleaseScene(scene);
+    }
+    rtcReleaseDevice(impl->device);
+}
+
+void EmbreeScene::AddMesh(const void* vertices, std::size_t vertex_stride,
+                          std::size_t num_vertices, const void* triangles,
+                          std::size_t index_stride, std::size_t num_triangles) {
+    RTCScene scene = NewScene(impl->device);
+    if (num_triangles > 0) {
+        RTCGeometry geometry = rtcNewGeometry(impl->device, RTC_GEOMETRY_TYPE_TRIANGLE);
+        rtcSetSharedGeometryBuffer(geometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
+                                   vertices, 0, vertex_stride, num_vertices);
+        rtcSetSharedGeometryBuffer(geometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
+                                   triangles, 0, index_stride, num_triangles);
+        rtcCommitGeometry(geometry);
+        rtcAttachGeometry(scene, geometry);
+        rtcReleaseGeometry(geometry);
+    }
+    rtcCommitScene(scene);
+    impl->meshes.push_back(scene);
+}
+
+void EmbreeScene::SetInstances(std::span<const u32> meshes, std::span<const glm::mat4> transforms) {
+    if (impl->instances) {
+        rtcReleaseScene(impl->instances);
+    }
+    impl->instances = NewScene(impl->device);
+    for (std::size_t i = 0; i < meshes.size(); ++i) {
+        RTCGeometry geometry = rtcNewGeometry(impl->device, RTC_GEOMETRY_TYPE_INSTANCE);
+        rtcSetGeometryInstancedScene(geometry, impl->meshes[meshes[i]]);
+        rtcSetGeometryTransform(geometry, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR,
+                                &transforms[i][0][0]);
+        rtcCommitGeometry(geometry);
+        // So that the hits have the index of their instance
+        rtcAttachGeometryByID(impl->instances, geometry, static_cast<u32>(i));
+        rtcReleaseGeometry(geometry);
+    }
+    rtcCommitScene(impl->instances);
+}
+
+bool EmbreeScene::Intersect(const glm::vec3& origin, const glm::vec3& direction, float t_min,
+                            float t_max, const Filter& filter, Hit& hit, bool any_hit) const {
+    FilterContext context{};
+    rtcInitRayQueryContext(&context.context);
+    context.filter = &filter;
+    RTCRay ray{
+        .org_x = origin.x,
+        .org_y = origin.y,
+        .org_z = origin.z,
+        .tnear = t_min,
+        .dir_x = direction.x,
+        .dir_y = direction.y,
+        .dir_z = direction.z,
+        .time = 0.0f,
+        .tfar = t_max,
+        .mask = ~0u,
+        .id = 0,
+        .flags = 0,
+    };
+
+    if (any_hit) {
+        RTCOccludedArguments args;
+        rtcInitOccludedArguments(&args);
+        args.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
+        args.context = &context.context;
+        args.filter = FilterHits;
+        rtcOccluded1(impl->instances, &ray, &args);
+        // Set to -infinity if anything is hit
+        return ray.tfar < 0;
+    }
+
+    RTCRayHit ray_hit{.ray = ray};
+    ray_hit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+    ray_hit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+    RTCIntersectArguments args;
+    rtcInitIntersectArguments(&args);
+    args.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
+    args.context = &context.context;
+    args.filter = FilterHits;
+    rtcIntersect1(impl->instances, &ray_hit, &args);
+    if (ray_hit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+        return false;
+    }
+    hit = {
+        .t = ray_hit.ray.tfar,
+        .instance = ray_hit.hit.instID[0],
+        .triangle = ray_hit.hit.primID,
+        .barycentrics = {ray_hit.hit.u, ray_hit.hit.v},
+    };
+    return true;
+}
+
+#else
+
+struct EmbreeScene::Impl {};
+
+bool EmbreeScene::IsSupported() noexcept {
+    return false;
+}
+
+EmbreeScene::EmbreeScene() {
+    throw std::runtime_error("Built without ENABLE_EMBREE");
+}
+
+EmbreeScene::~EmbreeScene() = default;
+
+void EmbreeScene::AddMesh(const void*, std::size_t, std::size_t, const void*, std::size_t,
+                          std::size_t) {}
+
+void EmbreeScene::SetInstances(std::span<const u32>, std::span<const glm::mat4>) {}
+
+bool EmbreeScene::Intersect(const glm::vec3&, const glm::vec3&, float, float, const Filter&,
+                            Hit&, bool) const {
+    return false;
+}
+
+#endif
+
+} // namespace Renderer
@@ -0,0 +1,55 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <span>
+#include <glm/glm.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+/**
+ * Traces the rays of VulkanPathTracerCPU with Embree (ENABLE_EMBREE) instead of its HostBVHs:
+ * each mesh is a scene of a triangle geometry, over the vertices and triangles of the tracer
+ * which it shares, and the instances are those of the meshes in a scene of their own. Without
+ * Embree, IsSupported is false and the constructor throws.
+ */
+class EmbreeScene : NonCopyable {
+public:
+    static bool IsSupported() noexcept;
+
+    struct Hit {
+        float t{};
+        u32 instance{};
+        u32 triangle{};
+        glm::vec2 barycentrics{}; // Of the second and third vertices
+    };
+    // Whether to accept the candidate hit, e.g. for culling back faces and alpha testing
+    using Filter = std::function<bool(const Hit& hit)>;
+
+    EmbreeScene();
+    ~EmbreeScene();
+
+    // Adds the next mesh, of triangles of three u32 vertex indices each, which are index_stride
+    // bytes apart, into vertices of a float3 position each, vertex_stride bytes apart. Both are
+    // shared, so they must outlive the scene.
+    void AddMesh(const void* vertices, std::size_t vertex_stride, std::size_t num_vertices,
+                 const void* triangles, std::size_t index_stride, std::size_t num_triangles);
+    // Replaces the instances, each of the mesh (in the order they were added) with the transform
+    void SetInstances(std::span<const u32> meshes, std::span<const glm::mat4> transforms);
+
+    // Closest hit along the ray in [t_min, t_max) that the filter accepts, or for shadow rays
+    // whether there is any. Thread safe.
+    bool Intersect(const glm::vec3& origin, const glm::vec3& direction, float t_min, float t_max,
+                   const Filter& filter, Hit& hit, bool any_hit) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+} // namespace Renderer
@@ -0,0 +1,142 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <numeric>
+#include "core/path_tracer_cpu/host_bvh.h"
+
+namespace Renderer {
+
+static GLSL::AABB Merge(const GLSL::AABB& a, const GLSL::AABB& b) {
+    return {
+        .min_point = glm::min(a.min_point, b.min_point),
+        .max_point = glm::max(a.max_point, b.max_point),
+    };
+}
+
+// Proportional to the chance of a ray hitting the box, as it is to its surface area
+static float HalfArea(const GLSL::AABB& bounds) {
+    const glm::vec3 d = glm::max(bounds.max_point - bounds.min_point, glm::vec3{0});
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static const GLSL::AABB EmptyBounds{
+    .min_point = glm::vec3{std::numeric_limits<float>::infinity()},
+    .max_point = glm::vec3{-std::numeric_limits<float>::infinity()},
+};
+
+HostBVH::HostBVH(std::span<const GLSL::AABB> item_bounds) {
+    if (item_bounds.empty()) {
+        return;
+    }
+    std::vector<glm::vec3> centroids;
+    centroids.reserve(item_bounds.size());
+    for (const auto& bounds : item_bounds) {
+        centroids.emplace_back((bounds.min_point + bounds.max_point) * 0.5f);
+    }
+    items.resize(item_bounds.size());
+    std::iota(items.begin(), items.end(), u32{0});
+
+    nodes.reserve(2 * (items.size() / MaxLeafSize + 1));
+    nodes.emplace_back();
+    Build(0, 0, static_cast<u32>(items.size()), item_bounds, centroids);
+}
+
+void HostBVH::Build(u32 node_idx, u32 begin, u32 end, std::span<const GLSL::AABB> item_bounds,
+                    std::span<const glm::vec3> centroids) {
+    GLSL::AABB bounds = EmptyBounds;
+    GLSL::AABB centroid_bounds = EmptyBounds;
+    for (u32 i = begin; i < end; ++i) {
+        bounds = Merge(bounds, item_bounds[items[i]]);
+        centroid_bounds.min_point = glm::min(centroid_bounds.min_point, centroids[items[i]]);
+        centroid_bounds.max_point = glm::max(centroid_bounds.max_point, centroids[items[i]]);
+    }
+    if (end - begin <= MaxLeafSize) {
+        nodes[node_idx] = {
+            .bounds = bounds,
+            .first = begin,
+            .count = end - begin,
+        };
+        return;
+    }
+
+    // The split between bins of the lowest cost, counting the items on either side weighted by
+    // the area of their bounds
+    const glm::vec3 extent = centroid_bounds.max_point - centroid_bounds.min_point;
+    const auto GetBin = [&centroid_bounds, &extent](const glm::vec3& centroid, int axis) {
+        const float offset = (centroid[axis] - centroid_bounds.min_point[axis]) / extent[axis];
+        return std::min(static_cast<std::size_t>(offset * NumBins), NumBins - 1);
+    };
+    int best_axis = -1;
+    std::size_t best_split = 0; // Bins up to it go to the first child
+    float best_cost = std::numeric_limits<float>::infinity();
+    for (int axis = 0; axis < 3; ++axis) {
+        if (extent[axis] <= 0) {
+            continue;
+        }
+        std::array<GLSL::AABB, NumBins> bin_bounds;
+        bin_bounds.fill(EmptyBounds);
+        std::array<u32, NumBins> bin_counts{};
+        for (u32 i = begin; i < end; ++i) {
+            const std::size_t bin = GetBin(centroids[items[i]], axis);
+            bin_bounds[bin] = Merge(bin_bounds[bin], item_bounds[items[i]]);
+            ++bin_counts[bin];
+        }
+        std::array<float, NumBins> right_costs{};
+        GLSL::AABB right_bounds = EmptyBounds;
+        u32 right_count = 0;
+        for (std::size_t bin = NumBins - 1; bin > 0; --bin) {
+            right_bounds = Merge(right_bounds, bin_bounds[bin]);
+            right_count += bin_counts[bin];
+            right_costs[bin - 1] = right_count > 0 ? HalfArea(right_bounds) * right_count : 0;
+        }
+        GLSL::AABB left_bounds = EmptyBounds;
+        u32 left_count = 0;
+        for (std::size_t split = 0; split + 1 < NumBins; ++split) {
+            left_bounds = Merge(left_bounds, bin_bounds[split]);
+            left_count += bin_counts[split];
+            if (left_count == 0 || left_count == end - begin) {
+                continue;
+            }
+            const float cost = HalfArea(left_bounds) * left_count + right_costs[split];
+            if (cost < best_cost) {
+                best_axis = axis;
+                best_split = split;
+                best_cost = cost;
+            }
+        }
+    }
+
+    u32 mid;
+    if (best_axis >= 0) {
+        mid = static_cast<u32>(
+            std::partition(items.begin() + begin, items.begin() + end,
+                           [&](u32 item) {
+                               return GetBin(centroids[item], best_axis) <= best_split;
+                           }) -
+            items.begin());
+    } else { // All centroids coincide
+        mid = begin + (end - begin) / 2;
+    }
+
+    const auto first_child = static_cast<u32>(nodes.size());
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[node_idx] = {
+        .bounds = bounds,
+        .first = first_child,
+        .count = 0,
+    };
+    Build(first_child, begin, mid, item_bounds, centroids);
+    Build(first_child + 1, mid, end, item_bounds, centroids);
+}
+
+GLSL::AABB HostBVH::GetBounds() const noexcept {
+    return nodes.empty() ? EmptyBounds : nodes[0].bounds;
+}
+
+std::size_t HostBVH::GetHostSize() const noexcept {
+    return nodes.capacity() * sizeof(Node) + items.capacity() * sizeof(u32);
+}
+
+} // namespace Renderer
@@ -0,0 +1,128 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <span>
+#include <vector>
+#include <glm/glm.hpp>
+#include "common/common_types.h"
+#include "core/shaders/scene_glsl.h"
+
+namespace Renderer {
+
+/**
+ * Bounding volume hierarchy over boxes for tracing rays on the CPU, of the triangles of a mesh
+ * or of the instances of a sub scene. Built top down by the surface area heuristic over bins of
+ * the centroids of the items, so that the items of every leaf are contiguous. The items are
+ * tested by the caller, which the traversal hands those of the leaves the ray enters, near
+ * children first.
+ */
+class HostBVH {
+public:
+    static constexpr std::size_t MaxLeafSize = 4;
+    // Of the centroids along each axis, over which splits are evaluated
+    static constexpr std::size_t NumBins = 16;
+
+    struct Node {
+        GLSL::AABB bounds;
+        u32 first{}; // The first child, followed by the second, or the first item of a leaf
+        u32 count{}; // Items of a leaf, 0 for inner nodes
+    };
+
+    HostBVH() = default;
+    explicit HostBVH(std::span<const GLSL::AABB> item_bounds);
+
+    // Of all items. Empty (min above max) without any.
+    GLSL::AABB GetBounds() const noexcept;
+
+    // Calls test(item) for the items of the leaves the ray enters before t_max, which test may
+    // lower (through the reference) to the distance of a hit. Stops once test returns true,
+    // e.g. for shadow rays. inv_direction is 1 / direction.
+    template <typename F>
+    void Traverse(const glm::vec3& origin, const glm::vec3& inv_direction, float& t_max,
+                  F&& test) const {
+        if (nodes.empty()) {
+            return;
+        }
+        std::array<u32, 64> stack;
+        std::size_t stack_size = 0;
+        u32 node_idx = 0;
+        if (IntersectNode(nodes[0], origin, inv_direction, t_max) > t_max) {
+            return;
+        }
+        while (true) {
+            const Node& node = nodes[node_idx];
+            if (node.count > 0) {
+                for (u32 i = node.first; i < node.first + node.count; ++i) {
+                    if (test(items[i])) {
+                        return;
+                    }
+                }
+            } else {
+                u32 near = node.first;
+                u32 far = node.first + 1;
+                float near_t = IntersectNode(nodes[near], origin, inv_direction, t_max);
+                float far_t = IntersectNode(nodes[far], origin, inv_direction, t_max);
+                if (far_t < near_t) {
+                    std::swap(near, far);
+                    std::swap(near_t, far_t);
+                }
+                if (near_t <= t_max) {
+                    if (far_t <= t_max) {
+                        stack[stack_size++] = far;
+                    }
+                    node_idx = near;
+                    continue;
+                }
+            }
+            // Skips those the hits found since have moved beyond
+            while (true) {
+                if (stack_size == 0) {
+                    return;
+                }
+                node_idx = stack[--stack_size];
+                if (IntersectNode(nodes[node_idx], origin, inv_direction, t_max) <= t_max) {
+                    break;
+                }
+            }
+        }
+    }
+
+    // Bytes of the tree on the heap
+    std::size_t GetHostSize() const noexcept;
+
+    // The root first, for tracing the tree elsewhere, e.g. on the device
+    std::span<const Node> GetNodes() const noexcept {
+        return nodes;
+    }
+    // Indices of the items, which the leaves refer to by their position in this order
+    std::span<const u32> GetItems() const noexcept {
+        return items;
+    }
+
+private:
+    // Distance along the ray to where it enters the node, infinity if it misses it
+    static float IntersectNode(const Node& node, const glm::vec3& origin,
+                               const glm::vec3& inv_direction, float t_max) noexcept {
+        const glm::vec3 t0 = (node.bounds.min_point - origin) * inv_direction;
+        const glm::vec3 t1 = (node.bounds.max_point - origin) * inv_direction;
+        const glm::vec3 t_near = glm::min(t0, t1);
+        const glm::vec3 t_far = glm::max(t0, t1);
+        const float enter = std::max({t_near.x, t_near.y, t_near.z, 0.0f});
+        const float exit = std::min({t_far.x, t_far.y, t_far.z, t_max});
+        return enter <= exit ? enter : std::numeric_limits<float>::infinity();
+    }
+
+    void Build(u32 node_idx, u32 begin, u32 end, std::span<const GLSL::AABB> item_bounds,
+               std::span<const glm::vec3> centroids);
+
+    std::vector<Node> nodes;
+    std::vector<u32> items; // See GetItems
+};
+
+} // namespace Renderer
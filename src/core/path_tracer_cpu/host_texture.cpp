@@ -0,0 +1,121 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <spdlog/spdlog.h>
+#include "core/path_tracer_cpu/host_texture.h"
+#include "core/vulkan/vulkan_texture.h"
+
+namespace Renderer {
+
+const vk::SamplerCreateInfo HostTexture::DefaultSampler{
+    .magFilter = vk::Filter::eLinear,
+    .minFilter = vk::Filter::eLinear,
+    .mipmapMode = vk::SamplerMipmapMode::eLinear,
+    .addressModeU = vk::SamplerAddressMode::eRepeat,
+    .addressModeV = vk::SamplerAddressMode::eRepeat,
+    .minLod = 0.0f,
+    .maxLod = VK_LOD_CLAMP_NONE,
+};
+
+// Of each 8-bit sRGB value
+static const std::array<float, 256> SrgbToLinear = [] {
+    std::array<float, 256> table{};
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        const float c = static_cast<float>(i) / 255.0f;
+        table[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+    return table;
+}();
+
+HostTexture::HostTexture(const DecodedTexture& data, const vk::SamplerCreateInfo& sampler)
+    : srgb(data.format == vk::Format::eR8G8B8A8Srgb), mag_filter(sampler.magFilter),
+      min_filter(sampler.minFilter), mipmap_mode(sampler.mipmapMode),
+      address_mode_u(sampler.addressModeU), address_mode_v(sampler.addressModeV),
+      max_lod(sampler.maxLod) {
+    if (data.format != vk::Format::eR8G8B8A8Srgb && data.format != vk::Format::eR8G8B8A8Unorm) {
+        SPDLOG_WARN("Host texture of format {} cannot be sampled", vk::to_string(data.format));
+        return;
+    }
+    for (std::size_t i = 0; i < data.mip_levels.size(); ++i) {
+        levels.push_back({
+            .width = std::max(data.width >> i, 1u),
+            .height = std::max(data.height >> i, 1u),
+            .texels = data.GetLevel(i),
+        });
+    }
+    size_lod = 0.5f * std::log2(static_cast<float>(data.width) * static_cast<float>(data.height));
+}
+
+// Of the texel at the integer coordinate, wrapped into the extent
+static int WrapCoordinate(int i, int size, vk::SamplerAddressMode mode) {
+    switch (mode) {
+    case vk::SamplerAddressMode::eRepeat:
+        return ((i % size) + size) % size;
+    case vk::SamplerAddressMode::eMirroredRepeat: {
+        const int t = ((i % (2 * size)) + 2 * size) % (2 * size);
+        return t < size ? t : 2 * size - 1 - t;
+    }
+    default:
+        return std::clamp(i, 0, size - 1);
+    }
+}
+
+glm::vec4 HostTexture::Fetch(const Level& level, int x, int y) const {
+    x = WrapCoordinate(x, static_cast<int>(level.width), address_mode_u);
+    y = WrapCoordinate(y, static_cast<int>(level.height), address_mode_v);
+    const u8* texel = &level.texels[(static_cast<std::size_t>(y) * level.width + x) * 4];
+    if (srgb) {
+        return {SrgbToLinear[texel[0]], SrgbToLinear[texel[1]], SrgbToLinear[texel[2]],
+                texel[3] / 255.0f};
+    }
+    return glm::vec4{texel[0], texel[1], texel[2], texel[3]} / 255.0f;
+}
+
+glm::vec4 HostTexture::SampleLevel(const Level& level, const glm::vec2& texcoord,
+                                   vk::Filter filter) const {
+    const glm::vec2 position = texcoord * glm::vec2{level.width, level.height};
+    if (filter == vk::Filter::eNearest) {
+        return Fetch(level, static_cast<int>(std::floor(position.x)),
+                     static_cast<int>(std::floor(position.y)));
+    }
+    // Between the centers of the four texels around it
+    const glm::vec2 corner = position - 0.5f;
+    const glm::vec2 base = glm::floor(corner);
+    const glm::vec2 weight = corner - base;
+    const int x = static_cast<int>(base.x);
+    const int y = static_cast<int>(base.y);
+    return glm::mix(glm::mix(Fetch(level, x, y), Fetch(level, x + 1, y), weight.x),
+                    glm::mix(Fetch(level, x, y + 1), Fetch(level, x + 1, y + 1), weight.x),
+                    weight.y);
+}
+
+glm::vec4 HostTexture::Sample(const glm::vec2& texcoord, float lod) const {
+    if (levels.empty()) {
+        return glm::vec4{1};
+    }
+    // The level selection of the Vulkan spec, without a bias
+    const float lambda = std::clamp(lod + size_lod, 0.0f, max_lod);
+    if (lambda <= 0) {
+        return SampleLevel(levels[0], texcoord, mag_filter);
+    }
+    const auto max_level = static_cast<float>(levels.size() - 1);
+    if (mipmap_mode == vk::SamplerMipmapMode::eNearest) {
+        const float level = std::min(std::ceil(lambda + 0.5f) - 1.0f, max_level);
+        return SampleLevel(levels[static_cast<std::size_t>(level)], texcoord, min_filter);
+    }
+    const float level = std::min(std::floor(lambda), max_level);
+    const auto finer = static_cast<std::size_t>(level);
+    const std::size_t coarser = std::min(finer + 1, levels.size() - 1);
+    const glm::vec4 finer_value = SampleLevel(levels[finer], texcoord, min_filter);
+    if (coarser == finer) {
+        return finer_value;
+    }
+    return glm::mix(finer_value, SampleLevel(levels[coarser], texcoord, min_filter),
+                    lambda - level);
+}
+
+} // namespace Renderer
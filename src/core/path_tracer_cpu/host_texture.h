@@ -0,0 +1,61 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include <vector>
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class DecodedTexture;
+
+/**
+ * Samples a texture on the CPU as textureLod does on the device: bilinearly (or the nearest
+ * texel) within a level by the filters of the sampler, and between the levels by its mipmap
+ * mode, wrapping the texcoords by its address modes. sRGB texels are decoded before they are
+ * filtered, like those of sRGB formats. Reads the RGBA8 levels of an Image::host_texture, which
+ * must outlive it.
+ */
+class HostTexture {
+public:
+    // Textures without a sampler, as VulkanDevice::default_sampler
+    static const vk::SamplerCreateInfo DefaultSampler;
+
+    // Of nothing, sampled as white, e.g. for images that are not kept on the host
+    HostTexture() = default;
+    explicit HostTexture(const DecodedTexture& data, const vk::SamplerCreateInfo& sampler);
+
+    // lod is that of a texture of a single texel, to which the log2 of the size is added, see
+    // PointInfo of vertex_attributes.inl.glsl. Below that of any texture, it samples level 0.
+    glm::vec4 Sample(const glm::vec2& texcoord, float lod) const;
+
+    bool IsEmpty() const noexcept {
+        return levels.empty();
+    }
+
+private:
+    struct Level {
+        u32 width{};
+        u32 height{};
+        std::span<const u8> texels; // RGBA8
+    };
+    glm::vec4 Fetch(const Level& level, int x, int y) const;
+    glm::vec4 SampleLevel(const Level& level, const glm::vec2& texcoord, vk::Filter filter) const;
+
+    std::vector<Level> levels;
+    bool srgb{};
+    float size_lod{}; // Half the log2 of the texels of level 0
+    vk::Filter mag_filter{};
+    vk::Filter min_filter{};
+    vk::SamplerMipmapMode mipmap_mode{};
+    vk::SamplerAddressMode address_mode_u{};
+    vk::SamplerAddressMode address_mode_v{};
+    float max_lod{};
+};
+
+} // namespace Renderer
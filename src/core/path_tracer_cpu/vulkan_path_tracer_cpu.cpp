@@ -0,0 +1,1108 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <numbers>
+#include <spdlog/spdlog.h>
+#include "common/profiling.h"
+#include "common/thread_pool.h"
+#include "core/hot_reload.h"
+#include "core/load_profiler.h"
+#include "core/path_tracer_cpu/vulkan_path_tracer_cpu.h"
+#include "core/scene.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_context.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_frames_in_flight.hpp"
+#include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_profiler.h"
+#include "core/vulkan/vulkan_swapchain.h"
+#include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_texture_streamer.h"
+#include "core/vulkan/vulkan_upload_ring.h"
+
+namespace Renderer {
+
+namespace {
+
+// Those of the path tracer shaders, see raytrace.rgen
+constexpr float RayTMin = 0.001f;
+constexpr float RayTMax = 10000.0f;
+constexpr float Pi = std::numbers::pi_v<float>;
+// Below the level of any texture, see FINEST_TEXTURE_LOD of vertex_attributes.inl.glsl
+constexpr float FinestTextureLod = -128.0f;
+
+// Ported from sampler.glsl and rng.glsl, so that the samples are those of the GPU
+
+constexpr u32 CameraDimensions = 4;
+constexpr u32 BounceDimensions = 16;
+
+constexpr std::array<u32, 96> SobolDirections{{
+    0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u,
+    0xff000000u, 0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u,
+    0xaaaa0000u, 0xffff0000u, 0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u,
+    0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u, 0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u,
+    0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+
+    0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u,
+    0xc5000000u, 0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u,
+    0x60ee0000u, 0x90550000u, 0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u,
+    0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u, 0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u,
+    0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+
+    0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u,
+    0x93000000u, 0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u,
+    0x82020000u, 0xc3050000u, 0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u,
+    0x914e5400u, 0xdbe79e00u, 0x25db6d00u, 0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u,
+    0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u,
+}};
+
+u32 ReverseBits(u32 x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+u32 Tea(u32 val0, u32 val1) {
+    u32 v0 = val0;
+    u32 v1 = val1;
+    u32 s0 = 0;
+    for (u32 n = 0; n < 16; n++) {
+        s0 += 0x9e3779b9u;
+        v0 += ((v1 << 4) + 0xa341316cu) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4u);
+        v1 += ((v0 << 4) + 0xad90777du) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761eu);
+    }
+    return v0;
+}
+
+u32 Sobol(u32 index, u32 dimension) {
+    if (dimension == 0) {
+        return ReverseBits(index);
+    }
+    u32 x = 0;
+    for (u32 bit = (dimension - 1) * 32; index != 0; index >>= 1, ++bit) {
+        if ((index & 1) != 0) {
+            x ^= SobolDirections[bit];
+        }
+    }
+    return x;
+}
+
+u32 HashUint(u32 x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+u32 LaineKarrasPermutation(u32 x, u32 seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+u32 NestedUniformScramble(u32 x, u32 seed) {
+    return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+}
+
+struct SamplerState {
+    u32 scramble{};
+    u32 sample_index{};
+    u32 dimension{};
+
+    void SetBounceDimension(u32 bounce) {
+        dimension = CameraDimensions + bounce * BounceDimensions;
+    }
+
+    float Next() {
+        const u32 group_seed = HashUint(scramble ^ HashUint(dimension / 4));
+        const u32 index = NestedUniformScramble(sample_index, group_seed);
+        const u32 x = NestedUniformScramble(Sobol(index, dimension % 4),
+                                            HashUint(group_seed + dimension % 4));
+        dimension++;
+        return static_cast<float>(x >> 8) / static_cast<float>(0x01000000);
+    }
+};
+
+// Ported from russian_roulette.glsl
+float RouletteSurvival(const glm::vec3& weight, u32 depth, u32 roulette_depth,
+                       float min_probability, float u) {
+    if (weight == glm::vec3{0}) {
+        return 0.0f;
+    }
+    if (depth < roulette_depth || min_probability >= 1.0f) {
+        return 1.0f;
+    }
+    const float luminance = glm::dot(weight, glm::vec3{0.2126f, 0.7152f, 0.0722f});
+    const float probability = std::clamp(luminance, min_probability, 1.0f);
+    return u < probability ? probability : 0.0f;
+}
+
+// Ported from punctual_light.glsl
+glm::vec3 GetPunctualLightIrradiance(const GLSL::PunctualLight& light, const glm::vec3& position,
+                                     glm::vec3& direction, float& distance) {
+    if (light.type == PUNCTUAL_LIGHT_DIRECTIONAL) {
+        direction = -light.direction;
+        distance = RayTMax;
+        return light.intensity;
+    }
+    const glm::vec3 to_light = light.position - position;
+    const float distance_sqr = glm::dot(to_light, to_light);
+    if (distance_sqr == 0) {
+        direction = {0, 0, 1};
+        distance = 0;
+        return glm::vec3{0};
+    }
+    distance = std::sqrt(distance_sqr);
+    direction = to_light / distance;
+
+    float attenuation = 1.0f / distance_sqr;
+    if (light.range > 0) {
+        const float ratio = distance / light.range;
+        attenuation *= std::clamp(1.0f - ratio * ratio * ratio * ratio, 0.0f, 1.0f);
+    }
+    if (light.type == PUNCTUAL_LIGHT_SPOT) {
+        const float cos_angle = glm::dot(light.direction, -direction);
+        const float scale = 1.0f / std::max(light.cos_inner_cone - light.cos_outer_cone, 1e-4f);
+        const float spot = std::clamp((cos_angle - light.cos_outer_cone) * scale, 0.0f, 1.0f);
+        attenuation *= spot * spot;
+    }
+    return light.intensity * attenuation;
+}
+
+// Ported from surface.glsl, see there
+
+float TexcoordAreaLod(const glm::vec2& texcoord0, const glm::vec2& texcoord1,
+                      const glm::vec2& texcoord2) {
+    const glm::vec2 edge1 = texcoord1 - texcoord0;
+    const glm::vec2 edge2 = texcoord2 - texcoord0;
+    return 0.5f * std::log2(std::max(std::abs(edge1.x * edge2.y - edge1.y * edge2.x), 1e-30f));
+}
+
+// Instead of the tangents of the vertices, which those on the host do not have: of the triangle
+// of the edges, along the texcoords of their ends, orthogonal to the normal, with the sign of
+// the bitangent in W. False if the texcoords are degenerate.
+bool GetTriangleTangent(const glm::vec3& e1, const glm::vec3& e2, const glm::vec2& uv1,
+                        const glm::vec2& uv2, const glm::vec3& normal, glm::vec4& tangent) {
+    const float det = uv1.x * uv2.y - uv1.y * uv2.x;
+    if (det == 0) {
+        return false;
+    }
+    const glm::vec3 t = (e1 * uv2.y - e2 * uv1.y) / det;
+    const glm::vec3 b = (e2 * uv1.x - e1 * uv2.x) / det;
+    const glm::vec3 orthogonal = t - normal * glm::dot(normal, t);
+    const float length = glm::length(orthogonal);
+    if (!(length > 0)) {
+        return false;
+    }
+    tangent = glm::vec4{orthogonal / length,
+                        glm::dot(glm::cross(normal, orthogonal), b) < 0 ? -1.0f : 1.0f};
+    return true;
+}
+
+// Ported from pbr_metallic_roughness.glsl, see there
+
+glm::vec3 ImportanceSampleCosine(SamplerState& sampler) {
+    const float r1 = sampler.Next();
+    const float r2 = sampler.Next();
+    const float sq = std::sqrt(1.0f - r2);
+    return {std::cos(2 * Pi * r1) * sq, std::sin(2 * Pi * r1) * sq, std::sqrt(r2)};
+}
+
+void CreateCoordinateSystem(const glm::vec3& N, glm::vec3& Nt, glm::vec3& Nb) {
+    if (std::abs(N.x) > std::abs(N.y)) {
+        Nt = glm::vec3{N.z, 0, -N.x} / std::sqrt(N.x * N.x + N.z * N.z);
+    } else {
+        Nt = glm::vec3{0, -N.z, N.y} / std::sqrt(N.y * N.y + N.z * N.z);
+    }
+    Nb = glm::cross(N, Nt);
+}
+
+glm::vec3 SampleGGXVNDF(const glm::vec3& V_tangent, float alpha, SamplerState& sampler) {
+    const float xi_x = sampler.Next();
+    const float xi_y = sampler.Next();
+
+    const glm::vec3 V = glm::normalize(glm::vec3{alpha * V_tangent.x, alpha * V_tangent.y,
+                                                 V_tangent.z});
+    const float lensq = V.x * V.x + V.y * V.y;
+    const glm::vec3 T1 =
+        lensq > 0.0f ? glm::vec3{-V.y, V.x, 0.0f} / std::sqrt(lensq) : glm::vec3{1, 0, 0};
+    const glm::vec3 T2 = glm::cross(V, T1);
+
+    const float a = 1.0f / (1.0f + V.z);
+    const float r = std::sqrt(xi_x);
+    const float phi = (xi_y < a) ? xi_y / a * Pi : Pi + (xi_y - a) / (1.0f - a) * Pi;
+    const float P1 = r * std::cos(phi);
+    const float P2 = r * std::sin(phi) * ((xi_y < a) ? 1.0f : V.z);
+
+    glm::vec3 H = P1 * T1 + P2 * T2 + std::sqrt(std::max(0.0f, 1.0f - P1 * P1 - P2 * P2)) * V;
+    H = {alpha * H.x, alpha * H.y, std::max(0.0f, H.z)};
+    return glm::normalize(H);
+}
+
+float LambdaSmith(float NdotX, float alpha) {
+    const float alpha_sqr = alpha * alpha;
+    const float NdotX_sqr = NdotX * NdotX;
+    return (-1.0f + std::sqrt(alpha_sqr * (1.0f - NdotX_sqr) / NdotX_sqr + 1.0f)) * 0.5f;
+}
+
+float G1Smith(float NdotV, float alpha) {
+    return 1.0f / (1.0f + LambdaSmith(NdotV, alpha));
+}
+
+float G2Smith(float NdotL, float NdotV, float alpha) {
+    return 1.0f / (1.0f + LambdaSmith(NdotV, alpha) + LambdaSmith(NdotL, alpha));
+}
+
+float DGGX(float NdotH, float alpha) {
+    const float alpha_sqr = alpha * alpha;
+    const float d = NdotH * NdotH * (alpha_sqr - 1.0f) + 1.0f;
+    return alpha_sqr / (Pi * d * d);
+}
+
+float SamplePdf(const glm::vec3& V, const glm::vec3& wi, float alpha, float p) {
+    if (wi.z <= 0 || V.z <= 0) {
+        return 0;
+    }
+    const glm::vec3 H = glm::normalize(wi + V);
+    const float specular_pdf = G1Smith(V.z, alpha) * DGGX(H.z, alpha) / (4 * V.z);
+    return p * wi.z / Pi + (1 - p) * specular_pdf;
+}
+
+bool IsPerfectSpecular(float metallic, float roughness) {
+    return metallic > 0.999f && roughness < 0.001f;
+}
+
+glm::vec3 Fresnel(const glm::vec3& f0, float cos_theta) {
+    return f0 + (1.0f - f0) * std::pow(1 - std::abs(cos_theta), 5.0f);
+}
+
+// Cosine weighted
+glm::vec3 EvaluateBSDF(const glm::vec3& base_color, float metallic, float roughness,
+                       glm::vec3 V, const glm::vec3& N, glm::vec3 wi, float& pdf) {
+    pdf = 0;
+    if (IsPerfectSpecular(metallic, roughness)) {
+        return glm::vec3{0};
+    }
+    glm::vec3 Nt, Nb;
+    CreateCoordinateSystem(N, Nt, Nb);
+    V = {glm::dot(V, Nt), glm::dot(V, Nb), glm::dot(V, N)};
+    wi = {glm::dot(wi, Nt), glm::dot(wi, Nb), glm::dot(wi, N)};
+    if (wi.z <= 0 || V.z <= 0) {
+        return glm::vec3{0};
+    }
+
+    const float alpha = std::max(roughness * roughness, 1e-3f);
+    const glm::vec3 c_diff = glm::mix(base_color, glm::vec3{0}, metallic);
+    const glm::vec3 f0 = glm::mix(glm::vec3{0.04f}, base_color, metallic);
+    const float p = 0.5f * (1 - metallic);
+    pdf = SamplePdf(V, wi, alpha, p);
+
+    const glm::vec3 H = glm::normalize(wi + V);
+    const glm::vec3 F = Fresnel(f0, glm::dot(V, H));
+    const glm::vec3 diffuse = (1.0f - F) * c_diff / Pi * wi.z;
+    const glm::vec3 specular = F * DGGX(H.z, alpha) * G2Smith(wi.z, V.z, alpha) / (4 * V.z);
+    return diffuse + specular;
+}
+
+// Cosine weighted and divided by the PDF
+void ImportanceSample(const glm::vec3& base_color, float metallic, float roughness,
+                      glm::vec3 V, const glm::vec3& N, SamplerState& sampler, glm::vec3& wi,
+                      glm::vec3& reflectance) {
+    const glm::vec3 f0 = glm::mix(glm::vec3{0.04f}, base_color, metallic);
+    if (IsPerfectSpecular(metallic, roughness)) {
+        wi = glm::reflect(-V, N);
+        reflectance = Fresnel(f0, glm::dot(V, N));
+        return;
+    }
+
+    glm::vec3 Nt, Nb;
+    CreateCoordinateSystem(N, Nt, Nb);
+    V = {glm::dot(V, Nt), glm::dot(V, Nb), glm::dot(V, N)};
+
+    const float alpha = roughness * roughness;
+    const glm::vec3 c_diff = glm::mix(base_color, glm::vec3{0}, metallic);
+    const float p = 0.5f * (1 - metallic);
+    if (sampler.Next() < p) {
+        wi = ImportanceSampleCosine(sampler);
+        const glm::vec3 F = Fresnel(f0, glm::dot(V, glm::normalize(wi + V)));
+        reflectance = (1.0f - F) * c_diff / p;
+    } else {
+        wi = SampleGGXVNDF(V, alpha, sampler);
+        const glm::vec3 F = Fresnel(f0, glm::dot(V, glm::normalize(wi + V)));
+        reflectance = F * G2Smith(wi.z, V.z, alpha) / G1Smith(V.z, alpha) / (1 - p);
+    }
+    wi = wi.x * Nt + wi.y * Nb + wi.z * N;
+}
+
+} // namespace
+
+VulkanPathTracerCPU::VulkanPathTracerCPU(bool enable_validation_layers,
+                                         std::vector<const char*> frontend_required_extensions)
+    : VulkanPathTracerHW(enable_validation_layers, std::move(frontend_required_extensions)) {}
+
+VulkanPathTracerCPU::~VulkanPathTracerCPU() {
+    device->WaitIdle();
+}
+
+VulkanRenderer::OffscreenImageInfo VulkanPathTracerCPU::GetOffscreenImageInfo() const {
+    return {
+        .format = vk::Format::eR32G32B32A32Sfloat,
+        .usage = vk::ImageUsageFlagBits::eTransferDst,
+        .dst_stage_mask = vk::PipelineStageFlagBits2::eCopy,
+        .dst_access_mask = vk::AccessFlagBits2::eTransferWrite,
+    };
+}
+
+VulkanRenderer::DeviceRequirements VulkanPathTracerCPU::GetDeviceRequirements() const {
+    // Nothing of ray tracing, so that any device can present, software ones included
+    return {
+        .features =
+            Helpers::GenericStructureChain{
+                vk::PhysicalDeviceFeatures2{
+                    .features =
+                        {
+                            .samplerAnisotropy = VK_TRUE,
+                        },
+                },
+                vk::PhysicalDeviceVulkan12Features{
+                    .runtimeDescriptorArray = VK_TRUE,
+                    .timelineSemaphore = VK_TRUE,
+                    // We don't need this in itself, but we enabled it on VMA
+                    .bufferDeviceAddress = VK_TRUE,
+                },
+                vk::PhysicalDeviceVulkan13Features{
+                    .pipelineCreationCacheControl = VK_TRUE,
+                    .synchronization2 = VK_TRUE,
+                },
+            },
+    };
+}
+
+void VulkanPathTracerCPU::LoadScene(GLTF::Container& gltf) {
+    scene = std::make_unique<Scene>();
+
+    // The device copies of the geometry are left unused. Unless device_textures is set, so are
+    // those of the textures, which are only loaded at their smallest as the shading samples the
+    // host copies.
+    SceneLoader loader{{
+                           .usage = vk::BufferUsageFlagBits::eVertexBuffer,
+                           .dst_stage_mask = vk::PipelineStageFlagBits2::eVertexAttributeInput,
+                           .dst_access_mask = vk::AccessFlagBits2::eVertexAttributeRead,
+                       },
+                       {
+                           .usage = vk::BufferUsageFlagBits::eIndexBuffer,
+                           .dst_stage_mask = vk::PipelineStageFlagBits2::eIndexInput,
+                           .dst_access_mask = vk::AccessFlagBits2::eIndexRead,
+                       },
+                       *scene,
+                       *device,
+                       gltf,
+                       thread_pool.get(),
+                       device_textures && compress_textures,
+                       0,
+                       num_frames_in_flight,
+                       false,
+                       false,
+                       true,
+                       false,
+                       false,
+                       0,
+                       optimize_indices,
+                       pack_vertices,
+                       false,
+                       device_textures ? TextureQuality{
+                                             .max_size = max_texture_size,
+                                             .dropped_levels = dropped_texture_levels,
+                                             .budget = texture_quality_budget,
+                                         }
+                                       : TextureQuality{
+                                             .max_size = 1,
+                                         },
+                       gpu_tangent_triangles,
+                       spatial_order,
+                       0,
+                       false,
+                       !device_textures};
+    BuildMeshes();
+    loader.profiler->Report();
+    device->allocator->LogUsage();
+
+    UpdateMaterials();
+    BuildTextures();
+    sub_scene_idx = scene->main_sub_scene;
+    BuildInstances();
+    if (!staging_frames) {
+        staging_frames = std::make_unique<VulkanFramesInFlight<Frame>>(*device,
+                                                                        num_frames_in_flight);
+    }
+    frame_count = 0;
+}
+
+void VulkanPathTracerCPU::BuildMeshes() {
+    embree.reset(); // Shares the meshes
+    meshes = std::vector<HostMesh>(scene->meshes.size());
+    const bool use_embree = EmbreeScene::IsSupported();
+    const auto BuildMesh = [this, use_embree](std::size_t mesh_idx) {
+        auto& host_mesh = meshes[mesh_idx];
+        for (const auto& primitive : scene->meshes[mesh_idx]->primitives) {
+            if (primitive->meshlets.meshlets.empty()) {
+                SPDLOG_WARN("Primitive of mesh {} has no meshlets and will not be drawn",
+                            mesh_idx);
+                continue;
+            }
+            const auto first_vertex = static_cast<u32>(host_mesh.vertices.size());
+            host_mesh.vertices.insert(host_mesh.vertices.end(), primitive->meshlet_vertices.begin(),
+                                      primitive->meshlet_vertices.end());
+            const auto material = static_cast<u32>(
+                primitive->material == -1 ? scene->materials.size() - 1 : primitive->material);
+            // Three 8-bit indices in the vertices of the meshlet each
+            const auto& meshlets = primitive->meshlets;
+            for (const auto& meshlet : meshlets.meshlets) {
+                for (u32 t = 0; t < meshlet.triangle_count; ++t) {
+                    const u32 packed = meshlets.triangles[meshlet.first_triangle + t];
+                    Triangle triangle{.material = material};
+                    for (u32 j = 0; j < 3; ++j) {
+                        const u32 local_index = (packed >> (j * 8)) & 0xFF;
+                        triangle.vertices[j] =
+                            first_vertex + meshlets.vertices[meshlet.first_vertex + local_index];
+                    }
+                    host_mesh.triangles.emplace_back(triangle);
+                }
+            }
+            // Only the host copies are traced
+            primitive->meshlets = {};
+            primitive->meshlet_vertices = {};
+        }
+        if (use_embree) {
+            return;
+        }
+
+        std::vector<GLSL::AABB> triangle_bounds;
+        triangle_bounds.reserve(host_mesh.triangles.size());
+        for (const auto& triangle : host_mesh.triangles) {
+            GLSL::AABB bounds{
+                .min_point = host_mesh.vertices[triangle.vertices[0]].position,
+                .max_point = host_mesh.vertices[triangle.vertices[0]].position,
+            };
+            for (u32 j = 1; j < 3; ++j) {
+                const glm::vec3& position = host_mesh.vertices[triangle.vertices[j]].position;
+                bounds.min_point = glm::min(bounds.min_point, position);
+                bounds.max_point = glm::max(bounds.max_point, position);
+            }
+            triangle_bounds.emplace_back(bounds);
+        }
+        host_mesh.bvh = HostBVH{triangle_bounds};
+    };
+    if (thread_pool) {
+        thread_pool->ParallelFor(std::size_t{0}, meshes.size(), BuildMesh);
+    } else {
+        for (std::size_t i = 0; i < meshes.size(); ++i) {
+            BuildMesh(i);
+        }
+    }
+    if (use_embree) { // Which builds them in parallel itself
+        embree = std::make_unique<EmbreeScene>();
+        for (const auto& mesh : meshes) {
+            // The positions come first in the vertices
+            embree->AddMesh(mesh.vertices.data(), sizeof(MeshPrimitive::MeshletVertex),
+                            mesh.vertices.size(), mesh.triangles.data(), sizeof(Triangle),
+                            mesh.triangles.size());
+        }
+    }
+}
+
+void VulkanPathTracerCPU::UpdateMaterials() {
+    materials.clear();
+    for (const auto& material : scene->materials) {
+        materials.push_back({
+            .factors = material->glsl_material,
+            .double_sided = material->double_sided,
+            .textured = material->IsTextured(),
+        });
+    }
+}
+
+void VulkanPathTracerCPU::BuildTextures() {
+    textures.clear();
+    for (const auto& texture : scene->textures) {
+        if (!texture->image->host_texture) {
+            textures.emplace_back();
+            continue;
+        }
+        textures.emplace_back(*texture->image->host_texture,
+                              texture->sampler ? texture->sampler->create_info
+                                               : HostTexture::DefaultSampler);
+    }
+}
+
+void VulkanPathTracerCPU::BuildInstances() {
+    const auto& sub_scene = GetSubScene();
+    instances.clear();
+    std::vector<GLSL::AABB> instance_bounds;
+    std::vector<u32> instance_meshes;
+    std::vector<glm::mat4> instance_transforms;
+    for (std::size_t i = 0; i < sub_scene.instance_meshes.size(); ++i) {
+        const u32 mesh = sub_scene.instance_meshes[i];
+        if (meshes[mesh].triangles.empty()) {
+            continue;
+        }
+        const glm::mat4& transform = sub_scene.instance_transforms[i];
+        const glm::mat4 world_to_object = glm::inverse(transform);
+        instances.push_back({
+            .mesh = mesh,
+            .world_to_object = world_to_object,
+            .object_to_world = glm::mat3{transform},
+            .normal_to_world = glm::transpose(glm::mat3{world_to_object}),
+            .mirrored = glm::determinant(glm::mat3{transform}) < 0,
+        });
+        if (embree) {
+            instance_meshes.push_back(mesh);
+            instance_transforms.push_back(transform);
+            continue;
+        }
+
+        const GLSL::AABB local_bounds = meshes[mesh].bvh.GetBounds();
+        GLSL::AABB bounds{
+            .min_point = glm::vec3{std::numeric_limits<float>::infinity()},
+            .max_point = glm::vec3{-std::numeric_limits<float>::infinity()},
+        };
+        for (u32 corner = 0; corner < 8; ++corner) {
+            const glm::vec3 point{
+                (corner & 1) ? local_bounds.max_point.x : local_bounds.min_point.x,
+                (corner & 2) ? local_bounds.max_point.y : local_bounds.min_point.y,
+                (corner & 4) ? local_bounds.max_point.z : local_bounds.min_point.z,
+            };
+            const glm::vec3 world_point{transform * glm::vec4{point, 1.0f}};
+            bounds.min_point = glm::min(bounds.min_point, world_point);
+            bounds.max_point = glm::max(bounds.max_point, world_point);
+        }
+        instance_bounds.emplace_back(bounds);
+    }
+    if (embree) {
+        embree->SetInstances(instance_meshes, instance_transforms);
+    } else {
+        instance_bvh = HostBVH{instance_bounds};
+    }
+    lights = sub_scene.lights;
+}
+
+bool VulkanPathTracerCPU::IsBackFaceCulled(const HostInstance& instance,
+                                           const Triangle& triangle, float det) const {
+    return (det > 0) == instance.mirrored && !materials[triangle.material].double_sided;
+}
+
+bool VulkanPathTracerCPU::IsAlphaCutOut(const HostMesh& mesh, const Triangle& triangle,
+                                        const glm::vec2& barycentrics) const {
+    const auto& material = materials[triangle.material].factors;
+    if (material.alpha_cutoff < 0) {
+        return false;
+    }
+    const auto& v0 = mesh.vertices[triangle.vertices[0]];
+    const auto& v1 = mesh.vertices[triangle.vertices[1]];
+    const auto& v2 = mesh.vertices[triangle.vertices[2]];
+    const glm::vec3 bary{1 - barycentrics.x - barycentrics.y, barycentrics};
+    float alpha = (v0.color.a * bary.x + v1.color.a * bary.y + v2.color.a * bary.z) *
+                  material.base_color_factor.a;
+    if (material.base_color_texture_index != -1) {
+        const std::array<glm::vec2, 2> texcoords{
+            v0.texcoord_0 * bary.x + v1.texcoord_0 * bary.y + v2.texcoord_0 * bary.z,
+            v0.texcoord_1 * bary.x + v1.texcoord_1 * bary.y + v2.texcoord_1 * bary.z,
+        };
+        alpha *= SampleTexture(material.base_color_texture_index,
+                               material.base_color_texture_texcoord, texcoords,
+                               glm::vec2{FinestTextureLod})
+                     .a;
+    }
+    return alpha < material.alpha_cutoff;
+}
+
+glm::vec4 VulkanPathTracerCPU::SampleTexture(int texture_index, u32 texcoord,
+                                             const std::array<glm::vec2, 2>& texcoords,
+                                             const glm::vec2& lods) const {
+    if (texture_index == -1) {
+        return glm::vec4{1};
+    }
+    return textures[texture_index].Sample(texcoords[texcoord], lods[texcoord]);
+}
+
+bool VulkanPathTracerCPU::Intersect(const glm::vec3& origin, const glm::vec3& direction,
+                                    float t_max, Hit& hit, bool any_hit) const {
+    if (embree) {
+        // Culled and alpha tested as below, from the triangles in object space
+        const EmbreeScene::Filter filter = [this, &direction](const Hit& candidate) {
+            const auto& instance = instances[candidate.instance];
+            const auto& mesh = meshes[instance.mesh];
+            const auto& triangle = mesh.triangles[candidate.triangle];
+            const glm::vec3& p0 = mesh.vertices[triangle.vertices[0]].position;
+            const glm::vec3 object_direction{instance.world_to_object *
+                                             glm::vec4{direction, 0.0f}};
+            const float det =
+                glm::dot(mesh.vertices[triangle.vertices[1]].position - p0,
+                         glm::cross(object_direction,
+                                    mesh.vertices[triangle.vertices[2]].position - p0));
+            return !IsBackFaceCulled(instance, triangle, det) &&
+                   !IsAlphaCutOut(mesh, triangle, candidate.barycentrics);
+        };
+        return embree->Intersect(origin, direction, RayTMin, t_max, filter, hit, any_hit);
+    }
+
+    bool found = false;
+    instance_bvh.Traverse(origin, 1.0f / direction, t_max, [&](u32 instance_idx) {
+        const auto& instance = instances[instance_idx];
+        const auto& mesh = meshes[instance.mesh];
+        // Distances are the same in object space, as the direction is transformed as is
+        const glm::vec3 object_origin{instance.world_to_object * glm::vec4{origin, 1.0f}};
+        const glm::vec3 object_direction{instance.world_to_object * glm::vec4{direction, 0.0f}};
+        bool stop = false;
+        mesh.bvh.Traverse(object_origin, 1.0f / object_direction, t_max, [&](u32 triangle_idx) {
+            const auto& triangle = mesh.triangles[triangle_idx];
+            const auto& v0 = mesh.vertices[triangle.vertices[0]];
+            const auto& v1 = mesh.vertices[triangle.vertices[1]];
+            const auto& v2 = mesh.vertices[triangle.vertices[2]];
+            // Moller-Trumbore, where the determinant is positive for counterclockwise triangles
+            // facing the ray
+            const glm::vec3 e1 = v1.position - v0.position;
+            const glm::vec3 e2 = v2.position - v0.position;
+            const glm::vec3 pvec = glm::cross(object_direction, e2);
+            const float det = glm::dot(e1, pvec);
+            if (det == 0 || IsBackFaceCulled(instance, triangle, det)) {
+                return false;
+            }
+            const float inv_det = 1.0f / det;
+            const glm::vec3 tvec = object_origin - v0.position;
+            const float u = glm::dot(tvec, pvec) * inv_det;
+            if (u < 0 || u > 1) {
+                return false;
+            }
+            const glm::vec3 qvec = glm::cross(tvec, e1);
+            const float v = glm::dot(object_direction, qvec) * inv_det;
+            if (v < 0 || u + v > 1) {
+                return false;
+            }
+            const float t = glm::dot(e2, qvec) * inv_det;
+            if (t < RayTMin || t >= t_max || IsAlphaCutOut(mesh, triangle, {u, v})) {
+                return false;
+            }
+            t_max = t;
+            hit = {
+                .t = t,
+                .instance = instance_idx,
+                .triangle = triangle_idx,
+                .barycentrics = {u, v},
+            };
+            found = true;
+            stop = any_hit;
+            return stop;
+        });
+        return stop;
+    });
+    return found;
+}
+
+glm::vec3 VulkanPathTracerCPU::TraceSample(const FrameUniforms& uniforms, u32 pixel_idx,
+                                           u32 sample_index) const {
+    // As raytrace.rgen samples the pixel, followed by the bounces
+    SamplerState sampler{
+        .scramble = Tea(pixel_idx, sampler_seed),
+        .sample_index = sample_index,
+    };
+    const glm::vec2 jitter = uniforms.frame == 0 ? glm::vec2{0.5f}
+                                                 : glm::vec2{sampler.Next(), sampler.Next()};
+    const u32 x = pixel_idx % uniforms.render_extent.width;
+    const u32 y = pixel_idx / uniforms.render_extent.width;
+    const glm::vec2 d = (glm::vec2{x, y} + jitter) /
+                            glm::vec2{uniforms.render_extent.width, uniforms.render_extent.height} *
+                            2.0f -
+                        1.0f;
+    glm::vec3 origin{uniforms.view_inverse * glm::vec4{0, 0, 0, 1}};
+    const glm::vec4 target = uniforms.proj_inverse * glm::vec4{d.x, d.y, 1, 1};
+    glm::vec3 direction{uniforms.view_inverse * glm::vec4{glm::normalize(glm::vec3{target}), 0}};
+    if (focal_dist != 0) { // Depth of field
+        const glm::vec3 focal_point = focal_dist * direction;
+        const float cam_r1 = sampler.Next() * 2 * Pi;
+        const float cam_r2 = sampler.Next() * aperture;
+        const glm::vec3 cam_right{uniforms.view_inverse * glm::vec4{1, 0, 0, 0}};
+        const glm::vec3 cam_up{uniforms.view_inverse * glm::vec4{0, 1, 0, 0}};
+        const glm::vec3 aperture_pos =
+            (std::cos(cam_r1) * cam_right + std::sin(cam_r1) * cam_up) * std::sqrt(cam_r2);
+        origin += aperture_pos;
+        direction = glm::normalize(focal_point - aperture_pos);
+    }
+
+    glm::vec3 radiance{0};
+    glm::vec3 weight{1};
+    // Of the ray cone, as PathTrace of raytrace.inl.glsl
+    float cone_width = 0;
+    float cone_spread = uniforms.pixel_spread_angle;
+    for (u32 depth = 0; depth < max_depth; ++depth) {
+        sampler.SetBounceDimension(depth);
+        const float survival = RouletteSurvival(weight, depth, roulette_depth, russian_roulette,
+                                                sampler.Next());
+        if (survival == 0) {
+            break;
+        }
+        weight /= survival;
+
+        Hit hit;
+        if (!Intersect(origin, direction, RayTMax, hit, false)) {
+            radiance += weight * (depth == 0 ? glm::vec3{0.8f} : glm::vec3{ambient_light});
+            break;
+        }
+        const auto& instance = instances[hit.instance];
+        const auto& mesh = meshes[instance.mesh];
+        const auto& triangle = mesh.triangles[hit.triangle];
+        const auto& v0 = mesh.vertices[triangle.vertices[0]];
+        const auto& v1 = mesh.vertices[triangle.vertices[1]];
+        const auto& v2 = mesh.vertices[triangle.vertices[2]];
+        const glm::vec3 bary{1 - hit.barycentrics.x - hit.barycentrics.y, hit.barycentrics};
+        const glm::vec3 position = origin + direction * hit.t;
+        const auto& material = materials[triangle.material].factors;
+        const glm::vec3 e1 = v1.position - v0.position;
+        const glm::vec3 e2 = v2.position - v0.position;
+
+        // As ReadVertexAttributes of vertex_attributes.inl.glsl: the footprint of the cone on
+        // the triangle in world space grows as it gets smaller or more grazing, and shrinks as
+        // its texcoords do. Missing texcoords are loaded as zero, which samples the finest level.
+        const std::array<std::array<glm::vec2, 3>, 2> vertex_texcoords{{
+            {v0.texcoord_0, v1.texcoord_0, v2.texcoord_0},
+            {v0.texcoord_1, v1.texcoord_1, v2.texcoord_1},
+        }};
+        std::array<glm::vec2, 2> texcoords;
+        glm::vec2 texcoord_lods{FinestTextureLod};
+        cone_width += cone_spread * hit.t;
+        for (glm::length_t i = 0; i < 2; ++i) {
+            const auto& [t0, t1, t2] = vertex_texcoords[i];
+            texcoords[i] = t0 * bary.x + t1 * bary.y + t2 * bary.z;
+        }
+        if (materials[triangle.material].textured && cone_width > 0) {
+            const glm::vec3 world_cross =
+                glm::cross(instance.object_to_world * e1, instance.object_to_world * e2);
+            const float world_area = std::max(glm::length(world_cross), 1e-30f);
+            const float cos_cone =
+                std::max(std::abs(glm::dot(world_cross, direction)) / world_area, 1e-3f);
+            const float cone_lod = std::log2(cone_width / cos_cone) - 0.5f * std::log2(world_area);
+            for (glm::length_t i = 0; i < 2; ++i) {
+                const auto& [t0, t1, t2] = vertex_texcoords[i];
+                texcoord_lods[i] = cone_lod + TexcoordAreaLod(t0, t1, t2);
+            }
+        }
+
+        // Flat where the primitive has no normals, which are loaded as zero
+        glm::vec3 normal = v0.normal * bary.x + v1.normal * bary.y + v2.normal * bary.z;
+        if (glm::dot(normal, normal) == 0) {
+            normal = glm::cross(e1, e2);
+        } else if (const int normal_texture = material.normal_texture_index;
+                   normal_texture != -1 && !textures[normal_texture].IsEmpty()) {
+            normal = glm::normalize(normal);
+            const auto& [t0, t1, t2] = vertex_texcoords[material.normal_texture_texcoord];
+            glm::vec4 tangent;
+            if (GetTriangleTangent(e1, e2, t1 - t0, t2 - t0, normal, tangent)) {
+                // Z is reconstructed, as the device copies of normal maps may only store XY
+                const glm::vec2 texture_normal =
+                    glm::vec2{SampleTexture(normal_texture, material.normal_texture_texcoord,
+                                            texcoords, texcoord_lods)} *
+                        2.0f -
+                    1.0f;
+                const float texture_normal_z =
+                    std::sqrt(std::max(1.0f - glm::dot(texture_normal, texture_normal), 0.0f));
+                const glm::vec3 vNt = glm::normalize(
+                    glm::vec3{texture_normal * material.normal_scale, texture_normal_z});
+                const glm::vec3 tangent_xyz{tangent};
+                const glm::vec3 vB = tangent.w * glm::cross(normal, tangent_xyz);
+                normal = vNt.x * tangent_xyz + vNt.y * vB + vNt.z * normal;
+            }
+        }
+        normal = glm::normalize(instance.normal_to_world * normal);
+
+        const glm::vec4 color = v0.color * bary.x + v1.color * bary.y + v2.color * bary.z;
+        const glm::vec3 base_color =
+            glm::vec3{color} * glm::vec3{material.base_color_factor} *
+            glm::vec3{SampleTexture(material.base_color_texture_index,
+                                    material.base_color_texture_texcoord, texcoords,
+                                    texcoord_lods)};
+        const glm::vec4 metallic_roughness =
+            SampleTexture(material.metallic_roughness_texture_index,
+                          material.metallic_roughness_texture_texcoord, texcoords, texcoord_lods);
+        const float metallic = material.metallic_factor * metallic_roughness.b;
+        const float roughness = material.roughness_factor * metallic_roughness.g;
+        const glm::vec3 emittance =
+            material.emissive_factor *
+            glm::vec3{SampleTexture(material.emissive_texture_index,
+                                    material.emissive_texture_texcoord, texcoords,
+                                    texcoord_lods)};
+
+        radiance += weight * emittance * intensity_multiplier;
+        const glm::vec3 V = -direction;
+        if (!lights.empty()) { // Picked uniformly
+            const auto num_lights = static_cast<u32>(lights.size());
+            const u32 light = std::min(static_cast<u32>(sampler.Next() * num_lights),
+                                       num_lights - 1);
+            glm::vec3 light_direction;
+            float light_distance;
+            const glm::vec3 irradiance =
+                GetPunctualLightIrradiance(lights[light], position, light_direction,
+                                           light_distance);
+            float pdf;
+            const glm::vec3 bsdf = EvaluateBSDF(base_color, metallic, roughness, V, normal,
+                                                light_direction, pdf);
+            Hit shadow_hit;
+            if (pdf > 0 && irradiance != glm::vec3{0} &&
+                !Intersect(position, light_direction, light_distance - RayTMin, shadow_hit,
+                           true)) {
+                radiance += weight * irradiance * intensity_multiplier * bsdf *
+                            static_cast<float>(num_lights);
+            }
+        }
+
+        glm::vec3 reflectance;
+        ImportanceSample(base_color, metallic, roughness, V, normal, sampler, direction,
+                         reflectance);
+        weight *= reflectance;
+        origin = position;
+        // Rough lobes widen the cone, as raytrace.rchit
+        cone_spread += roughness * roughness;
+    }
+
+    // Removing fireflies, as raytrace.rgen
+    const float lum = glm::dot(radiance, glm::vec3{0.212671f, 0.715160f, 0.072169f});
+    if (lum > intensity_multiplier) {
+        radiance *= intensity_multiplier / lum;
+    }
+    return radiance;
+}
+
+void VulkanPathTracerCPU::TracePixel(const FrameUniforms& uniforms, u32 x, u32 y) {
+    const u32 pixel_idx = y * uniforms.render_extent.width + x;
+    auto& pixel = accumulation[pixel_idx];
+    for (u32 i = 0; i < uniforms.num_samples; ++i) {
+        const glm::vec3 value = TraceSample(uniforms, pixel_idx, uniforms.first_sample + i);
+        if (std::isnan(value.x) || std::isnan(value.y) || std::isnan(value.z)) {
+            continue;
+        }
+        pixel.sum += value;
+        pixel.num_samples++;
+    }
+    uniforms.image[pixel_idx] =
+        glm::vec4{pixel.sum / static_cast<float>(std::max(pixel.num_samples, 1u)), 1.0f};
+}
+
+void VulkanPathTracerCPU::TraceFrame(const FrameUniforms& uniforms) {
+    PROFILE_FUNCTION();
+    const u32 tiles_x = (uniforms.render_extent.width + TileSize - 1) / TileSize;
+    const u32 tiles_y = (uniforms.render_extent.height + TileSize - 1) / TileSize;
+    const u32 num_tiles = tiles_x * tiles_y;
+    std::atomic<u32> next_tile{0};
+    const auto TraceTiles = [&] {
+        for (u32 tile; (tile = next_tile.fetch_add(1, std::memory_order_relaxed)) < num_tiles;) {
+            const u32 x0 = (tile % tiles_x) * TileSize;
+            const u32 y0 = (tile / tiles_x) * TileSize;
+            const u32 x1 = std::min(x0 + TileSize, uniforms.render_extent.width);
+            const u32 y1 = std::min(y0 + TileSize, uniforms.render_extent.height);
+            for (u32 y = y0; y < y1; ++y) {
+                for (u32 x = x0; x < x1; ++x) {
+                    TracePixel(uniforms, x, y);
+                }
+            }
+        }
+    };
+    if (!thread_pool) {
+        TraceTiles();
+        return;
+    }
+    // One task per worker, each claiming tiles until none are left
+    std::vector<std::future<void>> futures;
+    for (std::size_t i = 0; i < thread_pool->GetNumThreads(); ++i) {
+        futures.emplace_back(thread_pool->Submit(TraceTiles));
+    }
+    thread_pool->WaitAll(futures);
+}
+
+void VulkanPathTracerCPU::DrawFrame(const Camera& external_camera, bool force_external_camera) {
+    PROFILE_FUNCTION();
+    const FrameScope frame_scope{*this};
+    StepDefragmentation(true);
+    device->upload_ring->Flush();
+
+    auto& frame = staging_frames->AcquireNextFrame();
+    staging_frames->BeginFrame();
+    const auto& cmd = frame.command_buffer;
+    if (gpu_profiler) {
+        gpu_profiler->BeginFrame(cmd, frame.idx);
+    }
+
+    const auto& sub_scene = GetSubScene();
+    const bool use_external_camera = force_external_camera || sub_scene.cameras.empty();
+    const auto& camera = use_external_camera ? external_camera : *sub_scene.cameras[0];
+    const double viewport_aspect_ratio =
+        static_cast<double>(swap_chain->extent.width) / swap_chain->extent.height;
+    const auto& view = camera.view;
+    const auto& proj = camera.GetProj(viewport_aspect_ratio);
+    const bool camera_moved = view != last_view || proj != last_proj;
+    // Dynamic resolution only while the camera moves, as VulkanPathTracerHW
+    const auto display_extent = GetDisplayExtent(camera.GetAspectRatio(viewport_aspect_ratio));
+    const auto render_extent =
+        GetRenderExtent(camera.GetAspectRatio(viewport_aspect_ratio), camera_moved);
+    if (camera_moved || camera_properties_changed || render_extent != accumulation_extent) {
+        frame_count = 0;
+        camera_properties_changed = false;
+    }
+    last_view = view;
+    last_proj = proj;
+    const std::size_t num_pixels =
+        static_cast<std::size_t>(render_extent.width) * render_extent.height;
+    if (frame_count == 0) {
+        accumulation.assign(num_pixels, {});
+        accumulation_extent = render_extent;
+        accumulated_samples = 0;
+    }
+
+    auto& staging_buffer = frame.extras.staging_buffer;
+    if (!staging_buffer || staging_buffer->size < num_pixels * sizeof(glm::vec4)) {
+        staging_buffer = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = num_pixels * sizeof(glm::vec4),
+                .usage = vk::BufferUsageFlagBits::eTransferSrc,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Scratch);
+    }
+
+    const FrameUniforms uniforms{
+        .view_inverse = glm::inverse(view),
+        .proj_inverse = glm::inverse(proj),
+        .render_extent = render_extent,
+        .first_sample = sample_stream * SamplesPerStream + accumulated_samples % SamplesPerStream,
+        .num_samples = samples_per_frame,
+        .frame = frame_count,
+        .pixel_spread_angle = std::atan(
+            2.0f / (std::abs(proj[1][1]) * static_cast<float>(render_extent.height))),
+        .image = static_cast<glm::vec4*>(staging_buffer->allocation_info.pMappedData),
+    };
+    const auto start = std::chrono::steady_clock::now();
+    TraceFrame(uniforms);
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    UpdateRenderScale({
+        .milliseconds = elapsed.count(),
+        .render_scale = camera_moved ? GetRenderScale() : 1.0,
+    });
+    vmaFlushAllocation(staging_buffer->allocator, staging_buffer->allocation, 0,
+                       num_pixels * sizeof(glm::vec4));
+    frame_count++;
+    accumulated_samples += samples_per_frame;
+
+    {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Copy"};
+        cmd.copyBufferToImage(**staging_buffer, **offscreen_frames[frame.idx].image,
+                              vk::ImageLayout::eGeneral,
+                              {{
+                                  .imageSubresource =
+                                      {
+                                          .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                          .mipLevel = 0,
+                                          .baseArrayLayer = 0,
+                                          .layerCount = 1,
+                                      },
+                                  .imageExtent = {render_extent.width, render_extent.height, 1},
+                              }});
+    }
+    const auto image_available =
+        RecordPostprocess(cmd, frame.idx, render_extent, display_extent,
+                          vk::PipelineStageFlagBits2::eCopy,
+                          vk::AccessFlagBits2::eTransferWrite);
+
+    staging_frames->EndFrame();
+
+    auto wait_semaphores = frame_arena.MakeVector<vk::SemaphoreSubmitInfo>();
+    if (image_available && image_available->semaphore) {
+        wait_semaphores.push_back(*image_available);
+    }
+    staging_frames->Submit(*frame.command_buffer, wait_semaphores, image_available.has_value());
+    if (!image_available) {
+        throw std::runtime_error("Failed to acquire image, ignoring");
+    }
+    swap_chain->Present(*frame.render_finished_semaphore);
+}
+
+void VulkanPathTracerCPU::OnResized(const vk::Extent2D& actual_extent) {
+    VulkanRenderer::OnResized(actual_extent);
+    // Otherwise kept while the render extent is, see DrawFrame
+    if (render_targets_resized) {
+        frame_count = 0;
+    }
+}
+
+void VulkanPathTracerCPU::SetSubScene(std::size_t index) {
+    VulkanRenderer::SetSubScene(index);
+    BuildInstances();
+    frame_count = 0;
+}
+
+void VulkanPathTracerCPU::OnSceneUpdated(const SceneChanges& changes) {
+    if (changes.materials) {
+        UpdateMaterials();
+    }
+    if (changes.transforms) {
+        BuildInstances();
+    }
+    frame_count = 0;
+}
+
+void VulkanPathTracerCPU::AddSceneStats(SceneStats& stats) const {
+    // The BVHs count as the acceleration structures, of their host memory (which that of
+    // Embree does not report)
+    for (const auto& mesh : meshes) {
+        if (!mesh.triangles.empty()) {
+            ++stats.blases.count;
+            stats.blases.bytes += mesh.bvh.GetHostSize();
+        }
+    }
+    ++stats.tlases.count;
+    stats.tlases.bytes += instance_bvh.GetHostSize();
+}
+
+bool VulkanPathTracerCPU::SupportsTiledTracing() const {
+    return false;
+}
+
+bool VulkanPathTracerCPU::SupportsCostHeatmap() const {
+    return false;
+}
+
+bool VulkanPathTracerCPU::SupportsRayStats() const {
+    return false;
+}
+
+bool VulkanPathTracerCPU::SupportsReSTIR() const {
+    return false;
+}
+
+bool VulkanPathTracerCPU::SupportsPathGuiding() const {
+    return false;
+}
+
+bool VulkanPathTracerCPU::SupportsIntegrators() const {
+    return false;
+}
+
+} // namespace Renderer
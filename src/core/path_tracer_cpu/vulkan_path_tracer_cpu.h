@@ -0,0 +1,163 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include <vulkan/vulkan_raii.hpp>
+#include "core/path_tracer_cpu/embree_scene.h"
+#include "core/path_tracer_cpu/host_bvh.h"
+#include "core/path_tracer_cpu/host_texture.h"
+#include "core/path_tracer_hw/vulkan_path_tracer_hw.h"
+#include "core/scene.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+
+/**
+ * Traces the paths of VulkanPathTracerHW on the CPU instead, for render nodes without a GPU
+ * that can trace rays. The Vulkan device (any, e.g. a software one) only postprocesses and
+ * presents or reads back the frames. Each mesh gets a BVH over its triangles, kept on the host
+ * with their vertices, and each sub scene one over the instances, or with Embree
+ * (ENABLE_EMBREE) an EmbreeScene of them instead. The frames are split into
+ * square tiles, which the worker threads claim in turn until none are left, so that threads
+ * done with cheap tiles take over the rest. The accumulation is kept on the host, whose mean is
+ * copied into the offscreen image.
+ *
+ * Pixels draw their samples from the same sequences as VulkanPathTracerHW, by the seed, the
+ * stream and the sample index, so that the frames of both merge with those of the other. The
+ * materials are shaded as raytrace.rchit does, sampling the host copies of the textures (see
+ * HostTexture) at the LODs of the ray cones, but for normal maps taking the tangents from the
+ * texcoords of each triangle, as its vertices have none. The punctual lights are sampled at
+ * every hit and emissive surfaces are found by the bounces, while misses see the ambient light.
+ * Of the settings of VulkanPathTracerHW, those of the lights, the camera, the sampling, the seed
+ * and stream and the convergence apply.
+ */
+class VulkanPathTracerCPU : public VulkanPathTracerHW {
+public:
+    explicit VulkanPathTracerCPU(bool enable_validation_layers,
+                                 std::vector<const char*> frontend_required_extensions);
+    ~VulkanPathTracerCPU() override;
+
+    void LoadScene(GLTF::Container& gltf) override;
+    void DrawFrame(const Camera& external_camera, bool force_external_camera) override;
+    void OnResized(const vk::Extent2D& actual_extent) override;
+    void SetSubScene(std::size_t index) override;
+
+    // Of the pixels the worker threads claim at once
+    static constexpr u32 TileSize = 16;
+
+protected:
+    DeviceRequirements GetDeviceRequirements() const override;
+    // Copied into from the host
+    OffscreenImageInfo GetOffscreenImageInfo() const override;
+    void OnSceneUpdated(const SceneChanges& changes) override;
+    void AddSceneStats(SceneStats& stats) const override;
+    // The frames are traced on the host, in tiles of their own
+    bool SupportsTiledTracing() const override;
+    // It neither measures the costs of the pixels nor counts its rays
+    bool SupportsCostHeatmap() const override;
+    bool SupportsRayStats() const override;
+    // It samples one punctual light per hit, and the BSDFs alone
+    bool SupportsReSTIR() const override;
+    bool SupportsPathGuiding() const override;
+    bool SupportsIntegrators() const override;
+    // Takes the meshlets of the primitives loaded into the triangles of their meshes, and
+    // builds the BVHs of the meshes with the worker threads
+    void BuildMeshes();
+    void UpdateMaterials();
+    // From the host copies of the images the loader kept
+    void BuildTextures();
+    // Of the current sub scene, from its instances and lights
+    void BuildInstances();
+
+    struct Triangle {
+        std::array<u32, 3> vertices{}; // In HostMesh::vertices
+        u32 material{};
+    };
+    struct HostMesh {
+        std::vector<MeshPrimitive::MeshletVertex> vertices; // Of all primitives
+        std::vector<Triangle> triangles;
+        HostBVH bvh; // Over the triangles, unless traced by embree
+    };
+    struct HostInstance {
+        u32 mesh{};
+        glm::mat4 world_to_object{};
+        glm::mat3 object_to_world{}; // Of directions, e.g. for the footprint of ray cones
+        glm::mat3 normal_to_world{}; // Inverse transpose of the transform
+        bool mirrored{};             // Reverses the winding of the triangles
+    };
+    struct HostMaterial {
+        GLSL::Material factors{}; // And the indices of its textures
+        bool double_sided{};
+        bool textured{};
+    };
+    std::vector<HostMesh> meshes; // Indexed like the meshes of the scene
+    std::vector<HostMaterial> materials; // The last is that of primitives without one
+    std::vector<HostTexture> textures;   // Indexed like the textures of the scene
+    std::vector<HostInstance> instances; // Of the current sub scene, with triangles
+    HostBVH instance_bvh;                // Unless traced by embree
+    std::unique_ptr<EmbreeScene> embree; // Of the meshes and instances, if supported
+    std::vector<GLSL::PunctualLight> lights;
+
+private:
+    using Hit = EmbreeScene::Hit;
+    // Closest hit along the ray before t_max, or for shadow rays whether there is any
+    bool Intersect(const glm::vec3& origin, const glm::vec3& direction, float t_max, Hit& hit,
+                   bool any_hit) const;
+    // Whether the hit is on a back face of a single sided material, by the determinant of the
+    // triangle and the direction of the ray in object space (positive for front faces)
+    bool IsBackFaceCulled(const HostInstance& instance, const Triangle& triangle,
+                          float det) const;
+    // Whether the hit at the barycentrics is below the alpha cutoff of its alpha masked
+    // material, at the finest level of the base color texture as alpha_mask.glsl
+    bool IsAlphaCutOut(const HostMesh& mesh, const Triangle& triangle,
+                       const glm::vec2& barycentrics) const;
+    // Of the texture (white if there is none) at the texcoords of the set, of the LOD of a
+    // texture of a single texel, see HostTexture::Sample
+    glm::vec4 SampleTexture(int texture_index, u32 texcoord,
+                            const std::array<glm::vec2, 2>& texcoords,
+                            const glm::vec2& lods) const;
+    struct PixelAccumulation {
+        glm::vec3 sum{};
+        u32 num_samples{};
+    };
+    struct FrameUniforms {
+        glm::mat4 view_inverse{};
+        glm::mat4 proj_inverse{};
+        vk::Extent2D render_extent;
+        u32 first_sample{};
+        u32 num_samples{};
+        u32 frame{};
+        float pixel_spread_angle{}; // Of the ray cones, as PathTracerUniforms
+        glm::vec4* image{}; // Mapped staging buffer, written the mean of each pixel
+    };
+    // Traces the samples of the pixel for the frame into its accumulation
+    void TracePixel(const FrameUniforms& uniforms, u32 x, u32 y);
+    // The camera ray through the pixel and its bounces, as SamplePixel and PathTrace of the
+    // ray generation shader
+    glm::vec3 TraceSample(const FrameUniforms& uniforms, u32 pixel_idx, u32 sample_index) const;
+    // Spreads the tiles of the frame over the worker threads
+    void TraceFrame(const FrameUniforms& uniforms);
+
+    std::vector<PixelAccumulation> accumulation; // Of the render extent
+    vk::Extent2D accumulation_extent;
+    glm::mat4 last_view{};
+    glm::mat4 last_proj{};
+
+    struct Frame {
+        // Host visible, of the mean of the accumulation, copied into the offscreen image
+        std::unique_ptr<VulkanBuffer> staging_buffer;
+    };
+    std::unique_ptr<VulkanFramesInFlight<Frame>> staging_frames;
+    // Whether the device copies of the textures are loaded at the texture quality and sampled
+    // by the shading on the device, instead of the host copies (which are then not kept)
+    bool device_textures = false;
+};
+
+} // namespace Renderer
@@ -0,0 +1,96 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <array>
+#include <cmath>
+#include <numbers>
+#include <span>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <spdlog/spdlog.h>
+#include <stb_image.h>
+#include "common/file_util.h"
+#include "core/path_tracer_hw/environment_map.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_texture.h"
+
+namespace Renderer {
+
+EnvironmentMap::EnvironmentMap(VulkanDevice& device, const std::filesystem::path& path,
+                               vk::PipelineStageFlags2 dst_stage_mask) {
+    const auto contents = Common::ReadFileContents(path);
+    int image_width, image_height, channels_in_file;
+    float* pixels = stbi_loadf_from_memory(contents.data(), static_cast<int>(contents.size()),
+                                           &image_width, &image_height, &channels_in_file,
+                                           STBI_rgb_alpha);
+    if (!pixels) {
+        SPDLOG_ERROR("Failed to load environment map {}: {}", path.string(),
+                     stbi_failure_reason());
+        throw std::runtime_error("Failed to load environment map");
+    }
+    width = static_cast<u32>(image_width);
+    height = static_cast<u32>(image_height);
+    const std::span<const glm::vec4> texels{reinterpret_cast<const glm::vec4*>(pixels),
+                                            std::size_t{width} * height};
+
+    // Luminance of each texel, with rows weighted by their solid angle
+    std::vector<float> cdf(height + texels.size());
+    double total = 0;
+    for (u32 y = 0; y < height; ++y) {
+        const std::span<float> row{cdf.data() + height + std::size_t{y} * width, width};
+        double row_sum = 0;
+        for (u32 x = 0; x < width; ++x) {
+            const glm::vec3 color{texels[std::size_t{y} * width + x]};
+            row_sum += std::max(glm::dot(color, glm::vec3{0.212671f, 0.715160f, 0.072169f}), 0.0f);
+            row[x] = static_cast<float>(row_sum);
+        }
+        for (u32 x = 0; x < width; ++x) { // Uniform if the row is black, it is never picked
+            row[x] = row_sum > 0 ? static_cast<float>(row[x] / row_sum)
+                                 : static_cast<float>(x + 1) / static_cast<float>(width);
+        }
+        total += row_sum * std::sin(std::numbers::pi * (y + 0.5) / height);
+        cdf[y] = static_cast<float>(total);
+    }
+    for (u32 y = 0; y < height; ++y) {
+        cdf[y] = total > 0 ? static_cast<float>(cdf[y] / total)
+                           : static_cast<float>(y + 1) / static_cast<float>(height);
+    }
+    if (!(total > 0)) {
+        SPDLOG_WARN("Environment map {} is black", path.string());
+    }
+
+    std::vector<u64> half_texels(texels.size());
+    for (std::size_t i = 0; i < texels.size(); ++i) {
+        half_texels[i] = glm::packHalf4x16(texels[i]);
+    }
+    stbi_image_free(pixels);
+
+    const std::array<std::span<const u8>, 1> levels{{
+        {reinterpret_cast<const u8*>(half_texels.data()), half_texels.size() * sizeof(u64)},
+    }};
+    VulkanTextureUploadBatch batch{device};
+    texture = std::make_unique<VulkanTexture>(
+        device,
+        std::make_unique<DecodedTexture>(width, height, 1, vk::Format::eR16G16B16A16Sfloat,
+                                         vk::ComponentMapping{}, levels, nullptr),
+        batch);
+    batch.Flush();
+
+    cdf_buffer = std::make_unique<VulkanImmUploadBuffer>(
+        device,
+        VulkanBufferCreateInfo{
+            .size = cdf.size() * sizeof(float),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            .dst_stage_mask = dst_stage_mask,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+        },
+        reinterpret_cast<const u8*>(cdf.data()));
+    SPDLOG_INFO("Loaded environment map {} ({}x{})", path.string(), width, height);
+}
+
+EnvironmentMap::~EnvironmentMap() = default;
+
+} // namespace Renderer
@@ -0,0 +1,37 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <vulkan/vulkan.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanDevice;
+class VulkanImmUploadBuffer;
+class VulkanTexture;
+
+/**
+ * Equirectangular HDR environment map (Radiance .hdr), lighting the scene where rays miss it.
+ * Uploaded as RGBA16F, along with the CDFs for importance sampling it by its luminance: the
+ * marginal CDF of the rows (weighted by their solid angle), then the conditional CDF of the
+ * texels of each row. See environment.glsl.
+ */
+class EnvironmentMap : NonCopyable {
+public:
+    // The CDFs are read by the dst_stage_mask
+    explicit EnvironmentMap(VulkanDevice& device, const std::filesystem::path& path,
+                            vk::PipelineStageFlags2 dst_stage_mask);
+    ~EnvironmentMap();
+
+    u32 width{};
+    u32 height{};
+    std::unique_ptr<VulkanTexture> texture;
+    std::unique_ptr<VulkanImmUploadBuffer> cdf_buffer;
+};
+
+} // namespace Renderer
@@ -0,0 +1,248 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numbers>
+#include <numeric>
+#include "core/path_tracer_hw/light_tree.h"
+
+namespace Renderer {
+
+namespace {
+
+struct LightBounds {
+    glm::vec3 min_point{std::numeric_limits<float>::infinity()};
+    glm::vec3 max_point{-std::numeric_limits<float>::infinity()};
+    float power{};
+    // Of the cone bounding the normals, up to sign as the triangles are two sided
+    glm::vec3 axis{0, 0, 1};
+    float theta_o{};
+};
+
+LightBounds GetLightBounds(const LightTree::Light& light) {
+    LightBounds bounds{
+        .power = light.power,
+    };
+    for (const auto& position : light.positions) {
+        bounds.min_point = glm::min(bounds.min_point, position);
+        bounds.max_point = glm::max(bounds.max_point, position);
+    }
+    const glm::vec3 normal = glm::cross(light.positions[1] - light.positions[0],
+                                        light.positions[2] - light.positions[0]);
+    const float length = glm::length(normal);
+    if (length > 0) {
+        bounds.axis = normal / length;
+    } else { // Degenerate, bounded by every direction
+        bounds.theta_o = std::numbers::pi_v<float>;
+    }
+    return bounds;
+}
+
+// Lights without power are left out of the cones
+LightBounds Merge(const LightBounds& a, const LightBounds& b) {
+    LightBounds result{
+        .min_point = glm::min(a.min_point, b.min_point),
+        .max_point = glm::max(a.max_point, b.max_point),
+        .power = a.power + b.power,
+    };
+    if (!(a.power > 0) || !(b.power > 0)) {
+        const LightBounds& lit = a.power > 0 ? a : b;
+        result.axis = lit.axis;
+        result.theta_o = lit.theta_o;
+        return result;
+    }
+
+    // Smallest cone containing both, with the axes flipped to agree
+    glm::vec3 wide_axis = a.axis;
+    float wide_theta = a.theta_o;
+    glm::vec3 narrow_axis = glm::dot(a.axis, b.axis) < 0 ? -b.axis : b.axis;
+    float narrow_theta = b.theta_o;
+    if (narrow_theta > wide_theta) {
+        std::swap(wide_axis, narrow_axis);
+        std::swap(wide_theta, narrow_theta);
+    }
+    const float cos_theta_d = std::clamp(glm::dot(wide_axis, narrow_axis), -1.0f, 1.0f);
+    const float theta_d = std::acos(cos_theta_d);
+    if (std::min(theta_d + narrow_theta, std::numbers::pi_v<float>) <= wide_theta) {
+        result.axis = wide_axis;
+        result.theta_o = wide_theta;
+        return result;
+    }
+    result.theta_o = (wide_theta + theta_d + narrow_theta) / 2;
+    if (result.theta_o >= std::numbers::pi_v<float>) {
+        result.axis = wide_axis;
+        result.theta_o = std::numbers::pi_v<float>;
+        return result;
+    }
+    // Rotated from the wider axis towards the other
+    const float theta_r = result.theta_o - wide_theta;
+    const glm::vec3 ortho = narrow_axis - wide_axis * cos_theta_d;
+    const float ortho_length = glm::length(ortho);
+    result.axis = ortho_length > 0 ? glm::normalize(wide_axis * std::cos(theta_r) +
+                                                    ortho / ortho_length * std::sin(theta_r))
+                                   : wide_axis;
+    return result;
+}
+
+// Of the directions a cone of normals emits to, with the angle of emission a right angle
+float OrientationMeasure(float theta_o) {
+    constexpr float pi = std::numbers::pi_v<float>;
+    const float theta_w = std::min(theta_o + pi / 2, pi);
+    const float sin_theta_o = std::sin(theta_o);
+    const float cos_theta_o = std::cos(theta_o);
+    return 2 * pi * (1 - cos_theta_o) +
+           pi / 2 *
+               (2 * theta_w * sin_theta_o - std::cos(theta_o - 2 * theta_w) -
+                2 * theta_o * sin_theta_o + cos_theta_o);
+}
+
+// Surface area orientation heuristic, with the regularizer for thin nodes along the axis
+float SplitCost(const LightBounds& bounds, float regularizer) {
+    if (!(bounds.power > 0)) {
+        return 0;
+    }
+    const glm::vec3 extent = bounds.max_point - bounds.min_point;
+    const float area = 2 * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    return bounds.power * OrientationMeasure(bounds.theta_o) * area * regularizer;
+}
+
+} // namespace
+
+LightTree::LightTree(std::span<const Light> lights) {
+    if (lights.empty()) {
+        return;
+    }
+    std::vector<LightBounds> light_bounds(lights.size());
+    std::vector<glm::vec3> centroids(lights.size());
+    for (std::size_t i = 0; i < lights.size(); ++i) {
+        light_bounds[i] = GetLightBounds(lights[i]);
+        centroids[i] = (light_bounds[i].min_point + light_bounds[i].max_point) * 0.5f;
+    }
+    std::vector<u32> items(lights.size());
+    std::iota(items.begin(), items.end(), 0);
+
+    nodes.reserve(2 * lights.size() - 1);
+    nodes.emplace_back();
+    light_leaves.resize(lights.size());
+
+    // Top down with a stack of the nodes to split, as the tree may be deep
+    struct Task {
+        u32 node_idx{};
+        u32 begin{}; // Range of the subtree in items
+        u32 end{};
+    };
+    std::vector<Task> tasks{{.node_idx = 0, .begin = 0, .end = static_cast<u32>(items.size())}};
+    while (!tasks.empty()) {
+        const Task task = tasks.back();
+        tasks.pop_back();
+        if (task.end - task.begin == 1) {
+            nodes[task.node_idx].light = items[task.begin];
+            light_leaves[items[task.begin]] = task.node_idx;
+            continue;
+        }
+
+        LightBounds bounds;
+        glm::vec3 centroid_min = centroids[items[task.begin]];
+        glm::vec3 centroid_max = centroid_min;
+        for (u32 i = task.begin; i < task.end; ++i) {
+            bounds = Merge(bounds, light_bounds[items[i]]);
+            centroid_min = glm::min(centroid_min, centroids[items[i]]);
+            centroid_max = glm::max(centroid_max, centroids[items[i]]);
+        }
+
+        // Cheapest split between the bins of the centroids along any axis
+        const glm::vec3 extent = bounds.max_point - bounds.min_point;
+        const float max_extent = std::max({extent.x, extent.y, extent.z});
+        const glm::vec3 centroid_extent = centroid_max - centroid_min;
+        const auto GetBin = [&](int axis, u32 item) {
+            const float offset =
+                (centroids[item][axis] - centroid_min[axis]) / centroid_extent[axis];
+            return std::min(static_cast<std::size_t>(offset * NumBins), NumBins - 1);
+        };
+        int best_axis = -1;
+        std::size_t best_split{};
+        float best_cost = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!(centroid_extent[axis] > 0)) {
+                continue;
+            }
+            std::array<LightBounds, NumBins> bins{};
+            std::array<u32, NumBins> bin_counts{};
+            for (u32 i = task.begin; i < task.end; ++i) {
+                const std::size_t bin = GetBin(axis, items[i]);
+                bins[bin] = Merge(bins[bin], light_bounds[items[i]]);
+                bin_counts[bin]++;
+            }
+            const float regularizer = max_extent / std::max(extent[axis], 1e-20f);
+            // The costs of the bins below each split, then added to those above it
+            std::array<float, NumBins - 1> costs{};
+            LightBounds below;
+            for (std::size_t split = 0; split + 1 < NumBins; ++split) {
+                below = Merge(below, bins[split]);
+                costs[split] = SplitCost(below, regularizer);
+            }
+            LightBounds above;
+            for (std::size_t split = NumBins - 1; split > 0; --split) {
+                above = Merge(above, bins[split]);
+                costs[split - 1] += SplitCost(above, regularizer);
+            }
+            u32 count_below = 0;
+            for (std::size_t split = 0; split + 1 < NumBins; ++split) {
+                count_below += bin_counts[split];
+                if (count_below == 0 || count_below == task.end - task.begin) {
+                    continue;
+                }
+                if (costs[split] < best_cost) {
+                    best_axis = axis;
+                    best_split = split;
+                    best_cost = costs[split];
+                }
+            }
+        }
+
+        u32 mid{};
+        if (best_axis != -1) {
+            const auto it =
+                std::partition(items.begin() + task.begin, items.begin() + task.end,
+                               [&](u32 item) { return GetBin(best_axis, item) <= best_split; });
+            mid = static_cast<u32>(it - items.begin());
+        } else { // All centroids coincide, split at the median
+            mid = task.begin + (task.end - task.begin) / 2;
+        }
+
+        const auto first_child = static_cast<u32>(nodes.size());
+        nodes.resize(nodes.size() + 2);
+        nodes[task.node_idx].first_child = first_child;
+        nodes[first_child].parent = task.node_idx;
+        nodes[first_child + 1].parent = task.node_idx;
+        tasks.push_back({.node_idx = first_child, .begin = task.begin, .end = mid});
+        tasks.push_back({.node_idx = first_child + 1, .begin = mid, .end = task.end});
+    }
+    Refit(lights);
+}
+
+LightTree::~LightTree() = default;
+
+void LightTree::Refit(std::span<const Light> lights) {
+    std::vector<LightBounds> bounds(nodes.size());
+    for (std::size_t i = 0; i < lights.size(); ++i) {
+        bounds[light_leaves[i]] = GetLightBounds(lights[i]);
+    }
+    // Children are after their parents
+    for (std::size_t i = nodes.size(); i-- > 0;) {
+        auto& node = nodes[i];
+        if (node.first_child != 0) {
+            bounds[i] = Merge(bounds[node.first_child], bounds[node.first_child + 1]);
+        }
+        node.bounds_min = bounds[i].min_point;
+        node.power = bounds[i].power;
+        node.bounds_max = bounds[i].max_point;
+        node.theta_o = bounds[i].theta_o;
+        node.axis = bounds[i].axis;
+    }
+}
+
+} // namespace Renderer
@@ -0,0 +1,48 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <span>
+#include <vector>
+#include <glm/glm.hpp>
+#include "common/common_types.h"
+#include "core/path_tracer_hw/shaders/path_tracer_glsl.h"
+
+namespace Renderer {
+
+/**
+ * Binary BVH over the emissive triangles of a sub scene for many-light sampling (the light tree
+ * of Conty Estevez and Kulla). Each node bounds the positions, power and normals (as a cone) of
+ * the triangles below, so that light samples descend it towards those of the most estimated
+ * contribution to the shaded point, see light_sampling.glsl. Built top down by binned splits of
+ * the least surface area orientation heuristic, with a triangle in each leaf. When the triangles
+ * move or change power, the tree is refit keeping its topology.
+ */
+class LightTree : NonCopyable {
+public:
+    static constexpr std::size_t NumBins = 12; // Of the splits along each axis
+
+    struct Light {
+        std::array<glm::vec3, 3> positions; // World space
+        float power{};
+    };
+
+    explicit LightTree(std::span<const Light> lights);
+    ~LightTree();
+
+    // Of the same lights the tree was built with, in the same order
+    void Refit(std::span<const Light> lights);
+
+    std::size_t GetNumLights() const noexcept {
+        return light_leaves.size();
+    }
+
+    // Root first, empty without lights
+    std::vector<GLSL::LightTreeNode> nodes;
+    std::vector<u32> light_leaves; // Node of each light
+};
+
+} // namespace Renderer
@@ -0,0 +1,349 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <spdlog/spdlog.h>
+#include "common/temp_ptr.h"
+#include "core/path_tracer_hw/mesh_deformer.h"
+#include "core/scene.h"
+#include "core/vulkan/vulkan_accel_structure.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_shader.h"
+
+namespace Renderer {
+
+namespace {
+
+constexpr u32 WorkGroupSize = 64;
+// Of the deformed attributes in the vertices buffer, floats like the rest of the loader's
+constexpr u32 PositionStride = 3 * sizeof(float);
+constexpr u32 NormalStride = 3 * sizeof(float);
+constexpr u32 TangentStride = 4 * sizeof(float);
+constexpr vk::DeviceSize AttributeAlignment = 16;
+
+vk::DeviceSize AlignUp(vk::DeviceSize size) {
+    return (size + AttributeAlignment - 1) / AttributeAlignment * AttributeAlignment;
+}
+
+// Whether the primitive is deformed by the instance, by its skin or morph targets
+bool IsDeformedBy(const MeshPrimitive& primitive, u32 skin) {
+    return primitive.deformation && ((skin != SubScene::NoSkin &&
+                                      !primitive.deformation->skin_vertices.empty()) ||
+                                     primitive.deformation->num_targets > 0);
+}
+
+u32 GetNumTargets(const Mesh& mesh) {
+    u32 num_targets = 0;
+    for (const auto& primitive : mesh.primitives) {
+        if (primitive->deformation) {
+            num_targets = std::max(num_targets, primitive->deformation->num_targets);
+        }
+    }
+    return num_targets;
+}
+
+} // namespace
+
+bool MeshDeformer::IsDeformed(const Scene& scene, std::size_t sub_scene_idx,
+                              std::size_t instance) {
+    const auto& sub_scene = *scene.sub_scenes[sub_scene_idx];
+    const auto& mesh = *scene.meshes[sub_scene.instance_meshes[instance]];
+    const u32 skin = sub_scene.instance_skins[instance];
+    return std::ranges::any_of(mesh.primitives,
+                               [skin](const auto& primitive) {
+                                   return IsDeformedBy(*primitive, skin);
+                               }) &&
+           std::ranges::all_of(mesh.primitives, [](const auto& primitive) {
+               return primitive->GetPrimitiveInfo().position_address != 0;
+           });
+}
+
+MeshDeformer::MeshDeformer(VulkanDevice& device_, const Scene& scene_, std::size_t sub_scene_idx_,
+                           u32 first_primitive_)
+    : first_primitive(first_primitive_), device(device_), scene(scene_),
+      sub_scene_idx(sub_scene_idx_) {
+
+    const auto& sub_scene = *scene.sub_scenes[sub_scene_idx];
+    instance_indices.assign(sub_scene.GetNumInstances(), NotDeformed);
+
+    // Offsets of the skin vertices and morph deltas of each deformed primitive in the buffer
+    struct DeformationOffsets {
+        vk::DeviceSize skin{};
+        vk::DeviceSize morph{};
+    };
+    std::unordered_map<const MeshPrimitive*, DeformationOffsets> deformation_offsets;
+    std::vector<u8> deformation_data;
+    const auto Append = [&deformation_data]<typename T>(const std::vector<T>& values) {
+        const vk::DeviceSize offset = deformation_data.size();
+        deformation_data.resize(AlignUp(offset + values.size() * sizeof(T)));
+        std::memcpy(deformation_data.data() + offset, values.data(), values.size() * sizeof(T));
+        return offset;
+    };
+
+    // Made addresses once the buffers are created, of each copy
+    struct CopyOffsets {
+        DeformationOffsets deformation;
+        bool skinned{};
+        vk::DeviceSize position{}; // In the vertices buffer
+        vk::DeviceSize normal{};
+        vk::DeviceSize tangent{};
+    };
+    std::vector<CopyOffsets> copy_offsets;
+    vk::DeviceSize vertices_size = 0;
+    u32 num_joints = 0;
+    u32 num_weights = 0;
+    for (std::size_t i = 0; i < sub_scene.GetNumInstances(); ++i) {
+        if (!IsDeformed(scene, sub_scene_idx, i)) {
+            continue;
+        }
+        const u32 mesh_idx = sub_scene.instance_meshes[i];
+        const auto& mesh = *scene.meshes[mesh_idx];
+        const u32 skin = sub_scene.instance_skins[i];
+        instance_indices[i] = static_cast<u32>(instances.size());
+        auto& instance = instances.emplace_back(Instance{
+            .instance = static_cast<u32>(i),
+            .first_primitive = static_cast<u32>(primitives.size()),
+            .first_joint = num_joints,
+            .first_weight = num_weights,
+            .num_weights = GetNumTargets(mesh),
+        });
+        if (skin != SubScene::NoSkin) {
+            num_joints += static_cast<u32>(scene.skins[skin]->joints.size());
+        }
+        num_weights += instance.num_weights;
+
+        for (std::size_t j = 0; j < mesh.primitives.size(); ++j) {
+            const auto& primitive = *mesh.primitives[j];
+            const auto& deformation = primitive.deformation;
+            CopyOffsets offsets{
+                .skinned = skin != SubScene::NoSkin && deformation &&
+                           !deformation->skin_vertices.empty(),
+            };
+            // Skins without the joints the vertices reference leave them at rest
+            if (offsets.skinned && deformation->max_joint >= scene.skins[skin]->joints.size()) {
+                SPDLOG_WARN("Skin {} has too few joints for mesh {}", scene.skins[skin]->name,
+                            mesh.name);
+                offsets.skinned = false;
+            }
+            if (deformation) {
+                const auto [it, inserted] = deformation_offsets.try_emplace(&primitive);
+                if (inserted) {
+                    it->second.skin = Append(deformation->skin_vertices);
+                    it->second.morph = Append(deformation->morph_deltas);
+                }
+                offsets.deformation = it->second;
+            }
+
+            const auto rest_info = primitive.GetPrimitiveInfo();
+            const auto num_vertices = static_cast<vk::DeviceSize>(primitive.max_vertices);
+            offsets.position = vertices_size;
+            vertices_size += AlignUp(num_vertices * PositionStride);
+            if (rest_info.normal_address) {
+                offsets.normal = vertices_size;
+                vertices_size += AlignUp(num_vertices * NormalStride);
+            }
+            if (rest_info.tangent_address) {
+                offsets.tangent = vertices_size;
+                vertices_size += AlignUp(num_vertices * TangentStride);
+            }
+            copy_offsets.emplace_back(offsets);
+
+            primitives.emplace_back(Primitive{
+                .source = scene.mesh_first_primitives[mesh_idx] + static_cast<u32>(j),
+                .info = rest_info,
+                .push_constant =
+                    {
+                        .position_address = rest_info.position_address,
+                        .normal_address = rest_info.normal_address,
+                        .tangent_address = rest_info.tangent_address,
+                        .position_format = rest_info.position_format,
+                        .normal_format = rest_info.normal_format,
+                        .tangent_format = rest_info.tangent_format,
+                        .num_vertices = static_cast<u32>(num_vertices),
+                        .num_targets = deformation ? deformation->num_targets : 0,
+                    },
+            });
+        }
+    }
+    if (instances.empty()) {
+        return;
+    }
+
+    // Buffers cannot be empty
+    deformation_data.resize(std::max<std::size_t>(deformation_data.size(), AttributeAlignment));
+    deformation_buffer = std::make_unique<VulkanImmUploadBuffer>(
+        device,
+        VulkanBufferCreateInfo{
+            .size = deformation_data.size(),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            .dst_stage_mask = vk::PipelineStageFlagBits2::eComputeShader,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+        },
+        deformation_data.data());
+    deformation_buffer->SetName("mesh deformation");
+
+    vertices_buffer = std::make_unique<VulkanBuffer>(
+        *device.allocator,
+        vk::BufferCreateInfo{
+            .size = vertices_size,
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                     vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+        },
+        MemoryCategory::Geometry);
+    vertices_buffer->SetName("deformed vertices");
+
+    const auto CreateMapped = [this](vk::DeviceSize size) {
+        return std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .size = std::max<vk::DeviceSize>(size, AttributeAlignment),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Geometry);
+    };
+    joints_buffer = CreateMapped(num_joints * sizeof(glm::mat4));
+    joints_buffer->SetName("deformation joints");
+    weights_buffer = CreateMapped(num_weights * sizeof(float));
+    weights_buffer->SetName("deformation weights");
+
+    const auto GetAddress = [this](const VulkanBuffer& buffer) -> vk::DeviceAddress {
+        return device->getBufferAddress({.buffer = *buffer});
+    };
+    const auto deformation_address = GetAddress(*deformation_buffer);
+    const auto vertices_address = GetAddress(*vertices_buffer);
+    const auto joints_address = GetAddress(*joints_buffer);
+    const auto weights_address = GetAddress(*weights_buffer);
+    for (const auto& instance : instances) {
+        const u32 num_primitives = sub_scene.instance_num_primitives[instance.instance];
+        for (u32 j = instance.first_primitive; j < instance.first_primitive + num_primitives;
+             ++j) {
+            const auto& offsets = copy_offsets[j];
+            auto& info = primitives[j].info;
+            auto& push_constant = primitives[j].push_constant;
+            if (offsets.skinned) {
+                push_constant.skin_address = deformation_address + offsets.deformation.skin;
+                push_constant.joints_address =
+                    joints_address + instance.first_joint * sizeof(glm::mat4);
+            }
+            if (push_constant.num_targets > 0) {
+                push_constant.morph_address = deformation_address + offsets.deformation.morph;
+                push_constant.weights_address =
+                    weights_address + instance.first_weight * sizeof(float);
+            }
+            push_constant.out_position_address = vertices_address + offsets.position;
+            push_constant.out_normal_address =
+                push_constant.normal_address ? vertices_address + offsets.normal : 0;
+            push_constant.out_tangent_address =
+                push_constant.tangent_address ? vertices_address + offsets.tangent : 0;
+
+            // The deformed attributes are floats, the rest are read as they were
+            info.position_address = push_constant.out_position_address;
+            info.position_format = PackAttributeFormat(PositionStride, 0);
+            info.normal_address = push_constant.out_normal_address;
+            if (info.normal_address) {
+                info.normal_format = PackAttributeFormat(NormalStride, 0);
+            }
+            info.tangent_address = push_constant.out_tangent_address;
+            if (info.tangent_address) {
+                info.tangent_format = PackAttributeFormat(TangentStride, 0);
+            }
+        }
+    }
+
+    pipeline = std::make_unique<VulkanComputePipeline>(
+        device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{device, u8"core/shaders/mesh_deformation.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::MeshDeformationPushConstant>(
+                    vk::ShaderStageFlagBits::eCompute),
+            }},
+        });
+}
+
+MeshDeformer::~MeshDeformer() = default;
+
+void MeshDeformer::Record(const vk::raii::CommandBuffer& cmd,
+                          vk::PipelineStageFlags2 dst_stage_mask) {
+    if (instances.empty()) {
+        return;
+    }
+
+    const auto& sub_scene = *scene.sub_scenes[sub_scene_idx];
+    auto* joints = static_cast<glm::mat4*>(joints_buffer->allocation_info.pMappedData);
+    auto* weights = static_cast<float*>(weights_buffer->allocation_info.pMappedData);
+    std::vector<glm::mat4> joint_matrices;
+    for (const auto& instance : instances) {
+        if (sub_scene.instance_skins[instance.instance] != SubScene::NoSkin) {
+            sub_scene.GetJointMatrices(instance.instance, scene, joint_matrices);
+            std::ranges::copy(joint_matrices, joints + instance.first_joint);
+        }
+        if (instance.num_weights == 0) {
+            continue;
+        }
+        // Nodes of meshes with morph targets have a weight for each, see Scene::node_weights
+        const u32 node = sub_scene.node_indices[sub_scene.instance_nodes[instance.instance]];
+        const auto& node_weights = scene.node_weights.at(node);
+        for (u32 i = 0; i < instance.num_weights; ++i) {
+            weights[instance.first_weight + i] = i < node_weights.size() ? node_weights[i] : 0;
+        }
+    }
+    vmaFlushAllocation(joints_buffer->allocator, joints_buffer->allocation, 0, VK_WHOLE_SIZE);
+    vmaFlushAllocation(weights_buffer->allocator, weights_buffer->allocation, 0, VK_WHOLE_SIZE);
+
+    // The refits of the previous deformation read the vertices
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderRead,
+            .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+        }},
+    });
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **pipeline);
+    const u32 max_groups =
+        device.physical_device.getProperties().limits.maxComputeWorkGroupCount[0];
+    for (const auto& primitive : primitives) {
+        cmd.pushConstants<GLSL::MeshDeformationPushConstant>(
+            *pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+            {primitive.push_constant});
+        const u32 num_vertices = primitive.push_constant.num_vertices;
+        cmd.dispatch(std::clamp((num_vertices + WorkGroupSize - 1) / WorkGroupSize, 1u,
+                                max_groups),
+                     1, 1);
+    }
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask =
+                vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR | dst_stage_mask,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderRead,
+        }},
+    });
+}
+
+} // namespace Renderer
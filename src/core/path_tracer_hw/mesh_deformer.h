@@ -0,0 +1,86 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <limits>
+#include <memory>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+#include "core/shaders/mesh_deformation_glsl.h"
+#include "core/shaders/primitive_glsl.h"
+
+namespace Renderer {
+
+struct Scene;
+class VulkanAccelStructure;
+class VulkanBuffer;
+class VulkanComputePipeline;
+class VulkanDevice;
+class VulkanImmUploadBuffer;
+
+/**
+ * Deforms the instances of a sub scene whose meshes are skinned or have morph targets on the
+ * GPU with a compute pass (see mesh_deformation.comp), writing the deformed positions, normals
+ * and tangents of each instance to vertex buffers of its own. Each deformed instance is traced
+ * against a BLAS over those, which is refit rather than rebuilt as the instance moves, as the
+ * topology stays the same.
+ *
+ * Every primitive of a deformed instance gets a copy of its PrimitiveInfo, with the attributes
+ * replaced by the deformed ones, which the renderer appends to those of the scene. The other
+ * attributes (and the indices) are still read from the primitive.
+ */
+class MeshDeformer : NonCopyable {
+public:
+    static constexpr u32 NotDeformed = std::numeric_limits<u32>::max();
+
+    struct Primitive {
+        u32 source{};             // In the primitives of the scene
+        GLSL::PrimitiveInfo info; // Of the deformed copy
+        GLSL::MeshDeformationPushConstant push_constant;
+    };
+    struct Instance {
+        u32 instance{};        // In the sub scene
+        u32 first_primitive{}; // In primitives, one for each primitive of its mesh
+        u32 first_joint{};     // In the mapped joints, of a matrix each (if it has a skin)
+        u32 first_weight{};    // In the mapped weights, one for each morph target
+        u32 num_weights{};
+        // Over the deformed positions, built by the renderer and refit after each Record
+        std::unique_ptr<VulkanAccelStructure> blas;
+    };
+
+    // Whether the instance of the sub scene is deformed, by its skin or the morph targets of its
+    // mesh. Instances of meshes a primitive of which has no positions are not.
+    static bool IsDeformed(const Scene& scene, std::size_t sub_scene_idx, std::size_t instance);
+
+    // The copies of the PrimitiveInfos come after first_primitive others
+    explicit MeshDeformer(VulkanDevice& device, const Scene& scene, std::size_t sub_scene_idx,
+                          u32 first_primitive);
+    ~MeshDeformer();
+
+    // Writes the joint matrices and weights of the instances as the sub scene is now posed, then
+    // records their deformation, followed by a barrier for building acceleration structures from
+    // the deformed positions and for the dst_stage_mask to read the attributes. Nothing may read
+    // the mapped joints and weights meanwhile.
+    void Record(const vk::raii::CommandBuffer& cmd, vk::PipelineStageFlags2 dst_stage_mask);
+
+    u32 first_primitive{};             // Of the first copy, after those of the scene
+    std::vector<Primitive> primitives; // Of the instances in turn
+    std::vector<Instance> instances;   // Deformed instances of the sub scene
+    std::vector<u32> instance_indices; // In instances of each instance, or NotDeformed
+
+private:
+    VulkanDevice& device;
+    const Scene& scene;
+    std::size_t sub_scene_idx{};
+    // SkinVertex and MorphDelta of each deformed primitive of the scene, shared by its instances
+    std::unique_ptr<VulkanImmUploadBuffer> deformation_buffer;
+    std::unique_ptr<VulkanBuffer> vertices_buffer; // Deformed attributes of each copy
+    std::unique_ptr<VulkanBuffer> joints_buffer;   // Host visible mat4s
+    std::unique_ptr<VulkanBuffer> weights_buffer;  // Host visible floats
+    std::unique_ptr<VulkanComputePipeline> pipeline;
+};
+
+} // namespace Renderer
@@ -0,0 +1,131 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <spdlog/spdlog.h>
+#include "common/mapped_file.h"
+#include "core/path_tracer_hw/render_checkpoint.h"
+
+namespace Renderer {
+
+namespace {
+
+constexpr u32 Magic = 0x4b434342; // BCCK
+
+struct Header {
+    u32 magic;
+    u32 version;
+    u64 key_low;
+    u64 key_high;
+    glm::mat4 view;
+    glm::mat4 proj;
+    u32 width;
+    u32 height;
+    u32 frame_count;
+    u32 accumulated_samples;
+    u32 sample_offset;
+    u32 seed;
+    u32 stream;
+    u32 padding;
+    u64 accumulation_size;
+    u64 stats_size;
+    // Followed by the accumulation, then the stats
+};
+
+} // namespace
+
+bool WriteRenderCheckpoint(const std::filesystem::path& path, const RenderCheckpoint& checkpoint) {
+    auto temp_path = path;
+    temp_path += ".tmp";
+    {
+        std::ofstream out_file{temp_path, std::ios::binary};
+        const Header header{
+            .magic = Magic,
+            .version = RenderCheckpoint::Version,
+            .key_low = checkpoint.key.first,
+            .key_high = checkpoint.key.second,
+            .view = checkpoint.view,
+            .proj = checkpoint.proj,
+            .width = checkpoint.width,
+            .height = checkpoint.height,
+            .frame_count = checkpoint.frame_count,
+            .accumulated_samples = checkpoint.accumulated_samples,
+            .sample_offset = checkpoint.sample_offset,
+            .seed = checkpoint.seed,
+            .stream = checkpoint.stream,
+            .padding = 0,
+            .accumulation_size = checkpoint.accumulation.size(),
+            .stats_size = checkpoint.stats.size(),
+        };
+        out_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out_file.write(reinterpret_cast<const char*>(checkpoint.accumulation.data()),
+                       static_cast<std::streamsize>(checkpoint.accumulation.size()));
+        out_file.write(reinterpret_cast<const char*>(checkpoint.stats.data()),
+                       static_cast<std::streamsize>(checkpoint.stats.size()));
+        if (!out_file) {
+            SPDLOG_WARN("Failed to write render checkpoint {}", path.string());
+            out_file.close();
+            std::error_code error;
+            std::filesystem::remove(temp_path, error);
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    if (error) {
+        SPDLOG_WARN("Failed to write render checkpoint {}: {}", path.string(), error.message());
+        std::filesystem::remove(temp_path, error);
+        return false;
+    }
+    return true;
+}
+
+std::optional<RenderCheckpoint> ReadRenderCheckpoint(const std::filesystem::path& path) {
+    if (!std::filesystem::exists(path)) {
+        return std::nullopt;
+    }
+    try {
+        const Common::MappedFile file{path};
+        const auto contents = file.GetSpan();
+        if (contents.size() < sizeof(Header)) {
+            throw std::runtime_error("Checkpoint is truncated");
+        }
+        Header header;
+        std::memcpy(&header, contents.data(), sizeof(Header));
+        if (header.magic != Magic || header.version != RenderCheckpoint::Version) {
+            throw std::runtime_error("Checkpoint has a different version");
+        }
+        const auto data = contents.subspan(sizeof(Header));
+        if (header.accumulation_size > data.size() ||
+            header.stats_size != data.size() - header.accumulation_size) {
+            throw std::runtime_error("Checkpoint is truncated");
+        }
+
+        const auto accumulation = data.first(header.accumulation_size);
+        const auto stats = data.subspan(header.accumulation_size);
+        return RenderCheckpoint{
+            .key = {header.key_low, header.key_high},
+            .view = header.view,
+            .proj = header.proj,
+            .width = header.width,
+            .height = header.height,
+            .frame_count = header.frame_count,
+            .accumulated_samples = header.accumulated_samples,
+            .sample_offset = header.sample_offset,
+            .seed = header.seed,
+            .stream = header.stream,
+            .accumulation = {accumulation.begin(), accumulation.end()},
+            .stats = {stats.begin(), stats.end()},
+        };
+    } catch (const std::exception& e) {
+        SPDLOG_WARN("Ignoring invalid render checkpoint {}: {}", path.string(), e.what());
+        return std::nullopt;
+    }
+}
+
+} // namespace Renderer
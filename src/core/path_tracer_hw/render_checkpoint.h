@@ -0,0 +1,46 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <vector>
+#include <glm/glm.hpp>
+#include "common/common_types.h"
+#include "core/scene_cache.h"
+
+namespace Renderer {
+
+/**
+ * State of a progressive render written to disk, so that it can be resumed once the process is
+ * stopped, e.g. on another machine: the sums of the samples of the pixels and their numbers, and
+ * where the sample sequences of their next samples start. Renders are only resumed from those
+ * of the same key (the scene and the settings that change the image), camera and extent.
+ */
+struct RenderCheckpoint {
+    // Bump when the layout of the file or of the pixel data changes
+    static constexpr u32 Version = 1;
+
+    SceneCache::Key key{};
+    glm::mat4 view{};
+    glm::mat4 proj{};
+    u32 width{};
+    u32 height{};
+    u32 frame_count{};
+    u32 accumulated_samples{};
+    u32 sample_offset{};
+    u32 seed{};
+    u32 stream{};
+    std::vector<u8> accumulation; // GLSL::PixelAccumulation of each pixel
+    std::vector<u8> stats;        // GLSL::PixelStats of each pixel, if sampling adaptively
+};
+
+// Writes a temporary file first and renames it over the previous checkpoint, so that being
+// stopped while writing keeps that. Failures are logged, returning false.
+bool WriteRenderCheckpoint(const std::filesystem::path& path, const RenderCheckpoint& checkpoint);
+// Nothing if there is no checkpoint at the path, or it is invalid (which is logged)
+std::optional<RenderCheckpoint> ReadRenderCheckpoint(const std::filesystem::path& path);
+
+} // namespace Renderer
@@ -0,0 +1,64 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+// Alpha test of the materials of alphaMode MASK, for any hit shaders, ray queries and the
+// visibility buffer of VulkanPathTracerWavefront. The includer declares primitives, materials
+// and textures as raytrace.rchit does, and includes texture_streaming.glsl.
+
+#ifndef _ALPHA_MASK_GLSL
+#define _ALPHA_MASK_GLSL
+
+#include "core/shaders/vertex_fetch.glsl"
+
+// Whether the hit of the triangle at the barycentrics (of its second and third vertex) has an
+// alpha below the cutoff of its material, so that it must be ignored. Opacity micromaps have
+// resolved most hits before these, so this samples the finest resident level without a LOD.
+bool IsAlphaCutOut(uint primitive_idx, int triangle, vec2 attribs) {
+    const PrimitiveInfo primitive = primitives[primitive_idx];
+    if (primitive.material_idx == -1) {
+        return false;
+    }
+    const Material material = UnpackMaterial(materials[primitive.material_idx]);
+    if (material.alpha_cutoff < 0) {
+        return false;
+    }
+
+    const uvec3 indices = ReadTriangleIndices(primitive, triangle);
+    const vec3 barycentrics = vec3(1.0 - attribs.x - attribs.y, attribs.x, attribs.y);
+    float alpha = material.base_color_factor.a;
+
+    // Only RGBA vertex colors have an alpha
+    const uint color_stride = ATTRIBUTE_STRIDE(primitive.color_format);
+    const uint color_type = ATTRIBUTE_TYPE(primitive.color_format);
+    if (color_stride != 0 && color_type <= 2) {
+        const vec3 color_alphas =
+            vec3(LoadColor(primitive.color_address + indices.x * color_stride, color_type).a,
+                 LoadColor(primitive.color_address + indices.y * color_stride, color_type).a,
+                 LoadColor(primitive.color_address + indices.z * color_stride, color_type).a);
+        alpha *= dot(color_alphas, barycentrics);
+    }
+
+    if (material.base_color_texture_index != -1) {
+        const bool second = material.base_color_texture_texcoord != 0;
+        const uint64_t address =
+            second ? primitive.texcoord1_address : primitive.texcoord0_address;
+        const uint format = second ? primitive.texcoord1_format : primitive.texcoord0_format;
+        const uint stride = ATTRIBUTE_STRIDE(format);
+        const uint type = ATTRIBUTE_TYPE(format);
+        if (stride != 0) {
+            const vec2 texcoord0 = LoadTexCoord(address + indices.x * stride, type);
+            const vec2 texcoord1 = LoadTexCoord(address + indices.y * stride, type);
+            const vec2 texcoord2 = LoadTexCoord(address + indices.z * stride, type);
+            const vec2 texcoord = texcoord0 * barycentrics.x + texcoord1 * barycentrics.y +
+                                  texcoord2 * barycentrics.z;
+            const uint texture_index = material.base_color_texture_index;
+            alpha *= textureLod(textures[nonuniformEXT(texture_index)], texcoord,
+                                GetTextureMinLod(texture_index))
+                         .a;
+        }
+    }
+    return alpha < material.alpha_cutoff;
+}
+
+#endif
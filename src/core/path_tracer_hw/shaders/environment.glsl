@@ -0,0 +1,88 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _ENVIRONMENT_GLSL
+#define _ENVIRONMENT_GLSL
+
+// Lookups of the equirectangular environment map, and the density of its importance samples
+// (see EnvironmentMap). Included with the uniforms, by the shaders that handle misses.
+
+#ifndef M_PI
+#define M_PI 3.1415926
+#endif
+
+layout(set = 0, binding = 9) uniform sampler2D environment_map;
+// The marginal CDF of the rows, then the conditional CDF of each row
+layout(set = 0, binding = 10, std430) readonly buffer EnvironmentCDFBlock {
+    float environment_cdf[];
+};
+
+bool HasEnvironmentMap() {
+    return uniforms.p.environment_width != 0;
+}
+
+// Of light samples picking the environment map rather than an emissive triangle or a punctual
+// light
+float EnvironmentSelectionProbability() {
+    if (!HasEnvironmentMap()) {
+        return 0.0;
+    }
+    return uniforms.p.num_lights == 0 && uniforms.p.num_punctual_lights == 0 ? 1.0 : 0.5;
+}
+
+float PowerHeuristic(float pdf, float other_pdf) {
+    const float pdf_sqr = pdf * pdf;
+    return pdf_sqr / (pdf_sqr + other_pdf * other_pdf);
+}
+
+// +Y is up, and the center of the map is towards -Z
+vec2 EnvironmentUV(vec3 direction) {
+    return vec2(atan(direction.x, -direction.z) / (2 * M_PI) + 0.5,
+                acos(clamp(direction.y, -1.0, 1.0)) / M_PI);
+}
+
+vec3 EnvironmentDirection(vec2 uv) {
+    const float phi = (uv.x - 0.5) * 2 * M_PI;
+    const float theta = uv.y * M_PI;
+    return vec3(sin(theta) * sin(phi), cos(theta), -sin(theta) * cos(phi));
+}
+
+vec3 GetEnvironment(vec3 direction) {
+    return textureLod(environment_map, EnvironmentUV(direction), 0.0).rgb *
+           uniforms.p.environment_intensity;
+}
+
+// Probability of the entry i of the CDF starting at first
+float GetCDFStep(uint first, uint i) {
+    return environment_cdf[first + i] - (i == 0 ? 0.0 : environment_cdf[first + i - 1]);
+}
+
+// Of sampling the direction from the map, per unit solid angle
+float EnvironmentPdf(vec3 direction) {
+    const uint width = uniforms.p.environment_width;
+    const uint height = uniforms.p.environment_height;
+    const float sin_theta = sqrt(max(1.0 - direction.y * direction.y, 0.0));
+    if (sin_theta == 0) {
+        return 0.0;
+    }
+    const vec2 uv = EnvironmentUV(direction);
+    const uint x = min(uint(uv.x * width), width - 1);
+    const uint y = min(uint(uv.y * height), height - 1);
+    return GetCDFStep(0, y) * GetCDFStep(height + y * width, x) * float(width * height) /
+           (2 * M_PI * M_PI * sin_theta);
+}
+
+// Of the environment seen by a BSDF sample of the PDF, weighted against the light samples
+float EnvironmentMISWeight(float bsdf_pdf, vec3 direction) {
+    if (bsdf_pdf == 0) {
+        return 1.0;
+    }
+    const float light_pdf = EnvironmentSelectionProbability() * EnvironmentPdf(direction);
+    if (bsdf_pdf < 0) { // Left to the resampled light sample of the last hit, see restir.glsl
+        return light_pdf > 0 ? 0.0 : 1.0;
+    }
+    return PowerHeuristic(bsdf_pdf, light_pdf);
+}
+
+#endif
@@ -0,0 +1,370 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _LIGHT_SAMPLING_GLSL
+#define _LIGHT_SAMPLING_GLSL
+
+// Next event estimation on the emissive triangles and punctual lights of the sub scene and the
+// environment map, combined with the BSDF samples hitting them by multiple importance sampling
+// (power heuristic). Included after vertex_attributes.inl.glsl and SampleTexture, with the
+// uniforms, primitives and materials.
+
+#include "core/path_tracer_hw/shaders/environment.glsl"
+#include "core/path_tracer_hw/shaders/sampler.glsl"
+#include "core/shaders/punctual_light.glsl"
+
+layout(set = 0, binding = 7, std430) readonly buffer EmissiveTriangleBlock {
+    EmissiveTriangle lights[];
+};
+layout(set = 0, binding = 8, std430) readonly buffer LightTreeBlock {
+    LightTreeNode light_tree[];
+};
+// Of the first light of each primitive in those of its mesh, then of each instance of the TLAS,
+// ~0 for those without lights
+layout(set = 0, binding = 16, std430) readonly buffer LightOffsetBlock {
+    uint light_offsets[];
+};
+layout(set = 0, binding = 17, std430) readonly buffer PunctualLightBlock {
+    PunctualLight punctual_lights[];
+};
+
+// Of light samples that do not pick the environment map picking a punctual light rather than
+// an emissive triangle
+float PunctualSelectionProbability() {
+    if (uniforms.p.num_punctual_lights == 0) {
+        return 0.0;
+    }
+    return uniforms.p.num_lights == 0 ? 1.0 : 0.5;
+}
+
+// Estimated contribution of the triangles below the node to the position, from their power,
+// distance and the angle their normals may make with it at least (as in "Importance Sampling of
+// Many Lights with Adaptive Tree Splitting"). The normal at the position is left out, so that
+// the hits of BSDF samples find the same. The triangles emit to both sides.
+float LightTreeImportance(LightTreeNode node, vec3 position) {
+    if (node.power == 0) {
+        return 0.0;
+    }
+    const vec3 center = (node.bounds_min + node.bounds_max) * 0.5;
+    const vec3 to_center = center - position;
+    const float radius_sqr = dot(node.bounds_max - center, node.bounds_max - center);
+    const float distance_sqr = dot(to_center, to_center);
+    // Of the direction to the center from the axis, and of the bounding sphere from there
+    const float cos_theta =
+        min(abs(dot(node.axis, to_center)) * inversesqrt(max(distance_sqr, 1e-20)), 1.0);
+    const float theta_u =
+        distance_sqr <= radius_sqr ? M_PI : asin(sqrt(radius_sqr / distance_sqr));
+    const float theta = max(acos(cos_theta) - node.theta_o - theta_u, 0.0);
+    if (theta >= M_PI / 2) {
+        return 0.0;
+    }
+    return node.power * cos(theta) / max(max(distance_sqr, radius_sqr), 1e-20);
+}
+
+// Of the light tree picking the light for the position
+float LightTreePmf(uint light_idx, vec3 position) {
+    float pmf = 1.0;
+    for (uint node_idx = lights[light_idx].leaf; node_idx != 0;) {
+        const uint parent = light_tree[node_idx].parent;
+        const uint first_child = light_tree[parent].first_child;
+        const uint sibling = node_idx == first_child ? first_child + 1 : first_child;
+        const float importance = LightTreeImportance(light_tree[node_idx], position);
+        if (importance == 0) {
+            return 0.0;
+        }
+        pmf *= importance / (importance + LightTreeImportance(light_tree[sibling], position));
+        node_idx = parent;
+    }
+    return pmf;
+}
+
+// Descends the light tree from the root in proportion to the importance of the children,
+// reusing the random number at each level. ~0 if no light contributes to the position.
+uint SampleLightTree(vec3 position, float u, out float pmf) {
+    pmf = 1.0;
+    uint node_idx = 0;
+    while (light_tree[node_idx].first_child != 0) {
+        const uint first_child = light_tree[node_idx].first_child;
+        const float first = LightTreeImportance(light_tree[first_child], position);
+        const float second = LightTreeImportance(light_tree[first_child + 1], position);
+        if (first + second == 0) {
+            return ~0u;
+        }
+        const float probability = first / (first + second);
+        if (u < probability) {
+            node_idx = first_child;
+            u = min(u / probability, 0.99999994);
+            pmf *= probability;
+        } else {
+            node_idx = first_child + 1;
+            u = min((u - probability) / (1.0 - probability), 0.99999994);
+            pmf *= 1.0 - probability;
+        }
+    }
+    return light_tree[node_idx].light;
+}
+
+// Of the emission hit by a BSDF sample of the PDF from the origin, distance away, on the
+// triangle of the primitive of the instance (in the TLAS). cos_light is that of the angle
+// between the ray and the triangle.
+float EmissionMISWeight(uint instance, uint primitive_idx, uint triangle, vec3 origin,
+                        float bsdf_pdf, float distance, float cos_light) {
+    if (bsdf_pdf == 0 || uniforms.p.num_lights == 0) {
+        return 1.0;
+    }
+    const uint first_light = light_offsets[primitives.length() + instance];
+    const uint primitive_offset = light_offsets[primitive_idx];
+    if (first_light == ~0u || primitive_offset == ~0u) { // E.g. became emissive after loading
+        return 1.0;
+    }
+    const uint light_idx = first_light + primitive_offset + triangle;
+    const float pmf = LightTreePmf(light_idx, origin);
+    if (pmf == 0) { // Never sampled, e.g. without power
+        return 1.0;
+    }
+    if (bsdf_pdf < 0) { // Left to the resampled light sample of the last hit, see restir.glsl
+        return 0.0;
+    }
+    const float light_pdf = (1.0 - EnvironmentSelectionProbability()) *
+                            (1.0 - PunctualSelectionProbability()) * pmf /
+                            lights[light_idx].area * distance * distance / max(cos_light, 1e-6);
+    return PowerHeuristic(bsdf_pdf, light_pdf);
+}
+
+vec3 GetLightEmission(EmissiveTriangle light, vec3 barycentrics) {
+    const Material material = UnpackMaterial(materials[light.material]);
+    if (material.emissive_texture_index == -1) {
+        return material.emissive_factor;
+    }
+
+    const PrimitiveInfo primitive = primitives[light.primitive];
+    const uvec3 indices = ReadTriangleIndices(primitive, int(light.triangle));
+    const bool second = material.emissive_texture_texcoord != 0;
+    const uint64_t address = second ? primitive.texcoord1_address : primitive.texcoord0_address;
+    const uint format = second ? primitive.texcoord1_format : primitive.texcoord0_format;
+    const uint stride = ATTRIBUTE_STRIDE(format);
+    const uint type = ATTRIBUTE_TYPE(format);
+    vec2 texcoord = vec2(0);
+    if (stride != 0) {
+        texcoord = LoadTexCoord(address + indices.x * stride, type) * barycentrics.x +
+                   LoadTexCoord(address + indices.y * stride, type) * barycentrics.y +
+                   LoadTexCoord(address + indices.z * stride, type) * barycentrics.z;
+    }
+    // The light sample has no ray cone of its own
+    return material.emissive_factor *
+           SampleStreamedTexture(material.emissive_texture_index, texcoord, FINEST_TEXTURE_LOD)
+               .rgb;
+}
+
+// Of LightSample::light, besides the emissive triangles
+#define LIGHT_PUNCTUAL_BIT 0x80000000u // With the index of the punctual light
+#define LIGHT_ENVIRONMENT 0xfffffffeu
+
+struct LightSample {
+    vec3 direction;
+    float distance;
+    vec3 emission; // Towards the position, irradiance for punctual lights
+    float pdf;     // Per unit solid angle, the probability of picking them for punctual lights
+    // Of punctual lights, which BSDF samples never hit, so it is not weighted against them
+    bool delta;
+    // What was sampled, so that it can be evaluated at other positions (see LoadLightSample):
+    // the emissive triangle and the barycentrics (y, z) of the point on it, the punctual light,
+    // or the environment map and the UV of the direction. Points are packed with
+    // packUnorm2x16.
+    uint light;
+    uint light_point;
+    // Of emissive triangles, cos_light / distance^2, which turns the PDF into one per unit area.
+    // 1 for the others, whose samples are the same wherever they are evaluated.
+    float geometry;
+};
+
+// Weighs the contribution of the light sample against BSDF samples of the PDF
+float LightSampleMISWeight(LightSample light_sample, float bsdf_pdf) {
+    return light_sample.delta ? 1.0 : PowerHeuristic(light_sample.pdf, bsdf_pdf);
+}
+
+float Luminance(vec3 color) {
+    return dot(color, vec3(0.212671, 0.715160, 0.072169));
+}
+
+// Picks one of the punctual lights in proportion to the luminance of its irradiance at the
+// position, in a single pass over them with the random number rescaled at each light
+bool SamplePunctualLight(vec3 position, float u, float probability,
+                         out LightSample light_sample) {
+    float total = 0.0;
+    float chosen = 0.0;
+    light_sample.light_point = 0;
+    light_sample.geometry = 1.0;
+    for (uint i = 0; i < uniforms.p.num_punctual_lights; ++i) {
+        vec3 direction;
+        float distance;
+        const vec3 irradiance =
+            GetPunctualLightIrradiance(punctual_lights[i], position, direction, distance);
+        const float weight = Luminance(irradiance);
+        if (!(weight > 0)) {
+            continue;
+        }
+        total += weight;
+        const float keep = weight / total;
+        if (u < keep) {
+            u = min(u / keep, 0.99999994);
+            chosen = weight;
+            light_sample.light = LIGHT_PUNCTUAL_BIT | i;
+            light_sample.direction = direction;
+            light_sample.distance = distance;
+            light_sample.emission = irradiance;
+        } else {
+            u = min((u - keep) / (1.0 - keep), 0.99999994);
+        }
+    }
+    light_sample.pdf = probability * chosen / max(total, 1e-20);
+    light_sample.delta = true;
+    return chosen > 0;
+}
+
+// Importance samples a direction from the environment map
+vec3 SampleEnvironment(out float pdf) {
+    const uint width = uniforms.p.environment_width;
+    const uint height = uniforms.p.environment_height;
+    // First entries of the CDFs above the random numbers (binary search)
+    const float u_y = rnd(sampler_state);
+    uint y = 0;
+    for (uint count = height; count > 0;) {
+        const uint step = count / 2;
+        if (environment_cdf[y + step] <= u_y) {
+            y += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+    y = min(y, height - 1);
+    const uint row = height + y * width;
+    const float u_x = rnd(sampler_state);
+    uint x = 0;
+    for (uint count = width; count > 0;) {
+        const uint step = count / 2;
+        if (environment_cdf[row + x + step] <= u_x) {
+            x += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+    x = min(x, width - 1);
+
+    const vec2 jitter = vec2(rnd(sampler_state), rnd(sampler_state));
+    const vec2 uv = (vec2(x, y) + jitter) / vec2(width, height);
+    const vec3 direction = EnvironmentDirection(uv);
+    pdf = EnvironmentPdf(direction);
+    return direction;
+}
+
+// Of the point of the barycentrics (y, z) on the emissive triangle, leaving the PDF to the caller
+bool GetTriangleLightSample(uint light_idx, vec2 barycentrics, vec3 position,
+                            inout LightSample light_sample) {
+    const EmissiveTriangle light = lights[light_idx];
+    const vec3 weights = vec3(1.0 - barycentrics.x - barycentrics.y, barycentrics);
+    const vec3 point =
+        light.position0 * weights.x + light.position1 * weights.y + light.position2 * weights.z;
+
+    const vec3 to_light = point - position;
+    const float distance_sqr = dot(to_light, to_light);
+    if (distance_sqr == 0) {
+        return false;
+    }
+    light_sample.distance = sqrt(distance_sqr);
+    light_sample.direction = to_light / light_sample.distance;
+    const vec3 normal = normalize(
+        cross(light.position1 - light.position0, light.position2 - light.position0));
+    // Emitted from both sides, like the hits
+    const float cos_light = abs(dot(normal, light_sample.direction));
+    if (cos_light <= 0) {
+        return false;
+    }
+    light_sample.light = light_idx;
+    light_sample.light_point = packUnorm2x16(barycentrics);
+    light_sample.geometry = cos_light / distance_sqr;
+    light_sample.emission = GetLightEmission(light, weights);
+    return true;
+}
+
+// Picks a point on the emissive triangles, a punctual light or a direction of the environment
+// map for the position. False if there is none.
+bool SampleLight(vec3 position, out LightSample light_sample) {
+    light_sample.delta = false;
+    const float environment_probability = EnvironmentSelectionProbability();
+    if (environment_probability > 0 && rnd(sampler_state) < environment_probability) {
+        float pdf;
+        light_sample.direction = SampleEnvironment(pdf);
+        light_sample.distance = 10000.0; // Of the rays
+        light_sample.pdf = environment_probability * pdf;
+        light_sample.emission = GetEnvironment(light_sample.direction);
+        light_sample.light = LIGHT_ENVIRONMENT;
+        light_sample.light_point = packUnorm2x16(EnvironmentUV(light_sample.direction));
+        light_sample.geometry = 1.0;
+        return light_sample.pdf > 0;
+    }
+    const float punctual_probability = PunctualSelectionProbability();
+    if (punctual_probability > 0 && rnd(sampler_state) < punctual_probability) {
+        return SamplePunctualLight(position, rnd(sampler_state),
+                                   (1.0 - environment_probability) * punctual_probability,
+                                   light_sample);
+    }
+    if (uniforms.p.num_lights == 0) {
+        return false;
+    }
+    float pmf;
+    const uint light_idx = SampleLightTree(position, rnd(sampler_state), pmf);
+    if (light_idx == ~0u) {
+        return false;
+    }
+
+    // Uniformly on the triangle
+    const float r1 = sqrt(rnd(sampler_state));
+    const float r2 = rnd(sampler_state);
+    if (!GetTriangleLightSample(light_idx, vec2(r1 * (1.0 - r2), r1 * r2), position,
+                                light_sample)) {
+        return false;
+    }
+    light_sample.pdf = (1.0 - environment_probability) * (1.0 - punctual_probability) * pmf /
+                       lights[light_idx].area / light_sample.geometry;
+    return true;
+}
+
+// Of the light sample picked elsewhere, as seen from the position. Its PDF is left 0, as the
+// sample was not drawn for this position. False if it has no contribution there.
+bool LoadLightSample(uint light, uint light_point, vec3 position,
+                     out LightSample light_sample) {
+    light_sample.pdf = 0.0;
+    light_sample.delta = false;
+    light_sample.light = light;
+    light_sample.light_point = light_point;
+    light_sample.geometry = 1.0;
+    if (light == LIGHT_ENVIRONMENT) {
+        if (!HasEnvironmentMap()) {
+            return false;
+        }
+        light_sample.direction = EnvironmentDirection(unpackUnorm2x16(light_point));
+        light_sample.distance = 10000.0;
+        light_sample.emission = GetEnvironment(light_sample.direction);
+        return true;
+    }
+    if ((light & LIGHT_PUNCTUAL_BIT) != 0) {
+        const uint i = light & ~LIGHT_PUNCTUAL_BIT;
+        if (i >= uniforms.p.num_punctual_lights) {
+            return false;
+        }
+        light_sample.delta = true;
+        light_sample.emission = GetPunctualLightIrradiance(
+            punctual_lights[i], position, light_sample.direction, light_sample.distance);
+        return Luminance(light_sample.emission) > 0;
+    }
+    if (light >= uniforms.p.num_lights) {
+        return false;
+    }
+    return GetTriangleLightSample(light, unpackUnorm2x16(light_point), position, light_sample);
+}
+
+#endif
@@ -0,0 +1,80 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _PATH_GUIDING_GLSL
+#define _PATH_GUIDING_GLSL
+
+// Path guiding with a spatial hash grid over the scene, each cell of which has a histogram of the
+// directions radiance arrives at it from (as in Vorba et al., "On-line Learning of Parametric
+// Mixture Models for Light Transport Simulation", with histograms in place of the mixtures).
+// The ray generation shader records the radiance the first bounces of the paths found, which
+// guide.comp then learns the histograms from after each frame, and the closest hit shader
+// samples them alongside the BSDF. Cells are hashed without telling apart those that collide,
+// which then share a histogram. Included with the uniforms and the global sampler_state.
+
+#include "core/path_tracer_hw/shaders/sampler.glsl"
+
+#ifndef M_PI
+#define M_PI 3.1415926
+#endif
+
+layout(set = 0, binding = 20, std430) readonly buffer GuideDistributionBlock {
+    float guide_distributions[];
+};
+
+uint GetGuideCell(vec3 position) {
+    const ivec3 cell = ivec3(floor(position / uniforms.p.guide_cell_size));
+    return HashUint(uint(cell.x) ^ HashUint(uint(cell.y) ^ HashUint(uint(cell.z)))) %
+           uniforms.p.guide_cells;
+}
+
+// Equal area, as cos(theta) and phi are uniform over the sphere
+uint GetGuideBin(vec3 direction) {
+    const float u = clamp(direction.z * 0.5 + 0.5, 0.0, 0.99999994);
+    const float v = clamp(atan(direction.y, direction.x) / (2 * M_PI) + 0.5, 0.0, 0.99999994);
+    return uint(u * GUIDE_BINS_PER_SIDE) * GUIDE_BINS_PER_SIDE + uint(v * GUIDE_BINS_PER_SIDE);
+}
+
+// Of the point of the bin at the jitter
+vec3 GetGuideDirection(uint bin, vec2 jitter) {
+    const vec2 uv =
+        (vec2(bin / GUIDE_BINS_PER_SIDE, bin % GUIDE_BINS_PER_SIDE) + jitter) / GUIDE_BINS_PER_SIDE;
+    const float cos_theta = uv.x * 2 - 1;
+    const float sin_theta = sqrt(max(1 - cos_theta * cos_theta, 0.0));
+    const float phi = (uv.y - 0.5) * 2 * M_PI;
+    return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+bool HasGuide(uint cell) {
+    return guide_distributions[cell * GUIDE_CELL_FLOATS + GUIDE_CELL_FLOATS - 1] > 0;
+}
+
+// Of sampling the direction from the histogram of the cell, per unit solid angle
+float GuidePdf(uint cell, vec3 direction) {
+    const uint first = cell * GUIDE_CELL_FLOATS + GUIDE_BINS;
+    const uint bin = GetGuideBin(direction);
+    const float probability =
+        guide_distributions[first + bin] - (bin == 0 ? 0.0 : guide_distributions[first + bin - 1]);
+    return probability * float(GUIDE_BINS) / (4 * M_PI);
+}
+
+// Picks a bin in proportion to its radiance (binary search of the CDF), and a direction in it
+vec3 SampleGuide(uint cell) {
+    const uint first = cell * GUIDE_CELL_FLOATS + GUIDE_BINS;
+    const float u = rnd(sampler_state);
+    uint bin = 0;
+    for (uint count = GUIDE_BINS; count > 0;) {
+        const uint step = count / 2;
+        if (guide_distributions[first + bin + step] <= u) {
+            bin += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+    bin = min(bin, GUIDE_BINS - 1);
+    return GetGuideDirection(bin, vec2(rnd(sampler_state), rnd(sampler_state)));
+}
+
+#endif
@@ -7,42 +7,12 @@
 
 #include "core/vulkan/host_glsl_shared.h"
 
-BEGIN_STRUCT(PrimitiveInfo)
-
-uint64_t index_address;
-uint64_t position_address;
-uint64_t normal_address;
-uint64_t texcoord0_address;
-uint64_t texcoord1_address;
-uint64_t color_address;
-uint64_t tangent_address;
-int material_idx;
-uint index_size;
-uint position_stride;
-uint normal_stride;
-uint texcoord0_stride;
-
-// Type 0 = vec2, 1 = u8vec2, 2 = u16vec2
-uint texcoord0_type;
-
-uint texcoord1_stride;
-uint texcoord1_type;
-
-uint color_stride;
-
-// Type 0 = vec4, 1 = u8vec4, 2 = u16vec4,
-//      3 = vec3, 4 = u8vec3, 5 = u16vec3
-uint color_type;
-
-uint tangent_stride;
-INSERT_PADDING(3)
-
-END_STRUCT(PrimitiveInfo)
-
-BEGIN_STRUCT(PathTracerPushConstant)
+BEGIN_STRUCT(PathTracerUniforms)
 
 mat4 view_inverse;
 mat4 proj_inverse;
+mat4 view_proj; // Of the visibility buffer of VulkanPathTracerWavefront, see visibility.vert
+mat4 prev_view_proj; // Of the last frame, for reusing its light reservoirs
 float intensity_multiplier;
 float ambient_light;
 uint frame;
@@ -50,45 +20,251 @@ uint frame;
 // Depth of view
 float focal_dist;
 float aperture;
+// Pixels stop being traced once their relative error is below this, 0 traces all of them
+float adaptive_threshold;
+
+// Of each pixel in this frame
+uint samples_per_pixel;
+uint max_depth; // Bounces of each path at most
+// Lowest probability of a path going on at each bounce from roulette_depth on, see
+// RouletteSurvival. 1 disables Russian roulette.
+float russian_roulette;
+uint roulette_depth;
+uint write_aovs; // For the denoiser
+// Emissive triangles sampled for next event estimation, 0 disables it
+uint num_lights;
+uint num_punctual_lights; // Of the sub scene, see GLSL::PunctualLight
+// Of the environment map, which replaces the ambient light unless they are 0
+uint environment_width;
+uint environment_height;
+float environment_intensity;
+// Samples of each pixel accumulated before this frame, which index those of the frame
+uint first_sample;
+uint seed; // Of the scrambles of the sampler
+// Between the camera rays of neighbouring pixels, that of their ray cones
+float pixel_spread_angle;
+uint write_first_hits; // For reprojecting the accumulation, see reproject.comp
+uint measure_costs;    // Of the pixels and materials, for the cost heatmap, see heatmap.comp
+uint count_rays;       // See RayStats
+// Light samples resampled at each first hit, see restir.glsl. 0 disables ReSTIR.
+uint restir_candidates;
+// Half of the light reservoirs written by this frame. The other has those of the last frame,
+// which are reused unless reuse_reservoirs is 0.
+uint reservoir_half;
+uint reuse_reservoirs;
+// Of the spatial hash grid of path guiding, see path_guiding.glsl. 0 cells disable it.
+uint guide_cells;
+float guide_cell_size;
+uint integrator;   // See INTEGRATOR_PATH
+float ao_distance; // Of the rays of INTEGRATOR_AMBIENT_OCCLUSION
+
+END_STRUCT(PathTracerUniforms)
+
+// Of the uniforms. All but the first end the paths at their first hits, see
+// VulkanPathTracerHW::Integrator.
+#define INTEGRATOR_PATH 0u
+#define INTEGRATOR_AMBIENT_OCCLUSION 1u
+#define INTEGRATOR_DIRECT 2u
+#define INTEGRATOR_ALBEDO 3u
+#define INTEGRATOR_NORMALS 4u
+
+// Bits of the instance masks, for the rays that they are visible to. Each kind of ray traces
+// with its bit as the cull mask.
+#define INSTANCE_MASK_CAMERA 1u   // Rays from the camera
+#define INSTANCE_MASK_INDIRECT 2u // Bounces of the paths
+#define INSTANCE_MASK_SHADOW 4u   // Shadow rays of light samples, i.e. what casts shadows
+
+// Of the ray generation shader, which traces a tile of the render extent
+BEGIN_STRUCT(TracePushConstant)
+
+uvec2 tile_offset;
+uvec2 render_extent;
+
+END_STRUCT(TracePushConstant)
+
+// Sum of the samples of a pixel since the accumulation was reset, accumulated in place. The
+// offscreen image of each frame gets their mean, at half precision.
+BEGIN_STRUCT(PixelAccumulation)
+
+vec3 sum;
+uint num_samples; // Excluding NaNs
+
+END_STRUCT(PixelAccumulation)
+
+// Of the passes reusing the accumulation of the previous camera after it moved, see
+// reproject.comp. The first hits of the camera rays of each pixel (vec4) hold the world position
+// and its distance from the camera, or the direction and 0 for misses.
+BEGIN_STRUCT(ReprojectPushConstant)
+
+mat4 prev_view_proj;
+vec3 prev_camera_position;
+uint resolve; // The second pass, which writes the means of the accumulation into the image
+uvec2 render_extent;
+// Of the history in the pixel accumulation and first hits, copied there before tracing
+uint history_offset;
+INSERT_PADDING(1)
+
+END_STRUCT(ReprojectPushConstant)
+
+// Clock cycles the closest hit shader spent on the hits of a material in a frame, summed in two
+// words so that 64-bit atomics are not needed
+BEGIN_STRUCT(MaterialCost)
+
+uint cycles_low;
+uint cycles_high;
+uint num_hits;
+INSERT_PADDING(1)
+
+END_STRUCT(MaterialCost)
+
+// Of the rays the ray generation shader traced in a frame, summed over the subgroups. Each count
+// is in two words, the low one carrying into the high one.
+BEGIN_STRUCT(RayStats)
+
+uvec2 camera_rays;
+uvec2 bounce_rays; // After the camera rays
+uvec2 shadow_rays;
+uvec2 paths;       // Samples traced, including those whose paths ended before the camera ray
+uvec2 roulette_terminations;
+uvec2 nan_samples; // Discarded
+
+END_STRUCT(RayStats)
+
+// Of the pass showing the clock cycles the ray generation shader spent on each pixel, relative to
+// the most expensive one, as a false-color heatmap
+BEGIN_STRUCT(HeatmapPushConstant)
+
+uvec2 render_extent;
+INSERT_PADDING(2)
+
+END_STRUCT(HeatmapPushConstant)
+
+// Running statistics of the mean luminance of each frame's samples of a pixel, for adaptive
+// sampling. Reset on the first frame of an accumulation.
+BEGIN_STRUCT(PixelStats)
+
+float mean;
+float m2; // Sum of squared differences from the mean (Welford's algorithm)
+uint num_frames;
+float error; // Standard error of the mean, relative to it
+
+END_STRUCT(PixelStats)
+
+// Of the direct lighting at the first hit of a pixel, resampled from the light samples there and
+// the reservoirs of the last frame, see restir.glsl
+BEGIN_STRUCT(LightReservoir)
+
+vec3 position; // Of the first hit, for telling apart reservoirs of other surfaces
+uint normal;   // Shading, see PackDirection
+// Of the sample kept, see LightSample. ~0 if there is none.
+uint light;
+uint light_point;
+float weight;        // Contribution weight of the sample, 0 if it is shadowed
+uint num_candidates; // Resampled into it, 0 if empty
+
+END_STRUCT(LightReservoir)
+
+// Directions of each cell of the path guiding grid, in bins of equal area over cos(theta) and phi
+#define GUIDE_BINS_PER_SIDE 8u
+#define GUIDE_BINS (GUIDE_BINS_PER_SIDE * GUIDE_BINS_PER_SIDE)
+// Of each cell, the radiance estimates of its bins, then their CDF. The CDF is all zeros until
+// the cell has learned something.
+#define GUIDE_CELL_FLOATS (GUIDE_BINS * 2)
+// Recorded by the paths of a frame for each cell, the sums of the radiance over the PDF of each
+// bin (fixed point, the low word carrying into the high one), then the number of records
+#define GUIDE_CELL_SAMPLES (GUIDE_BINS + 1)
+#define GUIDE_FIXED_POINT 256.0
+#define GUIDE_MAX_RECORD 1e6 // Clamped to, so that a record cannot overflow the low word
+
+// Of the pass learning the distributions of the path guiding grid from the radiance the paths
+// of a frame recorded, see guide.comp
+BEGIN_STRUCT(GuidePushConstant)
+
+uint num_cells;
 INSERT_PADDING(3)
 
-END_STRUCT(PathTracerPushConstant)
-
-#ifndef GL_core_profile
-constexpr u32 GetTexCoordType(vk::Format format) {
-    if (format == vk::Format::eR32G32Sfloat) {
-        return 0;
-    }
-    if (format == vk::Format::eR8G8Unorm) {
-        return 1;
-    }
-    if (format == vk::Format::eR16G16Unorm) {
-        return 2;
-    }
-    UNREACHABLE();
-}
-
-constexpr u32 GetColorType(vk::Format format) {
-    if (format == vk::Format::eR32G32B32A32Sfloat) {
-        return 0;
-    }
-    if (format == vk::Format::eR8G8B8A8Unorm) {
-        return 1;
-    }
-    if (format == vk::Format::eR16G16B16A16Unorm) {
-        return 2;
-    }
-    if (format == vk::Format::eR32G32B32Sfloat) {
-        return 3;
-    }
-    if (format == vk::Format::eR8G8B8Unorm) {
-        return 4;
-    }
-    if (format == vk::Format::eR16G16B16Unorm) {
-        return 5;
-    }
-    UNREACHABLE();
-}
-#endif
+END_STRUCT(GuidePushConstant)
+
+// Traced against the TLAS of the sub scene by pick.comp, see VulkanPathTracerHW::Pick
+BEGIN_STRUCT(PickRay)
+
+vec3 origin;
+float max_distance;
+vec3 direction;
+INSERT_PADDING(1)
+
+END_STRUCT(PickRay)
+
+BEGIN_STRUCT(PickHit)
+
+uint instance;  // Of the TLAS, ~0 if the ray hit nothing
+uint primitive; // In the scene, the custom index of the instance plus the geometry index
+uint triangle;  // In the primitive
+float distance; // In lengths of the direction of the ray
+vec2 barycentrics; // Of the second and third vertices
+INSERT_PADDING(2)
+
+END_STRUCT(PickHit)
+
+BEGIN_STRUCT(PickPushConstant)
+
+uint num_rays;
+INSERT_PADDING(3)
+
+END_STRUCT(PickPushConstant)
+
+// Emissive triangle of the current sub scene, in world space, sampled for next event
+// estimation. The triangles are picked through the light tree, see LightTreeNode.
+BEGIN_STRUCT(EmissiveTriangle)
+
+vec3 position0;
+uint primitive; // In the scene, for the texture coordinates of the emission
+vec3 position1;
+uint triangle; // In the primitive
+vec3 position2;
+uint material; // Resolved, never -1
+float area;
+uint leaf; // Node of the light tree
+INSERT_PADDING(2)
+
+END_STRUCT(EmissiveTriangle)
+
+// Of the light tree over the emissive triangles (see LightTree), root first. Descended by the
+// light samples in proportion to the estimated contribution of each child to the shaded point.
+BEGIN_STRUCT(LightTreeNode)
+
+vec3 bounds_min;
+float power; // Of the triangles below, by luminance
+vec3 bounds_max;
+float theta_o; // Half angle of the cone of the normals
+vec3 axis;     // Of the cone, up to sign as the triangles are two sided
+uint first_child; // The second one follows it. Zero for leaves, as the root is 0.
+uint light;       // Of leaves
+uint parent;
+INSERT_PADDING(2)
+
+END_STRUCT(LightTreeNode)
+
+// First hit of each pixel, guiding the denoiser. Written by every sample, so the last one's.
+BEGIN_STRUCT(PixelAOV)
+
+vec4 albedo; // Base color, of the environment on misses
+vec4 normal; // World space, 0 on misses
+
+END_STRUCT(PixelAOV)
+
+// Of a pass of the edge-avoiding a-trous wavelet filter in denoise.comp
+BEGIN_STRUCT(DenoisePushConstant)
+
+uvec2 render_extent;
+uint step_width; // Between the taps of the 5x5 kernel, doubled with each pass
+uint first_pass; // Reads the accumulated image instead of the previous pass
+// Lower weights neighbours differing in the color, normal and albedo by more
+float color_phi;
+float normal_phi;
+float albedo_phi;
+INSERT_PADDING(1)
+
+END_STRUCT(DenoisePushConstant)
 
 #endif
@@ -5,14 +5,14 @@
 #ifndef _PBR_METALLIC_ROUGHNESS_GLSL
 #define _PBR_METALLIC_ROUGHNESS_GLSL
 
-#include "core/path_tracer_hw/shaders/rng.glsl"
+#include "core/path_tracer_hw/shaders/sampler.glsl"
 
 #define M_PI 3.1415926
 
 // Randomly sampling around +Z. PDF is 1 / PI
 vec3 ImportanceSampleCosine() {
-    float r1 = rnd(prd.seed);
-    float r2 = rnd(prd.seed);
+    float r1 = rnd(sampler_state);
+    float r2 = rnd(sampler_state);
     float sq = sqrt(1.0 - r2);
     return vec3(cos(2 * M_PI * r1) * sq, sin(2 * M_PI * r1) * sq, sqrt(r2));
 }
@@ -30,7 +30,7 @@ void createCoordinateSystem(in vec3 N, out vec3 Nt, out vec3 Nb) {
 // Adapted from https://www.shadertoy.com/view/NscBWs, method is from paper
 // https://hal.science/hal-01509746/document
 vec3 sample_ggx_vndf(vec3 V_tangent, float alpha) {
-    vec2 Xi = vec2(rnd(prd.seed), rnd(prd.seed));
+    vec2 Xi = vec2(rnd(sampler_state), rnd(sampler_state));
 
     // Stretch view -- isotropic
     vec3 V = normalize(vec3(alpha * V_tangent.xy, V_tangent.z));
@@ -79,6 +79,60 @@ float G2_Smith(float NdotL, float NdotV, float alpha) {
     return 1.0 / (1.0 + lambdaV + lambdaL);
 }
 
+// GGX normal distribution
+float D_GGX(float NdotH, float alpha) {
+    const float alpha_sqr = alpha * alpha;
+    const float d = NdotH * NdotH * (alpha_sqr - 1.0) + 1.0;
+    return alpha_sqr / (M_PI * d * d);
+}
+
+// Of the lobes picked by ImportanceSample, in the tangent space of its basis. p is the
+// probability of the diffuse one.
+float SamplePdf(vec3 V, vec3 wi, float alpha, float p) {
+    if (wi.z <= 0 || V.z <= 0) {
+        return 0;
+    }
+    const vec3 H = normalize(wi + V);
+    // Visible normals, reflected about H
+    const float specular_pdf = G1_Smith(V.z, alpha) * D_GGX(H.z, alpha) / (4 * V.z);
+    return p * wi.z / M_PI + (1 - p) * specular_pdf;
+}
+
+bool IsPerfectSpecular(float metallic, float roughness) {
+    return metallic > 0.999 && roughness < 0.001;
+}
+
+// BRDF of the light from wi, cosine weighted. Also outputs the PDF of ImportanceSample
+// returning wi. Perfect reflections have neither (both are 0).
+vec3 EvaluateBSDF(vec3 base_color, float metallic, float roughness, vec3 V, vec3 N, vec3 wi,
+                  out float pdf) {
+    pdf = 0;
+    if (IsPerfectSpecular(metallic, roughness)) {
+        return vec3(0);
+    }
+
+    vec3 Nt, Nb;
+    createCoordinateSystem(N, Nt, Nb);
+    V = vec3(dot(V, Nt), dot(V, Nb), dot(V, N));
+    wi = vec3(dot(wi, Nt), dot(wi, Nb), dot(wi, N));
+    if (wi.z <= 0 || V.z <= 0) {
+        return vec3(0);
+    }
+
+    // Same as ImportanceSample
+    const float alpha = max(roughness * roughness, 1e-3);
+    const vec3 c_diff = mix(base_color.rgb, vec3(0), metallic);
+    const vec3 f0 = mix(vec3(0.04), base_color.rgb, metallic);
+    const float p = 0.5 * (1 - metallic);
+    pdf = SamplePdf(V, wi, alpha, p);
+
+    const vec3 H = normalize(wi + V);
+    const vec3 F = f0 + (1 - f0) * pow(1 - abs(dot(V, H)), 5);
+    const vec3 diffuse = (1 - F) * c_diff / M_PI * wi.z;
+    const vec3 specular = F * D_GGX(H.z, alpha) * G2_Smith(wi.z, V.z, alpha) / (4 * V.z);
+    return diffuse + specular;
+}
+
 void ImportanceSamplePerfectSpecular(vec3 base_color, float metallic, vec3 V, vec3 N, out vec3 wi,
                                      out vec3 reflectance) {
     const vec3 f0 = mix(vec3(0.04), base_color.rgb, metallic);
@@ -87,15 +141,17 @@ void ImportanceSamplePerfectSpecular(vec3 base_color, float metallic, vec3 V, ve
     reflectance = F;
 }
 
-// Output is cosine weighted & pdf-adjusted
+// Output is cosine weighted & pdf-adjusted. The PDF is that of sampling wi with either lobe, for
+// weighting it against light samples, 0 for perfect reflections.
 void ImportanceSample(vec3 base_color, float metallic, float roughness, vec3 V, vec3 N, out vec3 wi,
-                      out vec3 reflectance) {
+                      out vec3 reflectance, out float pdf) {
     // if (dot(N, V) < 0) {
     //     N = -N;
     // }
-    if (metallic > 0.999 && roughness < 0.001) {
+    if (IsPerfectSpecular(metallic, roughness)) {
         // Special case: BRDF is almost infinite
         ImportanceSamplePerfectSpecular(base_color, metallic, V, N, wi, reflectance);
+        pdf = 0;
         return;
     }
 
@@ -111,7 +167,7 @@ void ImportanceSample(vec3 base_color, float metallic, float roughness, vec3 V,
     // This is an estimation of (1 - metallic) * (0.04 + 0.96 * (1 - abs(VdotH))^5
     // Kind of a heuristic, but vk_raytrace also agrees
     const float p = 0.5 * (1 - metallic);
-    if (rnd(prd.seed) < p) { // Estimate diffuse
+    if (rnd(sampler_state) < p) { // Estimate diffuse
         wi = ImportanceSampleCosine();
         const vec3 H = normalize(wi + V);
         const vec3 F = f0 + (1 - f0) * pow(1 - abs(dot(V, H)), 5);
@@ -125,6 +181,7 @@ void ImportanceSample(vec3 base_color, float metallic, float roughness, vec3 V,
         float G1 = G1_Smith(V.z, alpha);
         reflectance = F * G2 / G1 / (1 - p);
     }
+    pdf = SamplePdf(V, wi, max(alpha, 1e-3), p);
 
     wi = wi.x * Nt + wi.y * Nb + wi.z * N;
 }
@@ -5,14 +5,70 @@
 #ifndef _RAY_COMMON_GLSL
 #define _RAY_COMMON_GLSL
 
+// Every trace carries the payload, so it is packed where precision allows: directions are
+// octahedral (see PackDirection) and the weight is half precision. Positions, PDFs and radiance
+// stay float, the latter two can get too large for halves.
 struct hitPayload {
     vec3 hit_value;
-    uint seed;
     uint depth;
     // Next ray
     vec3 ray_origin;
-    vec3 ray_direction;
-    vec3 weight;
+    uint ray_direction;
+    uvec2 weight;
+    // Of the ray cone at the origin, see RayCone
+    float cone_width;
+    float cone_spread; // Angle
+    // Of the SamplerState, whose dimension follows from the depth
+    uint scramble;
+    uint sample_index;
+    // Of sampling the next ray, 0 for camera rays and perfect reflections, whose emission hits
+    // are not weighted against the light samples. Negated after first hits whose light sample
+    // was resampled, see restir.glsl.
+    float bsdf_pdf;
+    // Unoccluded contribution of a light sample (next event estimation), which the raygen
+    // shader traces a shadow ray for. No sample if the distance is 0.
+    vec3 light_value;
+    float light_distance;
+    uint light_direction;
 };
 
+// Of the tile being traced, which the launch covers
+layout(push_constant) uniform PushConstant {
+    TracePushConstant push_constant;
+};
+
+// In the pixel buffers, of the pixel of the invocation
+uint GetPixelIndex() {
+    const uvec2 pixel = gl_LaunchIDEXT.xy + push_constant.tile_offset;
+    return pixel.y * push_constant.render_extent.x + pixel.x;
+}
+
+// Octahedral encoding of unit vectors with 16 bits per coordinate, see Cigolle et al., "A Survey
+// of Efficient Representations for Independent Unit Vectors". The error is below 1e-4 radians.
+uint PackDirection(vec3 v) {
+    vec2 p = v.xy / (abs(v.x) + abs(v.y) + abs(v.z));
+    if (v.z < 0) {
+        p = (1.0 - abs(p.yx)) * vec2(p.x >= 0 ? 1.0 : -1.0, p.y >= 0 ? 1.0 : -1.0);
+    }
+    return packSnorm2x16(p);
+}
+
+vec3 UnpackDirection(uint packed_direction) {
+    const vec2 p = unpackSnorm2x16(packed_direction);
+    vec3 v = vec3(p, 1.0 - abs(p.x) - abs(p.y));
+    const float t = max(-v.z, 0.0);
+    v.xy += vec2(v.x >= 0 ? -t : t, v.y >= 0 ? -t : t);
+    return normalize(v);
+}
+
+// Clamped to the largest half, weights are reflectances over PDFs and rarely get close
+uvec2 PackWeight(vec3 weight) {
+    const vec3 w = min(weight, vec3(65504.0));
+    return uvec2(packHalf2x16(w.xy), packHalf2x16(vec2(w.z, 0.0)));
+}
+
+vec3 UnpackWeight(uvec2 packed_weight) {
+    return vec3(unpackHalf2x16(packed_weight.x), unpackHalf2x16(packed_weight.y).x);
+}
+
 #endif
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2019-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2019-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+// The raygen shader of the path tracer, included by raytrace.rgen and, with REORDER_THREADS
+// defined to 1, by raytrace_reorder.rgen for shader execution reordering
+// (GL_NV_shader_invocation_reorder).
+
+#ifndef REORDER_THREADS
+#define REORDER_THREADS 0
+#endif
+
+#include "core/path_tracer_hw/shaders/path_tracer_glsl.h"
+#include "core/path_tracer_hw/shaders/ray_common.glsl"
+#include "core/path_tracer_hw/shaders/russian_roulette.glsl"
+#include "core/path_tracer_hw/shaders/sampler.glsl"
+#include "core/shaders/primitive_glsl.h"
+
+layout(set = 0, binding = 4, std140) uniform FrameUniforms {
+    PathTracerUniforms p;
+}
+uniforms;
+
+#include "core/path_tracer_hw/shaders/path_guiding.glsl"
+
+layout(set = 0, binding = 0) uniform accelerationStructureEXT topLevelAS;
+layout(set = 1, binding = 0, rgba16f) uniform writeonly image2D image;
+// Of each pixel, when sampling adaptively
+layout(set = 0, binding = 5, std430) buffer PixelStatsBlock {
+    PixelStats pixel_stats[];
+};
+layout(set = 0, binding = 11, std430) buffer PixelAccumulationBlock {
+    PixelAccumulation pixel_accumulation[];
+};
+layout(set = 0, binding = 12, std430) writeonly buffer PixelFirstHitBlock {
+    vec4 pixel_first_hits[];
+};
+// Clock cycles of the pixels in this frame, when measuring costs. The maximum is cleared before
+// each frame.
+layout(set = 0, binding = 13, std430) buffer PixelCostBlock {
+    uint max_pixel_cost;
+    uint pixel_costs[];
+};
+// Of this frame when counting rays, cleared before it
+layout(set = 0, binding = 15, std430) buffer RayStatsBlock {
+    RayStats ray_stats;
+};
+// Written by the closest hit shader at the first hits, see restir.glsl
+layout(set = 0, binding = 18, std430) buffer LightReservoirBlock {
+    LightReservoir reservoirs[];
+};
+
+// Adaptively sampled pixels are traced for at least this many frames, before their error
+// estimate is trusted
+#define MIN_ADAPTIVE_FRAMES 4
+
+layout(location = 0) rayPayloadEXT hitPayload prd;
+// Of the sample being traced, which the closest hit shader continues from the payload
+SamplerState sampler_state;
+// Of the last camera ray of the pixel, see ReprojectPushConstant
+vec4 first_hit;
+// Cleared by raytrace_shadow.rmiss if nothing is in the way
+layout(location = 1) rayPayloadEXT bool shadowed;
+// Of the invocation, see AddRayStats
+uint num_camera_rays = 0;
+uint num_bounce_rays = 0;
+uint num_shadow_rays = 0;
+uint num_roulette_terminations = 0;
+
+// Radiance the paths found, for learning the path guiding histograms, see GUIDE_CELL_SAMPLES
+layout(set = 0, binding = 19, std430) buffer GuideSampleBlock {
+    uvec2 guide_samples[];
+};
+// First bounces of each path recorded for path guiding
+#define GUIDE_RECORDS 4
+
+// Of the pixel, in the half of the light reservoirs of this frame
+uint GetReservoirIndex() {
+    return uniforms.p.reservoir_half * (reservoirs.length() / 2) + GetPixelIndex();
+}
+
+#if REORDER_THREADS
+layout(set = 0, binding = 1, std430) readonly buffer PrimitiveInfoBlock {
+    PrimitiveInfo primitives[];
+};
+
+// Of the material indices, above which the reordering hardware may ignore them anyway
+#define COHERENCE_HINT_BITS 16
+
+uint GetCoherenceHint(hitObjectNV hit_object) {
+    if (!hitObjectIsHitNV(hit_object)) {
+        return 0;
+    }
+    // See raytrace.rchit
+    const int material_idx = primitives[hitObjectGetInstanceCustomIndexNV(hit_object) +
+                                        hitObjectGetGeometryIndexNV(hit_object)]
+                                 .material_idx;
+    return uint(material_idx + 1) & ((1u << COHERENCE_HINT_BITS) - 1);
+}
+#endif
+
+// Of a bounce for path guiding: the radiance the path gathered up to it and its throughput, from
+// which that arriving along the bounce follows once the path has ended
+struct GuideRecord {
+    uint cell;
+    uint bin;
+    float pdf;
+    vec3 hit_value;
+    vec3 weight;
+};
+
+// Adds the radiance over the PDF to the bin of the cell
+void AddGuideRecord(uint cell, uint bin, float value) {
+    const uint first = cell * GUIDE_CELL_SAMPLES;
+    const uint fixed_value = uint(min(value, GUIDE_MAX_RECORD) * GUIDE_FIXED_POINT);
+    if (fixed_value != 0) {
+        const uint old_value = atomicAdd(guide_samples[first + bin].x, fixed_value);
+        if (old_value + fixed_value < old_value) {
+            atomicAdd(guide_samples[first + bin].y, 1);
+        }
+    }
+    atomicAdd(guide_samples[first + GUIDE_BINS].x, 1);
+}
+
+vec3 PathTrace(vec3 origin, vec3 direction) {
+    // Geometry that is not opaque is alpha tested by raytrace.rahit. Back faces of single sided
+    // materials are culled, see GetInstanceFlags.
+    uint rayFlags = gl_RayFlagsCullBackFacingTrianglesEXT;
+    float tMin = 0.001;
+    float tMax = 10000.0;
+
+    prd.hit_value = vec3(0);
+    prd.depth = 0;
+    prd.ray_origin = origin;
+    prd.ray_direction = PackDirection(direction);
+    prd.weight = PackWeight(vec3(0));
+    prd.cone_width = 0;
+    prd.cone_spread = uniforms.p.pixel_spread_angle;
+    prd.bsdf_pdf = 0;
+
+    vec3 cur_weight = vec3(1);
+    vec3 hit_value = vec3(0);
+    GuideRecord guide_records[GUIDE_RECORDS];
+    uint num_guide_records = 0;
+
+    for (; prd.depth < uniforms.p.max_depth; prd.depth++) {
+        SetBounceDimension(sampler_state, prd.depth);
+        const float survival =
+            RouletteSurvival(cur_weight, prd.depth, uniforms.p.roulette_depth,
+                             uniforms.p.russian_roulette, rnd(sampler_state));
+        if (survival == 0.0) {
+            num_roulette_terminations++;
+            break;
+        }
+        cur_weight /= survival;
+        prd.light_distance = 0;
+        const bool camera_ray = prd.depth == 0;
+        const uint cull_mask = camera_ray ? INSTANCE_MASK_CAMERA : INSTANCE_MASK_INDIRECT;
+        if (camera_ray) {
+            num_camera_rays++;
+        } else {
+            num_bounce_rays++;
+        }
+#if REORDER_THREADS
+        hitObjectNV hit_object;
+        hitObjectTraceRayNV(hit_object, topLevelAS, rayFlags, cull_mask, 0, 0, 0, prd.ray_origin,
+                            tMin, UnpackDirection(prd.ray_direction), tMax, 0);
+        // Hits of the same material are shaded together, and misses apart from them
+        reorderThreadNV(hit_object, GetCoherenceHint(hit_object), COHERENCE_HINT_BITS);
+        hitObjectExecuteShaderNV(hit_object, 0);
+#else
+        traceRayEXT(topLevelAS,                         // acceleration structure
+                    rayFlags,                           // rayFlags
+                    cull_mask,                          // cullMask
+                    0,                                  // sbtRecordOffset
+                    0,                                  // sbtRecordStride
+                    0,                                  // missIndex
+                    prd.ray_origin,                     // ray origin
+                    tMin,                               // ray min range
+                    UnpackDirection(prd.ray_direction), // ray direction
+                    tMax,                               // ray max range
+                    0                                   // payload (location = 0)
+        );
+#endif
+
+        if (camera_ray) { // Misses end the path
+            first_hit = prd.depth == 0 ? vec4(prd.ray_origin, distance(prd.ray_origin, origin))
+                                       : vec4(direction, 0.0);
+            // Leaves nothing to reuse where the hit of the last frame was
+            if (prd.depth != 0 && uniforms.p.restir_candidates != 0) {
+                reservoirs[GetReservoirIndex()].num_candidates = 0;
+            }
+        }
+        hit_value += prd.hit_value * cur_weight;
+        // Shadow ray of the light sample of the hit. It ends short of the light, which would
+        // otherwise occlude itself.
+        if (prd.light_distance > 0) {
+            num_shadow_rays++;
+            shadowed = true;
+            traceRayEXT(topLevelAS,
+                        rayFlags | gl_RayFlagsTerminateOnFirstHitEXT |
+                            gl_RayFlagsSkipClosestHitShaderEXT,
+                        INSTANCE_MASK_SHADOW, 0, 0, 1, prd.ray_origin, tMin,
+                        UnpackDirection(prd.light_direction), prd.light_distance * 0.999, 1);
+            if (!shadowed) {
+                hit_value += prd.light_value * cur_weight;
+            } else if (camera_ray && uniforms.p.restir_candidates != 0) {
+                reservoirs[GetReservoirIndex()].weight = 0; // Not to be reused
+            }
+        }
+        if (uniforms.p.integrator != INTEGRATOR_PATH) { // See raytrace.rchit
+            break;
+        }
+        cur_weight *= UnpackWeight(prd.weight);
+        // Of bounces that are traced (not after misses or at the last depth), other than perfect
+        // reflections
+        if (uniforms.p.guide_cells != 0 && prd.depth + 1 < uniforms.p.max_depth &&
+            prd.bsdf_pdf != 0 && num_guide_records < GUIDE_RECORDS) {
+            const vec3 bounce_direction = UnpackDirection(prd.ray_direction);
+            guide_records[num_guide_records++] =
+                GuideRecord(GetGuideCell(prd.ray_origin), GetGuideBin(bounce_direction),
+                            abs(prd.bsdf_pdf), hit_value, cur_weight);
+        }
+    }
+
+    for (uint i = 0; i < num_guide_records; ++i) {
+        const GuideRecord record = guide_records[i];
+        const vec3 radiance = mix(vec3(0), (hit_value - record.hit_value) / record.weight,
+                                  greaterThan(record.weight, vec3(0)));
+        AddGuideRecord(record.cell, record.bin,
+                       dot(radiance, vec3(0.212671f, 0.715160f, 0.072169f)) / record.pdf);
+    }
+    return hit_value;
+}
+
+// Of the invocation since it started at the time, see heatmap.comp
+void WritePixelCost(uint pixel_idx, uint64_t start_time) {
+    if (uniforms.p.measure_costs == 0) {
+        return;
+    }
+    const uint cost = uint(min(clockARB() - start_time, uint64_t(0xffffffffu)));
+    pixel_costs[pixel_idx] = cost;
+    atomicMax(max_pixel_cost, cost);
+}
+
+// Adds the count of the invocations of the subgroup to the counter, a uvec2 of RayStats
+#define ADD_RAY_COUNT(counter, count)                                                              \
+    {                                                                                              \
+        const uint subgroup_count = subgroupAdd(count);                                            \
+        if (subgroupElect() && subgroup_count != 0) {                                              \
+            const uint old_count = atomicAdd(counter.x, subgroup_count);                           \
+            if (old_count + subgroup_count < old_count) {                                          \
+                atomicAdd(counter.y, 1);                                                           \
+            }                                                                                      \
+        }                                                                                          \
+    }
+
+// Once per invocation, so that each subgroup adds to the counters once
+void AddRayStats(uint num_paths, uint num_nan_samples) {
+    if (uniforms.p.count_rays == 0) {
+        return;
+    }
+    ADD_RAY_COUNT(ray_stats.camera_rays, num_camera_rays);
+    ADD_RAY_COUNT(ray_stats.bounce_rays, num_bounce_rays);
+    ADD_RAY_COUNT(ray_stats.shadow_rays, num_shadow_rays);
+    ADD_RAY_COUNT(ray_stats.paths, num_paths);
+    ADD_RAY_COUNT(ray_stats.roulette_terminations, num_roulette_terminations);
+    ADD_RAY_COUNT(ray_stats.nan_samples, num_nan_samples);
+}
+
+vec3 SamplePixel(ivec2 imageCoords, ivec2 sizeImage) {
+    vec3 pixelColor = vec3(0);
+
+    // Subpixel jitter: send the ray through a different position inside the pixel each time, to
+    // provide antialiasing.
+    vec2 subpixel_jitter =
+        uniforms.p.frame == 0 ? vec2(0.5f, 0.5f) : vec2(rnd(sampler_state), rnd(sampler_state));
+
+    // Compute sampling position between [-1 .. 1]
+    const vec2 pixelCenter = vec2(imageCoords) + subpixel_jitter;
+    const vec2 inUV = pixelCenter / vec2(sizeImage.xy);
+    vec2 d = inUV * 2.0 - 1.0;
+
+    // Compute ray origin and direction
+    vec4 origin = uniforms.p.view_inverse * vec4(0, 0, 0, 1);
+    vec4 target = uniforms.p.proj_inverse * vec4(d.x, d.y, 1, 1);
+    vec4 direction = uniforms.p.view_inverse * vec4(normalize(target.xyz), 0);
+
+    // Depth-of-Field
+    vec3 randomAperturePos = vec3(0), finalRayDir = direction.xyz;
+    if (uniforms.p.focal_dist != 0) {
+        vec3 focalPoint = uniforms.p.focal_dist * direction.xyz;
+        float cam_r1 = rnd(sampler_state) * 2 * 3.1415926;
+        float cam_r2 = rnd(sampler_state) * uniforms.p.aperture;
+        vec4 cam_right = uniforms.p.view_inverse * vec4(1, 0, 0, 0);
+        vec4 cam_up = uniforms.p.view_inverse * vec4(0, 1, 0, 0);
+        randomAperturePos = (cos(cam_r1) * cam_right.xyz + sin(cam_r1) * cam_up.xyz) * sqrt(cam_r2);
+        finalRayDir = normalize(focalPoint - randomAperturePos);
+    }
+
+    vec3 radiance = PathTrace(origin.xyz + randomAperturePos, finalRayDir);
+
+    // Removing fireflies
+    float lum = dot(radiance, vec3(0.212671f, 0.715160f, 0.072169f));
+    if (lum > uniforms.p.intensity_multiplier) { // magic
+        radiance *= uniforms.p.intensity_multiplier / lum;
+    }
+
+    return radiance;
+}
+
+void main() {
+    const uint64_t start_time = clockARB();
+    // The launch covers the tile
+    const ivec2 pixel = ivec2(gl_LaunchIDEXT.xy + push_constant.tile_offset);
+    const ivec2 extent = ivec2(push_constant.render_extent);
+    const uint pixel_idx = GetPixelIndex();
+    const bool adaptive = uniforms.p.adaptive_threshold > 0;
+    PixelStats stats = PixelStats(0.0, 0.0, 0, 0.0);
+    if (adaptive && uniforms.p.frame > 0) {
+        stats = pixel_stats[pixel_idx];
+        // Converged pixels keep their color
+        if (stats.num_frames >= MIN_ADAPTIVE_FRAMES &&
+            stats.error < uniforms.p.adaptive_threshold) {
+            const PixelAccumulation accumulation = pixel_accumulation[pixel_idx];
+            imageStore(image, pixel,
+                       vec4(accumulation.sum / float(max(accumulation.num_samples, 1)), 1.0));
+            WritePixelCost(pixel_idx, start_time);
+            return;
+        }
+    }
+
+    vec3 sample_sum = vec3(0);
+    uint num_samples = 0;
+    first_hit = vec4(0); // Reprojects nowhere if no camera ray is traced
+    for (uint i = 0; i < uniforms.p.samples_per_pixel; ++i) {
+        sampler_state = InitSampler(pixel_idx, uniforms.p.first_sample + i, uniforms.p.seed);
+        prd.scramble = sampler_state.scramble;
+        prd.sample_index = sampler_state.sample_index;
+        vec3 val = SamplePixel(pixel, extent);
+        if (isnan(val.x) || isnan(val.y) || isnan(val.z)) {
+            continue;
+        }
+        sample_sum += val;
+        num_samples++;
+    }
+
+    // Accumulate over time, weighting the samples of all frames alike
+    PixelAccumulation accumulation = PixelAccumulation(sample_sum, num_samples);
+    if (uniforms.p.frame > 0) {
+        const PixelAccumulation old_accumulation = pixel_accumulation[pixel_idx];
+        accumulation.sum += old_accumulation.sum;
+        accumulation.num_samples += old_accumulation.num_samples;
+    }
+    pixel_accumulation[pixel_idx] = accumulation;
+    imageStore(image, pixel,
+               vec4(accumulation.sum / float(max(accumulation.num_samples, 1)), 1.0));
+    if (uniforms.p.write_first_hits != 0) {
+        pixel_first_hits[pixel_idx] = first_hit;
+    }
+
+    if (adaptive) {
+        const vec3 final_color = sample_sum / float(num_samples);
+        const float lum = dot(final_color, vec3(0.212671f, 0.715160f, 0.072169f));
+        stats.num_frames++;
+        const float delta = lum - stats.mean;
+        stats.mean += delta / float(stats.num_frames);
+        stats.m2 += delta * (lum - stats.mean);
+        if (stats.num_frames > 1) {
+            const float variance = stats.m2 / float(stats.num_frames - 1);
+            stats.error = sqrt(variance / float(stats.num_frames)) / max(stats.mean, 1e-3);
+        }
+        pixel_stats[pixel_idx] = stats;
+    }
+    AddRayStats(uniforms.p.samples_per_pixel, uniforms.p.samples_per_pixel - num_samples);
+    WritePixelCost(pixel_idx, start_time);
+}
@@ -0,0 +1,163 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _RESTIR_GLSL
+#define _RESTIR_GLSL
+
+// Resampled light samples of the first hits (ReSTIR DI, see Bitterli et al., "Spatiotemporal
+// Reservoir Resampling for Real-Time Ray Tracing with Dynamic Direct Lighting"). Each first hit
+// keeps one of several light samples in proportion to its unshadowed contribution, then merges
+// in the reservoirs the last frame left where the hit was seen by its camera and around there.
+// Samples found shadowed keep no weight for those reusing them. As the reservoirs are weighed by
+// their candidates alone, this is the biased variant of the paper, darkening contact shadows a
+// little. The emission that the BSDF samples of the first hits find is left to the resampled
+// samples, see EmissionMISWeight.
+// Included after light_sampling.glsl and EvaluateBSDF.
+
+layout(set = 0, binding = 18, std430) buffer LightReservoirBlock {
+    LightReservoir reservoirs[];
+};
+
+// Of the random numbers of the candidates, far above those of the bounces, so that the light
+// samples draw the same dimensions either way
+#define RESTIR_FIRST_DIMENSION 0x10000u
+#define RESTIR_CANDIDATE_DIMENSIONS 8u // At most drawn by SampleLight
+// Of picking the reservoirs reused and which of them to keep, after those of the candidates
+#define RESTIR_REUSE_DIMENSION 0x18000u
+// Reservoirs of the last frame reused, the first where the hit was seen and the others within
+// the radius (in pixels) around there
+#define RESTIR_REUSE_TAPS 5u
+#define RESTIR_REUSE_RADIUS 16.0
+// Their candidates count up to this many times those of a frame, so that the history keeps
+// following the lighting
+#define RESTIR_MAX_HISTORY 20u
+// Reservoirs are reused on surfaces with normals at least this close, and at most this far from
+// the plane of the hit, relative to its distance from the camera
+#define RESTIR_NORMAL_THRESHOLD 0.9
+#define RESTIR_DEPTH_TOLERANCE 0.05
+
+struct ShadingPoint {
+    vec3 position;
+    vec3 normal;
+    vec3 V; // Towards the camera
+    vec3 base_color;
+    vec2 metallic_roughness;
+};
+
+// Target function of the resampling, the luminance of the unshadowed contribution of the light
+// sample to the point, per unit area on emissive triangles
+float GetLightSampleTarget(LightSample light_sample, ShadingPoint point, out vec3 contribution) {
+    float bsdf_pdf;
+    const vec3 bsdf =
+        EvaluateBSDF(point.base_color, point.metallic_roughness.x, point.metallic_roughness.y,
+                     point.V, point.normal, light_sample.direction, bsdf_pdf);
+    contribution = light_sample.emission * bsdf * light_sample.geometry;
+    return bsdf_pdf > 0 ? Luminance(contribution) : 0.0;
+}
+
+float ReuseRandom(uint dimension) {
+    sampler_state.dimension = RESTIR_REUSE_DIMENSION + dimension;
+    return rnd(sampler_state);
+}
+
+// Streams the candidate of the weight into the reservoir of the weight sum, whether it replaces
+// the sample kept
+bool UpdateReservoir(inout float weight_sum, float weight, float u) {
+    weight_sum += weight;
+    return weight > 0 && u * weight_sum < weight;
+}
+
+bool IsSameSurface(LightReservoir reservoir, ShadingPoint point, vec3 camera_position) {
+    return dot(UnpackDirection(reservoir.normal), point.normal) >= RESTIR_NORMAL_THRESHOLD &&
+           abs(dot(reservoir.position - point.position, point.normal)) <=
+               RESTIR_DEPTH_TOLERANCE * distance(point.position, camera_position);
+}
+
+// Of the pixel, in the half of the light reservoirs
+uint GetReservoirIndex(uint half_idx, uint pixel_idx) {
+    return half_idx * (reservoirs.length() / 2) + pixel_idx;
+}
+
+// Light sample of the first hit seen from the camera, resampled from the candidates and the
+// reservoirs of the last frame, and its contribution over its PDF. Writes the reservoir of the
+// pixel. False if there is no sample.
+bool ResampleLights(ShadingPoint point, vec3 camera_position, out LightSample light_sample,
+                    out vec3 contribution) {
+    const uint bounce_dimension = sampler_state.dimension;
+    float weight_sum = 0.0;
+    float target = 0.0; // Of the sample kept
+    uint num_candidates = 0;
+    contribution = vec3(0);
+    LightSample candidate;
+    vec3 candidate_contribution;
+    for (uint i = 0; i < uniforms.p.restir_candidates; ++i) {
+        sampler_state.dimension = RESTIR_FIRST_DIMENSION + i * RESTIR_CANDIDATE_DIMENSIONS;
+        num_candidates++;
+        if (!SampleLight(point.position, candidate)) {
+            continue;
+        }
+        const float candidate_target =
+            GetLightSampleTarget(candidate, point, candidate_contribution);
+        // Over the PDF per unit area, which the geometry of the target cancels out of
+        if (UpdateReservoir(weight_sum, candidate_target / (candidate.pdf * candidate.geometry),
+                            ReuseRandom(i))) {
+            light_sample = candidate;
+            contribution = candidate_contribution;
+            target = candidate_target;
+        }
+    }
+
+    const ivec2 extent = ivec2(push_constant.render_extent);
+    const vec4 clip = uniforms.p.prev_view_proj * vec4(point.position, 1.0);
+    if (uniforms.p.reuse_reservoirs != 0 && clip.w > 0) {
+        const vec2 prev_pixel = (clip.xy / clip.w * 0.5 + 0.5) * vec2(extent);
+        const uint max_history = RESTIR_MAX_HISTORY * uniforms.p.restir_candidates;
+        for (uint tap = 0; tap < RESTIR_REUSE_TAPS; ++tap) {
+            const uint dimension = uniforms.p.restir_candidates + tap * 3;
+            vec2 offset = vec2(0);
+            if (tap > 0) { // Uniformly on the disk
+                const float radius = RESTIR_REUSE_RADIUS * sqrt(ReuseRandom(dimension));
+                const float angle = 2 * M_PI * ReuseRandom(dimension + 1);
+                offset = radius * vec2(cos(angle), sin(angle));
+            }
+            const ivec2 pixel = ivec2(floor(prev_pixel + offset));
+            if (any(lessThan(pixel, ivec2(0))) || any(greaterThanEqual(pixel, extent))) {
+                continue;
+            }
+            const LightReservoir reservoir = reservoirs[GetReservoirIndex(
+                1 - uniforms.p.reservoir_half, pixel.y * extent.x + pixel.x)];
+            if (reservoir.num_candidates == 0 ||
+                !IsSameSurface(reservoir, point, camera_position)) {
+                continue;
+            }
+            const uint reservoir_candidates = min(reservoir.num_candidates, max_history);
+            num_candidates += reservoir_candidates;
+            if (reservoir.weight == 0 || !LoadLightSample(reservoir.light, reservoir.light_point,
+                                                           point.position, candidate)) {
+                continue;
+            }
+            const float candidate_target =
+                GetLightSampleTarget(candidate, point, candidate_contribution);
+            if (UpdateReservoir(weight_sum,
+                                candidate_target * reservoir.weight * float(reservoir_candidates),
+                                ReuseRandom(dimension + 2))) {
+                light_sample = candidate;
+                contribution = candidate_contribution;
+                target = candidate_target;
+            }
+        }
+    }
+    sampler_state.dimension = bounce_dimension;
+
+    const bool found = target > 0;
+    const float weight = found ? weight_sum / (float(num_candidates) * target) : 0.0;
+    reservoirs[GetReservoirIndex(uniforms.p.reservoir_half, GetPixelIndex())] = LightReservoir(
+        point.position, PackDirection(point.normal), found ? light_sample.light : ~0u,
+        found ? light_sample.light_point : 0, weight,
+        min(num_candidates, RESTIR_MAX_HISTORY * uniforms.p.restir_candidates));
+    contribution *= weight;
+    return found;
+}
+
+#endif
@@ -0,0 +1,27 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _RUSSIAN_ROULETTE_GLSL
+#define _RUSSIAN_ROULETTE_GLSL
+
+// Russian roulette of the paths of both path tracers, driven by their throughput: from the
+// roulette depth on, a path goes on with the luminance of its weight as the probability, at
+// least the minimum, so that dark paths end early and bright ones always go on. Paths of no
+// weight end anyway, as they add nothing more. Unbiased as long as the minimum is above 0.
+// Returns the probability the weight must be divided by if the path goes on, or 0 if it ends.
+// u is the first dimension of the bounce.
+float RouletteSurvival(vec3 weight, uint depth, uint roulette_depth, float min_probability,
+                       float u) {
+    if (all(equal(weight, vec3(0.0)))) {
+        return 0.0;
+    }
+    if (depth < roulette_depth || min_probability >= 1.0) {
+        return 1.0;
+    }
+    const float luminance = dot(weight, vec3(0.2126, 0.7152, 0.0722));
+    const float probability = clamp(luminance, min_probability, 1.0);
+    return u < probability ? probability : 0.0;
+}
+
+#endif
@@ -0,0 +1,106 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _SAMPLER_GLSL
+#define _SAMPLER_GLSL
+
+// Owen-scrambled Sobol sequence, see Burley, "Practical Hash-based Owen Scrambling". The numbers
+// are indexed by the pixel (its scramble), the sample index and the dimension, which rnd()
+// advances. Dimensions are padded with 4-dimensional Sobol sequences, shuffled independently of
+// each other, and every bounce starts at dimensions of its own, so that the same decision of
+// different samples draws from the same dimension. The BSDF and light sampling code draws from
+// the global SamplerState sampler_state of its includer.
+
+#include "core/path_tracer_hw/shaders/rng.glsl"
+
+struct SamplerState {
+    uint scramble;
+    uint sample_index; // Of the pixel, since the accumulation started
+    uint dimension;    // Next to be drawn
+};
+
+// Subpixel jitter and the aperture
+#define CAMERA_DIMENSIONS 4
+// At most drawn by each bounce (BSDF, light sample and Russian roulette)
+#define BOUNCE_DIMENSIONS 16
+
+// Direction numbers of dimensions 1 to 3, those of dimension 0 reverse the bits of the index
+const uint SOBOL_DIRECTIONS[96] = uint[96](
+    0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u,
+    0xff000000u, 0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u,
+    0xaaaa0000u, 0xffff0000u, 0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u,
+    0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u, 0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u,
+    0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+
+    0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u,
+    0xc5000000u, 0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u,
+    0x60ee0000u, 0x90550000u, 0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u,
+    0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u, 0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u,
+    0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+
+    0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u,
+    0x93000000u, 0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u,
+    0x82020000u, 0xc3050000u, 0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u,
+    0x914e5400u, 0xdbe79e00u, 0x25db6d00u, 0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u,
+    0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u);
+
+uint Sobol(uint index, uint dimension) {
+    if (dimension == 0) {
+        return bitfieldReverse(index);
+    }
+    uint x = 0;
+    for (uint bit = (dimension - 1) * 32; index != 0; index >>= 1, ++bit) {
+        if ((index & 1) != 0) {
+            x ^= SOBOL_DIRECTIONS[bit];
+        }
+    }
+    return x;
+}
+
+// lowbias32 of Chris Wellons' hash prospector
+uint HashUint(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Random permutation of the (reversed) bits where each only depends on the lower ones, see Laine
+// and Karras, "Stratified Sampling for Stochastic Transparency"
+uint LaineKarrasPermutation(uint x, uint seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling in base 2
+uint NestedUniformScramble(uint x, uint seed) {
+    return bitfieldReverse(LaineKarrasPermutation(bitfieldReverse(x), seed));
+}
+
+SamplerState InitSampler(uint pixel_idx, uint sample_index, uint seed) {
+    return SamplerState(tea(pixel_idx, seed), sample_index, 0);
+}
+
+// Where the bounce (0 for the camera ray) starts drawing
+void SetBounceDimension(inout SamplerState state, uint bounce) {
+    state.dimension = CAMERA_DIMENSIONS + bounce * BOUNCE_DIMENSIONS;
+}
+
+// Generate a random float in [0, 1), advancing the dimension
+float rnd(inout SamplerState state) {
+    const uint group_seed = HashUint(state.scramble ^ HashUint(state.dimension / 4));
+    const uint index = NestedUniformScramble(state.sample_index, group_seed);
+    const uint x = NestedUniformScramble(Sobol(index, state.dimension % 4),
+                                         HashUint(group_seed + state.dimension % 4));
+    state.dimension++;
+    return float(x >> 8) / float(0x01000000);
+}
+
+#endif
@@ -0,0 +1,71 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+// Texture LODs and normal mapping of the shading, shared by ReadVertexAttributes (see
+// vertex_attributes.inl.glsl) and trace.comp of VulkanPathTracerCompute, which reads the
+// attributes of vertices of its own.
+
+#ifndef _SURFACE_GLSL
+#define _SURFACE_GLSL
+
+// Ray hitting the point, for texture LOD by ray cones, see Akenine-Möller et al., "Improved
+// Shader and Texture Level of Detail Using Ray Cones". The cone is isotropic, as wide as the
+// footprint of a pixel at the first hit.
+struct RayCone {
+    vec3 direction;
+    float width; // At the point, 0 if there is no cone
+};
+
+// Below the level of any texture, which thus samples the finest level resident
+#define FINEST_TEXTURE_LOD -128.0
+
+// Half the log2 of the area of the triangle of the texcoords
+float TexcoordAreaLod(vec2 texcoord0, vec2 texcoord1, vec2 texcoord2) {
+    const vec2 edge1 = texcoord1 - texcoord0;
+    const vec2 edge2 = texcoord2 - texcoord0;
+    return 0.5 * log2(max(abs(edge1.x * edge2.y - edge1.y * edge2.x), 1e-30));
+}
+
+// Of the cone over the triangle of the edges in world space, for a texture of a single texel
+// whose texcoords span a unit triangle: its footprint grows as the triangle gets smaller or more
+// grazing. The texcoords add their TexcoordAreaLod, as they shrink it.
+float GetRayConeLod(RayCone cone, vec3 world_edge1, vec3 world_edge2) {
+    const vec3 world_cross = cross(world_edge1, world_edge2);
+    const float world_area = max(length(world_cross), 1e-30);
+    const float cos_cone = max(abs(dot(world_cross, cone.direction)) / world_area, 1e-3);
+    return log2(cone.width / cos_cone) - 0.5 * log2(world_area);
+}
+
+// Instead of the tangents of the vertices, for those that have none: of the triangle of the
+// edges, along the texcoords of their ends, orthogonal to the normal, with the sign of the
+// bitangent in W. False if the texcoords are degenerate.
+bool GetTriangleTangent(vec3 e1, vec3 e2, vec2 uv1, vec2 uv2, vec3 normal, out vec4 tangent) {
+    tangent = vec4(0);
+    const float det = uv1.x * uv2.y - uv1.y * uv2.x;
+    if (det == 0) {
+        return false;
+    }
+    const vec3 t = (e1 * uv2.y - e2 * uv1.y) / det;
+    const vec3 b = (e2 * uv1.x - e1 * uv2.x) / det;
+    const vec3 orthogonal = t - normal * dot(normal, t);
+    const float len = length(orthogonal);
+    if (!(len > 0)) {
+        return false;
+    }
+    tangent = vec4(orthogonal / len, dot(cross(normal, orthogonal), b) < 0 ? -1.0 : 1.0);
+    return true;
+}
+
+// The normal perturbed by the XY of the texel of the tangent space normal map, with the sign of
+// the bitangent in the W of the tangent. Reference: mikktspace.com
+vec3 ApplyNormalMap(vec3 normal, vec4 tangent, vec2 texel, float normal_scale) {
+    // Z is reconstructed, as two channel (BC5) normal maps only store XY
+    const vec2 texture_normal = texel * 2.0 - 1.0;
+    const float texture_normal_z = sqrt(max(1.0 - dot(texture_normal, texture_normal), 0.0));
+    const vec3 vNt = normalize(vec3(texture_normal * normal_scale, texture_normal_z));
+    const vec3 vB = tangent.w * cross(normal, tangent.xyz);
+    return normalize(vNt.x * tangent.xyz + vNt.y * vB + vNt.z * normal);
+}
+
+#endif
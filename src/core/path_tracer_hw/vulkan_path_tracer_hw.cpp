@@ -2,293 +2,437 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <random>
+#include <span>
+#include <tuple>
 #include <unordered_map>
+#include <fmt/format.h>
 #include <glm/glm.hpp>
 #include <spdlog/spdlog.h>
 #include "common/assert.h"
 #include "common/file_util.h"
+#include "common/profiling.h"
 #include "common/ranges.h"
 #include "core/path_tracer_hw/shaders/path_tracer_glsl.h"
+#include "core/hot_reload.h"
+#include "core/lazy_texture_loader.h"
+#include "core/load_profiler.h"
+#include "core/path_tracer_hw/environment_map.h"
+#include "core/path_tracer_hw/light_tree.h"
+#include "core/path_tracer_hw/mesh_deformer.h"
 #include "core/path_tracer_hw/vulkan_path_tracer_hw.h"
 #include "core/scene.h"
+#include "core/scene_cache.h"
 #include "core/vulkan/vulkan_accel_structure.h"
 #include "core/vulkan/vulkan_allocator.h"
 #include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
 #include "core/vulkan/vulkan_context.h"
 #include "core/vulkan/vulkan_descriptor_sets.h"
 #include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_frame_allocator.h"
 #include "core/vulkan/vulkan_frames_in_flight.hpp"
+#include "core/vulkan/vulkan_geometry_heap.h"
 #include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_opacity_micromap.h"
+#include "core/vulkan/vulkan_profiler.h"
 #include "core/vulkan/vulkan_raytracing_pipeline.h"
+#include "core/vulkan/vulkan_render_graph.h"
 #include "core/vulkan/vulkan_shader.h"
 #include "core/vulkan/vulkan_swapchain.h"
 #include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_texture_streamer.h"
+#include "core/vulkan/vulkan_tlas_instance_generator.h"
+#include "core/vulkan/vulkan_upload_ring.h"
 
 namespace Renderer {
 
 VulkanPathTracerHW::VulkanPathTracerHW(bool enable_validation_layers,
                                        std::vector<const char*> frontend_required_extensions)
-    : VulkanRenderer(enable_validation_layers, std::move(frontend_required_extensions)) {}
+    : VulkanRenderer(enable_validation_layers, std::move(frontend_required_extensions)),
+      sampler_seed(std::random_device{}()) {}
 
 VulkanPathTracerHW::~VulkanPathTracerHW() {
-    (*device)->waitIdle();
+    if (specialized_pipeline.valid()) {
+        specialized_pipeline.wait();
+    }
+    device->WaitIdle();
 }
 
 VulkanRenderer::OffscreenImageInfo VulkanPathTracerHW::GetOffscreenImageInfo() const {
     return {
-        .format = vk::Format::eR32G32B32A32Sfloat,
+        // Only the mean of the accumulation, which is kept at full precision in a buffer
+        .format = vk::Format::eR16G16B16A16Sfloat,
         .usage = vk::ImageUsageFlagBits::eStorage,
-        .dst_stage_mask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+        .dst_stage_mask = GetTracePipelineStages(),
         .dst_access_mask = vk::AccessFlagBits2::eShaderStorageWrite,
     };
 }
 
-std::unique_ptr<VulkanDevice> VulkanPathTracerHW::CreateDevice(
-    vk::SurfaceKHR surface, [[maybe_unused]] const vk::Extent2D& actual_extent) const {
-    return std::make_unique<VulkanDevice>(
-        context->instance, surface,
-        std::array{
-            VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-            VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
-            VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
-            VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
-            VK_KHR_SHADER_CLOCK_EXTENSION_NAME,
-        },
-        Helpers::GenericStructureChain{vk::PhysicalDeviceFeatures2{
-                                           .features =
-                                               {
-                                                   .samplerAnisotropy = VK_TRUE,
-                                                   .shaderInt64 = VK_TRUE,
-                                                   .shaderInt16 = VK_TRUE,
-                                               },
-                                       },
-                                       vk::PhysicalDeviceVulkan11Features{
-                                           .storageBuffer16BitAccess = VK_TRUE,
-                                       },
-                                       vk::PhysicalDeviceVulkan12Features{
-                                           .storageBuffer8BitAccess = VK_TRUE,
-                                           .shaderInt8 = VK_TRUE,
-                                           .runtimeDescriptorArray = VK_TRUE,
-                                           .bufferDeviceAddress = VK_TRUE,
-                                       },
-                                       vk::PhysicalDeviceVulkan13Features{
-                                           .pipelineCreationCacheControl = VK_TRUE,
-                                           .synchronization2 = VK_TRUE,
-                                       },
-                                       vk::PhysicalDeviceAccelerationStructureFeaturesKHR{
-                                           .accelerationStructure = VK_TRUE,
-                                       },
-                                       vk::PhysicalDeviceRayTracingPipelineFeaturesKHR{
-                                           .rayTracingPipeline = VK_TRUE,
-                                       },
-                                       vk::PhysicalDeviceShaderClockFeaturesKHR{
-                                           .shaderSubgroupClock = VK_TRUE,
-                                       }});
-}
-
-void VulkanPathTracerHW::Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_extent) {
-    VulkanRenderer::Init(surface, actual_extent);
-    // TODO: Use a uniform instead and remove this requirement
-    if (device->physical_device.getProperties().limits.maxPushConstantsSize <
-        sizeof(GLSL::PathTracerPushConstantBlock)) {
-
-        SPDLOG_ERROR("Physical device max push constants size is too small");
-        throw std::runtime_error("Max push constants size too small");
+VulkanRenderer::DeviceRequirements VulkanPathTracerHW::GetDeviceRequirements() const {
+    const auto GetFeatures = [](auto&&... extra_features) {
+        return Helpers::GenericStructureChain{
+            vk::PhysicalDeviceFeatures2{
+                .features =
+                    {
+                        .samplerAnisotropy = VK_TRUE,
+                        .shaderInt64 = VK_TRUE,
+                        .shaderInt16 = VK_TRUE,
+                    },
+            },
+            vk::PhysicalDeviceVulkan11Features{
+                .storageBuffer16BitAccess = VK_TRUE,
+            },
+            vk::PhysicalDeviceVulkan12Features{
+                .storageBuffer8BitAccess = VK_TRUE,
+                .shaderInt8 = VK_TRUE,
+                .runtimeDescriptorArray = VK_TRUE,
+                .timelineSemaphore = VK_TRUE,
+                .bufferDeviceAddress = VK_TRUE,
+            },
+            vk::PhysicalDeviceVulkan13Features{
+                .pipelineCreationCacheControl = VK_TRUE,
+                .synchronization2 = VK_TRUE,
+            },
+            vk::PhysicalDeviceAccelerationStructureFeaturesKHR{
+                .accelerationStructure = VK_TRUE,
+            },
+            vk::PhysicalDeviceRayTracingPipelineFeaturesKHR{
+                .rayTracingPipeline = VK_TRUE,
+            },
+            vk::PhysicalDeviceShaderClockFeaturesKHR{
+                .shaderSubgroupClock = VK_TRUE,
+            },
+            std::forward<decltype(extra_features)>(extra_features)...,
+        };
+    };
+    if (!picking) {
+        return {
+            .extensions =
+                {
+                    VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+                    VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
+                    VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
+                    VK_KHR_SHADER_CLOCK_EXTENSION_NAME,
+                },
+            .features = GetFeatures(),
+        };
     }
+    // The rays picked are traced from a compute shader
+    return {
+        .extensions =
+            {
+                VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+                VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
+                VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
+                VK_KHR_SHADER_CLOCK_EXTENSION_NAME,
+                VK_KHR_RAY_QUERY_EXTENSION_NAME,
+            },
+        .features = GetFeatures(vk::PhysicalDeviceRayQueryFeaturesKHR{
+            .rayQuery = VK_TRUE,
+        }),
+    };
 }
 
-void VulkanPathTracerHW::LoadScene(GLTF::Container& gltf) {
-    scene = std::make_unique<Scene>();
+namespace {
 
-    SceneLoader loader{
-        {
-            .usage = vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
-                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
-            .dst_stage_mask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
-            .dst_access_mask = vk::AccessFlagBits2::eShaderRead,
-        },
-        {
-            .usage = vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
-                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
-            .dst_stage_mask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
-            .dst_access_mask = vk::AccessFlagBits2::eShaderRead,
-        },
-        *scene,
-        *device,
-        gltf};
+struct BLASGeometry {
+    std::vector<vk::AccelerationStructureGeometryKHR> geometries;
+    std::vector<vk::AccelerationStructureBuildRangeInfoKHR> build_ranges;
+};
 
-    // Upload primitives & build acceleration structures
-    blases.clear();
+// Whether any hit shaders alpha test the primitive, so that its geometry is not opaque
+bool IsAlphaMasked(const Scene& scene, const MeshPrimitive& primitive) {
+    return primitive.material != -1 && scene.materials[primitive.material]->IsAlphaMasked();
+}
 
-    // Mesh ptr -> starting position in array
-    std::unordered_map<std::shared_ptr<Mesh>, std::size_t> mesh_blas_map;
-    std::vector<GLSL::PrimitiveInfo> primitives_info;
-    for (const auto& [mesh, transform] : scene->main_sub_scene->mesh_instances) {
-        if (mesh_blas_map.count(mesh)) {
-            continue;
-        }
-        mesh_blas_map.emplace(mesh, blases.size());
+// Whether a primitive of the mesh has an opacity micromap, which its BLAS references. Those are
+// not serialized to the scene cache, as deserializing them would need the same micromaps.
+bool HasOpacityMicromaps(const Mesh& mesh) {
+    return std::ranges::any_of(mesh.primitives,
+                               [](const auto& primitive) { return !!primitive->opacity_micromap; });
+}
 
-        for (const auto& primitive : mesh->primitives) {
-            const auto GetAttributeAddress = [this, &primitive](std::size_t i) -> u64 {
-                const auto& attribute = primitive->attributes[i];
-                if (!primitive->raw_vertex_buffers[attribute.binding]) {
-                    return 0;
-                }
-                return (*device)->getBufferAddress({
-                           .buffer = primitive->raw_vertex_buffers[attribute.binding],
-                       }) +
-                       primitive->vertex_buffer_offsets[attribute.binding] + attribute.offset;
-            };
-            const auto GetAttributeStride = [this, &primitive](std::size_t i) {
-                const auto& attribute = primitive->attributes[i];
-                return primitive->bindings[attribute.binding].stride;
-            };
+// One geometry per primitive, in primitive order. From the copies the primitives keep on the CPU
+// if on_host, which cannot reference opacity micromaps.
+BLASGeometry GetBLASGeometry(const Scene& scene, const Mesh& mesh, bool on_host) {
+    BLASGeometry out;
+    for (const auto& primitive : mesh.primitives) {
+        const auto GetAttributeAddress = [&primitive](std::size_t i) -> u64 {
+            const auto& attribute = primitive->attributes[i];
+            if (!primitive->raw_vertex_buffers[attribute.binding]) {
+                return 0;
+            }
+            return primitive->vertex_buffer_addresses[attribute.binding] + attribute.offset;
+        };
+        const auto GetAttributeStride = [&primitive](std::size_t i) {
+            const auto& attribute = primitive->attributes[i];
+            return primitive->bindings[attribute.binding].stride;
+        };
 
-            // Location 0 is POSITION
-            vk::AccelerationStructureGeometryKHR geometry{
-                .geometryType = vk::GeometryTypeKHR::eTriangles,
-                .geometry =
-                    {
-                        .triangles =
-                            {
-                                .vertexFormat = primitive->attributes[0].format,
-                                .vertexData =
-                                    {
-                                        .deviceAddress = GetAttributeAddress(0),
-                                    },
-                                .vertexStride = GetAttributeStride(0),
-                                .maxVertex = static_cast<u32>(primitive->max_vertices),
-                            },
-                    },
-                .flags = vk::GeometryFlagBitsKHR::eOpaque,
+        // Location 0 is POSITION. Quantized positions are used directly, the loader has
+        // converted any that are not supported as geometry formats to floats.
+        vk::AccelerationStructureGeometryKHR geometry{
+            .geometryType = vk::GeometryTypeKHR::eTriangles,
+            .geometry =
+                {
+                    .triangles =
+                        {
+                            .vertexFormat = primitive->attributes[0].format,
+                            .vertexData =
+                                {
+                                    .deviceAddress = GetAttributeAddress(0),
+                                },
+                            .vertexStride = GetAttributeStride(0),
+                            .maxVertex = static_cast<u32>(primitive->max_vertices),
+                        },
+                },
+            .flags = IsAlphaMasked(scene, *primitive)
+                         ? vk::GeometryFlagBitsKHR::eNoDuplicateAnyHitInvocation
+                         : vk::GeometryFlagBitsKHR::eOpaque,
+        };
+        if (primitive->opacity_micromap && !on_host) {
+            geometry.geometry.triangles.pNext = &primitive->opacity_micromap->GetTrianglesInfo();
+        }
+        if (primitive->index_buffer) {
+            geometry.geometry.triangles.indexType =
+                GLTF::GetIndexType(primitive->index_buffer->component_type);
+            geometry.geometry.triangles.indexData = {
+                .deviceAddress = primitive->index_buffer->gpu_buffer->address,
             };
+            out.build_ranges.push_back({
+                .primitiveCount = static_cast<u32>(primitive->index_buffer->count / 3),
+            });
+        } else {
+            geometry.geometry.triangles.indexType = vk::IndexType::eNoneKHR;
+            out.build_ranges.push_back({
+                .primitiveCount = static_cast<u32>(primitive->max_vertices / 3),
+            });
+        }
+        if (on_host) {
+            auto& triangles = geometry.geometry.triangles;
+            triangles.vertexFormat = vk::Format::eR32G32B32Sfloat;
+            triangles.vertexData = {.hostAddress = primitive->host_positions.data()};
+            triangles.vertexStride = 3 * sizeof(float);
             if (primitive->index_buffer) {
-                geometry.geometry.triangles.indexType =
-                    GLTF::GetIndexType(primitive->index_buffer->component_type);
-                geometry.geometry.triangles.indexData = {
-                    .deviceAddress = (*device)->getBufferAddress({
-                        .buffer = **primitive->index_buffer->gpu_buffer,
-                    }),
-                };
-                blases.emplace_back(std::make_unique<VulkanAccelStructure>(
-                    *device, geometry,
-                    vk::AccelerationStructureBuildRangeInfoKHR{
-                        .primitiveCount = static_cast<u32>(primitive->index_buffer->count / 3),
-                    }));
-            } else {
-                geometry.geometry.triangles.indexType = vk::IndexType::eNoneKHR;
-                blases.emplace_back(std::make_unique<VulkanAccelStructure>(
-                    *device, geometry,
-                    vk::AccelerationStructureBuildRangeInfoKHR{
-                        .primitiveCount = static_cast<u32>(primitive->max_vertices / 3),
-                    }));
+                triangles.indexType = vk::IndexType::eUint32;
+                triangles.indexData = {.hostAddress = primitive->host_indices.data()};
             }
+        }
+        out.geometries.emplace_back(geometry);
+    }
+    return out;
+}
 
-            // Gather primitive info
-            primitives_info.emplace_back(GLSL::PrimitiveInfo{
-                .index_address = (*device)->getBufferAddress({
-                    .buffer = **primitive->index_buffer->gpu_buffer,
-                }),
-                .position_address = GetAttributeAddress(0),
-                .normal_address = GetAttributeAddress(1),
-                .texcoord0_address = GetAttributeAddress(2),
-                .texcoord1_address = GetAttributeAddress(3),
-                .color_address = GetAttributeAddress(4),
-                .tangent_address = GetAttributeAddress(5),
-                .material_idx = primitive->material,
-                .index_size = primitive->index_buffer
-                                  ? static_cast<u32>(
-                                        GetComponentSize(primitive->index_buffer->component_type))
-                                  : 0,
-                .position_stride = GetAttributeStride(0),
-                .normal_stride = GetAttributeStride(1),
-                .texcoord0_stride = GetAttributeStride(2),
-                .texcoord0_type = GetTexCoordType(primitive->attributes[2].format),
-                .texcoord1_stride = GetAttributeStride(3),
-                .texcoord1_type = GetTexCoordType(primitive->attributes[3].format),
-                .color_stride = GetAttributeStride(4),
-                .color_type = GetColorType(primitive->attributes[4].format),
-                .tangent_stride = GetAttributeStride(5),
-            });
+// Primitives without one have the default material, which comes last
+std::size_t GetMaterialIndex(const Scene& scene, const MeshPrimitive& primitive) {
+    return primitive.material == -1 ? scene.materials.size() - 1
+                                    : static_cast<std::size_t>(primitive.material);
+}
 
-            // Try to compact and cleanup all previous BLASes
-            for (auto& blas : blases) {
-                blas->Compact();
-                blas->Cleanup();
-            }
+// Flags of the hit groups, whose closest hit shaders are specialized for them (see
+// CreatePipeline). Each mesh has the hit group whose flags hold for all of its primitives, as
+// the rays do not select records by geometry.
+constexpr u32 HitGroupUntextured = 1;
+constexpr u32 HitGroupFloatAttributes = 2;
+constexpr u32 NumHitGroups = 4;
+
+// Of the push constants of the tiles, see GetPixelIndex
+constexpr vk::ShaderStageFlags TraceStages =
+    vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eClosestHitKHR |
+    vk::ShaderStageFlagBits::eAnyHitKHR | vk::ShaderStageFlagBits::eMissKHR;
+
+u32 GetHitGroup(const Scene& scene, const Mesh& mesh) {
+    u32 hit_group = HitGroupUntextured | HitGroupFloatAttributes;
+    for (const auto& primitive : mesh.primitives) {
+        if (scene.materials[GetMaterialIndex(scene, *primitive)]->IsTextured()) {
+            hit_group &= ~HitGroupUntextured;
+        }
+        if (!primitive->HasFloatAttributes()) {
+            hit_group &= ~HitGroupFloatAttributes;
         }
     }
+    return hit_group;
+}
 
-    primitives_buffer = std::make_unique<VulkanImmUploadBuffer>(
-        *device,
-        VulkanBufferCreateInfo{
-            .size = primitives_info.size() * sizeof(GLSL::PrimitiveInfo),
-            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
-            .dst_stage_mask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
-            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
-        },
-        reinterpret_cast<const u8*>(primitives_info.data()));
-
-    // Wait until all compacts have started
-    auto blases_to_compact = Common::VectorFromRange(
-        blases | std::views::filter([](const auto& ptr) { return *ptr->build_fence; }) |
-        std::views::transform(&std::unique_ptr<VulkanAccelStructure>::get));
-    while (!blases_to_compact.empty()) {
-        const auto result = (*device)->waitForFences(
-            Common::VectorFromRange(blases_to_compact |
-                                    std::views::transform([](VulkanAccelStructure* blas) {
-                                        return *blas->build_fence;
-                                    })),
-            VK_FALSE, std::numeric_limits<u64>::max());
-        if (result != vk::Result::eSuccess) {
-            SPDLOG_ERROR("Failed to wait for fences");
-            throw std::runtime_error("Failed to wait for fences");
+// glTF front faces are counterclockwise, unlike the default facing of ray tracing. As facing is
+// determined in object space, mirroring transforms (whose winding glTF reverses) need nothing
+// more. Back faces are culled unless a material of the mesh is double sided, as instances cannot
+// cull per geometry.
+vk::GeometryInstanceFlagsKHR GetInstanceFlags(const Scene& scene, const Mesh& mesh) {
+    vk::GeometryInstanceFlagsKHR flags = vk::GeometryInstanceFlagBitsKHR::eTriangleFlipFacing;
+    for (const auto& primitive : mesh.primitives) {
+        if (scene.materials[GetMaterialIndex(scene, *primitive)]->double_sided) {
+            flags |= vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable;
         }
+    }
+    return flags;
+}
 
-        std::vector<VulkanAccelStructure*> new_blases_to_compact;
-        for (auto* blas : blases_to_compact) {
-            if (blas->build_fence.getStatus() == vk::Result::eSuccess) {
-                blas->Compact();
-            } else {
-                new_blases_to_compact.emplace_back(blas);
-            }
+// Every mesh is visible to all rays, as no material property hides them from any yet
+u8 GetInstanceMask(const Scene&, const Mesh&) {
+    return INSTANCE_MASK_CAMERA | INSTANCE_MASK_INDIRECT | INSTANCE_MASK_SHADOW;
+}
+
+// Deformed instances are traced against their own BLASes and copies of their primitives, see
+// MeshDeformer. They are skipped like the rest, when their mesh is not in the TLASes.
+std::vector<VulkanAccelStructure::BLASInstance> GetTLASInstances(
+    const Scene& scene, const SubScene& sub_scene,
+    const std::vector<std::unique_ptr<VulkanAccelStructure>>& blases,
+    const MeshDeformer* deformer = nullptr) {
+
+    const auto hit_groups = Common::VectorFromRange(
+        scene.meshes |
+        std::views::transform([&scene](const auto& mesh) { return GetHitGroup(scene, *mesh); }));
+    const auto instance_flags = Common::VectorFromRange(
+        scene.meshes | std::views::transform(
+                           [&scene](const auto& mesh) { return GetInstanceFlags(scene, *mesh); }));
+    std::vector<VulkanAccelStructure::BLASInstance> instances;
+    for (std::size_t i = 0; i < sub_scene.GetNumInstances(); ++i) {
+        const u32 mesh = sub_scene.instance_meshes[i];
+        const auto& blas = blases.at(mesh);
+        if (!blas) {
+            continue;
         }
-        blases_to_compact = std::move(new_blases_to_compact);
+        const u32 deformed = deformer ? deformer->instance_indices[i] : MeshDeformer::NotDeformed;
+        const auto& deformed_instance =
+            deformed != MeshDeformer::NotDeformed ? &deformer->instances[deformed] : nullptr;
+        // The hit shader adds the geometry index to find the primitive
+        instances.emplace_back(VulkanAccelStructure::BLASInstance{
+            .blas = deformed_instance ? *deformed_instance->blas : *blas,
+            .transform = sub_scene.instance_transforms[i],
+            .custom_index = deformed_instance ? deformer->first_primitive +
+                                                    deformed_instance->first_primitive
+                                              : sub_scene.instance_first_primitives[i],
+            .hit_group = hit_groups[mesh],
+            .mask = GetInstanceMask(scene, *scene.meshes[mesh]),
+            .flags = instance_flags[mesh],
+        });
+    }
+    return instances;
+}
+
+float Luminance(const glm::vec3& color) {
+    return glm::dot(color, glm::vec3{0.212671f, 0.715160f, 0.072169f});
+}
+
+// Of the compute passes after tracing, whose images are all in the general layout
+VulkanRenderGraph::Access StorageAccess(vk::AccessFlags2 access) {
+    return {
+        .stages = vk::PipelineStageFlagBits2::eComputeShader,
+        .access = access,
+        .layout = vk::ImageLayout::eGeneral,
+    };
+}
+
+// Of the uniforms. Few bounces are path tracing of a lower max depth.
+u32 GetShaderIntegrator(VulkanPathTracerHW::Integrator integrator) {
+    using Integrator = VulkanPathTracerHW::Integrator;
+    switch (integrator) {
+    case Integrator::AmbientOcclusion:
+        return INTEGRATOR_AMBIENT_OCCLUSION;
+    case Integrator::DirectLighting:
+        return INTEGRATOR_DIRECT;
+    case Integrator::Albedo:
+        return INTEGRATOR_ALBEDO;
+    case Integrator::Normals:
+        return INTEGRATOR_NORMALS;
+    default:
+        return INTEGRATOR_PATH;
+    }
+}
+
+} // namespace
+
+// One TLAS per sub scene over the same BLASes, so that switching between them is cheap
+std::vector<std::unique_ptr<VulkanAccelStructure>> VulkanPathTracerHW::BuildTLASes(
+    LoadProfiler* profiler, bool allow_update) {
 
-        for (auto& blas : blases) {
-            blas->Cleanup();
+    // Of generated instances, one BLAS per mesh as there are no LODs of them
+    std::vector<std::vector<vk::DeviceAddress>> mesh_blases;
+    if (gpu_instances) {
+        for (const auto& blas : blases) {
+            mesh_blases.emplace_back();
+            if (blas) {
+                mesh_blases.back().emplace_back(blas->compacted_as->address);
+            }
         }
     }
 
-    std::vector<VulkanAccelStructure::BLASInstance> instances;
-    for (const auto& [mesh, transform] : scene->main_sub_scene->mesh_instances) {
-        const std::size_t index = mesh_blas_map.at(mesh);
-        for (std::size_t i = 0; i < mesh->primitives.size(); ++i) {
-            instances.emplace_back(VulkanAccelStructure::BLASInstance{
-                .blas = *blases.at(index + i),
-                .transform = transform,
-                .custom_index = static_cast<u32>(index + i),
+    std::vector<std::unique_ptr<VulkanAccelStructure>> built;
+    for (std::size_t idx = 0; idx < scene->sub_scenes.size(); ++idx) {
+        const auto& sub_scene = scene->sub_scenes[idx];
+        const auto instances = GetTLASInstances(*scene, *sub_scene, blases,
+                                                GetMeshDeformer(idx));
+        if (instances.empty()) { // Cannot be rendered
+            SPDLOG_WARN("Sub scene {} has no meshes", sub_scene->name);
+            built.emplace_back();
+            continue;
+        }
+        const LoadProfiler::Scope profile_scope{profiler, LoadProfiler::Stage::TLASBuild};
+        if (!gpu_instances) {
+            built.emplace_back(std::make_unique<VulkanAccelStructure>(instances, allow_update));
+            continue;
+        }
+        // Like GetTLASInstances, whose instances are in the same order
+        std::vector<VulkanTLASInstanceGenerator::Instance> sources;
+        std::size_t instance_idx = 0;
+        for (std::size_t i = 0; i < sub_scene->GetNumInstances(); ++i) {
+            const u32 mesh = sub_scene->instance_meshes[i];
+            if (!blases.at(mesh)) {
+                continue;
+            }
+            const auto& instance = instances[instance_idx++];
+            sources.emplace_back(VulkanTLASInstanceGenerator::Instance{
+                .mesh = mesh,
+                .transform = instance.transform,
+                .bounds = sub_scene->instance_bounds[i],
+                .custom_index = instance.custom_index,
+                .hit_group = instance.hit_group,
+                .mask = instance.mask,
+                .flags = instance.flags,
             });
         }
+        // Rebuilt by DrawFrame once the camera has moved from its first one
+        const glm::vec3 camera_position =
+            sub_scene->cameras.empty() ? glm::vec3{}
+                                       : glm::vec3{glm::inverse(sub_scene->cameras[0]->view)[3]};
+        built.emplace_back(std::make_unique<VulkanAccelStructure>(
+            *device,
+            std::make_unique<VulkanTLASInstanceGenerator>(
+                *device, sources, mesh_blases,
+                VulkanTLASInstanceGenerator::Settings{
+                    .cull_distance = instance_cull_distance,
+                    .min_projected_size = instance_min_projected_size,
+                }),
+            camera_position));
     }
-    tlas = std::make_unique<VulkanAccelStructure>(instances);
+    return built;
+}
 
-    // Pending tasks: compact & cleanup TLAS; cleanup BLAS
+// The BLASes all come from a VulkanBLASBuilder, so they are compacted once built
+void VulkanPathTracerHW::WaitForAccelStructures() {
     // Strictly speaking we do not have to cleanup everything here, but we do not want to maintain
     // the states
-    auto blases_to_clean = Common::VectorFromRange(
-        blases | std::views::filter([](const auto& ptr) { return *ptr->compact_fence; }) |
+    auto tlases_to_clean = Common::VectorFromRange(
+        tlases | std::views::filter([](const auto& ptr) { return ptr != nullptr; }) |
         std::views::transform(&std::unique_ptr<VulkanAccelStructure>::get));
-    while (!blases_to_clean.empty() || *tlas->build_fence || *tlas->compact_fence) {
-        auto fences = Common::VectorFromRange(
-            blases_to_clean |
-            std::views::transform([](VulkanAccelStructure* blas) { return *blas->compact_fence; }));
-        if (*tlas->build_fence) { // compact has not started
-            fences.emplace_back(*tlas->build_fence);
-        } else if (*tlas->compact_fence) { // not cleaned up
-            fences.emplace_back(*tlas->compact_fence);
+    while (!tlases_to_clean.empty()) {
+        std::vector<vk::Fence> fences;
+        for (auto* tlas : tlases_to_clean) {
+            if (*tlas->build_fence) { // compact has not started
+                fences.emplace_back(*tlas->build_fence);
+            } else if (*tlas->compact_fence) { // not cleaned up
+                fences.emplace_back(*tlas->compact_fence);
+            }
         }
         const auto result =
             (*device)->waitForFences(fences, VK_FALSE, std::numeric_limits<u64>::max());
@@ -297,41 +441,394 @@ void VulkanPathTracerHW::LoadScene(GLTF::Container& gltf) {
             throw std::runtime_error("Failed to wait for fences");
         }
 
-        tlas->Compact();
-        tlas->Cleanup();
+        std::erase_if(tlases_to_clean, [](VulkanAccelStructure* tlas) { return tlas->Poll(); });
+    }
+}
+
+void VulkanPathTracerHW::CreateMeshDeformers(std::size_t num_primitives) {
+    mesh_deformers.clear();
+    mesh_deformers.resize(scene->sub_scenes.size());
+    for (std::size_t idx = 0; idx < scene->sub_scenes.size(); ++idx) {
+        const auto& sub_scene = *scene->sub_scenes[idx];
+        bool deformed = false;
+        for (std::size_t i = 0; i < sub_scene.GetNumInstances() && !deformed; ++i) {
+            deformed = MeshDeformer::IsDeformed(*scene, idx, i);
+        }
+        if (!deformed) {
+            continue;
+        }
+        if (gpu_instances) {
+            SPDLOG_WARN("Skinned and morphed meshes are traced at rest with GPU instances");
+            break;
+        }
+
+        auto deformer = std::make_unique<MeshDeformer>(*device, *scene, idx,
+                                                       static_cast<u32>(num_primitives));
+        num_primitives += deformer->primitives.size();
+        {
+            Helpers::OneTimeCommandContext cmd{*device};
+            deformer->Record(*cmd, GetTracePipelineStages());
+        } // Submits and waits
 
-        std::vector<VulkanAccelStructure*> new_blases_to_clean;
-        for (auto* blas : blases_to_clean) {
-            if (blas->compact_fence.getStatus() == vk::Result::eSuccess) {
-                blas->Cleanup();
-            } else {
-                new_blases_to_clean.emplace_back(blas);
+        // Of the deformed positions, which are floats
+        for (auto& instance : deformer->instances) {
+            const auto& mesh = *scene->meshes[sub_scene.instance_meshes[instance.instance]];
+            auto geometry = GetBLASGeometry(*scene, mesh, false);
+            for (std::size_t j = 0; j < geometry.geometries.size(); ++j) {
+                auto& triangles = geometry.geometries[j].geometry.triangles;
+                triangles.pNext = nullptr; // Micromaps are of the rest pose
+                triangles.vertexFormat = vk::Format::eR32G32B32Sfloat;
+                triangles.vertexData = {
+                    .deviceAddress =
+                        deformer->primitives[instance.first_primitive + j].info.position_address,
+                };
+                triangles.vertexStride = 3 * sizeof(float);
+            }
+            instance.blas = std::make_unique<VulkanAccelStructure>(
+                *device, geometry.geometries, geometry.build_ranges,
+                vk::AccelerationStructureTypeKHR::eBottomLevel, true);
+        }
+        for (const auto& instance : deformer->instances) {
+            const auto result = (*device)->waitForFences(*instance.blas->build_fence, VK_TRUE,
+                                                         std::numeric_limits<u64>::max());
+            if (result != vk::Result::eSuccess) {
+                SPDLOG_ERROR("Failed to wait for fence");
+                throw std::runtime_error("Failed to wait for fence");
             }
+            instance.blas->Compact(); // Only marks it as built, as it allows updates
+        }
+        SPDLOG_INFO("Deforming {} instances of sub scene {}", deformer->instances.size(),
+                    sub_scene.name);
+        mesh_deformers[idx] = std::move(deformer);
+    }
+}
+
+void VulkanPathTracerHW::UpdateMeshDeformers() {
+    if (std::ranges::none_of(mesh_deformers, [](const auto& deformer) { return !!deformer; })) {
+        return;
+    }
+
+    Helpers::OneTimeCommandContext cmd{*device};
+    for (const auto& deformer : mesh_deformers) {
+        if (!deformer) {
+            continue;
+        }
+        deformer->Record(*cmd, GetTracePipelineStages());
+        for (const auto& instance : deformer->instances) {
+            instance.blas->RecordUpdate(*cmd);
         }
-        blases_to_clean = std::move(new_blases_to_clean);
     }
+    // For the TLAS updates, and the tracing
+    cmd->pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+            .srcAccessMask = vk::AccessFlagBits2::eAccelerationStructureWriteKHR,
+            .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR |
+                            GetTracePipelineStages(),
+            .dstAccessMask = vk::AccessFlagBits2::eAccelerationStructureReadKHR,
+        }},
+    });
+} // Submits and waits
+
+const MeshDeformer* VulkanPathTracerHW::GetMeshDeformer(std::size_t sub_scene) const {
+    return sub_scene < mesh_deformers.size() ? mesh_deformers[sub_scene].get() : nullptr;
+}
 
-    // Upload materials
+void VulkanPathTracerHW::UploadMaterials() {
     const auto materials_info = Common::VectorFromRange(
         scene->materials | std::views::transform([](const std::unique_ptr<Material>& material) {
-            return material->glsl_material;
+            return material->GetPackedMaterial();
         }));
     materials_buffer = std::make_unique<VulkanImmUploadBuffer>(
         *device,
         VulkanBufferCreateInfo{
-            .size = materials_info.size() * sizeof(GLSL::Material),
+            .size = materials_info.size() * sizeof(GLSL::PackedMaterial),
             .usage = vk::BufferUsageFlagBits::eStorageBuffer,
-            .dst_stage_mask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .dst_stage_mask = GetTracePipelineStages(),
             .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
         },
         reinterpret_cast<const u8*>(materials_info.data()));
+    materials_buffer->SetMovable();
+}
+
+GeometryRequirements VulkanPathTracerHW::GetGeometryRequirements(
+    const VulkanDevice& device_) const {
+    const bool build_on_host = host_builds && device_.accel_structure_host_commands;
+    const BufferParams build_input_params{
+        .usage = vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                 vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        .dst_stage_mask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+        .dst_access_mask = vk::AccessFlagBits2::eShaderRead,
+    };
+    return {
+        .vertex_buffer_params = build_input_params,
+        .index_buffer_params = build_input_params,
+        .keep_host_geometry = build_on_host,
+        .keep_emissive_geometry = true,
+        .bake_opacity_micromaps = device_.opacity_micromap && !build_on_host,
+    };
+}
+
+void VulkanPathTracerHW::LoadScene(GLTF::Container& gltf) {
+    CheckSceneSettings();
+    scene = std::make_unique<Scene>();
+
+    const auto requirements = GetSwitchGeometryRequirements();
+    SceneLoader loader{
+        requirements.vertex_buffer_params,
+        requirements.index_buffer_params,
+        *scene,
+        *device,
+        gltf,
+        thread_pool.get(),
+        compress_textures,
+        texture_budget,
+        num_frames_in_flight,
+        lazy_textures,
+        false,
+        false,
+        requirements.keep_host_geometry,
+        requirements.keep_emissive_geometry,
+        0,
+        optimize_indices,
+        pack_vertices,
+        requirements.bake_opacity_micromaps,
+        TextureQuality{
+            .max_size = max_texture_size,
+            .dropped_levels = dropped_texture_levels,
+            .budget = texture_quality_budget,
+        },
+        gpu_tangent_triangles,
+        spatial_order,
+        host_cache_budget,
+        gpu_image_decode};
+    scene_cache = loader.cache;
+    sub_scene_idx = scene->main_sub_scene;
+    CreateSceneResources(loader.profiler.get(), &gltf);
+}
+
+void VulkanPathTracerHW::OnSceneShared() {
+    CheckSceneSettings();
+    if (!checkpoint_path.empty()) {
+        SPDLOG_WARN("Checkpoints are of scenes loaded by the renderer, not writing any");
+    }
+    // Where the loader of the scene keeps its cache too
+    scene_cache =
+        std::make_shared<SceneCache>(device->startup_path / u8"cache", thread_pool.get());
+    CreateSceneResources(nullptr, nullptr);
+}
+
+void VulkanPathTracerHW::CheckSceneSettings() {
+    // The specialized pipeline of the previous scene is compiled against its descriptor sets
+    if (specialized_pipeline.valid()) {
+        specialized_pipeline.wait();
+        specialized_pipeline = {};
+    }
+    if (host_builds && !device->accel_structure_host_commands) {
+        SPDLOG_WARN("Device cannot build acceleration structures on the host, using the GPU");
+        host_builds = false;
+    }
+    if (cost_heatmap && !SupportsCostHeatmap()) {
+        SPDLOG_WARN("Renderer cannot measure costs, disabling the cost heatmap");
+        cost_heatmap = false;
+    }
+    if (ray_stats && !SupportsRayStats()) {
+        SPDLOG_WARN("Renderer cannot count rays, disabling the ray stats");
+        ray_stats = false;
+    }
+    if (restir_candidates > 0 && !SupportsReSTIR()) {
+        SPDLOG_WARN("Renderer cannot resample light samples, disabling ReSTIR");
+        restir_candidates = 0;
+    }
+    if (path_guiding && !SupportsPathGuiding()) {
+        SPDLOG_WARN("Renderer cannot guide paths, disabling path guiding");
+        path_guiding = false;
+    }
+    // Frames of no paths are those adaptive sampling traced no pixels of
+    if (converge_adaptively && adaptive_threshold > 0 && !ray_stats) {
+        ray_stats = SupportsRayStats();
+        if (!ray_stats) {
+            SPDLOG_WARN("Renderer cannot count rays, only converging on the target samples");
+        }
+    }
+    if (progressive_builds && !checkpoint_path.empty()) {
+        SPDLOG_WARN("Checkpoints are of the whole scene, disabling progressive builds");
+        progressive_builds = false;
+    }
+}
+
+void VulkanPathTracerHW::CreateSceneResources(LoadProfiler* profiler,
+                                              const GLTF::Container* gltf) {
+    const bool build_on_host = host_builds; // Supported by the device, see CheckSceneSettings
+
+    // Upload primitives & build acceleration structures
+    pending_tlases.clear();
+    pending_tlases_add_instances = false;
+    retired_blases.clear();
+    blases.clear();
+    mesh_deformers.clear();
+
+    // All meshes are built together once their geometry is uploaded. Those built on an earlier
+    // load are deserialized from the scene cache instead, if the device is compatible.
+    VulkanBLASBuilder blas_builder{*device, thread_pool.get()};
+    const auto device_uuid = device->physical_device.getProperties().pipelineCacheUUID;
+    std::vector<std::size_t> built_meshes;
+    std::vector<std::shared_ptr<const SceneCache::Entry>> cached_blases; // Kept until built
+    std::vector<std::pair<std::size_t, SceneCache::Key>> blases_to_cache; // Index in built_meshes
+    std::vector<GLSL::PrimitiveInfo> primitives_info;
+    blas_upgrades.clear();
+    blas_upgrader.reset();
+    progressive_meshes.clear();
+    progressive_builder.reset();
+    // Only device builds can be asynchronous
+    if (progressive_builds && !build_on_host) {
+        progressive_builder = std::make_unique<VulkanBLASBuilder>(*device);
+    }
+    for (std::size_t mesh_idx = 0; mesh_idx < scene->meshes.size(); ++mesh_idx) {
+        const auto& mesh = *scene->meshes[mesh_idx];
+        if (mesh.primitives.empty()) {
+            continue;
+        }
+        SceneCache::Hasher blas_hasher{"blas"};
+        blas_hasher.AddValue(device_uuid);
+        for (const auto& primitive : mesh.primitives) {
+            blas_hasher.AddValue(primitive->geometry_hash);
+            blas_hasher.AddValue(IsAlphaMasked(*scene, *primitive));
+            primitives_info.emplace_back(primitive->GetPrimitiveInfo());
+        }
+        const auto key = blas_hasher.Get();
+        const bool cacheable = !HasOpacityMicromaps(mesh);
+        std::shared_ptr<const SceneCache::Entry> entry =
+            cacheable ? scene_cache->Load(key) : nullptr;
+        if (entry && entry->GetNumSections() == 1 &&
+            blas_builder.IsCompatible(entry->GetSection(0))) {
+            blas_builder.AddSerialized(entry->GetSection(0));
+            cached_blases.emplace_back(std::move(entry));
+        } else {
+            // Fast builds are upgraded (and cached) later
+            const auto preference = fast_first_builds
+                                        ? VulkanBLASBuilder::BuildPreference::FastBuild
+                                        : VulkanBLASBuilder::BuildPreference::FastTrace;
+            const auto geometry = GetBLASGeometry(*scene, mesh, build_on_host);
+            if (fast_first_builds) {
+                blas_upgrades.push_back({.mesh = mesh_idx, .key = key, .cacheable = cacheable});
+            }
+            if (progressive_builder) { // Built in the background instead
+                progressive_builder->Add(geometry.geometries, geometry.build_ranges, preference);
+                progressive_meshes.push_back({
+                    .mesh = mesh_idx,
+                    .key = key,
+                    .cacheable = cacheable && !fast_first_builds,
+                });
+                continue;
+            }
+            if (build_on_host) {
+                blas_builder.AddHost(geometry.geometries, geometry.build_ranges, preference);
+            } else {
+                blas_builder.Add(geometry.geometries, geometry.build_ranges, preference);
+            }
+            if (!fast_first_builds && cacheable) {
+                blases_to_cache.emplace_back(built_meshes.size(), key);
+            }
+        }
+        built_meshes.emplace_back(mesh_idx);
+    }
+    {
+        const LoadProfiler::Scope profile_scope{profiler, LoadProfiler::Stage::BLASBuild};
+        const std::size_t num_cached = cached_blases.size();
+        auto built_blases = blas_builder.Build();
+        cached_blases.clear();
+
+        const auto serialized = blas_builder.Serialize(Common::VectorFromRange(
+            blases_to_cache | std::views::transform([&built_blases](const auto& pair) {
+                return static_cast<const VulkanAccelStructure*>(built_blases[pair.first].get());
+            })));
+        for (std::size_t i = 0; i < serialized.size(); ++i) {
+            const std::array<std::span<const u8>, 1> sections{{serialized[i]}};
+            scene_cache->Store(blases_to_cache[i].second, sections);
+        }
+        SPDLOG_INFO("{} of {} BLASes loaded from the cache", num_cached, built_meshes.size());
+
+        blases.resize(scene->meshes.size());
+        for (std::size_t i = 0; i < built_meshes.size(); ++i) {
+            blases[built_meshes[i]] = std::move(built_blases[i]);
+        }
+
+        // Only until there is something to trace, the first round likely
+        if (progressive_builder && progressive_meshes.empty()) {
+            progressive_builder.reset();
+        } else if (progressive_builder) {
+            SPDLOG_INFO("Building {} BLASes in the background", progressive_meshes.size());
+            progressive_builder->BuildAsync(BLASUpgradesPerRound);
+            const auto& main_sub_scene = *scene->sub_scenes[scene->main_sub_scene];
+            while (progressive_builder &&
+                   GetTLASInstances(*scene, main_sub_scene, blases).empty()) {
+                progressive_builder->WaitAsync();
+                TakeProgressiveBLASes();
+            }
+        }
+    }
+    GetEmissiveTriangles();
+    for (const auto& mesh : scene->meshes) { // Only needed for the builds and the lights
+        for (const auto& primitive : mesh->primitives) {
+            primitive->host_positions = {};
+            primitive->host_indices = {};
+        }
+    }
+    CreateMeshDeformers(primitives_info.size());
+    for (const auto& deformer : mesh_deformers) {
+        if (deformer) {
+            for (const auto& primitive : deformer->primitives) {
+                primitives_info.emplace_back(primitive.info);
+            }
+        }
+    }
+
+    primitives_buffer = std::make_unique<VulkanImmUploadBuffer>(
+        *device,
+        VulkanBufferCreateInfo{
+            .size = primitives_info.size() * sizeof(GLSL::PrimitiveInfo),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            .dst_stage_mask = GetTracePipelineStages(),
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+        },
+        reinterpret_cast<const u8*>(primitives_info.data()));
+    primitives_buffer->SetMovable();
+
+    tlases = BuildTLASes(profiler);
+    if (!tlases[scene->main_sub_scene]) {
+        SPDLOG_ERROR("Main scene has no meshes");
+        throw std::runtime_error("Main scene has no meshes");
+    }
+    WaitForAccelStructures();
+
+    if (profiler) {
+        profiler->AddGPUTime(LoadProfiler::Stage::BLASBuild, blas_builder.build_gpu_time);
+        profiler->AddGPUTime(LoadProfiler::Stage::BLASCompaction, blas_builder.compact_gpu_time);
+        for (const auto& tlas : tlases) {
+            if (tlas) {
+                profiler->AddGPUTime(LoadProfiler::Stage::TLASBuild,
+                                     tlas->build_gpu_time + tlas->compact_gpu_time);
+            }
+        }
+        profiler->Report();
+    }
+    device->allocator->LogUsage();
 
-    frames = std::make_unique<VulkanFramesInFlight<Frame, 2>>(*device);
+    UploadMaterials();
+    CreateLightBuffers();
+    frames = std::make_unique<VulkanFramesInFlight<Frame>>(*device, num_frames_in_flight);
+    // The uniforms of each pass, see SetTracePasses
+    frame_allocator = std::make_unique<VulkanFrameAllocator>(
+        *device, frames->frames_in_flight.size(),
+        VulkanFrameAllocator::GetAllocationSize(*device, sizeof(GLSL::PathTracerUniformsBlock)) *
+            MaxTracePasses);
 
     auto images = Common::VectorFromRange(
         scene->textures | std::views::transform([this](const std::unique_ptr<Texture>& texture) {
             return DescriptorBinding::CombinedImageSampler{
-                .image = *texture->image->texture->image_view,
+                .image = *texture->image->GetTexture().image_view,
                 .sampler = texture->sampler ? *texture->sampler->sampler : *device->default_sampler,
             };
         }));
@@ -346,26 +843,56 @@ void VulkanPathTracerHW::LoadScene(GLTF::Container& gltf) {
         });
     }
 
+    if (!environment_map_path.empty() && !environment_map) { // Kept across reloads
+        environment_map = std::make_unique<EnvironmentMap>(*device, environment_map_path,
+                                                           GetTracePipelineStages());
+    }
+    if (!environment_map && !environment_cdf_placeholder) { // Cannot create empty buffers
+        static constexpr float PlaceholderCDF = 1.0f;
+        environment_cdf_placeholder = std::make_unique<VulkanImmUploadBuffer>(
+            *device,
+            VulkanBufferCreateInfo{
+                .size = sizeof(PlaceholderCDF),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+                .dst_stage_mask = GetTracePipelineStages(),
+                .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+            },
+            reinterpret_cast<const u8*>(&PlaceholderCDF));
+    }
+    // Any image will do without a map, it is never sampled
+    const auto environment_image =
+        environment_map ? DescriptorBinding::CombinedImageSampler{
+                              .image = *environment_map->texture->image_view,
+                              .sampler = *device->default_sampler,
+                          }
+                        : images[0];
+
+    CreatePixelBuffers();
+    CreateCounterBuffers();
+    CreateGuideBuffers();
+    const auto trace_stages = GetTraceStages();
     fixed_descriptor_set = std::make_unique<VulkanDescriptorSets>(
         *device, 1,
         std::initializer_list<DescriptorBinding>{
             {
                 .type = vk::DescriptorType::eAccelerationStructureKHR,
-                .stages = vk::ShaderStageFlagBits::eRaygenKHR,
+                // Also traced by the rays picked
+                .stages = picking ? trace_stages | vk::ShaderStageFlagBits::eCompute
+                                  : trace_stages,
                 .value = DescriptorBinding::AccelStructuresValue{{
-                    .accel_structures = {{**tlas}},
+                    .accel_structures = {{**tlases[sub_scene_idx]}},
                 }},
             },
             {
                 .type = vk::DescriptorType::eStorageBuffer,
-                .stages = vk::ShaderStageFlagBits::eClosestHitKHR,
+                .stages = trace_stages,
                 .value = DescriptorBinding::BuffersValue{{
                     .buffers = {{**primitives_buffer}},
                 }},
             },
             {
                 .type = vk::DescriptorType::eStorageBuffer,
-                .stages = vk::ShaderStageFlagBits::eClosestHitKHR,
+                .stages = trace_stages,
                 .value = DescriptorBinding::BuffersValue{{
                     .buffers = {{**materials_buffer}},
                 }},
@@ -373,190 +900,2568 @@ void VulkanPathTracerHW::LoadScene(GLTF::Container& gltf) {
             {
                 .type = vk::DescriptorType::eCombinedImageSampler,
                 .array_size = static_cast<u32>(images.size()),
-                .stages = vk::ShaderStageFlagBits::eClosestHitKHR,
+                .stages = trace_stages,
                 .value = DescriptorBinding::CombinedImageSamplersValue{{
                     .images = images,
                 }},
-            }});
-
-    image_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
-        *device, 2,
-        std::initializer_list<DescriptorBinding>{
+            },
             {
-                .type = vk::DescriptorType::eStorageImage,
-                .stages = vk::ShaderStageFlagBits::eRaygenKHR,
-                .value =
-                    DescriptorBinding::CombinedImageSamplersValue{
-                        {
-                            .images = {{
-                                .image = *pp_frames->frames_in_flight[0].extras.image_view,
-                                .layout = vk::ImageLayout::eGeneral,
-                            }},
-                        },
-                        {
-                            .images = {{
-                                .image = *pp_frames->frames_in_flight[1].extras.image_view,
-                                .layout = vk::ImageLayout::eGeneral,
-                            }},
-                        },
-                    },
+                .type = vk::DescriptorType::eUniformBufferDynamic,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{frame_allocator->GetBuffer()}},
+                    .range = sizeof(GLSL::PathTracerUniformsBlock),
+                }},
             },
-        });
-
-    pipeline = std::make_unique<VulkanRayTracingPipeline>(
-        *device,
-        vk::RayTracingPipelineCreateInfoKHR{
-            .stageCount = 3,
-            .pStages = TempArr<vk::PipelineShaderStageCreateInfo>{{
-                {
-                    .stage = vk::ShaderStageFlagBits::eRaygenKHR,
-                    .module =
-                        *VulkanShader{**device, u8"core/path_tracer_hw/shaders/raytrace.rgen"},
-                    .pName = "main",
-                },
-                {
-                    .stage = vk::ShaderStageFlagBits::eMissKHR,
-                    .module =
-                        *VulkanShader{**device, u8"core/path_tracer_hw/shaders/raytrace.rmiss"},
-                    .pName = "main",
-                },
-                {
-                    .stage = vk::ShaderStageFlagBits::eClosestHitKHR,
-                    .module =
-                        *VulkanShader{**device, u8"core/path_tracer_hw/shaders/raytrace.rchit"},
-                    .pName = "main",
-                },
-            }},
-            .groupCount = 3,
-            .pGroups = TempArr<vk::RayTracingShaderGroupCreateInfoKHR>{{
-                General(0),
-                General(1),
-                TrianglesGroup({
-                    .closestHitShader = 2,
-                    .anyHitShader = VK_SHADER_UNUSED_KHR,
-                    .intersectionShader = VK_SHADER_UNUSED_KHR,
-                }),
-            }},
-        },
-        vk::PipelineLayoutCreateInfo{
-            .setLayoutCount = 3,
-            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
-                *fixed_descriptor_set->descriptor_set_layout,
-                *image_descriptor_sets->descriptor_set_layout,
-                *image_descriptor_sets->descriptor_set_layout,
-            }},
-            .pushConstantRangeCount = 1,
-            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
-                PushConstant<GLSL::PathTracerPushConstantBlock>(
-                    vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eClosestHitKHR |
-                    vk::ShaderStageFlagBits::eMissKHR),
-            }},
-        });
-}
-
-void VulkanPathTracerHW::DrawFrame(const Camera& external_camera, bool force_external_camera) {
-    device->allocator->CleanupStagingBuffers();
-
-    const auto& frame = frames->AcquireNextFrame();
-
-    frames->BeginFrame();
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**pixel_stats_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**pixel_aovs_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**lights_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**light_tree_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eCombinedImageSampler,
+                .stages = trace_stages,
+                .value = DescriptorBinding::CombinedImageSamplersValue{{
+                    .images = {{environment_image}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{environment_map ? **environment_map->cdf_buffer
+                                                 : **environment_cdf_placeholder}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**pixel_accumulation_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**pixel_first_hits_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**pixel_costs_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**material_costs_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**ray_stats_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**light_offsets_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**punctual_lights_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**light_reservoirs_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**guide_samples_buffer}},
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = trace_stages,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**guide_distributions_buffer}},
+                }},
+            }});
+
+    image_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+        *device, offscreen_frames.size(),
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eStorageImage,
+                .stages = trace_stages,
+                .value = DescriptorBinding::CombinedImageSamplersValue{GetOffscreenImages()},
+            },
+        });
+
+    CreatePipeline();
+    if (reprojection) {
+        CreateReprojectResources();
+    }
+    if (denoise) {
+        CreateDenoiseResources();
+    }
+    if (cost_heatmap) {
+        CreateHeatmapResources();
+    }
+    if (path_guiding) {
+        CreateGuideResources();
+    }
+    if (picking) {
+        CreatePickResources();
+    }
+
+    checkpoint_scene_hash.reset();
+    resume_checkpoint.reset();
+    if (!checkpoint_path.empty() && gltf) {
+        checkpoint_scene_hash = GLTFSnapshot{*gltf}.GetHash();
+        resume_checkpoint = ReadRenderCheckpoint(checkpoint_path);
+        last_checkpoint_time = std::chrono::steady_clock::now();
+    }
+}
+
+void VulkanPathTracerHW::GetEmissiveTriangles() {
+    mesh_emissive_triangles.assign(scene->meshes.size(), {});
+    primitive_light_offsets.assign(scene->mesh_first_primitives.back(), ~0u);
+    for (std::size_t mesh_idx = 0; mesh_idx < scene->meshes.size(); ++mesh_idx) {
+        const auto& primitives = scene->meshes[mesh_idx]->primitives;
+        for (std::size_t primitive_idx = 0; primitive_idx < primitives.size(); ++primitive_idx) {
+            const auto& primitive = *primitives[primitive_idx];
+            const std::size_t material = GetMaterialIndex(*scene, primitive);
+            if (primitive.host_positions.empty() ||
+                scene->materials[material]->glsl_material.emissive_factor == glm::vec3{}) {
+                continue;
+            }
+            primitive_light_offsets[scene->mesh_first_primitives[mesh_idx] + primitive_idx] =
+                static_cast<u32>(mesh_emissive_triangles[mesh_idx].size());
+            const auto GetPosition = [&primitive](std::size_t vertex) {
+                return glm::vec3{primitive.host_positions[vertex * 3],
+                                 primitive.host_positions[vertex * 3 + 1],
+                                 primitive.host_positions[vertex * 3 + 2]};
+            };
+            const std::size_t num_triangles = primitive.host_indices.empty()
+                                                  ? primitive.host_positions.size() / 9
+                                                  : primitive.host_indices.size() / 3;
+            for (std::size_t i = 0; i < num_triangles; ++i) {
+                MeshEmissiveTriangle triangle{
+                    .primitive = static_cast<u32>(primitive_idx),
+                    .triangle = static_cast<u32>(i),
+                };
+                for (std::size_t j = 0; j < 3; ++j) {
+                    triangle.positions[j] = GetPosition(primitive.host_indices.empty()
+                                                            ? i * 3 + j
+                                                            : primitive.host_indices[i * 3 + j]);
+                }
+                mesh_emissive_triangles[mesh_idx].emplace_back(triangle);
+            }
+        }
+    }
+}
+
+void VulkanPathTracerHW::CreateLightBuffers(bool refit) {
+    const auto& sub_scene = *scene->sub_scenes[sub_scene_idx];
+    std::vector<GLSL::EmissiveTriangle> lights;
+    std::vector<LightTree::Light> tree_lights;
+    // Every emissive triangle of the instances is a light, even those without power, so that
+    // the hits find theirs by their offsets
+    std::vector<u32> light_offsets = primitive_light_offsets;
+    // The copies of deformed primitives, whose emission is sampled as it is at rest
+    for (const auto& deformer : mesh_deformers) {
+        if (deformer) {
+            for (const auto& primitive : deformer->primitives) {
+                light_offsets.emplace_back(primitive_light_offsets[primitive.source]);
+            }
+        }
+    }
+    const auto* deformer = GetMeshDeformer(sub_scene_idx);
+    double total_power = 0;
+    for (std::size_t i = 0; i < sub_scene.GetNumInstances(); ++i) {
+        const u32 mesh = sub_scene.instance_meshes[i];
+        if (!blases[mesh]) { // Not in the TLAS, like GetTLASInstances
+            continue;
+        }
+        // Of its primitives, or their deformed copies, like GetTLASInstances
+        const u32 deformed = deformer ? deformer->instance_indices[i] : MeshDeformer::NotDeformed;
+        const u32 first_primitive =
+            deformed != MeshDeformer::NotDeformed
+                ? deformer->first_primitive + deformer->instances[deformed].first_primitive
+                : sub_scene.instance_first_primitives[i];
+        const auto& transform = sub_scene.instance_transforms[i];
+        light_offsets.emplace_back(mesh_emissive_triangles[mesh].empty()
+                                       ? ~0u
+                                       : static_cast<u32>(lights.size()));
+        for (const auto& triangle : mesh_emissive_triangles[mesh]) {
+            const auto& primitive = *scene->meshes[mesh]->primitives[triangle.primitive];
+            const std::size_t material = GetMaterialIndex(*scene, primitive);
+            std::array<glm::vec3, 3> positions;
+            for (std::size_t j = 0; j < 3; ++j) {
+                positions[j] = glm::vec3{transform * glm::vec4{triangle.positions[j], 1.0f}};
+            }
+            const float area =
+                glm::length(glm::cross(positions[1] - positions[0], positions[2] - positions[0])) /
+                2;
+            // Textured emission is taken as its factor, the samples are weighted by the
+            // texture where they land
+            const float power =
+                Luminance(scene->materials[material]->glsl_material.emissive_factor) * area;
+            lights.push_back({
+                .position0 = positions[0],
+                .primitive = first_primitive + triangle.primitive,
+                .position1 = positions[1],
+                .triangle = triangle.triangle,
+                .position2 = positions[2],
+                .material = static_cast<u32>(material),
+                .area = area,
+            });
+            tree_lights.push_back({
+                .positions = positions,
+                .power = std::max(power, 0.0f),
+            });
+            total_power += tree_lights.back().power;
+        }
+    }
+
+    if (refit && light_tree && light_tree->GetNumLights() == tree_lights.size()) {
+        light_tree->Refit(tree_lights);
+    } else {
+        light_tree = std::make_unique<LightTree>(tree_lights);
+    }
+    for (std::size_t i = 0; i < lights.size(); ++i) {
+        lights[i].leaf = light_tree->light_leaves[i];
+    }
+    num_lights = total_power > 0 ? static_cast<u32>(lights.size()) : 0;
+    reuse_reservoirs = false; // Their samples are of the previous lights
+    num_punctual_lights = static_cast<u32>(sub_scene.lights.size());
+    SPDLOG_INFO("{} emissive triangles and {} punctual lights sampled as lights", num_lights,
+                num_punctual_lights);
+
+    // Cannot create empty buffers
+    const auto CreateBuffer = [this]<typename T>(const std::vector<T>& data) {
+        const T placeholder{};
+        return std::make_unique<VulkanImmUploadBuffer>(
+            *device,
+            VulkanBufferCreateInfo{
+                .size = std::max<std::size_t>(data.size(), 1) * sizeof(T),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+                .dst_stage_mask = GetTracePipelineStages(),
+                .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+            },
+            reinterpret_cast<const u8*>(data.empty() ? &placeholder : data.data()));
+    };
+    lights_buffer = CreateBuffer(lights);
+    light_tree_buffer = CreateBuffer(light_tree->nodes);
+    light_offsets_buffer = CreateBuffer(light_offsets);
+    punctual_lights_buffer = CreateBuffer(sub_scene.lights);
+}
+
+void VulkanPathTracerHW::UpdateLightDescriptors() {
+    fixed_descriptor_set->UpdateDescriptor(7, DescriptorBinding::BuffersValue{{
+                                                  .buffers = {{**lights_buffer}},
+                                              }});
+    fixed_descriptor_set->UpdateDescriptor(8, DescriptorBinding::BuffersValue{{
+                                                  .buffers = {{**light_tree_buffer}},
+                                              }});
+    fixed_descriptor_set->UpdateDescriptor(16, DescriptorBinding::BuffersValue{{
+                                                   .buffers = {{**light_offsets_buffer}},
+                                               }});
+    fixed_descriptor_set->UpdateDescriptor(17, DescriptorBinding::BuffersValue{{
+                                                   .buffers = {{**punctual_lights_buffer}},
+                                               }});
+}
+
+void VulkanPathTracerHW::CreatePixelBuffers() {
+    const std::size_t num_pixels = render_target_extent.width * render_target_extent.height;
+    // The history is copied within the buffers, and checkpoints out of and into them
+    const auto CreateBuffer = [this](std::size_t size, bool copied = false) {
+        return std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage = copied ? vk::BufferUsageFlagBits::eStorageBuffer |
+                                      vk::BufferUsageFlagBits::eTransferSrc |
+                                      vk::BufferUsageFlagBits::eTransferDst
+                                : vk::BufferUsageFlagBits::eStorageBuffer,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+    };
+    const bool checkpoints = !checkpoint_path.empty();
+    pixel_stats_buffer = CreateBuffer(
+        (adaptive_threshold > 0 ? num_pixels : 1) * sizeof(GLSL::PixelStats), checkpoints);
+    pixel_aovs_buffer = CreateBuffer((denoise ? num_pixels : 1) * sizeof(GLSL::PixelAOV));
+    pixel_accumulation_buffer = CreateBuffer(
+        (reprojection ? num_pixels * 2 : num_pixels) * sizeof(GLSL::PixelAccumulation),
+        reprojection || checkpoints);
+    pixel_first_hits_buffer =
+        CreateBuffer((reprojection ? num_pixels * 2 : 1) * sizeof(glm::vec4), reprojection);
+    light_reservoirs_buffer = CreateBuffer(
+        (restir_candidates > 0 ? num_pixels * 2 : 1) * sizeof(GLSL::LightReservoir));
+    reuse_reservoirs = false;
+    // Cleared before each frame
+    pixel_costs_buffer = CreateBuffer((cost_heatmap ? num_pixels + 1 : 2) * sizeof(u32), true);
+}
+
+void VulkanPathTracerHW::CreateCounterBuffers() {
+    const std::size_t num_materials = cost_heatmap ? scene->materials.size() : 1;
+    const auto CreateBuffer = [this](std::size_t size, bool readback) {
+        return std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage = readback ? vk::BufferUsageFlagBits::eTransferDst
+                                  : vk::BufferUsageFlagBits::eStorageBuffer |
+                                        vk::BufferUsageFlagBits::eTransferSrc |
+                                        vk::BufferUsageFlagBits::eTransferDst,
+            },
+            VmaAllocationCreateInfo{
+                .flags = readback ? VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                                        VMA_ALLOCATION_CREATE_MAPPED_BIT
+                                  : 0,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+    };
+    material_costs_buffer = CreateBuffer(num_materials * sizeof(GLSL::MaterialCost), false);
+    ray_stats_buffer = CreateBuffer(sizeof(GLSL::RayStats), false);
+
+    material_costs.clear();
+    if (cost_heatmap) {
+        for (const auto& material : scene->materials) {
+            material_costs.push_back({.name = material->name});
+        }
+    }
+    last_ray_stats.reset();
+    total_ray_stats.reset();
+    for (auto& frame : frames->frames_in_flight) {
+        if (cost_heatmap) {
+            frame.extras.material_costs =
+                CreateBuffer(num_materials * sizeof(GLSL::MaterialCost), true);
+        }
+        if (ray_stats) {
+            frame.extras.ray_stats = CreateBuffer(sizeof(GLSL::RayStats), true);
+        }
+        frame.extras.material_costs_pending = frame.extras.ray_stats_pending = false;
+    }
+}
+
+void VulkanPathTracerHW::ReadCounters(std::size_t frame_idx) {
+    auto& frame = frames->frames_in_flight[frame_idx].extras;
+    if (frame.material_costs_pending) {
+        frame.material_costs_pending = false;
+        vmaInvalidateAllocation(frame.material_costs->allocator,
+                                frame.material_costs->allocation, 0, VK_WHOLE_SIZE);
+        const auto* costs = static_cast<const GLSL::MaterialCost*>(
+            frame.material_costs->allocation_info.pMappedData);
+        for (std::size_t i = 0; i < material_costs.size(); ++i) {
+            material_costs[i].cycles += costs[i].cycles_low | (u64{costs[i].cycles_high} << 32);
+            material_costs[i].num_hits += costs[i].num_hits;
+        }
+    }
+
+    if (frame.ray_stats_pending) {
+        frame.ray_stats_pending = false;
+        vmaInvalidateAllocation(frame.ray_stats->allocator, frame.ray_stats->allocation, 0,
+                                VK_WHOLE_SIZE);
+        const auto& stats =
+            *static_cast<const GLSL::RayStats*>(frame.ray_stats->allocation_info.pMappedData);
+        const auto GetCount = [](const glm::uvec2& counter) {
+            return counter.x | (u64{counter.y} << 32);
+        };
+        const auto time = GetFrameTime(frame_idx);
+        last_ray_stats = RayStats{
+            .camera_rays = GetCount(stats.camera_rays),
+            .bounce_rays = GetCount(stats.bounce_rays),
+            .shadow_rays = GetCount(stats.shadow_rays),
+            .paths = GetCount(stats.paths),
+            .roulette_terminations = GetCount(stats.roulette_terminations),
+            .nan_samples = GetCount(stats.nan_samples),
+            .milliseconds = time ? time->milliseconds : 0.0,
+        };
+        if (!total_ray_stats) {
+            total_ray_stats.emplace();
+        }
+        *total_ray_stats += *last_ray_stats;
+        if (converge_adaptively && adaptive_threshold > 0 && frame.num_samples > 0 &&
+            last_ray_stats->paths == 0 && frame.accumulation_id == accumulation_id) {
+            converged_accumulation = accumulation_id;
+        }
+    }
+}
+
+void VulkanPathTracerHW::ClearCounters(const vk::raii::CommandBuffer& cmd) {
+    if (!cost_heatmap && !ray_stats) {
+        return;
+    }
+    const auto MemoryBarrier = [&cmd](vk::PipelineStageFlags2 src_stage_mask,
+                                      vk::AccessFlags2 src_access_mask,
+                                      vk::PipelineStageFlags2 dst_stage_mask,
+                                      vk::AccessFlags2 dst_access_mask) {
+        cmd.pipelineBarrier2({
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+                .srcStageMask = src_stage_mask,
+                .srcAccessMask = src_access_mask,
+                .dstStageMask = dst_stage_mask,
+                .dstAccessMask = dst_access_mask,
+            }}},
+        });
+    };
+    // After the previous frame has traced, copied out its counters and drawn its heatmap
+    MemoryBarrier(GetTracePipelineStages() | vk::PipelineStageFlagBits2::eComputeShader |
+                      vk::PipelineStageFlagBits2::eCopy,
+                  vk::AccessFlagBits2::eShaderStorageRead |
+                      vk::AccessFlagBits2::eShaderStorageWrite |
+                      vk::AccessFlagBits2::eTransferRead,
+                  vk::PipelineStageFlagBits2::eClear, vk::AccessFlagBits2::eTransferWrite);
+    if (cost_heatmap) {
+        cmd.fillBuffer(**material_costs_buffer, 0, VK_WHOLE_SIZE, 0);
+        cmd.fillBuffer(**pixel_costs_buffer, 0, sizeof(u32), 0); // The maximum
+    }
+    if (ray_stats) {
+        cmd.fillBuffer(**ray_stats_buffer, 0, VK_WHOLE_SIZE, 0);
+    }
+    MemoryBarrier(vk::PipelineStageFlagBits2::eClear, vk::AccessFlagBits2::eTransferWrite,
+                  GetTracePipelineStages(),
+                  vk::AccessFlagBits2::eShaderStorageRead |
+                      vk::AccessFlagBits2::eShaderStorageWrite);
+}
+
+void VulkanPathTracerHW::CopyCounters(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx) {
+    if (!cost_heatmap && !ray_stats) {
+        return;
+    }
+    auto& frame = frames->frames_in_flight[frame_idx].extras;
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = GetTracePipelineStages(),
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+        }}},
+    });
+    // Made visible to the host by the wait for the frame in flight
+    if (cost_heatmap) {
+        cmd.copyBuffer(**material_costs_buffer, **frame.material_costs,
+                       {{.size = frame.material_costs->size}});
+        frame.material_costs_pending = true;
+    }
+    if (ray_stats) {
+        cmd.copyBuffer(**ray_stats_buffer, **frame.ray_stats, {{.size = sizeof(GLSL::RayStats)}});
+        frame.ray_stats_pending = true;
+    }
+}
+
+void VulkanPathTracerHW::CreatePickResources() {
+    pick_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+        *device, frames->frames_in_flight.size(),
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            }});
+    // Over the set of the TLAS, which the descriptor sets of LoadScene replace
+    pick_pipeline = std::make_unique<VulkanComputePipeline>(
+        *device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{*device, u8"core/path_tracer_hw/shaders/pick.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 2,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *fixed_descriptor_set->descriptor_set_layout,
+                *pick_descriptor_sets->descriptor_set_layout,
+            }},
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::PickPushConstant>(vk::ShaderStageFlagBits::eCompute),
+            }},
+        });
+
+    // Written and read by the host directly
+    const auto CreateBuffer = [this](std::size_t size, VmaAllocationCreateFlags host_access) {
+        return std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            },
+            VmaAllocationCreateInfo{
+                .flags = host_access | VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+    };
+    std::vector<DescriptorBinding::Buffers> ray_buffers, hit_buffers;
+    for (auto& frame : frames->frames_in_flight) {
+        frame.extras.pick_rays =
+            CreateBuffer(MaxPicksPerFrame * sizeof(GLSL::PickRay),
+                         VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+        frame.extras.pick_hits = CreateBuffer(MaxPicksPerFrame * sizeof(GLSL::PickHit),
+                                              VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+        ray_buffers.push_back({.buffers = {{**frame.extras.pick_rays}}});
+        hit_buffers.push_back({.buffers = {{**frame.extras.pick_hits}}});
+    }
+    pick_descriptor_sets->UpdateDescriptor(0, DescriptorBinding::BuffersValue{ray_buffers});
+    pick_descriptor_sets->UpdateDescriptor(1, DescriptorBinding::BuffersValue{hit_buffers});
+}
+
+void VulkanPathTracerHW::RecordPicks(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                                     u32 uniforms_offset) {
+    auto& frame = frames->frames_in_flight[frame_idx].extras;
+    std::size_t num_batches = 0;
+    std::size_t num_rays = 0;
+    while (num_batches < pending_picks.size() &&
+           num_rays + pending_picks[num_batches].rays.size() <= MaxPicksPerFrame) {
+        num_rays += pending_picks[num_batches++].rays.size();
+    }
+    if (num_batches == 0) {
+        return;
+    }
+    frame.picks.assign(std::make_move_iterator(pending_picks.begin()),
+                       std::make_move_iterator(pending_picks.begin() + num_batches));
+    pending_picks.erase(pending_picks.begin(), pending_picks.begin() + num_batches);
+    // Without a TLAS, ReadPicks reports misses
+    frame.picks_traced = tlases[sub_scene_idx] != nullptr;
+    if (!frame.picks_traced) {
+        return;
+    }
+
+    auto* rays = static_cast<GLSL::PickRay*>(frame.pick_rays->allocation_info.pMappedData);
+    for (const auto& batch : frame.picks) {
+        for (const auto& ray : batch.rays) {
+            *rays++ = {
+                .origin = ray.origin,
+                .max_distance = ray.max_distance,
+                .direction = ray.direction,
+            };
+        }
+    }
+    vmaFlushAllocation(frame.pick_rays->allocator, frame.pick_rays->allocation, 0, VK_WHOLE_SIZE);
+    // Like GetTLASInstances, whose instances are in the same order
+    frame.pick_instances.clear();
+    if (!gpu_instances) {
+        const auto& sub_scene = GetSubScene();
+        for (std::size_t i = 0; i < sub_scene.GetNumInstances(); ++i) {
+            if (blases.at(sub_scene.instance_meshes[i])) {
+                frame.pick_instances.push_back(static_cast<u32>(i));
+            }
+        }
+    }
+
+    const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame_idx, "Pick"};
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **pick_pipeline);
+    VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                               *pick_pipeline->pipeline_layout, 0,
+                               {{*fixed_descriptor_set, 0}, {*pick_descriptor_sets, frame_idx}},
+                               {uniforms_offset});
+    cmd.pushConstants<GLSL::PickPushConstant>(*pick_pipeline->pipeline_layout,
+                                              vk::ShaderStageFlagBits::eCompute, 0,
+                                              {{
+                                                  .num_rays = static_cast<u32>(num_rays),
+                                              }});
+    cmd.dispatch(static_cast<u32>((num_rays + 63) / 64), 1, 1);
+    // Made visible to the host by the wait for the frame in flight
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eHost,
+            .dstAccessMask = vk::AccessFlagBits2::eHostRead,
+        }}},
+    });
+}
+
+void VulkanPathTracerHW::ReadPicks(std::size_t frame_idx) {
+    auto& frame = frames->frames_in_flight[frame_idx].extras;
+    if (frame.picks.empty()) {
+        return;
+    }
+    const bool traced = frame.picks_traced;
+    if (traced) {
+        vmaInvalidateAllocation(frame.pick_hits->allocator, frame.pick_hits->allocation, 0,
+                                VK_WHOLE_SIZE);
+    }
+    const auto* hits =
+        static_cast<const GLSL::PickHit*>(frame.pick_hits->allocation_info.pMappedData);
+    const auto GetHit = [this, &frame](const GLSL::PickHit& hit) -> std::optional<PickHit> {
+        if (hit.instance == ~0u) {
+            return std::nullopt;
+        }
+        // The first primitive of the mesh of the instance is its custom index
+        const auto& first_primitives = scene->mesh_first_primitives;
+        const auto mesh =
+            static_cast<u32>(std::ranges::upper_bound(first_primitives, hit.primitive) -
+                             first_primitives.begin() - 1);
+        return PickHit{
+            .instance =
+                frame.pick_instances.empty() ? ~0u : frame.pick_instances.at(hit.instance),
+            .mesh = mesh,
+            .primitive = hit.primitive - first_primitives[mesh],
+            .triangle = hit.triangle,
+            .barycentrics = hit.barycentrics,
+            .distance = hit.distance,
+        };
+    };
+    std::vector<std::optional<PickHit>> results;
+    for (auto& batch : frame.picks) {
+        results.clear();
+        for (std::size_t i = 0; i < batch.rays.size(); ++i) {
+            results.push_back(traced ? GetHit(*hits++) : std::nullopt);
+        }
+        batch.callback(results);
+    }
+    frame.picks.clear();
+}
+
+void VulkanPathTracerHW::Pick(std::vector<PickRay> rays, PickCallback callback) {
+    if (rays.size() > MaxPicksPerFrame) {
+        throw std::runtime_error(
+            fmt::format("Picked {} rays at once, more than {}", rays.size(), MaxPicksPerFrame));
+    }
+    if (!picking) {
+        SPDLOG_WARN("Picking is not enabled, the rays hit nothing");
+        std::vector<std::optional<PickHit>> misses(rays.size());
+        callback(misses);
+        return;
+    }
+    pending_picks.push_back({
+        .rays = std::move(rays),
+        .callback = std::move(callback),
+    });
+}
+
+void VulkanPathTracerHW::CreateHeatmapResources() {
+    if (!heatmap_descriptor_sets) {
+        heatmap_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+            *device, offscreen_frames.size(),
+            std::initializer_list<DescriptorBinding>{
+                {
+                    .type = vk::DescriptorType::eStorageImage,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
+                },
+                {
+                    .type = vk::DescriptorType::eStorageBuffer,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
+                }});
+        heatmap_pipeline = std::make_unique<VulkanComputePipeline>(
+            *device,
+            vk::PipelineShaderStageCreateInfo{
+                .stage = vk::ShaderStageFlagBits::eCompute,
+                .module = *VulkanShader{*device, u8"core/path_tracer_hw/shaders/heatmap.comp"},
+                .pName = "main",
+            },
+            vk::PipelineLayoutCreateInfo{
+                .setLayoutCount = 1,
+                .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                    *heatmap_descriptor_sets->descriptor_set_layout,
+                }},
+                .pushConstantRangeCount = 1,
+                .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                    PushConstant<GLSL::HeatmapPushConstant>(vk::ShaderStageFlagBits::eCompute),
+                }},
+            });
+    }
+
+    // Whichever image is presented
+    std::vector<DescriptorBinding::CombinedImageSamplers> images;
+    std::vector<DescriptorBinding::Buffers> costs_buffers;
+    for (std::size_t frame = 0; frame < offscreen_frames.size(); ++frame) {
+        images.push_back({.images = {{
+                              .image = denoise
+                                           ? *denoise_images[2 + frame].image_view
+                                           : *offscreen_frames[frame].image_view,
+                              .layout = vk::ImageLayout::eGeneral,
+                          }}});
+        costs_buffers.push_back({.buffers = {{**pixel_costs_buffer}}});
+    }
+    heatmap_descriptor_sets->UpdateDescriptor(
+        0, DescriptorBinding::CombinedImageSamplersValue{images});
+    heatmap_descriptor_sets->UpdateDescriptor(1, DescriptorBinding::BuffersValue{costs_buffers});
+}
+
+void VulkanPathTracerHW::DrawHeatmap(VulkanRenderGraph& graph, const TracedResources& traced,
+                                     VulkanRenderGraph::Resource image, std::size_t frame_idx,
+                                     const vk::Extent2D& render_extent) {
+    graph.AddPass(
+        "Heatmap",
+        {
+            {image, StorageAccess(vk::AccessFlagBits2::eShaderStorageRead |
+                                  vk::AccessFlagBits2::eShaderStorageWrite)},
+            {traced.costs, StorageAccess(vk::AccessFlagBits2::eShaderStorageRead)},
+        },
+        [this, frame_idx, render_extent](const vk::raii::CommandBuffer& cmd) {
+            cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **heatmap_pipeline);
+            VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                       *heatmap_pipeline->pipeline_layout, 0,
+                                       {{*heatmap_descriptor_sets, frame_idx}});
+            cmd.pushConstants<GLSL::HeatmapPushConstant>(
+                *heatmap_pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+                {{
+                    .render_extent = {render_extent.width, render_extent.height},
+                }});
+            cmd.dispatch((render_extent.width + 7) / 8, (render_extent.height + 7) / 8, 1);
+        });
+}
+
+void VulkanPathTracerHW::CreateGuideBuffers() {
+    const auto CreateBuffer = [this](std::size_t size) {
+        return std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eTransferDst, // Cleared by ClearGuide
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+    };
+    const std::size_t num_cells = path_guiding ? GuideCells : 1;
+    guide_samples_buffer = CreateBuffer(num_cells * GUIDE_CELL_SAMPLES * sizeof(glm::uvec2));
+    guide_distributions_buffer = CreateBuffer(num_cells * GUIDE_CELL_FLOATS * sizeof(float));
+    ResetGuiding();
+}
+
+void VulkanPathTracerHW::CreateGuideResources() {
+    if (!guide_descriptor_sets) {
+        guide_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+            *device, 1,
+            std::initializer_list<DescriptorBinding>{
+                {
+                    .type = vk::DescriptorType::eStorageBuffer,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
+                },
+                {
+                    .type = vk::DescriptorType::eStorageBuffer,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
+                }});
+        guide_pipeline = std::make_unique<VulkanComputePipeline>(
+            *device,
+            vk::PipelineShaderStageCreateInfo{
+                .stage = vk::ShaderStageFlagBits::eCompute,
+                .module = *VulkanShader{*device, u8"core/path_tracer_hw/shaders/guide.comp"},
+                .pName = "main",
+            },
+            vk::PipelineLayoutCreateInfo{
+                .setLayoutCount = 1,
+                .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                    *guide_descriptor_sets->descriptor_set_layout,
+                }},
+                .pushConstantRangeCount = 1,
+                .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                    PushConstant<GLSL::GuidePushConstant>(vk::ShaderStageFlagBits::eCompute),
+                }},
+            });
+    }
+    guide_descriptor_sets->UpdateDescriptor(0, DescriptorBinding::BuffersValue{{
+                                                   .buffers = {{**guide_samples_buffer}},
+                                               }});
+    guide_descriptor_sets->UpdateDescriptor(1, DescriptorBinding::BuffersValue{{
+                                                   .buffers = {{**guide_distributions_buffer}},
+                                               }});
+}
+
+void VulkanPathTracerHW::ResetGuiding() {
+    // Of the instances with bounds
+    glm::vec3 min_point{std::numeric_limits<float>::max()};
+    glm::vec3 max_point{std::numeric_limits<float>::lowest()};
+    for (const auto& bounds : GetSubScene().instance_bounds) {
+        if (!glm::any(glm::isinf(bounds.min_point)) && !glm::any(glm::isinf(bounds.max_point))) {
+            min_point = glm::min(min_point, bounds.min_point);
+            max_point = glm::max(max_point, bounds.max_point);
+        }
+    }
+    const glm::vec3 size = max_point - min_point;
+    const float longest_side = std::max({size.x, size.y, size.z});
+    sub_scene_size = longest_side > 0 ? longest_side : 1.0f;
+    if (!path_guiding) {
+        return;
+    }
+    guide_cell_size = sub_scene_size / GuideGridResolution;
+    guide_reset = true;
+}
+
+void VulkanPathTracerHW::ClearGuide(const vk::raii::CommandBuffer& cmd) {
+    guide_reset = false;
+    // After the previous frame has traced and learned
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = GetTracePipelineStages() | vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask =
+                vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eClear,
+            .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+        }}},
+    });
+    cmd.fillBuffer(**guide_samples_buffer, 0, VK_WHOLE_SIZE, 0);
+    cmd.fillBuffer(**guide_distributions_buffer, 0, VK_WHOLE_SIZE, 0);
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eClear,
+            .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+            .dstStageMask = GetTracePipelineStages(),
+            .dstAccessMask =
+                vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite,
+        }}},
+    });
+}
+
+void VulkanPathTracerHW::LearnGuide(VulkanRenderGraph& graph, const TracedResources& traced) {
+    static constexpr auto ReadWrite =
+        vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite;
+    graph.AddPass("Guide", {{traced.guide, StorageAccess(ReadWrite)}},
+                  [this](const vk::raii::CommandBuffer& cmd) {
+                      cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **guide_pipeline);
+                      VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                                 *guide_pipeline->pipeline_layout, 0,
+                                                 {{*guide_descriptor_sets, 0}});
+                      cmd.pushConstants<GLSL::GuidePushConstant>(
+                          *guide_pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+                          {{
+                              .num_cells = GuideCells,
+                          }});
+                      cmd.dispatch(GuideCells / 64, 1, 1);
+                  });
+    // The next frame samples the distributions and records into the grid
+    graph.Export(traced.guide, {
+                                   .stages = GetTracePipelineStages(),
+                                   .access = ReadWrite,
+                               });
+}
+
+void VulkanPathTracerHW::CreateReprojectResources() {
+    if (!reproject_descriptor_sets) {
+        reproject_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+            *device, offscreen_frames.size(),
+            std::initializer_list<DescriptorBinding>{
+                {
+                    .type = vk::DescriptorType::eStorageImage,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
+                },
+                {
+                    .type = vk::DescriptorType::eStorageBuffer,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
+                },
+                {
+                    .type = vk::DescriptorType::eStorageBuffer,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
+                }});
+        reproject_pipeline = std::make_unique<VulkanComputePipeline>(
+            *device,
+            vk::PipelineShaderStageCreateInfo{
+                .stage = vk::ShaderStageFlagBits::eCompute,
+                .module =
+                    *VulkanShader{*device, u8"core/path_tracer_hw/shaders/reproject.comp"},
+                .pName = "main",
+            },
+            vk::PipelineLayoutCreateInfo{
+                .setLayoutCount = 1,
+                .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                    *reproject_descriptor_sets->descriptor_set_layout,
+                }},
+                .pushConstantRangeCount = 1,
+                .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                    PushConstant<GLSL::ReprojectPushConstant>(vk::ShaderStageFlagBits::eCompute),
+                }},
+            });
+    }
+
+    std::vector<DescriptorBinding::CombinedImageSamplers> images;
+    std::vector<DescriptorBinding::Buffers> accumulation_buffers, first_hits_buffers;
+    for (const auto& frame : offscreen_frames) {
+        images.push_back({.images = {{
+                              .image = *frame.image_view,
+                              .layout = vk::ImageLayout::eGeneral,
+                          }}});
+        accumulation_buffers.push_back({.buffers = {{**pixel_accumulation_buffer}}});
+        first_hits_buffers.push_back({.buffers = {{**pixel_first_hits_buffer}}});
+    }
+    reproject_descriptor_sets->UpdateDescriptor(
+        0, DescriptorBinding::CombinedImageSamplersValue{images});
+    reproject_descriptor_sets->UpdateDescriptor(
+        1, DescriptorBinding::BuffersValue{accumulation_buffers});
+    reproject_descriptor_sets->UpdateDescriptor(
+        2, DescriptorBinding::BuffersValue{first_hits_buffers});
+}
+
+void VulkanPathTracerHW::CopyHistory(const vk::raii::CommandBuffer& cmd,
+                                     const vk::Extent2D& render_extent) {
+    const vk::DeviceSize num_pixels = render_target_extent.width * render_target_extent.height;
+    const vk::DeviceSize num_rendered = render_extent.width * render_extent.height;
+    // After the previous frames' tracing and reprojection
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask =
+                GetTracePipelineStages() | vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .dstAccessMask =
+                vk::AccessFlagBits2::eTransferRead | vk::AccessFlagBits2::eTransferWrite,
+        }}},
+    });
+    cmd.copyBuffer(**pixel_accumulation_buffer, **pixel_accumulation_buffer,
+                   {{
+                       .srcOffset = 0,
+                       .dstOffset = num_pixels * sizeof(GLSL::PixelAccumulation),
+                       .size = num_rendered * sizeof(GLSL::PixelAccumulation),
+                   }});
+    cmd.copyBuffer(**pixel_first_hits_buffer, **pixel_first_hits_buffer,
+                   {{
+                       .srcOffset = 0,
+                       .dstOffset = num_pixels * sizeof(glm::vec4),
+                       .size = num_rendered * sizeof(glm::vec4),
+                   }});
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .srcAccessMask =
+                vk::AccessFlagBits2::eTransferRead | vk::AccessFlagBits2::eTransferWrite,
+            .dstStageMask =
+                GetTracePipelineStages() | vk::PipelineStageFlagBits2::eComputeShader,
+            .dstAccessMask =
+                vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite,
+        }}},
+    });
+}
+
+void VulkanPathTracerHW::Reproject(VulkanRenderGraph& graph, const TracedResources& traced,
+                                   std::size_t frame_idx, const vk::Extent2D& render_extent,
+                                   const glm::mat4& prev_view_proj,
+                                   const glm::vec3& prev_camera_position) {
+    static constexpr auto Read = vk::AccessFlagBits2::eShaderStorageRead;
+    static constexpr auto Write = vk::AccessFlagBits2::eShaderStorageWrite;
+    // The first pass adds the history to the accumulation, reading the neighbourhoods in the
+    // image, and the second resolves it into the image
+    const std::array<VulkanRenderGraph::ResourceAccess, 3> accumulate_accesses{{
+        {traced.image, StorageAccess(Read)},
+        {traced.accumulation, StorageAccess(Read | Write)},
+        {traced.first_hits, StorageAccess(Read)},
+    }};
+    const std::array<VulkanRenderGraph::ResourceAccess, 2> resolve_accesses{{
+        {traced.image, StorageAccess(Write)},
+        {traced.accumulation, StorageAccess(Read)},
+    }};
+    for (u32 pass = 0; pass < 2; ++pass) {
+        graph.AddPass(
+            "Reproject",
+            pass == 0 ? std::span<const VulkanRenderGraph::ResourceAccess>{accumulate_accesses}
+                      : std::span<const VulkanRenderGraph::ResourceAccess>{resolve_accesses},
+            [this, frame_idx, render_extent, prev_view_proj, prev_camera_position,
+             pass](const vk::raii::CommandBuffer& cmd) {
+                cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **reproject_pipeline);
+                VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                           *reproject_pipeline->pipeline_layout, 0,
+                                           {{*reproject_descriptor_sets, frame_idx}});
+                cmd.pushConstants<GLSL::ReprojectPushConstant>(
+                    *reproject_pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+                    {{
+                        .prev_view_proj = prev_view_proj,
+                        .prev_camera_position = prev_camera_position,
+                        .resolve = pass,
+                        .render_extent = {render_extent.width, render_extent.height},
+                        .history_offset = render_target_extent.width * render_target_extent.height,
+                    }});
+                cmd.dispatch((render_extent.width + 7) / 8, (render_extent.height + 7) / 8, 1);
+            });
+    }
+    // The next frame adds to the accumulation
+    graph.Export(traced.accumulation, {
+                                          .stages = GetTracePipelineStages(),
+                                          .access = Read | Write,
+                                      });
+}
+
+void VulkanPathTracerHW::CreateDenoiseResources() {
+    {
+        Helpers::OneTimeCommandContext cmd_context{*device};
+        denoise_images = std::vector<DenoiseImage>(2 + offscreen_frames.size());
+        for (auto& denoise_image : denoise_images) {
+            denoise_image.image = std::make_unique<VulkanImage>(
+                *device->allocator,
+                vk::ImageCreateInfo{
+                    .imageType = vk::ImageType::e2D,
+                    .format = vk::Format::eR16G16B16A16Sfloat,
+                    .extent =
+                        {
+                            .width = render_target_extent.width,
+                            .height = render_target_extent.height,
+                            .depth = 1,
+                        },
+                    .mipLevels = 1,
+                    .arrayLayers = 1,
+                    .usage = vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eSampled,
+                    .initialLayout = vk::ImageLayout::eUndefined,
+                },
+                VmaAllocationCreateInfo{
+                    .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+                    .usage = VMA_MEMORY_USAGE_AUTO,
+                    .priority = 1.0f,
+                },
+                MemoryCategory::RenderTargets,
+                fixed_rate_denoise ? vk::ImageCompressionFlagBitsEXT::eFixedRateDefault
+                                   : vk::ImageCompressionFlagsEXT{});
+            Helpers::ImageLayoutTransition(
+                *cmd_context, denoise_image.image,
+                {
+                    .srcStageMask = vk::PipelineStageFlagBits2::eTopOfPipe,
+                    .srcAccessMask = vk::AccessFlags2{},
+                    .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                    .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+                    .oldLayout = vk::ImageLayout::eUndefined,
+                    .newLayout = vk::ImageLayout::eGeneral,
+                    .subresourceRange =
+                        {
+                            .baseMipLevel = 0,
+                            .levelCount = 1,
+                        },
+                });
+            denoise_image.image_view =
+                vk::raii::ImageView{**device,
+                                    {
+                                        .image = **denoise_image.image,
+                                        .viewType = vk::ImageViewType::e2D,
+                                        .format = vk::Format::eR16G16B16A16Sfloat,
+                                        .subresourceRange =
+                                            {
+                                                .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                                .baseMipLevel = 0,
+                                                .levelCount = 1,
+                                                .baseArrayLayer = 0,
+                                                .layerCount = 1,
+                                            },
+                                    }};
+        }
+        denoise_images[0].image->LogCompression("Denoise image");
+    }
+
+    if (!denoise_descriptor_sets) {
+        const DescriptorBinding StorageImage{
+            .type = vk::DescriptorType::eStorageImage,
+            .stages = vk::ShaderStageFlagBits::eCompute,
+        };
+        denoise_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+            *device, offscreen_frames.size() * DenoisePasses,
+            std::initializer_list<DescriptorBinding>{StorageImage, StorageImage, StorageImage,
+                                                     {
+                                                         .type =
+                                                             vk::DescriptorType::eStorageBuffer,
+                                                         .stages =
+                                                             vk::ShaderStageFlagBits::eCompute,
+                                                     }});
+        denoise_pipeline = std::make_unique<VulkanComputePipeline>(
+            *device,
+            vk::PipelineShaderStageCreateInfo{
+                .stage = vk::ShaderStageFlagBits::eCompute,
+                .module = *VulkanShader{*device, u8"core/path_tracer_hw/shaders/denoise.comp"},
+                .pName = "main",
+            },
+            vk::PipelineLayoutCreateInfo{
+                .setLayoutCount = 1,
+                .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                    *denoise_descriptor_sets->descriptor_set_layout,
+                }},
+                .pushConstantRangeCount = 1,
+                .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                    PushConstant<GLSL::DenoisePushConstant>(vk::ShaderStageFlagBits::eCompute),
+                }},
+            });
+    }
+
+    // The passes alternate between the first two images, and the last writes the frame's
+    std::vector<DescriptorBinding::CombinedImageSamplers> accumulated_images, src_images,
+        dst_images;
+    for (std::size_t frame = 0; frame < offscreen_frames.size(); ++frame) {
+        const auto GetOutput = [this, frame](u32 pass) {
+            return pass + 1 == DenoisePasses ? *denoise_images[2 + frame].image_view
+                                             : *denoise_images[pass % 2].image_view;
+        };
+        for (u32 pass = 0; pass < DenoisePasses; ++pass) {
+            accumulated_images.push_back({.images = {{
+                                              .image = *offscreen_frames[frame].image_view,
+                                              .layout = vk::ImageLayout::eGeneral,
+                                          }}});
+            // Unused by the first pass
+            src_images.push_back({.images = {{
+                                      .image = pass == 0 ? *denoise_images[1].image_view
+                                                         : GetOutput(pass - 1),
+                                      .layout = vk::ImageLayout::eGeneral,
+                                  }}});
+            dst_images.push_back({.images = {{
+                                      .image = GetOutput(pass),
+                                      .layout = vk::ImageLayout::eGeneral,
+                                  }}});
+        }
+    }
+    denoise_descriptor_sets->UpdateDescriptor(
+        0, DescriptorBinding::CombinedImageSamplersValue{accumulated_images});
+    denoise_descriptor_sets->UpdateDescriptor(
+        1, DescriptorBinding::CombinedImageSamplersValue{src_images});
+    denoise_descriptor_sets->UpdateDescriptor(
+        2, DescriptorBinding::CombinedImageSamplersValue{dst_images});
+    denoise_descriptor_sets->UpdateDescriptor(3, DescriptorBinding::BuffersValue{{
+                                                     .buffers = {{**pixel_aovs_buffer}},
+                                                 }});
+
+    // Presents the outputs instead of the accumulated images
+    std::vector<DescriptorBinding::CombinedImageSamplers> output_images;
+    for (std::size_t frame = 0; frame < offscreen_frames.size(); ++frame) {
+        output_images.push_back({.images = {{
+                                     .image = *denoise_images[2 + frame].image_view,
+                                     .layout = vk::ImageLayout::eGeneral,
+                                 }}});
+    }
+    pp_descriptor_sets->UpdateDescriptor(
+        0, DescriptorBinding::CombinedImageSamplersValue{output_images});
+}
+
+VulkanRenderGraph::Resource VulkanPathTracerHW::Denoise(VulkanRenderGraph& graph,
+                                                        const TracedResources& traced,
+                                                        std::size_t frame_idx,
+                                                        const vk::Extent2D& render_extent) {
+    // Narrowed with each pass, so that the wider ones do not blur the details kept so far
+    static constexpr float ColorPhi = 0.1f;
+    static constexpr float NormalPhi = 0.1f;
+    static constexpr float AlbedoPhi = 0.05f;
+
+    // The alternated images were last used by the passes of the previous frame, and the output
+    // by the postprocessing and the heatmap of the previous use of the frame in flight
+    const std::array<VulkanRenderGraph::Resource, 2> scratch_images{
+        graph.ImportImage(**denoise_images[0].image,
+                          StorageAccess(vk::AccessFlagBits2::eShaderStorageRead |
+                                        vk::AccessFlagBits2::eShaderStorageWrite)),
+        graph.ImportImage(**denoise_images[1].image,
+                          StorageAccess(vk::AccessFlagBits2::eShaderStorageRead |
+                                        vk::AccessFlagBits2::eShaderStorageWrite)),
+    };
+    const auto output = graph.ImportImage(
+        **denoise_images[2 + frame_idx].image,
+        {
+            .stages = vk::PipelineStageFlagBits2::eComputeShader |
+                      vk::PipelineStageFlagBits2::eFragmentShader,
+            .access = vk::AccessFlagBits2::eShaderSampledRead |
+                      vk::AccessFlagBits2::eShaderStorageRead |
+                      vk::AccessFlagBits2::eShaderStorageWrite,
+            .layout = vk::ImageLayout::eGeneral,
+        });
+    const auto GetOutput = [&scratch_images, output](u32 pass) {
+        return pass + 1 == DenoisePasses ? output : scratch_images[pass % 2];
+    };
+
+    for (u32 pass = 0; pass < DenoisePasses; ++pass) {
+        // The last is the output of the previous pass, if any
+        const std::array<VulkanRenderGraph::ResourceAccess, 4> accesses{{
+            {traced.image, StorageAccess(vk::AccessFlagBits2::eShaderStorageRead)},
+            {traced.aovs, StorageAccess(vk::AccessFlagBits2::eShaderStorageRead)},
+            {GetOutput(pass), StorageAccess(vk::AccessFlagBits2::eShaderStorageWrite)},
+            {pass > 0 ? GetOutput(pass - 1) : VulkanRenderGraph::Resource{},
+             StorageAccess(vk::AccessFlagBits2::eShaderStorageRead)},
+        }};
+        graph.AddPass(
+            "Denoise", std::span{accesses}.first(pass > 0 ? 4 : 3),
+            [this, frame_idx, render_extent, pass](const vk::raii::CommandBuffer& cmd) {
+                cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **denoise_pipeline);
+                VulkanDescriptorSets::Bind(
+                    cmd, vk::PipelineBindPoint::eCompute, *denoise_pipeline->pipeline_layout, 0,
+                    {{*denoise_descriptor_sets, frame_idx * DenoisePasses + pass}});
+                cmd.pushConstants<GLSL::DenoisePushConstant>(
+                    *denoise_pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+                    {{
+                        .render_extent = {render_extent.width, render_extent.height},
+                        .step_width = 1u << pass,
+                        .first_pass = pass == 0,
+                        .color_phi = ColorPhi / static_cast<float>(1u << pass),
+                        .normal_phi = NormalPhi,
+                        .albedo_phi = AlbedoPhi,
+                    }});
+                cmd.dispatch((render_extent.width + 7) / 8, (render_extent.height + 7) / 8, 1);
+            });
+    }
+    return output;
+}
+
+VulkanPathTracerHW::TracedResources VulkanPathTracerHW::ImportTracedResources(
+    VulkanRenderGraph& graph, std::size_t frame_idx) const {
+
+    const VulkanRenderGraph::Access traced{
+        .stages = GetTracePipelineStages(),
+        .access = vk::AccessFlagBits2::eShaderStorageWrite,
+        .layout = vk::ImageLayout::eGeneral,
+    };
+    return {
+        .image = graph.ImportImage(**offscreen_frames[frame_idx].image, traced),
+        .accumulation = graph.ImportBuffer(traced),
+        .first_hits = graph.ImportBuffer(traced),
+        .aovs = graph.ImportBuffer(traced),
+        .costs = graph.ImportBuffer(traced),
+        .guide = graph.ImportBuffer(traced),
+    };
+}
+
+vk::ShaderStageFlags VulkanPathTracerHW::GetTraceStages() const {
+    return TraceStages;
+}
+
+vk::PipelineStageFlags2 VulkanPathTracerHW::GetTracePipelineStages() const {
+    return vk::PipelineStageFlagBits2::eRayTracingShaderKHR;
+}
+
+void VulkanPathTracerHW::CreatePipeline() {
+    // Traces with the generic closest hit shader (the defaults of its specialization constants
+    // hold for all meshes) until the specialized ones have been compiled in the background
+    pipeline = std::move(CreateTracePipeline(false, nullptr).pipeline);
+    pipeline_libraries.clear();
+
+    // Seeded with the pipeline cache of the device, so that the background thread does not
+    // contend with the pipelines created meanwhile
+    const auto& cache_data = device->pipeline_cache.getData();
+    specialized_pipeline_cache = vk::raii::PipelineCache{**device,
+                                                         {
+                                                             .initialDataSize = cache_data.size(),
+                                                             .pInitialData = cache_data.data(),
+                                                         }};
+    specialized_pipeline = std::async(std::launch::async, [this] {
+        return CreateTracePipeline(true, &specialized_pipeline_cache);
+    });
+}
+
+VulkanPathTracerHW::TracePipeline VulkanPathTracerHW::CreateTracePipeline(
+    bool specialized, const vk::raii::PipelineCache* pipeline_cache) const {
+
+    // Reorders the invocations by material before shading where supported
+    const auto raygen_path = device->invocation_reorder
+                                 ? u8"core/path_tracer_hw/shaders/raytrace_reorder.rgen"
+                                 : u8"core/path_tracer_hw/shaders/raytrace.rgen";
+
+    const VulkanShader raygen{*device, raygen_path};
+    const VulkanShader miss{*device, u8"core/path_tracer_hw/shaders/raytrace.rmiss"};
+    const VulkanShader shadow_miss{*device, u8"core/path_tracer_hw/shaders/raytrace_shadow.rmiss"};
+    // The closest hit shader of each hit group is specialized for its flags, see raytrace.rchit
+    const VulkanShader closest_hit{*device, u8"core/path_tracer_hw/shaders/raytrace.rchit"};
+    // Alpha tests the geometry that is not opaque, shared by all hit groups
+    const VulkanShader any_hit{*device, u8"core/path_tracer_hw/shaders/raytrace.rahit"};
+    static constexpr std::array<vk::SpecializationMapEntry, 2> SpecializationEntries{{
+        {.constantID = 0, .offset = 0, .size = sizeof(vk::Bool32)},
+        {.constantID = 1, .offset = sizeof(vk::Bool32), .size = sizeof(vk::Bool32)},
+    }};
+    std::array<std::array<vk::Bool32, 2>, NumHitGroups> specialization_data;
+    std::array<vk::SpecializationInfo, NumHitGroups> specialization_infos;
+    std::vector<vk::PipelineShaderStageCreateInfo> stages{
+        {.stage = vk::ShaderStageFlagBits::eRaygenKHR, .module = *raygen, .pName = "main"},
+        {.stage = vk::ShaderStageFlagBits::eMissKHR, .module = *miss, .pName = "main"},
+        {.stage = vk::ShaderStageFlagBits::eMissKHR, .module = *shadow_miss, .pName = "main"},
+        {.stage = vk::ShaderStageFlagBits::eAnyHitKHR, .module = *any_hit, .pName = "main"},
+    };
+    static constexpr u32 AnyHitStage = 3;
+    std::vector<vk::RayTracingShaderGroupCreateInfoKHR> groups{
+        General(0),
+        General(1),
+        General(2), // Miss index 1, of the shadow rays
+    };
+    static constexpr u32 NumGeneralGroups = 3;
+    // Hit group i comes right after the miss groups, and is the record offset of its instances
+    for (u32 i = 0; i < NumHitGroups; ++i) {
+        specialization_data[i] = {(i & HitGroupUntextured) == 0,
+                                  (i & HitGroupFloatAttributes) != 0};
+        specialization_infos[i] = {
+            .mapEntryCount = static_cast<u32>(SpecializationEntries.size()),
+            .pMapEntries = SpecializationEntries.data(),
+            .dataSize = sizeof(specialization_data[i]),
+            .pData = specialization_data[i].data(),
+        };
+        groups.emplace_back(TrianglesGroup({
+            .closestHitShader = static_cast<u32>(stages.size()),
+            .anyHitShader = AnyHitStage,
+            .intersectionShader = VK_SHADER_UNUSED_KHR,
+        }));
+        stages.emplace_back(vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eClosestHitKHR,
+            .module = *closest_hit,
+            .pName = "main",
+            .pSpecializationInfo = specialized ? &specialization_infos[i] : nullptr,
+        });
+    }
+
+    const std::array set_layouts{
+        *fixed_descriptor_set->descriptor_set_layout,
+        *image_descriptor_sets->descriptor_set_layout,
+        *scene->texture_streamer->descriptor_sets->descriptor_set_layout,
+    };
+    static constexpr std::array PushConstantRanges{
+        PushConstant<GLSL::TracePushConstant>(TraceStages),
+    };
+    const vk::PipelineLayoutCreateInfo layout_info{
+        .setLayoutCount = static_cast<u32>(set_layouts.size()),
+        .pSetLayouts = set_layouts.data(),
+        .pushConstantRangeCount = static_cast<u32>(PushConstantRanges.size()),
+        .pPushConstantRanges = PushConstantRanges.data(),
+    };
+
+    // Geometry may reference opacity micromaps, which rays otherwise ignore
+    vk::PipelineCreateFlags flags{};
+    if (device->opacity_micromap) {
+        flags |= vk::PipelineCreateFlagBits::eRayTracingOpacityMicromapEXT;
+    }
+
+    // Only the raygen shader traces rays
+    TracePipeline out;
+    if (!specialized || !device->pipeline_library) {
+        out.pipeline = std::make_unique<VulkanRayTracingPipeline>(
+            *device, specialized ? "specialized ray tracing" : "ray tracing",
+            vk::RayTracingPipelineCreateInfoKHR{
+                .flags = flags,
+                .stageCount = static_cast<u32>(stages.size()),
+                .pStages = stages.data(),
+                .groupCount = static_cast<u32>(groups.size()),
+                .pGroups = groups.data(),
+                .maxPipelineRayRecursionDepth = 1,
+            },
+            layout_info, std::span<const VulkanRayTracingPipeline* const>{}, pipeline_cache);
+        return out;
+    }
+
+    // Linked from a library of the raygen and miss shaders and one of each hit group, in the
+    // order of their groups above. The hit groups only differ by their specialization, so that
+    // their libraries are mostly found in the pipeline cache once any has been compiled.
+    static constexpr vk::RayTracingPipelineInterfaceCreateInfoKHR LibraryInterface{
+        .maxPipelineRayPayloadSize = 128, // Bounds hitPayload of ray_common.glsl
+        .maxPipelineRayHitAttributeSize = sizeof(glm::vec2),
+    };
+    const auto CreateLibrary = [this, &stages, &groups, &layout_info, pipeline_cache, flags](
+                                   std::string_view name, u32 first_group, u32 num_groups) {
+        // The groups of a library index its own stages
+        std::vector<vk::PipelineShaderStageCreateInfo> library_stages;
+        std::vector<vk::RayTracingShaderGroupCreateInfoKHR> library_groups;
+        const auto AddStage = [&](u32& shader) {
+            library_stages.emplace_back(stages[shader]);
+            shader = static_cast<u32>(library_stages.size() - 1);
+        };
+        for (u32 i = first_group; i < first_group + num_groups; ++i) {
+            auto group = groups[i];
+            if (group.type == vk::RayTracingShaderGroupTypeKHR::eGeneral) {
+                AddStage(group.generalShader);
+            } else {
+                AddStage(group.closestHitShader);
+                AddStage(group.anyHitShader);
+            }
+            library_groups.emplace_back(group);
+        }
+        return std::make_unique<VulkanRayTracingPipeline>(
+            *device, name,
+            vk::RayTracingPipelineCreateInfoKHR{
+                .flags = vk::PipelineCreateFlagBits::eLibraryKHR | flags,
+                .stageCount = static_cast<u32>(library_stages.size()),
+                .pStages = library_stages.data(),
+                .groupCount = static_cast<u32>(library_groups.size()),
+                .pGroups = library_groups.data(),
+                .maxPipelineRayRecursionDepth = 1,
+                .pLibraryInterface = &LibraryInterface,
+            },
+            layout_info, std::span<const VulkanRayTracingPipeline* const>{}, pipeline_cache);
+    };
+    out.libraries.emplace_back(CreateLibrary("ray tracing general library", 0, NumGeneralGroups));
+    for (u32 i = 0; i < NumHitGroups; ++i) {
+        out.libraries.emplace_back(CreateLibrary(fmt::format("ray tracing hit group {} library", i),
+                                                 NumGeneralGroups + i, 1));
+    }
+    const auto libraries = Common::VectorFromRange(
+        out.libraries | std::views::transform([](const auto& library) {
+            return static_cast<const VulkanRayTracingPipeline*>(library.get());
+        }));
+    out.pipeline = std::make_unique<VulkanRayTracingPipeline>(
+        *device, "specialized ray tracing",
+        vk::RayTracingPipelineCreateInfoKHR{
+            .flags = flags,
+            .maxPipelineRayRecursionDepth = 1,
+            .pLibraryInterface = &LibraryInterface,
+        },
+        layout_info, libraries, pipeline_cache);
+    return out;
+}
+
+void VulkanPathTracerHW::UpgradePipeline() {
+    if (!specialized_pipeline.valid() ||
+        specialized_pipeline.wait_for(std::chrono::seconds{0}) != std::future_status::ready) {
+        return;
+    }
+    try {
+        auto specialized = specialized_pipeline.get();
+        // The frames in flight may still trace with the generic one, which is retired for them
+        // rather than waited for
+        frames->Retire(std::move(pipeline));
+        frames->Retire(std::move(pipeline_libraries));
+        pipeline = std::move(specialized.pipeline);
+        pipeline_libraries = std::move(specialized.libraries);
+        SPDLOG_INFO("Swapped in the specialized ray tracing pipeline");
+    } catch (const std::exception& e) {
+        SPDLOG_WARN("Failed to create the specialized ray tracing pipeline, keeping the generic "
+                    "one: {}",
+                    e.what());
+    }
+    device->pipeline_cache.merge(*specialized_pipeline_cache);
+    specialized_pipeline_cache = nullptr;
+}
+
+bool VulkanPathTracerHW::TakeProgressiveBLASes() {
+    if (!progressive_builder) {
+        return false;
+    }
+    auto built = progressive_builder->Poll();
+    std::vector<std::pair<std::size_t, std::unique_ptr<VulkanAccelStructure>>> completed;
+    if (built) { // Those not taken yet
+        for (std::size_t i = 0; i < built->size(); ++i) {
+            if ((*built)[i]) {
+                completed.emplace_back(i, std::move((*built)[i]));
+            }
+        }
+    } else {
+        completed = progressive_builder->TakeCompleted();
+    }
+    for (auto& [idx, blas] : completed) {
+        blases[progressive_meshes[idx].mesh] = std::move(blas);
+    }
+    if (!built) {
+        return !completed.empty();
+    }
+
+    const auto meshes_to_cache = Common::VectorFromRange(
+        progressive_meshes | std::views::filter([](const auto& mesh) { return mesh.cacheable; }));
+    const auto serialized = progressive_builder->Serialize(Common::VectorFromRange(
+        meshes_to_cache | std::views::transform([this](const auto& mesh) {
+            return static_cast<const VulkanAccelStructure*>(blases[mesh.mesh].get());
+        })));
+    for (std::size_t i = 0; i < serialized.size(); ++i) {
+        const std::array<std::span<const u8>, 1> sections{{serialized[i]}};
+        scene_cache->Store(meshes_to_cache[i].key, sections);
+    }
+    SPDLOG_INFO("Built all {} BLASes in the background", progressive_meshes.size());
+    progressive_meshes.clear();
+    progressive_builder.reset();
+    return !completed.empty();
+}
+
+void VulkanPathTracerHW::AdvanceProgressiveBuilds() {
+    // The BLASes taken must all be in the TLASes built next, for them to be refit
+    if (!pending_tlases.empty() || !TakeProgressiveBLASes()) {
+        return;
+    }
+    const bool allow_update = std::ranges::any_of(
+        tlases, [](const auto& tlas) { return tlas && tlas->AllowsUpdate(); });
+    pending_tlases = BuildTLASes(nullptr, allow_update);
+    pending_tlases_add_instances = true;
+}
+
+void VulkanPathTracerHW::UpgradeBLASes() {
+    // Once all are built
+    if (!blas_upgrader) {
+        if (blas_upgrades.empty() || progressive_builder) {
+            return;
+        }
+        blas_upgrader = std::make_unique<VulkanBLASBuilder>(*device);
+        for (const auto& upgrade : blas_upgrades) {
+            const auto geometry = GetBLASGeometry(*scene, *scene->meshes[upgrade.mesh], false);
+            blas_upgrader->Add(geometry.geometries, geometry.build_ranges);
+        }
+        blas_upgrader->BuildAsync(BLASUpgradesPerRound);
+    }
+    auto upgraded = blas_upgrader->Poll();
+    if (!upgraded) {
+        return;
+    }
+
+    // All at once. The frames keep tracing against the old BLASes until the TLASes over the new
+    // ones are swapped in.
+    for (std::size_t i = 0; i < blas_upgrades.size(); ++i) {
+        retired_blases.emplace_back(std::move(blases[blas_upgrades[i].mesh]));
+        blases[blas_upgrades[i].mesh] = std::move((*upgraded)[i]);
+    }
+    const auto upgrades_to_cache = Common::VectorFromRange(
+        blas_upgrades | std::views::filter([](const auto& upgrade) { return upgrade.cacheable; }));
+    const auto serialized = blas_upgrader->Serialize(Common::VectorFromRange(
+        upgrades_to_cache | std::views::transform([this](const auto& upgrade) {
+            return static_cast<const VulkanAccelStructure*>(blases[upgrade.mesh].get());
+        })));
+    for (std::size_t i = 0; i < serialized.size(); ++i) {
+        const std::array<std::span<const u8>, 1> sections{{serialized[i]}};
+        scene_cache->Store(upgrades_to_cache[i].key, sections);
+    }
+    SPDLOG_INFO("Rebuilt {} BLASes for tracing, rebuilding the TLASes over them",
+                blas_upgrades.size());
+    blas_upgrades.clear();
+    blas_upgrader.reset();
+
+    // The instances reference the BLASes by address
+    const bool allow_update = std::ranges::any_of(
+        tlases, [](const auto& tlas) { return tlas && tlas->AllowsUpdate(); });
+    pending_tlases = BuildTLASes(nullptr, allow_update);
+}
+
+void VulkanPathTracerHW::SwapInPendingTLASes(bool wait) {
+    if (pending_tlases.empty()) {
+        return;
+    }
+    if (!wait) {
+        bool done = true;
+        for (const auto& tlas : pending_tlases) {
+            done &= !tlas || tlas->Poll();
+        }
+        if (!done) {
+            return;
+        }
+    }
+
+    // The frames in flight may still trace against the previous TLASes and their BLASes
+    device->WaitQueueIdle(device->graphics_queue);
+    tlases = std::move(pending_tlases);
+    pending_tlases.clear();
+    retired_blases.clear();
+    WaitForAccelStructures();
+    fixed_descriptor_set->UpdateDescriptor(0, DescriptorBinding::AccelStructuresValue{{
+                                                  .accel_structures = {{**tlases[sub_scene_idx]}},
+                                              }});
+    if (pending_tlases_add_instances) {
+        pending_tlases_add_instances = false;
+        frame_count = 0;
+        return;
+    }
+    SPDLOG_INFO("Swapped in the TLASes rebuilt over the upgraded BLASes");
+}
+
+void VulkanPathTracerHW::DrawFrame(const Camera& external_camera, bool force_external_camera) {
+    PROFILE_FUNCTION();
+    const FrameScope frame_scope{*this};
+    SwapInPendingTLASes(false);
+    AdvanceProgressiveBuilds();
+    UpgradeBLASes();
+    UpgradePipeline();
+    if (scene->lazy_texture_loader) {
+        const auto changed = scene->lazy_texture_loader->Poll(*scene->texture_streamer);
+        if (!changed.empty()) {
+            // The descriptor set may still be in use by the other frame in flight
+            device->WaitQueueIdle(device->graphics_queue);
+            frame_count = 0;
+        }
+        for (const std::size_t texture_idx : changed) {
+            const auto& texture = scene->textures[texture_idx];
+            fixed_descriptor_set->UpdateDescriptor(
+                3,
+                DescriptorBinding::CombinedImageSamplersValue{{
+                    .images = {{
+                        .image = *texture->image->GetTexture().image_view,
+                        .sampler = texture->sampler ? *texture->sampler->sampler
+                                                    : *device->default_sampler,
+                    }},
+                }},
+                static_cast<u32>(texture_idx));
+        }
+    }
+    StepDefragmentation(!scene->lazy_texture_loader || scene->lazy_texture_loader->IsDone());
+    device->upload_ring->Flush();
+
+    auto& frame = frames->AcquireNextFrame();
+    UpdateSampleBudget(frame.idx, frame.extras.num_samples, frame.extras.num_pixels);
+    ReadCounters(frame.idx);
+    ReadPicks(frame.idx);
+    WriteCheckpoint(frame.idx);
+    frame.extras.resume_buffer.reset();
+
+    frames->BeginFrame();
 
     const auto& cmd = frame.command_buffer;
-    cmd.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, **pipeline);
-    cmd.bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, *pipeline->pipeline_layout, 0,
-                           {fixed_descriptor_set->descriptor_sets[0],
-                            image_descriptor_sets->descriptor_sets[frame.idx],
-                            image_descriptor_sets->descriptor_sets[1 - frame.idx]},
-                           {});
-
-    const bool use_external_camera =
-        force_external_camera || scene->main_sub_scene->cameras.empty();
-    const auto& camera = use_external_camera ? external_camera : *scene->main_sub_scene->cameras[0];
+    if (gpu_profiler) {
+        gpu_profiler->BeginFrame(cmd, frame.idx);
+    }
+    VulkanTextureStreamer::FrameUpdate streaming_update;
+    {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Uploads"};
+        streaming_update = scene->texture_streamer->BeginFrame(cmd, frame.idx);
+    }
+    frame_allocator->BeginFrame(frame.idx);
+
+    const auto& sub_scene = GetSubScene();
+    const bool use_external_camera = force_external_camera || sub_scene.cameras.empty();
+    const auto& camera = use_external_camera ? external_camera : *sub_scene.cameras[0];
     const double viewport_aspect_ratio =
         static_cast<double>(swap_chain->extent.width) / swap_chain->extent.height;
-    const auto render_extent = GetRenderExtent(camera.GetAspectRatio(viewport_aspect_ratio));
-
     const auto& view = camera.view;
     const auto& proj = camera.GetProj(viewport_aspect_ratio);
-    if (view != last_camera_view || proj != last_camera_proj || camera_properties_changed) {
+    const bool camera_moved = view != last_camera_view || proj != last_camera_proj;
+    // Dynamic resolution only while the camera moves, accumulating at full resolution otherwise
+    const auto display_extent = GetDisplayExtent(camera.GetAspectRatio(viewport_aspect_ratio));
+    const auto render_extent =
+        GetRenderExtent(camera.GetAspectRatio(viewport_aspect_ratio), camera_moved);
+    PrefetchStreaming(view, proj, render_extent);
+
+    // Previews while the camera moves, whose samples are not mixed with those of the integrator
+    // set once it stops
+    const Integrator frame_integrator =
+        camera_moved && motion_integrator != Integrator::PathTracing ? motion_integrator
+                                                                     : integrator;
+    const bool integrator_changed = frame_integrator != last_integrator;
+    last_integrator = frame_integrator;
+
+    // Samples taken with coarser texture levels should not be mixed in either. Only the motion
+    // of the camera itself is reprojected.
+    bool reproject = false;
+    if (camera_moved || camera_properties_changed || streaming_update.residency_changed ||
+        render_extent != last_render_extent || integrator_changed) {
+        reproject = reprojection && camera_moved && frame_count > 0 &&
+                    !camera_properties_changed && !streaming_update.residency_changed &&
+                    render_extent == last_render_extent && !integrator_changed;
         frame_count = 0;
         camera_properties_changed = false;
     }
+    // Only the integrators that sample lights at the first hits resample them, and only full
+    // path tracing teaches path guiding
+    const bool samples_lights = frame_integrator == Integrator::PathTracing ||
+                                frame_integrator == Integrator::DirectLighting ||
+                                frame_integrator == Integrator::FewBounces;
+    const u32 frame_restir_candidates = samples_lights ? restir_candidates : 0;
+    const bool frame_path_guiding = path_guiding && frame_integrator == Integrator::PathTracing;
+    const glm::mat4 prev_view_proj = last_camera_proj * last_camera_view;
+    const glm::vec3 prev_camera_position{glm::inverse(last_camera_view)[3]};
+    // Reprojected like the accumulation, but also after other changes to the camera
+    const bool reuse_last_reservoirs = reuse_reservoirs && frame_restir_candidates > 0 &&
+                                       render_extent == last_render_extent;
 
     last_camera_view = view;
     last_camera_proj = proj;
-    cmd.pushConstants<GLSL::PathTracerPushConstantBlock>(
-        *pipeline->pipeline_layout,
-        vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eClosestHitKHR |
-            vk::ShaderStageFlagBits::eMissKHR,
-        0,
-        {{{
+    last_render_extent = render_extent;
+    frame_samples = target_trace_time > 0 ? static_cast<u32>(std::lround(sample_budget))
+                                          : samples_per_frame;
+    if (frame_count == 0) {
+        sample_offset = reproject ? (sample_offset + accumulated_samples) % SamplesPerStream : 0;
+        accumulated_samples = 0;
+        accumulation_id++;
+    }
+    if (resume_checkpoint && frame_count == 0 && frame_integrator == Integrator::PathTracing) {
+        ResumeCheckpoint(cmd, frame.idx, render_extent, view, proj);
+    }
+    // Several passes only while accumulating, and not past the samples to converge at
+    const bool tiled = tile_size > 0 && SupportsTiledTracing();
+    u32 num_passes = camera_moved || tiled ? 1 : trace_passes;
+    if (target_samples > 0 && accumulated_samples < target_samples) {
+        const u32 remaining = target_samples - accumulated_samples;
+        num_passes = std::min(num_passes, (remaining + frame_samples - 1) / frame_samples);
+    }
+    const auto PushUniforms = [&](bool reuse) {
+        const u32 offset = frame_allocator->Push<GLSL::PathTracerUniformsBlock>({{
             .view_inverse = glm::inverse(view),
             .proj_inverse = glm::inverse(proj),
+            .view_proj = proj * view,
+            .prev_view_proj = prev_view_proj,
             .intensity_multiplier = intensity_multiplier,
             .ambient_light = ambient_light,
             .frame = frame_count++,
             .focal_dist = focal_dist,
             .aperture = aperture,
-        }}});
-    pipeline->TraceRays(cmd, render_extent.width, render_extent.height, 1);
+            .adaptive_threshold = adaptive_threshold,
+            .samples_per_pixel = frame_samples,
+            .max_depth = frame_integrator == Integrator::FewBounces
+                             ? std::min(max_depth, PreviewMaxDepth)
+                             : max_depth,
+            .russian_roulette = russian_roulette,
+            .roulette_depth = roulette_depth,
+            .write_aovs = denoise,
+            .num_lights = num_lights,
+            .num_punctual_lights = num_punctual_lights,
+            .environment_width = environment_map ? environment_map->width : 0,
+            .environment_height = environment_map ? environment_map->height : 0,
+            .environment_intensity = environment_intensity,
+            .first_sample = sample_stream * SamplesPerStream +
+                            (sample_offset + accumulated_samples) % SamplesPerStream,
+            .seed = sampler_seed,
+            .pixel_spread_angle = std::atan(
+                2.0f / (std::abs(proj[1][1]) * static_cast<float>(render_extent.height))),
+            .write_first_hits = reprojection,
+            .measure_costs = cost_heatmap,
+            .count_rays = ray_stats,
+            .restir_candidates = frame_restir_candidates,
+            .reservoir_half = reservoir_half,
+            .reuse_reservoirs = reuse,
+            .guide_cells = frame_path_guiding ? GuideCells : 0,
+            .guide_cell_size = guide_cell_size,
+            .integrator = GetShaderIntegrator(frame_integrator),
+            .ao_distance = sub_scene_size * AmbientOcclusionRange,
+        }});
+        reservoir_half ^= 1;
+        reuse_reservoirs = frame_restir_candidates > 0;
+        accumulated_samples += frame_samples;
+        return offset;
+    };
+    // Each pass is traced like a frame of its own, with uniforms of its own
+    std::array<u32, MaxTracePasses> pass_uniforms_offsets;
+    for (u32 pass = 0; pass < num_passes; ++pass) {
+        pass_uniforms_offsets[pass] =
+            PushUniforms(pass == 0 ? reuse_last_reservoirs : frame_restir_candidates > 0);
+    }
+    const u32 uniforms_offset = pass_uniforms_offsets[0];
+    frame_allocator->EndFrame();
+
+    // Generated TLAS instances are culled by the camera
+    const auto& tlas = tlases[sub_scene_idx];
+    const glm::vec3 camera_position{glm::inverse(view)[3]};
+    if (tlas && tlas->NeedsRebuild(camera_position)) {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "TLAS"};
+        tlas->RecordBuild(cmd, camera_position);
+    }
+    if (picking) {
+        RecordPicks(cmd, frame.idx, uniforms_offset);
+    }
+    if (reproject) {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx,
+                                                  "Reproject"};
+        CopyHistory(cmd, render_extent);
+    }
+    ClearCounters(cmd);
+    if (guide_reset) {
+        ClearGuide(cmd);
+    }
+    BeginFrameTimer(cmd, frame.idx, camera_moved ? GetRenderScale() : 1.0);
+    // Tiles may end it in a later submission
+    const auto trace_scope =
+        gpu_profiler ? gpu_profiler->BeginScope(cmd, frame.idx, "Trace", false) : std::nullopt;
+    if (!tiled) {
+        for (u32 pass = 0; pass < num_passes; ++pass) {
+            Trace(cmd, frame.idx, pass_uniforms_offsets[pass], render_extent);
+        }
+    }
+    // The rest of the frame goes into the last submission
+    const auto& last_cmd =
+        tiled ? TraceTiles(frame.idx, uniforms_offset, render_extent,
+                           streaming_update.wait_semaphore)
+              : cmd;
+    EndFrameTimer(last_cmd, frame.idx, GetTracePipelineStages());
+    if (gpu_profiler) {
+        gpu_profiler->EndScope(last_cmd, frame.idx, trace_scope, GetTracePipelineStages());
+    }
+    frame.extras.num_samples = frame_samples * num_passes;
+    frame.extras.num_pixels = render_extent.width * render_extent.height;
+    frame.extras.accumulation_id = accumulation_id;
+    CopyCounters(last_cmd, frame.idx);
+
+    VulkanRenderGraph graph{frame_arena.GetResource()};
+    const auto traced = ImportTracedResources(graph, frame.idx);
+    if (frame_path_guiding) {
+        LearnGuide(graph, traced);
+    }
+    if (reproject) {
+        Reproject(graph, traced, frame.idx, render_extent, prev_view_proj, prev_camera_position);
+    }
+    const auto presented_image = denoise ? Denoise(graph, traced, frame.idx, render_extent)
+                                         : traced.image;
+    if (cost_heatmap) {
+        DrawHeatmap(graph, traced, presented_image, frame.idx, render_extent);
+    }
+    graph.Execute(last_cmd, gpu_profiler.get(), frame.idx);
+    RecordCheckpoint(last_cmd, frame.idx, render_extent);
+    const auto image_available =
+        RecordPostprocess(last_cmd, frame.idx, render_extent, display_extent,
+                          GetTracePipelineStages() | vk::PipelineStageFlagBits2::eComputeShader,
+                          vk::AccessFlagBits2::eShaderStorageWrite);
+    scene->texture_streamer->EndFrame(last_cmd);
+
+    const bool first_submission = &last_cmd == &cmd;
+    if (first_submission) {
+        frames->EndFrame();
+    } else {
+        last_cmd.end();
+    }
+
+    // Wait for the memory of the streamed textures to be bound, unless an earlier submission did
+    auto wait_semaphores = frame_arena.MakeVector<vk::SemaphoreSubmitInfo>();
+    if (first_submission && streaming_update.wait_semaphore) {
+        wait_semaphores.push_back({
+            .semaphore = streaming_update.wait_semaphore,
+            .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+        });
+    }
+    if (image_available && image_available->semaphore) {
+        wait_semaphores.push_back(*image_available);
+    }
+    // Nothing is presented if no image was acquired
+    frames->Submit(*last_cmd, wait_semaphores, image_available.has_value());
+    if (!image_available) {
+        throw std::runtime_error("Failed to acquire image, ignoring");
+    }
+    swap_chain->Present(*frame.render_finished_semaphore);
+}
+
+void VulkanPathTracerHW::UpdateSampleBudget(std::size_t frame_idx, u32 num_samples,
+                                            u32 num_pixels) {
+    const auto time = GetFrameTime(frame_idx);
+    if (!time || num_samples == 0) {
+        return;
+    }
+    const double trace_time = time->milliseconds;
+    if (trace_time <= 0) {
+        return;
+    }
+    pixel_sample_time = trace_time / (static_cast<double>(num_samples) * num_pixels);
+    // When time-boxed, the samples fill the frame time, so the resolution is only lowered until
+    // a single sample fits
+    UpdateRenderScale({
+        .milliseconds = target_trace_time > 0 ? trace_time / num_samples : trace_time,
+        .render_scale = time->render_scale,
+    });
+    if (target_trace_time <= 0) {
+        return;
+    }
+    // Damped, so that noisy timings do not make the budget oscillate. Of each pass, which takes
+    // the target time.
+    const double ideal_budget = num_samples * target_trace_time / trace_time;
+    sample_budget = std::clamp(sample_budget + (ideal_budget - sample_budget) * 0.5, 1.0,
+                               static_cast<double>(MaxSamplesPerFrame));
+}
+
+SceneCache::Key VulkanPathTracerHW::GetCheckpointKey() const {
+    // The environment map by its path, which is not hashed with the scene
+    const auto environment_map_name = environment_map_path.u8string();
+    return SceneCache::Hasher{"render_checkpoint"}
+        .AddValue(*checkpoint_scene_hash)
+        .AddValue(static_cast<u64>(sub_scene_idx))
+        .AddValue(intensity_multiplier)
+        .AddValue(ambient_light)
+        .AddValue(focal_dist)
+        .AddValue(aperture)
+        .AddValue(adaptive_threshold)
+        .AddValue(max_depth)
+        .AddValue(russian_roulette)
+        .AddValue(roulette_depth)
+        .AddValue(environment_intensity)
+        .Add({reinterpret_cast<const u8*>(environment_map_name.data()),
+              environment_map_name.size()})
+        .Get();
+}
+
+void VulkanPathTracerHW::ResumeCheckpoint(const vk::raii::CommandBuffer& cmd,
+                                          std::size_t frame_idx,
+                                          const vk::Extent2D& render_extent,
+                                          const glm::mat4& view, const glm::mat4& proj) {
+    const auto checkpoint = std::move(*resume_checkpoint);
+    resume_checkpoint.reset();
+
+    const std::size_t num_pixels = std::size_t{render_extent.width} * render_extent.height;
+    const std::size_t stats_size =
+        adaptive_threshold > 0 ? num_pixels * sizeof(GLSL::PixelStats) : 0;
+    if (!checkpoint_scene_hash || checkpoint.key != GetCheckpointKey() ||
+        checkpoint.view != view || checkpoint.proj != proj ||
+        render_extent != swap_chain->extent || checkpoint.width != render_extent.width ||
+        checkpoint.height != render_extent.height ||
+        checkpoint.accumulation.size() != num_pixels * sizeof(GLSL::PixelAccumulation) ||
+        checkpoint.stats.size() != stats_size) {
+        SPDLOG_WARN("Checkpoint {} is of another render, starting over",
+                    checkpoint_path.string());
+        return;
+    }
+
+    auto& frame = frames->frames_in_flight[frame_idx].extras;
+    frame.resume_buffer = std::make_unique<VulkanBuffer>(
+        *device->allocator,
+        vk::BufferCreateInfo{
+            .size = checkpoint.accumulation.size() + checkpoint.stats.size(),
+            .usage = vk::BufferUsageFlagBits::eTransferSrc,
+        },
+        VmaAllocationCreateInfo{
+            .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                     VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Scratch);
+    frame.resume_buffer->SetName("checkpoint upload");
+    auto* data = static_cast<u8*>(frame.resume_buffer->allocation_info.pMappedData);
+    std::memcpy(data, checkpoint.accumulation.data(), checkpoint.accumulation.size());
+    std::memcpy(data + checkpoint.accumulation.size(), checkpoint.stats.data(),
+                checkpoint.stats.size());
+    vmaFlushAllocation(frame.resume_buffer->allocator, frame.resume_buffer->allocation, 0,
+                       VK_WHOLE_SIZE);
+
+    // After the previous frames' tracing and reprojection
     cmd.pipelineBarrier2({
-        .imageMemoryBarrierCount = 1,
-        .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{{
-            .srcStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask =
+                GetTracePipelineStages() | vk::PipelineStageFlagBits2::eComputeShader,
             .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
-            .dstStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
-            .dstAccessMask = vk::AccessFlagBits2::eShaderStorageRead,
-            .image = **pp_frames->frames_in_flight[frame.idx].extras.image,
-            .subresourceRange =
-                {
-                    .aspectMask = vk::ImageAspectFlagBits::eColor,
-                    .baseMipLevel = 0,
-                    .levelCount = 1,
-                    .baseArrayLayer = 0,
-                    .layerCount = 1,
-                },
+            .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+        }}},
+    });
+    cmd.copyBuffer(**frame.resume_buffer, **pixel_accumulation_buffer,
+                   {{
+                       .srcOffset = 0,
+                       .dstOffset = 0,
+                       .size = checkpoint.accumulation.size(),
+                   }});
+    if (!checkpoint.stats.empty()) {
+        cmd.copyBuffer(**frame.resume_buffer, **pixel_stats_buffer,
+                       {{
+                           .srcOffset = checkpoint.accumulation.size(),
+                           .dstOffset = 0,
+                           .size = checkpoint.stats.size(),
+                       }});
+    }
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+            .dstStageMask = GetTracePipelineStages(),
+            .dstAccessMask =
+                vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite,
+        }}},
+    });
+
+    // The samples go on where the checkpoint's sequences left off
+    frame_count = checkpoint.frame_count;
+    accumulated_samples = checkpoint.accumulated_samples;
+    sample_offset = checkpoint.sample_offset;
+    sampler_seed = checkpoint.seed;
+    sample_stream = checkpoint.stream;
+    SPDLOG_INFO("Resumed from checkpoint {} at {} samples per pixel", checkpoint_path.string(),
+                accumulated_samples);
+}
+
+void VulkanPathTracerHW::RecordCheckpoint(const vk::raii::CommandBuffer& cmd,
+                                          std::size_t frame_idx,
+                                          const vk::Extent2D& render_extent) {
+    // Previews are not the render, see last_integrator
+    const auto now = std::chrono::steady_clock::now();
+    if (checkpoint_path.empty() || !checkpoint_scene_hash || frame_count == 0 ||
+        last_integrator != Integrator::PathTracing || render_extent != swap_chain->extent ||
+        std::chrono::duration<double>(now - last_checkpoint_time).count() <
+            checkpoint_interval) {
+        return;
+    }
+    last_checkpoint_time = now;
+
+    const std::size_t num_pixels = std::size_t{render_extent.width} * render_extent.height;
+    const vk::DeviceSize accumulation_size = num_pixels * sizeof(GLSL::PixelAccumulation);
+    const vk::DeviceSize stats_size =
+        adaptive_threshold > 0 ? num_pixels * sizeof(GLSL::PixelStats) : 0;
+    const vk::DeviceSize size = accumulation_size + stats_size;
+    auto& frame = frames->frames_in_flight[frame_idx].extras;
+    if (!frame.checkpoint_buffer || frame.checkpoint_buffer->size != size) {
+        frame.checkpoint_buffer = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage = vk::BufferUsageFlagBits::eTransferDst,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Scratch);
+        frame.checkpoint_buffer->SetName("render checkpoint");
+    }
+
+    // After the tracing and reprojection of this frame. The next frames' wait for the copies.
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask =
+                GetTracePipelineStages() | vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+        }}},
+    });
+    cmd.copyBuffer(**pixel_accumulation_buffer, **frame.checkpoint_buffer,
+                   {{
+                       .srcOffset = 0,
+                       .dstOffset = 0,
+                       .size = accumulation_size,
+                   }});
+    if (stats_size > 0) {
+        cmd.copyBuffer(**pixel_stats_buffer, **frame.checkpoint_buffer,
+                       {{
+                           .srcOffset = 0,
+                           .dstOffset = accumulation_size,
+                           .size = stats_size,
+                       }});
+    }
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eHost | GetTracePipelineStages() |
+                            vk::PipelineStageFlagBits2::eComputeShader,
+            .dstAccessMask = vk::AccessFlagBits2::eHostRead,
         }}},
     });
 
-    frames->EndFrame();
+    frame.checkpoint = RenderCheckpoint{
+        .key = GetCheckpointKey(),
+        .view = last_camera_view,
+        .proj = last_camera_proj,
+        .width = render_extent.width,
+        .height = render_extent.height,
+        .frame_count = frame_count,
+        .accumulated_samples = accumulated_samples,
+        .sample_offset = sample_offset,
+        .seed = sampler_seed,
+        .stream = sample_stream,
+    };
+}
+
+void VulkanPathTracerHW::WriteCheckpoint(std::size_t frame_idx) {
+    auto& frame = frames->frames_in_flight[frame_idx].extras;
+    if (!frame.checkpoint) {
+        return;
+    }
+    auto checkpoint = std::move(*frame.checkpoint);
+    frame.checkpoint.reset();
+
+    vmaInvalidateAllocation(frame.checkpoint_buffer->allocator,
+                            frame.checkpoint_buffer->allocation, 0, VK_WHOLE_SIZE);
+    const auto* data =
+        static_cast<const u8*>(frame.checkpoint_buffer->allocation_info.pMappedData);
+    const std::size_t accumulation_size =
+        std::size_t{checkpoint.width} * checkpoint.height * sizeof(GLSL::PixelAccumulation);
+    checkpoint.accumulation.assign(data, data + accumulation_size);
+    checkpoint.stats.assign(data + accumulation_size, data + frame.checkpoint_buffer->size);
+
+    // Written one at a time, each over the last
+    if (checkpoint_write.valid()) {
+        checkpoint_write.wait();
+    }
+    checkpoint_write = std::async(
+        std::launch::async, [path = checkpoint_path, checkpoint = std::move(checkpoint)] {
+            if (WriteRenderCheckpoint(path, checkpoint)) {
+                SPDLOG_INFO("Wrote checkpoint {} at {} samples per pixel", path.string(),
+                            checkpoint.accumulated_samples);
+            }
+        });
+}
+
+void VulkanPathTracerHW::Trace(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                               u32 uniforms_offset, const vk::Extent2D& render_extent) {
+    BindTracePipeline(cmd, frame_idx, uniforms_offset);
+    TraceRegion(cmd, render_extent, {.extent = render_extent});
+    TraceBarrier(cmd);
+}
+
+bool VulkanPathTracerHW::SupportsTiledTracing() const {
+    return true;
+}
+
+bool VulkanPathTracerHW::SupportsCostHeatmap() const {
+    return true;
+}
+
+bool VulkanPathTracerHW::SupportsRayStats() const {
+    // The counts are added up over the subgroups
+    const auto subgroup_properties =
+        device->physical_device
+            .getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceSubgroupProperties>()
+            .get<vk::PhysicalDeviceSubgroupProperties>();
+    return (subgroup_properties.supportedStages & vk::ShaderStageFlagBits::eRaygenKHR) &&
+           (subgroup_properties.supportedOperations & vk::SubgroupFeatureFlagBits::eArithmetic);
+}
+
+bool VulkanPathTracerHW::SupportsReSTIR() const {
+    return true;
+}
+
+bool VulkanPathTracerHW::SupportsPathGuiding() const {
+    return true;
+}
+
+bool VulkanPathTracerHW::SupportsIntegrators() const {
+    return true;
+}
+
+void VulkanPathTracerHW::BindTracePipeline(const vk::raii::CommandBuffer& cmd,
+                                           std::size_t frame_idx, u32 uniforms_offset) {
+    cmd.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, **pipeline);
+    VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eRayTracingKHR,
+                               *pipeline->pipeline_layout, 0,
+                               {
+                                   {*fixed_descriptor_set, 0},
+                                   {*image_descriptor_sets, frame_idx},
+                                   {*scene->texture_streamer->descriptor_sets, frame_idx},
+                               },
+                               {uniforms_offset});
+}
 
-    device->graphics_queue.submit(
+void VulkanPathTracerHW::TraceRegion(const vk::raii::CommandBuffer& cmd,
+                                     const vk::Extent2D& render_extent,
+                                     const vk::Rect2D& region) {
+    cmd.pushConstants<GLSL::TracePushConstant>(
+        *pipeline->pipeline_layout, TraceStages, 0,
         {{
-            .commandBufferCount = 1,
-            .pCommandBuffers = TempArr<vk::CommandBuffer>{*frame.command_buffer},
-            .signalSemaphoreCount = 1,
-            .pSignalSemaphores = TempArr<vk::Semaphore>{*frame.render_finished_semaphore},
-        }},
-        *frame.in_flight_fence);
-    PostprocessAndPresent(*frame.render_finished_semaphore);
+            .tile_offset = {static_cast<u32>(region.offset.x), static_cast<u32>(region.offset.y)},
+            .render_extent = {render_extent.width, render_extent.height},
+        }});
+    pipeline->TraceRays(cmd, region.extent.width, region.extent.height, 1);
+}
+
+const vk::raii::CommandBuffer& VulkanPathTracerHW::TraceTiles(std::size_t frame_idx,
+                                                              u32 uniforms_offset,
+                                                              const vk::Extent2D& render_extent,
+                                                              vk::Semaphore wait_semaphore) {
+    // Nearest to the center first, where the viewer looks
+    auto tiles = frame_arena.MakeVector<vk::Rect2D>();
+    for (u32 y = 0; y < render_extent.height; y += tile_size) {
+        for (u32 x = 0; x < render_extent.width; x += tile_size) {
+            tiles.push_back({
+                .offset = {static_cast<s32>(x), static_cast<s32>(y)},
+                .extent = {std::min(tile_size, render_extent.width - x),
+                           std::min(tile_size, render_extent.height - y)},
+            });
+        }
+    }
+    // Ties broken by position rather than with a stable sort, which would allocate
+    const auto DistanceToCenter = [&render_extent](const vk::Rect2D& tile) {
+        const double dx = tile.offset.x + tile.extent.width * 0.5 - render_extent.width * 0.5;
+        const double dy = tile.offset.y + tile.extent.height * 0.5 - render_extent.height * 0.5;
+        return std::tuple{dx * dx + dy * dy, tile.offset.y, tile.offset.x};
+    };
+    std::ranges::sort(tiles, {}, DistanceToCenter);
+
+    // One tile each until the time of the samples is known
+    const double tile_time = pixel_sample_time * tile_size * tile_size * frame_samples;
+    const std::size_t tiles_per_submit =
+        tile_time > 0 ? std::max<std::size_t>(static_cast<std::size_t>(submit_time / tile_time), 1)
+                      : 1;
+    const std::size_t num_submits = (tiles.size() + tiles_per_submit - 1) / tiles_per_submit;
+
+    auto& frame = frames->frames_in_flight[frame_idx];
+    auto& tile_command_buffers = frame.extras.tile_command_buffers;
+    if (tile_command_buffers.size() + 1 < num_submits) {
+        vk::raii::CommandBuffers command_buffers{
+            **device,
+            {
+                .commandPool = *device->command_pool,
+                .level = vk::CommandBufferLevel::ePrimary,
+                .commandBufferCount =
+                    static_cast<u32>(num_submits - 1 - tile_command_buffers.size()),
+            }};
+        for (auto& command_buffer : command_buffers) {
+            tile_command_buffers.emplace_back(std::move(command_buffer));
+        }
+    }
+
+    const vk::raii::CommandBuffer* cmd = &frame.command_buffer;
+    for (std::size_t submit = 0; submit < num_submits; ++submit) {
+        if (submit > 0) {
+            // Only the first submission waits for the memory of the streamed textures
+            cmd->end();
+            const bool wait_binds = submit == 1 && wait_semaphore;
+            device->Submit(device->graphics_queue, {{
+                .waitSemaphoreCount = wait_binds ? 1u : 0u,
+                .pWaitSemaphores = &wait_semaphore,
+                .pWaitDstStageMask =
+                    TempArr<vk::PipelineStageFlags>{vk::PipelineStageFlagBits::eAllCommands},
+                .commandBufferCount = 1,
+                .pCommandBuffers = TempArr<vk::CommandBuffer>{**cmd},
+            }});
+            cmd = &tile_command_buffers[submit - 1];
+            cmd->reset();
+            cmd->begin({});
+        }
+        BindTracePipeline(*cmd, frame_idx, uniforms_offset);
+        const std::size_t end = std::min((submit + 1) * tiles_per_submit, tiles.size());
+        for (std::size_t i = submit * tiles_per_submit; i < end; ++i) {
+            TraceRegion(*cmd, render_extent, tiles[i]);
+        }
+    }
+    TraceBarrier(*cmd);
+    return *cmd;
+}
+
+void VulkanPathTracerHW::TraceBarrier(const vk::raii::CommandBuffer& cmd) {
+    // The pixel accumulation and statistics are read back by the next frame
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eRayTracingShaderKHR,
+            .dstAccessMask =
+                vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite,
+        }}},
+    });
 }
 
 void VulkanPathTracerHW::OnResized(const vk::Extent2D& actual_extent) {
     VulkanRenderer::OnResized(actual_extent);
+    // Otherwise the accumulation is kept while the render extent is, see DrawFrame
+    if (!render_targets_resized) {
+        return;
+    }
+    CreatePixelBuffers();
+    fixed_descriptor_set->UpdateDescriptor(5, DescriptorBinding::BuffersValue{{
+                                                  .buffers = {{**pixel_stats_buffer}},
+                                              }});
+    fixed_descriptor_set->UpdateDescriptor(6, DescriptorBinding::BuffersValue{{
+                                                  .buffers = {{**pixel_aovs_buffer}},
+                                              }});
+    fixed_descriptor_set->UpdateDescriptor(11, DescriptorBinding::BuffersValue{{
+                                                   .buffers = {{**pixel_accumulation_buffer}},
+                                               }});
+    fixed_descriptor_set->UpdateDescriptor(12, DescriptorBinding::BuffersValue{{
+                                                   .buffers = {{**pixel_first_hits_buffer}},
+                                               }});
+    fixed_descriptor_set->UpdateDescriptor(13, DescriptorBinding::BuffersValue{{
+                                                   .buffers = {{**pixel_costs_buffer}},
+                                               }});
+    fixed_descriptor_set->UpdateDescriptor(18, DescriptorBinding::BuffersValue{{
+                                                   .buffers = {{**light_reservoirs_buffer}},
+                                               }});
     image_descriptor_sets->UpdateDescriptor(
-        0, DescriptorBinding::CombinedImageSamplersValue{
-               {
-                   .images = {{
-                       .image = *pp_frames->frames_in_flight[0].extras.image_view,
-                       .layout = vk::ImageLayout::eGeneral,
-                   }},
-               },
-               {
-                   .images = {{
-                       .image = *pp_frames->frames_in_flight[1].extras.image_view,
-                       .layout = vk::ImageLayout::eGeneral,
-                   }},
-               },
-           });
+        0, DescriptorBinding::CombinedImageSamplersValue{GetOffscreenImages()});
+    if (reprojection) {
+        CreateReprojectResources();
+    }
+    if (denoise) {
+        CreateDenoiseResources();
+    }
+    if (cost_heatmap) {
+        CreateHeatmapResources();
+    }
+    frame_count = 0;
+}
+
+void VulkanPathTracerHW::SetSubScene(std::size_t index) {
+    if (index < tlases.size() && !tlases[index]) {
+        SPDLOG_ERROR("Sub scene {} has no meshes", index);
+        throw std::runtime_error("Sub scene has no meshes");
+    }
+    VulkanRenderer::SetSubScene(index);
+
+    // The descriptor set may still be in use by the other frame in flight
+    device->WaitQueueIdle(device->graphics_queue);
+    fixed_descriptor_set->UpdateDescriptor(0, DescriptorBinding::AccelStructuresValue{{
+                                                  .accel_structures = {{**tlases[index]}},
+                                              }});
+    CreateLightBuffers();
+    UpdateLightDescriptors();
+    ResetGuiding();
+    frame_count = 0;
+}
+
+void VulkanPathTracerHW::ResetAccumulation() {
+    frame_count = 0;
+}
+
+bool VulkanPathTracerHW::IsInTLAS(std::size_t mesh) const {
+    return blases.at(mesh) != nullptr; // Like GetTLASInstances
+}
+
+bool VulkanPathTracerHW::SupportsFusedPostprocess() const {
+    return true;
+}
+
+void VulkanPathTracerHW::OnSceneUpdated(const SceneChanges& changes) {
+    if (changes.materials) {
+        UploadMaterials();
+        fixed_descriptor_set->UpdateDescriptor(2, DescriptorBinding::BuffersValue{{
+                                                      .buffers = {{**materials_buffer}},
+                                                  }});
+    }
+    if (changes.transforms) {
+        SwapInPendingTLASes(true);
+        // The BLASes stay as they are, but for those of deformed instances, which are refit. The
+        // first time, the TLASes are rebuilt to allow updates, as the transforms are likely to
+        // keep changing, and refit in place from then on.
+        UpdateMeshDeformers();
+        const bool can_update = std::ranges::all_of(
+            tlases, [](const auto& tlas) { return !tlas || tlas->AllowsUpdate(); });
+        if (can_update) {
+            for (std::size_t i = 0; i < tlases.size(); ++i) {
+                if (tlases[i]) {
+                    tlases[i]->Update(GetTLASInstances(*scene, *scene->sub_scenes[i], blases,
+                                                       GetMeshDeformer(i)));
+                }
+            }
+        } else {
+            tlases = BuildTLASes(nullptr, true);
+            WaitForAccelStructures();
+            fixed_descriptor_set->UpdateDescriptor(
+                0, DescriptorBinding::AccelStructuresValue{{
+                       .accel_structures = {{**tlases[sub_scene_idx]}},
+                   }});
+        }
+    }
+    if (changes.materials || changes.transforms) { // Moved the lights or changed their power
+        CreateLightBuffers(true);
+        UpdateLightDescriptors();
+        ResetGuiding();
+    }
+    if (checkpoint_scene_hash) {
+        SPDLOG_WARN("Scene was updated in place, no longer writing checkpoints");
+        checkpoint_scene_hash.reset();
+    }
     frame_count = 0;
 }
 
+void VulkanPathTracerHW::OnBuffersMoved(const std::vector<VulkanBuffer*>& buffers) {
+    // The contents stay the same, so the accumulated samples are kept
+    for (const auto* buffer : buffers) {
+        if (buffer == primitives_buffer.get()) {
+            fixed_descriptor_set->UpdateDescriptor(1, DescriptorBinding::BuffersValue{{
+                                                          .buffers = {{**primitives_buffer}},
+                                                      }});
+        } else if (buffer == materials_buffer.get()) {
+            fixed_descriptor_set->UpdateDescriptor(2, DescriptorBinding::BuffersValue{{
+                                                          .buffers = {{**materials_buffer}},
+                                                      }});
+        }
+    }
+}
+
+void VulkanPathTracerHW::AddSceneStats(SceneStats& stats) const {
+    const auto Add = [](SceneStats::AccelStructures& out,
+                        const std::vector<std::unique_ptr<VulkanAccelStructure>>& structures) {
+        // Null for those not built yet, or for empty sub scenes
+        for (const auto& structure : structures) {
+            if (structure) {
+                ++out.count;
+                out.build_bytes += structure->build_size;
+                out.bytes += structure->GetSize();
+            }
+        }
+    };
+    Add(stats.blases, blases);
+    Add(stats.tlases, tlases);
+}
+
 void VulkanPathTracerHW::SetLightProperties(float multiplier_, float ambient_light_) {
     intensity_multiplier = multiplier_;
     ambient_light = ambient_light_;
 }
 
+void VulkanPathTracerHW::SetHostBuilds(bool enabled) {
+    host_builds = enabled;
+}
+
+void VulkanPathTracerHW::SetFastFirstBuilds(bool enabled) {
+    fast_first_builds = enabled;
+}
+
+void VulkanPathTracerHW::SetProgressiveBuilds(bool enabled) {
+    progressive_builds = enabled;
+}
+
+void VulkanPathTracerHW::SetGPUInstances(bool enabled, float cull_distance,
+                                         float min_projected_size) {
+    gpu_instances = enabled;
+    instance_cull_distance = cull_distance;
+    instance_min_projected_size = min_projected_size;
+}
+
+void VulkanPathTracerHW::SetAdaptiveSampling(float threshold) {
+    adaptive_threshold = threshold;
+}
+
+void VulkanPathTracerHW::SetReprojection(bool enabled) {
+    reprojection = enabled;
+}
+
+void VulkanPathTracerHW::SetReSTIR(u32 candidates) {
+    restir_candidates = candidates;
+}
+
+void VulkanPathTracerHW::SetPathGuiding(bool enabled) {
+    path_guiding = enabled;
+}
+
+void VulkanPathTracerHW::SetIntegrator(Integrator integrator_) {
+    if (integrator_ != Integrator::PathTracing && !SupportsIntegrators()) {
+        SPDLOG_WARN("Renderer has no preview integrators, path tracing");
+        return;
+    }
+    integrator = integrator_; // The next frame starts over, see last_integrator
+}
+
+void VulkanPathTracerHW::SetMotionIntegrator(Integrator integrator_) {
+    if (integrator_ != Integrator::PathTracing && !SupportsIntegrators()) {
+        SPDLOG_WARN("Renderer has no preview integrators, path tracing while moving");
+        return;
+    }
+    motion_integrator = integrator_;
+}
+
+void VulkanPathTracerHW::SetDenoising(bool enabled, bool fixed_rate_compression) {
+    denoise = enabled;
+    fixed_rate_denoise = fixed_rate_compression;
+}
+
+void VulkanPathTracerHW::SetPicking(bool enabled) {
+    picking = enabled;
+}
+
+void VulkanPathTracerHW::SetCostHeatmap(bool enabled) {
+    cost_heatmap = enabled;
+}
+
+std::vector<VulkanPathTracerHW::MaterialCost> VulkanPathTracerHW::GetMaterialCosts() const {
+    auto costs = material_costs;
+    std::ranges::sort(costs, std::greater{}, &MaterialCost::cycles);
+    return costs;
+}
+
+void VulkanPathTracerHW::SetRayStats(bool enabled) {
+    ray_stats = enabled;
+}
+
+std::optional<VulkanPathTracerHW::RayStats> VulkanPathTracerHW::GetRayStats(bool total) const {
+    return total ? total_ray_stats : last_ray_stats;
+}
+
+VulkanPathTracerHW::RayStats& VulkanPathTracerHW::RayStats::operator+=(const RayStats& other) {
+    camera_rays += other.camera_rays;
+    bounce_rays += other.bounce_rays;
+    shadow_rays += other.shadow_rays;
+    paths += other.paths;
+    roulette_terminations += other.roulette_terminations;
+    nan_samples += other.nan_samples;
+    milliseconds += other.milliseconds;
+    return *this;
+}
+
+double VulkanPathTracerHW::RayStats::GetMraysPerSecond() const {
+    if (milliseconds <= 0) {
+        return 0;
+    }
+    return static_cast<double>(camera_rays + bounce_rays + shadow_rays) / (milliseconds * 1e3);
+}
+
+double VulkanPathTracerHW::RayStats::GetAveragePathLength() const {
+    if (paths == 0) {
+        return 0;
+    }
+    return static_cast<double>(camera_rays + bounce_rays) / paths;
+}
+
+void VulkanPathTracerHW::SetEnvironmentMap(std::filesystem::path path, float intensity) {
+    environment_map_path = std::move(path);
+    environment_intensity = intensity;
+    environment_map.reset();
+}
+
+void VulkanPathTracerHW::SetSamplerSeed(u32 seed) {
+    camera_properties_changed |= sampler_seed != seed;
+    sampler_seed = seed;
+}
+
+void VulkanPathTracerHW::SetSampleStream(u32 stream) {
+    camera_properties_changed |= sample_stream != stream;
+    sample_stream = stream;
+}
+
+void VulkanPathTracerHW::SetCheckpointing(std::filesystem::path path, double interval_seconds) {
+    checkpoint_path = std::move(path);
+    checkpoint_interval = interval_seconds;
+}
+
+void VulkanPathTracerHW::SetConvergence(u32 target_samples_, bool adaptive) {
+    target_samples = target_samples_;
+    converge_adaptively = adaptive;
+}
+
+bool VulkanPathTracerHW::IsConverged() const {
+    const bool pending = frame_count == 0 || camera_properties_changed ||
+                         integrator != last_integrator || !pending_tlases.empty() ||
+                         !blas_upgrades.empty() || progressive_builder ||
+                         specialized_pipeline.valid() ||
+                         (scene->lazy_texture_loader && !scene->lazy_texture_loader->IsDone());
+    if (pending) {
+        return false;
+    }
+    return (target_samples > 0 && accumulated_samples >= target_samples) ||
+           converged_accumulation == accumulation_id;
+}
+
+void VulkanPathTracerHW::SetSampling(u32 samples_per_frame_, u32 max_depth_,
+                                     float russian_roulette_, u32 roulette_depth_) {
+    // Paths of other lengths converge to something else, and Russian roulette to the same with
+    // other noise, which should not be mixed into the accumulation either
+    camera_properties_changed |= max_depth != max_depth_ ||
+                                 russian_roulette != russian_roulette_ ||
+                                 roulette_depth != roulette_depth_;
+    samples_per_frame = samples_per_frame_;
+    max_depth = max_depth_;
+    russian_roulette = russian_roulette_;
+    roulette_depth = roulette_depth_;
+    sample_budget = samples_per_frame;
+}
+
+void VulkanPathTracerHW::SetTracePasses(u32 passes) {
+    trace_passes = std::clamp(passes, 1u, MaxTracePasses);
+}
+
+void VulkanPathTracerHW::SetTiledTracing(u32 tile_size_, double submit_milliseconds) {
+    tile_size = tile_size_;
+    submit_time = submit_milliseconds;
+}
+
+void VulkanPathTracerHW::SetTargetTraceTime(double milliseconds) {
+    target_trace_time = milliseconds;
+    sample_budget = samples_per_frame;
+}
+
 void VulkanPathTracerHW::SetCameraProperties(float focal_dist_, float aperture_) {
     camera_properties_changed = (focal_dist != focal_dist_ || aperture != aperture_);
     focal_dist = focal_dist_;
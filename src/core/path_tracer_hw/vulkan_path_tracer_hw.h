@@ -4,19 +4,40 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <limits>
 #include <memory>
+#include <optional>
+#include <span>
+#include <string>
 #include <utility>
 #include <vector>
 #include <vulkan/vulkan_raii.hpp>
+#include "core/path_tracer_hw/render_checkpoint.h"
+#include "core/scene_cache.h"
+#include "core/vulkan/vulkan_render_graph.h"
 #include "core/vulkan_renderer.h"
 
 namespace Renderer {
 
+class EnvironmentMap;
+class LightTree;
+class LoadProfiler;
+class MeshDeformer;
 class VulkanAccelStructure;
+class VulkanBLASBuilder;
+class VulkanBuffer;
+class VulkanComputePipeline;
+class VulkanImage;
 class VulkanImmUploadBuffer;
 class VulkanTexture;
 class VulkanRayTracingPipeline;
 class VulkanDescriptorSets;
+class VulkanFrameAllocator;
 
 class VulkanPathTracerHW : public VulkanRenderer {
 public:
@@ -24,38 +45,589 @@ public:
                                 std::vector<const char*> frontend_required_extensions);
     ~VulkanPathTracerHW() override;
 
-    void Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_extent) override;
     void LoadScene(GLTF::Container& gltf) override;
     void DrawFrame(const Camera& external_camera, bool force_external_camera) override;
     void OnResized(const vk::Extent2D& actual_extent) override;
+    void SetSubScene(std::size_t index) override;
     void SetLightProperties(float multiplier, float ambient_light);
     void SetCameraProperties(float focal_dist, float aperture);
+    // Builds the BLASes on the host with the worker threads, where the device supports it, so
+    // that only their compaction runs on the GPU. Must be called before LoadScene.
+    void SetHostBuilds(bool enabled);
+    // Builds the BLASes for speed while loading, so that the scene is shown sooner. They are
+    // then rebuilt for tracing speed in the background and swapped in once all are done. Must be
+    // called before LoadScene.
+    void SetFastFirstBuilds(bool enabled);
+    // Returns from LoadScene once the BLASes of the first meshes to trace are built, building
+    // the rest in the background. The TLASes are rebuilt over the BLASes built so far as rounds
+    // of them complete, so that the scene fills in while the frames accumulate. Only applies to
+    // device builds. Must be called before LoadScene.
+    void SetProgressiveBuilds(bool enabled);
+    // Writes the instances of the TLASes on the GPU from a table of the instances of each sub
+    // scene, instead of on the host, for scenes of very many instances. Instances farther than
+    // cull_distance from the camera, or whose bounds have a radius below min_projected_size
+    // times their distance, are culled (0 culls none), in which case the TLAS is rebuilt as the
+    // camera moves. Must be called before LoadScene.
+    void SetGPUInstances(bool enabled, float cull_distance = 0, float min_projected_size = 0);
+    // Stops tracing pixels once the standard error of their mean luminance, relative to it, is
+    // below the threshold. 0 traces all pixels every frame. Must be called before LoadScene.
+    void SetAdaptiveSampling(float threshold);
+    // Samples of each pixel every frame, and bounces of each path at most. From roulette_depth
+    // bounces on, paths go on with the luminance of their throughput as the probability, at
+    // least russian_roulette (Russian roulette, 1 disables it), so that their length adapts.
+    void SetSampling(u32 samples_per_frame, u32 max_depth, float russian_roulette,
+                     u32 roulette_depth);
+    // Adjusts the samples of each frame so that tracing it takes about this long, starting from
+    // those set. 0 always takes those, e.g. for batches to trace as many as they are given.
+    void SetTargetTraceTime(double milliseconds);
+    // Traces this many passes of the samples of each frame into the accumulation (at most
+    // MaxTracePasses) while the camera is still, recorded into the one submission, before the
+    // frame is postprocessed and presented. Final renders then trace rather than wait for the
+    // presentation (e.g. for vsync). Takes the target trace time for each pass, and stops at
+    // the samples to converge at. Passes do not apply to tiled tracing.
+    void SetTracePasses(u32 passes);
+    // Traces each frame in square tiles of this many pixels, from the center out, over several
+    // submissions of about this many milliseconds each, so that frames of many samples do not
+    // starve the compositor or time out. A tile size of 0 traces each frame at once. Only
+    // applies to the ray tracing pipeline.
+    void SetTiledTracing(u32 tile_size, double submit_milliseconds);
+    // Reuses the accumulation where the first hits of the pixels were seen before the camera
+    // moved, instead of starting over, see reproject.comp. Must be called before LoadScene.
+    void SetReprojection(bool enabled);
+    // Resamples the light samples of the first hits from this many candidates each, and reuses
+    // those the last frame kept where the hits were seen and around there (ReSTIR), see
+    // restir.glsl. Biased, but far less noisy with many lights. 0 samples one light per hit.
+    // Only applies to the ray tracing pipeline. Must be called before LoadScene.
+    void SetReSTIR(u32 candidates);
+    // Samples the bounces from histograms of the directions radiance arrived from in a hash
+    // grid over the scene as well as from the BSDFs, learning them from the paths of each frame,
+    // see path_guiding.glsl. For indirect lighting through small openings. Only applies to the
+    // ray tracing pipeline. Must be called before LoadScene.
+    void SetPathGuiding(bool enabled);
+    // What the frames trace. The previews end the paths at their first hits (but for the one of
+    // fewer bounces), for placing the camera and checking assets far faster than the full light
+    // transport on large scenes.
+    enum class Integrator {
+        PathTracing,      // Global illumination
+        AmbientOcclusion, // Of a cosine distributed ray per sample, see AmbientOcclusionRange
+        DirectLighting,   // Emission and light samples of the first hits
+        Albedo,           // Base color of the first hits
+        Normals,          // Shading normals of the first hits, mapped to [0, 1]
+        FewBounces,       // Global illumination of at most PreviewMaxDepth bounces
+    };
+    // Switches the integrator, without reloading the scene. The accumulation starts over. Only
+    // applies to the ray tracing pipeline.
+    void SetIntegrator(Integrator integrator);
+    // Traces with this integrator instead while the camera moves, switching back once it stops,
+    // so that moving through large scenes stays responsive. PathTracing disables it.
+    void SetMotionIntegrator(Integrator integrator);
+    // Filters the accumulated image of each frame before presenting it, guided by the albedo
+    // and normal of the first hits, so that few samples already give a clean preview. Must be
+    // called before LoadScene. With fixed_rate_compression, the images the filter passes write
+    // ask for lossy compression at the default fixed rate of the driver, trading their
+    // precision for bandwidth (where the device has image_compression_control).
+    void SetDenoising(bool enabled, bool fixed_rate_compression = false);
+    // Presents the clock cycles the ray generation shader spent on each pixel of the frame as a
+    // false-color heatmap instead of the image, and sums those the closest hit shader spent on
+    // the hits of each material, see GetMaterialCosts. Only applies to the ray tracing
+    // pipeline. Must be called before LoadScene.
+    void SetCostHeatmap(bool enabled);
+    struct MaterialCost {
+        std::string name;
+        u64 cycles{};
+        u64 num_hits{};
+    };
+    // Summed over the frames read back since the scene was loaded, most expensive first. Empty
+    // without the cost heatmap.
+    std::vector<MaterialCost> GetMaterialCosts() const;
+    // Counts the rays of each frame, see GetRayStats. Only applies to the ray tracing pipeline,
+    // on devices with subgroup arithmetic in ray generation shaders.
+    void SetRayStats(bool enabled);
+    struct RayStats {
+        u64 camera_rays{};
+        u64 bounce_rays{};
+        u64 shadow_rays{};
+        u64 paths{}; // Samples traced
+        u64 roulette_terminations{};
+        u64 nan_samples{};
+        double milliseconds{}; // Of tracing on the GPU
 
-private:
+        RayStats& operator+=(const RayStats& other);
+        // Of all the rays
+        double GetMraysPerSecond() const;
+        // Rays traced per path, shadow rays excluded
+        double GetAveragePathLength() const;
+    };
+    // Of the last frame read back, or summed over the frames read back since the scene was
+    // loaded. Empty until a frame with ray stats is read back.
+    std::optional<RayStats> GetRayStats(bool total = false) const;
+    // Lights the scene with the equirectangular HDR image (Radiance .hdr) instead of the ambient
+    // light, scaled by the intensity. Must be called before LoadScene.
+    void SetEnvironmentMap(std::filesystem::path path, float intensity);
+    // Scrambles the sample sequences of the pixels with the seed, so that the samples (and
+    // images) are reproducible. Random for each renderer by default.
+    void SetSamplerSeed(u32 seed);
+    // Traces the samples of the stream, a range of SamplesPerStream sample indices of its own.
+    // Renderers with the same seed and different streams, e.g. the jobs of a frame on different
+    // machines, trace disjoint parts of the same sequences, so that their sums can be merged.
+    void SetSampleStream(u32 stream);
+    // Writes the accumulation to the file every this many seconds, in the background, and
+    // resumes the render from it where the scene, the settings, the camera and the extent are
+    // those it was written with, e.g. once the process was stopped, or on another machine. The
+    // seed and stream are then those of the checkpoint. An empty path disables checkpoints. Must
+    // be called before LoadScene.
+    void SetCheckpointing(std::filesystem::path path, double interval_seconds);
+    // Of each pixel, accumulated by the frames drawn since the accumulation was last reset. An
+    // upper bound when sampling adaptively, and without those reprojected.
+    u32 GetAccumulatedSamples() const noexcept {
+        return accumulated_samples;
+    }
+    // Accumulates anew from the next frame, e.g. to render the same view again from scratch
+    void ResetAccumulation();
+    // Considers the image converged, see IsConverged, once each pixel has target_samples
+    // samples (0 never), or if adaptive, once adaptive sampling stops tracing every pixel of a
+    // frame. Those frames are told apart by their ray stats, which are counted for it where
+    // they can be, see SetRayStats. Must be called before LoadScene.
+    void SetConvergence(u32 target_samples, bool adaptive);
+    // Whether drawing more frames would leave the image as it is: it has converged, and nothing
+    // starts the accumulation over or completes in the background, e.g. builds and lazy textures.
+    // Moving the camera still does, which the caller compares itself.
+    bool IsConverged() const;
+    // Lets Pick trace rays, from a compute shader with ray queries. Must be called before Init.
+    void SetPicking(bool enabled);
+    struct PickRay {
+        glm::vec3 origin{};
+        glm::vec3 direction{}; // Distances are in lengths of it
+        float max_distance = std::numeric_limits<float>::infinity();
+    };
+    struct PickHit {
+        // In the sub scene, ~0 with generated TLAS instances, see SetGPUInstances
+        u32 instance{};
+        u32 mesh{};
+        u32 primitive{}; // In the mesh
+        u32 triangle{};  // In the primitive
+        glm::vec2 barycentrics{}; // Of the second and third vertices of the triangle
+        float distance{};
+    };
+    // Gets the closest hit of each ray in order, or none if it hit nothing
+    using PickCallback = std::function<void(std::span<const std::optional<PickHit>>)>;
+    // Traces the rays against the TLAS of the sub scene with the next frame, e.g. for selecting
+    // objects or measuring distances in an editor. Every geometry is opaque to them. The callback
+    // is called by the DrawFrame that reuses the frame in flight, once its GPU work is done.
+    // Rays beyond MaxPicksPerFrame in a frame wait for the next ones, so batches are limited to
+    // that many. Without picking enabled, or a TLAS of the sub scene, the rays hit nothing.
+    void Pick(std::vector<PickRay> rays, PickCallback callback);
+
+    static constexpr u32 SamplesPerStream = 1u << 20;
+    static constexpr std::size_t MaxPicksPerFrame = 4096;
+
+protected:
+    // Interface for tracing some other way than the ray tracing pipeline, over the same
+    // acceleration structures and descriptor sets
     OffscreenImageInfo GetOffscreenImageInfo() const override;
-    std::unique_ptr<VulkanDevice> CreateDevice(vk::SurfaceKHR surface,
-                                               const vk::Extent2D& actual_extent) const override;
+    // Of the descriptor sets created by LoadScene
+    virtual vk::ShaderStageFlags GetTraceStages() const;
+    // That read the scene buffers and write the offscreen images
+    virtual vk::PipelineStageFlags2 GetTracePipelineStages() const;
+    // Called by LoadScene once the descriptor sets are created
+    virtual void CreatePipeline();
+    void OnSceneUpdated(const SceneChanges& changes) override;
+    void OnBuffersMoved(const std::vector<VulkanBuffer*>& buffers) override;
+    void AddSceneStats(SceneStats& stats) const override;
+    // Records tracing into the pixel accumulation and the offscreen image of the frame, which gets
+    // the mean of the accumulated samples. The uniforms are at the offset into the frame
+    // allocator's buffer.
+    virtual void Trace(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                       u32 uniforms_offset, const vk::Extent2D& render_extent);
+    // Whether the tracing of Trace can be split into tiles, see SetTiledTracing
+    virtual bool SupportsTiledTracing() const;
+    // Whether the shaders of Trace measure the costs of the pixels and materials, see
+    // SetCostHeatmap, and count their rays, see SetRayStats
+    virtual bool SupportsCostHeatmap() const;
+    virtual bool SupportsRayStats() const;
+    // Whether the shaders of Trace resample the light samples of the first hits, see SetReSTIR,
+    // and guide their paths, see SetPathGuiding
+    virtual bool SupportsReSTIR() const;
+    virtual bool SupportsPathGuiding() const;
+    // Whether the shaders of Trace have the preview integrators, see SetIntegrator
+    virtual bool SupportsIntegrators() const;
+    // Whether the instances of the mesh are in the TLASes, which skip meshes without a BLAS
+    bool IsInTLAS(std::size_t mesh) const;
+    // Whether the camera rays start on the aperture rather than a pinhole, see
+    // SetCameraProperties
+    bool HasDepthOfField() const noexcept {
+        return focal_dist != 0;
+    }
+
+    // Most samples of each frame when time-boxed
+    static constexpr u32 MaxSamplesPerFrame = 64;
+    // Most passes of them, see SetTracePasses
+    static constexpr u32 MaxTracePasses = 16;
+    u32 trace_passes = 1;
+    // Of each pass of the frame being traced
+    u32 frame_samples = 8;
+    u32 max_depth = 50;
+    u32 samples_per_frame = 8;
+    float russian_roulette = 0.1f;
+    u32 roulette_depth = 3;
+    float intensity_multiplier = 20.0;
+    float ambient_light = 5.0;
+    float focal_dist = 0;
+    float aperture = 0.5;
+    bool camera_properties_changed = false;
+    u32 frame_count = 0;
+    u32 accumulated_samples = 0; // Of each pixel since frame 0, the first index of the next
+    u32 sampler_seed;
+    u32 sample_stream = 0;
+
+    // Set 0 has the TLAS, primitives, materials, textures, uniforms, pixel statistics, pixel
+    // AOVs, emissive triangles, light tree, environment map and its CDFs, the pixel
+    // accumulation and first hits, the pixel and material costs, the ray stats, the light
+    // offsets, the punctual lights, the light reservoirs, and the path guiding records and
+    // distributions, in that order. Set 1 is the offscreen image of the frame, and set 2 the
+    // texture streaming residency.
+    std::unique_ptr<VulkanDescriptorSets> fixed_descriptor_set;
+    std::unique_ptr<VulkanDescriptorSets> image_descriptor_sets;
+    std::unique_ptr<VulkanFrameAllocator> frame_allocator;
+
+private:
+    DeviceRequirements GetDeviceRequirements() const override;
+    GeometryRequirements GetGeometryRequirements(const VulkanDevice& device) const override;
+    void OnSceneShared() override;
+    // Waits for the specialized pipeline of the previous scene, and disables what the renderer
+    // or the device cannot do. Called before creating the resources of a scene.
+    void CheckSceneSettings();
+    // Builds the acceleration structures of the scene, then everything traced with them. The
+    // profiler and the glTF (for checkpoints) are those a scene was loaded with, null for
+    // scenes shared.
+    void CreateSceneResources(LoadProfiler* profiler, const GLTF::Container* gltf);
+    // In the last command buffer of the frame, after tracing and denoising
+    bool SupportsFusedPostprocess() const override;
+    // One per sub scene
+    std::vector<std::unique_ptr<VulkanAccelStructure>> BuildTLASes(LoadProfiler* profiler,
+                                                                   bool allow_update = false);
+    // Compacts and cleans up the TLASes
+    void WaitForAccelStructures();
+    // Of the sub scenes with deformed instances, deformed as they are posed and with their
+    // BLASes built, see mesh_deformers. Their primitives follow the num_primitives of the scene.
+    void CreateMeshDeformers(std::size_t num_primitives);
+    // Deforms the instances as they are now posed and refits their BLASes, before the TLASes
+    // are updated. Blocks until done.
+    void UpdateMeshDeformers();
+    // Of the sub scene, null if none of its instances are deformed
+    const MeshDeformer* GetMeshDeformer(std::size_t sub_scene) const;
+    // Advances the rebuilds of fast built BLASes. Once all are done, the TLASes are rebuilt over
+    // them in the background, see pending_tlases.
+    void UpgradeBLASes();
+    // Moves the progressive builds completed so far into the BLASes, and caches them once all
+    // are. Returns whether any were.
+    bool TakeProgressiveBLASes();
+    // Rebuilds the TLASes in the background over the progressive builds completed since they
+    // were last, once the previous rebuild has been swapped in
+    void AdvanceProgressiveBuilds();
+    // Swaps in the pending TLASes once they are done, or waits for them
+    void SwapInPendingTLASes(bool wait);
+    struct TracePipeline {
+        // Linked into the pipeline, if it was linked from libraries
+        std::vector<std::unique_ptr<VulkanRayTracingPipeline>> libraries;
+        std::unique_ptr<VulkanRayTracingPipeline> pipeline;
+    };
+    // With the closest hit shader of each hit group specialized for its flags, otherwise the
+    // generic one for all of them. Specialized pipelines are linked from libraries of their
+    // shaders where supported.
+    TracePipeline CreateTracePipeline(bool specialized,
+                                      const vk::raii::PipelineCache* pipeline_cache) const;
+    // Swaps in the specialized pipeline once it has been compiled, see CreatePipeline
+    void UpgradePipeline();
+    void UploadMaterials();
+    // Keeps the triangles of the emissive primitives, before their CPU copies are released
+    void GetEmissiveTriangles();
+    // Of the emissive triangles of the current sub scene, see GLSL::EmissiveTriangle. The light
+    // tree is refit if given and the triangles are those it was built over, e.g. as they moved.
+    void CreateLightBuffers(bool refit = false);
+    void UpdateLightDescriptors();
+    // Of the accumulation of each pixel of the swap chain, and of its statistics, AOVs and first
+    // hits when sampling adaptively, denoising and reprojecting respectively, otherwise
+    // placeholders. The accumulation and first hits are followed by their history when
+    // reprojecting.
+    void CreatePixelBuffers();
+    // Written by the tracing, imported into the render graph of the passes after it
+    struct TracedResources {
+        VulkanRenderGraph::Resource image; // Offscreen
+        VulkanRenderGraph::Resource accumulation;
+        VulkanRenderGraph::Resource first_hits;
+        VulkanRenderGraph::Resource aovs;
+        VulkanRenderGraph::Resource costs;
+        VulkanRenderGraph::Resource guide; // The records and distributions of path guiding
+    };
+    TracedResources ImportTracedResources(VulkanRenderGraph& graph, std::size_t frame_idx) const;
+    // Of the denoiser for the swap chain, which the postprocessing then reads
+    void CreateDenoiseResources();
+    // Returns the output
+    VulkanRenderGraph::Resource Denoise(VulkanRenderGraph& graph, const TracedResources& traced,
+                                        std::size_t frame_idx, const vk::Extent2D& render_extent);
+    // Of the material costs and ray stats, and those of the frames in flight they are copied
+    // out into
+    void CreateCounterBuffers();
+    // Adds the material costs and ray stats of the previous use of the frame in flight, which
+    // has completed, to the totals
+    void ReadCounters(std::size_t frame_idx);
+    // Resets the costs and ray stats of the frame before tracing, and copies out those of the
+    // materials and the ray stats after
+    void ClearCounters(const vk::raii::CommandBuffer& cmd);
+    void CopyCounters(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx);
+    // Of the rays picked and their hits for each frame in flight
+    void CreatePickResources();
+    // Traces the batches of rays picked that fit into the frame, against the TLAS the frame
+    // traces, see Pick
+    void RecordPicks(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                     u32 uniforms_offset);
+    // Calls back the batches of the previous use of the frame in flight, which has completed
+    void ReadPicks(std::size_t frame_idx);
+    // Of the heatmap, which writes the image presented
+    void CreateHeatmapResources();
+    void DrawHeatmap(VulkanRenderGraph& graph, const TracedResources& traced,
+                     VulkanRenderGraph::Resource image, std::size_t frame_idx,
+                     const vk::Extent2D& render_extent);
+    // Of path guiding, whose grid then covers the current sub scene, see ResetGuiding
+    void CreateGuideBuffers();
+    void CreateGuideResources();
+    // Forgets what the path guiding grid learned, e.g. as the lights changed, and fits its cells
+    // to the bounds of the current sub scene. Measures them for sub_scene_size either way.
+    void ResetGuiding();
+    // Clears the path guiding grid before the frame once it was reset
+    void ClearGuide(const vk::raii::CommandBuffer& cmd);
+    // Learns the distributions of the path guiding grid from what the frame recorded
+    void LearnGuide(VulkanRenderGraph& graph, const TracedResources& traced);
+    void CreateReprojectResources();
+    // Copies the accumulation and first hits of the previous camera into their history
+    void CopyHistory(const vk::raii::CommandBuffer& cmd, const vk::Extent2D& render_extent);
+    void Reproject(VulkanRenderGraph& graph, const TracedResources& traced, std::size_t frame_idx,
+                   const vk::Extent2D& render_extent, const glm::mat4& prev_view_proj,
+                   const glm::vec3& prev_camera_position);
+    // Like Trace, submitting the command buffer of the frame and further ones of its own for the
+    // tiles in turn. Returns the one still being recorded, after the last tile.
+    const vk::raii::CommandBuffer& TraceTiles(std::size_t frame_idx, u32 uniforms_offset,
+                                              const vk::Extent2D& render_extent,
+                                              vk::Semaphore wait_semaphore);
+    void BindTracePipeline(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                           u32 uniforms_offset);
+    void TraceRegion(const vk::raii::CommandBuffer& cmd, const vk::Extent2D& render_extent,
+                     const vk::Rect2D& region);
+    void TraceBarrier(const vk::raii::CommandBuffer& cmd);
+    // Of the scene and the settings that change what the accumulation converges to
+    SceneCache::Key GetCheckpointKey() const;
+    // Uploads the accumulation of the checkpoint read by LoadScene before the first frame is
+    // traced, continuing its sample sequences, if it was written for this render
+    void ResumeCheckpoint(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                          const vk::Extent2D& render_extent, const glm::mat4& view,
+                          const glm::mat4& proj);
+    // Copies out the accumulation of a frame to checkpoint once the interval has passed, after
+    // it was traced at full resolution
+    void RecordCheckpoint(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                          const vk::Extent2D& render_extent);
+    // Writes the checkpoint copied out by the previous use of the frame in flight, which has
+    // completed, in the background
+    void WriteCheckpoint(std::size_t frame_idx);
+    // Scales the sample budget and the render scale by how long tracing the samples of the frame
+    // took
+    void UpdateSampleBudget(std::size_t frame_idx, u32 num_samples, u32 num_pixels);
 
     std::unique_ptr<VulkanImmUploadBuffer> primitives_buffer;
     std::unique_ptr<VulkanImmUploadBuffer> materials_buffer;
     std::unique_ptr<VulkanTexture> error_texture;
+    std::unique_ptr<VulkanBuffer> pixel_stats_buffer;        // GLSL::PixelStats
+    std::unique_ptr<VulkanBuffer> pixel_aovs_buffer;         // GLSL::PixelAOV
+    std::unique_ptr<VulkanBuffer> pixel_accumulation_buffer; // GLSL::PixelAccumulation
+    std::unique_ptr<VulkanBuffer> pixel_first_hits_buffer;   // vec4, see reproject.comp
+    // Those of this frame and the last, see GLSL::PathTracerUniforms::reservoir_half
+    std::unique_ptr<VulkanBuffer> light_reservoirs_buffer; // GLSL::LightReservoir
+    std::unique_ptr<VulkanBuffer> pixel_costs_buffer;        // The maximum, then a u32 each
+    std::unique_ptr<VulkanBuffer> material_costs_buffer;     // GLSL::MaterialCost
+    // Indexed like the materials of the scene
+    std::vector<MaterialCost> material_costs;
+    std::unique_ptr<VulkanBuffer> ray_stats_buffer; // GLSL::RayStats
+    std::optional<RayStats> last_ray_stats;
+    std::optional<RayStats> total_ray_stats;
+
+    // Mesh space, of the emissive primitives of each mesh, for the lights of the sub scenes
+    struct MeshEmissiveTriangle {
+        u32 primitive{}; // In the mesh
+        u32 triangle{};
+        std::array<glm::vec3, 3> positions{};
+    };
+    std::vector<std::vector<MeshEmissiveTriangle>> mesh_emissive_triangles;
+    // Of the first emissive triangle of each primitive of the scene in those of its mesh, ~0 if
+    // it has none
+    std::vector<u32> primitive_light_offsets;
+    std::unique_ptr<LightTree> light_tree; // Of the current sub scene
+    std::unique_ptr<VulkanImmUploadBuffer> lights_buffer;     // GLSL::EmissiveTriangle
+    std::unique_ptr<VulkanImmUploadBuffer> light_tree_buffer; // GLSL::LightTreeNode
+    // The primitive light offsets, then the first light of each instance of the TLAS (~0 if it
+    // has none), to find the triangles hit by BSDF samples in the lights
+    std::unique_ptr<VulkanImmUploadBuffer> light_offsets_buffer;
+    u32 num_lights{}; // 0 if there are none, with a placeholder in the buffers
+    std::unique_ptr<VulkanImmUploadBuffer> punctual_lights_buffer; // GLSL::PunctualLight
+    u32 num_punctual_lights{};
+    std::unique_ptr<EnvironmentMap> environment_map;
+    std::unique_ptr<VulkanImmUploadBuffer> environment_cdf_placeholder; // Without a map
+
+    // Passes of the a-trous filter, the last of which has taps 16 pixels apart
+    static constexpr u32 DenoisePasses = 5;
+    struct DenoiseImage {
+        std::unique_ptr<VulkanImage> image;
+        vk::raii::ImageView image_view = nullptr;
+    };
+    // Two alternated between the passes, then the output of each frame in flight
+    std::vector<DenoiseImage> denoise_images;
+    // Per frame in flight and pass. Binding 0 is the accumulated image, 1 the previous pass's
+    // output, 2 this pass's and 3 the pixel AOVs.
+    std::unique_ptr<VulkanDescriptorSets> denoise_descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> denoise_pipeline;
+    // Per frame in flight. Binding 0 is the offscreen image, 1 the pixel accumulation and 2 the
+    // first hits.
+    std::unique_ptr<VulkanDescriptorSets> reproject_descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> reproject_pipeline;
+    // Per frame in flight. Binding 0 is the image presented and 1 the pixel costs.
+    std::unique_ptr<VulkanDescriptorSets> heatmap_descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> heatmap_pipeline;
+    // Cells of the path guiding grid, which are hashed into
+    static constexpr u32 GuideCells = 1u << 16;
+    // Of the cells along the longest side of the bounds of the sub scene
+    static constexpr float GuideGridResolution = 128;
+    // Binding 0 is the records, 1 the distributions
+    std::unique_ptr<VulkanDescriptorSets> guide_descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> guide_pipeline;
+    // Per frame in flight. Binding 0 is the rays picked and 1 their hits, see Frame.
+    std::unique_ptr<VulkanDescriptorSets> pick_descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> pick_pipeline;
+    struct PickBatch {
+        std::vector<PickRay> rays;
+        PickCallback callback;
+    };
+    std::vector<PickBatch> pending_picks; // Until a frame has room for them, in order
+    std::unique_ptr<VulkanBuffer> guide_samples_buffer;       // See GUIDE_CELL_SAMPLES
+    std::unique_ptr<VulkanBuffer> guide_distributions_buffer; // See GUIDE_CELL_FLOATS
+    float guide_cell_size = 1;
+    bool guide_reset = false; // Cleared by the next frame
+    // Longest side of the bounds of the instances of the sub scene, 1 if none have any
+    float sub_scene_size = 1;
+    // Of the rays of ambient occlusion, relative to sub_scene_size
+    static constexpr float AmbientOcclusionRange = 0.1f;
+    static constexpr u32 PreviewMaxDepth = 3; // See Integrator::FewBounces
+    // One per mesh with a geometry per primitive, null for meshes without primitives. Shared by
+    // all sub scenes.
     std::vector<std::unique_ptr<VulkanAccelStructure>> blases;
-    std::unique_ptr<VulkanAccelStructure> tlas;
+    std::vector<std::unique_ptr<VulkanAccelStructure>> tlases; // Null for empty sub scenes
+    // Of each sub scene, null if it has no skinned or morphed instances. Their instances are
+    // traced against BLASes of their own, refit as they are animated. Never with gpu_instances,
+    // whose instances are generated on the GPU.
+    std::vector<std::unique_ptr<MeshDeformer>> mesh_deformers;
 
-    struct Frame {};
-    std::unique_ptr<VulkanFramesInFlight<Frame, 2>> frames;
-    std::unique_ptr<VulkanDescriptorSets> fixed_descriptor_set;
-    std::unique_ptr<VulkanDescriptorSets> image_descriptor_sets;
+    // Most BLAS rebuilds submitted at once, bounding the memory they take further
+    static constexpr std::size_t BLASUpgradesPerRound = 64;
+    struct BLASUpgrade {
+        std::size_t mesh{};
+        SceneCache::Key key{}; // Stored in the scene cache once swapped in
+        bool cacheable{};      // Unless it references opacity micromaps
+    };
+    std::vector<BLASUpgrade> blas_upgrades;
+    std::unique_ptr<VulkanBLASBuilder> blas_upgrader; // Builds them asynchronously
+    // Of the meshes whose BLASes are built after LoadScene with progressive builds, in the order
+    // they were added to the builder. Stored in the scene cache once all are done.
+    std::vector<BLASUpgrade> progressive_meshes;
+    std::unique_ptr<VulkanBLASBuilder> progressive_builder; // Null once all are done
+    // Rebuilt on the compute queue over the upgraded BLASes, while frames keep tracing against
+    // the previous TLASes. The BLASes those reference are retired until the swap.
+    std::vector<std::unique_ptr<VulkanAccelStructure>> pending_tlases;
+    // Whether they add instances, rather than trace the same faster, so that the accumulation
+    // starts over once they are swapped in
+    bool pending_tlases_add_instances{};
+    std::vector<std::unique_ptr<VulkanAccelStructure>> retired_blases;
+    std::shared_ptr<SceneCache> scene_cache;
+
+    struct Frame {
+        u32 num_samples{}; // Traced by its last submission over its passes, 0 if none
+        u32 num_pixels{};
+        // Of the submissions of the tiles after the first, see TraceTiles
+        std::vector<vk::raii::CommandBuffer> tile_command_buffers;
+        // Of its last submission when measuring costs or counting rays, if they have not been
+        // read back yet
+        std::unique_ptr<VulkanBuffer> material_costs; // GLSL::MaterialCost
+        bool material_costs_pending{};
+        std::unique_ptr<VulkanBuffer> ray_stats; // GLSL::RayStats
+        bool ray_stats_pending{};
+        // The accumulation, then the pixel statistics when sampling adaptively, of its last
+        // submission to checkpoint, and the rest of the checkpoint until they are read back
+        std::unique_ptr<VulkanBuffer> checkpoint_buffer;
+        std::optional<RenderCheckpoint> checkpoint;
+        std::unique_ptr<VulkanBuffer> resume_buffer; // Uploaded from by its last submission
+        // Of MaxPicksPerFrame each, host visible. The batches traced by its last submission
+        // take their hits in order.
+        std::unique_ptr<VulkanBuffer> pick_rays; // GLSL::PickRay
+        std::unique_ptr<VulkanBuffer> pick_hits; // GLSL::PickHit
+        std::vector<PickBatch> picks;
+        bool picks_traced{}; // Unless the sub scene had no TLAS, in which case all missed
+        // The instance of the sub scene of each instance of the TLAS picked against, empty with
+        // generated instances
+        std::vector<u32> pick_instances;
+        u32 accumulation_id{}; // Of its last submission, see accumulation_id
+    };
+    std::unique_ptr<VulkanFramesInFlight<Frame>> frames;
+    std::vector<std::unique_ptr<VulkanRayTracingPipeline>> pipeline_libraries;
     std::unique_ptr<VulkanRayTracingPipeline> pipeline;
+    // Compiled in the background with a pipeline cache of its own, merged into that of the
+    // device once done
+    std::future<TracePipeline> specialized_pipeline;
+    vk::raii::PipelineCache specialized_pipeline_cache = nullptr;
 
-    u32 frame_count = 0;
+    // Of the sample indices of frame 0, continued over reprojections so that the samples of the
+    // history and the new ones are not correlated
+    u32 sample_offset = 0;
     glm::mat4 last_camera_view;
     glm::mat4 last_camera_proj;
-    float intensity_multiplier = 20.0;
-    float ambient_light = 5.0;
-    float focal_dist = 0;
-    float aperture = 0.5;
-    bool camera_properties_changed = false;
+    vk::Extent2D last_render_extent;
+    bool host_builds = false;
+    bool fast_first_builds = false;
+    bool progressive_builds = false;
+    bool gpu_instances = false;
+    float instance_cull_distance = 0;
+    float instance_min_projected_size = 0;
+    float adaptive_threshold = 0;
+    bool denoise = false;
+    bool fixed_rate_denoise = false;
+    bool reprojection = false;
+    u32 restir_candidates = 0;
+    u32 reservoir_half = 0; // Written by the next frame
+    // Whether the last frame's light reservoirs are of the lights and pixels of the next one
+    bool reuse_reservoirs = false;
+    bool cost_heatmap = false;
+    bool path_guiding = false;
+    Integrator integrator = Integrator::PathTracing;
+    Integrator motion_integrator = Integrator::PathTracing;
+    // Of the last frame, whose accumulation only frames of the same one continue
+    Integrator last_integrator = Integrator::PathTracing;
+    bool ray_stats = false;
+    bool picking = false;
+    std::filesystem::path environment_map_path;
+    float environment_intensity = 1;
+    double target_trace_time = 0; // Milliseconds
+    double sample_budget = 8;     // Samples of each frame when time-boxed
+    u32 tile_size = 0;
+    double submit_time = 0;       // Milliseconds, of the submissions of the tiles
+    double pixel_sample_time = 0; // Milliseconds per sample of a pixel, of the last timed frame
+    std::filesystem::path checkpoint_path; // Empty if not checkpointing
+    double checkpoint_interval = 0;        // Seconds
+    // Of the glTF loaded, unless it has been updated in place since, which stops checkpoints
+    std::optional<SceneCache::Key> checkpoint_scene_hash;
+    std::optional<RenderCheckpoint> resume_checkpoint; // Until the first frame is traced
+    std::chrono::steady_clock::time_point last_checkpoint_time;
+    std::future<void> checkpoint_write; // Of the checkpoint written last
+    u32 target_samples = 0;
+    bool converge_adaptively = false;
+    u32 accumulation_id = 0; // Counts the resets of the accumulation
+    // That adaptive sampling stopped tracing every pixel of
+    std::optional<u32> converged_accumulation;
 };
 
 } // namespace Renderer
@@ -0,0 +1,68 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _EXTEND_COMMON_GLSL
+#define _EXTEND_COMMON_GLSL
+
+// Shared by extend.comp and resolve.comp, which find the hits of the rays in the ray queue. The
+// includer declares primitives as raytrace.rchit does.
+
+#include "core/path_tracer_wavefront/shaders/wavefront_common.glsl"
+
+// See raytrace.inl.glsl
+layout(set = 0, binding = 12, std430) writeonly buffer PixelFirstHitBlock {
+    vec4 pixel_first_hits[];
+};
+
+#include "core/path_tracer_hw/shaders/environment.glsl"
+
+// Of the camera rays, for reprojection. t is the distance of the hit.
+void WriteFirstHit(uint path_idx, bool hit, float t) {
+    if (paths[path_idx].depth == 0 && uniforms.p.write_first_hits != 0) {
+        pixel_first_hits[path_idx] =
+            hit ? vec4(paths[path_idx].origin + paths[path_idx].direction * t, t)
+                : vec4(paths[path_idx].direction, 0.0);
+    }
+}
+
+// Ends the sample of the path with the environment
+void MissPath(uint path_idx) {
+    // Environment intensity, see raytrace.rmiss
+    vec3 hit_value;
+    if (HasEnvironmentMap()) {
+        const vec3 direction = paths[path_idx].direction;
+        hit_value =
+            GetEnvironment(direction) * EnvironmentMISWeight(paths[path_idx].bsdf_pdf, direction);
+    } else {
+        hit_value = paths[path_idx].depth == 0 ? vec3(0.8) : vec3(uniforms.p.ambient_light);
+    }
+    paths[path_idx].radiance += hit_value * paths[path_idx].weight;
+    if (paths[path_idx].depth == 0 && uniforms.p.write_aovs != 0) {
+        aovs[path_idx] = PixelAOV(vec4(hit_value, 1.0), vec4(0.0));
+    }
+    paths[path_idx].material = NO_HIT;
+    FinishSample(path_idx);
+}
+
+// Stores the hit for shade.comp, counting it into the bin of its material. The instance is that
+// of the TLAS, and the transform has the rows of its object to world transform.
+void RecordHit(uint path_idx, uint primitive_idx, uint triangle, vec2 barycentrics, uint instance,
+               mat3x4 object_to_world) {
+    // See raytrace.rchit
+    const int material_idx = primitives[primitive_idx].material_idx;
+    const uint material =
+        material_idx == -1 ? push_constant.num_materials - 1 : uint(material_idx);
+
+    paths[path_idx].material = material;
+    paths[path_idx].primitive = primitive_idx;
+    paths[path_idx].barycentrics = barycentrics;
+    paths[path_idx].triangle = triangle;
+    paths[path_idx].instance = instance;
+    paths[path_idx].object_to_world0 = object_to_world[0];
+    paths[path_idx].object_to_world1 = object_to_world[1];
+    paths[path_idx].object_to_world2 = object_to_world[2];
+    atomicAdd(bins[material], 1);
+}
+
+#endif
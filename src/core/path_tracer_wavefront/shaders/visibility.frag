@@ -0,0 +1,65 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+#extension GL_EXT_nonuniform_qualifier : enable
+#extension GL_EXT_shader_explicit_arithmetic_types_int8 : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int16 : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int32 : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int64 : require
+#extension GL_EXT_buffer_reference2 : require
+#extension GL_EXT_scalar_block_layout : enable
+
+#include "core/path_tracer_hw/shaders/path_tracer_glsl.h"
+#include "core/shaders/primitive_glsl.h"
+#include "core/shaders/scene_glsl.h"
+
+layout(set = 0, binding = 1, std430) readonly buffer PrimitiveInfoBlock {
+    PrimitiveInfo primitives[];
+};
+layout(set = 0, binding = 2, std140) readonly buffer MaterialBlock {
+    PackedMaterial materials[];
+};
+layout(set = 0, binding = 3) uniform sampler2D textures[];
+layout(set = 0, binding = 4, std140) uniform FrameUniforms {
+    PathTracerUniforms p;
+}
+uniforms;
+
+#define TEXTURE_STREAMING_SET 2
+#include "core/shaders/texture_streaming.glsl"
+
+#include "core/path_tracer_hw/shaders/alpha_mask.glsl"
+#include "core/path_tracer_wavefront/shaders/visibility.glsl"
+
+layout(push_constant) uniform PushConstant {
+    WavefrontPushConstant push_constant;
+};
+
+layout(location = 0) flat in uint fragDraw;
+layout(location = 1) flat in int fragTriangle;
+
+layout(location = 0) out uvec2 outVisibility;
+
+// Stores the draw (plus 1) and triangle of the pixel. Triangles of alpha masked materials are
+// tested where the camera ray through the center of the pixel meets them.
+void main() {
+    const VisibilityDraw draw = draws[fragDraw];
+    const int material_idx = primitives[draw.primitive].material_idx;
+    if (material_idx != -1 && UnpackMaterial(materials[material_idx]).alpha_cutoff >= 0) {
+        // Like generate.comp, without the jitter
+        const vec2 d = gl_FragCoord.xy / vec2(push_constant.render_extent) * 2.0 - 1.0;
+        const vec4 origin = uniforms.p.view_inverse * vec4(0, 0, 0, 1);
+        const vec4 target = uniforms.p.proj_inverse * vec4(d.x, d.y, 1, 1);
+        const vec4 direction = uniforms.p.view_inverse * vec4(normalize(target.xyz), 0);
+        float t;
+        const vec2 barycentrics =
+            IntersectTriangle(draw, fragTriangle, origin.xyz, direction.xyz, t);
+        if (IsAlphaCutOut(draw.primitive, fragTriangle, barycentrics)) {
+            discard;
+        }
+    }
+    outVisibility = uvec2(fragDraw + 1, fragTriangle);
+}
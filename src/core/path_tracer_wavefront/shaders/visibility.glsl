@@ -0,0 +1,52 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _VISIBILITY_GLSL
+#define _VISIBILITY_GLSL
+
+// The draws of the visibility buffer, which visibility.vert and visibility.frag rasterize and
+// resolve.comp reads the hits of the camera rays from. The includer declares primitives as
+// raytrace.rchit does.
+
+#include "core/path_tracer_wavefront/shaders/wavefront_glsl.h"
+#include "core/shaders/vertex_fetch.glsl"
+
+layout(set = 3, binding = 5, std430) readonly buffer VisibilityDrawBlock {
+    VisibilityDraw draws[];
+};
+
+vec3 LoadWorldPosition(PrimitiveInfo primitive, VisibilityDraw draw, uint index) {
+    const uint stride = ATTRIBUTE_STRIDE(primitive.position_format);
+    const vec3 position = LoadPosition(primitive.position_address + index * stride,
+                                       ATTRIBUTE_TYPE(primitive.position_format));
+    return vec4(position, 1.0) *
+           mat3x4(draw.object_to_world0, draw.object_to_world1, draw.object_to_world2);
+}
+
+// Barycentrics (of the second and third vertex) of where the ray meets the plane of the triangle
+// of the draw, and their distance t along it. Rays that pass the triangle by, e.g. jittered ones
+// at its edges, get barycentrics outside of it, which extrapolate its attributes. Those parallel
+// to it get its center.
+vec2 IntersectTriangle(VisibilityDraw draw, int triangle, vec3 origin, vec3 direction,
+                       out float t) {
+    const PrimitiveInfo primitive = primitives[draw.primitive];
+    const uvec3 indices = ReadTriangleIndices(primitive, triangle);
+    const vec3 p0 = LoadWorldPosition(primitive, draw, indices.x);
+    const vec3 e1 = LoadWorldPosition(primitive, draw, indices.y) - p0;
+    const vec3 e2 = LoadWorldPosition(primitive, draw, indices.z) - p0;
+
+    // Moller-Trumbore, without the tests against the edges
+    const vec3 p = cross(direction, e2);
+    const float det = dot(e1, p);
+    if (abs(det) < 1e-12) {
+        t = dot(p0 + (e1 + e2) / 3.0 - origin, direction);
+        return vec2(1.0 / 3.0);
+    }
+    const vec3 s = origin - p0;
+    const vec3 q = cross(s, e1);
+    t = dot(e2, q) / det;
+    return vec2(dot(s, p), dot(direction, q)) / det;
+}
+
+#endif
@@ -0,0 +1,40 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+#extension GL_EXT_shader_explicit_arithmetic_types_int8 : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int16 : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int32 : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int64 : require
+#extension GL_EXT_buffer_reference2 : require
+#extension GL_EXT_scalar_block_layout : enable
+
+#include "core/path_tracer_hw/shaders/path_tracer_glsl.h"
+#include "core/shaders/primitive_glsl.h"
+
+layout(set = 0, binding = 1, std430) readonly buffer PrimitiveInfoBlock {
+    PrimitiveInfo primitives[];
+};
+layout(set = 0, binding = 4, std140) uniform FrameUniforms {
+    PathTracerUniforms p;
+}
+uniforms;
+
+#include "core/path_tracer_wavefront/shaders/visibility.glsl"
+
+layout(location = 0) flat out uint fragDraw;
+layout(location = 1) flat out int fragTriangle;
+
+// Each instance is a draw, whose triangles are drawn without an index buffer: the indices are
+// pulled like the vertices (see rasterizer.vert), so that each vertex knows its triangle.
+void main() {
+    const VisibilityDraw draw = draws[gl_InstanceIndex];
+    const PrimitiveInfo primitive = primitives[draw.primitive];
+    const int triangle = gl_VertexIndex / 3;
+    const uint index = ReadTriangleIndices(primitive, triangle)[gl_VertexIndex % 3];
+    gl_Position = uniforms.p.view_proj * vec4(LoadWorldPosition(primitive, draw, index), 1.0);
+    fragDraw = gl_InstanceIndex;
+    fragTriangle = triangle;
+}
@@ -0,0 +1,82 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _WAVEFRONT_COMMON_GLSL
+#define _WAVEFRONT_COMMON_GLSL
+
+// Shared by the stages of VulkanPathTracerWavefront, which all run in groups of 64
+
+#include "core/path_tracer_hw/shaders/path_tracer_glsl.h"
+#include "core/path_tracer_hw/shaders/russian_roulette.glsl"
+#include "core/path_tracer_wavefront/shaders/wavefront_glsl.h"
+
+#define GROUP_SIZE 64
+// Like raytrace.rgen
+#define MAX_BOUNCES uniforms.p.max_depth
+// Queues 0 and 1 are the ray queues, alternating between bounces
+#define SHADE_QUEUE 2
+// Material of paths whose last ray missed
+#define NO_HIT 0xFFFFFFFFu
+
+layout(set = 0, binding = 4, std140) uniform FrameUniforms {
+    PathTracerUniforms p;
+}
+uniforms;
+
+// Of the first hits, see raytrace.rchit
+layout(set = 0, binding = 6, std430) writeonly buffer PixelAOVBlock {
+    PixelAOV aovs[];
+};
+
+layout(push_constant) uniform PushConstant {
+    WavefrontPushConstant push_constant;
+};
+
+layout(set = 3, binding = 0, std430) buffer PathBlock {
+    WavefrontPath paths[];
+};
+layout(set = 3, binding = 1, std430) buffer QueueBlock {
+    WavefrontQueue queues[];
+};
+// Both ray queues, each of the queue capacity
+layout(set = 3, binding = 2, std430) buffer RayQueueBlock {
+    uint ray_queues[];
+};
+layout(set = 3, binding = 3, std430) buffer ShadeQueueBlock {
+    uint shade_queue[];
+};
+// Hits of each material, then the offsets of each in the shade queue
+layout(set = 3, binding = 4, std430) buffer BinBlock {
+    uint bins[];
+};
+
+// Returns the index of the item in the queue, counting the groups of its dispatch
+uint AppendToQueue(uint queue) {
+    const uint idx = atomicAdd(queues[queue].count, 1);
+    if (idx % GROUP_SIZE == 0) {
+        atomicAdd(queues[queue].groups_x, 1);
+    }
+    return idx;
+}
+
+void PushRay(uint queue, uint path_idx) {
+    ray_queues[queue * push_constant.queue_capacity + AppendToQueue(queue)] = path_idx;
+}
+
+// Ends the sample of the path, adding its radiance to the samples of the pixel
+void FinishSample(uint path_idx) {
+    vec3 radiance = paths[path_idx].radiance;
+    // Removing fireflies
+    const float lum = dot(radiance, vec3(0.212671f, 0.715160f, 0.072169f));
+    if (lum > uniforms.p.intensity_multiplier) { // magic
+        radiance *= uniforms.p.intensity_multiplier / lum;
+    }
+    if (isnan(radiance.x) || isnan(radiance.y) || isnan(radiance.z)) {
+        return;
+    }
+    paths[path_idx].sample_sum += radiance;
+    paths[path_idx].num_samples++;
+}
+
+#endif
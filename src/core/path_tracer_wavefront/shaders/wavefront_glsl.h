@@ -0,0 +1,71 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef WAVEFRONT_GLSL_H
+#define WAVEFRONT_GLSL_H
+
+#include "core/vulkan/host_glsl_shared.h"
+
+// State of the path of a pixel, carried between the stages
+BEGIN_STRUCT(WavefrontPath)
+
+vec3 origin;       // Of the next ray
+uint sample_index; // See SamplerState
+vec3 direction;
+uint depth; // Bounces so far
+vec3 weight;
+uint material; // Of the last hit, which the path is binned by for shading
+vec3 radiance;
+uint num_samples; // Finished ones of the frame, excluding NaNs
+vec3 sample_sum;
+uint primitive; // Of the last hit, in the scene
+vec2 barycentrics;
+uint triangle;
+float bsdf_pdf; // Of the last ray, see hitPayload
+// Rows of the object to world transform of the last hit
+vec4 object_to_world0;
+vec4 object_to_world1;
+vec4 object_to_world2;
+uint instance; // Of the last hit in the TLAS, for finding its light
+INSERT_PADDING(3)
+
+END_STRUCT(WavefrontPath)
+
+// A primitive of a mesh instance of the TLAS, drawn into the visibility buffer. Its pixels hold
+// the index of the draw plus 1 (0 is nothing drawn) and the triangle.
+BEGIN_STRUCT(VisibilityDraw)
+
+// Rows of the object to world transform of the instance
+vec4 object_to_world0;
+vec4 object_to_world1;
+vec4 object_to_world2;
+uint primitive; // In the scene
+uint instance;  // In the TLAS
+INSERT_PADDING(2)
+
+END_STRUCT(VisibilityDraw)
+
+// Header of a queue of path indices. The groups are those of the (compute) dispatch over its
+// items, to be read by vkCmdDispatchIndirect.
+BEGIN_STRUCT(WavefrontQueue)
+
+uint groups_x;
+uint groups_y;
+uint groups_z;
+uint count;
+
+END_STRUCT(WavefrontQueue)
+
+BEGIN_STRUCT(WavefrontPushConstant)
+
+uvec2 render_extent;
+uint sample;         // Of the frame, 0 starts the samples of a frame
+uint queue;          // Ray queue read by the stage, the other is written
+uint queue_capacity; // Of each ray queue, paths are indexed by pixel below this
+uint num_materials;
+INSERT_PADDING(2)
+
+END_STRUCT(WavefrontPushConstant)
+
+#endif
@@ -0,0 +1,699 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <glm/glm.hpp>
+#include "core/hot_reload.h"
+#include "core/path_tracer_hw/shaders/path_tracer_glsl.h"
+#include "core/path_tracer_wavefront/shaders/wavefront_glsl.h"
+#include "core/path_tracer_wavefront/vulkan_path_tracer_wavefront.h"
+#include "core/scene.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
+#include "core/vulkan/vulkan_context.h"
+#include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_frames_in_flight.hpp"
+#include "core/vulkan/vulkan_graphics_pipeline.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_shader.h"
+#include "core/vulkan/vulkan_swapchain.h"
+#include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_texture_streamer.h"
+
+namespace Renderer {
+
+// Of the visibility buffer, the draw plus 1 and the triangle of each pixel
+static constexpr vk::Format VisibilityFormat = vk::Format::eR32G32Uint;
+static constexpr vk::Format VisibilityDepthFormat = vk::Format::eD32Sfloat;
+
+VulkanPathTracerWavefront::VulkanPathTracerWavefront(
+    bool enable_validation_layers, std::vector<const char*> frontend_required_extensions)
+    : VulkanPathTracerHW(enable_validation_layers, std::move(frontend_required_extensions)) {}
+
+VulkanPathTracerWavefront::~VulkanPathTracerWavefront() = default;
+
+VulkanRenderer::DeviceRequirements VulkanPathTracerWavefront::GetDeviceRequirements() const {
+    // Same as VulkanPathTracerHW, with ray queries instead of the ray tracing pipeline
+    return {
+        .extensions =
+            {
+                VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+                VK_KHR_RAY_QUERY_EXTENSION_NAME,
+                VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
+            },
+        .features =
+            Helpers::GenericStructureChain{
+                vk::PhysicalDeviceFeatures2{
+                    .features =
+                        {
+                            .samplerAnisotropy = VK_TRUE,
+                            // For the texture streaming residency in the alpha test of the
+                            // visibility buffer
+                            .fragmentStoresAndAtomics = VK_TRUE,
+                            .shaderInt64 = VK_TRUE,
+                            .shaderInt16 = VK_TRUE,
+                        },
+                },
+                vk::PhysicalDeviceVulkan11Features{
+                    .storageBuffer16BitAccess = VK_TRUE,
+                },
+                vk::PhysicalDeviceVulkan12Features{
+                    .storageBuffer8BitAccess = VK_TRUE,
+                    .shaderInt8 = VK_TRUE,
+                    .shaderSampledImageArrayNonUniformIndexing = VK_TRUE,
+                    .runtimeDescriptorArray = VK_TRUE,
+                    .timelineSemaphore = VK_TRUE,
+                    .bufferDeviceAddress = VK_TRUE,
+                },
+                vk::PhysicalDeviceVulkan13Features{
+                    .pipelineCreationCacheControl = VK_TRUE,
+                    .synchronization2 = VK_TRUE,
+                },
+                vk::PhysicalDeviceAccelerationStructureFeaturesKHR{
+                    .accelerationStructure = VK_TRUE,
+                },
+                vk::PhysicalDeviceRayQueryFeaturesKHR{
+                    .rayQuery = VK_TRUE,
+                },
+            },
+    };
+}
+
+vk::ShaderStageFlags VulkanPathTracerWavefront::GetTraceStages() const {
+    if (rasterize_primary_hits) {
+        return vk::ShaderStageFlagBits::eCompute | vk::ShaderStageFlagBits::eVertex |
+               vk::ShaderStageFlagBits::eFragment;
+    }
+    return vk::ShaderStageFlagBits::eCompute;
+}
+
+vk::PipelineStageFlags2 VulkanPathTracerWavefront::GetTracePipelineStages() const {
+    if (rasterize_primary_hits) {
+        return vk::PipelineStageFlagBits2::eComputeShader |
+               vk::PipelineStageFlagBits2::eVertexShader |
+               vk::PipelineStageFlagBits2::eFragmentShader;
+    }
+    return vk::PipelineStageFlagBits2::eComputeShader;
+}
+
+bool VulkanPathTracerWavefront::SupportsTiledTracing() const {
+    return false;
+}
+
+bool VulkanPathTracerWavefront::SupportsCostHeatmap() const {
+    return false;
+}
+
+bool VulkanPathTracerWavefront::SupportsRayStats() const {
+    return false;
+}
+
+bool VulkanPathTracerWavefront::SupportsReSTIR() const {
+    return false;
+}
+
+bool VulkanPathTracerWavefront::SupportsPathGuiding() const {
+    return false;
+}
+
+bool VulkanPathTracerWavefront::SupportsIntegrators() const {
+    return false;
+}
+
+void VulkanPathTracerWavefront::CreatePipeline() {
+    wavefront_descriptor_set = std::make_unique<VulkanDescriptorSets>(
+        *device, 1,
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute | vk::ShaderStageFlagBits::eVertex |
+                          vk::ShaderStageFlagBits::eFragment,
+            },
+            {
+                .type = vk::DescriptorType::eCombinedImageSampler,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            },
+        });
+    CreatePathBuffers();
+
+    // All stages have the same layout
+    const auto CreateStage = [this](const char8_t* path) {
+        return std::make_unique<VulkanComputePipeline>(
+            *device,
+            vk::PipelineShaderStageCreateInfo{
+                .stage = vk::ShaderStageFlagBits::eCompute,
+                .module = *VulkanShader{*device, path},
+                .pName = "main",
+            },
+            vk::PipelineLayoutCreateInfo{
+                .setLayoutCount = 4,
+                .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                    *fixed_descriptor_set->descriptor_set_layout,
+                    *image_descriptor_sets->descriptor_set_layout,
+                    *scene->texture_streamer->descriptor_sets->descriptor_set_layout,
+                    *wavefront_descriptor_set->descriptor_set_layout,
+                }},
+                .pushConstantRangeCount = 1,
+                .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                    PushConstant<GLSL::WavefrontPushConstant>(vk::ShaderStageFlagBits::eCompute),
+                }},
+            });
+    };
+    generate_pipeline = CreateStage(u8"core/path_tracer_wavefront/shaders/generate.comp");
+    extend_pipeline = CreateStage(u8"core/path_tracer_wavefront/shaders/extend.comp");
+    bin_pipeline = CreateStage(u8"core/path_tracer_wavefront/shaders/bin.comp");
+    scatter_pipeline = CreateStage(u8"core/path_tracer_wavefront/shaders/scatter.comp");
+    shade_pipeline = CreateStage(u8"core/path_tracer_wavefront/shaders/shade.comp");
+    accumulate_pipeline = CreateStage(u8"core/path_tracer_wavefront/shaders/accumulate.comp");
+
+    if (rasterize_primary_hits) {
+        resolve_pipeline = CreateStage(u8"core/path_tracer_wavefront/shaders/resolve.comp");
+        CreateVisibilityPipeline();
+        CreateVisibilityBuffer();
+        UploadVisibilityDraws();
+    }
+}
+
+void VulkanPathTracerWavefront::CreateVisibilityPipeline() {
+    const std::array<vk::AttachmentDescription, 2> attachments{{
+        {
+            .format = VisibilityFormat,
+            .loadOp = vk::AttachmentLoadOp::eClear,
+            .storeOp = vk::AttachmentStoreOp::eStore,
+            .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+            .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+            .initialLayout = vk::ImageLayout::eUndefined,
+            .finalLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+        },
+        {
+            .format = VisibilityDepthFormat,
+            .loadOp = vk::AttachmentLoadOp::eClear,
+            .storeOp = vk::AttachmentStoreOp::eDontCare,
+            .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+            .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+            .initialLayout = vk::ImageLayout::eUndefined,
+            .finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+        },
+    }};
+    const std::array<vk::SubpassDependency, 2> dependencies{{
+        // After resolve.comp of the previous frame read it, and its depth tests are done
+        {
+            .srcSubpass = VK_SUBPASS_EXTERNAL,
+            .dstSubpass = 0,
+            .srcStageMask = vk::PipelineStageFlagBits::eComputeShader |
+                            vk::PipelineStageFlagBits::eLateFragmentTests,
+            .dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput |
+                            vk::PipelineStageFlagBits::eEarlyFragmentTests,
+            .srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+            .dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite |
+                             vk::AccessFlagBits::eDepthStencilAttachmentRead |
+                             vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+        },
+        // Before resolve.comp reads it
+        {
+            .srcSubpass = 0,
+            .dstSubpass = VK_SUBPASS_EXTERNAL,
+            .srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            .dstStageMask = vk::PipelineStageFlagBits::eComputeShader,
+            .srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
+            .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+        },
+    }};
+    const vk::AttachmentReference color_reference{
+        .attachment = 0,
+        .layout = vk::ImageLayout::eColorAttachmentOptimal,
+    };
+    const vk::AttachmentReference depth_reference{
+        .attachment = 1,
+        .layout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+    };
+    visibility_render_pass = vk::raii::RenderPass{
+        **device,
+        {
+            .attachmentCount = static_cast<u32>(attachments.size()),
+            .pAttachments = attachments.data(),
+            .subpassCount = 1,
+            .pSubpasses = TempArr<vk::SubpassDescription>{{
+                .pipelineBindPoint = vk::PipelineBindPoint::eGraphics,
+                .colorAttachmentCount = 1,
+                .pColorAttachments = &color_reference,
+                .pDepthStencilAttachment = &depth_reference,
+            }},
+            .dependencyCount = static_cast<u32>(dependencies.size()),
+            .pDependencies = dependencies.data(),
+        }};
+
+    const VulkanShader vertex_shader{*device,
+                                     u8"core/path_tracer_wavefront/shaders/visibility.vert"};
+    const VulkanShader fragment_shader{*device,
+                                       u8"core/path_tracer_wavefront/shaders/visibility.frag"};
+    const std::array<vk::PipelineShaderStageCreateInfo, 2> stages{{
+        {
+            .stage = vk::ShaderStageFlagBits::eVertex,
+            .module = *vertex_shader,
+            .pName = "main",
+        },
+        {
+            .stage = vk::ShaderStageFlagBits::eFragment,
+            .module = *fragment_shader,
+            .pName = "main",
+        },
+    }};
+    // Faces are culled per draw, like the instances of the TLAS
+    static constexpr vk::PipelineRasterizationStateCreateInfo RasterizationState{
+        .cullMode = vk::CullModeFlagBits::eBack,
+        .frontFace = vk::FrontFace::eCounterClockwise,
+        .lineWidth = 1.0f,
+    };
+    static constexpr vk::DynamicState CullModeState = vk::DynamicState::eCullMode;
+    static constexpr vk::PipelineDynamicStateCreateInfo DynamicState{
+        .dynamicStateCount = 1,
+        .pDynamicStates = &CullModeState,
+    };
+    static constexpr vk::PipelineDepthStencilStateCreateInfo DepthStencilState{
+        .depthTestEnable = VK_TRUE,
+        .depthWriteEnable = VK_TRUE,
+        .depthCompareOp = vk::CompareOp::eLess,
+    };
+    // No vertex input state, the vertex shader pulls the indices and vertices
+    visibility_pipeline = std::make_unique<VulkanGraphicsPipeline>(
+        *device,
+        vk::GraphicsPipelineCreateInfo{
+            .stageCount = static_cast<u32>(stages.size()),
+            .pStages = stages.data(),
+            .pRasterizationState = &RasterizationState,
+            .pDepthStencilState = &DepthStencilState,
+            .pDynamicState = &DynamicState,
+            .renderPass = *visibility_render_pass,
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 4,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *fixed_descriptor_set->descriptor_set_layout,
+                *image_descriptor_sets->descriptor_set_layout,
+                *scene->texture_streamer->descriptor_sets->descriptor_set_layout,
+                *wavefront_descriptor_set->descriptor_set_layout,
+            }},
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::WavefrontPushConstant>(vk::ShaderStageFlagBits::eFragment),
+            }},
+        });
+}
+
+void VulkanPathTracerWavefront::CreateVisibilityBuffer() {
+    const auto CreateImage = [this](vk::Format format, vk::ImageUsageFlags usage,
+                                    vk::ImageAspectFlags aspect,
+                                    std::unique_ptr<VulkanImage>& image,
+                                    vk::raii::ImageView& image_view) {
+        // Released first, so that the new one can take over its memory
+        image_view = nullptr;
+        image.reset();
+        image = std::make_unique<VulkanImage>(
+            *device->allocator,
+            vk::ImageCreateInfo{
+                .imageType = vk::ImageType::e2D,
+                .format = format,
+                .extent =
+                    {
+                        .width = render_target_extent.width,
+                        .height = render_target_extent.height,
+                        .depth = 1,
+                    },
+                .mipLevels = 1,
+                .arrayLayers = 1,
+                .usage = usage,
+                .initialLayout = vk::ImageLayout::eUndefined,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+                .priority = 1.0f,
+            },
+            MemoryCategory::RenderTargets);
+        image_view = vk::raii::ImageView{**device,
+                                         {
+                                             .image = **image,
+                                             .viewType = vk::ImageViewType::e2D,
+                                             .format = format,
+                                             .subresourceRange =
+                                                 {
+                                                     .aspectMask = aspect,
+                                                     .baseMipLevel = 0,
+                                                     .levelCount = 1,
+                                                     .baseArrayLayer = 0,
+                                                     .layerCount = 1,
+                                                 },
+                                         }};
+    };
+    CreateImage(VisibilityFormat,
+                vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eSampled,
+                vk::ImageAspectFlagBits::eColor, visibility_image, visibility_image_view);
+    visibility_image->SetName("visibility buffer");
+    CreateImage(VisibilityDepthFormat, vk::ImageUsageFlagBits::eDepthStencilAttachment,
+                vk::ImageAspectFlagBits::eDepth, visibility_depth_image,
+                visibility_depth_image_view);
+    visibility_depth_image->SetName("visibility buffer depth");
+
+    visibility_framebuffer = vk::raii::Framebuffer{
+        **device,
+        vk::FramebufferCreateInfo{
+            .renderPass = *visibility_render_pass,
+            .attachmentCount = 2,
+            .pAttachments =
+                TempArr<vk::ImageView>{*visibility_image_view, *visibility_depth_image_view},
+            .width = render_target_extent.width,
+            .height = render_target_extent.height,
+            .layers = 1,
+        }};
+    // Only fetched, so the sampler does not matter
+    wavefront_descriptor_set->UpdateDescriptor(
+        6, DescriptorBinding::CombinedImageSamplersValue{{
+               .images = {{
+                   .image = *visibility_image_view,
+                   .sampler = *device->default_sampler,
+               }},
+           }});
+}
+
+void VulkanPathTracerWavefront::UploadVisibilityDraws() {
+    const auto& sub_scene = GetSubScene();
+    // Like GetInstanceFlags, the back faces of meshes with only single sided materials are culled.
+    // The TLAS tells them apart in object space, where mirrored instances have their faces the
+    // other way around.
+    const auto GetCullMode = [this, &sub_scene](std::size_t instance) -> vk::CullModeFlags {
+        const auto& mesh = *scene->meshes[sub_scene.instance_meshes[instance]];
+        const bool double_sided =
+            std::ranges::any_of(mesh.primitives, [this](const auto& primitive) {
+                const auto material = primitive->material == -1
+                                          ? scene->materials.size() - 1
+                                          : static_cast<std::size_t>(primitive->material);
+                return scene->materials[material]->double_sided;
+            });
+        if (double_sided) {
+            return vk::CullModeFlagBits::eNone;
+        }
+        return glm::determinant(glm::mat3{sub_scene.instance_transforms[instance]}) < 0
+                   ? vk::CullModeFlagBits::eFront
+                   : vk::CullModeFlagBits::eBack;
+    };
+
+    std::vector<GLSL::VisibilityDraw> draws;
+    visibility_draw_calls.clear();
+    // A pass over the instances for each cull mode, so that the draws are sorted by it
+    for (const vk::CullModeFlags cull_mode :
+         {vk::CullModeFlags{vk::CullModeFlagBits::eBack},
+          vk::CullModeFlags{vk::CullModeFlagBits::eFront},
+          vk::CullModeFlags{vk::CullModeFlagBits::eNone}}) {
+        u32 tlas_instance = 0;
+        for (std::size_t i = 0; i < sub_scene.GetNumInstances(); ++i) {
+            const u32 mesh_idx = sub_scene.instance_meshes[i];
+            if (!IsInTLAS(mesh_idx)) {
+                continue;
+            }
+            if (GetCullMode(i) == cull_mode) {
+                // Every instance is visible to camera rays, see GetInstanceMask
+                const auto& mesh = *scene->meshes[mesh_idx];
+                const glm::mat4 rows = glm::transpose(sub_scene.instance_transforms[i]);
+                for (std::size_t j = 0; j < mesh.primitives.size(); ++j) {
+                    const auto& primitive = *mesh.primitives[j];
+                    draws.push_back({
+                        .object_to_world0 = rows[0],
+                        .object_to_world1 = rows[1],
+                        .object_to_world2 = rows[2],
+                        .primitive =
+                            sub_scene.instance_first_primitives[i] + static_cast<u32>(j),
+                        .instance = tlas_instance,
+                    });
+                    const auto num_vertices = primitive.index_buffer
+                                                  ? primitive.index_buffer->count
+                                                  : primitive.max_vertices;
+                    visibility_draw_calls.push_back({
+                        .vertex_count = static_cast<u32>(num_vertices / 3 * 3),
+                        .cull_mode = cull_mode,
+                    });
+                }
+            }
+            tlas_instance++;
+        }
+    }
+    if (draws.empty()) { // Storage buffers cannot be empty, it is never drawn
+        draws.emplace_back();
+    }
+
+    visibility_draws_buffer = std::make_unique<VulkanImmUploadBuffer>(
+        *device,
+        VulkanBufferCreateInfo{
+            .size = draws.size() * sizeof(GLSL::VisibilityDraw),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            .dst_stage_mask = vk::PipelineStageFlagBits2::eVertexShader |
+                              vk::PipelineStageFlagBits2::eFragmentShader |
+                              vk::PipelineStageFlagBits2::eComputeShader,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+            .category = MemoryCategory::Other,
+        },
+        reinterpret_cast<const u8*>(draws.data()));
+    wavefront_descriptor_set->UpdateDescriptor(5, DescriptorBinding::BuffersValue{{
+                                                      .buffers = {{**visibility_draws_buffer}},
+                                                  }});
+}
+
+void VulkanPathTracerWavefront::RasterizeVisibility(const vk::raii::CommandBuffer& cmd,
+                                                    std::size_t frame_idx, u32 uniforms_offset,
+                                                    const vk::Extent2D& render_extent) {
+    // Zero bits are nothing drawn
+    static constexpr std::array<vk::ClearValue, 2> ClearValues{{
+        {.color = {{{0.0f, 0.0f, 0.0f, 0.0f}}}},
+        {.depthStencil = {1.0f, 0}},
+    }};
+    visibility_pipeline->BeginRenderPass(cmd, {
+                                                  .framebuffer = *visibility_framebuffer,
+                                                  .renderArea =
+                                                      {
+                                                          .extent = render_extent,
+                                                      },
+                                                  .clearValueCount = 2,
+                                                  .pClearValues = ClearValues.data(),
+                                              });
+    const auto& layout = *visibility_pipeline->pipeline_layout;
+    cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, **visibility_pipeline);
+    VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eGraphics, layout, 0,
+                               {
+                                   {*fixed_descriptor_set, 0},
+                                   {*image_descriptor_sets, frame_idx},
+                                   {*scene->texture_streamer->descriptor_sets, frame_idx},
+                                   {*wavefront_descriptor_set, 0},
+                               },
+                               {uniforms_offset});
+    cmd.pushConstants<GLSL::WavefrontPushConstant>(
+        layout, vk::ShaderStageFlagBits::eFragment, 0,
+        GLSL::WavefrontPushConstant{
+            .render_extent = {render_extent.width, render_extent.height},
+        });
+    // Each draw is the instance of its index
+    for (std::size_t i = 0; i < visibility_draw_calls.size(); ++i) {
+        const auto& draw = visibility_draw_calls[i];
+        if (i == 0 || draw.cull_mode != visibility_draw_calls[i - 1].cull_mode) {
+            cmd.setCullMode(draw.cull_mode);
+        }
+        cmd.draw(draw.vertex_count, 1, 0, static_cast<u32>(i));
+    }
+    visibility_pipeline->EndRenderPass(cmd);
+}
+
+void VulkanPathTracerWavefront::CreatePathBuffers() {
+    path_capacity = render_target_extent.width * render_target_extent.height;
+
+    const auto CreateBuffer = [this](vk::DeviceSize size, vk::BufferUsageFlags usage) {
+        return std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer | usage,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+    };
+    paths_buffer = CreateBuffer(path_capacity * sizeof(GLSL::WavefrontPath), {});
+    queues_buffer = CreateBuffer(NumQueues * sizeof(GLSL::WavefrontQueue),
+                                 vk::BufferUsageFlagBits::eIndirectBuffer |
+                                     vk::BufferUsageFlagBits::eTransferDst);
+    ray_queues_buffer = CreateBuffer(2 * path_capacity * sizeof(u32), {});
+    shade_queue_buffer = CreateBuffer(path_capacity * sizeof(u32), {});
+    bins_buffer = CreateBuffer(2 * scene->materials.size() * sizeof(u32),
+                               vk::BufferUsageFlagBits::eTransferDst);
+
+    const std::array buffers{&paths_buffer, &queues_buffer, &ray_queues_buffer,
+                             &shade_queue_buffer, &bins_buffer};
+    for (std::size_t i = 0; i < buffers.size(); ++i) {
+        wavefront_descriptor_set->UpdateDescriptor(static_cast<u32>(i),
+                                                   DescriptorBinding::BuffersValue{{
+                                                       .buffers = {{***buffers[i]}},
+                                                   }});
+    }
+}
+
+void VulkanPathTracerWavefront::Trace(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                                      u32 uniforms_offset, const vk::Extent2D& render_extent) {
+    const auto MemoryBarrier = [&cmd](vk::PipelineStageFlags2 src_stage_mask,
+                                      vk::AccessFlags2 src_access_mask,
+                                      vk::PipelineStageFlags2 dst_stage_mask,
+                                      vk::AccessFlags2 dst_access_mask) {
+        cmd.pipelineBarrier2({
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+                .srcStageMask = src_stage_mask,
+                .srcAccessMask = src_access_mask,
+                .dstStageMask = dst_stage_mask,
+                .dstAccessMask = dst_access_mask,
+            }}},
+        });
+    };
+    static constexpr auto StorageReadWrite =
+        vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite;
+    // Each stage reads what the previous wrote, including the groups of its dispatch
+    const auto StageBarrier = [&MemoryBarrier] {
+        MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader, StorageReadWrite,
+                      vk::PipelineStageFlagBits2::eComputeShader |
+                          vk::PipelineStageFlagBits2::eDrawIndirect,
+                      StorageReadWrite | vk::AccessFlagBits2::eIndirectCommandRead);
+    };
+
+    const u32 num_paths = render_extent.width * render_extent.height;
+    GLSL::WavefrontPushConstant push_constant{
+        .render_extent = {render_extent.width, render_extent.height},
+        .queue_capacity = path_capacity,
+        .num_materials = static_cast<u32>(scene->materials.size()),
+    };
+    const auto& layout = *generate_pipeline->pipeline_layout;
+    const auto Bind = [&cmd, &layout, &push_constant](const VulkanComputePipeline& pipeline) {
+        cmd.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
+        cmd.pushConstants<GLSL::WavefrontPushConstant>(layout, vk::ShaderStageFlagBits::eCompute,
+                                                       0, push_constant);
+    };
+    const auto DispatchQueue = [this, &cmd, &Bind, &StageBarrier](
+                                 const VulkanComputePipeline& pipeline, u32 queue) {
+        Bind(pipeline);
+        cmd.dispatchIndirect(**queues_buffer, queue * sizeof(GLSL::WavefrontQueue));
+        StageBarrier();
+    };
+
+    // The rays of cameras with depth of field do not start at the eye the buffer is drawn from
+    const bool rasterized = rasterize_primary_hits && !HasDepthOfField();
+    if (rasterized) {
+        RasterizeVisibility(cmd, frame_idx, uniforms_offset, render_extent);
+    }
+
+    VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute, layout, 0,
+                               {
+                                   {*fixed_descriptor_set, 0},
+                                   {*image_descriptor_sets, frame_idx},
+                                   {*scene->texture_streamer->descriptor_sets, frame_idx},
+                                   {*wavefront_descriptor_set, 0},
+                               },
+                               {uniforms_offset});
+
+    // Empty, with a single group of y and z each
+    const std::array<GLSL::WavefrontQueue, NumQueues> empty_queues{{
+        {.groups_x = 0, .groups_y = 1, .groups_z = 1, .count = 0},
+        {.groups_x = 0, .groups_y = 1, .groups_z = 1, .count = 0},
+        {.groups_x = 0, .groups_y = 1, .groups_z = 1, .count = 0},
+    }};
+    for (u32 sample = 0; sample < frame_samples; ++sample) {
+        // The previous stages (of the last sample or frame) are done with the queues
+        MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader |
+                          vk::PipelineStageFlagBits2::eDrawIndirect,
+                      StorageReadWrite | vk::AccessFlagBits2::eIndirectCommandRead,
+                      vk::PipelineStageFlagBits2::eTransfer, vk::AccessFlagBits2::eTransferWrite);
+        if (sample == 0) { // bin.comp leaves them zeroed for the next bounce after
+            cmd.fillBuffer(**bins_buffer, 0, VK_WHOLE_SIZE, 0);
+        }
+        cmd.updateBuffer<GLSL::WavefrontQueue>(**queues_buffer, 0, empty_queues);
+        MemoryBarrier(vk::PipelineStageFlagBits2::eTransfer, vk::AccessFlagBits2::eTransferWrite,
+                      vk::PipelineStageFlagBits2::eComputeShader |
+                          vk::PipelineStageFlagBits2::eDrawIndirect,
+                      StorageReadWrite | vk::AccessFlagBits2::eIndirectCommandRead);
+
+        push_constant.sample = sample;
+        push_constant.queue = 0;
+        Bind(*generate_pipeline);
+        cmd.dispatch((num_paths + GroupSize - 1) / GroupSize, 1, 1);
+        StageBarrier();
+
+        // shade.comp ends the paths at the last bounce, so the queues are empty after
+        for (u32 bounce = 0; bounce < max_depth; ++bounce) {
+            push_constant.queue = bounce % 2;
+            // resolve.comp finds the primary hits in the visibility buffer instead of tracing
+            const bool resolve = rasterized && bounce == 0;
+            DispatchQueue(resolve ? *resolve_pipeline : *extend_pipeline, push_constant.queue);
+            Bind(*bin_pipeline);
+            cmd.dispatch(1, 1, 1);
+            StageBarrier();
+            DispatchQueue(*scatter_pipeline, push_constant.queue);
+            DispatchQueue(*shade_pipeline, NumQueues - 1);
+        }
+    }
+
+    Bind(*accumulate_pipeline);
+    cmd.dispatch((num_paths + GroupSize - 1) / GroupSize, 1, 1);
+    // The pixel accumulation is read back by the next frame, and the image by the denoiser
+    StageBarrier();
+}
+
+void VulkanPathTracerWavefront::OnResized(const vk::Extent2D& actual_extent) {
+    VulkanPathTracerHW::OnResized(actual_extent);
+    if (!render_targets_resized) {
+        return;
+    }
+    CreatePathBuffers();
+    if (rasterize_primary_hits) {
+        CreateVisibilityBuffer();
+    }
+}
+
+void VulkanPathTracerWavefront::SetSubScene(std::size_t index) {
+    VulkanPathTracerHW::SetSubScene(index);
+    if (rasterize_primary_hits) {
+        UploadVisibilityDraws();
+    }
+}
+
+void VulkanPathTracerWavefront::OnSceneUpdated(const SceneChanges& changes) {
+    VulkanPathTracerHW::OnSceneUpdated(changes);
+    // Reloaded resources have loaded the scene again, along with the draws
+    if (rasterize_primary_hits && !changes.resources && (changes.transforms || changes.materials)) {
+        UploadVisibilityDraws();
+    }
+}
+
+void VulkanPathTracerWavefront::SetRasterizedPrimaryHits(bool enabled) {
+    rasterize_primary_hits = enabled;
+}
+
+} // namespace Renderer
@@ -0,0 +1,114 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+#include "core/path_tracer_hw/vulkan_path_tracer_hw.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanComputePipeline;
+class VulkanDescriptorSets;
+class VulkanGraphicsPipeline;
+class VulkanImage;
+class VulkanImmUploadBuffer;
+
+/**
+ * Traces the same paths as VulkanPathTracerHW, but in stages of compute dispatches with ray
+ * queries instead of a ray tracing pipeline megakernel, to compare the two on the same scenes.
+ * The state of each pixel's path persists in storage buffers between the stages:
+ * generate.comp starts the paths with camera rays, extend.comp finds their hits, bin.comp and
+ * scatter.comp sort the hits by material, and shade.comp shades them and queues the next rays.
+ * Once all samples of the frame are done, accumulate.comp resolves them into the image.
+ * Each stage runs over a queue of path indices with an indirect dispatch, so that finished
+ * paths take no invocations in the later bounces, and shading invocations of the same group
+ * mostly evaluate the same material.
+ *
+ * With rasterized primary hits, the scene is first drawn into a visibility buffer of the draw
+ * and triangle of each pixel (visibility.vert and visibility.frag), pulling the vertices like
+ * the rasterizer. resolve.comp then takes the hits of the camera rays from it in place of
+ * extend.comp, which only traces the bounces.
+ */
+class VulkanPathTracerWavefront final : public VulkanPathTracerHW {
+public:
+    explicit VulkanPathTracerWavefront(bool enable_validation_layers,
+                                       std::vector<const char*> frontend_required_extensions);
+    ~VulkanPathTracerWavefront() override;
+
+    void OnResized(const vk::Extent2D& actual_extent) override;
+    void SetSubScene(std::size_t index) override;
+    // Rasterizes the first hits of the camera rays instead of tracing them, see above. Cameras
+    // with depth of field still trace them. Must be called before LoadScene.
+    void SetRasterizedPrimaryHits(bool enabled);
+
+private:
+    static constexpr u32 GroupSize = 64; // Of all stages but bin.comp, which is one group
+    static constexpr u32 NumQueues = 3;  // The two ray queues and the shade queue
+
+    DeviceRequirements GetDeviceRequirements() const override;
+    vk::ShaderStageFlags GetTraceStages() const override;
+    vk::PipelineStageFlags2 GetTracePipelineStages() const override;
+    void OnSceneUpdated(const SceneChanges& changes) override;
+    void CreatePipeline() override;
+    void Trace(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx, u32 uniforms_offset,
+               const vk::Extent2D& render_extent) override;
+    // The stages run over the paths of all pixels at once
+    bool SupportsTiledTracing() const override;
+    // Its stages do not measure their clock cycles or count their rays
+    bool SupportsCostHeatmap() const override;
+    bool SupportsRayStats() const override;
+    // Its shade stage samples one light per hit, and the BSDFs alone
+    bool SupportsReSTIR() const override;
+    bool SupportsPathGuiding() const override;
+    bool SupportsIntegrators() const override;
+    // For a path per pixel of the swap chain, which render extents fit in
+    void CreatePathBuffers();
+    void CreateVisibilityPipeline();
+    // Of the size of the swap chain
+    void CreateVisibilityBuffer();
+    // Of the instances of the current sub scene. The device must be idle.
+    void UploadVisibilityDraws();
+    void RasterizeVisibility(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                             u32 uniforms_offset, const vk::Extent2D& render_extent);
+
+    u32 path_capacity{};
+    std::unique_ptr<VulkanBuffer> paths_buffer;       // GLSL::WavefrontPath
+    std::unique_ptr<VulkanBuffer> queues_buffer;      // GLSL::WavefrontQueue
+    std::unique_ptr<VulkanBuffer> ray_queues_buffer;  // Path indices, path_capacity per queue
+    std::unique_ptr<VulkanBuffer> shade_queue_buffer; // Path indices, sorted by material
+    std::unique_ptr<VulkanBuffer> bins_buffer;        // Hits, then offsets, of the materials
+    // Set 3 of the stages. Binding 0 is the paths, 1 the queues, 2 the ray queues, 3 the shade
+    // queue, 4 the bins, 5 the visibility draws and 6 the visibility buffer.
+    std::unique_ptr<VulkanDescriptorSets> wavefront_descriptor_set;
+
+    std::unique_ptr<VulkanComputePipeline> generate_pipeline;
+    std::unique_ptr<VulkanComputePipeline> extend_pipeline;
+    std::unique_ptr<VulkanComputePipeline> bin_pipeline;
+    std::unique_ptr<VulkanComputePipeline> scatter_pipeline;
+    std::unique_ptr<VulkanComputePipeline> shade_pipeline;
+    std::unique_ptr<VulkanComputePipeline> accumulate_pipeline;
+
+    bool rasterize_primary_hits = false;
+    std::unique_ptr<VulkanImmUploadBuffer> visibility_draws_buffer; // GLSL::VisibilityDraw
+    struct VisibilityDrawCall {
+        u32 vertex_count{};
+        vk::CullModeFlags cull_mode{};
+    };
+    // Indexed like the visibility draws, which are sorted by their cull mode
+    std::vector<VisibilityDrawCall> visibility_draw_calls;
+    std::unique_ptr<VulkanImage> visibility_image; // R32G32_UINT, draw plus 1 and triangle
+    vk::raii::ImageView visibility_image_view = nullptr;
+    std::unique_ptr<VulkanImage> visibility_depth_image;
+    vk::raii::ImageView visibility_depth_image_view = nullptr;
+    vk::raii::RenderPass visibility_render_pass = nullptr;
+    vk::raii::Framebuffer visibility_framebuffer = nullptr;
+    std::unique_ptr<VulkanGraphicsPipeline> visibility_pipeline;
+    std::unique_ptr<VulkanComputePipeline> resolve_pipeline;
+};
+
+} // namespace Renderer
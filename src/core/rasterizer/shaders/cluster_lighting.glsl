@@ -0,0 +1,42 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _CLUSTER_LIGHTING_GLSL
+#define _CLUSTER_LIGHTING_GLSL
+
+// Lighting by the punctual lights of the clusters light_cluster.comp built, shared by
+// rasterizer.frag and shade.comp. The includer declares uniforms, lights and light_clusters as
+// rasterizer.frag does, and includes punctual_light.glsl.
+
+#define M_PI 3.1415926
+
+// Diffuse lighting of the surface at the pixel (in the render area of the view) over the albedo.
+// The normal in world space faces the viewer, or is 0 for primitives without normals, which are
+// lit as if they faced every light.
+vec3 GetPunctualLighting(vec2 pixel, vec3 position, vec3 normal, uint view) {
+    const vec2 tile = pixel / vec2(uniforms.u.render_extent) *
+                      vec2(LIGHT_CLUSTERS_X, LIGHT_CLUSTERS_Y);
+    const float depth = -(uniforms.u.view[view] * vec4(position, 1.0)).z;
+    const float slice = log(max(depth, LIGHT_CLUSTER_NEAR) / LIGHT_CLUSTER_NEAR) /
+                        log(LIGHT_CLUSTER_FAR / LIGHT_CLUSTER_NEAR) * LIGHT_CLUSTERS_Z;
+    const uvec3 coord = min(uvec3(tile, slice),
+                            uvec3(LIGHT_CLUSTERS_X - 1, LIGHT_CLUSTERS_Y - 1, LIGHT_CLUSTERS_Z - 1));
+    const uint first =
+        (((view * LIGHT_CLUSTERS_Z + coord.z) * LIGHT_CLUSTERS_Y + coord.y) * LIGHT_CLUSTERS_X +
+         coord.x) *
+        (MAX_CLUSTER_LIGHTS + 1);
+
+    const bool has_normal = dot(normal, normal) > 0;
+    vec3 lighting = vec3(0);
+    for (uint i = 0; i < light_clusters[first]; ++i) {
+        vec3 direction;
+        float distance;
+        const vec3 irradiance = GetPunctualLightIrradiance(lights[light_clusters[first + 1 + i]],
+                                                           position, direction, distance);
+        lighting += irradiance * (has_normal ? max(dot(normal, direction), 0.0) : 1.0);
+    }
+    return lighting / M_PI;
+}
+
+#endif
@@ -0,0 +1,152 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _PROBE_LIGHTING_GLSL
+#define _PROBE_LIGHTING_GLSL
+
+// Lighting by the irradiance probes of probe GI (see PROBE_RAYS), shared by rasterizer.frag,
+// shade.comp and the probe updates. The includer declares uniforms as rasterizer.frag does, and
+// the probes, which only the sampling reads.
+
+#ifndef M_PI
+#define M_PI 3.1415926
+#endif
+
+// Of the spherical harmonics, the constant band and the linear one
+#define PROBE_SH0 0.282095
+#define PROBE_SH1 0.488603
+// Fragments look the probes up this far along their normals, relative to the probe spacing, so
+// that the surfaces the probes see them on do not shadow them
+#define PROBE_NORMAL_BIAS 0.2
+
+uint GetProbeIndex(uvec3 coord) {
+    return (coord.z * uniforms.u.probe_grid.y + coord.y) * uniforms.u.probe_grid.x + coord.x;
+}
+
+uvec3 GetProbeCoord(uint probe) {
+    const uvec3 grid = uniforms.u.probe_grid;
+    return uvec3(probe % grid.x, (probe / grid.x) % grid.y, probe / (grid.x * grid.y));
+}
+
+vec3 GetProbePosition(uvec3 coord) {
+    return uniforms.u.probe_origin + vec3(coord) * uniforms.u.probe_spacing;
+}
+
+// Distances are clamped to this, so that those of the rays that missed do not outweigh the rest
+float GetProbeMaxDistance() {
+    return 1.5 * sqrt(3.0) * uniforms.u.probe_spacing;
+}
+
+// Spread evenly over the sphere (see Keinert et al., "Spherical Fibonacci Mapping"), and turned by
+// the rotation of the frame
+vec3 GetProbeRayDirection(mat3 rotation, uint ray) {
+    const float golden_angle = M_PI * (3.0 - sqrt(5.0));
+    const float z = 1.0 - (2.0 * float(ray) + 1.0) / float(PROBE_RAYS);
+    const float r = sqrt(max(1.0 - z * z, 0.0));
+    const float phi = golden_angle * float(ray);
+    return rotation * vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// See Cigolle et al., "A Survey of Efficient Representations for Independent Unit Vectors"
+vec2 ProbeOctahedralEncode(vec3 v) {
+    v /= abs(v.x) + abs(v.y) + abs(v.z);
+    if (v.z < 0.0) {
+        v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return v.xy;
+}
+
+uint GetProbeDepthTexel(vec3 direction) {
+    const uvec2 texel = min(uvec2((ProbeOctahedralEncode(direction) * 0.5 + 0.5) *
+                                  float(PROBE_DEPTH_SIZE)),
+                            uvec2(PROBE_DEPTH_SIZE - 1));
+    return texel.y * PROBE_DEPTH_SIZE + texel.x;
+}
+
+// Of the center of the texel
+vec3 GetProbeTexelDirection(uint texel) {
+    const vec2 e = (vec2(texel % PROBE_DEPTH_SIZE, texel / PROBE_DEPTH_SIZE) + 0.5) /
+                       float(PROBE_DEPTH_SIZE) * 2.0 -
+                   1.0;
+    vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (v.z < 0.0) {
+        v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(v);
+}
+
+// The mean distance and squared distance to the surfaces the probe sees in the direction
+vec2 GetProbeDepth(uint probe, vec3 direction) {
+    const uint texel = GetProbeDepthTexel(direction);
+    const vec4 pair = probes[probe * PROBE_VEC4S + 4 + texel / 2];
+    return texel % 2 == 0 ? pair.xy : pair.zw;
+}
+
+// Irradiance the probe receives on a surface of the normal (see Ramamoorthi and Hanrahan, "An
+// Efficient Representation for Irradiance Environment Maps"), or its mean over all normals for 0
+vec3 EvaluateProbeIrradiance(uint probe, vec3 normal) {
+    const uint first = probe * PROBE_VEC4S;
+    vec3 irradiance = M_PI * PROBE_SH0 * probes[first].rgb;
+    if (dot(normal, normal) > 0) {
+        irradiance += (2.0 * M_PI / 3.0) * PROBE_SH1 *
+                      (probes[first + 1].rgb * normal.y + probes[first + 2].rgb * normal.z +
+                       probes[first + 3].rgb * normal.x);
+    }
+    return max(irradiance, vec3(0));
+}
+
+// Irradiance at the position, blended from the 8 probes around it. Each is weighed by whether it
+// is in front of the surface, and by whether it sees the position (with a Chebyshev test of the
+// distances it saw, as in variance shadow maps). Probes not updated yet or left inside geometry
+// are skipped. The normal is as in GetPunctualLighting.
+vec3 GetProbeIrradiance(vec3 position, vec3 normal) {
+    const bool has_normal = dot(normal, normal) > 0;
+    const vec3 biased_position =
+        position + normal * (PROBE_NORMAL_BIAS * uniforms.u.probe_spacing);
+    const uvec3 grid = uniforms.u.probe_grid;
+    const vec3 grid_position =
+        clamp((biased_position - uniforms.u.probe_origin) / uniforms.u.probe_spacing, vec3(0),
+              vec3(grid - 1u));
+    const uvec3 base = min(uvec3(grid_position), grid - 2u);
+    const vec3 alpha = grid_position - vec3(base);
+
+    vec3 irradiance = vec3(0);
+    float weight_sum = 0.0;
+    for (uint i = 0; i < 8; ++i) {
+        const uvec3 offset = uvec3(i & 1u, (i >> 1) & 1u, i >> 2);
+        const uvec3 coord = base + offset;
+        const uint probe = GetProbeIndex(coord);
+        if (probes[probe * PROBE_VEC4S].w <= 0) {
+            continue;
+        }
+        const vec3 probe_position = GetProbePosition(coord);
+
+        float weight = 1.0;
+        const vec3 to_probe = probe_position - position;
+        const float probe_distance = length(to_probe);
+        if (has_normal && probe_distance > 0) {
+            const float wrap = (dot(to_probe / probe_distance, normal) + 1.0) * 0.5;
+            weight *= wrap * wrap + 0.2;
+        }
+        const vec3 from_probe = biased_position - probe_position;
+        const float distance = length(from_probe);
+        if (distance > 0) {
+            const vec2 moments = GetProbeDepth(probe, from_probe / distance);
+            if (distance > moments.x) {
+                const float variance = abs(moments.y - moments.x * moments.x);
+                const float delta = distance - moments.x;
+                const float visibility = variance / (variance + delta * delta);
+                weight *= visibility * visibility * visibility;
+            }
+        }
+        const vec3 trilinear = mix(1.0 - alpha, alpha, vec3(offset));
+        weight = max(weight, 1e-4) * trilinear.x * trilinear.y * trilinear.z;
+
+        irradiance += EvaluateProbeIrradiance(probe, normal) * weight;
+        weight_sum += weight;
+    }
+    return weight_sum > 0 ? irradiance / weight_sum : vec3(0);
+}
+
+#endif
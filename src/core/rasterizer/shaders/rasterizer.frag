@@ -5,30 +5,81 @@
 #version 460
 #extension GL_GOOGLE_include_directive : enable
 #extension GL_EXT_nonuniform_qualifier : enable
+#extension GL_EXT_multiview : enable
 
+#include "core/rasterizer/shaders/rasterizer_glsl.h"
 #include "core/shaders/scene_glsl.h"
+#include "core/shaders/punctual_light.glsl"
 
-layout(set = 0, binding = 0) uniform MaterialBlock {
-    Material m;
+layout(set = 0, binding = 0, std140) readonly buffer MaterialBlock {
+    PackedMaterial materials[];
+};
+layout(set = 0, binding = 1) uniform sampler2D textures[];
+
+#define TEXTURE_STREAMING_SET 1
+#include "core/shaders/texture_streaming.glsl"
+
+layout(set = 2, binding = 0, std140) uniform FrameUniforms {
+    RasterizerUniforms u;
 }
-material;
+uniforms;
+layout(set = 2, binding = 12, std430) readonly buffer PunctualLightBlock {
+    PunctualLight lights[];
+};
+// Written by light_cluster.comp
+layout(set = 2, binding = 13, std430) readonly buffer LightClusterBlock {
+    uint light_clusters[];
+};
+// Written by probe_blend.comp
+layout(set = 2, binding = 14, std430) readonly buffer ProbeBlock {
+    vec4 probes[];
+};
 
-layout(set = 0, binding = 1) uniform sampler2D base_color_texture;
+#include "core/rasterizer/shaders/cluster_lighting.glsl"
+#include "core/rasterizer/shaders/probe_lighting.glsl"
 
 layout(location = 0) in vec4 fragColor;
 layout(location = 1) in vec3 fragNormal;
 layout(location = 2) in vec2 fragTexCoord0;
 layout(location = 3) in vec2 fragTexCoord1;
+layout(location = 4) flat in uint fragMaterialIndex;
+layout(location = 5) in vec3 fragPosition;
 
 layout(location = 0) out vec4 outColor;
 
+// Requests the level the hardware would have picked, and samples as close to it as is resident
+vec4 SampleStreamedTexture(uint texture_index, vec2 texcoord) {
+    // Dynamically uniform, as the whole draw has the same material
+    const float lod = textureQueryLod(textures[texture_index], texcoord).y;
+    RequestTextureLevel(texture_index, lod);
+    // Scaling the gradients keeps the anisotropic footprint while moving to a coarser level
+    const float scale = exp2(max(GetTextureMinLod(texture_index) - lod, 0.0));
+    return textureGrad(textures[texture_index], texcoord, dFdx(texcoord) * scale,
+                       dFdy(texcoord) * scale);
+}
+
 // TODO: Actually implement the material
 void main() {
+    const Material material = UnpackMaterial(materials[fragMaterialIndex]);
     vec2 base_color_tex_coord =
-        material.m.base_color_texture_texcoord == 0 ? fragTexCoord0 : fragTexCoord1;
-    vec4 texture_color = material.m.base_color_texture_index == -1
-                             ? vec4(1)
-                             : texture(base_color_texture, base_color_tex_coord);
+        material.base_color_texture_texcoord == 0 ? fragTexCoord0 : fragTexCoord1;
+    vec4 texture_color =
+        material.base_color_texture_index == -1
+            ? vec4(1)
+            : SampleStreamedTexture(material.base_color_texture_index, base_color_tex_coord);
     // TODO: Fix unbound fragColor
-    outColor = material.m.base_color_factor * texture_color;
+    outColor = material.base_color_factor * texture_color;
+    if (uniforms.u.num_lights > 0 || uniforms.u.num_probes > 0) {
+        const bool has_normal = dot(fragNormal, fragNormal) > 0;
+        const vec3 normal =
+            has_normal ? normalize(gl_FrontFacing ? fragNormal : -fragNormal) : vec3(0);
+        vec3 lighting = vec3(0);
+        if (uniforms.u.num_lights > 0) {
+            lighting += GetPunctualLighting(gl_FragCoord.xy, fragPosition, normal, gl_ViewIndex);
+        }
+        if (uniforms.u.num_probes > 0) {
+            lighting += GetProbeIrradiance(fragPosition, normal) / M_PI;
+        }
+        outColor.rgb *= lighting;
+    }
 }
@@ -0,0 +1,74 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+// The vertex shader of the rasterizer, included by rasterizer.vert and, with
+// PRIMITIVE_SHADING_RATE defined to 1, by rasterizer_vrs.vert for the shading rates of the
+// materials (GL_EXT_fragment_shading_rate).
+
+#ifndef PRIMITIVE_SHADING_RATE
+#define PRIMITIVE_SHADING_RATE 0
+#endif
+
+#include "core/rasterizer/shaders/rasterizer_glsl.h"
+#include "core/shaders/primitive_glsl.h"
+#include "core/shaders/vertex_fetch.glsl"
+
+layout(set = 0, binding = 2, std430) readonly buffer PrimitiveBlock {
+    PrimitiveInfo primitives[];
+};
+
+layout(set = 2, binding = 0, std140) uniform FrameUniforms {
+    RasterizerUniforms u;
+}
+uniforms;
+layout(set = 2, binding = 1, std430) readonly buffer DrawInfoBlock {
+    DrawInfo draws[];
+};
+layout(set = 2, binding = 2, std430) readonly buffer TransformBlock {
+    mat4 instance_transforms[];
+};
+layout(set = 2, binding = 11, std430) readonly buffer BatchInstanceBlock {
+    uint batch_instances[];
+};
+
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec3 fragNormal;
+layout(location = 2) out vec2 fragTexCoord0;
+layout(location = 3) out vec2 fragTexCoord1;
+layout(location = 4) flat out uint fragMaterialIndex;
+layout(location = 5) out vec3 fragPosition; // In world space, as is the normal
+
+// The depth pre-pass runs this shader as well, and the shading pass tests against its depth
+invariant gl_Position;
+
+void main() {
+    // Each instance of the batch is one of its visible draws
+    const DrawInfo draw = draws[batch_instances[gl_InstanceIndex]];
+    const PrimitiveInfo primitive = primitives[draw.primitive];
+
+    // There is no vertex input state, the attributes are pulled from the vertex heap.
+    // gl_VertexIndex is the index of the vertex in its primitive.
+#define HAS_ATTRIBUTE(variable) (ATTRIBUTE_STRIDE(primitive.variable##_format) != 0)
+#define LOAD_ATTRIBUTE(Func, variable)                                                             \
+    Func(primitive.variable##_address +                                                            \
+             gl_VertexIndex * ATTRIBUTE_STRIDE(primitive.variable##_format),                       \
+         ATTRIBUTE_TYPE(primitive.variable##_format))
+
+    const mat4 transform = instance_transforms[draw.instance];
+    const vec4 world_position = transform * vec4(LOAD_ATTRIBUTE(LoadPosition, position), 1.0);
+    gl_Position = uniforms.u.view_proj[gl_ViewIndex] * world_position;
+    fragPosition = world_position.xyz;
+    fragNormal = HAS_ATTRIBUTE(normal)
+                     ? transpose(inverse(mat3(transform))) * LOAD_ATTRIBUTE(LoadNormal, normal)
+                     : vec3(0);
+    fragTexCoord0 = HAS_ATTRIBUTE(texcoord0) ? LOAD_ATTRIBUTE(LoadTexCoord, texcoord0) : vec2(0);
+    fragTexCoord1 = HAS_ATTRIBUTE(texcoord1) ? LOAD_ATTRIBUTE(LoadTexCoord, texcoord1) : vec2(0);
+    fragColor = HAS_ATTRIBUTE(color) ? LOAD_ATTRIBUTE(LoadColor, color) : vec4(1);
+#undef LOAD_ATTRIBUTE
+#undef HAS_ATTRIBUTE
+    fragMaterialIndex = draw.material;
+#if PRIMITIVE_SHADING_RATE
+    gl_PrimitiveShadingRateEXT = int(draw.shading_rate);
+#endif
+}
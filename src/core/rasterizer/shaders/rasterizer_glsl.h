@@ -0,0 +1,140 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef RASTERIZER_GLSL_H
+#define RASTERIZER_GLSL_H
+
+#include "core/vulkan/host_glsl_shared.h"
+
+// The view frustum is split into clusters for the punctual lights, in tiles of the render area
+// and slices of the view depth that grow exponentially from LIGHT_CLUSTER_NEAR to
+// LIGHT_CLUSTER_FAR. Fragments past it use the last slice. Each cluster lists the lights that may
+// reach it in MAX_CLUSTER_LIGHTS + 1 uints, their count followed by their indices.
+#define LIGHT_CLUSTERS_X 16
+#define LIGHT_CLUSTERS_Y 9
+#define LIGHT_CLUSTERS_Z 24
+#define LIGHT_CLUSTER_NEAR 0.1
+#define LIGHT_CLUSTER_FAR 1000.0
+#define MAX_CLUSTER_LIGHTS 63
+
+// Probe GI lights the fragments indirectly with a grid of irradiance probes over the instances,
+// as in DDGI (Majercik et al., "Dynamic Diffuse Global Illumination with Ray-Traced Irradiance
+// Fields"). Each probe is updated by tracing PROBE_RAYS rays around it, and keeps PROBE_VEC4S
+// vec4s: the L1 spherical harmonics of the radiance reaching it (whose first w is its state,
+// see probe_blend.comp), then the mean distances (and their squares) to the surfaces around it,
+// in PROBE_DEPTH_SIZE^2 texels octahedrally mapped over the sphere, two to a vec4.
+#define PROBE_RAYS 64
+#define PROBE_DEPTH_SIZE 8
+#define PROBE_DEPTH_TEXELS (PROBE_DEPTH_SIZE * PROBE_DEPTH_SIZE)
+#define PROBE_VEC4S (4 + PROBE_DEPTH_TEXELS / 2)
+
+// Variable rate shading encodes the fragment sizes as the shading rate image texels and
+// gl_PrimitiveShadingRateEXT do, log2 of the width in bits 2-3 and of the height in bits 0-1.
+// Tiles of the previous frame whose perceived luminance changes by less than
+// SHADING_RATE_THRESHOLD between neighbouring pixels along an axis are shaded coarser along it.
+#define SHADING_RATE_1X1 0
+#define SHADING_RATE_2X2 5
+#define SHADING_RATE_THRESHOLD 0.015
+
+// In stereo, both eyes are drawn at once with multiview, each into a layer of the render
+// targets. The light clusters, Hi-Z pyramid and matrices are per view, indexed by gl_ViewIndex.
+#define MAX_VIEWS 2
+
+// A primitive of a mesh instance
+BEGIN_STRUCT(DrawInfo)
+
+uint instance;    // In the sub scene
+uint material;    // In the scene
+uint first_batch; // Of the primitive, followed by those of its coarser levels of detail
+uint num_lods;
+uint primitive;   // In the scene, indexes the PrimitiveInfos the vertices are pulled with
+// Coarsest SHADING_RATE_* its material allows, combined with the shading rate image by taking
+// the finer of the two
+uint shading_rate;
+INSERT_PADDING(2)
+
+END_STRUCT(DrawInfo)
+
+// A level of detail of a primitive, whose visible draws are drawn as the instances of a single
+// indirect command. The vertex shader finds the draw of each instance in the batch instances.
+BEGIN_STRUCT(DrawBatch)
+
+uint group;          // Indexes the draw counts
+uint first_command;  // Of the group
+uint first_index;    // In the index heap block of the group
+uint index_count;
+uint first_instance; // Of its range in the batch instances, which fits all draws of the primitive
+float error;         // In mesh space, see MeshPrimitive::LOD. 0 for the primitive itself.
+INSERT_PADDING(2)
+
+END_STRUCT(DrawBatch)
+
+BEGIN_STRUCT(RasterizerUniforms)
+
+ARRAY(mat4, view_proj, MAX_VIEWS);
+uint num_draws;      // Visible ones, culled further by cull.comp
+uint hiz_levels;
+uvec2 render_extent; // Of each view, in pixels of the depth image, which the Hi-Z pyramid halves
+vec3 camera_position; // Between the eyes in stereo
+float lod_scale; // Pixels covered by a unit at unit distance, over the tolerated LOD error
+ARRAY(mat4, view, MAX_VIEWS);
+ARRAY(mat4, inverse_proj, MAX_VIEWS);
+uint num_lights; // Punctual lights of the sub scene, the fragments are unlit without any nor probes
+// Of each phase in the batch instances, for visibility.vert to find the batch it draws. At least
+// 1.
+uint num_batch_instances;
+uint num_views;         // Those of the arrays that are set
+INSERT_PADDING(1)
+mat4 inverse_view_proj; // Of view 0, for shade.comp to trace the camera rays
+vec3 probe_origin;       // Of the first probe of the grid
+float probe_spacing;     // Between neighbouring probes, along every axis
+uvec3 probe_grid;        // Probes along each axis, at least 2
+uint num_probes;         // 0 without probe GI
+
+END_STRUCT(RasterizerUniforms)
+
+// Occlusion culling runs in two phases. The first draws what was visible in the previous
+// frame, and the second tests the rest against the Hi-Z pyramid of the first's depth.
+BEGIN_STRUCT(CullPushConstant)
+
+uint phase;
+uint first_count;    // Of the phase in the draw counts
+uint num_batches;    // Each phase has as many batch counts and draw commands
+uint first_instance; // Of the phase in the batch instances
+
+END_STRUCT(CullPushConstant)
+
+// The probes updated in a frame are the next ones after those of the previous frame, wrapping
+// around the grid. Their rays are turned by a random rotation each frame, and pick the lights
+// they sample with a random seed.
+BEGIN_STRUCT(ProbeUpdatePushConstant)
+
+mat4 ray_rotation;
+uint first_probe;
+uint num_updated;
+uint seed;
+INSERT_PADDING(1)
+
+END_STRUCT(ProbeUpdatePushConstant)
+
+BEGIN_STRUCT(HiZPushConstant)
+
+uvec2 src_extent;
+uvec2 dst_extent;
+
+END_STRUCT(HiZPushConstant)
+
+// One workgroup of shading_rate.comp per texel of the shading rate image, covering tile_size
+// pixels of the render area (at least the workgroup size), read from the previous frame at the
+// same relative position
+BEGIN_STRUCT(ShadingRatePushConstant)
+
+uvec2 src_extent; // Render area of the previous frame
+uvec2 dst_extent; // Of this frame
+uvec2 tile_size;
+INSERT_PADDING(2)
+
+END_STRUCT(ShadingRatePushConstant)
+
+#endif
@@ -0,0 +1,16 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#version 460
+
+layout(location = 0) flat in uint fragDraw;
+layout(location = 1) flat in uint fragFirstTriangle;
+
+// The draw plus 1 (0 is nothing drawn) and the triangle
+layout(location = 0) out uvec2 outVisibility;
+
+// gl_PrimitiveID counts the triangles of the instance from the first index of its command
+void main() {
+    outVisibility = uvec2(fragDraw + 1, fragFirstTriangle + gl_PrimitiveID);
+}
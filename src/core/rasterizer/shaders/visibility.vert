@@ -0,0 +1,67 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+#extension GL_EXT_shader_explicit_arithmetic_types_int8 : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int16 : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int32 : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int64 : require
+#extension GL_EXT_buffer_reference2 : require
+#extension GL_EXT_scalar_block_layout : enable
+
+#include "core/rasterizer/shaders/rasterizer_glsl.h"
+#include "core/shaders/primitive_glsl.h"
+#include "core/shaders/vertex_fetch.glsl"
+
+layout(set = 0, binding = 2, std430) readonly buffer PrimitiveBlock {
+    PrimitiveInfo primitives[];
+};
+
+layout(set = 2, binding = 0, std140) uniform FrameUniforms {
+    RasterizerUniforms u;
+}
+uniforms;
+layout(set = 2, binding = 1, std430) readonly buffer DrawInfoBlock {
+    DrawInfo draws[];
+};
+layout(set = 2, binding = 2, std430) readonly buffer TransformBlock {
+    mat4 instance_transforms[];
+};
+layout(set = 2, binding = 9, std430) readonly buffer DrawBatchBlock {
+    DrawBatch batches[];
+};
+layout(set = 2, binding = 11, std430) readonly buffer BatchInstanceBlock {
+    uint batch_instances[];
+};
+
+layout(location = 0) flat out uint fragDraw;
+// Of the level of detail, in the triangles of the primitive that ReadTriangleIndices reads
+layout(location = 1) flat out uint fragFirstTriangle;
+
+// Only the positions of rasterizer.vert, the rest is fetched by shade.comp
+void main() {
+    const uint draw_idx = batch_instances[gl_InstanceIndex];
+    const DrawInfo draw = draws[draw_idx];
+    const PrimitiveInfo primitive = primitives[draw.primitive];
+
+    const vec3 position =
+        LoadPosition(primitive.position_address +
+                         gl_VertexIndex * ATTRIBUTE_STRIDE(primitive.position_format),
+                     ATTRIBUTE_TYPE(primitive.position_format));
+    gl_Position =
+        uniforms.u.view_proj[0] * instance_transforms[draw.instance] * vec4(position, 1.0);
+
+    // The batches of the levels of detail of a primitive take consecutive ranges of the batch
+    // instances, so the one drawn is the last that starts at or before this instance
+    const uint instance = gl_InstanceIndex % uniforms.u.num_batch_instances;
+    uint batch = draw.first_batch;
+    for (uint i = 1; i <= draw.num_lods && batches[draw.first_batch + i].first_instance <= instance;
+         ++i) {
+        batch = draw.first_batch + i;
+    }
+    // Their indices follow those of the full primitive
+    fragFirstTriangle = (batches[batch].first_index - batches[draw.first_batch].first_index) / 3;
+    fragDraw = draw_idx;
+}
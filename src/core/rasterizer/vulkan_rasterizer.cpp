@@ -2,23 +2,47 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <spdlog/spdlog.h>
 #include "common/file_util.h"
+#include "common/profiling.h"
 #include "common/ranges.h"
 #include "common/temp_ptr.h"
+#include "core/instance_bvh.h"
+#include "core/lazy_texture_loader.h"
+#include "core/load_profiler.h"
+#include "core/rasterizer/shaders/rasterizer_glsl.h"
 #include "core/rasterizer/vulkan_rasterizer.h"
 #include "core/scene.h"
+#include "core/vulkan/vulkan_accel_structure.h"
 #include "core/vulkan/vulkan_allocator.h"
 #include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
 #include "core/vulkan/vulkan_context.h"
 #include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_frame_allocator.h"
 #include "core/vulkan/vulkan_frames_in_flight.hpp"
+#include "core/vulkan/vulkan_geometry_heap.h"
+#include "core/vulkan/vulkan_geometry_streamer.h"
 #include "core/vulkan/vulkan_graphics_pipeline.h"
 #include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_profiler.h"
+#include "core/vulkan/vulkan_render_target_heap.h"
 #include "core/vulkan/vulkan_shader.h"
 #include "core/vulkan/vulkan_swapchain.h"
 #include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_texture_streamer.h"
+#include "core/vulkan/vulkan_upload_ring.h"
 
 namespace Renderer {
 
@@ -27,10 +51,26 @@ VulkanRasterizer::VulkanRasterizer(bool enable_validation_layers,
     : VulkanRenderer(enable_validation_layers, std::move(frontend_required_extensions)) {}
 
 VulkanRasterizer::~VulkanRasterizer() {
-    (*device)->waitIdle();
+    device->WaitIdle();
 }
 
 VulkanRenderer::OffscreenImageInfo VulkanRasterizer::GetOffscreenImageInfo() const {
+    if (visibility_buffer) { // Written by shade.comp
+        return {
+            .format = vk::Format::eR16G16B16A16Sfloat,
+            .usage = vk::ImageUsageFlagBits::eStorage,
+            .dst_stage_mask = vk::PipelineStageFlagBits2::eComputeShader,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageWrite,
+        };
+    }
+    if (GetNumViews() > 1) { // Copied from the layers of the stereo image
+        return {
+            .format = swap_chain->surface_format.format,
+            .usage = vk::ImageUsageFlagBits::eTransferDst,
+            .dst_stage_mask = vk::PipelineStageFlagBits2::eCopy,
+            .dst_access_mask = vk::AccessFlagBits2::eTransferWrite,
+        };
+    }
     return {
         .format = swap_chain->surface_format.format,
         .usage = vk::ImageUsageFlagBits::eColorAttachment,
@@ -39,39 +79,92 @@ VulkanRenderer::OffscreenImageInfo VulkanRasterizer::GetOffscreenImageInfo() con
     };
 }
 
-std::unique_ptr<VulkanDevice> VulkanRasterizer::CreateDevice(
-    vk::SurfaceKHR surface, [[maybe_unused]] const vk::Extent2D& actual_extent) const {
-    return std::make_unique<VulkanDevice>(
-        context->instance, surface,
-        std::array{
-            VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-            VK_EXT_VERTEX_INPUT_DYNAMIC_STATE_EXTENSION_NAME,
-            VK_EXT_ROBUSTNESS_2_EXTENSION_NAME,
-        },
-        Helpers::GenericStructureChain{
+// With multiview, each eye drawn into a layer of the attachments
+bool VulkanRasterizer::SupportsStereo() const {
+    return true;
+}
+
+VulkanRenderer::DeviceRequirements VulkanRasterizer::GetDeviceRequirements() const {
+    // The pixels of the visibility buffer are each shaded once already, in a compute pass
+    const bool fragment_shading_rate = variable_rate_shading && !visibility_buffer;
+    // The features of the extensions of probe GI are only chained with them, as the device
+    // enables more of the acceleration structure extensions it finds features of
+    const auto GetFeatures = [this](auto&&... extra_features) {
+        return Helpers::GenericStructureChain{
             vk::PhysicalDeviceFeatures2{
                 .features =
                     {
+                        // For gl_PrimitiveID in the fragment shader of the visibility buffer
+                        .geometryShader = visibility_buffer ? VK_TRUE : VK_FALSE,
+                        // For GPU-driven rendering
+                        .multiDrawIndirect = VK_TRUE,
+                        .drawIndirectFirstInstance = VK_TRUE,
                         .samplerAnisotropy = VK_TRUE,
+                        // For the texture streaming feedback
+                        .fragmentStoresAndAtomics = VK_TRUE,
+                        // For the material textures
+                        .shaderSampledImageArrayDynamicIndexing = VK_TRUE,
+                        // For pulling the vertices
+                        .shaderInt64 = VK_TRUE,
+                        .shaderInt16 = VK_TRUE,
                     },
             },
-            // We don't need this in itself, but we enabled it on VMA
+            vk::PhysicalDeviceVulkan11Features{
+                .storageBuffer16BitAccess = VK_TRUE,
+                // For drawing both eyes at once in stereo
+                .multiview = GetNumViews() > 1 ? VK_TRUE : VK_FALSE,
+            },
             vk::PhysicalDeviceVulkan12Features{
+                .drawIndirectCount = VK_TRUE,
+                .storageBuffer8BitAccess = VK_TRUE,
+                .shaderInt8 = VK_TRUE,
+                // For the textures of the materials of the pixels shade.comp shades
+                .shaderSampledImageArrayNonUniformIndexing =
+                    visibility_buffer ? VK_TRUE : VK_FALSE,
+                .runtimeDescriptorArray = VK_TRUE,
+                .scalarBlockLayout = VK_TRUE,
+                .timelineSemaphore = VK_TRUE,
+                // The vertex shader pulls the vertices through their addresses
                 .bufferDeviceAddress = VK_TRUE,
             },
             vk::PhysicalDeviceVulkan13Features{
                 .pipelineCreationCacheControl = VK_TRUE,
                 .synchronization2 = VK_TRUE,
             },
-            vk::PhysicalDeviceVertexInputDynamicStateFeaturesEXT{
-                .vertexInputDynamicState = VK_TRUE,
-            },
             vk::PhysicalDeviceRobustness2FeaturesEXT{
                 .nullDescriptor = VK_TRUE,
             },
-        });
+            std::forward<decltype(extra_features)>(extra_features)...,
+        };
+    };
+    if (!probe_gi) {
+        return {
+            .extensions = {VK_EXT_ROBUSTNESS_2_EXTENSION_NAME},
+            .features = GetFeatures(),
+            .fragment_shading_rate = fragment_shading_rate,
+        };
+    }
+    // The probes trace rays from compute shaders
+    return {
+        .extensions =
+            {
+                VK_EXT_ROBUSTNESS_2_EXTENSION_NAME,
+                VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+                VK_KHR_RAY_QUERY_EXTENSION_NAME,
+                VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
+            },
+        .features = GetFeatures(
+            vk::PhysicalDeviceAccelerationStructureFeaturesKHR{
+                .accelerationStructure = VK_TRUE,
+            },
+            vk::PhysicalDeviceRayQueryFeaturesKHR{
+                .rayQuery = VK_TRUE,
+            }),
+        .fragment_shading_rate = fragment_shading_rate,
+    };
 }
 
+// The depth image is also sampled to build the Hi-Z pyramid
 static vk::Format FindDepthFormat(const vk::raii::PhysicalDevice& physical_device) {
     static constexpr std::array<vk::Format, 3> Candidates{{
         vk::Format::eD32Sfloat,
@@ -79,42 +172,156 @@ static vk::Format FindDepthFormat(const vk::raii::PhysicalDevice& physical_devic
         vk::Format::eD24UnormS8Uint,
     }};
 
+    static constexpr vk::FormatFeatureFlags RequiredFeatures =
+        vk::FormatFeatureFlagBits::eDepthStencilAttachment |
+        vk::FormatFeatureFlagBits::eSampledImage;
     for (const auto format : Candidates) {
-        if (physical_device.getFormatProperties(format).optimalTilingFeatures &
-            vk::FormatFeatureFlagBits::eDepthStencilAttachment) {
+        if ((physical_device.getFormatProperties(format).optimalTilingFeatures &
+             RequiredFeatures) == RequiredFeatures) {
             return format;
         }
     }
     throw std::runtime_error("Failed to find depth format!");
 }
 
+// Without a color format, the render pass only has the depth attachment. Loaded attachments
+// keep what the previous pass of the frame has rendered. With several views, each is drawn into
+// a layer of the attachments with multiview. With a shading rate tile, the last attachment is
+// the shading rate image, with a texel per tile.
+static vk::raii::RenderPass CreateRenderPass(
+    const VulkanDevice& device, std::optional<vk::Format> color_format, vk::Format depth_format,
+    vk::AttachmentLoadOp color_load_op, vk::AttachmentLoadOp depth_load_op, u32 num_views,
+    std::optional<vk::Extent2D> shading_rate_tile = std::nullopt) {
+
+    std::vector<vk::AttachmentDescription2> attachments;
+    std::vector<vk::SubpassDependency2> dependencies{{
+        .srcSubpass = VK_SUBPASS_EXTERNAL,
+        .dstSubpass = 0,
+        .srcStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests |
+                        vk::PipelineStageFlagBits::eLateFragmentTests,
+        .dstStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests |
+                        vk::PipelineStageFlagBits::eLateFragmentTests,
+        .srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead |
+                         vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+        .dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead |
+                         vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+    }};
+    if (color_format) {
+        attachments.push_back({
+            .format = *color_format,
+            .loadOp = color_load_op,
+            .storeOp = vk::AttachmentStoreOp::eStore,
+            .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+            .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+            .initialLayout = color_load_op == vk::AttachmentLoadOp::eLoad
+                                 ? vk::ImageLayout::eGeneral
+                                 : vk::ImageLayout::eUndefined,
+            .finalLayout = vk::ImageLayout::eGeneral,
+        });
+        dependencies.push_back({
+            .srcSubpass = VK_SUBPASS_EXTERNAL,
+            .dstSubpass = 0,
+            .srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            .dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            .srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
+            .dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
+        });
+    }
+    // Stored for the Hi-Z pyramid and the later passes
+    attachments.push_back({
+        .format = depth_format,
+        .loadOp = depth_load_op,
+        .storeOp = vk::AttachmentStoreOp::eStore,
+        .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+        .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+        .initialLayout = depth_load_op == vk::AttachmentLoadOp::eLoad
+                             ? vk::ImageLayout::eDepthStencilAttachmentOptimal
+                             : vk::ImageLayout::eUndefined,
+        .finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+    });
+
+    // Only read, after the barrier that transitioned it in DrawFrame
+    if (shading_rate_tile) {
+        attachments.push_back({
+            .format = vk::Format::eR8Uint,
+            .loadOp = vk::AttachmentLoadOp::eLoad,
+            .storeOp = vk::AttachmentStoreOp::eNone,
+            .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+            .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+            .initialLayout = vk::ImageLayout::eFragmentShadingRateAttachmentOptimalKHR,
+            .finalLayout = vk::ImageLayout::eFragmentShadingRateAttachmentOptimalKHR,
+        });
+    }
+
+    const vk::AttachmentReference2 color_reference{
+        .attachment = 0,
+        .layout = vk::ImageLayout::eGeneral,
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+    };
+    const vk::AttachmentReference2 depth_reference{
+        .attachment = color_format ? 1u : 0u,
+        .layout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+        .aspectMask = vk::ImageAspectFlagBits::eDepth,
+    };
+    const vk::AttachmentReference2 shading_rate_reference{
+        .attachment = static_cast<u32>(attachments.size() - 1),
+        .layout = vk::ImageLayout::eFragmentShadingRateAttachmentOptimalKHR,
+    };
+    const vk::FragmentShadingRateAttachmentInfoKHR shading_rate_info{
+        .pFragmentShadingRateAttachment = &shading_rate_reference,
+        .shadingRateAttachmentTexelSize = shading_rate_tile.value_or(vk::Extent2D{}),
+    };
+    // The views see mostly the same, which implementations may render concurrently
+    const u32 view_mask = num_views > 1 ? (1u << num_views) - 1 : 0;
+    return vk::raii::RenderPass{
+        *device,
+        vk::RenderPassCreateInfo2{
+            .attachmentCount = static_cast<u32>(attachments.size()),
+            .pAttachments = attachments.data(),
+            .subpassCount = 1,
+            .pSubpasses = TempArr<vk::SubpassDescription2>{{
+                .pNext = shading_rate_tile ? &shading_rate_info : nullptr,
+                .pipelineBindPoint = vk::PipelineBindPoint::eGraphics,
+                .viewMask = view_mask,
+                .colorAttachmentCount = color_format ? 1u : 0u,
+                .pColorAttachments = color_format ? &color_reference : nullptr,
+                .pDepthStencilAttachment = &depth_reference,
+            }},
+            .dependencyCount = static_cast<u32>(dependencies.size()),
+            .pDependencies = dependencies.data(),
+            .correlatedViewMaskCount = view_mask != 0 ? 1u : 0u,
+            .pCorrelatedViewMasks = &view_mask,
+        }};
+}
+
 void VulkanRasterizer::CreateDepthResources() {
-    depth_image =
-        std::make_unique<VulkanImage>(*device->allocator,
-                                      vk::ImageCreateInfo{
-                                          .imageType = vk::ImageType::e2D,
-                                          .format = depth_format,
-                                          .extent =
-                                              {
-                                                  .width = swap_chain->extent.width,
-                                                  .height = swap_chain->extent.height,
-                                                  .depth = 1,
-                                              },
-                                          .mipLevels = 1,
-                                          .arrayLayers = 1,
-                                          .usage = vk::ImageUsageFlagBits::eDepthStencilAttachment,
-                                          .initialLayout = vk::ImageLayout::eUndefined,
-                                      },
-                                      VmaAllocationCreateInfo{
-                                          .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
-                                          .usage = VMA_MEMORY_USAGE_AUTO,
-                                          .priority = 1.0f,
-                                      });
+    // A layer per view
+    const auto view_target_extent = GetViewExtent(render_target_extent);
+    // Released first, so that the new one can take over its memory
+    depth_image_view = nullptr;
+    depth_image.reset();
+    depth_image = std::make_unique<VulkanImage>(
+        *render_target_heap, depth_render_target_slot,
+        vk::ImageCreateInfo{
+            .imageType = vk::ImageType::e2D,
+            .format = depth_format,
+            .extent =
+                {
+                    .width = view_target_extent.width,
+                    .height = view_target_extent.height,
+                    .depth = 1,
+                },
+            .mipLevels = 1,
+            .arrayLayers = GetNumViews(),
+            .usage = vk::ImageUsageFlagBits::eDepthStencilAttachment |
+                     vk::ImageUsageFlagBits::eSampled,
+            .initialLayout = vk::ImageLayout::eUndefined,
+        });
     depth_image_view =
         vk::raii::ImageView{**device,
                             {
                                 .image = **depth_image,
-                                .viewType = vk::ImageViewType::e2D,
+                                .viewType = vk::ImageViewType::e2DArray,
                                 .format = depth_format,
                                 .subresourceRange =
                                     {
@@ -122,283 +329,2093 @@ void VulkanRasterizer::CreateDepthResources() {
                                         .baseMipLevel = 0,
                                         .levelCount = 1,
                                         .baseArrayLayer = 0,
+                                        .layerCount = GetNumViews(),
+                                    },
+                            }};
+    depth_image->LogCompression("Depth image", vk::ImageAspectFlagBits::eDepth);
+
+    // The Hi-Z pyramid starts at half resolution
+    hiz_extents.clear();
+    vk::Extent2D extent = view_target_extent;
+    do {
+        extent = {std::max(extent.width / 2, 1u), std::max(extent.height / 2, 1u)};
+        hiz_extents.emplace_back(extent);
+    } while (extent.width > 1 || extent.height > 1);
+    const auto num_levels = static_cast<u32>(hiz_extents.size());
+
+    hiz_image = std::make_unique<VulkanImage>(
+        *device->allocator,
+        vk::ImageCreateInfo{
+            .imageType = vk::ImageType::e2D,
+            .format = vk::Format::eR32Sfloat,
+            .extent =
+                {
+                    .width = hiz_extents[0].width,
+                    .height = hiz_extents[0].height,
+                    .depth = 1,
+                },
+            .mipLevels = num_levels,
+            .arrayLayers = GetNumViews(),
+            .usage = vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eSampled,
+            .initialLayout = vk::ImageLayout::eUndefined,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::RenderTargets);
+    const auto CreateHiZView = [this](u32 base_level, u32 level_count) {
+        return vk::raii::ImageView{**device,
+                                   {
+                                       .image = **hiz_image,
+                                       .viewType = vk::ImageViewType::e2DArray,
+                                       .format = vk::Format::eR32Sfloat,
+                                       .subresourceRange =
+                                           {
+                                               .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                               .baseMipLevel = base_level,
+                                               .levelCount = level_count,
+                                               .baseArrayLayer = 0,
+                                               .layerCount = GetNumViews(),
+                                           },
+                                   }};
+    };
+    hiz_view = CreateHiZView(0, num_levels);
+    hiz_level_views.clear();
+    for (u32 i = 0; i < num_levels; ++i) {
+        hiz_level_views.emplace_back(CreateHiZView(i, 1));
+    }
+
+    // One set per level, reading the previous one
+    std::vector<DescriptorBinding::CombinedImageSamplers> src_images, dst_images;
+    for (u32 i = 0; i < num_levels; ++i) {
+        src_images.push_back({{{
+            .image = i == 0 ? *depth_image_view : *hiz_level_views[i - 1],
+            .layout = i == 0 ? vk::ImageLayout::eShaderReadOnlyOptimal : vk::ImageLayout::eGeneral,
+        }}});
+        dst_images.push_back({{{
+            .image = *hiz_level_views[i],
+            .layout = vk::ImageLayout::eGeneral,
+        }}});
+    }
+    hiz_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+        *device, num_levels,
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eCombinedImageSampler,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::CombinedImageSamplersValue{src_images},
+            },
+            {
+                .type = vk::DescriptorType::eStorageImage,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::CombinedImageSamplersValue{dst_images},
+            },
+        });
+}
+
+void VulkanRasterizer::CreateVisibilityResources() {
+    if (!visibility_buffer) {
+        return;
+    }
+    visibility_image_view = nullptr;
+    visibility_image.reset();
+    visibility_image = std::make_unique<VulkanImage>(
+        *device->allocator,
+        vk::ImageCreateInfo{
+            .imageType = vk::ImageType::e2D,
+            .format = vk::Format::eR32G32Uint,
+            .extent =
+                {
+                    .width = render_target_extent.width,
+                    .height = render_target_extent.height,
+                    .depth = 1,
+                },
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .usage = vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eSampled,
+            .initialLayout = vk::ImageLayout::eUndefined,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::RenderTargets);
+    visibility_image->SetName("visibility buffer");
+    visibility_image_view =
+        vk::raii::ImageView{**device,
+                            {
+                                .image = **visibility_image,
+                                .viewType = vk::ImageViewType::e2D,
+                                .format = vk::Format::eR32G32Uint,
+                                .subresourceRange =
+                                    {
+                                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                        .baseMipLevel = 0,
+                                        .levelCount = 1,
+                                        .baseArrayLayer = 0,
+                                        .layerCount = 1,
+                                    },
+                            }};
+
+    // The render passes leave it in the General layout, like the offscreen images. It is only
+    // fetched, so the sampler does not matter.
+    std::vector<DescriptorBinding::CombinedImageSamplers> visibility_images;
+    for (std::size_t i = 0; i < offscreen_frames.size(); ++i) {
+        visibility_images.push_back({{{
+            .image = *visibility_image_view,
+            .layout = vk::ImageLayout::eGeneral,
+        }}});
+    }
+    shade_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+        *device, offscreen_frames.size(),
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eCombinedImageSampler,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::CombinedImageSamplersValue{visibility_images},
+            },
+            {
+                .type = vk::DescriptorType::eStorageImage,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::CombinedImageSamplersValue{GetOffscreenImages()},
+            },
+        });
+}
+
+void VulkanRasterizer::CreateStereoResources() {
+    if (GetNumViews() <= 1) {
+        return;
+    }
+    const auto view_target_extent = GetViewExtent(render_target_extent);
+    stereo_image_view = nullptr;
+    stereo_image.reset();
+    stereo_image = std::make_unique<VulkanImage>(
+        *device->allocator,
+        vk::ImageCreateInfo{
+            .imageType = vk::ImageType::e2D,
+            .format = swap_chain->surface_format.format,
+            .extent =
+                {
+                    .width = view_target_extent.width,
+                    .height = view_target_extent.height,
+                    .depth = 1,
+                },
+            .mipLevels = 1,
+            .arrayLayers = GetNumViews(),
+            .usage = vk::ImageUsageFlagBits::eColorAttachment |
+                     vk::ImageUsageFlagBits::eTransferSrc,
+            .initialLayout = vk::ImageLayout::eUndefined,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::RenderTargets);
+    stereo_image->SetName("stereo image");
+    stereo_image_view =
+        vk::raii::ImageView{**device,
+                            {
+                                .image = **stereo_image,
+                                .viewType = vk::ImageViewType::e2DArray,
+                                .format = swap_chain->surface_format.format,
+                                .subresourceRange =
+                                    {
+                                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                        .baseMipLevel = 0,
+                                        .levelCount = 1,
+                                        .baseArrayLayer = 0,
+                                        .layerCount = GetNumViews(),
+                                    },
+                            }};
+}
+
+void VulkanRasterizer::CreateShadingRateResources() {
+    if (!variable_rate_shading) {
+        return;
+    }
+    shading_rate_image_view = nullptr;
+    shading_rate_image.reset();
+    shading_rate_image = std::make_unique<VulkanImage>(
+        *device->allocator,
+        vk::ImageCreateInfo{
+            .imageType = vk::ImageType::e2D,
+            .format = vk::Format::eR8Uint,
+            .extent =
+                {
+                    .width = (render_target_extent.width + shading_rate_tile.width - 1) /
+                             shading_rate_tile.width,
+                    .height = (render_target_extent.height + shading_rate_tile.height - 1) /
+                              shading_rate_tile.height,
+                    .depth = 1,
+                },
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .usage = vk::ImageUsageFlagBits::eFragmentShadingRateAttachmentKHR |
+                     vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferDst,
+            .initialLayout = vk::ImageLayout::eUndefined,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::RenderTargets);
+    shading_rate_image->SetName("shading rate image");
+    shading_rate_image_view =
+        vk::raii::ImageView{**device,
+                            {
+                                .image = **shading_rate_image,
+                                .viewType = vk::ImageViewType::e2D,
+                                .format = vk::Format::eR8Uint,
+                                .subresourceRange =
+                                    {
+                                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                        .baseMipLevel = 0,
+                                        .levelCount = 1,
+                                        .baseArrayLayer = 0,
                                         .layerCount = 1,
                                     },
                             }};
+
+    // Each frame in flight reads the offscreen image of the one before it, which the render
+    // passes leave in the General layout. It is only fetched, so the sampler does not matter.
+    std::vector<DescriptorBinding::CombinedImageSamplers> src_images, dst_images;
+    for (std::size_t i = 0; i < offscreen_frames.size(); ++i) {
+        const auto& previous =
+            offscreen_frames[(i + offscreen_frames.size() - 1) % offscreen_frames.size()];
+        src_images.push_back({{{
+            .image = *previous.image_view,
+            .layout = vk::ImageLayout::eGeneral,
+        }}});
+        dst_images.push_back({{{
+            .image = *shading_rate_image_view,
+            .layout = vk::ImageLayout::eGeneral,
+        }}});
+    }
+    shading_rate_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+        *device, offscreen_frames.size(),
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eCombinedImageSampler,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::CombinedImageSamplersValue{src_images},
+            },
+            {
+                .type = vk::DescriptorType::eStorageImage,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::CombinedImageSamplersValue{dst_images},
+            },
+        });
+    last_render_extent = vk::Extent2D{};
 }
 
 void VulkanRasterizer::Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_extent) {
+    // The eyes are drawn as layers with multiview, which these do not handle
+    if (GetNumViews() > 1 && visibility_buffer) {
+        SPDLOG_WARN("Visibility buffer does not support stereo, disabling it");
+        visibility_buffer = false;
+    }
+    if (GetNumViews() > 1 && variable_rate_shading) {
+        SPDLOG_WARN("Variable rate shading does not support stereo, disabling it");
+        variable_rate_shading = false;
+    }
     VulkanRenderer::Init(surface, actual_extent);
 
-    frames = std::make_unique<VulkanFramesInFlight<Frame, 2>>(*device);
+    frames = std::make_unique<VulkanFramesInFlight<Frame>>(*device, num_frames_in_flight);
+    const std::size_t num_recorders = thread_pool ? thread_pool->GetNumThreads() : 1;
+    for (auto& frame : frames->frames_in_flight) {
+        for (std::size_t i = 0; i < num_recorders; ++i) {
+            auto& pool = frame.extras.command_pools.emplace_back(
+                **device, vk::CommandPoolCreateInfo{
+                              .queueFamilyIndex = device->graphics_queue_family,
+                          });
+            vk::raii::CommandBuffers command_buffers{
+                **device,
+                {
+                    .commandPool = *pool,
+                    .level = vk::CommandBufferLevel::eSecondary,
+                    .commandBufferCount = static_cast<u32>(MaxDrawPasses),
+                }};
+            for (auto& command_buffer : command_buffers) {
+                frame.extras.secondary_command_buffers.emplace_back(std::move(command_buffer));
+            }
+        }
+    }
     depth_format = FindDepthFormat(device->physical_device);
+    // Nothing is shaded while drawing the visibility buffer, so there is nothing to save
+    if (visibility_buffer) {
+        depth_prepass = false;
+    }
+    if (variable_rate_shading && visibility_buffer) {
+        SPDLOG_WARN("Variable rate shading does not apply to the visibility buffer, disabling it");
+    }
+    variable_rate_shading =
+        variable_rate_shading && !visibility_buffer && device->fragment_shading_rate;
+    std::optional<vk::Extent2D> shading_rate_pass_tile;
+    if (variable_rate_shading) {
+        const auto& properties = device->fragment_shading_rate_properties;
+        shading_rate_tile = {
+            std::clamp(ShadingRateTileSize,
+                       properties.minFragmentShadingRateAttachmentTexelSize.width,
+                       properties.maxFragmentShadingRateAttachmentTexelSize.width),
+            std::clamp(ShadingRateTileSize,
+                       properties.minFragmentShadingRateAttachmentTexelSize.height,
+                       properties.maxFragmentShadingRateAttachmentTexelSize.height),
+        };
+        shading_rate_pass_tile = shading_rate_tile;
+        // The rates of the draws are combined with those of the image by taking the finer
+        material_shading_rates = device->primitive_shading_rate &&
+                                 properties.fragmentShadingRateNonTrivialCombinerOps;
+        SPDLOG_INFO("Shading rate image of {}x{} tiles{}", shading_rate_tile.width,
+                    shading_rate_tile.height,
+                    material_shading_rates ? ", capped by the materials" : "");
+    }
 
-    // Pipeline
-    render_pass =
-        vk::raii::RenderPass{
-            **device,
-            {
-                .attachmentCount = 2,
-                .pAttachments =
-                    TempArr<vk::AttachmentDescription>{
-                        {
-                            .format = swap_chain->surface_format.format,
-                            .loadOp = vk::AttachmentLoadOp::eClear,
-                            .storeOp = vk::AttachmentStoreOp::eStore,
-                            .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
-                            .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
-                            .finalLayout = vk::ImageLayout::eGeneral,
-                        },
-                        {
-                            .format = depth_format,
-                            .loadOp = vk::AttachmentLoadOp::eClear,
-                            .storeOp = vk::AttachmentStoreOp::eDontCare,
-                            .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
-                            .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
-                            .finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
-                        },
-                    },
-                .subpassCount = 1,
-                .pSubpasses = TempArr<vk::SubpassDescription>{{
-                    .pipelineBindPoint = vk::PipelineBindPoint::eGraphics,
-                    .colorAttachmentCount = 1,
-                    .pColorAttachments = TempArr<vk::AttachmentReference>{{
-                        .attachment = 0,
-                        .layout = vk::ImageLayout::eGeneral,
-                    }},
-                    .pDepthStencilAttachment = TempArr<vk::AttachmentReference>{{
-                        .attachment = 1,
-                        .layout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
-                    }},
-                }},
-                .dependencyCount = 2,
-                .pDependencies =
-                    TempArr<vk::SubpassDependency>{
-                        {
-                            .srcSubpass = VK_SUBPASS_EXTERNAL,
-                            .dstSubpass = 0,
-                            .srcStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests |
-                                            vk::PipelineStageFlagBits::eLateFragmentTests,
-                            .dstStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests |
-                                            vk::PipelineStageFlagBits::eLateFragmentTests,
-                            .srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead |
-                                             vk::AccessFlagBits::eDepthStencilAttachmentWrite,
-                            .dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead |
-                                             vk::AccessFlagBits::eDepthStencilAttachmentWrite,
-                        },
-                        {
-                            .srcSubpass = VK_SUBPASS_EXTERNAL,
-                            .dstSubpass = 0,
-                            .srcStageMask = vk::PipelineStageFlagBits::eNone,
-                            .dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
-                            .srcAccessMask = vk::AccessFlags{},
-                            .dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
-                        },
-                    },
-            }};
+    // With the pre-pass, the shading pass starts from its depth. Otherwise the second phase of
+    // occlusion culling draws on top of the first.
+    const auto color_format =
+        visibility_buffer ? vk::Format::eR32G32Uint : swap_chain->surface_format.format;
+    render_pass = CreateRenderPass(
+        *device, color_format, depth_format, vk::AttachmentLoadOp::eClear,
+        depth_prepass ? vk::AttachmentLoadOp::eLoad : vk::AttachmentLoadOp::eClear,
+        GetNumViews(), shading_rate_pass_tile);
+    render_pass_load =
+        CreateRenderPass(*device, color_format, depth_format, vk::AttachmentLoadOp::eLoad,
+                         vk::AttachmentLoadOp::eLoad, GetNumViews(), shading_rate_pass_tile);
+    depth_render_pass = CreateRenderPass(*device, std::nullopt, depth_format,
+                                         vk::AttachmentLoadOp::eDontCare,
+                                         vk::AttachmentLoadOp::eClear, GetNumViews());
+    depth_render_pass_load = CreateRenderPass(*device, std::nullopt, depth_format,
+                                              vk::AttachmentLoadOp::eDontCare,
+                                              vk::AttachmentLoadOp::eLoad, GetNumViews());
 
+    depth_render_target_slot = render_target_heap->AddSlot();
     CreateDepthResources();
+    CreateVisibilityResources();
+    CreateStereoResources();
+    CreateShadingRateResources();
     CreateFramebuffers();
+
+    if (variable_rate_shading) {
+        shading_rate_pipeline = std::make_unique<VulkanComputePipeline>(
+            *device,
+            vk::PipelineShaderStageCreateInfo{
+                .stage = vk::ShaderStageFlagBits::eCompute,
+                .module = *VulkanShader{*device, u8"core/rasterizer/shaders/shading_rate.comp"},
+                .pName = "main",
+            },
+            vk::PipelineLayoutCreateInfo{
+                .setLayoutCount = 1,
+                .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                    *shading_rate_descriptor_sets->descriptor_set_layout,
+                }},
+                .pushConstantRangeCount = 1,
+                .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                    PushConstant<GLSL::ShadingRatePushConstant>(vk::ShaderStageFlagBits::eCompute),
+                }},
+            });
+    }
+}
+
+void VulkanRasterizer::SetDepthPrepass(bool enabled) {
+    depth_prepass = enabled;
+}
+
+void VulkanRasterizer::SetLODs(bool enabled) {
+    generate_lods = enabled;
+}
+
+void VulkanRasterizer::SetGeometryBudget(vk::DeviceSize budget) {
+    geometry_budget = budget;
+}
+
+void VulkanRasterizer::SetVisibilityBuffer(bool enabled) {
+    visibility_buffer = enabled;
+}
+
+void VulkanRasterizer::SetProbeGI(bool enabled) {
+    probe_gi = enabled;
+}
+
+void VulkanRasterizer::SetVariableRateShading(bool enabled) {
+    variable_rate_shading = enabled;
+}
+
+// Binding 1 of the descriptor set, indexed like the scene textures
+static std::vector<DescriptorBinding::CombinedImageSampler> GetTextureImages(
+    const Scene& scene, const VulkanDevice& device) {
+
+    auto images = Common::VectorFromRange(
+        scene.textures | std::views::transform([&device](const std::unique_ptr<Texture>& texture) {
+            return DescriptorBinding::CombinedImageSampler{
+                .image = *texture->image->GetTexture().image_view,
+                .sampler = texture->sampler ? *texture->sampler->sampler : *device.default_sampler,
+            };
+        }));
+    if (images.empty()) { // Cannot create empty descriptors, but null ones are fine here
+        images.emplace_back(DescriptorBinding::CombinedImageSampler{
+            .image = VK_NULL_HANDLE,
+        });
+    }
+    return images;
+}
+
+void VulkanRasterizer::UploadMaterials() {
+    const auto materials_info = Common::VectorFromRange(
+        scene->materials | std::views::transform([](const std::unique_ptr<Material>& material) {
+            return material->GetPackedMaterial();
+        }));
+    materials_buffer = std::make_unique<VulkanImmUploadBuffer>(
+        *device,
+        VulkanBufferCreateInfo{
+            .size = materials_info.size() * sizeof(GLSL::PackedMaterial),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            .dst_stage_mask = vk::PipelineStageFlagBits2::eFragmentShader |
+                              vk::PipelineStageFlagBits2::eComputeShader,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+        },
+        reinterpret_cast<const u8*>(materials_info.data()));
+}
+
+GeometryRequirements VulkanRasterizer::GetGeometryRequirements(const VulkanDevice&) const {
+    // With probe GI, the BLASes of the probes are built from the vertices and indices as well
+    const vk::BufferUsageFlags build_input_usage =
+        probe_gi ? vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                       vk::BufferUsageFlagBits::eShaderDeviceAddress
+                 : vk::BufferUsageFlags{};
+    const vk::PipelineStageFlags2 build_input_stages =
+        probe_gi ? vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR
+                 : vk::PipelineStageFlags2{};
+    const vk::AccessFlags2 build_input_access =
+        probe_gi ? vk::AccessFlagBits2::eShaderRead : vk::AccessFlags2{};
+    return {
+        .vertex_buffer_params =
+            {
+                .usage = vk::BufferUsageFlagBits::eShaderDeviceAddress | build_input_usage,
+                .dst_stage_mask = vk::PipelineStageFlagBits2::eVertexShader | build_input_stages,
+                .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead | build_input_access,
+            },
+        .index_buffer_params =
+            {
+                .usage = vk::BufferUsageFlagBits::eIndexBuffer | build_input_usage,
+                .dst_stage_mask = vk::PipelineStageFlagBits2::eIndexInput | build_input_stages,
+                .dst_access_mask = vk::AccessFlagBits2::eIndexRead | build_input_access,
+            },
+    };
 }
 
 void VulkanRasterizer::LoadScene(GLTF::Container& gltf) {
     scene = std::make_unique<Scene>();
 
-    SceneLoader loader{{
-                           .usage = vk::BufferUsageFlagBits::eVertexBuffer,
-                           .dst_stage_mask = vk::PipelineStageFlagBits2::eVertexAttributeInput,
-                           .dst_access_mask = vk::AccessFlagBits2::eVertexAttributeRead,
-                       },
-                       {
-                           .usage = vk::BufferUsageFlagBits::eIndexBuffer,
-                           .dst_stage_mask = vk::PipelineStageFlagBits2::eIndexInput,
-                           .dst_access_mask = vk::AccessFlagBits2::eIndexRead,
-                       },
+    if (probe_gi && geometry_budget > 0) {
+        SPDLOG_WARN("Probe GI needs all meshes resident, disabling probe GI");
+        probe_gi = false;
+    }
+    const auto requirements = GetSwitchGeometryRequirements();
+    SceneLoader loader{requirements.vertex_buffer_params,
+                       requirements.index_buffer_params,
                        *scene,
                        *device,
-                       gltf};
+                       gltf,
+                       thread_pool.get(),
+                       compress_textures,
+                       texture_budget,
+                       num_frames_in_flight,
+                       lazy_textures,
+                       generate_lods,
+                       false,
+                       requirements.keep_host_geometry,
+                       requirements.keep_emissive_geometry,
+                       geometry_budget,
+                       optimize_indices,
+                       pack_vertices,
+                       requirements.bake_opacity_micromaps,
+                       TextureQuality{
+                           .max_size = max_texture_size,
+                           .dropped_levels = dropped_texture_levels,
+                           .budget = texture_quality_budget,
+                       },
+                       gpu_tangent_triangles,
+                       spatial_order,
+                       host_cache_budget,
+                       gpu_image_decode};
+    loader.profiler->Report();
+    device->allocator->LogUsage();
+    sub_scene_idx = scene->main_sub_scene;
+    CreateSceneResources();
+}
 
-    materials = Common::VectorFromRange(
-        scene->materials | std::views::transform([this](const std::unique_ptr<Material>& material) {
-            return std::make_unique<VulkanImmUploadBuffer>(
-                *device,
-                VulkanBufferCreateInfo{
-                    .size = sizeof(Material),
-                    .usage = vk::BufferUsageFlagBits::eUniformBuffer,
-                    .dst_stage_mask = vk::PipelineStageFlagBits2::eFragmentShader,
-                    .dst_access_mask = vk::AccessFlagBits2::eUniformRead,
-                },
-                reinterpret_cast<const u8*>(&material->glsl_material));
-        }));
+void VulkanRasterizer::OnSceneShared() {
+    CreateSceneResources();
+}
 
-    descriptor_sets = std::make_unique<VulkanDescriptorSets>(
-        *device, materials.size(),
+void VulkanRasterizer::CreateSceneResources() {
+    UploadMaterials();
+    UploadPrimitives();
+    if (probe_gi) {
+        BuildProbeBLASes();
+    }
+    const auto images = GetTextureImages(*scene, *device);
+    // The fragments are shaded by the fragment shader, or the pixels of the visibility buffer
+    // by shade.comp
+    const auto Shading = vk::ShaderStageFlagBits::eFragment | vk::ShaderStageFlagBits::eCompute;
+    descriptor_set = std::make_unique<VulkanDescriptorSets>(
+        *device, 1,
         std::initializer_list<DescriptorBinding>{
             {
-                .type = vk::DescriptorType::eUniformBuffer,
-                .stages = vk::ShaderStageFlagBits::eFragment,
-                .value = Common::VectorFromRange(
-                    materials |
-                    std::views::transform([](const std::unique_ptr<VulkanImmUploadBuffer>& buffer) {
-                        return DescriptorBinding::Buffers{
-                            .buffers = {{**buffer}},
-                        };
-                    })),
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = Shading,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**materials_buffer}},
+                }},
             },
             {
                 .type = vk::DescriptorType::eCombinedImageSampler,
-                .stages = vk::ShaderStageFlagBits::eFragment,
-                .value = Common::VectorFromRange(
-                    scene->materials |
-                    std::views::transform([this](const std::unique_ptr<Material>& material) {
-                        if (material->glsl_material.base_color_texture_index == -1) {
-                            return DescriptorBinding::CombinedImageSamplers{
-                                .images = {{
-                                    .image = VK_NULL_HANDLE,
-                                }},
-                            };
-                        }
-
-                        const auto& texture =
-                            scene->textures[material->glsl_material.base_color_texture_index];
-                        return DescriptorBinding::CombinedImageSamplers{
-                            .images = {{
-                                .image = *texture->image->texture->image_view,
-                                .sampler = texture->sampler ? *texture->sampler->sampler
-                                                            : *device->default_sampler,
-                            }},
-                        };
-                    })),
+                .array_size = static_cast<u32>(images.size()),
+                .stages = Shading,
+                .value = DescriptorBinding::CombinedImageSamplersValue{{
+                    .images = images,
+                }},
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{**primitives_buffer}},
+                }},
             },
         });
 
-    pipeline = std::make_unique<VulkanGraphicsPipeline>(
-        *device,
-        vk::GraphicsPipelineCreateInfo{
-            .stageCount = 2,
-            .pStages = TempArr<vk::PipelineShaderStageCreateInfo>{{
-                {
-                    .stage = vk::ShaderStageFlagBits::eVertex,
-                    .module = *VulkanShader{**device, u8"core/rasterizer/shaders/rasterizer.vert"},
-                    .pName = "main",
-                },
+    frame_allocator = std::make_unique<VulkanFrameAllocator>(
+        *device, frames->frames_in_flight.size(), sizeof(GLSL::RasterizerUniformsBlock));
+    // The buffers of the draws are written by BuildDrawList
+    const auto StorageBuffer = [](vk::ShaderStageFlags stages) {
+        return DescriptorBinding{
+            .type = vk::DescriptorType::eStorageBuffer,
+            .stages = stages,
+        };
+    };
+    for (auto& frame : frames->frames_in_flight) {
+        frame.extras.light_clusters = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z *
+                        (MAX_CLUSTER_LIGHTS + 1) * sizeof(u32) * GetNumViews(),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+    }
+    draw_descriptor_set = std::make_unique<VulkanDescriptorSets>(
+        *device, frames->frames_in_flight.size(),
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eUniformBufferDynamic,
+                .stages = vk::ShaderStageFlagBits::eVertex | Shading,
+                .value = DescriptorBinding::BuffersValue{{
+                    .buffers = {{frame_allocator->GetBuffer()}},
+                    .range = sizeof(GLSL::RasterizerUniformsBlock),
+                }},
+            },
+            StorageBuffer(vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eCompute),
+            StorageBuffer(vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eCompute),
+            StorageBuffer(vk::ShaderStageFlagBits::eCompute),
+            StorageBuffer(vk::ShaderStageFlagBits::eCompute),
+            StorageBuffer(vk::ShaderStageFlagBits::eCompute),
+            StorageBuffer(vk::ShaderStageFlagBits::eCompute),
+            StorageBuffer(vk::ShaderStageFlagBits::eCompute),
+            {
+                .type = vk::DescriptorType::eCombinedImageSampler,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::CombinedImageSamplersValue{{
+                    .images = {{
+                        .image = *hiz_view,
+                        .layout = vk::ImageLayout::eGeneral,
+                    }},
+                }},
+            },
+            StorageBuffer(vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eCompute),
+            StorageBuffer(vk::ShaderStageFlagBits::eCompute),
+            StorageBuffer(vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eCompute),
+            StorageBuffer(Shading),
+            StorageBuffer(Shading),
+            StorageBuffer(Shading),
+        });
+    std::vector<DescriptorBinding::Buffers> light_clusters;
+    for (const auto& frame : frames->frames_in_flight) {
+        light_clusters.push_back({.buffers = {{**frame.extras.light_clusters}}});
+    }
+    draw_descriptor_set->UpdateDescriptor(
+        13, DescriptorBinding::BuffersValue{std::move(light_clusters)});
+    // Written by CreateProbeResources
+    if (probe_gi) {
+        probe_descriptor_set = std::make_unique<VulkanDescriptorSets>(
+            *device, 1,
+            std::initializer_list<DescriptorBinding>{
                 {
-                    .stage = vk::ShaderStageFlagBits::eFragment,
-                    .module = *VulkanShader{**device, u8"core/rasterizer/shaders/rasterizer.frag"},
-                    .pName = "main",
+                    .type = vk::DescriptorType::eAccelerationStructureKHR,
+                    .stages = vk::ShaderStageFlagBits::eCompute,
                 },
+                StorageBuffer(vk::ShaderStageFlagBits::eCompute),
+                StorageBuffer(vk::ShaderStageFlagBits::eCompute),
+            });
+    }
+    BuildDrawList();
+    CreateProbeResources();
+
+    cull_pipeline = std::make_unique<VulkanComputePipeline>(
+        *device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{*device, u8"core/rasterizer/shaders/cull.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 1,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *draw_descriptor_set->descriptor_set_layout,
+            }},
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::CullPushConstant>(vk::ShaderStageFlagBits::eCompute),
+            }},
+        });
+    batch_pipeline = std::make_unique<VulkanComputePipeline>(
+        *device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{*device, u8"core/rasterizer/shaders/batch.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 1,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *draw_descriptor_set->descriptor_set_layout,
             }},
-            .pDepthStencilState = TempPtr{vk::PipelineDepthStencilStateCreateInfo{
-                .depthTestEnable = VK_TRUE,
-                .depthWriteEnable = VK_TRUE,
-                .depthCompareOp = vk::CompareOp::eLess,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::CullPushConstant>(vk::ShaderStageFlagBits::eCompute),
             }},
-            .pDynamicState = TempPtr{vk::PipelineDynamicStateCreateInfo{
-                .dynamicStateCount = 1,
-                .pDynamicStates = TempArr<vk::DynamicState>{{vk::DynamicState::eVertexInputEXT}},
+        });
+    light_cluster_pipeline = std::make_unique<VulkanComputePipeline>(
+        *device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{*device, u8"core/rasterizer/shaders/light_cluster.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 1,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *draw_descriptor_set->descriptor_set_layout,
             }},
-            .renderPass = *render_pass,
+        });
+    hiz_pipeline = std::make_unique<VulkanComputePipeline>(
+        *device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{*device, u8"core/rasterizer/shaders/hiz.comp"},
+            .pName = "main",
         },
         vk::PipelineLayoutCreateInfo{
             .setLayoutCount = 1,
-            .pSetLayouts = &*descriptor_sets->descriptor_set_layout,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *hiz_descriptor_sets->descriptor_set_layout,
+            }},
             .pushConstantRangeCount = 1,
             .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
-                PushConstant<glm::mat4>(vk::ShaderStageFlagBits::eVertex),
+                PushConstant<GLSL::HiZPushConstant>(vk::ShaderStageFlagBits::eCompute),
             }},
         });
+
+    // The visibility buffer only records the triangles, shaded by shade.comp
+    const VulkanShader vertex_shader{
+        *device, visibility_buffer        ? u8"core/rasterizer/shaders/visibility.vert"
+                 : material_shading_rates ? u8"core/rasterizer/shaders/rasterizer_vrs.vert"
+                                          : u8"core/rasterizer/shaders/rasterizer.vert"};
+    const VulkanShader fragment_shader{*device, visibility_buffer
+                                                    ? u8"core/rasterizer/shaders/visibility.frag"
+                                                    : u8"core/rasterizer/shaders/rasterizer.frag"};
+    const std::array<vk::PipelineShaderStageCreateInfo, 2> stages{{
+        {
+            .stage = vk::ShaderStageFlagBits::eVertex,
+            .module = *vertex_shader,
+            .pName = "main",
+        },
+        {
+            .stage = vk::ShaderStageFlagBits::eFragment,
+            .module = *fragment_shader,
+            .pName = "main",
+        },
+    }};
+    const std::array<vk::DescriptorSetLayout, 3> set_layouts{{
+        *descriptor_set->descriptor_set_layout,
+        *scene->texture_streamer->descriptor_sets->descriptor_set_layout,
+        *draw_descriptor_set->descriptor_set_layout,
+    }};
+    if (visibility_buffer) {
+        shade_pipeline = std::make_unique<VulkanComputePipeline>(
+            *device,
+            vk::PipelineShaderStageCreateInfo{
+                .stage = vk::ShaderStageFlagBits::eCompute,
+                .module = *VulkanShader{*device, u8"core/rasterizer/shaders/shade.comp"},
+                .pName = "main",
+            },
+            vk::PipelineLayoutCreateInfo{
+                .setLayoutCount = 4,
+                .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                    set_layouts[0],
+                    set_layouts[1],
+                    set_layouts[2],
+                    *shade_descriptor_sets->descriptor_set_layout,
+                }},
+            });
+    }
+    // The probes are updated with the same sets as the pixels are shaded with, and their own
+    if (probe_gi) {
+        const auto CreateProbePipeline = [this, &set_layouts](const char8_t* path) {
+            return std::make_unique<VulkanComputePipeline>(
+                *device,
+                vk::PipelineShaderStageCreateInfo{
+                    .stage = vk::ShaderStageFlagBits::eCompute,
+                    .module = *VulkanShader{*device, path},
+                    .pName = "main",
+                },
+                vk::PipelineLayoutCreateInfo{
+                    .setLayoutCount = 4,
+                    .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                        set_layouts[0],
+                        set_layouts[1],
+                        set_layouts[2],
+                        *probe_descriptor_set->descriptor_set_layout,
+                    }},
+                    .pushConstantRangeCount = 1,
+                    .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                        PushConstant<GLSL::ProbeUpdatePushConstant>(
+                            vk::ShaderStageFlagBits::eCompute),
+                    }},
+                });
+        };
+        probe_trace_pipeline = CreateProbePipeline(u8"core/rasterizer/shaders/probe_trace.comp");
+        probe_blend_pipeline = CreateProbePipeline(u8"core/rasterizer/shaders/probe_blend.comp");
+    }
+    // With variable rate shading, the shading pipeline takes the rates of the shading rate
+    // image, or the finer of those and the rates of the draws
+    using CombinerOp = vk::FragmentShadingRateCombinerOpKHR;
+    const vk::PipelineFragmentShadingRateStateCreateInfoKHR shading_rate_state{
+        .fragmentSize = vk::Extent2D{1, 1},
+        .combinerOps = std::array{material_shading_rates ? CombinerOp::eReplace : CombinerOp::eKeep,
+                                  material_shading_rates ? CombinerOp::eMin : CombinerOp::eReplace},
+    };
+    // No vertex input state, the vertex shader pulls the vertices
+    const auto CreatePipeline = [this, &stages, &set_layouts, &shading_rate_state](
+                                    bool depth_only, vk::RenderPass pass,
+                                    const vk::PipelineDepthStencilStateCreateInfo& depth_state) {
+        static constexpr vk::PipelineColorBlendStateCreateInfo NoColorBlendState{};
+        return std::make_unique<VulkanGraphicsPipeline>(
+            *device,
+            vk::GraphicsPipelineCreateInfo{
+                .pNext = variable_rate_shading && !depth_only ? &shading_rate_state : nullptr,
+                .stageCount = depth_only ? 1u : static_cast<u32>(stages.size()),
+                .pStages = stages.data(),
+                .pDepthStencilState = &depth_state,
+                .pColorBlendState = depth_only ? &NoColorBlendState : nullptr,
+                .renderPass = pass,
+            },
+            vk::PipelineLayoutCreateInfo{
+                .setLayoutCount = static_cast<u32>(set_layouts.size()),
+                .pSetLayouts = set_layouts.data(),
+            });
+    };
+
+    // With the pre-pass, only the nearest surfaces are shaded
+    pipeline = CreatePipeline(false, *render_pass,
+                              {
+                                  .depthTestEnable = VK_TRUE,
+                                  .depthWriteEnable = depth_prepass ? VK_FALSE : VK_TRUE,
+                                  .depthCompareOp = depth_prepass ? vk::CompareOp::eLessOrEqual
+                                                                  : vk::CompareOp::eLess,
+                              });
+    if (depth_prepass) {
+        depth_pipeline = CreatePipeline(true, *depth_render_pass,
+                                        {
+                                            .depthTestEnable = VK_TRUE,
+                                            .depthWriteEnable = VK_TRUE,
+                                            .depthCompareOp = vk::CompareOp::eLess,
+                                        });
+        draw_passes = {
+            DrawPass{
+                .pipeline = depth_pipeline.get(),
+                .render_pass = *depth_render_pass,
+                .depth_only = true,
+                .phase = 0,
+            },
+            DrawPass{
+                .pipeline = depth_pipeline.get(),
+                .render_pass = *depth_render_pass_load,
+                .depth_only = true,
+                .phase = 1,
+            },
+            DrawPass{
+                .pipeline = pipeline.get(),
+                .render_pass = *render_pass,
+                .phase = 0,
+                .num_phases = 2,
+            },
+        };
+    } else {
+        draw_passes = {
+            DrawPass{
+                .pipeline = pipeline.get(),
+                .render_pass = *render_pass,
+                .phase = 0,
+            },
+            DrawPass{
+                .pipeline = pipeline.get(),
+                .render_pass = *render_pass_load,
+                .phase = 1,
+            },
+        };
+    }
+    InvalidateDrawCommands();
+}
+
+// Storage buffers cannot be empty, so empty arrays get a single unused element
+template <typename T>
+static std::unique_ptr<VulkanImmUploadBuffer> CreateStorageBuffer(
+    VulkanDevice& device, const std::vector<T>& data, vk::PipelineStageFlags2 dst_stage_mask) {
+
+    static const T Empty{};
+    return std::make_unique<VulkanImmUploadBuffer>(
+        device,
+        VulkanBufferCreateInfo{
+            .size = std::max<std::size_t>(data.size(), 1) * sizeof(T),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            .dst_stage_mask = dst_stage_mask,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+            .category = MemoryCategory::Other,
+        },
+        reinterpret_cast<const u8*>(data.empty() ? &Empty : data.data()));
+}
+
+void VulkanRasterizer::UploadPrimitives() {
+    std::vector<GLSL::PrimitiveInfo> primitives_info;
+    primitive_indices.clear();
+    for (const auto& mesh : scene->meshes) {
+        for (const auto& primitive : mesh->primitives) {
+            primitive_indices.emplace(primitive.get(), static_cast<u32>(primitives_info.size()));
+            primitives_info.emplace_back(primitive->GetPrimitiveInfo());
+        }
+    }
+    primitives_buffer = CreateStorageBuffer(*device, primitives_info,
+                                            vk::PipelineStageFlagBits2::eVertexShader |
+                                                vk::PipelineStageFlagBits2::eComputeShader);
+}
+
+void VulkanRasterizer::BuildProbeBLASes() {
+    VulkanBLASBuilder blas_builder{*device, thread_pool.get()};
+    std::vector<std::size_t> built_meshes;
+    for (std::size_t i = 0; i < scene->meshes.size(); ++i) {
+        const auto& mesh = *scene->meshes[i];
+        if (mesh.primitives.empty()) {
+            continue;
+        }
+        // The probes ignore alpha cutouts, so all geometries are opaque. The rasterizer always
+        // has index buffers.
+        std::vector<vk::AccelerationStructureGeometryKHR> geometries;
+        std::vector<vk::AccelerationStructureBuildRangeInfoKHR> build_ranges;
+        for (const auto& primitive : mesh.primitives) {
+            const auto& attribute = primitive->attributes[0]; // POSITION
+            geometries.push_back({
+                .geometryType = vk::GeometryTypeKHR::eTriangles,
+                .geometry =
+                    {
+                        .triangles =
+                            {
+                                .vertexFormat = attribute.format,
+                                .vertexData =
+                                    {
+                                        .deviceAddress =
+                                            primitive->vertex_buffer_addresses[attribute.binding] +
+                                            attribute.offset,
+                                    },
+                                .vertexStride = primitive->bindings[attribute.binding].stride,
+                                .maxVertex = static_cast<u32>(primitive->max_vertices),
+                                .indexType =
+                                    GLTF::GetIndexType(primitive->index_buffer->component_type),
+                                .indexData =
+                                    {
+                                        .deviceAddress =
+                                            primitive->index_buffer->gpu_buffer->address,
+                                    },
+                            },
+                    },
+                .flags = vk::GeometryFlagBitsKHR::eOpaque,
+            });
+            build_ranges.push_back({
+                .primitiveCount = static_cast<u32>(primitive->index_buffer->count / 3),
+            });
+        }
+        blas_builder.Add(geometries, build_ranges);
+        built_meshes.emplace_back(i);
+    }
+    auto built_blases = blas_builder.Build();
+    probe_blases.clear();
+    probe_blases.resize(scene->meshes.size());
+    for (std::size_t i = 0; i < built_meshes.size(); ++i) {
+        probe_blases[built_meshes[i]] = std::move(built_blases[i]);
+    }
+}
+
+// The geometries of each BLAS are the primitives of its mesh, like the draws of each instance
+static std::vector<VulkanAccelStructure::BLASInstance> GetProbeTLASInstances(
+    const SubScene& sub_scene, const std::vector<std::unique_ptr<VulkanAccelStructure>>& blases,
+    const std::vector<u32>& instance_first_draws) {
+
+    std::vector<VulkanAccelStructure::BLASInstance> instances;
+    for (std::size_t i = 0; i < sub_scene.GetNumInstances(); ++i) {
+        const auto& blas = blases[sub_scene.instance_meshes[i]];
+        if (!blas) {
+            continue;
+        }
+        instances.push_back({
+            .blas = *blas,
+            .transform = sub_scene.instance_transforms[i],
+            .custom_index = instance_first_draws[i],
+        });
+    }
+    return instances;
+}
+
+void VulkanRasterizer::CreateProbeResources() {
+    probe_tlas.reset();
+    num_probes = 0;
+    std::vector<VulkanAccelStructure::BLASInstance> instances;
+    if (probe_gi) {
+        instances = GetProbeTLASInstances(GetSubScene(), probe_blases, instance_first_draws);
+    }
+    if (!instances.empty()) {
+        // Updated in place as the instances move
+        probe_tlas = std::make_unique<VulkanAccelStructure>(instances, true);
+        while (!probe_tlas->Poll()) {
+            std::this_thread::yield();
+        }
+
+        // Spaced evenly over the bounds of the sub scene, as finely as the limits allow
+        glm::vec3 min_point{std::numeric_limits<float>::max()};
+        glm::vec3 max_point{std::numeric_limits<float>::lowest()};
+        for (const auto& bounds : GetSubScene().instance_bounds) {
+            if (!glm::any(glm::isinf(bounds.min_point)) &&
+                !glm::any(glm::isinf(bounds.max_point))) {
+                min_point = glm::min(min_point, bounds.min_point);
+                max_point = glm::max(max_point, bounds.max_point);
+            }
+        }
+        if (glm::any(glm::greaterThan(min_point, max_point))) {
+            min_point = max_point = glm::vec3{};
+        }
+        const glm::vec3 extent = max_point - min_point;
+        probe_spacing =
+            std::max(std::max({extent.x, extent.y, extent.z}) / (MaxProbesPerAxis - 1), 1e-3f);
+        while (true) {
+            probe_grid = glm::clamp(glm::uvec3{glm::ceil(extent / probe_spacing)} + 1u,
+                                    glm::uvec3{2}, glm::uvec3{MaxProbesPerAxis});
+            if (probe_grid.x * probe_grid.y * probe_grid.z <= MaxProbes) {
+                break;
+            }
+            probe_spacing *= 1.1f;
+        }
+        probe_origin = (min_point + max_point) * 0.5f -
+                       glm::vec3{probe_grid - 1u} * probe_spacing * 0.5f;
+        num_probes = probe_grid.x * probe_grid.y * probe_grid.z;
+        SPDLOG_INFO("{}x{}x{} probes, {} apart", probe_grid.x, probe_grid.y, probe_grid.z,
+                    probe_spacing);
+    }
+
+    probes_buffer = std::make_unique<VulkanBuffer>(
+        *device->allocator,
+        vk::BufferCreateInfo{
+            .size = std::max<std::size_t>(num_probes, 1) * PROBE_VEC4S * sizeof(glm::vec4),
+            .usage =
+                vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Other);
+    clear_probes = true;
+    draw_descriptor_set->UpdateDescriptor(14, DescriptorBinding::BuffersValue{{
+                                                  .buffers = {{**probes_buffer}},
+                                              }});
+    if (!probe_tlas) {
+        return;
+    }
+
+    probe_rays_buffer = std::make_unique<VulkanBuffer>(
+        *device->allocator,
+        vk::BufferCreateInfo{
+            .size = ProbesPerFrame * PROBE_RAYS * sizeof(glm::vec4),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Other);
+    next_probe = 0;
+    probe_descriptor_set->UpdateDescriptor(0, DescriptorBinding::AccelStructuresValue{{
+                                                  .accel_structures = {{**probe_tlas}},
+                                              }});
+    probe_descriptor_set->UpdateDescriptor(1, DescriptorBinding::BuffersValue{{
+                                                  .buffers = {{**probes_buffer}},
+                                              }});
+    probe_descriptor_set->UpdateDescriptor(2, DescriptorBinding::BuffersValue{{
+                                                  .buffers = {{**probe_rays_buffer}},
+                                              }});
+}
+
+// Must not be called while the buffers are in use.
+void VulkanRasterizer::BuildDrawList() {
+    const auto& sub_scene = GetSubScene();
+
+    // The vertices are pulled, so only the index buffer binding splits the groups
+    using StateKey = std::pair<vk::Buffer, GLTF::Accessor::ComponentType>;
+    const auto GetStateKey = [](const MeshPrimitive& p) {
+        return StateKey{**p.index_buffer->gpu_buffer, p.index_buffer->component_type};
+    };
+    std::map<StateKey, u32> state_groups;
+    const auto GetGroup = [this, &state_groups, &GetStateKey](const MeshPrimitive& p) {
+        const auto [it, inserted] =
+            state_groups.try_emplace(GetStateKey(p), static_cast<u32>(draw_groups.size()));
+        if (inserted) {
+            draw_groups.push_back({.primitive = &p});
+        }
+        return it->second;
+    };
+
+    draw_groups.clear();
+    std::vector<GLSL::DrawInfo> draws;
+    std::vector<const MeshPrimitive*> draw_primitives;
+    // Primitives of each group, in the order they were found
+    std::vector<std::vector<const MeshPrimitive*>> group_primitives;
+    std::unordered_map<const MeshPrimitive*, u32> primitive_num_draws;
+    for (std::size_t i = 0; i < sub_scene.GetNumInstances(); ++i) {
+        const auto& mesh = *scene->meshes[sub_scene.instance_meshes[i]];
+        for (const auto& primitive : mesh.primitives) {
+            const u32 group = GetGroup(*primitive);
+            if (primitive_num_draws[primitive.get()]++ == 0) {
+                group_primitives.resize(draw_groups.size());
+                group_primitives[group].emplace_back(primitive.get());
+            }
+            const auto material = static_cast<u32>(
+                primitive->material == -1 ? scene->materials.size() - 1 : primitive->material);
+            draws.push_back({
+                .instance = static_cast<u32>(i),
+                .material = material,
+                .num_lods = static_cast<u32>(primitive->lods.size()),
+                .primitive = primitive_indices.at(primitive.get()),
+                // Alpha tests discard whole coarse fragments, which would show along the edges
+                .shading_rate = scene->materials[material]->IsAlphaMasked()
+                                    ? u32{SHADING_RATE_1X1}
+                                    : u32{SHADING_RATE_2X2},
+            });
+            draw_primitives.emplace_back(primitive.get());
+        }
+    }
+    num_draws = draws.size();
+
+    // Sort the groups by their state, so that consecutive ones share as much of it as possible
+    // and DrawFrame can skip rebinding it. Materials are bindless and so not part of it.
+    std::vector<u32> group_order(draw_groups.size());
+    std::iota(group_order.begin(), group_order.end(), 0);
+    std::ranges::sort(group_order, [this, &GetStateKey](u32 a, u32 b) {
+        return GetStateKey(*draw_groups[a].primitive) < GetStateKey(*draw_groups[b].primitive);
+    });
+    std::vector<DrawGroup> sorted_groups(draw_groups.size());
+    for (std::size_t i = 0; i < group_order.size(); ++i) {
+        sorted_groups[i] = draw_groups[group_order[i]];
+    }
+    draw_groups = std::move(sorted_groups);
+
+    // One batch per level of detail of each primitive, with room for the instances of all its
+    // draws. The batches of a group take its range of the commands.
+    std::vector<GLSL::DrawBatch> batches;
+    std::unordered_map<const MeshPrimitive*, u32> primitive_first_batches;
+    num_batch_instances = 0;
+    for (std::size_t i = 0; i < draw_groups.size(); ++i) {
+        auto& group = draw_groups[i];
+        group.first_command = static_cast<u32>(batches.size());
+        for (const auto* primitive : group_primitives[group_order[i]]) {
+            primitive_first_batches.emplace(primitive, static_cast<u32>(batches.size()));
+
+            // Heap ranges are aligned to more than the index size
+            const auto& index_buffer = *primitive->index_buffer->gpu_buffer;
+            const auto first_index = static_cast<u32>(
+                index_buffer.offset / GetComponentSize(primitive->index_buffer->component_type));
+            const u32 capacity = primitive_num_draws.at(primitive);
+            const auto AddBatch = [&](u32 lod_first_index, u32 index_count, float error) {
+                batches.push_back({
+                    .group = static_cast<u32>(i),
+                    .first_command = group.first_command,
+                    .first_index = first_index + lod_first_index,
+                    .index_count = index_count,
+                    .first_instance = static_cast<u32>(num_batch_instances),
+                    .error = error,
+                });
+                num_batch_instances += capacity;
+            };
+            AddBatch(0, static_cast<u32>(primitive->index_buffer->count), 0.0f);
+            for (const auto& lod : primitive->lods) {
+                AddBatch(lod.first_index, lod.index_count, lod.error);
+            }
+        }
+        group.num_batches = static_cast<u32>(batches.size() - group.first_command);
+    }
+    num_batches = batches.size();
+    for (std::size_t i = 0; i < num_draws; ++i) {
+        draws[i].first_batch = primitive_first_batches.at(draw_primitives[i]);
+    }
+
+    // Inverted for looking up the draws of the instances that survive CPU culling
+    instance_first_draws.assign(sub_scene.GetNumInstances() + 1, 0);
+    for (const auto& draw : draws) {
+        ++instance_first_draws[draw.instance + 1];
+    }
+    for (std::size_t i = 1; i < instance_first_draws.size(); ++i) {
+        instance_first_draws[i] += instance_first_draws[i - 1];
+    }
+    instance_draws.resize(num_draws);
+    std::vector<u32> instance_pos(instance_first_draws.begin(), instance_first_draws.end() - 1);
+    for (std::size_t i = 0; i < num_draws; ++i) {
+        instance_draws[instance_pos[draws[i].instance]++] = static_cast<u32>(i);
+    }
+
+    draws_buffer = CreateStorageBuffer(*device, draws,
+                                       vk::PipelineStageFlagBits2::eComputeShader |
+                                           vk::PipelineStageFlagBits2::eVertexShader);
+    transforms_buffer = CreateStorageBuffer(*device, sub_scene.instance_transforms,
+                                            vk::PipelineStageFlagBits2::eComputeShader |
+                                                vk::PipelineStageFlagBits2::eVertexShader);
+    bounds_buffer = CreateStorageBuffer(*device, sub_scene.instance_bounds,
+                                        vk::PipelineStageFlagBits2::eComputeShader);
+    batches_buffer = CreateStorageBuffer(*device, batches,
+                                         vk::PipelineStageFlagBits2::eComputeShader |
+                                             vk::PipelineStageFlagBits2::eVertexShader);
+    lights_buffer = CreateStorageBuffer(*device, sub_scene.lights,
+                                        vk::PipelineStageFlagBits2::eComputeShader |
+                                            vk::PipelineStageFlagBits2::eFragmentShader);
+    for (auto& frame : frames->frames_in_flight) {
+        frame.extras.visible_draws = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = std::max<std::size_t>(num_draws, 1) * sizeof(u32),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+        frame.extras.batch_counts = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = NumPhases * std::max<std::size_t>(num_batches, 1) * sizeof(u32),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eTransferDst,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+        frame.extras.batch_instances = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = NumPhases * std::max<std::size_t>(num_batch_instances, 1) * sizeof(u32),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+        frame.extras.draw_counts = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = NumPhases * std::max<std::size_t>(draw_groups.size(), 1) * sizeof(u32),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eIndirectBuffer |
+                         vk::BufferUsageFlagBits::eTransferDst,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+        frame.extras.draw_commands = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = NumPhases * std::max<std::size_t>(num_batches, 1) *
+                        sizeof(vk::DrawIndexedIndirectCommand),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eIndirectBuffer,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+    }
+    // Nothing is known to be visible yet, so the first frame draws everything in its second
+    // phase. Cleared by the next frame.
+    draw_visibility = std::make_unique<VulkanBuffer>(
+        *device->allocator,
+        vk::BufferCreateInfo{
+            .size = std::max<std::size_t>(num_draws, 1) * sizeof(u32),
+            .usage =
+                vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Other);
+    clear_draw_visibility = true;
+
+    draw_descriptor_set->UpdateDescriptor(1, DescriptorBinding::BuffersValue{{
+                                                 .buffers = {{**draws_buffer}},
+                                             }});
+    draw_descriptor_set->UpdateDescriptor(2, DescriptorBinding::BuffersValue{{
+                                                 .buffers = {{**transforms_buffer}},
+                                             }});
+    draw_descriptor_set->UpdateDescriptor(3, DescriptorBinding::BuffersValue{{
+                                                 .buffers = {{**bounds_buffer}},
+                                             }});
+    // One set per frame in flight
+    const auto PerFrame = [this](std::unique_ptr<VulkanBuffer> Frame::*buffer) {
+        std::vector<DescriptorBinding::Buffers> buffers;
+        for (const auto& frame : frames->frames_in_flight) {
+            buffers.push_back({.buffers = {{**(frame.extras.*buffer)}}});
+        }
+        return buffers;
+    };
+    draw_descriptor_set->UpdateDescriptor(
+        4, DescriptorBinding::BuffersValue{PerFrame(&Frame::draw_counts)});
+    draw_descriptor_set->UpdateDescriptor(
+        5, DescriptorBinding::BuffersValue{PerFrame(&Frame::draw_commands)});
+    draw_descriptor_set->UpdateDescriptor(
+        6, DescriptorBinding::BuffersValue{PerFrame(&Frame::visible_draws)});
+    draw_descriptor_set->UpdateDescriptor(7, DescriptorBinding::BuffersValue{{
+                                                 .buffers = {{**draw_visibility}},
+                                             }});
+    draw_descriptor_set->UpdateDescriptor(9, DescriptorBinding::BuffersValue{{
+                                                 .buffers = {{**batches_buffer}},
+                                             }});
+    draw_descriptor_set->UpdateDescriptor(
+        10, DescriptorBinding::BuffersValue{PerFrame(&Frame::batch_counts)});
+    draw_descriptor_set->UpdateDescriptor(
+        11, DescriptorBinding::BuffersValue{PerFrame(&Frame::batch_instances)});
+    draw_descriptor_set->UpdateDescriptor(12, DescriptorBinding::BuffersValue{{
+                                                  .buffers = {{**lights_buffer}},
+                                              }});
+    InvalidateDrawCommands();
+}
+
+void VulkanRasterizer::OnSceneUpdated(const SceneChanges& changes) {
+    if (changes.materials) {
+        UploadMaterials();
+        descriptor_set->UpdateDescriptor(0, DescriptorBinding::BuffersValue{{
+                                                .buffers = {{**materials_buffer}},
+                                            }});
+        InvalidateDrawCommands();
+    }
+    if (changes.transforms) {
+        BuildDrawList();
+        if (probe_tlas) {
+            probe_tlas->Update(
+                GetProbeTLASInstances(GetSubScene(), probe_blases, instance_first_draws));
+        }
+    }
+}
+
+void VulkanRasterizer::SetSubScene(std::size_t index) {
+    VulkanRenderer::SetSubScene(index);
+
+    // The buffers may still be in use by the other frame in flight
+    device->WaitQueueIdle(device->graphics_queue);
+    BuildDrawList();
+    CreateProbeResources();
+}
+
+void VulkanRasterizer::RecordDrawGroups(const vk::raii::CommandBuffer& cmd,
+                                        const FrameInFlight<Frame>& frame, const DrawPass& pass,
+                                        u32 uniforms_offset, std::size_t begin,
+                                        std::size_t end) const {
+    cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, **pass.pipeline);
+    VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eGraphics,
+                               *pass.pipeline->pipeline_layout, 0,
+                               {
+                                   {*descriptor_set, 0},
+                                   {*scene->texture_streamer->descriptor_sets, frame.idx},
+                                   {*draw_descriptor_set, frame.idx},
+                               },
+                               {uniforms_offset});
+
+    // The groups are sorted by their index buffer binding, which is all the state they set.
+    // Index data lives in a few heap blocks, so it rarely changes.
+    vk::Buffer bound_index_buffer{};
+    vk::IndexType bound_index_type{};
+    for (std::size_t i = begin; i < end; ++i) {
+        const auto& group = draw_groups[i];
+        const auto* primitive = group.primitive;
+        const auto& index_buffer = *primitive->index_buffer->gpu_buffer;
+        const auto index_type = GLTF::GetIndexType(primitive->index_buffer->component_type);
+        if (*index_buffer != bound_index_buffer || index_type != bound_index_type) {
+            cmd.bindIndexBuffer(*index_buffer, 0, index_type);
+            bound_index_buffer = *index_buffer;
+            bound_index_type = index_type;
+        }
+        for (u32 phase = pass.phase; phase < pass.phase + pass.num_phases; ++phase) {
+            cmd.drawIndexedIndirectCount(
+                **frame.extras.draw_commands,
+                (phase * num_batches + group.first_command) *
+                    sizeof(vk::DrawIndexedIndirectCommand),
+                **frame.extras.draw_counts, (phase * draw_groups.size() + i) * sizeof(u32),
+                group.num_batches, sizeof(vk::DrawIndexedIndirectCommand));
+        }
+    }
+}
+
+void VulkanRasterizer::RecordDrawCommands(FrameInFlight<Frame>& frame, u32 uniforms_offset,
+                                          const vk::Extent2D& render_extent) {
+    auto& extras = frame.extras;
+    const auto Record = [this, &frame, uniforms_offset, &render_extent](std::size_t i,
+                                                                        std::size_t num_chunks) {
+        // Each chunk has its own pool, as pools cannot be used from several threads
+        frame.extras.command_pools[i].reset();
+        for (std::size_t pass_idx = 0; pass_idx < draw_passes.size(); ++pass_idx) {
+            const auto& pass = draw_passes[pass_idx];
+            const auto& secondary =
+                frame.extras.secondary_command_buffers[i * MaxDrawPasses + pass_idx];
+            secondary.begin({
+                .flags = vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+                .pInheritanceInfo = TempPtr{vk::CommandBufferInheritanceInfo{
+                    .renderPass = pass.render_pass,
+                    .subpass = 0,
+                    .framebuffer = pass.depth_only ? *depth_framebuffer
+                                                   : *frame.extras.framebuffer,
+                }},
+            });
+            pass.pipeline->SetViewportScissor(secondary, render_extent);
+            RecordDrawGroups(secondary, frame, pass, uniforms_offset,
+                             i * draw_groups.size() / num_chunks,
+                             (i + 1) * draw_groups.size() / num_chunks);
+            secondary.end();
+        }
+    };
+
+    // Only spread the draw groups across the workers when there are enough of them
+    const std::size_t num_chunks = std::clamp<std::size_t>(
+        draw_groups.size() / MinGroupsPerRecorder, 1, extras.command_pools.size());
+    if (num_chunks == 1) {
+        Record(0, 1);
+    } else {
+        std::vector<std::future<void>> futures;
+        for (std::size_t i = 0; i < num_chunks; ++i) {
+            futures.emplace_back(
+                thread_pool->Submit([&Record, i, num_chunks] { Record(i, num_chunks); }));
+        }
+        thread_pool->WaitAll(futures);
+    }
+    extras.num_draw_command_buffers = num_chunks;
+    extras.draw_commands_extent = render_extent;
+    extras.draw_commands_uniforms_offset = uniforms_offset;
+}
+
+void VulkanRasterizer::InvalidateDrawCommands() {
+    for (auto& frame : frames->frames_in_flight) {
+        frame.extras.num_draw_command_buffers = 0;
+    }
+}
+
+// Roughly how large the instance is on screen, so that the meshes that stand out most are
+// streamed in first
+static float GetStreamingPriority(const GLSL::AABB& bounds, const glm::vec3& camera_position) {
+    const glm::vec3 extent = bounds.max_point - bounds.min_point;
+    if (!std::isfinite(extent.x + extent.y + extent.z)) {
+        return std::numeric_limits<float>::max();
+    }
+    const float radius = glm::length(extent) * 0.5f;
+    const float distance =
+        glm::distance((bounds.min_point + bounds.max_point) * 0.5f, camera_position);
+    return radius / std::max(distance - radius, 1e-3f);
 }
 
 void VulkanRasterizer::DrawFrame(const Camera& external_camera, bool force_external_camera) {
-    device->allocator->CleanupStagingBuffers();
+    PROFILE_FUNCTION();
+    const FrameScope frame_scope{*this};
+    if (scene->lazy_texture_loader) {
+        const auto changed = scene->lazy_texture_loader->Poll(*scene->texture_streamer);
+        if (!changed.empty()) {
+            // The descriptor set may still be in use by the other frame in flight
+            device->WaitQueueIdle(device->graphics_queue);
+        }
+        for (const std::size_t texture_idx : changed) {
+            const auto& texture = scene->textures[texture_idx];
+            descriptor_set->UpdateDescriptor(
+                1,
+                DescriptorBinding::CombinedImageSamplersValue{{
+                    .images = {{
+                        .image = *texture->image->GetTexture().image_view,
+                        .sampler = texture->sampler ? *texture->sampler->sampler
+                                                    : *device->default_sampler,
+                    }},
+                }},
+                static_cast<u32>(texture_idx));
+        }
+        if (!changed.empty()) {
+            InvalidateDrawCommands();
+        }
+    }
+    device->upload_ring->Flush();
 
-    const auto& frame = frames->AcquireNextFrame();
+    auto& frame = frames->AcquireNextFrame();
+    if (const auto time = GetFrameTime(frame.idx)) {
+        UpdateRenderScale(*time);
+    }
     frames->BeginFrame();
 
-    const bool use_external_camera =
-        force_external_camera || scene->main_sub_scene->cameras.empty();
-    const auto& camera = use_external_camera ? external_camera : *scene->main_sub_scene->cameras[0];
+    const auto& cmd = frame.command_buffer;
+    if (gpu_profiler) {
+        gpu_profiler->BeginFrame(cmd, frame.idx);
+    }
+    VulkanTextureStreamer::FrameUpdate streaming_update;
+    VulkanGeometryStreamer::FrameUpdate geometry_update;
+    {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Uploads"};
+        streaming_update = scene->texture_streamer->BeginFrame(cmd, frame.idx);
+        geometry_update = scene->geometry_streamer->BeginFrame(cmd, frame.idx);
+    }
+
+    const auto& sub_scene = GetSubScene();
+    const bool use_external_camera = force_external_camera || sub_scene.cameras.empty();
+    const auto& camera = use_external_camera ? external_camera : *sub_scene.cameras[0];
 
     const double viewport_aspect_ratio =
         static_cast<double>(swap_chain->extent.width) / swap_chain->extent.height;
+    const auto display_extent = GetDisplayExtent(camera.GetAspectRatio(viewport_aspect_ratio));
     const auto render_extent = GetRenderExtent(camera.GetAspectRatio(viewport_aspect_ratio));
-    const auto camera_transform = camera.GetProj(viewport_aspect_ratio) * camera.view;
+    BeginFrameTimer(cmd, frame.idx, GetRenderScale());
 
-    const auto& cmd = frame.command_buffer;
-    pipeline->BeginRenderPass(cmd, {
-                                       .framebuffer = *frame.extras.framebuffer,
-                                       .renderArea =
-                                           {
-                                               .extent = render_extent,
-                                           },
-                                       .clearValueCount = 2,
-                                       .pClearValues =
-                                           TempArr<vk::ClearValue>{
-                                               {.color = {{{0.0f, 0.0f, 0.0f, 0.0f}}}},
-                                               {.depthStencil = {1.0f, 0}},
-                                           },
-                                   });
-    cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, **pipeline);
+    const glm::mat4 proj = camera.GetProj(viewport_aspect_ratio);
+    const glm::vec3 camera_position{glm::inverse(camera.view)[3]};
+    // In stereo, each eye covers half the width with the same vertical field of view
+    const u32 num_views = GetNumViews();
+    const auto view_extent = GetViewExtent(render_extent);
+    glm::mat4 eye_proj = proj;
+    if (num_views > 1) {
+        eye_proj[0][0] *= 2;
+    }
+    std::array<glm::mat4, MAX_VIEWS> views{};
+    std::array<glm::mat4, MAX_VIEWS> view_projs{};
+    std::array<glm::mat4, MAX_VIEWS> inverse_projs{};
+    for (u32 i = 0; i < num_views; ++i) {
+        views[i] = GetEyeView(camera.view, i);
+        view_projs[i] = eye_proj * views[i];
+        inverse_projs[i] = glm::inverse(eye_proj);
+    }
 
-    // TODO: Many optimization opportunities
-    for (const auto& [mesh, model_transform] : scene->main_sub_scene->mesh_instances) {
-        cmd.pushConstants<glm::mat4>(*pipeline->pipeline_layout, vk::ShaderStageFlagBits::eVertex,
-                                     0, camera_transform * model_transform);
-        for (const auto& primitive : mesh->primitives) {
-            const std::size_t material =
-                primitive->material == -1 ? materials.size() - 1 : primitive->material;
-            cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *pipeline->pipeline_layout, 0,
-                                   descriptor_sets->descriptor_sets[material], {});
-
-            cmd.setVertexInputEXT(primitive->bindings, primitive->attributes);
-            cmd.bindVertexBuffers(0, primitive->raw_vertex_buffers,
-                                  primitive->vertex_buffer_offsets);
-            cmd.bindIndexBuffer(**primitive->index_buffer->gpu_buffer, 0,
-                                GLTF::GetIndexType(primitive->index_buffer->component_type));
-
-            cmd.drawIndexed(static_cast<u32>(primitive->index_buffer->count), 1, 0, 0, 0);
+    // Cull whole subtrees of instances on the CPU first, leaving the GPU to test the remaining
+    // draws one by one. The draws of instances seen by either eye are tested against both.
+    visible_instances.clear();
+    for (u32 i = 0; i < num_views; ++i) {
+        sub_scene.instance_bvh->Cull(Frustum{view_projs[i]}, visible_instances);
+    }
+    if (num_views > 1) {
+        std::ranges::sort(visible_instances);
+        const auto [first, last] = std::ranges::unique(visible_instances);
+        visible_instances.erase(first, last);
+    }
+    const auto& visible_draws = *frame.extras.visible_draws;
+    auto* visible_draws_data = static_cast<u32*>(visible_draws.allocation_info.pMappedData);
+    std::size_t num_visible_draws = 0;
+    auto& geometry_streamer = *scene->geometry_streamer;
+    for (const u32 instance : visible_instances) {
+        // The meshes that are not resident yet are streamed in for later frames
+        if (geometry_streamer.IsEnabled()) {
+            const u32 mesh = sub_scene.instance_meshes[instance];
+            geometry_streamer.Request(
+                mesh, GetStreamingPriority(sub_scene.instance_bounds[instance], camera_position));
+            if (!geometry_streamer.IsResident(mesh)) {
+                continue;
+            }
+        }
+        for (u32 i = instance_first_draws[instance]; i < instance_first_draws[instance + 1]; ++i) {
+            visible_draws_data[num_visible_draws++] = instance_draws[i];
         }
     }
+    if (num_visible_draws > 0) { // No-op for coherent memory
+        vmaFlushAllocation(visible_draws.allocator, visible_draws.allocation, 0,
+                           num_visible_draws * sizeof(u32));
+    }
+    PrefetchStreaming(camera.view, proj, render_extent);
 
-    pipeline->EndRenderPass(cmd);
+    // Levels of the Hi-Z pyramid covered by the render area
+    const auto HalfExtent = [](const vk::Extent2D& extent) {
+        return vk::Extent2D{std::max(extent.width / 2, 1u), std::max(extent.height / 2, 1u)};
+    };
+    u32 hiz_levels = 1;
+    for (auto extent = HalfExtent(view_extent); extent.width > 1 || extent.height > 1;
+         extent = HalfExtent(extent)) {
+        ++hiz_levels;
+    }
 
-    frames->EndFrame();
+    frame_allocator->BeginFrame(frame.idx);
+    const u32 uniforms_offset = frame_allocator->Push<GLSL::RasterizerUniformsBlock>({{
+        .view_proj = view_projs,
+        .num_draws = static_cast<u32>(num_visible_draws),
+        .hiz_levels = hiz_levels,
+        .render_extent = {view_extent.width, view_extent.height},
+        .camera_position = camera_position,
+        .lod_scale = proj[1][1] * static_cast<float>(view_extent.height) * 0.5f /
+                     LODErrorPixels,
+        .view = views,
+        .inverse_proj = inverse_projs,
+        .num_lights = static_cast<u32>(sub_scene.lights.size()),
+        .num_batch_instances = static_cast<u32>(std::max<std::size_t>(num_batch_instances, 1)),
+        .num_views = num_views,
+        .inverse_view_proj = glm::inverse(view_projs[0]),
+        .probe_origin = probe_origin,
+        .probe_spacing = probe_spacing,
+        .probe_grid = probe_grid,
+        .num_probes = num_probes,
+    }});
+    frame_allocator->EndFrame();
 
-    device->graphics_queue.submit(
-        {
+    auto& extras = frame.extras;
+    if (extras.num_draw_command_buffers == 0 || extras.draw_commands_extent != view_extent ||
+        extras.draw_commands_uniforms_offset != uniforms_offset) {
+        RecordDrawCommands(frame, uniforms_offset, view_extent);
+    }
+
+    const auto MemoryBarrier = [&cmd](vk::PipelineStageFlags2 src_stage_mask,
+                                      vk::AccessFlags2 src_access_mask,
+                                      vk::PipelineStageFlags2 dst_stage_mask,
+                                      vk::AccessFlags2 dst_access_mask) {
+        cmd.pipelineBarrier2({
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+                .srcStageMask = src_stage_mask,
+                .srcAccessMask = src_access_mask,
+                .dstStageMask = dst_stage_mask,
+                .dstAccessMask = dst_access_mask,
+            }}},
+        });
+    };
+    const auto DepthBarrier = [this, &cmd](vk::PipelineStageFlags2 src_stage_mask,
+                                           vk::AccessFlags2 src_access_mask,
+                                           vk::PipelineStageFlags2 dst_stage_mask,
+                                           vk::AccessFlags2 dst_access_mask,
+                                           vk::ImageLayout old_layout,
+                                           vk::ImageLayout new_layout) {
+        cmd.pipelineBarrier2({
+            .imageMemoryBarrierCount = 1,
+            .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{{
+                .srcStageMask = src_stage_mask,
+                .srcAccessMask = src_access_mask,
+                .dstStageMask = dst_stage_mask,
+                .dstAccessMask = dst_access_mask,
+                .oldLayout = old_layout,
+                .newLayout = new_layout,
+                .image = **depth_image,
+                .subresourceRange =
+                    {
+                        .aspectMask = vk::ImageAspectFlagBits::eDepth,
+                        .baseMipLevel = 0,
+                        .levelCount = 1,
+                        .baseArrayLayer = 0,
+                        .layerCount = VK_REMAINING_ARRAY_LAYERS,
+                    },
+            }}},
+        });
+    };
+    static constexpr auto FragmentTests = vk::PipelineStageFlagBits2::eEarlyFragmentTests |
+                                          vk::PipelineStageFlagBits2::eLateFragmentTests;
+    static constexpr auto DepthReadWrite = vk::AccessFlagBits2::eDepthStencilAttachmentRead |
+                                           vk::AccessFlagBits2::eDepthStencilAttachmentWrite;
+    static constexpr auto StorageReadWrite =
+        vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite;
+
+    // The visibility of the draws was written by the previous frame
+    MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader, StorageReadWrite,
+                  vk::PipelineStageFlagBits2::eClear | vk::PipelineStageFlagBits2::eComputeShader,
+                  vk::AccessFlagBits2::eTransferWrite | StorageReadWrite);
+    cmd.fillBuffer(**extras.batch_counts, 0, VK_WHOLE_SIZE, 0);
+    cmd.fillBuffer(**extras.draw_counts, 0, VK_WHOLE_SIZE, 0);
+    if (clear_draw_visibility) {
+        cmd.fillBuffer(**draw_visibility, 0, VK_WHOLE_SIZE, 0);
+        clear_draw_visibility = false;
+    }
+    MemoryBarrier(vk::PipelineStageFlagBits2::eClear, vk::AccessFlagBits2::eTransferWrite,
+                  vk::PipelineStageFlagBits2::eComputeShader, StorageReadWrite);
+
+    // Culls the draws into their batches for the phase, then turns the batches into the
+    // indirect commands of their groups. Both pipelines have the same layout.
+    const auto Cull = [&](u32 phase) {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Cull"};
+        cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **cull_pipeline);
+        VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                   *cull_pipeline->pipeline_layout, 0,
+                                   {{*draw_descriptor_set, frame.idx}}, {uniforms_offset});
+        cmd.pushConstants<GLSL::CullPushConstant>(
+            *cull_pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+            {{
+                .phase = phase,
+                .first_count = static_cast<u32>(phase * draw_groups.size()),
+                .num_batches = static_cast<u32>(num_batches),
+                .first_instance = static_cast<u32>(phase * num_batch_instances),
+            }});
+        cmd.dispatch(static_cast<u32>((num_visible_draws + CullGroupSize - 1) / CullGroupSize),
+                     1, 1);
+        MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderStorageWrite,
+                      vk::PipelineStageFlagBits2::eComputeShader, StorageReadWrite);
+        cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **batch_pipeline);
+        cmd.dispatch(static_cast<u32>((num_batches + BatchGroupSize - 1) / BatchGroupSize), 1,
+                     1);
+        MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderStorageWrite,
+                      vk::PipelineStageFlagBits2::eDrawIndirect |
+                          vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eIndirectCommandRead | StorageReadWrite);
+    };
+
+    const std::array<vk::ClearValue, 2> clear_values{{
+        {.color = {{{0.0f, 0.0f, 0.0f, 0.0f}}}},
+        {.depthStencil = {1.0f, 0}},
+    }};
+    const auto ExecutePass = [&](std::size_t pass_idx) {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Draw"};
+        const auto& pass = draw_passes[pass_idx];
+        // Depth only passes clear the depth, the first attachment
+        const auto clear_values_offset = pass.depth_only ? 1 : 0;
+        cmd.beginRenderPass(
             {
-                .commandBufferCount = 1,
-                .pCommandBuffers = TempArr<vk::CommandBuffer>{*frame.command_buffer},
-                .signalSemaphoreCount = 1,
-                .pSignalSemaphores = TempArr<vk::Semaphore>{*frame.render_finished_semaphore},
+                .renderPass = pass.render_pass,
+                .framebuffer = pass.depth_only ? *depth_framebuffer : *extras.framebuffer,
+                .renderArea =
+                    {
+                        .extent = view_extent,
+                    },
+                .clearValueCount = static_cast<u32>(clear_values.size() - clear_values_offset),
+                .pClearValues = clear_values.data() + clear_values_offset,
             },
-        },
-        *frame.in_flight_fence);
+            vk::SubpassContents::eSecondaryCommandBuffers);
+        auto secondaries = frame_arena.MakeVector<vk::CommandBuffer>();
+        for (std::size_t i = 0; i < extras.num_draw_command_buffers; ++i) {
+            secondaries.emplace_back(
+                *extras.secondary_command_buffers[i * MaxDrawPasses + pass_idx]);
+        }
+        cmd.executeCommands({static_cast<u32>(secondaries.size()), secondaries.data()});
+        cmd.endRenderPass();
+    };
+
+    // The lights of each cluster, which only the shading reads. The buffer of the frame was last
+    // read by its previous submission, which has completed.
+    if (!sub_scene.lights.empty()) {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx,
+                                                  "Light clusters"};
+        cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **light_cluster_pipeline);
+        VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                   *light_cluster_pipeline->pipeline_layout, 0,
+                                   {{*draw_descriptor_set, frame.idx}}, {uniforms_offset});
+        cmd.dispatch((LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z +
+                      LightClusterGroupSize - 1) /
+                         LightClusterGroupSize,
+                     num_views, 1);
+        MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderStorageWrite,
+                      vk::PipelineStageFlagBits2::eFragmentShader |
+                          vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderStorageRead);
+    }
+
+    // Some of the probes trace their rays and blend them in, before the shading reads them. The
+    // probes were last read by the shading of the previous frame, and the rays by its blending.
+    if (num_probes > 0) {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Probes"};
+        MemoryBarrier(vk::PipelineStageFlagBits2::eFragmentShader |
+                          vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderStorageRead,
+                      vk::PipelineStageFlagBits2::eClear |
+                          vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eTransferWrite |
+                          vk::AccessFlagBits2::eShaderStorageRead |
+                          vk::AccessFlagBits2::eShaderStorageWrite);
+        if (clear_probes) {
+            cmd.fillBuffer(**probes_buffer, 0, VK_WHOLE_SIZE, 0);
+            MemoryBarrier(vk::PipelineStageFlagBits2::eClear, vk::AccessFlagBits2::eTransferWrite,
+                          vk::PipelineStageFlagBits2::eComputeShader,
+                          vk::AccessFlagBits2::eShaderStorageRead |
+                              vk::AccessFlagBits2::eShaderStorageWrite);
+            clear_probes = false;
+        }
+
+        const u32 num_updated = std::min(ProbesPerFrame, num_probes);
+        std::normal_distribution<float> distribution;
+        const glm::quat rotation = glm::normalize(
+            glm::quat{distribution(probe_random), distribution(probe_random),
+                      distribution(probe_random), distribution(probe_random)});
+        const GLSL::ProbeUpdatePushConstant push_constant{
+            .ray_rotation = glm::mat4_cast(rotation),
+            .first_probe = next_probe,
+            .num_updated = num_updated,
+            .seed = static_cast<u32>(probe_random()),
+        };
+        const auto Dispatch = [&](const VulkanComputePipeline& pipeline) {
+            cmd.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
+            VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                       *pipeline.pipeline_layout, 0,
+                                       {
+                                           {*descriptor_set, 0},
+                                           {*scene->texture_streamer->descriptor_sets, frame.idx},
+                                           {*draw_descriptor_set, frame.idx},
+                                           {*probe_descriptor_set, 0},
+                                       },
+                                       {uniforms_offset});
+            cmd.pushConstants<GLSL::ProbeUpdatePushConstant>(
+                *pipeline.pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0, {push_constant});
+            cmd.dispatch(num_updated, 1, 1);
+        };
+        Dispatch(*probe_trace_pipeline);
+        MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderStorageWrite,
+                      vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderStorageRead |
+                          vk::AccessFlagBits2::eShaderStorageWrite);
+        Dispatch(*probe_blend_pipeline);
+        MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderStorageWrite,
+                      vk::PipelineStageFlagBits2::eFragmentShader |
+                          vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderStorageRead);
+        next_probe = (next_probe + num_updated) % num_probes;
+    }
+
+    // The visibility buffer was last read by the shading of the previous frame
+    if (visibility_buffer) {
+        MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader, vk::AccessFlagBits2::eNone,
+                      vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+                      vk::AccessFlagBits2::eColorAttachmentWrite);
+    }
+
+    // Shades coarsely where the previous frame was smooth, at the full rate on the first frame
+    if (shading_rate_image) {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx,
+                                                  "Shading rate"};
+        static constexpr vk::ImageSubresourceRange ColorSubresourceRange{
+            .aspectMask = vk::ImageAspectFlagBits::eColor,
+            .baseMipLevel = 0,
+            .levelCount = 1,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        };
+        const auto RateBarrier = [this, &cmd](vk::PipelineStageFlags2 src_stage_mask,
+                                              vk::AccessFlags2 src_access_mask,
+                                              vk::PipelineStageFlags2 dst_stage_mask,
+                                              vk::AccessFlags2 dst_access_mask,
+                                              vk::ImageLayout old_layout,
+                                              vk::ImageLayout new_layout) {
+            cmd.pipelineBarrier2({
+                .imageMemoryBarrierCount = 1,
+                .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{{
+                    .srcStageMask = src_stage_mask,
+                    .srcAccessMask = src_access_mask,
+                    .dstStageMask = dst_stage_mask,
+                    .dstAccessMask = dst_access_mask,
+                    .oldLayout = old_layout,
+                    .newLayout = new_layout,
+                    .image = **shading_rate_image,
+                    .subresourceRange = ColorSubresourceRange,
+                }}},
+            });
+        };
+        static constexpr auto ShadingRateStage =
+            vk::PipelineStageFlagBits2::eFragmentShadingRateAttachmentKHR;
+        static constexpr auto ShadingRateRead =
+            vk::AccessFlagBits2::eFragmentShadingRateAttachmentReadKHR;
+        RateBarrier(ShadingRateStage, ShadingRateRead,
+                    vk::PipelineStageFlagBits2::eComputeShader | vk::PipelineStageFlagBits2::eClear,
+                    vk::AccessFlagBits2::eShaderStorageWrite | vk::AccessFlagBits2::eTransferWrite,
+                    vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral);
+        const vk::Extent2D tiles{
+            (render_extent.width + shading_rate_tile.width - 1) / shading_rate_tile.width,
+            (render_extent.height + shading_rate_tile.height - 1) / shading_rate_tile.height,
+        };
+        if (last_render_extent.width != 0 && last_render_extent.height != 0) {
+            // The previous frame was last written by its shading
+            MemoryBarrier(vk::PipelineStageFlagBits2::eColorAttachmentOutput |
+                              vk::PipelineStageFlagBits2::eComputeShader,
+                          vk::AccessFlagBits2::eColorAttachmentWrite |
+                              vk::AccessFlagBits2::eShaderStorageWrite,
+                          vk::PipelineStageFlagBits2::eComputeShader,
+                          vk::AccessFlagBits2::eShaderSampledRead);
+            cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **shading_rate_pipeline);
+            VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                       *shading_rate_pipeline->pipeline_layout, 0,
+                                       {{*shading_rate_descriptor_sets, frame.idx}});
+            cmd.pushConstants<GLSL::ShadingRatePushConstant>(
+                *shading_rate_pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+                {{
+                    .src_extent = {last_render_extent.width, last_render_extent.height},
+                    .dst_extent = {render_extent.width, render_extent.height},
+                    .tile_size = {shading_rate_tile.width, shading_rate_tile.height},
+                }});
+            cmd.dispatch(tiles.width, tiles.height, 1);
+        } else {
+            cmd.clearColorImage(**shading_rate_image, vk::ImageLayout::eGeneral,
+                                vk::ClearColorValue{std::array<u32, 4>{SHADING_RATE_1X1}},
+                                ColorSubresourceRange);
+        }
+        RateBarrier(vk::PipelineStageFlagBits2::eComputeShader | vk::PipelineStageFlagBits2::eClear,
+                    vk::AccessFlagBits2::eShaderStorageWrite | vk::AccessFlagBits2::eTransferWrite,
+                    ShadingRateStage, ShadingRateRead, vk::ImageLayout::eGeneral,
+                    vk::ImageLayout::eFragmentShadingRateAttachmentOptimalKHR);
+        last_render_extent = render_extent;
+    }
+
+    // The stereo image was last copied from by the previous frame
+    if (stereo_image) {
+        MemoryBarrier(vk::PipelineStageFlagBits2::eCopy, vk::AccessFlagBits2::eNone,
+                      vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+                      vk::AccessFlagBits2::eColorAttachmentWrite);
+    }
+
+    // First phase, then the Hi-Z pyramid of its depth for testing the rest
+    Cull(0);
+    ExecutePass(0);
+    DepthBarrier(FragmentTests, vk::AccessFlagBits2::eDepthStencilAttachmentWrite,
+                 vk::PipelineStageFlagBits2::eComputeShader,
+                 vk::AccessFlagBits2::eShaderSampledRead,
+                 vk::ImageLayout::eDepthStencilAttachmentOptimal,
+                 vk::ImageLayout::eShaderReadOnlyOptimal);
+    {
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Hi-Z"};
+        cmd.pipelineBarrier2({
+            .imageMemoryBarrierCount = 1,
+            .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{{
+                .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .srcAccessMask = vk::AccessFlagBits2::eNone,
+                .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+                .oldLayout = vk::ImageLayout::eUndefined, // Rebuilt entirely
+                .newLayout = vk::ImageLayout::eGeneral,
+                .image = **hiz_image,
+                .subresourceRange =
+                    {
+                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+                        .baseMipLevel = 0,
+                        .levelCount = VK_REMAINING_MIP_LEVELS,
+                        .baseArrayLayer = 0,
+                        .layerCount = VK_REMAINING_ARRAY_LAYERS,
+                    },
+            }}},
+        });
+        cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **hiz_pipeline);
+        vk::Extent2D src_extent = view_extent;
+        for (u32 level = 0; level < hiz_levels; ++level) {
+            const auto dst_extent = HalfExtent(src_extent);
+            VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                       *hiz_pipeline->pipeline_layout, 0,
+                                       {{*hiz_descriptor_sets, level}});
+            cmd.pushConstants<GLSL::HiZPushConstant>(
+                *hiz_pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+                {{
+                    .src_extent = {src_extent.width, src_extent.height},
+                    .dst_extent = {dst_extent.width, dst_extent.height},
+                }});
+            cmd.dispatch((dst_extent.width + HiZGroupSize - 1) / HiZGroupSize,
+                         (dst_extent.height + HiZGroupSize - 1) / HiZGroupSize, num_views);
+            MemoryBarrier(vk::PipelineStageFlagBits2::eComputeShader,
+                          vk::AccessFlagBits2::eShaderStorageWrite,
+                          vk::PipelineStageFlagBits2::eComputeShader,
+                          vk::AccessFlagBits2::eShaderSampledRead);
+            src_extent = dst_extent;
+        }
+    }
+    DepthBarrier(vk::PipelineStageFlagBits2::eComputeShader,
+                 vk::AccessFlagBits2::eShaderSampledRead, FragmentTests, DepthReadWrite,
+                 vk::ImageLayout::eShaderReadOnlyOptimal,
+                 vk::ImageLayout::eDepthStencilAttachmentOptimal);
+
+    // Second phase, and the shading pass after the depth pre-pass
+    Cull(1);
+    for (std::size_t pass_idx = 1; pass_idx < draw_passes.size(); ++pass_idx) {
+        ExecutePass(pass_idx);
+    }
 
-    PostprocessAndPresent(*frame.render_finished_semaphore);
+    // Each pixel of the visibility buffer, once all of them are drawn
+    if (visibility_buffer) {
+        MemoryBarrier(vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+                      vk::AccessFlagBits2::eColorAttachmentWrite,
+                      vk::PipelineStageFlagBits2::eComputeShader,
+                      vk::AccessFlagBits2::eShaderSampledRead);
+        const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame.idx, "Shade"};
+        cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **shade_pipeline);
+        VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                   *shade_pipeline->pipeline_layout, 0,
+                                   {
+                                       {*descriptor_set, 0},
+                                       {*scene->texture_streamer->descriptor_sets, frame.idx},
+                                       {*draw_descriptor_set, frame.idx},
+                                       {*shade_descriptor_sets, frame.idx},
+                                   },
+                                   {uniforms_offset});
+        cmd.dispatch((render_extent.width + ShadeGroupSize - 1) / ShadeGroupSize,
+                     (render_extent.height + ShadeGroupSize - 1) / ShadeGroupSize, 1);
+    }
+
+    // The eyes side by side, left first
+    if (stereo_image) {
+        const auto& offscreen_image = *offscreen_frames[frame.idx].image;
+        const vk::ImageSubresourceRange color_range{
+            .aspectMask = vk::ImageAspectFlagBits::eColor,
+            .baseMipLevel = 0,
+            .levelCount = 1,
+            .baseArrayLayer = 0,
+            .layerCount = VK_REMAINING_ARRAY_LAYERS,
+        };
+        cmd.pipelineBarrier2({
+            .imageMemoryBarrierCount = 2,
+            .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{
+                {
+                    .srcStageMask = vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+                    .srcAccessMask = vk::AccessFlagBits2::eColorAttachmentWrite,
+                    .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+                    .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+                    .oldLayout = vk::ImageLayout::eGeneral,
+                    .newLayout = vk::ImageLayout::eGeneral,
+                    .image = **stereo_image,
+                    .subresourceRange = color_range,
+                },
+                {
+                    .srcStageMask = vk::PipelineStageFlagBits2::eNone,
+                    .srcAccessMask = vk::AccessFlagBits2::eNone,
+                    .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+                    .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                    .oldLayout = vk::ImageLayout::eUndefined, // Overwritten entirely
+                    .newLayout = vk::ImageLayout::eGeneral,
+                    .image = *offscreen_image,
+                    .subresourceRange = color_range,
+                },
+            }},
+        });
+        std::array<vk::ImageCopy, MAX_VIEWS> regions{};
+        for (u32 i = 0; i < num_views; ++i) {
+            regions[i] = {
+                .srcSubresource =
+                    {
+                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+                        .mipLevel = 0,
+                        .baseArrayLayer = i,
+                        .layerCount = 1,
+                    },
+                .dstSubresource =
+                    {
+                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+                        .mipLevel = 0,
+                        .baseArrayLayer = 0,
+                        .layerCount = 1,
+                    },
+                .dstOffset = {static_cast<s32>(i * view_extent.width), 0, 0},
+                .extent = {view_extent.width, view_extent.height, 1},
+            };
+        }
+        cmd.copyImage(**stereo_image, vk::ImageLayout::eGeneral, *offscreen_image,
+                      vk::ImageLayout::eGeneral, {num_views, regions.data()});
+    }
+
+    EndFrameTimer(cmd, frame.idx, vk::PipelineStageFlagBits2::eAllCommands);
+    const auto image_available = RecordPostprocess(
+        cmd, frame.idx, render_extent, display_extent,
+        visibility_buffer ? vk::PipelineStageFlagBits2::eComputeShader
+        : stereo_image    ? vk::PipelineStageFlagBits2::eCopy
+                          : vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+        visibility_buffer ? vk::AccessFlagBits2::eShaderStorageWrite
+        : stereo_image    ? vk::AccessFlagBits2::eTransferWrite
+                          : vk::AccessFlagBits2::eColorAttachmentWrite);
+    scene->texture_streamer->EndFrame(cmd);
+
+    frames->EndFrame();
+
+    // Wait for the memory of the streamed textures and geometry to be bound
+    auto wait_semaphores = frame_arena.MakeVector<vk::SemaphoreSubmitInfo>();
+    for (const auto semaphore : {streaming_update.wait_semaphore, geometry_update.wait_semaphore}) {
+        if (semaphore) {
+            wait_semaphores.push_back({
+                .semaphore = semaphore,
+                .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            });
+        }
+    }
+    if (image_available && image_available->semaphore) {
+        wait_semaphores.push_back(*image_available);
+    }
+    frames->Submit(*frame.command_buffer, wait_semaphores, image_available.has_value());
+    if (!image_available) {
+        throw std::runtime_error("Failed to acquire image, ignoring");
+    }
+    swap_chain->Present(*frame.render_finished_semaphore);
 }
 
 void VulkanRasterizer::CreateFramebuffers() {
+    // In stereo, the views are the layers of the attachments
+    const auto view_target_extent = GetViewExtent(render_target_extent);
     for (std::size_t i = 0; i < frames->frames_in_flight.size(); ++i) {
+        std::vector<vk::ImageView> attachments{
+            visibility_buffer ? *visibility_image_view
+            : stereo_image    ? *stereo_image_view
+                              : *offscreen_frames[i].image_view,
+            *depth_image_view,
+        };
+        if (shading_rate_image) {
+            attachments.emplace_back(*shading_rate_image_view);
+        }
         frames->frames_in_flight[i].extras.framebuffer = vk::raii::Framebuffer{
             **device,
             vk::FramebufferCreateInfo{
                 .renderPass = *render_pass,
-                .attachmentCount = 2,
-                .pAttachments =
-                    TempArr<vk::ImageView>{*pp_frames->frames_in_flight[i].extras.image_view,
-                                           *depth_image_view},
-                .width = swap_chain->extent.width,
-                .height = swap_chain->extent.height,
+                .attachmentCount = static_cast<u32>(attachments.size()),
+                .pAttachments = attachments.data(),
+                .width = view_target_extent.width,
+                .height = view_target_extent.height,
                 .layers = 1,
             }};
     }
+    depth_framebuffer = vk::raii::Framebuffer{
+        **device,
+        vk::FramebufferCreateInfo{
+            .renderPass = *depth_render_pass,
+            .attachmentCount = 1,
+            .pAttachments = &*depth_image_view,
+            .width = view_target_extent.width,
+            .height = view_target_extent.height,
+            .layers = 1,
+        }};
 }
 
 void VulkanRasterizer::OnResized([[maybe_unused]] const vk::Extent2D& actual_extent) {
     VulkanRenderer::OnResized(actual_extent);
+    InvalidateDrawCommands();
+    if (!render_targets_resized) {
+        return;
+    }
     CreateDepthResources();
+    CreateVisibilityResources();
+    CreateStereoResources();
+    CreateShadingRateResources();
     CreateFramebuffers();
+    if (draw_descriptor_set) {
+        draw_descriptor_set->UpdateDescriptor(8, DescriptorBinding::CombinedImageSamplersValue{{
+                                                     .images = {{
+                                                         .image = *hiz_view,
+                                                         .layout = vk::ImageLayout::eGeneral,
+                                                     }},
+                                                 }});
+    }
 }
 
 } // namespace Renderer
@@ -5,6 +5,8 @@
 #pragma once
 
 #include <memory>
+#include <random>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <vulkan/vulkan_raii.hpp>
@@ -12,11 +14,18 @@
 
 namespace Renderer {
 
+class MeshPrimitive;
+template <typename ExtraData>
+struct FrameInFlight;
+class VulkanAccelStructure;
+class VulkanBuffer;
+class VulkanComputePipeline;
 class VulkanGraphicsPipeline;
 class VulkanImage;
 class VulkanImmUploadBuffer;
 class VulkanTexture;
 class VulkanDescriptorSets;
+class VulkanFrameAllocator;
 
 namespace GLSL {
 struct MaterialBlock;
@@ -32,27 +41,248 @@ public:
     void LoadScene(GLTF::Container& gltf) override;
     void DrawFrame(const Camera& external_camera, bool force_external_camera) override;
     void OnResized(const vk::Extent2D& actual_extent) override;
+    void SetSubScene(std::size_t index) override;
+
+    // Draws the depth of the visible instances before shading them, so that each pixel is only
+    // shaded once. Must be called before Init.
+    void SetDepthPrepass(bool enabled);
+    // Generates coarser levels of detail for the primitives while loading, which are drawn when
+    // they differ from the full primitive by less than LODErrorPixels. Must be called before
+    // LoadScene.
+    void SetLODs(bool enabled);
+    // Streams the meshes in and out of this many bytes of device memory as the camera nears
+    // them, instead of loading all of them up front, and skips drawing those that are not
+    // resident yet. 0 disables streaming. Must be called before LoadScene.
+    void SetGeometryBudget(vk::DeviceSize budget);
+    // Draws the draw and triangle of each pixel into a visibility buffer instead of shading the
+    // fragments, and shades the pixels in a compute pass after, so that shading costs the same
+    // however much the triangles overdraw. Replaces the depth pre-pass. Not in stereo. Must be
+    // called before Init.
+    void SetVisibilityBuffer(bool enabled);
+    // Lights the fragments indirectly too, with a grid of irradiance probes over the sub scene
+    // that trace a few rays against an acceleration structure of it every frame, so that the
+    // light bouncing off the surfaces (and their emission) reaches those around them. Needs ray
+    // queries. Not with geometry streaming, as the acceleration structures need all meshes.
+    // Renderers sharing a scene must all enable it. Must be called before Init.
+    void SetProbeGI(bool enabled);
+    // Shades smooth regions at coarser rates (VK_KHR_fragment_shading_rate), from a shading
+    // rate image of the luminance gradients of the previous frame. Where the device has
+    // primitive shading rates, each draw also caps its rate by its material. Not with the
+    // visibility buffer, whose pixels are shaded in a compute pass, nor in stereo. Must be called
+    // before Init.
+    void SetVariableRateShading(bool enabled);
 
 private:
+    static constexpr std::size_t CullGroupSize = 64;  // local_size_x of cull.comp
+    static constexpr std::size_t BatchGroupSize = 64; // local_size_x of batch.comp
+    static constexpr u32 HiZGroupSize = 8;           // local_size_x/y of hiz.comp
+    static constexpr u32 LightClusterGroupSize = 64; // local_size_x of light_cluster.comp
+    static constexpr u32 ShadeGroupSize = 8;         // local_size_x/y of shade.comp
+    static constexpr u32 ShadingRateGroupSize = 8;   // local_size_x/y of shading_rate.comp
+    // Pixels along each side of a texel of the shading rate image, clamped to what the device
+    // supports (at least ShadingRateGroupSize)
+    static constexpr u32 ShadingRateTileSize = 16;
+    // Of probe GI. Each frame updates this many probes, one group of probe_trace.comp and
+    // probe_blend.comp each.
+    static constexpr u32 MaxProbes = 8192;
+    static constexpr u32 MaxProbesPerAxis = 32;
+    static constexpr u32 ProbesPerFrame = 256;
+    // The draws visible last frame are drawn first, then the rest that pass the occlusion test
+    // against the Hi-Z pyramid of the first phase, each with its own counts and commands.
+    static constexpr std::size_t NumPhases = 2;
+    static constexpr std::size_t MaxDrawPasses = 3;
+    static constexpr float LODErrorPixels = 1.0f;
+    // Fewer draw groups per worker are recorded faster on the render thread
+    static constexpr std::size_t MinGroupsPerRecorder = 64;
+
     OffscreenImageInfo GetOffscreenImageInfo() const override;
-    std::unique_ptr<VulkanDevice> CreateDevice(vk::SurfaceKHR surface,
-                                               const vk::Extent2D& actual_extent) const override;
+    bool SupportsStereo() const override;
+    DeviceRequirements GetDeviceRequirements() const override;
+    GeometryRequirements GetGeometryRequirements(const VulkanDevice& device) const override;
+    void OnSceneUpdated(const SceneChanges& changes) override;
+    void OnSceneShared() override;
+    // The GPU copies of the loaded scene, the draws of the current sub scene and the pipelines
+    void CreateSceneResources();
+    void UploadMaterials();
+    // The PrimitiveInfos of all primitives of the scene, for pulling their vertices
+    void UploadPrimitives();
+    void BuildDrawList();
     void CreateDepthResources();
+    // With the visibility buffer, of the size of the swap chain
+    void CreateVisibilityResources();
+    // With variable rate shading, of the size of the render targets
+    void CreateShadingRateResources();
+    // In stereo, of the size of an eye
+    void CreateStereoResources();
+    // With probe GI, one BLAS per mesh of the scene
+    void BuildProbeBLASes();
+    // The TLAS of the sub scene and its grid of probes, which start out unlit. Also binds the
+    // probes without probe GI, as a single unused one. After BuildDrawList.
+    void CreateProbeResources();
     void CreateFramebuffers();
 
     vk::Format depth_format{};
+    std::size_t depth_render_target_slot{};
     std::unique_ptr<VulkanImage> depth_image{};
     vk::raii::ImageView depth_image_view = nullptr;
+    bool depth_prepass{};
+    bool visibility_buffer{};
+    bool generate_lods{};
+    vk::DeviceSize geometry_budget{};
+    bool probe_gi{};
+
+    // Max depth pyramid of the render area, from half its size down to 1x1
+    std::unique_ptr<VulkanImage> hiz_image;
+    vk::raii::ImageView hiz_view = nullptr;
+    std::vector<vk::raii::ImageView> hiz_level_views;
+    std::vector<vk::Extent2D> hiz_extents;
+    // One per level, sampling the previous one (or the depth) and storing to it
+    std::unique_ptr<VulkanDescriptorSets> hiz_descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> hiz_pipeline;
+
+    // The draw plus 1 (0 is nothing drawn) and triangle of each pixel, R32G32_UINT. Drawn into in
+    // place of the offscreen images, which shade.comp writes instead.
+    std::unique_ptr<VulkanImage> visibility_image;
+    vk::raii::ImageView visibility_image_view = nullptr;
+    // Per frame in flight. Binding 0 is the visibility buffer, 1 the offscreen image.
+    std::unique_ptr<VulkanDescriptorSets> shade_descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> shade_pipeline;
 
-    std::vector<std::unique_ptr<VulkanImmUploadBuffer>> materials;
-    std::unique_ptr<VulkanDescriptorSets> descriptor_sets;
+    // In stereo, the eyes are drawn into its layers in place of the offscreen images, and then
+    // copied side by side into them
+    std::unique_ptr<VulkanImage> stereo_image;
+    vk::raii::ImageView stereo_image_view = nullptr;
 
+    bool variable_rate_shading{};
+    bool material_shading_rates{}; // Whether the draws set primitive shading rates too
+    // One R8_UINT texel per tile of the render area, written by shading_rate.comp and attached
+    // to the render passes that shade
+    vk::Extent2D shading_rate_tile{};
+    std::unique_ptr<VulkanImage> shading_rate_image;
+    vk::raii::ImageView shading_rate_image_view = nullptr;
+    // Per frame in flight. Binding 0 is the offscreen image of the previous frame, 1 the shading
+    // rate image.
+    std::unique_ptr<VulkanDescriptorSets> shading_rate_descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> shading_rate_pipeline;
+    // Of the previous frame, empty if its offscreen image is not valid (e.g. after resizing)
+    vk::Extent2D last_render_extent{};
+
+    std::unique_ptr<VulkanImmUploadBuffer> materials_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> primitives_buffer; // GLSL::PrimitiveInfo
+    std::unordered_map<const MeshPrimitive*, u32> primitive_indices; // In the primitives buffer
+    // Binding 0 is the materials, binding 1 the scene textures, binding 2 the primitives
+    std::unique_ptr<VulkanDescriptorSets> descriptor_set;
+
+    // The *_load ones continue from an earlier pass of the frame
     vk::raii::RenderPass render_pass = nullptr;
+    vk::raii::RenderPass render_pass_load = nullptr;
+    vk::raii::RenderPass depth_render_pass = nullptr;
+    vk::raii::RenderPass depth_render_pass_load = nullptr;
+    vk::raii::Framebuffer depth_framebuffer = nullptr;
     struct Frame {
         vk::raii::Framebuffer framebuffer = nullptr;
+        // Indices of the draws of the instances in the frustum, written by the CPU
+        std::unique_ptr<VulkanBuffer> visible_draws;
+        // Written by the culling pass, indexed like the batches. The instances of each are the
+        // indices of its visible draws.
+        std::unique_ptr<VulkanBuffer> batch_counts;
+        std::unique_ptr<VulkanBuffer> batch_instances;
+        // Written from the batches, indexed like the draw groups and the batches
+        std::unique_ptr<VulkanBuffer> draw_counts;
+        std::unique_ptr<VulkanBuffer> draw_commands;
+        // Lights of each cluster of the view frustum, written by the light clustering pass
+        std::unique_ptr<VulkanBuffer> light_clusters;
+        // One per worker, or one without a pool, for recording the draw groups in parallel.
+        // Pool i records i * MaxDrawPasses + pass.
+        std::vector<vk::raii::CommandPool> command_pools;
+        std::vector<vk::raii::CommandBuffer> secondary_command_buffers;
+        // Recorded ones, 0 if they have been invalidated
+        std::size_t num_draw_command_buffers{};
+        vk::Extent2D draw_commands_extent{};
+        u32 draw_commands_uniforms_offset{};
+    };
+    std::unique_ptr<VulkanFramesInFlight<Frame>> frames;
+
+    // Render pass drawing the commands of [phase, phase + num_phases)
+    struct DrawPass {
+        const VulkanGraphicsPipeline* pipeline{};
+        vk::RenderPass render_pass{};
+        bool depth_only{}; // Draws into depth_framebuffer
+        u32 phase{};
+        u32 num_phases = 1;
+    };
+    std::vector<DrawPass> draw_passes; // The first one is drawn before building the Hi-Z
+
+    // Records the draw groups in [begin, end), which may run on a worker thread
+    void RecordDrawGroups(const vk::raii::CommandBuffer& cmd, const FrameInFlight<Frame>& frame,
+                          const DrawPass& pass, u32 uniforms_offset, std::size_t begin,
+                          std::size_t end) const;
+    // Nothing in the draw commands depends on the camera or changes every frame, so they are
+    // recorded once per frame in flight and reused until invalidated.
+    void RecordDrawCommands(FrameInFlight<Frame>& frame, u32 uniforms_offset,
+                            const vk::Extent2D& render_extent);
+    // When the draw list, the extent or a descriptor the commands bind has changed
+    void InvalidateDrawCommands();
+
+    // Draws of the current sub scene, one per primitive of each instance. The draws of a
+    // primitive that use the same level of detail are batched into one instanced command, and
+    // a group is drawn with one indirect draw of these commands, as its primitives share their
+    // index buffer. Sorted by it, and only rebuilt when the sub scene or its transforms change.
+    struct DrawGroup {
+        const MeshPrimitive* primitive{}; // Any of the group
+        u32 first_command{};              // Its batches are contiguous
+        u32 num_batches{};
     };
-    std::unique_ptr<VulkanFramesInFlight<Frame, 2>> frames;
+    std::vector<DrawGroup> draw_groups;
+    std::size_t num_draws{};
+    std::size_t num_batches{};
+    std::size_t num_batch_instances{}; // Per phase
+    // Draws of instance i are instance_draws[instance_first_draws[i]..instance_first_draws[i+1]]
+    std::vector<u32> instance_first_draws;
+    std::vector<u32> instance_draws;
+    std::unique_ptr<VulkanImmUploadBuffer> draws_buffer; // GLSL::DrawInfo
+    std::unique_ptr<VulkanImmUploadBuffer> transforms_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> bounds_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> batches_buffer; // GLSL::DrawBatch
+    std::unique_ptr<VulkanImmUploadBuffer> lights_buffer;  // GLSL::PunctualLight
+
+    // The uniforms are read at a dynamic offset
+    std::unique_ptr<VulkanFrameAllocator> frame_allocator;
+    // Per frame in flight. Binding 0 is the uniforms, 1 the draws, 2 the instance transforms,
+    // 3 the instance bounds, 4 the draw counts, 5 the draw commands, 6 the visible draws, 7 the
+    // draw visibility, 8 the Hi-Z pyramid, 9 the batches, 10 the batch counts, 11 the batch
+    // instances, 12 the punctual lights, 13 the light clusters and 14 the probes.
+    std::unique_ptr<VulkanDescriptorSets> draw_descriptor_set;
+    std::unique_ptr<VulkanComputePipeline> cull_pipeline;
+    std::unique_ptr<VulkanComputePipeline> batch_pipeline;
+    std::unique_ptr<VulkanComputePipeline> light_cluster_pipeline;
     std::unique_ptr<VulkanGraphicsPipeline> pipeline;
+    std::unique_ptr<VulkanGraphicsPipeline> depth_pipeline; // With the depth pre-pass
+    // Whether each draw passed the occlusion test last frame, shared by the frames in flight
+    std::unique_ptr<VulkanBuffer> draw_visibility;
+    bool clear_draw_visibility{}; // After it has been recreated
+
+    // Of probe GI. The instances of the TLAS are those of the sub scene that have BLASes (those
+    // whose meshes have primitives), with their first draws as their custom indices.
+    std::vector<std::unique_ptr<VulkanAccelStructure>> probe_blases; // Indexed like the meshes
+    std::unique_ptr<VulkanAccelStructure> probe_tlas;
+    glm::vec3 probe_origin{};
+    float probe_spacing{};
+    glm::uvec3 probe_grid{};
+    u32 num_probes{};
+    u32 next_probe{}; // The first of those updated next frame
+    bool clear_probes{}; // After they have been recreated
+    std::mt19937 probe_random; // Of the rotations of the rays
+    // PROBE_VEC4S per probe, and the result of each ray of the probes updated in a frame
+    std::unique_ptr<VulkanBuffer> probes_buffer;
+    std::unique_ptr<VulkanBuffer> probe_rays_buffer;
+    // Binding 0 is the TLAS, 1 the probes, 2 the probe rays
+    std::unique_ptr<VulkanDescriptorSets> probe_descriptor_set;
+    std::unique_ptr<VulkanComputePipeline> probe_trace_pipeline;
+    std::unique_ptr<VulkanComputePipeline> probe_blend_pipeline;
+
+    // Reused across frames, for culling against the instance BVH
+    std::vector<u32> visible_instances;
 };
 
 } // namespace Renderer
@@ -2,46 +2,140 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cmath>
+#include <cstring>
+#include <exception>
 #include <map>
+#include <numbers>
+#include <numeric>
 #include <ranges>
+#include <tuple>
 #include <type_traits>
-#include <unordered_map>
-#include <boost/pfr.hpp>
+#include <unordered_set>
+#include <fmt/format.h>
+#include <fmt/ranges.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
-#include <glm/gtx/hash.hpp>
+#include <glm/packing.hpp>
 #include <libbase64.h>
-#include <mikktspace/mikktspace.h>
 #include <spdlog/spdlog.h>
+#include <vulkan/vulkan_format_traits.hpp>
+#include "common/alignment.h"
 #include "common/assert.h"
+#include "common/index_conversion.h"
+#include "common/jpeg.h"
+#include "common/log.h"
+#include "common/mesh_simplify.h"
+#include "common/meshlet_builder.h"
+#include "common/process_memory.h"
+#include "common/profiling.h"
 #include "common/ranges.h"
+#include "common/remote_file.h"
 #include "common/scope_exit.h"
 #include "common/swap.h"
+#include "common/thread_pool.h"
+#include "common/vertex_cache.h"
+#include "common/vertex_weld.h"
+#include "core/gltf/accessor_decoder.h"
+#include "core/gltf/draco_codec.h"
 #include "core/gltf/gltf_container.h"
 #include "core/gltf/json_helpers.hpp"
+#include "core/gltf/meshopt_codec.h"
+#include "core/instance_bvh.h"
+#include "core/lazy_texture_loader.h"
+#include "core/load_profiler.h"
+#include "core/mikkt.h"
 #include "core/scene.h"
+#include "core/scene_cache.h"
+#include "core/texture_compression.h"
+#include "core/vulkan/vulkan_allocator.h"
 #include "core/vulkan/vulkan_buffer.h"
 #include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_geometry_heap.h"
+#include "core/vulkan/vulkan_geometry_streamer.h"
+#include "core/vulkan/vulkan_host_cache.h"
+#include "core/vulkan/vulkan_opacity_micromap.h"
+#include "core/vulkan/vulkan_tangent_generator.h"
 #include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_texture_streamer.h"
+#include "core/vulkan/vulkan_upload_ring.h"
 
 namespace Renderer {
 
-BufferFile::BufferFile(const std::string_view& uri) {
-    Load(uri);
+BufferFile::BufferFile(const std::string_view& uri, std::string_view base_uri) {
+    Load(uri, base_uri);
 }
 BufferFile::BufferFile(SceneLoader& loader, const GLTF::Buffer& buffer) {
+    const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                            LoadProfiler::Stage::BufferIO, buffer.byte_length};
     if (buffer.uri.has_value()) {
-        Load(*buffer.uri);
-    } else if (loader.container.extra_buffer_file.has_value()) {
-        // There should only be one such buffer
-        file = std::move(loader.container.extra_buffer_file);
-        offset = loader.container.extra_buffer_offset;
+        Load(*buffer.uri, loader.container.uri);
+    } else if (loader.container.remote_buffer_size.has_value()) {
+        remote_file = loader.container.remote_file;
+        remote_offset = loader.container.remote_buffer_offset;
+        remote_size = *loader.container.remote_buffer_size;
+    } else if (loader.container.extra_buffer.has_value()) {
+        // There should only be one such buffer. The container keeps the mapping alive.
+        contents = *loader.container.extra_buffer;
+        // Geometry is written directly from the mapping when device memory is host visible
+        if (!contents.empty() && !loader.device.resizable_bar) {
+            // Read the whole chunk at once rather than in small scattered pieces per accessor
+            device = &loader.device;
+            staging_buffer = std::make_unique<VulkanBuffer>(
+                *device->allocator,
+                vk::BufferCreateInfo{
+                    .size = contents.size(),
+                    .usage = vk::BufferUsageFlagBits::eTransferSrc,
+                },
+                VmaAllocationCreateInfo{
+                    .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                             VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                    .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                },
+                MemoryCategory::Scratch);
+            staging_buffer->SetName("GLB binary chunk staging");
+            std::memcpy(staging_buffer->allocation_info.pMappedData, contents.data(),
+                        contents.size());
+            vmaFlushAllocation(**device->allocator, staging_buffer->allocation, 0, VK_WHOLE_SIZE);
+        }
     } else {
         SPDLOG_ERROR("No URI but no GLB buffer either");
         throw std::runtime_error("No URI but no GLB buffer either");
     }
 }
-BufferFile::~BufferFile() = default;
+
+BufferFile::BufferFile(SceneLoader& loader, const GLTF::BufferView& buffer_view)
+    : data(&loader.temp_memory) {
+    ASSERT(buffer_view.extensions.has_value() &&
+           buffer_view.extensions->meshopt_compression.has_value());
+    const auto& compression = *buffer_view.extensions->meshopt_compression;
+
+    const auto& buffer_file = *loader.buffer_files.Get(loader, compression.buffer);
+    const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                            LoadProfiler::Stage::BufferIO, compression.byte_length};
+    const std::size_t count = compression.count;
+    const std::size_t byte_stride = compression.byte_stride;
+    data.resize(count * byte_stride);
+    GLTF::Meshopt::Decode(data, count, byte_stride,
+                          buffer_file.GetSpan(compression.byte_offset, compression.byte_length),
+                          GLTF::Meshopt::ParseMode(compression.mode),
+                          GLTF::Meshopt::ParseFilter(compression.filter));
+    if (data.size() < buffer_view.byte_length) {
+        SPDLOG_ERROR("Decoded buffer view has size {}, expected {}", data.size(),
+                     static_cast<std::size_t>(buffer_view.byte_length));
+        throw std::runtime_error("Decoded buffer view is too small");
+    }
+    contents = data;
+}
+
+BufferFile::~BufferFile() {
+    if (staging_buffer) { // Copies may still be pending
+        device->upload_ring->Wait(device->upload_ring->Flush());
+    }
+}
 
 static constexpr int HexCharToInt(char c) {
     if ('0' <= c && c <= '9') {
@@ -55,8 +149,13 @@ static constexpr int HexCharToInt(char c) {
     throw std::runtime_error("Invalid hex char");
 }
 
-void BufferFile::Load(const std::string_view& uri) {
-    if (uri.starts_with("data:")) {
+void BufferFile::Load(const std::string_view& uri, std::string_view base_uri) {
+    if (!uri.starts_with("data:") && (!base_uri.empty() || Common::IsRemoteURI(uri))) {
+        // Kept percent-encoded, as requested
+        remote_file = std::make_shared<const Common::RemoteFile>(
+            base_uri.empty() ? std::string{uri} : Common::ResolveRemoteURI(base_uri, uri));
+        remote_size = remote_file->size();
+    } else if (uri.starts_with("data:")) {
         // Skip past the MIME type.
         // For safety we cannot directly search for commas because the MIME type may contain them
         bool quoted = false;
@@ -77,15 +176,21 @@ void BufferFile::Load(const std::string_view& uri) {
             throw std::runtime_error("Could not find data delimiter");
         }
 
-        const auto src_len = uri.size() - i;
-        if (src_len % 4 != 0) {
+        base64 = uri.substr(i);
+        if (base64.size() % 4 != 0) {
             SPDLOG_ERROR("Base64 input size is incorrect {}", uri);
             throw std::runtime_error("Base64 input size is incorrect");
         }
-        data.resize(src_len / 4 * 3);
-
-        base64_decode(uri.data() + i, src_len, reinterpret_cast<char*>(data.data()), &file_size, 0);
-        data.resize(file_size);
+        base64_size = base64.size() / 4 * 3;
+        if (base64.ends_with("==")) {
+            base64_size -= 2;
+        } else if (base64.ends_with('=')) {
+            base64_size -= 1;
+        }
+        // Decoded on demand, see GetSpan and Upload
+        base64_decoded.reset(new u8[base64_size]);
+        base64_blocks =
+            std::make_unique<std::once_flag[]>(Common::DivideCeil(base64_size, Base64BlockSize));
     } else {
         // Un-percent-encode the uri
         std::vector<char> decoded_str(uri.size() + 1);
@@ -107,41 +212,108 @@ void BufferFile::Load(const std::string_view& uri) {
             ++j;
         }
 
-        // Open file
-        file = std::ifstream(std::filesystem::u8path(decoded_str.data()),
-                             std::ios::ate | std::ios::binary);
-        if (!*file) {
-            SPDLOG_ERROR("Failed to open file {}", decoded_str.data());
-            throw std::runtime_error("Failed to open file");
-        }
-        file_size = file->tellg();
-        file->seekg(0);
+        mapped_file =
+            std::make_unique<Common::MappedFile>(std::filesystem::u8path(decoded_str.data()));
+        contents = mapped_file->GetSpan();
     }
 }
 
-void BufferFile::Read(void* out, std::size_t size) {
-    if (file) {
-        file->read(reinterpret_cast<char*>(out), size);
-        if (!*file) {
-            SPDLOG_ERROR("Failed to read from file");
-            throw std::runtime_error("Failed to read from file");
-        }
-    } else {
-        std::memcpy(out, data.data() + pos, size);
-        pos += size;
+std::size_t BufferFile::GetSize() const noexcept {
+    if (remote_file) {
+        return remote_size;
     }
+    return base64.empty() ? contents.size() : base64_size;
 }
 
-void BufferFile::Seek(std::size_t new_pos) {
-    if (file) {
-        file->seekg(offset + new_pos);
-        if (!*file) {
-            SPDLOG_ERROR("Failed to seek file");
-            throw std::runtime_error("Failed to seek file");
+void BufferFile::CheckRange(std::size_t offset, std::size_t size) const {
+    if (offset > GetSize() || size > GetSize() - offset) {
+        SPDLOG_ERROR("Range [{}, {}) out of bounds (size {})", offset, offset + size, GetSize());
+        throw std::runtime_error("Buffer range out of bounds");
+    }
+}
+
+void BufferFile::DecodeBase64(std::size_t offset, std::size_t size, u8* out) const {
+    // Every group of 4 characters decodes to 3 bytes, independently of the others
+    const auto decode = [this](std::size_t first_group, std::size_t num_groups, u8* dst) {
+        std::size_t decoded_size{};
+        if (base64_decode(base64.data() + first_group * 4, num_groups * 4,
+                          reinterpret_cast<char*>(dst), &decoded_size, 0) != 1) {
+            SPDLOG_ERROR("Invalid base64 data");
+            throw std::runtime_error("Invalid base64 data");
         }
-    } else {
-        pos = offset + new_pos;
+    };
+
+    const std::size_t end = offset + size;
+    if (offset % 3 != 0 && offset < end) { // Partial first group
+        std::array<u8, 3> group;
+        decode(offset / 3, 1, group.data());
+        const std::size_t count = std::min(3 - offset % 3, end - offset);
+        std::memcpy(out, group.data() + offset % 3, count);
+        out += count;
+        offset += count;
+    }
+    if (const std::size_t num_groups = (end - offset) / 3; num_groups > 0) {
+        decode(offset / 3, num_groups, out);
+        out += num_groups * 3;
+        offset += num_groups * 3;
+    }
+    if (offset < end) { // Partial last group
+        std::array<u8, 3> group;
+        decode(offset / 3, 1, group.data());
+        std::memcpy(out, group.data(), end - offset);
+    }
+}
+
+void BufferFile::Prefetch(std::size_t offset, std::size_t size) const {
+    CheckRange(offset, size);
+    if (base64.empty() && !remote_file) {
+        Common::PrefetchMemory(contents.subspan(offset, size));
+    }
+}
+
+std::span<const u8> BufferFile::GetSpan(std::size_t offset, std::size_t size) const {
+    CheckRange(offset, size);
+    if (remote_file) {
+        return remote_file->GetSpan(remote_offset + offset, size);
+    }
+    if (base64.empty()) {
+        return contents.subspan(offset, size);
+    }
+    if (size == 0) {
+        return {};
+    }
+    for (std::size_t block = offset / Base64BlockSize;
+         block < Common::DivideCeil(offset + size, Base64BlockSize); ++block) {
+        std::call_once(base64_blocks[block], [this, block] {
+            const std::size_t block_offset = block * Base64BlockSize;
+            DecodeBase64(block_offset, std::min(Base64BlockSize, base64_size - block_offset),
+                         base64_decoded.get() + block_offset);
+        });
+    }
+    return {base64_decoded.get() + offset, size};
+}
+
+std::shared_ptr<VulkanGeometryBuffer> BufferFile::Upload(VulkanGeometryHeap& heap,
+                                                         std::size_t offset,
+                                                         std::size_t size) const {
+    if (!base64.empty()) {
+        // Decode into the staging memory, leaving the blocks for the CPU-side accessors
+        CheckRange(offset, size);
+        return heap.Upload(size, [this, &offset](void* out, std::size_t chunk_size) {
+            DecodeBase64(offset, chunk_size, static_cast<u8*>(out));
+            offset += chunk_size;
+        });
     }
+    const auto src = GetSpan(offset, size);
+    if (staging_buffer) {
+        return heap.Copy(*staging_buffer, offset, src.size());
+    }
+    return heap.Upload(src);
+}
+
+// Accessors the loader maps are given are those of its glTF
+static std::size_t GetAccessorIndex(const SceneLoader& loader, const GLTF::Accessor& accessor) {
+    return static_cast<std::size_t>(&accessor - loader.gltf.accessors.data());
 }
 
 IndexBufferAccessor::IndexBufferAccessor() = default;
@@ -157,35 +329,56 @@ IndexBufferAccessor::IndexBufferAccessor(SceneLoader& loader, const GLTF::Access
         throw std::runtime_error("Index buffer has no buffer view");
     }
 
+    if (const auto accessor_idx = GetAccessorIndex(loader, accessor);
+        loader.OptimizesIndices(accessor_idx)) {
+        // Reordering keeps the values, so they still fit in the component type
+        const auto& indices = loader.optimized_indices.Get(loader, accessor_idx)->indices;
+        count = indices.size();
+        std::vector<u8> data;
+        if (component_type == GLTF::Accessor::ComponentType::UnsignedInt) {
+            data.resize(count * sizeof(u32_le));
+            Common::CopyToLE(std::span{reinterpret_cast<u32_le*>(data.data()), count}, indices);
+        } else {
+            component_type = GLTF::Accessor::ComponentType::UnsignedShort;
+            data.resize(count * sizeof(u16_le));
+            for (std::size_t i = 0; i < count; ++i) {
+                const u16_le index = static_cast<u16>(indices[i]);
+                std::memcpy(data.data() + i * sizeof(u16_le), &index, sizeof(u16_le));
+            }
+        }
+        const auto key =
+            SceneCache::Hasher{"optimized_index_data"}.AddValue(component_type).Add(data).Get();
+        gpu_buffer = loader.UploadUnique(
+            key, [&loader, &data] { return loader.scene.index_heap->Upload(data); });
+        return;
+    }
+
     const auto total_size = GetTotalSize(accessor);
 
     const auto& buffer_view = loader.gltf.buffer_views[*accessor.buffer_view];
-    auto& buffer_file = *loader.buffer_files.Get(loader, buffer_view.buffer);
-    buffer_file.Seek(buffer_view.byte_offset + accessor.byte_offset);
+    const auto& [buffer_file, view_offset] = loader.GetBufferViewData(buffer_view);
+    const auto offset = view_offset + accessor.byte_offset;
+    const auto src = buffer_file.GetSpan(offset, total_size);
+    // Accessors of the same indices share them
+    const auto key = SceneCache::Hasher{"index_data"}.AddValue(component_type).Add(src).Get();
 
     if (component_type == GLTF::Accessor::ComponentType::UnsignedByte) {
         component_type = GLTF::Accessor::ComponentType::UnsignedShort;
-        // Convert into u16 as we upload it
-        gpu_buffer = std::make_shared<VulkanImmUploadBuffer>(
-            loader.device,
-            VulkanBufferCreateInfo{total_size * 2, loader.index_buffer_params.usage,
-                                   loader.index_buffer_params.dst_stage_mask,
-                                   loader.index_buffer_params.dst_access_mask},
-            [&buffer_file](void* data, std::size_t size) {
-                std::vector<u8> temp_data(size);
-                buffer_file.Read(temp_data.data(), size);
-                for (std::size_t i = 0; i < size; ++i) {
-                    *(reinterpret_cast<u16_le*>(data) + i) = temp_data[i];
-                }
-            });
+        gpu_buffer = loader.UploadUnique(key, [&loader, src, total_size] {
+            // Convert into u16 as we upload it
+            std::size_t pos = 0;
+            return loader.scene.index_heap->Upload(
+                total_size * 2, [src, &pos](void* data, std::size_t size) {
+                    const std::size_t count = size / sizeof(u16);
+                    Common::WidenIndicesU8ToU16(src.subspan(pos, count), data);
+                    pos += count;
+                });
+        });
     } else {
         GetIndexType(component_type); // Make sure we have an index type
-        gpu_buffer = std::make_shared<VulkanImmUploadBuffer>(
-            loader.device,
-            VulkanBufferCreateInfo{total_size, loader.index_buffer_params.usage,
-                                   loader.index_buffer_params.dst_stage_mask,
-                                   loader.index_buffer_params.dst_access_mask},
-            [&buffer_file](void* data, std::size_t size) { buffer_file.Read(data, size); });
+        gpu_buffer = loader.UploadUnique(key, [&loader, &buffer_file, offset, total_size] {
+            return buffer_file.Upload(*loader.scene.index_heap, offset, total_size);
+        });
     }
 }
 
@@ -207,41 +400,33 @@ void VertexBufferView::AddAccessor(const GLTF::Accessor& accessor) {
 }
 
 void VertexBufferView::Load(SceneLoader& loader) {
-    if (!buffers.empty()) {
-        return;
-    }
+    std::call_once(load_flag, [this, &loader] { LoadImpl(loader); });
+}
 
-    auto& buffer_file = *loader.buffer_files.Get(loader, buffer_view.buffer);
+void VertexBufferView::LoadImpl(SceneLoader& loader) {
+    const auto& [buffer_file, view_offset] = loader.GetBufferViewData(buffer_view);
+    // Views of the same vertices share them
+    const auto Upload = [&loader, &buffer_file](std::size_t offset, std::size_t size) {
+        const auto key =
+            SceneCache::Hasher{"vertex_data"}.Add(buffer_file.GetSpan(offset, size)).Get();
+        return loader.UploadUnique(key, [&loader, &buffer_file, offset, size] {
+            return buffer_file.Upload(*loader.scene.vertex_heap, offset, size);
+        });
+    };
     if (buffer_view.byte_stride.has_value()) {
         const auto byte_stride = *buffer_view.byte_stride;
         for (const auto& chunk : chunks) {
-            buffer_file.Seek(buffer_view.byte_offset + chunk.lower() * byte_stride);
-            buffers.emplace(chunk.lower(),
-                            std::make_shared<VulkanImmUploadBuffer>(
-                                loader.device,
-                                VulkanBufferCreateInfo{
-                                    .size = (chunk.upper() - chunk.lower()) * byte_stride,
-                                    .usage = loader.vertex_buffer_params.usage,
-                                    .dst_stage_mask = loader.vertex_buffer_params.dst_stage_mask,
-                                    .dst_access_mask = loader.vertex_buffer_params.dst_access_mask,
-                                },
-                                [&buffer_file](void* data, std::size_t size) {
-                                    buffer_file.Read(data, size);
-                                }));
+            // The last element may not be padded to the full stride
+            const auto size = std::min((chunk.upper() - chunk.lower()) * byte_stride,
+                                       buffer_view.byte_length - chunk.lower() * byte_stride);
+            const auto offset = view_offset + chunk.lower() * byte_stride;
+            buffers.emplace(chunk.lower(), Upload(offset, size));
         }
     } else {
         ASSERT(non_strided_accessor);
 
-        buffer_file.Seek(buffer_view.byte_offset + non_strided_accessor->byte_offset);
-        non_strided_buffer = std::make_shared<VulkanImmUploadBuffer>(
-            loader.device,
-            VulkanBufferCreateInfo{
-                .size = GetTotalSize(*non_strided_accessor),
-                .usage = loader.vertex_buffer_params.usage,
-                .dst_stage_mask = loader.vertex_buffer_params.dst_stage_mask,
-                .dst_access_mask = loader.vertex_buffer_params.dst_access_mask,
-            },
-            [&buffer_file](void* data, std::size_t size) { buffer_file.Read(data, size); });
+        const auto size = GetTotalSize(*non_strided_accessor);
+        non_strided_buffer = Upload(view_offset + non_strided_accessor->byte_offset, size);
     }
 }
 
@@ -268,51 +453,588 @@ VertexBufferView::BufferInfo VertexBufferView::GetAccessorBufferInfo(
     }
 }
 
-Sampler::Sampler(const SceneLoader& loader, const GLTF::Sampler& sampler)
-    : name(sampler.name.value_or("Unnamed")), uses_mipmaps(IsMipmapUsed(sampler.min_filter)),
-      sampler{*loader.device,
-              vk::SamplerCreateInfo{
-                  .magFilter = ToVkFilter(sampler.mag_filter),
-                  .minFilter = ToVkFilter(sampler.min_filter),
-                  .mipmapMode = GetMipmapMode(sampler.min_filter),
-                  .addressModeU = ToAddressMode(sampler.wrapS),
-                  .addressModeV = ToAddressMode(sampler.wrapT),
-                  .mipLodBias = 0.0f,
-                  .anisotropyEnable = VK_TRUE,
-                  .maxAnisotropy =
-                      loader.device.physical_device.getProperties().limits.maxSamplerAnisotropy,
-                  .minLod = 0.0f,
-                  .maxLod = 0.0f,
-                  .borderColor = vk::BorderColor::eIntOpaqueBlack,
-              }} {}
+static vk::SamplerCreateInfo GetSamplerCreateInfo(const SceneLoader& loader,
+                                                  const GLTF::Sampler& sampler) {
+    return {
+        .magFilter = ToVkFilter(sampler.mag_filter),
+        .minFilter = ToVkFilter(sampler.min_filter),
+        .mipmapMode = GetMipmapMode(sampler.min_filter),
+        .addressModeU = ToAddressMode(sampler.wrapS),
+        .addressModeV = ToAddressMode(sampler.wrapT),
+        .mipLodBias = 0.0f,
+        .anisotropyEnable = VK_TRUE,
+        .maxAnisotropy = loader.device.physical_device.getProperties().limits.maxSamplerAnisotropy,
+        .minLod = 0.0f,
+        // Streamed textures are sampled from coarser levels until the finer ones arrive, even
+        // with filters that would not use them
+        .maxLod = IsMipmapUsed(sampler.min_filter) || loader.scene.texture_streamer->IsEnabled()
+                      ? VK_LOD_CLAMP_NONE
+                      : 0.0f,
+        .borderColor = vk::BorderColor::eIntOpaqueBlack,
+    };
+}
+
+Sampler::Sampler(const SceneLoader& loader, const GLTF::Sampler& sampler_)
+    : name(sampler_.name.value_or("Unnamed")), uses_mipmaps(IsMipmapUsed(sampler_.min_filter)),
+      create_info(GetSamplerCreateInfo(loader, sampler_)),
+      sampler{*loader.device, create_info} {}
 
 Sampler::~Sampler() = default;
 
-Image::Image(SceneLoader& loader, const GLTF::Image& image) : name(image.name.value_or("Unnamed")) {
+namespace {
+
+struct CachedTextureHeader {
+    u32 width;
+    u32 height;
+    u32 num_levels;
+    vk::Format format;
+    vk::ComponentMapping components;
+};
+
+// The format an image is stored in on the GPU
+enum class ImageEncoding : u32 {
+    RGBA8Srgb,
+    RGBA8Unorm,
+    BC4,                  // Occlusion (R)
+    BC5,                  // Normals (RG)
+    BC5MetallicRoughness, // GB
+    BC7Srgb,
+    BC7Unorm,
+    // Uncompressed data images keep only the channels they need
+    R8,                   // Occlusion
+    RG8,                  // Normals
+    RG8MetallicRoughness, // GB
+};
+
+// What decoding an image needs from the loader, so that it can also run after loading.
+struct TextureDecodeContext {
+    const VulkanDevice& device;
+    std::shared_ptr<SceneCache> cache;
+    Common::ThreadPool* thread_pool{};
+    ImageEncoding encoding{};
+    bool streaming{}; // Streamed textures need all of their levels on the CPU
+    LoadProfiler* profiler{}; // Null once loading is done
+    u32 max_size{};       // See TextureQuality
+    u32 dropped_levels{};
+    bool gpu_image_decode{}; // See SceneLoader
+};
+
+} // namespace
+
+static ImageEncoding GetImageEncoding(const SceneLoader& loader, const ImageUsage& usage) {
+    const bool is_data = usage.normal || usage.occlusion || usage.metallic_roughness;
+    if (usage.color && is_data) {
+        SPDLOG_WARN("Image is used both as color and as data, it may look wrong");
+    }
+    // Images not referenced by any material are treated as colors
+    const bool srgb = usage.color || !is_data;
+    const bool compress = loader.compress_textures;
+    if (srgb) {
+        return compress ? ImageEncoding::BC7Srgb : ImageEncoding::RGBA8Srgb;
+    }
+    // Packed images (e.g. occlusion in R, metallic roughness in GB) need all channels
+    if (usage.normal + usage.occlusion + usage.metallic_roughness > 1) {
+        return compress ? ImageEncoding::BC7Unorm : ImageEncoding::RGBA8Unorm;
+    }
+    if (usage.normal) {
+        return compress ? ImageEncoding::BC5 : ImageEncoding::RG8;
+    }
+    if (usage.metallic_roughness) {
+        return compress ? ImageEncoding::BC5MetallicRoughness
+                        : ImageEncoding::RG8MetallicRoughness;
+    }
+    return compress ? ImageEncoding::BC4 : ImageEncoding::R8;
+}
+
+static bool IsCompressed(ImageEncoding encoding) {
+    return encoding != ImageEncoding::RGBA8Srgb && encoding != ImageEncoding::RGBA8Unorm &&
+           encoding != ImageEncoding::R8 && encoding != ImageEncoding::RG8 &&
+           encoding != ImageEncoding::RG8MetallicRoughness;
+}
+
+static void EncodeTexture(const TextureDecodeContext& context, DecodedTexture& texture) {
+    switch (context.encoding) {
+    case ImageEncoding::RGBA8Srgb:
+    case ImageEncoding::RGBA8Unorm:
+        break;
+    case ImageEncoding::BC4:
+        texture.Compress(BlockFormat::BC4, 0, context.thread_pool);
+        break;
+    case ImageEncoding::BC5:
+        texture.Compress(BlockFormat::BC5, 0, context.thread_pool);
+        break;
+    case ImageEncoding::BC5MetallicRoughness:
+        texture.Compress(BlockFormat::BC5, 1, context.thread_pool);
+        break;
+    case ImageEncoding::BC7Srgb:
+    case ImageEncoding::BC7Unorm:
+        texture.Compress(BlockFormat::BC7, 0, context.thread_pool);
+        break;
+    case ImageEncoding::R8:
+        texture.Pack(context.device, 1, 0);
+        break;
+    case ImageEncoding::RG8:
+        texture.Pack(context.device, 2, 0);
+        break;
+    case ImageEncoding::RG8MetallicRoughness:
+        texture.Pack(context.device, 2, 1);
+        break;
+    }
+}
+
+static std::unique_ptr<DecodedTexture> LoadCachedTexture(const SceneCache::Entry& entry,
+                                                         std::shared_ptr<const void> owner) {
+    if (entry.GetNumSections() < 2 || entry.GetSection(0).size() != sizeof(CachedTextureHeader)) {
+        return nullptr;
+    }
+    CachedTextureHeader header;
+    std::memcpy(&header, entry.GetSection(0).data(), sizeof(header));
+
+    std::vector<std::span<const u8>> levels;
+    for (std::size_t i = 1; i < entry.GetNumSections(); ++i) {
+        levels.emplace_back(entry.GetSection(i));
+    }
+    try {
+        return std::make_unique<DecodedTexture>(header.width, header.height, header.num_levels,
+                                                header.format, header.components, levels,
+                                                std::move(owner));
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+}
+
+// Decodes (and compresses) the image file, or maps the result from the cache if it has been
+// processed before.
+static std::unique_ptr<DecodedTexture> DecodeTexture(const TextureDecodeContext& context,
+                                                     std::span<const u8> file_data) {
+    // The finest levels of the quality, and those larger than its max size
+    const auto DropLevels = [&context](DecodedTexture& decoded) {
+        u32 count = context.dropped_levels;
+        if (context.max_size != 0) {
+            while (count < 32 && (std::max(decoded.width, decoded.height) >> count) >
+                                     context.max_size) {
+                ++count;
+            }
+        }
+        decoded.DropLevels(count);
+    };
+    if (DecodedTexture::IsKTX2(file_data)) { // Nothing to decode, but Basis payloads to transcode
+        const LoadProfiler::Scope profile_scope{context.profiler, LoadProfiler::Stage::ImageDecode,
+                                                file_data.size()};
+        auto decoded = std::make_unique<DecodedTexture>(context.device, file_data);
+        DropLevels(*decoded);
+        return decoded;
+    }
+
+    const auto encoding = context.encoding;
+    const bool streaming = context.streaming;
+    auto* profiler = context.profiler;
+    const bool srgb = encoding == ImageEncoding::RGBA8Srgb || encoding == ImageEncoding::BC7Srgb;
+    const auto Decode = [&](bool gpu_decode) {
+        const LoadProfiler::Scope profile_scope{profiler, LoadProfiler::Stage::ImageDecode,
+                                                file_data.size()};
+        auto decoded = std::make_unique<DecodedTexture>(context.device, file_data, true, srgb,
+                                                        gpu_decode, profiler);
+        DropLevels(*decoded);
+        return decoded;
+    };
+
+    // JPEG files finished on the GPU are not cached, as mapping their pixels would take longer
+    std::unique_ptr<DecodedTexture> decoded;
+    if (context.gpu_image_decode && !streaming &&
+        (encoding == ImageEncoding::RGBA8Srgb || encoding == ImageEncoding::RGBA8Unorm) &&
+        Common::IsJPEG(file_data)) {
+        decoded = Decode(true);
+        if (decoded->jpeg) {
+            return decoded;
+        }
+    }
+
+    SceneCache::Hasher hasher{"texture"};
+    hasher.Add(file_data).AddValue(encoding).AddValue(streaming);
+    if (context.max_size != 0 || context.dropped_levels != 0) { // Keeps the keys of full quality
+        hasher.AddValue(context.max_size).AddValue(context.dropped_levels);
+    }
+    const auto key = hasher.Get();
+    if (!decoded) {
+        if (std::shared_ptr<const SceneCache::Entry> entry = context.cache->Load(key)) {
+            if (auto cached = LoadCachedTexture(*entry, entry)) {
+                return cached;
+            }
+            LOG_RATE_LIMITED(WARN, "Ignoring invalid cached texture");
+        }
+        decoded = Decode(false);
+    }
+    if (streaming && (decoded->format == vk::Format::eR8G8B8A8Srgb ||
+                      decoded->format == vk::Format::eR8G8B8A8Unorm)) {
+        const LoadProfiler::Scope profile_scope{profiler, LoadProfiler::Stage::MipGeneration};
+        decoded->GenerateMipmaps(); // Compress() generates them already
+    }
+    if (encoding != ImageEncoding::RGBA8Srgb && encoding != ImageEncoding::RGBA8Unorm) {
+        // Packing the channels of uncompressed images is cheap, and counted as decoding
+        const LoadProfiler::Scope profile_scope{profiler,
+                                                IsCompressed(encoding)
+                                                    ? LoadProfiler::Stage::TextureCompression
+                                                    : LoadProfiler::Stage::ImageDecode};
+        EncodeTexture(context, *decoded);
+    }
+    const CachedTextureHeader header{
+        .width = decoded->width,
+        .height = decoded->height,
+        .num_levels = decoded->num_levels,
+        .format = decoded->format,
+        .components = decoded->components,
+    };
+    std::vector<std::span<const u8>> sections{
+        {reinterpret_cast<const u8*>(&header), sizeof(header)}};
+    for (std::size_t i = 0; i < decoded->mip_levels.size(); ++i) {
+        sections.emplace_back(decoded->GetLevel(i));
+    }
+    context.cache->Store(key, sections);
+    if (streaming) {
+        // Map the levels from the cache instead of keeping them in memory
+        if (std::shared_ptr<const SceneCache::Entry> entry = context.cache->Load(key)) {
+            if (auto cached = LoadCachedTexture(*entry, entry)) {
+                return cached;
+            }
+        }
+    }
+    return decoded;
+}
+
+// Textures no larger than this on either side are put into arrays
+constexpr u32 MaxArrayTextureSize = 256;
+// The minimum of maxImageArrayLayers
+constexpr std::size_t MaxArrayLayers = 256;
+
+static void CreateTexture(SceneLoader& loader, Image& image,
+                          std::unique_ptr<DecodedTexture> decoded) {
+    auto& streamer = *loader.scene.texture_streamer;
+    if (streamer.CanStream(*decoded)) {
+        image.texture = streamer.AddTexture(std::move(decoded));
+        return;
+    }
+    if (decoded->width <= MaxArrayTextureSize && decoded->height <= MaxArrayTextureSize) {
+        std::scoped_lock lock{loader.array_textures_mutex};
+        loader.array_textures.emplace_back(&image, std::move(decoded));
+        return;
+    }
+    image.texture = std::make_unique<VulkanTexture>(loader.device, std::move(decoded),
+                                                    *loader.texture_upload_batch);
+}
+
+// Creates the textures held back by CreateTexture, with an image of array layers for each group
+// of the same format, extent and number of levels. Sharing one image and allocation, thousands
+// of tiny textures cost far less memory and allocations.
+static void CreateArrayTextures(SceneLoader& loader) {
+    auto& pending = loader.array_textures;
+    // Named images keep their layers across loads. Images decoded on the GPU have the storage
+    // usage, so they get arrays of their own.
+    std::ranges::sort(pending, [](const auto& lhs, const auto& rhs) {
+        const auto& a = *lhs.second;
+        const auto& b = *rhs.second;
+        const bool a_jpeg = a.jpeg != nullptr;
+        const bool b_jpeg = b.jpeg != nullptr;
+        return std::tie(a.format, a.width, a.height, a.num_levels, a_jpeg, lhs.first->name) <
+               std::tie(b.format, b.width, b.height, b.num_levels, b_jpeg, rhs.first->name);
+    });
+    const auto IsSameArray = [](const DecodedTexture& a, const DecodedTexture& b) {
+        return a.format == b.format && a.width == b.width && a.height == b.height &&
+               a.num_levels == b.num_levels && (a.jpeg != nullptr) == (b.jpeg != nullptr);
+    };
+    for (std::size_t begin = 0; begin < pending.size();) {
+        std::size_t end = begin + 1;
+        while (end < pending.size() && end - begin < MaxArrayLayers &&
+               IsSameArray(*pending[begin].second, *pending[end].second)) {
+            ++end;
+        }
+        if (end - begin == 1) {
+            auto& [image, decoded] = pending[begin];
+            image->texture = std::make_unique<VulkanTexture>(loader.device, std::move(decoded),
+                                                             *loader.texture_upload_batch);
+        } else {
+            std::vector<std::unique_ptr<DecodedTexture>> layers;
+            for (std::size_t i = begin; i < end; ++i) {
+                layers.emplace_back(std::move(pending[i].second));
+            }
+            auto textures = VulkanTexture::CreateArray(loader.device, std::move(layers),
+                                                       *loader.texture_upload_batch);
+            for (std::size_t i = begin; i < end; ++i) {
+                pending[i].first->texture = std::move(textures[i - begin]);
+            }
+        }
+        begin = end;
+    }
+    pending.clear();
+}
+
+static LazyTextureLoader::Placeholder GetPlaceholderType(const ImageUsage& usage) {
+    if (usage.normal) {
+        return LazyTextureLoader::Placeholder::Normal;
+    }
+    if (usage.color || !(usage.occlusion || usage.metallic_roughness)) {
+        return LazyTextureLoader::Placeholder::Color;
+    }
+    return LazyTextureLoader::Placeholder::Data;
+}
+
+// Queues the image onto the lazy texture loader. The source is captured here, as neither the
+// loader's buffers nor its current path are around by the time it is decoded.
+void Image::LoadLazily(SceneLoader& loader, const GLTF::Image& image, const ImageUsage& usage) {
+    auto& lazy_loader = *loader.scene.lazy_texture_loader;
+    placeholder = &lazy_loader.GetPlaceholder(GetPlaceholderType(usage));
+
+    TextureDecodeContext context{
+        .device = loader.device,
+        .cache = loader.cache,
+        .thread_pool = loader.GetThreadPool(),
+        .encoding = GetImageEncoding(loader, usage),
+        .streaming = false, // Lazily loaded textures are not streamed
+        .max_size = loader.texture_quality.max_size,
+        .dropped_levels = loader.texture_quality.dropped_levels,
+        .gpu_image_decode = loader.gpu_image_decode,
+    };
     if (image.buffer_view.has_value()) {
         const auto& buffer_view = loader.gltf.buffer_views[*image.buffer_view];
-        auto& buffer_file = *loader.buffer_files.Get(loader, buffer_view.buffer);
-        buffer_file.Seek(buffer_view.byte_offset);
-
-        std::vector<u8> data(buffer_view.byte_length);
-        buffer_file.Read(data.data(), data.size());
-        texture = std::make_unique<VulkanTexture>(loader.device, std::move(data));
-    } else if (image.uri.has_value()) {
-        BufferFile buffer_file{*image.uri};
-        std::vector<u8> data(buffer_file.file_size);
-        buffer_file.Read(data.data(), data.size());
-        texture = std::make_unique<VulkanTexture>(loader.device, std::move(data));
+        const auto& [buffer_file, view_offset] = loader.GetBufferViewData(buffer_view);
+        const auto data = buffer_file.GetSpan(view_offset, buffer_view.byte_length);
+        lazy_loader.Add(
+            *this,
+            [context = std::move(context), bytes = std::vector<u8>(data.begin(), data.end())] {
+                return DecodeTexture(context, bytes);
+            },
+            data.size());
     } else {
+        // Data URIs are decoded from the URI itself, which has to stay around
+        auto uri = std::make_shared<const std::string>(*image.uri);
+        auto buffer_file = std::make_shared<BufferFile>(*uri, loader.container.uri);
+        const auto size = uri->size();
+        lazy_loader.Add(*this,
+                        [context = std::move(context), uri = std::move(uri),
+                         buffer_file = std::move(buffer_file)] {
+                            return DecodeTexture(context, buffer_file->GetSpan());
+                        },
+                        size);
+    }
+}
+
+Image::Image(SceneLoader& loader, const GLTF::Image& image, const ImageUsage& usage)
+    : name(image.name.value_or("Unnamed")) {
+    if (!image.buffer_view.has_value() && !image.uri.has_value()) {
         SPDLOG_ERROR("Image has no source");
         throw std::runtime_error("Image has no source");
     }
+    if (loader.lazy_textures) {
+        LoadLazily(loader, image, usage);
+        return;
+    }
+
+    // Read and decode as a task, then queue the GPU copy onto the shared upload batch.
+    // Decoding of one image thus overlaps with the transfer of previously decoded ones.
+    const TextureDecodeContext context{
+        .device = loader.device,
+        .cache = loader.cache,
+        .thread_pool = loader.GetThreadPool(),
+        .encoding = GetImageEncoding(loader, usage),
+        .streaming = loader.scene.texture_streamer->IsEnabled(),
+        .profiler = loader.profiler.get(),
+        .max_size = loader.texture_quality.max_size,
+        .dropped_levels = loader.texture_quality.dropped_levels,
+        .gpu_image_decode = loader.gpu_image_decode,
+    };
+    if (image.buffer_view.has_value()) {
+        const auto& buffer_view = loader.gltf.buffer_views[*image.buffer_view];
+        const auto& [buffer_file, view_offset] = loader.GetBufferViewData(buffer_view);
+        const auto data = buffer_file.GetSpan(view_offset, buffer_view.byte_length);
+        loader.RunTask([this, &loader, context, data, color = usage.color] {
+            CreateTexture(loader, *this, DecodeTexture(context, data));
+            KeepHostTexture(loader, data, color);
+        });
+    } else {
+        loader.RunTask(
+            [this, &loader, context, uri = std::string{*image.uri}, color = usage.color] {
+                const BufferFile buffer_file{uri, loader.container.uri};
+                CreateTexture(loader, *this, DecodeTexture(context, buffer_file.GetSpan()));
+                KeepHostTexture(loader, buffer_file.GetSpan(), color);
+            });
+    }
+}
+
+void Image::KeepHostTexture(SceneLoader& loader, std::span<const u8> file_data, bool color) {
+    if (!loader.keep_host_textures) {
+        return;
+    }
+    if (DecodedTexture::IsKTX2(file_data)) { // Which may be block compressed
+        LOG_RATE_LIMITED(WARN, "KTX2 images are not kept on the host");
+        return;
+    }
+    // Decoded again, as the copy of the device may be compressed or of a lower resolution
+    const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                            LoadProfiler::Stage::ImageDecode, file_data.size()};
+    host_texture = std::make_unique<DecodedTexture>(loader.device, file_data, true, color, false,
+                                                    loader.profiler.get());
+    host_texture->GenerateMipmaps();
 }
 Image::~Image() = default;
 
+// Calls func with the contents of the image file, if it has any
+template <typename Func>
+static void ReadImageFile(SceneLoader& loader, const GLTF::Image& image, Func&& func) {
+    if (image.buffer_view.has_value()) {
+        const auto& buffer_view = loader.gltf.buffer_views[*image.buffer_view];
+        const auto& [buffer_file, view_offset] = loader.GetBufferViewData(buffer_view);
+        func(buffer_file.GetSpan(view_offset, buffer_view.byte_length));
+    } else if (image.uri.has_value()) {
+        const BufferFile buffer_file{*image.uri, loader.container.uri};
+        func(buffer_file.GetSpan());
+    }
+}
+
+// Finest levels to drop from every texture so that they fit the budget of the texture quality,
+// as each level dropped quarters them. Estimated from the headers of the images, which are not
+// decoded for it.
+static u32 GetBudgetDroppedLevels(SceneLoader& loader) {
+    const auto budget = loader.texture_quality.budget;
+    if (budget == 0) {
+        return 0;
+    }
+    std::size_t total_size = 0;
+    for (const auto& image : loader.gltf.images) {
+        ReadImageFile(loader, image, [&](std::span<const u8> data) {
+            total_size += DecodedTexture::EstimateSize(data, loader.compress_textures);
+        });
+    }
+    u32 levels = 0;
+    while (levels < 16 && (total_size >> (levels * 2)) > budget) {
+        ++levels;
+    }
+    if (levels != 0) {
+        SPDLOG_INFO("Dropping {} levels of the textures to fit {} MiB (estimated {} MiB)", levels,
+                    budget / 1024 / 1024, total_size / 1024 / 1024);
+    }
+    return levels;
+}
+
+// Starts reading the buffer views and the image files in the background. Their pages would
+// otherwise only be read as the tasks touch them, each task blocking on a page fault at a time,
+// which leaves network storage mostly idle. Failures are left to the actual loading. Remote
+// files are not, as they would be fetched whole rather than the ranges the scene reads, in
+// parallel as the tasks read them.
+static void PrefetchSources(SceneLoader& loader) {
+    if (!loader.container.uri.empty()) {
+        return;
+    }
+    const auto& gltf = loader.gltf;
+    for (const auto& buffer_view : gltf.buffer_views) {
+        std::size_t buffer = buffer_view.buffer;
+        std::size_t offset = buffer_view.byte_offset;
+        std::size_t size = buffer_view.byte_length;
+        if (buffer_view.extensions.has_value() &&
+            buffer_view.extensions->meshopt_compression.has_value()) {
+            // Only the compressed data is read, the buffer of the view is usually a fallback
+            const auto& compression = *buffer_view.extensions->meshopt_compression;
+            buffer = compression.buffer;
+            offset = compression.byte_offset;
+            size = compression.byte_length;
+        }
+        try {
+            loader.buffer_files.Get(loader, buffer)->Prefetch(offset, size);
+        } catch (const std::exception&) {
+            // Thrown again if the view is used
+        }
+    }
+    if (loader.lazy_textures) { // Read in the background anyway
+        return;
+    }
+    for (std::size_t i = 0; i < gltf.images.size(); ++i) {
+        const auto& usage = loader.image_usages[i];
+        const auto& uri = gltf.images[i].uri;
+        if (!(usage.color || usage.normal || usage.occlusion || usage.metallic_roughness) ||
+            !uri.has_value() || uri->starts_with("data:")) {
+            continue;
+        }
+        // Opening files may block too. The pages stay cached once the files are closed.
+        loader.RunTask([uri = *uri] {
+            try {
+                const BufferFile buffer_file{uri};
+                buffer_file.Prefetch(0, buffer_file.GetSize());
+            } catch (const std::exception&) {
+                // Thrown again when the image is loaded
+            }
+        });
+    }
+}
+
+static bool CanLoadKTX2Image(SceneLoader& loader, std::size_t idx) {
+    bool can_load = false;
+    ReadImageFile(loader, loader.gltf.images.at(idx), [&](std::span<const u8> data) {
+        can_load = DecodedTexture::CanLoadKTX2(loader.device, data);
+    });
+    return can_load;
+}
+
+AlphaMaskImage::AlphaMaskImage(SceneLoader& loader, const GLTF::Image& image_)
+    : image(image_), alpha(&loader.temp_memory) {
+    SceneCache::Hasher hasher{"alpha_mask"};
+    ReadImageFile(loader, image, [&hasher](std::span<const u8> data) { hasher.Add(data); });
+    key = hasher.Get();
+}
+
+AlphaMaskImage::~AlphaMaskImage() = default;
+
+const std::pmr::vector<u8>& AlphaMaskImage::GetAlpha(SceneLoader& loader, u32& width_,
+                                                     u32& height_) {
+    std::call_once(decode_flag, [&] {
+        ReadImageFile(loader, image, [&](std::span<const u8> data) {
+            if (DecodedTexture::IsKTX2(data)) {
+                return;
+            }
+            const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                                    LoadProfiler::Stage::ImageDecode, data.size()};
+            const DecodedTexture decoded{loader.device, data, false, false, false,
+                                         loader.profiler.get()};
+            const auto pixels = decoded.GetLevel(0);
+            width = decoded.width;
+            height = decoded.height;
+            alpha.resize(std::size_t{width} * height);
+            for (std::size_t i = 0; i < alpha.size(); ++i) {
+                alpha[i] = pixels[i * 4 + 3];
+            }
+        });
+    });
+    width_ = width;
+    height_ = height;
+    return alpha;
+}
+
+// Prefers the KTX2 image of KHR_texture_basisu when the device can sample it, directly or once
+// transcoded.
+static std::size_t GetImageSource(SceneLoader& loader, const GLTF::Texture& texture) {
+    if (texture.extensions.has_value() && texture.extensions->texture_basisu.has_value()) {
+        const std::size_t source = texture.extensions->texture_basisu->source;
+        if (CanLoadKTX2Image(loader, source)) {
+            return source;
+        }
+        if (!texture.source.has_value()) {
+            SPDLOG_ERROR("KTX2 image {} cannot be loaded and there is no fallback", source);
+            throw std::runtime_error("KTX2 image cannot be loaded");
+        }
+        SPDLOG_WARN("KTX2 image {} cannot be loaded, using fallback image {}", source,
+                    *texture.source);
+    }
+    if (!texture.source.has_value()) {
+        SPDLOG_ERROR("Texture has no source");
+        throw std::runtime_error("Texture has no source");
+    }
+    return *texture.source;
+}
+
 Texture::Texture(SceneLoader& loader, const GLTF::Texture& texture)
-    : name(texture.name.value_or("Unnamed")), image(loader.images.Get(loader, texture.source)) {
+    : name(texture.name.value_or("Unnamed")) {
+    const std::size_t source = GetImageSource(loader, texture);
+    image = loader.GetImage(source);
     if (texture.sampler.has_value()) {
-        sampler = loader.samplers.Get(loader, *texture.sampler);
+        sampler = loader.GetSampler(*texture.sampler);
     }
 }
 Texture::~Texture() = default;
@@ -322,7 +1044,12 @@ Material::Material(SceneLoader& loader, const GLTF::Material& material)
 
     const auto LoadTexture = [&loader](const auto& json_field, int& index, u32& texcoord) {
         if (json_field.has_value()) {
-            index = static_cast<int>(loader.textures.GetIndex(loader, json_field->index));
+            const std::size_t texture = loader.textures.GetIndex(loader, json_field->index);
+            if (texture >= MATERIAL_MAX_TEXTURES) {
+                SPDLOG_ERROR("Materials can only sample {} textures", MATERIAL_MAX_TEXTURES);
+                throw std::runtime_error("Too many textures");
+            }
+            index = static_cast<int>(texture);
             texcoord = static_cast<u32>(json_field->texcoord);
             if (texcoord > 1) {
                 SPDLOG_ERROR("Currently only 2 UVs are supported, but requested UV{}", texcoord);
@@ -333,38 +1060,22 @@ Material::Material(SceneLoader& loader, const GLTF::Material& material)
         }
     };
     if (material.pbr.has_value()) {
-        glsl_material.base_color_factor = material.pbr->base_color_factor;
-        glsl_material.metallic_factor = static_cast<float>(material.pbr->metallic_factor);
-        glsl_material.roughness_factor = static_cast<float>(material.pbr->roughness_factor);
-
         LoadTexture(material.pbr->base_color_texture, glsl_material.base_color_texture_index,
                     glsl_material.base_color_texture_texcoord);
         LoadTexture(material.pbr->metallic_roughness_texture,
                     glsl_material.metallic_roughness_texture_index,
                     glsl_material.metallic_roughness_texture_texcoord);
     } else {
-        glsl_material.base_color_factor = glm::vec4{1, 1, 1, 1};
-        glsl_material.metallic_factor = 1.0;
-        glsl_material.roughness_factor = 1.0;
         glsl_material.base_color_texture_index = -1;
         glsl_material.metallic_roughness_texture_index = -1;
     }
-
     LoadTexture(material.normal_texture, glsl_material.normal_texture_index,
                 glsl_material.normal_texture_texcoord);
-    if (material.normal_texture.has_value()) {
-        glsl_material.normal_scale = static_cast<float>(material.normal_texture->scale);
-    }
-
     LoadTexture(material.occlusion_texture, glsl_material.occlusion_texture_index,
                 glsl_material.occlusion_texture_texcoord);
-    if (material.occlusion_texture.has_value()) {
-        glsl_material.occlusion_strength = static_cast<float>(material.occlusion_texture->strength);
-    }
-
     LoadTexture(material.emissive_texture, glsl_material.emissive_texture_index,
                 glsl_material.emissive_texture_texcoord);
-    glsl_material.emissive_factor = material.emissive_factor;
+    UpdateFactors(material);
 }
 
 Material::Material(std::string name, const GLSL::Material& glsl_material)
@@ -372,6 +1083,69 @@ Material::Material(std::string name, const GLSL::Material& glsl_material)
 
 Material::~Material() = default;
 
+bool Material::IsTextured() const {
+    return glsl_material.base_color_texture_index != -1 ||
+           glsl_material.metallic_roughness_texture_index != -1 ||
+           glsl_material.normal_texture_index != -1 || glsl_material.emissive_texture_index != -1;
+}
+
+bool Material::IsAlphaMasked() const {
+    return glsl_material.alpha_cutoff >= 0;
+}
+
+GLSL::PackedMaterial Material::GetPackedMaterial() const {
+    const auto PackTexture = [](int index, u32 texcoord) {
+        return index == -1 ? MATERIAL_NO_TEXTURE : static_cast<u32>(index) | (texcoord << 15);
+    };
+    const auto PackTextures = [&PackTexture](int index_low, u32 texcoord_low, int index_high,
+                                             u32 texcoord_high) {
+        return PackTexture(index_low, texcoord_low) |
+               (PackTexture(index_high, texcoord_high) << 16);
+    };
+    const auto& m = glsl_material;
+    return {
+        .base_color_factor_rg =
+            glm::packHalf2x16({m.base_color_factor.r, m.base_color_factor.g}),
+        .base_color_factor_ba =
+            glm::packHalf2x16({m.base_color_factor.b, m.base_color_factor.a}),
+        .emissive_factor_rg = glm::packHalf2x16({m.emissive_factor.r, m.emissive_factor.g}),
+        .emissive_factor_b_normal_scale = glm::packHalf2x16({m.emissive_factor.b, m.normal_scale}),
+        .metallic_roughness_occlusion = glm::packUnorm4x8(
+            glm::vec4{m.metallic_factor, m.roughness_factor, m.occlusion_strength, 0}),
+        .alpha_cutoff_emissive_texture =
+            (glm::packHalf2x16({m.alpha_cutoff, 0}) & 0xffff) |
+            (PackTexture(m.emissive_texture_index, m.emissive_texture_texcoord) << 16),
+        .base_color_metallic_roughness_textures =
+            PackTextures(m.base_color_texture_index, m.base_color_texture_texcoord,
+                         m.metallic_roughness_texture_index, m.metallic_roughness_texture_texcoord),
+        .normal_occlusion_textures =
+            PackTextures(m.normal_texture_index, m.normal_texture_texcoord,
+                         m.occlusion_texture_index, m.occlusion_texture_texcoord),
+    };
+}
+
+void Material::UpdateFactors(const GLTF::Material& material) {
+    if (material.pbr.has_value()) {
+        glsl_material.base_color_factor = material.pbr->base_color_factor;
+        glsl_material.metallic_factor = static_cast<float>(material.pbr->metallic_factor);
+        glsl_material.roughness_factor = static_cast<float>(material.pbr->roughness_factor);
+    } else {
+        glsl_material.base_color_factor = glm::vec4{1, 1, 1, 1};
+        glsl_material.metallic_factor = 1.0;
+        glsl_material.roughness_factor = 1.0;
+    }
+    if (material.normal_texture.has_value()) {
+        glsl_material.normal_scale = static_cast<float>(material.normal_texture->scale);
+    }
+    if (material.occlusion_texture.has_value()) {
+        glsl_material.occlusion_strength = static_cast<float>(material.occlusion_texture->strength);
+    }
+    glsl_material.emissive_factor = material.emissive_factor;
+    glsl_material.alpha_cutoff =
+        material.alpha_mode == "MASK" ? static_cast<float>(material.alpha_cutoff) : -1.0f;
+    double_sided = material.double_sided;
+}
+
 MeshPrimitive::MeshPrimitive(const GLTF::Mesh::Primitive& primitive_) : primitive(primitive_) {}
 
 MeshPrimitive::MeshPrimitive(SceneLoader& loader, const GLTF::Mesh::Primitive& primitive_)
@@ -413,30 +1187,56 @@ MeshPrimitive::MeshPrimitive(SceneLoader& loader, const GLTF::Mesh::Primitive& p
 
 MeshPrimitive::~MeshPrimitive() = default;
 
+// Adds the bytes the accessor is read from, and how they are read
+static void AddAccessorData(SceneLoader& loader, SceneCache::Hasher& hasher,
+                            const GLTF::Accessor& accessor) {
+    const auto element_size =
+        GetComponentSize(accessor.component_type) * GLTF::GetComponentCount(accessor.type);
+    hasher.AddValue(static_cast<u64>(accessor.count))
+        .AddValue(static_cast<u32>(accessor.component_type))
+        .AddValue(static_cast<u64>(element_size))
+        .AddValue(static_cast<bool>(accessor.normalized));
+    if (!accessor.buffer_view.has_value() || accessor.count == 0) {
+        return;
+    }
+
+    const auto& buffer_view = loader.gltf.buffer_views[*accessor.buffer_view];
+    const auto& [buffer_file, view_offset] = loader.GetBufferViewData(buffer_view);
+    const auto stride = buffer_view.byte_stride.value_or(element_size);
+    hasher.AddValue(static_cast<u64>(stride))
+        .Add(buffer_file.GetSpan(view_offset + accessor.byte_offset,
+                                 (accessor.count - 1) * stride + element_size));
+}
+
 void MeshPrimitive::Load(SceneLoader& loader) {
     if (!attributes.empty()) {
         return;
     }
 
     // Keep note of all the buffers we'll use
-    // (buffer, buffer_offset) -> binding
-    std::map<std::pair<vk::Buffer, std::size_t>, u32> binding_index_map;
+    // (heap block, offset in block, stride) -> binding. Views of identical data share their
+    // buffers, which need not be read with the same stride.
+    std::pmr::map<std::tuple<vk::Buffer, std::size_t, std::size_t>, u32> binding_index_map{
+        &loader.temp_memory};
     const auto GetBindingIndex =
         [this, &binding_index_map](const VertexBufferView::BufferInfo& info, std::size_t stride) {
-            if (!binding_index_map.count({**info.buffer, info.buffer_offset})) {
+            const std::tuple<vk::Buffer, std::size_t, std::size_t> key{
+                **info.buffer, info.buffer->offset + info.buffer_offset, stride};
+            if (!binding_index_map.count(key)) {
                 bindings.emplace_back(vk::VertexInputBindingDescription2EXT{
                     .binding = static_cast<u32>(bindings.size()),
                     .stride = static_cast<u32>(stride),
                     .inputRate = vk::VertexInputRate::eVertex,
                     .divisor = 1,
                 });
-                raw_vertex_buffers.emplace_back(**info.buffer);
-                vertex_buffer_offsets.emplace_back(info.buffer_offset);
+                raw_vertex_buffers.emplace_back(std::get<0>(key));
+                vertex_buffer_offsets.emplace_back(std::get<1>(key));
+                vertex_buffer_addresses.emplace_back(
+                    info.buffer->address ? info.buffer->address + info.buffer_offset : 0);
                 vertex_buffers.emplace_back(info.buffer);
-                binding_index_map.emplace(std::make_pair(**info.buffer, info.buffer_offset),
-                                          static_cast<u32>(bindings.size() - 1));
+                binding_index_map.emplace(key, static_cast<u32>(bindings.size() - 1));
             }
-            return binding_index_map.at({**info.buffer, info.buffer_offset});
+            return binding_index_map.at(key);
         };
 
     // accessor, default format
@@ -463,6 +1263,7 @@ void MeshPrimitive::Load(SceneLoader& loader) {
                 });
                 raw_vertex_buffers.emplace_back(VK_NULL_HANDLE);
                 vertex_buffer_offsets.emplace_back(0);
+                vertex_buffer_addresses.emplace_back(0);
                 null_binding_idx = static_cast<int>(bindings.size() - 1);
             }
             attributes.emplace_back(vk::VertexInputAttributeDescription2EXT{
@@ -504,139 +1305,261 @@ void MeshPrimitive::Load(SceneLoader& loader) {
             .offset = attribute_offset,
         });
     }
-}
 
-CPUAccessor::CPUAccessor(SceneLoader& loader, const GLTF::Accessor& accessor) {
-    data.resize(GetTotalSize(accessor));
-    if (!accessor.buffer_view.has_value()) {
-        return;
+    // Location 0 is POSITION. Acceleration structures only accept a few quantized formats.
+    const bool builds_accel_structures =
+        static_cast<bool>(loader.vertex_buffer_params.usage &
+                          vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR);
+    if (builds_accel_structures && primitive.attributes.position.has_value() &&
+        !(loader.device.physical_device.getFormatProperties(attributes[0].format).bufferFeatures &
+          vk::FormatFeatureFlagBits::eAccelerationStructureVertexBufferKHR)) {
+        DequantizePositions(loader);
     }
-
-    const auto& buffer_view = loader.gltf.buffer_views[*accessor.buffer_view];
-    auto& buffer_file = *loader.buffer_files.Get(loader, buffer_view.buffer);
-    if (buffer_view.byte_stride.has_value()) {
-        const auto byte_stride = *buffer_view.byte_stride;
-        const auto element_size =
-            GetComponentSize(accessor.component_type) * GLTF::GetComponentCount(accessor.type);
-        for (std::size_t i = 0; i < accessor.count; ++i) {
-            buffer_file.Seek(buffer_view.byte_offset + accessor.byte_offset + i * byte_stride);
-            buffer_file.Read(data.data() + i * element_size, element_size);
+    if (builds_accel_structures) {
+        SceneCache::Hasher hasher{"geometry"};
+        hasher.AddValue(attributes[0].format);
+        if (primitive.attributes.position.has_value()) {
+            AddAccessorData(loader, hasher, loader.gltf.accessors[*primitive.attributes.position]);
         }
-    } else {
-        buffer_file.Seek(buffer_view.byte_offset + accessor.byte_offset);
-        buffer_file.Read(data.data(), data.size());
+        if (primitive.indices.has_value()) {
+            AddAccessorData(loader, hasher, loader.gltf.accessors[*primitive.indices]);
+            hasher.AddValue(loader.OptimizesIndices(*primitive.indices));
+        }
+        geometry_hash = hasher.Get();
     }
-}
 
-CPUAccessor::~CPUAccessor() = default;
+    if (IsDeformable(primitive)) {
+        LoadDeformation(loader);
+    }
 
-MeshPrimitiveGenerateTangent::MeshPrimitiveGenerateTangent(SceneLoader& loader,
-                                                           const GLTF::Mesh::Primitive& primitive_)
-    : MeshPrimitive(primitive_) {
-    if (primitive.material.has_value()) {
-        material = static_cast<int>(loader.materials.GetIndex(loader, *primitive.material));
+    const bool triangles = primitive.attributes.position.has_value() &&
+                           primitive.mode == GLTF::Mesh::Primitive::Mode::Triangles;
+    const bool generate_lods = loader.generate_lods && index_buffer && triangles;
+    const bool build_meshlets = loader.build_meshlets && triangles;
+    const bool keep_host_geometry = loader.KeepsHostGeometry(primitive);
+    const bool bake_opacity_micromap = loader.BakesOpacityMicromap(primitive);
+    if (!generate_lods && !build_meshlets && !keep_host_geometry && !bake_opacity_micromap) {
+        return;
+    }
+    std::vector<u32> indices;
+    if (primitive.indices.has_value()) {
+        indices = loader.LoadIndices(*primitive.indices);
+    }
+    if (build_meshlets) {
+        BuildMeshlets(loader, LoadMeshletVertices(loader), indices);
+    }
+    if (bake_opacity_micromap) {
+        const auto texcoord =
+            loader.materials.Get(loader, *primitive.material).glsl_material
+                .base_color_texture_texcoord;
+        const auto texcoord_accessor =
+            texcoord == 0 ? primitive.attributes.texcoord_0 : primitive.attributes.texcoord_1;
+        BakeOpacityMicromap(
+            loader, loader.LoadFloatAccessor(loader.gltf.accessors[*texcoord_accessor]), indices);
+    }
+    if (generate_lods || keep_host_geometry) {
+        const auto& position_accessor = loader.gltf.accessors[*primitive.attributes.position];
+        auto positions = loader.LoadFloatAccessor(position_accessor);
+        if (generate_lods) {
+            GenerateLODs(loader, positions, indices);
+        }
+        if (keep_host_geometry) {
+            host_positions = std::move(positions);
+            host_indices = std::move(indices);
+        }
     }
-    color_is_vec4 = true;
 }
 
-MeshPrimitiveGenerateTangent::~MeshPrimitiveGenerateTangent() = default;
-
-namespace MikkT {
+GLSL::PrimitiveInfo MeshPrimitive::GetPrimitiveInfo() const {
+    const auto GetAttributeAddress = [this](std::size_t i) -> u64 {
+        const auto& attribute = attributes[i];
+        if (!raw_vertex_buffers[attribute.binding]) {
+            return 0;
+        }
+        return vertex_buffer_addresses[attribute.binding] + attribute.offset;
+    };
+    const auto GetAttributeFormat = [this](std::size_t i, u32 type) {
+        return PackAttributeFormat(bindings[attributes[i].binding].stride, type);
+    };
 
-struct Vertex {
-    glm::vec3 position{};
-    glm::vec3 normal{};
-    glm::vec2 texcoord_0{};
-    glm::vec2 texcoord_1{};
-    glm::vec4 color{1.0f};
-    glm::vec4 tangent{};
+    return {
+        .index_address = index_buffer ? index_buffer->gpu_buffer->address : 0,
+        .position_address = GetAttributeAddress(0),
+        .normal_address = GetAttributeAddress(1),
+        .texcoord0_address = GetAttributeAddress(2),
+        .texcoord1_address = GetAttributeAddress(3),
+        .material_idx = material,
+        .index_size = index_buffer
+                          ? static_cast<u32>(GetComponentSize(index_buffer->component_type))
+                          : 0,
+        .position_format = GetAttributeFormat(0, GetAttributeType(attributes[0].format)),
+        .normal_format = GetAttributeFormat(1, GetDirectionType(attributes[1].format)),
+        .texcoord0_format = GetAttributeFormat(2, GetAttributeType(attributes[2].format)),
+        .texcoord1_format = GetAttributeFormat(3, GetAttributeType(attributes[3].format)),
+        .color_address = GetAttributeAddress(4),
+        .tangent_address = GetAttributeAddress(5),
+        .color_format = GetAttributeFormat(4, GetColorType(attributes[4].format)),
+        .tangent_format = GetAttributeFormat(5, GetDirectionType(attributes[5].format)),
+    };
+}
 
-    bool operator==(const Vertex&) const = default;
-};
+bool MeshPrimitive::IsDeformable(const GLTF::Mesh::Primitive& primitive) {
+    return (primitive.attributes.joints_0.has_value() &&
+            primitive.attributes.weights_0.has_value()) ||
+           !primitive.targets.empty();
+}
 
-} // namespace MikkT
-} // namespace Renderer
+void MeshPrimitive::LoadDeformation(SceneLoader& loader) {
+    // Of the type and count expected of the vertices
+    const auto Load = [this, &loader](std::size_t accessor_idx, std::string_view type) {
+        const auto& accessor = loader.gltf.accessors.at(accessor_idx);
+        if (accessor.type != type || accessor.count != max_vertices) {
+            SPDLOG_ERROR("Deformation accessor {} is not a {} per vertex", accessor_idx, type);
+            throw std::runtime_error("Deformation accessor has the wrong type or count");
+        }
+        return loader.LoadFloatAccessor(accessor);
+    };
 
-template <>
-struct std::hash<Renderer::MikkT::Vertex> {
-    std::size_t operator()(const Renderer::MikkT::Vertex& v) const noexcept {
-        return boost::pfr::hash_fields(v);
+    deformation = std::make_unique<Deformation>();
+    const auto& attributes = primitive.attributes;
+    if (attributes.joints_0.has_value() && attributes.weights_0.has_value()) {
+        const auto joints = Load(*attributes.joints_0, "VEC4");
+        const auto weights = Load(*attributes.weights_0, "VEC4");
+        deformation->skin_vertices.resize(max_vertices);
+        for (std::size_t i = 0; i < max_vertices; ++i) {
+            auto& vertex = deformation->skin_vertices[i];
+            for (glm::length_t j = 0; j < 4; ++j) {
+                vertex.joints[j] = static_cast<u32>(joints[i * 4 + j]);
+                vertex.weights[j] = weights[i * 4 + j];
+                // Joints of no weight may be anything, and are never read
+                if (vertex.weights[j] > 0) {
+                    deformation->max_joint = std::max(deformation->max_joint, vertex.joints[j]);
+                }
+            }
+        }
     }
-};
 
-namespace Renderer {
-namespace MikkT {
-
-struct UserData {
-    const std::vector<Vertex>& vertices;
-    const std::vector<u32>& indices;
-    std::size_t tex_coord{};
-    std::vector<glm::vec4> out;
-};
-
-static int GetNumFaces(const SMikkTSpaceContext* context) {
-    const auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
-    if (data.indices.empty()) {
-        return static_cast<int>(data.vertices.size() / 3);
+    deformation->num_targets = static_cast<u32>(primitive.targets.size());
+    deformation->morph_deltas.resize(primitive.targets.size() * max_vertices);
+    for (std::size_t t = 0; t < primitive.targets.size(); ++t) {
+        const auto& target = primitive.targets[t];
+        const std::span deltas =
+            std::span{deformation->morph_deltas}.subspan(t * max_vertices, max_vertices);
+        // Each of the attributes of the target is optional
+        const std::array<std::pair<std::optional<std::size_t>, glm::vec3 GLSL::MorphDelta::*>, 3>
+            target_accessors{{
+                {target.position, &GLSL::MorphDelta::position},
+                {target.normal, &GLSL::MorphDelta::normal},
+                {target.tangent, &GLSL::MorphDelta::tangent},
+            }};
+        for (const auto& [accessor_idx, member] : target_accessors) {
+            if (!accessor_idx.has_value()) {
+                continue;
+            }
+            const auto values = Load(*accessor_idx, "VEC3");
+            for (std::size_t i = 0; i < max_vertices; ++i) {
+                deltas[i].*member = {values[i * 3], values[i * 3 + 1], values[i * 3 + 2]};
+            }
+        }
     }
-    return static_cast<int>(data.indices.size() / 3);
 }
 
-static int GetVertexIndex(const UserData& data, int idx) {
-    if (data.indices.empty()) {
-        return idx;
+bool MeshPrimitive::HasFloatAttributes() const {
+    // Position, normal, texcoords, color and tangent, see GetPrimitiveInfo. Null bindings have a
+    // stride of 0.
+    for (std::size_t i = 0; i < 6; ++i) {
+        if (bindings[attributes[i].binding].stride == 0) {
+            continue;
+        }
+        if (i == 4 || GetAttributeType(attributes[i].format) != 0) {
+            return false;
+        }
     }
-    return data.indices[idx];
+    return true;
 }
 
-static float LoadFloat(const std::vector<u8>& data, std::size_t idx,
-                       GLTF::Accessor::ComponentType type) {
-    if (type == GLTF::Accessor::ComponentType::Float) {
-        return *reinterpret_cast<const float*>(data.data() + idx * sizeof(float));
-    } else if (type == GLTF::Accessor::ComponentType::UnsignedByte) {
-        return (*(data.data() + idx)) / 255.0f;
-    } else if (type == GLTF::Accessor::ComponentType::UnsignedShort) {
-        return (*reinterpret_cast<const u16_le*>(data.data() + idx * sizeof(u16))) / 65535.0f;
+CPUAccessor::CPUAccessor(SceneLoader& loader, const GLTF::Accessor& accessor)
+    : data(&loader.temp_memory) {
+    data.resize(GetTotalSize(accessor));
+    if (!accessor.buffer_view.has_value() || accessor.count == 0) {
+        return;
     }
-    SPDLOG_ERROR("Invalid component type {}", static_cast<int>(type));
-    throw std::runtime_error("Invalid component type");
-}
 
-static void GetPosition(const SMikkTSpaceContext* context, float out[], int face, int vert) {
-    const auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
-    const int idx = GetVertexIndex(data, face * 3 + vert);
-    for (glm::length_t i = 0; i < 3; ++i) {
-        out[i] = data.vertices[idx].position[i];
-    }
+    const auto& buffer_view = loader.gltf.buffer_views[*accessor.buffer_view];
+    const auto& [buffer_file, view_offset] = loader.GetBufferViewData(buffer_view);
+    const auto element_size =
+        GetComponentSize(accessor.component_type) * GLTF::GetComponentCount(accessor.type);
+    const auto byte_stride = buffer_view.byte_stride.value_or(element_size);
+    const auto src = buffer_file.GetSpan(view_offset + accessor.byte_offset,
+                                         (accessor.count - 1) * byte_stride + element_size);
+    GLTF::GatherAccessor(src, byte_stride, accessor, data);
 }
 
-static void GetNormal(const SMikkTSpaceContext* context, float out[], int face, int vert) {
-    const auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
-    const int idx = GetVertexIndex(data, face * 3 + vert);
-    for (glm::length_t i = 0; i < 3; ++i) {
-        out[i] = data.vertices[idx].normal[i];
-    }
-}
+CPUAccessor::~CPUAccessor() = default;
 
-static void GetTexCoord(const SMikkTSpaceContext* context, float out[], int face, int vert) {
-    const auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
-    const int idx = GetVertexIndex(data, face * 3 + vert);
-    for (glm::length_t i = 0; i < 2; ++i) {
-        if (data.tex_coord == 0) {
-            out[i] = data.vertices[idx].texcoord_0[i];
-        } else {
-            out[i] = data.vertices[idx].texcoord_1[i];
+OptimizedIndices::OptimizedIndices(SceneLoader& loader, const GLTF::Accessor& accessor)
+    : indices(&loader.temp_memory) {
+    const auto accessor_idx = GetAccessorIndex(loader, accessor);
+    const auto& data = loader.cpu_accessors.Get(loader, accessor_idx)->data;
+    // Of the triangle lists, to sort them spatially
+    std::vector<float> positions;
+    if (loader.spatial_order && loader.index_positions[accessor_idx] != SceneLoader::NoAccessor) {
+        positions =
+            loader.LoadFloatAccessor(loader.gltf.accessors[loader.index_positions[accessor_idx]]);
+    }
+    const auto key = SceneCache::Hasher{"optimized_indices"}
+                         .AddValue(GLTF::Accessor::ComponentType{accessor.component_type})
+                         .Add(data)
+                         .AddValue(Common::VertexCacheSize)
+                         .AddValue(loader.optimize_indices)
+                         .AddVector(positions)
+                         .Get();
+    const std::size_t count = accessor.count / 3 * 3;
+    indices.resize(count);
+    if (const auto entry = loader.cache->Load(key)) {
+        if (entry->GetNumSections() == 1 && entry->GetSection(0).size() == count * sizeof(u32_le)) {
+            Common::ReadIndices(entry->GetSection(0), sizeof(u32_le), indices);
+            return;
         }
+        LOG_RATE_LIMITED(WARN, "Ignoring invalid cached indices");
+    }
+
+    const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                            LoadProfiler::Stage::IndexOptimization, data.size()};
+    std::vector<u32> native_indices(accessor.count);
+    Common::ReadIndices(data, GetComponentSize(accessor.component_type), native_indices);
+    native_indices.resize(count);
+    const std::size_t num_vertices =
+        native_indices.empty() ? 0 : std::size_t{*std::ranges::max_element(native_indices)} + 1;
+    std::vector<std::size_t> clusters;
+    auto optimized = loader.optimize_indices
+                         ? Common::OptimizeVertexCache(native_indices, num_vertices, &clusters)
+                         : std::move(native_indices);
+    if (!positions.empty() && num_vertices * 3 <= positions.size()) {
+        Common::SortClustersSpatially(optimized, positions, clusters);
     }
+    std::ranges::copy(optimized, indices.begin());
+
+    std::vector<u32_le> le_indices(optimized.size());
+    Common::CopyToLE(le_indices, optimized);
+    const std::array<std::span<const u8>, 1> sections{{
+        {reinterpret_cast<const u8*>(le_indices.data()), le_indices.size() * sizeof(u32_le)},
+    }};
+    loader.cache->Store(key, sections);
 }
 
-static void SetTSpace(const SMikkTSpaceContext* context, const float tangent[], float sign,
-                      int face, int vert) {
-    auto& data = *reinterpret_cast<UserData*>(context->m_pUserData);
-    data.out[face * 3 + vert] = glm::vec4{tangent[0], tangent[1], tangent[2], -sign};
+OptimizedIndices::~OptimizedIndices() = default;
+
+MeshPrimitiveGenerateTangent::MeshPrimitiveGenerateTangent(SceneLoader& loader,
+                                                           const GLTF::Mesh::Primitive& primitive_)
+    : MeshPrimitive(primitive_) {
+    if (primitive.material.has_value()) {
+        material = static_cast<int>(loader.materials.GetIndex(loader, *primitive.material));
+    }
+    color_is_vec4 = true;
 }
 
-} // namespace MikkT
+MeshPrimitiveGenerateTangent::~MeshPrimitiveGenerateTangent() = default;
 
 static bool ShouldGenerateTangent(SceneLoader& loader, const GLTF::Mesh::Primitive& primitive) {
     if (primitive.attributes.tangent.has_value()) {
@@ -662,194 +1585,932 @@ static bool ShouldGenerateTangent(SceneLoader& loader, const GLTF::Mesh::Primiti
     return true;
 }
 
-template <glm::length_t L>
-glm::vec<L, float> LoadVec(SceneLoader& loader, std::optional<std::size_t> accessor_idx,
-                           std::size_t idx) {
-    if (!accessor_idx.has_value()) {
-        return glm::vec<L, float>{};
+namespace MikkT {
+
+// An optional vertex attribute, decoded to floats in one pass per primitive
+struct AttributeData {
+    std::vector<float> values; // Empty if the attribute is absent
+
+    explicit AttributeData(SceneLoader& loader, std::optional<std::size_t> accessor_idx) {
+        if (accessor_idx.has_value()) {
+            values = loader.LoadFloatAccessor(loader.gltf.accessors[*accessor_idx]);
+        }
     }
-    const auto& data = loader.cpu_accessors.Get(loader, *accessor_idx)->data;
-    const auto component_type = loader.gltf.accessors[*accessor_idx].component_type;
 
-    glm::vec<L, float> out;
-    for (glm::length_t i = 0; i < L; ++i) {
-        out[i] = MikkT::LoadFloat(data, idx * L + i, component_type);
+    template <glm::length_t L>
+    glm::vec<L, float> Load(std::size_t idx) const {
+        if (values.empty()) {
+            return glm::vec<L, float>{};
+        }
+        glm::vec<L, float> out;
+        for (glm::length_t i = 0; i < L; ++i) {
+            out[i] = values[idx * L + i];
+        }
+        return out;
     }
-    return out;
+};
+
+} // namespace MikkT
+
+namespace PackedVertex {
+
+// The attributes of a MikkT::Vertex other than its position, which stays a float3 for the
+// acceleration structures, packed into 20 bytes instead of 60. Normals and tangents are
+// octahedral snorm16 pairs, the sign of the bitangent in the lowest bit of that of the tangent.
+// The types are those of PrimitiveInfo, as the vertices are pulled by shaders and never bound
+// as vertex input.
+struct Attributes {
+    u32_le normal;
+    u32_le texcoord_0; // half2
+    u32_le texcoord_1;
+    u32_le color; // RGBA8
+    u32_le tangent;
+};
+static_assert(sizeof(Attributes) == 20);
+
+constexpr u32 TangentSignBit = 1u << 16;
+
+glm::vec2 OctahedralEncode(const glm::vec3& v) {
+    const float sum = std::abs(v.x) + std::abs(v.y) + std::abs(v.z);
+    if (sum == 0) {
+        return {};
+    }
+    const glm::vec2 p = glm::vec2{v} / sum;
+    if (v.z >= 0) {
+        return p;
+    }
+    return (1.0f - glm::abs(glm::vec2{p.y, p.x})) *
+           glm::vec2{p.x >= 0 ? 1.0f : -1.0f, p.y >= 0 ? 1.0f : -1.0f};
 }
 
-void MeshPrimitiveGenerateTangent::Load(SceneLoader& loader) {
-    SPDLOG_WARN("Generating tangents");
+Attributes Pack(const MikkT::Vertex& vertex) {
+    u32 tangent = glm::packSnorm2x16(OctahedralEncode(glm::vec3{vertex.tangent}));
+    tangent = (tangent & ~TangentSignBit) | (vertex.tangent.w < 0 ? TangentSignBit : 0);
+    return {
+        .normal = glm::packSnorm2x16(OctahedralEncode(vertex.normal)),
+        .texcoord_0 = glm::packHalf2x16(vertex.texcoord_0),
+        .texcoord_1 = glm::packHalf2x16(vertex.texcoord_1),
+        .color = glm::packUnorm4x8(vertex.color),
+        .tangent = tangent,
+    };
+}
 
-    // Load vertex data to CPU
-    max_vertices = loader.gltf.accessors[*primitive.attributes.position].count;
-    std::vector<MikkT::Vertex> old_vertices(max_vertices);
-    for (std::size_t i = 0; i < old_vertices.size(); ++i) {
-        old_vertices[i] = {
-            .position = LoadVec<3>(loader, primitive.attributes.position, i),
-            .normal = LoadVec<3>(loader, primitive.attributes.normal, i),
-            .texcoord_0 = LoadVec<2>(loader, primitive.attributes.texcoord_0, i),
-            .texcoord_1 = LoadVec<2>(loader, primitive.attributes.texcoord_1, i),
+} // namespace PackedVertex
+
+void MeshPrimitive::DequantizePositions(SceneLoader& loader) {
+    const MikkT::AttributeData position{loader, primitive.attributes.position};
+    std::vector<glm::vec3> positions(max_vertices);
+    for (std::size_t i = 0; i < positions.size(); ++i) {
+        positions[i] = position.Load<3>(i);
+    }
+    const auto buffer = loader.scene.vertex_heap->Upload(
+        {reinterpret_cast<const u8*>(positions.data()), positions.size() * sizeof(glm::vec3)});
+
+    auto& attribute = attributes[0];
+    attribute.binding = static_cast<u32>(bindings.size());
+    attribute.format = vk::Format::eR32G32B32Sfloat;
+    attribute.offset = 0;
+    bindings.emplace_back(vk::VertexInputBindingDescription2EXT{
+        .binding = attribute.binding,
+        .stride = sizeof(glm::vec3),
+        .inputRate = vk::VertexInputRate::eVertex,
+        .divisor = 1,
+    });
+    raw_vertex_buffers.emplace_back(**buffer);
+    vertex_buffer_offsets.emplace_back(buffer->offset);
+    vertex_buffer_addresses.emplace_back(buffer->address);
+    vertex_buffers.emplace_back(buffer);
+}
+
+namespace LODs {
+
+// Including the full primitive
+constexpr std::size_t MaxLevels = 4;
+// Each level aims for this fraction of the indices of the previous one
+constexpr double Reduction = 0.5;
+// Levels saving less than this fraction of the indices of the previous one are dropped
+constexpr double MinSaving = 0.2;
+// Of the diagonal of the bounds, as levels moving the surface further are never picked anyway
+constexpr float MaxError = 0.1f;
+
+} // namespace LODs
+
+static Common::AlphaMask::Wrap ToAlphaMaskWrap(GLTF::Sampler::Wrap wrap) {
+    switch (wrap) {
+    case GLTF::Sampler::Wrap::ClampToEdge:
+        return Common::AlphaMask::Wrap::ClampToEdge;
+    case GLTF::Sampler::Wrap::MirroredRepeat:
+        return Common::AlphaMask::Wrap::MirroredRepeat;
+    default:
+        return Common::AlphaMask::Wrap::Repeat;
+    }
+}
+
+void MeshPrimitive::BakeOpacityMicromap(SceneLoader& loader, std::span<const float> texcoords,
+                                        std::span<const u32> indices) {
+    const auto& gltf_material = loader.gltf.materials[*primitive.material];
+    const auto& gltf_texture = loader.gltf.textures[gltf_material.pbr->base_color_texture->index];
+    auto& alpha_mask = *loader.alpha_masks.Get(loader, *gltf_texture.source);
+
+    // The alpha is that of the texture times the factor, vertex colors having none
+    const glm::vec4 base_color_factor = gltf_material.pbr->base_color_factor;
+    Common::AlphaMask mask{
+        .cutoff = static_cast<float>(gltf_material.alpha_cutoff) / base_color_factor.a,
+    };
+    if (gltf_texture.sampler.has_value()) {
+        const auto& sampler = loader.gltf.samplers[*gltf_texture.sampler];
+        mask.wrap_s = ToAlphaMaskWrap(sampler.wrapS);
+        mask.wrap_t = ToAlphaMaskWrap(sampler.wrapT);
+    }
+    const u32 max_level =
+        std::min(Common::MaxOpacityMicromapLevel, loader.device.max_opacity_micromap_level);
+
+    const std::size_t num_vertices = texcoords.size() / 2;
+    const std::size_t num_triangles = (indices.empty() ? num_vertices : indices.size()) / 3;
+    std::vector<std::array<float, 6>> triangle_texcoords(num_triangles);
+    for (std::size_t i = 0; i < num_triangles; ++i) {
+        for (std::size_t j = 0; j < 3; ++j) {
+            const std::size_t vertex = indices.empty() ? i * 3 + j : indices[i * 3 + j];
+            if (vertex < num_vertices) {
+                triangle_texcoords[i][j * 2] = texcoords[vertex * 2];
+                triangle_texcoords[i][j * 2 + 1] = texcoords[vertex * 2 + 1];
+            }
+        }
+    }
+    const auto key = SceneCache::Hasher{"opacity_micromap"}
+                         .AddVector(triangle_texcoords)
+                         .AddValue(alpha_mask.key)
+                         .AddValue(mask.cutoff)
+                         .AddValue(mask.wrap_s)
+                         .AddValue(mask.wrap_t)
+                         .AddValue(max_level)
+                         .Get();
+
+    using Triangle = Common::OpacityMicromap::Triangle;
+    Common::OpacityMicromap micromap;
+    bool cached = false;
+    if (const auto entry = loader.cache->Load(key)) {
+        if (entry->GetNumSections() == 4 && entry->GetSection(1).size() % sizeof(Triangle) == 0 &&
+            entry->GetSection(1).size() != 0 &&
+            entry->GetSection(2).size() == num_triangles * sizeof(s32) &&
+            entry->GetSection(3).size() == sizeof(micromap.level_counts)) {
+            const auto CopySection = [&entry](std::size_t idx, auto& out) {
+                const auto section = entry->GetSection(idx);
+                out.resize(section.size() / sizeof(out[0]));
+                std::memcpy(out.data(), section.data(), section.size());
+            };
+            CopySection(0, micromap.data);
+            CopySection(1, micromap.triangles);
+            CopySection(2, micromap.indices);
+            std::memcpy(micromap.level_counts.data(), entry->GetSection(3).data(),
+                        sizeof(micromap.level_counts));
+            cached = true;
+        } else {
+            LOG_RATE_LIMITED(WARN, "Ignoring invalid cached opacity micromap");
+        }
+    }
+    if (!cached) {
+        const auto& alpha = alpha_mask.GetAlpha(loader, mask.width, mask.height);
+        if (alpha.empty()) {
+            return;
+        }
+        mask.alpha = alpha;
+
+        const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                                LoadProfiler::Stage::OpacityMicromapBaking};
+        micromap = Common::BakeOpacityMicromap(triangle_texcoords, mask, max_level);
+        const std::array<std::span<const u8>, 4> sections{{
+            {micromap.data.data(), micromap.data.size()},
+            {reinterpret_cast<const u8*>(micromap.triangles.data()),
+             micromap.triangles.size() * sizeof(Triangle)},
+            {reinterpret_cast<const u8*>(micromap.indices.data()),
+             micromap.indices.size() * sizeof(s32)},
+            {reinterpret_cast<const u8*>(micromap.level_counts.data()),
+             sizeof(micromap.level_counts)},
+        }};
+        loader.cache->Store(key, sections);
+    }
+
+    std::scoped_lock lock{loader.baked_micromaps_mutex};
+    loader.baked_micromaps.emplace_back(this, std::move(micromap));
+}
+
+void MeshPrimitive::GenerateLODs(SceneLoader& loader, std::span<const float> positions,
+                                 std::span<const u32> indices) {
+    const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                            LoadProfiler::Stage::LODGeneration};
+
+    const std::span<const u8> position_data{reinterpret_cast<const u8*>(positions.data()),
+                                            positions.size_bytes()};
+    const std::span<const u8> index_data{reinterpret_cast<const u8*>(indices.data()),
+                                         indices.size_bytes()};
+    const auto key = SceneCache::Hasher{"lod"}
+                         .Add(position_data)
+                         .Add(index_data)
+                         .AddValue(LODs::MaxLevels)
+                         .AddValue(LODs::Reduction)
+                         .AddValue(LODs::MinSaving)
+                         .AddValue(LODs::MaxError)
+                         .Get();
+
+    std::vector<u32_le> lod_indices; // Of every level, the full one first
+    bool cached = false;
+    if (const auto entry = loader.cache->Load(key)) {
+        if (entry->GetNumSections() == 2 && entry->GetSection(0).size() % sizeof(u32_le) == 0 &&
+            entry->GetSection(1).size() % sizeof(LOD) == 0) {
+            const auto cached_indices = entry->GetSection(0);
+            const auto cached_lods = entry->GetSection(1);
+            lod_indices.resize(cached_indices.size() / sizeof(u32_le));
+            std::memcpy(lod_indices.data(), cached_indices.data(), cached_indices.size());
+            lods.resize(cached_lods.size() / sizeof(LOD));
+            std::memcpy(lods.data(), cached_lods.data(), cached_lods.size());
+            cached = std::ranges::all_of(lods, [&lod_indices](const LOD& lod) {
+                return lod.first_index + lod.index_count <= lod_indices.size();
+            });
+        }
+        if (!cached) {
+            LOG_RATE_LIMITED(WARN, "Ignoring invalid cached LODs");
+            lods.clear();
+        }
+    }
+    if (!cached) {
+        std::array<float, 3> min_point;
+        min_point.fill(std::numeric_limits<float>::infinity());
+        std::array<float, 3> max_point;
+        max_point.fill(-std::numeric_limits<float>::infinity());
+        for (std::size_t i = 0; i + 2 < positions.size(); i += 3) {
+            for (std::size_t j = 0; j < 3; ++j) {
+                min_point[j] = std::min(min_point[j], positions[i + j]);
+                max_point[j] = std::max(max_point[j], positions[i + j]);
+            }
+        }
+        const float diagonal = std::hypot(max_point[0] - min_point[0],
+                                          max_point[1] - min_point[1],
+                                          max_point[2] - min_point[2]);
+
+        // Each level is simplified from the previous one, so their errors add up
+        lod_indices.resize(indices.size());
+        Common::CopyToLE(lod_indices, indices);
+        std::vector<u32> level(indices.begin(), indices.end());
+        float error = 0;
+        for (std::size_t i = 1; i < LODs::MaxLevels; ++i) {
+            const auto target_index_count =
+                static_cast<std::size_t>(static_cast<double>(level.size()) * LODs::Reduction);
+            auto simplified = Common::SimplifyMesh(positions, level, target_index_count,
+                                                   diagonal * LODs::MaxError - error);
+            if (simplified.indices.empty() ||
+                static_cast<double>(simplified.indices.size()) >
+                    static_cast<double>(level.size()) * (1.0 - LODs::MinSaving)) {
+                break;
+            }
+            error += simplified.error;
+            lods.push_back({
+                .first_index = static_cast<u32>(lod_indices.size()),
+                .index_count = static_cast<u32>(simplified.indices.size()),
+                .error = error,
+            });
+            const std::size_t first_index = lod_indices.size();
+            lod_indices.resize(first_index + simplified.indices.size());
+            Common::CopyToLE(std::span{lod_indices}.subspan(first_index), simplified.indices);
+            level = std::move(simplified.indices);
+        }
+
+        const std::array<std::span<const u8>, 2> sections{{
+            {reinterpret_cast<const u8*>(lod_indices.data()), lod_indices.size() * sizeof(u32_le)},
+            {reinterpret_cast<const u8*>(lods.data()), lods.size() * sizeof(LOD)},
+        }};
+        loader.cache->Store(key, sections);
+    }
+    if (lods.empty()) {
+        return;
+    }
+
+    index_buffer = std::make_shared<IndexBufferAccessor>();
+    index_buffer->name = "LODIndexBuffer";
+    index_buffer->gpu_buffer = loader.scene.index_heap->Upload(
+        {reinterpret_cast<const u8*>(lod_indices.data()), lod_indices.size() * sizeof(u32_le)});
+    index_buffer->component_type = GLTF::Accessor::ComponentType::UnsignedInt;
+    index_buffer->type = "SCALAR";
+    index_buffer->count = indices.size();
+}
+
+std::vector<MeshPrimitive::MeshletVertex> MeshPrimitive::LoadMeshletVertices(
+    SceneLoader& loader) const {
+    const MikkT::AttributeData position{loader, primitive.attributes.position};
+    const MikkT::AttributeData normal{loader, primitive.attributes.normal};
+    const MikkT::AttributeData texcoord_0{loader, primitive.attributes.texcoord_0};
+    const MikkT::AttributeData texcoord_1{loader, primitive.attributes.texcoord_1};
+    const MikkT::AttributeData color_0{loader, primitive.attributes.color_0};
+
+    std::vector<MeshletVertex> vertices(max_vertices);
+    for (std::size_t i = 0; i < vertices.size(); ++i) {
+        vertices[i] = {
+            .position = position.Load<3>(i),
+            .normal = normal.Load<3>(i),
+            .texcoord_0 = texcoord_0.Load<2>(i),
+            .texcoord_1 = texcoord_1.Load<2>(i),
         };
-        if (!primitive.attributes.color_0.has_value()) {
-            continue;
+        if (!color_0.values.empty()) {
+            vertices[i].color =
+                color_is_vec4 ? color_0.Load<4>(i) : glm::vec4{color_0.Load<3>(i), 1.0f};
         }
+    }
+    return vertices;
+}
+
+void MeshPrimitive::BuildMeshlets(SceneLoader& loader, std::vector<MeshletVertex> vertices,
+                                  std::span<const u32> indices) {
+    const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                            LoadProfiler::Stage::MeshletBuilding};
+
+    std::vector<u32> sequential_indices;
+    if (indices.empty()) {
+        sequential_indices.resize(vertices.size());
+        std::iota(sequential_indices.begin(), sequential_indices.end(), 0);
+        indices = sequential_indices;
+    }
+    if (std::ranges::any_of(indices, [&vertices](u32 idx) { return idx >= vertices.size(); })) {
+        SPDLOG_ERROR("Index out of range of the {} vertices", vertices.size());
+        throw std::runtime_error("Index out of range");
+    }
+
+    std::vector<float> positions(vertices.size() * 3);
+    for (std::size_t i = 0; i < vertices.size(); ++i) {
+        std::memcpy(&positions[i * 3], &vertices[i].position, sizeof(glm::vec3));
+    }
+    meshlets = Common::BuildMeshlets(positions, indices, MaxMeshletVertices, MaxMeshletTriangles);
+    meshlet_vertices = std::move(vertices);
+}
+
+// Reorders the triangles and vertices of the welded geometry, see SceneLoader::optimize_indices
+// and SceneLoader::spatial_order
+static void OptimizeGeometry(SceneLoader& loader, std::vector<MikkT::Vertex>& vertices,
+                             std::vector<u32_le>& indices) {
+    const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                            LoadProfiler::Stage::IndexOptimization,
+                                            indices.size() * sizeof(u32_le)};
+
+    std::vector<u32> optimized(indices.size());
+    const std::span<const u8> index_data{reinterpret_cast<const u8*>(indices.data()),
+                                         indices.size() * sizeof(u32_le)};
+    Common::ReadIndices(index_data, sizeof(u32_le), optimized);
+    std::vector<std::size_t> clusters;
+    if (loader.optimize_indices) {
+        optimized = Common::OptimizeVertexCache(optimized, vertices.size(), &clusters);
+    }
+
+    std::vector<float> positions(vertices.size() * 3);
+    for (std::size_t i = 0; i < vertices.size(); ++i) {
+        std::memcpy(&positions[i * 3], &vertices[i].position, sizeof(glm::vec3));
+    }
+    if (loader.spatial_order) {
+        Common::SortClustersSpatially(optimized, positions, clusters);
+    } else {
+        Common::OptimizeOverdraw(optimized, positions, clusters);
+    }
+
+    const auto old_vertices = Common::OptimizeVertexFetch(optimized, vertices.size());
+    std::vector<MikkT::Vertex> new_vertices(old_vertices.size());
+    for (std::size_t i = 0; i < old_vertices.size(); ++i) {
+        new_vertices[i] = vertices[old_vertices[i]];
+    }
+    vertices = std::move(new_vertices);
+    indices.resize(optimized.size());
+    Common::CopyToLE(indices, optimized);
+}
+
+// Generates the tangents of each corner with MikkTSpace, and welds the corners into vertices
+static void GenerateTangentsMikkT(SceneLoader& loader, MikkT::UserData& user_data,
+                                  std::vector<MikkT::Vertex>& vertices,
+                                  std::vector<u32_le>& indices) {
+    MikkT::GenerateTangents(user_data);
+    MikkT::WeldCorners(user_data, vertices, indices, loader.GetThreadPool());
+}
+
+void MeshPrimitiveGenerateTangent::Load(SceneLoader& loader) {
+    // This runs on the loader thread pool, one task per primitive
+    max_vertices = loader.gltf.accessors[*primitive.attributes.position].count;
+    const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                            LoadProfiler::Stage::TangentGeneration};
+    LOG_RATE_LIMITED(DEBUG, "Generating tangents for {} vertices", max_vertices);
+
+    // Load vertex data to CPU
+    const MikkT::AttributeData position{loader, primitive.attributes.position};
+    const MikkT::AttributeData normal{loader, primitive.attributes.normal};
+    const MikkT::AttributeData texcoord_0{loader, primitive.attributes.texcoord_0};
+    const MikkT::AttributeData texcoord_1{loader, primitive.attributes.texcoord_1};
+    const MikkT::AttributeData color_0{loader, primitive.attributes.color_0};
+    std::size_t color_components = 0;
+    if (primitive.attributes.color_0.has_value()) {
         const auto& accessor = loader.gltf.accessors[*primitive.attributes.color_0];
         if (accessor.type == "VEC3") {
-            old_vertices[i].color = {LoadVec<3>(loader, primitive.attributes.color_0, i), 1.0f};
+            color_components = 3;
         } else if (accessor.type == "VEC4") {
-            old_vertices[i].color = LoadVec<4>(loader, primitive.attributes.color_0, i);
+            color_components = 4;
         } else {
             SPDLOG_ERROR("Invalid accessor type {} for color", accessor.type);
             throw std::runtime_error("Invalid accessor type for color");
         }
     }
 
+    std::vector<MikkT::Vertex> old_vertices(max_vertices);
+    for (std::size_t i = 0; i < old_vertices.size(); ++i) {
+        old_vertices[i] = {
+            .position = position.Load<3>(i),
+            .normal = normal.Load<3>(i),
+            .texcoord_0 = texcoord_0.Load<2>(i),
+            .texcoord_1 = texcoord_1.Load<2>(i),
+        };
+        if (color_components == 3) {
+            old_vertices[i].color = {color_0.Load<3>(i), 1.0f};
+        } else if (color_components == 4) {
+            old_vertices[i].color = color_0.Load<4>(i);
+        }
+    }
+
     // Load index data to CPU
     std::vector<u32> old_indices;
     if (primitive.indices.has_value()) {
         const auto& index_data = loader.cpu_accessors.Get(loader, *primitive.indices)->data;
         const auto& accessor = loader.gltf.accessors[*primitive.indices];
-        old_indices.resize(accessor.count);
-        for (std::size_t i = 0; i < accessor.count; ++i) {
-            if (accessor.component_type == GLTF::Accessor::ComponentType::UnsignedByte) {
-                old_indices[i] = index_data[i];
-            } else if (accessor.component_type == GLTF::Accessor::ComponentType::UnsignedShort) {
-                old_indices[i] = index_data[2 * i] + (index_data[2 * i + 1] << static_cast<u16>(8));
-            } else if (accessor.component_type == GLTF::Accessor::ComponentType::UnsignedInt) {
-                old_indices[i] = index_data[4 * i] +
-                                 (index_data[4 * i + 1] << static_cast<u32>(8)) +
-                                 (index_data[4 * i + 2] << static_cast<u32>(16)) +
-                                 (index_data[4 * i + 3] << static_cast<u32>(24));
-            } else {
-                SPDLOG_ERROR(
-                    "Invalid component type for indices {}",
-                    static_cast<int>(GLTF::Accessor::ComponentType{accessor.component_type}));
-                throw std::runtime_error("Invalid component type for indices");
-            }
+        if (accessor.component_type != GLTF::Accessor::ComponentType::UnsignedByte &&
+            accessor.component_type != GLTF::Accessor::ComponentType::UnsignedShort &&
+            accessor.component_type != GLTF::Accessor::ComponentType::UnsignedInt) {
+            SPDLOG_ERROR("Invalid component type for indices {}",
+                         static_cast<int>(GLTF::Accessor::ComponentType{accessor.component_type}));
+            throw std::runtime_error("Invalid component type for indices");
         }
+        old_indices.resize(accessor.count);
+        Common::ReadIndices(index_data, GetComponentSize(accessor.component_type), old_indices);
     }
+    GenerateTangents(loader, std::move(old_vertices), std::move(old_indices));
+}
 
+void MeshPrimitiveGenerateTangent::GenerateTangents(SceneLoader& loader,
+                                                    std::vector<MikkT::Vertex> old_vertices,
+                                                    std::vector<u32> old_indices) {
     MikkT::UserData user_data{
         .vertices = old_vertices,
         .indices = old_indices,
         .tex_coord =
             loader.materials.Get(loader, *primitive.material).glsl_material.normal_texture_texcoord,
     };
-    const std::size_t total_vertices =
-        user_data.indices.empty() ? max_vertices : user_data.indices.size();
-    user_data.out.resize(total_vertices);
 
-    SMikkTSpaceInterface callbacks{
-        .m_getNumFaces = &MikkT::GetNumFaces,
-        .m_getNumVerticesOfFace = [](const SMikkTSpaceContext*, int) { return 3; },
-        .m_getPosition = &MikkT::GetPosition,
-        .m_getNormal = &MikkT::GetNormal,
-        .m_getTexCoord = &MikkT::GetTexCoord,
-        .m_setTSpaceBasic = &MikkT::SetTSpace,
+    // Huge primitives are done on the device, whose tangents differ slightly (see
+    // VulkanTangentGenerator)
+    const std::size_t num_triangles =
+        (old_indices.empty() ? old_vertices.size() : old_indices.size()) / 3;
+    const VulkanTangentGenerator::VertexLayout layout{
+        .stride = sizeof(MikkT::Vertex) / sizeof(float),
+        .position = offsetof(MikkT::Vertex, position) / sizeof(float),
+        .normal = offsetof(MikkT::Vertex, normal) / sizeof(float),
+        .texcoord = static_cast<u32>((user_data.tex_coord == 0
+                                          ? offsetof(MikkT::Vertex, texcoord_0)
+                                          : offsetof(MikkT::Vertex, texcoord_1)) /
+                                     sizeof(float)),
     };
-    SMikkTSpaceContext context{
-        .m_pInterface = &callbacks,
-        .m_pUserData = &user_data,
-    };
-    if (!genTangSpaceDefault(&context)) {
-        SPDLOG_ERROR("Failed to generate tangent space");
-        throw std::runtime_error("Failed to generate tangent space");
+    const bool on_device = loader.gpu_tangent_triangles != 0 &&
+                           num_triangles >= loader.gpu_tangent_triangles &&
+                           VulkanTangentGenerator::CanGenerate(loader.device, old_vertices.size(),
+                                                               layout, old_indices.size());
+
+    // The output only depends on these, so they are enough to identify it
+    const auto key = SceneCache::Hasher{"tangent"}
+                         .AddVector(old_vertices)
+                         .AddVector(old_indices)
+                         .AddValue(user_data.tex_coord)
+                         .AddValue(loader.optimize_indices)
+                         .AddValue(loader.spatial_order)
+                         .AddValue(on_device)
+                         .Get();
+    if (const auto entry = loader.cache->Load(key)) {
+        if (entry->GetNumSections() == 2 &&
+            entry->GetSection(0).size() % sizeof(MikkT::Vertex) == 0 &&
+            entry->GetSection(1).size() % sizeof(u32_le) == 0) {
+            Upload(loader, entry->GetSection(0), entry->GetSection(1));
+            return;
+        }
+        LOG_RATE_LIMITED(WARN, "Ignoring invalid cached tangents");
     }
 
-    // Reindex vertices
     std::vector<MikkT::Vertex> vertices;
     std::vector<u32_le> indices;
-    std::unordered_map<MikkT::Vertex, u32> vertex_index_map;
-    for (std::size_t i = 0; i < total_vertices; ++i) {
-        auto vertex = old_vertices.at(MikkT::GetVertexIndex(user_data, static_cast<int>(i)));
-        vertex.tangent = user_data.out[i];
-
-        if (!vertex_index_map.count(vertex)) {
-            vertices.emplace_back(vertex);
-            vertex_index_map.emplace(std::move(vertex), static_cast<u32>(vertices.size() - 1));
+    if (on_device) {
+        LOG_RATE_LIMITED(DEBUG, "Generating tangents for {} triangles on the device",
+                         num_triangles);
+        const auto tangents =
+            VulkanTangentGenerator{loader.device,
+                                   {reinterpret_cast<const float*>(old_vertices.data()),
+                                    old_vertices.size() * layout.stride},
+                                   layout, old_indices}
+                .Generate();
+        // The vertices are not split, so they are kept as they are
+        vertices = std::move(old_vertices);
+        for (std::size_t i = 0; i < vertices.size(); ++i) {
+            vertices[i].tangent = tangents[i];
+        }
+        if (old_indices.empty()) {
+            old_indices.resize(vertices.size());
+            std::iota(old_indices.begin(), old_indices.end(), 0);
         }
-        indices.emplace_back(vertex_index_map.at(vertex));
+        indices.resize(old_indices.size());
+        Common::CopyToLE(indices, old_indices);
+    } else {
+        GenerateTangentsMikkT(loader, user_data, vertices, indices);
+    }
+    if (loader.optimize_indices || loader.spatial_order) {
+        OptimizeGeometry(loader, vertices, indices);
     }
 
-    // Upload vertices & indices
-    vertex_buffers = {{std::make_shared<VulkanImmUploadBuffer>(
-        loader.device,
-        VulkanBufferCreateInfo{
-            .size = vertices.size() * sizeof(MikkT::Vertex),
-            .usage = loader.vertex_buffer_params.usage,
-            .dst_stage_mask = loader.vertex_buffer_params.dst_stage_mask,
-            .dst_access_mask = loader.vertex_buffer_params.dst_access_mask,
+    const std::span<const u8> vertex_data{reinterpret_cast<const u8*>(vertices.data()),
+                                          vertices.size() * sizeof(MikkT::Vertex)};
+    const std::span<const u8> index_data{reinterpret_cast<const u8*>(indices.data()),
+                                         indices.size() * sizeof(u32_le)};
+    const std::array<std::span<const u8>, 2> sections{vertex_data, index_data};
+    loader.cache->Store(key, sections);
+    Upload(loader, vertex_data, index_data);
+}
+
+void MeshPrimitiveGenerateTangent::UploadPackedVertices(SceneLoader& loader,
+                                                        std::span<const u8> vertices) {
+    std::vector<glm::vec3> positions(max_vertices);
+    std::vector<PackedVertex::Attributes> packed(max_vertices);
+    for (std::size_t i = 0; i < max_vertices; ++i) {
+        MikkT::Vertex vertex;
+        std::memcpy(&vertex, vertices.data() + i * sizeof(MikkT::Vertex), sizeof(vertex));
+        positions[i] = vertex.position;
+        packed[i] = PackedVertex::Pack(vertex);
+    }
+    vertex_buffers = {{
+        loader.scene.vertex_heap->Upload(
+            {reinterpret_cast<const u8*>(positions.data()), positions.size() * sizeof(glm::vec3)}),
+        loader.scene.vertex_heap->Upload({reinterpret_cast<const u8*>(packed.data()),
+                                          packed.size() * sizeof(PackedVertex::Attributes)}),
+    }};
+
+    const auto Attribute = [](u32 location, u32 binding, vk::Format format, u32 offset) {
+        return vk::VertexInputAttributeDescription2EXT{
+            .location = location,
+            .binding = binding,
+            .format = format,
+            .offset = offset,
+        };
+    };
+    // Locations are those of the MikkT::Vertex fields, see GetPrimitiveInfo
+    attributes = {
+        Attribute(0, 0, vk::Format::eR32G32B32Sfloat, 0),
+        Attribute(1, 1, vk::Format::eR16G16Snorm, offsetof(PackedVertex::Attributes, normal)),
+        Attribute(2, 1, vk::Format::eR16G16Sfloat,
+                  offsetof(PackedVertex::Attributes, texcoord_0)),
+        Attribute(3, 1, vk::Format::eR16G16Sfloat,
+                  offsetof(PackedVertex::Attributes, texcoord_1)),
+        Attribute(4, 1, vk::Format::eR8G8B8A8Unorm, offsetof(PackedVertex::Attributes, color)),
+        Attribute(5, 1, vk::Format::eR16G16Snorm, offsetof(PackedVertex::Attributes, tangent)),
+    };
+    bindings = {
+        {
+            .binding = 0,
+            .stride = sizeof(glm::vec3),
+            .inputRate = vk::VertexInputRate::eVertex,
+            .divisor = 1,
         },
-        reinterpret_cast<const u8*>(vertices.data()))}};
+        {
+            .binding = 1,
+            .stride = sizeof(PackedVertex::Attributes),
+            .inputRate = vk::VertexInputRate::eVertex,
+            .divisor = 1,
+        },
+    };
+}
 
-    static constexpr auto VertexAttributes = Helpers::AttributeDescriptionsFor<MikkT::Vertex>();
-    attributes.assign(VertexAttributes.begin(), VertexAttributes.end());
+void MeshPrimitiveGenerateTangent::Upload(SceneLoader& loader, std::span<const u8> vertices,
+                                          std::span<const u8> indices) {
+    // Welding may have split vertices with different tangents
+    max_vertices = vertices.size() / sizeof(MikkT::Vertex);
+    if (loader.vertex_buffer_params.usage &
+        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR) {
+        geometry_hash = SceneCache::Hasher{"generated_geometry"}.Add(vertices).Add(indices).Get();
+    }
 
-    bindings = {{
-        .binding = 0,
-        .stride = sizeof(MikkT::Vertex),
-        .inputRate = vk::VertexInputRate::eVertex,
-        .divisor = 1,
-    }};
-    raw_vertex_buffers = {{**vertex_buffers[0]}};
-    vertex_buffer_offsets = {{0}};
+    // Upload vertices & indices
+    if (loader.pack_vertices) {
+        UploadPackedVertices(loader, vertices);
+    } else {
+        vertex_buffers = {{loader.scene.vertex_heap->Upload(vertices)}};
+
+        static constexpr auto VertexAttributes =
+            Helpers::AttributeDescriptionsFor<MikkT::Vertex>();
+        attributes.assign(VertexAttributes.begin(), VertexAttributes.end());
+
+        bindings = {{
+            .binding = 0,
+            .stride = sizeof(MikkT::Vertex),
+            .inputRate = vk::VertexInputRate::eVertex,
+            .divisor = 1,
+        }};
+    }
+    raw_vertex_buffers.clear();
+    vertex_buffer_offsets.clear();
+    vertex_buffer_addresses.clear();
+    for (const auto& buffer : vertex_buffers) {
+        raw_vertex_buffers.emplace_back(**buffer);
+        vertex_buffer_offsets.emplace_back(buffer->offset);
+        vertex_buffer_addresses.emplace_back(buffer->address);
+    }
 
     index_buffer = std::make_shared<IndexBufferAccessor>();
     index_buffer->name = "GeneratedIndexBuffer";
-    index_buffer->gpu_buffer = std::make_shared<VulkanImmUploadBuffer>(
-        loader.device,
-        VulkanBufferCreateInfo{
-            .size = indices.size() * sizeof(u32_le),
-            .usage = loader.index_buffer_params.usage,
-            .dst_stage_mask = loader.index_buffer_params.dst_stage_mask,
-            .dst_access_mask = loader.index_buffer_params.dst_access_mask,
-        },
-        reinterpret_cast<const u8*>(indices.data()));
+    index_buffer->gpu_buffer = loader.scene.index_heap->Upload(indices);
     index_buffer->component_type = GLTF::Accessor::ComponentType::UnsignedInt;
     index_buffer->type = "SCALAR";
-    index_buffer->count = indices.size();
+    index_buffer->count = indices.size() / sizeof(u32_le);
+
+    const bool keep_host_geometry = loader.KeepsHostGeometry(primitive);
+    const bool bake_opacity_micromap = loader.BakesOpacityMicromap(primitive);
+    if (!loader.generate_lods && !loader.build_meshlets && !keep_host_geometry &&
+        !bake_opacity_micromap) {
+        return;
+    }
+    std::vector<u32> native_indices(index_buffer->count);
+    Common::ReadIndices(indices, sizeof(u32_le), native_indices);
+    if (bake_opacity_micromap) {
+        const bool texcoord_1 = loader.materials.Get(loader, *primitive.material)
+                                    .glsl_material.base_color_texture_texcoord == 1;
+        std::vector<float> texcoords(max_vertices * 2);
+        for (std::size_t i = 0; i < max_vertices; ++i) {
+            MikkT::Vertex vertex;
+            std::memcpy(&vertex, vertices.data() + i * sizeof(MikkT::Vertex), sizeof(vertex));
+            const glm::vec2& uv = texcoord_1 ? vertex.texcoord_1 : vertex.texcoord_0;
+            texcoords[i * 2] = uv.x;
+            texcoords[i * 2 + 1] = uv.y;
+        }
+        BakeOpacityMicromap(loader, texcoords, native_indices);
+    }
+    if (loader.generate_lods || keep_host_geometry) {
+        std::vector<float> positions(max_vertices * 3);
+        for (std::size_t i = 0; i < max_vertices; ++i) {
+            std::memcpy(&positions[i * 3], vertices.data() + i * sizeof(MikkT::Vertex),
+                        sizeof(glm::vec3));
+        }
+        if (loader.generate_lods) {
+            GenerateLODs(loader, positions, native_indices);
+        }
+        if (keep_host_geometry) {
+            host_positions = std::move(positions);
+            host_indices = native_indices;
+        }
+    }
+    if (loader.build_meshlets) {
+        std::vector<MeshletVertex> meshlet_vertex_data(max_vertices);
+        for (std::size_t i = 0; i < max_vertices; ++i) {
+            MikkT::Vertex vertex;
+            std::memcpy(&vertex, vertices.data() + i * sizeof(MikkT::Vertex), sizeof(vertex));
+            meshlet_vertex_data[i] = {
+                .position = vertex.position,
+                .normal = vertex.normal,
+                .texcoord_0 = vertex.texcoord_0,
+                .texcoord_1 = vertex.texcoord_1,
+                .color = vertex.color,
+            };
+        }
+        BuildMeshlets(loader, std::move(meshlet_vertex_data), native_indices);
+    }
 }
 
-Mesh::Mesh(SceneLoader& loader, const GLTF::Mesh& mesh) : name(mesh.name.value_or("Unnamed")) {
-    primitives = Common::VectorFromRange(
-        mesh.primitives |
-        std::views::transform(
-            [&loader](const GLTF::Mesh::Primitive& primitive) -> std::unique_ptr<MeshPrimitive> {
-                if (ShouldGenerateTangent(loader, primitive)) {
-                    return std::make_unique<MeshPrimitiveGenerateTangent>(loader, primitive);
-                } else {
-                    return std::make_unique<MeshPrimitive>(loader, primitive);
-                }
-            }));
+static bool IsDracoCompressed(const GLTF::Mesh::Primitive& primitive) {
+    return primitive.extensions.has_value() &&
+           primitive.extensions->draco_mesh_compression.has_value();
 }
 
-Mesh::~Mesh() = default;
+struct MeshPrimitiveDraco::Decoded {
+    std::once_flag flag;
+    std::exception_ptr error; // Rethrown by Load
+    std::vector<MikkT::Vertex> vertices;
+    std::vector<u32> indices;
+};
 
-void Mesh::Load(SceneLoader& loader) {
-    for (auto& primitive : primitives) {
-        primitive->Load(loader);
+// Decodes the compressed data, and the attributes it does not hold from their accessors
+static void DecodeDraco(SceneLoader& loader, const GLTF::Mesh::Primitive& primitive,
+                        std::vector<MikkT::Vertex>& vertices, std::vector<u32>& indices) {
+    if (primitive.mode != GLTF::Mesh::Primitive::Mode::Triangles) {
+        SPDLOG_ERROR("Draco compressed primitive is not a triangle list");
+        throw std::runtime_error("Draco compressed primitive is not a triangle list");
+    }
+    const auto& extension = *primitive.extensions->draco_mesh_compression;
+    const auto& buffer_view = loader.gltf.buffer_views.at(extension.buffer_view);
+    const auto& [buffer_file, view_offset] = loader.GetBufferViewData(buffer_view);
+    const auto data = buffer_file.GetSpan(view_offset, buffer_view.byte_length);
+    const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                            LoadProfiler::Stage::DracoDecode, data.size()};
+    const GLTF::Draco::DecodedMesh mesh{data};
+
+    using Attribute = std::optional<std::size_t>;
+    const auto LoadAttribute = [&loader, &mesh](const Attribute& accessor_idx,
+                                                const Attribute& id, u32 num_components) {
+        if (id.has_value()) {
+            return mesh.GetAttribute(static_cast<u32>(*id), num_components);
+        }
+        if (accessor_idx.has_value()) {
+            return loader.LoadFloatAccessor(loader.gltf.accessors[*accessor_idx]);
+        }
+        return std::vector<float>{};
+    };
+    const auto& accessors = primitive.attributes;
+    const auto& ids = extension.attributes;
+    const u32 color_components =
+        accessors.color_0.has_value() && loader.gltf.accessors[*accessors.color_0].type == "VEC3"
+            ? 3
+            : 4;
+    const auto position = LoadAttribute(accessors.position, ids.position, 3);
+    const auto normal = LoadAttribute(accessors.normal, ids.normal, 3);
+    const auto tangent = LoadAttribute(accessors.tangent, ids.tangent, 4);
+    const auto texcoord_0 = LoadAttribute(accessors.texcoord_0, ids.texcoord_0, 2);
+    const auto texcoord_1 = LoadAttribute(accessors.texcoord_1, ids.texcoord_1, 2);
+    const auto color_0 = LoadAttribute(accessors.color_0, ids.color_0, color_components);
+
+    const std::size_t num_points = mesh.GetNumPoints();
+    const auto Load = [num_points]<glm::length_t L>(const std::vector<float>& values,
+                                                    std::size_t idx, glm::vec<L, float>& out) {
+        if (values.size() < num_points * L) {
+            return;
+        }
+        for (glm::length_t i = 0; i < L; ++i) {
+            out[i] = values[idx * L + i];
+        }
+    };
+    vertices.resize(num_points);
+    for (std::size_t i = 0; i < num_points; ++i) {
+        auto& vertex = vertices[i];
+        Load(position, i, vertex.position);
+        Load(normal, i, vertex.normal);
+        Load(tangent, i, vertex.tangent);
+        Load(texcoord_0, i, vertex.texcoord_0);
+        Load(texcoord_1, i, vertex.texcoord_1);
+        if (color_components == 3) {
+            glm::vec3 color{1.0f};
+            Load(color_0, i, color);
+            vertex.color = {color, 1.0f};
+        } else {
+            Load(color_0, i, vertex.color);
+        }
+    }
+    indices = mesh.GetIndices();
+    if (std::ranges::any_of(indices, [num_points](u32 index) { return index >= num_points; })) {
+        SPDLOG_ERROR("Draco compressed primitive has indices out of range");
+        throw std::runtime_error("Draco compressed primitive has indices out of range");
     }
 }
 
-Camera::Camera(const glm::vec3& position, const glm::vec3& front, const glm::vec3& up) {
-    camera.perspective = {GLTF::Camera::Perspective{
-        .yfov = {glm::radians(45.0f)},
-        .znear = {0.01},
-    }};
-    view = glm::lookAt(position, position + front, up);
+MeshPrimitiveDraco::MeshPrimitiveDraco(SceneLoader& loader,
+                                       const GLTF::Mesh::Primitive& primitive_)
+    : MeshPrimitiveGenerateTangent(loader, primitive_), decoded(std::make_shared<Decoded>()),
+      generate_tangents(ShouldGenerateTangent(loader, primitive_)) {
+    // Decoding starts while the rest of the nodes are traversed. The loader outlives its tasks.
+    loader.RunTask([&loader, &primitive = primitive, decoded = decoded] {
+        std::call_once(decoded->flag, [&] {
+            try {
+                DecodeDraco(loader, primitive, decoded->vertices, decoded->indices);
+            } catch (...) {
+                decoded->error = std::current_exception();
+            }
+        });
+    });
 }
 
-Camera::Camera([[maybe_unused]] const SceneLoader& loader, const GLTF::Camera& camera_,
-               const glm::mat4& transform)
-    : name(camera_.name.value_or("Unnamed")), camera(camera_) {
-    view = glm::lookAt(glm::vec3{transform[3]}, glm::vec3{transform[3] - transform[2]},
-                       glm::normalize(glm::vec3{transform[1]}));
+MeshPrimitiveDraco::~MeshPrimitiveDraco() = default;
+
+bool MeshPrimitiveDraco::CanDecode(const GLTF::Mesh::Primitive& primitive) {
+    return IsDracoCompressed(primitive) && GLTF::Draco::IsSupported();
 }
 
-Camera::~Camera() = default;
+void MeshPrimitiveDraco::Load(SceneLoader& loader) {
+    // Also runs on the loader thread pool, which may not have started the task yet
+    std::call_once(decoded->flag, [this, &loader] {
+        DecodeDraco(loader, primitive, decoded->vertices, decoded->indices);
+    });
+    if (decoded->error) {
+        std::rethrow_exception(decoded->error);
+    }
+    auto vertices = std::move(decoded->vertices);
+    auto native_indices = std::move(decoded->indices);
+    max_vertices = vertices.size();
+    if (generate_tangents) {
+        const LoadProfiler::Scope profile_scope{loader.profiler.get(),
+                                                LoadProfiler::Stage::TangentGeneration};
+        GenerateTangents(loader, std::move(vertices), std::move(native_indices));
+        return;
+    }
 
-glm::mat4 Camera::GetProj(double default_aspect_ratio) const {
+    std::vector<u32_le> indices(native_indices.size());
+    Common::CopyToLE(indices, native_indices);
+    if (loader.optimize_indices || loader.spatial_order) {
+        OptimizeGeometry(loader, vertices, indices);
+    }
+    Upload(loader,
+           {reinterpret_cast<const u8*>(vertices.data()), vertices.size() * sizeof(MikkT::Vertex)},
+           {reinterpret_cast<const u8*>(indices.data()), indices.size() * sizeof(u32_le)});
+}
+
+// Without Draco, compressed primitives may still carry uncompressed fallback data in their
+// accessors.
+static void CheckDracoFallback(const SceneLoader& loader, const GLTF::Mesh::Primitive& primitive) {
+    if (!IsDracoCompressed(primitive)) {
+        return;
+    }
+
+    const std::array<std::optional<std::size_t>, 7> accessors{{
+        primitive.attributes.position,
+        primitive.attributes.normal,
+        primitive.attributes.tangent,
+        primitive.attributes.texcoord_0,
+        primitive.attributes.texcoord_1,
+        primitive.attributes.color_0,
+        primitive.indices,
+    }};
+    const bool has_fallback = std::ranges::all_of(accessors, [&loader](const auto& accessor) {
+        return !accessor.has_value() || loader.gltf.accessors[*accessor].buffer_view.has_value();
+    });
+    if (!has_fallback) {
+        SPDLOG_ERROR("Draco compressed primitive has no uncompressed fallback");
+        throw std::runtime_error("Built without ENABLE_DRACO, cannot decode Draco primitives");
+    }
+    LOG_RATE_LIMITED(WARN, "Built without ENABLE_DRACO, loading uncompressed Draco fallback");
+}
+
+Mesh::Mesh(SceneLoader& loader, const GLTF::Mesh& mesh) : name(mesh.name.value_or("Unnamed")) {
+    primitives = Common::VectorFromRange(
+        mesh.primitives |
+        std::views::transform(
+            [&loader](const GLTF::Mesh::Primitive& primitive) -> std::unique_ptr<MeshPrimitive> {
+                // Deformed along the vertices of the accessors, which neither welding nor
+                // Draco keeps in order
+                if (MeshPrimitive::IsDeformable(primitive)) {
+                    CheckDracoFallback(loader, primitive);
+                    return std::make_unique<MeshPrimitive>(loader, primitive);
+                }
+                if (MeshPrimitiveDraco::CanDecode(primitive)) {
+                    return std::make_unique<MeshPrimitiveDraco>(loader, primitive);
+                }
+                CheckDracoFallback(loader, primitive);
+                if (ShouldGenerateTangent(loader, primitive)) {
+                    return std::make_unique<MeshPrimitiveGenerateTangent>(loader, primitive);
+                } else {
+                    return std::make_unique<MeshPrimitive>(loader, primitive);
+                }
+            }));
+
+    GLSL::AABB mesh_bounds{
+        .min_point = glm::vec3{std::numeric_limits<float>::infinity()},
+        .max_point = glm::vec3{-std::numeric_limits<float>::infinity()},
+    };
+    for (const auto& primitive : mesh.primitives) {
+        const auto& position = primitive.attributes.position;
+        if (!position.has_value() || loader.gltf.accessors[*position].min.size() != 3 ||
+            loader.gltf.accessors[*position].max.size() != 3) {
+            SPDLOG_WARN("Positions of mesh {} have no bounds", name);
+            return;
+        }
+        const auto& accessor = loader.gltf.accessors[*position];
+        for (glm::length_t i = 0; i < 3; ++i) {
+            mesh_bounds.min_point[i] = std::min(mesh_bounds.min_point[i],
+                                                GLTF::DecodeFloatBound(accessor.min[i], accessor));
+            mesh_bounds.max_point[i] = std::max(mesh_bounds.max_point[i],
+                                                GLTF::DecodeFloatBound(accessor.max[i], accessor));
+        }
+    }
+    bounds = mesh_bounds;
+}
+
+Mesh::~Mesh() = default;
+
+void Mesh::Load(SceneLoader& loader) {
+    // Primitives generating tangents are expensive, so spread them out as well
+    loader.ParallelFor(primitives.size(),
+                       [this, &loader](std::size_t i) { primitives[i]->Load(loader); });
+}
+
+Camera::Camera(const glm::vec3& position, const glm::vec3& front, const glm::vec3& up,
+               float yfov) {
+    camera.perspective = {GLTF::Camera::Perspective{
+        .yfov = {yfov},
+        .znear = {0.01},
+    }};
+    view = glm::lookAt(position, position + front, up);
+}
+
+Camera::Camera(const GLTF::Camera& camera_, const glm::mat4& transform)
+    : name(camera_.name.value_or("Unnamed")), camera(camera_) {
+    SetTransform(transform);
+}
+
+Camera::~Camera() = default;
+
+void Camera::SetTransform(const glm::mat4& transform) {
+    view = glm::lookAt(glm::vec3{transform[3]}, glm::vec3{transform[3] - transform[2]},
+                       glm::normalize(glm::vec3{transform[1]}));
+}
+
+glm::mat4 Camera::GetProj(double default_aspect_ratio) const {
     glm::mat4 proj;
     if (camera.perspective.has_value()) {
         const double aspect_ratio = camera.perspective->aspect_ratio.value_or(default_aspect_ratio);
@@ -889,57 +2550,953 @@ double Camera::GetAspectRatio(double default_aspect_ratio) const {
     }
 }
 
+NodePose::NodePose(const GLTF::Node& node) {
+    if (node.matrix.has_value()) {
+        const glm::mat4& matrix = *node.matrix;
+        translation = glm::vec3{matrix[3]};
+        scale = {glm::length(glm::vec3{matrix[0]}), glm::length(glm::vec3{matrix[1]}),
+                 glm::length(glm::vec3{matrix[2]})};
+        if (glm::determinant(glm::mat3{matrix}) < 0) {
+            scale.x = -scale.x;
+        }
+        rotation = glm::normalize(glm::quat_cast(glm::mat3{glm::vec3{matrix[0]} / scale.x,
+                                                           glm::vec3{matrix[1]} / scale.y,
+                                                           glm::vec3{matrix[2]} / scale.z}));
+        return;
+    }
+    translation = node.translation.value_or(glm::vec3{});
+    if (node.rotation.has_value()) {
+        rotation = {node.rotation->w, node.rotation->x, node.rotation->y, node.rotation->z};
+    }
+    scale = node.scale.value_or(glm::vec3{1});
+}
+
+glm::mat4 NodePose::ToMatrix() const noexcept {
+    return glm::scale(glm::translate(glm::mat4{1}, translation) * glm::mat4_cast(rotation),
+                      scale);
+}
+
+Skin::Skin(SceneLoader& loader, const GLTF::Skin& skin)
+    : name(skin.name.value_or("Unnamed")), inverse_bind_matrices(skin.joints.size(), glm::mat4{1}) {
+    for (const std::size_t joint : skin.joints) {
+        if (joint >= loader.gltf.nodes.size()) {
+            SPDLOG_ERROR("Joint {} of skin {} out of range", joint, name);
+            throw std::runtime_error("Skin joint out of range");
+        }
+        joints.emplace_back(static_cast<u32>(joint));
+    }
+    if (!skin.inverse_bind_matrices.has_value()) {
+        return;
+    }
+
+    const auto& accessor = loader.gltf.accessors.at(*skin.inverse_bind_matrices);
+    if (accessor.type != "MAT4" || accessor.count != joints.size()) {
+        SPDLOG_ERROR("Inverse bind matrices of skin {} are not a MAT4 per joint", name);
+        throw std::runtime_error("Skin has mismatched inverse bind matrices");
+    }
+    // Column major, as in glm
+    const auto values = loader.LoadFloatAccessor(accessor);
+    std::memcpy(inverse_bind_matrices.data(), values.data(), values.size() * sizeof(float));
+}
+
+Skin::~Skin() = default;
+
+Animation::Animation(SceneLoader& loader, const GLTF::Animation& animation)
+    : name(animation.name.value_or("Unnamed")) {
+    for (const auto& gltf_channel : animation.channels) {
+        if (!gltf_channel.target.node.has_value()) {
+            continue;
+        }
+        Channel channel{.node = *gltf_channel.target.node};
+        std::string_view type;
+        if (gltf_channel.target.path == "translation") {
+            channel.path = Path::Translation;
+            type = "VEC3";
+        } else if (gltf_channel.target.path == "rotation") {
+            channel.path = Path::Rotation;
+            type = "VEC4";
+        } else if (gltf_channel.target.path == "scale") {
+            channel.path = Path::Scale;
+            type = "VEC3";
+        } else if (gltf_channel.target.path == "weights") {
+            channel.path = Path::Weights;
+            type = "SCALAR";
+        } else {
+            SPDLOG_WARN("Animation {} targets unsupported path {}, ignoring", name,
+                        std::string_view{gltf_channel.target.path});
+            continue;
+        }
+        if (channel.node >= loader.gltf.nodes.size() ||
+            gltf_channel.sampler >= animation.samplers.size()) {
+            SPDLOG_ERROR("Channel of animation {} out of range", name);
+            throw std::runtime_error("Animation channel out of range");
+        }
+
+        const auto& sampler = animation.samplers[gltf_channel.sampler];
+        const auto interpolation = sampler.interpolation.value_or("LINEAR");
+        std::size_t values_per_keyframe = 1;
+        if (interpolation == "STEP") {
+            channel.interpolation = Interpolation::Step;
+        } else if (interpolation == "LINEAR") {
+            channel.interpolation = Interpolation::Linear;
+        } else if (interpolation == "CUBICSPLINE") {
+            channel.interpolation = Interpolation::CubicSpline;
+            values_per_keyframe = 3;
+        } else {
+            SPDLOG_ERROR("Animation {} has unknown interpolation {}", name, interpolation);
+            throw std::runtime_error("Unknown animation interpolation");
+        }
+
+        if (sampler.input >= loader.gltf.accessors.size() ||
+            sampler.output >= loader.gltf.accessors.size()) {
+            SPDLOG_ERROR("Sampler of animation {} out of range", name);
+            throw std::runtime_error("Animation sampler out of range");
+        }
+        const auto& input = loader.gltf.accessors[sampler.input];
+        const auto& output = loader.gltf.accessors[sampler.output];
+        // Weights channels have as many scalars per keyframe as the mesh has morph targets
+        const std::size_t keyframe_values = input.count * values_per_keyframe;
+        channel.components = channel.path == Path::Weights
+                                 ? (keyframe_values ? output.count / keyframe_values : 0)
+                                 : (channel.path == Path::Rotation ? 4 : 3);
+        if (input.type != "SCALAR" || output.type != type || input.count == 0 ||
+            channel.components == 0 || output.count != keyframe_values * channel.components) {
+            SPDLOG_ERROR("Sampler of animation {} has mismatched accessors", name);
+            throw std::runtime_error("Animation sampler has mismatched accessors");
+        }
+        channel.times = loader.LoadFloatAccessor(input);
+        channel.values = loader.LoadFloatAccessor(output);
+        duration = std::max(duration, channel.times.back());
+        channels.emplace_back(std::move(channel));
+    }
+}
+
+Animation::~Animation() = default;
+
+void Animation::Sample(float time, std::span<NodePose> poses,
+                       Common::ThreadPool* thread_pool) const {
+    // Channels target different paths of each node, so they can be sampled in any order
+    const auto SampleAt = [this, time, poses](std::size_t i) {
+        SampleChannel(channels[i], time, poses[channels[i].node]);
+    };
+    if (thread_pool && channels.size() >= MinParallelChannels) {
+        thread_pool->ParallelFor(0, channels.size(), SampleAt);
+        return;
+    }
+    for (std::size_t i = 0; i < channels.size(); ++i) {
+        SampleAt(i);
+    }
+}
+
+// Of quaternions stored as xyzw, along the shorter arc
+static glm::vec4 Slerp(const glm::vec4& from, glm::vec4 to, float t) {
+    if (glm::dot(from, to) < 0) {
+        to = -to;
+    }
+    const glm::quat quat = glm::slerp(glm::quat{from.w, from.x, from.y, from.z},
+                                      glm::quat{to.w, to.x, to.y, to.z}, t);
+    return {quat.x, quat.y, quat.z, quat.w};
+}
+
+void Animation::SampleChannel(const Channel& channel, float time, NodePose& pose) {
+    if (channel.path == Path::Weights) {
+        SampleWeights(channel, time, pose.weights);
+        return;
+    }
+
+    const std::size_t components = channel.components;
+    const std::size_t stride = channel.interpolation == Interpolation::CubicSpline ? 3 : 1;
+    // Element j of keyframe k, where the value is element 1 of cubic splines
+    const auto Get = [&channel, components, stride](std::size_t k, std::size_t j) {
+        const float* value = channel.values.data() + (k * stride + j) * components;
+        return glm::vec4{value[0], value[1], value[2], components == 4 ? value[3] : 0.0f};
+    };
+    const std::size_t value_element = stride == 3 ? 1 : 0;
+
+    // Keyframes k and k + 1 surround the time
+    const auto next = std::ranges::upper_bound(channel.times, time);
+    glm::vec4 value;
+    if (next == channel.times.begin()) {
+        value = Get(0, value_element);
+    } else if (next == channel.times.end()) {
+        value = Get(channel.times.size() - 1, value_element);
+    } else {
+        const auto k = static_cast<std::size_t>(next - channel.times.begin()) - 1;
+        const float delta = channel.times[k + 1] - channel.times[k];
+        const float t = (time - channel.times[k]) / delta;
+        switch (channel.interpolation) {
+        case Interpolation::Step:
+            value = Get(k, 0);
+            break;
+        case Interpolation::Linear:
+            if (channel.path == Path::Rotation) {
+                value = Slerp(Get(k, 0), Get(k + 1, 0), t);
+            } else {
+                value = glm::mix(Get(k, 0), Get(k + 1, 0), t);
+            }
+            break;
+        case Interpolation::CubicSpline: {
+            // Hermite spline from the value and out-tangent of k to the in-tangent and value of
+            // k + 1, see Appendix C of the glTF Spec
+            const float t2 = t * t;
+            const float t3 = t2 * t;
+            value = (2 * t3 - 3 * t2 + 1) * Get(k, 1) + delta * (t3 - 2 * t2 + t) * Get(k, 2) +
+                    (-2 * t3 + 3 * t2) * Get(k + 1, 1) + delta * (t3 - t2) * Get(k + 1, 0);
+            break;
+        }
+        }
+    }
+
+    switch (channel.path) {
+    case Path::Translation:
+        pose.translation = glm::vec3{value};
+        break;
+    case Path::Rotation:
+        pose.rotation = glm::normalize(glm::quat{value.w, value.x, value.y, value.z});
+        break;
+    case Path::Scale:
+        pose.scale = glm::vec3{value};
+        break;
+    case Path::Weights:
+        break;
+    }
+}
+
+void Animation::SampleWeights(const Channel& channel, float time, std::vector<float>& weights) {
+    const std::size_t components = channel.components;
+    const std::size_t stride = channel.interpolation == Interpolation::CubicSpline ? 3 : 1;
+    // Weight i of element j of keyframe k, as in SampleChannel
+    const auto Get = [&channel, components, stride](std::size_t k, std::size_t j,
+                                                   std::size_t i) {
+        return channel.values[(k * stride + j) * components + i];
+    };
+    const std::size_t value_element = stride == 3 ? 1 : 0;
+
+    // Channels may drive fewer targets than the mesh has, or more, of which the extra are
+    // dropped
+    const std::size_t count = std::min(components, weights.size());
+    const auto next = std::ranges::upper_bound(channel.times, time);
+    if (next == channel.times.begin() || next == channel.times.end()) {
+        const std::size_t k = next == channel.times.begin() ? 0 : channel.times.size() - 1;
+        for (std::size_t i = 0; i < count; ++i) {
+            weights[i] = Get(k, value_element, i);
+        }
+        return;
+    }
+
+    const auto k = static_cast<std::size_t>(next - channel.times.begin()) - 1;
+    const float delta = channel.times[k + 1] - channel.times[k];
+    const float t = (time - channel.times[k]) / delta;
+    const float t2 = t * t;
+    const float t3 = t2 * t;
+    for (std::size_t i = 0; i < count; ++i) {
+        switch (channel.interpolation) {
+        case Interpolation::Step:
+            weights[i] = Get(k, 0, i);
+            break;
+        case Interpolation::Linear:
+            weights[i] = std::lerp(Get(k, 0, i), Get(k + 1, 0, i), t);
+            break;
+        case Interpolation::CubicSpline:
+            weights[i] = (2 * t3 - 3 * t2 + 1) * Get(k, 1, i) +
+                         delta * (t3 - 2 * t2 + t) * Get(k, 2, i) +
+                         (-2 * t3 + 3 * t2) * Get(k + 1, 1, i) +
+                         delta * (t3 - t2) * Get(k + 1, 0, i);
+            break;
+        }
+    }
+}
+
+std::size_t Animation::GetHostSize() const noexcept {
+    using Common::GetHeapSize;
+    std::size_t size = name.size() + GetHeapSize(channels);
+    for (const auto& channel : channels) {
+        size += GetHeapSize(channel.times) + GetHeapSize(channel.values);
+    }
+    return size;
+}
+
+// Number of EXT_mesh_gpu_instancing instances of the node, or nullopt if it is not instanced
+static std::optional<std::size_t> GetNumGPUInstances(const GLTF::GLTF& gltf,
+                                                     const GLTF::Node& node) {
+    if (!node.extensions.has_value() || !node.extensions->mesh_gpu_instancing.has_value()) {
+        return std::nullopt;
+    }
+    const auto& attributes = node.extensions->mesh_gpu_instancing->attributes;
+    std::optional<std::size_t> count;
+    for (const std::optional<std::size_t>& accessor_idx : std::array<std::optional<std::size_t>, 3>{
+             attributes.translation, attributes.rotation, attributes.scale}) {
+        if (!accessor_idx.has_value()) {
+            continue;
+        }
+        const std::size_t accessor_count = gltf.accessors.at(*accessor_idx).count;
+        if (count.has_value() && *count != accessor_count) {
+            SPDLOG_ERROR("Instancing accessors of node {} differ in count",
+                         node.name.value_or("Unnamed"));
+            throw std::runtime_error("Instancing accessors differ in count");
+        }
+        count = accessor_count;
+    }
+    return count;
+}
+
+// The KHR_lights_punctual light of the node, or null if it has none
+static const GLTF::Light* GetNodeLight(const GLTF::GLTF& gltf, const GLTF::Node& node) {
+    if (!node.extensions.has_value() || !node.extensions->lights_punctual.has_value()) {
+        return nullptr;
+    }
+    const std::size_t light_idx = node.extensions->lights_punctual->light;
+    if (!gltf.extensions.has_value() || !gltf.extensions->lights_punctual.has_value() ||
+        light_idx >= gltf.extensions->lights_punctual->lights.size()) {
+        SPDLOG_ERROR("Light {} of node {} out of range", light_idx,
+                     node.name.value_or("Unnamed"));
+        throw std::runtime_error("Light out of range");
+    }
+    return &gltf.extensions->lights_punctual->lights[light_idx];
+}
+
+// Moves the light to the world space transform of its node
+static void SetLightTransform(GLSL::PunctualLight& light, const glm::mat4& transform) {
+    light.position = glm::vec3{transform[3]};
+    light.direction = glm::normalize(glm::vec3{transform * glm::vec4{0, 0, -1, 0}});
+}
+
+static GLSL::PunctualLight GetPunctualLight(const GLTF::Light& light,
+                                            const glm::mat4& transform) {
+    GLSL::PunctualLight result{
+        .intensity = glm::vec3{light.color} * static_cast<float>(light.intensity),
+    };
+    if (light.type == "directional") {
+        result.type = PUNCTUAL_LIGHT_DIRECTIONAL;
+    } else if (light.type == "point") {
+        result.type = PUNCTUAL_LIGHT_POINT;
+    } else if (light.type == "spot") {
+        result.type = PUNCTUAL_LIGHT_SPOT;
+        // The defaults of the extension
+        const double inner_cone_angle = light.spot ? light.spot->inner_cone_angle : 0.0;
+        const double outer_cone_angle =
+            light.spot ? light.spot->outer_cone_angle : std::numbers::pi / 4;
+        result.cos_inner_cone = static_cast<float>(std::cos(inner_cone_angle));
+        result.cos_outer_cone = static_cast<float>(std::cos(outer_cone_angle));
+    } else {
+        SPDLOG_WARN("Light {} has unknown type {}, treated as a point light",
+                    light.name.value_or("Unnamed"), light.type);
+        result.type = PUNCTUAL_LIGHT_POINT;
+    }
+    result.range = static_cast<float>(light.range.value_or(0.0));
+    SetLightTransform(result, transform);
+    return result;
+}
+
+// Decodes the TRS of each instance into its transform, like GetNodeTransform.
+static void DecodeGPUInstances(SceneLoader& loader, const GLTF::Node& node,
+                               std::span<glm::mat4> out) {
+    const auto& attributes = node.extensions->mesh_gpu_instancing->attributes;
+    const auto Load = [&loader](const std::optional<std::size_t>& accessor_idx,
+                                std::string_view type) -> std::vector<float> {
+        if (!accessor_idx.has_value()) {
+            return {};
+        }
+        const auto& accessor = loader.gltf.accessors[*accessor_idx];
+        if (accessor.type != type) {
+            SPDLOG_ERROR("Instancing accessor {} is not a {}", *accessor_idx, type);
+            throw std::runtime_error("Instancing accessor has the wrong type");
+        }
+        return loader.LoadFloatAccessor(accessor);
+    };
+    const auto translations = Load(attributes.translation, "VEC3");
+    const auto rotations = Load(attributes.rotation, "VEC4");
+    const auto scales = Load(attributes.scale, "VEC3");
+    for (std::size_t i = 0; i < out.size(); ++i) {
+        glm::mat4 transform{1};
+        if (!translations.empty()) {
+            transform = glm::translate(transform, glm::vec3{translations[i * 3],
+                                                            translations[i * 3 + 1],
+                                                            translations[i * 3 + 2]});
+        }
+        if (!rotations.empty()) {
+            const glm::quat quat{rotations[i * 4 + 3], rotations[i * 4], rotations[i * 4 + 1],
+                                 rotations[i * 4 + 2]};
+            transform = transform * glm::mat4_cast(quat);
+        }
+        if (!scales.empty()) {
+            transform = glm::scale(transform,
+                                   glm::vec3{scales[i * 3], scales[i * 3 + 1], scales[i * 3 + 2]});
+        }
+        out[i] = transform;
+    }
+}
+
 SubScene::SubScene(SceneLoader& loader, const GLTF::Scene& scene)
     : name(scene.name.value_or("Unnamed")) {
-    for (const std::size_t node : scene.nodes) {
-        VisitNode(loader, node, glm::mat4{1});
+
+    // Depth first, without recursing as CAD scenes can be very deep
+    struct StackEntry {
+        u32 node{};
+        u32 parent{};
+        u32 depth{};
+    };
+    std::vector<StackEntry> stack;
+    for (auto it = scene.nodes.rbegin(); it != scene.nodes.rend(); ++it) {
+        stack.push_back({.node = static_cast<u32>(*it), .parent = NoParent});
+    }
+    std::vector<bool> visited(loader.gltf.nodes.size());
+    std::vector<u32> node_depths;
+    // glTF index of the nodes with GPU instances, and their first one
+    std::vector<std::pair<u32, u32>> gpu_instanced_nodes;
+    while (!stack.empty()) {
+        const auto [node_idx, parent, depth] = stack.back();
+        stack.pop_back();
+        if (node_idx >= visited.size()) {
+            SPDLOG_ERROR("Node {} out of range", node_idx);
+            throw std::runtime_error("Node out of range");
+        }
+        if (visited[node_idx]) {
+            SPDLOG_ERROR("Nodes formed a cycle");
+            throw std::runtime_error("Nodes formed a cycle");
+        }
+        visited[node_idx] = true;
+
+        const auto flattened_idx = static_cast<u32>(node_indices.size());
+        node_indices.emplace_back(node_idx);
+        node_parents.emplace_back(parent);
+        node_depths.emplace_back(depth);
+
+        const auto& node = loader.gltf.nodes[node_idx];
+        if (node.camera) {
+            camera_nodes.emplace_back(flattened_idx);
+        }
+        if (GetNodeLight(loader.gltf, node)) {
+            light_nodes.emplace_back(flattened_idx);
+        }
+        if (node.mesh) {
+            // Copies of the geometry of other meshes instance those instead
+            const auto mesh_idx = static_cast<u32>(
+                loader.meshes.GetIndex(loader, loader.GetUniqueMesh(*node.mesh)));
+            if (node.skin.has_value() && *node.skin >= loader.gltf.skins.size()) {
+                SPDLOG_ERROR("Skin {} out of range", *node.skin);
+                throw std::runtime_error("Skin out of range");
+            }
+            const u32 skin = node.skin.has_value() ? static_cast<u32>(*node.skin) : NoSkin;
+            if (const auto num_gpu_instances = GetNumGPUInstances(loader.gltf, node)) {
+                const auto first_gpu_instance = static_cast<u32>(gpu_instance_transforms.size());
+                gpu_instanced_nodes.emplace_back(node_idx, first_gpu_instance);
+                gpu_instance_transforms.resize(first_gpu_instance + *num_gpu_instances);
+                for (u32 i = 0; i < *num_gpu_instances; ++i) {
+                    instance_nodes.emplace_back(flattened_idx);
+                    instance_meshes.emplace_back(mesh_idx);
+                    instance_gpu_instances.emplace_back(first_gpu_instance + i);
+                    instance_skins.emplace_back(skin);
+                }
+            } else {
+                instance_nodes.emplace_back(flattened_idx);
+                instance_meshes.emplace_back(mesh_idx);
+                instance_gpu_instances.emplace_back(NoGPUInstance);
+                instance_skins.emplace_back(skin);
+            }
+        }
+        for (auto it = node.children.rbegin(); it != node.children.rend(); ++it) {
+            stack.push_back({
+                .node = static_cast<u32>(*it),
+                .parent = flattened_idx,
+                .depth = depth + 1,
+            });
+        }
     }
-    visited_nodes.clear();
+
+    // Counting sort by depth
+    const u32 num_levels =
+        node_depths.empty() ? 0 : *std::ranges::max_element(node_depths) + 1;
+    level_offsets.assign(num_levels + 1, 0);
+    for (const u32 depth : node_depths) {
+        ++level_offsets[depth + 1];
+    }
+    for (u32 i = 0; i < num_levels; ++i) {
+        level_offsets[i + 1] += level_offsets[i];
+    }
+    level_nodes.resize(node_indices.size());
+    std::vector<u32> level_ends(level_offsets.begin(), level_offsets.end() - 1);
+    for (u32 i = 0; i < node_depths.size(); ++i) {
+        level_nodes[level_ends[node_depths[i]]++] = i;
+    }
+
+    if (!loader.gltf.skins.empty()) {
+        flattened_nodes.assign(loader.gltf.nodes.size(), NoParent);
+        for (u32 i = 0; i < node_indices.size(); ++i) {
+            flattened_nodes[node_indices[i]] = i;
+        }
+    }
+
+    // Each node's instances are decoded in bulk, without creating a node for any of them
+    loader.ParallelFor(
+        gpu_instanced_nodes.size(), [this, &loader, &gpu_instanced_nodes](std::size_t i) {
+            const auto [node_idx, first] = gpu_instanced_nodes[i];
+            const std::size_t end = i + 1 < gpu_instanced_nodes.size()
+                                        ? gpu_instanced_nodes[i + 1].second
+                                        : gpu_instance_transforms.size();
+            DecodeGPUInstances(loader, loader.gltf.nodes[node_idx],
+                               std::span{gpu_instance_transforms}.subspan(first, end - first));
+        });
 }
 
 SubScene::~SubScene() = default;
 
-void SubScene::VisitNode(SceneLoader& loader, std::size_t node_idx, glm::mat4 parent_transform) {
-    if (visited_nodes.count(node_idx)) {
-        SPDLOG_ERROR("Nodes formed a cycle");
-        throw std::runtime_error("Nodes formed a cycle");
+void SubScene::SetPrimitiveRanges(const Scene& scene) {
+    instance_first_primitives.resize(instance_meshes.size());
+    instance_num_primitives.resize(instance_meshes.size());
+    for (std::size_t i = 0; i < instance_meshes.size(); ++i) {
+        const u32 mesh = instance_meshes[i];
+        instance_first_primitives[i] = scene.mesh_first_primitives[mesh];
+        instance_num_primitives[i] =
+            scene.mesh_first_primitives[mesh + 1] - scene.mesh_first_primitives[mesh];
     }
-    visited_nodes.emplace(node_idx);
-
-    const auto& node = loader.gltf.nodes[node_idx];
+}
 
-    auto transform = parent_transform;
+static glm::mat4 GetNodeTransform(const GLTF::Node& node) {
     if (node.matrix.has_value()) {
-        transform = transform * (*node.matrix);
-    } else {
-        if (node.translation.has_value()) {
-            transform = glm::translate(transform, (*node.translation));
+        return *node.matrix;
+    }
+    return NodePose{node}.ToMatrix();
+}
+
+// Transforms the center and the extents (Arvo's method), rather than all eight corners
+static GLSL::AABB TransformBounds(const GLSL::AABB& bounds, const glm::mat4& transform) {
+    const glm::vec3 center = (bounds.min_point + bounds.max_point) * 0.5f;
+    const glm::vec3 extents = (bounds.max_point - bounds.min_point) * 0.5f;
+    const glm::vec3 new_center{transform * glm::vec4{center, 1}};
+    const glm::mat3 abs_matrix{glm::abs(glm::vec3{transform[0]}),
+                               glm::abs(glm::vec3{transform[1]}),
+                               glm::abs(glm::vec3{transform[2]})};
+    const glm::vec3 new_extents = abs_matrix * extents;
+    return {
+        .min_point = new_center - new_extents,
+        .max_point = new_center + new_extents,
+    };
+}
+
+template <typename F>
+static void ForRange(Common::ThreadPool* thread_pool, std::size_t begin, std::size_t end,
+                     const F& func) {
+    if (thread_pool && end - begin >= SubScene::MinParallelSize) {
+        thread_pool->ParallelFor(begin, end, func);
+        return;
+    }
+    for (std::size_t i = begin; i < end; ++i) {
+        func(i);
+    }
+}
+
+void SubScene::UpdateTransforms(const GLTF::GLTF& gltf, const Scene& scene,
+                                Common::ThreadPool* thread_pool) {
+    node_transforms.resize(node_indices.size());
+    ForRange(thread_pool, 0, node_indices.size(), [this, &gltf](std::size_t i) {
+        node_transforms[i] = GetNodeTransform(gltf.nodes[node_indices[i]]);
+    });
+    PropagateTransforms(scene, thread_pool);
+
+    cameras.resize(camera_nodes.size());
+    for (std::size_t i = 0; i < camera_nodes.size(); ++i) {
+        const auto& node = gltf.nodes[node_indices[camera_nodes[i]]];
+        cameras[i] =
+            std::make_unique<Camera>(gltf.cameras[*node.camera], node_transforms[camera_nodes[i]]);
+    }
+    lights.resize(light_nodes.size());
+    for (std::size_t i = 0; i < light_nodes.size(); ++i) {
+        const auto& node = gltf.nodes[node_indices[light_nodes[i]]];
+        lights[i] = GetPunctualLight(*GetNodeLight(gltf, node), node_transforms[light_nodes[i]]);
+    }
+}
+
+void SubScene::UpdateTransforms(std::span<const glm::mat4> local_transforms, const Scene& scene,
+                                Common::ThreadPool* thread_pool) {
+    node_transforms.resize(node_indices.size());
+    ForRange(thread_pool, 0, node_indices.size(), [this, local_transforms](std::size_t i) {
+        node_transforms[i] = local_transforms[node_indices[i]];
+    });
+    PropagateTransforms(scene, thread_pool);
+
+    for (std::size_t i = 0; i < camera_nodes.size(); ++i) {
+        cameras[i]->SetTransform(node_transforms[camera_nodes[i]]);
+    }
+    for (std::size_t i = 0; i < light_nodes.size(); ++i) {
+        SetLightTransform(lights[i], node_transforms[light_nodes[i]]);
+    }
+}
+
+void SubScene::PropagateTransforms(const Scene& scene, Common::ThreadPool* thread_pool) {
+    // Parents into their children a level at a time
+    for (std::size_t level = 1; level + 1 < level_offsets.size(); ++level) {
+        ForRange(thread_pool, level_offsets[level], level_offsets[level + 1],
+                 [this](std::size_t i) {
+                     const u32 node = level_nodes[i];
+                     node_transforms[node] = node_transforms[node_parents[node]] *
+                                             node_transforms[node];
+                 });
+    }
+
+    instance_transforms.resize(instance_nodes.size());
+    instance_bounds.resize(instance_nodes.size());
+    ForRange(thread_pool, 0, instance_nodes.size(), [this, &scene](std::size_t i) {
+        instance_transforms[i] = node_transforms[instance_nodes[i]];
+        if (instance_gpu_instances[i] != NoGPUInstance) {
+            instance_transforms[i] *= gpu_instance_transforms[instance_gpu_instances[i]];
         }
-        if (node.rotation.has_value()) {
-            const glm::quat quat{node.rotation->x, node.rotation->y, node.rotation->z,
-                                 node.rotation->w};
-            transform = transform * glm::mat4_cast(quat);
+        const auto& mesh_bounds = scene.meshes[instance_meshes[i]]->bounds;
+        if (mesh_bounds.has_value()) {
+            instance_bounds[i] = TransformBounds(*mesh_bounds, instance_transforms[i]);
+        } else {
+            instance_bounds[i] = {
+                .min_point = glm::vec3{-std::numeric_limits<float>::infinity()},
+                .max_point = glm::vec3{std::numeric_limits<float>::infinity()},
+            };
+        }
+    });
+    instance_bvh = std::make_unique<InstanceBVH>(instance_bounds);
+}
+
+void SubScene::GetJointMatrices(std::size_t instance, const Scene& scene,
+                                std::vector<glm::mat4>& out) const {
+    const auto& skin = *scene.skins[instance_skins[instance]];
+    const glm::mat4 inverse_instance_transform = glm::inverse(instance_transforms[instance]);
+    out.resize(skin.joints.size());
+    for (std::size_t i = 0; i < skin.joints.size(); ++i) {
+        const u32 node = flattened_nodes[skin.joints[i]];
+        out[i] = node == NoParent ? glm::mat4{1}
+                                  : inverse_instance_transform * node_transforms[node] *
+                                        skin.inverse_bind_matrices[i];
+    }
+}
+
+void SubScene::SortInstances() {
+    glm::vec3 min_point{std::numeric_limits<float>::infinity()};
+    glm::vec3 max_point{-std::numeric_limits<float>::infinity()};
+    const auto GetCenter = [this](std::size_t i) {
+        return (instance_bounds[i].min_point + instance_bounds[i].max_point) * 0.5f;
+    };
+    for (std::size_t i = 0; i < instance_bounds.size(); ++i) {
+        const glm::vec3 center = GetCenter(i);
+        if (std::isfinite(center.x + center.y + center.z)) {
+            min_point = glm::min(min_point, center);
+            max_point = glm::max(max_point, center);
+        }
+    }
+    // Scaled uniformly, so that the cells of the curve stay cubes
+    const glm::vec3 extent = max_point - min_point;
+    const float scale = std::max({extent.x, extent.y, extent.z});
+    if (!(scale > 0) || !std::isfinite(scale)) {
+        return;
+    }
+
+    std::vector<u64> keys(instance_bounds.size()); // Code, then index to keep the order stable
+    for (std::size_t i = 0; i < instance_bounds.size(); ++i) {
+        const glm::vec3 center = GetCenter(i);
+        const glm::vec3 position = (center - min_point) / scale;
+        const u32 code = std::isfinite(center.x + center.y + center.z)
+                             ? Common::GetMortonCode(position.x, position.y, position.z)
+                             : std::numeric_limits<u32>::max();
+        keys[i] = (u64{code} << 32) | i;
+    }
+    std::ranges::sort(keys);
+
+    const auto Permute = [&keys]<typename T>(std::vector<T>& values) {
+        std::vector<T> sorted;
+        sorted.reserve(values.size());
+        for (const u64 key : keys) {
+            sorted.emplace_back(std::move(values[static_cast<u32>(key)]));
+        }
+        values = std::move(sorted);
+    };
+    Permute(instance_nodes);
+    Permute(instance_meshes);
+    Permute(instance_gpu_instances);
+    Permute(instance_first_primitives);
+    Permute(instance_num_primitives);
+    Permute(instance_transforms);
+    Permute(instance_bounds);
+    Permute(instance_skins);
+    instance_bvh = std::make_unique<InstanceBVH>(instance_bounds);
+}
+
+std::size_t SubScene::GetHostSize() const noexcept {
+    using Common::GetHeapSize;
+    std::size_t size = name.size() + GetHeapSize(cameras) + GetHeapSize(node_indices) +
+                       GetHeapSize(node_parents) + GetHeapSize(node_transforms) +
+                       GetHeapSize(instance_nodes) + GetHeapSize(instance_meshes) +
+                       GetHeapSize(instance_transforms) + GetHeapSize(instance_first_primitives) +
+                       GetHeapSize(instance_num_primitives) + GetHeapSize(instance_bounds) +
+                       GetHeapSize(camera_nodes) + GetHeapSize(gpu_instance_transforms) +
+                       GetHeapSize(instance_gpu_instances) + GetHeapSize(level_nodes) +
+                       GetHeapSize(level_offsets) + GetHeapSize(lights) +
+                       GetHeapSize(light_nodes) + GetHeapSize(instance_skins) +
+                       GetHeapSize(flattened_nodes);
+    for (const auto& camera : cameras) {
+        size += sizeof(Camera) + camera->name.size();
+    }
+    if (instance_bvh) {
+        size += sizeof(InstanceBVH) + instance_bvh->GetHostSize();
+    }
+    return size;
+}
+
+static std::size_t GetHostSize(const MeshPrimitive& primitive) {
+    using Common::GetHeapSize;
+    // Includes those of MeshPrimitiveGenerateTangent, which adds no data of its own
+    return sizeof(MeshPrimitive) + GetHeapSize(primitive.attributes) +
+           GetHeapSize(primitive.bindings) + GetHeapSize(primitive.raw_vertex_buffers) +
+           GetHeapSize(primitive.vertex_buffer_offsets) +
+           GetHeapSize(primitive.vertex_buffer_addresses) + GetHeapSize(primitive.vertex_buffers) +
+           GetHeapSize(primitive.lods) + GetHeapSize(primitive.meshlets.meshlets) +
+           GetHeapSize(primitive.meshlets.vertices) + GetHeapSize(primitive.meshlets.triangles) +
+           GetHeapSize(primitive.meshlet_vertices) + GetHeapSize(primitive.host_positions) +
+           GetHeapSize(primitive.host_indices) +
+           (primitive.deformation
+                ? sizeof(MeshPrimitive::Deformation) +
+                      GetHeapSize(primitive.deformation->skin_vertices) +
+                      GetHeapSize(primitive.deformation->morph_deltas)
+                : 0);
+}
+
+HostMemoryUsage GetHostMemory(const Scene& scene) {
+    using Common::GetHeapSize;
+    HostMemoryUsage memory{
+        .meshes = GetHeapSize(scene.meshes) + GetHeapSize(scene.mesh_first_primitives),
+        .nodes = GetHeapSize(scene.sub_scenes),
+        .materials = GetHeapSize(scene.textures) + GetHeapSize(scene.materials),
+    };
+    for (const auto& mesh : scene.meshes) {
+        memory.meshes += sizeof(Mesh) + mesh->name.size() + GetHeapSize(mesh->primitives);
+        for (const auto& primitive : mesh->primitives) {
+            memory.meshes += GetHostSize(*primitive);
+        }
+    }
+    for (const auto& sub_scene : scene.sub_scenes) {
+        memory.nodes += sizeof(SubScene) + sub_scene->GetHostSize();
+    }
+    memory.nodes += GetHeapSize(scene.animations) + GetHeapSize(scene.rest_poses) +
+                    GetHeapSize(scene.skins) + GetHeapSize(scene.node_weights);
+    for (const auto& animation : scene.animations) {
+        memory.nodes += sizeof(Animation) + animation->GetHostSize();
+    }
+    for (const auto& pose : scene.rest_poses) {
+        memory.nodes += GetHeapSize(pose.weights);
+    }
+    for (const auto& skin : scene.skins) {
+        memory.nodes += sizeof(Skin) + skin->name.size() + GetHeapSize(skin->joints) +
+                        GetHeapSize(skin->inverse_bind_matrices);
+    }
+    for (const auto& weights : scene.node_weights) {
+        memory.nodes += GetHeapSize(weights);
+    }
+    for (const auto& material : scene.materials) {
+        memory.materials += sizeof(Material) + material->name.size();
+    }
+    // Images and samplers can be shared by several textures
+    std::unordered_set<const void*> counted;
+    for (const auto& texture : scene.textures) {
+        memory.materials += sizeof(Texture) + texture->name.size();
+        if (texture->image && counted.insert(texture->image.get()).second) {
+            memory.materials += sizeof(Image) + texture->image->name.size();
+        }
+        if (texture->sampler && counted.insert(texture->sampler.get()).second) {
+            memory.materials += sizeof(Sampler) + texture->sampler->name.size();
+        }
+    }
+    if (scene.lazy_texture_loader) {
+        memory.pending_images = scene.lazy_texture_loader->GetPendingSize();
+    }
+    return memory;
+}
+
+void TrimHostMemory(Scene& scene) {
+    for (const auto& mesh : scene.meshes) {
+        for (const auto& primitive : mesh->primitives) {
+            primitive->meshlets = {};
+            primitive->meshlet_vertices = {};
+            primitive->host_positions = {};
+            primitive->host_indices = {};
+        }
+    }
+}
+
+// Of the locations of MeshPrimitive::attributes, in both the glTF and the packed layout
+constexpr std::array<const char*, 6> AttributeNames{
+    "POSITION", "NORMAL", "TEXCOORD_0", "TEXCOORD_1", "COLOR_0", "TANGENT",
+};
+
+static vk::DeviceSize GetLevelBytes(vk::Format format, u32 width, u32 height) {
+    const auto extent = vk::blockExtent(format);
+    return vk::DeviceSize{(width + extent[0] - 1) / extent[0]} *
+           ((height + extent[1] - 1) / extent[1]) * vk::blockSize(format);
+}
+
+SceneStats GetSceneStats(const Scene& scene, std::size_t sub_scene_idx) {
+    SceneStats stats{
+        .meshes = scene.meshes.size(),
+        .materials = scene.materials.size(),
+    };
+    std::vector<u64> mesh_triangles;
+    std::unordered_set<const IndexBufferAccessor*> counted_indices; // Shared by primitives
+    for (const auto& mesh : scene.meshes) {
+        u64 triangles = 0;
+        for (const auto& primitive : mesh->primitives) {
+            const auto& index_buffer = primitive->index_buffer;
+            triangles += (index_buffer ? index_buffer->count : primitive->max_vertices) / 3;
+            stats.vertices += primitive->max_vertices;
+            for (const auto& attribute : primitive->attributes) {
+                // Null bindings (of attributes it does not have) have no stride
+                if (attribute.location >= AttributeNames.size() ||
+                    primitive->bindings[attribute.binding].stride == 0) {
+                    continue;
+                }
+                stats.vertex_bytes[AttributeNames[attribute.location]] +=
+                    vk::DeviceSize{primitive->max_vertices} * vk::blockSize(attribute.format);
+            }
+            if (index_buffer && index_buffer->gpu_buffer &&
+                counted_indices.insert(index_buffer.get()).second) {
+                stats.index_bytes += index_buffer->gpu_buffer->size;
+            }
         }
-        if (node.scale.has_value()) {
-            transform = glm::scale(transform, (*node.scale));
+        stats.primitives += mesh->primitives.size();
+        stats.unique_triangles += triangles;
+        mesh_triangles.emplace_back(triangles);
+    }
+
+    if (sub_scene_idx < scene.sub_scenes.size()) {
+        const auto& sub_scene = *scene.sub_scenes[sub_scene_idx];
+        stats.instances = sub_scene.GetNumInstances();
+        for (std::size_t i = 0; i < sub_scene.GetNumInstances(); ++i) {
+            stats.instanced_triangles += mesh_triangles[sub_scene.instance_meshes[i]];
+            stats.draws += sub_scene.instance_num_primitives[i];
         }
     }
-    if (node.camera) {
-        cameras.emplace_back(
-            std::make_unique<Camera>(loader, loader.gltf.cameras[*node.camera], transform));
+
+    // Images can be shared by several textures
+    std::unordered_set<const Image*> counted;
+    for (const auto& texture : scene.textures) {
+        if (!texture->image || !counted.insert(texture->image.get()).second) {
+            continue;
+        }
+        const auto& loaded = texture->image->texture;
+        if (!loaded) {
+            ++stats.pending_images;
+            continue;
+        }
+        auto& format = stats.textures[loaded->format];
+        ++format.count;
+        format.level_bytes.resize(std::max<std::size_t>(format.level_bytes.size(),
+                                                        loaded->mip_levels));
+        for (u32 level = 0; level < loaded->mip_levels; ++level) {
+            format.level_bytes[level] +=
+                GetLevelBytes(loaded->format, std::max(loaded->width >> level, 1u),
+                              std::max(loaded->height >> level, 1u));
+        }
     }
-    if (node.mesh) {
-        mesh_instances.emplace_back(loader.meshes.Get(loader, *node.mesh), transform);
+    return stats;
+}
+
+std::string GetSceneStatsJSON(const SceneStats& stats) {
+    std::string json = fmt::format(
+        R"({{"meshes":{},"primitives":{},"materials":{},"instances":{},"draws":{},)"
+        R"("unique_triangles":{},"instanced_triangles":{},"vertices":{},"vertex_bytes":{{)",
+        stats.meshes, stats.primitives, stats.materials, stats.instances, stats.draws,
+        stats.unique_triangles, stats.instanced_triangles, stats.vertices);
+    bool first = true;
+    for (const auto& [attribute, bytes] : stats.vertex_bytes) {
+        json += fmt::format(R"({}"{}":{})", std::exchange(first, false) ? "" : ",", attribute,
+                            bytes);
     }
-    for (const std::size_t child : node.children) {
-        VisitNode(loader, child, transform);
+    json += fmt::format(R"(}},"index_bytes":{},"textures":{{)", stats.index_bytes);
+    first = true;
+    for (const auto& [format, texture_format] : stats.textures) {
+        json += fmt::format(R"({}"{}":{{"count":{},"level_bytes":[{}]}})",
+                            std::exchange(first, false) ? "" : ",", vk::to_string(format),
+                            texture_format.count, fmt::join(texture_format.level_bytes, ","));
     }
+    const auto AccelStructures = [](const SceneStats::AccelStructures& accel_structures) {
+        return fmt::format(R"({{"count":{},"build_bytes":{},"bytes":{}}})",
+                           accel_structures.count, accel_structures.build_bytes,
+                           accel_structures.bytes);
+    };
+    json += fmt::format(R"(}},"pending_images":{},"blases":{},"tlases":{}}})",
+                        stats.pending_images, AccelStructures(stats.blases),
+                        AccelStructures(stats.tlases));
+    return json;
 }
 
-void SubScene::Load(SceneLoader& loader) {
-    for (const auto& [mesh, _] : mesh_instances) {
-        mesh->Load(loader);
+// Records how each image is sampled by the materials, which decides its format.
+static std::vector<ImageUsage> GetImageUsages(const GLTF::GLTF& gltf) {
+    std::vector<ImageUsage> usages(gltf.images.size());
+    const auto MarkUsage = [&gltf, &usages](const auto& texture_info, bool ImageUsage::*flag) {
+        if (!texture_info.has_value()) {
+            return;
+        }
+        const std::size_t index = texture_info->index;
+        const auto& texture = gltf.textures.at(index);
+        if (texture.source.has_value()) {
+            usages.at(*texture.source).*flag = true;
+        }
+        if (texture.extensions.has_value() && texture.extensions->texture_basisu.has_value()) {
+            const std::size_t source = texture.extensions->texture_basisu->source;
+            usages.at(source).*flag = true;
+        }
+    };
+    for (const auto& material : gltf.materials) {
+        if (material.pbr.has_value()) {
+            MarkUsage(material.pbr->base_color_texture, &ImageUsage::color);
+            MarkUsage(material.pbr->metallic_roughness_texture, &ImageUsage::metallic_roughness);
+        }
+        MarkUsage(material.normal_texture, &ImageUsage::normal);
+        MarkUsage(material.occlusion_texture, &ImageUsage::occlusion);
+        MarkUsage(material.emissive_texture, &ImageUsage::color);
     }
+    return usages;
+}
+
+// Indexed like gltf.accessors, whether only triangle lists use it as indices, which may then be
+// reordered as they are drawn in no particular order
+static std::vector<bool> GetTriangleListIndices(const GLTF::GLTF& gltf) {
+    std::vector<bool> triangle_lists(gltf.accessors.size());
+    std::vector<bool> other_uses(gltf.accessors.size());
+    for (const auto& mesh : gltf.meshes) {
+        for (const auto& primitive : mesh.primitives) {
+            if (!primitive.indices.has_value()) {
+                continue;
+            }
+            const bool triangles = primitive.mode == GLTF::Mesh::Primitive::Mode::Triangles &&
+                                   primitive.attributes.position.has_value();
+            (triangles ? triangle_lists : other_uses).at(*primitive.indices) = true;
+        }
+    }
+    for (std::size_t i = 0; i < gltf.accessors.size(); ++i) {
+        using ComponentType = GLTF::Accessor::ComponentType;
+        const ComponentType component_type = gltf.accessors[i].component_type;
+        const bool index_type = component_type == ComponentType::UnsignedByte ||
+                                component_type == ComponentType::UnsignedShort ||
+                                component_type == ComponentType::UnsignedInt;
+        triangle_lists[i] = triangle_lists[i] && !other_uses[i] && index_type;
+    }
+    return triangle_lists;
+}
+
+static std::vector<std::size_t> GetIndexPositions(const GLTF::GLTF& gltf) {
+    // Unused ones are left as NoAccessor too
+    std::vector<std::size_t> positions(gltf.accessors.size(), SceneLoader::NoAccessor);
+    std::vector<bool> used(gltf.accessors.size());
+    for (const auto& mesh : gltf.meshes) {
+        for (const auto& primitive : mesh.primitives) {
+            if (!primitive.indices.has_value() || !primitive.attributes.position.has_value()) {
+                continue;
+            }
+            const std::size_t indices = *primitive.indices;
+            if (!used.at(indices)) {
+                used[indices] = true;
+                positions[indices] = *primitive.attributes.position;
+            } else if (positions[indices] != *primitive.attributes.position) {
+                positions[indices] = SceneLoader::NoAccessor;
+            }
+        }
+    }
+    return positions;
 }
 
 static std::pair<long, long> ParseVersion(const std::string_view& str) {
@@ -952,19 +3509,173 @@ static std::pair<long, long> ParseVersion(const std::string_view& str) {
             std::stoi(std::string{str.substr(pos + 1)})};
 }
 
+// The heap ranges the primitives of the mesh draw from
+static std::vector<std::shared_ptr<VulkanGeometryBuffer>> GetGeometryBuffers(const Mesh& mesh) {
+    std::vector<std::shared_ptr<VulkanGeometryBuffer>> buffers;
+    for (const auto& primitive : mesh.primitives) {
+        buffers.insert(buffers.end(), primitive->vertex_buffers.begin(),
+                       primitive->vertex_buffers.end());
+        if (primitive->index_buffer) {
+            buffers.emplace_back(primitive->index_buffer->gpu_buffer);
+        }
+    }
+    return buffers;
+}
+
+// Merges the materials the shaders cannot tell apart, e.g. duplicated by exporters, so that the
+// material buffers are smaller and more of the hits read the same materials. Takes their
+// indices from the glTF -> index map of the loader, and updates the primitives.
+static void DeduplicateMaterials(Scene& scene,
+                                 std::unordered_map<std::size_t, std::size_t>& material_indices) {
+    using Key = std::pair<std::array<u32, sizeof(GLSL::PackedMaterial) / sizeof(u32)>, bool>;
+    std::map<Key, std::size_t> unique_materials;
+    std::vector<std::unique_ptr<Material>> materials;
+    std::vector<std::size_t> remap(scene.materials.size());
+    for (std::size_t i = 0; i < scene.materials.size(); ++i) {
+        const auto packed = scene.materials[i]->GetPackedMaterial();
+        Key key{{}, scene.materials[i]->double_sided};
+        std::memcpy(key.first.data(), &packed, sizeof(packed));
+        const auto [it, inserted] = unique_materials.try_emplace(key, materials.size());
+        if (inserted) {
+            materials.emplace_back(std::move(scene.materials[i]));
+        }
+        remap[i] = it->second;
+    }
+    if (materials.size() == scene.materials.size()) {
+        return;
+    }
+    SPDLOG_INFO("Merged {} materials into {}", scene.materials.size(), materials.size());
+    scene.materials = std::move(materials);
+    for (auto& [gltf_idx, idx] : material_indices) {
+        idx = remap[idx];
+    }
+    for (const auto& mesh : scene.meshes) {
+        for (const auto& primitive : mesh->primitives) {
+            if (primitive->material != -1) {
+                primitive->material =
+                    static_cast<int>(remap[static_cast<std::size_t>(primitive->material)]);
+            }
+        }
+    }
+}
+
+GeometryRequirements& GeometryRequirements::operator|=(
+    const GeometryRequirements& other) noexcept {
+    const auto Merge = [](BufferParams& params, const BufferParams& other_params) {
+        params.usage |= other_params.usage;
+        params.dst_stage_mask |= other_params.dst_stage_mask;
+        params.dst_access_mask |= other_params.dst_access_mask;
+    };
+    Merge(vertex_buffer_params, other.vertex_buffer_params);
+    Merge(index_buffer_params, other.index_buffer_params);
+    keep_host_geometry |= other.keep_host_geometry;
+    keep_emissive_geometry |= other.keep_emissive_geometry;
+    bake_opacity_micromaps |= other.bake_opacity_micromaps;
+    return *this;
+}
+
 SceneLoader::SceneLoader(const BufferParams& vertex_buffer_params_,
                          const BufferParams& index_buffer_params_, Scene& scene_,
-                         VulkanDevice& device_, GLTF::Container& container_)
+                         VulkanDevice& device_, GLTF::Container& container_,
+                         Common::ThreadPool* thread_pool_, bool compress_textures_,
+                         vk::DeviceSize texture_budget, std::size_t num_frames_in_flight,
+                         bool lazy_textures_, bool generate_lods_, bool build_meshlets_,
+                         bool keep_host_geometry_, bool keep_emissive_geometry_,
+                         vk::DeviceSize geometry_budget, bool optimize_indices_,
+                         bool pack_vertices_, bool bake_opacity_micromaps_,
+                         const TextureQuality& texture_quality_,
+                         std::size_t gpu_tangent_triangles_, bool spatial_order_,
+                         vk::DeviceSize host_cache_budget, bool gpu_image_decode_,
+                         bool keep_host_textures_)
     : vertex_buffer_params(vertex_buffer_params_), index_buffer_params(index_buffer_params_),
-      scene(scene_), device(device_), container(container_) {
+      scene(scene_), device(device_), container(container_), compress_textures(compress_textures_),
+      lazy_textures(lazy_textures_), generate_lods(generate_lods_),
+      build_meshlets(build_meshlets_), keep_host_geometry(keep_host_geometry_),
+      keep_emissive_geometry(keep_emissive_geometry_), optimize_indices(optimize_indices_),
+      pack_vertices(pack_vertices_), bake_opacity_micromaps(bake_opacity_micromaps_),
+      texture_quality(texture_quality_), gpu_tangent_triangles(gpu_tangent_triangles_),
+      spatial_order(spatial_order_), gpu_image_decode(gpu_image_decode_),
+      keep_host_textures(keep_host_textures_), profiler(std::make_unique<LoadProfiler>()),
+      texture_upload_batch(std::make_unique<VulkanTextureUploadBatch>(device)),
+      cache(std::make_shared<SceneCache>(device.startup_path / u8"cache", thread_pool_)),
+      thread_pool(thread_pool_) {
+    PROFILE_SCOPE("SceneLoader");
+    // So that the peaks reported after loading are those of it
+    device.allocator->ResetPeakUsage();
+
+    if (geometry_budget != 0 && !device.sparse_buffer_residency) {
+        SPDLOG_WARN("Device does not support sparse buffers, geometry will not be streamed");
+        geometry_budget = 0;
+    }
+    const bool stream_geometry = geometry_budget != 0;
+    const auto heap_block_size = stream_geometry ? VulkanGeometryHeap::StreamingBlockSize
+                                                 : VulkanGeometryHeap::DefaultBlockSize;
+    const auto heap_cache = stream_geometry ? cache : nullptr;
+    scene.vertex_heap = std::make_unique<VulkanGeometryHeap>(
+        device, vertex_buffer_params.usage, vertex_buffer_params.dst_stage_mask,
+        vertex_buffer_params.dst_access_mask, heap_block_size, heap_cache);
+    scene.index_heap = std::make_unique<VulkanGeometryHeap>(
+        device, index_buffer_params.usage, index_buffer_params.dst_stage_mask,
+        index_buffer_params.dst_access_mask, heap_block_size, heap_cache);
+    if (texture_budget != 0 && !device.sparse_residency) {
+        SPDLOG_WARN("Device does not support sparse residency, textures will not be streamed");
+        texture_budget = 0;
+    }
+    // Only of use to the streamers
+    std::shared_ptr<VulkanHostCache> host_cache;
+    if (host_cache_budget != 0 && (stream_geometry || texture_budget != 0)) {
+        host_cache = std::make_shared<VulkanHostCache>(*device.allocator, host_cache_budget,
+                                                       num_frames_in_flight);
+    }
+    scene.geometry_streamer = std::make_unique<VulkanGeometryStreamer>(
+        device, geometry_budget, num_frames_in_flight, host_cache);
+    scene.texture_streamer = std::make_unique<VulkanTextureStreamer>(
+        device, texture_budget, num_frames_in_flight, host_cache);
+    if (lazy_textures) {
+        scene.lazy_texture_loader = std::make_unique<LazyTextureLoader>(device);
+    }
 
     const auto prev_current_path = std::filesystem::current_path();
-    if (container.path.has_parent_path()) {
+    if (container.uri.empty() && container.path.has_parent_path()) {
         std::filesystem::current_path(container.path.parent_path());
     }
     SCOPE_EXIT({ std::filesystem::current_path(prev_current_path); });
 
-    gltf = JSON::Deserialize<GLTF::GLTF>(container.json.get_value());
+    {
+        const LoadProfiler::Scope profile_scope{profiler.get(), LoadProfiler::Stage::JSONParse};
+        gltf = JSON::Deserialize<GLTF::GLTF>(container.json.get_value());
+    }
+    image_usages = GetImageUsages(gltf);
+    if (optimize_indices || spatial_order) {
+        triangle_list_indices = GetTriangleListIndices(gltf);
+    }
+    if (spatial_order) {
+        index_positions = GetIndexPositions(gltf);
+    }
+
+    if (bake_opacity_micromaps && !device.opacity_micromap) {
+        SPDLOG_WARN("Device does not support opacity micromaps, they will not be baked");
+        bake_opacity_micromaps = false;
+    }
+
+    if (compress_textures && !device.physical_device.getFeatures().textureCompressionBC) {
+        SPDLOG_WARN("Device does not support BC textures, images will not be compressed");
+        compress_textures = false;
+    }
+    texture_quality.dropped_levels += GetBudgetDroppedLevels(*this);
+    PrefetchSources(*this);
+
+    static constexpr std::array<std::string_view, 5> SupportedExtensions{
+        "EXT_mesh_gpu_instancing", "EXT_meshopt_compression", "KHR_lights_punctual",
+        "KHR_mesh_quantization", "KHR_texture_basisu"};
+    for (const auto& extension : gltf.extensions_required) {
+        if (extension == "KHR_draco_mesh_compression" && GLTF::Draco::IsSupported()) {
+            continue;
+        }
+        if (std::ranges::find(SupportedExtensions, extension) == SupportedExtensions.end()) {
+            SPDLOG_WARN("Required extension {} is not supported, scene may look wrong", extension);
+        }
+    }
 
     // Check GLTF version
     if (gltf.asset.min_version.has_value()) {
@@ -985,18 +3696,125 @@ SceneLoader::SceneLoader(const BufferParams& vertex_buffer_params_,
     }
 
     if (gltf.scene.has_value()) {
-        scene.main_sub_scene = std::make_unique<SubScene>(*this, gltf.scenes[*gltf.scene]);
-        scene.main_sub_scene->Load(*this);
+        // Wait for the tasks even when an exception is thrown, as they reference the loader
+        SCOPE_EXIT({
+            for (auto& task : pending_tasks) {
+                if (task.valid()) {
+                    task.wait();
+                }
+            }
+        });
+
+        {
+            const LoadProfiler::Scope profile_scope{profiler.get(),
+                                                    LoadProfiler::Stage::NodeTraversal};
+            if (*gltf.scene >= gltf.scenes.size()) {
+                SPDLOG_ERROR("Main scene {} out of range", *gltf.scene);
+                throw std::runtime_error("Main scene out of range");
+            }
+            scene.main_sub_scene = *gltf.scene;
+            for (const auto& gltf_scene : gltf.scenes) {
+                scene.sub_scenes.emplace_back(std::make_unique<SubScene>(*this, gltf_scene));
+            }
+            if (num_duplicate_meshes > 0) {
+                SPDLOG_INFO("Instancing {} meshes of the same geometry as others instead",
+                            num_duplicate_meshes);
+            }
+            scene.mesh_first_primitives.assign(1, 0);
+            for (const auto& mesh : scene.meshes) {
+                scene.mesh_first_primitives.emplace_back(scene.mesh_first_primitives.back() +
+                                                         static_cast<u32>(mesh->primitives.size()));
+            }
+            for (const auto& sub_scene : scene.sub_scenes) {
+                sub_scene->SetPrimitiveRanges(scene);
+                sub_scene->UpdateTransforms(gltf, scene, thread_pool);
+                if (spatial_order) {
+                    sub_scene->SortInstances();
+                }
+            }
+            for (const auto& animation : gltf.animations) {
+                scene.animations.emplace_back(std::make_unique<Animation>(*this, animation));
+            }
+            for (const auto& skin : gltf.skins) {
+                scene.skins.emplace_back(std::make_unique<Skin>(*this, skin));
+            }
+            // Nodes weigh the morph targets of their mesh themselves, or like the mesh does
+            const bool has_targets = std::ranges::any_of(gltf.meshes, [](const auto& mesh) {
+                return !mesh.primitives.empty() && !mesh.primitives[0].targets.empty();
+            });
+            if (has_targets) {
+                scene.node_weights = Common::VectorFromRange(
+                    gltf.nodes | std::views::transform([this](const GLTF::Node& node) {
+                        if (!node.mesh.has_value()) {
+                            return std::vector<float>{};
+                        }
+                        const auto& mesh = gltf.meshes.at(*node.mesh);
+                        const auto& weights = !node.weights.empty() ? node.weights : mesh.weights;
+                        std::vector<float> result(
+                            mesh.primitives.empty() ? 0 : mesh.primitives[0].targets.size());
+                        for (std::size_t i = 0; i < std::min(result.size(), weights.size()); ++i) {
+                            result[i] = static_cast<float>(weights[i]);
+                        }
+                        return result;
+                    }));
+            }
+            if (!scene.animations.empty()) {
+                scene.rest_poses = Common::VectorFromRange(
+                    gltf.nodes |
+                    std::views::transform([](const GLTF::Node& node) { return NodePose{node}; }));
+                for (std::size_t i = 0; i < scene.node_weights.size(); ++i) {
+                    scene.rest_poses[i].weights = scene.node_weights[i];
+                }
+            }
+
+            // Meshes may be instanced multiple times, in any of the sub scenes. They are only
+            // loaded once.
+            ParallelFor(scene.meshes.size(),
+                        [this](std::size_t i) { scene.meshes[i]->Load(*this); });
+        }
+        if (thread_pool) {
+            thread_pool->WaitAll(pending_tasks);
+        }
+        {
+            const LoadProfiler::Scope profile_scope{profiler.get(),
+                                                    LoadProfiler::Stage::UploadSubmit};
+            CreateArrayTextures(*this);
+            texture_upload_batch->Flush();
+            device.upload_ring->Flush();
+        }
+        if (!baked_micromaps.empty()) {
+            const auto sources = Common::VectorFromRange(
+                baked_micromaps | std::views::transform([](const auto& baked) {
+                    return static_cast<const Common::OpacityMicromap*>(&baked.second);
+                }));
+            auto micromaps = VulkanOpacityMicromap::Build(device, sources);
+            for (std::size_t i = 0; i < micromaps.size(); ++i) {
+                baked_micromaps[i].first->opacity_micromap = std::move(micromaps[i]);
+            }
+            baked_micromaps.clear();
+        }
+        scene.geometry_streamer->SetMeshes(Common::VectorFromRange(
+            scene.meshes | std::views::transform([](const std::unique_ptr<Mesh>& mesh) {
+                return GetGeometryBuffers(*mesh);
+            })));
+        scene.texture_streamer->SetTextures(Common::VectorFromRange(
+            scene.textures | std::views::transform([](const std::unique_ptr<Texture>& texture) {
+                return static_cast<const VulkanTexture*>(texture->image->texture.get());
+            })));
+        if (scene.lazy_texture_loader) {
+            scene.lazy_texture_loader->Start(scene);
+        }
     } else {
         SPDLOG_ERROR("No main scene in glTF");
         throw std::runtime_error("No main scene in glTF");
     }
 
-    if (scene.main_sub_scene->cameras.empty()) {
+    if (scene.sub_scenes[scene.main_sub_scene]->cameras.empty()) {
         SPDLOG_WARN("No camera in main scene, external camera will be used");
     }
 
-    // Add a default material
+    DeduplicateMaterials(scene, materials);
+    // Add a default material, which is kept last
     scene.materials.emplace_back(
         std::make_unique<Material>("Default", GLSL::Material{
                                                   .base_color_factor = glm::vec4{1, 1, 1, 1},
@@ -1007,10 +3825,234 @@ SceneLoader::SceneLoader(const BufferParams& vertex_buffer_params_,
                                                   .normal_texture_index = -1,
                                                   .occlusion_texture_index = -1,
                                                   .emissive_texture_index = -1,
+                                                  .alpha_cutoff = -1.0f,
                                                   .emissive_factor = glm::vec3{},
                                               }));
+    scene.material_indices = materials;
 }
 
 SceneLoader::~SceneLoader() = default;
 
+SceneLoader::BufferViewData SceneLoader::GetBufferViewData(const GLTF::BufferView& buffer_view) {
+    if (buffer_view.extensions.has_value() &&
+        buffer_view.extensions->meshopt_compression.has_value()) {
+        const auto idx = static_cast<std::size_t>(&buffer_view - gltf.buffer_views.data());
+        return {*decoded_buffer_views.Get(*this, idx), 0};
+    }
+    return {*buffer_files.Get(*this, buffer_view.buffer), buffer_view.byte_offset};
+}
+
+std::vector<float> SceneLoader::LoadFloatAccessor(const GLTF::Accessor& accessor) {
+    const std::size_t components = GLTF::GetComponentCount(accessor.type);
+    std::vector<float> out(accessor.count * components);
+    if (!accessor.buffer_view.has_value() || accessor.count == 0) {
+        return out;
+    }
+
+    const auto& buffer_view = gltf.buffer_views[*accessor.buffer_view];
+    const auto& [buffer_file, view_offset] = GetBufferViewData(buffer_view);
+    const std::size_t element_size = GetComponentSize(accessor.component_type) * components;
+    const std::size_t byte_stride = buffer_view.byte_stride.value_or(element_size);
+    const auto data = buffer_file.GetSpan(view_offset + accessor.byte_offset,
+                                          (accessor.count - 1) * byte_stride + element_size);
+    GLTF::DecodeFloatAccessor(data, byte_stride, accessor, out);
+    return out;
+}
+
+bool SceneLoader::OptimizesIndices(std::size_t accessor_idx) const {
+    return (optimize_indices || spatial_order) && triangle_list_indices.at(accessor_idx);
+}
+
+std::vector<u32> SceneLoader::LoadIndices(std::size_t accessor_idx) {
+    if (OptimizesIndices(accessor_idx)) {
+        const auto& indices = optimized_indices.Get(*this, accessor_idx)->indices;
+        return {indices.begin(), indices.end()};
+    }
+    const auto& accessor = gltf.accessors[accessor_idx];
+    std::vector<u32> indices(accessor.count);
+    Common::ReadIndices(cpu_accessors.Get(*this, accessor_idx)->data,
+                        GetComponentSize(accessor.component_type), indices);
+    return indices;
+}
+
+bool SceneLoader::BakesOpacityMicromap(const GLTF::Mesh::Primitive& primitive) const {
+    if (!bake_opacity_micromaps || !primitive.attributes.position.has_value() ||
+        primitive.mode != GLTF::Mesh::Primitive::Mode::Triangles ||
+        !primitive.material.has_value()) {
+        return false;
+    }
+    const auto& material = gltf.materials[*primitive.material];
+    if (material.alpha_mode != "MASK" || !material.pbr.has_value() ||
+        !material.pbr->base_color_texture.has_value()) {
+        return false;
+    }
+    const auto& texture_info = *material.pbr->base_color_texture;
+    const bool has_texcoord = texture_info.texcoord == 0
+                                  ? primitive.attributes.texcoord_0.has_value()
+                                  : texture_info.texcoord == 1 &&
+                                        primitive.attributes.texcoord_1.has_value();
+    if (!has_texcoord) {
+        return false;
+    }
+    if (primitive.attributes.color_0.has_value() &&
+        gltf.accessors[*primitive.attributes.color_0].type == "VEC4") {
+        return false;
+    }
+    return gltf.textures.at(texture_info.index).source.has_value();
+}
+
+bool SceneLoader::KeepsHostGeometry(const GLTF::Mesh::Primitive& primitive) const {
+    if (!primitive.attributes.position.has_value()) {
+        return false;
+    }
+    if (keep_host_geometry) {
+        return true;
+    }
+    if (!keep_emissive_geometry || !primitive.material.has_value()) {
+        return false;
+    }
+    const glm::vec3& emissive_factor = gltf.materials[*primitive.material].emissive_factor;
+    return emissive_factor != glm::vec3{};
+}
+
+std::shared_ptr<VulkanGeometryBuffer> SceneLoader::UploadUnique(
+    const SceneCache::Key& key,
+    const std::function<std::shared_ptr<VulkanGeometryBuffer>()>& upload) {
+    UniqueUpload* unique{};
+    {
+        std::scoped_lock lock{unique_uploads_mutex};
+        unique = &unique_uploads.try_emplace(key).first->second; // Nodes are stable
+    }
+    std::call_once(unique->flag, [&] { unique->buffer = upload(); });
+    return unique->buffer;
+}
+
+std::shared_ptr<Image> SceneLoader::GetImage(std::size_t idx) {
+    auto [it, inserted] = image_keys.try_emplace(idx);
+    if (inserted) {
+        const auto& image = gltf.images.at(idx);
+        SceneCache::Hasher hasher{"image"};
+        hasher.AddValue(image_usages.at(idx));
+        if (image.buffer_view.has_value()) {
+            const auto& buffer_view = gltf.buffer_views[*image.buffer_view];
+            const auto& [buffer_file, view_offset] = GetBufferViewData(buffer_view);
+            hasher.Add(buffer_file.GetSpan(view_offset, buffer_view.byte_length));
+        } else if (image.uri.has_value() && image.uri->starts_with("data:")) {
+            // The same contents encode to the same URI, which is cheaper to hash than to decode
+            hasher.Add({reinterpret_cast<const u8*>(image.uri->data()), image.uri->size()});
+        } else if (image.uri.has_value()) {
+            const BufferFile buffer_file{*image.uri, container.uri};
+            hasher.Add(buffer_file.GetSpan());
+        }
+        it->second = hasher.Get();
+    }
+
+    auto& unique = unique_images[it->second];
+    if (!unique) {
+        unique = std::make_shared<Image>(*this, gltf.images.at(idx), image_usages.at(idx));
+    }
+    return unique;
+}
+
+std::shared_ptr<Sampler> SceneLoader::GetSampler(std::size_t idx) {
+    const auto& sampler = gltf.samplers.at(idx);
+    const auto info = GetSamplerCreateInfo(*this, sampler);
+    auto& unique = unique_samplers[{info.magFilter, info.minFilter, info.mipmapMode,
+                                    info.addressModeU, info.addressModeV, info.maxLod}];
+    if (!unique) {
+        unique = std::make_shared<Sampler>(*this, sampler);
+    }
+    return unique;
+}
+
+std::size_t SceneLoader::GetUniqueMesh(std::size_t mesh_idx) {
+    if (const auto it = unique_mesh_indices.find(mesh_idx); it != unique_mesh_indices.end()) {
+        return it->second;
+    }
+
+    // Meshes often reference the same accessors, which are only hashed once
+    const auto AddAccessor = [this](SceneCache::Hasher& hasher,
+                                    const std::optional<std::size_t>& accessor_idx) {
+        if (!accessor_idx.has_value()) {
+            hasher.AddValue(NoAccessor);
+            return;
+        }
+        auto [it, inserted] = accessor_keys.try_emplace(*accessor_idx);
+        if (inserted) {
+            SceneCache::Hasher accessor_hasher{"accessor"};
+            AddAccessorData(*this, accessor_hasher, gltf.accessors.at(*accessor_idx));
+            it->second = accessor_hasher.Get();
+        }
+        hasher.AddValue(it->second);
+    };
+    SceneCache::Hasher hasher{"mesh"};
+    const auto& mesh = gltf.meshes.at(mesh_idx);
+    hasher.AddValue(static_cast<u64>(mesh.primitives.size()));
+    for (const auto& primitive : mesh.primitives) {
+        hasher.AddValue(static_cast<GLTF::Mesh::Primitive::Mode>(primitive.mode))
+            .AddValue(primitive.material.value_or(NoAccessor));
+        const auto& attributes = primitive.attributes;
+        AddAccessor(hasher, attributes.position);
+        AddAccessor(hasher, attributes.normal);
+        AddAccessor(hasher, attributes.tangent);
+        AddAccessor(hasher, attributes.texcoord_0);
+        AddAccessor(hasher, attributes.texcoord_1);
+        AddAccessor(hasher, attributes.color_0);
+        AddAccessor(hasher, attributes.joints_0);
+        AddAccessor(hasher, attributes.weights_0);
+        AddAccessor(hasher, primitive.indices);
+        hasher.AddValue(static_cast<u64>(primitive.targets.size()));
+        for (const auto& target : primitive.targets) {
+            AddAccessor(hasher, target.position);
+            AddAccessor(hasher, target.normal);
+            AddAccessor(hasher, target.tangent);
+        }
+        // The accessors of compressed primitives may have no data of their own
+        if (IsDracoCompressed(primitive)) {
+            const auto& extension = *primitive.extensions->draco_mesh_compression;
+            const auto& buffer_view = gltf.buffer_views.at(extension.buffer_view);
+            const auto& [buffer_file, view_offset] = GetBufferViewData(buffer_view);
+            hasher.Add(buffer_file.GetSpan(view_offset, buffer_view.byte_length));
+            const auto& ids = extension.attributes;
+            const std::array<std::optional<std::size_t>, 6> unique_ids{{
+                ids.position,
+                ids.normal,
+                ids.tangent,
+                ids.texcoord_0,
+                ids.texcoord_1,
+                ids.color_0,
+            }};
+            for (const auto& id : unique_ids) {
+                hasher.AddValue(id.value_or(NoAccessor));
+            }
+        }
+    }
+    const auto [it, inserted] = unique_meshes.try_emplace(hasher.Get(), mesh_idx);
+    if (!inserted) {
+        num_duplicate_meshes++;
+    }
+    unique_mesh_indices.emplace(mesh_idx, it->second);
+    return it->second;
+}
+
+void SceneLoader::RunTask(std::function<void()> task) {
+    if (!thread_pool) {
+        task();
+        return;
+    }
+    auto future = thread_pool->Submit(std::move(task));
+    std::scoped_lock lock{pending_tasks_mutex};
+    pending_tasks.emplace_back(std::move(future));
+}
+
+void SceneLoader::ParallelFor(std::size_t count, const std::function<void(std::size_t)>& func) {
+    if (!thread_pool) {
+        for (std::size_t i = 0; i < count; ++i) {
+            func(i);
+        }
+        return;
+    }
+    thread_pool->ParallelFor(0, count, func);
+}
+
 } // namespace Renderer
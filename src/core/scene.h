@@ -4,56 +4,134 @@
 
 #pragma once
 
-#include <fstream>
+#include <functional>
+#include <future>
 #include <limits>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
+#include <span>
 #include <string>
+#include <tuple>
 #include <unordered_map>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <boost/icl/interval_set.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
+#include "common/mapped_file.h"
+#include "common/meshlet_builder.h"
+#include "common/opacity_micromap.h"
 #include "common/pfr_helper.hpp"
 #include "core/gltf/gltf.h"
+#include "core/scene_cache.h"
+#include "core/shaders/mesh_deformation_glsl.h"
+#include "core/shaders/primitive_glsl.h"
 #include "core/shaders/scene_glsl.h"
 
+namespace Common {
+class RemoteFile;
+class ThreadPool;
+}
+
 namespace GLTF {
 class Container;
 }
 
 namespace Renderer {
 
+class InstanceBVH;
+class LazyTextureLoader;
+class LoadProfiler;
+class DecodedTexture;
 class VulkanBuffer;
 class VulkanDevice;
+class VulkanGeometryBuffer;
+class VulkanGeometryHeap;
+class VulkanGeometryStreamer;
+class VulkanOpacityMicromap;
 class VulkanTexture;
+class VulkanTextureStreamer;
+class VulkanTextureUploadBatch;
 
 class SceneLoader;
 
+namespace MikkT {
+struct Vertex;
+}
+
+/**
+ * Read-only view of a glTF buffer. External files are memory mapped, so accessors can be copied
+ * straight into staging memory without intermediate copies.
+ * The GLB BIN chunk is additionally copied into host visible memory in one sequential pass, and
+ * geometry accessors are then uploaded as GPU copies out of it.
+ * Buffer views compressed with EXT_meshopt_compression are decoded into a BufferFile of their
+ * own, which contains just the view.
+ * Base64 data URIs are decoded on demand, in blocks covering the requested ranges (so different
+ * accessors are decoded in parallel), and uploads decode straight into staging memory. The URI
+ * must then outlive the BufferFile.
+ * Remote files are fetched in blocks as their ranges are read, see Common::RemoteFile, as is
+ * the BIN chunk of a remote GLB. Thread safe.
+ */
 class BufferFile : NonCopyable {
 public:
-    explicit BufferFile(const std::string_view& uri);
+    // Blocks of decoded data URIs, as a whole number of base64 groups
+    static constexpr std::size_t Base64BlockSize = 3 * 16 * 1024;
+
+    // Relative URIs are resolved against base_uri if set, the GLTF::Container::uri of a remote
+    // glTF, and against the current directory otherwise
+    explicit BufferFile(const std::string_view& uri, std::string_view base_uri = {});
     explicit BufferFile(SceneLoader& loader, const GLTF::Buffer& buffer);
+    explicit BufferFile(SceneLoader& loader, const GLTF::BufferView& buffer_view);
     ~BufferFile();
 
-    void Load(const std::string_view& uri);
-    void Read(void* out, std::size_t size);
-    void Seek(std::size_t new_pos);
+    void Load(const std::string_view& uri, std::string_view base_uri = {});
+
+    std::size_t GetSize() const noexcept;
+    // Returns the bytes in [offset, offset + size). Throws if out of range.
+    std::span<const u8> GetSpan(std::size_t offset, std::size_t size) const;
+    std::span<const u8> GetSpan() const {
+        return GetSpan(0, GetSize());
+    }
+    // Starts reading the bytes in [offset, offset + size) from the file in the background, see
+    // Common::PrefetchMemory. Data URIs are in memory already, and remote files are fetched
+    // as read.
+    void Prefetch(std::size_t offset, std::size_t size) const;
+    // Uploads the bytes in [offset, offset + size) to the heap.
+    std::shared_ptr<VulkanGeometryBuffer> Upload(VulkanGeometryHeap& heap, std::size_t offset,
+                                                 std::size_t size) const;
+
+private:
+    void CheckRange(std::size_t offset, std::size_t size) const;
+    // Decodes [offset, offset + size) of the data URI into out.
+    void DecodeBase64(std::size_t offset, std::size_t size, u8* out) const;
 
-    std::vector<u8> data;
-    std::size_t pos = 0;
-    std::size_t file_size = 0;
+    std::span<const u8> contents; // Unless this is a data URI
+    std::pmr::vector<u8> data;    // Decoded buffer view, in the memory of the loader
+    std::unique_ptr<Common::MappedFile> mapped_file;
 
-    std::optional<std::ifstream> file;
-    std::size_t offset = 0;
+    // Remote only, with the range of the buffer in it
+    std::shared_ptr<const Common::RemoteFile> remote_file;
+    std::size_t remote_offset{};
+    std::size_t remote_size{};
+
+    std::string_view base64; // Data URI payload
+    std::size_t base64_size{};
+    // Not value-initialized, so that only the pages of decoded blocks become resident
+    std::unique_ptr<u8[]> base64_decoded;
+    std::unique_ptr<std::once_flag[]> base64_blocks;
+
+    const VulkanDevice* device{};
+    std::unique_ptr<VulkanBuffer> staging_buffer; // GLB BIN chunk only
 };
 
 class IndexBufferAccessor : NonCopyable {
 public:
     std::string name;
-    std::shared_ptr<VulkanBuffer> gpu_buffer;
+    std::shared_ptr<VulkanGeometryBuffer> gpu_buffer;
     GLTF::Accessor::ComponentType component_type{};
     std::string type;
     std::size_t count{};
@@ -75,7 +153,7 @@ public:
     void Load(SceneLoader& loader);
 
     struct BufferInfo {
-        const std::shared_ptr<VulkanBuffer>& buffer;
+        const std::shared_ptr<VulkanGeometryBuffer>& buffer;
         std::size_t buffer_offset{};
         std::size_t attribute_offset{};
     };
@@ -83,34 +161,59 @@ public:
     BufferInfo GetAccessorBufferInfo(const GLTF::Accessor& accessor) const;
 
 private:
+    void LoadImpl(SceneLoader& loader);
+
     const GLTF::BufferView& buffer_view;
+    std::once_flag load_flag;
     // Strided buffers
     boost::icl::interval_set<std::size_t> chunks;
     // Interval start element -> buffer
-    std::unordered_map<std::size_t, std::shared_ptr<VulkanBuffer>> buffers;
+    std::unordered_map<std::size_t, std::shared_ptr<VulkanGeometryBuffer>> buffers;
 
     // Non-strided buffers
     const GLTF::Accessor* non_strided_accessor{};
-    std::shared_ptr<VulkanBuffer> non_strided_buffer;
+    std::shared_ptr<VulkanGeometryBuffer> non_strided_buffer;
 };
 
 class Sampler : NonCopyable {
 public:
     std::string name;
     bool uses_mipmaps{};
+    vk::SamplerCreateInfo create_info; // Of sampler, e.g. for sampling the same on the host
     vk::raii::Sampler sampler = nullptr;
 
     explicit Sampler(const SceneLoader& loader, const GLTF::Sampler& sampler);
     ~Sampler();
 };
 
+// How the materials sample an image, which decides the format it is stored in.
+struct ImageUsage {
+    bool color{};              // Base color and emissive, sRGB encoded
+    bool normal{};             // RG only, B is reconstructed
+    bool occlusion{};          // R only
+    bool metallic_roughness{}; // GB only
+};
+
 class Image : NonCopyable {
 public:
     std::string name;
-    std::unique_ptr<VulkanTexture> texture;
+    std::unique_ptr<VulkanTexture> texture; // Null until loaded, with lazy textures
+    const VulkanTexture* placeholder{};     // Sampled until then
+    // RGBA8 of all levels at full resolution, sRGB if it is a color, kept on the CPU if the
+    // loader keeps host textures. Null otherwise, and for KTX2 and lazily loaded images.
+    std::unique_ptr<DecodedTexture> host_texture;
 
-    explicit Image(SceneLoader& loader, const GLTF::Image& image);
+    explicit Image(SceneLoader& loader, const GLTF::Image& image, const ImageUsage& usage);
     ~Image();
+
+    const VulkanTexture& GetTexture() const noexcept {
+        return texture ? *texture : *placeholder;
+    }
+
+private:
+    void LoadLazily(SceneLoader& loader, const GLTF::Image& image, const ImageUsage& usage);
+    // Into host_texture, if the loader keeps them
+    void KeepHostTexture(SceneLoader& loader, std::span<const u8> file_data, bool color);
 };
 
 class Texture : NonCopyable {
@@ -126,11 +229,21 @@ public:
 class Material : NonCopyable {
 public:
     std::string name;
-    GLSL::Material glsl_material;
+    GLSL::Material glsl_material{};
+    bool double_sided{}; // Back faces are visible too
 
     explicit Material(SceneLoader& loader, const GLTF::Material& material);
     explicit Material(std::string name, const GLSL::Material& glsl_material);
     ~Material();
+
+    // Takes the factors of the material, keeping the textures.
+    void UpdateFactors(const GLTF::Material& material);
+    // Whether it samples any texture when shading, e.g. to pick a specialized shader
+    bool IsTextured() const;
+    // Whether it is alpha tested (alphaMode MASK), so that its geometry is not opaque
+    bool IsAlphaMasked() const;
+    // As the material buffers of the renderers hold it
+    GLSL::PackedMaterial GetPackedMaterial() const;
 };
 
 class MeshPrimitive : NonCopyable {
@@ -141,14 +254,67 @@ public:
     std::vector<vk::VertexInputBindingDescription2EXT> bindings;
     std::vector<vk::Buffer> raw_vertex_buffers;
     std::vector<std::size_t> vertex_buffer_offsets;
+    // Per binding, if the vertex heap has device addresses (0 for null bindings)
+    std::vector<vk::DeviceAddress> vertex_buffer_addresses;
 
     // Keep them alive
-    std::vector<std::shared_ptr<VulkanBuffer>> vertex_buffers;
+    std::vector<std::shared_ptr<VulkanGeometryBuffer>> vertex_buffers;
     std::size_t max_vertices{}; // For ray tracing
     bool color_is_vec4{};       // For ray tracing
 
     std::shared_ptr<IndexBufferAccessor> index_buffer;
 
+    // Of the positions and indices, identifying the acceleration structures built from them.
+    // Only set when the vertex heap is an acceleration structure build input.
+    SceneCache::Key geometry_hash{};
+
+    // Levels of detail generated for the rasterizer, coarser ones after the full one. Their
+    // indices follow those of the full primitive (index_buffer->count) in the index buffer.
+    struct LOD {
+        u32 first_index{}; // From the start of the index buffer
+        u32 index_count{};
+        float error{}; // Distance the surface has moved, in mesh space
+    };
+    std::vector<LOD> lods; // Coarser levels only, empty unless generated
+
+    // Meshlets for the mesh shading path, which pulls the vertices itself, so they are decoded
+    // into a single layout. Kept on the CPU for the renderer to upload, empty unless built.
+    struct MeshletVertex {
+        glm::vec3 position{};
+        glm::vec3 normal{};
+        glm::vec2 texcoord_0{};
+        glm::vec2 texcoord_1{};
+        glm::vec4 color{1.0f};
+    };
+    static_assert(sizeof(MeshletVertex) == 14 * sizeof(float));
+    // Outputs of the mesh shader, see meshlet.mesh
+    static constexpr std::size_t MaxMeshletVertices = 64;
+    static constexpr std::size_t MaxMeshletTriangles = 124;
+    Common::MeshletMesh meshlets;
+    std::vector<MeshletVertex> meshlet_vertices; // Indexed by meshlets.vertices
+
+    // The positions (XYZ triples, dequantized) and indices (empty if not indexed) kept on the CPU,
+    // e.g. for building acceleration structures on the host. Empty unless kept.
+    std::vector<float> host_positions;
+    std::vector<u32> host_indices;
+
+    // Of the triangles, for their geometry in acceleration structures to resolve most of the
+    // alpha test without any-hit shaders. Null unless baked, see SceneLoader::BakesOpacityMicromap.
+    std::unique_ptr<VulkanOpacityMicromap> opacity_micromap;
+
+    // Of primitives that a skin or morph targets may deform, decoded on the CPU for the
+    // renderers to upload, see VulkanMeshDeformer. Their vertices are those of the accessors in
+    // order, as such primitives are neither welded nor decompressed. Null for the rest.
+    struct Deformation {
+        // Of each vertex, empty unless it has JOINTS_0 and WEIGHTS_0
+        std::vector<GLSL::SkinVertex> skin_vertices;
+        u32 max_joint{}; // Referenced by any of them, to check it against the skin
+        // Of each vertex of each target in turn
+        std::vector<GLSL::MorphDelta> morph_deltas;
+        u32 num_targets{};
+    };
+    std::unique_ptr<Deformation> deformation;
+
     explicit MeshPrimitive(const GLTF::Mesh::Primitive& primitive);
     explicit MeshPrimitive(SceneLoader& loader, const GLTF::Mesh::Primitive& primitive);
     virtual ~MeshPrimitive();
@@ -156,21 +322,83 @@ public:
     // Actually load the data. Must be called after vertex buffers have been loaded.
     virtual void Load(SceneLoader& loader);
 
+    // For pulling the vertices in shaders. The vertex heap must have device addresses.
+    GLSL::PrimitiveInfo GetPrimitiveInfo() const;
+    // Whether the attributes it has are all 32-bit floats, without vertex colors, so that
+    // shaders specialized for them can skip the type switches
+    bool HasFloatAttributes() const;
+    // Whether it has skinning attributes or morph targets, see deformation
+    static bool IsDeformable(const GLTF::Mesh::Primitive& primitive);
+
 protected:
+    // Replaces quantized positions with float copies
+    void DequantizePositions(SceneLoader& loader);
+    // Simplifies the primitive into the LODs, replacing the index buffer with one of 32-bit
+    // indices that also holds them. positions are XYZ triples.
+    void GenerateLODs(SceneLoader& loader, std::span<const float> positions,
+                      std::span<const u32> indices);
+    // Splits the triangle list into the meshlets. An empty index list draws the vertices in
+    // order.
+    void BuildMeshlets(SceneLoader& loader, std::vector<MeshletVertex> vertices,
+                       std::span<const u32> indices);
+    // Decodes the vertex attributes of the glTF primitive
+    std::vector<MeshletVertex> LoadMeshletVertices(SceneLoader& loader) const;
+    // Bakes the opacity micromap of the triangle list (or of the vertices in order, if indices
+    // is empty), which the loader builds once all meshes are loaded. texcoords are the UV pairs
+    // of the vertices that the base color texture samples.
+    void BakeOpacityMicromap(SceneLoader& loader, std::span<const float> texcoords,
+                             std::span<const u32> indices);
+    // Decodes the skinning attributes and morph targets into deformation
+    void LoadDeformation(SceneLoader& loader);
+
     const GLTF::Mesh::Primitive& primitive;
 };
 
 // Represents an accessor with its data loaded in CPU. Used while generating tangents.
 class CPUAccessor : NonCopyable {
 public:
-    std::vector<u8> data;
+    std::pmr::vector<u8> data; // In the memory of the loader
 
     explicit CPUAccessor(SceneLoader& loader, const GLTF::Accessor& accessor);
     ~CPUAccessor();
 };
 
+/// The alpha channel of an image, for baking opacity micromaps. The image is only decoded when
+/// a bake misses the cache, which is keyed by the file instead.
+class AlphaMaskImage : NonCopyable {
+public:
+    SceneCache::Key key; // Of the file
+
+    explicit AlphaMaskImage(SceneLoader& loader, const GLTF::Image& image);
+    ~AlphaMaskImage();
+
+    // Decodes the image on first use. Empty if it is not decoded (KTX2).
+    const std::pmr::vector<u8>& GetAlpha(SceneLoader& loader, u32& width, u32& height);
+
+private:
+    const GLTF::Image& image;
+    std::once_flag decode_flag;
+    u32 width{};
+    u32 height{};
+    std::pmr::vector<u8> alpha; // In the memory of the loader, a byte per texel
+};
+
+/// The indices of a triangle list accessor reordered for the post-transform vertex cache (see
+/// Common::OptimizeVertexCache) and/or along a space filling curve (see
+/// Common::SortClustersSpatially), which replace those of the accessor when
+/// SceneLoader::OptimizesIndices. Cached in the scene cache.
+class OptimizedIndices : NonCopyable {
+public:
+    std::pmr::vector<u32> indices; // In the memory of the loader
+
+    explicit OptimizedIndices(SceneLoader& loader, const GLTF::Accessor& accessor);
+    ~OptimizedIndices();
+};
+
 /// This should be used when it's necessary to generate the tangents. In this case, vertex buffers
-/// will be loaded to the CPU, and the index list will be regenerated
+/// will be loaded to the CPU, and the index list will be regenerated. When the loader packs
+/// vertices, the attributes other than the position take 20 bytes per vertex instead of 60:
+/// octahedral normals and tangents, half float texcoords and RGBA8 colors.
 class MeshPrimitiveGenerateTangent : public MeshPrimitive {
 public:
     explicit MeshPrimitiveGenerateTangent(SceneLoader& loader,
@@ -179,12 +407,47 @@ public:
 
     // Actually load the data. Must be called after vertex buffers have been loaded.
     void Load(SceneLoader& loader) override;
+
+protected:
+    // Generates the tangents of the vertices (replacing theirs), welds and uploads them. Empty
+    // indices draw the vertices in order.
+    void GenerateTangents(SceneLoader& loader, std::vector<MikkT::Vertex> old_vertices,
+                          std::vector<u32> old_indices);
+    // vertices and indices are MikkT::Vertex and u32_le
+    void Upload(SceneLoader& loader, std::span<const u8> vertices, std::span<const u8> indices);
+
+private:
+    void UploadPackedVertices(SceneLoader& loader, std::span<const u8> vertices);
+};
+
+/// A primitive compressed with KHR_draco_mesh_compression, when the loader is built with Draco
+/// (ENABLE_DRACO). Its data is decoded in a task of the loader as soon as it is created, which
+/// Load waits for (or decodes itself, if the task has not started yet). The decoded vertices
+/// are then uploaded like those of MeshPrimitiveGenerateTangent, generating their tangents when
+/// it would.
+class MeshPrimitiveDraco : public MeshPrimitiveGenerateTangent {
+public:
+    explicit MeshPrimitiveDraco(SceneLoader& loader, const GLTF::Mesh::Primitive& primitive);
+    ~MeshPrimitiveDraco() override;
+
+    void Load(SceneLoader& loader) override;
+
+    // Whether the primitive is compressed and can be decoded
+    static bool CanDecode(const GLTF::Mesh::Primitive& primitive);
+
+private:
+    struct Decoded;
+    // Shared with the task, which may outlive a primitive whose mesh fails to load
+    std::shared_ptr<Decoded> decoded;
+    bool generate_tangents{};
 };
 
 class Mesh : NonCopyable {
 public:
     std::string name;
     std::vector<std::unique_ptr<MeshPrimitive>> primitives;
+    // In local space. Unset if the positions of a primitive do not have their min and max.
+    std::optional<GLSL::AABB> bounds;
 
     explicit Mesh(SceneLoader& loader, const GLTF::Mesh& mesh);
     ~Mesh();
@@ -197,55 +460,417 @@ public:
     std::string name;
     glm::mat4 view;
 
-    // Default perspective camera
-    explicit Camera(const glm::vec3& position, const glm::vec3& front, const glm::vec3& up);
-    explicit Camera(const SceneLoader& loader, const GLTF::Camera& camera,
-                    const glm::mat4& transform);
+    // Default perspective camera, yfov in radians
+    explicit Camera(const glm::vec3& position, const glm::vec3& front, const glm::vec3& up,
+                    float yfov = glm::radians(45.0f));
+    explicit Camera(const GLTF::Camera& camera, const glm::mat4& transform);
     ~Camera();
 
     glm::mat4 GetProj(double default_aspect_ratio) const;
     double GetAspectRatio(double default_aspect_ratio) const;
 
+    // Looks down -Z of the world space transform of its node, with +Y up
+    void SetTransform(const glm::mat4& transform);
+
 private:
     GLTF::Camera camera;
 };
 
-// Corresponds to a `scene' in the GLTF Spec
+// Local transform of a node, as the translation, rotation and scale that animations target.
+struct NodePose {
+    glm::vec3 translation{};
+    glm::quat rotation{1, 0, 0, 0};
+    glm::vec3 scale{1};
+    // Of the morph targets of its mesh, empty if it has none
+    std::vector<float> weights;
+
+    NodePose() = default;
+    // Matrices are decomposed, assuming they have no shear or perspective
+    explicit NodePose(const GLTF::Node& node);
+
+    glm::mat4 ToMatrix() const noexcept;
+};
+
+/**
+ * Keyframes of a glTF animation, decoded once while loading. Sampling it poses the nodes whose
+ * translation, rotation, scale or morph target weights its channels target, leaving the rest
+ * alone.
+ */
+class Animation : NonCopyable {
+public:
+    // Smaller numbers of channels are not worth splitting across the thread pool
+    static constexpr std::size_t MinParallelChannels = 256;
+
+    std::string name;
+
+    explicit Animation(SceneLoader& loader, const GLTF::Animation& animation);
+    ~Animation();
+
+    // Time of the last keyframe, in seconds
+    float GetDuration() const noexcept {
+        return duration;
+    }
+    // Poses are indexed like the nodes of the glTF. Times outside the keyframes are clamped.
+    void Sample(float time, std::span<NodePose> poses, Common::ThreadPool* thread_pool) const;
+
+    // Bytes of the keyframes on the heap
+    std::size_t GetHostSize() const noexcept;
+
+private:
+    enum class Path {
+        Translation,
+        Rotation,
+        Scale,
+        Weights,
+    };
+    enum class Interpolation {
+        Step,
+        Linear,
+        CubicSpline,
+    };
+    struct Channel {
+        std::size_t node{};
+        Path path{};
+        Interpolation interpolation{};
+        std::vector<float> times;
+        // Of 3 or 4 components, or one per morph target of weights. Cubic splines have an
+        // in-tangent, a value and an out-tangent per keyframe.
+        std::vector<float> values;
+        std::size_t components{};
+    };
+
+    static void SampleChannel(const Channel& channel, float time, NodePose& pose);
+    // Like SampleChannel, each of any number of weights
+    static void SampleWeights(const Channel& channel, float time, std::vector<float>& weights);
+
+    std::vector<Channel> channels;
+    float duration{};
+};
+
+/**
+ * Joints of a glTF skin, and the inverse bind matrices that take the vertices of the meshes it
+ * deforms into the space of each joint.
+ */
+class Skin : NonCopyable {
+public:
+    std::string name;
+    std::vector<u32> joints; // Nodes of the glTF
+    std::vector<glm::mat4> inverse_bind_matrices;
+
+    explicit Skin(SceneLoader& loader, const GLTF::Skin& skin);
+    ~Skin();
+};
+
+/**
+ * Corresponds to a `scene' in the GLTF Spec.
+ *
+ * The node hierarchy is flattened into arrays in depth first order, so parents come before
+ * their children, and so are the mesh instances, in the order of their nodes. The arrays are
+ * contiguous and their elements laid out for std430, so they can be uploaded as they are.
+ * Transforms are propagated a level of the hierarchy at a time, in parallel within each level.
+ */
 class SubScene : NonCopyable {
 public:
+    static constexpr u32 NoParent = std::numeric_limits<u32>::max();
+    static constexpr u32 NoGPUInstance = std::numeric_limits<u32>::max();
+    static constexpr u32 NoSkin = std::numeric_limits<u32>::max();
+    // Smaller ranges are not worth splitting across the thread pool
+    static constexpr std::size_t MinParallelSize = 4096;
+
     std::string name;
     std::vector<std::unique_ptr<Camera>> cameras;
-    std::vector<std::pair<std::shared_ptr<Mesh>, glm::mat4>> mesh_instances;
+    std::vector<GLSL::PunctualLight> lights; // KHR_lights_punctual, in world space
 
+    // Flattened nodes
+    std::vector<u32> node_indices;          // In the glTF
+    std::vector<u32> node_parents;          // Flattened index, NoParent for the roots
+    std::vector<glm::mat4> node_transforms; // World space
+
+    // Mesh instances. Nodes with EXT_mesh_gpu_instancing have one per element of its
+    // accessors, all of them the same node.
+    std::vector<u32> instance_nodes;            // Flattened index
+    std::vector<u32> instance_meshes;           // In Scene::meshes
+    std::vector<glm::mat4> instance_transforms; // World space
+    std::vector<u32> instance_first_primitives; // See Scene::mesh_first_primitives
+    std::vector<u32> instance_num_primitives;
+    std::vector<GLSL::AABB> instance_bounds;   // World space, infinite if the mesh has none
+    std::unique_ptr<InstanceBVH> instance_bvh; // Over instance_bounds
+    std::vector<u32> instance_skins; // Of their nodes, in Scene::skins, NoSkin if they have none
+
+    // Only flattens the nodes and creates the meshes. Call SetPrimitiveRanges and
+    // UpdateTransforms once all sub scenes have been created.
     explicit SubScene(SceneLoader& loader, const GLTF::Scene& scene);
     ~SubScene();
 
-    void Load(SceneLoader& loader);
+    std::size_t GetNumInstances() const noexcept {
+        return instance_meshes.size();
+    }
+
+    void SetPrimitiveRanges(const Scene& scene);
+    // Computes the transforms and bounds of the nodes and mesh instances, the cameras and the
+    // lights.
+    // Also used for nodes that only differ in their transforms from the ones loaded.
+    void UpdateTransforms(const GLTF::GLTF& gltf, const Scene& scene,
+                          Common::ThreadPool* thread_pool);
+    // Like UpdateTransforms, but from the local transforms of the glTF nodes as they have been
+    // posed by animations, and moving the existing cameras and lights instead of recreating
+    // them.
+    void UpdateTransforms(std::span<const glm::mat4> local_transforms, const Scene& scene,
+                          Common::ThreadPool* thread_pool);
+
+    // Reorders the instances along a Morton curve through the centers of their bounds, those
+    // with infinite bounds last, e.g. so that the instances of a TLAS are built in a coherent
+    // order. Later updates of the transforms keep the order. Call after UpdateTransforms.
+    void SortInstances();
+
+    // Bytes of the nodes, instances, cameras, lights and BVH on the heap
+    std::size_t GetHostSize() const noexcept;
+
+    // Of each joint of the skin of the instance, from the space of its mesh into that of the
+    // joint as it is now posed, and back into that of the instance, where the mesh is deformed
+    // (the node of a skinned mesh only places it in the TLAS). Joints outside the sub scene
+    // stay in their bind pose.
+    void GetJointMatrices(std::size_t instance, const Scene& scene,
+                          std::vector<glm::mat4>& out) const;
 
 private:
-    void VisitNode(SceneLoader& loader, std::size_t node, glm::mat4 parent_transform);
-    std::unordered_set<std::size_t> visited_nodes;
+    // Propagates the local transforms in node_transforms, and updates the instances from them
+    void PropagateTransforms(const Scene& scene, Common::ThreadPool* thread_pool);
+
+    std::vector<u32> camera_nodes; // Flattened index
+    std::vector<u32> light_nodes;  // Flattened index, of the lights
+    // Transforms of the EXT_mesh_gpu_instancing instances relative to their nodes, decoded
+    // once while loading. Indexed by instance_gpu_instances, NoGPUInstance for the others.
+    std::vector<glm::mat4> gpu_instance_transforms;
+    std::vector<u32> instance_gpu_instances;
+    // Flattened indices grouped by depth. Level i is [level_offsets[i], level_offsets[i + 1]).
+    std::vector<u32> level_nodes;
+    std::vector<u32> level_offsets;
+    // Flattened index of each node of the glTF, NoParent for those not in the sub scene. Empty
+    // unless the glTF has skins, whose joints are looked up in it.
+    std::vector<u32> flattened_nodes;
 };
 
 struct Scene {
+    // All vertex and index data is suballocated from these. Declared first to outlive the rest.
+    std::unique_ptr<VulkanGeometryHeap> vertex_heap;
+    std::unique_ptr<VulkanGeometryHeap> index_heap;
+    // Binds the memory of streamed textures, so it outlives them too.
+    std::unique_ptr<VulkanTextureStreamer> texture_streamer;
+    // Binds the memory of streamed geometry, whose ranges it keeps alive until the heaps go.
+    std::unique_ptr<VulkanGeometryStreamer> geometry_streamer;
+
     std::vector<std::unique_ptr<Texture>> textures;
     std::vector<std::unique_ptr<Material>> materials;
-    // TODO: More sub scenes
-    std::unique_ptr<SubScene> main_sub_scene;
+    // Every mesh instanced by any of the sub scenes
+    std::vector<std::unique_ptr<Mesh>> meshes;
+    // The primitives of all meshes are numbered one mesh after another. Index of the first
+    // primitive of each mesh, followed by the total number of primitives.
+    std::vector<u32> mesh_first_primitives;
+    // Indexed like the scenes of the glTF. They share the meshes, materials and textures.
+    std::vector<std::unique_ptr<SubScene>> sub_scenes;
+    std::size_t main_sub_scene{}; // The one the glTF selects
+    // glTF material index -> index in materials, for the materials that were loaded
+    std::unordered_map<std::size_t, std::size_t> material_indices;
+    std::vector<std::unique_ptr<Animation>> animations;
+    // Of each node of the glTF, which animations are applied on top of. Empty unless the glTF
+    // has animations.
+    std::vector<NodePose> rest_poses;
+    std::vector<std::unique_ptr<Skin>> skins; // Indexed like those of the glTF
+    // Of the morph targets of the mesh of each node of the glTF, as they are now posed (empty
+    // for nodes without any). Empty unless a mesh has morph targets.
+    std::vector<std::vector<float>> node_weights;
+
+    // Loads the images in the background. Null unless textures are lazy. Declared last to stop
+    // before the images it loads are destroyed.
+    std::unique_ptr<LazyTextureLoader> lazy_texture_loader;
 };
 
+// Bytes of host memory held for rendering, by what they are for. Those of the scene count the
+// capacity of its arrays and its names, not the overhead of the heap.
+struct HostMemoryUsage {
+    std::size_t meshes{};    // Primitive layouts, and positions and meshlets kept on the CPU
+    std::size_t nodes{};     // Of the sub scenes, and the animations
+    std::size_t materials{}; // Materials, textures, images and samplers (not their texels)
+    std::size_t pending_images{}; // Encoded images that are yet to be loaded lazily
+    std::size_t snapshot{};       // Kept by the renderer for hot reloading, see GLTFSnapshot
+    std::size_t resident{};       // Of the whole process, see Common::GetResidentMemory
+};
+// Fills in the parts of the scene
+HostMemoryUsage GetHostMemory(const Scene& scene);
+// Releases what the renderers only need while loading, once they have uploaded the scene: the
+// positions, indices and meshlets kept on the CPU.
+void TrimHostMemory(Scene& scene);
+
+// Complexity of a scene, e.g. to compare assets or to size budgets for them
+struct SceneStats {
+    std::size_t meshes{};
+    std::size_t primitives{};
+    std::size_t materials{};
+    std::size_t instances{}; // Of the sub scene
+    std::size_t draws{};     // Primitives of its instances, drawn one by one
+    u64 unique_triangles{};    // Of the primitives, once each
+    u64 instanced_triangles{}; // Of the instances of the sub scene
+    u64 vertices{};
+    // Over all primitives, by glTF attribute name (POSITION, NORMAL...), in the formats they
+    // are stored in on the GPU. Attributes a primitive does not have are not counted.
+    std::map<std::string, vk::DeviceSize> vertex_bytes;
+    vk::DeviceSize index_bytes{};
+
+    // Of the loaded images (shared by textures, counted once), by format
+    struct TextureFormat {
+        std::size_t count{};
+        std::vector<vk::DeviceSize> level_bytes; // Finest level first
+    };
+    std::map<vk::Format, TextureFormat> textures;
+    std::size_t pending_images{}; // Yet to be loaded lazily, not counted above
+
+    // Filled in by the renderers that build them
+    struct AccelStructures {
+        std::size_t count{};
+        vk::DeviceSize build_bytes{}; // As built
+        vk::DeviceSize bytes{};       // As they are now, smaller once compacted
+    };
+    AccelStructures blases;
+    AccelStructures tlases;
+};
+// Fills in the parts of the scene and the sub scene
+SceneStats GetSceneStats(const Scene& scene, std::size_t sub_scene);
+// As a JSON object, with the formats named as by vk::to_string
+std::string GetSceneStatsJSON(const SceneStats& stats);
+
 struct BufferParams {
     vk::BufferUsageFlags usage;
     vk::PipelineStageFlags2 dst_stage_mask;
     vk::AccessFlags2 dst_access_mask;
 };
+// What a renderer needs of the geometry of the scenes it renders, as passed to SceneLoader.
+// Combined with |=, the geometry is loaded for both renderers, which can then share the scene,
+// see VulkanRenderer::AddSwitchTarget.
+struct GeometryRequirements {
+    BufferParams vertex_buffer_params;
+    BufferParams index_buffer_params;
+    bool keep_host_geometry = false;
+    bool keep_emissive_geometry = false;
+    bool bake_opacity_micromaps = false;
+
+    GeometryRequirements& operator|=(const GeometryRequirements& other) noexcept;
+};
+// Lowers the resolution of the textures of a scene while loading it, e.g. for previews. The
+// levels dropped are neither uploaded nor compressed, nor kept in memory.
+struct TextureQuality {
+    u32 max_size = 0;       // Of either side of the textures, 0 for no limit
+    u32 dropped_levels = 0; // Finest levels dropped from every texture
+    // Device memory of all textures, estimated before decoding them, 0 for no limit. Levels are
+    // dropped from every texture until they fit.
+    vk::DeviceSize budget = 0;
+};
 class SceneLoader {
 public:
+    // If thread_pool is not null, images, buffer views and meshes are loaded in parallel on it.
+    // If compress_textures is set, images are block compressed (when the device supports it).
+    // If texture_budget is not 0, the finer levels of large textures are streamed in on demand,
+    // using at most that many bytes of device memory. Its frames are the num_frames_in_flight of
+    // the renderer.
+    // If lazy_textures is set, images are loaded in the background after the constructor
+    // returns, see LazyTextureLoader.
+    // If generate_lods is set, indexed triangle primitives get coarser levels of detail, see
+    // MeshPrimitive::lods.
+    // If build_meshlets is set, triangle primitives are split into meshlets, see
+    // MeshPrimitive::meshlets.
+    // If keep_host_geometry is set, primitives keep their positions and indices on the CPU, see
+    // MeshPrimitive::host_positions. If keep_emissive_geometry is set, those with emissive
+    // materials do, e.g. for sampling them as lights.
+    // If geometry_budget is not 0, the heaps stream, and meshes are paged in on demand using at
+    // most that many bytes of device memory, see VulkanGeometryStreamer. Nothing may read the
+    // heaps on the device while loading then.
+    // If optimize_indices is set, the triangles of the primitives are reordered for the vertex
+    // cache, see OptimizesIndices. Triangle lists of generated vertices (e.g. when generating
+    // tangents) are also sorted against overdraw and their vertices in the order they are used.
+    // If spatial_order is set, the triangles of the primitives (or the runs of them that the
+    // vertex cache optimization leaves) are sorted along a Morton curve instead, and so are the
+    // instances of the sub scenes, see SubScene::SortInstances, for the coherence of ray
+    // tracing. Whatever is indexed by triangle or instance is built after, in the new order.
+    // If pack_vertices is set, the vertices the loader generates are stored as a float3 position
+    // stream and a stream of packed attributes, see MeshPrimitiveGenerateTangent.
+    // If bake_opacity_micromaps is set (and the device supports them), alpha tested primitives
+    // get opacity micromaps, see BakesOpacityMicromap.
+    // The textures are loaded at the resolution of texture_quality.
+    // If gpu_tangent_triangles is not 0, tangents of primitives of at least that many triangles
+    // are generated on the device instead of with MikkTSpace, see VulkanTangentGenerator.
+    // If host_cache_budget is not 0, what the streamers upload is kept in that many bytes of
+    // host memory, to be uploaded again from it once evicted, see VulkanHostCache.
+    // If gpu_image_decode is set, JPEG images of uncompressed textures that are not streamed are
+    // only entropy decoded on the CPU, and finished on the GPU, see VulkanJPEGDecoder.
+    // If keep_host_textures is set, images also keep a copy on the CPU, see Image::host_texture,
+    // e.g. for shading on the host.
     explicit SceneLoader(const BufferParams& vertex_buffer_params,
                          const BufferParams& index_buffer_params, Scene& scene,
-                         VulkanDevice& device, GLTF::Container& container);
+                         VulkanDevice& device, GLTF::Container& container,
+                         Common::ThreadPool* thread_pool = nullptr,
+                         bool compress_textures = false, vk::DeviceSize texture_budget = 0,
+                         std::size_t num_frames_in_flight = 2, bool lazy_textures = false,
+                         bool generate_lods = false, bool build_meshlets = false,
+                         bool keep_host_geometry = false, bool keep_emissive_geometry = false,
+                         vk::DeviceSize geometry_budget = 0, bool optimize_indices = false,
+                         bool pack_vertices = false, bool bake_opacity_micromaps = false,
+                         const TextureQuality& texture_quality = {},
+                         std::size_t gpu_tangent_triangles = 0, bool spatial_order = false,
+                         vk::DeviceSize host_cache_budget = 0, bool gpu_image_decode = false,
+                         bool keep_host_textures = false);
     ~SceneLoader();
 
+    // Runs the task on the thread pool if there is one, or immediately otherwise.
+    // All tasks are waited for before the constructor returns.
+    void RunTask(std::function<void()> task);
+    // Calls func(i) for i in [0, count), in parallel if there is a thread pool.
+    void ParallelFor(std::size_t count, const std::function<void(std::size_t)>& func);
+
+    Common::ThreadPool* GetThreadPool() const noexcept {
+        return thread_pool;
+    }
+
+    struct BufferViewData {
+        const BufferFile& buffer_file;
+        std::size_t offset{}; // Of the view in the buffer
+    };
+    // Where the contents of the buffer view are, decoding it first if it is compressed.
+    BufferViewData GetBufferViewData(const GLTF::BufferView& buffer_view);
+    // Decodes the accessor into floats, one element after another. See GLTF::DecodeFloatAccessor.
+    std::vector<float> LoadFloatAccessor(const GLTF::Accessor& accessor);
+    // Whether the primitive keeps its positions and indices, see MeshPrimitive::host_positions
+    bool KeepsHostGeometry(const GLTF::Mesh::Primitive& primitive) const;
+    // Whether the primitive gets an opacity micromap (MeshPrimitive::opacity_micromap): baking
+    // is enabled, and it is a triangle list of an alpha tested material whose base color
+    // texture has a source that is not KTX2 only, without RGBA vertex colors that would
+    // modulate the alpha. Others keep the alpha test of the any-hit shaders alone.
+    bool BakesOpacityMicromap(const GLTF::Mesh::Primitive& primitive) const;
+    // Whether the index accessor is replaced by OptimizedIndices, i.e. index optimization or
+    // spatial ordering is enabled and only triangle lists use it
+    bool OptimizesIndices(std::size_t accessor_idx) const;
+    // Reads the indices of the accessor into native 32-bit integers, optimized if
+    // OptimizesIndices
+    std::vector<u32> LoadIndices(std::size_t accessor_idx);
+
+    // Uploads vertex or index data with upload, unless data of the same key (a hash of its
+    // contents and of what heap it is for) has been uploaded already, sharing that buffer
+    // instead. Thread safe.
+    std::shared_ptr<VulkanGeometryBuffer> UploadUnique(
+        const SceneCache::Key& key,
+        const std::function<std::shared_ptr<VulkanGeometryBuffer>()>& upload);
+    // The image of the glTF index, shared with the other images of the same encoded contents
+    // and usage. Only called from the loading thread.
+    std::shared_ptr<Image> GetImage(std::size_t idx);
+    // The sampler of the glTF index, shared with the other samplers of the same create info.
+    // Only called from the loading thread.
+    std::shared_ptr<Sampler> GetSampler(std::size_t idx);
+    // The glTF index of the first mesh whose primitives have the same geometry (the contents
+    // and layout of their accessors, and their modes) and materials as those of the mesh, or
+    // the mesh itself. Nodes instance that one instead, so that copies exported as meshes of
+    // their own (e.g. the same bolt under hundreds of mesh indices) share its buffers and BLAS,
+    // whatever the transforms of the nodes. Only called from the loading thread.
+    std::size_t GetUniqueMesh(std::size_t mesh_idx);
+
     BufferParams vertex_buffer_params;
     BufferParams index_buffer_params;
 
@@ -254,32 +879,110 @@ public:
     GLTF::Container& container;
     GLTF::GLTF gltf;
 
+    bool compress_textures{};
+    bool lazy_textures{};
+    bool generate_lods{};
+    bool build_meshlets{};
+    bool keep_host_geometry{};
+    bool keep_emissive_geometry{};
+    bool optimize_indices{};
+    bool pack_vertices{};
+    bool bake_opacity_micromaps{};
+    // With the levels dropped to fit its budget added to dropped_levels
+    TextureQuality texture_quality;
+    std::size_t gpu_tangent_triangles{};
+    bool spatial_order{};
+    bool gpu_image_decode{};
+    bool keep_host_textures{};
+    // Times the stages of loading. The renderers add their own (e.g. acceleration structure
+    // builds) and report it once they are done.
+    std::unique_ptr<LoadProfiler> profiler;
+    // Indexed like gltf.images
+    std::vector<ImageUsage> image_usages;
+    // Indexed like gltf.accessors, whether only triangle lists use it as indices. Empty unless
+    // optimize_indices or spatial_order is set.
+    std::vector<bool> triangle_list_indices;
+    static constexpr std::size_t NoAccessor = std::numeric_limits<std::size_t>::max();
+    // Indexed like gltf.accessors, the positions of the triangle lists using it as indices, or
+    // NoAccessor unless they are the same for all of them. Empty unless spatial_order is set.
+    std::vector<std::size_t> index_positions;
+
+    // Of the temporaries of loading (the maps below, decoded buffer views, CPU accessors...),
+    // which are released in one go with the loader. Thread safe.
+    std::pmr::synchronized_pool_resource temp_memory;
+
     // Temporary maps used while loading to avoid loading the same resource multiple times
-    // Indices of U -> shared ptrs of T
-    template <typename U, typename T>
-    class LoaderTempMap : public std::unordered_map<std::size_t, std::shared_ptr<T>> {
+    // Indices of U -> shared ptrs of T. These are thread safe: concurrent requests for the
+    // same index construct it only once, and the others wait for it.
+    // If Transient is set, T is allocated from temp_memory, so it must not outlive the loader.
+    // Otherwise (e.g. images, which the scene references) it is allocated on the heap.
+    template <typename U, typename T, bool Transient = false>
+    class LoaderTempMap {
     public:
+        explicit LoaderTempMap(std::pmr::memory_resource* memory) : entries(memory) {}
+
         template <typename... Args>
         std::shared_ptr<T>& Get(SceneLoader& loader, std::size_t idx, Args&&... args) {
-            if (!this->count(idx)) {
-                this->emplace(idx,
-                              std::make_shared<T>(
-                                  loader, Common::PFR::GetDerived<std::vector<U>>(loader.gltf)[idx],
-                                  std::forward<Args>(args)...));
+            Entry* entry{};
+            {
+                std::scoped_lock lock{mutex};
+                entry = &entries.try_emplace(idx).first->second; // Nodes are stable
             }
-            return this->at(idx);
+            std::call_once(entry->flag, [&] {
+                const auto& gltf_value = Common::PFR::GetDerived<std::vector<U>>(loader.gltf)[idx];
+                if constexpr (Transient) {
+                    entry->value = std::allocate_shared<T>(
+                        std::pmr::polymorphic_allocator<T>{entries.get_allocator().resource()},
+                        loader, gltf_value, std::forward<Args>(args)...);
+                } else {
+                    entry->value =
+                        std::make_shared<T>(loader, gltf_value, std::forward<Args>(args)...);
+                }
+            });
+            return entry->value;
         }
+
+    private:
+        struct Entry {
+            std::once_flag flag;
+            std::shared_ptr<T> value;
+        };
+        std::mutex mutex;
+        std::pmr::unordered_map<std::size_t, Entry> entries;
+    };
+    LoaderTempMap<GLTF::Buffer, BufferFile, true> buffer_files{&temp_memory};
+    LoaderTempMap<GLTF::BufferView, BufferFile, true> decoded_buffer_views{&temp_memory};
+    LoaderTempMap<GLTF::Accessor, CPUAccessor, true> cpu_accessors{&temp_memory};
+    LoaderTempMap<GLTF::Accessor, IndexBufferAccessor> index_accessors{&temp_memory};
+    LoaderTempMap<GLTF::Accessor, OptimizedIndices, true> optimized_indices{&temp_memory};
+    LoaderTempMap<GLTF::BufferView, VertexBufferView, true> vertex_buffer_views{&temp_memory};
+    LoaderTempMap<GLTF::Image, AlphaMaskImage, true> alpha_masks{&temp_memory};
+
+    // Contents loaded already, e.g. duplicates in assets merged from several sources
+    struct UniqueUpload {
+        std::once_flag flag;
+        std::shared_ptr<VulkanGeometryBuffer> buffer;
     };
-    LoaderTempMap<GLTF::Buffer, BufferFile> buffer_files;
-    LoaderTempMap<GLTF::Accessor, CPUAccessor> cpu_accessors;
-    LoaderTempMap<GLTF::Accessor, IndexBufferAccessor> index_accessors;
-    LoaderTempMap<GLTF::BufferView, VertexBufferView> vertex_buffer_views;
-    LoaderTempMap<GLTF::Sampler, Sampler> samplers;
-    LoaderTempMap<GLTF::Image, Image> images;
-    LoaderTempMap<GLTF::Mesh, Mesh> meshes;
+    std::mutex unique_uploads_mutex;
+    std::pmr::map<SceneCache::Key, UniqueUpload> unique_uploads{&temp_memory};
+    std::pmr::map<std::size_t, SceneCache::Key> image_keys{&temp_memory}; // By glTF index
+    std::pmr::map<SceneCache::Key, std::shared_ptr<Image>> unique_images{&temp_memory};
+    // Of the fields of vk::SamplerCreateInfo that depend on the glTF sampler
+    using SamplerKey = std::tuple<vk::Filter, vk::Filter, vk::SamplerMipmapMode,
+                                  vk::SamplerAddressMode, vk::SamplerAddressMode, float>;
+    std::pmr::map<SamplerKey, std::shared_ptr<Sampler>> unique_samplers{&temp_memory};
+    // Of GetUniqueMesh, by glTF index of the meshes and of their accessors
+    std::pmr::map<std::size_t, std::size_t> unique_mesh_indices{&temp_memory};
+    std::pmr::map<std::size_t, SceneCache::Key> accessor_keys{&temp_memory};
+    std::pmr::map<SceneCache::Key, std::size_t> unique_meshes{&temp_memory};
+    std::size_t num_duplicate_meshes{};
+    // Baked by the primitives while loading, built together once they are done
+    std::mutex baked_micromaps_mutex;
+    std::vector<std::pair<MeshPrimitive*, Common::OpacityMicromap>> baked_micromaps;
 
     // Helper used when the resources must be kept in a vector and referenced to with indices
-    // (because, e.g. they will be passed to a shader)
+    // (because, e.g. they will be passed to a shader). Entries are only created from the
+    // loading thread, so that indices are assigned in a deterministic order.
     template <typename U, typename T>
     class LoaderMap : public std::unordered_map<std::size_t, std::size_t> {
     public:
@@ -309,6 +1012,22 @@ public:
     };
     LoaderMap<GLTF::Texture, Texture> textures;
     LoaderMap<GLTF::Material, Material> materials;
+    LoaderMap<GLTF::Mesh, Mesh> meshes;
+
+    // Texture uploads from all images are batched together.
+    std::unique_ptr<VulkanTextureUploadBatch> texture_upload_batch;
+    // Small textures, put into arrays with those of the same format and extent once all images
+    // are decoded
+    std::mutex array_textures_mutex;
+    std::vector<std::pair<Image*, std::unique_ptr<DecodedTexture>>> array_textures;
+    // Decoded textures and generated geometry from previous loads. Shared with lazily loaded
+    // images.
+    std::shared_ptr<SceneCache> cache;
+
+private:
+    Common::ThreadPool* thread_pool{};
+    std::mutex pending_tasks_mutex;
+    std::vector<std::future<void>> pending_tasks;
 };
 
 } // namespace Renderer
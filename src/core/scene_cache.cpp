@@ -0,0 +1,350 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <citycrc.h>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/mapped_file.h"
+#include "common/thread_pool.h"
+#include "core/scene_cache.h"
+
+#ifdef ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace Renderer {
+
+namespace {
+
+constexpr u32 Magic = 0x43534342; // BCSC
+constexpr std::size_t SectionAlignment = 16;
+
+enum class Codec : u32 {
+    None,
+    Zstd,
+};
+
+#ifdef ENABLE_ZSTD
+constexpr Codec StoreCodec = Codec::Zstd;
+#else
+constexpr Codec StoreCodec = Codec::None;
+#endif
+
+struct Header {
+    u32 magic;
+    u32 version;
+    Codec codec;
+    u32 chunk_size;
+    u64 num_sections;
+    // Followed by u64 sizes[num_sections] and u64 stored_sizes[num_sections], then the stored
+    // sections, each aligned to SectionAlignment. Compressed sections start with the u32 stored
+    // sizes of their chunks, of chunk_size bytes but the last, followed by the chunks. Chunks
+    // stored at their size (which compressed chunks never are) are not compressed.
+};
+
+// Calls func(i) for i in [0, count), in parallel on the thread pool if any
+template <typename F>
+void ForEach(Common::ThreadPool* thread_pool, std::size_t count, F&& func) {
+    if (thread_pool && count > 1) {
+        thread_pool->ParallelFor(0, count, func);
+        return;
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        func(i);
+    }
+}
+
+// Returns empty if the chunk is to be stored as is
+std::vector<u8> CompressChunk([[maybe_unused]] std::span<const u8> chunk) {
+#ifdef ENABLE_ZSTD
+    std::vector<u8> compressed(ZSTD_compressBound(chunk.size()));
+    const std::size_t size = ZSTD_compress(compressed.data(), compressed.size(), chunk.data(),
+                                           chunk.size(), SceneCache::CompressionLevel);
+    if (ZSTD_isError(size) || size >= chunk.size()) {
+        return {};
+    }
+    compressed.resize(size);
+    return compressed;
+#else
+    return {};
+#endif
+}
+
+bool DecompressChunk(std::span<const u8> stored, std::span<u8> out) {
+    if (stored.size() == out.size()) {
+        std::memcpy(out.data(), stored.data(), out.size());
+        return true;
+    }
+#ifdef ENABLE_ZSTD
+    const std::size_t size = ZSTD_decompress(out.data(), out.size(), stored.data(), stored.size());
+    return !ZSTD_isError(size) && size == out.size();
+#else
+    return false;
+#endif
+}
+
+} // namespace
+
+SceneCache::Hasher::Hasher(std::string_view kind) {
+    const auto [low, high] = CityHashCrc128(kind.data(), kind.size());
+    key = {low ^ Version, high};
+}
+
+SceneCache::Hasher& SceneCache::Hasher::Add(std::span<const u8> data) {
+    const auto [low, high] = CityHashCrc128WithSeed(reinterpret_cast<const char*>(data.data()),
+                                                    data.size(), {key.first, key.second});
+    key = {low, high};
+    return *this;
+}
+
+SceneCache::Entry::Entry(std::unique_ptr<Common::MappedFile> file_,
+                         Common::ThreadPool* thread_pool)
+    : file(std::move(file_)) {
+    const auto contents = file->GetSpan();
+    if (contents.size() < sizeof(Header)) {
+        throw std::runtime_error("Cache entry is truncated");
+    }
+    Header header;
+    std::memcpy(&header, contents.data(), sizeof(Header));
+    if (header.magic != Magic || header.version != Version) {
+        throw std::runtime_error("Cache entry has a different version");
+    }
+    if (header.codec != Codec::None && header.codec != StoreCodec) {
+        throw std::runtime_error("Cache entry is compressed with an unsupported codec");
+    }
+    if (header.num_sections > (contents.size() - sizeof(Header)) / (2 * sizeof(u64))) {
+        throw std::runtime_error("Cache entry is truncated");
+    }
+
+    std::vector<u64> sizes(header.num_sections);
+    std::vector<u64> stored_sizes(header.num_sections);
+    std::memcpy(sizes.data(), contents.data() + sizeof(Header), sizes.size() * sizeof(u64));
+    std::memcpy(stored_sizes.data(), contents.data() + sizeof(Header) + sizes.size() * sizeof(u64),
+                stored_sizes.size() * sizeof(u64));
+    std::size_t offset = sizeof(Header) + 2 * sizes.size() * sizeof(u64);
+    std::vector<std::span<const u8>> stored_sections;
+    for (const u64 size : stored_sizes) {
+        offset = Common::AlignUp(offset, SectionAlignment);
+        if (offset > contents.size() || size > contents.size() - offset) {
+            throw std::runtime_error("Cache entry is truncated");
+        }
+        stored_sections.emplace_back(contents.subspan(offset, size));
+        offset += size;
+    }
+    if (header.codec == Codec::None) {
+        if (sizes != stored_sizes) {
+            throw std::runtime_error("Cache entry is corrupted");
+        }
+        sections = std::move(stored_sections);
+        return;
+    }
+    if (header.chunk_size == 0) {
+        throw std::runtime_error("Cache entry is corrupted");
+    }
+
+    // Decompressed sections are laid out like stored ones, aligned
+    std::vector<std::size_t> section_offsets;
+    std::size_t total_size = 0;
+    for (const u64 size : sizes) {
+        total_size = Common::AlignUp(total_size, SectionAlignment);
+        section_offsets.push_back(total_size);
+        total_size += size;
+    }
+    decompressed.reset(new u8[std::max<std::size_t>(total_size, 1)]);
+
+    struct Chunk {
+        std::span<const u8> stored;
+        std::span<u8> out;
+    };
+    std::vector<Chunk> chunks;
+    for (std::size_t i = 0; i < sizes.size(); ++i) {
+        const auto stored = stored_sections[i];
+        const std::size_t num_chunks = Common::DivideCeil(sizes[i], header.chunk_size);
+        if (num_chunks > stored.size() / sizeof(u32)) {
+            throw std::runtime_error("Cache entry is truncated");
+        }
+        std::vector<u32> chunk_sizes(num_chunks);
+        std::memcpy(chunk_sizes.data(), stored.data(), num_chunks * sizeof(u32));
+        std::size_t chunk_offset = num_chunks * sizeof(u32);
+        for (std::size_t j = 0; j < num_chunks; ++j) {
+            if (chunk_sizes[j] > stored.size() - chunk_offset) {
+                throw std::runtime_error("Cache entry is truncated");
+            }
+            const std::size_t out_offset = j * header.chunk_size;
+            chunks.push_back({
+                .stored = stored.subspan(chunk_offset, chunk_sizes[j]),
+                .out = {decompressed.get() + section_offsets[i] + out_offset,
+                        std::min<std::size_t>(header.chunk_size, sizes[i] - out_offset)},
+            });
+            chunk_offset += chunk_sizes[j];
+        }
+    }
+    std::atomic_bool valid{true};
+    ForEach(thread_pool, chunks.size(), [&chunks, &valid](std::size_t i) {
+        if (!DecompressChunk(chunks[i].stored, chunks[i].out)) {
+            valid = false;
+        }
+    });
+    if (!valid) {
+        throw std::runtime_error("Cache entry is corrupted");
+    }
+    for (std::size_t i = 0; i < sizes.size(); ++i) {
+        sections.emplace_back(decompressed.get() + section_offsets[i], sizes[i]);
+    }
+    file.reset(); // Everything is decompressed
+}
+
+SceneCache::Entry::~Entry() = default;
+
+std::span<const u8> SceneCache::Entry::GetSection(std::size_t idx) const {
+    if (idx >= sections.size()) {
+        SPDLOG_ERROR("Cache entry section {} out of range (count {})", idx, sections.size());
+        throw std::runtime_error("Cache entry section out of range");
+    }
+    return sections[idx];
+}
+
+SceneCache::SceneCache(std::filesystem::path folder_, Common::ThreadPool* thread_pool_)
+    : folder(std::move(folder_)), thread_pool(thread_pool_) {
+    std::error_code error;
+    std::filesystem::create_directories(folder, error);
+    if (error) {
+        SPDLOG_WARN("Could not create scene cache folder {}: {}", folder.string(),
+                    error.message());
+    }
+}
+
+SceneCache::~SceneCache() = default;
+
+std::filesystem::path SceneCache::GetPath(const Key& key) const {
+    return folder / std::filesystem::u8path(fmt::format("{:016x}{:016x}.bin", key.first,
+                                                        key.second));
+}
+
+std::unique_ptr<SceneCache::Entry> SceneCache::Load(const Key& key) const {
+    const auto path = GetPath(key);
+    if (!std::filesystem::exists(path)) {
+        return nullptr;
+    }
+    try {
+        return std::unique_ptr<Entry>(
+            new Entry(std::make_unique<Common::MappedFile>(path), thread_pool));
+    } catch (const std::exception& e) {
+        SPDLOG_WARN("Ignoring invalid scene cache entry {}: {}", path.string(), e.what());
+        return nullptr;
+    }
+}
+
+void SceneCache::Store(const Key& key, std::span<const std::span<const u8>> sections) const {
+    const auto path = GetPath(key);
+
+    // The chunks of all sections are compressed in parallel. Empty ones are stored as is.
+    std::vector<std::vector<std::vector<u8>>> compressed(sections.size());
+    std::vector<u64> stored_sizes;
+    if constexpr (StoreCodec != Codec::None) {
+        std::vector<std::pair<std::size_t, std::size_t>> chunks; // Of sections and within them
+        for (std::size_t i = 0; i < sections.size(); ++i) {
+            compressed[i].resize(Common::DivideCeil(sections[i].size(), ChunkSize));
+            for (std::size_t j = 0; j < compressed[i].size(); ++j) {
+                chunks.emplace_back(i, j);
+            }
+        }
+        ForEach(thread_pool, chunks.size(), [&sections, &compressed, &chunks](std::size_t i) {
+            const auto [section, chunk] = chunks[i];
+            const std::size_t offset = chunk * ChunkSize;
+            compressed[section][chunk] = CompressChunk(
+                sections[section].subspan(offset, std::min(ChunkSize, sections[section].size() -
+                                                                          offset)));
+        });
+    }
+    for (std::size_t i = 0; i < sections.size(); ++i) {
+        if constexpr (StoreCodec == Codec::None) {
+            stored_sizes.push_back(sections[i].size());
+            continue;
+        }
+        u64 stored_size = compressed[i].size() * sizeof(u32);
+        for (std::size_t j = 0; j < compressed[i].size(); ++j) {
+            stored_size += compressed[i][j].empty()
+                               ? std::min(ChunkSize, sections[i].size() - j * ChunkSize)
+                               : compressed[i][j].size();
+        }
+        stored_sizes.push_back(stored_size);
+    }
+
+    // Write to a temporary file first, so that concurrent loads never see partial entries
+    auto temp_path = path;
+    temp_path += fmt::format(".{:x}.tmp", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    {
+        std::ofstream out_file{temp_path, std::ios::binary};
+        const Header header{
+            .magic = Magic,
+            .version = Version,
+            .codec = StoreCodec,
+            .chunk_size = static_cast<u32>(ChunkSize),
+            .num_sections = sections.size(),
+        };
+        out_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const auto& section : sections) {
+            const u64 size = section.size();
+            out_file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        }
+        out_file.write(reinterpret_cast<const char*>(stored_sizes.data()),
+                       static_cast<std::streamsize>(stored_sizes.size() * sizeof(u64)));
+
+        const auto Write = [&out_file](std::span<const u8> data) {
+            out_file.write(reinterpret_cast<const char*>(data.data()),
+                           static_cast<std::streamsize>(data.size()));
+        };
+        std::size_t offset = sizeof(Header) + 2 * sections.size() * sizeof(u64);
+        static constexpr std::array<char, SectionAlignment> Padding{};
+        for (std::size_t i = 0; i < sections.size(); ++i) {
+            const auto aligned_offset = Common::AlignUp(offset, SectionAlignment);
+            out_file.write(Padding.data(), static_cast<std::streamsize>(aligned_offset - offset));
+            if constexpr (StoreCodec == Codec::None) {
+                Write(sections[i]);
+            } else {
+                for (std::size_t j = 0; j < compressed[i].size(); ++j) {
+                    const auto chunk_size = static_cast<u32>(
+                        compressed[i][j].empty()
+                            ? std::min(ChunkSize, sections[i].size() - j * ChunkSize)
+                            : compressed[i][j].size());
+                    out_file.write(reinterpret_cast<const char*>(&chunk_size), sizeof(chunk_size));
+                }
+                for (std::size_t j = 0; j < compressed[i].size(); ++j) {
+                    Write(compressed[i][j].empty()
+                              ? sections[i].subspan(j * ChunkSize,
+                                                    std::min(ChunkSize,
+                                                             sections[i].size() - j * ChunkSize))
+                              : std::span<const u8>{compressed[i][j]});
+                }
+            }
+            offset = aligned_offset + stored_sizes[i];
+        }
+        if (!out_file) {
+            SPDLOG_WARN("Failed to write scene cache entry {}", path.string());
+            out_file.close();
+            std::error_code error;
+            std::filesystem::remove(temp_path, error);
+            return;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    if (error) {
+        SPDLOG_WARN("Failed to write scene cache entry {}: {}", path.string(), error.message());
+        std::filesystem::remove(temp_path, error);
+    }
+}
+
+} // namespace Renderer
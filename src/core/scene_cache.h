@@ -0,0 +1,100 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "common/common_types.h"
+
+namespace Common {
+class MappedFile;
+class ThreadPool;
+}
+
+namespace Renderer {
+
+/**
+ * On-disk cache of processed scene data (generated geometry, decoded textures), so that they
+ * can be memory mapped and uploaded directly on later loads.
+ * Entries are content addressed: their key is a hash of all the inputs used to produce them,
+ * so changed sources simply miss. Thread safe.
+ * With ENABLE_ZSTD, sections are stored compressed in chunks that are compressed and
+ * decompressed in parallel on the thread pool, as reading large entries uncompressed is bound
+ * by the disk. Chunks that do not shrink (e.g. of block compressed textures) are stored as is.
+ */
+class SceneCache : NonCopyable {
+public:
+    // Bump when the layout of any cached data changes
+    static constexpr u32 Version = 4;
+    // Of the sections, compressed independently
+    static constexpr std::size_t ChunkSize = 256 * 1024;
+    // zstd level of the chunks, favoring the speed of stores
+    static constexpr int CompressionLevel = 3;
+
+    using Key = std::pair<u64, u64>;
+
+    class Hasher {
+    public:
+        explicit Hasher(std::string_view kind);
+
+        Hasher& Add(std::span<const u8> data);
+        template <typename T>
+        Hasher& AddValue(const T& value) {
+            return Add({reinterpret_cast<const u8*>(&value), sizeof(T)});
+        }
+        template <typename T>
+        Hasher& AddVector(const std::vector<T>& data) {
+            return Add({reinterpret_cast<const u8*>(data.data()), data.size() * sizeof(T)});
+        }
+
+        Key Get() const noexcept {
+            return key;
+        }
+
+    private:
+        Key key{};
+    };
+
+    // A memory mapped entry, made up of several sections. Compressed entries are decompressed
+    // into memory of their own instead, and unmapped.
+    class Entry : NonCopyable {
+    public:
+        ~Entry();
+
+        std::span<const u8> GetSection(std::size_t idx) const;
+        std::size_t GetNumSections() const noexcept {
+            return sections.size();
+        }
+
+    private:
+        friend class SceneCache;
+        explicit Entry(std::unique_ptr<Common::MappedFile> file, Common::ThreadPool* thread_pool);
+
+        std::unique_ptr<Common::MappedFile> file;
+        std::unique_ptr<u8[]> decompressed; // Of all the sections, if compressed
+        std::vector<std::span<const u8>> sections;
+    };
+
+    // If thread_pool is not null, the chunks of compressed entries are processed on it
+    explicit SceneCache(std::filesystem::path folder, Common::ThreadPool* thread_pool = nullptr);
+    ~SceneCache();
+
+    // Returns null if there is no valid entry for the key.
+    std::unique_ptr<Entry> Load(const Key& key) const;
+    // Failures are logged but otherwise ignored, as the cache is only an optimization.
+    void Store(const Key& key, std::span<const std::span<const u8>> sections) const;
+
+private:
+    std::filesystem::path GetPath(const Key& key) const;
+
+    std::filesystem::path folder;
+    Common::ThreadPool* thread_pool{};
+};
+
+} // namespace Renderer
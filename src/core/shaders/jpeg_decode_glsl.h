@@ -0,0 +1,33 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef JPEG_DECODE_GLSL_H
+#define JPEG_DECODE_GLSL_H
+
+#include "core/vulkan/host_glsl_shared.h"
+
+// Of the image decoded by a dispatch of jpeg_decode.comp, a workgroup per MCU
+BEGIN_STRUCT(JPEGDecodePushConstant)
+
+// The coefficient buffer holds the offsets of the blocks, then their coefficients (see
+// Common::JPEGCoefficients)
+uint num_blocks;
+uint width;
+uint height;
+uint mcus_x;
+uint num_components;
+uint sampling;        // Horizontal then vertical factor of each component, 4 bits each
+uint color_transform; // One of JPEG_COLOR_*
+INSERT_PADDING(1)
+
+END_STRUCT(JPEGDecodePushConstant)
+
+#define JPEG_COLOR_GRAY 0
+#define JPEG_COLOR_YCBCR 1
+#define JPEG_COLOR_RGB 2
+
+// Of an MCU, with sampling factors of at most 2
+#define JPEG_MAX_BLOCKS_PER_MCU 10
+
+#endif
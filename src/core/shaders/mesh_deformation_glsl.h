@@ -0,0 +1,55 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef MESH_DEFORMATION_GLSL_H
+#define MESH_DEFORMATION_GLSL_H
+
+// GLSL users need GL_EXT_shader_explicit_arithmetic_types_int64
+#include "core/vulkan/host_glsl_shared.h"
+
+// JOINTS_0 and WEIGHTS_0 of a skinned vertex. The joints index those of its skin.
+BEGIN_STRUCT(SkinVertex)
+
+uvec4 joints;
+vec4 weights;
+
+END_STRUCT(SkinVertex)
+
+// Displacements of a vertex by a morph target, zero for the attributes it does not displace
+BEGIN_STRUCT(MorphDelta)
+
+vec3 position;
+INSERT_PADDING(1)
+vec3 normal;
+INSERT_PADDING(1)
+vec3 tangent;
+INSERT_PADDING(1)
+
+END_STRUCT(MorphDelta)
+
+// Of deforming the vertices of an instance of a primitive, see mesh_deformation.comp. The rest
+// attributes are read like those of a PrimitiveInfo, and the deformed ones written as floats.
+BEGIN_STRUCT(MeshDeformationPushConstant)
+
+uint64_t position_address;
+uint64_t normal_address;  // 0 if the primitive has no normals
+uint64_t tangent_address; // 0 if it has no tangents
+uint64_t skin_address;    // SkinVertex of each vertex, 0 without a skin
+// MorphDelta of each vertex of each target in turn
+uint64_t morph_address;
+uint64_t joints_address;  // mat4 of each joint of the skin of the instance
+uint64_t weights_address; // float of each target, of the instance
+uint64_t out_position_address; // vec3
+uint64_t out_normal_address;   // vec3
+uint64_t out_tangent_address;  // vec4
+uint position_format;
+uint normal_format;
+uint tangent_format;
+uint num_vertices;
+uint num_targets;
+INSERT_PADDING(3)
+
+END_STRUCT(MeshDeformationPushConstant)
+
+#endif
@@ -0,0 +1,22 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef NV12_CONVERT_GLSL_H
+#define NV12_CONVERT_GLSL_H
+
+#include "core/vulkan/host_glsl_shared.h"
+
+BEGIN_STRUCT(NV12ConvertPushConstant)
+
+uvec2 extent;       // Of the frame, whose edge pixels are repeated up to coded_extent
+uvec2 coded_extent; // Multiples of 16, the rows of the planes in bytes
+uint encode_srgb;   // Whether the frame is read linear (sRGB and HDR formats)
+INSERT_PADDING(3)
+
+END_STRUCT(NV12ConvertPushConstant)
+
+// Invocations of nv12_convert.comp each convert 4x2 pixels, in groups of this many squared
+#define NV12_CONVERT_GROUP_SIZE 8
+
+#endif
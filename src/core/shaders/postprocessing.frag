@@ -18,12 +18,26 @@
  */
 
 #version 450
+#extension GL_GOOGLE_include_directive : enable
+
+#include "core/shaders/postprocessing_glsl.h"
+
 layout(location = 0) in vec2 outUV;
 layout(location = 0) out vec4 fragColor;
 
 layout(set = 0, binding = 0) uniform sampler2D noisyTxt;
 
+layout(push_constant) uniform PushConstant {
+    PostprocessPushConstant push_constant;
+};
+
+#include "core/shaders/postprocessing.glsl"
+
 void main() {
-    vec2 uv = outUV;
-    fragColor = texture(noisyTxt, uv).rgba;
+    const vec2 display_extent = vec2(push_constant.display_extent);
+    if (any(greaterThanEqual(gl_FragCoord.xy, display_extent))) {
+        fragColor = vec4(0.0, 0.0, 0.0, 1.0);
+        return;
+    }
+    fragColor = vec4(PostprocessPixel(noisyTxt, ivec2(gl_FragCoord.xy)), 1.0);
 }
@@ -0,0 +1,73 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _POSTPROCESSING_GLSL
+#define _POSTPROCESSING_GLSL
+
+// Postprocessing of a pixel of the display extent, shared by the fragment shader and the compute
+// shader that writes into storage swapchain images: upscaling, exposure, tonemapping, dithering
+// and sRGB encoding. Reads the global PostprocessPushConstant push_constant of its includer.
+
+#include "core/shaders/upscaling.glsl"
+
+// Fit of the ACES filmic curve, see Narkowicz, "ACES Filmic Tone Mapping Curve"
+vec3 TonemapACES(vec3 x) {
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+vec3 EncodeSRGB(vec3 x) {
+    return mix(12.92 * x, 1.055 * pow(x, vec3(1.0 / 2.4)) - 0.055, greaterThan(x, vec3(0.0031308)));
+}
+
+vec3 DecodeSRGB(vec3 x) {
+    return mix(x / 12.92, pow((x + 0.055) / 1.055, vec3(2.4)), greaterThan(x, vec3(0.04045)));
+}
+
+// lowbias32 of Chris Wellons' hash prospector
+uint HashPixel(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Noise with a triangular distribution in (-1, 1), the sum of two uniform values, which unlike
+// uniform noise also makes the variance of the quantization error independent of the signal
+float TriangularNoise(ivec2 pixel) {
+    const uint hash = HashPixel(uint(pixel.x) | (uint(pixel.y) << 16));
+    const float u0 = float(hash & 0xffffu) / 65536.0;
+    const float u1 = float(hash >> 16) / 65536.0;
+    return u0 + u1 - 1.0;
+}
+
+vec3 PostprocessPixel(sampler2D image, ivec2 pixel) {
+    const ivec2 render_extent = ivec2(push_constant.render_extent);
+    const vec2 display_extent = vec2(push_constant.display_extent);
+    vec3 color;
+    if (render_extent == ivec2(display_extent)) {
+        color = texelFetch(image, pixel, 0).rgb;
+    } else {
+        const vec2 position = (vec2(pixel) + 0.5) * vec2(render_extent) / display_extent;
+        color = Upscale(image, position, render_extent, push_constant.sharpness);
+    }
+
+    color *= push_constant.exposure;
+    if (push_constant.tonemap != 0) {
+        color = TonemapACES(color);
+    }
+    if (push_constant.dither == 0 && push_constant.encode_srgb == 0) {
+        return color;
+    }
+
+    // Dithered by one step of 8 bits in the encoded values, where the steps are even
+    vec3 encoded = EncodeSRGB(clamp(color, 0.0, 1.0));
+    if (push_constant.dither != 0) {
+        encoded = clamp(encoded + TriangularNoise(pixel) / 255.0, 0.0, 1.0);
+    }
+    return push_constant.encode_srgb != 0 ? encoded : DecodeSRGB(encoded);
+}
+
+#endif
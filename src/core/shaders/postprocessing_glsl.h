@@ -0,0 +1,24 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef POSTPROCESSING_GLSL_H
+#define POSTPROCESSING_GLSL_H
+
+#include "core/vulkan/host_glsl_shared.h"
+
+BEGIN_STRUCT(PostprocessPushConstant)
+
+// Of the offscreen image, at its top left, upscaled to the display extent of the viewport
+uvec2 render_extent;
+uvec2 display_extent;
+float sharpness;  // Of the upscaling, 0 to 1
+float exposure;   // Multiplier of the linear values
+uint tonemap;     // Whether to tonemap with ACES rather than clamp
+uint dither;      // Whether to dither the 8 bit output
+uint encode_srgb; // Whether to write sRGB encoded values, into UNORM images
+INSERT_PADDING(3)
+
+END_STRUCT(PostprocessPushConstant)
+
+#endif
@@ -0,0 +1,136 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef PRIMITIVE_GLSL_H
+#define PRIMITIVE_GLSL_H
+
+// GLSL users need GL_EXT_shader_explicit_arithmetic_types_int64
+#include "core/vulkan/host_glsl_shared.h"
+
+// Where and how the vertex attributes of a primitive are stored, for shaders that fetch them
+// through buffer device addresses themselves. Packed into 96 bytes, the same in std140, std430
+// and scalar layouts: the first 64 are all that most hits read, the last 32 are only read for
+// vertex colors and normal maps. Each part thus takes whole 32-byte sectors of the caches.
+BEGIN_STRUCT(PrimitiveInfo)
+
+uint64_t index_address;
+uint64_t position_address;
+uint64_t normal_address;
+uint64_t texcoord0_address;
+uint64_t texcoord1_address;
+int material_idx;
+uint index_size;
+
+// The formats hold the stride of the attribute in the lower 16 bits (0 if it is absent) and its
+// type in the upper ones, see ATTRIBUTE_STRIDE and ATTRIBUTE_TYPE.
+// Positions, normals, tangents and texcoords may be quantized (KHR_mesh_quantization).
+// Type 0 = float, 1 = unorm8, 2 = unorm16, 3 = snorm8, 4 = snorm16,
+//      5 = uint8, 6 = uint16, 7 = sint8, 8 = sint16,
+//      9 = octahedral snorm16 pair (normals, and tangents with the sign of W in bit 16),
+//      10 = half float (texcoords), the last two packed by the loader.
+uint position_format;
+uint normal_format;
+uint texcoord0_format;
+uint texcoord1_format;
+
+uint64_t color_address;
+uint64_t tangent_address;
+
+// Type 0 = vec4, 1 = u8vec4, 2 = u16vec4,
+//      3 = vec3, 4 = u8vec3, 5 = u16vec3
+uint color_format;
+uint tangent_format;
+uint64_t reserved; // Fills the cold part up to 32 bytes
+
+END_STRUCT(PrimitiveInfo)
+
+#ifdef GL_core_profile
+#define ATTRIBUTE_STRIDE(format) ((format) & 0xffffu)
+#define ATTRIBUTE_TYPE(format) ((format) >> 16)
+#endif
+
+#ifndef GL_core_profile
+#include "common/assert.h"
+
+static_assert(sizeof(Renderer::GLSL::PrimitiveInfo) == 96);
+
+constexpr u32 PackAttributeFormat(u32 stride, u32 type) {
+    ASSERT(stride <= 0xffff);
+    return stride | (type << 16);
+}
+
+constexpr u32 GetAttributeType(vk::Format format) {
+    switch (format) {
+    case vk::Format::eR32G32Sfloat:
+    case vk::Format::eR32G32B32Sfloat:
+    case vk::Format::eR32G32B32A32Sfloat:
+        return 0;
+    case vk::Format::eR8G8Unorm:
+    case vk::Format::eR8G8B8Unorm:
+    case vk::Format::eR8G8B8A8Unorm:
+        return 1;
+    case vk::Format::eR16G16Unorm:
+    case vk::Format::eR16G16B16Unorm:
+    case vk::Format::eR16G16B16A16Unorm:
+        return 2;
+    case vk::Format::eR8G8Snorm:
+    case vk::Format::eR8G8B8Snorm:
+    case vk::Format::eR8G8B8A8Snorm:
+        return 3;
+    case vk::Format::eR16G16Snorm:
+    case vk::Format::eR16G16B16Snorm:
+    case vk::Format::eR16G16B16A16Snorm:
+        return 4;
+    case vk::Format::eR8G8Uscaled:
+    case vk::Format::eR8G8B8Uscaled:
+    case vk::Format::eR8G8B8A8Uscaled:
+        return 5;
+    case vk::Format::eR16G16Uscaled:
+    case vk::Format::eR16G16B16Uscaled:
+    case vk::Format::eR16G16B16A16Uscaled:
+        return 6;
+    case vk::Format::eR8G8Sscaled:
+    case vk::Format::eR8G8B8Sscaled:
+    case vk::Format::eR8G8B8A8Sscaled:
+        return 7;
+    case vk::Format::eR16G16Sscaled:
+    case vk::Format::eR16G16B16Sscaled:
+    case vk::Format::eR16G16B16A16Sscaled:
+        return 8;
+    case vk::Format::eR16G16Sfloat:
+        return 10;
+    default:
+        UNREACHABLE();
+    }
+}
+
+// Of normals and tangents, which only have two components when packed octahedrally
+constexpr u32 GetDirectionType(vk::Format format) {
+    return format == vk::Format::eR16G16Snorm ? 9 : GetAttributeType(format);
+}
+
+constexpr u32 GetColorType(vk::Format format) {
+    if (format == vk::Format::eR32G32B32A32Sfloat) {
+        return 0;
+    }
+    if (format == vk::Format::eR8G8B8A8Unorm) {
+        return 1;
+    }
+    if (format == vk::Format::eR16G16B16A16Unorm) {
+        return 2;
+    }
+    if (format == vk::Format::eR32G32B32Sfloat) {
+        return 3;
+    }
+    if (format == vk::Format::eR8G8B8Unorm) {
+        return 4;
+    }
+    if (format == vk::Format::eR16G16B16Unorm) {
+        return 5;
+    }
+    UNREACHABLE();
+}
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _PUNCTUAL_LIGHT_GLSL
+#define _PUNCTUAL_LIGHT_GLSL
+
+// Lighting by the KHR_lights_punctual lights, with the falloffs the extension recommends.
+// Included after scene_glsl.h.
+
+// Irradiance of the light at the position, on a surface facing it. Outputs the direction from
+// the position to the light and its distance, 10000 (that of rays) for directional lights.
+vec3 GetPunctualLightIrradiance(PunctualLight light, vec3 position, out vec3 direction,
+                                out float distance) {
+    if (light.type == PUNCTUAL_LIGHT_DIRECTIONAL) {
+        direction = -light.direction;
+        distance = 10000.0;
+        return light.intensity;
+    }
+    const vec3 to_light = light.position - position;
+    const float distance_sqr = dot(to_light, to_light);
+    if (distance_sqr == 0) {
+        direction = vec3(0, 0, 1);
+        distance = 0;
+        return vec3(0);
+    }
+    distance = sqrt(distance_sqr);
+    direction = to_light / distance;
+
+    float attenuation = 1.0 / distance_sqr;
+    if (light.range > 0) {
+        const float ratio = distance / light.range;
+        attenuation *= clamp(1.0 - ratio * ratio * ratio * ratio, 0.0, 1.0);
+    }
+    if (light.type == PUNCTUAL_LIGHT_SPOT) {
+        const float cos_angle = dot(light.direction, -direction);
+        const float scale = 1.0 / max(light.cos_inner_cone - light.cos_outer_cone, 1e-4);
+        const float spot = clamp((cos_angle - light.cos_outer_cone) * scale, 0.0, 1.0);
+        attenuation *= spot * spot;
+    }
+    return light.intensity * attenuation;
+}
+
+#endif
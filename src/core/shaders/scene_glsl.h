@@ -7,6 +7,7 @@
 
 #include "core/vulkan/host_glsl_shared.h"
 
+// Of the materials, as the host keeps them and the shaders unpack them, see PackedMaterial
 BEGIN_STRUCT(Material)
 
 // PBR metallic roughness
@@ -30,7 +31,10 @@ float occlusion_strength;
 int emissive_texture_index;
 uint emissive_texture_texcoord;
 
-INSERT_PADDING(2)
+// Of alphaMode MASK, below which the base color alpha is cut out. -1 for other modes.
+float alpha_cutoff;
+
+INSERT_PADDING(1)
 
 vec3 emissive_factor;
 
@@ -38,4 +42,104 @@ INSERT_PADDING(1)
 
 END_STRUCT(Material)
 
+// Texture slot of a PackedMaterial without a texture
+#define MATERIAL_NO_TEXTURE 0xffffu
+// Texture indices are below this. Packed with the texcoord in bit 15.
+#define MATERIAL_MAX_TEXTURES 0x7fffu
+
+// A Material as the material buffers hold it, packed into 32 bytes, the same in std140, std430
+// and scalar layouts, so that each hit reads a single 32-byte sector of the caches. Unpacked
+// by UnpackMaterial. Texture slots are the index in the low 15 bits and the texcoord in bit 15,
+// or MATERIAL_NO_TEXTURE.
+BEGIN_STRUCT(PackedMaterial)
+
+uint base_color_factor_rg; // Half floats
+uint base_color_factor_ba;
+uint emissive_factor_rg;
+uint emissive_factor_b_normal_scale;
+uint metallic_roughness_occlusion;           // Unorm8 metallic, roughness, occlusion strength
+uint alpha_cutoff_emissive_texture;          // Half float alpha cutoff, slot in high bits
+uint base_color_metallic_roughness_textures; // Slots, the first in the low bits
+uint normal_occlusion_textures;
+
+END_STRUCT(PackedMaterial)
+
+#ifdef GL_core_profile
+void UnpackMaterialTexture(uint slot, out int index, out uint texcoord) {
+    index = slot == MATERIAL_NO_TEXTURE ? -1 : int(slot & MATERIAL_MAX_TEXTURES);
+    texcoord = slot >> 15;
+}
+
+// The compiler only unpacks the fields that are read
+Material UnpackMaterial(PackedMaterial packed) {
+    Material material;
+    material.base_color_factor = vec4(unpackHalf2x16(packed.base_color_factor_rg),
+                                      unpackHalf2x16(packed.base_color_factor_ba));
+    const vec2 emissive_b_normal_scale = unpackHalf2x16(packed.emissive_factor_b_normal_scale);
+    material.emissive_factor =
+        vec3(unpackHalf2x16(packed.emissive_factor_rg), emissive_b_normal_scale.x);
+    material.normal_scale = emissive_b_normal_scale.y;
+    const vec4 metallic_roughness_occlusion = unpackUnorm4x8(packed.metallic_roughness_occlusion);
+    material.metallic_factor = metallic_roughness_occlusion.x;
+    material.roughness_factor = metallic_roughness_occlusion.y;
+    material.occlusion_strength = metallic_roughness_occlusion.z;
+    material.alpha_cutoff = unpackHalf2x16(packed.alpha_cutoff_emissive_texture).x;
+
+    UnpackMaterialTexture(packed.base_color_metallic_roughness_textures & 0xffffu,
+                          material.base_color_texture_index, material.base_color_texture_texcoord);
+    UnpackMaterialTexture(packed.base_color_metallic_roughness_textures >> 16,
+                          material.metallic_roughness_texture_index,
+                          material.metallic_roughness_texture_texcoord);
+    UnpackMaterialTexture(packed.normal_occlusion_textures & 0xffffu,
+                          material.normal_texture_index, material.normal_texture_texcoord);
+    UnpackMaterialTexture(packed.normal_occlusion_textures >> 16,
+                          material.occlusion_texture_index, material.occlusion_texture_texcoord);
+    UnpackMaterialTexture(packed.alpha_cutoff_emissive_texture >> 16,
+                          material.emissive_texture_index, material.emissive_texture_texcoord);
+    return material;
+}
+#endif
+
+// Per texture, written by VulkanTextureStreamer and read back for the feedback
+BEGIN_STRUCT(TextureStreamingInfo)
+
+float min_lod;        // Finest resident level, 0 for textures that are not streamed
+uint requested_level; // Finest level sampled since the last read back, ~0u for none
+
+INSERT_PADDING(2)
+
+END_STRUCT(TextureStreamingInfo)
+
+#define PUNCTUAL_LIGHT_DIRECTIONAL 0
+#define PUNCTUAL_LIGHT_POINT 1
+#define PUNCTUAL_LIGHT_SPOT 2
+
+// Of KHR_lights_punctual, in world space. See punctual_light.glsl.
+BEGIN_STRUCT(PunctualLight)
+
+vec3 position;        // Of point and spot lights
+uint type;            // PUNCTUAL_LIGHT_*
+vec3 direction;       // Of spot and directional lights, which they point towards
+float range;          // Beyond which the light has no effect, 0 if infinite
+vec3 intensity;       // Color times intensity, in candela (lux for directional lights)
+float cos_inner_cone; // Of spot lights, inside which they have their full intensity
+float cos_outer_cone; // Outside which they have none
+INSERT_PADDING(3)
+
+END_STRUCT(PunctualLight)
+
+// Axis aligned bounding box
+BEGIN_STRUCT(AABB)
+
+vec3 min_point;
+INSERT_PADDING(1)
+vec3 max_point;
+INSERT_PADDING(1)
+
+END_STRUCT(AABB)
+
+#ifndef GL_core_profile
+static_assert(sizeof(Renderer::GLSL::PackedMaterial) == 32);
+#endif
+
 #endif
@@ -0,0 +1,25 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef TANGENT_GENERATION_GLSL_H
+#define TANGENT_GENERATION_GLSL_H
+
+#include "core/vulkan/host_glsl_shared.h"
+
+// Of the tangent generation passes, see tangent_generation.comp
+BEGIN_STRUCT(TangentGenerationPushConstant)
+
+uint num_triangles;
+uint num_vertices;
+// Of the attributes in the interleaved vertices, in floats
+uint vertex_stride;
+uint position_offset;
+uint normal_offset;
+uint texcoord_offset;
+uint indexed; // Whether the triangles are indexed, or their vertices sequential
+uint pass;    // 0 accumulates the triangles at their vertices, 1 orthonormalizes the vertices
+
+END_STRUCT(TangentGenerationPushConstant)
+
+#endif
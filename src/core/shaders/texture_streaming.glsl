@@ -0,0 +1,31 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef TEXTURE_STREAMING_GLSL
+#define TEXTURE_STREAMING_GLSL
+
+// Residency of the textures streamed by VulkanTextureStreamer. TEXTURE_STREAMING_SET must be
+// defined to the descriptor set it is bound to.
+
+#include "core/shaders/scene_glsl.h"
+
+layout(set = TEXTURE_STREAMING_SET, binding = 0, std430) buffer TextureStreamingBlock {
+    TextureStreamingInfo texture_streaming[];
+};
+
+// Sampling must be clamped to this, as finer levels may not have memory bound
+float GetTextureMinLod(uint texture_index) {
+    return texture_streaming[texture_index].min_lod;
+}
+
+// Reports that the level would have been sampled, so that it gets streamed in
+void RequestTextureLevel(uint texture_index, float lod) {
+    const uint level = uint(max(floor(lod), 0.0));
+    // Most invocations request what has already been requested; avoid the atomic then
+    if (texture_streaming[texture_index].requested_level > level) {
+        atomicMin(texture_streaming[texture_index].requested_level, level);
+    }
+}
+
+#endif
@@ -0,0 +1,58 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef TLAS_INSTANCES_GLSL_H
+#define TLAS_INSTANCES_GLSL_H
+
+#include "core/vulkan/host_glsl_shared.h"
+
+// Of the instance table that the instances of TLASes are generated from on the GPU, see
+// tlas_instances.comp
+BEGIN_STRUCT(TLASInstanceSource)
+
+// Rows of the world transform, as in VkTransformMatrixKHR
+vec4 transform_row0;
+vec4 transform_row1;
+vec4 transform_row2;
+vec4 bounding_sphere; // World space center and radius, a negative radius if unbounded
+uint mesh;            // Of its LOD BLASes
+uint custom_index;
+uint hit_group;
+uint mask_and_flags; // Instance mask in the low 8 bits, then the geometry instance flags
+
+END_STRUCT(TLASInstanceSource)
+
+// As VkAccelerationStructureInstanceKHR
+BEGIN_STRUCT(TLASInstance)
+
+vec4 transform_row0;
+vec4 transform_row1;
+vec4 transform_row2;
+uint custom_index_and_mask;   // Instance custom index in the low 24 bits, then the mask
+uint hit_group_and_flags;     // Shader binding table record offset, then the flags
+uvec2 blas_address;           // Low and high bits
+
+END_STRUCT(TLASInstance)
+
+BEGIN_STRUCT(TLASInstancesPushConstant)
+
+vec3 camera_position;
+// Instances farther from the camera than this are culled, 0 culls none
+float cull_distance;
+// Instances whose bounding spheres have a smaller radius relative to their distance from the
+// camera are culled, 0 culls none
+float min_projected_size;
+// Each instance takes the next coarser LOD BLAS of its mesh at every this many times the radius
+// of its bounding sphere of distance from the camera, 0 always takes the finest
+float lod_distance;
+uint num_instances;
+INSERT_PADDING(1)
+
+END_STRUCT(TLASInstancesPushConstant)
+
+#ifndef GL_core_profile
+static_assert(sizeof(Renderer::GLSL::TLASInstance) == sizeof(VkAccelerationStructureInstanceKHR));
+#endif
+
+#endif
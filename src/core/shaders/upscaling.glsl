@@ -0,0 +1,63 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#ifndef _UPSCALING_GLSL
+#define _UPSCALING_GLSL
+
+// Spatial upscaling after AMD FidelityFX Super Resolution 1 (Lottes). A Lanczos-2 filter over the
+// 4x4 texels around the sample is clamped to the 2x2 nearest, which removes its ringing, and then
+// sharpened by as much as the contrast of those leaves room for, like RCAS. Unlike EASU, the
+// kernel is not stretched along edges.
+
+float Lanczos2(float x) {
+    x = abs(x);
+    if (x >= 2.0) {
+        return 0.0;
+    }
+    if (x < 1e-5) {
+        return 1.0;
+    }
+    const float px = 3.14159265 * x;
+    return 2.0 * sin(px) * sin(px * 0.5) / (px * px);
+}
+
+// The position is in texels of the source, which covers its extent at the top left of the image
+vec3 Upscale(sampler2D src, vec2 position, ivec2 extent, float sharpness) {
+    const vec2 center = position - 0.5;
+    const ivec2 base = ivec2(floor(center));
+    const vec2 f = center - vec2(base);
+
+    vec3 sum = vec3(0);
+    float weight_sum = 0;
+    vec3 nearest_min = vec3(1e30);
+    vec3 nearest_max = vec3(0);
+    vec3 nearest_sum = vec3(0);
+    for (int y = -1; y <= 2; ++y) {
+        for (int x = -1; x <= 2; ++x) {
+            const ivec2 tap = clamp(base + ivec2(x, y), ivec2(0), extent - 1);
+            const vec3 color = max(texelFetch(src, tap, 0).rgb, vec3(0));
+            const float weight = Lanczos2(float(x) - f.x) * Lanczos2(float(y) - f.y);
+            sum += color * weight;
+            weight_sum += weight;
+            if (x >= 0 && x <= 1 && y >= 0 && y <= 1) {
+                nearest_min = min(nearest_min, color);
+                nearest_max = max(nearest_max, color);
+                nearest_sum += color;
+            }
+        }
+    }
+    vec3 color = clamp(sum / weight_sum, nearest_min, nearest_max);
+    if (sharpness > 0) {
+        // Compared tonemapped, so that bright texels do not suppress it
+        const vec3 mapped_min = nearest_min / (1.0 + nearest_min);
+        const vec3 mapped_max = nearest_max / (1.0 + nearest_max);
+        const vec3 amount =
+            sharpness * sqrt(clamp(min(mapped_min, 1.0 - mapped_max) / max(mapped_max, 1e-5),
+                                   vec3(0), vec3(1)));
+        color = clamp(color + (color - nearest_sum * 0.25) * amount, nearest_min, nearest_max);
+    }
+    return color;
+}
+
+#endif
@@ -0,0 +1,157 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+// Loads of vertex attributes through the addresses and types of a PrimitiveInfo. Needs the
+// explicit arithmetic types (int8 to int64), buffer_reference2 and scalar_block_layout.
+
+#ifndef VERTEX_FETCH_GLSL
+#define VERTEX_FETCH_GLSL
+
+#include "core/shaders/primitive_glsl.h"
+
+// Used to dereference buffer addresses
+layout(buffer_reference, scalar, buffer_reference_align = 2) readonly buffer Index_U16 {
+    u16vec3 v;
+};
+layout(buffer_reference, scalar, buffer_reference_align = 4) readonly buffer Index_U32 {
+    u32vec3 v;
+};
+
+uvec3 ReadTriangleIndices(PrimitiveInfo primitive, int primitive_id) {
+    if (primitive.index_size == 2) {
+        return Index_U16(primitive.index_address)[primitive_id].v;
+    } else if (primitive.index_size == 4) {
+        return Index_U32(primitive.index_address)[primitive_id].v;
+    } else {
+        return uvec3(primitive_id * 3, primitive_id * 3 + 1, primitive_id * 3 + 2);
+    }
+}
+
+// Typed variables (may have different times that need to be resolved at runtime)
+// Positions, normals, tangents and texcoords may be quantized, see PrimitiveInfo for the types.
+// Non-normalized values are returned as is, the node transform dequantizes them.
+#define DEFINE_QUANTIZED_LOAD(Name, N)                                                             \
+    layout(buffer_reference, scalar, buffer_reference_align = 4) readonly buffer Name {            \
+        vec##N v;                                                                                  \
+    };                                                                                             \
+    layout(buffer_reference, scalar, buffer_reference_align = 1) readonly buffer Name##_U8 {       \
+        u8vec##N v;                                                                                \
+    };                                                                                             \
+    layout(buffer_reference, scalar, buffer_reference_align = 2) readonly buffer Name##_U16 {      \
+        u16vec##N v;                                                                               \
+    };                                                                                             \
+    layout(buffer_reference, scalar, buffer_reference_align = 1) readonly buffer Name##_S8 {       \
+        i8vec##N v;                                                                                \
+    };                                                                                             \
+    layout(buffer_reference, scalar, buffer_reference_align = 2) readonly buffer Name##_S16 {      \
+        i16vec##N v;                                                                               \
+    };                                                                                             \
+    vec##N LoadQuantized##Name(uint64_t address, uint type) {                                      \
+        switch (type) {                                                                            \
+        case 0:                                                                                    \
+            return Name(address).v;                                                                \
+        case 1:                                                                                    \
+            return Name##_U8(address).v / 255.0;                                                   \
+        case 2:                                                                                    \
+            return Name##_U16(address).v / 65535.0;                                                \
+        case 3:                                                                                    \
+            return max(Name##_S8(address).v / 127.0, -1.0);                                        \
+        case 4:                                                                                    \
+            return max(Name##_S16(address).v / 32767.0, -1.0);                                     \
+        case 5:                                                                                    \
+            return vec##N(Name##_U8(address).v);                                                   \
+        case 6:                                                                                    \
+            return vec##N(Name##_U16(address).v);                                                  \
+        case 7:                                                                                    \
+            return vec##N(Name##_S8(address).v);                                                   \
+        default:                                                                                   \
+            return vec##N(Name##_S16(address).v);                                                  \
+        }                                                                                          \
+    }
+
+DEFINE_QUANTIZED_LOAD(Position, 3)
+DEFINE_QUANTIZED_LOAD(Normal, 3)
+DEFINE_QUANTIZED_LOAD(Tangent, 4)
+DEFINE_QUANTIZED_LOAD(TexCoord, 2)
+#undef DEFINE_QUANTIZED_LOAD
+
+// Attributes packed by the loader (types 9 and 10), two 16-bit values in a word
+layout(buffer_reference, scalar, buffer_reference_align = 4) readonly buffer Packed16x2 {
+    uint v;
+};
+
+// See Cigolle et al., "A Survey of Efficient Representations for Independent Unit Vectors"
+vec3 OctahedralDecode(vec2 e) {
+    vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (v.z < 0.0) {
+        v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(v);
+}
+
+vec3 LoadPosition(uint64_t address, uint type) {
+    return LoadQuantizedPosition(address, type);
+}
+
+vec3 LoadNormal(uint64_t address, uint type) {
+    if (type == 9) {
+        return OctahedralDecode(unpackSnorm2x16(Packed16x2(address).v));
+    }
+    return LoadQuantizedNormal(address, type);
+}
+
+vec4 LoadTangent(uint64_t address, uint type) {
+    if (type == 9) {
+        const uint packed = Packed16x2(address).v;
+        return vec4(OctahedralDecode(unpackSnorm2x16(packed)),
+                    (packed & 0x10000u) != 0 ? -1.0 : 1.0);
+    }
+    return LoadQuantizedTangent(address, type);
+}
+
+vec2 LoadTexCoord(uint64_t address, uint type) {
+    if (type == 10) {
+        return unpackHalf2x16(Packed16x2(address).v);
+    }
+    return LoadQuantizedTexCoord(address, type);
+}
+
+layout(buffer_reference, scalar, buffer_reference_align = 4) readonly buffer Color4 {
+    vec4 v;
+};
+layout(buffer_reference, scalar, buffer_reference_align = 1) readonly buffer Color4_U8 {
+    u8vec4 v;
+};
+layout(buffer_reference, scalar, buffer_reference_align = 2) readonly buffer Color4_U16 {
+    u16vec4 v;
+};
+layout(buffer_reference, scalar, buffer_reference_align = 4) readonly buffer Color3 {
+    vec3 v;
+};
+layout(buffer_reference, scalar, buffer_reference_align = 1) readonly buffer Color3_U8 {
+    u8vec3 v;
+};
+layout(buffer_reference, scalar, buffer_reference_align = 2) readonly buffer Color3_U16 {
+    u16vec3 v;
+};
+vec4 LoadColor(uint64_t address, uint type) {
+    if (type == 0) {
+        return Color4(address).v;
+    }
+    if (type == 1) {
+        return Color4_U8(address).v / 255.0;
+    }
+    if (type == 2) {
+        return Color4_U16(address).v / 65535.0;
+    }
+    if (type == 3) {
+        return vec4(Color3(address).v, 1.0);
+    }
+    if (type == 4) {
+        return vec4(Color3_U8(address).v / 255.0, 1.0);
+    }
+    return vec4(Color3_U16(address).v / 65535.0, 1.0);
+}
+
+#endif
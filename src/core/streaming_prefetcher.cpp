@@ -0,0 +1,157 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include "core/instance_bvh.h"
+#include "core/scene.h"
+#include "core/streaming_prefetcher.h"
+#include "core/vulkan/vulkan_geometry_streamer.h"
+#include "core/vulkan/vulkan_texture_streamer.h"
+
+namespace Renderer {
+
+// Weight of the motion of the latest frame in the smoothed velocity
+static constexpr float VelocitySmoothing = 0.25f;
+// Slower cameras are treated as standing still, in world units per frame
+static constexpr float MinSpeed = 1e-4f;
+static constexpr float MinAngularSpeed = 1e-4f; // Radians per frame
+
+StreamingPrefetcher::StreamingPrefetcher() = default;
+
+StreamingPrefetcher::~StreamingPrefetcher() = default;
+
+void StreamingPrefetcher::SetCameraPath(std::vector<glm::mat4> views) {
+    camera_path = std::move(views);
+    path_frame = 0;
+}
+
+bool StreamingPrefetcher::PredictViews(const glm::mat4& view) {
+    predicted_views.clear();
+    constexpr std::size_t Step = LookaheadFrames / NumPredictedViews;
+
+    // The path starts at the frame of the first Update after it was set, and is extrapolated
+    // beyond its end
+    if (path_frame < camera_path.size()) {
+        const std::size_t frame = path_frame++;
+        for (std::size_t i = 1; i <= NumPredictedViews; ++i) {
+            const std::size_t ahead = frame + i * Step;
+            if (ahead >= camera_path.size()) {
+                break;
+            }
+            predicted_views.emplace_back(camera_path[ahead]);
+        }
+        last_view = view;
+        return !predicted_views.empty();
+    }
+
+    // Extrapolated in world space, from the camera to world transforms
+    const glm::mat4 camera = glm::inverse(view);
+    const glm::vec3 position{camera[3]};
+    const glm::quat rotation = glm::quat_cast(glm::mat3{camera});
+    if (!last_view) {
+        last_view = view;
+        return false;
+    }
+    const glm::mat4 last_camera = glm::inverse(*last_view);
+    last_view = view;
+    velocity = glm::mix(velocity, position - glm::vec3{last_camera[3]}, VelocitySmoothing);
+    glm::quat rotation_delta =
+        glm::normalize(rotation * glm::inverse(glm::quat_cast(glm::mat3{last_camera})));
+    if (rotation_delta.w < 0) { // Along the shorter arc
+        rotation_delta = -rotation_delta;
+    }
+    const float angle = glm::angle(rotation_delta);
+    if (glm::length(velocity) < MinSpeed && angle < MinAngularSpeed) {
+        return false;
+    }
+
+    const glm::vec3 axis = glm::axis(rotation_delta);
+    for (std::size_t i = 1; i <= NumPredictedViews; ++i) {
+        const auto frames = static_cast<float>(i * Step);
+        // At most half a turn, beyond which the direction of the rotation is lost
+        const glm::quat turned =
+            angle < MinAngularSpeed
+                ? rotation
+                : glm::angleAxis(std::min(angle * frames, glm::pi<float>()), axis) * rotation;
+        glm::mat4 predicted = glm::mat4_cast(turned);
+        predicted[3] = glm::vec4{position + velocity * frames, 1.0f};
+        predicted_views.emplace_back(glm::inverse(predicted));
+    }
+    return true;
+}
+
+void StreamingPrefetcher::PrefetchView(const Scene& scene, const SubScene& sub_scene,
+                                       const glm::mat4& view, const glm::mat4& proj,
+                                       u32 render_height, float weight) {
+    auto& geometry_streamer = *scene.geometry_streamer;
+    auto& texture_streamer = *scene.texture_streamer;
+    const glm::vec3 camera_position{glm::inverse(view)[3]};
+    // Pixels per unit of size over distance, vertically
+    const float pixel_scale = std::abs(proj[1][1]) * static_cast<float>(render_height) * 0.5f;
+
+    visible_instances.clear();
+    sub_scene.instance_bvh->Cull(Frustum{proj * view}, visible_instances);
+    for (const u32 instance : visible_instances) {
+        const auto& bounds = sub_scene.instance_bounds[instance];
+        const glm::vec3 extent = bounds.max_point - bounds.min_point;
+        if (!std::isfinite(extent.x + extent.y + extent.z)) {
+            continue; // Always drawn, so always requested
+        }
+        // Roughly how large the instance will be on screen, like the requests of the renderers
+        const float radius = glm::length(extent) * 0.5f;
+        const float distance =
+            glm::distance((bounds.min_point + bounds.max_point) * 0.5f, camera_position);
+        const float size = radius / std::max(distance - radius, 1e-3f);
+
+        const u32 mesh_idx = sub_scene.instance_meshes[instance];
+        if (geometry_streamer.IsEnabled()) {
+            geometry_streamer.Prefetch(mesh_idx, size * weight);
+        }
+        if (!texture_streamer.IsEnabled()) {
+            continue;
+        }
+        // As if the textures of the mesh were mapped once over its bounds
+        const float pixels = 2 * size * pixel_scale;
+        for (const auto& primitive : scene.meshes[mesh_idx]->primitives) {
+            if (primitive->material == -1) {
+                continue;
+            }
+            const auto& material =
+                scene.materials[static_cast<std::size_t>(primitive->material)]->glsl_material;
+            for (const int texture_idx : {
+                     material.base_color_texture_index,
+                     material.metallic_roughness_texture_index,
+                     material.normal_texture_index,
+                     material.occlusion_texture_index,
+                     material.emissive_texture_index,
+                 }) {
+                if (texture_idx != -1) {
+                    texture_streamer.Prefetch(static_cast<std::size_t>(texture_idx), pixels);
+                }
+            }
+        }
+    }
+}
+
+void StreamingPrefetcher::Update(const Scene& scene, const SubScene& sub_scene,
+                                 const glm::mat4& view, const glm::mat4& proj,
+                                 u32 render_height) {
+    if (!scene.geometry_streamer->IsEnabled() && !scene.texture_streamer->IsEnabled()) {
+        return;
+    }
+    if (!PredictViews(view)) {
+        return;
+    }
+    // The nearer predictions come first, as they are more certain and needed sooner
+    for (std::size_t i = 0; i < predicted_views.size(); ++i) {
+        PrefetchView(scene, sub_scene, predicted_views[i], proj, render_height,
+                     1.0f / static_cast<float>(i + 1));
+    }
+}
+
+} // namespace Renderer
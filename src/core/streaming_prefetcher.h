@@ -0,0 +1,63 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <optional>
+#include <vector>
+#include <glm/glm.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class SubScene;
+struct Scene;
+
+/**
+ * Predicts the views of the camera over the next frames, and prefetches the streamed meshes and
+ * texture levels that they see (see VulkanGeometryStreamer::Prefetch and
+ * VulkanTextureStreamer::Prefetch), so that they are resident by the time they come into view
+ * rather than some frames after they are requested.
+ *
+ * The views are those of the camera path when one is set, e.g. of a benchmark, and are
+ * otherwise extrapolated from the motion of the camera: its velocity, smoothed over the last
+ * frames, and its rotation since the previous frame. A camera that stands still prefetches
+ * nothing, as the feedback of its frames already asks for what it sees. Not thread safe.
+ */
+class StreamingPrefetcher : NonCopyable {
+public:
+    // How many frames ahead the views are predicted, at NumPredictedViews even steps
+    static constexpr std::size_t LookaheadFrames = 30;
+    static constexpr std::size_t NumPredictedViews = 3;
+
+    explicit StreamingPrefetcher();
+    ~StreamingPrefetcher();
+
+    // Views of the frames that follow, one per call to Update from the next one. Empty to
+    // extrapolate them.
+    void SetCameraPath(std::vector<glm::mat4> views);
+
+    // Takes the view of the frame being drawn, and prefetches what the predicted views see with
+    // the projection. The render height (in pixels) picks the texture levels.
+    void Update(const Scene& scene, const SubScene& sub_scene, const glm::mat4& view,
+                const glm::mat4& proj, u32 render_height);
+
+private:
+    // Fills predicted_views, returning false if the camera is not expected to move
+    bool PredictViews(const glm::mat4& view);
+    void PrefetchView(const Scene& scene, const SubScene& sub_scene, const glm::mat4& view,
+                      const glm::mat4& proj, u32 render_height, float weight);
+
+    std::vector<glm::mat4> camera_path;
+    std::size_t path_frame{}; // Index in camera_path of the frame of the next Update
+
+    std::optional<glm::mat4> last_view;
+    glm::vec3 velocity{}; // Of the camera in world space, per frame
+
+    // Kept across frames, so that prefetching does not allocate them every frame
+    std::vector<glm::mat4> predicted_views; // Nearest first
+    std::vector<u32> visible_instances;
+};
+
+} // namespace Renderer
@@ -0,0 +1,217 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <glm/glm.hpp>
+#include <spdlog/spdlog.h>
+#include "common/assert.h"
+#include "common/thread_pool.h"
+#include "core/texture_compression.h"
+
+namespace Renderer {
+
+namespace {
+
+using Block = std::array<glm::u8vec4, 16>;
+
+// Clamps at the edges, so that partial blocks only contain texels of the image
+Block FetchBlock(std::span<const u8> pixels, u32 width, u32 height, u32 block_x, u32 block_y) {
+    Block block;
+    for (u32 y = 0; y < 4; ++y) {
+        const u32 src_y = std::min(block_y * 4 + y, height - 1);
+        for (u32 x = 0; x < 4; ++x) {
+            const u32 src_x = std::min(block_x * 4 + x, width - 1);
+            const auto* src = pixels.data() + (std::size_t{src_y} * width + src_x) * 4;
+            block[y * 4 + x] = {src[0], src[1], src[2], src[3]};
+        }
+    }
+    return block;
+}
+
+void EncodeBC4(const Block& block, int channel, u8* out) {
+    u8 max = 0, min = 255;
+    for (const auto& texel : block) {
+        max = std::max(max, texel[channel]);
+        min = std::min(min, texel[channel]);
+    }
+
+    // With endpoint 0 > endpoint 1, index 0 is the max, 1 the min and 2-7 are the six
+    // interpolated values from max to min
+    static constexpr std::array<u64, 8> IndexForStep{1, 7, 6, 5, 4, 3, 2, 0};
+    u64 indices = 0;
+    if (max != min) {
+        const int range = max - min;
+        for (std::size_t i = 0; i < block.size(); ++i) {
+            // Nearest of the 8 evenly spaced values from min to max
+            const int step = ((block[i][channel] - min) * 14 + range) / (range * 2);
+            indices |= IndexForStep[step] << (3 * i);
+        }
+    }
+
+    out[0] = max;
+    out[1] = min;
+    for (int i = 0; i < 6; ++i) {
+        out[2 + i] = static_cast<u8>(indices >> (8 * i));
+    }
+}
+
+class BitWriter {
+public:
+    explicit BitWriter(u8* out_) : out(out_) {
+        std::fill_n(out, 16, u8{0});
+    }
+
+    void Write(u32 value, u32 bits) {
+        for (u32 i = 0; i < bits; ++i, ++pos) {
+            out[pos / 8] |= static_cast<u8>(((value >> i) & 1) << (pos % 8));
+        }
+    }
+
+private:
+    u8* out{};
+    u32 pos{};
+};
+
+// Mode 6: one subset, RGBA 7.7.7.7 endpoints with a unique p-bit each, 4 bit indices
+void EncodeBC7(const Block& block, u8* out) {
+    static constexpr std::array<int, 16> Weights{0,  4,  9,  13, 17, 21, 26, 30,
+                                                 34, 38, 43, 47, 51, 55, 60, 64};
+
+    // Principal axis of the texels by power iteration
+    glm::vec4 mean{};
+    for (const auto& texel : block) {
+        mean += glm::vec4{texel};
+    }
+    mean /= 16.0f;
+    glm::mat4 covariance{0.0f};
+    for (const auto& texel : block) {
+        const auto d = glm::vec4{texel} - mean;
+        covariance += glm::outerProduct(d, d);
+    }
+    glm::vec4 axis{1.0f};
+    for (int i = 0; i < 8; ++i) {
+        axis = covariance * axis;
+        const float length = glm::length(axis);
+        if (length < 1e-6f) {
+            axis = {};
+            break;
+        }
+        axis /= length;
+    }
+
+    float min_t = 0.0f, max_t = 0.0f;
+    for (const auto& texel : block) {
+        const float t = glm::dot(glm::vec4{texel} - mean, axis);
+        min_t = std::min(min_t, t);
+        max_t = std::max(max_t, t);
+    }
+    const std::array<glm::vec4, 2> endpoints{
+        glm::clamp(mean + axis * min_t, 0.0f, 255.0f),
+        glm::clamp(mean + axis * max_t, 0.0f, 255.0f),
+    };
+
+    // Quantize with the p-bit giving the least error
+    std::array<glm::ivec4, 2> quantized;
+    std::array<int, 2> p_bits;
+    for (std::size_t i = 0; i < 2; ++i) {
+        float best_error = std::numeric_limits<float>::max();
+        for (int p = 0; p < 2; ++p) {
+            const auto q = glm::clamp(glm::ivec4{glm::round((endpoints[i] - float(p)) / 2.0f)},
+                                      0, 127);
+            const auto d = glm::vec4{q * 2 + p} - endpoints[i];
+            const float error = glm::dot(d, d);
+            if (error < best_error) {
+                best_error = error;
+                quantized[i] = q;
+                p_bits[i] = p;
+            }
+        }
+    }
+
+    std::array<glm::ivec4, 16> palette;
+    const auto e0 = quantized[0] * 2 + p_bits[0];
+    const auto e1 = quantized[1] * 2 + p_bits[1];
+    for (std::size_t i = 0; i < palette.size(); ++i) {
+        palette[i] = ((64 - Weights[i]) * e0 + Weights[i] * e1 + 32) >> 6;
+    }
+
+    std::array<u32, 16> indices;
+    for (std::size_t i = 0; i < block.size(); ++i) {
+        int best_error = std::numeric_limits<int>::max();
+        for (u32 j = 0; j < palette.size(); ++j) {
+            const auto d = glm::ivec4{block[i]} - palette[j];
+            const int error = d.x * d.x + d.y * d.y + d.z * d.z + d.w * d.w;
+            if (error < best_error) {
+                best_error = error;
+                indices[i] = j;
+            }
+        }
+    }
+
+    // The MSB of the first index is implicitly 0. The weights are symmetric, so swapping the
+    // endpoints and inverting the indices gives the same colors.
+    if (indices[0] >= 8) {
+        std::swap(quantized[0], quantized[1]);
+        std::swap(p_bits[0], p_bits[1]);
+        for (auto& index : indices) {
+            index = 15 - index;
+        }
+    }
+
+    BitWriter writer{out};
+    writer.Write(1 << 6, 7);
+    for (glm::length_t channel = 0; channel < 4; ++channel) {
+        writer.Write(static_cast<u32>(quantized[0][channel]), 7);
+        writer.Write(static_cast<u32>(quantized[1][channel]), 7);
+    }
+    writer.Write(static_cast<u32>(p_bits[0]), 1);
+    writer.Write(static_cast<u32>(p_bits[1]), 1);
+    writer.Write(indices[0], 3);
+    for (std::size_t i = 1; i < indices.size(); ++i) {
+        writer.Write(indices[i], 4);
+    }
+}
+
+} // namespace
+
+void CompressBlocks(BlockFormat format, std::span<const u8> pixels, u32 width, u32 height,
+                    std::span<u8> out, Common::ThreadPool* thread_pool) {
+    ASSERT_MSG(pixels.size() == std::size_t{width} * height * 4, "Invalid pixel data size");
+    ASSERT_MSG(out.size() == GetCompressedSize(format, width, height), "Invalid output size");
+
+    const u32 blocks_x = (width + 3) / 4;
+    const u32 blocks_y = (height + 3) / 4;
+    const auto CompressRow = [&](std::size_t block_y) {
+        for (u32 block_x = 0; block_x < blocks_x; ++block_x) {
+            const auto block =
+                FetchBlock(pixels, width, height, block_x, static_cast<u32>(block_y));
+            u8* dst = out.data() + (block_y * blocks_x + block_x) * GetBlockSize(format);
+            switch (format) {
+            case BlockFormat::BC4:
+                EncodeBC4(block, 0, dst);
+                break;
+            case BlockFormat::BC5:
+                EncodeBC4(block, 0, dst);
+                EncodeBC4(block, 1, dst + 8);
+                break;
+            case BlockFormat::BC7:
+                EncodeBC7(block, dst);
+                break;
+            }
+        }
+    };
+
+    if (thread_pool) {
+        thread_pool->ParallelFor(0, blocks_y, CompressRow);
+    } else {
+        for (u32 block_y = 0; block_y < blocks_y; ++block_y) {
+            CompressRow(block_y);
+        }
+    }
+}
+
+} // namespace Renderer
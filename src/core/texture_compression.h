@@ -0,0 +1,39 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <span>
+#include "common/common_types.h"
+
+namespace Common {
+class ThreadPool;
+}
+
+namespace Renderer {
+
+/**
+ * Fast CPU block compressors, for compressing textures at load time.
+ * BC4 encodes the R channel, BC5 the RG channels, and BC7 all of RGBA (using mode 6 only).
+ */
+enum class BlockFormat {
+    BC4,
+    BC5,
+    BC7,
+};
+
+constexpr std::size_t GetBlockSize(BlockFormat format) {
+    return format == BlockFormat::BC4 ? 8 : 16;
+}
+
+constexpr std::size_t GetCompressedSize(BlockFormat format, u32 width, u32 height) {
+    return std::size_t{(width + 3) / 4} * ((height + 3) / 4) * GetBlockSize(format);
+}
+
+// Compresses tightly packed RGBA8 pixels into out, which must be GetCompressedSize() bytes.
+// Rows of blocks are spread across the thread pool if there is one.
+void CompressBlocks(BlockFormat format, std::span<const u8> pixels, u32 width, u32 height,
+                    std::span<u8> out, Common::ThreadPool* thread_pool = nullptr);
+
+} // namespace Renderer
@@ -17,8 +17,11 @@
 
 #define INSERT_PADDING(num_scalars)
 
+#define ARRAY(Type, name, size) Type name[size]
+
 #else
 
+#include <array>
 #include <glm/glm.hpp>
 #include "common/common_types.h"
 #include "core/vulkan/vulkan_helpers.hpp"
@@ -55,6 +58,10 @@ static_assert(sizeof(int) == 4);
     float CONCAT2(pad3_, __LINE__);
 #define INSERT_PADDING(num_scalars) INSERT_PADDING_##num_scalars
 
+// Fixed size arrays of members, which are std::arrays on the host as boost::pfr cannot verify raw
+// arrays
+#define ARRAY(Type, name, size) std::array<Type, size> name
+
 #endif
 
 #endif
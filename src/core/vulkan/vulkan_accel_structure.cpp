@@ -2,45 +2,166 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/assert.h"
+#include "common/profiling.h"
 #include "common/ranges.h"
+#include "common/thread_pool.h"
 #include "core/vulkan/vulkan_accel_structure.h"
 #include "core/vulkan/vulkan_allocator.h"
 #include "core/vulkan/vulkan_buffer.h"
 #include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_tlas_instance_generator.h"
+#include "core/vulkan/vulkan_upload_ring.h"
 
 namespace Renderer {
 
+namespace {
+
+// Start of the output of vkCmdCopyAccelerationStructureToMemoryKHR
+struct SerializedHeader {
+    std::array<u8, VK_UUID_SIZE> driver_uuid;
+    std::array<u8, VK_UUID_SIZE> compatibility_uuid;
+    u64 serialized_size;
+    u64 deserialized_size;
+    u64 num_handles; // Of referenced BLASes, 0 for BLASes themselves
+};
+
+constexpr vk::BuildAccelerationStructureFlagsKHR UpdatableFlags =
+    vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace |
+    vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+
+vk::AccelerationStructureGeometryKHR GetInstancesGeometry(vk::DeviceAddress address) {
+    return {
+        .geometryType = vk::GeometryTypeKHR::eInstances,
+        .geometry =
+            {
+                .instances =
+                    {
+                        .data =
+                            {
+                                .deviceAddress = address,
+                            },
+                    },
+            },
+    };
+}
+
+} // namespace
+
 VulkanAccelStructureMemory::VulkanAccelStructureMemory(
-    const VulkanDevice& device, vk::AccelerationStructureCreateInfoKHR create_info) {
+    const VulkanDevice& device, vk::AccelerationStructureCreateInfoKHR create_info,
+    bool host_visible)
+    : VulkanAccelStructureMemory(device, create_info,
+                                 CreateBuffer(device, create_info.size, host_visible), 0) {}
 
-    buffer = std::make_unique<VulkanBuffer>(
-        *device.allocator,
-        vk::BufferCreateInfo{
-            .size = create_info.size,
-            .usage = vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
-                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
-        },
-        VmaAllocationCreateInfo{
-            .usage = VMA_MEMORY_USAGE_AUTO,
-        });
+VulkanAccelStructureMemory::VulkanAccelStructureMemory(
+    const VulkanDevice& device, vk::AccelerationStructureCreateInfoKHR create_info,
+    std::shared_ptr<VulkanBuffer> buffer_, vk::DeviceSize offset_)
+    : buffer(std::move(buffer_)), offset(offset_), size(create_info.size) {
 
     create_info.buffer = **buffer;
-    create_info.offset = 0;
+    create_info.offset = offset;
     as = vk::raii::AccelerationStructureKHR{*device, create_info};
+    address = device->getAccelerationStructureAddressKHR({
+        .accelerationStructure = *as,
+    });
 }
 
 VulkanAccelStructureMemory::~VulkanAccelStructureMemory() = default;
 
+std::vector<std::unique_ptr<VulkanAccelStructureMemory>> VulkanAccelStructureMemory::CreatePooled(
+    const VulkanDevice& device, std::span<const vk::DeviceSize> sizes,
+    vk::AccelerationStructureTypeKHR type, bool host_visible) {
+
+    std::vector<std::unique_ptr<VulkanAccelStructureMemory>> out;
+    std::size_t pool_begin = 0;
+    while (pool_begin < sizes.size()) {
+        // Take structures until the pool is full
+        std::vector<vk::DeviceSize> offsets;
+        vk::DeviceSize pool_size = 0;
+        std::size_t pool_end = pool_begin;
+        for (; pool_end < sizes.size(); ++pool_end) {
+            const vk::DeviceSize offset = Common::AlignUp(pool_size, Alignment);
+            if (pool_end != pool_begin && offset + sizes[pool_end] > MaxPoolSize) {
+                break;
+            }
+            offsets.emplace_back(offset);
+            pool_size = offset + sizes[pool_end];
+        }
+
+        const auto pool = CreateBuffer(device, pool_size, host_visible);
+        for (std::size_t i = pool_begin; i < pool_end; ++i) {
+            out.emplace_back(new VulkanAccelStructureMemory(device,
+                                                            {
+                                                                .size = sizes[i],
+                                                                .type = type,
+                                                            },
+                                                            pool, offsets[i - pool_begin]));
+        }
+        pool_begin = pool_end;
+    }
+    return out;
+}
+
+std::shared_ptr<VulkanBuffer> VulkanAccelStructureMemory::CreateBuffer(const VulkanDevice& device,
+                                                                      vk::DeviceSize size,
+                                                                      bool host_visible) {
+    // Built on the compute queue, but traced against on the graphics queue
+    vk::BufferCreateInfo buffer_create_info{
+        .size = size,
+        .usage = vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
+                 vk::BufferUsageFlagBits::eShaderDeviceAddress,
+    };
+    if (device.shared_queue_families.size() > 1) {
+        buffer_create_info.sharingMode = vk::SharingMode::eConcurrent;
+        buffer_create_info.setQueueFamilyIndices(device.shared_queue_families);
+    }
+    VmaAllocationCreateInfo alloc_create_info{
+        .usage = VMA_MEMORY_USAGE_AUTO,
+    };
+    if (host_visible) {
+        alloc_create_info = {
+            .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+            .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+        };
+    }
+    auto buffer = std::make_shared<VulkanBuffer>(*device.allocator, buffer_create_info,
+                                                 alloc_create_info,
+                                                 MemoryCategory::AccelStructures);
+    buffer->SetName("acceleration structures");
+    return buffer;
+}
+
 VulkanAccelStructure::VulkanAccelStructure(
     VulkanDevice& device_,
     const vk::ArrayProxy<const vk::AccelerationStructureGeometryKHR>& geometries,
     const vk::ArrayProxy<const vk::AccelerationStructureBuildRangeInfoKHR>& build_ranges,
-    vk::AccelerationStructureTypeKHR type_)
-    : device(device_), type(type_) {
+    vk::AccelerationStructureTypeKHR type_, bool allow_update_)
+    : device(device_), type(type_), allow_update(allow_update_) {
 
+    if (allow_update) {
+        update_geometries.assign(geometries.begin(), geometries.end());
+        update_build_ranges.assign(build_ranges.begin(), build_ranges.end());
+    }
     Init(geometries, build_ranges);
 }
 
+VulkanAccelStructure::VulkanAccelStructure(
+    VulkanDevice& device_, std::unique_ptr<VulkanAccelStructureMemory> compacted_as_,
+    vk::DeviceSize build_size_)
+    : build_size(build_size_ ? build_size_ : compacted_as_->size), device(device_),
+      type(vk::AccelerationStructureTypeKHR::eBottomLevel),
+      compacted_as(std::move(compacted_as_)), compacted(true) {}
+
 constexpr vk::TransformMatrixKHR ToVulkanMatrix(const glm::mat4& mat) {
     return {std::array{
         std::array{mat[0][0], mat[1][0], mat[2][0], mat[3][0]},
@@ -49,62 +170,185 @@ constexpr vk::TransformMatrixKHR ToVulkanMatrix(const glm::mat4& mat) {
     }};
 }
 
-VulkanAccelStructure::VulkanAccelStructure(const vk::ArrayProxy<const BLASInstance>& instances)
-    : device((*instances.begin()).blas.device), type(vk::AccelerationStructureTypeKHR::eTopLevel) {
+VulkanAccelStructure::VulkanAccelStructure(const vk::ArrayProxy<const BLASInstance>& instances,
+                                           bool allow_update_)
+    : device((*instances.begin()).blas.device), type(vk::AccelerationStructureTypeKHR::eTopLevel),
+      allow_update(allow_update_), num_instances(instances.size()) {
 
     const auto instance_geometries = Common::VectorFromRange(
-        instances | std::views::transform([this](const auto& instance) {
-            return vk::AccelerationStructureInstanceKHR{
-                .transform = ToVulkanMatrix(instance.transform),
-                .instanceCustomIndex = instance.custom_index,
-                .mask = 0xFF,
-                .instanceShaderBindingTableRecordOffset = 0,
-                .flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,
-                .accelerationStructureReference = device->getBufferAddress({
-                    .buffer = **instance.blas.compacted_as->buffer,
-                }),
-            };
-        }));
-
-    instances_buffer = std::make_unique<VulkanImmUploadBuffer>(
-        device,
-        VulkanBufferCreateInfo{
-            .size = instance_geometries.size() * sizeof(vk::AccelerationStructureInstanceKHR),
-            .usage = vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+        instances |
+        std::views::transform([this](const auto& instance) { return GetInstance(instance); }));
+    const std::size_t size =
+        instance_geometries.size() * sizeof(vk::AccelerationStructureInstanceKHR);
+
+    vk::DeviceAddress instances_address{};
+    if (allow_update) {
+        // Rewritten by the host on every update
+        mapped_instances_buffer = std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage = vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                         vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::AccelStructures);
+        mapped_instances_buffer->SetName("TLAS instances");
+        std::memcpy(mapped_instances_buffer->allocation_info.pMappedData,
+                    instance_geometries.data(), size);
+        vmaFlushAllocation(**device.allocator, mapped_instances_buffer->allocation, 0,
+                           VK_WHOLE_SIZE);
+        instances_address = device->getBufferAddress({
+            .buffer = **mapped_instances_buffer,
+        });
+    } else {
+        instances_buffer = std::make_unique<VulkanImmUploadBuffer>(
+            device,
+            VulkanBufferCreateInfo{
+                .size = size,
+                .usage = vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                         vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                .dst_stage_mask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                .dst_access_mask = vk::AccessFlagBits2::eShaderRead,
+                .category = MemoryCategory::AccelStructures,
+            },
+            reinterpret_cast<const u8*>(instance_geometries.data()));
+        instances_buffer->SetName("TLAS instances");
+        instances_address = device->getBufferAddress({
+            .buffer = **instances_buffer,
+        });
+    }
+    Init(GetInstancesGeometry(instances_address), vk::AccelerationStructureBuildRangeInfoKHR{
+                                                      .primitiveCount = num_instances,
+                                                  });
+}
+
+VulkanAccelStructure::VulkanAccelStructure(VulkanDevice& device_,
+                                           std::unique_ptr<VulkanTLASInstanceGenerator> generator,
+                                           const glm::vec3& camera_position)
+    : device(device_), type(vk::AccelerationStructureTypeKHR::eTopLevel),
+      num_instances(generator->GetNumInstances()), instance_generator(std::move(generator)) {
+
+    const auto geometry = GetInstancesGeometry(device->getBufferAddress({
+        .buffer = *instance_generator->GetInstancesBuffer(),
+    }));
+    const auto size_info = device->getAccelerationStructureBuildSizesKHR(
+        vk::AccelerationStructureBuildTypeKHR::eDevice,
+        {
+            .type = type,
+            .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild,
+            .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
+            .geometryCount = 1,
+            .pGeometries = &geometry,
+        },
+        num_instances);
+    scratch_buffer = std::make_unique<VulkanBuffer>(
+        *device.allocator,
+        vk::BufferCreateInfo{
+            .size = size_info.buildScratchSize,
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer |
                      vk::BufferUsageFlagBits::eShaderDeviceAddress,
-            .dst_stage_mask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
-            .dst_access_mask = vk::AccessFlagBits2::eShaderRead,
         },
-        reinterpret_cast<const u8*>(instance_geometries.data()));
-    Init(
-        vk::AccelerationStructureGeometryKHR{
-            .geometryType = vk::GeometryTypeKHR::eInstances,
-            .geometry =
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Scratch);
+    scratch_buffer->SetName("build scratch");
+    as = std::make_unique<VulkanAccelStructureMemory>(
+        device, vk::AccelerationStructureCreateInfoKHR{
+                    .size = size_info.accelerationStructureSize,
+                    .type = type,
+                });
+    build_size = as->size;
+    compacted = true; // Used as is
+
+    Helpers::OneTimeCommandContext cmd{device};
+    RecordBuild(*cmd, camera_position);
+}
+
+bool VulkanAccelStructure::NeedsRebuild(const glm::vec3& camera_position) const {
+    return instance_generator && instance_generator->NeedsUpdate(camera_position);
+}
+
+void VulkanAccelStructure::RecordBuild(const vk::raii::CommandBuffer& cmd,
+                                       const glm::vec3& camera_position) {
+    ASSERT_MSG(instance_generator, "Instances of the acceleration structure are not generated");
+
+    // Earlier frames trace the structure that is rebuilt in place
+    static constexpr vk::PipelineStageFlags2 TraceStages =
+        vk::PipelineStageFlagBits2::eRayTracingShaderKHR |
+        vk::PipelineStageFlagBits2::eComputeShader | vk::PipelineStageFlagBits2::eFragmentShader;
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = TraceStages,
+            .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+        }},
+    });
+    instance_generator->Record(cmd, camera_position);
+
+    const auto geometry = GetInstancesGeometry(device->getBufferAddress({
+        .buffer = *instance_generator->GetInstancesBuffer(),
+    }));
+    const vk::AccelerationStructureBuildRangeInfoKHR build_range{
+        .primitiveCount = num_instances,
+    };
+    cmd.buildAccelerationStructuresKHR(
+        vk::AccelerationStructureBuildGeometryInfoKHR{
+            .type = type,
+            .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild,
+            .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
+            .dstAccelerationStructure = **as,
+            .geometryCount = 1,
+            .pGeometries = &geometry,
+            .scratchData =
                 {
-                    .instances =
-                        {
-                            .data =
-                                {
-                                    .deviceAddress = device->getBufferAddress({
-                                        .buffer = **instances_buffer,
-                                    }),
-                                },
-                        },
+                    .deviceAddress = device->getBufferAddress({
+                        .buffer = **scratch_buffer,
+                    }),
                 },
         },
-        vk::AccelerationStructureBuildRangeInfoKHR{
-            .primitiveCount = instances.size(),
-        });
+        &build_range);
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+            .srcAccessMask = vk::AccessFlagBits2::eAccelerationStructureWriteKHR,
+            .dstStageMask = TraceStages,
+            .dstAccessMask = vk::AccessFlagBits2::eAccelerationStructureReadKHR,
+        }},
+    });
+}
+
+vk::AccelerationStructureInstanceKHR VulkanAccelStructure::GetInstance(
+    const BLASInstance& instance) const {
+
+    return {
+        .transform = ToVulkanMatrix(instance.transform),
+        .instanceCustomIndex = instance.custom_index,
+        .mask = instance.mask,
+        .instanceShaderBindingTableRecordOffset = instance.hit_group,
+        .flags = static_cast<VkGeometryInstanceFlagsKHR>(instance.flags),
+        // Bottom level structures allowing updates are never compacted
+        .accelerationStructureReference =
+            (instance.blas.compacted_as ? instance.blas.compacted_as : instance.blas.as)->address,
+    };
 }
 
 void VulkanAccelStructure::Init(
     const vk::ArrayProxy<const vk::AccelerationStructureGeometryKHR>& geometries,
     const vk::ArrayProxy<const vk::AccelerationStructureBuildRangeInfoKHR>& build_ranges) {
+    PROFILE_FUNCTION();
 
     vk::AccelerationStructureBuildGeometryInfoKHR geometry_info{
         .type = type,
-        .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace |
-                 vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction,
+        .flags = allow_update ? UpdatableFlags
+                              : vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace |
+                                    vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction,
         .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
         .geometryCount = geometries.size(),
         .pGeometries = geometries.data(),
@@ -120,38 +364,55 @@ void VulkanAccelStructure::Init(
     scratch_buffer =
         std::make_unique<VulkanBuffer>(*device.allocator,
                                        vk::BufferCreateInfo{
-                                           .size = size_info.buildScratchSize,
+                                           // Kept for the updates of those allowing them
+                                           .size = allow_update
+                                                       ? std::max(size_info.buildScratchSize,
+                                                                  size_info.updateScratchSize)
+                                                       : size_info.buildScratchSize,
                                            .usage = vk::BufferUsageFlagBits::eStorageBuffer |
                                                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
                                        },
                                        VmaAllocationCreateInfo{
                                            .usage = VMA_MEMORY_USAGE_AUTO,
-                                       });
+                                       },
+                                       MemoryCategory::Scratch);
+    scratch_buffer->SetName("build scratch");
 
     as = std::make_unique<VulkanAccelStructureMemory>(
         device, vk::AccelerationStructureCreateInfoKHR{
                     .size = size_info.accelerationStructureSize,
                     .type = type,
                 });
+    build_size = as->size;
 
     vk::raii::CommandBuffers cmdbufs{*device,
                                      {
-                                         .commandPool = *device.command_pool,
+                                         .commandPool = device.GetThreadCommandPool(
+                                             device.compute_queue_family),
                                          .level = vk::CommandBufferLevel::ePrimary,
-                                         .commandBufferCount = 2,
+                                         .commandBufferCount = allow_update ? 1u : 2u,
                                      }};
     build_cmdbuf = std::move(cmdbufs[0]);
-    compact_cmdbuf = std::move(cmdbufs[1]);
-
     build_fence = vk::raii::Fence{*device, vk::FenceCreateInfo{}};
-    compact_fence = vk::raii::Fence{*device, vk::FenceCreateInfo{}};
 
-    query_pool =
-        vk::raii::QueryPool{*device,
-                            {
-                                .queryType = vk::QueryType::eAccelerationStructureCompactedSizeKHR,
-                                .queryCount = 1,
-                            }};
+    if (!allow_update) {
+        compact_cmdbuf = std::move(cmdbufs[1]);
+        compact_fence = vk::raii::Fence{*device, vk::FenceCreateInfo{}};
+        query_pool = vk::raii::QueryPool{
+            *device,
+            {
+                .queryType = vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+                .queryCount = 1,
+            }};
+    }
+    if (device.compute_timestamp_period != 0) {
+        // Build begin and end, then compact begin and end
+        timestamp_pool = vk::raii::QueryPool{*device,
+                                             {
+                                                 .queryType = vk::QueryType::eTimestamp,
+                                                 .queryCount = 4,
+                                             }};
+    }
 
     // Fill out remainder fields
     geometry_info.dstAccelerationStructure = **as;
@@ -160,31 +421,65 @@ void VulkanAccelStructure::Init(
     });
 
     build_cmdbuf.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    if (*timestamp_pool) {
+        build_cmdbuf.resetQueryPool(*timestamp_pool, 0, 4);
+        build_cmdbuf.writeTimestamp2(vk::PipelineStageFlagBits2::eNone, *timestamp_pool, 0);
+    }
     build_cmdbuf.buildAccelerationStructuresKHR(geometry_info, build_ranges.data());
-    build_cmdbuf.resetQueryPool(*query_pool, 0, 1);
-    build_cmdbuf.pipelineBarrier2({
-        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
-            .srcStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
-            .srcAccessMask = vk::AccessFlagBits2::eAccelerationStructureWriteKHR,
-            .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
-            .dstAccessMask = vk::AccessFlagBits2::eAccelerationStructureReadKHR,
-        }},
-    });
-    build_cmdbuf.writeAccelerationStructuresPropertiesKHR(
-        **as, vk::QueryType::eAccelerationStructureCompactedSizeKHR, *query_pool, 0);
+    if (*timestamp_pool) {
+        build_cmdbuf.writeTimestamp2(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                                     *timestamp_pool, 1);
+    }
+    if (*query_pool) {
+        build_cmdbuf.resetQueryPool(*query_pool, 0, 1);
+        build_cmdbuf.pipelineBarrier2({
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+                .srcStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                .srcAccessMask = vk::AccessFlagBits2::eAccelerationStructureWriteKHR,
+                .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                .dstAccessMask = vk::AccessFlagBits2::eAccelerationStructureReadKHR,
+            }},
+        });
+        build_cmdbuf.writeAccelerationStructuresPropertiesKHR(
+            **as, vk::QueryType::eAccelerationStructureCompactedSizeKHR, *query_pool, 0);
+    }
 
     build_cmdbuf.end();
 
-    device.graphics_queue.submit({{
-                                     .commandBufferCount = 1,
-                                     .pCommandBuffers = TempArr<vk::CommandBuffer>{*build_cmdbuf},
-                                 }},
-                                 *build_fence);
+    // Wait for the geometry to be uploaded
+    const u64 upload_value = device.upload_ring->Flush();
+    device.Submit2(
+        device.compute_queue,
+        {{
+            .waitSemaphoreInfoCount = 1,
+            .pWaitSemaphoreInfos = TempArr<vk::SemaphoreSubmitInfo>{device.upload_ring->GetWaitInfo(
+                upload_value, vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR)},
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = TempArr<vk::CommandBufferSubmitInfo>{{
+                .commandBuffer = *build_cmdbuf,
+            }},
+        }},
+        *build_fence);
 }
 
 VulkanAccelStructure::~VulkanAccelStructure() = default;
 
+std::chrono::nanoseconds VulkanAccelStructure::ReadGPUTime(u32 first_query) const {
+    if (!*timestamp_pool) {
+        return {};
+    }
+    const auto [result, timestamps] = timestamp_pool.getResults<u64>(
+        first_query, 2, 2 * sizeof(u64), sizeof(u64), vk::QueryResultFlagBits::e64);
+    if (result != vk::Result::eSuccess) {
+        return {};
+    }
+    return std::chrono::nanoseconds{static_cast<s64>(static_cast<double>(timestamps[1] -
+                                                                         timestamps[0]) *
+                                                     device.compute_timestamp_period)};
+}
+
 void VulkanAccelStructure::Compact() {
+    PROFILE_FUNCTION();
     if (compacted) {
         return;
     }
@@ -192,7 +487,13 @@ void VulkanAccelStructure::Compact() {
         return;
     }
 
+    build_gpu_time = ReadGPUTime(0);
     build_fence = nullptr;
+    if (allow_update) { // Used as is
+        timestamp_pool = nullptr;
+        compacted = true;
+        return;
+    }
     build_cmdbuf = nullptr;
     scratch_buffer.reset();
     instances_buffer.reset();
@@ -212,30 +513,816 @@ void VulkanAccelStructure::Compact() {
                                                              });
 
     compact_cmdbuf.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    if (*timestamp_pool) {
+        compact_cmdbuf.writeTimestamp2(vk::PipelineStageFlagBits2::eNone, *timestamp_pool, 2);
+    }
     compact_cmdbuf.copyAccelerationStructureKHR({
         .src = **as,
         .dst = **compacted_as,
         .mode = vk::CopyAccelerationStructureModeKHR::eCompact,
     });
+    if (*timestamp_pool) {
+        compact_cmdbuf.writeTimestamp2(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                                       *timestamp_pool, 3);
+    }
     compact_cmdbuf.end();
 
-    device.graphics_queue.submit({{
-                                     .commandBufferCount = 1,
-                                     .pCommandBuffers = TempArr<vk::CommandBuffer>{*compact_cmdbuf},
-                                 }},
-                                 *compact_fence);
+    device.Submit(device.compute_queue, {{
+                                    .commandBufferCount = 1,
+                                    .pCommandBuffers = TempArr<vk::CommandBuffer>{*compact_cmdbuf},
+                                }},
+                                *compact_fence);
     compacted = true;
 }
 
 void VulkanAccelStructure::Cleanup() {
-    if (!compacted || !as) {
+    if (!compacted || !as || allow_update || instance_generator) {
         return;
     }
     if (compact_fence.getStatus() == vk::Result::eSuccess) {
+        compact_gpu_time = ReadGPUTime(2);
+        timestamp_pool = nullptr;
         compact_fence = nullptr;
         compact_cmdbuf = nullptr;
         as.reset();
     }
 }
 
+bool VulkanAccelStructure::Poll() {
+    Compact();
+    Cleanup();
+    return !*build_fence && !*compact_fence;
+}
+
+void VulkanAccelStructure::Update(const vk::ArrayProxy<const BLASInstance>& instances) {
+    PROFILE_FUNCTION();
+    ASSERT_MSG(allow_update && compacted, "Acceleration structure cannot be updated");
+    ASSERT_MSG(instances.size() == num_instances, "Instances changed");
+
+    auto* mapped = static_cast<vk::AccelerationStructureInstanceKHR*>(
+        mapped_instances_buffer->allocation_info.pMappedData);
+    for (const auto& instance : instances) {
+        *mapped++ = GetInstance(instance);
+    }
+    vmaFlushAllocation(**device.allocator, mapped_instances_buffer->allocation, 0, VK_WHOLE_SIZE);
+
+    const bool rebuild = ++num_updates >= MaxUpdatesPerBuild;
+    if (rebuild) {
+        num_updates = 0;
+    }
+    const auto geometry = GetInstancesGeometry(device->getBufferAddress({
+        .buffer = **mapped_instances_buffer,
+    }));
+    const vk::AccelerationStructureBuildGeometryInfoKHR geometry_info{
+        .type = type,
+        .flags = UpdatableFlags,
+        .mode = rebuild ? vk::BuildAccelerationStructureModeKHR::eBuild
+                        : vk::BuildAccelerationStructureModeKHR::eUpdate,
+        .srcAccelerationStructure = rebuild ? vk::AccelerationStructureKHR{} : **as,
+        .dstAccelerationStructure = **as,
+        .geometryCount = 1,
+        .pGeometries = &geometry,
+        .scratchData =
+            {
+                .deviceAddress = device->getBufferAddress({
+                    .buffer = **scratch_buffer,
+                }),
+            },
+    };
+    const vk::AccelerationStructureBuildRangeInfoKHR build_range{
+        .primitiveCount = num_instances,
+    };
+
+    // The host writes above are made visible by the submission
+    build_cmdbuf.reset();
+    build_cmdbuf.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    build_cmdbuf.buildAccelerationStructuresKHR(geometry_info, &build_range);
+    build_cmdbuf.end();
+
+    const vk::raii::Fence fence{*device, vk::FenceCreateInfo{}};
+    device.Submit(device.compute_queue, {{
+                                    .commandBufferCount = 1,
+                                    .pCommandBuffers = TempArr<vk::CommandBuffer>{*build_cmdbuf},
+                                }},
+                                *fence);
+    const auto result = device->waitForFences(*fence, VK_TRUE, std::numeric_limits<u64>::max());
+    if (result != vk::Result::eSuccess) {
+        SPDLOG_ERROR("Failed to wait for fence");
+        throw std::runtime_error("Failed to wait for fence");
+    }
+}
+
+void VulkanAccelStructure::RecordUpdate(const vk::raii::CommandBuffer& cmd) const {
+    ASSERT_MSG(allow_update && compacted && !update_geometries.empty(),
+               "Acceleration structure cannot be updated");
+
+    cmd.buildAccelerationStructuresKHR(
+        vk::AccelerationStructureBuildGeometryInfoKHR{
+            .type = type,
+            .flags = UpdatableFlags,
+            .mode = vk::BuildAccelerationStructureModeKHR::eUpdate,
+            .srcAccelerationStructure = **as,
+            .dstAccelerationStructure = **as,
+            .geometryCount = static_cast<u32>(update_geometries.size()),
+            .pGeometries = update_geometries.data(),
+            .scratchData =
+                {
+                    .deviceAddress = device->getBufferAddress({
+                        .buffer = **scratch_buffer,
+                    }),
+                },
+        },
+        update_build_ranges.data());
+}
+
+VulkanBLASBuilder::VulkanBLASBuilder(VulkanDevice& device_, Common::ThreadPool* thread_pool_,
+                                     vk::DeviceSize scratch_pool_size_)
+    : device(device_), thread_pool(thread_pool_), scratch_pool_size(scratch_pool_size_) {
+
+    const auto& properties2 = device.physical_device.getProperties2<
+        vk::PhysicalDeviceProperties2, vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
+    scratch_alignment =
+        properties2.get<vk::PhysicalDeviceAccelerationStructurePropertiesKHR>()
+            .minAccelerationStructureScratchOffsetAlignment;
+
+    cmdbuf = std::move(vk::raii::CommandBuffers{*device,
+                                                {
+                                                    .commandPool = device.GetThreadCommandPool(
+                                                        device.compute_queue_family),
+                                                    .level = vk::CommandBufferLevel::ePrimary,
+                                                    .commandBufferCount = 1,
+                                                }}[0]);
+    timeline = vk::raii::Semaphore{*device, vk::StructureChain{
+                                                vk::SemaphoreCreateInfo{},
+                                                vk::SemaphoreTypeCreateInfo{
+                                                    .semaphoreType = vk::SemaphoreType::eTimeline,
+                                                    .initialValue = 0,
+                                                },
+                                            }
+                                                .get()};
+    if (device.compute_timestamp_period != 0) {
+        timestamp_pool = vk::raii::QueryPool{*device,
+                                             {
+                                                 .queryType = vk::QueryType::eTimestamp,
+                                                 .queryCount = 2,
+                                             }};
+    }
+}
+
+VulkanBLASBuilder::~VulkanBLASBuilder() = default;
+
+void VulkanBLASBuilder::Add(
+    const vk::ArrayProxy<const vk::AccelerationStructureGeometryKHR>& geometries,
+    const vk::ArrayProxy<const vk::AccelerationStructureBuildRangeInfoKHR>& build_ranges,
+    BuildPreference preference) {
+
+    pending.push_back({
+        .geometries = {geometries.begin(), geometries.end()},
+        .build_ranges = {build_ranges.begin(), build_ranges.end()},
+        .preference = preference,
+    });
+}
+
+void VulkanBLASBuilder::AddHost(
+    const vk::ArrayProxy<const vk::AccelerationStructureGeometryKHR>& geometries,
+    const vk::ArrayProxy<const vk::AccelerationStructureBuildRangeInfoKHR>& build_ranges,
+    BuildPreference preference) {
+
+    ASSERT_MSG(device.accel_structure_host_commands, "Host builds are not supported");
+    pending.push_back({
+        .geometries = {geometries.begin(), geometries.end()},
+        .build_ranges = {build_ranges.begin(), build_ranges.end()},
+        .host = true,
+        .preference = preference,
+    });
+}
+
+void VulkanBLASBuilder::AddSerialized(std::span<const u8> data) {
+    pending.push_back({.serialized = data});
+}
+
+std::vector<std::unique_ptr<VulkanAccelStructure>> VulkanBLASBuilder::Build() {
+    ASSERT_MSG(async_rounds.empty(), "Asynchronous builds in progress");
+
+    // Each round only takes one kind of work
+    std::array<std::vector<std::size_t>, 2> builds;      // By preference
+    std::array<std::vector<std::size_t>, 2> host_builds; // By preference
+    std::vector<std::size_t> deserializations;
+    for (std::size_t i = 0; i < pending.size(); ++i) {
+        if (!pending[i].serialized.empty()) {
+            deserializations.emplace_back(i);
+        } else {
+            const auto preference = static_cast<std::size_t>(pending[i].preference);
+            (pending[i].host ? host_builds : builds)[preference].emplace_back(i);
+        }
+    }
+
+    std::vector<std::unique_ptr<VulkanAccelStructure>> blases(pending.size());
+    const auto RunRounds = [this, &blases](const std::vector<std::size_t>& indices,
+                                           auto round) {
+        for (std::size_t i = 0; i < indices.size(); i += MaxBuildsPerRound) {
+            (this->*round)(
+                std::span{indices}.subspan(i, std::min(MaxBuildsPerRound, indices.size() - i)),
+                blases);
+        }
+    };
+    for (const auto& indices : builds) {
+        RunRounds(indices, &VulkanBLASBuilder::BuildRound);
+    }
+    for (const auto& indices : host_builds) {
+        RunRounds(indices, &VulkanBLASBuilder::HostBuildRound);
+    }
+    RunRounds(deserializations, &VulkanBLASBuilder::DeserializeRound);
+    pending.clear();
+    return blases;
+}
+
+void VulkanBLASBuilder::BuildAsync(std::size_t max_builds_per_round) {
+    ASSERT_MSG(async_rounds.empty(), "Asynchronous builds in progress");
+
+    std::array<std::vector<std::size_t>, 2> builds; // By preference
+    for (std::size_t i = 0; i < pending.size(); ++i) {
+        ASSERT_MSG(pending[i].serialized.empty() && !pending[i].host,
+                   "Only device builds can be asynchronous");
+        builds[static_cast<std::size_t>(pending[i].preference)].emplace_back(i);
+    }
+    for (const auto& indices : builds) {
+        for (std::size_t i = 0; i < indices.size(); i += max_builds_per_round) {
+            async_rounds.emplace_back(
+                indices.begin() + i,
+                indices.begin() + std::min(i + max_builds_per_round, indices.size()));
+        }
+    }
+    next_async_round = 0;
+    async_out.resize(pending.size());
+    async_completed.clear();
+}
+
+std::optional<std::vector<std::unique_ptr<VulkanAccelStructure>>> VulkanBLASBuilder::Poll() {
+    if (async_round) {
+        if (timeline.getCounterValue() < async_round->value ||
+            !AdvanceRound(*async_round, async_out)) {
+            return std::nullopt;
+        }
+        async_completed.insert(async_completed.end(), async_round->indices.begin(),
+                               async_round->indices.end());
+        async_round.reset();
+        ++next_async_round;
+    }
+    if (next_async_round < async_rounds.size()) {
+        async_round.emplace(SubmitBuildRound(async_rounds[next_async_round]));
+        return std::nullopt;
+    }
+
+    async_rounds.clear();
+    async_completed.clear();
+    pending.clear();
+    return std::move(async_out);
+}
+
+std::vector<std::pair<std::size_t, std::unique_ptr<VulkanAccelStructure>>>
+VulkanBLASBuilder::TakeCompleted() {
+    std::vector<std::pair<std::size_t, std::unique_ptr<VulkanAccelStructure>>> out;
+    for (const std::size_t idx : async_completed) {
+        out.emplace_back(idx, std::move(async_out[idx]));
+    }
+    async_completed.clear();
+    return out;
+}
+
+void VulkanBLASBuilder::WaitAsync() const {
+    if (async_round) {
+        Wait(async_round->value);
+    }
+}
+
+void VulkanBLASBuilder::BuildRound(std::span<const std::size_t> indices,
+                                   std::vector<std::unique_ptr<VulkanAccelStructure>>& out) {
+    auto round = SubmitBuildRound(indices);
+    do {
+        Wait(round.value);
+    } while (!AdvanceRound(round, out));
+}
+
+VulkanBLASBuilder::Round VulkanBLASBuilder::SubmitBuildRound(std::span<const std::size_t> indices) {
+    PROFILE_FUNCTION();
+    const auto builds = Common::VectorFromRange(
+        indices | std::views::transform([this](std::size_t idx) { return &pending[idx]; }));
+
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> geometry_infos;
+    std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> build_range_ptrs;
+    std::vector<vk::DeviceSize> as_sizes;
+    std::vector<vk::DeviceSize> scratch_sizes;
+    // Fast builds are displayed as they are
+    const bool compact = builds[0]->preference == BuildPreference::FastTrace;
+    for (const auto* build : builds) {
+        vk::AccelerationStructureBuildGeometryInfoKHR geometry_info{
+            .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
+            .flags = compact ? vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace |
+                                   vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction
+                             : vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild,
+            .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
+            .geometryCount = static_cast<u32>(build->geometries.size()),
+            .pGeometries = build->geometries.data(),
+        };
+        const auto size_info = device->getAccelerationStructureBuildSizesKHR(
+            vk::AccelerationStructureBuildTypeKHR::eDevice, geometry_info,
+            Common::VectorFromRange(build->build_ranges |
+                                    std::views::transform([](const auto& build_range) {
+                                        return build_range.primitiveCount;
+                                    })));
+        geometry_infos.emplace_back(geometry_info);
+        build_range_ptrs.emplace_back(build->build_ranges.data());
+        as_sizes.emplace_back(size_info.accelerationStructureSize);
+        scratch_sizes.emplace_back(Common::AlignUp(size_info.buildScratchSize, scratch_alignment));
+    }
+    Round round{
+        .indices = {indices.begin(), indices.end()},
+        .build_as = VulkanAccelStructureMemory::CreatePooled(
+            device, as_sizes, vk::AccelerationStructureTypeKHR::eBottomLevel),
+    };
+    for (std::size_t i = 0; i < builds.size(); ++i) {
+        geometry_infos[i].dstAccelerationStructure = **round.build_as[i];
+    }
+
+    const vk::DeviceSize max_scratch_size = *std::ranges::max_element(scratch_sizes);
+    if (!scratch_buffer || max_scratch_size > scratch_pool_size) {
+        scratch_pool_size = std::max(scratch_pool_size, max_scratch_size);
+        // Over-allocated, as the allocation may not meet the scratch offset alignment
+        scratch_buffer = std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .size = scratch_pool_size + scratch_alignment,
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Scratch);
+        scratch_buffer->SetName("BLAS build scratch");
+        scratch_address = Common::AlignUp(device->getBufferAddress({.buffer = **scratch_buffer}),
+                                          scratch_alignment);
+    }
+
+    auto& query_pool = round.query_pool;
+    if (compact) {
+        query_pool = vk::raii::QueryPool{
+            *device,
+            {
+                .queryType = vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+                .queryCount = static_cast<u32>(builds.size()),
+            }};
+    }
+
+    cmdbuf.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    if (*timestamp_pool) {
+        cmdbuf.resetQueryPool(*timestamp_pool, 0, 2);
+        cmdbuf.writeTimestamp2(vk::PipelineStageFlagBits2::eNone, *timestamp_pool, 0);
+    }
+    if (compact) {
+        cmdbuf.resetQueryPool(*query_pool, 0, static_cast<u32>(builds.size()));
+    }
+
+    // Each batch takes as many builds as fit in the scratch pool
+    std::size_t batch_begin = 0;
+    vk::DeviceSize scratch_offset = 0;
+    const auto RecordBatch = [this, &geometry_infos, &build_range_ptrs, &batch_begin,
+                              &scratch_offset](std::size_t batch_end) {
+        if (batch_begin != 0) { // The previous batch must be done with the scratch
+            cmdbuf.pipelineBarrier2({
+                .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+                    .srcStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                    .srcAccessMask = vk::AccessFlagBits2::eAccelerationStructureWriteKHR,
+                    .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                    .dstAccessMask = vk::AccessFlagBits2::eAccelerationStructureReadKHR |
+                                     vk::AccessFlagBits2::eAccelerationStructureWriteKHR,
+                }},
+            });
+        }
+        const auto count = static_cast<u32>(batch_end - batch_begin);
+        cmdbuf.buildAccelerationStructuresKHR({count, geometry_infos.data() + batch_begin},
+                                              {count, build_range_ptrs.data() + batch_begin});
+        batch_begin = batch_end;
+        scratch_offset = 0;
+    };
+    for (std::size_t i = 0; i < builds.size(); ++i) {
+        if (scratch_offset + scratch_sizes[i] > scratch_pool_size) {
+            RecordBatch(i);
+        }
+        geometry_infos[i].scratchData.deviceAddress = scratch_address + scratch_offset;
+        scratch_offset += scratch_sizes[i];
+    }
+    RecordBatch(builds.size());
+
+    if (compact) {
+        cmdbuf.pipelineBarrier2({
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+                .srcStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                .srcAccessMask = vk::AccessFlagBits2::eAccelerationStructureWriteKHR,
+                .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                .dstAccessMask = vk::AccessFlagBits2::eAccelerationStructureReadKHR,
+            }},
+        });
+        cmdbuf.writeAccelerationStructuresPropertiesKHR(
+            Common::VectorFromRange(geometry_infos | std::views::transform([](const auto& info) {
+                                        return info.dstAccelerationStructure;
+                                    })),
+            vk::QueryType::eAccelerationStructureCompactedSizeKHR, *query_pool, 0);
+    }
+    if (*timestamp_pool) {
+        cmdbuf.writeTimestamp2(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                               *timestamp_pool, 1);
+    }
+    cmdbuf.end();
+    round.value = Submit(true);
+    return round;
+}
+
+bool VulkanBLASBuilder::AdvanceRound(Round& round,
+                                     std::vector<std::unique_ptr<VulkanAccelStructure>>& out) {
+    if (!round.compacted_as.empty()) {
+        compact_gpu_time += ReadGPUTime();
+        for (std::size_t i = 0; i < round.indices.size(); ++i) {
+            out[round.indices[i]].reset(new VulkanAccelStructure(
+                device, std::move(round.compacted_as[i]), round.build_as[i]->size));
+        }
+        return true;
+    }
+
+    build_gpu_time += ReadGPUTime();
+    if (!*round.query_pool) { // Used as built
+        for (std::size_t i = 0; i < round.indices.size(); ++i) {
+            out[round.indices[i]].reset(
+                new VulkanAccelStructure(device, std::move(round.build_as[i])));
+        }
+        return true;
+    }
+    // One query for the whole round
+    const auto count = static_cast<u32>(round.indices.size());
+    const auto [result, compacted_sizes] = round.query_pool.getResults<vk::DeviceSize>(
+        0, count, count * sizeof(vk::DeviceSize), sizeof(vk::DeviceSize),
+        vk::QueryResultFlagBits::e64);
+    if (result != vk::Result::eSuccess) {
+        vk::throwResultException(result, "vkGetQueryPoolResults");
+    }
+    round.query_pool = nullptr;
+    SubmitCompaction(round, compacted_sizes);
+    return false;
+}
+
+void VulkanBLASBuilder::HostBuildRound(std::span<const std::size_t> indices,
+                                       std::vector<std::unique_ptr<VulkanAccelStructure>>& out) {
+    PROFILE_FUNCTION();
+    const auto builds = Common::VectorFromRange(
+        indices | std::views::transform([this](std::size_t idx) { return &pending[idx]; }));
+
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> geometry_infos;
+    std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> build_range_ptrs;
+    std::vector<vk::DeviceSize> as_sizes;
+    std::vector<vk::DeviceSize> scratch_sizes;
+    const bool fast_trace = builds[0]->preference == BuildPreference::FastTrace;
+    for (const auto* build : builds) {
+        vk::AccelerationStructureBuildGeometryInfoKHR geometry_info{
+            .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
+            .flags = (fast_trace ? vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace
+                                 : vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild) |
+                     vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction,
+            .mode = vk::BuildAccelerationStructureModeKHR::eBuild,
+            .geometryCount = static_cast<u32>(build->geometries.size()),
+            .pGeometries = build->geometries.data(),
+        };
+        const auto size_info = device->getAccelerationStructureBuildSizesKHR(
+            vk::AccelerationStructureBuildTypeKHR::eHost, geometry_info,
+            Common::VectorFromRange(build->build_ranges |
+                                    std::views::transform([](const auto& build_range) {
+                                        return build_range.primitiveCount;
+                                    })));
+        geometry_infos.emplace_back(geometry_info);
+        build_range_ptrs.emplace_back(build->build_ranges.data());
+        as_sizes.emplace_back(size_info.accelerationStructureSize);
+        scratch_sizes.emplace_back(Common::AlignUp(size_info.buildScratchSize, scratch_alignment));
+    }
+    Round round{
+        .indices = {indices.begin(), indices.end()},
+        .build_as = VulkanAccelStructureMemory::CreatePooled(
+            device, as_sizes, vk::AccelerationStructureTypeKHR::eBottomLevel, true),
+    };
+    for (std::size_t i = 0; i < builds.size(); ++i) {
+        geometry_infos[i].dstAccelerationStructure = **round.build_as[i];
+    }
+
+    const vk::DeviceSize max_scratch_size = *std::ranges::max_element(scratch_sizes);
+    if (host_scratch.empty() || max_scratch_size > scratch_pool_size) {
+        scratch_pool_size = std::max(scratch_pool_size, max_scratch_size);
+        host_scratch.resize(static_cast<std::size_t>(scratch_pool_size + scratch_alignment));
+    }
+    const auto scratch_base = Common::AlignUp(reinterpret_cast<std::uintptr_t>(host_scratch.data()),
+                                              static_cast<std::size_t>(scratch_alignment));
+
+    // Each deferred operation takes as many builds as fit in the scratch pool, like the batches
+    // of BuildRound
+    std::size_t batch_begin = 0;
+    vk::DeviceSize scratch_offset = 0;
+    const auto BuildBatch = [this, &geometry_infos, &build_range_ptrs, &batch_begin,
+                             &scratch_offset](std::size_t batch_end) {
+        BuildDeferred(std::span{geometry_infos}.subspan(batch_begin, batch_end - batch_begin),
+                      std::span{build_range_ptrs}.subspan(batch_begin, batch_end - batch_begin));
+        batch_begin = batch_end;
+        scratch_offset = 0;
+    };
+    for (std::size_t i = 0; i < builds.size(); ++i) {
+        if (scratch_offset + scratch_sizes[i] > scratch_pool_size) {
+            BuildBatch(i);
+        }
+        geometry_infos[i].scratchData.hostAddress =
+            reinterpret_cast<void*>(scratch_base + scratch_offset);
+        scratch_offset += scratch_sizes[i];
+    }
+    BuildBatch(builds.size());
+
+    const auto compacted_sizes = device->writeAccelerationStructuresPropertiesKHR<vk::DeviceSize>(
+        Common::VectorFromRange(geometry_infos | std::views::transform([](const auto& info) {
+                                    return info.dstAccelerationStructure;
+                                })),
+        vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+        builds.size() * sizeof(vk::DeviceSize), sizeof(vk::DeviceSize));
+    SubmitCompaction(round, compacted_sizes);
+    Wait(round.value);
+    AdvanceRound(round, out);
+}
+
+void VulkanBLASBuilder::BuildDeferred(
+    std::span<const vk::AccelerationStructureBuildGeometryInfoKHR> geometry_infos,
+    std::span<const vk::AccelerationStructureBuildRangeInfoKHR* const> build_range_ptrs) {
+
+    const vk::raii::DeferredOperationKHR operation{*device};
+    const auto result = device->buildAccelerationStructuresKHR(
+        *operation, {static_cast<u32>(geometry_infos.size()), geometry_infos.data()},
+        {static_cast<u32>(build_range_ptrs.size()), build_range_ptrs.data()});
+    if (result == vk::Result::eOperationDeferredKHR) {
+        const auto Join = [&operation] {
+            // Idle threads may get more work later, the others are done
+            while (operation.join() == vk::Result::eThreadIdleKHR) {
+                std::this_thread::yield();
+            }
+        };
+        std::vector<std::future<void>> futures;
+        if (thread_pool) {
+            const std::size_t num_threads = std::min<std::size_t>(
+                operation.getMaxConcurrency(), thread_pool->GetNumThreads() + 1);
+            for (std::size_t i = 1; i < num_threads; ++i) {
+                futures.emplace_back(thread_pool->Submit(Join));
+            }
+        }
+        Join();
+        if (thread_pool) {
+            thread_pool->WaitAll(futures);
+        }
+        if (operation.getResult() != vk::Result::eSuccess) {
+            SPDLOG_ERROR("Failed to build acceleration structures on the host");
+            throw std::runtime_error("Failed to build acceleration structures on the host");
+        }
+    }
+}
+
+void VulkanBLASBuilder::SubmitCompaction(Round& round,
+                                         std::span<const vk::DeviceSize> compacted_sizes) {
+    // Packed into fresh pools, so that the build pools are released as a whole
+    round.compacted_as = VulkanAccelStructureMemory::CreatePooled(
+        device, compacted_sizes, vk::AccelerationStructureTypeKHR::eBottomLevel);
+    cmdbuf.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    if (*timestamp_pool) {
+        cmdbuf.resetQueryPool(*timestamp_pool, 0, 2);
+        cmdbuf.writeTimestamp2(vk::PipelineStageFlagBits2::eNone, *timestamp_pool, 0);
+    }
+    for (std::size_t i = 0; i < round.indices.size(); ++i) {
+        cmdbuf.copyAccelerationStructureKHR({
+            .src = **round.build_as[i],
+            .dst = **round.compacted_as[i],
+            .mode = vk::CopyAccelerationStructureModeKHR::eCompact,
+        });
+    }
+    if (*timestamp_pool) {
+        cmdbuf.writeTimestamp2(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                               *timestamp_pool, 1);
+    }
+    cmdbuf.end();
+    round.value = Submit(false);
+}
+
+void VulkanBLASBuilder::DeserializeRound(std::span<const std::size_t> indices,
+                                         std::vector<std::unique_ptr<VulkanAccelStructure>>& out) {
+    PROFILE_FUNCTION();
+    std::vector<vk::DeviceSize> offsets;
+    vk::DeviceSize size = 0;
+    for (const std::size_t idx : indices) {
+        size = Common::AlignUp(size, SerializedDataAlignment);
+        offsets.emplace_back(size);
+        size += pending[idx].serialized.size();
+    }
+    const auto data_buffer = CreateSerializedDataBuffer(
+        size, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+
+    std::vector<vk::DeviceSize> deserialized_sizes;
+    for (const std::size_t idx : indices) {
+        SerializedHeader header;
+        std::memcpy(&header, pending[idx].serialized.data(), sizeof(SerializedHeader));
+        deserialized_sizes.emplace_back(header.deserialized_size);
+    }
+    auto deserialized_as = VulkanAccelStructureMemory::CreatePooled(
+        device, deserialized_sizes, vk::AccelerationStructureTypeKHR::eBottomLevel);
+
+    cmdbuf.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    for (std::size_t i = 0; i < indices.size(); ++i) {
+        const auto data = pending[indices[i]].serialized;
+        std::memcpy(data_buffer.data + offsets[i], data.data(), data.size());
+        cmdbuf.copyMemoryToAccelerationStructureKHR({
+            .src = {.deviceAddress = data_buffer.address + offsets[i]},
+            .dst = **deserialized_as[i],
+            .mode = vk::CopyAccelerationStructureModeKHR::eDeserialize,
+        });
+    }
+    cmdbuf.end();
+    vmaFlushAllocation(data_buffer.buffer->allocator, data_buffer.buffer->allocation, 0,
+                       VK_WHOLE_SIZE);
+    SubmitAndWait(false);
+
+    for (std::size_t i = 0; i < indices.size(); ++i) {
+        out[indices[i]].reset(new VulkanAccelStructure(device, std::move(deserialized_as[i])));
+    }
+}
+
+bool VulkanBLASBuilder::IsCompatible(std::span<const u8> data) const {
+    if (data.size() < sizeof(SerializedHeader)) {
+        return false;
+    }
+    SerializedHeader header;
+    std::memcpy(&header, data.data(), sizeof(SerializedHeader));
+    if (header.serialized_size != data.size() || header.num_handles != 0) {
+        return false;
+    }
+    return device->getAccelerationStructureCompatibilityKHR({.pVersionData = data.data()}) ==
+           vk::AccelerationStructureCompatibilityKHR::eCompatible;
+}
+
+std::vector<std::vector<u8>> VulkanBLASBuilder::Serialize(
+    std::span<const VulkanAccelStructure* const> blases) {
+    PROFILE_FUNCTION();
+
+    if (blases.empty()) {
+        return {};
+    }
+    const auto handles = Common::VectorFromRange(
+        blases | std::views::transform([](const VulkanAccelStructure* blas) { return **blas; }));
+    const auto count = static_cast<u32>(handles.size());
+
+    // Query the sizes first
+    const vk::raii::QueryPool query_pool{
+        *device,
+        {
+            .queryType = vk::QueryType::eAccelerationStructureSerializationSizeKHR,
+            .queryCount = count,
+        }};
+    cmdbuf.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    cmdbuf.resetQueryPool(*query_pool, 0, count);
+    cmdbuf.pipelineBarrier2({
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            .srcAccessMask = vk::AccessFlagBits2::eMemoryWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+            .dstAccessMask = vk::AccessFlagBits2::eAccelerationStructureReadKHR,
+        }},
+    });
+    cmdbuf.writeAccelerationStructuresPropertiesKHR(
+        handles, vk::QueryType::eAccelerationStructureSerializationSizeKHR, *query_pool, 0);
+    cmdbuf.end();
+    SubmitAndWait(false);
+
+    const auto [result, sizes] = query_pool.getResults<vk::DeviceSize>(
+        0, count, count * sizeof(vk::DeviceSize), sizeof(vk::DeviceSize),
+        vk::QueryResultFlagBits::e64);
+    if (result != vk::Result::eSuccess) {
+        vk::throwResultException(result, "vkGetQueryPoolResults");
+    }
+
+    std::vector<vk::DeviceSize> offsets;
+    vk::DeviceSize size = 0;
+    for (const auto blas_size : sizes) {
+        size = Common::AlignUp(size, SerializedDataAlignment);
+        offsets.emplace_back(size);
+        size += blas_size;
+    }
+    const auto data_buffer =
+        CreateSerializedDataBuffer(size, VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+
+    cmdbuf.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    for (std::size_t i = 0; i < handles.size(); ++i) {
+        cmdbuf.copyAccelerationStructureToMemoryKHR({
+            .src = handles[i],
+            .dst = {.deviceAddress = data_buffer.address + offsets[i]},
+            .mode = vk::CopyAccelerationStructureModeKHR::eSerialize,
+        });
+    }
+    cmdbuf.pipelineBarrier2({
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            .srcAccessMask = vk::AccessFlagBits2::eMemoryWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eHost,
+            .dstAccessMask = vk::AccessFlagBits2::eHostRead,
+        }},
+    });
+    cmdbuf.end();
+    SubmitAndWait(false);
+    vmaInvalidateAllocation(data_buffer.buffer->allocator, data_buffer.buffer->allocation, 0,
+                            VK_WHOLE_SIZE);
+
+    std::vector<std::vector<u8>> serialized;
+    for (std::size_t i = 0; i < handles.size(); ++i) {
+        const u8* data = data_buffer.data + offsets[i];
+        serialized.emplace_back(data, data + sizes[i]);
+    }
+    return serialized;
+}
+
+VulkanBLASBuilder::SerializedDataBuffer VulkanBLASBuilder::CreateSerializedDataBuffer(
+    vk::DeviceSize size, VmaAllocationCreateFlags flags) const {
+
+    // Over-allocated, as the allocation may not meet the alignment
+    auto buffer = std::make_unique<VulkanBuffer>(
+        *device.allocator,
+        vk::BufferCreateInfo{
+            .size = size + SerializedDataAlignment,
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        },
+        VmaAllocationCreateInfo{
+            .flags = flags | VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Scratch);
+    buffer->SetName("serialized BLASes");
+    const auto base_address = device->getBufferAddress({.buffer = **buffer});
+    const auto address = Common::AlignUp(base_address, SerializedDataAlignment);
+    auto* data = static_cast<u8*>(buffer->allocation_info.pMappedData) + (address - base_address);
+    return {
+        .buffer = std::move(buffer),
+        .address = address,
+        .data = data,
+    };
+}
+
+u64 VulkanBLASBuilder::Submit(bool wait_for_upload) {
+    const vk::CommandBufferSubmitInfo cmdbuf_info{
+        .commandBuffer = *cmdbuf,
+    };
+    vk::SubmitInfo2 submit_info{
+        .commandBufferInfoCount = 1,
+        .pCommandBufferInfos = &cmdbuf_info,
+    };
+    vk::SemaphoreSubmitInfo wait_info;
+    if (wait_for_upload) { // Wait for the geometry to be uploaded
+        wait_info = device.upload_ring->GetWaitInfo(
+            device.upload_ring->Flush(),
+            vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR);
+        submit_info.setWaitSemaphoreInfos(wait_info);
+    }
+    const vk::SemaphoreSubmitInfo signal_info{
+        .semaphore = *timeline,
+        .value = ++timeline_value,
+        .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+    };
+    submit_info.setSignalSemaphoreInfos(signal_info);
+    device.Submit2(device.compute_queue, submit_info);
+    return timeline_value;
+}
+
+void VulkanBLASBuilder::Wait(u64 value) const {
+    const auto result = device->waitSemaphores(
+        {
+            .semaphoreCount = 1,
+            .pSemaphores = TempArr<vk::Semaphore>{*timeline},
+            .pValues = TempArr<u64>{value},
+        },
+        std::numeric_limits<u64>::max());
+    if (result != vk::Result::eSuccess) {
+        SPDLOG_ERROR("Failed to wait for semaphore");
+        throw std::runtime_error("Failed to wait for semaphore");
+    }
+}
+
+std::chrono::nanoseconds VulkanBLASBuilder::ReadGPUTime() const {
+    if (!*timestamp_pool) {
+        return {};
+    }
+    const auto [result, timestamps] = timestamp_pool.getResults<u64>(
+        0, 2, 2 * sizeof(u64), sizeof(u64), vk::QueryResultFlagBits::e64);
+    if (result != vk::Result::eSuccess) {
+        return {};
+    }
+    return std::chrono::nanoseconds{static_cast<s64>(static_cast<double>(timestamps[1] -
+                                                                         timestamps[0]) *
+                                                     device.compute_timestamp_period)};
+}
+
 } // namespace Renderer
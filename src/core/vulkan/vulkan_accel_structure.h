@@ -4,64 +4,166 @@
 
 #pragma once
 
+#include <chrono>
 #include <memory>
+#include <optional>
+#include <span>
 #include <utility>
+#include <vector>
 #include <glm/glm.hpp>
+#include <vk_mem_alloc.h>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
 
+namespace Common {
+class ThreadPool;
+}
+
 namespace Renderer {
 
 class VulkanBuffer;
 class VulkanImmUploadBuffer;
 class VulkanDevice;
+class VulkanTLASInstanceGenerator;
 
+/**
+ * Storage of an acceleration structure. Either has a buffer of its own, or shares a pool buffer
+ * with others allocated along with it, which is freed once all of them are.
+ */
 class VulkanAccelStructureMemory : NonCopyable {
 public:
+    // Offsets of acceleration structures in their buffers must be aligned to this
+    static constexpr vk::DeviceSize Alignment = 256;
+    // Pool buffers are split at this size, unless a single structure is larger
+    static constexpr vk::DeviceSize MaxPoolSize = 256 * 1024 * 1024;
+
+    // Those built on the host must be in host visible memory
     explicit VulkanAccelStructureMemory(const VulkanDevice& device,
-                                        vk::AccelerationStructureCreateInfoKHR create_info);
+                                        vk::AccelerationStructureCreateInfoKHR create_info,
+                                        bool host_visible = false);
     ~VulkanAccelStructureMemory();
 
+    // Packs structures of the sizes one after another into as few pool buffers as possible,
+    // instead of allocating a buffer for each
+    static std::vector<std::unique_ptr<VulkanAccelStructureMemory>> CreatePooled(
+        const VulkanDevice& device, std::span<const vk::DeviceSize> sizes,
+        vk::AccelerationStructureTypeKHR type, bool host_visible = false);
+
     vk::AccelerationStructureKHR operator*() const noexcept {
         return *as;
     }
 
-    std::unique_ptr<VulkanBuffer> buffer;
+    std::shared_ptr<VulkanBuffer> buffer;
+    vk::DeviceSize offset{};
+    vk::DeviceSize size{};       // Of the acceleration structure, not of its whole buffer
+    vk::DeviceAddress address{}; // Of the acceleration structure, e.g. for instances
 
 private:
+    explicit VulkanAccelStructureMemory(const VulkanDevice& device,
+                                        vk::AccelerationStructureCreateInfoKHR create_info,
+                                        std::shared_ptr<VulkanBuffer> buffer,
+                                        vk::DeviceSize offset);
+
+    static std::shared_ptr<VulkanBuffer> CreateBuffer(const VulkanDevice& device,
+                                                      vk::DeviceSize size, bool host_visible);
+
     vk::raii::AccelerationStructureKHR as = nullptr;
 };
 
 // Generic acceleration structure
 class VulkanAccelStructure {
 public:
-    // (Typically) bottom level
+    // (Typically) bottom level. Those allowing updates are not compacted, and keep copies of the
+    // geometries for RecordUpdate, whose pNext chains must be null.
     explicit VulkanAccelStructure(
         VulkanDevice& device,
         const vk::ArrayProxy<const vk::AccelerationStructureGeometryKHR>& geometries,
         const vk::ArrayProxy<const vk::AccelerationStructureBuildRangeInfoKHR>& build_ranges,
-        vk::AccelerationStructureTypeKHR type = vk::AccelerationStructureTypeKHR::eBottomLevel);
+        vk::AccelerationStructureTypeKHR type = vk::AccelerationStructureTypeKHR::eBottomLevel,
+        bool allow_update = false);
 
     // Top level
     struct BLASInstance {
         const VulkanAccelStructure& blas;
         glm::mat4 transform;
         u32 custom_index{};
+        u32 hit_group{}; // Offset of its records in the shader binding table
+        u8 mask = 0xFF;  // Against the cull masks of the rays
+        // Back faces are only culled by rays that ask to, and not for instances with this set
+        vk::GeometryInstanceFlagsKHR flags =
+            vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable;
     };
-    explicit VulkanAccelStructure(const vk::ArrayProxy<const BLASInstance>& instances);
+    // Those allowing updates are not compacted, and keep their instances mapped for Update
+    explicit VulkanAccelStructure(const vk::ArrayProxy<const BLASInstance>& instances,
+                                  bool allow_update = false);
+    // Top level, over the instances the generator writes on the GPU, so that none of them are
+    // filled in on the host. Built for the camera position right away (blocking), and again by
+    // RecordBuild, built for speed as it is rebuilt as the camera moves. Never compacted, nor
+    // refit by Update.
+    explicit VulkanAccelStructure(VulkanDevice& device,
+                                  std::unique_ptr<VulkanTLASInstanceGenerator> generator,
+                                  const glm::vec3& camera_position);
 
     ~VulkanAccelStructure();
 
+    // No-ops for those from a VulkanBLASBuilder, which are compacted once built
     void Compact();
     void Cleanup();
+    // Advances the build and compaction without blocking, like Compact and Cleanup do. Returns
+    // whether the structure is in its final form, e.g. to swap it in for one traced meanwhile.
+    bool Poll();
+
+    // Refits a top level structure allowing updates in place, once it has been built. The
+    // instances must be those it was built with in the same order, only their transforms may
+    // differ. Refitting degrades the quality of the hierarchy as the instances move, so every
+    // MaxUpdatesPerBuild updates it is rebuilt instead. Blocks until done.
+    void Update(const vk::ArrayProxy<const BLASInstance>& instances);
+    bool AllowsUpdate() const noexcept {
+        return allow_update;
+    }
+    // Refits a bottom level structure allowing updates in place, once it has been built, to
+    // where the vertices of its geometries have moved since. The buffers they are read from must
+    // stay the same, nor may the topology change, so unlike Update it is never rebuilt. Needs a
+    // barrier before the structure is traced.
+    void RecordUpdate(const vk::raii::CommandBuffer& cmd) const;
+
+    // Whether its instances are generated on the GPU, and the camera has moved far enough for
+    // them to change, see VulkanTLASInstanceGenerator::NeedsUpdate
+    bool NeedsRebuild(const glm::vec3& camera_position) const;
+    // Generates the instances for the camera and rebuilds the structure over them, between
+    // barriers against the tracing of earlier commands and for that of later ones. Only for
+    // those with generated instances.
+    void RecordBuild(const vk::raii::CommandBuffer& cmd, const glm::vec3& camera_position);
 
     vk::AccelerationStructureKHR operator*() const noexcept {
-        return **compacted_as;
+        return compacted_as ? **compacted_as : **as;
+    }
+
+    // Measured with timestamp queries once the build has completed (see Compact), and once the
+    // compaction has (see Cleanup). Zero if the compute queue has no timestamps.
+    std::chrono::nanoseconds build_gpu_time{};
+    std::chrono::nanoseconds compact_gpu_time{};
+
+    // Of the storage of the structure as it is now, and as it was built (before compaction)
+    vk::DeviceSize GetSize() const noexcept {
+        return compacted_as ? compacted_as->size : as->size;
     }
+    vk::DeviceSize build_size{};
 
 private:
+    // Built (and compacted) by a VulkanBLASBuilder, from a structure of build_size (the same
+    // size if it was used as built, or deserialized)
+    explicit VulkanAccelStructure(VulkanDevice& device,
+                                  std::unique_ptr<VulkanAccelStructureMemory> compacted_as,
+                                  vk::DeviceSize build_size = 0);
+
+    static constexpr u32 MaxUpdatesPerBuild = 16;
+
     void Init(const vk::ArrayProxy<const vk::AccelerationStructureGeometryKHR>& geometries,
               const vk::ArrayProxy<const vk::AccelerationStructureBuildRangeInfoKHR>& build_ranges);
+    vk::AccelerationStructureInstanceKHR GetInstance(const BLASInstance& instance) const;
+    // Elapsed time between two timestamps
+    std::chrono::nanoseconds ReadGPUTime(u32 first_query) const;
 
     VulkanDevice& device;
     vk::AccelerationStructureTypeKHR type;
@@ -73,6 +175,7 @@ private:
     vk::raii::Fence build_fence = nullptr;
     vk::raii::Fence compact_fence = nullptr;
     vk::raii::QueryPool query_pool = nullptr;
+    vk::raii::QueryPool timestamp_pool = nullptr;
 
     // Really means 'whether compact has started'
     bool compacted = false;
@@ -80,7 +183,175 @@ private:
     // For top level initialization
     std::unique_ptr<VulkanImmUploadBuffer> instances_buffer{};
 
+    // For top level structures allowing updates, which keep their scratch buffer and build
+    // command buffer too
+    bool allow_update = false;
+    u32 num_instances{};
+    u32 num_updates{}; // Since the last full build
+    std::unique_ptr<VulkanBuffer> mapped_instances_buffer{};
+
+    // For bottom level structures allowing updates
+    std::vector<vk::AccelerationStructureGeometryKHR> update_geometries;
+    std::vector<vk::AccelerationStructureBuildRangeInfoKHR> update_build_ranges;
+
+    // For top level structures over generated instances
+    std::unique_ptr<VulkanTLASInstanceGenerator> instance_generator;
+
     friend class VulkanPathTracerHW;
+    friend class VulkanBLASBuilder;
+};
+
+/**
+ * Builds many bottom level acceleration structures with a few submissions, instead of one
+ * each. The builds share a scratch pool: as many as fit in it are recorded into a single
+ * vkCmdBuildAccelerationStructuresKHR, with a barrier before the next batch reuses it. The
+ * compacted sizes of a whole round of batches are written to one query pool, and the round is
+ * compacted with one more submission.
+ * Compacted BLASes can also be serialized, and deserialized on a compatible device in place of
+ * their builds.
+ * Where the device supports it, BLASes can instead be built on the host as deferred operations,
+ * joined by the threads of the pool. Only their compaction into device memory is left to the GPU.
+ * Device builds can also run in the background, advanced by polling a single timeline semaphore
+ * value, so that the bookkeeping is per round rather than per BLAS.
+ */
+class VulkanBLASBuilder : NonCopyable {
+public:
+    // The pool grows to fit the largest single build, if that does not fit
+    static constexpr vk::DeviceSize DefaultScratchPoolSize = 64 * 1024 * 1024;
+
+    // The thread pool, if any, joins the host builds
+    explicit VulkanBLASBuilder(VulkanDevice& device, Common::ThreadPool* thread_pool = nullptr,
+                               vk::DeviceSize scratch_pool_size = DefaultScratchPoolSize);
+    ~VulkanBLASBuilder();
+
+    enum class BuildPreference {
+        FastTrace, // Compacted once built
+        FastBuild, // Left uncompacted on the GPU, for displaying as soon as possible
+    };
+
+    // Queues a build. The geometry data must stay alive until Build.
+    void Add(const vk::ArrayProxy<const vk::AccelerationStructureGeometryKHR>& geometries,
+             const vk::ArrayProxy<const vk::AccelerationStructureBuildRangeInfoKHR>& build_ranges,
+             BuildPreference preference = BuildPreference::FastTrace);
+    // Queues a build on the host, for geometries with host addresses instead. The device must
+    // have accel_structure_host_commands, and the geometry data must stay alive until Build.
+    // These are always compacted, as that moves them to device memory.
+    void AddHost(
+        const vk::ArrayProxy<const vk::AccelerationStructureGeometryKHR>& geometries,
+        const vk::ArrayProxy<const vk::AccelerationStructureBuildRangeInfoKHR>& build_ranges,
+        BuildPreference preference = BuildPreference::FastTrace);
+    // Queues a BLAS to be deserialized instead, from the output of Serialize. The data must stay
+    // alive until Build, and be compatible with the device.
+    void AddSerialized(std::span<const u8> data);
+    std::size_t GetNumPending() const noexcept {
+        return pending.size();
+    }
+
+    // Builds and compacts (or deserializes) all queued BLASes in the order they were added,
+    // blocking until done
+    std::vector<std::unique_ptr<VulkanAccelStructure>> Build();
+
+    // Non-blocking alternative to Build, for queued device builds only. The rounds take at most
+    // max_builds_per_round builds, keeping each submission short.
+    void BuildAsync(std::size_t max_builds_per_round = MaxBuildsPerRound);
+    // Advances the builds started by BuildAsync by at most one submission. Returns the BLASes in
+    // the order they were added once all are done.
+    std::optional<std::vector<std::unique_ptr<VulkanAccelStructure>>> Poll();
+    // Moves out the BLASes of the rounds Poll has completed so far, with their indices in the
+    // order they were added, so that they can be used before all are done. Those taken are null
+    // in what Poll returns.
+    std::vector<std::pair<std::size_t, std::unique_ptr<VulkanAccelStructure>>> TakeCompleted();
+    // Blocks until the submission in flight of the builds started by BuildAsync is done, so that
+    // the next Poll advances them
+    void WaitAsync() const;
+
+    // Whether data serialized on some device can be deserialized on this one, checked with
+    // vkGetDeviceAccelerationStructureCompatibilityKHR
+    bool IsCompatible(std::span<const u8> data) const;
+    // Serializes built BLASes, e.g. to cache them on disk. Blocks until done.
+    std::vector<std::vector<u8>> Serialize(std::span<const VulkanAccelStructure* const> blases);
+
+    // Totals over all rounds built so far. Zero if the compute queue has no timestamps.
+    std::chrono::nanoseconds build_gpu_time{};
+    std::chrono::nanoseconds compact_gpu_time{};
+
+private:
+    // Bounds the uncompacted memory of a round, and the size of its query pool
+    static constexpr std::size_t MaxBuildsPerRound = 1024;
+
+    // Of the addresses serialized data is copied to and from
+    static constexpr vk::DeviceSize SerializedDataAlignment = 256;
+
+    struct PendingBuild {
+        std::vector<vk::AccelerationStructureGeometryKHR> geometries;
+        std::vector<vk::AccelerationStructureBuildRangeInfoKHR> build_ranges;
+        std::span<const u8> serialized; // Deserialized instead if not empty
+        bool host{};
+        BuildPreference preference{};
+    };
+    // A round of builds in flight, built and then possibly compacted
+    struct Round {
+        std::vector<std::size_t> indices;
+        std::vector<std::unique_ptr<VulkanAccelStructureMemory>> build_as;
+        vk::raii::QueryPool query_pool = nullptr; // Compacted sizes, for device builds to compact
+        std::vector<std::unique_ptr<VulkanAccelStructureMemory>> compacted_as; // Once compacting
+        u64 value{}; // Of the timeline, once the stage submitted last is done
+    };
+    Round SubmitBuildRound(std::span<const std::size_t> indices);
+    void SubmitCompaction(Round& round, std::span<const vk::DeviceSize> compacted_sizes);
+    // Once the round's value is reached, starts its next stage, or writes its BLASes and returns
+    // true if there is none. The build memory of compacted rounds is released with the round.
+    bool AdvanceRound(Round& round, std::vector<std::unique_ptr<VulkanAccelStructure>>& out);
+
+    // All take indices into pending, and write the BLASes at them. The builds of a round share
+    // their preference.
+    void BuildRound(std::span<const std::size_t> indices,
+                    std::vector<std::unique_ptr<VulkanAccelStructure>>& out);
+    void HostBuildRound(std::span<const std::size_t> indices,
+                        std::vector<std::unique_ptr<VulkanAccelStructure>>& out);
+    void DeserializeRound(std::span<const std::size_t> indices,
+                          std::vector<std::unique_ptr<VulkanAccelStructure>>& out);
+
+    // Host visible, with the address and data aligned for serialized data
+    struct SerializedDataBuffer {
+        std::unique_ptr<VulkanBuffer> buffer;
+        vk::DeviceAddress address{};
+        u8* data{};
+    };
+    SerializedDataBuffer CreateSerializedDataBuffer(vk::DeviceSize size,
+                                                    VmaAllocationCreateFlags flags) const;
+    // Submits the command buffer on the compute queue, returning the timeline value it signals
+    u64 Submit(bool wait_for_upload);
+    void Wait(u64 value) const;
+    void SubmitAndWait(bool wait_for_upload) {
+        Wait(Submit(wait_for_upload));
+    }
+    std::chrono::nanoseconds ReadGPUTime() const;
+    // Builds on the host, with as many threads joining as the operation can use
+    void BuildDeferred(
+        std::span<const vk::AccelerationStructureBuildGeometryInfoKHR> geometry_infos,
+        std::span<const vk::AccelerationStructureBuildRangeInfoKHR* const> build_range_ptrs);
+
+    VulkanDevice& device;
+    Common::ThreadPool* thread_pool{};
+    vk::DeviceSize scratch_pool_size{};
+    vk::DeviceSize scratch_alignment{};
+    std::vector<PendingBuild> pending;
+
+    std::unique_ptr<VulkanBuffer> scratch_buffer; // Created on first use
+    vk::DeviceAddress scratch_address{};
+    std::vector<u8> host_scratch; // Grown on demand, up to the scratch pool size
+    vk::raii::CommandBuffer cmdbuf = nullptr;
+    vk::raii::Semaphore timeline = nullptr;
+    u64 timeline_value{}; // Signalled by the last submission
+    vk::raii::QueryPool timestamp_pool = nullptr;
+
+    // For BuildAsync, the pending indices of each round
+    std::vector<std::vector<std::size_t>> async_rounds;
+    std::size_t next_async_round{};
+    std::optional<Round> async_round; // In flight
+    std::vector<std::unique_ptr<VulkanAccelStructure>> async_out;
+    std::vector<std::size_t> async_completed; // Not taken yet, see TakeCompleted
 };
 
 } // namespace Renderer
@@ -2,85 +2,267 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
-#include <algorithm>
-#include <limits>
-#include <ranges>
+#include <fstream>
+#include <stdexcept>
+#include <fmt/format.h>
 #include <spdlog/spdlog.h>
-#include "common/ranges.h"
+#include "common/profiling.h"
 #include "common/temp_ptr.h"
 #include "core/vulkan/vulkan_allocator.h"
-#include "core/vulkan/vulkan_buffer.h"
 #include "core/vulkan/vulkan_device.h"
 
 namespace Renderer {
 
+#ifdef ENABLE_TRACY
+// Blocks of device memory, including the dedicated allocations of VMA
+static void VKAPI_PTR OnDeviceMemoryAllocated(VmaAllocator, u32, VkDeviceMemory memory,
+                                              VkDeviceSize size, void*) {
+    PROFILE_ALLOC(reinterpret_cast<void*>(memory), size, "Vulkan");
+}
+
+static void VKAPI_PTR OnDeviceMemoryFreed(VmaAllocator, u32, VkDeviceMemory memory, VkDeviceSize,
+                                          void*) {
+    PROFILE_FREE(reinterpret_cast<void*>(memory), "Vulkan");
+}
+
+static constexpr VmaDeviceMemoryCallbacks DeviceMemoryCallbacks{
+    .pfnAllocate = &OnDeviceMemoryAllocated,
+    .pfnFree = &OnDeviceMemoryFreed,
+};
+#endif
+
 VulkanAllocator::VulkanAllocator(const vk::raii::Instance& instance, const VulkanDevice& device_)
     : device(device_) {
-    const auto result =
-        vmaCreateAllocator(TempPtr{VmaAllocatorCreateInfo{
-                               .flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT,
-                               .physicalDevice = *device.physical_device,
-                               .device = **device,
-                               .instance = *instance,
-                               .vulkanApiVersion = VK_API_VERSION_1_3,
-                           }},
-                           &allocator);
+    VmaAllocatorCreateFlags flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT;
+    if (device.memory_budget) {
+        flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+    }
+    const auto result = vmaCreateAllocator(TempPtr{VmaAllocatorCreateInfo{
+                                               .flags = flags,
+                                               .physicalDevice = *device.physical_device,
+                                               .device = **device,
+#ifdef ENABLE_TRACY
+                                               .pDeviceMemoryCallbacks = &DeviceMemoryCallbacks,
+#endif
+                                               .instance = *instance,
+                                               .vulkanApiVersion = VK_API_VERSION_1_3,
+                                           }},
+                                           &allocator);
     if (result != VK_SUCCESS) {
         vk::throwResultException(vk::Result{result}, "vmaCreateAllocator");
     }
 }
 
 VulkanAllocator::~VulkanAllocator() {
-    if (!staging_buffers.empty()) {
-        vk::Result result;
-        do {
-            result = device->waitForFences(
-                Common::VectorFromRange(
-                    staging_buffers |
-                    std::views::transform([](const auto& pair) { return *pair.second; })),
-                VK_TRUE, std::numeric_limits<u64>::max());
-        } while (result == vk::Result::eTimeout);
-    }
-    staging_buffers.clear();
-
     vmaDestroyAllocator(allocator);
 }
 
-VulkanAllocator::StagingBufferHandle::StagingBufferHandle(VulkanAllocator& allocator_,
-                                                          std::size_t size)
-    : allocator(allocator_),
-      buffer(std::make_unique<VulkanStagingBuffer>(allocator, size)), fence{*allocator.device,
-                                                                            vk::FenceCreateInfo{}} {
+void VulkanAllocator::SetPressureCallback(PressureCallback callback) {
+    std::scoped_lock lock{callback_mutex};
+    pressure_callback = std::move(callback);
+}
+
+static bool IsOutOfMemory(VkResult result) {
+    return result == VK_ERROR_OUT_OF_DEVICE_MEMORY || result == VK_ERROR_OUT_OF_HOST_MEMORY;
+}
+
+static constexpr std::array<const char*, NumMemoryCategories> CategoryNames{{
+    "geometry",
+    "textures",
+    "acceleration structures",
+    "scratch",
+    "render targets",
+    "other",
+}};
+
+const char* GetMemoryCategoryName(MemoryCategory category) {
+    return CategoryNames[static_cast<std::size_t>(category)];
+}
+
+VkResult VulkanAllocator::Allocate(MemoryCategory category, vk::DeviceSize size,
+                                   const VmaAllocationCreateInfo& create_info,
+                                   const AllocateFunc& allocate) const {
 
-    buffer->command_buffer.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    VmaAllocationCreateInfo within_budget = create_info;
+    within_budget.flags |= VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT;
+    VkResult result = allocate(within_budget);
+    for (std::size_t i = 0; i < MaxPressureRetries && IsOutOfMemory(result); ++i) {
+        {
+            std::scoped_lock lock{callback_mutex};
+            if (!pressure_callback || !pressure_callback(category, size)) {
+                break;
+            }
+        }
+        result = allocate(within_budget);
+    }
+    if (!IsOutOfMemory(result)) {
+        return result;
+    }
+
+    // Nothing more to release, exceed the budget rather than fail
+    SPDLOG_WARN("Allocating {} bytes of {} exceeds the memory budget", size,
+                CategoryNames[static_cast<std::size_t>(category)]);
+    result = allocate(create_info);
+    if (IsOutOfMemory(result)) {
+        LogUsage();
+    }
+    return result;
+}
+
+static void UpdatePeak(std::atomic<vk::DeviceSize>& peak, vk::DeviceSize value) noexcept {
+    auto current = peak.load(std::memory_order_relaxed);
+    while (current < value &&
+           !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
 }
 
-void VulkanAllocator::StagingBufferHandle::Submit() {
-    buffer->command_buffer.end();
-    allocator.device.graphics_queue.submit(
-        {{
-            .commandBufferCount = 1,
-            .pCommandBuffers = TempArr<vk::CommandBuffer>{*buffer->command_buffer},
-        }},
-        *fence);
+void VulkanAllocator::AddUsage(MemoryCategory category, vk::DeviceSize size) const noexcept {
+    const auto idx = static_cast<std::size_t>(category);
+    UpdatePeak(category_peaks[idx], category_usage[idx] += size);
+    UpdatePeak(total_peak, total_usage += size);
+}
+
+void VulkanAllocator::RemoveUsage(MemoryCategory category, vk::DeviceSize size) const noexcept {
+    category_usage[static_cast<std::size_t>(category)] -= size;
+    total_usage -= size;
+}
 
-    allocator.staging_buffers.emplace_back(std::move(buffer), std::move(fence));
+void VulkanAllocator::ResetPeakUsage() const noexcept {
+    for (std::size_t i = 0; i < NumMemoryCategories; ++i) {
+        category_peaks[i] = category_usage[i].load();
+    }
+    total_peak = total_usage.load();
 }
 
-VulkanAllocator::StagingBufferHandle::~StagingBufferHandle() {
+MemoryUsage VulkanAllocator::GetUsage() const {
+    MemoryUsage usage;
+    for (std::size_t i = 0; i < NumMemoryCategories; ++i) {
+        usage.categories[i] = category_usage[i];
+        usage.peak_categories[i] = category_peaks[i];
+    }
+    usage.peak_total = total_peak;
+
+    const VkPhysicalDeviceMemoryProperties* memory_properties{};
+    vmaGetMemoryProperties(allocator, &memory_properties);
+    std::array<VmaBudget, VK_MAX_MEMORY_HEAPS> budgets{};
+    vmaGetHeapBudgets(allocator, budgets.data());
+    for (u32 i = 0; i < memory_properties->memoryHeapCount; ++i) {
+        if (memory_properties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            usage.device_usage += budgets[i].usage;
+            usage.device_budget += budgets[i].budget;
+        }
+    }
+    return usage;
+}
+
+void VulkanAllocator::RegisterBuffer(vk::Buffer buffer, const BufferRange& range) const {
+    std::scoped_lock lock{buffer_ranges_mutex};
+    buffer_ranges.emplace(static_cast<VkBuffer>(buffer), range);
+}
+
+void VulkanAllocator::UnregisterBuffer(vk::Buffer buffer) const {
+    std::scoped_lock lock{buffer_ranges_mutex};
+    buffer_ranges.erase(static_cast<VkBuffer>(buffer));
+}
+
+VulkanAllocator::BufferRange VulkanAllocator::GetBufferRange(vk::Buffer buffer) const {
+    std::scoped_lock lock{buffer_ranges_mutex};
+    const auto it = buffer_ranges.find(static_cast<VkBuffer>(buffer));
+    if (it == buffer_ranges.end()) {
+        throw std::runtime_error("Buffer has no device address for descriptor buffers");
+    }
+    return it->second;
+}
+
+void VulkanAllocator::RegisterMovable(VmaAllocation allocation, VulkanBuffer& buffer) const {
+    std::scoped_lock lock{movables_mutex};
+    movables.insert_or_assign(allocation, Movable{.buffer = &buffer});
+}
+
+bool VulkanAllocator::UnregisterMovable(VmaAllocation allocation) const {
+    std::scoped_lock lock{movables_mutex};
+    const auto it = movables.find(allocation);
+    if (it == movables.end()) {
+        return true;
+    }
+    if (it->second.moving) {
+        it->second.buffer = nullptr;
+        return false;
+    }
+    movables.erase(it);
+    return true;
+}
+
+VulkanBuffer* VulkanAllocator::BeginMove(VmaAllocation allocation) const {
+    std::scoped_lock lock{movables_mutex};
+    const auto it = movables.find(allocation);
+    if (it == movables.end()) {
+        return nullptr;
+    }
+    it->second.moving = true;
+    return it->second.buffer;
+}
+
+VulkanBuffer* VulkanAllocator::EndMove(VmaAllocation allocation) const {
+    std::scoped_lock lock{movables_mutex};
+    const auto it = movables.find(allocation);
+    if (it == movables.end()) {
+        return nullptr;
+    }
+    auto* buffer = it->second.buffer;
     if (buffer) {
-        SPDLOG_WARN("Staging buffer not uploaded");
+        it->second.moving = false;
+    } else {
+        movables.erase(it);
     }
+    return buffer;
 }
 
-VulkanAllocator::StagingBufferHandle VulkanAllocator::CreateStagingBuffer(std::size_t size) {
-    CleanupStagingBuffers();
-    return StagingBufferHandle{*this, size};
+void VulkanAllocator::LogUsage() const {
+    static constexpr double MiB = 1024.0 * 1024.0;
+    const auto usage = GetUsage();
+    SPDLOG_INFO("Device memory: {:.1f} of {:.1f} MiB used, peak allocated {:.1f} MiB",
+                usage.device_usage / MiB, usage.device_budget / MiB, usage.peak_total / MiB);
+    for (std::size_t i = 0; i < NumMemoryCategories; ++i) {
+        SPDLOG_INFO("  {}: {:.1f} MiB (peak {:.1f} MiB)", CategoryNames[i],
+                    usage.categories[i] / MiB, usage.peak_categories[i] / MiB);
+    }
 }
 
-void VulkanAllocator::CleanupStagingBuffers() {
-    std::erase_if(staging_buffers,
-                  [](const auto& pair) { return pair.second.getStatus() == vk::Result::eSuccess; });
+void VulkanAllocator::SetAllocationName(VmaAllocation allocation, MemoryCategory category,
+                                        std::string_view name) const {
+    const auto full_name = name.empty()
+                               ? std::string{GetMemoryCategoryName(category)}
+                               : fmt::format("{}: {}", GetMemoryCategoryName(category), name);
+    vmaSetAllocationName(allocator, allocation, full_name.c_str()); // Copied
+}
+
+std::string VulkanAllocator::GetReport(bool detailed) const {
+    const auto usage = GetUsage();
+    std::string report = fmt::format(
+        R"({{"device_usage":{},"device_budget":{},"peak_total":{},"categories":{{)",
+        usage.device_usage, usage.device_budget, usage.peak_total);
+    for (std::size_t i = 0; i < NumMemoryCategories; ++i) {
+        report += fmt::format(R"({}"{}":{{"bytes":{},"peak_bytes":{}}})", i == 0 ? "" : ",",
+                              CategoryNames[i], usage.categories[i], usage.peak_categories[i]);
+    }
+
+    char* stats{};
+    vmaBuildStatsString(allocator, &stats, detailed);
+    report += fmt::format(R"(}},"vma":{}}})", stats);
+    vmaFreeStatsString(allocator, stats);
+    return report;
+}
+
+bool VulkanAllocator::WriteReport(const std::filesystem::path& path, bool detailed) const {
+    std::ofstream file(path);
+    file << GetReport(detailed);
+    if (!file) {
+        SPDLOG_ERROR("Failed to write memory report {}", path.string());
+        return false;
+    }
+    SPDLOG_INFO("Wrote memory report {}", path.string());
+    return true;
 }
 
 } // namespace Renderer
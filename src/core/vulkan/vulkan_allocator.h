@@ -4,60 +4,140 @@
 
 #pragma once
 
-#include <memory>
-#include <utility>
+#include <array>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vk_mem_alloc.h>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
 
 namespace Renderer {
 
+class VulkanBuffer;
 class VulkanDevice;
-class VulkanStagingBuffer;
+
+// What device memory is used for, to track the usage of each
+enum class MemoryCategory {
+    Geometry,        // Vertices, indices and other scene data (materials, primitives)
+    Textures,
+    AccelStructures, // Including the instances of TLASes
+    Scratch,         // Staging, readback and acceleration structure build scratch buffers
+    RenderTargets,   // Offscreen images
+    Other,           // Small resources such as uniform buffers and shader binding tables
+};
+inline constexpr std::size_t NumMemoryCategories = 6;
+
+const char* GetMemoryCategoryName(MemoryCategory category);
+
+struct MemoryUsage {
+    std::array<vk::DeviceSize, NumMemoryCategories> categories{}; // Allocated by the renderer
+    // The most allocated since the peaks were last reset, of each category and in total
+    std::array<vk::DeviceSize, NumMemoryCategories> peak_categories{};
+    vk::DeviceSize peak_total{};
+    // Of the device local heaps, by this process and what the driver estimates it can use.
+    // Without VK_EXT_memory_budget, the usage only counts VMA's own blocks and the budget is
+    // a fraction of the heap sizes.
+    vk::DeviceSize device_usage{};
+    vk::DeviceSize device_budget{};
+};
 
 /**
- * RAII wrapper around VmaAllocator. Also handles the creation and deletion of staging buffers.
+ * RAII wrapper around VmaAllocator.
+ *
+ * Also tracks the memory the renderer has allocated per category, and its peaks. Allocations
+ * are named after their category and resource in the VMA statistics, which GetReport includes
+ * in a JSON report along with the usage of each category. Allocations made through
+ * Allocate() stay within the heap budgets first: when one does not fit, the pressure callback
+ * gets a chance to release memory (e.g. drop texture levels) before the allocation is retried,
+ * finally exceeding the budget and letting the driver page.
  */
 class VulkanAllocator final : NonCopyable {
 public:
+    // Called with the category and size of the allocation that does not fit. Returns whether
+    // it has released memory, in which case the allocation is retried within budget.
+    // May be called from any thread that allocates, e.g. the scene loading threads, but never
+    // concurrently. Must not allocate itself.
+    using PressureCallback = std::function<bool(MemoryCategory category, vk::DeviceSize size)>;
+    using AllocateFunc = std::function<VkResult(const VmaAllocationCreateInfo&)>;
+    // Pressure callbacks releasing memory are called up to this many times per allocation
+    static constexpr std::size_t MaxPressureRetries = 4;
+
     explicit VulkanAllocator(const vk::raii::Instance& instance, const VulkanDevice& device);
     ~VulkanAllocator();
 
-    // Creates a staging buffer that returns itself to the ownership of the allocator
-    // when submitted
-    struct StagingBufferHandle : NonCopyable {
-        explicit StagingBufferHandle(VulkanAllocator& allocator, std::size_t size);
-        void Submit();
-        ~StagingBufferHandle();
-
-        VulkanStagingBuffer& operator*() noexcept {
-            return *buffer;
-        }
-
-        const VulkanStagingBuffer& operator*() const noexcept {
-            return *buffer;
-        }
-
-    private:
-        VulkanAllocator& allocator;
-        std::unique_ptr<VulkanStagingBuffer> buffer;
-        vk::raii::Fence fence;
-    };
-    [[nodiscard]] StagingBufferHandle CreateStagingBuffer(std::size_t size);
-
-    // Should be called from the render thread.
-    void CleanupStagingBuffers();
-
     VmaAllocator operator*() const noexcept {
         return allocator;
     }
 
+    void SetPressureCallback(PressureCallback callback);
+    // Creates the allocation with allocate, which receives create_info with any extra flags.
+    // Returns the result of the last attempt. The caller tracks the allocation with AddUsage.
+    VkResult Allocate(MemoryCategory category, vk::DeviceSize size,
+                      const VmaAllocationCreateInfo& create_info,
+                      const AllocateFunc& allocate) const;
+
+    // Thread safe.
+    void AddUsage(MemoryCategory category, vk::DeviceSize size) const noexcept;
+    void RemoveUsage(MemoryCategory category, vk::DeviceSize size) const noexcept;
+    MemoryUsage GetUsage() const;
+    void ResetPeakUsage() const noexcept;
+    void LogUsage() const;
+
+    // Names the allocation after its category, followed by the name of the resource if any
+    void SetAllocationName(VmaAllocation allocation, MemoryCategory category,
+                           std::string_view name = {}) const;
+    // JSON of the usage of each category and the device heaps, and the VMA statistics (from
+    // vmaBuildStatsString), with every allocation if detailed
+    std::string GetReport(bool detailed = true) const;
+    // Logs and returns false on failure
+    bool WriteReport(const std::filesystem::path& path, bool detailed = true) const;
+
+    // Of the uniform and storage buffers when descriptor buffers are enabled, whose descriptors
+    // are written from their address and size rather than their handle. Registered by
+    // VulkanBuffer. Thread safe.
+    struct BufferRange {
+        vk::DeviceAddress address{};
+        vk::DeviceSize size{};
+    };
+    void RegisterBuffer(vk::Buffer buffer, const BufferRange& range) const;
+    void UnregisterBuffer(vk::Buffer buffer) const;
+    // Throws if the buffer is not registered
+    BufferRange GetBufferRange(vk::Buffer buffer) const;
+
+    // Of the buffers that defragmentation may move, see VulkanBuffer::SetMovable. Thread safe.
+    void RegisterMovable(VmaAllocation allocation, VulkanBuffer& buffer) const;
+    // Returns false if the buffer is being moved, in which case VulkanDefragmenter frees its
+    // allocation instead once the move ends.
+    bool UnregisterMovable(VmaAllocation allocation) const;
+    // Null if the allocation is not of a movable buffer. Otherwise it is marked as being moved
+    // until EndMove, which returns null if the buffer has been destroyed meanwhile.
+    VulkanBuffer* BeginMove(VmaAllocation allocation) const;
+    VulkanBuffer* EndMove(VmaAllocation allocation) const;
+
     const VulkanDevice& device;
 
 private:
     VmaAllocator allocator = nullptr;
 
-    std::vector<std::pair<std::unique_ptr<VulkanStagingBuffer>, vk::raii::Fence>> staging_buffers;
+    mutable std::array<std::atomic<vk::DeviceSize>, NumMemoryCategories> category_usage{};
+    mutable std::array<std::atomic<vk::DeviceSize>, NumMemoryCategories> category_peaks{};
+    mutable std::atomic<vk::DeviceSize> total_usage{};
+    mutable std::atomic<vk::DeviceSize> total_peak{};
+    mutable std::mutex callback_mutex; // Serializes the pressure callback
+    PressureCallback pressure_callback;
+    mutable std::mutex buffer_ranges_mutex;
+    mutable std::unordered_map<VkBuffer, BufferRange> buffer_ranges;
+    struct Movable {
+        VulkanBuffer* buffer{}; // Null once destroyed while being moved
+        bool moving{};
+    };
+    mutable std::mutex movables_mutex;
+    mutable std::unordered_map<VmaAllocation, Movable> movables;
 };
 
 } // namespace Renderer
@@ -13,55 +13,118 @@ namespace Renderer {
 
 VulkanBuffer::VulkanBuffer(const VulkanAllocator& allocator_,
                            const vk::BufferCreateInfo& buffer_create_info,
-                           const VmaAllocationCreateInfo& alloc_create_info)
-    : allocator(*allocator_), size(buffer_create_info.size) {
+                           const VmaAllocationCreateInfo& alloc_create_info,
+                           MemoryCategory category_)
+    : allocator(*allocator_), size(buffer_create_info.size),
+      sharing_mode(buffer_create_info.sharingMode), category(category_), owner(allocator_) {
 
-    const VkBufferCreateInfo& buffer_create_info_raw = buffer_create_info;
-    const auto result = vmaCreateBuffer(allocator, &buffer_create_info_raw, &alloc_create_info,
-                                        &buffer, &allocation, &allocation_info);
+    // Descriptor buffers refer to them by address
+    auto create_info = buffer_create_info;
+    descriptor_address = owner.device.descriptor_buffer &&
+                         (create_info.usage & (vk::BufferUsageFlagBits::eUniformBuffer |
+                                               vk::BufferUsageFlagBits::eStorageBuffer));
+    if (descriptor_address) {
+        create_info.usage |= vk::BufferUsageFlagBits::eShaderDeviceAddress;
+    }
+    usage = create_info.usage;
+    queue_family_indices.assign(create_info.pQueueFamilyIndices,
+                                create_info.pQueueFamilyIndices + create_info.queueFamilyIndexCount);
+    const VkBufferCreateInfo& buffer_create_info_raw = create_info;
+    const auto result = owner.Allocate(
+        category, size, alloc_create_info, [this, &buffer_create_info_raw](const auto& info) {
+            return vmaCreateBuffer(allocator, &buffer_create_info_raw, &info, &buffer,
+                                   &allocation, &allocation_info);
+        });
     if (result != VK_SUCCESS) {
         vk::throwResultException(vk::Result{result}, "vmaCreateBuffer");
     }
+    owner.AddUsage(category, allocation_info.size);
+    owner.SetAllocationName(allocation, category);
+    if (descriptor_address) {
+        RegisterAddress();
+    }
 }
 
 VulkanBuffer::~VulkanBuffer() {
+    if (descriptor_address) {
+        owner.UnregisterBuffer(buffer);
+    }
+    owner.RemoveUsage(category, allocation_info.size);
+    if (movable && !owner.UnregisterMovable(allocation)) {
+        // Being moved, the defragmenter frees the allocation once the move ends
+        owner.device->getDispatcher()->vkDestroyBuffer(**owner.device, buffer, nullptr);
+        return;
+    }
     vmaDestroyBuffer(allocator, buffer, allocation);
 }
 
-VulkanStagingBuffer::VulkanStagingBuffer(const VulkanAllocator& allocator, std::size_t size)
-    : VulkanBuffer{allocator,
-                   {
-                       .size = size,
-                       .usage = vk::BufferUsageFlagBits::eTransferSrc,
-                   },
-                   {
-                       .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
-                                VMA_ALLOCATION_CREATE_MAPPED_BIT,
-                       .usage = VMA_MEMORY_USAGE_AUTO,
-                   }} {
+void VulkanBuffer::SetName(std::string_view name) const {
+    owner.SetAllocationName(allocation, category, name);
+}
 
-    vk::raii::CommandBuffers command_buffers{*allocator.device,
-                                             {
-                                                 .commandPool = *allocator.device.command_pool,
-                                                 .level = vk::CommandBufferLevel::ePrimary,
-                                                 .commandBufferCount = 1,
-                                             }};
-    command_buffer = std::move(command_buffers[0]);
+void VulkanBuffer::SetMovable() {
+    if (!movable) {
+        movable = true;
+        owner.RegisterMovable(allocation, *this);
+    }
+}
+
+vk::BufferCreateInfo VulkanBuffer::GetCreateInfo() const noexcept {
+    vk::BufferCreateInfo create_info{
+        .size = size,
+        .usage = usage,
+        .sharingMode = sharing_mode,
+    };
+    create_info.setQueueFamilyIndices(queue_family_indices);
+    return create_info;
+}
+
+void VulkanBuffer::Relocate(VkBuffer new_buffer) {
+    if (descriptor_address) {
+        owner.UnregisterBuffer(buffer);
+    }
+    owner.device->getDispatcher()->vkDestroyBuffer(**owner.device, buffer, nullptr);
+    buffer = new_buffer;
+    vmaGetAllocationInfo(allocator, allocation, &allocation_info); // Mapped elsewhere now
+    if (descriptor_address) {
+        RegisterAddress();
+    }
+}
+
+void VulkanBuffer::RegisterAddress() const {
+    owner.RegisterBuffer(buffer, {
+                                     .address = owner.device->getBufferAddress({
+                                         .buffer = buffer,
+                                     }),
+                                     .size = size,
+                                 });
 }
 
-VulkanStagingBuffer::~VulkanStagingBuffer() = default;
+// Acceleration structure build inputs are read by the compute queue as well as the graphics queue
+static vk::BufferCreateInfo GetUploadBufferCreateInfo(const VulkanDevice& device,
+                                                      const VulkanBufferCreateInfo& create_info) {
+    vk::BufferCreateInfo buffer_create_info{
+        .size = create_info.size,
+        .usage = create_info.usage | vk::BufferUsageFlagBits::eTransferDst,
+    };
+    if ((create_info.usage &
+         vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR) &&
+        device.shared_queue_families.size() > 1) {
+        buffer_create_info.sharingMode = vk::SharingMode::eConcurrent;
+        buffer_create_info.setQueueFamilyIndices(device.shared_queue_families);
+    }
+    return buffer_create_info;
+}
 
 VulkanImmUploadBuffer::VulkanImmUploadBuffer(VulkanDevice& device,
                                              const VulkanBufferCreateInfo& create_info,
                                              std::function<void(void*, std::size_t)> read_func)
-    : VulkanBuffer{*device.allocator,
-                   {
-                       .size = create_info.size,
-                       .usage = create_info.usage | vk::BufferUsageFlagBits::eTransferDst,
-                   },
+    : VulkanBuffer{*device.allocator, GetUploadBufferCreateInfo(device, create_info),
                    {
+                       .flags = DirectUploadFlags,
                        .usage = VMA_MEMORY_USAGE_AUTO,
-                   }} {
+                   },
+                   create_info.category} {
 
     Helpers::ReadAndUploadBuffer(device, *this, create_info.dst_stage_mask,
                                  create_info.dst_access_mask, std::move(read_func));
@@ -70,14 +133,12 @@ VulkanImmUploadBuffer::VulkanImmUploadBuffer(VulkanDevice& device,
 VulkanImmUploadBuffer::VulkanImmUploadBuffer(VulkanDevice& device,
                                              const VulkanBufferCreateInfo& create_info,
                                              const u8* data)
-    : VulkanBuffer{*device.allocator,
-                   {
-                       .size = create_info.size,
-                       .usage = create_info.usage | vk::BufferUsageFlagBits::eTransferDst,
-                   },
+    : VulkanBuffer{*device.allocator, GetUploadBufferCreateInfo(device, create_info),
                    {
+                       .flags = DirectUploadFlags,
                        .usage = VMA_MEMORY_USAGE_AUTO,
-                   }} {
+                   },
+                   create_info.category} {
 
     std::size_t pos = 0;
     Helpers::ReadAndUploadBuffer(device, *this, create_info.dst_stage_mask,
@@ -99,11 +160,13 @@ VulkanZeroedBuffer::VulkanZeroedBuffer(VulkanDevice& device,
                    },
                    {
                        .usage = VMA_MEMORY_USAGE_AUTO,
-                   }} {
+                   },
+                   create_info.category} {
 
     vk::raii::CommandBuffers command_buffers{*device,
                                              {
-                                                 .commandPool = *device.command_pool,
+                                                 .commandPool = device.GetThreadCommandPool(
+                                                     device.graphics_queue_family),
                                                  .level = vk::CommandBufferLevel::ePrimary,
                                                  .commandBufferCount = 1,
                                              }};
@@ -126,7 +189,7 @@ VulkanZeroedBuffer::VulkanZeroedBuffer(VulkanDevice& device,
         }},
     });
     command_buffer.end();
-    device.graphics_queue.submit({{
+    device.Submit(device.graphics_queue, {{
         .commandBufferCount = 1,
         .pCommandBuffers = TempArr<vk::CommandBuffer>{*command_buffer},
     }});
@@ -147,7 +210,8 @@ VulkanUniformBuffer::VulkanUniformBuffer(const VulkanAllocator& allocator_, std:
                               VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT |
                               VMA_ALLOCATION_CREATE_MAPPED_BIT,
                      .usage = VMA_MEMORY_USAGE_AUTO,
-                 }} {
+                 },
+                 MemoryCategory::Other} {
 
     VkMemoryPropertyFlags mem_props;
     vmaGetAllocationMemoryProperties(*allocator, dst_buffer.allocation, &mem_props);
@@ -163,7 +227,9 @@ VulkanUniformBuffer::VulkanUniformBuffer(const VulkanAllocator& allocator_, std:
                 .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
                          VMA_ALLOCATION_CREATE_MAPPED_BIT,
                 .usage = VMA_MEMORY_USAGE_AUTO,
-            });
+            },
+            MemoryCategory::Scratch);
+        src_buffer->SetName("uniform staging");
     }
 }
 
@@ -7,48 +7,78 @@
 #include <cstring>
 #include <functional>
 #include <memory>
+#include <string_view>
+#include <vector>
 #include <vk_mem_alloc.h>
 #include <vulkan/vulkan.hpp>
 #include "common/common_types.h"
+#include "core/vulkan/vulkan_allocator.h"
 #include "core/vulkan/vulkan_helpers.hpp"
 
 namespace Renderer {
 
-class VulkanAllocator;
 class VulkanDevice;
 
 /**
- * RAII wrapper for VMA buffer allocations.
+ * RAII wrapper for VMA buffer allocations, whose memory is tracked under the category. The
+ * allocation is named after the category, see SetName.
  */
 class VulkanBuffer : NonCopyable {
 public:
     explicit VulkanBuffer(const VulkanAllocator& allocator,
                           const vk::BufferCreateInfo& buffer_create_info,
-                          const VmaAllocationCreateInfo& alloc_create_info);
+                          const VmaAllocationCreateInfo& alloc_create_info,
+                          MemoryCategory category);
     ~VulkanBuffer();
 
+    // Names the allocation after the resource as well, in the memory report
+    void SetName(std::string_view name) const;
+
+    // Lets VulkanDefragmenter move the buffer to compact device memory, which replaces its
+    // handle (and address). Only for buffers the device no longer writes, e.g. once uploaded,
+    // whose owner rebinds the new handle when told that it has moved.
+    void SetMovable();
+
+    // For buffers that are filled once and then only read by the device. They are host visible
+    // where device local memory can be written by the host within budget, and filled through a
+    // staging copy otherwise, see Helpers::ReadAndUploadBuffer.
+    static constexpr VmaAllocationCreateFlags DirectUploadFlags =
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT |
+        VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
     VkBuffer operator*() const noexcept {
         return buffer;
     }
 
+    // Whether the buffer is persistently mapped, i.e. the host can write to it directly
+    bool IsMapped() const noexcept {
+        return allocation_info.pMappedData != nullptr;
+    }
+
     VmaAllocator allocator{};
     VmaAllocation allocation{};
     VmaAllocationInfo allocation_info{};
     std::size_t size{};
+    vk::SharingMode sharing_mode{};
+    MemoryCategory category{};
 
 protected:
     VkBuffer buffer{};
-};
 
-/**
- * One-use buffer for uploading data to another buffer. It also keeps a command buffer.
- */
-class VulkanStagingBuffer : public VulkanBuffer {
-public:
-    explicit VulkanStagingBuffer(const VulkanAllocator& allocator, std::size_t size);
-    ~VulkanStagingBuffer();
-
-    vk::raii::CommandBuffer command_buffer = nullptr;
+private:
+    friend class VulkanDefragmenter;
+    // Of a replacement, bound to the new memory of the allocation
+    vk::BufferCreateInfo GetCreateInfo() const noexcept;
+    // Destroys the old handle once the allocation has moved
+    void Relocate(VkBuffer new_buffer);
+    void RegisterAddress() const;
+
+    const VulkanAllocator& owner;
+    vk::BufferUsageFlags usage{};
+    std::vector<u32> queue_family_indices; // Of concurrent sharing
+    bool descriptor_address{}; // Whether it is registered with the allocator
+    bool movable{};
 };
 
 // Too many params, let's do it the Vulkan style
@@ -57,6 +87,7 @@ struct VulkanBufferCreateInfo {
     vk::BufferUsageFlags usage{};
     vk::PipelineStageFlags2 dst_stage_mask{};
     vk::AccessFlags2 dst_access_mask{};
+    MemoryCategory category = MemoryCategory::Geometry;
 };
 
 /**
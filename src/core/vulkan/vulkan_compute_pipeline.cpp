@@ -0,0 +1,34 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include "core/vulkan/vulkan_compute_pipeline.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+
+namespace Renderer {
+
+VulkanComputePipeline::VulkanComputePipeline(const VulkanDevice& device,
+                                             const vk::PipelineShaderStageCreateInfo& stage,
+                                             vk::PipelineLayoutCreateInfo pipeline_layout_info) {
+
+    pipeline_layout = vk::raii::PipelineLayout{*device, pipeline_layout_info};
+    vk::PipelineCreationFeedback feedback;
+    const vk::PipelineCreationFeedbackCreateInfo feedback_info{
+        .pPipelineCreationFeedback = &feedback,
+    };
+    const auto flags = device.descriptor_buffer ? vk::PipelineCreateFlagBits::eDescriptorBufferEXT
+                                                : vk::PipelineCreateFlags{};
+    pipeline = vk::raii::Pipeline{*device, device.pipeline_cache,
+                                  vk::ComputePipelineCreateInfo{
+                                      .pNext = &feedback_info,
+                                      .flags = flags,
+                                      .stage = stage,
+                                      .layout = *pipeline_layout,
+                                  }};
+    Helpers::LogPipelineCreationFeedback("compute", feedback);
+}
+
+VulkanComputePipeline::~VulkanComputePipeline() = default;
+
+} // namespace Renderer
@@ -0,0 +1,29 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanDevice;
+
+class VulkanComputePipeline : NonCopyable {
+public:
+    explicit VulkanComputePipeline(const VulkanDevice& device,
+                                   const vk::PipelineShaderStageCreateInfo& stage,
+                                   vk::PipelineLayoutCreateInfo pipeline_layout_info);
+    ~VulkanComputePipeline();
+
+    vk::Pipeline operator*() const noexcept {
+        return *pipeline;
+    }
+
+    vk::raii::Pipeline pipeline = nullptr;
+    vk::raii::PipelineLayout pipeline_layout = nullptr;
+};
+
+} // namespace Renderer
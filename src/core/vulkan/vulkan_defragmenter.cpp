@@ -0,0 +1,173 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <spdlog/spdlog.h>
+#include "common/temp_ptr.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_defragmenter.h"
+#include "core/vulkan/vulkan_device.h"
+
+namespace Renderer {
+
+VulkanDefragmenter::VulkanDefragmenter(VulkanDevice& device_)
+    : device(device_), command_buffers{*device,
+                                       {
+                                           .commandPool = *device.command_pool,
+                                           .level = vk::CommandBufferLevel::ePrimary,
+                                           .commandBufferCount = 1,
+                                       }},
+      fence{*device, vk::FenceCreateInfo{}} {}
+
+VulkanDefragmenter::~VulkanDefragmenter() {
+    if (!context) {
+        return;
+    }
+    if (pass_in_flight) {
+        [[maybe_unused]] const auto result = device->waitForFences({*fence}, VK_TRUE, UINT64_MAX);
+        // Owners are destroyed by now, or keep the moved buffers until they are
+        EndPass();
+    }
+    vmaEndDefragmentation(**device.allocator, context, nullptr);
+}
+
+bool VulkanDefragmenter::Begin() {
+    if (context) {
+        return true;
+    }
+
+    VmaTotalStatistics stats{};
+    vmaCalculateStatistics(**device.allocator, &stats);
+    const auto& total = stats.total.statistics;
+    const auto free_bytes = total.blockBytes - total.allocationBytes;
+    if (free_bytes < MinFreeBytes || free_bytes < total.blockBytes * MinFreeFraction) {
+        return false;
+    }
+
+    const auto result =
+        vmaBeginDefragmentation(**device.allocator,
+                                TempPtr{VmaDefragmentationInfo{
+                                    .flags = VMA_DEFRAGMENTATION_FLAG_ALGORITHM_BALANCED_BIT,
+                                    .maxBytesPerPass = MaxBytesPerPass,
+                                }},
+                                &context);
+    if (result != VK_SUCCESS) {
+        SPDLOG_WARN("Failed to begin defragmentation: {}", vk::to_string(vk::Result{result}));
+        context = nullptr;
+        return false;
+    }
+    SPDLOG_INFO("Defragmenting {} MiB of free device memory", free_bytes / (1024 * 1024));
+    return true;
+}
+
+std::vector<VulkanBuffer*> VulkanDefragmenter::Step() {
+    if (!context) {
+        return {};
+    }
+    if (!pass_in_flight) {
+        BeginPass();
+        return {};
+    }
+    if (device->getFenceStatus(*fence) != vk::Result::eSuccess) {
+        return {};
+    }
+    // Frames recorded during the pass still read the old buffers
+    device.WaitQueueIdle(device.graphics_queue);
+    return EndPass();
+}
+
+void VulkanDefragmenter::BeginPass() {
+    const auto& allocator = *device.allocator;
+    const auto result = vmaBeginDefragmentationPass(*allocator, context, &pass_info);
+    if (result == VK_SUCCESS) { // Nothing left to move
+        VmaDefragmentationStats stats{};
+        vmaEndDefragmentation(*allocator, context, &stats);
+        context = nullptr;
+        SPDLOG_INFO("Defragmentation moved {} allocations ({} MiB), freeing {} MiB",
+                    stats.allocationsMoved, stats.bytesMoved / (1024 * 1024),
+                    stats.bytesFreed / (1024 * 1024));
+        return;
+    }
+
+    moves.clear();
+    const auto& cmd = command_buffers[0];
+    cmd.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    for (u32 i = 0; i < pass_info.moveCount; ++i) {
+        auto& move = pass_info.pMoves[i];
+        auto* buffer = allocator.BeginMove(move.srcAllocation);
+        if (!buffer) { // Not movable
+            move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+            continue;
+        }
+
+        const VkBufferCreateInfo& create_info = buffer->GetCreateInfo();
+        VkBuffer new_buffer{};
+        auto create_result = device->getDispatcher()->vkCreateBuffer(**device, &create_info,
+                                                                    nullptr, &new_buffer);
+        if (create_result == VK_SUCCESS) {
+            create_result = vmaBindBufferMemory(*allocator, move.dstTmpAllocation, new_buffer);
+            if (create_result != VK_SUCCESS) {
+                device->getDispatcher()->vkDestroyBuffer(**device, new_buffer, nullptr);
+            }
+        }
+        if (create_result != VK_SUCCESS) {
+            allocator.EndMove(move.srcAllocation);
+            move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+            continue;
+        }
+        cmd.copyBuffer(**buffer, new_buffer, {{.size = buffer->size}});
+        moves.emplace_back(Move{.buffer = buffer, .new_buffer = new_buffer});
+    }
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            .dstAccessMask = vk::AccessFlagBits2::eMemoryRead,
+        }},
+    });
+    cmd.end();
+
+    if (moves.empty()) { // Nothing to copy, the pass can end right away
+        vmaEndDefragmentationPass(*allocator, context, &pass_info);
+        return;
+    }
+    device->resetFences({*fence});
+    device.Submit(device.graphics_queue,
+                  {{
+                      .commandBufferCount = 1,
+                      .pCommandBuffers = TempArr<vk::CommandBuffer>{*cmd},
+                  }},
+                  *fence);
+    pass_in_flight = true;
+}
+
+std::vector<VulkanBuffer*> VulkanDefragmenter::EndPass() {
+    const auto& allocator = *device.allocator;
+    std::vector<VulkanBuffer*> moved;
+    std::size_t move_idx = 0;
+    for (u32 i = 0; i < pass_info.moveCount; ++i) {
+        auto& move = pass_info.pMoves[i];
+        if (move.operation != VMA_DEFRAGMENTATION_MOVE_OPERATION_COPY) {
+            continue;
+        }
+        const auto& [buffer, new_buffer] = moves[move_idx++];
+        if (allocator.EndMove(move.srcAllocation)) {
+            buffer->Relocate(new_buffer);
+            moved.emplace_back(buffer);
+        } else { // Its owner has destroyed it meanwhile
+            device->getDispatcher()->vkDestroyBuffer(**device, new_buffer, nullptr);
+            move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_DESTROY;
+        }
+    }
+    moves.clear();
+    pass_in_flight = false;
+
+    // VK_INCOMPLETE if there are more passes, which the next Step begins
+    vmaEndDefragmentationPass(*allocator, context, &pass_info);
+    return moved;
+}
+
+} // namespace Renderer
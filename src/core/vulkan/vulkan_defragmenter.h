@@ -0,0 +1,67 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanDevice;
+
+/**
+ * Compacts device memory with the defragmentation of VMA, a pass at a time over several frames,
+ * e.g. after loading has left it fragmented with freed scratch and staging buffers.
+ *
+ * Only buffers marked movable (see VulkanBuffer::SetMovable) are moved, everything else stays
+ * where it is. Each pass moves up to MaxBytesPerPass, copying the buffers into their new places
+ * on the graphics queue, and ends on a later Step once those copies have completed.
+ */
+class VulkanDefragmenter : NonCopyable {
+public:
+    static constexpr vk::DeviceSize MaxBytesPerPass = 32 * 1024 * 1024;
+    // Begin only starts a defragmentation when at least this fraction of the memory of the
+    // blocks VMA has allocated is free, and at least MinFreeBytes of it
+    static constexpr double MinFreeFraction = 0.25;
+    static constexpr vk::DeviceSize MinFreeBytes = 64 * 1024 * 1024;
+
+    explicit VulkanDefragmenter(VulkanDevice& device);
+    // Finishes the pass in flight, if any
+    ~VulkanDefragmenter();
+
+    bool IsRunning() const noexcept {
+        return context != nullptr;
+    }
+    // Starts a defragmentation unless one is running or memory is not fragmented enough.
+    // Returns whether one is running.
+    bool Begin();
+    // Begins the next pass, or ends the one in flight once its copies have completed, waiting
+    // for the graphics queue to be idle so that frames no longer use the old buffers. Returns
+    // the buffers that pass has moved, whose handles have changed: their owners must rebind
+    // them. Called from the thread that renders.
+    std::vector<VulkanBuffer*> Step();
+
+private:
+    struct Move {
+        VulkanBuffer* buffer{};
+        VkBuffer new_buffer{};
+    };
+
+    void BeginPass();
+    std::vector<VulkanBuffer*> EndPass();
+
+    VulkanDevice& device;
+    VmaDefragmentationContext context{};
+    VmaDefragmentationPassMoveInfo pass_info{};
+    std::vector<Move> moves; // Of pass_info
+    vk::raii::CommandBuffers command_buffers = nullptr;
+    vk::raii::Fence fence = nullptr;
+    bool pass_in_flight{};
+};
+
+} // namespace Renderer
@@ -0,0 +1,103 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include "common/temp_ptr.h"
+#include "core/vulkan/vulkan_deletion_queue.h"
+#include "core/vulkan/vulkan_device.h"
+
+namespace Renderer {
+
+static u64 GetCounterValue(const VulkanDevice& device, vk::Semaphore timeline) {
+    u64 value{};
+    const auto result =
+        device->getDispatcher()->vkGetSemaphoreCounterValue(*device.device, timeline, &value);
+    if (result != VK_SUCCESS) {
+        vk::throwResultException(vk::Result{result}, "vkGetSemaphoreCounterValue");
+    }
+    return value;
+}
+
+VulkanDeletionQueue::VulkanDeletionQueue(const VulkanDevice& device_) : device(device_) {}
+
+VulkanDeletionQueue::~VulkanDeletionQueue() = default;
+
+void VulkanDeletionQueue::RetireShared(vk::Semaphore timeline, u64 value,
+                                       std::shared_ptr<const void> resource) {
+    std::scoped_lock lock{mutex};
+    entries.push_back({
+        .timeline = timeline,
+        .value = value,
+        .resource = std::move(resource),
+    });
+}
+
+std::size_t VulkanDeletionQueue::Collect() {
+    std::scoped_lock collect_lock{collect_mutex};
+    {
+        std::scoped_lock lock{mutex};
+        if (entries.empty()) {
+            return 0;
+        }
+        counter_values.clear();
+        // Once per semaphore, of which there are few
+        const auto GetValue = [this](vk::Semaphore timeline) {
+            const auto it = std::ranges::find(counter_values, timeline,
+                                              &decltype(counter_values)::value_type::first);
+            if (it != counter_values.end()) {
+                return it->second;
+            }
+            return counter_values.emplace_back(timeline, GetCounterValue(device, timeline)).second;
+        };
+        // Unlike stable_partition, which may allocate, as Collect runs every frame. Neither the
+        // pending entries nor the retired ones need to keep their order.
+        const auto it = std::partition(
+            entries.begin(), entries.end(),
+            [&GetValue](const Entry& entry) { return GetValue(entry.timeline) < entry.value; });
+        std::move(it, entries.end(), std::back_inserter(collected));
+        entries.erase(it, entries.end());
+    }
+    const std::size_t count = collected.size();
+    collected.clear();
+    return count;
+}
+
+void VulkanDeletionQueue::Release(vk::Semaphore timeline) {
+    std::vector<Entry> released;
+    {
+        std::scoped_lock lock{mutex};
+        const auto it = std::stable_partition(
+            entries.begin(), entries.end(),
+            [timeline](const Entry& entry) { return entry.timeline != timeline; });
+        std::move(it, entries.end(), std::back_inserter(released));
+        entries.erase(it, entries.end());
+    }
+    if (released.empty()) {
+        return;
+    }
+    const u64 value = std::ranges::max(released, {}, &Entry::value).value;
+    vk::Result result;
+    do {
+        result = device->waitSemaphores(
+            {
+                .semaphoreCount = 1,
+                .pSemaphores = TempArr<vk::Semaphore>{timeline},
+                .pValues = TempArr<u64>{value},
+            },
+            std::numeric_limits<u64>::max());
+    } while (result == vk::Result::eTimeout);
+}
+
+void VulkanDeletionQueue::Clear() {
+    std::vector<Entry> cleared;
+    {
+        std::scoped_lock lock{mutex};
+        cleared = std::move(entries);
+        entries.clear();
+    }
+}
+
+} // namespace Renderer
@@ -0,0 +1,66 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanDevice;
+
+/**
+ * Destroys resources once the GPU has passed the timeline value of their last use, instead of
+ * waiting for the queue or device to be idle, or polling a fence per resource. Resources are
+ * retired with the timeline semaphore and value of the submission that last uses them (e.g. of
+ * the frame in flight, or of the upload batch), and destroyed by Collect once the semaphore
+ * reaches it, reading the counter of each semaphore once. Thread safe.
+ *
+ * The semaphores must outlive what is retired on them: their owners Release them before they
+ * are destroyed.
+ */
+class VulkanDeletionQueue : NonCopyable {
+public:
+    explicit VulkanDeletionQueue(const VulkanDevice& device);
+    ~VulkanDeletionQueue();
+
+    template <typename T>
+    void Retire(vk::Semaphore timeline, u64 value, T resource) {
+        RetireShared(timeline, value, std::make_shared<T>(std::move(resource)));
+    }
+    // Keeps a reference to the resource until then, which may be shared with other owners
+    void RetireShared(vk::Semaphore timeline, u64 value, std::shared_ptr<const void> resource);
+
+    // Destroys the retired resources whose timeline values have been reached, without waiting.
+    // Returns how many there were.
+    std::size_t Collect();
+    // Waits for the values of the resources retired on the timeline semaphore and destroys them,
+    // before the semaphore is destroyed
+    void Release(vk::Semaphore timeline);
+    // Destroys everything retired, once the device is idle
+    void Clear();
+
+private:
+    struct Entry {
+        vk::Semaphore timeline;
+        u64 value{};
+        std::shared_ptr<const void> resource;
+    };
+
+    const VulkanDevice& device;
+    std::mutex mutex;
+    std::vector<Entry> entries;
+    // Of Collect, which destroys the resources outside of the lock of the entries, as their
+    // destructors may retire more. Kept to not allocate at every frame.
+    std::mutex collect_mutex;
+    std::vector<std::pair<vk::Semaphore, u64>> counter_values;
+    std::vector<Entry> collected;
+};
+
+} // namespace Renderer
@@ -0,0 +1,95 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include "common/temp_ptr.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_descriptor_heap.h"
+#include "core/vulkan/vulkan_device.h"
+
+namespace Renderer {
+
+static constexpr vk::BufferUsageFlags DescriptorBufferUsage =
+    vk::BufferUsageFlagBits::eSamplerDescriptorBufferEXT |
+    vk::BufferUsageFlagBits::eResourceDescriptorBufferEXT |
+    vk::BufferUsageFlagBits::eShaderDeviceAddress;
+
+VulkanDescriptorHeap::VulkanDescriptorHeap(const VulkanDevice& device_) : device(device_) {
+    const auto& properties = device.descriptor_buffer_properties;
+    const auto size = std::min({MaxSize, properties.maxSamplerDescriptorBufferRange,
+                                properties.maxResourceDescriptorBufferRange});
+
+    buffer = std::make_unique<VulkanBuffer>(
+        *device.allocator,
+        vk::BufferCreateInfo{
+            .size = size,
+            .usage = DescriptorBufferUsage,
+        },
+        VmaAllocationCreateInfo{
+            .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                     VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Other);
+    address = device->getBufferAddress({
+        .buffer = **buffer,
+    });
+
+    const auto result = vmaCreateVirtualBlock(TempPtr{VmaVirtualBlockCreateInfo{
+                                                  .size = size,
+                                              }},
+                                              &virtual_block);
+    if (result != VK_SUCCESS) {
+        vk::throwResultException(vk::Result{result}, "vmaCreateVirtualBlock");
+    }
+    SPDLOG_INFO("Created descriptor heap of {} bytes", size);
+}
+
+VulkanDescriptorHeap::~VulkanDescriptorHeap() {
+    vmaClearVirtualBlock(virtual_block);
+    vmaDestroyVirtualBlock(virtual_block);
+}
+
+VulkanDescriptorHeap::Range VulkanDescriptorHeap::Allocate(vk::DeviceSize size) {
+    const VmaVirtualAllocationCreateInfo create_info{
+        .size = std::max<vk::DeviceSize>(size, 1),
+        .alignment = device.descriptor_buffer_properties.descriptorBufferOffsetAlignment,
+    };
+
+    std::scoped_lock lock{mutex};
+    Range range;
+    const auto result =
+        vmaVirtualAllocate(virtual_block, &create_info, &range.allocation, &range.offset);
+    if (result != VK_SUCCESS) {
+        vk::throwResultException(vk::Result{result}, "vmaVirtualAllocate");
+    }
+    return range;
+}
+
+void VulkanDescriptorHeap::Free(const Range& range) noexcept {
+    std::scoped_lock lock{mutex};
+    vmaVirtualFree(virtual_block, range.allocation);
+}
+
+void VulkanDescriptorHeap::Write(vk::DeviceSize offset, std::span<const u8> data) {
+    std::memcpy(static_cast<u8*>(buffer->allocation_info.pMappedData) + offset, data.data(),
+                data.size());
+    const auto result = vmaFlushAllocation(buffer->allocator, buffer->allocation, offset,
+                                           data.size());
+    if (result != VK_SUCCESS) {
+        vk::throwResultException(vk::Result{result}, "vmaFlushAllocation");
+    }
+}
+
+void VulkanDescriptorHeap::Bind(const vk::raii::CommandBuffer& cmd) const {
+    cmd.bindDescriptorBuffersEXT({{
+        .address = address,
+        .usage = DescriptorBufferUsage,
+    }});
+}
+
+} // namespace Renderer
@@ -0,0 +1,55 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanDevice;
+
+/**
+ * The descriptor buffer (VK_EXT_descriptor_buffer) that the data of all descriptor sets is
+ * suballocated from using a VMA virtual block, so that a single buffer is bound for every
+ * pipeline. It is host visible and persistently mapped, and written directly by the host.
+ * Thread safe. Created by the device when descriptor buffers are enabled.
+ */
+class VulkanDescriptorHeap : NonCopyable {
+public:
+    // Capped by the ranges of sampler and resource descriptors the device can address
+    static constexpr vk::DeviceSize MaxSize = 16 * 1024 * 1024;
+
+    explicit VulkanDescriptorHeap(const VulkanDevice& device);
+    ~VulkanDescriptorHeap();
+
+    struct Range {
+        VmaVirtualAllocation allocation{};
+        vk::DeviceSize offset{};
+    };
+    // Aligned for set offsets. Throws if the heap is full.
+    Range Allocate(vk::DeviceSize size);
+    void Free(const Range& range) noexcept;
+
+    // The range must not be in use by the device
+    void Write(vk::DeviceSize offset, std::span<const u8> data);
+
+    void Bind(const vk::raii::CommandBuffer& cmd) const;
+
+private:
+    const VulkanDevice& device;
+    std::unique_ptr<VulkanBuffer> buffer;
+    vk::DeviceAddress address{};
+
+    std::mutex mutex;
+    VmaVirtualBlock virtual_block{};
+};
+
+} // namespace Renderer
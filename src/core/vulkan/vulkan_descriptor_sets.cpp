@@ -2,8 +2,14 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <map>
+#include <stdexcept>
+#include "common/assert.h"
 #include "common/ranges.h"
+#include "core/vulkan/vulkan_allocator.h"
 #include "core/vulkan/vulkan_descriptor_sets.h"
 #include "core/vulkan/vulkan_device.h"
 
@@ -26,9 +32,31 @@ VulkanDescriptorSets::VulkanDescriptorSets(const VulkanDevice& device_, std::siz
         });
     }
 
+    if (device.descriptor_buffer) {
+        CreateBufferSets();
+    } else {
+        CreateDescriptorPool();
+    }
+    for (u32 i = 0; i < bindings.size(); ++i) {
+        const auto& binding = *(bindings.begin() + i);
+        UpdateDescriptor(i, binding.value);
+    }
+}
+
+VulkanDescriptorSets::~VulkanDescriptorSets() {
+    for (const auto& set : buffer_sets) {
+        for (const auto& copy : set.copies) {
+            device.descriptor_heap->Free(copy.range);
+        }
+        device.descriptor_heap->Free(set.range);
+    }
+}
+
+void VulkanDescriptorSets::CreateDescriptorPool() {
     std::map<vk::DescriptorType, u32> descriptor_type_count;
-    for (const auto& binding : bindings) {
-        descriptor_type_count[binding.type] += static_cast<u32>(binding.array_size * count);
+    for (const auto& binding : binding_info) {
+        descriptor_type_count[binding.descriptorType] +=
+            static_cast<u32>(binding.descriptorCount * count);
     }
     descriptor_pool = vk::raii::DescriptorPool{
         *device,
@@ -65,17 +93,190 @@ VulkanDescriptorSets::VulkanDescriptorSets(const VulkanDevice& device_, std::siz
                                          })
                                          .at(0));
     }
-    for (u32 i = 0; i < bindings.size(); ++i) {
-        const auto& binding = *(bindings.begin() + i);
-        UpdateDescriptor(i, binding.value);
+}
+
+void VulkanDescriptorSets::CreateBufferSets() {
+    auto layout_bindings = binding_info;
+    for (auto& binding : layout_bindings) {
+        if (binding.descriptorType == vk::DescriptorType::eUniformBufferDynamic) {
+            ASSERT_MSG(binding.descriptorCount == 1,
+                       "Arrays of dynamic uniform buffers are not supported");
+            binding.descriptorType = vk::DescriptorType::eUniformBuffer;
+            dynamic_bindings.emplace_back(binding.binding);
+        }
+    }
+    descriptor_set_layout = vk::raii::DescriptorSetLayout{
+        *device,
+        {
+            .flags = vk::DescriptorSetLayoutCreateFlagBits::eDescriptorBufferEXT,
+            .bindingCount = static_cast<u32>(layout_bindings.size()),
+            .pBindings = layout_bindings.data(),
+        }};
+
+    const auto alignment = device.descriptor_buffer_properties.descriptorBufferOffsetAlignment;
+    set_size = (descriptor_set_layout.getSizeEXT() + alignment - 1) / alignment * alignment;
+    for (const auto& binding : layout_bindings) {
+        binding_offsets.emplace_back(descriptor_set_layout.getBindingOffsetEXT(binding.binding));
+    }
+
+    buffer_sets.resize(count);
+    for (auto& set : buffer_sets) {
+        set.range = device.descriptor_heap->Allocate(set_size);
+        set.data.resize(set_size);
+        set.dynamic_buffers.resize(dynamic_bindings.size());
+    }
+}
+
+std::size_t VulkanDescriptorSets::GetDescriptorSize(vk::DescriptorType type) const {
+    const auto& properties = device.descriptor_buffer_properties;
+    switch (type) {
+    case vk::DescriptorType::eUniformBuffer:
+    case vk::DescriptorType::eUniformBufferDynamic:
+        return properties.uniformBufferDescriptorSize;
+    case vk::DescriptorType::eStorageBuffer:
+        return properties.storageBufferDescriptorSize;
+    case vk::DescriptorType::eCombinedImageSampler:
+        return properties.combinedImageSamplerDescriptorSize;
+    case vk::DescriptorType::eStorageImage:
+        return properties.storageImageDescriptorSize;
+    case vk::DescriptorType::eAccelerationStructureKHR:
+        return properties.accelerationStructureDescriptorSize;
+    default:
+        UNREACHABLE_MSG("Unsupported descriptor type {}", vk::to_string(type));
     }
 }
 
-VulkanDescriptorSets::~VulkanDescriptorSets() = default;
+void VulkanDescriptorSets::WriteDescriptor(std::size_t set_idx, std::size_t binding_idx,
+                                           u32 array_element, const vk::DescriptorGetInfoEXT& info,
+                                           std::pair<std::size_t, std::size_t>& written) {
+    const auto& binding = binding_info[binding_idx];
+    const auto& properties = device.descriptor_buffer_properties;
+    std::vector<u8> descriptor(GetDescriptorSize(binding.descriptorType));
+    device->getDescriptorEXT(info, descriptor.size(), descriptor.data());
+
+    auto& data = buffer_sets[set_idx].data;
+    const auto Write = [&data, &written](std::size_t offset, std::span<const u8> bytes) {
+        std::memcpy(data.data() + offset, bytes.data(), bytes.size());
+        written.first = std::min(written.first, offset);
+        written.second = std::max(written.second, offset + bytes.size());
+    };
+    const auto offset = static_cast<std::size_t>(binding_offsets[binding_idx]);
+    if (binding.descriptorType == vk::DescriptorType::eCombinedImageSampler &&
+        !properties.combinedImageSamplerDescriptorSingleArray) {
+
+        // An array of the images, followed by an array of the samplers
+        const std::span bytes{descriptor};
+        const auto image_size = properties.sampledImageDescriptorSize;
+        const auto sampler_size = properties.samplerDescriptorSize;
+        Write(offset + array_element * image_size, bytes.first(image_size));
+        Write(offset + binding.descriptorCount * image_size + array_element * sampler_size,
+              bytes.subspan(image_size, sampler_size));
+    } else {
+        Write(offset + array_element * descriptor.size(), descriptor);
+    }
+}
+
+void VulkanDescriptorSets::FlushBufferSet(std::size_t set_idx,
+                                          std::pair<std::size_t, std::size_t> written) {
+    const auto& [begin, end] = written;
+    if (begin >= end) {
+        return;
+    }
+    const auto& set = buffer_sets[set_idx];
+    const std::span bytes{set.data.data() + begin, end - begin};
+    device.descriptor_heap->Write(set.range.offset + begin, bytes);
+    for (const auto& copy : set.copies) {
+        device.descriptor_heap->Write(copy.range.offset + begin, bytes);
+    }
+}
+
+void VulkanDescriptorSets::WriteDynamicBuffers(const BufferSet& set, const BufferSetCopy& copy) {
+    std::vector<u8> descriptor(GetDescriptorSize(vk::DescriptorType::eUniformBuffer));
+    for (std::size_t i = 0; i < dynamic_bindings.size(); ++i) {
+        auto address_info = set.dynamic_buffers[i];
+        address_info.address += copy.dynamic_offsets[i];
+        vk::DescriptorDataEXT data{};
+        data.pUniformBuffer = &address_info;
+        device->getDescriptorEXT(
+            {
+                .type = vk::DescriptorType::eUniformBuffer,
+                .data = data,
+            },
+            descriptor.size(), descriptor.data());
+        device.descriptor_heap->Write(copy.range.offset + binding_offsets[dynamic_bindings[i]],
+                                      descriptor);
+    }
+}
+
+vk::DeviceSize VulkanDescriptorSets::GetBufferSetOffset(std::size_t set_idx,
+                                                        std::span<const u32> dynamic_offsets) {
+    std::scoped_lock lock{buffer_sets_mutex};
+    auto& set = buffer_sets[set_idx];
+    if (dynamic_bindings.empty()) {
+        return set.range.offset;
+    }
+    const auto it = std::ranges::find_if(set.copies, [dynamic_offsets](const auto& copy) {
+        return std::ranges::equal(copy.dynamic_offsets, dynamic_offsets);
+    });
+    if (it != set.copies.end()) {
+        return it->range.offset;
+    }
+    if (set.copies.size() >= MaxDynamicCopies) {
+        throw std::runtime_error("Too many dynamic offsets for descriptor buffers");
+    }
+
+    // Written before it is bound, so that the set can be used in the same command buffer
+    auto& copy = set.copies.emplace_back(BufferSetCopy{
+        .dynamic_offsets = {dynamic_offsets.begin(), dynamic_offsets.end()},
+        .range = device.descriptor_heap->Allocate(set_size),
+    });
+    device.descriptor_heap->Write(copy.range.offset, set.data);
+    WriteDynamicBuffers(set, copy);
+    return copy.range.offset;
+}
+
+void VulkanDescriptorSets::Bind(const vk::raii::CommandBuffer& cmd,
+                                vk::PipelineBindPoint bind_point, vk::PipelineLayout layout,
+                                u32 first_set, std::initializer_list<Ref> sets,
+                                vk::ArrayProxy<const u32> dynamic_offsets) {
+    ASSERT(sets.size() > 0 && sets.size() <= MaxBoundSets);
+    const auto& device = sets.begin()->sets.device;
+    const auto num_sets = static_cast<u32>(sets.size());
+    if (!device.descriptor_buffer) {
+        std::array<vk::DescriptorSet, MaxBoundSets> handles;
+        std::ranges::transform(sets, handles.begin(), [](const Ref& ref) {
+            return ref.sets.descriptor_sets[ref.idx];
+        });
+        cmd.bindDescriptorSets(bind_point, layout, first_set, {num_sets, handles.data()},
+                               dynamic_offsets);
+        return;
+    }
+
+    std::array<vk::DeviceSize, MaxBoundSets> offsets;
+    std::size_t dynamic_idx = 0;
+    for (std::size_t i = 0; const auto& [ref_sets, idx] : sets) {
+        const auto num_dynamic = ref_sets.dynamic_bindings.size();
+        ASSERT(dynamic_idx + num_dynamic <= dynamic_offsets.size());
+        offsets[i++] = ref_sets.GetBufferSetOffset(
+            idx, {dynamic_offsets.data() + dynamic_idx, num_dynamic});
+        dynamic_idx += num_dynamic;
+    }
+    // All in the one descriptor buffer that is bound
+    static constexpr std::array<u32, MaxBoundSets> BufferIndices{};
+    device.descriptor_heap->Bind(cmd);
+    cmd.setDescriptorBufferOffsetsEXT(bind_point, layout, first_set,
+                                      {num_sets, BufferIndices.data()},
+                                      {num_sets, offsets.data()});
+}
 
 void VulkanDescriptorSets::UpdateDescriptor(
-    std::size_t binding_idx, const DescriptorBinding::DescriptorBindingValue& binding_value) {
+    std::size_t binding_idx, const DescriptorBinding::DescriptorBindingValue& binding_value,
+    u32 first_array_element) {
 
+    if (device.descriptor_buffer) {
+        UpdateBufferSets(binding_idx, binding_value, first_array_element);
+        return;
+    }
     if (const auto* values = std::get_if<DescriptorBinding::BuffersValue>(&binding_value)) {
         for (std::size_t i = 0; i < count; ++i) {
             const auto& value = values->size() > i ? *(values->begin() + i) : (*values->begin());
@@ -84,14 +285,15 @@ void VulkanDescriptorSets::UpdateDescriptor(
                 {{
                     .dstSet = descriptor_sets[i],
                     .dstBinding = static_cast<u32>(binding_idx),
+                    .dstArrayElement = first_array_element,
                     .descriptorCount = static_cast<u32>(buffers.size()),
                     .descriptorType = binding_info[binding_idx].descriptorType,
                     .pBufferInfo = Common::VectorFromRange(
-                                       buffers | std::views::transform([](vk::Buffer buffer) {
+                                       buffers | std::views::transform([&value](vk::Buffer buffer) {
                                            return vk::DescriptorBufferInfo{
                                                .buffer = buffer,
                                                .offset = 0,
-                                               .range = VK_WHOLE_SIZE,
+                                               .range = value.range,
                                            };
                                        }))
                                        .data(),
@@ -108,6 +310,7 @@ void VulkanDescriptorSets::UpdateDescriptor(
                 {{
                     .dstSet = descriptor_sets[i],
                     .dstBinding = static_cast<u32>(binding_idx),
+                    .dstArrayElement = first_array_element,
                     .descriptorCount = static_cast<u32>(images.size()),
                     .descriptorType = binding_info[binding_idx].descriptorType,
                     .pImageInfo = Common::VectorFromRange(
@@ -133,6 +336,7 @@ void VulkanDescriptorSets::UpdateDescriptor(
                     vk::WriteDescriptorSet{
                         .dstSet = descriptor_sets[i],
                         .dstBinding = static_cast<u32>(binding_idx),
+                        .dstArrayElement = first_array_element,
                         .descriptorCount = static_cast<u32>(accel_structures.size()),
                         .descriptorType = binding_info[binding_idx].descriptorType,
                     },
@@ -146,4 +350,99 @@ void VulkanDescriptorSets::UpdateDescriptor(
     }
 }
 
+void VulkanDescriptorSets::UpdateBufferSets(
+    std::size_t binding_idx, const DescriptorBinding::DescriptorBindingValue& binding_value,
+    u32 first_array_element) {
+
+    const auto type = binding_info[binding_idx].descriptorType;
+    const auto dynamic_it = std::ranges::find(dynamic_bindings, binding_idx);
+    const bool dynamic = dynamic_it != dynamic_bindings.end();
+
+    std::scoped_lock lock{buffer_sets_mutex};
+    for (std::size_t i = 0; i < count; ++i) {
+        auto& set = buffer_sets[i];
+        std::pair<std::size_t, std::size_t> written{set.data.size(), 0};
+        if (const auto* values = std::get_if<DescriptorBinding::BuffersValue>(&binding_value)) {
+            const auto& value = values->size() > i ? *(values->begin() + i) : (*values->begin());
+            for (u32 j = 0; j < value.buffers.size(); ++j) {
+                // Buffers are addressed by range, which cannot be the whole size here
+                vk::DescriptorAddressInfoEXT address_info{};
+                if (value.buffers[j]) {
+                    const auto buffer_range = device.allocator->GetBufferRange(value.buffers[j]);
+                    address_info.address = buffer_range.address;
+                    address_info.range =
+                        value.range == VK_WHOLE_SIZE ? buffer_range.size : value.range;
+                }
+                // Null descriptors have no address info
+                const auto* address_info_ptr = value.buffers[j] ? &address_info : nullptr;
+                vk::DescriptorDataEXT data{};
+                if (type == vk::DescriptorType::eStorageBuffer) {
+                    data.pStorageBuffer = address_info_ptr;
+                } else {
+                    data.pUniformBuffer = address_info_ptr;
+                }
+                WriteDescriptor(i, binding_idx, first_array_element + j,
+                                {
+                                    .type = dynamic ? vk::DescriptorType::eUniformBuffer : type,
+                                    .data = data,
+                                },
+                                written);
+                if (dynamic) {
+                    set.dynamic_buffers[dynamic_it - dynamic_bindings.begin()] = address_info;
+                }
+            }
+        }
+        if (const auto* values =
+                std::get_if<DescriptorBinding::CombinedImageSamplersValue>(&binding_value)) {
+            const auto& value = values->size() > i ? *(values->begin() + i) : (*values->begin());
+            for (u32 j = 0; j < value.images.size(); ++j) {
+                const auto& image = value.images[j];
+                const vk::DescriptorImageInfo image_info{
+                    .sampler = image.sampler ? image.sampler : *device.default_sampler,
+                    .imageView = image.image,
+                    .imageLayout = image.layout,
+                };
+                vk::DescriptorDataEXT data{};
+                if (type == vk::DescriptorType::eStorageImage) {
+                    data.pStorageImage = image.image ? &image_info : nullptr;
+                } else {
+                    data.pCombinedImageSampler = &image_info;
+                }
+                WriteDescriptor(i, binding_idx, first_array_element + j,
+                                {
+                                    .type = type,
+                                    .data = data,
+                                },
+                                written);
+            }
+        }
+        if (const auto* values =
+                std::get_if<DescriptorBinding::AccelStructuresValue>(&binding_value)) {
+            const auto& value = values->size() > i ? *(values->begin() + i) : (*values->begin());
+            for (u32 j = 0; j < value.accel_structures.size(); ++j) {
+                const auto accel_structure = value.accel_structures[j];
+                vk::DescriptorDataEXT data{};
+                if (accel_structure) {
+                    data.accelerationStructure = device->getAccelerationStructureAddressKHR({
+                        .accelerationStructure = accel_structure,
+                    });
+                }
+                WriteDescriptor(i, binding_idx, first_array_element + j,
+                                {
+                                    .type = type,
+                                    .data = data,
+                                },
+                                written);
+            }
+        }
+
+        FlushBufferSet(i, written);
+        if (dynamic) {
+            for (const auto& copy : set.copies) {
+                WriteDynamicBuffers(set, copy);
+            }
+        }
+    }
+}
+
 } // namespace Renderer
@@ -4,12 +4,16 @@
 
 #pragma once
 
+#include <initializer_list>
 #include <memory>
+#include <mutex>
+#include <span>
 #include <utility>
 #include <variant>
 #include <vector>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
+#include "core/vulkan/vulkan_descriptor_heap.h"
 #include "core/vulkan/vulkan_helpers.hpp"
 
 namespace Renderer {
@@ -30,6 +34,8 @@ struct DescriptorBinding {
     // This is to avoid the quirks of nested brace-init-lists
     struct Buffers {
         std::vector<vk::Buffer> buffers;
+        // Bytes read at each offset, which must be set for dynamic uniform buffers
+        vk::DeviceSize range = VK_WHOLE_SIZE;
     };
     struct CombinedImageSamplers {
         std::vector<CombinedImageSampler> images;
@@ -47,22 +53,77 @@ struct DescriptorBinding {
     DescriptorBindingValue value;
 };
 
-// A set layout, descriptor pool, and array of descriptor sets.
+// A set layout, and array of descriptor sets allocated from a descriptor pool. With descriptor
+// buffers enabled on the device, the sets are instead written into ranges of the descriptor heap,
+// and dynamic uniform buffers (which descriptor buffers do not have) are emulated with a copy of
+// the set for each combination of dynamic offsets it is bound with, see Bind.
 class VulkanDescriptorSets : NonCopyable {
 public:
+    // Copies of each set for dynamic offsets. Bind throws beyond this many.
+    static constexpr std::size_t MaxDynamicCopies = 64;
+
     explicit VulkanDescriptorSets(const VulkanDevice& device, std::size_t count,
                                   const vk::ArrayProxy<const DescriptorBinding>& bindings);
     ~VulkanDescriptorSets();
 
+    // Writes the value of every set, starting at the given element of the binding's array.
     void UpdateDescriptor(std::size_t binding_idx,
-                          const DescriptorBinding::DescriptorBindingValue& value);
+                          const DescriptorBinding::DescriptorBindingValue& value,
+                          u32 first_array_element = 0);
+
+    struct Ref {
+        VulkanDescriptorSets& sets;
+        std::size_t idx{};
+    };
+    // Sets bound by a single call of Bind, which does not allocate
+    static constexpr std::size_t MaxBoundSets = 8;
+
+    // Binds the sets to consecutive set numbers from first_set, like vkCmdBindDescriptorSets.
+    // The dynamic offsets are those of the dynamic uniform buffers of the sets, in order.
+    static void Bind(const vk::raii::CommandBuffer& cmd, vk::PipelineBindPoint bind_point,
+                     vk::PipelineLayout layout, u32 first_set, std::initializer_list<Ref> sets,
+                     vk::ArrayProxy<const u32> dynamic_offsets = {});
 
     const VulkanDevice& device;
     std::size_t count{};
     std::vector<vk::DescriptorSetLayoutBinding> binding_info;
-    vk::raii::DescriptorPool descriptor_pool = nullptr;
+    vk::raii::DescriptorPool descriptor_pool = nullptr; // Null with descriptor buffers
     vk::raii::DescriptorSetLayout descriptor_set_layout = nullptr;
-    std::vector<vk::DescriptorSet> descriptor_sets;
+    std::vector<vk::DescriptorSet> descriptor_sets; // Empty with descriptor buffers
+
+private:
+    struct BufferSetCopy {
+        std::vector<u32> dynamic_offsets;
+        VulkanDescriptorHeap::Range range;
+    };
+    struct BufferSet {
+        VulkanDescriptorHeap::Range range;
+        std::vector<u8> data; // Host copy, as the heap is only written
+        // Of the dynamic uniform buffers, in the order of dynamic_bindings
+        std::vector<vk::DescriptorAddressInfoEXT> dynamic_buffers;
+        std::vector<BufferSetCopy> copies;
+    };
+
+    void CreateDescriptorPool();
+    void CreateBufferSets();
+    void UpdateBufferSets(std::size_t binding_idx,
+                          const DescriptorBinding::DescriptorBindingValue& binding_value,
+                          u32 first_array_element);
+    std::size_t GetDescriptorSize(vk::DescriptorType type) const;
+    // Writes into the host copy of the set, and extends the byte range written
+    void WriteDescriptor(std::size_t set_idx, std::size_t binding_idx, u32 array_element,
+                         const vk::DescriptorGetInfoEXT& info,
+                         std::pair<std::size_t, std::size_t>& written);
+    // Writes the byte range of the host copy to the heap, for the set and its copies
+    void FlushBufferSet(std::size_t set_idx, std::pair<std::size_t, std::size_t> written);
+    void WriteDynamicBuffers(const BufferSet& set, const BufferSetCopy& copy);
+    vk::DeviceSize GetBufferSetOffset(std::size_t set_idx, std::span<const u32> dynamic_offsets);
+
+    vk::DeviceSize set_size{};
+    std::vector<vk::DeviceSize> binding_offsets;
+    std::vector<std::size_t> dynamic_bindings;
+    std::mutex buffer_sets_mutex; // Sets are bound while recording in parallel
+    std::vector<BufferSet> buffer_sets;
 };
 
 template <typename T>
@@ -2,47 +2,117 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <numeric>
+#include <random>
 #include <set>
+#include <span>
+#include <string>
+#include <system_error>
+#include <fmt/format.h>
 #include <spdlog/spdlog.h>
+#include "common/assert.h"
 #include "common/file_util.h"
 #include "common/ranges.h"
 #include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_deletion_queue.h"
+#include "core/vulkan/vulkan_descriptor_heap.h"
 #include "core/vulkan/vulkan_device.h"
 #include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_shader.h"
+#include "core/vulkan/vulkan_upload_ring.h"
 
 namespace Renderer {
 
+namespace {
+
+// Drivers are supposed to reject caches of other devices too, but not all of them do
+bool IsPipelineCacheOf(std::span<const u8> data, const vk::PhysicalDeviceProperties& properties) {
+    vk::PipelineCacheHeaderVersionOne header;
+    if (data.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    return header.headerSize >= sizeof(header) &&
+           header.headerVersion == vk::PipelineCacheHeaderVersion::eOne &&
+           header.vendorID == properties.vendorID && header.deviceID == properties.deviceID &&
+           header.pipelineCacheUUID == properties.pipelineCacheUUID;
+}
+
+// For exporting headless frames, see VulkanSwapchain. The Win32 names are spelled out, as their
+// header is only included with VK_USE_PLATFORM_WIN32_KHR.
+#ifdef _WIN32
+constexpr std::array ExternalFrameExtensions{
+    "VK_KHR_external_memory_win32",
+    "VK_KHR_external_semaphore_win32",
+};
+#else
+constexpr std::array ExternalFrameExtensions{
+    VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
+    VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
+};
+#endif
+
+constexpr std::array VideoEncodeExtensions{
+    VK_KHR_VIDEO_QUEUE_EXTENSION_NAME,
+    VK_KHR_VIDEO_ENCODE_QUEUE_EXTENSION_NAME,
+    VK_KHR_VIDEO_ENCODE_H264_EXTENSION_NAME,
+};
+
+} // namespace
+
 VulkanDevice::VulkanDevice(
     const vk::raii::Instance& instance, vk::SurfaceKHR surface_,
     const vk::ArrayProxy<const char* const>& extensions,
-    const Helpers::GenericStructureChain<vk::PhysicalDeviceFeatures2>& features)
-    : surface{instance, surface_} {
+    const Helpers::GenericStructureChain<vk::PhysicalDeviceFeatures2>& features,
+    std::optional<std::size_t> physical_device_index, bool descriptor_buffer_,
+    bool fragment_shading_rate_)
+    : descriptor_buffer_requested(descriptor_buffer_),
+      fragment_shading_rate_requested(fragment_shading_rate_) {
 
+    if (surface_) {
+        surface = vk::raii::SurfaceKHR{instance, surface_};
+    }
     startup_path = std::filesystem::current_path();
 
     vk::raii::PhysicalDevices physical_devices{instance};
-
-    // Prefer discrete GPUs
-    const auto result = std::ranges::find_if(
-        physical_devices, [this, &instance, &extensions, &features](vk::raii::PhysicalDevice& it) {
-            return it.getProperties().deviceType == vk::PhysicalDeviceType::eDiscreteGpu &&
-                   CreateDevice(instance, it, extensions, features);
-        });
-    if (result != physical_devices.end()) {
+    const auto profiles = GetDeviceProfiles(instance);
+    if (physical_device_index.has_value()) {
+        if (*physical_device_index >= physical_devices.size()) {
+            SPDLOG_ERROR("Physical device {} out of range ({} devices)", *physical_device_index,
+                         physical_devices.size());
+            throw std::runtime_error("Physical device out of range");
+        }
+        if (!CreateDevice(instance, physical_devices[*physical_device_index], extensions,
+                          features)) {
+            throw std::runtime_error("Failed to create device");
+        }
+        profile = profiles[*physical_device_index];
         return;
     }
 
-    // Try everything else
-    const auto result_2 = std::ranges::find_if(
-        physical_devices, [this, &instance, &extensions, &features](vk::raii::PhysicalDevice& it) {
-            return it.getProperties().deviceType != vk::PhysicalDeviceType::eDiscreteGpu &&
-                   CreateDevice(instance, it, extensions, features);
+    // Best scores first, those that lack what the renderer needs failing to be created
+    std::vector<std::size_t> order(physical_devices.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::stable_sort(order, std::greater{},
+                             [&profiles](std::size_t i) { return GetDeviceScore(profiles[i]); });
+    for (const std::size_t i : order) {
+        SPDLOG_DEBUG("Physical device {} ({}) scores {}", profiles[i].name,
+                     FormatDeviceUUID(profiles[i].uuid), GetDeviceScore(profiles[i]));
+    }
+    const auto result = std::ranges::find_if(
+        order, [this, &instance, &extensions, &features, &physical_devices](std::size_t i) {
+            return CreateDevice(instance, physical_devices[i], extensions, features);
         });
-    if (result_2 == physical_devices.end()) {
+    if (result == order.end()) {
         throw std::runtime_error("Failed to create any device");
     }
+    profile = profiles[*result];
 }
 
 bool VulkanDevice::CreateDevice(
@@ -54,16 +124,24 @@ bool VulkanDevice::CreateDevice(
     const std::string device_name = physical_device.getProperties().deviceName;
 
     const auto& queue_families = physical_device.getQueueFamilyProperties();
-    graphics_queue_family = *std::ranges::find_if(
-        std::ranges::iota_view<u32, u32>(0, static_cast<u32>(queue_families.size())),
-        [&queue_families](u32 i) {
-            // TODO: Support separate queues
-            return static_cast<bool>(queue_families[i].queueFlags & vk::QueueFlagBits::eGraphics) &&
-                   static_cast<bool>(queue_families[i].queueFlags & vk::QueueFlagBits::eCompute);
-        });
-    present_queue_family = *std::ranges::find_if(
-        std::ranges::iota_view<u32, u32>(0, static_cast<u32>(queue_families.size())),
-        [this](u32 i) { return physical_device.getSurfaceSupportKHR(i, *surface); });
+    const auto FindQueueFamily = [&queue_families](vk::QueueFlags required,
+                                                   vk::QueueFlags excluded) {
+        return *std::ranges::find_if(
+            std::ranges::iota_view<u32, u32>(0, static_cast<u32>(queue_families.size())),
+            [&queue_families, required, excluded](u32 i) {
+                return (queue_families[i].queueFlags & required) == required &&
+                       !(queue_families[i].queueFlags & excluded);
+            });
+    };
+    graphics_queue_family =
+        FindQueueFamily(vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute, {});
+    if (*surface) {
+        present_queue_family = *std::ranges::find_if(
+            std::ranges::iota_view<u32, u32>(0, static_cast<u32>(queue_families.size())),
+            [this](u32 i) { return physical_device.getSurfaceSupportKHR(i, *surface); });
+    } else { // Headless
+        present_queue_family = graphics_queue_family;
+    }
 
     if (graphics_queue_family == queue_families.size() ||
         present_queue_family == queue_families.size()) {
@@ -71,16 +149,287 @@ bool VulkanDevice::CreateDevice(
         return false;
     }
 
-    const std::set<u32> family_ids{graphics_queue_family, present_queue_family};
+    // Prefer families that do not share hardware queues with graphics
+    transfer_queue_family = FindQueueFamily(vk::QueueFlagBits::eTransfer,
+                                            vk::QueueFlagBits::eGraphics |
+                                                vk::QueueFlagBits::eCompute);
+    if (transfer_queue_family == queue_families.size()) {
+        transfer_queue_family = graphics_queue_family;
+    }
+    compute_queue_family =
+        FindQueueFamily(vk::QueueFlagBits::eCompute, vk::QueueFlagBits::eGraphics);
+    if (compute_queue_family == queue_families.size()) {
+        compute_queue_family = graphics_queue_family;
+    }
+    if (queue_families[compute_queue_family].timestampValidBits != 0) {
+        compute_timestamp_period = physical_device.getProperties().limits.timestampPeriod;
+    }
+
+    const auto supported_extensions = physical_device.enumerateDeviceExtensionProperties();
+    const auto IsSupported = [&supported_extensions](std::string_view name) {
+        return std::ranges::any_of(supported_extensions, [name](const auto& ext) {
+            return std::string_view{ext.extensionName} == name;
+        });
+    };
+    // For encoding headless frames, see VulkanVideoEncoder
+    video_encode = !*surface && std::ranges::all_of(VideoEncodeExtensions, IsSupported);
+    if (video_encode) {
+        const auto video_families =
+            physical_device.getQueueFamilyProperties2<vk::QueueFamilyProperties2,
+                                                      vk::QueueFamilyVideoPropertiesKHR>();
+        const auto it = std::ranges::find_if(video_families, [](const auto& family) {
+            return (family.template get<vk::QueueFamilyProperties2>()
+                        .queueFamilyProperties.queueFlags &
+                    vk::QueueFlagBits::eVideoEncodeKHR) &&
+                   (family.template get<vk::QueueFamilyVideoPropertiesKHR>()
+                        .videoCodecOperations &
+                    vk::VideoCodecOperationFlagBitsKHR::eEncodeH264);
+        });
+        video_encode = it != video_families.end();
+        if (video_encode) {
+            encode_queue_family = static_cast<u32>(it - video_families.begin());
+        }
+    }
+
+    std::set<u32> family_ids{graphics_queue_family, present_queue_family, transfer_queue_family,
+                             compute_queue_family};
+    if (video_encode) {
+        family_ids.insert(encode_queue_family);
+    }
     float priority = 1.0f;
 
-    const auto& extensions_raw = Common::VectorFromRange(
+    auto extensions_raw = Common::VectorFromRange(
         extensions | std::views::transform([](const std::string_view& str) { return str.data(); }));
+    if (*surface) {
+        extensions_raw.emplace_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
+    memory_budget = std::ranges::any_of(supported_extensions, [](const auto& extension) {
+        return std::string_view{extension.extensionName} == VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+    });
+    if (memory_budget) {
+        extensions_raw.emplace_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    }
+
+    // Without resizable BAR, only a small window (typically 256 MiB) of device local memory is
+    // host visible
+    const auto memory_properties = physical_device.getMemoryProperties();
+    const std::span heaps{memory_properties.memoryHeaps.data(), memory_properties.memoryHeapCount};
+    const std::span types{memory_properties.memoryTypes.data(), memory_properties.memoryTypeCount};
+    vk::DeviceSize device_local_size = 0;
+    for (const auto& heap : heaps) {
+        if (heap.flags & vk::MemoryHeapFlagBits::eDeviceLocal) {
+            device_local_size = std::max(device_local_size, heap.size);
+        }
+    }
+    static constexpr auto HostVisibleDeviceLocal =
+        vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible;
+    resizable_bar = std::ranges::any_of(types, [&heaps, device_local_size](const auto& type) {
+        return (type.propertyFlags & HostVisibleDeviceLocal) == HostVisibleDeviceLocal &&
+               heaps[type.heapIndex].size >= device_local_size;
+    });
+
+    // Compressed texture formats are enabled whenever available, for KTX2 and compressed images
+    auto device_features = static_cast<const vk::PhysicalDeviceFeatures2&>(features);
+    const auto supported_features = physical_device.getFeatures();
+    device_features.features.textureCompressionBC |= supported_features.textureCompressionBC;
+    device_features.features.textureCompressionETC2 |= supported_features.textureCompressionETC2;
+    device_features.features.textureCompressionASTC_LDR |=
+        supported_features.textureCompressionASTC_LDR;
+    // For texture streaming. Binds are submitted on the graphics queue.
+    sparse_residency = supported_features.sparseBinding &&
+                       supported_features.sparseResidencyImage2D &&
+                       (queue_families[graphics_queue_family].queueFlags &
+                        vk::QueueFlagBits::eSparseBinding);
+    device_features.features.sparseBinding |= sparse_residency;
+    device_features.features.sparseResidencyImage2D |= sparse_residency;
+    // And for geometry streaming
+    sparse_buffer_residency = supported_features.sparseBinding &&
+                              supported_features.sparseResidencyBuffer &&
+                              (queue_families[graphics_queue_family].queueFlags &
+                               vk::QueueFlagBits::eSparseBinding);
+    device_features.features.sparseBinding |= sparse_buffer_residency;
+    device_features.features.sparseResidencyBuffer |= sparse_buffer_residency;
+    pipeline_statistics = supported_features.pipelineStatisticsQuery;
+    device_features.features.pipelineStatisticsQuery |= pipeline_statistics;
+    storage_image_write_without_format = supported_features.shaderStorageImageWriteWithoutFormat;
+    device_features.features.shaderStorageImageWriteWithoutFormat |=
+        storage_image_write_without_format;
+    // Host builds of acceleration structures and shader execution reordering likewise, for
+    // renderers that use them at all
+    accel_structure_host_commands = false;
+    opacity_micromap = false;
+    invocation_reorder = false;
+    pipeline_library = false;
+    for (auto* next = static_cast<vk::BaseOutStructure*>(device_features.pNext); next;
+         next = next->pNext) {
+        if (next->sType == vk::StructureType::ePhysicalDeviceAccelerationStructureFeaturesKHR) {
+            auto& as_features =
+                *reinterpret_cast<vk::PhysicalDeviceAccelerationStructureFeaturesKHR*>(next);
+            accel_structure_host_commands =
+                physical_device
+                    .getFeatures2<vk::PhysicalDeviceFeatures2,
+                                  vk::PhysicalDeviceAccelerationStructureFeaturesKHR>()
+                    .get<vk::PhysicalDeviceAccelerationStructureFeaturesKHR>()
+                    .accelerationStructureHostCommands;
+            as_features.accelerationStructureHostCommands = accel_structure_host_commands;
+            opacity_micromap = std::ranges::any_of(supported_extensions, [](const auto& ext) {
+                return std::string_view{ext.extensionName} ==
+                       VK_EXT_OPACITY_MICROMAP_EXTENSION_NAME;
+            });
+        } else if (next->sType ==
+                   vk::StructureType::ePhysicalDeviceRayTracingPipelineFeaturesKHR) {
+            invocation_reorder = std::ranges::any_of(supported_extensions, [](const auto& ext) {
+                return std::string_view{ext.extensionName} ==
+                       VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME;
+            });
+            pipeline_library = std::ranges::any_of(supported_extensions, [](const auto& ext) {
+                return std::string_view{ext.extensionName} ==
+                       VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME;
+            });
+        }
+    }
+    vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV reorder_features{
+        .pNext = device_features.pNext,
+        .rayTracingInvocationReorder = VK_TRUE,
+    };
+    if (invocation_reorder) {
+        invocation_reorder =
+            physical_device
+                .getFeatures2<vk::PhysicalDeviceFeatures2,
+                              vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV>()
+                .get<vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV>()
+                .rayTracingInvocationReorder;
+    }
+    if (invocation_reorder) {
+        extensions_raw.emplace_back(VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME);
+        device_features.pNext = &reorder_features;
+    }
+    if (pipeline_library) {
+        extensions_raw.emplace_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+    }
+    vk::PhysicalDeviceOpacityMicromapFeaturesEXT micromap_features{
+        .pNext = device_features.pNext,
+        .micromap = VK_TRUE,
+    };
+    if (opacity_micromap) {
+        opacity_micromap =
+            physical_device
+                .getFeatures2<vk::PhysicalDeviceFeatures2,
+                              vk::PhysicalDeviceOpacityMicromapFeaturesEXT>()
+                .get<vk::PhysicalDeviceOpacityMicromapFeaturesEXT>()
+                .micromap;
+    }
+    if (opacity_micromap) {
+        extensions_raw.emplace_back(VK_EXT_OPACITY_MICROMAP_EXTENSION_NAME);
+        device_features.pNext = &micromap_features;
+        max_opacity_micromap_level =
+            physical_device
+                .getProperties2<vk::PhysicalDeviceProperties2,
+                                vk::PhysicalDeviceOpacityMicromapPropertiesEXT>()
+                .get<vk::PhysicalDeviceOpacityMicromapPropertiesEXT>()
+                .maxOpacity4StateSubdivisionLevel;
+    }
+    // For the swapchain, to pace presentation
+    present_wait = *surface && IsSupported(VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+                   IsSupported(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+    if (present_wait) {
+        const auto present_features =
+            physical_device.getFeatures2<vk::PhysicalDeviceFeatures2,
+                                         vk::PhysicalDevicePresentIdFeaturesKHR,
+                                         vk::PhysicalDevicePresentWaitFeaturesKHR>();
+        present_wait = present_features.get<vk::PhysicalDevicePresentIdFeaturesKHR>().presentId &&
+                       present_features.get<vk::PhysicalDevicePresentWaitFeaturesKHR>().presentWait;
+    }
+    vk::PhysicalDevicePresentIdFeaturesKHR present_id_features{
+        .pNext = device_features.pNext,
+        .presentId = VK_TRUE,
+    };
+    vk::PhysicalDevicePresentWaitFeaturesKHR present_wait_features{
+        .pNext = &present_id_features,
+        .presentWait = VK_TRUE,
+    };
+    if (present_wait) {
+        extensions_raw.emplace_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+        extensions_raw.emplace_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+        device_features.pNext = &present_wait_features;
+    }
+    image_compression_control =
+        IsSupported(VK_EXT_IMAGE_COMPRESSION_CONTROL_EXTENSION_NAME) &&
+        physical_device
+            .getFeatures2<vk::PhysicalDeviceFeatures2,
+                          vk::PhysicalDeviceImageCompressionControlFeaturesEXT>()
+            .get<vk::PhysicalDeviceImageCompressionControlFeaturesEXT>()
+            .imageCompressionControl;
+    vk::PhysicalDeviceImageCompressionControlFeaturesEXT compression_control_features{
+        .pNext = device_features.pNext,
+        .imageCompressionControl = VK_TRUE,
+    };
+    if (image_compression_control) {
+        extensions_raw.emplace_back(VK_EXT_IMAGE_COMPRESSION_CONTROL_EXTENSION_NAME);
+        device_features.pNext = &compression_control_features;
+    }
+    descriptor_buffer = descriptor_buffer_requested &&
+                        IsSupported(VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME) &&
+                        physical_device
+                            .getFeatures2<vk::PhysicalDeviceFeatures2,
+                                          vk::PhysicalDeviceDescriptorBufferFeaturesEXT>()
+                            .get<vk::PhysicalDeviceDescriptorBufferFeaturesEXT>()
+                            .descriptorBuffer;
+    vk::PhysicalDeviceDescriptorBufferFeaturesEXT descriptor_buffer_features{
+        .pNext = device_features.pNext,
+        .descriptorBuffer = VK_TRUE,
+    };
+    if (descriptor_buffer) {
+        extensions_raw.emplace_back(VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME);
+        device_features.pNext = &descriptor_buffer_features;
+        descriptor_buffer_properties =
+            physical_device
+                .getProperties2<vk::PhysicalDeviceProperties2,
+                                vk::PhysicalDeviceDescriptorBufferPropertiesEXT>()
+                .get<vk::PhysicalDeviceDescriptorBufferPropertiesEXT>();
+    }
+    fragment_shading_rate =
+        fragment_shading_rate_requested && IsSupported(VK_KHR_FRAGMENT_SHADING_RATE_EXTENSION_NAME);
+    primitive_shading_rate = false;
+    if (fragment_shading_rate) {
+        const auto shading_rate_features =
+            physical_device
+                .getFeatures2<vk::PhysicalDeviceFeatures2,
+                              vk::PhysicalDeviceFragmentShadingRateFeaturesKHR>()
+                .get<vk::PhysicalDeviceFragmentShadingRateFeaturesKHR>();
+        // Pipeline shading rates are always supported with the extension
+        fragment_shading_rate = shading_rate_features.attachmentFragmentShadingRate;
+        primitive_shading_rate = shading_rate_features.primitiveFragmentShadingRate;
+    }
+    vk::PhysicalDeviceFragmentShadingRateFeaturesKHR shading_rate_features{
+        .pNext = device_features.pNext,
+        .pipelineFragmentShadingRate = VK_TRUE,
+        .primitiveFragmentShadingRate = primitive_shading_rate ? VK_TRUE : VK_FALSE,
+        .attachmentFragmentShadingRate = VK_TRUE,
+    };
+    if (fragment_shading_rate) {
+        extensions_raw.emplace_back(VK_KHR_FRAGMENT_SHADING_RATE_EXTENSION_NAME);
+        device_features.pNext = &shading_rate_features;
+        fragment_shading_rate_properties =
+            physical_device
+                .getProperties2<vk::PhysicalDeviceProperties2,
+                                vk::PhysicalDeviceFragmentShadingRatePropertiesKHR>()
+                .get<vk::PhysicalDeviceFragmentShadingRatePropertiesKHR>();
+    }
+    external_frames = !*surface && std::ranges::all_of(ExternalFrameExtensions, IsSupported);
+    if (external_frames) {
+        extensions_raw.insert(extensions_raw.end(), ExternalFrameExtensions.begin(),
+                              ExternalFrameExtensions.end());
+    }
+    if (video_encode) {
+        extensions_raw.insert(extensions_raw.end(), VideoEncodeExtensions.begin(),
+                              VideoEncodeExtensions.end());
+    }
     try {
         device = vk::raii::Device{
             physical_device,
             {
-                .pNext = features,
+                .pNext = &device_features,
                 .queueCreateInfoCount = static_cast<u32>(family_ids.size()),
                 .pQueueCreateInfos =
                     Common::VectorFromRange(family_ids |
@@ -100,10 +449,70 @@ bool VulkanDevice::CreateDevice(
         return false;
     }
 
-    queue_family_indices.assign(family_ids.begin(), family_ids.end());
+    const std::set<u32> present_family_ids{graphics_queue_family, present_queue_family};
+    queue_family_indices.assign(present_family_ids.begin(), present_family_ids.end());
     graphics_queue = device.getQueue(graphics_queue_family, 0);
-    present_queue = device.getQueue(present_queue_family, 0);
+    if (*surface) {
+        present_queue = device.getQueue(present_queue_family, 0);
+    }
+    transfer_queue = device.getQueue(transfer_queue_family, 0);
+    compute_queue = device.getQueue(compute_queue_family, 0);
+    if (video_encode) {
+        encode_queue = device.getQueue(encode_queue_family, 0);
+    }
+    for (const auto* queue :
+         {&graphics_queue, &present_queue, &transfer_queue, &compute_queue, &encode_queue}) {
+        if (**queue && std::ranges::find(queue_mutexes, **queue,
+                                         &decltype(queue_mutexes)::value_type::first) ==
+                           queue_mutexes.end()) {
+            queue_mutexes.emplace_back(**queue, std::make_unique<std::mutex>());
+        }
+    }
     SPDLOG_INFO("Selected physical device {}", device_name);
+    SPDLOG_INFO("Queue families: graphics {}, transfer {}, compute {}", graphics_queue_family,
+                transfer_queue_family, compute_queue_family);
+    if (resizable_bar) {
+        SPDLOG_INFO("Device local memory is host visible, writing uploads directly");
+    }
+    if (accel_structure_host_commands) {
+        SPDLOG_INFO("Acceleration structures can be built on the host");
+    }
+    if (opacity_micromap) {
+        SPDLOG_INFO("Alpha tested geometry can use opacity micromaps");
+    }
+    if (invocation_reorder) {
+        SPDLOG_INFO("Ray tracing shader invocations can be reordered");
+    }
+    if (pipeline_library) {
+        SPDLOG_INFO("Ray tracing pipelines can be linked from libraries");
+    }
+    if (present_wait) {
+        SPDLOG_INFO("Presents can be waited for");
+    }
+    if (image_compression_control) {
+        SPDLOG_INFO("Compression of render targets can be controlled");
+    }
+    if (external_frames) {
+        SPDLOG_INFO("Headless frames can be exported to other processes");
+    }
+    if (video_encode) {
+        SPDLOG_INFO("Headless frames can be encoded on queue family {}", encode_queue_family);
+    }
+    if (descriptor_buffer) {
+        SPDLOG_INFO("Descriptors are written into descriptor buffers");
+    } else if (descriptor_buffer_requested) {
+        SPDLOG_WARN("Descriptor buffers are not supported, falling back to descriptor pools");
+    }
+    if (fragment_shading_rate) {
+        SPDLOG_INFO("Fragments can be shaded at variable rates{}",
+                    primitive_shading_rate ? ", per primitive too" : "");
+    } else if (fragment_shading_rate_requested) {
+        SPDLOG_WARN("Attachment fragment shading rates are not supported, shading at full rate");
+    }
+
+    const std::set<u32> shared_family_ids{graphics_queue_family, transfer_queue_family,
+                                          compute_queue_family};
+    shared_queue_families.assign(shared_family_ids.begin(), shared_family_ids.end());
 
     command_pool =
         vk::raii::CommandPool{device,
@@ -113,6 +522,12 @@ bool VulkanDevice::CreateDevice(
                               }};
 
     allocator = std::make_unique<VulkanAllocator>(instance, *this);
+    deletion_queue = std::make_unique<VulkanDeletionQueue>(*this);
+    upload_ring = std::make_unique<VulkanUploadRing>(*this);
+    if (descriptor_buffer) {
+        descriptor_heap = std::make_unique<VulkanDescriptorHeap>(*this);
+    }
+    shader_cache = std::make_unique<VulkanShaderCache>(device);
 
     default_sampler = vk::raii::Sampler{
         device, vk::SamplerCreateInfo{
@@ -125,33 +540,153 @@ bool VulkanDevice::CreateDevice(
                     .anisotropyEnable = VK_TRUE,
                     .maxAnisotropy = physical_device.getProperties().limits.maxSamplerAnisotropy,
                     .minLod = 0.0f,
-                    .maxLod = 0.0f,
+                    .maxLod = VK_LOD_CLAMP_NONE,
                     .borderColor = vk::BorderColor::eIntOpaqueBlack,
                 }};
 
-    const auto& data = Common::ReadFileContents(PipelineCachePath);
-    pipeline_cache = vk::raii::PipelineCache{
-        device,
-        {
-            .flags = vk::PipelineCacheCreateFlagBits::eExternallySynchronized,
-            .initialDataSize = data.size(),
-            .pInitialData = data.data(),
-        }};
+    const auto& data = ReadPipelineCache();
+    pipeline_cache = vk::raii::PipelineCache{device,
+                                             {
+                                                 .initialDataSize = data.size(),
+                                                 .pInitialData = data.data(),
+                                             }};
     return true;
 }
 
+std::filesystem::path VulkanDevice::GetPipelineCachePath() const {
+    const auto properties = physical_device.getProperties();
+    std::string uuid;
+    for (const u8 byte : properties.pipelineCacheUUID) {
+        uuid += fmt::format("{:02x}", byte);
+    }
+    return startup_path / PipelineCacheFolder /
+           std::filesystem::u8path(fmt::format("{:04x}_{:04x}_{:08x}_{}.bin", properties.vendorID,
+                                               properties.deviceID, properties.driverVersion,
+                                               uuid));
+}
+
+std::vector<u8> VulkanDevice::ReadPipelineCache() const {
+    const auto path = GetPipelineCachePath();
+    if (!std::filesystem::exists(path)) {
+        return {};
+    }
+    auto data = Common::ReadFileContents(path);
+    if (!IsPipelineCacheOf(data, physical_device.getProperties())) {
+        SPDLOG_WARN("Ignoring invalid pipeline cache {}", path.string());
+        return {};
+    }
+    return data;
+}
+
+void VulkanDevice::SavePipelineCache() const {
+    // Keeps the pipelines of the instances that saved since this one loaded the cache
+    const auto& saved = ReadPipelineCache();
+    if (!saved.empty()) {
+        const vk::raii::PipelineCache saved_cache{device,
+                                                  {
+                                                      .initialDataSize = saved.size(),
+                                                      .pInitialData = saved.data(),
+                                                  }};
+        pipeline_cache.merge(*saved_cache);
+    }
+    const auto& data = pipeline_cache.getData();
+
+    const auto path = GetPipelineCachePath();
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+
+    // Write to a temporary file first, so that instances saving at the same time never leave
+    // a mix of their caches behind
+    auto temp_path = path;
+    temp_path += fmt::format(".{:08x}.tmp", std::random_device{}());
+    {
+        std::ofstream out_file{temp_path, std::ios::binary};
+        out_file.write(reinterpret_cast<const char*>(data.data()),
+                       static_cast<std::streamsize>(data.size()));
+        if (!out_file) {
+            SPDLOG_WARN("Failed to write pipeline cache {}", path.string());
+            out_file.close();
+            std::filesystem::remove(temp_path, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temp_path, path, error);
+    if (error) {
+        SPDLOG_WARN("Failed to write pipeline cache {}: {}", path.string(), error.message());
+        std::filesystem::remove(temp_path, error);
+    }
+}
+
 VulkanDevice::~VulkanDevice() {
     if (!*device) {
         return;
     }
 
-    device.waitIdle();
+    WaitIdle();
+    if (deletion_queue) {
+        deletion_queue->Clear();
+    }
+    SavePipelineCache();
+}
 
-    // Save pipeline cache
-    const auto& data = pipeline_cache.getData();
+std::mutex& VulkanDevice::GetQueueMutex(const vk::raii::Queue& queue) const {
+    const auto it = std::ranges::find(queue_mutexes, *queue,
+                                      &decltype(queue_mutexes)::value_type::first);
+    ASSERT_MSG(it != queue_mutexes.end(), "Queue is not of this device");
+    return *it->second;
+}
+
+void VulkanDevice::Submit(const vk::raii::Queue& queue,
+                          vk::ArrayProxy<const vk::SubmitInfo> submits, vk::Fence fence) const {
+    std::scoped_lock lock{GetQueueMutex(queue)};
+    queue.submit(submits, fence);
+}
+
+void VulkanDevice::Submit2(const vk::raii::Queue& queue,
+                           vk::ArrayProxy<const vk::SubmitInfo2> submits, vk::Fence fence) const {
+    std::scoped_lock lock{GetQueueMutex(queue)};
+    queue.submit2(submits, fence);
+}
+
+void VulkanDevice::BindSparse(const vk::raii::Queue& queue,
+                              vk::ArrayProxy<const vk::BindSparseInfo> bind_infos,
+                              vk::Fence fence) const {
+    std::scoped_lock lock{GetQueueMutex(queue)};
+    queue.bindSparse(bind_infos, fence);
+}
+
+vk::Result VulkanDevice::Present(const vk::PresentInfoKHR& present_info) const {
+    std::scoped_lock lock{GetQueueMutex(present_queue)};
+    return present_queue.presentKHR(present_info);
+}
+
+void VulkanDevice::WaitQueueIdle(const vk::raii::Queue& queue) const {
+    std::scoped_lock lock{GetQueueMutex(queue)};
+    queue.waitIdle();
+}
+
+void VulkanDevice::WaitIdle() const {
+    // Always locked in the same order, so that this cannot deadlock another WaitIdle
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (const auto& [queue, mutex] : queue_mutexes) {
+        locks.emplace_back(*mutex);
+    }
+    device.waitIdle();
+}
 
-    std::ofstream out_file(startup_path / PipelineCachePath, std::ios::binary);
-    out_file.write(reinterpret_cast<const char*>(data.data()), data.size());
+vk::CommandPool VulkanDevice::GetThreadCommandPool(u32 queue_family) const {
+    std::scoped_lock lock{thread_command_pools_mutex};
+    const auto [it, inserted] = thread_command_pools.try_emplace(
+        std::pair{std::this_thread::get_id(), queue_family}, nullptr);
+    if (inserted) {
+        it->second = vk::raii::CommandPool{
+            device,
+            {
+                .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+                .queueFamilyIndex = queue_family,
+            }};
+    }
+    return *it->second;
 }
 
 } // namespace Renderer
@@ -5,15 +5,25 @@
 #pragma once
 
 #include <filesystem>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string_view>
+#include <thread>
 #include <utility>
+#include <vector>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
+#include "core/vulkan/vulkan_device_profile.h"
 
 namespace Renderer {
 
 class VulkanAllocator;
+class VulkanDeletionQueue;
+class VulkanDescriptorHeap;
+class VulkanShaderCache;
+class VulkanUploadRing;
 
 namespace Helpers {
 template <typename T>
@@ -22,10 +32,19 @@ struct GenericStructureChain;
 
 class VulkanDevice : NonCopyable {
 public:
+    // Without a surface (headless rendering), there is no present queue. The swapchain
+    // extension is enabled when there is a surface.
+    // If physical_device_index is set, only that device (in enumeration order) is used, e.g. to
+    // drive several GPUs with a device each. Otherwise the devices are tried from the best
+    // score down, see GetDeviceScore.
+    // If descriptor_buffer is set, VK_EXT_descriptor_buffer is used where supported, and if
+    // fragment_shading_rate is set, VK_KHR_fragment_shading_rate likewise.
     explicit VulkanDevice(
         const vk::raii::Instance& instance, vk::SurfaceKHR surface,
         const vk::ArrayProxy<const char* const>& extensions,
-        const Helpers::GenericStructureChain<vk::PhysicalDeviceFeatures2>& features);
+        const Helpers::GenericStructureChain<vk::PhysicalDeviceFeatures2>& features,
+        std::optional<std::size_t> physical_device_index = std::nullopt,
+        bool descriptor_buffer = false, bool fragment_shading_rate = false);
     ~VulkanDevice();
 
     vk::raii::Device& operator*() noexcept {
@@ -43,28 +62,143 @@ public:
 
     vk::raii::SurfaceKHR surface = nullptr;
     vk::raii::PhysicalDevice physical_device = nullptr;
+    // What the physical device supports, whether or not the renderer enabled it
+    DeviceProfile profile;
     vk::raii::Device device = nullptr;
 
     vk::raii::Queue graphics_queue = nullptr;
     u32 graphics_queue_family = 0;
-    vk::raii::Queue present_queue = nullptr;
-    u32 present_queue_family = 0;
+    vk::raii::Queue present_queue = nullptr; // Null if headless
+    u32 present_queue_family = 0;            // The graphics family if headless
     std::vector<u32> queue_family_indices;
 
+    // Dedicated transfer and async compute queues. These fall back to the graphics queue
+    // family when the device does not expose separate ones.
+    vk::raii::Queue transfer_queue = nullptr;
+    u32 transfer_queue_family = 0;
+    vk::raii::Queue compute_queue = nullptr;
+    u32 compute_queue_family = 0;
+    // Of H.264 encoding, null unless video_encode
+    vk::raii::Queue encode_queue = nullptr;
+    u32 encode_queue_family = 0;
+    // Nanoseconds per timestamp tick on the compute queue, 0 if it has no timestamps
+    float compute_timestamp_period = 0;
+    // Unique graphics, compute and transfer families, for resources shared between queues
+    std::vector<u32> shared_queue_families;
+
+    // Of the thread that renders. Command buffers recorded on other threads come from
+    // GetThreadCommandPool instead.
     vk::raii::CommandPool command_pool = nullptr;
     std::unique_ptr<VulkanAllocator> allocator;
+    // Of resources of any renderer or loader on the device, emptied once the device is idle
+    std::unique_ptr<VulkanDeletionQueue> deletion_queue;
+    std::unique_ptr<VulkanUploadRing> upload_ring;
+    std::unique_ptr<VulkanDescriptorHeap> descriptor_heap; // Null without descriptor buffers
     vk::raii::Sampler default_sampler = nullptr;
+    std::unique_ptr<VulkanShaderCache> shader_cache;
+    // Whether sparse binding and sparse residency of 2D images are enabled
+    bool sparse_residency{};
+    // Whether sparse binding and sparse residency of buffers are enabled
+    bool sparse_buffer_residency{};
+    // Whether all of device local memory can be mapped (resizable BAR or unified memory), so
+    // that uploads are better written directly than staged
+    bool resizable_bar{};
+    // Whether VK_EXT_memory_budget is enabled, for the allocator to track the heap budgets
+    bool memory_budget{};
+    // Whether acceleration structures can be built on the host (accelerationStructureHostCommands).
+    // Enabled whenever supported, if the features request acceleration structures.
+    bool accel_structure_host_commands{};
+    // Whether VK_EXT_opacity_micromap is enabled, for alpha tested geometry to skip most of its
+    // any-hit invocations. Enabled whenever supported, if the features request acceleration
+    // structures.
+    bool opacity_micromap{};
+    u32 max_opacity_micromap_level{}; // Of 4-state micromaps
+    // Whether VK_NV_ray_tracing_invocation_reorder is enabled, for shader execution reordering.
+    // Enabled whenever supported, if the features request the ray tracing pipeline.
+    bool invocation_reorder{};
+    // Whether VK_KHR_pipeline_library is enabled, for linking ray tracing pipelines from
+    // libraries of their shaders. Enabled whenever supported, if the features request the ray
+    // tracing pipeline.
+    bool pipeline_library{};
+    // Whether pipeline statistics queries are enabled, for profiling. Enabled whenever supported.
+    bool pipeline_statistics{};
+    // Whether storage images can be written without a format
+    // (shaderStorageImageWriteWithoutFormat), for postprocessing into swapchain images. Enabled
+    // whenever supported.
+    bool storage_image_write_without_format{};
+    // Whether VK_EXT_image_compression_control is enabled, for render targets to request fixed
+    // rate compression and query how they are compressed. Enabled whenever supported.
+    bool image_compression_control{};
+    // Whether VK_KHR_present_id and VK_KHR_present_wait are enabled, for pacing frames by when
+    // they are displayed. Enabled whenever supported, if there is a surface.
+    bool present_wait{};
+    // Whether the external memory and semaphore extensions of the platform (fd or Win32) are
+    // enabled, for exporting headless frames to other processes. Enabled whenever supported, if
+    // there is no surface.
+    bool external_frames{};
+    // Whether VK_KHR_video_encode_queue and VK_KHR_video_encode_h264 are enabled, with a queue
+    // family that encodes H.264, for encoding headless frames. Enabled whenever supported, if
+    // there is no surface.
+    bool video_encode{};
+    // Whether VK_EXT_descriptor_buffer is enabled, for VulkanDescriptorSets to write descriptors
+    // into a buffer instead of allocating sets from pools. Enabled if requested and supported.
+    bool descriptor_buffer{};
+    vk::PhysicalDeviceDescriptorBufferPropertiesEXT descriptor_buffer_properties;
+    // Whether VK_KHR_fragment_shading_rate is enabled with pipeline and attachment shading
+    // rates, for variable rate shading. Enabled if requested and supported.
+    bool fragment_shading_rate{};
+    // Whether primitive shading rates are enabled too, with fragment_shading_rate if supported
+    bool primitive_shading_rate{};
+    vk::PhysicalDeviceFragmentShadingRatePropertiesKHR fragment_shading_rate_properties;
 
     // For writing files to the correct place even when current path has changed
     std::filesystem::path startup_path;
 
-    static constexpr std::u8string_view PipelineCachePath{u8"cache.bin"};
+    // One file per vendor, device, driver version and pipelineCacheUUID of the physical device
+    // in this folder of the startup path, so that caches of other GPUs and drivers are kept
+    // rather than overwritten. Thread safe. Saved when the device is destroyed, merged with the
+    // one another instance may have saved meanwhile, and replaced atomically.
+    static constexpr std::u8string_view PipelineCacheFolder{u8"pipeline_cache"};
     vk::raii::PipelineCache pipeline_cache = nullptr;
 
+    // Queues must be externally synchronized, and the queues above may be one and the same.
+    // These submit to (or bind sparse memory on, present with, wait for) the queue while holding
+    // its lock, so that any thread may, e.g. loading threads while the render thread draws.
+    void Submit(const vk::raii::Queue& queue, vk::ArrayProxy<const vk::SubmitInfo> submits,
+                vk::Fence fence = {}) const;
+    void Submit2(const vk::raii::Queue& queue, vk::ArrayProxy<const vk::SubmitInfo2> submits,
+                 vk::Fence fence = {}) const;
+    void BindSparse(const vk::raii::Queue& queue,
+                    vk::ArrayProxy<const vk::BindSparseInfo> bind_infos,
+                    vk::Fence fence = {}) const;
+    vk::Result Present(const vk::PresentInfoKHR& present_info) const;
+    void WaitQueueIdle(const vk::raii::Queue& queue) const;
+    // Waits for the whole device, holding the locks of all queues
+    void WaitIdle() const;
+
+    // Command pool of the calling thread for the queue family, created on first use, as pools
+    // must be externally synchronized too. Command buffers allocated from it must be recorded
+    // on that thread, and freed there or while it does not use the pool. Thread safe.
+    vk::CommandPool GetThreadCommandPool(u32 queue_family) const;
+
 private:
+    bool descriptor_buffer_requested{};
+    bool fragment_shading_rate_requested{};
+
+    std::mutex& GetQueueMutex(const vk::raii::Queue& queue) const;
+    // By queue, of each distinct queue
+    std::vector<std::pair<vk::Queue, std::unique_ptr<std::mutex>>> queue_mutexes;
+
+    mutable std::mutex thread_command_pools_mutex;
+    mutable std::map<std::pair<std::thread::id, u32>, vk::raii::CommandPool> thread_command_pools;
+
     bool CreateDevice(const vk::raii::Instance& instance, vk::raii::PhysicalDevice& physical_device,
                       const vk::ArrayProxy<const char* const>& extensions,
                       const Helpers::GenericStructureChain<vk::PhysicalDeviceFeatures2>& features);
+    std::filesystem::path GetPipelineCachePath() const;
+    // Empty if there is no valid pipeline cache of the physical device
+    std::vector<u8> ReadPipelineCache() const;
+    void SavePipelineCache() const;
 };
 
 } // namespace Renderer
@@ -0,0 +1,176 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <fmt/format.h>
+#include "core/vulkan/vulkan_device_profile.h"
+
+namespace Renderer {
+
+std::vector<DeviceProfile> GetDeviceProfiles(const vk::raii::Instance& instance) {
+    std::vector<DeviceProfile> profiles;
+    vk::raii::PhysicalDevices physical_devices{instance};
+    for (std::size_t i = 0; i < physical_devices.size(); ++i) {
+        const auto& physical_device = physical_devices[i];
+        const auto properties =
+            physical_device
+                .getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>();
+        const auto& device_properties =
+            properties.get<vk::PhysicalDeviceProperties2>().properties;
+
+        auto& profile = profiles.emplace_back();
+        profile.index = i;
+        profile.name = device_properties.deviceName.data();
+        profile.uuid = properties.get<vk::PhysicalDeviceIDProperties>().deviceUUID;
+        profile.type = device_properties.deviceType;
+        const auto memory_properties = physical_device.getMemoryProperties();
+        for (u32 j = 0; j < memory_properties.memoryHeapCount; ++j) {
+            const auto& heap = memory_properties.memoryHeaps[j];
+            if (heap.flags & vk::MemoryHeapFlagBits::eDeviceLocal) {
+                profile.device_local_memory = std::max(profile.device_local_memory, heap.size);
+            }
+        }
+
+        // Feature structures are only queried for the extensions that are there
+        const auto supported_extensions = physical_device.enumerateDeviceExtensionProperties();
+        const auto IsSupported = [&supported_extensions](std::string_view name) {
+            return std::ranges::any_of(supported_extensions, [name](const auto& ext) {
+                return std::string_view{ext.extensionName} == name;
+            });
+        };
+        const bool acceleration_structure =
+            IsSupported(VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) &&
+            physical_device
+                .getFeatures2<vk::PhysicalDeviceFeatures2,
+                              vk::PhysicalDeviceAccelerationStructureFeaturesKHR>()
+                .get<vk::PhysicalDeviceAccelerationStructureFeaturesKHR>()
+                .accelerationStructure;
+        profile.ray_tracing_pipeline =
+            acceleration_structure && IsSupported(VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME) &&
+            physical_device
+                .getFeatures2<vk::PhysicalDeviceFeatures2,
+                              vk::PhysicalDeviceRayTracingPipelineFeaturesKHR>()
+                .get<vk::PhysicalDeviceRayTracingPipelineFeaturesKHR>()
+                .rayTracingPipeline;
+        profile.ray_query =
+            acceleration_structure && IsSupported(VK_KHR_RAY_QUERY_EXTENSION_NAME) &&
+            physical_device
+                .getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceRayQueryFeaturesKHR>()
+                .get<vk::PhysicalDeviceRayQueryFeaturesKHR>()
+                .rayQuery;
+        profile.invocation_reorder =
+            profile.ray_tracing_pipeline &&
+            IsSupported(VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME) &&
+            physical_device
+                .getFeatures2<vk::PhysicalDeviceFeatures2,
+                              vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV>()
+                .get<vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV>()
+                .rayTracingInvocationReorder;
+        if (IsSupported(VK_EXT_MESH_SHADER_EXTENSION_NAME)) {
+            const auto mesh_features =
+                physical_device
+                    .getFeatures2<vk::PhysicalDeviceFeatures2,
+                                  vk::PhysicalDeviceMeshShaderFeaturesEXT>()
+                    .get<vk::PhysicalDeviceMeshShaderFeaturesEXT>();
+            profile.mesh_shader = mesh_features.taskShader && mesh_features.meshShader;
+        }
+        profile.opacity_micromap =
+            acceleration_structure && IsSupported(VK_EXT_OPACITY_MICROMAP_EXTENSION_NAME) &&
+            physical_device
+                .getFeatures2<vk::PhysicalDeviceFeatures2,
+                              vk::PhysicalDeviceOpacityMicromapFeaturesEXT>()
+                .get<vk::PhysicalDeviceOpacityMicromapFeaturesEXT>()
+                .micromap;
+    }
+    return profiles;
+}
+
+u32 GetDeviceScore(const DeviceProfile& profile) {
+    // The type outweighs everything else, so that a hybrid laptop takes its discrete GPU even
+    // where the integrated one traces rays too
+    u32 score = 0;
+    switch (profile.type) {
+    case vk::PhysicalDeviceType::eDiscreteGpu:
+        score += 10000;
+        break;
+    case vk::PhysicalDeviceType::eIntegratedGpu:
+        score += 5000;
+        break;
+    case vk::PhysicalDeviceType::eVirtualGpu:
+        score += 2000;
+        break;
+    default: // CPU (software) and others
+        break;
+    }
+    score += profile.ray_tracing_pipeline ? 1000 : 0;
+    score += profile.ray_query ? 800 : 0;
+    score += profile.invocation_reorder ? 400 : 0;
+    score += profile.mesh_shader ? 400 : 0;
+    score += profile.opacity_micromap ? 200 : 0;
+    // 10 per GiB, up to 64 GiB (unified memory reports about all of system memory)
+    static constexpr vk::DeviceSize GiB = 1024 * 1024 * 1024;
+    score += static_cast<u32>(std::min<vk::DeviceSize>(profile.device_local_memory / GiB, 64)) *
+             10;
+    return score;
+}
+
+std::size_t GetBestDevice(std::span<const DeviceProfile> profiles) {
+    // The first enumerated of equal scores
+    const auto it = std::ranges::max_element(profiles, [](const auto& lhs, const auto& rhs) {
+        return GetDeviceScore(lhs) < GetDeviceScore(rhs) ||
+               (GetDeviceScore(lhs) == GetDeviceScore(rhs) && lhs.index > rhs.index);
+    });
+    return it == profiles.end() ? 0 : it->index;
+}
+
+std::string FormatDeviceUUID(const std::array<u8, VK_UUID_SIZE>& uuid) {
+    std::string out;
+    for (std::size_t i = 0; i < uuid.size(); ++i) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            out.push_back('-');
+        }
+        out += fmt::format("{:02x}", uuid[i]);
+    }
+    return out;
+}
+
+const DeviceProfile* FindDevice(std::span<const DeviceProfile> profiles, std::string_view id) {
+    std::size_t index{};
+    const auto [end, error] = std::from_chars(id.data(), id.data() + id.size(), index);
+    if (error == std::errc{} && end == id.data() + id.size()) {
+        return index < profiles.size() ? &profiles[index] : nullptr;
+    }
+
+    std::string digits;
+    for (const char c : id) {
+        if (c != '-') {
+            digits.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(c))));
+        }
+    }
+    const auto it = std::ranges::find_if(profiles, [&digits](const DeviceProfile& profile) {
+        std::string uuid = FormatDeviceUUID(profile.uuid);
+        std::erase(uuid, '-');
+        return uuid == digits;
+    });
+    return it == profiles.end() ? nullptr : &*it;
+}
+
+PathTracerBackend PickPathTracer(const DeviceProfile& profile) {
+    // Without reordering, the divergent shading of the megakernel is slower than sorting it
+    // between the passes of the wavefront path tracer
+    if (profile.ray_tracing_pipeline && profile.invocation_reorder) {
+        return PathTracerBackend::HW;
+    }
+    if (profile.ray_query) {
+        return PathTracerBackend::Wavefront;
+    }
+    if (profile.ray_tracing_pipeline) {
+        return PathTracerBackend::HW;
+    }
+    return PathTracerBackend::Compute;
+}
+
+} // namespace Renderer
@@ -0,0 +1,61 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+/**
+ * What a physical device supports of the paths that the backends choose between, probed
+ * without creating a device, so that the fastest backend it runs can be picked up front (see
+ * PickPathTracer) and VulkanDevice tries the best devices first (see GetDeviceScore).
+ */
+struct DeviceProfile {
+    std::size_t index{}; // In enumeration order
+    std::string name;
+    std::array<u8, VK_UUID_SIZE> uuid{}; // deviceUUID, stable across runs and processes
+    vk::PhysicalDeviceType type{};
+    vk::DeviceSize device_local_memory{}; // Of the largest device local heap
+    bool ray_tracing_pipeline{};
+    bool ray_query{};
+    bool invocation_reorder{}; // VK_NV_ray_tracing_invocation_reorder
+    bool mesh_shader{};        // VK_EXT_mesh_shader, with task shaders
+    bool opacity_micromap{};
+};
+
+// Of every physical device of the instance, in enumeration order
+std::vector<DeviceProfile> GetDeviceProfiles(const vk::raii::Instance& instance);
+
+// Higher for the faster device: discrete GPUs first, then ray tracing and the other paths the
+// backends can take, then device local memory
+u32 GetDeviceScore(const DeviceProfile& profile);
+
+// Index of the device of the best score, or 0 if there are none
+std::size_t GetBestDevice(std::span<const DeviceProfile> profiles);
+
+// As 32 hex digits, dashed like 8-4-4-4-12
+std::string FormatDeviceUUID(const std::array<u8, VK_UUID_SIZE>& uuid);
+
+// The device by index (in enumeration order) or by UUID (hex digits, dashes ignored). Null if
+// none matches.
+const DeviceProfile* FindDevice(std::span<const DeviceProfile> profiles, std::string_view id);
+
+// The path tracers, fastest first where the device supports them all
+enum class PathTracerBackend {
+    HW,        // Ray tracing pipeline with invocation reordering (megakernel)
+    Wavefront, // Ray queries, with shading sorted between passes
+    Compute,   // No ray tracing hardware at all
+};
+PathTracerBackend PickPathTracer(const DeviceProfile& profile);
+
+} // namespace Renderer
@@ -0,0 +1,72 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_frame_allocator.h"
+
+namespace Renderer {
+
+VulkanFrameAllocator::VulkanFrameAllocator(const VulkanDevice& device, std::size_t num_frames,
+                                           std::size_t frame_size_)
+    : alignment(static_cast<std::size_t>(
+          device.physical_device.getProperties().limits.minUniformBufferOffsetAlignment)) {
+
+    frame_size = Common::AlignUp(std::max<std::size_t>(frame_size_, 1), alignment);
+    buffer = std::make_unique<VulkanBuffer>(
+        *device.allocator,
+        vk::BufferCreateInfo{
+            .size = frame_size * num_frames,
+            .usage = vk::BufferUsageFlagBits::eUniformBuffer,
+        },
+        VmaAllocationCreateInfo{
+            .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                     VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Other);
+}
+
+VulkanFrameAllocator::~VulkanFrameAllocator() = default;
+
+std::size_t VulkanFrameAllocator::GetAllocationSize(const VulkanDevice& device,
+                                                    std::size_t size) {
+    return Common::AlignUp(
+        size, static_cast<std::size_t>(
+                  device.physical_device.getProperties().limits.minUniformBufferOffsetAlignment));
+}
+
+void VulkanFrameAllocator::BeginFrame(std::size_t frame_idx) {
+    frame_begin = pos = frame_idx * frame_size;
+}
+
+VulkanFrameAllocator::Allocation VulkanFrameAllocator::Allocate(std::size_t size) {
+    if (pos + size > frame_begin + frame_size) {
+        SPDLOG_ERROR("Frame allocator exhausted (frame size {}, requested {})", frame_size, size);
+        throw std::runtime_error("Frame allocator exhausted");
+    }
+    const Allocation allocation{
+        .data = static_cast<u8*>(buffer->allocation_info.pMappedData) + pos,
+        .offset = static_cast<u32>(pos),
+    };
+    pos = Common::AlignUp(pos + size, alignment);
+    return allocation;
+}
+
+void VulkanFrameAllocator::EndFrame() const {
+    // No-op for coherent memory
+    if (pos != frame_begin) {
+        vmaFlushAllocation(buffer->allocator, buffer->allocation, frame_begin, pos - frame_begin);
+    }
+}
+
+vk::Buffer VulkanFrameAllocator::GetBuffer() const noexcept {
+    return **buffer;
+}
+
+} // namespace Renderer
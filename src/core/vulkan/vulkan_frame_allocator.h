@@ -0,0 +1,68 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <vulkan/vulkan.hpp>
+#include "common/common_types.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanDevice;
+
+/**
+ * Linear allocator for data that changes every frame, like per draw constants. Allocations come
+ * from a persistently mapped uniform buffer with a region per frame in flight, and are read by
+ * dynamic uniform buffer descriptors (see DescriptorBinding::Buffers::range) at their offset.
+ *
+ * Unlike push constants, this is not limited to 128 bytes on many devices. The writes of a
+ * frame are flushed once, and allocations are only valid until their region is reused.
+ */
+class VulkanFrameAllocator : NonCopyable {
+public:
+    explicit VulkanFrameAllocator(const VulkanDevice& device, std::size_t num_frames,
+                                  std::size_t frame_size);
+    ~VulkanFrameAllocator();
+
+    // Space taken in a frame by an allocation of size bytes
+    static std::size_t GetAllocationSize(const VulkanDevice& device, std::size_t size);
+
+    struct Allocation {
+        u8* data{};
+        u32 offset{}; // Dynamic offset into the buffer
+    };
+
+    // Starts allocating from the region of the frame, whose previous submission must have
+    // completed.
+    void BeginFrame(std::size_t frame_idx);
+    // Throws if the region of the frame is exhausted.
+    Allocation Allocate(std::size_t size);
+    // Flushes the writes of the frame. Must be called before the frame is submitted.
+    void EndFrame() const;
+
+    // Returns the dynamic offset
+    template <typename T>
+    u32 Push(const T& value) {
+        static_assert(Helpers::VerifyLayoutStd140<T>());
+        const auto allocation = Allocate(sizeof(T));
+        std::memcpy(allocation.data, &value, sizeof(T));
+        return allocation.offset;
+    }
+
+    vk::Buffer GetBuffer() const noexcept;
+
+private:
+    std::unique_ptr<VulkanBuffer> buffer;
+    std::size_t alignment{};
+    std::size_t frame_size{};
+
+    std::size_t frame_begin{};
+    std::size_t pos{};
+};
+
+} // namespace Renderer
@@ -5,10 +5,16 @@
 #pragma once
 
 #include <array>
+#include <limits>
 #include <memory>
+#include <span>
+#include <stdexcept>
 #include <utility>
+#include <vector>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
+#include "common/temp_ptr.h"
+#include "core/vulkan/vulkan_deletion_queue.h"
 #include "core/vulkan/vulkan_device.h"
 #include "core/vulkan/vulkan_helpers.hpp"
 
@@ -18,18 +24,24 @@ template <typename ExtraData>
 struct FrameInFlight : NonCopyable {
     std::size_t idx{};
     vk::raii::CommandBuffer command_buffer = nullptr;
+    // Signalled by the submission of the frame if it is presented
     vk::raii::Semaphore render_finished_semaphore = nullptr;
-    vk::raii::Fence in_flight_fence = nullptr;
+    // Of the timeline semaphore, signalled once the last submission of the frame has completed
+    u64 timeline_value{};
     ExtraData extras;
 };
 
 /**
- * Base class for a pipeline. Handles descriptors, push constants, frames in flight, etc.
+ * A ring of frames in flight, each with a command buffer and the data derived classes keep per
+ * frame. A single timeline semaphore tracks them instead of a fence per frame: the last
+ * submission of each frame signals the next value, which is waited for on the host once the ring
+ * comes around to the frame again. Resources the frames use are retired on it with Retire.
  */
-template <typename ExtraData, std::size_t NumFramesInFlight>
+template <typename ExtraData>
 class VulkanFramesInFlight : NonCopyable {
 public:
-    explicit VulkanFramesInFlight(const VulkanDevice& device_) : device(device_) {
+    explicit VulkanFramesInFlight(const VulkanDevice& device_, std::size_t num_frames)
+        : device(device_), frames_in_flight(num_frames) {
         // Command buffers
         vk::raii::CommandBuffers command_buffers{
             *device,
@@ -47,24 +59,28 @@ public:
         for (auto& frame : frames_in_flight) {
             frame.render_finished_semaphore =
                 vk::raii::Semaphore{*device, vk::SemaphoreCreateInfo{}};
-            frame.in_flight_fence = vk::raii::Fence{*device,
-                                                    {
-                                                        .flags = vk::FenceCreateFlagBits::eSignaled,
-                                                    }};
         }
+        timeline_semaphore = vk::raii::Semaphore{
+            *device, vk::StructureChain{
+                         vk::SemaphoreCreateInfo{},
+                         vk::SemaphoreTypeCreateInfo{
+                             .semaphoreType = vk::SemaphoreType::eTimeline,
+                             .initialValue = 0,
+                         },
+                     }
+                         .get()};
     }
 
-    ~VulkanFramesInFlight() = default;
+    // What was retired on the timeline semaphore is destroyed with it
+    ~VulkanFramesInFlight() {
+        device.deletion_queue->Release(*timeline_semaphore);
+    }
 
     FrameInFlight<ExtraData>& AcquireNextFrame() {
         current_frame = (current_frame + 1) % frames_in_flight.size();
 
         auto& frame = frames_in_flight[current_frame];
-        if (device->waitForFences({*frame.in_flight_fence}, VK_TRUE,
-                                  std::numeric_limits<u64>::max()) != vk::Result::eSuccess) {
-
-            throw std::runtime_error("Failed to wait for fences");
-        }
+        Wait(frame.timeline_value);
         frame.command_buffer.reset();
         return frame;
     }
@@ -77,12 +93,67 @@ public:
     void EndFrame() const {
         const auto& frame = frames_in_flight[current_frame];
         frame.command_buffer.end();
-        device->resetFences({*frame.in_flight_fence});
+    }
+
+    // The last submission of the current frame, on the graphics queue. It signals the next value
+    // of the timeline semaphore, and the render finished semaphore of the frame if it is to be
+    // presented.
+    void Submit(vk::CommandBuffer command_buffer,
+                std::span<const vk::SemaphoreSubmitInfo> wait_semaphores, bool present = true) {
+        auto& frame = frames_in_flight[current_frame];
+        frame.timeline_value = ++timeline_value;
+        const std::array<vk::SemaphoreSubmitInfo, 2> signal_semaphores{{
+            {
+                .semaphore = *timeline_semaphore,
+                .value = frame.timeline_value,
+                .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            },
+            {
+                .semaphore = *frame.render_finished_semaphore,
+                .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            },
+        }};
+        device.Submit2(device.graphics_queue, {{
+            .waitSemaphoreInfoCount = static_cast<u32>(wait_semaphores.size()),
+            .pWaitSemaphoreInfos = wait_semaphores.data(),
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = TempArr<vk::CommandBufferSubmitInfo>{{
+                .commandBuffer = command_buffer,
+            }},
+            .signalSemaphoreInfoCount = present ? 2u : 1u,
+            .pSignalSemaphoreInfos = signal_semaphores.data(),
+        }});
+    }
+
+    // Destroys the resource once the frames submitted so far have completed, e.g. a pipeline
+    // swapped for another that later frames use
+    template <typename T>
+    void Retire(T resource) const {
+        device.deletion_queue->Retire(*timeline_semaphore, timeline_value, std::move(resource));
     }
 
     const VulkanDevice& device;
-    std::array<FrameInFlight<ExtraData>, NumFramesInFlight> frames_in_flight;
+    std::vector<FrameInFlight<ExtraData>> frames_in_flight;
+    vk::raii::Semaphore timeline_semaphore = nullptr;
+    u64 timeline_value{}; // Of the last submission
     std::size_t current_frame = 0;
+
+private:
+    void Wait(u64 value) const {
+        if (value == 0) {
+            return;
+        }
+        if (device->waitSemaphores(
+                {
+                    .semaphoreCount = 1,
+                    .pSemaphores = &*timeline_semaphore,
+                    .pValues = &value,
+                },
+                std::numeric_limits<u64>::max()) != vk::Result::eSuccess) {
+
+            throw std::runtime_error("Failed to wait for semaphores");
+        }
+    }
 };
 
 } // namespace Renderer
@@ -0,0 +1,218 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <utility>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/assert.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_geometry_heap.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+
+namespace Renderer {
+
+VulkanGeometryBuffer::VulkanGeometryBuffer(VulkanGeometryHeap& heap_,
+                                           const VulkanBuffer* block_buffer_,
+                                           VmaVirtualBlock virtual_block_,
+                                           VmaVirtualAllocation allocation_)
+    : heap(heap_), block_buffer(block_buffer_), virtual_block(virtual_block_),
+      allocation(allocation_) {}
+
+VulkanGeometryBuffer::~VulkanGeometryBuffer() {
+    heap.Free(virtual_block, allocation);
+}
+
+VulkanGeometryHeap::VulkanGeometryHeap(VulkanDevice& device_, vk::BufferUsageFlags usage_,
+                                       vk::PipelineStageFlags2 dst_stage_mask_,
+                                       vk::AccessFlags2 dst_access_mask_,
+                                       vk::DeviceSize block_size_,
+                                       std::shared_ptr<const SceneCache> cache_)
+    : device(device_), usage(usage_), dst_stage_mask(dst_stage_mask_),
+      dst_access_mask(dst_access_mask_), block_size(block_size_), cache(std::move(cache_)) {
+
+    if (cache) {
+        ASSERT_MSG(device.sparse_buffer_residency, "Streaming requires sparse buffers");
+        const auto create_info = GetBlockCreateInfo(block_size);
+        sparse_requirements =
+            device->getBufferMemoryRequirements({.pCreateInfo = &create_info}).memoryRequirements;
+    }
+}
+
+VulkanGeometryHeap::~VulkanGeometryHeap() {
+    for (auto& block : blocks) {
+        vmaClearVirtualBlock(block->virtual_block);
+        vmaDestroyVirtualBlock(block->virtual_block);
+    }
+}
+
+std::shared_ptr<VulkanGeometryBuffer> VulkanGeometryHeap::Upload(
+    std::size_t size, const std::function<void(void*, std::size_t)>& read_func) {
+
+    auto buffer = Allocate(size);
+    if (cache) {
+        std::vector<u8> data(size);
+        read_func(data.data(), size);
+        const std::span<const u8> span{data};
+        SetSource(*buffer, span, std::move(data));
+        return buffer;
+    }
+    Helpers::ReadAndUploadBuffer(device, *buffer->block_buffer, buffer->offset, size,
+                                 dst_stage_mask, dst_access_mask, read_func);
+    return buffer;
+}
+
+std::shared_ptr<VulkanGeometryBuffer> VulkanGeometryHeap::Upload(std::span<const u8> data) {
+    if (cache) {
+        auto buffer = Allocate(data.size());
+        SetSource(*buffer, data);
+        return buffer;
+    }
+    std::size_t pos = 0;
+    return Upload(data.size(), [data, &pos](void* out, std::size_t read_size) {
+        std::memcpy(out, data.data() + pos, read_size);
+        pos += read_size;
+    });
+}
+
+std::shared_ptr<VulkanGeometryBuffer> VulkanGeometryHeap::Copy(const VulkanBuffer& src_buffer,
+                                                               vk::DeviceSize src_offset,
+                                                               std::size_t size) {
+    if (cache) {
+        // Staging buffers are mapped, so they are read on the host instead
+        ASSERT_MSG(src_buffer.IsMapped(), "Source buffer is not mapped");
+        return Upload(
+            {static_cast<const u8*>(src_buffer.allocation_info.pMappedData) + src_offset, size});
+    }
+    auto buffer = Allocate(size);
+    Helpers::CopyFromStagingBuffer(device, src_buffer, src_offset, *buffer->block_buffer,
+                                   buffer->offset, size, dst_stage_mask, dst_access_mask);
+    return buffer;
+}
+
+std::size_t VulkanGeometryHeap::GetNumBlocks() const {
+    std::scoped_lock lock{mutex};
+    return blocks.size();
+}
+
+std::shared_ptr<VulkanGeometryBuffer> VulkanGeometryHeap::Allocate(std::size_t size) {
+    const vk::DeviceSize alignment = cache ? sparse_requirements.alignment : Alignment;
+    const VmaVirtualAllocationCreateInfo create_info{
+        .size = Common::AlignUp(std::max<vk::DeviceSize>(size, 1), alignment),
+        .alignment = alignment,
+    };
+
+    std::scoped_lock lock{mutex};
+    VmaVirtualAllocation allocation{};
+    VkDeviceSize offset{};
+    auto* block = [&]() -> Block* {
+        for (auto& it : blocks) {
+            if (vmaVirtualAllocate(it->virtual_block, &create_info, &allocation, &offset) ==
+                VK_SUCCESS) {
+                return it.get();
+            }
+        }
+        // Larger allocations get a block of their own
+        auto& new_block = CreateBlock(std::max(block_size, create_info.size));
+        const auto result =
+            vmaVirtualAllocate(new_block.virtual_block, &create_info, &allocation, &offset);
+        if (result != VK_SUCCESS) {
+            vk::throwResultException(vk::Result{result}, "vmaVirtualAllocate");
+        }
+        return &new_block;
+    }();
+
+    auto buffer = std::shared_ptr<VulkanGeometryBuffer>(
+        new VulkanGeometryBuffer(*this, block->buffer.get(), block->virtual_block, allocation));
+    buffer->buffer = block->buffer ? vk::Buffer{**block->buffer} : *block->sparse_buffer;
+    buffer->offset = offset;
+    buffer->size = size;
+    buffer->address = block->address ? block->address + offset : 0;
+    return buffer;
+}
+
+vk::BufferCreateInfo VulkanGeometryHeap::GetBlockCreateInfo(vk::DeviceSize size) const {
+    // Blocks are written by the transfer queue while other ranges are in use on the others,
+    // so they cannot have a single owner
+    vk::BufferCreateInfo buffer_create_info{
+        .size = size,
+        .usage = usage | vk::BufferUsageFlagBits::eTransferDst,
+    };
+    if (cache) {
+        buffer_create_info.flags =
+            vk::BufferCreateFlagBits::eSparseBinding | vk::BufferCreateFlagBits::eSparseResidency;
+    }
+    if (device.shared_queue_families.size() > 1) {
+        buffer_create_info.sharingMode = vk::SharingMode::eConcurrent;
+        buffer_create_info.setQueueFamilyIndices(device.shared_queue_families);
+    }
+    return buffer_create_info;
+}
+
+VulkanGeometryHeap::Block& VulkanGeometryHeap::CreateBlock(vk::DeviceSize size) {
+    const auto buffer_create_info = GetBlockCreateInfo(size);
+
+    auto block = std::make_unique<Block>();
+    if (cache) {
+        block->sparse_buffer = vk::raii::Buffer{*device, buffer_create_info};
+    } else {
+        block->buffer = std::make_unique<VulkanBuffer>(
+            *device.allocator, buffer_create_info,
+            VmaAllocationCreateInfo{
+                .flags = VulkanBuffer::DirectUploadFlags,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Geometry);
+    }
+    const auto result = vmaCreateVirtualBlock(TempPtr{VmaVirtualBlockCreateInfo{
+                                                  .size = size,
+                                              }},
+                                              &block->virtual_block);
+    if (result != VK_SUCCESS) {
+        vk::throwResultException(vk::Result{result}, "vmaCreateVirtualBlock");
+    }
+    if (usage & vk::BufferUsageFlagBits::eShaderDeviceAddress) {
+        block->address = device->getBufferAddress({
+            .buffer = block->buffer ? vk::Buffer{**block->buffer} : *block->sparse_buffer,
+        });
+    }
+
+    SPDLOG_INFO("Created {}geometry heap block of {} bytes", cache ? "sparse " : "", size);
+    return *blocks.emplace_back(std::move(block));
+}
+
+void VulkanGeometryHeap::Free(VmaVirtualBlock virtual_block, VmaVirtualAllocation allocation) {
+    std::scoped_lock lock{mutex};
+    vmaVirtualFree(virtual_block, allocation);
+}
+
+void VulkanGeometryHeap::SetSource(VulkanGeometryBuffer& buffer, std::span<const u8> data,
+                                   std::vector<u8> owned) const {
+    // Content addressed like the rest of the cache, so the entries of an earlier load are reused
+    const auto key = SceneCache::Hasher{"streamed_geometry"}.Add(data).Get();
+    auto entry = cache->Load(key);
+    if (!entry) {
+        const std::array sections{data};
+        cache->Store(key, sections);
+        entry = cache->Load(key);
+    }
+    if (entry && entry->GetNumSections() == 1 && entry->GetSection(0).size() == data.size()) {
+        buffer.source = entry->GetSection(0);
+        buffer.source_entry = std::move(entry);
+        return;
+    }
+
+    SPDLOG_WARN("Could not cache streamed geometry, keeping it in host memory");
+    if (owned.empty()) {
+        owned.assign(data.begin(), data.end());
+    }
+    buffer.source_data = std::move(owned);
+    buffer.source = buffer.source_data;
+}
+
+} // namespace Renderer
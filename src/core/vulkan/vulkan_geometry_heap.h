@@ -0,0 +1,145 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+#include "core/scene_cache.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanDevice;
+class VulkanGeometryHeap;
+
+/**
+ * A range of a geometry heap block. The range is returned to the heap on destruction.
+ */
+class VulkanGeometryBuffer : NonCopyable {
+public:
+    ~VulkanGeometryBuffer();
+
+    vk::Buffer operator*() const noexcept {
+        return buffer;
+    }
+
+    vk::Buffer buffer; // The whole heap block
+    vk::DeviceSize offset{};
+    vk::DeviceSize size{};
+    vk::DeviceAddress address{}; // Of the start of the range, if the heap has device addresses
+
+    // Of streaming heaps, whose ranges are only backed by memory while VulkanGeometryStreamer
+    // keeps them resident: the contents, mapped from the scene cache
+    std::span<const u8> source;
+
+    const VulkanGeometryHeap& GetHeap() const noexcept {
+        return heap;
+    }
+
+private:
+    friend class VulkanGeometryHeap;
+    explicit VulkanGeometryBuffer(VulkanGeometryHeap& heap_, const VulkanBuffer* block_buffer_,
+                                  VmaVirtualBlock virtual_block_,
+                                  VmaVirtualAllocation allocation_);
+
+    VulkanGeometryHeap& heap;
+    const VulkanBuffer* block_buffer{}; // Null for the sparse blocks of streaming heaps
+    VmaVirtualBlock virtual_block{};
+    VmaVirtualAllocation allocation{};
+    std::unique_ptr<SceneCache::Entry> source_entry;
+    std::vector<u8> source_data; // Instead, if the contents could not be cached
+};
+
+/**
+ * A few large device local buffers that vertex or index data is suballocated from using
+ * VMA virtual blocks, instead of having one VkBuffer (and allocation) per glTF chunk.
+ *
+ * Streaming heaps, for scenes whose geometry does not fit in device memory, have sparse blocks
+ * instead that only reserve addresses: uploads are written to the scene cache, and memory is
+ * bound to the ranges that are resident by VulkanGeometryStreamer. Ranges keep their offsets
+ * and addresses whether or not they are resident, so nothing that refers to them changes.
+ *
+ * Thread safe. Must outlive all buffers allocated from it.
+ */
+class VulkanGeometryHeap : NonCopyable {
+public:
+    static constexpr vk::DeviceSize DefaultBlockSize = 64 * 1024 * 1024;
+    // Enough for any vertex attribute or index type
+    static constexpr vk::DeviceSize Alignment = 16;
+    // Sparse blocks take no memory of their own, so there are fewer larger ones
+    static constexpr vk::DeviceSize StreamingBlockSize = 1024 * 1024 * 1024;
+
+    // The heap streams if cache is not null, which requires VulkanDevice::sparse_buffer_residency.
+    explicit VulkanGeometryHeap(VulkanDevice& device, vk::BufferUsageFlags usage,
+                                vk::PipelineStageFlags2 dst_stage_mask,
+                                vk::AccessFlags2 dst_access_mask,
+                                vk::DeviceSize block_size = DefaultBlockSize,
+                                std::shared_ptr<const SceneCache> cache = nullptr);
+    ~VulkanGeometryHeap();
+
+    bool IsStreaming() const noexcept {
+        return cache != nullptr;
+    }
+    // Of the memory bound to the ranges of a streaming heap. Ranges are aligned to it and padded
+    // to a multiple of it, so that they never share memory.
+    const vk::MemoryRequirements& GetSparseRequirements() const noexcept {
+        return sparse_requirements;
+    }
+    // Where uploads to the heap are visible to
+    vk::PipelineStageFlags2 GetDstStageMask() const noexcept {
+        return dst_stage_mask;
+    }
+    vk::AccessFlags2 GetDstAccessMask() const noexcept {
+        return dst_access_mask;
+    }
+
+    // Allocates `size` bytes and fills them with read_func, like VulkanImmUploadBuffer.
+    std::shared_ptr<VulkanGeometryBuffer> Upload(
+        std::size_t size, const std::function<void(void*, std::size_t)>& read_func);
+    std::shared_ptr<VulkanGeometryBuffer> Upload(std::span<const u8> data);
+    // Copies from a host visible buffer on the GPU. See Helpers::CopyFromStagingBuffer.
+    std::shared_ptr<VulkanGeometryBuffer> Copy(const VulkanBuffer& src_buffer,
+                                               vk::DeviceSize src_offset, std::size_t size);
+
+    std::size_t GetNumBlocks() const;
+
+private:
+    struct Block {
+        std::unique_ptr<VulkanBuffer> buffer;
+        vk::raii::Buffer sparse_buffer = nullptr; // Instead of buffer, for streaming heaps
+        VmaVirtualBlock virtual_block{};
+        vk::DeviceAddress address{};
+    };
+
+    std::shared_ptr<VulkanGeometryBuffer> Allocate(std::size_t size);
+    vk::BufferCreateInfo GetBlockCreateInfo(vk::DeviceSize size) const;
+    Block& CreateBlock(vk::DeviceSize size);
+    void Free(VmaVirtualBlock virtual_block, VmaVirtualAllocation allocation);
+    // Writes the contents of a range to the cache, and maps them back as its source. The data
+    // may be owned, to be kept if caching fails.
+    void SetSource(VulkanGeometryBuffer& buffer, std::span<const u8> data,
+                   std::vector<u8> owned = {}) const;
+
+    VulkanDevice& device;
+    vk::BufferUsageFlags usage;
+    vk::PipelineStageFlags2 dst_stage_mask;
+    vk::AccessFlags2 dst_access_mask;
+    vk::DeviceSize block_size{};
+    std::shared_ptr<const SceneCache> cache;
+    vk::MemoryRequirements sparse_requirements;
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<Block>> blocks;
+
+    friend class VulkanGeometryBuffer;
+};
+
+} // namespace Renderer
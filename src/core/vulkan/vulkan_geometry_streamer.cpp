@@ -0,0 +1,460 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/mapped_file.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_geometry_heap.h"
+#include "core/vulkan/vulkan_geometry_streamer.h"
+#include "core/vulkan/vulkan_host_cache.h"
+
+namespace Renderer {
+
+VulkanGeometryStreamer::VulkanGeometryStreamer(VulkanDevice& device_, vk::DeviceSize budget_,
+                                               std::size_t num_frames_in_flight_,
+                                               std::shared_ptr<VulkanHostCache> host_cache_)
+    : device(device_), budget(budget_), host_cache(std::move(host_cache_)),
+      num_frames_in_flight(num_frames_in_flight_), frames(num_frames_in_flight_) {
+
+    for (auto& frame : frames) {
+        frame.bind_semaphore = vk::raii::Semaphore{*device, vk::SemaphoreCreateInfo{}};
+    }
+}
+
+// Frees memory bound to a streaming heap, which is tracked as geometry memory
+static void FreeGeometryMemory(const VulkanAllocator& allocator, VmaAllocation allocation) {
+    VmaAllocationInfo allocation_info{};
+    vmaGetAllocationInfo(*allocator, allocation, &allocation_info);
+    allocator.RemoveUsage(MemoryCategory::Geometry, allocation_info.size);
+    vmaFreeMemory(*allocator, allocation);
+}
+
+VulkanGeometryStreamer::~VulkanGeometryStreamer() {
+    const auto& allocator = *device.allocator;
+    for (auto& frame : frames) {
+        for (const auto allocation : frame.retired) {
+            FreeGeometryMemory(allocator, allocation);
+        }
+    }
+    for (const auto& range : ranges) {
+        if (range->allocation) {
+            FreeGeometryMemory(allocator, range->allocation);
+        }
+    }
+}
+
+void VulkanGeometryStreamer::SetMeshes(
+    std::span<const std::vector<std::shared_ptr<VulkanGeometryBuffer>>> mesh_buffers) {
+
+    meshes.assign(mesh_buffers.size(), {});
+    if (!IsEnabled()) {
+        return;
+    }
+
+    std::unordered_map<const VulkanGeometryBuffer*, Range*> buffer_ranges;
+    vk::DeviceSize total_size = 0;
+    for (std::size_t i = 0; i < mesh_buffers.size(); ++i) {
+        auto& mesh = meshes[i];
+        for (const auto& buffer : mesh_buffers[i]) {
+            if (!buffer || buffer->size == 0 || !buffer->GetHeap().IsStreaming()) {
+                continue;
+            }
+            auto& range = buffer_ranges[buffer.get()];
+            if (!range) {
+                const auto alignment = buffer->GetHeap().GetSparseRequirements().alignment;
+                range = ranges
+                            .emplace_back(std::make_unique<Range>(Range{
+                                .buffer = buffer,
+                                .memory_size = Common::AlignUp(buffer->size, alignment),
+                            }))
+                            .get();
+                total_size += range->memory_size;
+            }
+            if (std::ranges::find(mesh.ranges, range) == mesh.ranges.end()) {
+                mesh.ranges.emplace_back(range);
+            }
+        }
+        // Nothing to stream in
+        mesh.resident = mesh.ranges.empty();
+    }
+    candidates.reserve(meshes.size());
+    prefetch_candidates.reserve(meshes.size());
+    victims.reserve(meshes.size());
+    pending_unbinds.reserve(ranges.size());
+    SPDLOG_INFO("Streaming {} bytes of geometry in {} ranges within {} bytes", total_size,
+                ranges.size(), budget);
+}
+
+void VulkanGeometryStreamer::Request(std::size_t mesh_idx, float priority) {
+    if (!IsEnabled()) {
+        return;
+    }
+    auto& mesh = meshes[mesh_idx];
+    if (mesh.last_requested != frame_number) {
+        mesh.last_requested = frame_number;
+        mesh.priority = priority;
+        if (!mesh.resident) {
+            candidates.emplace_back(&mesh);
+        }
+    } else {
+        mesh.priority = std::max(mesh.priority, priority);
+    }
+}
+
+void VulkanGeometryStreamer::Prefetch(std::size_t mesh_idx, float priority) {
+    if (!IsEnabled()) {
+        return;
+    }
+    auto& mesh = meshes[mesh_idx];
+    if (mesh.last_prefetched != frame_number) {
+        mesh.last_prefetched = frame_number;
+        mesh.prefetch_priority = priority;
+        if (!mesh.resident) {
+            prefetch_candidates.emplace_back(&mesh);
+        }
+    } else {
+        mesh.prefetch_priority = std::max(mesh.prefetch_priority, priority);
+    }
+}
+
+bool VulkanGeometryStreamer::MakeRoom(vk::DeviceSize size, bool prefetch) {
+    if (used_memory + size <= budget) {
+        return true;
+    }
+    const auto WasPrefetched = [this](const Mesh& mesh) {
+        return mesh.last_prefetched + 1 >= frame_number;
+    };
+    if (!victims_gathered) {
+        // Least recently requested first, those about to be used last. The meshes requested
+        // last frame are still needed.
+        for (auto& mesh : meshes) {
+            if (mesh.resident && !mesh.ranges.empty() && mesh.last_requested + 1 < frame_number) {
+                victims.emplace_back(&mesh);
+            }
+        }
+        std::ranges::sort(victims, {}, [&WasPrefetched](const Mesh* mesh) {
+            return std::make_pair(WasPrefetched(*mesh), mesh->last_requested);
+        });
+        victims_gathered = true;
+    }
+    while (used_memory + size > budget) {
+        if (next_victim == victims.size() ||
+            (prefetch && WasPrefetched(*victims[next_victim]))) {
+            return false;
+        }
+        Evict(*victims[next_victim++]);
+    }
+    return true;
+}
+
+void VulkanGeometryStreamer::Evict(Mesh& mesh) {
+    // Renderers stop drawing the mesh from this frame on, but earlier frames may still be
+    // running, so its ranges are only unbound once they have completed
+    mesh.resident = false;
+    for (auto* range : mesh.ranges) {
+        if (--range->num_resident_meshes != 0) {
+            continue;
+        }
+        used_memory -= range->memory_size;
+        range->last_evicted = frame_number;
+        if (!range->pending_unbind) {
+            range->pending_unbind = true;
+            pending_unbinds.emplace_back(range);
+        }
+    }
+}
+
+bool VulkanGeometryStreamer::Load(Mesh& mesh) {
+    const auto& allocator = *device.allocator;
+
+    // Ranges that are still bound (e.g. evicted recently, or shared with a resident mesh) keep
+    // their contents
+    const std::size_t first_upload = uploads.size();
+    for (auto* range : mesh.ranges) {
+        if (range->allocation) {
+            continue;
+        }
+        const auto& sparse_requirements = range->buffer->GetHeap().GetSparseRequirements();
+        const VkMemoryRequirements requirements{
+            .size = range->memory_size,
+            .alignment = sparse_requirements.alignment,
+            .memoryTypeBits = sparse_requirements.memoryTypeBits,
+        };
+        // Never oversubscribe for meshes that can be evicted instead
+        const VmaAllocationCreateInfo alloc_create_info{
+            .flags = VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT,
+            .usage = VMA_MEMORY_USAGE_UNKNOWN,
+            .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        };
+        VmaAllocationInfo allocation_info{};
+        if (vmaAllocateMemory(*allocator, &requirements, &alloc_create_info, &range->allocation,
+                              &allocation_info) != VK_SUCCESS) {
+            for (std::size_t i = first_upload; i < uploads.size(); ++i) {
+                FreeGeometryMemory(allocator, std::exchange(uploads[i]->allocation, nullptr));
+            }
+            uploads.resize(first_upload);
+            range->allocation = nullptr;
+            return false;
+        }
+        allocator.AddUsage(MemoryCategory::Geometry, allocation_info.size);
+        allocator.SetAllocationName(range->allocation, MemoryCategory::Geometry,
+                                    "streamed geometry");
+        uploads.emplace_back(range);
+    }
+
+    for (std::size_t i = first_upload; i < uploads.size(); ++i) {
+        const auto* range = uploads[i];
+        VmaAllocationInfo allocation_info{};
+        vmaGetAllocationInfo(*allocator, range->allocation, &allocation_info);
+        binds.emplace_back(range->buffer->buffer, vk::SparseMemoryBind{
+                                                      .resourceOffset = range->buffer->offset,
+                                                      .size = range->memory_size,
+                                                      .memory = allocation_info.deviceMemory,
+                                                      .memoryOffset = allocation_info.offset,
+                                                  });
+    }
+    for (auto* range : mesh.ranges) {
+        if (range->num_resident_meshes++ == 0) {
+            used_memory += range->memory_size;
+        }
+    }
+    mesh.resident = true;
+    return true;
+}
+
+void VulkanGeometryStreamer::UnbindRanges(Frame& frame) {
+    std::erase_if(pending_unbinds, [this, &frame](Range* range) {
+        if (range->num_resident_meshes != 0) { // Loaded again before it was unbound
+            range->pending_unbind = false;
+            return true;
+        }
+        // The last frame that may have drawn it is the one before it was evicted
+        if (range->last_evicted + num_frames_in_flight > frame_number + 1) {
+            return false;
+        }
+        binds.emplace_back(range->buffer->buffer, vk::SparseMemoryBind{
+                                                      .resourceOffset = range->buffer->offset,
+                                                      .size = range->memory_size,
+                                                  });
+        frame.retired.emplace_back(std::exchange(range->allocation, nullptr));
+        range->pending_unbind = false;
+        return true;
+    });
+}
+
+void VulkanGeometryStreamer::SubmitBinds(vk::Semaphore signal_semaphore) {
+    bind_infos.clear();
+    for (const auto& [buffer, bind] : binds) {
+        bind_infos.push_back({
+            .buffer = buffer,
+            .bindCount = 1,
+            .pBinds = &bind,
+        });
+    }
+    device.BindSparse(device.graphics_queue, vk::BindSparseInfo{
+        .bufferBindCount = static_cast<u32>(bind_infos.size()),
+        .pBufferBinds = bind_infos.data(),
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &signal_semaphore,
+    });
+}
+
+void VulkanGeometryStreamer::RecordUploads(const vk::raii::CommandBuffer& cmd, Frame& frame) {
+    // Ranges in the host cache are copied from it, and the others are added to it to be copied
+    // from, if they fit
+    const bool use_host_cache = host_cache && host_cache->IsEnabled();
+    cached_uploads.clear();
+    std::size_t total_size = 0;
+    for (const auto* range : uploads) {
+        const VulkanBuffer* cached = nullptr;
+        if (use_host_cache) {
+            const VulkanHostCache::Key key{.owner = range};
+            cached = host_cache->Find(key);
+            if (!cached) {
+                cached = host_cache->Add(key, range->buffer->source);
+            }
+        }
+        cached_uploads.emplace_back(cached);
+        if (!cached) {
+            total_size += Common::AlignUp(range->buffer->size, VulkanGeometryHeap::Alignment);
+        }
+    }
+    if (total_size != 0 &&
+        (!frame.staging_buffer || frame.staging_buffer->size < total_size)) {
+        frame.staging_buffer = std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .size = std::max(total_size, MaxUploadPerFrame),
+                .usage = vk::BufferUsageFlagBits::eTransferSrc,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+            },
+            MemoryCategory::Scratch);
+        frame.staging_buffer->SetName("geometry streaming staging");
+    }
+
+    // Freshly bound memory needs no barrier before it is written, as the frame waits for the
+    // binds before it runs
+    auto* staging = total_size != 0
+                        ? static_cast<u8*>(frame.staging_buffer->allocation_info.pMappedData)
+                        : nullptr;
+    std::size_t offset = 0;
+    vk::PipelineStageFlags2 dst_stage_mask;
+    vk::AccessFlags2 dst_access_mask;
+    for (std::size_t i = 0; i < uploads.size(); ++i) {
+        const auto& buffer = *uploads[i]->buffer;
+        dst_stage_mask |= buffer.GetHeap().GetDstStageMask();
+        dst_access_mask |= buffer.GetHeap().GetDstAccessMask();
+        if (const auto* cached = cached_uploads[i]) {
+            cmd.copyBuffer(**cached, buffer.buffer,
+                           {{
+                               .srcOffset = 0,
+                               .dstOffset = buffer.offset,
+                               .size = buffer.source.size(),
+                           }});
+            continue;
+        }
+        std::memcpy(staging + offset, buffer.source.data(), buffer.source.size());
+        cmd.copyBuffer(**frame.staging_buffer, buffer.buffer,
+                       {{
+                           .srcOffset = offset,
+                           .dstOffset = buffer.offset,
+                           .size = buffer.source.size(),
+                       }});
+        offset += Common::AlignUp(buffer.size, VulkanGeometryHeap::Alignment);
+    }
+    if (offset != 0) {
+        vmaFlushAllocation(**device.allocator, frame.staging_buffer->allocation, 0, offset);
+    }
+
+    const vk::MemoryBarrier2 barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+        .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+        .dstStageMask = dst_stage_mask,
+        .dstAccessMask = dst_access_mask,
+    };
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = &barrier,
+    });
+}
+
+VulkanGeometryStreamer::FrameUpdate VulkanGeometryStreamer::BeginFrame(
+    const vk::raii::CommandBuffer& cmd, std::size_t frame_idx) {
+
+    ++frame_number;
+    auto& frame = frames[frame_idx];
+
+    // The frame that waited for these unbinds has completed
+    for (const auto allocation : frame.retired) {
+        FreeGeometryMemory(*device.allocator, allocation);
+    }
+    frame.retired.clear();
+    if (host_cache) {
+        host_cache->BeginFrame(frame_idx);
+    }
+    if (!IsEnabled()) {
+        return {};
+    }
+
+    binds.clear();
+    uploads.clear();
+    victims.clear();
+    victims_gathered = false;
+    next_victim = 0;
+
+    // The meshes requested last frame, most important first
+    bool residency_changed = false;
+    std::ranges::sort(candidates, std::greater{}, &Mesh::priority);
+    std::size_t upload_size = 0;
+    for (auto* mesh : candidates) {
+        vk::DeviceSize added_memory = 0;
+        std::size_t size = 0;
+        for (const auto* range : mesh->ranges) {
+            if (range->num_resident_meshes == 0) {
+                added_memory += range->memory_size;
+            }
+            if (!range->allocation) {
+                size += range->buffer->size;
+            }
+        }
+        if (upload_size != 0 && upload_size + size > MaxUploadPerFrame) {
+            break;
+        }
+        if (added_memory > budget) {
+            continue; // Never fits, so nothing is evicted for it
+        }
+        if (!MakeRoom(added_memory, false) || !Load(*mesh)) {
+            continue;
+        }
+        upload_size += size;
+        residency_changed = true;
+    }
+    candidates.clear();
+
+    // Then the prefetched ones, with what is left. Those that do not fit are read ahead from the
+    // source instead, so that their uploads on later frames do not wait for the disk.
+    std::ranges::sort(prefetch_candidates, std::greater{}, &Mesh::prefetch_priority);
+    std::size_t prefetch_size = 0;
+    for (auto* mesh : prefetch_candidates) {
+        if (mesh->resident) {
+            continue; // Requested as well
+        }
+        vk::DeviceSize added_memory = 0;
+        std::size_t size = 0;
+        for (const auto* range : mesh->ranges) {
+            if (range->num_resident_meshes == 0) {
+                added_memory += range->memory_size;
+            }
+            if (!range->allocation) {
+                size += range->buffer->size;
+            }
+        }
+        if (added_memory > budget) {
+            continue;
+        }
+        if (prefetch_size + size > MaxPrefetchPerFrame ||
+            upload_size + size > MaxUploadPerFrame || !MakeRoom(added_memory, true) ||
+            !Load(*mesh)) {
+            for (auto* range : mesh->ranges) {
+                if (!range->allocation && !range->read_ahead) {
+                    Common::PrefetchMemory(range->buffer->source);
+                    range->read_ahead = true;
+                }
+            }
+            continue;
+        }
+        prefetch_size += size;
+        upload_size += size;
+        residency_changed = true;
+    }
+    prefetch_candidates.clear();
+    residency_changed |= next_victim != 0;
+
+    // After loading, so that ranges loaded again are not unbound first
+    UnbindRanges(frame);
+
+    FrameUpdate update{.residency_changed = residency_changed};
+    if (!binds.empty()) {
+        SubmitBinds(*frame.bind_semaphore);
+        update.wait_semaphore = *frame.bind_semaphore;
+    }
+    if (!uploads.empty()) {
+        RecordUploads(cmd, frame);
+    }
+    return update;
+}
+
+} // namespace Renderer
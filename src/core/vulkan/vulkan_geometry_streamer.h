@@ -0,0 +1,145 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanDevice;
+class VulkanGeometryBuffer;
+class VulkanHostCache;
+
+/**
+ * Pages the meshes of a scene whose geometry is in streaming heaps (see VulkanGeometryHeap) in
+ * and out of device memory under a budget.
+ *
+ * Renderers request the meshes of the instances they would draw each frame, with a priority
+ * such as their size on screen, and skip those that are not resident. At the start of the next
+ * frame, memory is bound to the ranges of the most important requested meshes and their
+ * contents are copied in from the scene cache, up to MaxUploadPerFrame, releasing the least
+ * recently requested meshes when the budget is exhausted. Meshes that share ranges share their
+ * memory as well. Meshes expected to be requested soon (e.g. along the predicted path of the
+ * camera) can be prefetched, which streams them in with what is left of the upload budget.
+ * With a host cache, the uploaded ranges are kept in it, and uploaded again from it once
+ * evicted.
+ *
+ * With a budget of 0 (or heaps that do not stream), every mesh is resident. Not thread safe.
+ */
+class VulkanGeometryStreamer : NonCopyable {
+public:
+    static constexpr std::size_t MaxUploadPerFrame = 64 * 1024 * 1024;
+    // Of the uploads for prefetched meshes, within MaxUploadPerFrame
+    static constexpr std::size_t MaxPrefetchPerFrame = 16 * 1024 * 1024;
+
+    // A budget of 0 disables streaming. Frames are indexed like those in flight of the renderer,
+    // and of the host cache if there is one.
+    explicit VulkanGeometryStreamer(VulkanDevice& device, vk::DeviceSize budget,
+                                    std::size_t num_frames_in_flight,
+                                    std::shared_ptr<VulkanHostCache> host_cache = nullptr);
+    ~VulkanGeometryStreamer();
+
+    bool IsEnabled() const noexcept {
+        return budget != 0;
+    }
+
+    // The ranges of each mesh of the scene, which are made resident together. Ranges of heaps
+    // that do not stream are ignored. Must be called once the meshes have been loaded.
+    void SetMeshes(std::span<const std::vector<std::shared_ptr<VulkanGeometryBuffer>>> meshes);
+
+    // Whether the mesh may be drawn in the current frame
+    bool IsResident(std::size_t mesh) const noexcept {
+        return !IsEnabled() || meshes[mesh].resident;
+    }
+    // Requests the mesh for the next frame. Those of higher priority are streamed in first.
+    void Request(std::size_t mesh, float priority);
+    // Asks for the mesh ahead of its requests. At the next frame it is streamed in after the
+    // requested meshes, within MaxPrefetchPerFrame and without evicting meshes requested or
+    // prefetched last frame, or its source is read ahead if it does not fit.
+    void Prefetch(std::size_t mesh, float priority);
+
+    struct FrameUpdate {
+        // If set, the frame must wait for this before running its command buffer
+        vk::Semaphore wait_semaphore;
+        // Whether any mesh has become resident or been evicted
+        bool residency_changed{};
+    };
+    // Records the uploads into the command buffer of the frame, whose previous submission must
+    // have completed.
+    FrameUpdate BeginFrame(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx);
+
+    vk::DeviceSize GetUsedMemory() const noexcept {
+        return used_memory;
+    }
+
+private:
+    struct Range {
+        std::shared_ptr<VulkanGeometryBuffer> buffer;
+        VmaAllocation allocation{}; // Null unless bound
+        vk::DeviceSize memory_size{};
+        std::size_t num_resident_meshes{};
+        u64 last_evicted{};    // Frame its last resident mesh was evicted in
+        bool pending_unbind{}; // In pending_unbinds
+        bool read_ahead{};     // Whether its source has been read ahead of its upload
+    };
+    struct Mesh {
+        std::vector<Range*> ranges;
+        bool resident{};
+        float priority{};
+        float prefetch_priority{};
+        u64 last_requested{};
+        u64 last_prefetched{};
+    };
+    struct Frame {
+        std::unique_ptr<VulkanBuffer> staging_buffer;
+        vk::raii::Semaphore bind_semaphore = nullptr;
+        // Unbound memory, freed once the frame that waited for the unbinds has completed
+        std::vector<VmaAllocation> retired;
+    };
+
+    // Evicts meshes until size bytes fit in the budget. Returns false if they cannot. Prefetches
+    // do not evict meshes prefetched last frame.
+    bool MakeRoom(vk::DeviceSize size, bool prefetch);
+    void Evict(Mesh& mesh);
+    // Returns false if memory could not be allocated, leaving the mesh as it was
+    bool Load(Mesh& mesh);
+    void UnbindRanges(Frame& frame);
+    void SubmitBinds(vk::Semaphore signal_semaphore);
+    void RecordUploads(const vk::raii::CommandBuffer& cmd, Frame& frame);
+
+    VulkanDevice& device;
+    vk::DeviceSize budget{};
+    vk::DeviceSize used_memory{}; // By the ranges of resident meshes
+    std::shared_ptr<VulkanHostCache> host_cache; // May be null
+    std::size_t num_frames_in_flight{};
+    u64 frame_number{};
+
+    std::vector<std::unique_ptr<Range>> ranges;
+    std::vector<Mesh> meshes;
+
+    // Kept across frames, so that streaming does not allocate them every frame
+    std::vector<Mesh*> candidates;          // Requested meshes that are not resident
+    std::vector<Mesh*> prefetch_candidates; // Prefetched meshes that are not resident
+    std::vector<Mesh*> victims;    // Resident meshes that were not requested, gathered on demand
+    bool victims_gathered{};
+    std::size_t next_victim{};
+    std::vector<Range*> uploads;
+    std::vector<const VulkanBuffer*> cached_uploads; // Of uploads, null if not in the host cache
+    std::vector<std::pair<vk::Buffer, vk::SparseMemoryBind>> binds;
+    std::vector<vk::SparseBufferMemoryBindInfo> bind_infos;
+    // Ranges of no resident mesh, unbound once the frames that may have drawn them completed
+    std::vector<Range*> pending_unbinds;
+
+    std::vector<Frame> frames;
+};
+
+} // namespace Renderer
@@ -6,6 +6,7 @@
 #include <set>
 #include "core/vulkan/vulkan_device.h"
 #include "core/vulkan/vulkan_graphics_pipeline.h"
+#include "core/vulkan/vulkan_helpers.hpp"
 
 namespace Renderer {
 
@@ -95,13 +96,24 @@ VulkanGraphicsPipeline::VulkanGraphicsPipeline(const VulkanDevice& device,
         dynamic_viewport_scissor = true;
     }
 
+    vk::PipelineCreationFeedback feedback;
+    const vk::PipelineCreationFeedbackCreateInfo feedback_info{
+        .pNext = pipeline_info.pNext,
+        .pPipelineCreationFeedback = &feedback,
+    };
+    pipeline_info.pNext = &feedback_info;
+    if (device.descriptor_buffer) {
+        pipeline_info.flags |= vk::PipelineCreateFlagBits::eDescriptorBufferEXT;
+    }
     pipeline = vk::raii::Pipeline{*device, device.pipeline_cache, pipeline_info};
+    Helpers::LogPipelineCreationFeedback("graphics", feedback);
 }
 
 VulkanGraphicsPipeline::~VulkanGraphicsPipeline() = default;
 
 void VulkanGraphicsPipeline::BeginRenderPass(const vk::raii::CommandBuffer& command_buffer,
-                                             vk::RenderPassBeginInfo render_pass_begin) const {
+                                             vk::RenderPassBeginInfo render_pass_begin,
+                                             vk::SubpassContents contents) const {
     render_pass_begin.renderPass = render_pass;
     static constexpr vk::ClearValue clear_value{{{{0.0f, 0.0f, 0.0f, 1.0f}}}};
     if (render_pass_begin.clearValueCount == 0) {
@@ -109,21 +121,28 @@ void VulkanGraphicsPipeline::BeginRenderPass(const vk::raii::CommandBuffer& comm
         render_pass_begin.pClearValues = &clear_value;
     }
 
-    command_buffer.beginRenderPass(render_pass_begin, vk::SubpassContents::eInline);
-    if (dynamic_viewport_scissor) {
-        command_buffer.setViewport(
-            0, {{
-                   .x = 0.0f,
-                   .y = 0.0f,
-                   .width = static_cast<float>(render_pass_begin.renderArea.extent.width),
-                   .height = static_cast<float>(render_pass_begin.renderArea.extent.height),
-                   .minDepth = 0.0f,
-                   .maxDepth = 1.0f,
-               }});
-        command_buffer.setScissor(0, {{
-                                         .extent = render_pass_begin.renderArea.extent,
-                                     }});
+    command_buffer.beginRenderPass(render_pass_begin, contents);
+    if (contents == vk::SubpassContents::eInline) {
+        SetViewportScissor(command_buffer, render_pass_begin.renderArea.extent);
+    }
+}
+
+void VulkanGraphicsPipeline::SetViewportScissor(const vk::raii::CommandBuffer& command_buffer,
+                                                const vk::Extent2D& extent) const {
+    if (!dynamic_viewport_scissor) {
+        return;
     }
+    command_buffer.setViewport(0, {{
+                                      .x = 0.0f,
+                                      .y = 0.0f,
+                                      .width = static_cast<float>(extent.width),
+                                      .height = static_cast<float>(extent.height),
+                                      .minDepth = 0.0f,
+                                      .maxDepth = 1.0f,
+                                  }});
+    command_buffer.setScissor(0, {{
+                                     .extent = extent,
+                                 }});
 }
 
 void VulkanGraphicsPipeline::EndRenderPass(const vk::raii::CommandBuffer& command_buffer) const {
@@ -25,8 +25,13 @@ public:
         return *pipeline;
     }
 
+    // With secondary command buffer contents, they have to set the viewport and scissor.
     void BeginRenderPass(const vk::raii::CommandBuffer& command_buffer,
-                         vk::RenderPassBeginInfo render_pass_begin) const;
+                         vk::RenderPassBeginInfo render_pass_begin,
+                         vk::SubpassContents contents = vk::SubpassContents::eInline) const;
+    // No-op unless they are dynamic
+    void SetViewportScissor(const vk::raii::CommandBuffer& command_buffer,
+                            const vk::Extent2D& extent) const;
     void EndRenderPass(const vk::raii::CommandBuffer& command_buffer) const;
 
     vk::raii::Pipeline pipeline = nullptr;
@@ -3,10 +3,11 @@
 // Refer to the license.txt file included.
 
 #include <array>
-#include "core/vulkan/vulkan_allocator.h"
+#include <spdlog/spdlog.h>
 #include "core/vulkan/vulkan_buffer.h"
 #include "core/vulkan/vulkan_helpers.hpp"
 #include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_upload_ring.h"
 
 namespace Renderer::Helpers {
 
@@ -30,44 +31,93 @@ void ImageLayoutTransition(const vk::raii::CommandBuffer& command_buffer,
 void ReadAndUploadBuffer(const VulkanDevice& device, const VulkanBuffer& dst_buffer,
                          vk::PipelineStageFlags2 dst_stage_mask, vk::AccessFlags2 dst_access_mask,
                          std::function<void(void*, std::size_t)> read_func) {
-    // TODO: Test this more
-    static constexpr std::size_t UploadBufferSize = 32 * 1024 * 1024;
+    ReadAndUploadBuffer(device, dst_buffer, 0, dst_buffer.size, dst_stage_mask, dst_access_mask,
+                        std::move(read_func));
+}
 
-    std::size_t bytes_remaining = dst_buffer.size;
-    while (bytes_remaining > 0) {
-        auto handle = device.allocator->CreateStagingBuffer(UploadBufferSize);
-        const auto& src_buffer = *handle;
+void ReadAndUploadBuffer(const VulkanDevice& device, const VulkanBuffer& dst_buffer,
+                         vk::DeviceSize dst_offset, std::size_t size,
+                         vk::PipelineStageFlags2 dst_stage_mask, vk::AccessFlags2 dst_access_mask,
+                         std::function<void(void*, std::size_t)> read_func) {
+    if (dst_buffer.IsMapped()) {
+        // Host writes are made visible to the device by the next queue submission
+        read_func(static_cast<u8*>(dst_buffer.allocation_info.pMappedData) + dst_offset, size);
+        vmaFlushAllocation(dst_buffer.allocator, dst_buffer.allocation, dst_offset, size);
+        return;
+    }
 
-        const std::size_t to_write = std::min(bytes_remaining, UploadBufferSize);
-        read_func(src_buffer.allocation_info.pMappedData, to_write);
-        vmaFlushAllocation(**device.allocator, src_buffer.allocation, 0, VK_WHOLE_SIZE);
+    const std::size_t chunk_size = device.upload_ring->GetMaxAllocationSize();
+
+    std::size_t bytes_remaining = size;
+    while (bytes_remaining > 0) {
+        const std::size_t to_write = std::min(bytes_remaining, chunk_size);
+        auto upload = device.upload_ring->Allocate(to_write);
+        // Reading may take a while (e.g. from a file), during which others can use the ring
+        upload.WriteUnlocked([&] { read_func(upload.data, to_write); });
 
-        const auto& cmd = src_buffer.command_buffer;
-        cmd.copyBuffer(*src_buffer, *dst_buffer,
+        const auto& cmd = upload.command_buffer;
+        cmd.copyBuffer(upload.buffer, *dst_buffer,
                        {{
-                           .dstOffset = dst_buffer.size - bytes_remaining,
+                           .srcOffset = upload.offset,
+                           .dstOffset = dst_offset + size - bytes_remaining,
                            .size = to_write,
                        }});
         if (bytes_remaining == to_write) { // Last write
-            cmd.pipelineBarrier2({
-                .bufferMemoryBarrierCount = 1,
-                .pBufferMemoryBarriers = TempArr<vk::BufferMemoryBarrier2>{{
+            upload.Release(
+                {
                     .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
                     .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
                     .dstStageMask = dst_stage_mask,
                     .dstAccessMask = dst_access_mask,
-                    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-                    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
                     .buffer = *dst_buffer,
-                    .offset = 0,
-                    .size = dst_buffer.size,
-                }},
-            });
+                    .offset = dst_offset,
+                    .size = size,
+                },
+                dst_buffer.sharing_mode);
         }
 
-        handle.Submit();
         bytes_remaining -= to_write;
     }
 }
 
+void CopyFromStagingBuffer(const VulkanDevice& device, const VulkanBuffer& src_buffer,
+                           vk::DeviceSize src_offset, const VulkanBuffer& dst_buffer,
+                           vk::DeviceSize dst_offset, std::size_t size,
+                           vk::PipelineStageFlags2 dst_stage_mask,
+                           vk::AccessFlags2 dst_access_mask) {
+    if (size == 0) {
+        return;
+    }
+
+    const auto upload = device.upload_ring->Record();
+    upload.command_buffer.copyBuffer(*src_buffer, *dst_buffer,
+                                     {{
+                                         .srcOffset = src_offset,
+                                         .dstOffset = dst_offset,
+                                         .size = size,
+                                     }});
+    upload.Release(
+        {
+            .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
+            .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+            .dstStageMask = dst_stage_mask,
+            .dstAccessMask = dst_access_mask,
+            .buffer = *dst_buffer,
+            .offset = dst_offset,
+            .size = size,
+        },
+        dst_buffer.sharing_mode);
+}
+
+void LogPipelineCreationFeedback(std::string_view name,
+                                 const vk::PipelineCreationFeedback& feedback) {
+    if (!(feedback.flags & vk::PipelineCreationFeedbackFlagBits::eValid)) {
+        return;
+    }
+    const bool cache_hit = static_cast<bool>(
+        feedback.flags & vk::PipelineCreationFeedbackFlagBits::eApplicationPipelineCacheHit);
+    SPDLOG_DEBUG("Created {} pipeline in {:.3f} ms{}", name, feedback.duration / 1e6,
+                 cache_hit ? " (pipeline cache hit)" : "");
+}
+
 } // namespace Renderer::Helpers
@@ -4,11 +4,16 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 #include <functional>
 #include <memory>
+#include <string_view>
 #include <tuple>
 #include <type_traits>
 #include <utility>
+#include <vector>
 #include <boost/pfr.hpp>
 #include <glm/glm.hpp>
 #include <vulkan/vulkan_raii.hpp>
@@ -16,6 +21,7 @@
 #include "common/common_types.h"
 #include "common/temp_ptr.h"
 #include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_upload_ring.h"
 
 namespace Renderer {
 class VulkanBuffer;
@@ -47,7 +53,8 @@ struct OneTimeCommandContext {
     explicit OneTimeCommandContext(const VulkanDevice& device_)
         : device(device_), command_buffers{*device,
                                            {
-                                               .commandPool = *device.command_pool,
+                                               .commandPool = device.GetThreadCommandPool(
+                                                   device.graphics_queue_family),
                                                .level = vk::CommandBufferLevel::ePrimary,
                                                .commandBufferCount = 1,
                                            }} {
@@ -56,12 +63,15 @@ struct OneTimeCommandContext {
     }
 
     ~OneTimeCommandContext() {
+        // Make sure pending uploads are executed first
+        device.upload_ring->Flush();
+
         command_buffers[0].end();
-        device.graphics_queue.submit({{
+        device.Submit(device.graphics_queue, {{
             .commandBufferCount = 1,
             .pCommandBuffers = TempArr<vk::CommandBuffer>{*command_buffers[0]},
         }});
-        device.graphics_queue.waitIdle();
+        device.WaitQueueIdle(device.graphics_queue);
     }
 
     vk::raii::CommandBuffer& operator*() {
@@ -106,6 +116,77 @@ struct GenericStructureChain {
         data = std::make_unique<u8[]>(sizeof(TupleType));
         auto* tuple = new (data.get()) TupleType{std::forward<T>(t), std::forward<Args>(args)...};
         first_ptr = &std::get<0>(*tuple);
+        sizes = {sizeof(std::remove_cvref_t<T>), sizeof(std::remove_cvref_t<Args>)...};
+    }
+
+    // Adds the structures of the other chain, ORing together those of the same type in both.
+    // Only for feature structures, which are all VkBool32s after sType and pNext.
+    void Merge(const GenericStructureChain& other) {
+        struct Entry {
+            const vk::BaseOutStructure* structure;
+            std::size_t size;
+        };
+        std::vector<Entry> entries;
+        const auto Find = [&entries](vk::StructureType type) {
+            return std::ranges::find(entries, type,
+                                     [](const Entry& entry) { return entry.structure->sType; });
+        };
+        const auto Collect = [&entries, &Find](const GenericStructureChain& chain) {
+            const auto* structure = reinterpret_cast<const vk::BaseOutStructure*>(chain.first_ptr);
+            for (const std::size_t size : chain.sizes) {
+                if (Find(structure->sType) == entries.end()) {
+                    entries.push_back({.structure = structure, .size = size});
+                }
+                structure = structure->pNext;
+            }
+        };
+        Collect(*this);
+        Collect(other);
+
+        // Each at the alignment of new[], like the elements of the tuple
+        static constexpr std::size_t Alignment = alignof(std::max_align_t);
+        std::size_t total_size = 0;
+        for (const auto& entry : entries) {
+            total_size += Common::AlignUp(entry.size, Alignment);
+        }
+        auto merged = std::make_unique<u8[]>(total_size);
+        std::vector<vk::BaseOutStructure*> merged_structures;
+        std::size_t offset = 0;
+        for (const auto& entry : entries) {
+            std::memcpy(merged.get() + offset, entry.structure, entry.size);
+            merged_structures.push_back(
+                reinterpret_cast<vk::BaseOutStructure*>(merged.get() + offset));
+            offset += Common::AlignUp(entry.size, Alignment);
+        }
+        for (std::size_t i = 0; i < merged_structures.size(); ++i) {
+            merged_structures[i]->pNext =
+                i + 1 < merged_structures.size() ? merged_structures[i + 1] : nullptr;
+        }
+
+        // The structures of other are the same as those copied, or of the same type as ones of
+        // this chain
+        const auto* structure = reinterpret_cast<const vk::BaseOutStructure*>(other.first_ptr);
+        for (const std::size_t size : other.sizes) {
+            const auto i = static_cast<std::size_t>(Find(structure->sType) - entries.begin());
+            auto* dst = reinterpret_cast<u8*>(merged_structures[i]);
+            const auto* src = reinterpret_cast<const u8*>(structure);
+            for (std::size_t j = sizeof(vk::BaseOutStructure); j + sizeof(VkBool32) <= size;
+                 j += sizeof(VkBool32)) {
+                VkBool32 dst_value, src_value;
+                std::memcpy(&dst_value, dst + j, sizeof(dst_value));
+                std::memcpy(&src_value, src + j, sizeof(src_value));
+                dst_value |= src_value;
+                std::memcpy(dst + j, &dst_value, sizeof(dst_value));
+            }
+            structure = structure->pNext;
+        }
+
+        data = std::move(merged);
+        first_ptr = reinterpret_cast<T*>(merged_structures[0]);
+        sizes.clear();
+        for (const auto& entry : entries) {
+            sizes.push_back(entry.size);
+        }
     }
 
     operator T*() {
@@ -123,16 +204,40 @@ struct GenericStructureChain {
 
     std::unique_ptr<u8[]> data;
     T* first_ptr{};
+    std::vector<std::size_t> sizes; // Of the structures, in the order of the chain
 };
 
 void ImageLayoutTransition(const vk::raii::CommandBuffer& command_buffer,
                            const std::unique_ptr<VulkanImage>& image,
                            vk::ImageMemoryBarrier2 params);
 
+// Buffers created with VulkanBuffer::DirectUploadFlags that ended up in host visible memory
+// (device local memory behind resizable BAR, or unified memory) are written directly, without a
+// staging copy or any submission.
+void ReadAndUploadBuffer(const VulkanDevice& device, const VulkanBuffer& dst_buffer,
+                         vk::PipelineStageFlags2 dst_stage_mask, vk::AccessFlags2 dst_access_mask,
+                         std::function<void(void*, std::size_t)> read_func);
+
+// Copies from an already filled host visible buffer on the GPU, recorded into the upload ring.
+// The source must be kept alive until the upload ring batch has completed.
+void CopyFromStagingBuffer(const VulkanDevice& device, const VulkanBuffer& src_buffer,
+                           vk::DeviceSize src_offset, const VulkanBuffer& dst_buffer,
+                           vk::DeviceSize dst_offset, std::size_t size,
+                           vk::PipelineStageFlags2 dst_stage_mask,
+                           vk::AccessFlags2 dst_access_mask);
+
+// Uploads to [dst_offset, dst_offset + size) of the buffer only
 void ReadAndUploadBuffer(const VulkanDevice& device, const VulkanBuffer& dst_buffer,
+                         vk::DeviceSize dst_offset, std::size_t size,
                          vk::PipelineStageFlags2 dst_stage_mask, vk::AccessFlags2 dst_access_mask,
                          std::function<void(void*, std::size_t)> read_func);
 
+// Logs (at debug level) how long the pipeline took to create and whether it was found in the
+// pipeline cache, as reported through a vk::PipelineCreationFeedbackCreateInfo chained into its
+// create info.
+void LogPipelineCreationFeedback(std::string_view name,
+                                 const vk::PipelineCreationFeedback& feedback);
+
 // Attributes helpers
 
 namespace detail {
@@ -0,0 +1,87 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_host_cache.h"
+
+namespace Renderer {
+
+VulkanHostCache::VulkanHostCache(const VulkanAllocator& allocator_, vk::DeviceSize budget_,
+                                 std::size_t num_frames_in_flight)
+    : allocator(allocator_), budget(budget_), retired(num_frames_in_flight) {
+
+    if (IsEnabled()) {
+        SPDLOG_INFO("Caching evicted streaming contents in {} bytes of host memory", budget);
+    }
+}
+
+VulkanHostCache::~VulkanHostCache() = default;
+
+void VulkanHostCache::BeginFrame(std::size_t frame_idx_) {
+    frame_idx = frame_idx_;
+    // Only the first streamer of the frame finds any
+    retired[frame_idx].clear();
+}
+
+const VulkanBuffer* VulkanHostCache::Find(const Key& key) {
+    const auto it = entry_map.find(key);
+    if (it == entry_map.end()) {
+        return nullptr;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->buffer.get();
+}
+
+const VulkanBuffer* VulkanHostCache::Add(const Key& key, std::span<const u8> contents) {
+    if (!IsEnabled() || contents.empty() || contents.size() > budget) {
+        return nullptr;
+    }
+    if (const auto it = entry_map.find(key); it != entry_map.end()) {
+        used_memory -= it->second->buffer->size;
+        retired[frame_idx].emplace_back(std::move(it->second->buffer));
+        entries.erase(it->second);
+        entry_map.erase(it);
+    }
+    while (used_memory + contents.size() > budget) {
+        auto& victim = entries.back();
+        used_memory -= victim.buffer->size;
+        retired[frame_idx].emplace_back(std::move(victim.buffer));
+        entry_map.erase(victim.key);
+        entries.pop_back();
+    }
+
+    std::unique_ptr<VulkanBuffer> buffer;
+    try {
+        // Host memory, which devices copy from without a staging copy
+        buffer = std::make_unique<VulkanBuffer>(
+            allocator,
+            vk::BufferCreateInfo{
+                .size = contents.size(),
+                .usage = vk::BufferUsageFlagBits::eTransferSrc,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+            },
+            MemoryCategory::Scratch);
+    } catch (const vk::SystemError& error) {
+        SPDLOG_WARN("Failed to allocate host cache entry of {} bytes: {}", contents.size(),
+                    error.what());
+        return nullptr;
+    }
+    buffer->SetName("host cache");
+    std::memcpy(buffer->allocation_info.pMappedData, contents.data(), contents.size());
+    vmaFlushAllocation(buffer->allocator, buffer->allocation, 0, contents.size());
+
+    used_memory += buffer->size;
+    entries.push_front({.key = key, .buffer = std::move(buffer)});
+    entry_map.emplace(key, entries.begin());
+    return entries.front().buffer.get();
+}
+
+} // namespace Renderer
@@ -0,0 +1,85 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanAllocator;
+class VulkanBuffer;
+
+/**
+ * Second tier of streaming, keeping what the streamers upload in host memory under a budget,
+ * so that contents evicted from device memory are streamed in again with a single copy from
+ * it, instead of reading their source again (e.g. from the scene cache on disk, or from remote
+ * storage, whose pages the system may have dropped meanwhile). Contents are kept as uploaded,
+ * e.g. block compressed texture levels, in host visible memory that the driver pins and the
+ * device copies from directly.
+ *
+ * The least recently used entries are released when the budget is exhausted, and freed once the
+ * frames in flight that may still copy from them have completed, which may exceed the budget
+ * until then. Shared by the streamers of a scene. Not thread safe.
+ */
+class VulkanHostCache : NonCopyable {
+public:
+    struct Key {
+        const void* owner{}; // E.g. the streamed texture
+        u64 index{};         // E.g. the level
+        bool operator==(const Key&) const = default;
+    };
+
+    // A budget of 0 disables caching. Frames are indexed like those in flight of the renderer.
+    explicit VulkanHostCache(const VulkanAllocator& allocator, vk::DeviceSize budget,
+                             std::size_t num_frames_in_flight);
+    ~VulkanHostCache();
+
+    bool IsEnabled() const noexcept {
+        return budget != 0;
+    }
+    vk::DeviceSize GetUsedMemory() const noexcept {
+        return used_memory;
+    }
+
+    // Frees the entries released by the previous submission of the frame, which must have
+    // completed. Called by each streamer at the start of the frame.
+    void BeginFrame(std::size_t frame_idx);
+
+    // Returns the buffer holding the contents of the key (from offset 0), or null if it is not
+    // cached. Marks it as the most recently used.
+    const VulkanBuffer* Find(const Key& key);
+    // Copies the contents into a new entry of the key, releasing the least recently used ones to
+    // fit. Returns its buffer, or null (caching nothing) if it cannot fit or be allocated.
+    const VulkanBuffer* Add(const Key& key, std::span<const u8> contents);
+
+private:
+    struct Entry {
+        Key key;
+        std::unique_ptr<VulkanBuffer> buffer;
+    };
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const noexcept {
+            return std::hash<const void*>{}(key.owner) ^ (key.index * 0x9E3779B97F4A7C15ull);
+        }
+    };
+
+    const VulkanAllocator& allocator;
+    vk::DeviceSize budget{};
+    vk::DeviceSize used_memory{}; // By the entries, excluding the released ones
+    std::size_t frame_idx{};
+
+    std::list<Entry> entries; // Most recently used first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> entry_map;
+    // Released by each frame in flight, freed at its next BeginFrame
+    std::vector<std::vector<std::unique_ptr<VulkanBuffer>>> retired;
+};
+
+} // namespace Renderer
@@ -0,0 +1,212 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <cstring>
+#include "common/jpeg.h"
+#include "common/temp_ptr.h"
+#include "core/shaders/jpeg_decode_glsl.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
+#include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_jpeg_decoder.h"
+#include "core/vulkan/vulkan_shader.h"
+#include "core/vulkan/vulkan_texture.h"
+
+namespace Renderer {
+
+std::size_t VulkanJPEGDecoder::GetUploadSize(const Common::JPEGCoefficients& coefficients) {
+    return (coefficients.block_offsets.size() + coefficients.coefficients.size()) * sizeof(u32);
+}
+
+static GLSL::JPEGDecodePushConstant GetPushConstant(const Common::JPEGCoefficients& coefficients) {
+    u32 sampling = 0;
+    for (std::size_t i = 0; i < coefficients.components.size(); ++i) {
+        const auto& component = coefficients.components[i];
+        sampling |= (component.h_sampling | (component.v_sampling << 4)) << (i * 8);
+    }
+    const u32 num_components = static_cast<u32>(coefficients.components.size());
+    return {
+        .num_blocks = static_cast<u32>(coefficients.block_offsets.size() - 1),
+        .width = coefficients.width,
+        .height = coefficients.height,
+        .mcus_x = coefficients.mcus_x,
+        .num_components = num_components,
+        .sampling = sampling,
+        .color_transform = num_components == 1 ? JPEG_COLOR_GRAY
+                           : coefficients.rgb  ? JPEG_COLOR_RGB
+                                               : JPEG_COLOR_YCBCR,
+    };
+}
+
+VulkanJPEGDecoder::VulkanJPEGDecoder(const VulkanDevice& device,
+                                     const VulkanUploadRing::Upload& upload,
+                                     std::span<const Image> images) {
+    // Copy the coefficients to the device, where the shaders read them
+    std::vector<vk::BufferMemoryBarrier2> buffer_barriers;
+    for (const auto& image : images) {
+        const auto& coefficients = *image.coefficients;
+        std::memcpy(upload.data + image.offset, coefficients.block_offsets.data(),
+                    coefficients.block_offsets.size() * sizeof(u32));
+        std::memcpy(upload.data + image.offset + coefficients.block_offsets.size() * sizeof(u32),
+                    coefficients.coefficients.data(),
+                    coefficients.coefficients.size() * sizeof(u32));
+
+        const vk::DeviceSize size = GetUploadSize(coefficients);
+        const auto& buffer = coefficient_buffers.emplace_back(std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage =
+                    vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+            },
+            MemoryCategory::Scratch));
+        buffer->SetName("JPEG coefficients");
+        upload.command_buffer.copyBuffer(upload.buffer, **buffer,
+                                         {{
+                                             .srcOffset = upload.offset + image.offset,
+                                             .dstOffset = 0,
+                                             .size = size,
+                                         }});
+        upload.Release(
+            {
+                .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+                .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .dstAccessMask = vk::AccessFlagBits2::eShaderStorageRead,
+                .buffer = **buffer,
+                .offset = 0,
+                .size = VK_WHOLE_SIZE,
+            },
+            vk::SharingMode::eExclusive);
+
+        // sRGB formats are rarely storage images, so level 0 is written through a UNORM view
+        storage_views.emplace_back(
+            *device, vk::ImageViewCreateInfo{
+                         .image = image.texture->GetImage(),
+                         .viewType = vk::ImageViewType::e2D,
+                         .format = vk::Format::eR8G8B8A8Unorm,
+                         .subresourceRange =
+                             {
+                                 .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                 .baseMipLevel = 0,
+                                 .levelCount = 1,
+                                 .baseArrayLayer = image.texture->layer,
+                                 .layerCount = 1,
+                             },
+                     });
+    }
+
+    std::vector<DescriptorBinding::Buffers> buffers;
+    std::vector<DescriptorBinding::CombinedImageSamplers> views;
+    for (std::size_t i = 0; i < images.size(); ++i) {
+        buffers.push_back({{**coefficient_buffers[i]}});
+        views.push_back({{{
+            .image = *storage_views[i],
+            .layout = vk::ImageLayout::eGeneral,
+        }}});
+    }
+    descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+        device, images.size(),
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::BuffersValue{buffers},
+            },
+            {
+                .type = vk::DescriptorType::eStorageImage,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+                .value = DescriptorBinding::CombinedImageSamplersValue{views},
+            },
+        });
+    pipeline = std::make_unique<VulkanComputePipeline>(
+        device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{device, u8"core/shaders/jpeg_decode.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 1,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *descriptor_sets->descriptor_set_layout,
+            }},
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::JPEGDecodePushConstant>(vk::ShaderStageFlagBits::eCompute),
+            }},
+        });
+
+    const auto MakeBarrier = [](const Image& image, vk::ImageMemoryBarrier2 params) {
+        params.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        params.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        params.image = image.texture->GetImage();
+        params.subresourceRange = {
+            .aspectMask = vk::ImageAspectFlagBits::eColor,
+            .baseMipLevel = 0,
+            .levelCount = 1,
+            .baseArrayLayer = image.texture->layer,
+            .layerCount = 1,
+        };
+        return params;
+    };
+    std::vector<vk::ImageMemoryBarrier2> barriers;
+    for (const auto& image : images) {
+        barriers.emplace_back(
+            MakeBarrier(image, {
+                                   .srcStageMask = vk::PipelineStageFlagBits2::eNone,
+                                   .srcAccessMask = vk::AccessFlags2{},
+                                   .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                                   .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+                                   .oldLayout = vk::ImageLayout::eUndefined,
+                                   .newLayout = vk::ImageLayout::eGeneral,
+                               }));
+    }
+    const auto& cmd = upload.GetGraphicsCommandBuffer();
+    cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = static_cast<u32>(barriers.size()),
+        .pImageMemoryBarriers = barriers.data(),
+    });
+
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **pipeline);
+    for (std::size_t i = 0; i < images.size(); ++i) {
+        const auto& coefficients = *images[i].coefficients;
+        VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                                   *pipeline->pipeline_layout, 0, {{*descriptor_sets, i}});
+        cmd.pushConstants<GLSL::JPEGDecodePushConstant>(*pipeline->pipeline_layout,
+                                                        vk::ShaderStageFlagBits::eCompute, 0,
+                                                        {GetPushConstant(coefficients)});
+        cmd.dispatch(coefficients.mcus_x, coefficients.mcus_y, 1);
+    }
+
+    barriers.clear();
+    for (const auto& image : images) {
+        const bool has_levels = image.texture->mip_levels > 1;
+        barriers.emplace_back(MakeBarrier(
+            image, {
+                       .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                       .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+                       .dstStageMask = has_levels ? vk::PipelineStageFlagBits2::eBlit
+                                                  : vk::PipelineStageFlagBits2::eFragmentShader,
+                       .dstAccessMask = has_levels ? vk::AccessFlagBits2::eTransferRead
+                                                   : vk::AccessFlagBits2::eShaderRead,
+                       .oldLayout = vk::ImageLayout::eGeneral,
+                       .newLayout = has_levels ? vk::ImageLayout::eTransferSrcOptimal
+                                               : vk::ImageLayout::eShaderReadOnlyOptimal,
+                   }));
+    }
+    cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = static_cast<u32>(barriers.size()),
+        .pImageMemoryBarriers = barriers.data(),
+    });
+}
+
+VulkanJPEGDecoder::~VulkanJPEGDecoder() = default;
+
+} // namespace Renderer
@@ -0,0 +1,62 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <span>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+#include "core/vulkan/vulkan_upload_ring.h"
+
+namespace Common {
+struct JPEGCoefficients;
+}
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanComputePipeline;
+class VulkanDescriptorSets;
+class VulkanDevice;
+class VulkanTexture;
+
+/**
+ * Finishes decoding JPEG textures on the GPU. The CPU only entropy decodes them (see
+ * Common::JPEGCoefficients), and the inverse DCT and color conversion of jpeg_decode.comp write
+ * level 0 of their images directly, so the decoded pixels are never uploaded. The nonzero
+ * coefficients of typical photos are a fraction of the size of their pixels, and the decoding
+ * threads are spared the most expensive part of decoding.
+ *
+ * Used by VulkanTextureUploadBatch, which keeps each decoder alive with the batch it records
+ * into (see VulkanUploadRing::Upload::Retain).
+ */
+class VulkanJPEGDecoder : NonCopyable {
+public:
+    struct Image {
+        const VulkanTexture* texture{}; // Created with the storage usage, see CreateImage
+        const Common::JPEGCoefficients* coefficients{};
+        std::size_t offset{}; // Of the coefficients in the upload
+    };
+
+    // Bytes of the coefficients of the image in the upload
+    static std::size_t GetUploadSize(const Common::JPEGCoefficients& coefficients);
+
+    // Writes the coefficients of the images into the upload, records their copy to the device,
+    // and their decoding on the graphics command buffer of the upload. Level 0 of the images is
+    // left for the blits generating the rest of the levels if they have more, and for the
+    // shaders otherwise (as the batch leaves uploaded levels).
+    explicit VulkanJPEGDecoder(const VulkanDevice& device, const VulkanUploadRing::Upload& upload,
+                               std::span<const Image> images);
+    ~VulkanJPEGDecoder();
+
+private:
+    std::vector<std::unique_ptr<VulkanBuffer>> coefficient_buffers; // Of each image
+    std::vector<vk::raii::ImageView> storage_views;
+    std::unique_ptr<VulkanDescriptorSets> descriptor_sets; // Of each image
+    std::unique_ptr<VulkanComputePipeline> pipeline;
+};
+
+} // namespace Renderer
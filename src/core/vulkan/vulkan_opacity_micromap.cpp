@@ -0,0 +1,200 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <cstring>
+#include "common/alignment.h"
+#include "common/opacity_micromap.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_opacity_micromap.h"
+
+namespace Renderer {
+
+namespace {
+
+// Of the data and triangle arrays the builds read
+constexpr vk::DeviceSize InputAlignment = 256;
+
+vk::MicromapBuildInfoEXT GetBuildInfo(std::span<const vk::MicromapUsageEXT> usage_counts) {
+    return {
+        .type = vk::MicromapTypeEXT::eOpacityMicromap,
+        .flags = vk::BuildMicromapFlagBitsEXT::ePreferFastTrace,
+        .mode = vk::BuildMicromapModeEXT::eBuild,
+        .usageCountsCount = static_cast<u32>(usage_counts.size()),
+        .pUsageCounts = usage_counts.data(),
+        .triangleArrayStride = sizeof(Common::OpacityMicromap::Triangle),
+    };
+}
+
+} // namespace
+
+VulkanOpacityMicromap::VulkanOpacityMicromap(VulkanDevice& device,
+                                             const Common::OpacityMicromap& data) {
+    for (u32 level = 0; level < data.level_counts.size(); ++level) {
+        if (data.level_counts[level] != 0) {
+            usage_counts.push_back({
+                .count = data.level_counts[level],
+                .subdivisionLevel = level,
+                .format = static_cast<u32>(vk::OpacityMicromapFormatEXT::e4State),
+            });
+        }
+    }
+    const auto size_info = device->getMicromapBuildSizesEXT(
+        vk::AccelerationStructureBuildTypeKHR::eDevice, GetBuildInfo(usage_counts));
+    build_scratch_size = size_info.buildScratchSize;
+
+    // Built on the graphics queue, but read by the builds of the BLASes on the compute queue
+    vk::BufferCreateInfo buffer_create_info{
+        .size = size_info.micromapSize,
+        .usage = vk::BufferUsageFlagBits::eMicromapStorageEXT |
+                 vk::BufferUsageFlagBits::eShaderDeviceAddress,
+    };
+    if (device.shared_queue_families.size() > 1) {
+        buffer_create_info.sharingMode = vk::SharingMode::eConcurrent;
+        buffer_create_info.setQueueFamilyIndices(device.shared_queue_families);
+    }
+    buffer = std::make_unique<VulkanBuffer>(*device.allocator, buffer_create_info,
+                                            VmaAllocationCreateInfo{
+                                                .usage = VMA_MEMORY_USAGE_AUTO,
+                                            },
+                                            MemoryCategory::AccelStructures);
+    buffer->SetName("opacity micromap");
+    micromap = vk::raii::MicromapEXT{*device,
+                                     {
+                                         .buffer = **buffer,
+                                         .size = size_info.micromapSize,
+                                         .type = vk::MicromapTypeEXT::eOpacityMicromap,
+                                     }};
+
+    index_buffer = std::make_unique<VulkanImmUploadBuffer>(
+        device,
+        VulkanBufferCreateInfo{
+            .size = data.indices.size() * sizeof(s32),
+            .usage = vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            .dst_stage_mask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+            .dst_access_mask = vk::AccessFlagBits2::eShaderRead,
+            .category = MemoryCategory::AccelStructures,
+        },
+        reinterpret_cast<const u8*>(data.indices.data()));
+    triangles_info = {
+        .indexType = vk::IndexType::eUint32,
+        .indexBuffer =
+            {
+                .deviceAddress = device->getBufferAddress({.buffer = **index_buffer}),
+            },
+        .indexStride = sizeof(s32),
+        .usageCountsCount = static_cast<u32>(usage_counts.size()),
+        .pUsageCounts = usage_counts.data(),
+        .micromap = *micromap,
+    };
+}
+
+VulkanOpacityMicromap::~VulkanOpacityMicromap() = default;
+
+std::vector<std::unique_ptr<VulkanOpacityMicromap>> VulkanOpacityMicromap::Build(
+    VulkanDevice& device, std::span<const Common::OpacityMicromap* const> micromaps) {
+
+    std::vector<std::unique_ptr<VulkanOpacityMicromap>> out;
+    if (micromaps.empty()) {
+        return out;
+    }
+
+    const auto scratch_alignment =
+        device.physical_device
+            .getProperties2<vk::PhysicalDeviceProperties2,
+                            vk::PhysicalDeviceAccelerationStructurePropertiesKHR>()
+            .get<vk::PhysicalDeviceAccelerationStructurePropertiesKHR>()
+            .minAccelerationStructureScratchOffsetAlignment;
+    // The triangles and data of each build, and its scratch, one after another
+    std::vector<vk::DeviceSize> input_offsets;
+    std::vector<vk::DeviceSize> scratch_offsets;
+    vk::DeviceSize input_size = 0;
+    vk::DeviceSize scratch_size = 0;
+    for (const auto* micromap : micromaps) {
+        out.emplace_back(new VulkanOpacityMicromap(device, *micromap));
+        input_offsets.emplace_back(input_size);
+        const auto triangles_size = Common::AlignUp(
+            micromap->triangles.size() * sizeof(Common::OpacityMicromap::Triangle),
+            InputAlignment);
+        input_size += Common::AlignUp(triangles_size + micromap->data.size(), InputAlignment);
+        scratch_offsets.emplace_back(scratch_size);
+        scratch_size += Common::AlignUp(out.back()->build_scratch_size, scratch_alignment);
+    }
+
+    // Over-allocated, as the allocations may not meet the alignments
+    VulkanBuffer input_buffer{
+        *device.allocator,
+        {
+            .size = input_size + InputAlignment,
+            .usage = vk::BufferUsageFlagBits::eMicromapBuildInputReadOnlyEXT |
+                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        },
+        {
+            .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                     VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Scratch,
+    };
+    input_buffer.SetName("opacity micromap build inputs");
+    VulkanBuffer scratch_buffer{
+        *device.allocator,
+        {
+            .size = scratch_size + scratch_alignment,
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        },
+        {
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Scratch,
+    };
+    scratch_buffer.SetName("opacity micromap build scratch");
+
+    const auto input_base = device->getBufferAddress({.buffer = *input_buffer});
+    const auto input_address = Common::AlignUp(input_base, InputAlignment);
+    auto* input_data = static_cast<u8*>(input_buffer.allocation_info.pMappedData) +
+                       (input_address - input_base);
+    const auto scratch_address = Common::AlignUp(
+        device->getBufferAddress({.buffer = *scratch_buffer}), scratch_alignment);
+
+    std::vector<vk::MicromapBuildInfoEXT> build_infos;
+    for (std::size_t i = 0; i < micromaps.size(); ++i) {
+        const auto& micromap = *micromaps[i];
+        const auto triangles_size =
+            micromap.triangles.size() * sizeof(Common::OpacityMicromap::Triangle);
+        const auto data_offset = input_offsets[i] + Common::AlignUp(triangles_size, InputAlignment);
+        std::memcpy(input_data + input_offsets[i], micromap.triangles.data(), triangles_size);
+        std::memcpy(input_data + data_offset, micromap.data.data(), micromap.data.size());
+
+        auto build_info = GetBuildInfo(out[i]->usage_counts);
+        build_info.dstMicromap = *out[i]->micromap;
+        build_info.data.deviceAddress = input_address + data_offset;
+        build_info.scratchData.deviceAddress = scratch_address + scratch_offsets[i];
+        build_info.triangleArray.deviceAddress = input_address + input_offsets[i];
+        build_infos.emplace_back(build_info);
+    }
+    vmaFlushAllocation(**device.allocator, input_buffer.allocation, 0, VK_WHOLE_SIZE);
+
+    {
+        Helpers::OneTimeCommandContext cmd{device};
+        cmd->buildMicromapsEXT(build_infos);
+        // For the builds of the BLASes that reference them
+        cmd->pipelineBarrier2({
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+                .srcStageMask = vk::PipelineStageFlagBits2::eMicromapBuildEXT,
+                .srcAccessMask = vk::AccessFlagBits2::eMicromapWriteEXT,
+                .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                .dstAccessMask = vk::AccessFlagBits2::eMicromapReadEXT,
+            }}},
+        });
+    }
+    return out;
+}
+
+} // namespace Renderer
@@ -0,0 +1,53 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <span>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Common {
+struct OpacityMicromap;
+}
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanDevice;
+class VulkanImmUploadBuffer;
+
+/**
+ * Opacity micromap (VK_EXT_opacity_micromap) of the triangles of a geometry, built from what
+ * Common::BakeOpacityMicromap baked. Chained to the triangles of the geometry in its bottom
+ * level acceleration structures, which reference it until they are destroyed.
+ */
+class VulkanOpacityMicromap : NonCopyable {
+public:
+    // Builds them all with a single submission to the graphics queue, blocking until done. The
+    // device must have opacity_micromap.
+    static std::vector<std::unique_ptr<VulkanOpacityMicromap>> Build(
+        VulkanDevice& device, std::span<const Common::OpacityMicromap* const> micromaps);
+    ~VulkanOpacityMicromap();
+
+    // For the pNext of vk::AccelerationStructureGeometryTrianglesDataKHR, valid for as long as
+    // the micromap
+    const vk::AccelerationStructureTrianglesOpacityMicromapEXT& GetTrianglesInfo() const noexcept {
+        return triangles_info;
+    }
+
+private:
+    explicit VulkanOpacityMicromap(VulkanDevice& device, const Common::OpacityMicromap& micromap);
+
+    std::unique_ptr<VulkanBuffer> buffer;
+    vk::raii::MicromapEXT micromap = nullptr;
+    std::unique_ptr<VulkanImmUploadBuffer> index_buffer;
+    std::vector<vk::MicromapUsageEXT> usage_counts;
+    vk::AccelerationStructureTrianglesOpacityMicromapEXT triangles_info;
+    vk::DeviceSize build_scratch_size{};
+};
+
+} // namespace Renderer
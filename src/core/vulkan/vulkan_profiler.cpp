@@ -0,0 +1,279 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <utility>
+#include <fmt/format.h>
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_profiler.h"
+
+namespace Renderer {
+
+// In the order of their bits, which is the order of the results
+static constexpr vk::QueryPipelineStatisticFlags StatisticFlags =
+    vk::QueryPipelineStatisticFlagBits::eVertexShaderInvocations |
+    vk::QueryPipelineStatisticFlagBits::eClippingPrimitives |
+    vk::QueryPipelineStatisticFlagBits::eFragmentShaderInvocations |
+    vk::QueryPipelineStatisticFlagBits::eComputeShaderInvocations;
+static constexpr std::size_t NumStatistics = 4;
+
+VulkanProfiler::Scope::Scope(VulkanProfiler* profiler_, const vk::raii::CommandBuffer& cmd_,
+                             std::size_t slot_, std::string_view name,
+                             vk::PipelineStageFlags2 stages_)
+    : profiler(profiler_), cmd(cmd_), slot(slot_), stages(stages_) {
+    if (profiler) {
+        query = profiler->BeginScope(cmd, slot, name);
+#ifdef ENABLE_TRACY
+        zone.emplace(profiler->tracy_context,
+                     &profiler->tracy_locations[profiler->GetScopeIndex(name)], *cmd, true);
+#endif
+    }
+}
+
+VulkanProfiler::Scope::~Scope() {
+    if (profiler) {
+#ifdef ENABLE_TRACY
+        zone.reset();
+#endif
+        profiler->EndScope(cmd, slot, query, stages);
+    }
+}
+
+VulkanProfiler::VulkanProfiler(const VulkanDevice& device_, std::size_t num_slots)
+    : device(device_),
+      timestamp_period(device.physical_device.getProperties().limits.timestampPeriod),
+      pipeline_statistics(device.pipeline_statistics), slots(num_slots) {
+    for (auto& slot : slots) {
+        slot.records.reserve(MaxScopes);
+    }
+    frame_times.reserve(HistoryLength);
+
+    timestamp_pool = vk::raii::QueryPool{
+        *device,
+        {
+            .queryType = vk::QueryType::eTimestamp,
+            .queryCount = static_cast<u32>(num_slots * MaxScopes * 2),
+        }};
+    if (pipeline_statistics) {
+        statistics_pool = vk::raii::QueryPool{
+            *device,
+            {
+                .queryType = vk::QueryType::ePipelineStatistics,
+                .queryCount = static_cast<u32>(num_slots * MaxScopes),
+                .pipelineStatistics = StatisticFlags,
+            }};
+    }
+
+#ifdef ENABLE_TRACY
+    // Calibrated with a command buffer of its own, which it submits and waits for
+    const vk::raii::CommandBuffers command_buffers{*device,
+                                                   {
+                                                       .commandPool = *device.command_pool,
+                                                       .level = vk::CommandBufferLevel::ePrimary,
+                                                       .commandBufferCount = 1,
+                                                   }};
+    tracy_context = TracyVkContext(*device.physical_device, **device, *device.graphics_queue,
+                                   *command_buffers[0]);
+#endif
+}
+
+VulkanProfiler::~VulkanProfiler() {
+#ifdef ENABLE_TRACY
+    TracyVkDestroy(tracy_context);
+#endif
+}
+
+void VulkanProfiler::BeginFrame(const vk::raii::CommandBuffer& cmd, std::size_t slot) {
+    ReadBack(slot);
+
+    auto& frame = slots[slot];
+    frame.frame = num_frames++;
+    frame.records.clear();
+    frame.statistics_active = false;
+    frame.num_statistics = 0;
+    cmd.resetQueryPool(*timestamp_pool, static_cast<u32>(slot * MaxScopes * 2), MaxScopes * 2);
+#ifdef ENABLE_TRACY
+    TracyVkCollect(tracy_context, *cmd);
+#endif
+    if (pipeline_statistics) {
+        cmd.resetQueryPool(*statistics_pool, static_cast<u32>(slot * MaxScopes), MaxScopes);
+    }
+}
+
+std::optional<u32> VulkanProfiler::BeginScope(const vk::raii::CommandBuffer& cmd,
+                                              std::size_t slot, std::string_view name,
+                                              bool statistics) {
+    auto& frame = slots[slot];
+    if (frame.records.size() >= MaxScopes) {
+        return std::nullopt;
+    }
+    const auto query = static_cast<u32>(frame.records.size());
+    auto& record = frame.records.emplace_back(Record{.scope_idx = GetScopeIndex(name)});
+    if (statistics && pipeline_statistics && !frame.statistics_active) {
+        record.statistics_query = static_cast<u32>(slot * MaxScopes) + frame.num_statistics++;
+        cmd.beginQuery(*statistics_pool, *record.statistics_query, {});
+        frame.statistics_active = true;
+    }
+    cmd.writeTimestamp2(vk::PipelineStageFlagBits2::eNone, *timestamp_pool,
+                        static_cast<u32>(slot * MaxScopes + query) * 2);
+    return query;
+}
+
+void VulkanProfiler::EndScope(const vk::raii::CommandBuffer& cmd, std::size_t slot,
+                              std::optional<u32> query, vk::PipelineStageFlags2 stages) {
+    if (!query) {
+        return;
+    }
+    auto& frame = slots[slot];
+    cmd.writeTimestamp2(stages, *timestamp_pool,
+                        static_cast<u32>(slot * MaxScopes + *query) * 2 + 1);
+    const auto& record = frame.records[*query];
+    if (record.statistics_query) {
+        cmd.endQuery(*statistics_pool, *record.statistics_query);
+        frame.statistics_active = false;
+    }
+}
+
+std::size_t VulkanProfiler::GetScopeIndex(std::string_view name) {
+    auto it = scope_indices.find(name);
+    if (it != scope_indices.end()) {
+        return it->second;
+    }
+    it = scope_indices.emplace(std::string{name}, scopes.size()).first;
+    scopes.push_back({.name = std::string{name}});
+#ifdef ENABLE_TRACY
+    tracy_locations.push_back({
+        .name = it->first.c_str(),
+        .function = "VulkanProfiler::Scope",
+        .file = __FILE__,
+        .line = static_cast<uint32_t>(__LINE__),
+    });
+#endif
+    return it->second;
+}
+
+void VulkanProfiler::ReadBack(std::size_t slot) {
+    const auto& frame = slots[slot];
+    if (frame.records.empty()) {
+        return;
+    }
+
+    // Each value is followed by its availability, so that nothing waits. Read into arrays of
+    // the most there can be rather than vectors, which would allocate.
+    const auto num_timestamps = static_cast<u32>(frame.records.size() * 2);
+    const auto timestamps =
+        timestamp_pool
+            .getResult<std::array<u64, MaxScopes * 4>>(
+                static_cast<u32>(slot * MaxScopes * 2), num_timestamps, 2 * sizeof(u64),
+                vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability)
+            .second;
+    std::array<u64, MaxScopes * (NumStatistics + 1)> statistics{};
+    if (frame.num_statistics > 0) {
+        statistics = statistics_pool
+                         .getResult<decltype(statistics)>(
+                             static_cast<u32>(slot * MaxScopes), frame.num_statistics,
+                             (NumStatistics + 1) * sizeof(u64),
+                             vk::QueryResultFlagBits::e64 |
+                                 vk::QueryResultFlagBits::eWithAvailability)
+                         .second;
+    }
+
+    scope_milliseconds.assign(scopes.size(), std::nullopt);
+    scope_statistics.assign(scopes.size(), std::nullopt);
+    for (std::size_t i = 0; i < frame.records.size(); ++i) {
+        const auto& record = frame.records[i];
+        const u64* begin = &timestamps[i * 4];
+        const u64* end = &timestamps[i * 4 + 2];
+        if (!begin[1] || !end[1]) {
+            continue;
+        }
+        auto& total = scope_milliseconds[record.scope_idx];
+        total = total.value_or(0) + (end[0] - begin[0]) * timestamp_period / 1e6;
+
+        if (!record.statistics_query) {
+            continue;
+        }
+        const u64* values =
+            &statistics[(*record.statistics_query - slot * MaxScopes) * (NumStatistics + 1)];
+        if (!values[NumStatistics]) {
+            continue;
+        }
+        auto& total_statistics = scope_statistics[record.scope_idx];
+        if (!total_statistics) {
+            total_statistics.emplace();
+        }
+        total_statistics->vertex_invocations += values[0];
+        total_statistics->clipping_primitives += values[1];
+        total_statistics->fragment_invocations += values[2];
+        total_statistics->compute_invocations += values[3];
+    }
+
+    std::optional<double> frame_milliseconds;
+    for (std::size_t i = 0; i < scopes.size(); ++i) {
+        if (!scope_milliseconds[i]) {
+            continue;
+        }
+        frame_milliseconds = frame_milliseconds.value_or(0) + *scope_milliseconds[i];
+        auto& scope = scopes[i];
+        auto& value = scope.history[scope.num_frames % HistoryLength];
+        if (scope.num_frames >= HistoryLength) {
+            scope.sum -= value;
+        }
+        value = *scope_milliseconds[i];
+        scope.sum += value;
+        scope.num_frames++;
+        if (scope_statistics[i]) {
+            scope.statistics = scope_statistics[i];
+        }
+    }
+    if (frame_milliseconds) {
+        if (frame_times.size() >= HistoryLength) { // Not taken
+            frame_times.erase(frame_times.begin());
+        }
+        frame_times.push_back({
+            .frame = frame.frame,
+            .milliseconds = *frame_milliseconds,
+        });
+    }
+}
+
+std::vector<VulkanProfiler::ScopeStats> VulkanProfiler::GetStats() const {
+    std::vector<ScopeStats> stats;
+    for (const auto& scope : scopes) {
+        if (scope.num_frames == 0) {
+            continue;
+        }
+        stats.push_back({
+            .name = scope.name,
+            .milliseconds = scope.sum / std::min(scope.num_frames, HistoryLength),
+            .statistics = scope.statistics,
+        });
+    }
+    return stats;
+}
+
+std::string VulkanProfiler::GetReport() const {
+    std::string report;
+    for (const auto& stats : GetStats()) {
+        report += fmt::format("{}: {:.3f} ms", stats.name, stats.milliseconds);
+        if (const auto& statistics = stats.statistics) {
+            report += fmt::format(" (vertices: {}, primitives: {}, fragments: {}, compute: {})",
+                                  statistics->vertex_invocations,
+                                  statistics->clipping_primitives,
+                                  statistics->fragment_invocations,
+                                  statistics->compute_invocations);
+        }
+        report += '\n';
+    }
+    return report;
+}
+
+std::vector<VulkanProfiler::FrameTime> VulkanProfiler::TakeFrameTimes() {
+    // Keeps the capacity, so that the frames read back later do not allocate
+    auto taken = frame_times;
+    frame_times.clear();
+    return taken;
+}
+
+} // namespace Renderer
@@ -0,0 +1,157 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <array>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+#include "common/profiling.h"
+
+#ifdef ENABLE_TRACY
+#include <tracy/TracyVulkan.hpp>
+#endif
+
+namespace Renderer {
+
+class VulkanDevice;
+
+/**
+ * GPU time of named scopes of the frames, measured with timestamp queries, and the pipeline
+ * statistics of the outermost scopes where the device supports them. Every command buffer of a
+ * frame in flight records into a slot of its own, whose results are read back when the slot
+ * begins again, once the frame in flight has been waited for. That is a few frames
+ * late, but never waits for the GPU: results that are not available yet are dropped.
+ *
+ * Scopes of the same name in one frame add up. Each scope reports the average of its last
+ * frames. Not thread safe.
+ *
+ * With Tracy (see common/profiling.h), every Scope is also a GPU zone of its command buffer.
+ */
+class VulkanProfiler : NonCopyable {
+public:
+    // Frames each scope is averaged over
+    static constexpr std::size_t HistoryLength = 64;
+    // Per slot, further scopes are not measured
+    static constexpr u32 MaxScopes = 32;
+
+    struct PipelineStatistics {
+        u64 vertex_invocations{};
+        u64 clipping_primitives{}; // Output by clipping, i.e. rasterized
+        u64 fragment_invocations{};
+        u64 compute_invocations{};
+    };
+    struct ScopeStats {
+        std::string name;
+        double milliseconds{}; // Averaged
+        // Of the last frame, empty if not measured
+        std::optional<PipelineStatistics> statistics;
+    };
+    struct FrameTime {
+        u64 frame{};           // Counted by BeginFrame, from 0
+        double milliseconds{}; // Total of its scopes
+    };
+
+    explicit VulkanProfiler(const VulkanDevice& device, std::size_t num_slots);
+    ~VulkanProfiler();
+
+    // Reads back the results of the previous frame of the slot and resets its queries. Must be
+    // recorded before its scopes, outside of render passes.
+    void BeginFrame(const vk::raii::CommandBuffer& cmd, std::size_t slot);
+
+    // Scopes may end in a later command buffer of the same frame, if they have no pipeline
+    // statistics. Returns the scope to end, or nothing if it is not measured.
+    std::optional<u32> BeginScope(const vk::raii::CommandBuffer& cmd, std::size_t slot,
+                                  std::string_view name, bool statistics = true);
+    void EndScope(const vk::raii::CommandBuffer& cmd, std::size_t slot,
+                  std::optional<u32> query,
+                  vk::PipelineStageFlags2 stages = vk::PipelineStageFlagBits2::eAllCommands);
+
+    // Times the enclosing block of commands of one command buffer. Does nothing if the
+    // profiler is null.
+    class Scope : NonCopyable {
+    public:
+        explicit Scope(VulkanProfiler* profiler, const vk::raii::CommandBuffer& cmd,
+                       std::size_t slot, std::string_view name,
+                       vk::PipelineStageFlags2 stages = vk::PipelineStageFlagBits2::eAllCommands);
+        ~Scope();
+
+    private:
+        VulkanProfiler* profiler{};
+        const vk::raii::CommandBuffer& cmd;
+        std::size_t slot{};
+        vk::PipelineStageFlags2 stages;
+        std::optional<u32> query;
+#ifdef ENABLE_TRACY
+        std::optional<tracy::VkCtxScope> zone;
+#endif
+    };
+
+    // In the order the scopes were first begun
+    std::vector<ScopeStats> GetStats() const;
+    // One line per scope
+    std::string GetReport() const;
+    // Of each frame, unlike GetStats, e.g. for benchmarks. Those read back since the last call,
+    // in order, up to HistoryLength. Frames whose results were dropped are missing.
+    std::vector<FrameTime> TakeFrameTimes();
+
+private:
+    struct Record {
+        std::size_t scope_idx{};
+        std::optional<u32> statistics_query;
+    };
+    struct Slot {
+        u64 frame{};
+        std::vector<Record> records; // Indexed by their timestamp query pair
+        bool statistics_active{};    // Pipeline statistics queries may not be nested
+        u32 num_statistics{};
+    };
+    struct ScopeHistory {
+        std::string name;
+        std::array<double, HistoryLength> history{}; // Milliseconds of each frame
+        std::size_t num_frames{};
+        double sum{};
+        std::optional<PipelineStatistics> statistics;
+    };
+
+    // Looks names up without copying them into strings
+    struct NameHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view name) const noexcept {
+            return std::hash<std::string_view>{}(name);
+        }
+    };
+
+    // Adds the scope if it is new
+    std::size_t GetScopeIndex(std::string_view name);
+    void ReadBack(std::size_t slot);
+
+    const VulkanDevice& device;
+    float timestamp_period{}; // Nanoseconds per tick
+    bool pipeline_statistics{};
+    vk::raii::QueryPool timestamp_pool = nullptr;  // MaxScopes pairs per slot
+    vk::raii::QueryPool statistics_pool = nullptr; // MaxScopes per slot
+    std::vector<Slot> slots;
+    std::vector<ScopeHistory> scopes;
+    std::unordered_map<std::string, std::size_t, NameHash, std::equal_to<>> scope_indices;
+    u64 num_frames{}; // Begun
+    std::vector<FrameTime> frame_times;
+    // Totals of the scopes in the frame read back, kept so that reading back does not allocate
+    std::vector<std::optional<double>> scope_milliseconds;
+    std::vector<std::optional<PipelineStatistics>> scope_statistics;
+#ifdef ENABLE_TRACY
+    tracy::VkCtx* tracy_context{};
+    // Of each scope, named by the keys of scope_indices, which zones need to outlive them
+    std::deque<tracy::SourceLocationData> tracy_locations;
+#endif
+};
+
+} // namespace Renderer
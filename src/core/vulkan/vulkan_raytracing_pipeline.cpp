@@ -3,41 +3,78 @@
 // Refer to the license.txt file included.
 
 #include <cstring>
+#include <ranges>
 #include <vector>
 #include "common/alignment.h"
+#include "common/ranges.h"
 #include "core/vulkan/vulkan_buffer.h"
 #include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_helpers.hpp"
 #include "core/vulkan/vulkan_raytracing_pipeline.h"
 
 namespace Renderer {
 
 VulkanRayTracingPipeline::VulkanRayTracingPipeline(
-    const VulkanDevice& device, vk::RayTracingPipelineCreateInfoKHR create_info,
-    vk::PipelineLayoutCreateInfo pipeline_layout_info) {
+    const VulkanDevice& device, std::string_view name,
+    vk::RayTracingPipelineCreateInfoKHR create_info,
+    vk::PipelineLayoutCreateInfo pipeline_layout_info,
+    std::span<const VulkanRayTracingPipeline* const> libraries,
+    const vk::raii::PipelineCache* pipeline_cache) {
 
     pipeline_layout = vk::raii::PipelineLayout{*device, pipeline_layout_info};
 
+    const auto library_handles = Common::VectorFromRange(
+        libraries | std::views::transform([](const auto* library) { return **library; }));
+    const vk::PipelineLibraryCreateInfoKHR library_info{
+        .libraryCount = static_cast<u32>(library_handles.size()),
+        .pLibraries = library_handles.data(),
+    };
+    if (!libraries.empty()) {
+        create_info.pLibraryInfo = &library_info;
+    }
+    vk::PipelineCreationFeedback feedback;
+    const vk::PipelineCreationFeedbackCreateInfo feedback_info{
+        .pNext = create_info.pNext,
+        .pPipelineCreationFeedback = &feedback,
+    };
+    create_info.pNext = &feedback_info;
     create_info.layout = *pipeline_layout;
-    pipeline = vk::raii::Pipeline{*device, nullptr, device.pipeline_cache, create_info};
+    // Libraries must agree with the pipelines linking them
+    if (device.descriptor_buffer) {
+        create_info.flags |= vk::PipelineCreateFlagBits::eDescriptorBufferEXT;
+    }
+    pipeline = vk::raii::Pipeline{*device, nullptr,
+                                  pipeline_cache ? *pipeline_cache : device.pipeline_cache,
+                                  create_info};
+    Helpers::LogPipelineCreationFeedback(name, feedback);
+
+    for (std::size_t i = 0; i < create_info.groupCount; ++i) {
+        const auto& group_info = create_info.pGroups[i];
+        group_stages.emplace_back(group_info.type == vk::RayTracingShaderGroupTypeKHR::eGeneral
+                                      ? create_info.pStages[group_info.generalShader].stage
+                                      : vk::ShaderStageFlagBits::eClosestHitKHR);
+    }
+    for (const auto* library : libraries) {
+        group_stages.insert(group_stages.end(), library->group_stages.begin(),
+                            library->group_stages.end());
+    }
+    if (create_info.flags & vk::PipelineCreateFlagBits::eLibraryKHR) {
+        return;
+    }
 
     // Count the groups
     u32 count_rgen = 0;
     u32 count_miss = 0;
     u32 count_hit = 0;
     u32 count_call = 0;
-    for (std::size_t i = 0; i < create_info.groupCount; ++i) {
-        const auto& group_info = create_info.pGroups[i];
-        if (group_info.type == vk::RayTracingShaderGroupTypeKHR::eGeneral) {
-            const auto stage = create_info.pStages[group_info.generalShader].stage;
-            if (stage == vk::ShaderStageFlagBits::eRaygenKHR) {
-                count_rgen++;
-            } else if (stage == vk::ShaderStageFlagBits::eMissKHR) {
-                count_miss++;
-            } else if (stage == vk::ShaderStageFlagBits::eCallableKHR) {
-                count_call++;
-            }
-        } else if (group_info.type == vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup ||
-                   group_info.type == vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup) {
+    for (const auto stage : group_stages) {
+        if (stage == vk::ShaderStageFlagBits::eRaygenKHR) {
+            count_rgen++;
+        } else if (stage == vk::ShaderStageFlagBits::eMissKHR) {
+            count_miss++;
+        } else if (stage == vk::ShaderStageFlagBits::eCallableKHR) {
+            count_call++;
+        } else {
             count_hit++;
         }
     }
@@ -84,7 +121,8 @@ VulkanRayTracingPipeline::VulkanRayTracingPipeline(
             .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
                      VMA_ALLOCATION_CREATE_MAPPED_BIT,
             .usage = VMA_MEMORY_USAGE_AUTO,
-        });
+        },
+        MemoryCategory::Other);
     const auto address = device->getBufferAddress({
         .buffer = **sbt_buffer,
     });
@@ -94,8 +132,9 @@ VulkanRayTracingPipeline::VulkanRayTracingPipeline(
     call_region.deviceAddress = hit_region.deviceAddress + hit_region.size;
 
     // Write handles
+    const auto num_groups = static_cast<u32>(group_stages.size());
     const auto& handles = pipeline.getRayTracingShaderGroupHandlesKHR<u8>(
-        0, create_info.groupCount, properties.shaderGroupHandleSize * create_info.groupCount);
+        0, num_groups, properties.shaderGroupHandleSize * num_groups);
 
     std::vector<u8> sbt_temp(sbt_buffer->size);
     const auto WriteHandle = [this, &properties = properties, &address, &handles,
@@ -112,19 +151,15 @@ VulkanRayTracingPipeline::VulkanRayTracingPipeline(
     u32 written_miss = 0;
     u32 written_hit = 0;
     u32 written_call = 0;
-    for (std::size_t i = 0; i < create_info.groupCount; ++i) {
-        const auto& group_info = create_info.pGroups[i];
-        if (group_info.type == vk::RayTracingShaderGroupTypeKHR::eGeneral) {
-            const auto stage = create_info.pStages[group_info.generalShader].stage;
-            if (stage == vk::ShaderStageFlagBits::eRaygenKHR) {
-                WriteHandle(rgen_region, i, written_rgen);
-            } else if (stage == vk::ShaderStageFlagBits::eMissKHR) {
-                WriteHandle(miss_region, i, written_miss);
-            } else if (stage == vk::ShaderStageFlagBits::eCallableKHR) {
-                WriteHandle(call_region, i, written_call);
-            }
-        } else if (group_info.type == vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup ||
-                   group_info.type == vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup) {
+    for (std::size_t i = 0; i < group_stages.size(); ++i) {
+        const auto stage = group_stages[i];
+        if (stage == vk::ShaderStageFlagBits::eRaygenKHR) {
+            WriteHandle(rgen_region, i, written_rgen);
+        } else if (stage == vk::ShaderStageFlagBits::eMissKHR) {
+            WriteHandle(miss_region, i, written_miss);
+        } else if (stage == vk::ShaderStageFlagBits::eCallableKHR) {
+            WriteHandle(call_region, i, written_call);
+        } else {
             WriteHandle(hit_region, i, written_hit);
         }
     }
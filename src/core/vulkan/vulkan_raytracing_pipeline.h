@@ -5,6 +5,9 @@
 #pragma once
 
 #include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
 
@@ -31,11 +34,22 @@ constexpr vk::RayTracingShaderGroupCreateInfoKHR TrianglesGroup(
     return in_info;
 }
 
+/**
+ * Ray tracing pipeline and its shader binding table, with all the groups of each kind in order.
+ * Pipeline libraries (VK_KHR_pipeline_library, eLibraryKHR in the flags of the create info) have
+ * no shader binding table. Pipelines linked from libraries get the groups of the libraries after
+ * their own, in the order of the libraries, whose layouts must match.
+ *
+ * The pipeline cache defaults to that of the device.
+ */
 class VulkanRayTracingPipeline : NonCopyable {
 public:
-    explicit VulkanRayTracingPipeline(const VulkanDevice& device,
-                                      vk::RayTracingPipelineCreateInfoKHR create_info,
-                                      vk::PipelineLayoutCreateInfo pipeline_layout_info);
+    explicit VulkanRayTracingPipeline(
+        const VulkanDevice& device, std::string_view name,
+        vk::RayTracingPipelineCreateInfoKHR create_info,
+        vk::PipelineLayoutCreateInfo pipeline_layout_info,
+        std::span<const VulkanRayTracingPipeline* const> libraries = {},
+        const vk::raii::PipelineCache* pipeline_cache = nullptr);
     ~VulkanRayTracingPipeline();
 
     vk::Pipeline operator*() const noexcept {
@@ -47,6 +61,9 @@ public:
     vk::raii::Pipeline pipeline = nullptr;
     vk::raii::PipelineLayout pipeline_layout = nullptr;
 
+    // Of each group including those of the libraries, the closest hit stage for hit groups
+    std::vector<vk::ShaderStageFlagBits> group_stages;
+
     vk::StridedDeviceAddressRegionKHR rgen_region;
     vk::StridedDeviceAddressRegionKHR miss_region;
     vk::StridedDeviceAddressRegionKHR hit_region;
@@ -0,0 +1,172 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include "common/assert.h"
+#include "core/vulkan/vulkan_profiler.h"
+#include "core/vulkan/vulkan_render_graph.h"
+
+namespace Renderer {
+
+// Any other access only reads
+static constexpr vk::AccessFlags2 WriteAccess =
+    vk::AccessFlagBits2::eShaderWrite | vk::AccessFlagBits2::eShaderStorageWrite |
+    vk::AccessFlagBits2::eColorAttachmentWrite |
+    vk::AccessFlagBits2::eDepthStencilAttachmentWrite | vk::AccessFlagBits2::eTransferWrite |
+    vk::AccessFlagBits2::eHostWrite | vk::AccessFlagBits2::eMemoryWrite |
+    vk::AccessFlagBits2::eAccelerationStructureWriteKHR;
+
+VulkanRenderGraph::VulkanRenderGraph(std::pmr::memory_resource* upstream)
+    : memory(upstream), resources(&memory), passes(&memory), exports(&memory) {}
+
+VulkanRenderGraph::~VulkanRenderGraph() = default;
+
+VulkanRenderGraph::Resource VulkanRenderGraph::ImportBuffer(const Access& last_access) {
+    return Import({}, {}, last_access);
+}
+
+VulkanRenderGraph::Resource VulkanRenderGraph::ImportImage(
+    vk::Image image, const Access& last_access,
+    const vk::ImageSubresourceRange& subresource_range) {
+
+    return Import(image, subresource_range, last_access);
+}
+
+VulkanRenderGraph::Resource VulkanRenderGraph::Import(
+    vk::Image image, const vk::ImageSubresourceRange& subresource_range,
+    const Access& last_access) {
+
+    auto& state = resources.emplace_back(ResourceState{
+        .image = image,
+        .subresource_range = subresource_range,
+        .layout = last_access.layout,
+    });
+    if (last_access.access & WriteAccess) {
+        state.write_stages = last_access.stages;
+        state.write_access = last_access.access & WriteAccess;
+    }
+    if (last_access.access & ~WriteAccess) {
+        state.read_stages = last_access.stages;
+    }
+    return resources.size() - 1;
+}
+
+void VulkanRenderGraph::AddPass(std::string_view name, std::span<const ResourceAccess> accesses,
+                                const void* record, RecordThunk thunk) {
+    auto* merged = static_cast<ResourceAccess*>(
+        memory.allocate(accesses.size() * sizeof(ResourceAccess), alignof(ResourceAccess)));
+    std::size_t num_merged = 0;
+    for (const auto& [resource, access] : accesses) {
+        const auto end = merged + num_merged;
+        const auto it = std::ranges::find(merged, end, resource, &ResourceAccess::resource);
+        if (it == end) {
+            std::construct_at(end, ResourceAccess{resource, access});
+            ++num_merged;
+            continue;
+        }
+        ASSERT_MSG(it->access.layout == access.layout, "Conflicting layouts in one pass");
+        it->access.stages |= access.stages;
+        it->access.access |= access.access;
+    }
+    passes.push_back({
+        .name = name,
+        .accesses = {merged, num_merged},
+        .record = record,
+        .thunk = thunk,
+    });
+}
+
+void VulkanRenderGraph::Export(Resource resource, const Access& next_access) {
+    exports.push_back({resource, next_access});
+}
+
+void VulkanRenderGraph::Transition(ResourceState& state, const Access& access,
+                                   Barriers& barriers) const {
+    const bool layout_change = state.image && access.layout != state.layout;
+    vk::PipelineStageFlags2 src_stages;
+    vk::AccessFlags2 src_access;
+    if ((access.access & WriteAccess) || layout_change) {
+        // After the last write, and the reads since, which must not see this one
+        src_stages = state.write_stages | state.read_stages;
+        src_access = state.write_access;
+        state.write_stages = access.stages;
+        state.write_access = access.access & WriteAccess;
+        state.visible_stages = {};
+        state.visible_access = {};
+        state.read_stages = {};
+    } else {
+        state.read_stages |= access.stages;
+        const bool visible = (access.stages & ~state.visible_stages) == vk::PipelineStageFlags2{} &&
+                             (access.access & ~state.visible_access) == vk::AccessFlags2{};
+        if (!state.write_access || visible) {
+            return;
+        }
+        src_stages = state.write_stages;
+        src_access = state.write_access;
+        // Only the last one is kept, as the union of two would also cover pairs of the stages of
+        // one and the accesses of the other
+        state.visible_stages = access.stages;
+        state.visible_access = access.access;
+    }
+
+    if (layout_change) {
+        barriers.image_barriers.push_back({
+            .srcStageMask = src_stages,
+            .srcAccessMask = src_access,
+            .dstStageMask = access.stages,
+            .dstAccessMask = access.access,
+            .oldLayout = state.layout,
+            .newLayout = access.layout,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = state.image,
+            .subresourceRange = state.subresource_range,
+        });
+        state.layout = access.layout;
+    } else if (src_stages) {
+        auto& memory_barrier = barriers.memory_barrier;
+        memory_barrier.srcStageMask |= src_stages;
+        memory_barrier.srcAccessMask |= src_access;
+        memory_barrier.dstStageMask |= access.stages;
+        memory_barrier.dstAccessMask |= access.access;
+    }
+}
+
+void VulkanRenderGraph::RecordBarriers(const vk::raii::CommandBuffer& cmd,
+                                       const Barriers& barriers) {
+    const bool memory_barrier = static_cast<bool>(barriers.memory_barrier.srcStageMask);
+    if (!memory_barrier && barriers.image_barriers.empty()) {
+        return;
+    }
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = memory_barrier ? 1u : 0u,
+        .pMemoryBarriers = &barriers.memory_barrier,
+        .imageMemoryBarrierCount = static_cast<u32>(barriers.image_barriers.size()),
+        .pImageMemoryBarriers = barriers.image_barriers.data(),
+    });
+}
+
+void VulkanRenderGraph::Execute(const vk::raii::CommandBuffer& cmd, VulkanProfiler* profiler,
+                                std::size_t profiler_slot) {
+    for (const auto& pass : passes) {
+        Barriers barriers{.image_barriers = std::pmr::vector<vk::ImageMemoryBarrier2>(&memory)};
+        for (const auto& [resource, access] : pass.accesses) {
+            Transition(resources[resource], access, barriers);
+        }
+        RecordBarriers(cmd, barriers);
+
+        const VulkanProfiler::Scope profile_scope{profiler, cmd, profiler_slot, pass.name};
+        pass.thunk(pass.record, cmd);
+    }
+
+    Barriers barriers{.image_barriers = std::pmr::vector<vk::ImageMemoryBarrier2>(&memory)};
+    for (const auto& [resource, access] : exports) {
+        Transition(resources[resource], access, barriers);
+    }
+    RecordBarriers(cmd, barriers);
+}
+
+} // namespace Renderer
@@ -0,0 +1,132 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <initializer_list>
+#include <memory_resource>
+#include <new>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanProfiler;
+
+/**
+ * Passes of a command buffer that declare the resources they read and write, so that the
+ * barriers between them are derived instead of written by hand. Each resource is tracked from
+ * the access it was last used with before the graph, and before each pass a single barrier
+ * covers what its accesses need: making earlier writes visible, waiting for earlier reads
+ * before writing, and transitioning the layouts of images. Reads that follow reads, or writes
+ * made visible already, get nothing. Buffers share a global memory barrier. Images only get
+ * barriers of their own to change layout.
+ *
+ * Passes are recorded in the order they were added, into one command buffer. Resources are
+ * whole buffers or image subresource ranges, and must not alias each other. Built per frame, in
+ * memory from the given resource (e.g. a Common::FrameArena) that is only released with the
+ * graph, so that building one need not allocate.
+ */
+class VulkanRenderGraph : NonCopyable {
+public:
+    struct Access {
+        vk::PipelineStageFlags2 stages;
+        vk::AccessFlags2 access;
+        vk::ImageLayout layout = vk::ImageLayout::eUndefined; // Of images
+    };
+    using Resource = std::size_t;
+    struct ResourceAccess {
+        Resource resource{};
+        Access access;
+    };
+
+    explicit VulkanRenderGraph(
+        std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+    ~VulkanRenderGraph();
+
+    // Last accessed with the given access before the graph, e.g. by an earlier frame. The
+    // default is unused, or used by submissions that have completed.
+    Resource ImportBuffer(const Access& last_access = {});
+    Resource ImportImage(vk::Image image, const Access& last_access,
+                         const vk::ImageSubresourceRange& subresource_range = {
+                             .aspectMask = vk::ImageAspectFlagBits::eColor,
+                             .baseMipLevel = 0,
+                             .levelCount = 1,
+                             .baseArrayLayer = 0,
+                             .layerCount = 1,
+                         });
+    // Accesses of the same resource are merged, and must agree on the layout. The name is
+    // that of the profiler scope of the pass, which adds up over passes of the same name, and
+    // must outlive the graph. The record function is called with the command buffer. It is
+    // copied into the memory of the graph and never destroyed, so it must be trivially
+    // destructible, e.g. a lambda capturing references and plain values.
+    template <typename Func>
+    void AddPass(std::string_view name, std::span<const ResourceAccess> accesses, Func&& record) {
+        using Record = std::remove_cvref_t<Func>;
+        static_assert(std::is_trivially_destructible_v<Record>, "Records are never destroyed");
+        const auto* stored = new (memory.allocate(sizeof(Record), alignof(Record)))
+            Record(std::forward<Func>(record));
+        AddPass(name, accesses, stored,
+                [](const void* stored_record, const vk::raii::CommandBuffer& cmd) {
+                    (*static_cast<const Record*>(stored_record))(cmd);
+                });
+    }
+    template <typename Func>
+    void AddPass(std::string_view name, std::initializer_list<ResourceAccess> accesses,
+                 Func&& record) {
+        AddPass(name, std::span{accesses.begin(), accesses.size()}, std::forward<Func>(record));
+    }
+    // Used with the access after the graph, e.g. by the next frame, for which a barrier is
+    // recorded after the passes.
+    void Export(Resource resource, const Access& next_access);
+
+    // Times the passes with the profiler, if not null
+    void Execute(const vk::raii::CommandBuffer& cmd, VulkanProfiler* profiler = nullptr,
+                 std::size_t profiler_slot = 0);
+
+private:
+    struct ResourceState {
+        vk::Image image; // Null for buffers
+        vk::ImageSubresourceRange subresource_range;
+        vk::ImageLayout layout{};
+        // Of the last write, and those it was made visible to since
+        vk::PipelineStageFlags2 write_stages;
+        vk::AccessFlags2 write_access;
+        vk::PipelineStageFlags2 visible_stages;
+        vk::AccessFlags2 visible_access;
+        vk::PipelineStageFlags2 read_stages; // Since the last write
+    };
+    using RecordThunk = void (*)(const void* record, const vk::raii::CommandBuffer& cmd);
+    struct Pass {
+        std::string_view name;
+        std::span<const ResourceAccess> accesses; // Merged, in memory
+        const void* record{};
+        RecordThunk thunk{};
+    };
+    struct Barriers {
+        vk::MemoryBarrier2 memory_barrier;
+        std::pmr::vector<vk::ImageMemoryBarrier2> image_barriers;
+    };
+
+    void AddPass(std::string_view name, std::span<const ResourceAccess> accesses,
+                 const void* record, RecordThunk thunk);
+
+    Resource Import(vk::Image image, const vk::ImageSubresourceRange& subresource_range,
+                    const Access& last_access);
+    // Adds what the access needs to the barriers, and moves the resource to its state after it
+    void Transition(ResourceState& state, const Access& access, Barriers& barriers) const;
+    static void RecordBarriers(const vk::raii::CommandBuffer& cmd, const Barriers& barriers);
+
+    std::pmr::monotonic_buffer_resource memory; // Of everything below
+    std::pmr::vector<ResourceState> resources;
+    std::pmr::vector<Pass> passes;
+    std::pmr::vector<ResourceAccess> exports;
+};
+
+} // namespace Renderer
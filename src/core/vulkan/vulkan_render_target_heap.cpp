@@ -0,0 +1,89 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <fmt/format.h>
+#include "common/assert.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_render_target_heap.h"
+
+namespace Renderer {
+
+VulkanRenderTargetHeap::VulkanRenderTargetHeap(const VulkanAllocator& allocator_)
+    : allocator(allocator_) {}
+
+VulkanRenderTargetHeap::~VulkanRenderTargetHeap() {
+    for (auto& memory : slots) {
+        Free(memory);
+    }
+}
+
+VulkanRenderTargetHeap::Slot VulkanRenderTargetHeap::AddSlot() {
+    slots.emplace_back();
+    return slots.size() - 1;
+}
+
+void VulkanRenderTargetHeap::Bind(Slot slot, VkImage image,
+                                  const VkMemoryRequirements& requirements, bool transient) {
+    auto& memory = slots[slot];
+    // Allocations are dedicated, so that they start at offset 0 and meet any alignment
+    const bool fits = memory.allocation && memory.transient == transient &&
+                      memory.allocation_info.size >= requirements.size &&
+                      (requirements.memoryTypeBits & (1u << memory.allocation_info.memoryType));
+    if (!fits) {
+        ASSERT_MSG(memory.num_images == 0, "Image does not fit the memory of those it aliases");
+        Free(memory);
+
+        const auto Allocate = [this, &memory, &requirements](VkMemoryPropertyFlags flags) {
+            const VmaAllocationCreateInfo create_info{
+                .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+                .usage = VMA_MEMORY_USAGE_UNKNOWN,
+                .requiredFlags = flags,
+                .priority = 1.0f,
+            };
+            return allocator.Allocate(MemoryCategory::RenderTargets, requirements.size,
+                                      create_info, [&](const auto& info) {
+                                          return vmaAllocateMemory(*allocator, &requirements,
+                                                                   &info, &memory.allocation,
+                                                                   &memory.allocation_info);
+                                      });
+        };
+        auto result = VK_ERROR_FEATURE_NOT_PRESENT;
+        if (transient) {
+            result = Allocate(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                              VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+        }
+        if (result != VK_SUCCESS) {
+            result = Allocate(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        }
+        if (result != VK_SUCCESS) {
+            vk::throwResultException(vk::Result{result}, "vmaAllocateMemory");
+        }
+        allocator.AddUsage(MemoryCategory::RenderTargets, memory.allocation_info.size);
+        allocator.SetAllocationName(memory.allocation, MemoryCategory::RenderTargets,
+                                    fmt::format("slot {}", slot));
+        memory.transient = transient;
+    }
+
+    const auto result = vmaBindImageMemory(*allocator, memory.allocation, image);
+    if (result != VK_SUCCESS) {
+        vk::throwResultException(vk::Result{result}, "vmaBindImageMemory");
+    }
+    memory.num_images++;
+}
+
+void VulkanRenderTargetHeap::Unbind(Slot slot) noexcept {
+    slots[slot].num_images--;
+}
+
+void VulkanRenderTargetHeap::Free(SlotMemory& memory) noexcept {
+    if (!memory.allocation) {
+        return;
+    }
+    allocator.RemoveUsage(MemoryCategory::RenderTargets, memory.allocation_info.size);
+    vmaFreeMemory(*allocator, memory.allocation);
+    memory.allocation = {};
+    memory.allocation_info = {};
+}
+
+} // namespace Renderer
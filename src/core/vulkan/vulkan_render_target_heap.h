@@ -0,0 +1,54 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanAllocator;
+
+/**
+ * Memory of the render targets, which are recreated at the extent of the swap chain on resize.
+ * Images are placed into slots, each a block of memory that is kept across their recreation:
+ * one that still fits, e.g. after shrinking, is bound to the same memory again instead of
+ * allocating anew. Images of the same slot alias its memory, for those whose uses never overlap.
+ *
+ * Transient attachments (with vk::ImageUsageFlagBits::eTransientAttachment) are placed into
+ * lazily allocated memory where the device has any, which tilers may never back at all.
+ */
+class VulkanRenderTargetHeap : NonCopyable {
+public:
+    using Slot = std::size_t;
+
+    explicit VulkanRenderTargetHeap(const VulkanAllocator& allocator);
+    ~VulkanRenderTargetHeap();
+
+    Slot AddSlot();
+
+    // Used by VulkanImage. The memory of the slot is reallocated if the image does not fit,
+    // which requires that no other image is bound to it.
+    void Bind(Slot slot, VkImage image, const VkMemoryRequirements& requirements,
+              bool transient);
+    void Unbind(Slot slot) noexcept;
+
+    const VulkanAllocator& allocator;
+
+private:
+    struct SlotMemory {
+        VmaAllocation allocation{};
+        VmaAllocationInfo allocation_info{};
+        bool transient{}; // Requested, whether or not the memory is lazily allocated
+        std::size_t num_images{};
+    };
+    void Free(SlotMemory& memory) noexcept;
+
+    std::vector<SlotMemory> slots;
+};
+
+} // namespace Renderer
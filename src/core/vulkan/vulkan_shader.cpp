@@ -2,22 +2,37 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
-#include "common/file_util.h"
+#include <stdexcept>
+#include <spdlog/spdlog.h>
+#include "core/vulkan/vulkan_device.h"
 #include "core/vulkan/vulkan_shader.h"
 
 namespace Renderer {
 
-VulkanShader::VulkanShader(const vk::raii::Device& device, const std::filesystem::path& path) {
-    const auto file_path = (std::filesystem::path{u8"shaders"} / path).concat(u8".spv");
-    const auto& code = Common::ReadFileContents(file_path);
+VulkanShaderCache::VulkanShaderCache(const vk::raii::Device& device_) : device(device_) {}
+
+VulkanShaderCache::~VulkanShaderCache() = default;
+
+vk::ShaderModule VulkanShaderCache::Get(const std::filesystem::path& path) {
+    const auto key = path.generic_u8string();
+
+    std::lock_guard lock{mutex};
+    if (const auto it = modules.find(key); it != modules.end()) {
+        return *it->second;
+    }
+    const auto code = GetEmbeddedShader(key);
     if (code.empty()) {
-        throw std::runtime_error("Unable to read shader file");
+        SPDLOG_ERROR("Shader {} is not embedded", path.string());
+        throw std::runtime_error("Shader not embedded");
     }
-
-    shader_module = vk::raii::ShaderModule{
-        device, {.codeSize = code.size(), .pCode = reinterpret_cast<const u32*>(code.data())}};
+    const auto& [it, inserted] = modules.emplace(
+        key, vk::raii::ShaderModule{device, {.codeSize = code.size_bytes(), .pCode = code.data()}});
+    return *it->second;
 }
 
+VulkanShader::VulkanShader(const VulkanDevice& device, const std::filesystem::path& path)
+    : shader_module(device.shader_cache->Get(path)) {}
+
 VulkanShader::~VulkanShader() = default;
 
 } // namespace Renderer
@@ -5,24 +5,52 @@
 #pragma once
 
 #include <filesystem>
-#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
 
 namespace Renderer {
 
+class VulkanDevice;
+
+// SPIR-V of the shader compiled by target_shaders into the library, by the path of its source
+// relative to src (e.g. core/shaders/postprocessing.vert). Empty if there is none.
+std::span<const u32> GetEmbeddedShader(std::u8string_view path);
+
+/**
+ * Shader modules of the embedded shaders, each created once and kept until the device is
+ * destroyed. Thread safe.
+ */
+class VulkanShaderCache : NonCopyable {
+public:
+    explicit VulkanShaderCache(const vk::raii::Device& device);
+    ~VulkanShaderCache();
+
+    vk::ShaderModule Get(const std::filesystem::path& path);
+
+private:
+    const vk::raii::Device& device;
+    std::mutex mutex;
+    std::unordered_map<std::u8string, vk::raii::ShaderModule> modules;
+};
+
+// Shader module of an embedded shader, owned by the shader cache of the device
 class VulkanShader : NonCopyable {
 public:
-    explicit VulkanShader(const vk::raii::Device& device, const std::filesystem::path& path);
+    explicit VulkanShader(const VulkanDevice& device, const std::filesystem::path& path);
     ~VulkanShader();
 
     const vk::ShaderModule& operator*() const noexcept {
-        return *shader_module;
+        return shader_module;
     }
 
 private:
-    vk::raii::ShaderModule shader_module = nullptr;
+    vk::ShaderModule shader_module;
 };
 
 } // namespace Renderer
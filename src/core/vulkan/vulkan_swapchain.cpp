@@ -2,11 +2,21 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <algorithm>
 #include <limits>
 #include <spdlog/spdlog.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <vulkan/vulkan_win32.h>
+#endif
+#include "common/profiling.h"
 #include "common/temp_ptr.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
 #include "core/vulkan/vulkan_device.h"
 #include "core/vulkan/vulkan_swapchain.h"
+#include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_video_encoder.h"
 
 namespace Renderer {
 
@@ -20,23 +30,102 @@ static vk::SurfaceFormatKHR SelectSurfaceFormat(const std::vector<vk::SurfaceFor
     return formats[0];
 }
 
-static vk::PresentModeKHR SelectPresentMode(const std::vector<vk::PresentModeKHR>& present_modes) {
-    for (const auto mode : present_modes) {
-        if (mode == vk::PresentModeKHR::eMailbox) {
-            return mode;
+// sRGB formats can rarely be storage images, so the UNORM ones are written sRGB encoded instead
+static std::optional<vk::SurfaceFormatKHR> SelectStorageSurfaceFormat(
+    const vk::raii::PhysicalDevice& physical_device,
+    const std::vector<vk::SurfaceFormatKHR>& formats) {
+    for (const auto format : formats) {
+        if (format.colorSpace != vk::ColorSpaceKHR::eSrgbNonlinear ||
+            (format.format != vk::Format::eB8G8R8A8Unorm &&
+             format.format != vk::Format::eR8G8B8A8Unorm)) {
+            continue;
+        }
+        if (physical_device.getFormatProperties(format.format).optimalTilingFeatures &
+            vk::FormatFeatureFlagBits::eStorageImage) {
+            return format;
         }
     }
+    return std::nullopt;
+}
+
+static vk::PresentModeKHR SelectPresentMode(const std::vector<vk::PresentModeKHR>& present_modes,
+                                            VulkanSwapchain::Pacing pacing) {
+    // FIFO is always supported, and queues no more frames than are waited for
+    if (pacing == VulkanSwapchain::Pacing::LowLatency) {
+        return vk::PresentModeKHR::eFifo;
+    }
+    const auto IsSupported = [&present_modes](vk::PresentModeKHR mode) {
+        return std::ranges::find(present_modes, mode) != present_modes.end();
+    };
+    if (pacing == VulkanSwapchain::Pacing::Immediate &&
+        IsSupported(vk::PresentModeKHR::eImmediate)) {
+        return vk::PresentModeKHR::eImmediate;
+    }
+    if (IsSupported(vk::PresentModeKHR::eMailbox)) {
+        return vk::PresentModeKHR::eMailbox;
+    }
     return present_modes[0];
 }
 
-VulkanSwapchain::VulkanSwapchain(const VulkanDevice& device_, const vk::Extent2D& extent_)
-    : device(device_) {
-    surface_format =
-        SelectSurfaceFormat(device.physical_device.getSurfaceFormatsKHR(*device.surface));
-    const auto present_mode =
-        SelectPresentMode(device.physical_device.getSurfacePresentModesKHR(*device.surface));
+// Opaque handles, only importable by the same driver
+#ifdef _WIN32
+constexpr auto ExportMemoryHandleType = vk::ExternalMemoryHandleTypeFlagBits::eOpaqueWin32;
+constexpr auto ExportSemaphoreHandleType = vk::ExternalSemaphoreHandleTypeFlagBits::eOpaqueWin32;
+#else
+constexpr auto ExportMemoryHandleType = vk::ExternalMemoryHandleTypeFlagBits::eOpaqueFd;
+constexpr auto ExportSemaphoreHandleType = vk::ExternalSemaphoreHandleTypeFlagBits::eOpaqueFd;
+#endif
+
+// Of headless images, sampled by importers and VulkanVideoEncoder
+static vk::ImageUsageFlags GetOffscreenUsage(bool storage) {
+    return vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc |
+           vk::ImageUsageFlagBits::eSampled |
+           (storage ? vk::ImageUsageFlagBits::eStorage : vk::ImageUsageFlags{});
+}
+
+// Presents that may never be displayed, e.g. of minimized windows, do not stall the frames
+static constexpr u64 PacingTimeout = 100'000'000; // 100 ms
+// Weight of each frame in the average latency
+static constexpr double LatencySmoothing = 0.1;
+// Older presents are no longer measured
+static constexpr std::size_t MaxPendingPresents = 16;
+
+VulkanSwapchain::VulkanSwapchain(const VulkanDevice& device_, vk::SurfaceKHR surface,
+                                 const vk::Extent2D& extent_, FrameCallback frame_callback_,
+                                 bool hdr_readback, bool storage, Pacing pacing_,
+                                 const ExportCallback& export_callback, u32 export_image_count,
+                                 vk::SwapchainKHR old_swap_chain)
+    : device(device_), frame_callback(std::move(frame_callback_)), pacing(pacing_) {
+
+    if (!surface) {
+        extent = extent_;
+        if (export_callback && !device.external_frames) {
+            SPDLOG_WARN("Frames cannot be exported without external memory, reading them back");
+        }
+        const bool exported = export_callback && device.external_frames;
+        CreateOffscreenImages(hdr_readback, storage,
+                              exported ? std::max(export_image_count, 1u) : HeadlessImageCount,
+                              exported);
+        if (IsExported()) {
+            export_callback(GetExportedFrames());
+        }
+        return;
+    }
+
+    const auto& capabilities = device.physical_device.getSurfaceCapabilitiesKHR(surface);
+    const auto& formats = device.physical_device.getSurfaceFormatsKHR(surface);
+    std::optional<vk::SurfaceFormatKHR> storage_format;
+    if (storage && (capabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eStorage)) {
+        storage_format = SelectStorageSurfaceFormat(device.physical_device, formats);
+    }
+    storage_images = storage_format.has_value();
+    encode_srgb = storage_images;
+    surface_format = storage_format.value_or(SelectSurfaceFormat(formats));
+    const auto present_mode = SelectPresentMode(
+        device.physical_device.getSurfacePresentModesKHR(surface), pacing);
+    present_ids = device.present_wait;
+    pending_presents.reserve(MaxPendingPresents + 1);
 
-    const auto& capabilities = device.physical_device.getSurfaceCapabilitiesKHR(*device.surface);
     extent = vk::Extent2D{
         std::clamp(extent_.width, capabilities.minImageExtent.width,
                    capabilities.maxImageExtent.width),
@@ -47,13 +136,15 @@ VulkanSwapchain::VulkanSwapchain(const VulkanDevice& device_, const vk::Extent2D
     swap_chain = vk::raii::SwapchainKHR{
         *device,
         {
-            .surface = *device.surface,
+            .surface = surface,
             .minImageCount = image_count,
             .imageFormat = surface_format.format,
             .imageColorSpace = surface_format.colorSpace,
             .imageExtent = extent,
             .imageArrayLayers = 1,
-            .imageUsage = vk::ImageUsageFlagBits::eColorAttachment,
+            .imageUsage = vk::ImageUsageFlagBits::eColorAttachment |
+                          (storage_images ? vk::ImageUsageFlagBits::eStorage
+                                          : vk::ImageUsageFlags{}),
             .imageSharingMode = device.queue_family_indices.size() > 1
                                     ? vk::SharingMode::eConcurrent
                                     : vk::SharingMode::eExclusive,
@@ -61,11 +152,12 @@ VulkanSwapchain::VulkanSwapchain(const VulkanDevice& device_, const vk::Extent2D
             .pQueueFamilyIndices = device.queue_family_indices.data(),
             .preTransform = capabilities.currentTransform,
             .presentMode = present_mode,
-            .oldSwapchain = *swap_chain,
+            .oldSwapchain = old_swap_chain,
         }};
 
+    images = swap_chain.getImages();
     image_views.clear();
-    for (const auto& image : swap_chain.getImages()) {
+    for (const auto& image : images) {
         image_views.emplace_back(*device, vk::ImageViewCreateInfo{
                                               .image = image,
                                               .viewType = vk::ImageViewType::e2D,
@@ -82,7 +174,339 @@ VulkanSwapchain::VulkanSwapchain(const VulkanDevice& device_, const vk::Extent2D
     }
 }
 
-VulkanSwapchain::~VulkanSwapchain() = default;
+VulkanSwapchain::~VulkanSwapchain() {
+    video_encoder.reset(); // Of the images
+    readbacks.clear(); // Their images may be allocated from the pool
+    if (export_pool) {
+        vmaDestroyPool(**device.allocator, export_pool);
+    }
+}
+
+bool VulkanSwapchain::CanExport(vk::Format format, vk::ImageUsageFlags usage) const {
+    try {
+        const auto image_properties =
+            device.physical_device
+                .getImageFormatProperties2<vk::ImageFormatProperties2,
+                                           vk::ExternalImageFormatProperties>(
+                    vk::StructureChain{
+                        vk::PhysicalDeviceImageFormatInfo2{
+                            .format = format,
+                            .type = vk::ImageType::e2D,
+                            .tiling = vk::ImageTiling::eOptimal,
+                            .usage = usage,
+                        },
+                        vk::PhysicalDeviceExternalImageFormatInfo{
+                            .handleType = ExportMemoryHandleType,
+                        },
+                    }
+                        .get<vk::PhysicalDeviceImageFormatInfo2>());
+        if (!(image_properties.get<vk::ExternalImageFormatProperties>()
+                  .externalMemoryProperties.externalMemoryFeatures &
+              vk::ExternalMemoryFeatureFlagBits::eExportable)) {
+            return false;
+        }
+    } catch (const vk::FormatNotSupportedError&) {
+        return false;
+    }
+    const vk::SemaphoreTypeCreateInfo timeline_info{
+        .semaphoreType = vk::SemaphoreType::eTimeline,
+    };
+    return static_cast<bool>(device.physical_device
+                                 .getExternalSemaphoreProperties({
+                                     .pNext = &timeline_info,
+                                     .handleType = ExportSemaphoreHandleType,
+                                 })
+                                 .externalSemaphoreFeatures &
+                             vk::ExternalSemaphoreFeatureFlagBits::eExportable);
+}
+
+void VulkanSwapchain::CreateExportPool(const vk::ImageCreateInfo& image_create_info) {
+    const VkImageCreateInfo& image_create_info_raw = image_create_info;
+    const VmaAllocationCreateInfo alloc_create_info{
+        .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+        .usage = VMA_MEMORY_USAGE_AUTO,
+    };
+    u32 memory_type_index{};
+    if (vmaFindMemoryTypeIndexForImageInfo(**device.allocator, &image_create_info_raw,
+                                           &alloc_create_info,
+                                           &memory_type_index) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to find memory type of exported frames");
+    }
+    export_allocate_info = vk::ExportMemoryAllocateInfo{
+        .handleTypes = ExportMemoryHandleType,
+    };
+    const VmaPoolCreateInfo pool_create_info{
+        .memoryTypeIndex = memory_type_index,
+        .pMemoryAllocateNext = &export_allocate_info,
+    };
+    if (vmaCreatePool(**device.allocator, &pool_create_info, &export_pool) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create pool of exported frames");
+    }
+}
+
+VulkanSwapchain::ExportedFrames VulkanSwapchain::GetExportedFrames() const {
+    const auto id_properties =
+        device.physical_device
+            .getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>()
+            .get<vk::PhysicalDeviceIDProperties>();
+    ExportedFrames frames{
+        .extent = extent,
+        .format = surface_format.format,
+        .usage = GetOffscreenUsage(storage_images),
+        .layout = vk::ImageLayout::eTransferSrcOptimal,
+        .memory_handle_type = ExportMemoryHandleType,
+        .semaphore_handle_type = ExportSemaphoreHandleType,
+        .device_uuid = id_properties.deviceUUID,
+        .driver_uuid = id_properties.driverUUID,
+    };
+#ifdef _WIN32
+    // Through the C API, as vulkan.hpp only has it with VK_USE_PLATFORM_WIN32_KHR
+    const auto raw_device = static_cast<VkDevice>(*device.device);
+    const auto get_memory_handle = reinterpret_cast<PFN_vkGetMemoryWin32HandleKHR>(
+        device->getProcAddr("vkGetMemoryWin32HandleKHR"));
+    const auto get_semaphore_handle = reinterpret_cast<PFN_vkGetSemaphoreWin32HandleKHR>(
+        device->getProcAddr("vkGetSemaphoreWin32HandleKHR"));
+    for (const auto& readback : readbacks) {
+        const VkMemoryGetWin32HandleInfoKHR handle_info{
+            .sType = VK_STRUCTURE_TYPE_MEMORY_GET_WIN32_HANDLE_INFO_KHR,
+            .memory = readback.image->allocation_info.deviceMemory,
+            .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_WIN32_BIT,
+        };
+        HANDLE handle{};
+        if (get_memory_handle(raw_device, &handle_info, &handle) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to export frame memory");
+        }
+        frames.images.push_back({.memory = handle, .size = readback.image->allocation_info.size});
+    }
+    const VkSemaphoreGetWin32HandleInfoKHR semaphore_info{
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_WIN32_HANDLE_INFO_KHR,
+        .semaphore = *export_semaphore,
+        .handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_WIN32_BIT,
+    };
+    HANDLE semaphore_handle{};
+    if (get_semaphore_handle(raw_device, &semaphore_info, &semaphore_handle) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to export frame semaphore");
+    }
+    frames.semaphore = semaphore_handle;
+#else
+    for (const auto& readback : readbacks) {
+        frames.images.push_back({
+            .memory = device->getMemoryFdKHR({
+                .memory = readback.image->allocation_info.deviceMemory,
+                .handleType = ExportMemoryHandleType,
+            }),
+            .size = readback.image->allocation_info.size,
+        });
+    }
+    frames.semaphore = device->getSemaphoreFdKHR({
+        .semaphore = *export_semaphore,
+        .handleType = ExportSemaphoreHandleType,
+    });
+#endif
+    return frames;
+}
+
+void VulkanSwapchain::CreateOffscreenImages(bool hdr, bool storage, u32 image_count,
+                                            bool exported) {
+    // RGBA order, so that the frames can be written out without swizzling. Both formats can
+    // always be storage images, RGBA8 as UNORM.
+    storage_images = storage;
+    encode_srgb = storage && !hdr;
+    surface_format = vk::SurfaceFormatKHR{
+        .format = hdr ? vk::Format::eR32G32B32A32Sfloat
+                      : (storage ? vk::Format::eR8G8B8A8Unorm : vk::Format::eR8G8B8A8Srgb),
+        .colorSpace = vk::ColorSpaceKHR::eSrgbNonlinear,
+    };
+    const std::size_t texel_size = hdr ? 16 : 4;
+    const std::size_t buffer_size = std::size_t{extent.width} * extent.height * texel_size;
+
+    if (exported && !CanExport(surface_format.format, GetOffscreenUsage(storage))) {
+        SPDLOG_WARN("Frames of format {} cannot be exported, reading them back",
+                    vk::to_string(surface_format.format));
+        exported = false;
+        image_count = HeadlessImageCount;
+    }
+    const vk::ExternalMemoryImageCreateInfo external_image_info{
+        .handleTypes = ExportMemoryHandleType,
+    };
+    const vk::ImageCreateInfo image_create_info{
+        .pNext = exported ? &external_image_info : nullptr,
+        .imageType = vk::ImageType::e2D,
+        .format = surface_format.format,
+        .extent =
+            {
+                .width = extent.width,
+                .height = extent.height,
+                .depth = 1,
+            },
+        .mipLevels = 1,
+        .arrayLayers = 1,
+        .usage = GetOffscreenUsage(storage),
+        .initialLayout = vk::ImageLayout::eUndefined,
+    };
+    if (exported) {
+        CreateExportPool(image_create_info);
+        const vk::StructureChain semaphore_create_info{
+            vk::SemaphoreCreateInfo{},
+            vk::SemaphoreTypeCreateInfo{
+                .semaphoreType = vk::SemaphoreType::eTimeline,
+                .initialValue = 0,
+            },
+            vk::ExportSemaphoreCreateInfo{
+                .handleTypes = ExportSemaphoreHandleType,
+            },
+        };
+        export_semaphore =
+            vk::raii::Semaphore{*device, semaphore_create_info.get<vk::SemaphoreCreateInfo>()};
+        current_image_index = image_count - 1; // So that frames are in images[number % size]
+    }
+
+    for (u32 i = 0; i < image_count; ++i) {
+        auto& readback = readbacks.emplace_back();
+        // Dedicated, so that each image is exported with a memory of its own
+        readback.image = std::make_unique<VulkanImage>(
+            *device.allocator, image_create_info,
+            VmaAllocationCreateInfo{
+                .flags = exported ? VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT
+                                  : VmaAllocationCreateFlags{},
+                .usage = VMA_MEMORY_USAGE_AUTO,
+                .pool = export_pool,
+            },
+            MemoryCategory::RenderTargets);
+        images.push_back(**readback.image);
+        image_views.emplace_back(*device, vk::ImageViewCreateInfo{
+                                              .image = **readback.image,
+                                              .viewType = vk::ImageViewType::e2D,
+                                              .format = surface_format.format,
+                                              .subresourceRange =
+                                                  {
+                                                      .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                                      .baseMipLevel = 0,
+                                                      .levelCount = 1,
+                                                      .baseArrayLayer = 0,
+                                                      .layerCount = 1,
+                                                  },
+                                          });
+
+        vk::raii::CommandBuffers command_buffers{*device,
+                                                 {
+                                                     .commandPool = *device.command_pool,
+                                                     .level = vk::CommandBufferLevel::ePrimary,
+                                                     .commandBufferCount = 1,
+                                                 }};
+        readback.command_buffer = std::move(command_buffers[0]);
+        if (exported) {
+            // Postprocessing leaves the image in TransferSrcOptimal, which it is released in.
+            // Nothing is acquired back, as the next frame overwrites the image.
+            const auto& cmd = readback.command_buffer;
+            cmd.begin({});
+            cmd.pipelineBarrier2({
+                .imageMemoryBarrierCount = 1,
+                .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{
+                    .srcStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+                    .srcAccessMask = vk::AccessFlagBits2::eMemoryWrite,
+                    .oldLayout = vk::ImageLayout::eTransferSrcOptimal,
+                    .newLayout = vk::ImageLayout::eTransferSrcOptimal,
+                    .srcQueueFamilyIndex = device.graphics_queue_family,
+                    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL,
+                    .image = **readback.image,
+                    .subresourceRange =
+                        {
+                            .aspectMask = vk::ImageAspectFlagBits::eColor,
+                            .baseMipLevel = 0,
+                            .levelCount = 1,
+                            .baseArrayLayer = 0,
+                            .layerCount = 1,
+                        },
+                }},
+            });
+            cmd.end();
+            continue;
+        }
+
+        readback.buffer = std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .size = buffer_size,
+                .usage = vk::BufferUsageFlagBits::eTransferDst,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Scratch);
+        readback.buffer->SetName("frame readback");
+
+        // Postprocessing leaves the image in TransferSrcOptimal
+        const auto& cmd = readback.command_buffer;
+        cmd.begin({});
+        cmd.copyImageToBuffer(**readback.image, vk::ImageLayout::eTransferSrcOptimal,
+                              **readback.buffer,
+                              {{
+                                  .imageSubresource =
+                                      {
+                                          .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                          .mipLevel = 0,
+                                          .baseArrayLayer = 0,
+                                          .layerCount = 1,
+                                      },
+                                  .imageExtent = {extent.width, extent.height, 1},
+                              }});
+        cmd.pipelineBarrier2({
+            .bufferMemoryBarrierCount = 1,
+            .pBufferMemoryBarriers = TempArr<vk::BufferMemoryBarrier2>{{
+                .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+                .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                .dstStageMask = vk::PipelineStageFlagBits2::eHost,
+                .dstAccessMask = vk::AccessFlagBits2::eHostRead,
+                .buffer = **readback.buffer,
+                .offset = 0,
+                .size = VK_WHOLE_SIZE,
+            }},
+        });
+        cmd.end();
+
+        readback.fence = vk::raii::Fence{*device, vk::FenceCreateInfo{}};
+    }
+}
+
+void VulkanSwapchain::DeliverReadback(Readback& readback) {
+    if (!readback.pending) {
+        return;
+    }
+    if (device->waitForFences({*readback.fence}, VK_TRUE, std::numeric_limits<u64>::max()) !=
+        vk::Result::eSuccess) {
+        throw std::runtime_error("Failed to wait for fences");
+    }
+    device->resetFences({*readback.fence});
+    readback.pending = false;
+
+    vmaInvalidateAllocation(readback.buffer->allocator, readback.buffer->allocation, 0,
+                            VK_WHOLE_SIZE);
+    if (frame_callback) {
+        frame_callback({
+            .number = readback.frame_number,
+            .extent = extent,
+            .format = surface_format.format,
+            .pixels = {static_cast<const u8*>(readback.buffer->allocation_info.pMappedData),
+                       readback.buffer->size},
+        });
+    }
+}
+
+void VulkanSwapchain::FlushReadbacks() {
+    for (std::size_t i = 1; i <= readbacks.size(); ++i) {
+        DeliverReadback(readbacks[(current_image_index + i) % readbacks.size()]);
+    }
+    if (video_encoder) {
+        video_encoder->Flush();
+    }
+}
+
+void VulkanSwapchain::SetVideoEncoder(std::unique_ptr<VulkanVideoEncoder> encoder) {
+    video_encoder = std::move(encoder);
+}
 
 void VulkanSwapchain::CreateFramebuffers(const vk::raii::RenderPass& render_pass) {
     framebuffers.clear();
@@ -99,7 +523,67 @@ void VulkanSwapchain::CreateFramebuffers(const vk::raii::RenderPass& render_pass
 }
 
 void VulkanSwapchain::Present(const vk::Semaphore& wait_semaphore) {
-    const auto present_result = device.present_queue.presentKHR({
+    PROFILE_FRAME();
+    if (IsHeadless()) {
+        auto& readback = readbacks[current_image_index];
+        const u64 number = frame_count++;
+        // Exported frames are always released, and signalled for importers, who may drop them
+        const bool read_back = readback_enabled && !IsExported();
+        std::array<vk::CommandBufferSubmitInfo, 2> command_buffers;
+        std::array<vk::SemaphoreSubmitInfo, 2> signal_semaphores;
+        u32 num_command_buffers = 0, num_signal_semaphores = 0;
+        if (video_encoder) { // Converts the frame, before copying or releasing it
+            command_buffers[num_command_buffers++] = {
+                .commandBuffer = video_encoder->RecordConvert(current_image_index),
+            };
+            signal_semaphores[num_signal_semaphores++] = {
+                .semaphore = video_encoder->GetConvertedSemaphore(current_image_index),
+                .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            };
+        }
+        if (read_back || IsExported()) {
+            command_buffers[num_command_buffers++] = {
+                .commandBuffer = *readback.command_buffer,
+            };
+        }
+        if (IsExported()) {
+            signal_semaphores[num_signal_semaphores++] = {
+                .semaphore = *export_semaphore,
+                .value = number + 1,
+                .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            };
+        }
+        // Otherwise this only consumes the semaphore
+        device.Submit2(device.graphics_queue,
+                       {{
+                           .waitSemaphoreInfoCount = 1,
+                           .pWaitSemaphoreInfos = TempArr<vk::SemaphoreSubmitInfo>{{
+                               .semaphore = wait_semaphore,
+                               .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+                           }},
+                           .commandBufferInfoCount = num_command_buffers,
+                           .pCommandBufferInfos = command_buffers.data(),
+                           .signalSemaphoreInfoCount = num_signal_semaphores,
+                           .pSignalSemaphoreInfos = signal_semaphores.data(),
+                       }},
+                       read_back ? *readback.fence : vk::Fence{});
+        if (video_encoder) {
+            video_encoder->Encode(current_image_index, number);
+        }
+        if (read_back) {
+            readback.frame_number = number;
+            readback.pending = true;
+        }
+        return;
+    }
+
+    const u64 present_id = present_ids ? ++last_present_id : 0;
+    const vk::PresentIdKHR present_id_info{
+        .swapchainCount = 1,
+        .pPresentIds = &present_id,
+    };
+    const auto present_result = device.Present({
+        .pNext = present_ids ? &present_id_info : nullptr,
         .waitSemaphoreCount = 1,
         .pWaitSemaphores = TempArr<vk::Semaphore>{wait_semaphore},
         .swapchainCount = 1,
@@ -109,11 +593,53 @@ void VulkanSwapchain::Present(const vk::Semaphore& wait_semaphore) {
     if (present_result != vk::Result::eSuccess) {
         throw std::runtime_error("Failed to present");
     }
+    if (present_ids) {
+        pending_presents.push_back({.id = present_id, .frame_start = frame_start});
+        if (pending_presents.size() > MaxPendingPresents) {
+            pending_presents.erase(pending_presents.begin());
+        }
+    }
+}
+
+void VulkanSwapchain::WaitForFrameStart() {
+    if (present_ids) {
+        if (pacing == Pacing::LowLatency && last_present_id > 0) {
+            WaitForPresent(last_present_id, PacingTimeout);
+        }
+        while (!pending_presents.empty() && WaitForPresent(pending_presents.front().id, 0)) {
+            const double milliseconds =
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                          pending_presents.front().frame_start)
+                    .count();
+            latency = latency ? *latency + (milliseconds - *latency) * LatencySmoothing
+                              : milliseconds;
+            pending_presents.erase(pending_presents.begin());
+        }
+    }
+    frame_start = std::chrono::steady_clock::now();
+}
+
+bool VulkanSwapchain::WaitForPresent(u64 id, u64 timeout) {
+    try {
+        return swap_chain.waitForPresent(id, timeout) == vk::Result::eSuccess;
+    } catch (const vk::OutOfDateKHRError&) { // Until it is recreated
+        pending_presents.clear();
+        return false;
+    }
 }
 
 std::optional<const std::reference_wrapper<vk::raii::Framebuffer>> VulkanSwapchain::AcquireImage(
     const vk::Semaphore& image_available_semaphore) {
 
+    if (IsHeadless()) {
+        current_image_index = (current_image_index + 1) % static_cast<u32>(readbacks.size());
+        DeliverReadback(readbacks[current_image_index]);
+        if (video_encoder) {
+            video_encoder->Deliver(current_image_index);
+        }
+        return framebuffers[current_image_index];
+    }
+
     const auto& [result, image_index] =
         swap_chain.acquireNextImage(std::numeric_limits<u64>::max(), image_available_semaphore);
     if (result == vk::Result::eErrorOutOfDateKHR) {
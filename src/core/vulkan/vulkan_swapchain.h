@@ -4,37 +4,201 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <optional>
+#include <span>
 #include <utility>
+#include <vector>
+#include <vk_mem_alloc.h>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
 
 namespace Renderer {
 
+class VulkanBuffer;
 class VulkanDevice;
 class VulkanGraphicsPipeline;
+class VulkanImage;
+class VulkanVideoEncoder;
 
+/**
+ * The images that postprocessed frames are written to.
+ *
+ * With a surface, this is a swapchain presenting them. Without one (headless rendering) the
+ * images are offscreen: presenting submits a command buffer, recorded once per image, that
+ * copies the image into host visible memory. The frame is delivered to the callback once the
+ * copy has completed, which is checked when the image is acquired again, so rendering does
+ * not wait for the readback of the latest frames.
+ *
+ * Headless frames can be exported instead, for another process to import the images without
+ * copies. They are then rendered into a ring of images with exportable memory, whose handles
+ * are delivered once with those of a timeline semaphore that counts the frames written.
+ */
 class VulkanSwapchain : NonCopyable {
 public:
-    explicit VulkanSwapchain(const VulkanDevice& device, const vk::Extent2D& extent);
+    static constexpr u32 HeadlessImageCount = 3;
+
+    struct ReadbackFrame {
+        u64 number{}; // Counting the frames presented by this swapchain
+        vk::Extent2D extent;
+        vk::Format format{};
+        std::span<const u8> pixels; // Tightly packed rows, valid during the callback
+    };
+    using FrameCallback = std::function<void(const ReadbackFrame&)>;
+
+#ifdef _WIN32
+    using ExternalHandle = void*; // HANDLE
+#else
+    using ExternalHandle = int; // File descriptor
+#endif
+    // The handles are owned by the callback, which must close them or pass them on
+    struct ExportedFrames {
+        vk::Extent2D extent;
+        vk::Format format{};
+        // Of the images, which importers create alike, 2D with optimal tiling and one level
+        vk::ImageUsageFlags usage;
+        // Of the images once their frame is signalled, released to VK_QUEUE_FAMILY_EXTERNAL
+        vk::ImageLayout layout{};
+        vk::ExternalMemoryHandleTypeFlagBits memory_handle_type{};
+        vk::ExternalSemaphoreHandleTypeFlagBits semaphore_handle_type{};
+        struct Image {
+            ExternalHandle memory{}; // Dedicated to the image
+            vk::DeviceSize size{};
+        };
+        std::vector<Image> images;
+        // Timeline, signalled with the number of each frame plus one once it has been written
+        // into images[number % images.size()]. That image is written again images.size() frames
+        // later, so importers read the latest value, dropping the frames they have missed.
+        ExternalHandle semaphore{};
+        // Importers must use the same physical device and driver
+        std::array<u8, VK_UUID_SIZE> device_uuid{};
+        std::array<u8, VK_UUID_SIZE> driver_uuid{};
+    };
+    using ExportCallback = std::function<void(const ExportedFrames&)>;
+
+    // How frames are presented, with a surface
+    enum class Pacing {
+        Throughput, // Mailbox where supported: the latest frame is shown at each vertical blank
+        // FIFO, and WaitForFrameStart waits for the last frame to be displayed where presents
+        // can be waited for, so that the next one samples the input as late as possible
+        LowLatency,
+        Immediate, // Without waiting for vertical blanks where supported, for benchmarks
+    };
+
+    // The surface is that of the device, or another one its present queue supports. The
+    // callback and hdr_readback are only used by headless swapchains, i.e. if there is no
+    // surface. Their images are linear RGBA32F if hdr_readback is set, sRGB encoded RGBA8
+    // otherwise. With storage, the images are created as storage images where the surface
+    // supports it, see storage_images.
+    // With export_callback, headless frames are exported rather than read back, into
+    // export_image_count images, and the callback is called here with their handles. Without
+    // VulkanDevice::external_frames or exportable images, the frames are read back instead.
+    // The old swapchain of the surface, if any, hands its resources over to this one, which
+    // replaces it. It must then be kept until the frames in flight that use it have completed.
+    explicit VulkanSwapchain(const VulkanDevice& device, vk::SurfaceKHR surface,
+                             const vk::Extent2D& extent,
+                             FrameCallback frame_callback = {}, bool hdr_readback = false,
+                             bool storage = false, Pacing pacing = Pacing::Throughput,
+                             const ExportCallback& export_callback = {},
+                             u32 export_image_count = HeadlessImageCount,
+                             vk::SwapchainKHR old_swap_chain = {});
     ~VulkanSwapchain();
 
+    bool IsHeadless() const noexcept {
+        return !*swap_chain;
+    }
+    bool IsExported() const noexcept {
+        return static_cast<bool>(*export_semaphore);
+    }
+    // Waits for the readbacks (and encodes) in flight and delivers them, oldest first. Headless
+    // only.
+    void FlushReadbacks();
+    // Whether the following headless frames are read back (the default). Frames that are not
+    // are presented without a copy, e.g. while accumulating samples.
+    void SetReadbackEnabled(bool enabled) noexcept {
+        readback_enabled = enabled;
+    }
+    // Encodes the following headless frames as well, see VulkanVideoEncoder, which must have
+    // been created for the images of this swapchain. Null stops encoding.
+    void SetVideoEncoder(std::unique_ptr<VulkanVideoEncoder> encoder);
+
     void CreateFramebuffers(const vk::raii::RenderPass& render_pass);
 
     const VulkanDevice& device;
     vk::SurfaceFormatKHR surface_format{};
     vk::raii::SwapchainKHR swap_chain = nullptr;
     vk::Extent2D extent{};
+    // Whether the images can be written as storage images, in the General layout. Their format
+    // is UNORM then, so writers must encode sRGB themselves if encode_srgb is set.
+    bool storage_images{};
+    bool encode_srgb{};
 
+    std::vector<vk::Image> images;
     std::vector<vk::raii::ImageView> image_views;
     std::vector<vk::raii::Framebuffer> framebuffers;
     u32 current_image_index = 0;
 
+    // Headless swapchains do not signal the semaphore, the image can be rendered to right away.
     std::optional<const std::reference_wrapper<vk::raii::Framebuffer>> AcquireImage(
         const vk::Semaphore& image_available_semaphore);
     void Present(const vk::Semaphore& wait_semaphore);
+
+    // Called before sampling the input of each frame. Waits for the last frame to be displayed
+    // with Pacing::LowLatency, and measures the latency of the frames displayed meanwhile.
+    void WaitForFrameStart();
+    // Milliseconds from the start of the frames to their display, averaged. Only measured
+    // where presents can be waited for (VulkanDevice::present_wait), empty otherwise.
+    std::optional<double> GetLatency() const noexcept {
+        return latency;
+    }
+
+private:
+    struct Readback {
+        std::unique_ptr<VulkanImage> image;
+        std::unique_ptr<VulkanBuffer> buffer; // Null if exported
+        // Copies image into buffer, or releases image to other processes if exported
+        vk::raii::CommandBuffer command_buffer = nullptr;
+        vk::raii::Fence fence = nullptr;
+        u64 frame_number{};
+        bool pending{};
+    };
+
+    void CreateOffscreenImages(bool hdr, bool storage, u32 image_count, bool exported);
+    // Whether images of the format can be exported, with a semaphore to signal them
+    bool CanExport(vk::Format format, vk::ImageUsageFlags usage) const;
+    void CreateExportPool(const vk::ImageCreateInfo& image_create_info);
+    ExportedFrames GetExportedFrames() const;
+    // Waits for the readback of the image if it is pending, and delivers it.
+    void DeliverReadback(Readback& readback);
+    // Whether the present has been displayed within the timeout
+    bool WaitForPresent(u64 id, u64 timeout);
+
+    std::vector<Readback> readbacks; // Headless only, indexed like the images
+    FrameCallback frame_callback;
+    u64 frame_count{};
+    bool readback_enabled = true;
+
+    // Of the exported images, allocating them from memory that can be exported
+    vk::ExportMemoryAllocateInfo export_allocate_info;
+    VmaPool export_pool{};
+    vk::raii::Semaphore export_semaphore = nullptr; // Null unless exported
+    std::unique_ptr<VulkanVideoEncoder> video_encoder;
+
+    Pacing pacing{};
+    bool present_ids{}; // Whether the presents are identified, to wait for them
+    u64 last_present_id{};
+    struct PendingPresent {
+        u64 id{};
+        std::chrono::steady_clock::time_point frame_start;
+    };
+    // Not displayed yet when last checked, oldest first. Reserved up front, unlike a deque that
+    // would allocate as it moves along.
+    std::vector<PendingPresent> pending_presents;
+    std::chrono::steady_clock::time_point frame_start; // Of the frame in progress
+    std::optional<double> latency;
 };
 
 } // namespace Renderer
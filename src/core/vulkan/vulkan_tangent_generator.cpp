@@ -0,0 +1,198 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+#include "common/temp_ptr.h"
+#include "core/shaders/tangent_generation_glsl.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
+#include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_shader.h"
+#include "core/vulkan/vulkan_tangent_generator.h"
+
+namespace Renderer {
+
+namespace {
+
+constexpr u32 WorkGroupSize = 64;
+constexpr std::size_t SumsPerVertex = 6;
+
+} // namespace
+
+bool VulkanTangentGenerator::CanGenerate(const VulkanDevice& device, std::size_t num_vertices,
+                                         const VertexLayout& layout, std::size_t num_indices) {
+    const std::size_t max_range =
+        device.physical_device.getProperties().limits.maxStorageBufferRange;
+    const std::array<std::size_t, 4> sizes{{
+        num_vertices * layout.stride * sizeof(float),
+        num_indices * sizeof(u32),
+        num_vertices * SumsPerVertex * sizeof(s32),
+        num_vertices * sizeof(glm::vec4),
+    }};
+    return num_vertices * layout.stride <= std::numeric_limits<u32>::max() &&
+           num_indices <= std::numeric_limits<u32>::max() &&
+           std::ranges::all_of(sizes, [max_range](std::size_t size) { return size <= max_range; });
+}
+
+VulkanTangentGenerator::VulkanTangentGenerator(VulkanDevice& device_,
+                                               std::span<const float> vertices,
+                                               const VertexLayout& layout_,
+                                               std::span<const u32> indices)
+    : device(device_), layout(layout_),
+      num_vertices(static_cast<u32>(vertices.size() / layout.stride)), indexed(!indices.empty()) {
+
+    num_triangles = static_cast<u32>((indexed ? indices.size() : num_vertices) / 3);
+
+    const auto Upload = [this](const auto& data) {
+        return std::make_unique<VulkanImmUploadBuffer>(
+            device,
+            VulkanBufferCreateInfo{
+                .size = data.size() * sizeof(data[0]),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+                .dst_stage_mask = vk::PipelineStageFlagBits2::eComputeShader,
+                .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+                .category = MemoryCategory::Scratch,
+            },
+            reinterpret_cast<const u8*>(data.data()));
+    };
+    vertices_buffer = Upload(vertices);
+    vertices_buffer->SetName("tangent generation vertices");
+    static constexpr std::array<u32, 1> NoIndices{}; // Buffers cannot be empty
+    indices_buffer = indexed ? Upload(indices) : Upload(NoIndices);
+
+    sums_buffer = std::make_unique<VulkanBuffer>(
+        *device.allocator,
+        vk::BufferCreateInfo{
+            .size = std::max<std::size_t>(num_vertices, 1) * SumsPerVertex * sizeof(s32),
+            .usage =
+                vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+        },
+        MemoryCategory::Scratch);
+    sums_buffer->SetName("tangent generation sums");
+    tangents_buffer = std::make_unique<VulkanBuffer>(
+        *device.allocator,
+        vk::BufferCreateInfo{
+            .size = std::max<std::size_t>(num_vertices, 1) * sizeof(glm::vec4),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+        },
+        VmaAllocationCreateInfo{
+            .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                     VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Scratch);
+    tangents_buffer->SetName("generated tangents");
+
+    std::vector<DescriptorBinding> bindings(4, {
+                                                   .type = vk::DescriptorType::eStorageBuffer,
+                                                   .stages = vk::ShaderStageFlagBits::eCompute,
+                                               });
+    descriptor_sets = std::make_unique<VulkanDescriptorSets>(device, 1, bindings);
+    const std::array<const VulkanBuffer*, 4> buffers{{vertices_buffer.get(), indices_buffer.get(),
+                                                      sums_buffer.get(), tangents_buffer.get()}};
+    for (std::size_t i = 0; i < buffers.size(); ++i) {
+        descriptor_sets->UpdateDescriptor(i, DescriptorBinding::BuffersValue{{
+                                                 .buffers = {{**buffers[i]}},
+                                             }});
+    }
+    pipeline = std::make_unique<VulkanComputePipeline>(
+        device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{device, u8"core/shaders/tangent_generation.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 1,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *descriptor_sets->descriptor_set_layout,
+            }},
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::TangentGenerationPushConstant>(
+                    vk::ShaderStageFlagBits::eCompute),
+            }},
+        });
+}
+
+VulkanTangentGenerator::~VulkanTangentGenerator() = default;
+
+std::vector<glm::vec4> VulkanTangentGenerator::Generate() {
+    const u32 max_groups =
+        device.physical_device.getProperties().limits.maxComputeWorkGroupCount[0];
+    const auto GetNumGroups = [max_groups](u32 count) {
+        return std::clamp((count + WorkGroupSize - 1) / WorkGroupSize, 1u, max_groups);
+    };
+    {
+        Helpers::OneTimeCommandContext cmd{device};
+        cmd->fillBuffer(**sums_buffer, 0, VK_WHOLE_SIZE, 0);
+        cmd->pipelineBarrier2({
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+                .srcStageMask = vk::PipelineStageFlagBits2::eClear,
+                .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .dstAccessMask = vk::AccessFlagBits2::eShaderStorageRead |
+                                 vk::AccessFlagBits2::eShaderStorageWrite,
+            }},
+        });
+        cmd->bindPipeline(vk::PipelineBindPoint::eCompute, **pipeline);
+        VulkanDescriptorSets::Bind(*cmd, vk::PipelineBindPoint::eCompute,
+                                   *pipeline->pipeline_layout, 0, {{*descriptor_sets, 0}});
+        GLSL::TangentGenerationPushConstant push_constant{
+            .num_triangles = num_triangles,
+            .num_vertices = num_vertices,
+            .vertex_stride = layout.stride,
+            .position_offset = layout.position,
+            .normal_offset = layout.normal,
+            .texcoord_offset = layout.texcoord,
+            .indexed = indexed,
+            .pass = 0,
+        };
+        cmd->pushConstants<GLSL::TangentGenerationPushConstant>(
+            *pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0, {push_constant});
+        cmd->dispatch(GetNumGroups(num_triangles), 1, 1);
+
+        cmd->pipelineBarrier2({
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+                .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+                .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .dstAccessMask = vk::AccessFlagBits2::eShaderStorageRead,
+            }},
+        });
+        push_constant.pass = 1;
+        cmd->pushConstants<GLSL::TangentGenerationPushConstant>(
+            *pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0, {push_constant});
+        cmd->dispatch(GetNumGroups(num_vertices), 1, 1);
+
+        cmd->pipelineBarrier2({
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+                .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+                .dstStageMask = vk::PipelineStageFlagBits2::eHost,
+                .dstAccessMask = vk::AccessFlagBits2::eHostRead,
+            }},
+        });
+    } // Submits and waits
+
+    vmaInvalidateAllocation(tangents_buffer->allocator, tangents_buffer->allocation, 0,
+                            VK_WHOLE_SIZE);
+    std::vector<glm::vec4> tangents(num_vertices);
+    std::memcpy(tangents.data(), tangents_buffer->allocation_info.pMappedData,
+                tangents.size() * sizeof(glm::vec4));
+    return tangents;
+}
+
+} // namespace Renderer
@@ -0,0 +1,71 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <span>
+#include <vector>
+#include <glm/glm.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanComputePipeline;
+class VulkanDescriptorSets;
+class VulkanDevice;
+class VulkanImmUploadBuffer;
+
+/**
+ * Generates the tangents of a triangle list on the GPU with a compute pass (see
+ * tangent_generation.comp), for primitives so large that MikkTSpace on the host would be the
+ * long tail of loading.
+ *
+ * Like MikkTSpace, the tangent and bitangent directions of each triangle are weighted by the
+ * angle of each of its corners and accumulated at the vertex, which is then orthonormalized
+ * against its normal. Unlike it, vertices are never split: where the triangles around a vertex
+ * disagree (mirrored texture coordinates, seams sharing the vertex) their frames are averaged
+ * rather than kept apart. The sums are in 16.16 fixed point, so that they are deterministic
+ * without float atomics, which quantizes the contributions and limits a vertex to about 10000
+ * triangles.
+ */
+class VulkanTangentGenerator : NonCopyable {
+public:
+    // Of the attributes in the interleaved vertices, in floats
+    struct VertexLayout {
+        u32 stride{};
+        u32 position{}; // float3
+        u32 normal{};   // float3
+        u32 texcoord{}; // float2, of the normal texture
+    };
+
+    // Whether the buffers of the primitive fit the storage buffers of the device
+    static bool CanGenerate(const VulkanDevice& device, std::size_t num_vertices,
+                            const VertexLayout& layout, std::size_t num_indices);
+
+    // indices is empty if the primitive is not indexed. Uploads the primitive.
+    explicit VulkanTangentGenerator(VulkanDevice& device, std::span<const float> vertices,
+                                    const VertexLayout& layout, std::span<const u32> indices);
+    ~VulkanTangentGenerator();
+
+    // Tangent of each vertex, the sign of its bitangent in w as written by MikkT::SetTSpace.
+    // Blocks until the pass is done.
+    std::vector<glm::vec4> Generate();
+
+private:
+    VulkanDevice& device;
+    VertexLayout layout;
+    u32 num_vertices{};
+    u32 num_triangles{};
+    bool indexed{};
+    std::unique_ptr<VulkanImmUploadBuffer> vertices_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> indices_buffer;
+    std::unique_ptr<VulkanBuffer> sums_buffer;     // 16.16 tangent and bitangent of each vertex
+    std::unique_ptr<VulkanBuffer> tangents_buffer; // Host visible
+    std::unique_ptr<VulkanDescriptorSets> descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> pipeline;
+};
+
+} // namespace Renderer
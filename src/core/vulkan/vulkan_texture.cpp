@@ -2,234 +2,1192 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cmath>
-#include <fstream>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <ranges>
+#include <string>
+#include <tuple>
+#include <utility>
 #include <citycrc.h>
 #include <spdlog/spdlog.h>
-#include <stb_image.h>
 #include <stb_image_resize.h>
-#include <stb_image_write.h>
-#include "common/file_util.h"
+#include "common/alignment.h"
+#include "common/jpeg.h"
+#include "common/log.h"
+#include "common/profiling.h"
+#include "common/ranges.h"
+#include "core/basisu_transcoder.h"
+#include "core/image_decoder.h"
+#include "core/mipmap_pack.h"
+#include "core/texture_compression.h"
 #include "core/vulkan/vulkan_allocator.h"
 #include "core/vulkan/vulkan_buffer.h"
 #include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_jpeg_decoder.h"
 #include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_upload_ring.h"
 
 namespace Renderer {
 
+// Chains the compression requested to the create info, unless it is the default or the device
+// cannot control it. The memory requirements must be of the result too, as compression changes
+// the size of images.
+static vk::ImageCreateInfo WithCompression(const VulkanDevice& device,
+                                           const vk::ImageCreateInfo& image_create_info,
+                                           vk::ImageCompressionFlagsEXT compression,
+                                           vk::ImageCompressionControlEXT& compression_control) {
+    auto result = image_create_info;
+    if (compression && device.image_compression_control) {
+        compression_control = {
+            .pNext = image_create_info.pNext,
+            .flags = compression,
+        };
+        result.pNext = &compression_control;
+    }
+    return result;
+}
+
 VulkanImage::VulkanImage(const VulkanAllocator& allocator_,
-                         const vk::ImageCreateInfo& image_create_info,
-                         const VmaAllocationCreateInfo& alloc_create_info)
-    : allocator(*allocator_) {
+                         const vk::ImageCreateInfo& image_create_info_,
+                         const VmaAllocationCreateInfo& alloc_create_info,
+                         MemoryCategory category_, vk::ImageCompressionFlagsEXT compression)
+    : allocator(*allocator_), category(category_), owner(allocator_) {
 
+    vk::ImageCompressionControlEXT compression_control;
+    const auto image_create_info =
+        WithCompression(owner.device, image_create_info_, compression, compression_control);
     const VkImageCreateInfo& image_create_info_raw = image_create_info;
-    const auto result = vmaCreateImage(allocator, &image_create_info_raw, &alloc_create_info,
-                                       &image, &allocation, &allocation_info);
+    const vk::DeviceSize size =
+        (*owner.device)
+            .getImageMemoryRequirements({.pCreateInfo = &image_create_info})
+            .memoryRequirements.size;
+    const auto result = owner.Allocate(
+        category, size, alloc_create_info,
+        [this, &image_create_info_raw](const auto& info) {
+            return vmaCreateImage(allocator, &image_create_info_raw, &info, &image, &allocation,
+                                  &allocation_info);
+        });
     if (result != VK_SUCCESS) {
         vk::throwResultException(vk::Result{result}, "vmaCreateImage");
     }
+    owner.AddUsage(category, allocation_info.size);
+    owner.SetAllocationName(allocation, category);
+}
+
+VulkanImage::VulkanImage(VulkanRenderTargetHeap& heap_, VulkanRenderTargetHeap::Slot slot_,
+                         const vk::ImageCreateInfo& image_create_info_,
+                         vk::ImageCompressionFlagsEXT compression)
+    : allocator(*heap_.allocator), category(MemoryCategory::RenderTargets),
+      owner(heap_.allocator), heap(&heap_), slot(slot_) {
+
+    vk::ImageCompressionControlEXT compression_control;
+    const auto image_create_info =
+        WithCompression(owner.device, image_create_info_, compression, compression_control);
+    const auto& device = *owner.device;
+    image = static_cast<VkImage>(device.createImage(image_create_info).release());
+    const VkMemoryRequirements requirements =
+        device.getImageMemoryRequirements({.pCreateInfo = &image_create_info})
+            .memoryRequirements;
+    try {
+        heap->Bind(slot, image, requirements,
+                   static_cast<bool>(image_create_info.usage &
+                                     vk::ImageUsageFlagBits::eTransientAttachment));
+    } catch (...) {
+        vmaDestroyImage(allocator, image, nullptr);
+        throw;
+    }
 }
 
 VulkanImage::~VulkanImage() {
+    // The memory of the heap is only released with it
+    if (heap) {
+        vmaDestroyImage(allocator, image, nullptr);
+        heap->Unbind(slot);
+        return;
+    }
+    owner.RemoveUsage(category, allocation_info.size);
     vmaDestroyImage(allocator, image, allocation);
 }
 
-struct StbImage : NonCopyable {
+void VulkanImage::SetName(std::string_view name) const {
+    if (!heap) {
+        owner.SetAllocationName(allocation, category, name);
+    }
+}
+
+std::optional<vk::ImageCompressionPropertiesEXT> VulkanImage::GetCompression(
+    vk::ImageAspectFlags aspect) const {
+
+    if (!owner.device.image_compression_control) {
+        return std::nullopt;
+    }
+    VkImageCompressionPropertiesEXT properties{
+        .sType = VK_STRUCTURE_TYPE_IMAGE_COMPRESSION_PROPERTIES_EXT,
+    };
+    VkSubresourceLayout2EXT layout{
+        .sType = VK_STRUCTURE_TYPE_SUBRESOURCE_LAYOUT_2_EXT,
+        .pNext = &properties,
+    };
+    const VkImageSubresource2EXT subresource{
+        .sType = VK_STRUCTURE_TYPE_IMAGE_SUBRESOURCE_2_EXT,
+        .imageSubresource = {.aspectMask = static_cast<VkImageAspectFlags>(aspect)},
+    };
+    owner.device->getDispatcher()->vkGetImageSubresourceLayout2EXT(**owner.device, image,
+                                                                   &subresource, &layout);
+    return vk::ImageCompressionPropertiesEXT{properties};
+}
+
+void VulkanImage::LogCompression(std::string_view name, vk::ImageAspectFlags aspect) const {
+    const auto properties = GetCompression(aspect);
+    if (!properties) {
+        return;
+    }
+    const auto flags = properties->imageCompressionFlags;
+    if (flags & vk::ImageCompressionFlagBitsEXT::eFixedRateExplicit) {
+        // Of the lowest rate set, 1 << (N - 1) for N bits per component
+        const auto rate = static_cast<VkImageCompressionFixedRateFlagsEXT>(
+            properties->imageCompressionFixedRateFlags);
+        SPDLOG_DEBUG("{} is compressed at a fixed rate of {} bits per component", name,
+                     std::countr_zero(rate) + 1);
+    } else if (flags & vk::ImageCompressionFlagBitsEXT::eDisabled) {
+        SPDLOG_DEBUG("{} is not compressed", name);
+    } else {
+        SPDLOG_DEBUG("{} is compressed losslessly, as far as the driver does", name);
+    }
+}
+
+// Largest texel block size of any format
+static constexpr std::size_t TexelBlockAlignment = 16;
+
+// Pixels (or blocks) of a mip level
+struct TextureLevel : NonCopyable {
 public:
-    explicit StbImage(int width_, int height_)
+    // Allocates RGBA8 pixels, for an image decoder or stb_image_resize to write
+    explicit TextureLevel(int width_, int height_)
         : width(width_), height(height_), size(width * height * std::size_t{4}) {
 
-        pixels = reinterpret_cast<stbi_uc*>(std::malloc(size));
-    }
-    explicit StbImage(std::vector<u8> contents) {
-        int channels_in_file;
-        pixels = stbi_load_from_memory(contents.data(), static_cast<int>(contents.size()), &width,
-                                       &height, &channels_in_file, STBI_rgb_alpha);
+        pixels = reinterpret_cast<u8*>(std::malloc(size));
         if (!pixels) {
-            throw std::runtime_error("Failed to load image");
+            throw std::bad_alloc();
         }
-        size = width * height * std::size_t{4};
     }
-    ~StbImage() {
-        // stbi_image_free() is just free()
-        std::free(pixels);
+    // Copies already encoded data
+    explicit TextureLevel(int width_, int height_, std::span<const u8> data)
+        : width(width_), height(height_), size(data.size()) {
+
+        pixels = reinterpret_cast<u8*>(std::malloc(size));
+        std::memcpy(pixels, data.data(), size);
+    }
+    // Refers to pixels (or blocks) owned elsewhere, which are never written to
+    struct Borrow {};
+    explicit TextureLevel(int width_, int height_, std::span<const u8> data, Borrow)
+        : pixels(const_cast<u8*>(data.data())), width(width_), height(height_),
+          size(data.size()), owned(false) {}
+    ~TextureLevel() {
+        if (owned) {
+            std::free(pixels);
+        }
     }
 
-    stbi_uc* pixels{};
+    u8* pixels{};
     int width{};
     int height{};
     std::size_t size{};
+    bool owned = true;
+};
+
+// Colors are filtered in linear space, data as is
+static std::unique_ptr<TextureLevel> ResizeImage(const TextureLevel& image, u32 width,
+                                                 u32 height, bool srgb) {
+    auto resized =
+        std::make_unique<TextureLevel>(static_cast<int>(width), static_cast<int>(height));
+    const int result =
+        srgb ? stbir_resize_uint8_srgb(image.pixels, image.width, image.height, 0,
+                                       resized->pixels, resized->width, resized->height, 0, 4, 3,
+                                       0)
+             : stbir_resize_uint8(image.pixels, image.width, image.height, 0, resized->pixels,
+                                  resized->width, resized->height, 0, 4);
+    if (!result) {
+        throw std::runtime_error("Could not resize image");
+    }
+    return resized;
+}
+
+// With the first of the image decoders accepting the file that succeeds, straight into the
+// pixels of the level
+static std::unique_ptr<TextureLevel> DecodeImage(std::span<const u8> file_data,
+                                                 LoadProfiler* profiler) {
+    const LoadProfiler::Scope profile_scope{profiler, GetImageDecodeStage(file_data),
+                                            file_data.size()};
+    for (const auto* decoder : GetImageDecoders()) {
+        if (!decoder->Accepts(file_data)) {
+            continue;
+        }
+        try {
+            const auto info = decoder->GetInfo(file_data);
+            if (info.width == 0 || info.height == 0) {
+                throw std::runtime_error("Image is empty");
+            }
+            auto image = std::make_unique<TextureLevel>(static_cast<int>(info.width),
+                                                        static_cast<int>(info.height));
+            decoder->Decode(file_data, {image->pixels, image->size});
+            return image;
+        } catch (const std::exception& e) {
+            SPDLOG_DEBUG("{} failed to decode image: {}", decoder->GetName(), e.what());
+        }
+    }
+    throw std::runtime_error("Failed to load image");
+}
+
+static vk::Format GetCompressedFormat(BlockFormat block_format, bool srgb) {
+    switch (block_format) {
+    case BlockFormat::BC4:
+        return vk::Format::eBc4UnormBlock;
+    case BlockFormat::BC5:
+        return vk::Format::eBc5UnormBlock;
+    case BlockFormat::BC7:
+        return srgb ? vk::Format::eBc7SrgbBlock : vk::Format::eBc7UnormBlock;
+    }
+    throw std::runtime_error("Invalid block format");
+}
+
+// Only for the formats produced by DecodedTexture itself, or wrapped by it
+static std::size_t GetLevelSize(vk::Format format, u32 width, u32 height) {
+    switch (format) {
+    case vk::Format::eR8Unorm:
+        return std::size_t{width} * height;
+    case vk::Format::eR8G8Unorm:
+        return std::size_t{width} * height * 2;
+    case vk::Format::eR8G8B8A8Srgb:
+    case vk::Format::eR8G8B8A8Unorm:
+        return std::size_t{width} * height * 4;
+    case vk::Format::eR16G16B16A16Sfloat: // Only wrapped, e.g. HDR images
+        return std::size_t{width} * height * 8;
+    case vk::Format::eBc4UnormBlock:
+        return GetCompressedSize(BlockFormat::BC4, width, height);
+    case vk::Format::eBc5UnormBlock:
+        return GetCompressedSize(BlockFormat::BC5, width, height);
+    case vk::Format::eBc7SrgbBlock:
+    case vk::Format::eBc7UnormBlock:
+    // Of the same blocks, as transcoded from Basis Universal payloads
+    case vk::Format::eAstc4x4SrgbBlock:
+    case vk::Format::eAstc4x4UnormBlock:
+    case vk::Format::eEtc2R8G8B8A8SrgbBlock:
+    case vk::Format::eEtc2R8G8B8A8UnormBlock:
+        return GetCompressedSize(BlockFormat::BC7, width, height);
+    default:
+        SPDLOG_ERROR("Unexpected texture format {}", vk::to_string(format));
+        throw std::runtime_error("Unexpected texture format");
+    }
+}
+
+namespace KTX2 {
+
+constexpr std::array<u8, 12> Identifier{0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32,
+                                        0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+
+struct Header {
+    std::array<u8, 12> identifier;
+    u32 vk_format;
+    u32 type_size;
+    u32 pixel_width;
+    u32 pixel_height;
+    u32 pixel_depth;
+    u32 layer_count;
+    u32 face_count;
+    u32 level_count;
+    u32 supercompression_scheme;
+    u32 dfd_byte_offset;
+    u32 dfd_byte_length;
+    u32 kvd_byte_offset;
+    u32 kvd_byte_length;
+    u64 sgd_byte_offset;
+    u64 sgd_byte_length;
+};
+static_assert(sizeof(Header) == 80);
+
+struct LevelIndex {
+    u64 byte_offset;
+    u64 byte_length;
+    u64 uncompressed_byte_length;
+};
+
+// Of the transfer function of the data format descriptor
+constexpr u8 TransferSRGB = 2;
+
+struct File {
+    vk::Format format{}; // Undefined for Basis Universal payloads
+    u32 width{};
+    u32 height{};
+    std::vector<std::span<const u8>> levels; // Largest first, as stored
+    bool srgb{};                             // Of the data format descriptor
 };
 
-static void StbiWriteCallback(void* context, void* data, int size) {
-    auto& out_file = *reinterpret_cast<std::ofstream*>(context);
-    out_file.write(reinterpret_cast<const char*>(data), size);
+static File Parse(std::span<const u8> data) {
+    Header header;
+    if (data.size() < sizeof(Header)) {
+        throw std::runtime_error("KTX2 file is truncated");
+    }
+    std::memcpy(&header, data.data(), sizeof(Header));
+    if (header.identifier != Identifier) {
+        throw std::runtime_error("Not a KTX2 file");
+    }
+    // Basis Universal payloads have no format of their own and are transcoded, but other
+    // supercompressed files are not
+    if (header.vk_format != VK_FORMAT_UNDEFINED && header.supercompression_scheme != 0) {
+        throw std::runtime_error("Supercompressed KTX2 files are not supported");
+    }
+    if (header.pixel_height == 0 || header.pixel_depth > 1 || header.layer_count > 1 ||
+        header.face_count != 1) {
+        throw std::runtime_error("Only 2D KTX2 textures are supported");
+    }
+
+    const u32 level_count = std::max(header.level_count, 1u);
+    if (level_count > 32 || sizeof(Header) + level_count * sizeof(LevelIndex) > data.size()) {
+        throw std::runtime_error("KTX2 file is truncated");
+    }
+    File file{
+        .format = static_cast<vk::Format>(header.vk_format),
+        .width = header.pixel_width,
+        .height = header.pixel_height,
+    };
+    // The transfer function follows the total size and the first 10 bytes of the basic block
+    if (header.dfd_byte_length >= 16 && header.dfd_byte_offset <= data.size() - 16) {
+        file.srgb = data[header.dfd_byte_offset + 14] == TransferSRGB;
+    }
+    for (u32 i = 0; i < level_count; ++i) {
+        LevelIndex level;
+        std::memcpy(&level, data.data() + sizeof(Header) + i * sizeof(LevelIndex),
+                    sizeof(LevelIndex));
+        if (level.byte_offset > data.size() ||
+            level.byte_length > data.size() - level.byte_offset) {
+            throw std::runtime_error("KTX2 file is truncated");
+        }
+        file.levels.emplace_back(data.subspan(level.byte_offset, level.byte_length));
+    }
+    return file;
+}
+
+} // namespace KTX2
+
+bool DecodedTexture::IsKTX2(std::span<const u8> file_data) {
+    return file_data.size() >= KTX2::Identifier.size() &&
+           std::equal(KTX2::Identifier.begin(), KTX2::Identifier.end(), file_data.begin());
+}
+
+static bool IsFormatSampleable(const VulkanDevice& device, vk::Format format) {
+    const auto properties = device.physical_device.getFormatProperties(format);
+    return static_cast<bool>(properties.optimalTilingFeatures &
+                             vk::FormatFeatureFlagBits::eSampledImage);
+}
+
+// Of Basis Universal payloads, the first of the block formats the device can sample, which are
+// in the order of their quality, or RGBA8 (which any device can) otherwise
+static std::pair<BasisU::TargetFormat, vk::Format> GetBasisTarget(const VulkanDevice& device,
+                                                                  bool srgb) {
+    const std::array<std::pair<BasisU::TargetFormat, vk::Format>, 3> candidates{{
+        {BasisU::TargetFormat::BC7,
+         srgb ? vk::Format::eBc7SrgbBlock : vk::Format::eBc7UnormBlock},
+        {BasisU::TargetFormat::ASTC4x4,
+         srgb ? vk::Format::eAstc4x4SrgbBlock : vk::Format::eAstc4x4UnormBlock},
+        {BasisU::TargetFormat::ETC2,
+         srgb ? vk::Format::eEtc2R8G8B8A8SrgbBlock : vk::Format::eEtc2R8G8B8A8UnormBlock},
+    }};
+    for (const auto& candidate : candidates) {
+        if (IsFormatSampleable(device, candidate.second)) {
+            return candidate;
+        }
+    }
+    return {BasisU::TargetFormat::RGBA8,
+            srgb ? vk::Format::eR8G8B8A8Srgb : vk::Format::eR8G8B8A8Unorm};
+}
+
+bool DecodedTexture::CanLoadKTX2(const VulkanDevice& device, std::span<const u8> file_data) {
+    try {
+        const auto file = KTX2::Parse(file_data);
+        if (file.format == vk::Format::eUndefined) {
+            return BasisU::CanTranscode(file_data);
+        }
+        return IsFormatSampleable(device, file.format);
+    } catch (const std::exception& e) {
+        SPDLOG_WARN("Cannot load KTX2 file: {}", e.what());
+        return false;
+    }
+}
+
+std::size_t DecodedTexture::EstimateSize(std::span<const u8> file_data, bool block_compressed) {
+    if (IsKTX2(file_data)) {
+        try {
+            const auto file = KTX2::Parse(file_data);
+            std::size_t size = 0;
+            // Basis Universal payloads as transcoded to blocks of 16 bytes
+            u32 mip_width = file.width, mip_height = file.height;
+            for (const auto& level : file.levels) {
+                size += file.format == vk::Format::eUndefined
+                            ? GetCompressedSize(BlockFormat::BC7, mip_width, mip_height)
+                            : level.size();
+                mip_width = std::max(mip_width / 2, 1u);
+                mip_height = std::max(mip_height / 2, 1u);
+            }
+            return size;
+        } catch (const std::exception&) {
+            return 0;
+        }
+    }
+    for (const auto* decoder : GetImageDecoders()) {
+        if (!decoder->Accepts(file_data)) {
+            continue;
+        }
+        try {
+            const auto info = decoder->GetInfo(file_data);
+            // The levels below the first add a third
+            const std::size_t texels = std::size_t{info.width} * info.height * 4 / 3;
+            return block_compressed ? texels : texels * 4;
+        } catch (const std::exception&) {
+            // Left to the next decoder
+        }
+    }
+    return 0;
+}
+
+void DecodedTexture::LoadKTX2(const VulkanDevice& device, std::span<const u8> file_data) {
+    auto file = KTX2::Parse(file_data);
+    std::vector<std::vector<u8>> transcoded;
+    if (file.format == vk::Format::eUndefined) {
+        BasisU::TargetFormat target;
+        std::tie(target, file.format) = GetBasisTarget(device, file.srgb);
+        transcoded = BasisU::Transcode(file_data, target);
+        file.levels.clear();
+        for (const auto& level : transcoded) {
+            file.levels.emplace_back(level);
+        }
+    }
+    if (!IsFormatSampleable(device, file.format)) {
+        SPDLOG_ERROR("KTX2 format {} is not supported by the device", vk::to_string(file.format));
+        throw std::runtime_error("KTX2 format is not supported");
+    }
+
+    width = file.width;
+    height = file.height;
+    format = file.format;
+    num_levels = static_cast<u32>(file.levels.size());
+    u32 mip_width = width, mip_height = height;
+    for (const auto& level : file.levels) {
+        mip_levels.emplace_back(std::make_unique<TextureLevel>(
+            static_cast<int>(mip_width), static_cast<int>(mip_height), level));
+        mip_width = std::max(mip_width / 2, 1u);
+        mip_height = std::max(mip_height / 2, 1u);
+    }
+}
+
+// Of the mipmaps folder, which is the same for every device
+static MipmapPack& GetMipmapPack(const std::filesystem::path& mipmaps_folder) {
+    static MipmapPack pack = [&mipmaps_folder] {
+        std::error_code error;
+        std::filesystem::create_directory(mipmaps_folder, error);
+        // Remove the image file per level that older versions wrote
+        if (std::filesystem::remove(mipmaps_folder / u8"index.txt", error)) {
+            for (const auto& entry : std::filesystem::directory_iterator{mipmaps_folder, error}) {
+                if (entry.path().extension() == u8".png") {
+                    std::filesystem::remove(entry.path(), error);
+                }
+            }
+        }
+        return MipmapPack{mipmaps_folder / u8"mipmaps.pack"};
+    }();
+    return pack;
+}
+
+static bool CanBlitMipmaps(const VulkanDevice& device, vk::Format format) {
+    static constexpr auto RequiredFeatures = vk::FormatFeatureFlagBits::eBlitSrc |
+                                             vk::FormatFeatureFlagBits::eBlitDst |
+                                             vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+    const auto properties = device.physical_device.getFormatProperties(format);
+    return (properties.optimalTilingFeatures & RequiredFeatures) == RequiredFeatures;
 }
 
-VulkanTexture::VulkanTexture(VulkanDevice& device, std::vector<u8> file_data, bool mipmaps) {
+static u32 GetNumLevels(u32 width, u32 height, bool mipmaps) {
+    return mipmaps ? static_cast<u32>(std::floor(std::log2(std::max(width, height)))) + 1 : 1;
+}
+
+DecodedTexture::DecodedTexture(const VulkanDevice& device, std::span<const u8> file_data,
+                               bool mipmaps, bool srgb, bool gpu_decode,
+                               LoadProfiler* profiler) {
+    PROFILE_FUNCTION();
+    if (IsKTX2(file_data)) { // Levels are already prepared
+        LoadKTX2(device, file_data);
+        return;
+    }
+    format = srgb ? vk::Format::eR8G8B8A8Srgb : vk::Format::eR8G8B8A8Unorm;
+
+    // Levels other than 0 are generated by the upload batch then
+    if (gpu_decode && Common::IsJPEG(file_data) && (!mipmaps || CanBlitMipmaps(device, format))) {
+        try {
+            const LoadProfiler::Scope profile_scope{profiler, LoadProfiler::Stage::JPEGDecode,
+                                                    file_data.size()};
+            auto coefficients = std::make_unique<Common::JPEGCoefficients>(
+                Common::DecodeJPEGCoefficients(file_data));
+            // Each image binds its coefficients as a single storage buffer
+            if (VulkanJPEGDecoder::GetUploadSize(*coefficients) <=
+                device.physical_device.getProperties().limits.maxStorageBufferRange) {
+                width = coefficients->width;
+                height = coefficients->height;
+                num_levels = GetNumLevels(width, height, mipmaps);
+                jpeg = std::move(coefficients);
+                jpeg_file.assign(file_data.begin(), file_data.end());
+                LOG_TALLY("JPEG images decoded on the GPU", "images", 1);
+                return;
+            }
+        } catch (const std::exception& e) {
+            SPDLOG_DEBUG("Decoding JPEG on the CPU: {}", e.what());
+        }
+    }
+
     // Load image file
-    auto image_data = std::make_unique<StbImage>(std::move(file_data));
+    auto image_data = DecodeImage(file_data, profiler);
     width = static_cast<u32>(image_data->width);
     height = static_cast<u32>(image_data->height);
 
-    const u32 mip_levels =
-        mipmaps ? static_cast<u32>(std::floor(std::log2(std::max(width, height)))) + 1 : 1;
+    num_levels = GetNumLevels(width, height, mipmaps);
+    if (num_levels > 1 && CanBlitMipmaps(device, format)) { // Generated by the upload batch
+        mip_levels.emplace_back(std::move(image_data));
+        return;
+    }
+
+    mip_levels.emplace_back(std::move(image_data));
+    if (num_levels == 1) {
+        return;
+    }
+
+    // Hash the image to mark mipmap version. The file is hashed rather than the decoded pixels,
+    // which are many times larger.
+    const auto& [hash_h, hash_l] =
+        CityHashCrc128(reinterpret_cast<const char*>(file_data.data()), file_data.size());
+    const auto hash = fmt::format("{:016x}{:016x}{}", hash_h, hash_l, srgb ? "" : ".linear");
+    auto& pack = GetMipmapPack(device.startup_path / u8"mipmaps");
+    auto cached = pack.Find(hash, width, height, num_levels);
+    if (cached.mapping) { // Refer to the mapped levels rather than copying them
+        u32 mip_width = width, mip_height = height;
+        for (const auto& level : cached.data) {
+            mip_width = std::max(mip_width / 2, 1u);
+            mip_height = std::max(mip_height / 2, 1u);
+            mip_levels.emplace_back(std::make_unique<TextureLevel>(
+                static_cast<int>(mip_width), static_cast<int>(mip_height), level,
+                TextureLevel::Borrow{}));
+        }
+        owner = std::move(cached.mapping);
+        return;
+    }
+
+    u32 mip_width = width, mip_height = height;
+    for (u32 i = 1; i < num_levels; ++i) {
+        // In case the image is not square keep at 1
+        if (mip_width > 1)
+            mip_width /= 2;
+        if (mip_height > 1)
+            mip_height /= 2;
+
+        mip_levels.emplace_back(ResizeImage(*mip_levels.back(), mip_width, mip_height, srgb));
+    }
+    LOG_TALLY("Generated mip levels", "textures", num_levels - 1);
+
+    std::vector<std::span<const u8>> levels;
+    for (const auto& level : mip_levels | std::views::drop(1)) {
+        levels.emplace_back(level->pixels, level->size);
+    }
+    pack.Add(hash, width, height, levels);
+}
+
+DecodedTexture::DecodedTexture(u32 width_, u32 height_, u32 num_levels_, vk::Format format_,
+                               const vk::ComponentMapping& components_,
+                               std::span<const std::span<const u8>> levels,
+                               std::shared_ptr<const void> owner_)
+    : width(width_), height(height_), num_levels(num_levels_), format(format_),
+      components(components_), owner(std::move(owner_)) {
+
+    if (levels.empty() || levels.size() > num_levels) {
+        SPDLOG_ERROR("Invalid number of mip levels {} (total {})", levels.size(), num_levels);
+        throw std::runtime_error("Invalid number of mip levels");
+    }
+
+    u32 mip_width = width, mip_height = height;
+    for (const auto& level : levels) {
+        if (level.size() != GetLevelSize(format, mip_width, mip_height)) {
+            SPDLOG_ERROR("Mip level {} has size {}, expected {}x{} {}", mip_levels.size(),
+                         level.size(), mip_width, mip_height, vk::to_string(format));
+            throw std::runtime_error("Mip level has incorrect size");
+        }
+        if (owner) {
+            mip_levels.emplace_back(std::make_unique<TextureLevel>(
+                static_cast<int>(mip_width), static_cast<int>(mip_height), level,
+                TextureLevel::Borrow{}));
+        } else {
+            mip_levels.emplace_back(std::make_unique<TextureLevel>(
+                static_cast<int>(mip_width), static_cast<int>(mip_height), level));
+        }
+        mip_width = std::max(mip_width / 2, 1u);
+        mip_height = std::max(mip_height / 2, 1u);
+    }
+}
+
+DecodedTexture::~DecodedTexture() = default;
+
+void DecodedTexture::DecodeOnCPU() {
+    if (!jpeg) {
+        return;
+    }
+    mip_levels.emplace_back(DecodeImage(jpeg_file, nullptr));
+    jpeg.reset();
+    jpeg_file = {};
+}
+
+void DecodedTexture::GenerateMipmaps() {
+    PROFILE_FUNCTION();
+    DecodeOnCPU();
+    const bool srgb = format == vk::Format::eR8G8B8A8Srgb;
+    while (mip_levels.size() < num_levels) {
+        const auto& last_image = *mip_levels.back();
+        mip_levels.emplace_back(ResizeImage(last_image,
+                                            std::max(static_cast<u32>(last_image.width) / 2, 1u),
+                                            std::max(static_cast<u32>(last_image.height) / 2, 1u),
+                                            srgb));
+    }
+}
+
+void DecodedTexture::DropLevels(u32 count) {
+    PROFILE_FUNCTION();
+    count = std::min(count, num_levels - 1);
+    if (count != 0) {
+        DecodeOnCPU();
+    }
+    const bool can_resize =
+        format == vk::Format::eR8G8B8A8Srgb || format == vk::Format::eR8G8B8A8Unorm;
+    if (count >= mip_levels.size() && !can_resize) {
+        count = static_cast<u32>(mip_levels.size()) - 1;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    width = std::max(width >> count, 1u);
+    height = std::max(height >> count, 1u);
+    num_levels -= count;
+    if (count < mip_levels.size()) {
+        mip_levels.erase(mip_levels.begin(), mip_levels.begin() + count);
+        return;
+    }
+    // Once, from the finest level, rather than generating the levels in between
+    auto resized = ResizeImage(*mip_levels[0], width, height, format == vk::Format::eR8G8B8A8Srgb);
+    mip_levels.clear();
+    mip_levels.emplace_back(std::move(resized));
+}
+
+// Swizzle for the view of an image whose first channels hold [first_channel, first_channel +
+// num_channels) of the original, putting them back in their place
+static vk::ComponentMapping GetMovedChannels(u32 first_channel, u32 num_channels) {
+    std::array<vk::ComponentSwizzle, 4> swizzles{vk::ComponentSwizzle::eZero,
+                                                 vk::ComponentSwizzle::eZero,
+                                                 vk::ComponentSwizzle::eZero,
+                                                 vk::ComponentSwizzle::eOne};
+    static constexpr std::array<vk::ComponentSwizzle, 2> Sources{vk::ComponentSwizzle::eR,
+                                                                 vk::ComponentSwizzle::eG};
+    for (u32 i = 0; i < num_channels; ++i) {
+        swizzles[first_channel + i] = Sources[i];
+    }
+    return {swizzles[0], swizzles[1], swizzles[2], swizzles[3]};
+}
+
+void DecodedTexture::Compress(BlockFormat block_format, u32 first_channel,
+                              Common::ThreadPool* thread_pool) {
+    PROFILE_FUNCTION();
+    if (format != vk::Format::eR8G8B8A8Srgb && format != vk::Format::eR8G8B8A8Unorm) {
+        SPDLOG_ERROR("Cannot compress texture of format {}", vk::to_string(format));
+        throw std::runtime_error("Cannot compress texture");
+    }
+    const u32 num_channels = block_format == BlockFormat::BC4   ? 1
+                             : block_format == BlockFormat::BC5 ? 2
+                                                                : 4;
+    if (first_channel + num_channels > 4) {
+        SPDLOG_ERROR("Invalid channels {}..{} to compress", first_channel,
+                     first_channel + num_channels);
+        throw std::runtime_error("Invalid channels to compress");
+    }
+
+    GenerateMipmaps(); // Decodes jpeg as well
+
+    std::vector<u8> shifted, compressed;
+    for (auto& level : mip_levels) {
+        std::span<const u8> pixels{level->pixels, level->size};
+        if (first_channel != 0) { // Move the channels to encode to the front
+            shifted.assign(pixels.begin(), pixels.end());
+            for (std::size_t i = 0; i < shifted.size(); i += 4) {
+                std::memmove(shifted.data() + i, shifted.data() + i + first_channel,
+                             4 - first_channel);
+            }
+            pixels = shifted;
+        }
+
+        const auto level_width = static_cast<u32>(level->width);
+        const auto level_height = static_cast<u32>(level->height);
+        compressed.resize(GetCompressedSize(block_format, level_width, level_height));
+        CompressBlocks(block_format, pixels, level_width, level_height, compressed, thread_pool);
+        level = std::make_unique<TextureLevel>(level->width, level->height, compressed);
+    }
+
+    if (first_channel != 0) {
+        components = GetMovedChannels(first_channel, num_channels);
+    }
+    format = GetCompressedFormat(block_format, format == vk::Format::eR8G8B8A8Srgb);
+}
+
+void DecodedTexture::Pack(const VulkanDevice& device, u32 num_channels, u32 first_channel) {
+    PROFILE_FUNCTION();
+    if (format != vk::Format::eR8G8B8A8Unorm) {
+        SPDLOG_ERROR("Cannot pack texture of format {}", vk::to_string(format));
+        throw std::runtime_error("Cannot pack texture");
+    }
+    if (num_channels == 0 || num_channels > 2 || first_channel + num_channels > 4) {
+        SPDLOG_ERROR("Invalid channels {}..{} to pack", first_channel,
+                     first_channel + num_channels);
+        throw std::runtime_error("Invalid channels to pack");
+    }
+    DecodeOnCPU();
+    const auto packed_format = num_channels == 1 ? vk::Format::eR8Unorm : vk::Format::eR8G8Unorm;
+    if (mip_levels.size() < num_levels && !CanBlitMipmaps(device, packed_format)) {
+        GenerateMipmaps();
+    }
+
+    std::vector<u8> packed;
+    for (auto& level : mip_levels) {
+        const std::size_t num_pixels = std::size_t{static_cast<u32>(level->width)} *
+                                       static_cast<u32>(level->height);
+        packed.resize(num_pixels * num_channels);
+        for (std::size_t i = 0; i < num_pixels; ++i) {
+            for (u32 j = 0; j < num_channels; ++j) {
+                packed[i * num_channels + j] = level->pixels[i * 4 + first_channel + j];
+            }
+        }
+        level = std::make_unique<TextureLevel>(level->width, level->height, packed);
+    }
+
+    if (first_channel != 0) {
+        components = GetMovedChannels(first_channel, num_channels);
+    }
+    format = packed_format;
+}
+
+std::span<const u8> DecodedTexture::GetLevel(std::size_t level) const {
+    return {mip_levels.at(level)->pixels, mip_levels.at(level)->size};
+}
+
+std::size_t DecodedTexture::GetTotalSize() const {
+    std::size_t total_size =
+        jpeg ? Common::AlignUp(VulkanJPEGDecoder::GetUploadSize(*jpeg), TexelBlockAlignment) : 0;
+    for (const auto& level : mip_levels) {
+        total_size += Common::AlignUp(level->size, TexelBlockAlignment);
+    }
+    return total_size;
+}
+
+VulkanTexture::VulkanTexture(VulkanDevice& device, std::span<const u8> file_data, bool mipmaps) {
+    auto data = std::make_unique<DecodedTexture>(device, file_data, mipmaps);
+    CreateImage(device, *data);
+
+    VulkanTextureUploadBatch batch{device};
+    batch.Upload(*this, std::move(data));
+    batch.Flush();
+}
+
+VulkanTexture::VulkanTexture(VulkanDevice& device, std::unique_ptr<DecodedTexture> data,
+                             VulkanTextureUploadBatch& batch) {
+    CreateImage(device, *data);
+    batch.Upload(*this, std::move(data));
+}
+
+VulkanTexture::~VulkanTexture() = default;
+
+std::unique_ptr<VulkanTexture> VulkanTexture::CreateSparse(VulkanDevice& device,
+                                                           const DecodedTexture& data) {
+    std::unique_ptr<VulkanTexture> texture{new VulkanTexture()};
+    texture->CreateImage(device, data, true);
+    return texture;
+}
+
+std::vector<std::unique_ptr<VulkanTexture>> VulkanTexture::CreateArray(
+    VulkanDevice& device, std::vector<std::unique_ptr<DecodedTexture>> data,
+    VulkanTextureUploadBatch& batch) {
+
+    std::vector<std::unique_ptr<VulkanTexture>> textures;
+    for (auto& layer_data : data) {
+        std::unique_ptr<VulkanTexture> texture{new VulkanTexture()};
+        if (textures.empty()) {
+            texture->CreateImage(device, *layer_data, false, static_cast<u32>(data.size()));
+        } else {
+            const auto& first = *textures[0];
+            texture->width = first.width;
+            texture->height = first.height;
+            texture->mip_levels = first.mip_levels;
+            texture->format = first.format;
+            texture->layer = static_cast<u32>(textures.size());
+            texture->image = first.image;
+            texture->CreateView(device, *layer_data);
+        }
+        batch.Upload(*texture, std::move(layer_data));
+        textures.emplace_back(std::move(texture));
+    }
+    return textures;
+}
+
+void VulkanTexture::CreateImage(VulkanDevice& device, const DecodedTexture& data, bool sparse,
+                                u32 array_layers) {
+    PROFILE_FUNCTION();
+    width = data.width;
+    height = data.height;
+    mip_levels = data.num_levels;
+    format = data.format;
+
+    // Level 0 of JPEG images is written by VulkanJPEGDecoder, through a UNORM storage view
+    vk::ImageCreateFlags flags{};
+    if (sparse) {
+        flags = vk::ImageCreateFlagBits::eSparseBinding | vk::ImageCreateFlagBits::eSparseResidency;
+    } else if (data.jpeg && data.format != vk::Format::eR8G8B8A8Unorm) {
+        flags = vk::ImageCreateFlagBits::eMutableFormat | vk::ImageCreateFlagBits::eExtendedUsage;
+    }
 
     // Create image & image_view
-    image = std::make_unique<VulkanImage>(
-        *device.allocator,
-        vk::ImageCreateInfo{
-            .imageType = vk::ImageType::e2D,
-            .format = vk::Format::eR8G8B8A8Srgb,
-            .extent =
-                {
-                    .width = width,
-                    .height = height,
-                    .depth = 1,
-                },
-            .mipLevels = mip_levels,
-            .arrayLayers = 1,
-            .usage = vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled,
-            .sharingMode = vk::SharingMode::eExclusive,
-            .initialLayout = vk::ImageLayout::eUndefined,
-        },
-        VmaAllocationCreateInfo{
-            .usage = VMA_MEMORY_USAGE_AUTO,
-        });
+    const vk::ImageCreateInfo image_create_info{
+        .flags = flags,
+        .imageType = vk::ImageType::e2D,
+        .format = data.format,
+        .extent =
+            {
+                .width = width,
+                .height = height,
+                .depth = 1,
+            },
+        .mipLevels = mip_levels,
+        .arrayLayers = array_layers,
+        .usage = vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eTransferDst |
+                 vk::ImageUsageFlagBits::eSampled |
+                 (data.jpeg ? vk::ImageUsageFlagBits::eStorage : vk::ImageUsageFlags{}),
+        .sharingMode = vk::SharingMode::eExclusive,
+        .initialLayout = vk::ImageLayout::eUndefined,
+    };
+    if (sparse) {
+        sparse_image = vk::raii::Image{*device, image_create_info};
+    } else {
+        image = std::make_shared<VulkanImage>(*device.allocator, image_create_info,
+                                              VmaAllocationCreateInfo{
+                                                  .usage = VMA_MEMORY_USAGE_AUTO,
+                                              },
+                                              MemoryCategory::Textures);
+        image->SetName(array_layers == 1 ? fmt::format("{}x{} {}", width, height,
+                                                       vk::to_string(data.format))
+                                         : fmt::format("{}x{}x{} {}", width, height, array_layers,
+                                                       vk::to_string(data.format)));
+    }
+    CreateView(device, data);
+}
+
+void VulkanTexture::CreateView(VulkanDevice& device, const DecodedTexture& data) {
     image_view =
         vk::raii::ImageView{*device, vk::ImageViewCreateInfo{
-                                         .image = **image,
+                                         .image = GetImage(),
                                          .viewType = vk::ImageViewType::e2D,
-                                         .format = vk::Format::eR8G8B8A8Srgb,
+                                         .format = data.format,
+                                         .components = data.components,
                                          .subresourceRange =
                                              {
                                                  .aspectMask = vk::ImageAspectFlagBits::eColor,
                                                  .baseMipLevel = 0,
                                                  .levelCount = mip_levels,
-                                                 .baseArrayLayer = 0,
+                                                 .baseArrayLayer = layer,
                                                  .layerCount = 1,
                                              },
                                      }};
+}
 
-    // Determine & create mipmaps folder
-    const std::filesystem::path mipmaps_folder = device.startup_path / u8"mipmaps";
-    std::filesystem::create_directory(mipmaps_folder);
+VulkanTextureUploadBatch::VulkanTextureUploadBatch(VulkanDevice& device_,
+                                                   std::size_t max_batch_size_)
+    : device(device_),
+      // Larger batches would not fit in the ring and get dedicated staging buffers instead
+      max_batch_size(std::min(max_batch_size_, device.upload_ring->GetMaxAllocationSize())) {}
 
-    // Hash the image to mark mipmap version, if necessary
-    std::string hash;
-    if (mip_levels > 1) {
-        const auto& [hash_h, hash_l] =
-            CityHashCrc128(reinterpret_cast<const char*>(image_data->pixels), image_data->size);
-        hash = fmt::format("{:08x}{:08x}", hash_h, hash_l);
+VulkanTextureUploadBatch::~VulkanTextureUploadBatch() {
+    if (!pending.empty()) {
+        SPDLOG_WARN("Texture upload batch destroyed with {} pending uploads", pending.size());
     }
+}
 
-    u32 mip_width = width, mip_height = height;
-    for (u32 i = 0; i < mip_levels; ++i) {
-        if (i != 0) {
-            // Try load mipmap. If not successful, resize it on the fly and save it.
-            // Determine mipmap path
-            const auto mipmap_name = fmt::format("{}.{}.png", hash, i);
-            const auto mipmap_path = mipmaps_folder / std::filesystem::u8path(mipmap_name);
-
-            const auto last_image = std::move(image_data);
-            image_data.reset();
-            if (std::filesystem::exists(mipmap_path)) {
-                try {
-                    image_data = std::make_unique<StbImage>(Common::ReadFileContents(mipmap_path));
-                } catch (...) {
-                    SPDLOG_WARN("Could not load {} mip level {} from file, regenerating.", hash, i);
-                    image_data.reset();
-                }
-                if (static_cast<u32>(image_data->width) != mip_width ||
-                    static_cast<u32>(image_data->height) != mip_height) {
+void VulkanTextureUploadBatch::Upload(const VulkanTexture& texture,
+                                      std::unique_ptr<DecodedTexture> data) {
+    PendingUploads uploads;
+    std::size_t total_size{};
+    {
+        std::scoped_lock lock{mutex};
+        pending_size += data->GetTotalSize();
+        pending.emplace_back(&texture, std::move(data));
+        if (pending_size < max_batch_size) {
+            return;
+        }
+        uploads = std::move(pending);
+        total_size = std::exchange(pending_size, 0);
+        pending.clear();
+    }
+    // Submit outside the lock so that other threads can keep queueing
+    Submit(uploads, total_size);
+}
 
-                    SPDLOG_WARN("{} mip level {} has incorrect dimensions, regenerating.", hash, i);
-                    image_data.reset();
-                }
-            } else {
-                SPDLOG_WARN("{} mip level {} does not exist, generating.", hash, i);
-            }
+void VulkanTextureUploadBatch::Flush() {
+    PendingUploads uploads;
+    std::size_t total_size{};
+    {
+        std::scoped_lock lock{mutex};
+        uploads = std::move(pending);
+        total_size = std::exchange(pending_size, 0);
+        pending.clear();
+    }
+    if (!uploads.empty()) {
+        Submit(uploads, total_size);
+    }
+}
 
-            if (!image_data) { // Resize on the fly and save
-                image_data = std::make_unique<StbImage>(mip_width, mip_height);
-                if (!stbir_resize_uint8_srgb(last_image->pixels, last_image->width,
-                                             last_image->height, 0, image_data->pixels,
-                                             image_data->width, image_data->height, 0, 4, 3, 0)) {
-                    throw std::runtime_error("Could not resize image");
-                }
+void VulkanTextureUploadBatch::Submit(const PendingUploads& uploads, std::size_t total_size) {
+    PROFILE_FUNCTION();
+    auto upload = device.upload_ring->Allocate(total_size);
+    const auto& cmd = upload.command_buffer;
 
-                std::ofstream out_file{mipmap_path, std::ios::binary};
-                if (!stbi_write_png_to_func(&StbiWriteCallback, &out_file, image_data->width,
-                                            image_data->height, 4, image_data->pixels, 0)) {
-                    SPDLOG_WARN("Failed to write {} mip level {} to file", hash, i);
-                }
+    // Copy the data with the ring unlocked, so that other threads can upload meanwhile. The
+    // offsets are the same as those of the copies recorded below.
+    upload.WriteUnlocked([&] {
+        std::size_t offset = 0;
+        for (const auto& [texture, data] : uploads) {
+            if (data->jpeg) {
+                offset += data->GetTotalSize();
+                continue;
+            }
+            for (const auto& level : data->mip_levels) {
+                std::memcpy(upload.data + offset, level->pixels, level->size);
+                offset += Common::AlignUp(level->size, TexelBlockAlignment);
             }
         }
+    });
+
+    const auto MakeBarrier = [](const VulkanTexture& texture, u32 base_level, u32 level_count,
+                                vk::ImageMemoryBarrier2 params) {
+        params.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        params.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        params.image = **texture.image;
+        params.subresourceRange = {
+            .aspectMask = vk::ImageAspectFlagBits::eColor,
+            .baseMipLevel = base_level,
+            .levelCount = level_count,
+            .baseArrayLayer = texture.layer,
+            .layerCount = 1,
+        };
+        return params;
+    };
+    // Level 0 of JPEG images is decoded on the GPU instead
+    const auto GetNumUploadedLevels = [](const auto& upload) {
+        return upload.second->jpeg ? 1u : static_cast<u32>(upload.second->mip_levels.size());
+    };
+    const auto IsCopied = [](const auto& upload) { return !upload.second->jpeg; };
 
-        // Upload mipmap
-        auto handle = device.allocator->CreateStagingBuffer(image_data->size);
-        const auto& buffer = *handle;
-
-        std::memcpy(buffer.allocation_info.pMappedData, image_data->pixels, image_data->size);
-        vmaFlushAllocation(**device.allocator, buffer.allocation, 0, VK_WHOLE_SIZE);
-
-        Helpers::ImageLayoutTransition(buffer.command_buffer, image,
-                                       {
-                                           .srcStageMask = vk::PipelineStageFlagBits2::eTopOfPipe,
-                                           .srcAccessMask = vk::AccessFlags2{},
-                                           .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
-                                           .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
-                                           .oldLayout = vk::ImageLayout::eUndefined,
-                                           .newLayout = vk::ImageLayout::eTransferDstOptimal,
-                                           .subresourceRange =
-                                               {
-                                                   .baseMipLevel = i,
-                                                   .levelCount = 1,
-                                               },
-                                       });
-        buffer.command_buffer.copyBufferToImage(
-            *buffer, **image, vk::ImageLayout::eTransferDstOptimal,
-            {{
+    // Transition all images at once
+    const auto to_transfer_barriers = Common::VectorFromRange(
+        uploads | std::views::filter(IsCopied) | std::views::transform([&](const auto& upload) {
+            return MakeBarrier(*upload.first, 0, GetNumUploadedLevels(upload),
+                               {
+                                   .srcStageMask = vk::PipelineStageFlagBits2::eTopOfPipe,
+                                   .srcAccessMask = vk::AccessFlags2{},
+                                   .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+                                   .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                                   .oldLayout = vk::ImageLayout::eUndefined,
+                                   .newLayout = vk::ImageLayout::eTransferDstOptimal,
+                               });
+        }));
+    cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = static_cast<u32>(to_transfer_barriers.size()),
+        .pImageMemoryBarriers = to_transfer_barriers.data(),
+    });
+
+    std::size_t offset = 0;
+    std::vector<vk::BufferImageCopy> regions;
+    std::vector<VulkanJPEGDecoder::Image> jpeg_images;
+    for (const auto& [texture, data] : uploads) {
+        if (data->jpeg) { // Written by the decoder
+            jpeg_images.push_back({
+                .texture = texture,
+                .coefficients = data->jpeg.get(),
+                .offset = offset,
+            });
+            offset += data->GetTotalSize();
+            continue;
+        }
+        regions.clear();
+        for (u32 i = 0; i < data->mip_levels.size(); ++i) {
+            const auto& level = *data->mip_levels[i];
+            regions.push_back({
+                .bufferOffset = upload.offset + offset,
                 .imageSubresource =
                     {
                         .aspectMask = vk::ImageAspectFlagBits::eColor,
                         .mipLevel = i,
-                        .baseArrayLayer = 0,
+                        .baseArrayLayer = texture->layer,
                         .layerCount = 1,
                     },
                 .imageExtent =
                     {
-                        .width = mip_width,
-                        .height = mip_height,
+                        .width = static_cast<u32>(level.width),
+                        .height = static_cast<u32>(level.height),
                         .depth = 1,
                     },
-            }});
-        Helpers::ImageLayoutTransition(
-            buffer.command_buffer, image,
-            {
-                .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
-                .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
-                .dstStageMask = vk::PipelineStageFlagBits2::eFragmentShader,
-                .dstAccessMask = vk::AccessFlagBits2::eShaderRead,
-                .oldLayout = vk::ImageLayout::eTransferDstOptimal,
-                .newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
-                .subresourceRange =
-                    {
-                        .baseMipLevel = i,
-                        .levelCount = 1,
-                    },
             });
+            // Block compressed copies need offsets aligned to the block size
+            offset += Common::AlignUp(level.size, TexelBlockAlignment);
+        }
+        cmd.copyBufferToImage(upload.buffer, **texture->image, vk::ImageLayout::eTransferDstOptimal,
+                              regions);
+    }
 
-        handle.Submit();
+    // Fully uploaded images go straight to the shaders, the rest to the blits below, which read
+    // from the last uploaded level
+    const auto release_barriers = Common::VectorFromRange(
+        uploads | std::views::filter(IsCopied) | std::views::transform([&](const auto& upload) {
+            const u32 uploaded_levels = GetNumUploadedLevels(upload);
+            if (uploaded_levels == upload.first->mip_levels) {
+                return MakeBarrier(*upload.first, 0, uploaded_levels,
+                                   {
+                                       .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
+                                       .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                                       .dstStageMask = vk::PipelineStageFlagBits2::eFragmentShader,
+                                       .dstAccessMask = vk::AccessFlagBits2::eShaderRead,
+                                       .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+                                       .newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+                                   });
+            }
+            return MakeBarrier(*upload.first, 0, uploaded_levels,
+                               {
+                                   .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
+                                   .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                                   .dstStageMask = vk::PipelineStageFlagBits2::eBlit,
+                                   .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+                                   .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+                                   .newLayout = vk::ImageLayout::eTransferSrcOptimal,
+                               });
+        }));
+    upload.Release(release_barriers);
+    if (!jpeg_images.empty()) {
+        upload.Retain(std::make_shared<VulkanJPEGDecoder>(device, upload, jpeg_images));
+    }
 
-        // In case the image is not square keep at 1
-        if (mip_width > 1)
-            mip_width /= 2;
-        if (mip_height > 1)
-            mip_height /= 2;
+    // Generate the remaining levels on the graphics queue, one level of all images at a time
+    std::vector<std::pair<const VulkanTexture*, u32>> generated; // Texture, first level
+    for (const auto& upload : uploads) {
+        const u32 uploaded_levels = GetNumUploadedLevels(upload);
+        if (uploaded_levels < upload.first->mip_levels) {
+            generated.emplace_back(upload.first, uploaded_levels);
+        }
+    }
+    if (generated.empty()) {
+        return;
     }
-}
 
-VulkanTexture::~VulkanTexture() = default;
+    const auto& graphics_cmd = upload.GetGraphicsCommandBuffer();
+    std::vector<vk::ImageMemoryBarrier2> barriers;
+    for (const auto& [texture, first_level] : generated) {
+        barriers.emplace_back(MakeBarrier(*texture, first_level, texture->mip_levels - first_level,
+                                          {
+                                              .srcStageMask = vk::PipelineStageFlagBits2::eNone,
+                                              .srcAccessMask = vk::AccessFlags2{},
+                                              .dstStageMask = vk::PipelineStageFlagBits2::eBlit,
+                                              .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                                              .oldLayout = vk::ImageLayout::eUndefined,
+                                              .newLayout = vk::ImageLayout::eTransferDstOptimal,
+                                          }));
+    }
+    graphics_cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = static_cast<u32>(barriers.size()),
+        .pImageMemoryBarriers = barriers.data(),
+    });
+
+    const auto GetExtent = [](const VulkanTexture& texture, u32 level) {
+        return vk::Offset3D{
+            .x = static_cast<s32>(std::max(texture.width >> level, 1u)),
+            .y = static_cast<s32>(std::max(texture.height >> level, 1u)),
+            .z = 1,
+        };
+    };
+    const u32 max_levels = std::ranges::max(
+        generated | std::views::transform([](const auto& pair) { return pair.first->mip_levels; }));
+    for (u32 level = 1; level < max_levels; ++level) {
+        barriers.clear();
+        for (const auto& [texture, first_level] : generated) {
+            if (level < first_level || level >= texture->mip_levels) {
+                continue;
+            }
+            // Box filtered. For sRGB formats the filtering happens in linear space.
+            graphics_cmd.blitImage(
+                **texture->image, vk::ImageLayout::eTransferSrcOptimal, **texture->image,
+                vk::ImageLayout::eTransferDstOptimal,
+                {{
+                    .srcSubresource =
+                        {
+                            .aspectMask = vk::ImageAspectFlagBits::eColor,
+                            .mipLevel = level - 1,
+                            .baseArrayLayer = texture->layer,
+                            .layerCount = 1,
+                        },
+                    .srcOffsets = {{vk::Offset3D{}, GetExtent(*texture, level - 1)}},
+                    .dstSubresource =
+                        {
+                            .aspectMask = vk::ImageAspectFlagBits::eColor,
+                            .mipLevel = level,
+                            .baseArrayLayer = texture->layer,
+                            .layerCount = 1,
+                        },
+                    .dstOffsets = {{vk::Offset3D{}, GetExtent(*texture, level)}},
+                }},
+                vk::Filter::eLinear);
+            barriers.emplace_back(
+                MakeBarrier(*texture, level, 1,
+                            {
+                                .srcStageMask = vk::PipelineStageFlagBits2::eBlit,
+                                .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                                .dstStageMask = vk::PipelineStageFlagBits2::eBlit,
+                                .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+                                .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+                                .newLayout = vk::ImageLayout::eTransferSrcOptimal,
+                            }));
+        }
+        graphics_cmd.pipelineBarrier2({
+            .imageMemoryBarrierCount = static_cast<u32>(barriers.size()),
+            .pImageMemoryBarriers = barriers.data(),
+        });
+    }
+
+    barriers.clear();
+    for (const auto& [texture, first_level] : generated) {
+        barriers.emplace_back(MakeBarrier(*texture, 0, texture->mip_levels,
+                                          {
+                                              .srcStageMask = vk::PipelineStageFlagBits2::eBlit,
+                                              .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                                              .dstStageMask =
+                                                  vk::PipelineStageFlagBits2::eFragmentShader,
+                                              .dstAccessMask = vk::AccessFlagBits2::eShaderRead,
+                                              .oldLayout = vk::ImageLayout::eTransferSrcOptimal,
+                                              .newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+                                          }));
+    }
+    graphics_cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = static_cast<u32>(barriers.size()),
+        .pImageMemoryBarriers = barriers.data(),
+    });
+}
 
 } // namespace Renderer
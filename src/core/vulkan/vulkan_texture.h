@@ -6,26 +6,58 @@
 
 #include <filesystem>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string_view>
 #include <utility>
+#include <vector>
 #include <vk_mem_alloc.h>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_render_target_heap.h"
+
+namespace Common {
+struct JPEGCoefficients;
+class ThreadPool;
+}
 
 namespace Renderer {
 
-class VulkanAllocator;
+enum class BlockFormat;
+
+class LoadProfiler;
 class VulkanDevice;
 
 /**
- * RAII wrapper for VMA image allocations.
+ * RAII wrapper for VMA image allocations, whose memory is tracked under the category.
+ * Render targets may instead be placed into a slot of the render target heap, which owns their
+ * memory (and leaves the allocation null).
+ * Images may request compression other than the default lossless one of the driver (e.g.
+ * eFixedRateDefault), where the device has image_compression_control.
  */
 class VulkanImage : NonCopyable {
 public:
     explicit VulkanImage(const VulkanAllocator& allocator,
                          const vk::ImageCreateInfo& image_create_info,
-                         const VmaAllocationCreateInfo& alloc_create_info);
+                         const VmaAllocationCreateInfo& alloc_create_info,
+                         MemoryCategory category, vk::ImageCompressionFlagsEXT compression = {});
+    explicit VulkanImage(VulkanRenderTargetHeap& heap, VulkanRenderTargetHeap::Slot slot,
+                         const vk::ImageCreateInfo& image_create_info,
+                         vk::ImageCompressionFlagsEXT compression = {});
     ~VulkanImage();
 
+    // Names the allocation, as VulkanBuffer::SetName. Images of the render target heap share
+    // the memory of their slot, which is named by the heap.
+    void SetName(std::string_view name) const;
+    // How the first level and layer of the aspect are compressed, if the device can tell
+    std::optional<vk::ImageCompressionPropertiesEXT> GetCompression(
+        vk::ImageAspectFlags aspect = vk::ImageAspectFlagBits::eColor) const;
+    // Logs GetCompression at debug level, to compare the bandwidth of runs against
+    void LogCompression(std::string_view name,
+                        vk::ImageAspectFlags aspect = vk::ImageAspectFlagBits::eColor) const;
+
     VkImage operator*() const noexcept {
         return image;
     }
@@ -33,20 +65,169 @@ public:
     VmaAllocator allocator{};
     VmaAllocation allocation{};
     VmaAllocationInfo allocation_info{};
+    MemoryCategory category{};
 
 private:
     VkImage image{};
+    const VulkanAllocator& owner;
+    VulkanRenderTargetHeap* heap{}; // Null unless placed into it
+    VulkanRenderTargetHeap::Slot slot{};
+};
+
+struct TextureLevel;
+class VulkanTextureUploadBatch;
+
+/**
+ * CPU side texture data: the image decoded to RGBA8 (see ImageDecoder), along with its mip chain.
+ * When the device can blit the format, only level 0 is decoded and the rest of the chain is
+ * generated on the GPU during upload.
+ * KTX2 files are not decoded; their levels (typically block compressed) are uploaded as is.
+ * Basis Universal payloads are transcoded to the first of BC7, ASTC 4x4 and ETC2 the device can
+ * sample, or RGBA8, see BasisU.
+ * Decoded images may also be block compressed on the CPU with Compress().
+ * JPEG files may instead be left as DCT coefficients, which the upload batch finishes decoding
+ * on the GPU (see VulkanJPEGDecoder).
+ * Does not touch the GPU, so it can be created on any thread.
+ */
+class DecodedTexture : NonCopyable {
+public:
+    // Non-sRGB images hold data (e.g. normals) rather than colors.
+    // If gpu_decode is set, JPEG files that Common::DecodeJPEGCoefficients can read are only
+    // entropy decoded, when level 0 is all that would be decoded on the CPU.
+    // Files are decoded by the first of GetImageDecoders that can, timed by the profiler if any.
+    explicit DecodedTexture(const VulkanDevice& device, std::span<const u8> file_data,
+                            bool mipmaps = true, bool srgb = true, bool gpu_decode = false,
+                            LoadProfiler* profiler = nullptr);
+    // Wraps already decoded levels (e.g. from a cache), which owner keeps alive.
+    // If owner is null, the levels are copied instead.
+    explicit DecodedTexture(u32 width, u32 height, u32 num_levels, vk::Format format,
+                            const vk::ComponentMapping& components,
+                            std::span<const std::span<const u8>> levels,
+                            std::shared_ptr<const void> owner);
+    ~DecodedTexture();
+
+    // Whether the file is a KTX2 container, which may not be loadable on every device.
+    static bool IsKTX2(std::span<const u8> file_data);
+    // Whether the KTX2 file is valid and its format can be sampled directly, or it is a Basis
+    // Universal payload that can be transcoded.
+    static bool CanLoadKTX2(const VulkanDevice& device, std::span<const u8> file_data);
+    // Device memory of the texture of the file with all of its levels, estimated from its header
+    // without decoding it: as RGBA8, or a byte per texel if block_compressed (KTX2 files have
+    // their actual levels, and Basis Universal payloads a byte per texel). 0 if the file cannot
+    // be read.
+    static std::size_t EstimateSize(std::span<const u8> file_data, bool block_compressed);
+
+    // Generates the missing levels on the CPU, then compresses every level. Channels
+    // [first_channel, first_channel + N) of the image are encoded, and the view swizzle moves
+    // them back, so shaders sample them in their original place.
+    void Compress(BlockFormat block_format, u32 first_channel = 0,
+                  Common::ThreadPool* thread_pool = nullptr);
+    // Keeps [first_channel, first_channel + num_channels) of a linear RGBA8 image as R8 (1) or
+    // RG8 (2), with the view swizzle moving them back like Compress. The missing levels are
+    // left to the GPU when it can generate them in that format.
+    void Pack(const VulkanDevice& device, u32 num_channels, u32 first_channel = 0);
+
+    // Including the padding between levels in the upload batch
+    std::size_t GetTotalSize() const;
+    // Tightly packed texels (or blocks) of the level. Not of the levels of jpeg.
+    std::span<const u8> GetLevel(std::size_t level) const;
+
+    // Generates the levels that would otherwise be generated on the GPU. RGBA8 only.
+    void GenerateMipmaps();
+    // Drops the count finest levels, keeping at least one, so that the texture becomes that many
+    // times smaller. Decoded RGBA8 images without the levels are downscaled straight to the new
+    // extent; other formats drop at most the levels they have but one.
+    void DropLevels(u32 count);
+
+    u32 width{};
+    u32 height{};
+    u32 num_levels{}; // Including the levels to generate on the GPU
+    vk::Format format = vk::Format::eR8G8B8A8Srgb;
+    vk::ComponentMapping components{};
+    std::vector<std::unique_ptr<TextureLevel>> mip_levels;
+    // Level 0 left to the GPU, mip_levels is empty then. The methods processing the levels on
+    // the CPU (GenerateMipmaps, DropLevels, Compress and Pack) decode it on the CPU first.
+    std::unique_ptr<Common::JPEGCoefficients> jpeg;
+
+private:
+    void LoadKTX2(const VulkanDevice& device, std::span<const u8> file_data);
+    // Of jpeg, from a copy of its file
+    void DecodeOnCPU();
+
+    std::shared_ptr<const void> owner;
+    std::vector<u8> jpeg_file;
 };
 
 class VulkanTexture : NonCopyable {
 public:
-    explicit VulkanTexture(VulkanDevice& device, std::vector<u8> file_data, bool mipmaps = true);
+    // Decodes and uploads the texture immediately.
+    explicit VulkanTexture(VulkanDevice& device, std::span<const u8> file_data,
+                           bool mipmaps = true);
+    // Creates the image and queues the upload on the batch.
+    // The texture must not be used before the batch has been flushed.
+    explicit VulkanTexture(VulkanDevice& device, std::unique_ptr<DecodedTexture> data,
+                           VulkanTextureUploadBatch& batch);
     ~VulkanTexture();
 
+    // Creates a sparse image without any memory bound, for VulkanTextureStreamer.
+    static std::unique_ptr<VulkanTexture> CreateSparse(VulkanDevice& device,
+                                                       const DecodedTexture& data);
+    // Creates a single image with a layer for each of the textures, which must have the same
+    // format, extent and number of levels, and queues their uploads on the batch. Each texture
+    // views its own layer as a 2D image, so they are sampled like any other.
+    static std::vector<std::unique_ptr<VulkanTexture>> CreateArray(
+        VulkanDevice& device, std::vector<std::unique_ptr<DecodedTexture>> data,
+        VulkanTextureUploadBatch& batch);
+
+    vk::Image GetImage() const noexcept {
+        return image ? vk::Image{**image} : *sparse_image;
+    }
+
     u32 width{};
     u32 height{};
-    std::unique_ptr<VulkanImage> image;
+    u32 mip_levels{};
+    vk::Format format{};
+    u32 layer{}; // Of image, which is shared by the textures of an array
+    std::shared_ptr<VulkanImage> image;
+    vk::raii::Image sparse_image = nullptr; // Instead of image, for streamed textures
     vk::raii::ImageView image_view = nullptr;
+
+private:
+    VulkanTexture() = default;
+    void CreateImage(VulkanDevice& device, const DecodedTexture& data, bool sparse = false,
+                     u32 array_layers = 1);
+    void CreateView(VulkanDevice& device, const DecodedTexture& data);
+};
+
+/**
+ * Records the uploads of many textures into a single upload ring allocation.
+ * Upload() is thread safe. When the queued data exceeds the batch size, the calling thread
+ * records the batch while other threads continue decoding and queueing into a new one.
+ * The batch size is capped at the largest allocation of the upload ring.
+ */
+class VulkanTextureUploadBatch : NonCopyable {
+public:
+    static constexpr std::size_t DefaultBatchSize = 64 * 1024 * 1024;
+
+    explicit VulkanTextureUploadBatch(VulkanDevice& device,
+                                      std::size_t max_batch_size = DefaultBatchSize);
+    ~VulkanTextureUploadBatch();
+
+    void Upload(const VulkanTexture& texture, std::unique_ptr<DecodedTexture> data);
+    // Submits everything queued so far.
+    void Flush();
+
+private:
+    using PendingUploads =
+        std::vector<std::pair<const VulkanTexture*, std::unique_ptr<DecodedTexture>>>;
+    void Submit(const PendingUploads& uploads, std::size_t total_size);
+
+    VulkanDevice& device;
+    std::size_t max_batch_size{};
+
+    std::mutex mutex;
+    PendingUploads pending;
+    std::size_t pending_size{};
 };
 
 } // namespace Renderer
@@ -0,0 +1,773 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/assert.h"
+#include "common/mapped_file.h"
+#include "core/shaders/scene_glsl.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_host_cache.h"
+#include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_texture_streamer.h"
+
+namespace Renderer {
+
+// Block compressed copies need offsets aligned to the block size
+static constexpr std::size_t TexelBlockAlignment = 16;
+static constexpr u32 NoRequest = std::numeric_limits<u32>::max();
+
+static constexpr vk::ImageUsageFlags SparseImageUsage = vk::ImageUsageFlagBits::eTransferSrc |
+                                                        vk::ImageUsageFlagBits::eTransferDst |
+                                                        vk::ImageUsageFlagBits::eSampled;
+
+struct VulkanTextureStreamer::StreamedTexture {
+    VulkanTexture* texture{}; // Owned by the scene
+    std::unique_ptr<DecodedTexture> data;
+
+    vk::DeviceSize block_size{};
+    u32 memory_type_bits{};
+    vk::Extent3D granularity;
+    u32 mip_tail_first_level{};
+    vk::DeviceSize mip_tail_offset{};
+    vk::DeviceSize mip_tail_size{};
+    vk::DeviceSize metadata_offset{};
+    vk::DeviceSize metadata_size{}; // 0 if the format has no metadata aspect
+
+    u32 coarse_level{};   // Finest of the levels that are always resident
+    u32 resident_level{}; // Finest resident level, num_levels until the coarse levels are bound
+    u32 wanted_level{};   // According to the latest feedback
+    u32 prefetch_level{}; // Of the latest prefetch
+    u32 read_ahead_level = NoRequest; // Finest source level read ahead of its upload
+    u64 last_used{};
+    u64 last_prefetched{};
+    u64 last_evicted{};
+    u64 last_loaded{};
+
+    std::vector<VmaAllocation> level_allocations; // Above the mip tail
+    std::vector<VmaAllocation> tail_allocations;  // Mip tail and metadata
+
+    u32 GetLevelWidth(u32 level) const {
+        return std::max(texture->width >> level, 1u);
+    }
+    u32 GetLevelHeight(u32 level) const {
+        return std::max(texture->height >> level, 1u);
+    }
+    vk::DeviceSize GetLevelMemorySize(u32 level) const {
+        return vk::DeviceSize{(GetLevelWidth(level) + granularity.width - 1) / granularity.width} *
+               ((GetLevelHeight(level) + granularity.height - 1) / granularity.height) *
+               block_size;
+    }
+};
+
+struct VulkanTextureStreamer::SparseBinds {
+    std::vector<std::pair<vk::Image, vk::SparseImageMemoryBind>> image_binds;
+    std::vector<std::pair<vk::Image, vk::SparseMemoryBind>> opaque_binds;
+
+    bool empty() const noexcept {
+        return image_binds.empty() && opaque_binds.empty();
+    }
+};
+
+VulkanTextureStreamer::VulkanTextureStreamer(VulkanDevice& device_, vk::DeviceSize budget_,
+                                             std::size_t num_frames_in_flight,
+                                             std::shared_ptr<VulkanHostCache> host_cache_)
+    : device(device_), budget(budget_), host_cache(std::move(host_cache_)),
+      frames(num_frames_in_flight) {
+
+    for (auto& frame : frames) {
+        frame.bind_semaphore = vk::raii::Semaphore{*device, vk::SemaphoreCreateInfo{}};
+    }
+}
+
+// Frees memory bound to a sparse texture, which is tracked as texture memory
+static void FreeTextureMemory(const VulkanAllocator& allocator, VmaAllocation allocation) {
+    VmaAllocationInfo allocation_info{};
+    vmaGetAllocationInfo(*allocator, allocation, &allocation_info);
+    allocator.RemoveUsage(MemoryCategory::Textures, allocation_info.size);
+    vmaFreeMemory(*allocator, allocation);
+}
+
+VulkanTextureStreamer::~VulkanTextureStreamer() {
+    const auto& allocator = *device.allocator;
+    for (auto& frame : frames) {
+        for (const auto allocation : frame.retired) {
+            FreeTextureMemory(allocator, allocation);
+        }
+    }
+    for (const auto& texture : textures) {
+        for (const auto allocation : texture->level_allocations) {
+            if (allocation) {
+                FreeTextureMemory(allocator, allocation);
+            }
+        }
+        for (const auto allocation : texture->tail_allocations) {
+            FreeTextureMemory(allocator, allocation);
+        }
+    }
+}
+
+bool VulkanTextureStreamer::CanStream(const DecodedTexture& data) const {
+    if (!IsEnabled() || data.mip_levels.size() != data.num_levels ||
+        std::max(data.width, data.height) <= CoarseLevelSize) {
+        return false;
+    }
+    const auto& properties = device.physical_device.getSparseImageFormatProperties(
+        data.format, vk::ImageType::e2D, vk::SampleCountFlagBits::e1, SparseImageUsage,
+        vk::ImageTiling::eOptimal);
+    return std::ranges::any_of(properties, [](const vk::SparseImageFormatProperties& property) {
+        return static_cast<bool>(property.aspectMask & vk::ImageAspectFlagBits::eColor);
+    });
+}
+
+std::unique_ptr<VulkanTexture> VulkanTextureStreamer::AddTexture(
+    std::unique_ptr<DecodedTexture> data) {
+
+    auto texture = VulkanTexture::CreateSparse(device, *data);
+
+    auto streamed = std::make_unique<StreamedTexture>();
+    streamed->texture = texture.get();
+    const auto& requirements = texture->sparse_image.getMemoryRequirements();
+    streamed->block_size = requirements.alignment;
+    streamed->memory_type_bits = requirements.memoryTypeBits;
+    for (const auto& sparse_requirements : texture->sparse_image.getSparseMemoryRequirements()) {
+        const auto aspect = sparse_requirements.formatProperties.aspectMask;
+        if (aspect & vk::ImageAspectFlagBits::eColor) {
+            streamed->granularity = sparse_requirements.formatProperties.imageGranularity;
+            streamed->mip_tail_first_level =
+                std::min(sparse_requirements.imageMipTailFirstLod, texture->mip_levels);
+            streamed->mip_tail_offset = sparse_requirements.imageMipTailOffset;
+            streamed->mip_tail_size = sparse_requirements.imageMipTailSize;
+        }
+        if (aspect & vk::ImageAspectFlagBits::eMetadata) {
+            streamed->metadata_offset = sparse_requirements.imageMipTailOffset;
+            streamed->metadata_size = sparse_requirements.imageMipTailSize;
+        }
+    }
+
+    u32 coarse_level = 0;
+    while (coarse_level < streamed->mip_tail_first_level &&
+           std::max(streamed->GetLevelWidth(coarse_level),
+                    streamed->GetLevelHeight(coarse_level)) > CoarseLevelSize) {
+        ++coarse_level;
+    }
+    streamed->coarse_level = coarse_level;
+    streamed->resident_level = texture->mip_levels;
+    streamed->wanted_level = coarse_level;
+    streamed->level_allocations.resize(texture->mip_levels);
+    streamed->data = std::move(data);
+
+    std::scoped_lock lock{mutex};
+    pending_coarse.emplace_back(streamed.get());
+    textures.emplace_back(std::move(streamed));
+    return texture;
+}
+
+void VulkanTextureStreamer::SetTextures(std::span<const VulkanTexture* const> scene_textures) {
+    std::unordered_map<const VulkanTexture*, int> streamed_indices;
+    for (std::size_t i = 0; i < textures.size(); ++i) {
+        streamed_indices.emplace(textures[i]->texture, static_cast<int>(i));
+    }
+    texture_slots.clear();
+    for (const auto* texture : scene_textures) {
+        const auto it = streamed_indices.find(texture);
+        texture_slots.emplace_back(it == streamed_indices.end() ? -1 : it->second);
+    }
+
+    const std::size_t size =
+        std::max<std::size_t>(texture_slots.size(), 1) * sizeof(GLSL::TextureStreamingInfo);
+    for (auto& frame : frames) {
+        frame.info_buffer = std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Other);
+        auto* infos = static_cast<GLSL::TextureStreamingInfo*>(
+            frame.info_buffer->allocation_info.pMappedData);
+        // Until the first frame, as if nothing but the coarse levels were resident
+        for (std::size_t i = 0; i < texture_slots.size(); ++i) {
+            infos[i] = {
+                .min_lod = texture_slots[i] == -1
+                               ? 0.0f
+                               : static_cast<float>(textures[texture_slots[i]]->coarse_level),
+                .requested_level = NoRequest,
+            };
+        }
+        vmaFlushAllocation(**device.allocator, frame.info_buffer->allocation, 0, VK_WHOLE_SIZE);
+    }
+
+    std::vector<DescriptorBinding::Buffers> info_buffers;
+    for (const auto& frame : frames) {
+        info_buffers.push_back({.buffers = {*frame.info_buffer}});
+    }
+    descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+        device, frames.size(),
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eAll,
+                .value = DescriptorBinding::BuffersValue{info_buffers},
+            },
+        });
+}
+
+bool VulkanTextureStreamer::BindLevel(StreamedTexture& texture, u32 level, SparseBinds& binds) {
+    const VkMemoryRequirements requirements{
+        .size = texture.GetLevelMemorySize(level),
+        .alignment = texture.block_size,
+        .memoryTypeBits = texture.memory_type_bits,
+    };
+    // Never oversubscribe for levels that can be evicted instead
+    const VmaAllocationCreateInfo alloc_create_info{
+        .flags = VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT,
+        .usage = VMA_MEMORY_USAGE_UNKNOWN,
+        .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    };
+    VmaAllocation allocation{};
+    VmaAllocationInfo allocation_info{};
+    if (vmaAllocateMemory(**device.allocator, &requirements, &alloc_create_info, &allocation,
+                          &allocation_info) != VK_SUCCESS) {
+        return false;
+    }
+    device.allocator->AddUsage(MemoryCategory::Textures, allocation_info.size);
+    device.allocator->SetAllocationName(allocation, MemoryCategory::Textures,
+                                        fmt::format("streamed level {}", level));
+    texture.level_allocations[level] = allocation;
+    binds.image_binds.emplace_back(texture.texture->GetImage(),
+                                   vk::SparseImageMemoryBind{
+                                       .subresource =
+                                           {
+                                               .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                               .mipLevel = level,
+                                               .arrayLayer = 0,
+                                           },
+                                       .offset = {0, 0, 0},
+                                       .extent =
+                                           {
+                                               .width = texture.GetLevelWidth(level),
+                                               .height = texture.GetLevelHeight(level),
+                                               .depth = 1,
+                                           },
+                                       .memory = allocation_info.deviceMemory,
+                                       .memoryOffset = allocation_info.offset,
+                                   });
+    return true;
+}
+
+void VulkanTextureStreamer::BindMipTail(StreamedTexture& texture, SparseBinds& binds) {
+    const auto Bind = [this, &texture, &binds](vk::DeviceSize offset, vk::DeviceSize size,
+                                               vk::SparseMemoryBindFlags flags) {
+        const VkMemoryRequirements requirements{
+            .size = size,
+            .alignment = texture.block_size,
+            .memoryTypeBits = texture.memory_type_bits,
+        };
+        const VmaAllocationCreateInfo alloc_create_info{
+            .usage = VMA_MEMORY_USAGE_UNKNOWN,
+            .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        };
+        VmaAllocation allocation{};
+        VmaAllocationInfo allocation_info{};
+        const auto result = device.allocator->Allocate(
+            MemoryCategory::Textures, size, alloc_create_info, [&](const auto& create_info) {
+                return vmaAllocateMemory(**device.allocator, &requirements, &create_info,
+                                         &allocation, &allocation_info);
+            });
+        if (result != VK_SUCCESS) {
+            vk::throwResultException(vk::Result{result}, "vmaAllocateMemory");
+        }
+        device.allocator->AddUsage(MemoryCategory::Textures, allocation_info.size);
+        device.allocator->SetAllocationName(allocation, MemoryCategory::Textures, "mip tail");
+        texture.tail_allocations.emplace_back(allocation);
+        binds.opaque_binds.emplace_back(texture.texture->GetImage(),
+                                        vk::SparseMemoryBind{
+                                            .resourceOffset = offset,
+                                            .size = size,
+                                            .memory = allocation_info.deviceMemory,
+                                            .memoryOffset = allocation_info.offset,
+                                            .flags = flags,
+                                        });
+    };
+    if (texture.mip_tail_size != 0) {
+        Bind(texture.mip_tail_offset, texture.mip_tail_size, {});
+    }
+    if (texture.metadata_size != 0) {
+        Bind(texture.metadata_offset, texture.metadata_size,
+             vk::SparseMemoryBindFlagBits::eMetadata);
+    }
+}
+
+bool VulkanTextureStreamer::MakeRoom(vk::DeviceSize size, const StreamedTexture& loading,
+                                     bool prefetch) {
+    while (used_memory + size > budget) {
+        StreamedTexture* victim{};
+        const auto IsBetterVictim = [this, &victim](const StreamedTexture& texture) {
+            if (!victim) {
+                return true;
+            }
+            // Levels finer than wanted are released first, then those not about to be used, then
+            // the least recently used ones
+            const bool over_resident = texture.resident_level < texture.wanted_level;
+            const bool victim_over_resident = victim->resident_level < victim->wanted_level;
+            if (over_resident != victim_over_resident) {
+                return over_resident;
+            }
+            const bool prefetched = texture.last_prefetched == frame_number;
+            const bool victim_prefetched = victim->last_prefetched == frame_number;
+            if (prefetched != victim_prefetched) {
+                return !prefetched;
+            }
+            return texture.last_used < victim->last_used;
+        };
+        for (const auto& texture : textures) {
+            if (texture.get() == &loading || texture->resident_level >= texture->coarse_level ||
+                texture->last_loaded == frame_number) {
+                continue;
+            }
+            if (texture->last_used == frame_number &&
+                texture->resident_level >= texture->wanted_level) {
+                continue; // Still needed
+            }
+            if (prefetch && (texture->last_used == frame_number ||
+                             texture->last_prefetched == frame_number)) {
+                continue;
+            }
+            if (IsBetterVictim(*texture)) {
+                victim = texture.get();
+            }
+        }
+        if (!victim) {
+            return false;
+        }
+
+        // Shaders stop sampling the level from this frame on, but the previous frame may still
+        // be running, so it is only unbound at the next one
+        const u32 level = victim->resident_level++;
+        used_memory -= victim->GetLevelMemorySize(level);
+        victim->last_evicted = frame_number;
+        pending_unbinds.emplace_back(victim, level);
+    }
+    return true;
+}
+
+void VulkanTextureStreamer::SubmitBinds(const SparseBinds& binds, vk::Semaphore signal_semaphore) {
+    std::vector<vk::SparseImageMemoryBindInfo> image_bind_infos;
+    for (const auto& [image, bind] : binds.image_binds) {
+        image_bind_infos.push_back({
+            .image = image,
+            .bindCount = 1,
+            .pBinds = &bind,
+        });
+    }
+    std::vector<vk::SparseImageOpaqueMemoryBindInfo> opaque_bind_infos;
+    for (const auto& [image, bind] : binds.opaque_binds) {
+        opaque_bind_infos.push_back({
+            .image = image,
+            .bindCount = 1,
+            .pBinds = &bind,
+        });
+    }
+    device.BindSparse(device.graphics_queue, vk::BindSparseInfo{
+        .imageOpaqueBindCount = static_cast<u32>(opaque_bind_infos.size()),
+        .pImageOpaqueBinds = opaque_bind_infos.data(),
+        .imageBindCount = static_cast<u32>(image_bind_infos.size()),
+        .pImageBinds = image_bind_infos.data(),
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &signal_semaphore,
+    });
+}
+
+void VulkanTextureStreamer::RecordUploads(const vk::raii::CommandBuffer& cmd, Frame& frame,
+                                          std::span<const Upload> uploads) {
+    // Levels in the host cache are copied from it, and the others are added to it to be copied
+    // from, if they fit
+    const bool use_host_cache = host_cache && host_cache->IsEnabled();
+    std::vector<const VulkanBuffer*> cached_levels;
+    std::size_t total_size = 0;
+    for (const auto& upload : uploads) {
+        for (u32 level = upload.first_level; level < upload.end_level; ++level) {
+            const VulkanBuffer* cached = nullptr;
+            if (use_host_cache) {
+                const VulkanHostCache::Key key{.owner = upload.texture, .index = level};
+                cached = host_cache->Find(key);
+                if (!cached) {
+                    cached = host_cache->Add(key, upload.texture->data->GetLevel(level));
+                }
+            }
+            cached_levels.emplace_back(cached);
+            if (!cached) {
+                total_size += Common::AlignUp(upload.texture->data->GetLevel(level).size(),
+                                              TexelBlockAlignment);
+            }
+        }
+    }
+    if (total_size != 0 &&
+        (!frame.staging_buffer || frame.staging_buffer->size < total_size)) {
+        frame.staging_buffer = std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .size = std::max(total_size, MaxUploadPerFrame),
+                .usage = vk::BufferUsageFlagBits::eTransferSrc,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+            },
+            MemoryCategory::Scratch);
+        frame.staging_buffer->SetName("texture streaming staging");
+    }
+
+    const auto MakeBarrier = [](const Upload& upload, vk::ImageMemoryBarrier2 params) {
+        params.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        params.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        params.image = upload.texture->texture->GetImage();
+        params.subresourceRange = {
+            .aspectMask = vk::ImageAspectFlagBits::eColor,
+            .baseMipLevel = upload.first_level,
+            .levelCount = upload.end_level - upload.first_level,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        };
+        return params;
+    };
+
+    std::vector<vk::ImageMemoryBarrier2> barriers;
+    for (const auto& upload : uploads) {
+        // Freshly bound memory has no defined contents
+        barriers.emplace_back(MakeBarrier(upload, {
+                                                      .srcStageMask =
+                                                          vk::PipelineStageFlagBits2::eTopOfPipe,
+                                                      .srcAccessMask = vk::AccessFlags2{},
+                                                      .dstStageMask =
+                                                          vk::PipelineStageFlagBits2::eCopy,
+                                                      .dstAccessMask =
+                                                          vk::AccessFlagBits2::eTransferWrite,
+                                                      .oldLayout = vk::ImageLayout::eUndefined,
+                                                      .newLayout =
+                                                          vk::ImageLayout::eTransferDstOptimal,
+                                                  }));
+    }
+    cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = static_cast<u32>(barriers.size()),
+        .pImageMemoryBarriers = barriers.data(),
+    });
+
+    auto* staging = total_size != 0
+                        ? static_cast<u8*>(frame.staging_buffer->allocation_info.pMappedData)
+                        : nullptr;
+    std::size_t offset = 0;
+    std::size_t cached_idx = 0;
+    std::vector<vk::BufferImageCopy> regions;
+    for (const auto& upload : uploads) {
+        regions.clear();
+        for (u32 level = upload.first_level; level < upload.end_level; ++level) {
+            const vk::BufferImageCopy region{
+                .bufferOffset = offset,
+                .imageSubresource =
+                    {
+                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+                        .mipLevel = level,
+                        .baseArrayLayer = 0,
+                        .layerCount = 1,
+                    },
+                .imageExtent =
+                    {
+                        .width = upload.texture->GetLevelWidth(level),
+                        .height = upload.texture->GetLevelHeight(level),
+                        .depth = 1,
+                    },
+            };
+            if (const auto* cached = cached_levels[cached_idx++]) {
+                auto cached_region = region;
+                cached_region.bufferOffset = 0;
+                cmd.copyBufferToImage(**cached, upload.texture->texture->GetImage(),
+                                      vk::ImageLayout::eTransferDstOptimal, cached_region);
+                continue;
+            }
+            const auto data = upload.texture->data->GetLevel(level);
+            std::memcpy(staging + offset, data.data(), data.size());
+            regions.emplace_back(region);
+            offset += Common::AlignUp(data.size(), TexelBlockAlignment);
+        }
+        if (!regions.empty()) {
+            cmd.copyBufferToImage(**frame.staging_buffer, upload.texture->texture->GetImage(),
+                                  vk::ImageLayout::eTransferDstOptimal, regions);
+        }
+    }
+    if (offset != 0) {
+        vmaFlushAllocation(**device.allocator, frame.staging_buffer->allocation, 0, offset);
+    }
+
+    barriers.clear();
+    for (const auto& upload : uploads) {
+        barriers.emplace_back(
+            MakeBarrier(upload, {
+                                    .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+                                    .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                                    .dstStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+                                    .dstAccessMask = vk::AccessFlagBits2::eShaderSampledRead,
+                                    .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+                                    .newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+                                }));
+    }
+    cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = static_cast<u32>(barriers.size()),
+        .pImageMemoryBarriers = barriers.data(),
+    });
+}
+
+VulkanTextureStreamer::FrameUpdate VulkanTextureStreamer::BeginFrame(
+    const vk::raii::CommandBuffer& cmd, std::size_t frame_idx) {
+
+    ASSERT_MSG(descriptor_sets, "SetTextures must be called first");
+
+    ++frame_number;
+    auto& frame = frames[frame_idx];
+    const auto allocator = **device.allocator;
+
+    // The frame that waited for these unbinds has completed
+    for (const auto allocation : frame.retired) {
+        FreeTextureMemory(*device.allocator, allocation);
+    }
+    frame.retired.clear();
+    if (host_cache) {
+        host_cache->BeginFrame(frame_idx);
+    }
+
+    // Read back the feedback of the previous use of this frame
+    vmaInvalidateAllocation(allocator, frame.info_buffer->allocation, 0, VK_WHOLE_SIZE);
+    auto* infos =
+        static_cast<GLSL::TextureStreamingInfo*>(frame.info_buffer->allocation_info.pMappedData);
+    sampled.resize(texture_slots.size());
+    for (std::size_t i = 0; i < texture_slots.size(); ++i) {
+        sampled[i] = infos[i].requested_level != NoRequest;
+    }
+    if (!IsEnabled()) {
+        for (std::size_t i = 0; i < texture_slots.size(); ++i) {
+            infos[i].requested_level = NoRequest;
+        }
+        vmaFlushAllocation(allocator, frame.info_buffer->allocation, 0, VK_WHOLE_SIZE);
+        return {};
+    }
+
+    requested_levels.assign(textures.size(), NoRequest);
+    for (std::size_t i = 0; i < texture_slots.size(); ++i) {
+        if (texture_slots[i] != -1) {
+            auto& requested = requested_levels[texture_slots[i]];
+            requested = std::min(requested, infos[i].requested_level);
+        }
+    }
+    for (std::size_t i = 0; i < textures.size(); ++i) {
+        if (requested_levels[i] != NoRequest) {
+            textures[i]->wanted_level = std::min(requested_levels[i], textures[i]->coarse_level);
+            textures[i]->last_used = frame_number;
+        }
+    }
+    prefetch_levels.resize(textures.size(), NoRequest);
+    for (std::size_t i = 0; i < textures.size(); ++i) {
+        if (prefetch_levels[i] != NoRequest) {
+            textures[i]->prefetch_level = std::min(prefetch_levels[i], textures[i]->coarse_level);
+            textures[i]->last_prefetched = frame_number;
+            prefetch_levels[i] = NoRequest;
+        }
+    }
+
+    SparseBinds binds;
+    std::vector<Upload> uploads;
+    bool residency_changed = false;
+
+    // Newly added textures get their coarse levels and mip tail
+    std::vector<StreamedTexture*> added;
+    {
+        std::scoped_lock lock{mutex};
+        added = std::exchange(pending_coarse, {});
+    }
+    for (auto* texture : added) {
+        for (u32 level = texture->coarse_level; level < texture->mip_tail_first_level; ++level) {
+            if (!BindLevel(*texture, level, binds)) {
+                SPDLOG_ERROR("Failed to allocate memory for coarse texture levels");
+                throw std::runtime_error("Failed to allocate memory for coarse texture levels");
+            }
+        }
+        BindMipTail(*texture, binds);
+        texture->resident_level = texture->coarse_level;
+        uploads.push_back({
+            .texture = texture,
+            .first_level = texture->coarse_level,
+            .end_level = texture->texture->mip_levels,
+        });
+    }
+
+    for (const auto& [texture, level] : pending_unbinds) {
+        binds.image_binds.emplace_back(texture->texture->GetImage(),
+                                       vk::SparseImageMemoryBind{
+                                           .subresource =
+                                               {
+                                                   .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                                   .mipLevel = level,
+                                                   .arrayLayer = 0,
+                                               },
+                                           .offset = {0, 0, 0},
+                                           .extent =
+                                               {
+                                                   .width = texture->GetLevelWidth(level),
+                                                   .height = texture->GetLevelHeight(level),
+                                                   .depth = 1,
+                                               },
+                                       });
+        frame.retired.emplace_back(std::exchange(texture->level_allocations[level], nullptr));
+    }
+    pending_unbinds.clear();
+
+    // Stream in one level per texture at a time, cheapest first, so that many textures improve
+    // at once rather than a few jumping straight to full resolution
+    candidates.clear();
+    for (const auto& texture : textures) {
+        if (texture->wanted_level < texture->resident_level &&
+            texture->resident_level <= texture->coarse_level &&
+            texture->last_evicted + 1 < frame_number) {
+            candidates.emplace_back(texture.get());
+        }
+    }
+    std::ranges::sort(candidates, {}, [](const StreamedTexture* texture) {
+        return texture->GetLevelMemorySize(texture->resident_level - 1);
+    });
+    std::size_t upload_size = 0;
+    for (auto* texture : candidates) {
+        const u32 level = texture->resident_level - 1;
+        const std::size_t size = texture->data->GetLevel(level).size();
+        if (upload_size != 0 && upload_size + size > MaxUploadPerFrame) {
+            break;
+        }
+        const auto memory_size = texture->GetLevelMemorySize(level);
+        if (!MakeRoom(memory_size, *texture, false) || !BindLevel(*texture, level, binds)) {
+            continue;
+        }
+        used_memory += memory_size;
+        texture->resident_level = level;
+        texture->last_loaded = frame_number;
+        upload_size += size;
+        uploads.push_back({
+            .texture = texture,
+            .first_level = level,
+            .end_level = level + 1,
+        });
+        residency_changed = true;
+    }
+
+    // Then the prefetched levels, with what is left. Those that do not fit are read ahead from
+    // the source instead, so that their uploads on later frames do not wait for the disk.
+    candidates.clear();
+    for (const auto& texture : textures) {
+        if (texture->last_prefetched == frame_number &&
+            texture->prefetch_level < texture->resident_level &&
+            texture->resident_level <= texture->coarse_level &&
+            texture->last_loaded != frame_number && texture->last_evicted + 1 < frame_number) {
+            candidates.emplace_back(texture.get());
+        }
+    }
+    std::ranges::sort(candidates, {}, [](const StreamedTexture* texture) {
+        return texture->GetLevelMemorySize(texture->resident_level - 1);
+    });
+    std::size_t prefetch_size = 0;
+    for (auto* texture : candidates) {
+        const u32 level = texture->resident_level - 1;
+        const std::size_t size = texture->data->GetLevel(level).size();
+        const auto memory_size = texture->GetLevelMemorySize(level);
+        if (prefetch_size + size > MaxPrefetchPerFrame ||
+            upload_size + size > MaxUploadPerFrame || !MakeRoom(memory_size, *texture, true) ||
+            !BindLevel(*texture, level, binds)) {
+            for (u32 next = texture->prefetch_level;
+                 next <= level && next < texture->read_ahead_level; ++next) {
+                Common::PrefetchMemory(texture->data->GetLevel(next));
+            }
+            texture->read_ahead_level = std::min(texture->read_ahead_level,
+                                                 texture->prefetch_level);
+            continue;
+        }
+        used_memory += memory_size;
+        texture->resident_level = level;
+        texture->last_loaded = frame_number;
+        prefetch_size += size;
+        upload_size += size;
+        uploads.push_back({
+            .texture = texture,
+            .first_level = level,
+            .end_level = level + 1,
+        });
+        residency_changed = true;
+    }
+    residency_changed |= !pending_unbinds.empty();
+
+    // Residency for this use of the frame, which also resets the feedback
+    for (std::size_t i = 0; i < texture_slots.size(); ++i) {
+        infos[i] = {
+            .min_lod = texture_slots[i] == -1
+                           ? 0.0f
+                           : static_cast<float>(textures[texture_slots[i]]->resident_level),
+            .requested_level = NoRequest,
+        };
+    }
+    vmaFlushAllocation(allocator, frame.info_buffer->allocation, 0, VK_WHOLE_SIZE);
+
+    FrameUpdate update{.residency_changed = residency_changed};
+    if (!binds.empty()) {
+        SubmitBinds(binds, *frame.bind_semaphore);
+        update.wait_semaphore = *frame.bind_semaphore;
+    }
+    if (!uploads.empty()) {
+        RecordUploads(cmd, frame, uploads);
+    }
+    return update;
+}
+
+void VulkanTextureStreamer::Prefetch(std::size_t texture_idx, float pixels) {
+    if (!IsEnabled() || texture_idx >= texture_slots.size() || texture_slots[texture_idx] == -1 ||
+        !(pixels > 0.0f)) {
+        return;
+    }
+    const auto slot = static_cast<std::size_t>(texture_slots[texture_idx]);
+    const auto& texture = *textures[slot];
+    // The level whose texels are about as large as the pixels of the surface
+    const auto size =
+        static_cast<float>(std::max(texture.texture->width, texture.texture->height));
+    const u32 level =
+        size <= pixels ? 0 : static_cast<u32>(std::floor(std::log2(size / pixels)));
+    if (prefetch_levels.size() < textures.size()) {
+        prefetch_levels.resize(textures.size(), NoRequest);
+    }
+    prefetch_levels[slot] = std::min(prefetch_levels[slot], level);
+}
+
+void VulkanTextureStreamer::EndFrame(const vk::raii::CommandBuffer& cmd) const {
+    const vk::MemoryBarrier2 barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+        .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+        .dstStageMask = vk::PipelineStageFlagBits2::eHost,
+        .dstAccessMask = vk::AccessFlagBits2::eHostRead,
+    };
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = &barrier,
+    });
+}
+
+} // namespace Renderer
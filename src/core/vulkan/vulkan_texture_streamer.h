@@ -0,0 +1,141 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <span>
+#include <utility>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class DecodedTexture;
+class VulkanBuffer;
+class VulkanDescriptorSets;
+class VulkanDevice;
+class VulkanHostCache;
+class VulkanTexture;
+
+/**
+ * Streams the mip levels of sparse (partially resident) textures in and out under a memory
+ * budget.
+ *
+ * Shaders clamp their sampling to the finest resident level of each texture and report the
+ * finest level they wanted (see texture_streaming.glsl), through a buffer per frame in flight.
+ * At the start of every frame, the feedback of the frame's previous use is read back; memory is
+ * bound for the requested levels and they are uploaded, and the least recently used levels are
+ * released when the budget is exhausted. Coarse levels always stay resident.
+ * The source levels are kept in the DecodedTextures, which are usually mapped from the scene
+ * cache on disk. With a host cache, the uploaded levels are kept in it, and uploaded again from
+ * it once evicted.
+ *
+ * Textures that are not streamed are reported as fully resident. The feedback is gathered
+ * even when streaming is disabled, see WasSampled. Not thread safe, except AddTexture.
+ */
+class VulkanTextureStreamer : NonCopyable {
+public:
+    // Levels of at most this size are always resident
+    static constexpr u32 CoarseLevelSize = 128;
+    static constexpr std::size_t MaxUploadPerFrame = 32 * 1024 * 1024;
+    // Of the uploads for prefetched levels, within MaxUploadPerFrame
+    static constexpr std::size_t MaxPrefetchPerFrame = 8 * 1024 * 1024;
+
+    // A budget of 0 disables streaming. Frames are indexed like those in flight of the renderer,
+    // and of the host cache if there is one.
+    explicit VulkanTextureStreamer(VulkanDevice& device, vk::DeviceSize budget,
+                                   std::size_t num_frames_in_flight,
+                                   std::shared_ptr<VulkanHostCache> host_cache = nullptr);
+    ~VulkanTextureStreamer();
+
+    bool IsEnabled() const noexcept {
+        return budget != 0;
+    }
+    // Whether the texture has all of its levels, in a format that can be sparsely resident.
+    bool CanStream(const DecodedTexture& data) const;
+
+    // Creates the sparse texture. Memory is bound at the next frame. Thread safe.
+    std::unique_ptr<VulkanTexture> AddTexture(std::unique_ptr<DecodedTexture> data);
+    // Creates the feedback buffers, indexed like the textures given (which need not all be
+    // streamed). Must be called once all textures have been added.
+    void SetTextures(std::span<const VulkanTexture* const> scene_textures);
+
+    struct FrameUpdate {
+        // If set, the frame must wait for this before running its command buffer
+        vk::Semaphore wait_semaphore;
+        // Whether any texture now samples different levels
+        bool residency_changed{};
+    };
+    // Records the uploads into the command buffer of the frame, whose previous submission must
+    // have completed.
+    FrameUpdate BeginFrame(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx);
+    // Makes the feedback written by the frame visible to the host. Recorded last.
+    void EndFrame(const vk::raii::CommandBuffer& cmd) const;
+
+    // Asks for the levels of the scene texture that a surface covering this many pixels across
+    // would sample, ahead of the feedback of the frames that will sample them. They are
+    // streamed in at the next BeginFrame after the requested ones, within MaxPrefetchPerFrame,
+    // without evicting levels in use, and the source levels beyond the budget are read ahead.
+    void Prefetch(std::size_t texture_idx, float pixels);
+
+    // Whether the scene texture was sampled in the latest frame read back by BeginFrame.
+    bool WasSampled(std::size_t texture_idx) const noexcept {
+        return texture_idx < sampled.size() && sampled[texture_idx];
+    }
+
+    // Binding 0 is the TextureStreamingInfo buffer of each frame in flight
+    std::unique_ptr<VulkanDescriptorSets> descriptor_sets;
+
+private:
+    struct StreamedTexture;
+    struct SparseBinds;
+    struct Upload {
+        StreamedTexture* texture{};
+        u32 first_level{};
+        u32 end_level{};
+    };
+    struct Frame {
+        std::unique_ptr<VulkanBuffer> info_buffer;
+        std::unique_ptr<VulkanBuffer> staging_buffer;
+        vk::raii::Semaphore bind_semaphore = nullptr;
+        // Unbound memory, freed once the frame that waited for the unbinds has completed
+        std::vector<VmaAllocation> retired;
+    };
+
+    bool BindLevel(StreamedTexture& texture, u32 level, SparseBinds& binds);
+    void BindMipTail(StreamedTexture& texture, SparseBinds& binds);
+    // Releases levels until size bytes fit in the budget. Returns false if it cannot.
+    // Prefetches only release levels that are neither used nor prefetched in this frame.
+    bool MakeRoom(vk::DeviceSize size, const StreamedTexture& loading, bool prefetch);
+    void SubmitBinds(const SparseBinds& binds, vk::Semaphore signal_semaphore);
+    void RecordUploads(const vk::raii::CommandBuffer& cmd, Frame& frame,
+                       std::span<const Upload> uploads);
+
+    VulkanDevice& device;
+    vk::DeviceSize budget{};
+    vk::DeviceSize used_memory{}; // By the streamed levels, excluding the coarse ones
+    std::shared_ptr<VulkanHostCache> host_cache; // May be null
+
+    u64 frame_number{};
+
+    std::mutex mutex; // Protects textures and pending_coarse while loading
+    std::vector<std::unique_ptr<StreamedTexture>> textures;
+    std::vector<StreamedTexture*> pending_coarse;
+    std::vector<int> texture_slots; // Scene texture -> index in textures, -1 if not streamed
+    std::vector<bool> sampled;      // Indexed like the scene textures
+    // Kept across frames, so that streaming does not allocate them every frame
+    std::vector<u32> requested_levels; // Indexed like textures
+    std::vector<u32> prefetch_levels;  // Indexed like textures, since the last BeginFrame
+    std::vector<StreamedTexture*> candidates;
+
+    // Levels evicted last frame, unbound at the next one
+    std::vector<std::pair<StreamedTexture*, u32>> pending_unbinds;
+    std::vector<Frame> frames;
+};
+
+} // namespace Renderer
@@ -0,0 +1,189 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include "common/temp_ptr.h"
+#include "core/shaders/tlas_instances_glsl.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
+#include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_shader.h"
+#include "core/vulkan/vulkan_tlas_instance_generator.h"
+
+namespace Renderer {
+
+namespace {
+
+// Of the bounds, a negative radius if they are infinite
+glm::vec4 GetBoundingSphere(const GLSL::AABB& bounds) {
+    const auto extent = bounds.max_point - bounds.min_point;
+    if (!std::isfinite(extent.x) || !std::isfinite(extent.y) || !std::isfinite(extent.z)) {
+        return {0.0f, 0.0f, 0.0f, -1.0f};
+    }
+    return {(bounds.min_point + bounds.max_point) * 0.5f, glm::length(extent) * 0.5f};
+}
+
+GLSL::TLASInstanceSource GetSource(const VulkanTLASInstanceGenerator::Instance& instance) {
+    // Rows of the transform, like ToVulkanMatrix
+    const auto row = [&instance](int i) {
+        return glm::vec4{instance.transform[0][i], instance.transform[1][i],
+                         instance.transform[2][i], instance.transform[3][i]};
+    };
+    return {
+        .transform_row0 = row(0),
+        .transform_row1 = row(1),
+        .transform_row2 = row(2),
+        .bounding_sphere = GetBoundingSphere(instance.bounds),
+        .mesh = instance.mesh,
+        .custom_index = instance.custom_index,
+        .hit_group = instance.hit_group,
+        .mask_and_flags =
+            instance.mask | (static_cast<VkGeometryInstanceFlagsKHR>(instance.flags) << 8),
+    };
+}
+
+} // namespace
+
+VulkanTLASInstanceGenerator::VulkanTLASInstanceGenerator(
+    VulkanDevice& device_, std::span<const Instance> instances,
+    std::span<const std::vector<vk::DeviceAddress>> mesh_lods, const Settings& settings_)
+    : device(device_), settings(settings_), num_instances(static_cast<u32>(instances.size())) {
+
+    std::vector<GLSL::TLASInstanceSource> sources;
+    sources.reserve(instances.size());
+    min_radius = std::numeric_limits<float>::infinity();
+    for (const auto& instance : instances) {
+        sources.emplace_back(GetSource(instance));
+        if (sources.back().bounding_sphere.w >= 0) {
+            min_radius = std::min(min_radius, sources.back().bounding_sphere.w);
+        }
+    }
+    std::vector<glm::uvec2> lods;
+    std::vector<vk::DeviceAddress> addresses;
+    for (const auto& blases : mesh_lods) {
+        lods.emplace_back(static_cast<u32>(addresses.size()), static_cast<u32>(blases.size()));
+        addresses.insert(addresses.end(), blases.begin(), blases.end());
+    }
+    if (addresses.empty()) { // Buffers cannot be empty
+        addresses.emplace_back(0);
+    }
+
+    const auto Upload = [this](const auto& data) {
+        return std::make_unique<VulkanImmUploadBuffer>(
+            device,
+            VulkanBufferCreateInfo{
+                .size = data.size() * sizeof(data[0]),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+                .dst_stage_mask = vk::PipelineStageFlagBits2::eComputeShader,
+                .dst_access_mask = vk::AccessFlagBits2::eShaderStorageRead,
+                .category = MemoryCategory::AccelStructures,
+            },
+            reinterpret_cast<const u8*>(data.data()));
+    };
+    sources_buffer = Upload(sources);
+    sources_buffer->SetName("TLAS instance sources");
+    mesh_lods_buffer = Upload(lods);
+    blas_addresses_buffer = Upload(addresses);
+
+    instances_buffer = std::make_unique<VulkanBuffer>(
+        *device.allocator,
+        vk::BufferCreateInfo{
+            .size = instances.size() * sizeof(GLSL::TLASInstance),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                     vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+        },
+        MemoryCategory::AccelStructures);
+    instances_buffer->SetName("TLAS instances");
+
+    std::vector<DescriptorBinding> bindings(4, {
+                                                   .type = vk::DescriptorType::eStorageBuffer,
+                                                   .stages = vk::ShaderStageFlagBits::eCompute,
+                                               });
+    descriptor_sets = std::make_unique<VulkanDescriptorSets>(device, 1, bindings);
+    const std::array<const VulkanBuffer*, 4> buffers{{sources_buffer.get(), mesh_lods_buffer.get(),
+                                                      blas_addresses_buffer.get(),
+                                                      instances_buffer.get()}};
+    for (std::size_t i = 0; i < buffers.size(); ++i) {
+        descriptor_sets->UpdateDescriptor(i, DescriptorBinding::BuffersValue{{
+                                                 .buffers = {{**buffers[i]}},
+                                             }});
+    }
+    pipeline = std::make_unique<VulkanComputePipeline>(
+        device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{device, u8"core/shaders/tlas_instances.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 1,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *descriptor_sets->descriptor_set_layout,
+            }},
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::TLASInstancesPushConstant>(vk::ShaderStageFlagBits::eCompute),
+            }},
+        });
+}
+
+VulkanTLASInstanceGenerator::~VulkanTLASInstanceGenerator() = default;
+
+bool VulkanTLASInstanceGenerator::NeedsUpdate(const glm::vec3& camera_position) const {
+    if (!generated_position) {
+        return true;
+    }
+    if (!settings.DependsOnCamera()) {
+        return false;
+    }
+    // Distances change by at most how far the camera moved, so that less than a fraction of the
+    // smallest instance keeps nearly every cull and LOD decision
+    static constexpr float MaxMoveFraction = 0.25f;
+    return glm::distance(camera_position, *generated_position) > min_radius * MaxMoveFraction;
+}
+
+void VulkanTLASInstanceGenerator::Record(const vk::raii::CommandBuffer& cmd,
+                                         const glm::vec3& camera_position) {
+    // The previous build (and the frames tracing it) read the instances
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+            .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+        }},
+    });
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **pipeline);
+    VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute, *pipeline->pipeline_layout,
+                               0, {{*descriptor_sets, 0}});
+    cmd.pushConstants<GLSL::TLASInstancesPushConstant>(
+        *pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+        {{
+            .camera_position = camera_position,
+            .cull_distance = settings.cull_distance,
+            .min_projected_size = settings.min_projected_size,
+            .lod_distance = settings.lod_distance,
+            .num_instances = num_instances,
+        }});
+    cmd.dispatch((num_instances + 63) / 64, 1, 1);
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderRead,
+        }},
+    });
+    generated_position = camera_position;
+}
+
+} // namespace Renderer
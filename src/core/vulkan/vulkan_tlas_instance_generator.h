@@ -0,0 +1,94 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+#include <glm/glm.hpp>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+#include "core/shaders/scene_glsl.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanComputePipeline;
+class VulkanDescriptorSets;
+class VulkanDevice;
+class VulkanImmUploadBuffer;
+
+/**
+ * Writes the instances of a TLAS on the GPU with a compute pass (see tlas_instances.comp), from
+ * a table of the instances uploaded once, so that scenes of millions of instances are not
+ * filled in on the host and uploaded again whenever they change.
+ *
+ * Instances can be culled by their distance from the camera or the size their bounding spheres
+ * are seen at, and each takes one of the LOD BLASes of its mesh by its distance. Culled
+ * instances are written with a zero mask, so that the TLAS is always built over all of them.
+ */
+class VulkanTLASInstanceGenerator : NonCopyable {
+public:
+    struct Instance {
+        u32 mesh{}; // Of the LOD BLASes
+        glm::mat4 transform;
+        GLSL::AABB bounds{}; // World space, infinite if unbounded (never culled)
+        u32 custom_index{};
+        u32 hit_group{};
+        u8 mask = 0xFF;
+        vk::GeometryInstanceFlagsKHR flags;
+    };
+    struct Settings {
+        // Instances farther from the camera than this are culled, 0 culls none
+        float cull_distance{};
+        // Instances whose bounding spheres have a smaller radius relative to their distance from
+        // the camera are culled, 0 culls none
+        float min_projected_size{};
+        // Instances take the next coarser LOD at every this many radii of their bounding spheres
+        // of distance, 0 always takes the finest
+        float lod_distance{};
+
+        bool DependsOnCamera() const noexcept {
+            return cull_distance > 0 || min_projected_size > 0 || lod_distance > 0;
+        }
+    };
+
+    // mesh_lods has the addresses of the BLASes of each mesh, finest first. Instances of meshes
+    // without any are inactive.
+    explicit VulkanTLASInstanceGenerator(VulkanDevice& device, std::span<const Instance> instances,
+                                         std::span<const std::vector<vk::DeviceAddress>> mesh_lods,
+                                         const Settings& settings);
+    ~VulkanTLASInstanceGenerator();
+
+    u32 GetNumInstances() const noexcept {
+        return num_instances;
+    }
+    // VkAccelerationStructureInstanceKHR of each instance, once generated
+    const VulkanBuffer& GetInstancesBuffer() const noexcept {
+        return *instances_buffer;
+    }
+    // Whether the camera has moved far enough from where the instances were last generated for
+    // their culling and LODs to change. Always true before they are first generated.
+    bool NeedsUpdate(const glm::vec3& camera_position) const;
+    // Records the generation for the camera, followed by a barrier for building acceleration
+    // structures from the instances. Waits for earlier builds reading them.
+    void Record(const vk::raii::CommandBuffer& cmd, const glm::vec3& camera_position);
+
+private:
+    VulkanDevice& device;
+    Settings settings;
+    u32 num_instances{};
+    std::unique_ptr<VulkanImmUploadBuffer> sources_buffer; // GLSL::TLASInstanceSource
+    std::unique_ptr<VulkanImmUploadBuffer> mesh_lods_buffer;
+    std::unique_ptr<VulkanImmUploadBuffer> blas_addresses_buffer;
+    std::unique_ptr<VulkanBuffer> instances_buffer;
+    std::unique_ptr<VulkanDescriptorSets> descriptor_sets;
+    std::unique_ptr<VulkanComputePipeline> pipeline;
+    std::optional<glm::vec3> generated_position; // Of the camera
+    float min_radius{}; // Of the bounded instances, for NeedsUpdate
+};
+
+} // namespace Renderer
@@ -0,0 +1,428 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <limits>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/scope_exit.h"
+#include "common/temp_ptr.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_deletion_queue.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_upload_ring.h"
+
+namespace Renderer {
+
+static std::unique_ptr<VulkanBuffer> CreateStagingBuffer(const VulkanAllocator& allocator,
+                                                         std::size_t size) {
+    auto buffer = std::make_unique<VulkanBuffer>(
+        allocator,
+        vk::BufferCreateInfo{
+            .size = size,
+            .usage = vk::BufferUsageFlagBits::eTransferSrc,
+        },
+        VmaAllocationCreateInfo{
+            .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                     VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::Scratch);
+    buffer->SetName("upload ring");
+    return buffer;
+}
+
+VulkanUploadRing::Upload::Upload(VulkanUploadRing& ring_, std::unique_lock<std::mutex> lock_,
+                                 VmaAllocator allocator_, VmaAllocation allocation_, u8* data_,
+                                 vk::Buffer buffer_, vk::DeviceSize offset_, std::size_t size_,
+                                 const VulkanDevice& device_,
+                                 const vk::raii::CommandBuffer& command_buffer_,
+                                 const vk::raii::CommandBuffer* acquire_command_buffer_,
+                                 std::vector<std::shared_ptr<const void>>& retained_)
+    : data(data_), buffer(buffer_), offset(offset_), size(size_), command_buffer(command_buffer_),
+      ring(ring_), lock(std::move(lock_)), allocator(allocator_), allocation(allocation_),
+      device(device_), acquire_command_buffer(acquire_command_buffer_), retained(retained_) {}
+
+VulkanUploadRing::Upload::~Upload() {
+    // No-op for coherent memory
+    if (allocation) {
+        vmaFlushAllocation(allocator, allocation, offset, size);
+    }
+}
+
+void VulkanUploadRing::Upload::WriteUnlocked(const std::function<void()>& write) {
+    ++ring.num_writers;
+    lock.unlock();
+    SCOPE_EXIT({
+        lock.lock();
+        if (--ring.num_writers == 0) {
+            ring.writers_cv.notify_all();
+        }
+    });
+    write();
+}
+
+void VulkanUploadRing::Upload::Release(vk::BufferMemoryBarrier2 barrier,
+                                       vk::SharingMode sharing_mode) const {
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    if (!acquire_command_buffer) {
+        command_buffer.pipelineBarrier2({
+            .bufferMemoryBarrierCount = 1,
+            .pBufferMemoryBarriers = &barrier,
+        });
+        return;
+    }
+    if (sharing_mode == vk::SharingMode::eConcurrent) {
+        // No ownership to transfer, the semaphore wait on the consumer queue is enough
+        return;
+    }
+
+    auto release = barrier;
+    release.srcQueueFamilyIndex = device.transfer_queue_family;
+    release.dstQueueFamilyIndex = device.graphics_queue_family;
+    release.dstStageMask = vk::PipelineStageFlagBits2::eNone;
+    release.dstAccessMask = vk::AccessFlagBits2::eNone;
+    command_buffer.pipelineBarrier2({
+        .bufferMemoryBarrierCount = 1,
+        .pBufferMemoryBarriers = &release,
+    });
+
+    auto acquire = barrier;
+    acquire.srcQueueFamilyIndex = device.transfer_queue_family;
+    acquire.dstQueueFamilyIndex = device.graphics_queue_family;
+    acquire.srcStageMask = vk::PipelineStageFlagBits2::eNone;
+    acquire.srcAccessMask = vk::AccessFlagBits2::eNone;
+    acquire_command_buffer->pipelineBarrier2({
+        .bufferMemoryBarrierCount = 1,
+        .pBufferMemoryBarriers = &acquire,
+    });
+}
+
+void VulkanUploadRing::Upload::Release(
+    const vk::ArrayProxy<const vk::ImageMemoryBarrier2>& barriers) const {
+
+    const auto GetBarriers = [&barriers](u32 src_family, u32 dst_family) {
+        std::vector<vk::ImageMemoryBarrier2> result(barriers.begin(), barriers.end());
+        for (auto& barrier : result) {
+            barrier.srcQueueFamilyIndex = src_family;
+            barrier.dstQueueFamilyIndex = dst_family;
+        }
+        return result;
+    };
+
+    if (!acquire_command_buffer) {
+        const auto& result = GetBarriers(VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+        command_buffer.pipelineBarrier2({
+            .imageMemoryBarrierCount = static_cast<u32>(result.size()),
+            .pImageMemoryBarriers = result.data(),
+        });
+        return;
+    }
+
+    auto release = GetBarriers(device.transfer_queue_family, device.graphics_queue_family);
+    for (auto& barrier : release) {
+        barrier.dstStageMask = vk::PipelineStageFlagBits2::eNone;
+        barrier.dstAccessMask = vk::AccessFlagBits2::eNone;
+    }
+    command_buffer.pipelineBarrier2({
+        .imageMemoryBarrierCount = static_cast<u32>(release.size()),
+        .pImageMemoryBarriers = release.data(),
+    });
+
+    auto acquire = GetBarriers(device.transfer_queue_family, device.graphics_queue_family);
+    for (auto& barrier : acquire) {
+        barrier.srcStageMask = vk::PipelineStageFlagBits2::eNone;
+        barrier.srcAccessMask = vk::AccessFlagBits2::eNone;
+    }
+    acquire_command_buffer->pipelineBarrier2({
+        .imageMemoryBarrierCount = static_cast<u32>(acquire.size()),
+        .pImageMemoryBarriers = acquire.data(),
+    });
+}
+
+void VulkanUploadRing::Upload::Retain(std::shared_ptr<const void> object) const {
+    retained.emplace_back(std::move(object));
+}
+
+static vk::raii::Semaphore CreateTimelineSemaphore(const VulkanDevice& device) {
+    return vk::raii::Semaphore{*device, vk::StructureChain{
+                                            vk::SemaphoreCreateInfo{},
+                                            vk::SemaphoreTypeCreateInfo{
+                                                .semaphoreType = vk::SemaphoreType::eTimeline,
+                                                .initialValue = 0,
+                                            },
+                                        }
+                                            .get()};
+}
+
+VulkanUploadRing::VulkanUploadRing(const VulkanDevice& device_, std::size_t ring_size_)
+    : device(device_), ring_size(ring_size_),
+      buffer(CreateStagingBuffer(*device.allocator, ring_size)),
+      mapped(reinterpret_cast<u8*>(buffer->allocation_info.pMappedData)),
+      ownership_transfer(device.transfer_queue_family != device.graphics_queue_family) {
+
+    command_pool =
+        vk::raii::CommandPool{*device,
+                              {
+                                  .flags = vk::CommandPoolCreateFlagBits::eTransient |
+                                           vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+                                  .queueFamilyIndex = device.transfer_queue_family,
+                              }};
+    timeline = CreateTimelineSemaphore(device);
+
+    if (ownership_transfer) {
+        acquire_command_pool =
+            vk::raii::CommandPool{*device,
+                                  {
+                                      .flags = vk::CommandPoolCreateFlagBits::eTransient |
+                                               vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+                                      .queueFamilyIndex = device.graphics_queue_family,
+                                  }};
+        transfer_timeline = CreateTimelineSemaphore(device);
+    }
+}
+
+VulkanUploadRing::~VulkanUploadRing() {
+    if (current) {
+        SPDLOG_WARN("Upload ring destroyed with unsubmitted uploads, submitting them");
+        std::unique_lock lock{mutex};
+        FlushLocked(lock);
+    }
+    Wait(next_value - 1);
+    device.deletion_queue->Release(*timeline);
+}
+
+VulkanUploadRing::Upload VulkanUploadRing::MakeUpload(std::unique_lock<std::mutex> lock,
+                                                      const VulkanBuffer& src_buffer, u64 offset,
+                                                      std::size_t size) {
+    return Upload{*this,
+                  std::move(lock),
+                  **device.allocator,
+                  src_buffer.allocation,
+                  reinterpret_cast<u8*>(src_buffer.allocation_info.pMappedData) + offset,
+                  *src_buffer,
+                  offset,
+                  size,
+                  device,
+                  current->command_buffer,
+                  ownership_transfer ? &current->acquire_command_buffer : nullptr,
+                  current->retained};
+}
+
+VulkanUploadRing::Upload VulkanUploadRing::Allocate(std::size_t size) {
+    std::unique_lock lock{mutex};
+
+    if (size > GetMaxAllocationSize()) {
+        // Too large for the ring, use a dedicated buffer that lives as long as the batch
+        BeginBatch();
+        const auto& dedicated_buffer =
+            current->dedicated_buffers.emplace_back(CreateStagingBuffer(*device.allocator, size));
+        return MakeUpload(std::move(lock), *dedicated_buffer, 0, size);
+    }
+
+    u64 start{};
+    while (true) {
+        Reclaim();
+
+        start = Common::AlignUp(head, Alignment);
+        if (start % ring_size + size > ring_size) { // Wrap around
+            start = Common::AlignUp(start, ring_size);
+        }
+        if (start + size - tail <= ring_size) {
+            break;
+        }
+
+        // Not enough space. Submit what we have, or wait for the oldest batch
+        if (current) {
+            FlushLocked(lock);
+        } else {
+            Wait(in_flight.front().value);
+        }
+    }
+    head = start + size;
+
+    BeginBatch();
+    current->end = head;
+    return MakeUpload(std::move(lock), *buffer, start % ring_size, size);
+}
+
+VulkanUploadRing::Upload VulkanUploadRing::Record() {
+    std::unique_lock lock{mutex};
+    BeginBatch();
+    return Upload{*this,
+                  std::move(lock),
+                  **device.allocator,
+                  nullptr,
+                  nullptr,
+                  nullptr,
+                  0,
+                  0,
+                  device,
+                  current->command_buffer,
+                  ownership_transfer ? &current->acquire_command_buffer : nullptr,
+                  current->retained};
+}
+
+u64 VulkanUploadRing::Flush() {
+    u64 value{};
+    {
+        std::unique_lock lock{mutex};
+        Reclaim();
+        value = current ? FlushLocked(lock) : next_value - 1;
+    }
+    // Also while loading, when no frames are drawn
+    device.deletion_queue->Collect();
+    return value;
+}
+
+void VulkanUploadRing::Wait(u64 value) const {
+    if (timeline.getCounterValue() >= value) {
+        return;
+    }
+    vk::Result result;
+    do {
+        result = device->waitSemaphores(
+            {
+                .semaphoreCount = 1,
+                .pSemaphores = TempArr<vk::Semaphore>{*timeline},
+                .pValues = TempArr<u64>{value},
+            },
+            std::numeric_limits<u64>::max());
+    } while (result == vk::Result::eTimeout);
+}
+
+bool VulkanUploadRing::IsComplete(u64 value) const {
+    return timeline.getCounterValue() >= value;
+}
+
+vk::SemaphoreSubmitInfo VulkanUploadRing::GetWaitInfo(u64 value,
+                                                      vk::PipelineStageFlags2 stage_mask) const {
+    return {
+        .semaphore = *timeline,
+        .value = value,
+        .stageMask = stage_mask,
+    };
+}
+
+void VulkanUploadRing::BeginBatch() {
+    if (current) {
+        return;
+    }
+
+    if (free_batches.empty()) {
+        current = std::make_unique<Batch>();
+
+        vk::raii::CommandBuffers command_buffers{*device,
+                                                 {
+                                                     .commandPool = *command_pool,
+                                                     .level = vk::CommandBufferLevel::ePrimary,
+                                                     .commandBufferCount = 1,
+                                                 }};
+        current->command_buffer = std::move(command_buffers[0]);
+        if (ownership_transfer) {
+            vk::raii::CommandBuffers acquire_command_buffers{
+                *device,
+                {
+                    .commandPool = *acquire_command_pool,
+                    .level = vk::CommandBufferLevel::ePrimary,
+                    .commandBufferCount = 1,
+                }};
+            current->acquire_command_buffer = std::move(acquire_command_buffers[0]);
+        }
+    } else {
+        current = std::make_unique<Batch>(std::move(free_batches.back()));
+        free_batches.pop_back();
+        current->command_buffer.reset();
+        if (ownership_transfer) {
+            current->acquire_command_buffer.reset();
+        }
+    }
+
+    current->end = head;
+    current->command_buffer.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    if (ownership_transfer) {
+        current->acquire_command_buffer.begin(
+            {.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    }
+}
+
+u64 VulkanUploadRing::FlushLocked(std::unique_lock<std::mutex>& lock) {
+    writers_cv.wait(lock, [this] { return num_writers == 0; });
+    current->value = next_value++;
+    current->command_buffer.end();
+
+    if (!ownership_transfer) {
+        device.Submit2(device.graphics_queue, {{
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = TempArr<vk::CommandBufferSubmitInfo>{{
+                .commandBuffer = *current->command_buffer,
+            }},
+            .signalSemaphoreInfoCount = 1,
+            .pSignalSemaphoreInfos = TempArr<vk::SemaphoreSubmitInfo>{{
+                .semaphore = *timeline,
+                .value = current->value,
+                .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            }},
+        }});
+    } else {
+        // Copy on the transfer queue, then acquire the resources on the graphics queue
+        current->acquire_command_buffer.end();
+        device.Submit2(device.transfer_queue, {{
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = TempArr<vk::CommandBufferSubmitInfo>{{
+                .commandBuffer = *current->command_buffer,
+            }},
+            .signalSemaphoreInfoCount = 1,
+            .pSignalSemaphoreInfos = TempArr<vk::SemaphoreSubmitInfo>{{
+                .semaphore = *transfer_timeline,
+                .value = current->value,
+                .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            }},
+        }});
+        device.Submit2(device.graphics_queue, {{
+            .waitSemaphoreInfoCount = 1,
+            .pWaitSemaphoreInfos = TempArr<vk::SemaphoreSubmitInfo>{{
+                .semaphore = *transfer_timeline,
+                .value = current->value,
+                .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            }},
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = TempArr<vk::CommandBufferSubmitInfo>{{
+                .commandBuffer = *current->acquire_command_buffer,
+            }},
+            .signalSemaphoreInfoCount = 1,
+            .pSignalSemaphoreInfos = TempArr<vk::SemaphoreSubmitInfo>{{
+                .semaphore = *timeline,
+                .value = current->value,
+                .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            }},
+        }});
+    }
+
+    const u64 value = current->value;
+    for (auto& object : current->retained) {
+        device.deletion_queue->RetireShared(*timeline, value, std::move(object));
+    }
+    current->retained.clear();
+    in_flight.emplace_back(std::move(*current));
+    current.reset();
+    return value;
+}
+
+void VulkanUploadRing::Reclaim() {
+    const u64 completed = timeline.getCounterValue();
+    while (!in_flight.empty() && in_flight.front().value <= completed) {
+        auto& batch = in_flight.front();
+        tail = batch.end;
+        batch.dedicated_buffers.clear();
+        free_batches.emplace_back(std::move(batch));
+        in_flight.pop_front();
+    }
+    if (in_flight.empty() && !current) { // Everything is free, start over from the beginning
+        head = tail = 0;
+    }
+}
+
+} // namespace Renderer
@@ -0,0 +1,157 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanDevice;
+
+/**
+ * Persistently mapped staging ring buffer. Uploads are suballocated from the ring and their
+ * copy commands are recorded into a shared command buffer, which is submitted as one batch
+ * signalling a timeline semaphore. Space is reclaimed as the GPU completes the batches.
+ *
+ * Batches run on the dedicated transfer queue if there is one. Resources are then handed over
+ * to the graphics queue family with Release(), and the timeline semaphore is signalled by the
+ * graphics queue once it has acquired them.
+ */
+class VulkanUploadRing : NonCopyable {
+public:
+    static constexpr std::size_t DefaultSize = 128 * 1024 * 1024;
+    // Enough for any texel block size, and for buffer copies
+    static constexpr std::size_t Alignment = 16;
+
+    explicit VulkanUploadRing(const VulkanDevice& device, std::size_t ring_size = DefaultSize);
+    ~VulkanUploadRing();
+
+    /**
+     * Space for one upload. Write the data to `data`, then record commands that read from
+     * `buffer` at `offset` into `command_buffer`. The ring is locked while this is alive, except
+     * within WriteUnlocked.
+     * Note that `command_buffer` may belong to a transfer-only queue family.
+     */
+    class Upload : NonCopyable {
+    public:
+        ~Upload();
+
+        // Runs write() with the ring unlocked, so that other threads can allocate and record
+        // while it writes to `data` (e.g. reading it from a file). The space stays reserved, and
+        // the batch is not submitted until it returns, with the ring locked again to record the
+        // commands. It must not allocate from the ring itself.
+        void WriteUnlocked(const std::function<void()>& write);
+
+        // Makes the written resources available to the graphics queue. Barriers are given as
+        // if on a single queue (from transfer writes to their consumers), and are split into
+        // queue family ownership release/acquire pairs when needed.
+        void Release(vk::BufferMemoryBarrier2 barrier, vk::SharingMode sharing_mode) const;
+        void Release(const vk::ArrayProxy<const vk::ImageMemoryBarrier2>& barriers) const;
+        // Keeps the object (e.g. buffers and pipelines the commands use) alive until the batch
+        // has completed, retiring it to the deletion queue of the device once submitted.
+        void Retain(std::shared_ptr<const void> object) const;
+
+        // Graphics queue command buffer that runs after the released resources are acquired,
+        // for work transfer queues cannot do (e.g. blits).
+        const vk::raii::CommandBuffer& GetGraphicsCommandBuffer() const noexcept {
+            return acquire_command_buffer ? *acquire_command_buffer : command_buffer;
+        }
+
+        u8* data{};
+        vk::Buffer buffer;
+        vk::DeviceSize offset{};
+        std::size_t size{};
+        const vk::raii::CommandBuffer& command_buffer;
+
+    private:
+        friend class VulkanUploadRing;
+        explicit Upload(VulkanUploadRing& ring_, std::unique_lock<std::mutex> lock_,
+                        VmaAllocator allocator_, VmaAllocation allocation_, u8* data_,
+                        vk::Buffer buffer_, vk::DeviceSize offset_, std::size_t size_,
+                        const VulkanDevice& device_,
+                        const vk::raii::CommandBuffer& command_buffer_,
+                        const vk::raii::CommandBuffer* acquire_command_buffer_,
+                        std::vector<std::shared_ptr<const void>>& retained_);
+
+        VulkanUploadRing& ring;
+        std::unique_lock<std::mutex> lock;
+        VmaAllocator allocator{};
+        VmaAllocation allocation{};
+        const VulkanDevice& device;
+        // Only when uploading on a separate transfer queue family
+        const vk::raii::CommandBuffer* acquire_command_buffer{};
+        std::vector<std::shared_ptr<const void>>& retained; // Of the batch
+    };
+
+    // Thread safe. Blocks if the ring is full until the GPU has consumed enough of it.
+    // Uploads larger than the ring get a dedicated staging buffer for the batch.
+    [[nodiscard]] Upload Allocate(std::size_t size);
+    // Locks the ring to record copies from other host visible buffers into the current batch,
+    // without allocating staging space. `data` is null.
+    [[nodiscard]] Upload Record();
+
+    // Largest upload that fits in the ring, useful for splitting up large uploads.
+    std::size_t GetMaxAllocationSize() const noexcept {
+        return ring_size / 4;
+    }
+
+    // Submits the recorded uploads. Returns the timeline value signalled on their completion.
+    u64 Flush();
+    // Waits until the batch with the given timeline value has completed.
+    void Wait(u64 value) const;
+    // Whether the batch with the given timeline value has completed, without waiting.
+    bool IsComplete(u64 value) const;
+    // For making submissions on other queues wait for a batch.
+    vk::SemaphoreSubmitInfo GetWaitInfo(u64 value, vk::PipelineStageFlags2 stage_mask) const;
+
+private:
+    struct Batch {
+        u64 value{}; // Timeline value signalled on completion
+        u64 end{};   // Ring position after the last allocation of the batch
+        vk::raii::CommandBuffer command_buffer = nullptr;
+        vk::raii::CommandBuffer acquire_command_buffer = nullptr;
+        std::vector<std::unique_ptr<VulkanBuffer>> dedicated_buffers;
+        std::vector<std::shared_ptr<const void>> retained; // Until submitted
+    };
+
+    void BeginBatch();
+    // Waits for the uploads within WriteUnlocked first, which the batch is to copy from
+    u64 FlushLocked(std::unique_lock<std::mutex>& lock);
+    void Reclaim();
+    Upload MakeUpload(std::unique_lock<std::mutex> lock, const VulkanBuffer& src_buffer, u64 offset,
+                      std::size_t size);
+
+    const VulkanDevice& device;
+    std::size_t ring_size{};
+    std::unique_ptr<VulkanBuffer> buffer;
+    u8* mapped{};
+    bool ownership_transfer{}; // Whether the transfer queue family differs from graphics
+
+    vk::raii::CommandPool command_pool = nullptr;
+    vk::raii::CommandPool acquire_command_pool = nullptr;
+    vk::raii::Semaphore timeline = nullptr;
+    vk::raii::Semaphore transfer_timeline = nullptr; // Signalled by the transfer queue
+
+    std::mutex mutex;
+    std::condition_variable writers_cv;
+    std::size_t num_writers{}; // Uploads within WriteUnlocked, of the current batch
+    u64 head{}; // Next free position
+    u64 tail{}; // Oldest position still in use by the GPU
+    u64 next_value = 1;
+    std::unique_ptr<Batch> current;
+    std::deque<Batch> in_flight;
+    std::vector<Batch> free_batches;
+};
+
+} // namespace Renderer
@@ -0,0 +1,819 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/temp_ptr.h"
+#include "core/shaders/nv12_convert_glsl.h"
+#include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
+#include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_device.h"
+#include "core/vulkan/vulkan_shader.h"
+#include "core/vulkan/vulkan_swapchain.h"
+#include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_video_encoder.h"
+
+namespace Renderer {
+
+// H.264 macroblocks
+static constexpr u32 MacroblockSize = 16;
+// log2_max_frame_num_minus4 and log2_max_pic_order_cnt_lsb_minus4 of the SPS
+static constexpr u32 Log2MaxFrameNumMinus4 = 4;
+static constexpr u32 Log2MaxPicOrderCntLsbMinus4 = 4;
+// Of the virtual buffer of the rate control, short for low latency
+static constexpr u32 VirtualBufferMilliseconds = 200;
+
+static const vk::ImageSubresourceRange ColorRange{
+    .aspectMask = vk::ImageAspectFlagBits::eColor,
+    .baseMipLevel = 0,
+    .levelCount = 1,
+    .baseArrayLayer = 0,
+    .layerCount = 1,
+};
+
+// The first format of the usage, preferring NV12
+static vk::Format SelectVideoFormat(const vk::raii::PhysicalDevice& physical_device,
+                                    const vk::VideoProfileListInfoKHR& profile_list,
+                                    vk::ImageUsageFlags usage) {
+    const auto formats = physical_device.getVideoFormatPropertiesKHR({
+        .pNext = &profile_list,
+        .imageUsage = usage,
+    });
+    if (formats.empty()) {
+        throw std::runtime_error("No video format for encoding");
+    }
+    const auto it = std::ranges::find(formats, vk::Format::eG8B8R82Plane420Unorm,
+                                      &vk::VideoFormatPropertiesKHR::format);
+    return it != formats.end() ? it->format : formats[0].format;
+}
+
+VulkanVideoEncoder::VulkanVideoEncoder(const VulkanDevice& device_,
+                                       const VulkanSwapchain& swapchain, const Settings& settings_,
+                                       PacketCallback callback_)
+    : device(device_), settings(settings_), callback(std::move(callback_)),
+      extent(swapchain.extent) {
+
+    if (!device.video_encode || !swapchain.IsHeadless()) {
+        throw std::runtime_error("Video encoding needs a headless device with an encode queue");
+    }
+    h264_profile = vk::VideoEncodeH264ProfileInfoKHR{
+        .stdProfileIdc = STD_VIDEO_H264_PROFILE_IDC_MAIN,
+    };
+    profile = vk::VideoProfileInfoKHR{
+        .pNext = &h264_profile,
+        .videoCodecOperation = vk::VideoCodecOperationFlagBitsKHR::eEncodeH264,
+        .chromaSubsampling = vk::VideoChromaSubsamplingFlagBitsKHR::e420,
+        .lumaBitDepth = vk::VideoComponentBitDepthFlagBitsKHR::e8,
+        .chromaBitDepth = vk::VideoComponentBitDepthFlagBitsKHR::e8,
+    };
+    profile_list = vk::VideoProfileListInfoKHR{
+        .profileCount = 1,
+        .pProfiles = &profile,
+    };
+    const auto capability_chain =
+        device.physical_device
+            .getVideoCapabilitiesKHR<vk::VideoCapabilitiesKHR, vk::VideoEncodeCapabilitiesKHR,
+                                     vk::VideoEncodeH264CapabilitiesKHR>(profile);
+    capabilities = capability_chain.get<vk::VideoCapabilitiesKHR>();
+    encode_capabilities = capability_chain.get<vk::VideoEncodeCapabilitiesKHR>();
+    h264_capabilities = capability_chain.get<vk::VideoEncodeH264CapabilitiesKHR>();
+
+    coded_extent = vk::Extent2D{
+        Common::AlignUp(extent.width, MacroblockSize),
+        Common::AlignUp(extent.height, MacroblockSize),
+    };
+    if (coded_extent.width < capabilities.minCodedExtent.width ||
+        coded_extent.height < capabilities.minCodedExtent.height ||
+        coded_extent.width > capabilities.maxCodedExtent.width ||
+        coded_extent.height > capabilities.maxCodedExtent.height) {
+        throw std::runtime_error("Frames are beyond the extents the device can encode");
+    }
+    // P pictures reference the previous picture
+    if (capabilities.maxDpbSlots < 2 || capabilities.maxActiveReferencePictures < 1 ||
+        h264_capabilities.maxPPictureL0ReferenceCount < 1) {
+        throw std::runtime_error("The device cannot encode P pictures");
+    }
+    source_format = SelectVideoFormat(device.physical_device, profile_list,
+                                      vk::ImageUsageFlagBits::eVideoEncodeSrcKHR);
+    dpb_format = SelectVideoFormat(device.physical_device, profile_list,
+                                   vk::ImageUsageFlagBits::eVideoEncodeDpbKHR);
+    if (source_format != vk::Format::eG8B8R82Plane420Unorm) {
+        throw std::runtime_error("The device cannot encode NV12 pictures");
+    }
+
+    // Sampling returns linear values, except of the UNORM storage images written sRGB encoded
+    encode_srgb = !swapchain.encode_srgb;
+
+    CreateSession();
+    CreateSessionParameters();
+    CreateSlots(swapchain);
+    CreatePipeline();
+
+    // Constant bitrate where supported, for steady streaming
+    const auto& modes = encode_capabilities.rateControlModes;
+    const auto mode = (modes & vk::VideoEncodeRateControlModeFlagBitsKHR::eCbr)
+                          ? vk::VideoEncodeRateControlModeFlagBitsKHR::eCbr
+                      : (modes & vk::VideoEncodeRateControlModeFlagBitsKHR::eVbr)
+                          ? vk::VideoEncodeRateControlModeFlagBitsKHR::eVbr
+                          : vk::VideoEncodeRateControlModeFlagBitsKHR::eDefault;
+    const u64 bitrate = std::min<u64>(settings.bitrate, encode_capabilities.maxBitrate);
+    rate_control_layer = vk::VideoEncodeRateControlLayerInfoKHR{
+        .averageBitrate = bitrate,
+        .maxBitrate = mode == vk::VideoEncodeRateControlModeFlagBitsKHR::eVbr
+                          ? std::min<u64>(bitrate * 2, encode_capabilities.maxBitrate)
+                          : bitrate,
+        .frameRateNumerator = std::max(settings.frame_rate, 1u),
+        .frameRateDenominator = 1,
+    };
+    h264_rate_control = vk::VideoEncodeH264RateControlInfoKHR{
+        .gopFrameCount = settings.gop_length,
+        .idrPeriod = settings.gop_length,
+        .consecutiveBFrameCount = 0,
+        .temporalLayerCount = 1,
+    };
+    const bool has_layer = mode != vk::VideoEncodeRateControlModeFlagBitsKHR::eDefault;
+    rate_control = vk::VideoEncodeRateControlInfoKHR{
+        .pNext = &h264_rate_control,
+        .rateControlMode = mode,
+        .layerCount = has_layer ? 1u : 0u,
+        .pLayers = has_layer ? &rate_control_layer : nullptr,
+        .virtualBufferSizeInMs = has_layer ? VirtualBufferMilliseconds : 0,
+        .initialVirtualBufferSizeInMs = has_layer ? VirtualBufferMilliseconds / 2 : 0,
+    };
+    SPDLOG_INFO("Encoding {}x{} frames to H.264 at {} kbit/s ({})", extent.width, extent.height,
+                bitrate / 1000, vk::to_string(mode));
+}
+
+VulkanVideoEncoder::~VulkanVideoEncoder() {
+    device.WaitQueueIdle(device.encode_queue);
+    session_parameters.clear();
+    session.clear();
+    for (const auto allocation : session_memory) {
+        VmaAllocationInfo info;
+        vmaGetAllocationInfo(**device.allocator, allocation, &info);
+        device.allocator->RemoveUsage(MemoryCategory::Other, info.size);
+        vmaFreeMemory(**device.allocator, allocation);
+    }
+}
+
+void VulkanVideoEncoder::CreateSession() {
+    session = vk::raii::VideoSessionKHR{
+        *device,
+        {
+            .queueFamilyIndex = device.encode_queue_family,
+            .pVideoProfile = &profile,
+            .pictureFormat = source_format,
+            .maxCodedExtent = coded_extent,
+            .referencePictureFormat = dpb_format,
+            .maxDpbSlots = 2,
+            .maxActiveReferencePictures = 1,
+            .pStdHeaderVersion = &capabilities.stdHeaderVersion,
+        }};
+
+    // Bound to memory of its own, which VMA does not know the resource of
+    std::vector<vk::BindVideoSessionMemoryInfoKHR> binds;
+    for (const auto& requirements : session.getMemoryRequirements()) {
+        const VkMemoryRequirements memory_requirements = requirements.memoryRequirements;
+        const VmaAllocationCreateInfo alloc_create_info{
+            .preferredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        };
+        VmaAllocation allocation{};
+        VmaAllocationInfo allocation_info{};
+        if (vmaAllocateMemory(**device.allocator, &memory_requirements, &alloc_create_info,
+                              &allocation, &allocation_info) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to allocate video session memory");
+        }
+        session_memory.push_back(allocation);
+        device.allocator->AddUsage(MemoryCategory::Other, allocation_info.size);
+        binds.push_back({
+            .memoryBindIndex = requirements.memoryBindIndex,
+            .memory = allocation_info.deviceMemory,
+            .memoryOffset = allocation_info.offset,
+            .memorySize = memory_requirements.size,
+        });
+    }
+    session.bindMemory(binds);
+}
+
+void VulkanVideoEncoder::CreateSessionParameters() {
+    // BT.709 limited range, as nv12_convert.comp writes
+    StdVideoH264SequenceParameterSetVui vui{};
+    vui.flags.video_signal_type_present_flag = 1;
+    vui.flags.color_description_present_flag = 1;
+    vui.video_format = 5; // Unspecified
+    vui.colour_primaries = 1;
+    vui.transfer_characteristics = 1;
+    vui.matrix_coefficients = 1;
+
+    StdVideoH264SequenceParameterSet sps{};
+    sps.flags.direct_8x8_inference_flag = 1;
+    sps.flags.frame_mbs_only_flag = 1;
+    sps.flags.vui_parameters_present_flag = 1;
+    sps.profile_idc = STD_VIDEO_H264_PROFILE_IDC_MAIN;
+    sps.level_idc = h264_capabilities.maxLevelIdc;
+    sps.chroma_format_idc = STD_VIDEO_H264_CHROMA_FORMAT_IDC_420;
+    sps.seq_parameter_set_id = 0;
+    sps.log2_max_frame_num_minus4 = Log2MaxFrameNumMinus4;
+    sps.pic_order_cnt_type = STD_VIDEO_H264_POC_TYPE_0;
+    sps.log2_max_pic_order_cnt_lsb_minus4 = Log2MaxPicOrderCntLsbMinus4;
+    sps.max_num_ref_frames = 1;
+    sps.pic_width_in_mbs_minus1 = coded_extent.width / MacroblockSize - 1;
+    sps.pic_height_in_map_units_minus1 = coded_extent.height / MacroblockSize - 1;
+    // In units of 2 luma samples with 4:2:0 chroma
+    if (coded_extent != extent) {
+        sps.flags.frame_cropping_flag = 1;
+        sps.frame_crop_right_offset = (coded_extent.width - extent.width) / 2;
+        sps.frame_crop_bottom_offset = (coded_extent.height - extent.height) / 2;
+    }
+    sps.pSequenceParameterSetVui = &vui;
+
+    StdVideoH264PictureParameterSet pps{};
+    pps.flags.deblocking_filter_control_present_flag = 1;
+    // CABAC where it can be chosen
+    pps.flags.entropy_coding_mode_flag =
+        (h264_capabilities.stdSyntaxFlags &
+         vk::VideoEncodeH264StdFlagBitsKHR::eEntropyCodingModeFlagSet)
+            ? 1
+            : 0;
+    pps.seq_parameter_set_id = 0;
+    pps.pic_parameter_set_id = 0;
+    pps.num_ref_idx_l0_default_active_minus1 = 0;
+
+    const vk::VideoEncodeH264SessionParametersAddInfoKHR add_info{
+        .stdSPSCount = 1,
+        .pStdSPSs = &sps,
+        .stdPPSCount = 1,
+        .pStdPPSs = &pps,
+    };
+    const vk::VideoEncodeH264SessionParametersCreateInfoKHR h264_create_info{
+        .maxStdSPSCount = 1,
+        .maxStdPPSCount = 1,
+        .pParametersAddInfo = &add_info,
+    };
+    session_parameters = vk::raii::VideoSessionParametersKHR{
+        *device,
+        {
+            .pNext = &h264_create_info,
+            .videoSession = *session,
+        }};
+
+    const vk::VideoEncodeH264SessionParametersGetInfoKHR h264_get_info{
+        .writeStdSPS = VK_TRUE,
+        .writeStdPPS = VK_TRUE,
+        .stdSPSId = 0,
+        .stdPPSId = 0,
+    };
+    parameter_sets = device->getEncodedVideoSessionParametersKHR({
+                                .pNext = &h264_get_info,
+                                .videoSessionParameters = *session_parameters,
+                            })
+                         .second;
+}
+
+void VulkanVideoEncoder::CreateSlots(const VulkanSwapchain& swapchain) {
+    // The source images are written on the graphics queue and read on the encode queue
+    const auto source_families = std::array{device.graphics_queue_family,
+                                            device.encode_queue_family};
+    const bool concurrent = device.graphics_queue_family != device.encode_queue_family;
+    const vk::DeviceSize luma_size = vk::DeviceSize{coded_extent.width} * coded_extent.height;
+    const vk::DeviceSize bitstream_size = Common::AlignUp(
+        luma_size * 3 / 2 + parameter_sets.size(), capabilities.minBitstreamBufferSizeAlignment);
+
+    dpb_image = std::make_unique<VulkanImage>(
+        *device.allocator,
+        vk::ImageCreateInfo{
+            .pNext = &profile_list,
+            .imageType = vk::ImageType::e2D,
+            .format = dpb_format,
+            .extent = {coded_extent.width, coded_extent.height, 1},
+            .mipLevels = 1,
+            .arrayLayers = 2,
+            .usage = vk::ImageUsageFlagBits::eVideoEncodeDpbKHR,
+            .initialLayout = vk::ImageLayout::eUndefined,
+        },
+        VmaAllocationCreateInfo{
+            .usage = VMA_MEMORY_USAGE_AUTO,
+        },
+        MemoryCategory::RenderTargets);
+    dpb_image->SetName("video DPB");
+    for (u32 layer = 0; layer < 2; ++layer) {
+        auto range = ColorRange;
+        range.baseArrayLayer = layer;
+        dpb_views.emplace_back(*device, vk::ImageViewCreateInfo{
+                                            .image = **dpb_image,
+                                            .viewType = vk::ImageViewType::e2D,
+                                            .format = dpb_format,
+                                            .subresourceRange = range,
+                                        });
+    }
+
+    // The profile is chained last, keeping its own H.264 profile
+    const vk::QueryPoolVideoEncodeFeedbackCreateInfoKHR feedback_create_info{
+        .pNext = &profile,
+        .encodeFeedbackFlags = vk::VideoEncodeFeedbackFlagBitsKHR::eBitstreamBufferOffset |
+                               vk::VideoEncodeFeedbackFlagBitsKHR::eBitstreamBytesWritten,
+    };
+    feedback_query_pool = vk::raii::QueryPool{*device,
+                                              {
+                                                  .pNext = &feedback_create_info,
+                                                  .queryType =
+                                                      vk::QueryType::eVideoEncodeFeedbackKHR,
+                                                  .queryCount =
+                                                      static_cast<u32>(swapchain.images.size()),
+                                              }};
+
+    const auto encode_pool = device.GetThreadCommandPool(device.encode_queue_family);
+    for (std::size_t i = 0; i < swapchain.images.size(); ++i) {
+        auto& slot = slots.emplace_back();
+        slot.frame_image = swapchain.images[i];
+        slot.frame_view = *swapchain.image_views[i];
+        slot.nv12_buffer = std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .size = luma_size * 3 / 2,
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eTransferSrc,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Scratch);
+        slot.nv12_buffer->SetName("NV12 frame");
+        slot.source_image = std::make_unique<VulkanImage>(
+            *device.allocator,
+            vk::ImageCreateInfo{
+                .pNext = &profile_list,
+                .imageType = vk::ImageType::e2D,
+                .format = source_format,
+                .extent = {coded_extent.width, coded_extent.height, 1},
+                .mipLevels = 1,
+                .arrayLayers = 1,
+                .usage = vk::ImageUsageFlagBits::eVideoEncodeSrcKHR |
+                         vk::ImageUsageFlagBits::eTransferDst,
+                .sharingMode = concurrent ? vk::SharingMode::eConcurrent
+                                          : vk::SharingMode::eExclusive,
+                .queueFamilyIndexCount = concurrent ? 2u : 0u,
+                .pQueueFamilyIndices = concurrent ? source_families.data() : nullptr,
+                .initialLayout = vk::ImageLayout::eUndefined,
+            },
+            VmaAllocationCreateInfo{
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::RenderTargets);
+        slot.source_view = vk::raii::ImageView{*device, vk::ImageViewCreateInfo{
+                                                            .image = **slot.source_image,
+                                                            .viewType = vk::ImageViewType::e2D,
+                                                            .format = source_format,
+                                                            .subresourceRange = ColorRange,
+                                                        }};
+        slot.bitstream_buffer = std::make_unique<VulkanBuffer>(
+            *device.allocator,
+            vk::BufferCreateInfo{
+                .pNext = &profile_list,
+                .size = bitstream_size,
+                .usage = vk::BufferUsageFlagBits::eVideoEncodeDstKHR,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Scratch);
+        slot.bitstream_buffer->SetName("video bitstream");
+
+        vk::raii::CommandBuffers convert_command_buffers{
+            *device,
+            {
+                .commandPool = *device.command_pool,
+                .level = vk::CommandBufferLevel::ePrimary,
+                .commandBufferCount = 1,
+            }};
+        slot.convert_command_buffer = std::move(convert_command_buffers[0]);
+        vk::raii::CommandBuffers encode_command_buffers{
+            *device,
+            {
+                .commandPool = encode_pool,
+                .level = vk::CommandBufferLevel::ePrimary,
+                .commandBufferCount = 1,
+            }};
+        slot.encode_command_buffer = std::move(encode_command_buffers[0]);
+        slot.converted_semaphore = vk::raii::Semaphore{*device, vk::SemaphoreCreateInfo{}};
+        slot.fence = vk::raii::Fence{*device, vk::FenceCreateInfo{}};
+    }
+    last_encoded_slot = static_cast<u32>(slots.size()) - 1;
+}
+
+void VulkanVideoEncoder::CreatePipeline() {
+    descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+        device, slots.size(),
+        std::initializer_list<DescriptorBinding>{
+            {
+                .type = vk::DescriptorType::eCombinedImageSampler,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            },
+            {
+                .type = vk::DescriptorType::eStorageBuffer,
+                .stages = vk::ShaderStageFlagBits::eCompute,
+            },
+        });
+    std::vector<DescriptorBinding::CombinedImageSamplers> frames;
+    std::vector<DescriptorBinding::Buffers> buffers;
+    for (const auto& slot : slots) {
+        frames.push_back({.images = {{
+                              .image = slot.frame_view,
+                              .sampler = *device.default_sampler,
+                          }}});
+        buffers.push_back({.buffers = {{**slot.nv12_buffer}}});
+    }
+    descriptor_sets->UpdateDescriptor(0, DescriptorBinding::CombinedImageSamplersValue{frames});
+    descriptor_sets->UpdateDescriptor(1, DescriptorBinding::BuffersValue{buffers});
+    pipeline = std::make_unique<VulkanComputePipeline>(
+        device,
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = *VulkanShader{device, u8"core/shaders/nv12_convert.comp"},
+            .pName = "main",
+        },
+        vk::PipelineLayoutCreateInfo{
+            .setLayoutCount = 1,
+            .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                *descriptor_sets->descriptor_set_layout,
+            }},
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::NV12ConvertPushConstant>(vk::ShaderStageFlagBits::eCompute),
+            }},
+        });
+}
+
+vk::CommandBuffer VulkanVideoEncoder::RecordConvert(u32 image_index) {
+    auto& slot = slots[image_index];
+    const auto& cmd = slot.convert_command_buffer;
+    cmd.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    // The previous encode of the slot has been waited for, see Deliver
+    cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = 1,
+        .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+            .srcAccessMask = vk::AccessFlagBits2::eMemoryWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderSampledRead,
+            .oldLayout = vk::ImageLayout::eTransferSrcOptimal,
+            .newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+            .image = slot.frame_image,
+            .subresourceRange = ColorRange,
+        }},
+    });
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **pipeline);
+    VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute, *pipeline->pipeline_layout,
+                               0, {{*descriptor_sets, image_index}});
+    cmd.pushConstants<GLSL::NV12ConvertPushConstant>(
+        *pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+        {{
+            .extent = {extent.width, extent.height},
+            .coded_extent = {coded_extent.width, coded_extent.height},
+            .encode_srgb = encode_srgb ? 1u : 0u,
+        }});
+    cmd.dispatch(Common::DivideCeil(coded_extent.width / 4, NV12_CONVERT_GROUP_SIZE),
+                 Common::DivideCeil(coded_extent.height / 2, NV12_CONVERT_GROUP_SIZE), 1);
+
+    const auto source_range = vk::ImageSubresourceRange{
+        .aspectMask = vk::ImageAspectFlagBits::ePlane0 | vk::ImageAspectFlagBits::ePlane1,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+    cmd.pipelineBarrier2({
+        .bufferMemoryBarrierCount = 1,
+        .pBufferMemoryBarriers = TempArr<vk::BufferMemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+            .buffer = **slot.nv12_buffer,
+            .offset = 0,
+            .size = VK_WHOLE_SIZE,
+        }},
+        .imageMemoryBarrierCount = 2,
+        .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{
+            // For the readback or the release of the frame that follows
+            {
+                .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+                .srcAccessMask = vk::AccessFlagBits2::eShaderSampledRead,
+                .dstStageMask = vk::PipelineStageFlagBits2::eAllCommands,
+                .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+                .oldLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+                .newLayout = vk::ImageLayout::eTransferSrcOptimal,
+                .image = slot.frame_image,
+                .subresourceRange = ColorRange,
+            },
+            {
+                .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+                .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+                .oldLayout = vk::ImageLayout::eUndefined,
+                .newLayout = vk::ImageLayout::eTransferDstOptimal,
+                .image = **slot.source_image,
+                .subresourceRange = source_range,
+            },
+        }},
+    });
+    const vk::DeviceSize luma_size = vk::DeviceSize{coded_extent.width} * coded_extent.height;
+    cmd.copyBufferToImage(**slot.nv12_buffer, **slot.source_image,
+                          vk::ImageLayout::eTransferDstOptimal,
+                          {
+                              {
+                                  .bufferOffset = 0,
+                                  .imageSubresource =
+                                      {
+                                          .aspectMask = vk::ImageAspectFlagBits::ePlane0,
+                                          .mipLevel = 0,
+                                          .baseArrayLayer = 0,
+                                          .layerCount = 1,
+                                      },
+                                  .imageExtent = {coded_extent.width, coded_extent.height, 1},
+                              },
+                              {
+                                  .bufferOffset = luma_size,
+                                  .imageSubresource =
+                                      {
+                                          .aspectMask = vk::ImageAspectFlagBits::ePlane1,
+                                          .mipLevel = 0,
+                                          .baseArrayLayer = 0,
+                                          .layerCount = 1,
+                                      },
+                                  .imageExtent = {coded_extent.width / 2,
+                                                  coded_extent.height / 2, 1},
+                              },
+                          });
+    cmd.end();
+    return *cmd;
+}
+
+vk::Semaphore VulkanVideoEncoder::GetConvertedSemaphore(u32 image_index) const {
+    return *slots[image_index].converted_semaphore;
+}
+
+void VulkanVideoEncoder::RecordEncode(Slot& slot, u32 slot_index, bool idr) {
+    const u32 setup_dpb_slot = idr ? 0 : 1 - last_dpb_slot;
+    const u32 frame_num = frames_since_idr % (1u << (Log2MaxFrameNumMinus4 + 4));
+    const s32 pic_order_cnt = static_cast<s32>(frames_since_idr * 2);
+    const auto picture_type = idr ? STD_VIDEO_H264_PICTURE_TYPE_IDR : STD_VIDEO_H264_PICTURE_TYPE_P;
+
+    const auto& cmd = slot.encode_command_buffer;
+    cmd.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    cmd.resetQueryPool(*feedback_query_pool, slot_index, 1);
+    // The source was copied on the graphics queue, which the semaphore waits for. The DPB is
+    // written by the previous encode, or not initialized yet.
+    const auto source_range = vk::ImageSubresourceRange{
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+    auto dpb_range = ColorRange;
+    dpb_range.layerCount = 2;
+    cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = 2,
+        .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{
+            {
+                .dstStageMask = vk::PipelineStageFlagBits2::eVideoEncodeKHR,
+                .dstAccessMask = vk::AccessFlagBits2::eVideoEncodeReadKHR,
+                .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+                .newLayout = vk::ImageLayout::eVideoEncodeSrcKHR,
+                .image = **slot.source_image,
+                .subresourceRange = source_range,
+            },
+            {
+                .srcStageMask = vk::PipelineStageFlagBits2::eVideoEncodeKHR,
+                .srcAccessMask = vk::AccessFlagBits2::eVideoEncodeWriteKHR,
+                .dstStageMask = vk::PipelineStageFlagBits2::eVideoEncodeKHR,
+                .dstAccessMask = vk::AccessFlagBits2::eVideoEncodeReadKHR |
+                                 vk::AccessFlagBits2::eVideoEncodeWriteKHR,
+                .oldLayout = dpb_initialized ? vk::ImageLayout::eVideoEncodeDpbKHR
+                                             : vk::ImageLayout::eUndefined,
+                .newLayout = vk::ImageLayout::eVideoEncodeDpbKHR,
+                .image = **dpb_image,
+                .subresourceRange = dpb_range,
+            },
+        }},
+    });
+    dpb_initialized = true;
+
+    // The picture reconstructed into the setup slot is the reference of the next one
+    StdVideoEncodeH264ReferenceInfo setup_std_info{};
+    setup_std_info.primary_pic_type = picture_type;
+    setup_std_info.FrameNum = frame_num;
+    setup_std_info.PicOrderCnt = pic_order_cnt;
+    const vk::VideoEncodeH264DpbSlotInfoKHR setup_h264_info{
+        .pStdReferenceInfo = &setup_std_info,
+    };
+    const vk::VideoPictureResourceInfoKHR setup_resource{
+        .codedExtent = coded_extent,
+        .baseArrayLayer = 0,
+        .imageViewBinding = *dpb_views[setup_dpb_slot],
+    };
+    const vk::VideoReferenceSlotInfoKHR setup_slot{
+        .pNext = &setup_h264_info,
+        .slotIndex = static_cast<int32_t>(setup_dpb_slot),
+        .pPictureResource = &setup_resource,
+    };
+
+    StdVideoEncodeH264ReferenceInfo reference_std_info{};
+    reference_std_info.primary_pic_type =
+        frames_since_idr == 1 ? STD_VIDEO_H264_PICTURE_TYPE_IDR : STD_VIDEO_H264_PICTURE_TYPE_P;
+    reference_std_info.FrameNum = (frames_since_idr - 1) % (1u << (Log2MaxFrameNumMinus4 + 4));
+    reference_std_info.PicOrderCnt = pic_order_cnt - 2;
+    const vk::VideoEncodeH264DpbSlotInfoKHR reference_h264_info{
+        .pStdReferenceInfo = &reference_std_info,
+    };
+    const vk::VideoPictureResourceInfoKHR reference_resource{
+        .codedExtent = coded_extent,
+        .baseArrayLayer = 0,
+        .imageViewBinding = *dpb_views[last_dpb_slot],
+    };
+    const vk::VideoReferenceSlotInfoKHR reference_slot{
+        .pNext = &reference_h264_info,
+        .slotIndex = static_cast<int32_t>(last_dpb_slot),
+        .pPictureResource = &reference_resource,
+    };
+
+    // The setup slot is activated by the encode
+    auto begin_setup_slot = setup_slot;
+    begin_setup_slot.slotIndex = -1;
+    const std::array begin_slots{begin_setup_slot, reference_slot};
+    cmd.beginVideoCodingKHR({
+        .pNext = session_reset ? &rate_control : nullptr,
+        .videoSession = *session,
+        .videoSessionParameters = *session_parameters,
+        .referenceSlotCount = idr ? 1u : 2u,
+        .pReferenceSlots = begin_slots.data(),
+    });
+    if (!session_reset) {
+        cmd.controlVideoCodingKHR({
+            .pNext = &rate_control,
+            .flags = vk::VideoCodingControlFlagBitsKHR::eReset |
+                     vk::VideoCodingControlFlagBitsKHR::eEncodeRateControl,
+        });
+        session_reset = true;
+    }
+
+    StdVideoEncodeH264ReferenceListsInfo reference_lists{};
+    std::ranges::fill(reference_lists.RefPicList0, STD_VIDEO_H264_NO_REFERENCE_PICTURE);
+    std::ranges::fill(reference_lists.RefPicList1, STD_VIDEO_H264_NO_REFERENCE_PICTURE);
+    if (!idr) {
+        reference_lists.RefPicList0[0] = static_cast<u8>(last_dpb_slot);
+    }
+    StdVideoEncodeH264SliceHeader slice_header{};
+    slice_header.slice_type = idr ? STD_VIDEO_H264_SLICE_TYPE_I : STD_VIDEO_H264_SLICE_TYPE_P;
+    slice_header.cabac_init_idc = STD_VIDEO_H264_CABAC_INIT_IDC_0;
+    slice_header.disable_deblocking_filter_idc =
+        STD_VIDEO_H264_DISABLE_DEBLOCKING_FILTER_IDC_DISABLED;
+    const vk::VideoEncodeH264NaluSliceInfoKHR nalu_slice{
+        .pStdSliceHeader = &slice_header,
+    };
+    StdVideoEncodeH264PictureInfo picture_info{};
+    picture_info.flags.IdrPicFlag = idr ? 1 : 0;
+    picture_info.flags.is_reference = 1;
+    picture_info.seq_parameter_set_id = 0;
+    picture_info.pic_parameter_set_id = 0;
+    picture_info.idr_pic_id = static_cast<u16>(idr_count);
+    picture_info.primary_pic_type = picture_type;
+    picture_info.frame_num = frame_num;
+    picture_info.PicOrderCnt = pic_order_cnt;
+    picture_info.pRefLists = &reference_lists;
+    const vk::VideoEncodeH264PictureInfoKHR h264_picture_info{
+        .naluSliceEntryCount = 1,
+        .pNaluSliceEntries = &nalu_slice,
+        .pStdPictureInfo = &picture_info,
+    };
+    cmd.beginQuery(*feedback_query_pool, slot_index, {});
+    cmd.encodeVideoKHR({
+        .pNext = &h264_picture_info,
+        .dstBuffer = **slot.bitstream_buffer,
+        .dstBufferOffset = 0,
+        .dstBufferRange = slot.bitstream_buffer->size,
+        .srcPictureResource =
+            {
+                .codedExtent = coded_extent,
+                .baseArrayLayer = 0,
+                .imageViewBinding = *slot.source_view,
+            },
+        .pSetupReferenceSlot = &setup_slot,
+        .referenceSlotCount = idr ? 0u : 1u,
+        .pReferenceSlots = &reference_slot,
+    });
+    cmd.endQuery(*feedback_query_pool, slot_index);
+    cmd.endVideoCodingKHR({});
+    cmd.pipelineBarrier2({
+        .bufferMemoryBarrierCount = 1,
+        .pBufferMemoryBarriers = TempArr<vk::BufferMemoryBarrier2>{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eVideoEncodeKHR,
+            .srcAccessMask = vk::AccessFlagBits2::eVideoEncodeWriteKHR,
+            .dstStageMask = vk::PipelineStageFlagBits2::eHost,
+            .dstAccessMask = vk::AccessFlagBits2::eHostRead,
+            .buffer = **slot.bitstream_buffer,
+            .offset = 0,
+            .size = VK_WHOLE_SIZE,
+        }},
+    });
+    cmd.end();
+    last_dpb_slot = setup_dpb_slot;
+}
+
+void VulkanVideoEncoder::Encode(u32 image_index, u64 number) {
+    auto& slot = slots[image_index];
+    const bool idr = frames_since_idr == 0 || frames_since_idr >= settings.gop_length;
+    if (idr) {
+        if (frames_since_idr != 0) {
+            ++idr_count;
+        }
+        frames_since_idr = 0;
+    }
+    RecordEncode(slot, image_index, idr);
+    device.Submit2(device.encode_queue,
+                   {{
+                       .waitSemaphoreInfoCount = 1,
+                       .pWaitSemaphoreInfos = TempArr<vk::SemaphoreSubmitInfo>{{
+                           .semaphore = *slot.converted_semaphore,
+                           .stageMask = vk::PipelineStageFlagBits2::eVideoEncodeKHR,
+                       }},
+                       .commandBufferInfoCount = 1,
+                       .pCommandBufferInfos = TempArr<vk::CommandBufferSubmitInfo>{{
+                           .commandBuffer = *slot.encode_command_buffer,
+                       }},
+                   }},
+                   *slot.fence);
+    ++frames_since_idr;
+    slot.number = number;
+    slot.keyframe = idr;
+    slot.pending = true;
+    last_encoded_slot = image_index;
+}
+
+bool VulkanVideoEncoder::DeliverSlot(Slot& slot, u32 slot_index, bool wait) {
+    if (!slot.pending) {
+        return true;
+    }
+    if (!wait && slot.fence.getStatus() != vk::Result::eSuccess) {
+        return false;
+    }
+    if (device->waitForFences({*slot.fence}, VK_TRUE, std::numeric_limits<u64>::max()) !=
+        vk::Result::eSuccess) {
+        throw std::runtime_error("Failed to wait for fences");
+    }
+    device->resetFences({*slot.fence});
+    slot.pending = false;
+
+    // Offset, bytes written and status
+    const auto [result, feedback] = feedback_query_pool.getResults<u32>(
+        slot_index, 1, 3 * sizeof(u32), 3 * sizeof(u32),
+        vk::QueryResultFlagBits::eWithStatusKHR);
+    if (result != vk::Result::eSuccess ||
+        static_cast<s32>(feedback[2]) != VK_QUERY_RESULT_STATUS_COMPLETE_KHR) {
+        SPDLOG_WARN("Failed to encode frame {}, dropping it", slot.number);
+        return true;
+    }
+    vmaInvalidateAllocation(slot.bitstream_buffer->allocator, slot.bitstream_buffer->allocation,
+                            0, VK_WHOLE_SIZE);
+    const auto* bitstream =
+        static_cast<const u8*>(slot.bitstream_buffer->allocation_info.pMappedData) + feedback[0];
+    if (!callback) {
+        return true;
+    }
+    if (slot.keyframe) { // Decoders can start from any IDR picture
+        std::vector<u8> data(parameter_sets);
+        data.insert(data.end(), bitstream, bitstream + feedback[1]);
+        callback({.number = slot.number, .keyframe = true, .data = data});
+    } else {
+        callback({.number = slot.number, .keyframe = false, .data = {bitstream, feedback[1]}});
+    }
+    return true;
+}
+
+void VulkanVideoEncoder::Deliver(u32 image_index) {
+    // The slot is the oldest, followed by the newer ones in order
+    DeliverSlot(slots[image_index], image_index, true);
+    for (u32 i = 1; i < slots.size(); ++i) {
+        const u32 slot_index = (image_index + i) % static_cast<u32>(slots.size());
+        if (!DeliverSlot(slots[slot_index], slot_index, false)) {
+            break;
+        }
+    }
+}
+
+void VulkanVideoEncoder::Flush() {
+    for (u32 i = 1; i <= slots.size(); ++i) {
+        const u32 slot_index = (last_encoded_slot + i) % static_cast<u32>(slots.size());
+        DeliverSlot(slots[slot_index], slot_index, true);
+    }
+}
+
+} // namespace Renderer
@@ -0,0 +1,136 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan_raii.hpp>
+#include "common/common_types.h"
+
+namespace Renderer {
+
+class VulkanBuffer;
+class VulkanComputePipeline;
+class VulkanDescriptorSets;
+class VulkanDevice;
+class VulkanImage;
+class VulkanSwapchain;
+
+/**
+ * Encodes the frames of a headless swapchain to H.264 on the GPU (Vulkan Video), so that they
+ * can be streamed without leaving device memory uncompressed.
+ *
+ * Each frame is converted to NV12 on the graphics queue (see nv12_convert.comp) in the same
+ * submission that reads it back, then encoded on the encode queue as an IDR picture starting
+ * each GOP or a P picture referencing the previous one, without B pictures so that no frame
+ * waits for later ones. The bitstream of each frame (Annex B, the IDR pictures preceded by the
+ * SPS and PPS) is delivered to the callback as soon as it is found encoded on later frames, at
+ * the latest when its image is acquired again.
+ */
+class VulkanVideoEncoder : NonCopyable {
+public:
+    struct Settings {
+        u32 bitrate = 20'000'000; // Bits per second, constant where supported
+        u32 frame_rate = 60;      // Of the rate control, not enforced
+        u32 gop_length = 60;      // Frames from each IDR picture to the next
+    };
+    struct Packet {
+        u64 number{}; // Of the frame, see VulkanSwapchain::ReadbackFrame
+        bool keyframe{};
+        std::span<const u8> data; // Valid during the callback
+    };
+    using PacketCallback = std::function<void(const Packet&)>;
+
+    // Throws if the device cannot encode the frames of the swapchain, e.g. without
+    // VulkanDevice::video_encode or at extents beyond its capabilities.
+    explicit VulkanVideoEncoder(const VulkanDevice& device, const VulkanSwapchain& swapchain,
+                                const Settings& settings, PacketCallback callback);
+    ~VulkanVideoEncoder();
+
+    // Records the conversion of the swapchain image (in TransferSrcOptimal, which it is left in)
+    // for Encode. Its submission must signal GetConvertedSemaphore.
+    vk::CommandBuffer RecordConvert(u32 image_index);
+    vk::Semaphore GetConvertedSemaphore(u32 image_index) const;
+    // Submits the encode of the converted image, once its conversion has been submitted
+    void Encode(u32 image_index, u64 number);
+    // Waits for the encode of the image if any, delivering it, after first delivering the older
+    // ones already done
+    void Deliver(u32 image_index);
+    // Waits for all encodes in flight and delivers them, oldest first
+    void Flush();
+
+private:
+    struct Slot {
+        std::unique_ptr<VulkanBuffer> nv12_buffer; // Written by the conversion
+        std::unique_ptr<VulkanImage> source_image; // Copied from nv12_buffer
+        vk::raii::ImageView source_view = nullptr;
+        vk::ImageView frame_view; // Of the swapchain image
+        vk::Image frame_image;
+        std::unique_ptr<VulkanBuffer> bitstream_buffer; // Host visible
+        vk::raii::CommandBuffer convert_command_buffer = nullptr;
+        vk::raii::Semaphore converted_semaphore = nullptr;
+        vk::raii::CommandBuffer encode_command_buffer = nullptr;
+        vk::raii::Fence fence = nullptr;
+        u64 number{};
+        bool keyframe{};
+        bool pending{};
+    };
+
+    void CreateSession();
+    void CreateSessionParameters();
+    void CreateSlots(const VulkanSwapchain& swapchain);
+    void CreatePipeline();
+    void RecordEncode(Slot& slot, u32 slot_index, bool idr);
+    // Returns false if the encode is not done yet and wait is not set
+    bool DeliverSlot(Slot& slot, u32 slot_index, bool wait);
+
+    const VulkanDevice& device;
+    Settings settings;
+    PacketCallback callback;
+    vk::Extent2D extent;       // Of the frames
+    vk::Extent2D coded_extent; // In whole macroblocks, cropped by the SPS
+
+    vk::VideoEncodeH264ProfileInfoKHR h264_profile;
+    vk::VideoProfileInfoKHR profile;
+    vk::VideoProfileListInfoKHR profile_list;
+    vk::VideoCapabilitiesKHR capabilities;
+    vk::VideoEncodeCapabilitiesKHR encode_capabilities;
+    vk::VideoEncodeH264CapabilitiesKHR h264_capabilities;
+    vk::Format source_format{};
+    vk::Format dpb_format{};
+    bool encode_srgb{}; // Whether the conversion encodes the sampled frames, see RecordConvert
+
+    vk::raii::VideoSessionKHR session = nullptr;
+    std::vector<VmaAllocation> session_memory;
+    vk::raii::VideoSessionParametersKHR session_parameters = nullptr;
+    std::vector<u8> parameter_sets; // SPS and PPS, preceding IDR pictures
+
+    // The layers are the reconstructed picture of the current frame and the reference of the
+    // previous one, alternately
+    std::unique_ptr<VulkanImage> dpb_image;
+    std::vector<vk::raii::ImageView> dpb_views;
+    bool dpb_initialized{};
+
+    // Rate control, set by the first encode after the session is reset and repeated after
+    vk::VideoEncodeRateControlLayerInfoKHR rate_control_layer;
+    vk::VideoEncodeH264RateControlInfoKHR h264_rate_control;
+    vk::VideoEncodeRateControlInfoKHR rate_control;
+    bool session_reset{}; // Whether the first encode has reset the session
+
+    std::vector<Slot> slots; // Indexed like the swapchain images
+    std::unique_ptr<VulkanDescriptorSets> descriptor_sets; // Of each slot
+    std::unique_ptr<VulkanComputePipeline> pipeline;
+    vk::raii::QueryPool feedback_query_pool = nullptr; // One query per slot
+
+    u32 frames_since_idr{};
+    u32 idr_count{};
+    u32 last_dpb_slot{};   // Of the reference for the next P picture
+    u32 last_encoded_slot{};
+};
+
+} // namespace Renderer
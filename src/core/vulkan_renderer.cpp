@@ -2,23 +2,50 @@
 // Licensed under GPLv2 or any later version
 // Refer to the license.txt file included.
 
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <typeinfo>
+#include <spdlog/spdlog.h>
+#include "common/alignment.h"
+#include "common/allocation_counter.h"
+#include "common/process_memory.h"
+#include "common/profiling.h"
 #include "common/temp_ptr.h"
+#include "common/thread_pool.h"
+#include "core/hot_reload.h"
 #include "core/scene.h"
+#include "core/shaders/postprocessing_glsl.h"
 #include "core/vulkan/vulkan_allocator.h"
+#include "core/vulkan/vulkan_buffer.h"
+#include "core/vulkan/vulkan_compute_pipeline.h"
 #include "core/vulkan/vulkan_context.h"
+#include "core/vulkan/vulkan_defragmenter.h"
+#include "core/vulkan/vulkan_deletion_queue.h"
 #include "core/vulkan/vulkan_descriptor_sets.h"
 #include "core/vulkan/vulkan_device.h"
 #include "core/vulkan/vulkan_frames_in_flight.hpp"
+#include "core/vulkan/vulkan_geometry_heap.h"
 #include "core/vulkan/vulkan_graphics_pipeline.h"
 #include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_profiler.h"
+#include "core/vulkan/vulkan_render_target_heap.h"
 #include "core/vulkan/vulkan_shader.h"
 #include "core/vulkan/vulkan_swapchain.h"
 #include "core/vulkan/vulkan_texture.h"
+#include "core/vulkan/vulkan_video_encoder.h"
 #include "core/vulkan_renderer.h"
 
 namespace Renderer {
 
+// Sharpens what the upscaling blurs, nothing at full resolution
+static constexpr float UpscalingSharpness = 0.5f;
+
 VulkanRenderer::VulkanRenderer(bool enable_validation_layers,
                                std::vector<const char*> frontend_required_extensions) {
 
@@ -27,7 +54,7 @@ VulkanRenderer::VulkanRenderer(bool enable_validation_layers,
 }
 
 VulkanRenderer::~VulkanRenderer() {
-    (*device)->waitIdle();
+    device->WaitIdle();
 }
 
 vk::raii::Instance& VulkanRenderer::GetVulkanInstance() {
@@ -38,12 +65,510 @@ const vk::raii::Instance& VulkanRenderer::GetVulkanInstance() const {
     return context->instance;
 }
 
+void VulkanRenderer::SetWorkerThreads(std::size_t num_threads) {
+    num_worker_threads = num_threads;
+}
+
+void VulkanRenderer::SetTextureCompression(bool enabled) {
+    compress_textures = enabled;
+}
+
+void VulkanRenderer::SetTextureBudget(std::size_t budget) {
+    texture_budget = budget;
+}
+
+void VulkanRenderer::SetHostCacheBudget(std::size_t budget) {
+    host_cache_budget = budget;
+}
+
+void VulkanRenderer::SetTextureQuality(u32 max_size, u32 dropped_levels, std::size_t budget) {
+    max_texture_size = max_size;
+    dropped_texture_levels = dropped_levels;
+    texture_quality_budget = budget;
+}
+
+void VulkanRenderer::SetLazyTextures(bool enabled) {
+    lazy_textures = enabled;
+}
+
+void VulkanRenderer::SetIndexOptimization(bool enabled) {
+    optimize_indices = enabled;
+}
+
+void VulkanRenderer::SetSpatialReordering(bool enabled) {
+    spatial_order = enabled;
+}
+
+void VulkanRenderer::SetVertexPacking(bool enabled) {
+    pack_vertices = enabled;
+}
+
+void VulkanRenderer::SetGPUTangentThreshold(std::size_t triangles) {
+    gpu_tangent_triangles = triangles;
+}
+
+void VulkanRenderer::SetGPUImageDecode(bool enabled) {
+    gpu_image_decode = enabled;
+}
+
+void VulkanRenderer::SetDynamicResolution(double target_milliseconds, double min_scale) {
+    target_frame_time = target_milliseconds;
+    min_render_scale = std::clamp(min_scale, 0.1, 1.0);
+    render_scale = 1;
+}
+
+void VulkanRenderer::SetGPUProfiling(bool enabled) {
+    gpu_profiling = enabled;
+}
+
+void VulkanRenderer::SetFramesInFlight(std::size_t count) {
+    num_frames_in_flight = std::max<std::size_t>(count, 1);
+}
+
+void VulkanRenderer::SetExposure(float stops) {
+    exposure = stops;
+}
+
+void VulkanRenderer::SetTonemapping(bool enabled) {
+    tonemapping = enabled;
+}
+
+void VulkanRenderer::SetStereo(float eye_separation_) {
+    eye_separation = std::max(eye_separation_, 0.0f);
+}
+
+const VulkanProfiler* VulkanRenderer::GetGPUProfiler() const {
+    return gpu_profiler.get();
+}
+
+VulkanProfiler* VulkanRenderer::GetGPUProfiler() {
+    return gpu_profiler.get();
+}
+
+void VulkanRenderer::SetPresentPacing(VulkanSwapchain::Pacing pacing) {
+    present_pacing = pacing;
+}
+
+void VulkanRenderer::WaitForFrameStart() {
+    swap_chain->WaitForFrameStart();
+}
+
+std::optional<double> VulkanRenderer::GetPresentLatency() const {
+    return swap_chain->GetLatency();
+}
+
+void VulkanRenderer::SetPhysicalDevice(std::size_t index) {
+    physical_device_index = index;
+}
+
+void VulkanRenderer::SetDescriptorBuffer(bool enabled) {
+    descriptor_buffer = enabled;
+}
+
+void VulkanRenderer::SetDefragmentation(bool enabled) {
+    defragmentation = enabled;
+}
+
+void VulkanRenderer::SetMemoryPressureCallback(
+    std::function<bool(MemoryCategory, vk::DeviceSize)> callback) {
+    memory_pressure_callback = std::move(callback);
+}
+
+MemoryUsage VulkanRenderer::GetMemoryUsage() const {
+    return device->allocator->GetUsage();
+}
+
+bool VulkanRenderer::WriteMemoryReport(const std::filesystem::path& path) const {
+    return device->allocator->WriteReport(path);
+}
+
+HostMemoryUsage VulkanRenderer::GetHostMemoryUsage() const {
+    HostMemoryUsage usage = scene ? GetHostMemory(*scene) : HostMemoryUsage{};
+    if (snapshot) {
+        usage.snapshot = snapshot->GetHostSize();
+    }
+    usage.resident = Common::GetResidentMemory();
+    return usage;
+}
+
+void VulkanRenderer::TrimHostMemory() {
+    const std::size_t prev_resident = Common::GetResidentMemory();
+    if (scene) {
+        Renderer::TrimHostMemory(*scene);
+    }
+    Common::TrimHeap();
+
+    static constexpr double MiB = 1024.0 * 1024.0;
+    const auto usage = GetHostMemoryUsage();
+    SPDLOG_INFO("Host memory: {:.1f} MiB resident ({:.1f} MiB before trimming)",
+                usage.resident / MiB, prev_resident / MiB);
+    SPDLOG_INFO("  meshes: {:.1f} MiB, nodes: {:.1f} MiB, materials: {:.1f} MiB",
+                usage.meshes / MiB, usage.nodes / MiB, usage.materials / MiB);
+    SPDLOG_INFO("  pending images: {:.1f} MiB, snapshot: {:.1f} MiB", usage.pending_images / MiB,
+                usage.snapshot / MiB);
+}
+
+SceneStats VulkanRenderer::GetSceneStats() const {
+    if (!scene) {
+        return {};
+    }
+    auto stats = Renderer::GetSceneStats(*scene, sub_scene_idx);
+    AddSceneStats(stats);
+    return stats;
+}
+
+bool VulkanRenderer::WriteSceneStats(const std::filesystem::path& path) const {
+    const auto stats = GetSceneStats();
+    std::ofstream file(path);
+    file << GetSceneStatsJSON(stats);
+    if (!file) {
+        SPDLOG_ERROR("Failed to write scene statistics {}", path.string());
+        return false;
+    }
+
+    static constexpr double MiB = 1024.0 * 1024.0;
+    const auto Sum = [](const auto& map, const auto& value) {
+        vk::DeviceSize sum = 0;
+        for (const auto& [key, element] : map) {
+            sum += value(element);
+        }
+        return sum;
+    };
+    SPDLOG_INFO("Wrote scene statistics {}", path.string());
+    SPDLOG_INFO("  {} meshes, {} primitives, {} materials, {} instances, {} draws", stats.meshes,
+                stats.primitives, stats.materials, stats.instances, stats.draws);
+    SPDLOG_INFO("  triangles: {} unique, {} instanced", stats.unique_triangles,
+                stats.instanced_triangles);
+    SPDLOG_INFO("  vertices: {:.1f} MiB, indices: {:.1f} MiB",
+                Sum(stats.vertex_bytes, [](vk::DeviceSize bytes) { return bytes; }) / MiB,
+                stats.index_bytes / MiB);
+    SPDLOG_INFO("  textures: {:.1f} MiB in {} images ({} pending)",
+                Sum(stats.textures,
+                    [](const SceneStats::TextureFormat& format) {
+                        return std::accumulate(format.level_bytes.begin(),
+                                               format.level_bytes.end(), vk::DeviceSize{0});
+                    }) /
+                    MiB,
+                Sum(stats.textures,
+                    [](const SceneStats::TextureFormat& format) { return format.count; }),
+                stats.pending_images);
+    if (stats.blases.count != 0 || stats.tlases.count != 0) {
+        SPDLOG_INFO("  BLASes: {:.1f} MiB ({:.1f} MiB as built), TLASes: {:.1f} MiB",
+                    stats.blases.bytes / MiB, stats.blases.build_bytes / MiB,
+                    stats.tlases.bytes / MiB);
+    }
+    return true;
+}
+
+void VulkanRenderer::SetFrameCallback(
+    std::function<void(const VulkanSwapchain::ReadbackFrame&)> callback, bool hdr) {
+    frame_callback = std::move(callback);
+    hdr_readback = hdr;
+}
+
+void VulkanRenderer::SetFrameExport(VulkanSwapchain::ExportCallback callback, bool hdr,
+                                    u32 image_count) {
+    export_callback = std::move(callback);
+    hdr_readback = hdr;
+    export_image_count = image_count;
+}
+
+void VulkanRenderer::SetVideoEncoding(VulkanVideoEncoder::PacketCallback callback,
+                                      const VulkanVideoEncoder::Settings& settings) {
+    video_packet_callback = std::move(callback);
+    video_settings = settings;
+}
+
+bool VulkanRenderer::IsHeadless() const {
+    return swap_chain->IsHeadless();
+}
+
+void VulkanRenderer::FlushFrames() {
+    if (IsHeadless()) {
+        swap_chain->FlushReadbacks();
+    }
+    if (std::ranges::none_of(offscreen_frames,
+                             [](const auto& frame) { return bool{frame.capture_callback}; })) {
+        return;
+    }
+    device->WaitIdle();
+    // Oldest first
+    std::vector<std::size_t> captured(offscreen_frames.size());
+    std::iota(captured.begin(), captured.end(), 0);
+    std::ranges::sort(captured, {}, [this](std::size_t i) {
+        return offscreen_frames[i].capture.number;
+    });
+    for (const std::size_t frame_idx : captured) {
+        DeliverCapture(frame_idx);
+    }
+}
+
+void VulkanRenderer::CaptureFrame(
+    std::function<void(const VulkanSwapchain::ReadbackFrame&)> callback) {
+    next_capture_callback = std::move(callback);
+}
+
+void VulkanRenderer::DeliverCapture(std::size_t frame_idx) {
+    auto& frame = offscreen_frames[frame_idx];
+    if (!frame.capture_callback) {
+        return;
+    }
+    const auto callback = std::move(frame.capture_callback);
+    frame.capture_callback = {};
+    vmaInvalidateAllocation(frame.capture_buffer->allocator, frame.capture_buffer->allocation, 0,
+                            VK_WHOLE_SIZE);
+    callback(frame.capture);
+}
+
+void VulkanRenderer::SetFrameReadback(bool enabled) {
+    swap_chain->SetReadbackEnabled(enabled);
+}
+
+std::size_t VulkanRenderer::GetNumSubScenes() const {
+    return scene ? scene->sub_scenes.size() : 0;
+}
+
+void VulkanRenderer::SetSubScene(std::size_t index) {
+    if (index >= GetNumSubScenes()) {
+        SPDLOG_ERROR("Sub scene {} out of range", index);
+        throw std::runtime_error("Sub scene out of range");
+    }
+    sub_scene_idx = index;
+}
+
+void VulkanRenderer::ReloadScene(GLTF::Container& gltf) {
+    auto new_snapshot = std::make_unique<GLTFSnapshot>(gltf);
+    auto changes =
+        snapshot ? DiffGLTF(*snapshot, *new_snapshot) : SceneChanges{.resources = true};
+    if (!changes.resources && changes.Any()) {
+        SPDLOG_INFO("Updating materials: {}, transforms: {}", changes.materials,
+                    changes.transforms);
+        device->WaitIdle(); // The GPU copies may still be in use
+        if (UpdateScene(*scene, changes, new_snapshot->gltf, thread_pool.get())) {
+            OnSceneUpdated(changes);
+        } else {
+            SPDLOG_INFO("Merged materials have changed");
+            changes.resources = true;
+        }
+    }
+    if (changes.resources) {
+        SPDLOG_INFO("Loading the whole scene");
+        device->WaitIdle();
+        const std::size_t prev_sub_scene_idx = sub_scene_idx;
+        LoadScene(gltf);
+        if (snapshot && prev_sub_scene_idx < GetNumSubScenes()) {
+            SetSubScene(prev_sub_scene_idx);
+        }
+    }
+    snapshot = std::move(new_snapshot);
+}
+
+void VulkanRenderer::SetAnimationTime(double time) {
+    if (!scene || scene->animations.empty()) {
+        return;
+    }
+    animation_poses.assign(scene->rest_poses.begin(), scene->rest_poses.end());
+    for (const auto& animation : scene->animations) {
+        const double duration = animation->GetDuration();
+        const double animation_time = duration > 0 ? std::fmod(time, duration) : 0;
+        animation->Sample(static_cast<float>(animation_time), animation_poses, thread_pool.get());
+    }
+    animation_transforms.resize(animation_poses.size());
+    const auto ToMatrix = [this](std::size_t i) {
+        animation_transforms[i] = animation_poses[i].ToMatrix();
+    };
+    if (thread_pool && animation_poses.size() >= SubScene::MinParallelSize) {
+        thread_pool->ParallelFor(0, animation_poses.size(), ToMatrix);
+    } else {
+        for (std::size_t i = 0; i < animation_poses.size(); ++i) {
+            ToMatrix(i);
+        }
+    }
+
+    device->WaitIdle(); // The GPU copies may still be in use
+    for (const auto& sub_scene : scene->sub_scenes) {
+        sub_scene->UpdateTransforms(animation_transforms, *scene, thread_pool.get());
+    }
+    // Read with the joints of the skins by the renderers that deform meshes
+    for (std::size_t i = 0; i < scene->node_weights.size(); ++i) {
+        scene->node_weights[i] = std::move(animation_poses[i].weights);
+    }
+    OnSceneUpdated(SceneChanges{.transforms = true});
+}
+
+void VulkanRenderer::SetCameraPath(std::vector<glm::mat4> views) {
+    streaming_prefetcher.SetCameraPath(std::move(views));
+}
+
+const SubScene& VulkanRenderer::GetSubScene() const {
+    return *scene->sub_scenes[sub_scene_idx];
+}
+
+void VulkanRenderer::ShareScene(VulkanRenderer& source) {
+    if (!source.scene) {
+        SPDLOG_ERROR("Source renderer has not loaded a scene");
+        throw std::runtime_error("Source renderer has not loaded a scene");
+    }
+    if (device != source.device) {
+        SPDLOG_ERROR("Scenes can only be shared by renderers sharing the device");
+        throw std::runtime_error("Scenes can only be shared by renderers sharing the device");
+    }
+    // Their state is of the frames in flight of the renderer that loaded the scene
+    if (source.scene->texture_streamer->IsEnabled() ||
+        source.scene->geometry_streamer->IsEnabled() || source.scene->lazy_texture_loader) {
+        SPDLOG_ERROR("Scenes that stream textures or geometry cannot be shared");
+        throw std::runtime_error("Scenes that stream textures or geometry cannot be shared");
+    }
+
+    device->WaitIdle(); // The GPU copies of the previous scene may still be in use
+    scene = source.scene;
+    sub_scene_idx = source.sub_scene_idx;
+    snapshot.reset(); // Reloads of this renderer load the whole scene
+    OnSceneShared();
+}
+
+void VulkanRenderer::OnSceneShared() {
+    SPDLOG_ERROR("Renderer cannot share scenes");
+    throw std::runtime_error("Renderer cannot share scenes");
+}
+
+void VulkanRenderer::StepDefragmentation(bool idle) {
+    if (!defragmenter || !idle) {
+        return;
+    }
+    if (!defragmenter->IsRunning()) {
+        if (num_drawn_frames < next_defragmentation_frame) {
+            return;
+        }
+        next_defragmentation_frame = num_drawn_frames + DefragmentationInterval;
+        if (!defragmenter->Begin()) {
+            return;
+        }
+    }
+    const auto moved = defragmenter->Step();
+    if (!moved.empty()) {
+        OnBuffersMoved(moved);
+    }
+}
+
+void VulkanRenderer::PrefetchStreaming(const glm::mat4& view, const glm::mat4& proj,
+                                       const vk::Extent2D& render_extent) {
+    PROFILE_FUNCTION();
+    streaming_prefetcher.Update(*scene, GetSubScene(), view, proj, render_extent.height);
+}
+
+void VulkanRenderer::OnBuffersMoved(const std::vector<VulkanBuffer*>&) {}
+
+void VulkanRenderer::AddSceneStats(SceneStats&) const {}
+
+void VulkanRenderer::ShareDevice(VulkanRenderer& source) {
+    // The device has the extensions and features of the class that created it, and of its
+    // switch targets
+    if (typeid(*this) != typeid(source) &&
+        std::ranges::find(source.switch_targets, this) == source.switch_targets.end()) {
+        SPDLOG_ERROR("Devices can only be shared by renderers of the same class");
+        throw std::runtime_error("Devices can only be shared by renderers of the same class");
+    }
+    if (!source.device) {
+        SPDLOG_ERROR("Source renderer has not been initialized");
+        throw std::runtime_error("Source renderer has not been initialized");
+    }
+    context = source.context;
+    device = source.device;
+    thread_pool = source.thread_pool;
+}
+
+void VulkanRenderer::AddSwitchTarget(const VulkanRenderer& other) {
+    switch_targets.push_back(&other);
+}
+
+std::unique_ptr<VulkanDevice> VulkanRenderer::CreateDevice(vk::SurfaceKHR surface) const {
+    auto requirements = GetDeviceRequirements();
+    for (const auto* target : switch_targets) {
+        auto target_requirements = target->GetDeviceRequirements();
+        for (const char* extension : target_requirements.extensions) {
+            if (std::ranges::none_of(requirements.extensions, [extension](const char* name) {
+                    return std::string_view{name} == extension;
+                })) {
+                requirements.extensions.push_back(extension);
+            }
+        }
+        requirements.features.Merge(target_requirements.features);
+        requirements.fragment_shading_rate |= target_requirements.fragment_shading_rate;
+    }
+    return std::make_unique<VulkanDevice>(context->instance, surface, requirements.extensions,
+                                          requirements.features, physical_device_index,
+                                          descriptor_buffer, requirements.fragment_shading_rate);
+}
+
+GeometryRequirements VulkanRenderer::GetGeometryRequirements(const VulkanDevice&) const {
+    return {};
+}
+
+GeometryRequirements VulkanRenderer::GetSwitchGeometryRequirements() const {
+    auto requirements = GetGeometryRequirements(*device);
+    for (const auto* target : switch_targets) {
+        requirements |= target->GetGeometryRequirements(*device);
+    }
+    return requirements;
+}
+
 void VulkanRenderer::Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_extent) {
-    device = CreateDevice(surface, actual_extent);
-    swap_chain = std::make_unique<VulkanSwapchain>(*device, actual_extent);
+    if (eye_separation > 0 && !SupportsStereo()) {
+        SPDLOG_WARN("Renderer does not support stereo, rendering the camera alone");
+        eye_separation = 0;
+    }
+    if (device) { // Shared, see ShareDevice
+        if (surface) {
+            shared_device_surface = vk::raii::SurfaceKHR{context->instance, surface};
+            if (!*device->surface || !device->physical_device.getSurfaceSupportKHR(
+                                         device->present_queue_family, surface)) {
+                SPDLOG_ERROR("Shared device cannot present to the surface");
+                throw std::runtime_error("Shared device cannot present to the surface");
+            }
+        }
+        swap_chain_surface = surface;
+    } else {
+        const std::size_t num_threads =
+            num_worker_threads == 0 ? std::thread::hardware_concurrency() : num_worker_threads;
+        if (num_threads > 1) {
+            thread_pool = std::make_shared<Common::ThreadPool>(num_threads);
+        }
+
+        device = CreateDevice(surface);
+        device->allocator->SetPressureCallback(memory_pressure_callback);
+        swap_chain_surface = *device->surface;
+        if (defragmentation) { // VMA defragments one allocator at a time
+            defragmenter = std::make_unique<VulkanDefragmenter>(*device);
+        }
+    }
+    swap_chain = std::make_unique<VulkanSwapchain>(
+        *device, swap_chain_surface, actual_extent, frame_callback, hdr_readback,
+        SupportsFusedPostprocess() && device->storage_image_write_without_format, present_pacing,
+        export_callback, export_image_count);
+    fused_postprocess = swap_chain->storage_images;
+    CreateVideoEncoder();
+    render_target_extent = swap_chain->extent;
 
-    pp_frames = std::make_unique<VulkanFramesInFlight<OffscreenFrame, 2>>(*device);
+    render_target_heap = std::make_unique<VulkanRenderTargetHeap>(*device->allocator);
+    offscreen_frames = std::vector<OffscreenFrame>(num_frames_in_flight);
+    for (auto& frame : offscreen_frames) {
+        frame.image_available_semaphore =
+            vk::raii::Semaphore{**device, vk::SemaphoreCreateInfo{}};
+        frame.render_target_slot = render_target_heap->AddSlot();
+    }
     CreateRenderTargets();
+    frame_timestamp_pool = vk::raii::QueryPool{
+        **device,
+        {
+            .queryType = vk::QueryType::eTimestamp,
+            .queryCount = static_cast<u32>(2 * num_frames_in_flight),
+        }};
+    timestamp_period = device->physical_device.getProperties().limits.timestampPeriod;
+    frame_render_scales.assign(num_frames_in_flight, std::nullopt);
+    if (gpu_profiling) {
+        gpu_profiler = std::make_unique<VulkanProfiler>(*device, num_frames_in_flight);
+    }
 
     pp_render_pass = vk::raii::RenderPass{
         **device,
@@ -55,7 +580,9 @@ void VulkanRenderer::Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_ext
                 .storeOp = vk::AttachmentStoreOp::eStore,
                 .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
                 .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
-                .finalLayout = vk::ImageLayout::ePresentSrcKHR,
+                // Headless frames are then copied out
+                .finalLayout = swap_chain->IsHeadless() ? vk::ImageLayout::eTransferSrcOptimal
+                                                        : vk::ImageLayout::ePresentSrcKHR,
             }},
             .subpassCount = 1,
             .pSubpasses = TempArr<vk::SubpassDescription>{{
@@ -80,25 +607,11 @@ void VulkanRenderer::Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_ext
     swap_chain->CreateFramebuffers(pp_render_pass);
 
     pp_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
-        *device, 2,
+        *device, num_frames_in_flight,
         DescriptorBinding{
             .type = vk::DescriptorType::eCombinedImageSampler,
-            .stages = vk::ShaderStageFlagBits::eFragment,
-            .value =
-                DescriptorBinding::CombinedImageSamplersValue{
-                    {
-                        .images = {{
-                            .image = *pp_frames->frames_in_flight[0].extras.image_view,
-                            .layout = vk::ImageLayout::eGeneral,
-                        }},
-                    },
-                    {
-                        .images = {{
-                            .image = *pp_frames->frames_in_flight[1].extras.image_view,
-                            .layout = vk::ImageLayout::eGeneral,
-                        }},
-                    },
-                },
+            .stages = vk::ShaderStageFlagBits::eFragment | vk::ShaderStageFlagBits::eCompute,
+            .value = DescriptorBinding::CombinedImageSamplersValue{GetOffscreenImages()},
         });
     pp_pipeline = std::make_unique<VulkanGraphicsPipeline>(
         *device,
@@ -107,12 +620,12 @@ void VulkanRenderer::Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_ext
             .pStages = TempArr<vk::PipelineShaderStageCreateInfo>{{
                 {
                     .stage = vk::ShaderStageFlagBits::eVertex,
-                    .module = *VulkanShader{**device, u8"core/shaders/postprocessing.vert"},
+                    .module = *VulkanShader{*device, u8"core/shaders/postprocessing.vert"},
                     .pName = "main",
                 },
                 {
                     .stage = vk::ShaderStageFlagBits::eFragment,
-                    .module = *VulkanShader{**device, u8"core/shaders/postprocessing.frag"},
+                    .module = *VulkanShader{*device, u8"core/shaders/postprocessing.frag"},
                     .pName = "main",
                 },
             }},
@@ -125,38 +638,110 @@ void VulkanRenderer::Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_ext
         vk::PipelineLayoutCreateInfo{
             .setLayoutCount = 1,
             .pSetLayouts = &*pp_descriptor_sets->descriptor_set_layout,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                PushConstant<GLSL::PostprocessPushConstant>(vk::ShaderStageFlagBits::eFragment),
+            }},
         });
+
+    if (fused_postprocess) {
+        CreatePostprocessOutputs();
+        pp_compute_pipeline = std::make_unique<VulkanComputePipeline>(
+            *device,
+            vk::PipelineShaderStageCreateInfo{
+                .stage = vk::ShaderStageFlagBits::eCompute,
+                .module = *VulkanShader{*device, u8"core/shaders/postprocessing.comp"},
+                .pName = "main",
+            },
+            vk::PipelineLayoutCreateInfo{
+                .setLayoutCount = 2,
+                .pSetLayouts = TempArr<vk::DescriptorSetLayout>{{
+                    *pp_descriptor_sets->descriptor_set_layout,
+                    *pp_output_descriptor_sets->descriptor_set_layout,
+                }},
+                .pushConstantRangeCount = 1,
+                .pPushConstantRanges = TempArr<vk::PushConstantRange>{{
+                    PushConstant<GLSL::PostprocessPushConstant>(vk::ShaderStageFlagBits::eCompute),
+                }},
+            });
+    }
+}
+
+void VulkanRenderer::CreateVideoEncoder() {
+    if (!video_packet_callback || !swap_chain->IsHeadless()) {
+        return;
+    }
+    try {
+        swap_chain->SetVideoEncoder(std::make_unique<VulkanVideoEncoder>(
+            *device, *swap_chain, video_settings, video_packet_callback));
+    } catch (const std::exception& e) {
+        SPDLOG_WARN("Frames will not be encoded: {}", e.what());
+    }
+}
+
+void VulkanRenderer::CreatePostprocessOutputs() {
+    // Recreated with the swapchain, whose number of images may change. The set layouts are
+    // identically defined, so the pipeline layout stays compatible.
+    if (pp_output_descriptor_sets) {
+        Retire(std::move(pp_output_descriptor_sets));
+    }
+    std::vector<DescriptorBinding::CombinedImageSamplers> images;
+    for (const auto& image_view : swap_chain->image_views) {
+        images.push_back({.images = {{
+                              .image = *image_view,
+                              .layout = vk::ImageLayout::eGeneral,
+                          }}});
+    }
+    pp_output_descriptor_sets = std::make_unique<VulkanDescriptorSets>(
+        *device, images.size(),
+        DescriptorBinding{
+            .type = vk::DescriptorType::eStorageImage,
+            .stages = vk::ShaderStageFlagBits::eCompute,
+            .value = DescriptorBinding::CombinedImageSamplersValue{images},
+        });
+}
+
+// The frames read back as hdr are only upscaled
+static GLSL::PostprocessPushConstant GetPostprocessPushConstant(
+    const VulkanSwapchain& swap_chain, bool hdr_readback, float exposure, bool tonemapping,
+    const vk::Extent2D& render_extent, const vk::Extent2D& display_extent) {
+    const bool hdr = hdr_readback && swap_chain.IsHeadless();
+    return {
+        .render_extent = {render_extent.width, render_extent.height},
+        .display_extent = {display_extent.width, display_extent.height},
+        .sharpness = render_extent == display_extent ? 0.0f : UpscalingSharpness,
+        .exposure = hdr ? 1.0f : std::exp2(exposure),
+        .tonemap = !hdr && tonemapping,
+        .dither = !hdr,
+        .encode_srgb = swap_chain.encode_srgb,
+    };
 }
 
 void VulkanRenderer::CreateRenderTargets() {
     Helpers::OneTimeCommandContext cmd_context{*device};
 
     const auto& info = GetOffscreenImageInfo();
-    for (auto& frame_in_flight : pp_frames->frames_in_flight) {
-        auto& frame = frame_in_flight.extras;
-
-        frame.render_start_semaphore = vk::raii::Semaphore{**device, vk::SemaphoreCreateInfo{}};
-
+    for (auto& frame : offscreen_frames) {
+        // Released first, so that the new one can take over its memory
+        frame.image_view = nullptr;
+        frame.image.reset();
         frame.image = std::make_unique<VulkanImage>(
-            *device->allocator,
+            *render_target_heap, frame.render_target_slot,
             vk::ImageCreateInfo{
                 .imageType = vk::ImageType::e2D,
                 .format = info.format,
                 .extent =
                     {
-                        .width = swap_chain->extent.width,
-                        .height = swap_chain->extent.height,
+                        .width = render_target_extent.width,
+                        .height = render_target_extent.height,
                         .depth = 1,
                     },
                 .mipLevels = 1,
                 .arrayLayers = 1,
-                .usage = info.usage | vk::ImageUsageFlagBits::eSampled,
+                // Copied out by CaptureFrame
+                .usage = info.usage | vk::ImageUsageFlagBits::eSampled |
+                         vk::ImageUsageFlagBits::eTransferSrc,
                 .initialLayout = vk::ImageLayout::eUndefined,
-            },
-            VmaAllocationCreateInfo{
-                .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
-                .usage = VMA_MEMORY_USAGE_AUTO,
-                .priority = 1.0f,
             });
 
         Helpers::ImageLayoutTransition(
@@ -195,84 +780,298 @@ void VulkanRenderer::CreateRenderTargets() {
                                         },
                                 }};
     }
+    offscreen_frames[0].image->LogCompression("Offscreen image");
+}
+
+bool VulkanRenderer::SupportsFusedPostprocess() const {
+    return false;
 }
 
-void VulkanRenderer::PostprocessAndPresent(vk::Semaphore offscreen_render_finished_semaphore) {
-    const auto& frame = pp_frames->AcquireNextFrame();
+bool VulkanRenderer::SupportsStereo() const {
+    return false;
+}
+
+// Of the formats of the offscreen images of the derived classes
+static std::size_t GetTexelSize(vk::Format format) {
+    switch (format) {
+    case vk::Format::eR32G32B32A32Sfloat:
+        return 16;
+    case vk::Format::eR16G16B16A16Sfloat:
+        return 8;
+    default: // 8-bit RGBA or BGRA, like the surface formats
+        return 4;
+    }
+}
 
-    const auto& framebuffer = swap_chain->AcquireImage(*frame.extras.render_start_semaphore);
+void VulkanRenderer::RecordCapture(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                                   const vk::Extent2D& render_extent,
+                                   vk::PipelineStageFlags2 src_stages,
+                                   vk::AccessFlags2 src_access) {
+    auto& frame = offscreen_frames[frame_idx];
+    const auto format = GetOffscreenImageInfo().format;
+    const vk::DeviceSize size =
+        vk::DeviceSize{render_extent.width} * render_extent.height * GetTexelSize(format);
+    if (!frame.capture_buffer || frame.capture_buffer->size < size) {
+        frame.capture_buffer = std::make_unique<VulkanBuffer>(
+            *device->allocator,
+            vk::BufferCreateInfo{
+                .size = size,
+                .usage = vk::BufferUsageFlagBits::eTransferDst,
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_AUTO,
+            },
+            MemoryCategory::Scratch);
+        frame.capture_buffer->SetName("frame capture");
+    }
+
+    // The offscreen images stay in the General layout, which copies can read
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = src_stages,
+            .srcAccessMask = src_access,
+            .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+        }}},
+    });
+    cmd.copyImageToBuffer(**frame.image, vk::ImageLayout::eGeneral, **frame.capture_buffer,
+                          {{
+                              .imageSubresource =
+                                  {
+                                      .aspectMask = vk::ImageAspectFlagBits::eColor,
+                                      .mipLevel = 0,
+                                      .baseArrayLayer = 0,
+                                      .layerCount = 1,
+                                  },
+                              .imageExtent = {render_extent.width, render_extent.height, 1},
+                          }});
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+            .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+            .dstStageMask = vk::PipelineStageFlagBits2::eHost,
+            .dstAccessMask = vk::AccessFlagBits2::eHostRead,
+        }}},
+    });
+
+    frame.capture_callback = std::move(next_capture_callback);
+    next_capture_callback = {};
+    frame.capture = {
+        .number = num_drawn_frames,
+        .extent = render_extent,
+        .format = format,
+        .pixels = {static_cast<const u8*>(frame.capture_buffer->allocation_info.pMappedData),
+                   static_cast<std::size_t>(size)},
+    };
+}
+
+std::optional<vk::SemaphoreSubmitInfo> VulkanRenderer::RecordPostprocess(
+    const vk::raii::CommandBuffer& cmd, std::size_t frame_idx, const vk::Extent2D& render_extent,
+    const vk::Extent2D& display_extent, vk::PipelineStageFlags2 src_stages,
+    vk::AccessFlags2 src_access) {
+    PROFILE_FUNCTION();
+
+    // Waited for by the previous submission of the frame in flight, which has completed
+    const auto& image_available_semaphore = offscreen_frames[frame_idx].image_available_semaphore;
+    DeliverCapture(frame_idx);
+    const auto& framebuffer = swap_chain->AcquireImage(*image_available_semaphore);
     if (!framebuffer.has_value()) {
-        throw std::runtime_error("Failed to acquire image, ignoring");
-    }
-
-    pp_frames->BeginFrame();
-
-    const auto& cmd = frame.command_buffer;
-    pp_pipeline->BeginRenderPass(
-        cmd, {
-                 .framebuffer = *framebuffer->get(),
-                 .renderArea =
-                     {
-                         .extent = swap_chain->extent,
-                     },
-                 .clearValueCount = 1,
-                 .pClearValues = TempArr<vk::ClearValue>{{.color = {{{0.0f, 0.0f, 0.0f, 0.0f}}}}},
-             });
-    cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, **pp_pipeline);
-    cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *pp_pipeline->pipeline_layout, 0,
-                           pp_descriptor_sets->descriptor_sets[frame.idx], {});
-    cmd.draw(3, 1, 0, 0);
-    pp_pipeline->EndRenderPass(cmd);
-
-    pp_frames->EndFrame();
-
-    device->graphics_queue.submit(
-        {
+        return std::nullopt;
+    }
+    if (next_capture_callback) {
+        RecordCapture(cmd, frame_idx, render_extent, src_stages, src_access);
+    }
+    const u32 image_idx = swap_chain->current_image_index;
+    const vk::ImageSubresourceRange subresource_range{
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+    const bool headless = swap_chain->IsHeadless();
+    const auto push_constant = GetPostprocessPushConstant(*swap_chain, hdr_readback, exposure,
+                                                          tonemapping, render_extent,
+                                                          display_extent);
+
+    const VulkanProfiler::Scope profile_scope{gpu_profiler.get(), cmd, frame_idx, "Postprocess"};
+    if (!fused_postprocess) {
+        // The render pass waits for the image to be acquired at the color attachment output
+        cmd.pipelineBarrier2({
+            .memoryBarrierCount = 1,
+            .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+                .srcStageMask = src_stages,
+                .srcAccessMask = src_access,
+                .dstStageMask = vk::PipelineStageFlagBits2::eFragmentShader,
+                .dstAccessMask = vk::AccessFlagBits2::eShaderSampledRead,
+            }}},
+        });
+        pp_pipeline->BeginRenderPass(
+            cmd,
             {
-                .waitSemaphoreCount = 2,
-                .pWaitSemaphores = TempArr<vk::Semaphore>{offscreen_render_finished_semaphore,
-                                                          *frame.extras.render_start_semaphore},
-                .pWaitDstStageMask =
-                    TempArr<vk::PipelineStageFlags>{
-                        vk::PipelineStageFlagBits::eFragmentShader,
-                        vk::PipelineStageFlagBits::eColorAttachmentOutput},
-                .commandBufferCount = 1,
-                .pCommandBuffers = TempArr<vk::CommandBuffer>{*frame.command_buffer},
-                .signalSemaphoreCount = 1,
-                .pSignalSemaphores = TempArr<vk::Semaphore>{*frame.render_finished_semaphore},
-            },
-        },
-        *frame.in_flight_fence);
+                .framebuffer = *framebuffer->get(),
+                .renderArea =
+                    {
+                        .extent = swap_chain->extent,
+                    },
+                .clearValueCount = 1,
+                .pClearValues = TempArr<vk::ClearValue>{{.color = {{{0.0f, 0.0f, 0.0f, 0.0f}}}}},
+            });
+        cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, **pp_pipeline);
+        VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eGraphics,
+                                   *pp_pipeline->pipeline_layout, 0,
+                                   {{*pp_descriptor_sets, frame_idx}});
+        cmd.pushConstants<GLSL::PostprocessPushConstant>(
+            *pp_pipeline->pipeline_layout, vk::ShaderStageFlagBits::eFragment, 0, {push_constant});
+        cmd.draw(3, 1, 0, 0);
+        pp_pipeline->EndRenderPass(cmd);
+
+        // Headless images are not acquired from a presentation engine, so there is nothing to
+        // wait
+        return vk::SemaphoreSubmitInfo{
+            .semaphore = headless ? vk::Semaphore{} : *image_available_semaphore,
+            .stageMask = vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+        };
+    }
+
+    // The previous contents of the swapchain image are discarded. Its layout transition waits
+    // at the stage the semaphore is waited at.
+    cmd.pipelineBarrier2({
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = TempArr<vk::MemoryBarrier2>{{{
+            .srcStageMask = src_stages,
+            .srcAccessMask = src_access,
+            .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderSampledRead,
+        }}},
+        .imageMemoryBarrierCount = 1,
+        .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask = vk::AccessFlags2{},
+            .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .oldLayout = vk::ImageLayout::eUndefined,
+            .newLayout = vk::ImageLayout::eGeneral,
+            .image = swap_chain->images[image_idx],
+            .subresourceRange = subresource_range,
+        }}},
+    });
 
-    swap_chain->Present(*frame.render_finished_semaphore);
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, **pp_compute_pipeline);
+    VulkanDescriptorSets::Bind(cmd, vk::PipelineBindPoint::eCompute,
+                               *pp_compute_pipeline->pipeline_layout, 0,
+                               {
+                                   {*pp_descriptor_sets, frame_idx},
+                                   {*pp_output_descriptor_sets, image_idx},
+                               });
+    cmd.pushConstants<GLSL::PostprocessPushConstant>(
+        *pp_compute_pipeline->pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+        {push_constant});
+    cmd.dispatch((swap_chain->extent.width + 7) / 8, (swap_chain->extent.height + 7) / 8, 1);
+
+    // Headless frames are then copied out
+    cmd.pipelineBarrier2({
+        .imageMemoryBarrierCount = 1,
+        .pImageMemoryBarriers = TempArr<vk::ImageMemoryBarrier2>{{{
+            .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+            .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+            .dstStageMask =
+                headless ? vk::PipelineStageFlagBits2::eCopy : vk::PipelineStageFlagBits2::eNone,
+            .dstAccessMask =
+                headless ? vk::AccessFlagBits2::eTransferRead : vk::AccessFlags2{},
+            .oldLayout = vk::ImageLayout::eGeneral,
+            .newLayout =
+                headless ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR,
+            .image = swap_chain->images[image_idx],
+            .subresourceRange = subresource_range,
+        }}},
+    });
+    return vk::SemaphoreSubmitInfo{
+        .semaphore = headless ? vk::Semaphore{} : *image_available_semaphore,
+        .stageMask = vk::PipelineStageFlagBits2::eComputeShader,
+    };
 }
 
-void VulkanRenderer::OnResized(const vk::Extent2D& actual_extent) {
-    (*device)->waitIdle();
+std::vector<DescriptorBinding::CombinedImageSamplers> VulkanRenderer::GetOffscreenImages() const {
+    std::vector<DescriptorBinding::CombinedImageSamplers> images;
+    for (const auto& frame : offscreen_frames) {
+        images.push_back({.images = {{
+                              .image = *frame.image_view,
+                              .layout = vk::ImageLayout::eGeneral,
+                          }}});
+    }
+    return images;
+}
 
-    swap_chain.reset(); // Need to destroy old first
-    swap_chain = std::make_unique<VulkanSwapchain>(*device, actual_extent);
+// Of the render targets for the swapchain extent: kept while it fits and is not much smaller,
+// grown with a margin otherwise so that the next small steps fit too
+static vk::Extent2D FitRenderTargetExtent(const vk::Extent2D& current, const vk::Extent2D& extent,
+                                          u32 max_dimension) {
+    static constexpr u32 MarginDivisor = 8; // Of the dimensions
+    static constexpr u32 Alignment = 64;
+    static constexpr u64 ShrinkRatio = 2; // Of the areas
+    const bool fits = extent.width <= current.width && extent.height <= current.height;
+    if (fits && u64{extent.width} * extent.height * ShrinkRatio >=
+                    u64{current.width} * current.height) {
+        return current;
+    }
+    const auto Grow = [max_dimension](u32 size) {
+        return std::min(Common::AlignUp(size + size / MarginDivisor, Alignment),
+                        std::max(max_dimension, size));
+    };
+    return {Grow(extent.width), Grow(extent.height)};
+}
+
+void VulkanRenderer::ReleaseSwapchain() {
+    if (IsHeadless()) {
+        return;
+    }
+    FlushFrames();
+    device->WaitIdle();
+    // OnResized hands over from the null swapchain left
+    swap_chain->framebuffers.clear();
+    swap_chain->image_views.clear();
+    swap_chain->swap_chain = nullptr;
+}
+
+void VulkanRenderer::OnResized(const vk::Extent2D& actual_extent) {
+    // The old swapchain hands over to the new one, and is retired for the frames in flight that
+    // may still use it instead of waiting for the device to be idle
+    FlushFrames();
+    auto old_swap_chain = std::move(swap_chain);
+    swap_chain = std::make_unique<VulkanSwapchain>(
+        *device, swap_chain_surface, actual_extent, frame_callback, hdr_readback,
+        fused_postprocess, present_pacing, export_callback, export_image_count,
+        *old_swap_chain->swap_chain);
+    Retire(std::move(old_swap_chain));
     swap_chain->CreateFramebuffers(pp_render_pass);
+    CreateVideoEncoder();
+    fused_postprocess = swap_chain->storage_images;
+    if (fused_postprocess) {
+        CreatePostprocessOutputs();
+    }
 
+    const auto extent =
+        FitRenderTargetExtent(render_target_extent, swap_chain->extent,
+                              device->physical_device.getProperties().limits.maxImageDimension2D);
+    render_targets_resized = extent != render_target_extent;
+    if (!render_targets_resized) {
+        return;
+    }
+    // The descriptors of the render targets are rewritten, which the frames in flight must not
+    // use anymore. Only they are waited for, not the other queues.
+    device->WaitQueueIdle(device->graphics_queue);
+    render_target_extent = extent;
     CreateRenderTargets();
     pp_descriptor_sets->UpdateDescriptor(
-        0, DescriptorBinding::CombinedImageSamplersValue{
-               {
-                   .images = {{
-                       .image = *pp_frames->frames_in_flight[0].extras.image_view,
-                       .layout = vk::ImageLayout::eGeneral,
-                   }},
-               },
-               {
-                   .images = {{
-                       .image = *pp_frames->frames_in_flight[1].extras.image_view,
-                       .layout = vk::ImageLayout::eGeneral,
-                   }},
-               },
-           });
-}
-
-vk::Extent2D VulkanRenderer::GetRenderExtent(double camera_aspect_ratio) const {
+        0, DescriptorBinding::CombinedImageSamplersValue{GetOffscreenImages()});
+}
+
+vk::Extent2D VulkanRenderer::GetDisplayExtent(double camera_aspect_ratio) const {
     vk::Extent2D render_extent = swap_chain->extent;
     const double viewport_aspect_ratio =
         static_cast<double>(swap_chain->extent.width) / swap_chain->extent.height;
@@ -285,4 +1084,105 @@ vk::Extent2D VulkanRenderer::GetRenderExtent(double camera_aspect_ratio) const {
     return render_extent;
 }
 
+vk::Extent2D VulkanRenderer::GetRenderExtent(double camera_aspect_ratio, bool scaled) const {
+    const auto display_extent = GetDisplayExtent(camera_aspect_ratio);
+    const double scale = scaled ? GetRenderScale() : 1;
+    if (scale == 1) {
+        return display_extent;
+    }
+    return {
+        std::max(static_cast<u32>(display_extent.width * scale), 1u),
+        std::max(static_cast<u32>(display_extent.height * scale), 1u),
+    };
+}
+
+vk::Extent2D VulkanRenderer::GetViewExtent(const vk::Extent2D& render_extent) const {
+    if (GetNumViews() == 1) {
+        return render_extent;
+    }
+    return {std::max(render_extent.width / 2, 1u), render_extent.height};
+}
+
+glm::mat4 VulkanRenderer::GetEyeView(const glm::mat4& view, u32 index) const {
+    if (GetNumViews() == 1) {
+        return view;
+    }
+    // Moving the eye to the left moves the scene to the right of it
+    glm::mat4 eye_view = view;
+    eye_view[3][0] += (index == 0 ? 0.5f : -0.5f) * eye_separation;
+    return eye_view;
+}
+
+double VulkanRenderer::GetRenderScale() const {
+    // So that small changes do not change the extent of every frame, which renderers may have
+    // recorded commands for
+    static constexpr double ScaleSteps = 16;
+    if (target_frame_time <= 0) {
+        return 1;
+    }
+    return std::clamp(std::round(render_scale * ScaleSteps) / ScaleSteps, min_render_scale, 1.0);
+}
+
+// Frames that may still fill what is kept across frames, e.g. the capacities of vectors
+static constexpr u64 WarmUpFrames = 8;
+
+VulkanRenderer::FrameScope::FrameScope(VulkanRenderer& renderer_)
+    : renderer(renderer_), allocation_count(Common::GetAllocationCount()) {
+    renderer.frame_arena.Reset();
+}
+
+VulkanRenderer::FrameScope::~FrameScope() {
+    const u64 frame = renderer.num_drawn_frames++;
+    // Drawing a frame has waited for the one num_frames_in_flight before it to complete
+    std::erase_if(renderer.retired_resources, [this](const RetiredResource& retired) {
+        return renderer.num_drawn_frames >= retired.frame + renderer.num_frames_in_flight;
+    });
+    renderer.device->deletion_queue->Collect();
+    const u64 allocations = Common::GetAllocationCount() - allocation_count;
+    if (allocations > 0 && frame >= WarmUpFrames) {
+        SPDLOG_WARN("Frame {} made {} heap allocations", frame, allocations);
+    }
+}
+
+void VulkanRenderer::BeginFrameTimer(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                                     double render_scale_) {
+    const auto first_query = static_cast<u32>(frame_idx * 2);
+    cmd.resetQueryPool(*frame_timestamp_pool, first_query, 2);
+    cmd.writeTimestamp2(vk::PipelineStageFlagBits2::eNone, *frame_timestamp_pool, first_query);
+    frame_render_scales[frame_idx] = render_scale_;
+}
+
+void VulkanRenderer::EndFrameTimer(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                                   vk::PipelineStageFlags2 stages) {
+    cmd.writeTimestamp2(stages, *frame_timestamp_pool, static_cast<u32>(frame_idx * 2 + 1));
+}
+
+std::optional<VulkanRenderer::FrameTime> VulkanRenderer::GetFrameTime(
+    std::size_t frame_idx) const {
+    if (!frame_render_scales[frame_idx]) {
+        return std::nullopt;
+    }
+    // Into a single value rather than a vector, which would allocate
+    const auto [result, timestamps] = frame_timestamp_pool.getResult<std::array<u64, 2>>(
+        static_cast<u32>(frame_idx * 2), 2, sizeof(u64), vk::QueryResultFlagBits::e64);
+    if (result != vk::Result::eSuccess) {
+        return std::nullopt;
+    }
+    return FrameTime{
+        .milliseconds = (timestamps[1] - timestamps[0]) * timestamp_period / 1e6,
+        .render_scale = *frame_render_scales[frame_idx],
+    };
+}
+
+void VulkanRenderer::UpdateRenderScale(const FrameTime& time) {
+    if (target_frame_time <= 0 || time.milliseconds <= 0) {
+        return;
+    }
+    // The time is about proportional to the pixels, the square of the scale. Damped, so that
+    // noisy timings do not make the resolution oscillate.
+    const double ideal_scale = time.render_scale * std::sqrt(target_frame_time / time.milliseconds);
+    render_scale =
+        std::clamp(render_scale + (ideal_scale - render_scale) * 0.5, min_render_scale, 1.0);
+}
+
 } // namespace Renderer
@@ -4,11 +4,25 @@
 
 #pragma once
 
+#include <filesystem>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <utility>
 #include <vector>
+#include <glm/glm.hpp>
 #include <vulkan/vulkan_raii.hpp>
 #include "common/common_types.h"
+#include "common/frame_arena.h"
+#include "core/streaming_prefetcher.h"
+#include "core/vulkan/vulkan_descriptor_sets.h"
+#include "core/vulkan/vulkan_helpers.hpp"
+#include "core/vulkan/vulkan_swapchain.h"
+#include "core/vulkan/vulkan_video_encoder.h"
+
+namespace Common {
+class ThreadPool;
+}
 
 namespace GLTF {
 class Container;
@@ -16,17 +30,27 @@ class Container;
 
 namespace Renderer {
 
+enum class MemoryCategory;
+struct HostMemoryUsage;
+struct MemoryUsage;
+struct SceneStats;
+class VulkanBuffer;
 class VulkanContext;
+class VulkanDefragmenter;
 class VulkanDevice;
 class VulkanImage;
+class VulkanComputePipeline;
 class VulkanGraphicsPipeline;
-class VulkanSwapchain;
-class VulkanDescriptorSets;
-template <typename ExtraData, std::size_t NumFramesInFlight>
-class VulkanFramesInFlight;
+class VulkanProfiler;
+class VulkanRenderTargetHeap;
 
 class Camera;
+class GLTFSnapshot;
+struct GeometryRequirements;
+struct NodePose;
+class SubScene;
 struct Scene;
+struct SceneChanges;
 
 /**
  * Base class for Vulkan based renderers.
@@ -42,10 +66,195 @@ public:
     vk::raii::Instance& GetVulkanInstance();
     const vk::raii::Instance& GetVulkanInstance() const;
 
+    // Number of worker threads used while loading scenes. 0 means one per hardware thread,
+    // 1 disables parallel loading. Must be called before Init.
+    void SetWorkerThreads(std::size_t num_threads);
+    // Whether to block compress textures while loading scenes. Must be called before LoadScene.
+    void SetTextureCompression(bool enabled);
+    // Device memory for streaming texture levels in bytes, 0 to upload every level up front.
+    // Must be called before LoadScene.
+    void SetTextureBudget(std::size_t budget);
+    // Host memory for keeping the streamed texture levels and geometry in bytes, so that those
+    // evicted from device memory are uploaded again from it rather than read from their source.
+    // 0 (default) disables it. Must be called before LoadScene.
+    void SetHostCacheBudget(std::size_t budget);
+    // Loads the textures at a lower resolution: dropping their finest levels, those larger than
+    // max_size on either side (0 for no limit) and then those over budget bytes of device memory
+    // (0 for no limit), see TextureQuality. Must be called before LoadScene.
+    void SetTextureQuality(u32 max_size, u32 dropped_levels = 0, std::size_t budget = 0);
+    // Whether to load images in the background after the rest of the scene, rendering with
+    // placeholders until then. Must be called before LoadScene.
+    void SetLazyTextures(bool enabled);
+    // Whether to reorder the triangles of the scenes for the post-transform vertex cache while
+    // loading them, see SceneLoader. Must be called before LoadScene.
+    void SetIndexOptimization(bool enabled);
+    // Whether to sort the triangles and instances of the scenes along a space filling curve
+    // while loading them, for the coherence of ray tracing, see SceneLoader. Must be called
+    // before LoadScene.
+    void SetSpatialReordering(bool enabled);
+    // Whether to store the vertices generated while loading scenes (e.g. with tangents) as packed
+    // attributes, see SceneLoader. Must be called before LoadScene.
+    void SetVertexPacking(bool enabled);
+    // Generates the tangents of primitives of at least this many triangles on the GPU rather
+    // than with MikkTSpace, 0 (default) for none, see SceneLoader. Must be called before
+    // LoadScene.
+    void SetGPUTangentThreshold(std::size_t triangles);
+    // Finishes decoding the JPEG images of uncompressed textures that are not streamed on the
+    // GPU, see SceneLoader. Must be called before LoadScene.
+    void SetGPUImageDecode(bool enabled);
+    // Renders at a lower resolution while rendering a frame takes longer than this many
+    // milliseconds on the GPU, down to the minimum scale of each dimension, and upscales the
+    // frames to the viewport. 0 always renders at the resolution of the viewport.
+    void SetDynamicResolution(double target_milliseconds, double min_scale = 0.5);
+    // Measures the GPU time of the passes of each frame, see VulkanProfiler. Must be called
+    // before Init.
+    void SetGPUProfiling(bool enabled);
+    // Frames that may be recorded while the GPU is still rendering earlier ones (default 2).
+    // More frames keep the GPU busier, at the cost of latency and memory. Must be called before
+    // Init.
+    void SetFramesInFlight(std::size_t count);
+    // Scales the linear values of the frames by 2 to the power of stops before presenting them.
+    // Not applied to frames read back as hdr.
+    void SetExposure(float stops);
+    // Whether to tonemap the frames with a fit of the ACES curve rather than clamping them. Not
+    // applied to frames read back as hdr, which are not dithered either.
+    void SetTonemapping(bool enabled);
+    // Renders both eyes of a stereo pair into each frame, side by side with the left one on the
+    // left, from either side of the camera this far apart along its X axis (in scene units),
+    // e.g. for headsets and displays taking side by side frames. 0 (default) renders the camera
+    // alone. Renderers that cannot render stereo pairs render the camera alone. Must be called
+    // before Init.
+    void SetStereo(float eye_separation);
+    // Null unless GPU profiling is enabled
+    const VulkanProfiler* GetGPUProfiler() const;
+    VulkanProfiler* GetGPUProfiler();
+    // How frames are presented, see VulkanSwapchain::Pacing. Must be called before Init.
+    void SetPresentPacing(VulkanSwapchain::Pacing pacing);
+    // Called before sampling the input of each frame, which it may wait for with low latency
+    // pacing.
+    void WaitForFrameStart();
+    // Milliseconds from WaitForFrameStart to the display of the frames, averaged. Empty if it
+    // cannot be measured.
+    std::optional<double> GetPresentLatency() const;
+
+    // Called when a device allocation does not fit in the memory budget, to release memory
+    // instead, see VulkanAllocator. Must be called before Init.
+    void SetMemoryPressureCallback(std::function<bool(MemoryCategory, vk::DeviceSize)> callback);
+    // Device memory allocated per category, and used against the budget. Thread safe.
+    MemoryUsage GetMemoryUsage() const;
+    // Writes the usage per category, their peaks and the statistics of VMA as JSON, see
+    // VulkanAllocator::GetReport. Thread safe.
+    bool WriteMemoryReport(const std::filesystem::path& path) const;
+    // Host memory held for rendering the loaded scene, and resident in the whole process
+    HostMemoryUsage GetHostMemoryUsage() const;
+    // Releases what the loaded scene only needed while loading, and returns the free memory of
+    // the heap to the system, e.g. for hosts running several instances. Call once the container
+    // passed to LoadScene has been destroyed, as it is not needed for rendering. Logs the usage.
+    void TrimHostMemory();
+    // Complexity of the loaded scene and the current sub scene, with the acceleration structures
+    // built for it so far, see SceneStats
+    SceneStats GetSceneStats() const;
+    // Writes them as JSON, see GetSceneStatsJSON, and logs a summary
+    bool WriteSceneStats(const std::filesystem::path& path) const;
+
+    // Whether to compact device memory on idle frames once it is fragmented, e.g. after loading,
+    // moving the buffers derived classes mark movable, see VulkanDefragmenter. Renderers sharing
+    // the device of another do not. Must be called before Init.
+    void SetDefragmentation(bool enabled);
+
+    // Uses the physical device at this index (in enumeration order) instead of picking one,
+    // e.g. to drive several GPUs with a renderer each. Must be called before Init.
+    void SetPhysicalDevice(std::size_t index);
+    // Writes descriptors into a descriptor buffer (VK_EXT_descriptor_buffer) where supported,
+    // instead of allocating descriptor sets from pools. Must be called before Init.
+    void SetDescriptorBuffer(bool enabled);
+    // Called with headless frames once they have been read back, see VulkanSwapchain. If hdr is
+    // set, they are read back as linear RGBA32F rather than sRGB encoded RGBA8, e.g. to merge
+    // them. Must be called before Init.
+    void SetFrameCallback(std::function<void(const VulkanSwapchain::ReadbackFrame&)> callback,
+                          bool hdr = false);
+    // Exports headless frames to other processes instead of reading them back, writing them
+    // into a ring of image_count images shared without copies, see VulkanSwapchain. The callback
+    // is called with the handles of the images whenever they are created, at Init and on
+    // resizes. hdr is as in SetFrameCallback. Frames are read back as before where exporting is
+    // unsupported. Must be called before Init.
+    void SetFrameExport(VulkanSwapchain::ExportCallback callback, bool hdr = false,
+                        u32 image_count = VulkanSwapchain::HeadlessImageCount);
+    // Encodes headless frames to H.264 on the GPU, calling the callback with the bitstream of
+    // each frame, see VulkanVideoEncoder. Frames are still read back or exported as set. Frames
+    // are not encoded where the device cannot encode them. Must be called before Init.
+    void SetVideoEncoding(VulkanVideoEncoder::PacketCallback callback,
+                          const VulkanVideoEncoder::Settings& settings = {});
+    // Renders with the device (and worker threads) of another renderer of the same class instead
+    // of creating its own, e.g. to draw several views of one scene, see ShareScene. Its instance
+    // replaces that of this renderer, so surfaces must be created from the source's instance,
+    // and its device must have a surface for this one to present to one. Both must be used from
+    // the same thread. The source must have been initialized, and this must be called before
+    // Init.
+    void ShareDevice(VulkanRenderer& source);
+    // Creates the device with the extensions and features of the other renderer (of any class)
+    // as well, and loads the geometry of scenes for it too, so that it can share the device and
+    // the scenes of this one (see ShareDevice and ShareScene), e.g. to switch between
+    // rasterizing and path tracing a scene without loading it again. Only the device and scene
+    // settings of the other renderer are read, which must be set before this is called. Must be
+    // called before Init.
+    void AddSwitchTarget(const VulkanRenderer& other);
+    // A null surface renders headless: frames are postprocessed into offscreen images and read
+    // back into host memory instead of being presented.
     virtual void Init(vk::SurfaceKHR surface, const vk::Extent2D& actual_extent);
+    bool IsHeadless() const;
+    // Delivers the headless frames whose readbacks are still in flight, e.g. before exiting.
+    void FlushFrames();
+    // Whether the following headless frames are read back, see VulkanSwapchain.
+    void SetFrameReadback(bool enabled);
+    // Reads the offscreen image of the next frame drawn back into host memory, as it is before
+    // postprocessing: linear, at the render extent, in the format of the derived class. Also
+    // with a surface, e.g. to save frames while presenting them. The copy is recorded into the
+    // frame, and the callback is called once the frame in flight is next drawn (or by
+    // FlushFrames), whose submission has completed by then, so that drawing does not wait.
+    void CaptureFrame(std::function<void(const VulkanSwapchain::ReadbackFrame&)> callback);
     virtual void LoadScene(GLTF::Container& gltf) = 0;
+    // Renders the scene the source has loaded instead of loading one: its geometry and textures
+    // are shared, while the render targets, frames and GPU copies of the sub scene are of this
+    // renderer, which starts on the sub scene of the source. The source must share the device
+    // of this renderer (see ShareDevice), and stream neither textures nor geometry, nor load
+    // textures lazily. Later reloads and animations of either are not seen by the other until
+    // this is called again. Not all renderers support it, and those of another class than the
+    // source only if the source loaded the scene for them, see AddSwitchTarget.
+    void ShareScene(VulkanRenderer& source);
+    // Whether both render the same scene, i.e. neither has loaded another since ShareScene
+    bool SharesScene(const VulkanRenderer& other) const noexcept {
+        return scene && scene == other.scene;
+    }
+    // Loads a new version of the glTF, only updating what changed since the previous call:
+    // material factors and node transforms are updated in place, while any other change loads
+    // the whole scene again. The first call loads it like LoadScene.
+    void ReloadScene(GLTF::Container& gltf);
+    // Poses the nodes as the animations of the glTF are at that time in seconds, each of them
+    // looping, and updates the GPU copies of the transforms like ReloadScene. Acceleration
+    // structures are refit rather than rebuilt. Does nothing if the glTF has no animations.
+    void SetAnimationTime(double time);
+    // The views of the frames that will be drawn, one per DrawFrame from the next one, e.g. of a
+    // benchmark. Streamed meshes and textures are prefetched along them instead of along the
+    // extrapolated motion of the camera, see StreamingPrefetcher. Empty to extrapolate again.
+    void SetCameraPath(std::vector<glm::mat4> views);
     virtual void DrawFrame(const Camera& external_camera, bool force_external_camera) = 0;
     virtual void OnResized(const vk::Extent2D& actual_extent);
+    // Destroys the swapchain once the device is idle, so that another renderer sharing the
+    // device can present to the window (which takes one swapchain at a time), e.g. the one
+    // switched to, see AddSwitchTarget. No frames may be drawn until OnResized creates it
+    // again. Does nothing headless.
+    void ReleaseSwapchain();
+
+    // Number of scenes in the loaded glTF
+    std::size_t GetNumSubScenes() const;
+    std::size_t GetCurrentSubScene() const noexcept {
+        return sub_scene_idx;
+    }
+    // Renders another scene of the loaded glTF. The scenes share their meshes and textures, so
+    // switching is cheap. The main scene is rendered after LoadScene.
+    virtual void SetSubScene(std::size_t index);
+    const SubScene& GetSubScene() const;
 
 protected:
     // Interface for derived classes
@@ -56,27 +265,232 @@ protected:
         vk::AccessFlags2 dst_access_mask;
     };
     virtual OffscreenImageInfo GetOffscreenImageInfo() const = 0;
-    virtual std::unique_ptr<VulkanDevice> CreateDevice(vk::SurfaceKHR surface,
-                                                       const vk::Extent2D& actual_extent) const = 0;
+    // What the device is created with, see VulkanDevice
+    struct DeviceRequirements {
+        std::vector<const char*> extensions;
+        Helpers::GenericStructureChain<vk::PhysicalDeviceFeatures2> features;
+        bool fragment_shading_rate = false;
+    };
+    virtual DeviceRequirements GetDeviceRequirements() const = 0;
+    // From those of this renderer and of its switch targets, see AddSwitchTarget
+    std::unique_ptr<VulkanDevice> CreateDevice(vk::SurfaceKHR surface) const;
+    // Of the geometry of the scenes the derived class loads or shares on the device. Empty by
+    // default, for renderers that cannot share scenes.
+    virtual GeometryRequirements GetGeometryRequirements(const VulkanDevice& device) const;
+    // Those of this renderer together with those of its switch targets, to load scenes with,
+    // see AddSwitchTarget
+    GeometryRequirements GetSwitchGeometryRequirements() const;
+    // At render_target_extent
     void CreateRenderTargets();
-    void PostprocessAndPresent(vk::Semaphore offscreen_render_finished_semaphore);
-    vk::Extent2D GetRenderExtent(double camera_aspect_ratio) const;
+    // Destroys the resource once the frames in flight that may still use it have completed,
+    // rather than waiting for the device to be idle, e.g. the swapchain replaced on resize
+    template <typename T>
+    void Retire(T resource) {
+        retired_resources.push_back({
+            .frame = num_drawn_frames,
+            .resource = std::make_shared<T>(std::move(resource)),
+        });
+    }
+    // One per frame in flight, as the descriptors of storage or sampled images in the General
+    // layout
+    std::vector<DescriptorBinding::CombinedImageSamplers> GetOffscreenImages() const;
+    // Copies the render area of the offscreen image of the frame in flight into its capture
+    // buffer, after the source stages and accesses that wrote it, for next_capture_callback
+    void RecordCapture(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                       const vk::Extent2D& render_extent, vk::PipelineStageFlags2 src_stages,
+                       vk::AccessFlags2 src_access);
+    // Calls the callback of the frame captured into the buffer of the frame in flight, if any.
+    // Its submission must have completed.
+    void DeliverCapture(std::size_t frame_idx);
+    // Of the swapchain images, for fused postprocessing
+    void CreatePostprocessOutputs();
+    // Of the headless swapchain, if video encoding is set and supported
+    void CreateVideoEncoder();
+    // Whether the derived class writes its offscreen images in stages the compute shader of
+    // fused postprocessing can follow, see fused_postprocess.
+    virtual bool SupportsFusedPostprocess() const;
+    // Whether the derived class renders the views of GetNumViews, see SetStereo
+    virtual bool SupportsStereo() const;
+    // Acquires a swapchain image and postprocesses the offscreen image of the frame in flight
+    // into it, in the command buffer of the frame after the source stages and accesses that
+    // wrote the image, so that each frame is a single submission. The render extent is
+    // upscaled to the display extent where they differ. With fused_postprocess, a compute
+    // shader writes the swapchain image instead of a render pass. The submission must wait for
+    // the returned semaphore, whose semaphore is null for headless swapchains, and signal the
+    // one passed to swap_chain->Present. Nothing is recorded or returned if no image was
+    // acquired, in which case the frame is not presented.
+    std::optional<vk::SemaphoreSubmitInfo> RecordPostprocess(const vk::raii::CommandBuffer& cmd,
+                                                             std::size_t frame_idx,
+                                                             const vk::Extent2D& render_extent,
+                                                             const vk::Extent2D& display_extent,
+                                                             vk::PipelineStageFlags2 src_stages,
+                                                             vk::AccessFlags2 src_access);
+    // Of the viewport, fitted to the aspect ratio of the camera
+    vk::Extent2D GetDisplayExtent(double camera_aspect_ratio) const;
+    // The display extent scaled by the render scale, in steps, or by 1 for full resolution
+    vk::Extent2D GetRenderExtent(double camera_aspect_ratio, bool scaled = true) const;
+    double GetRenderScale() const;
+    // Views rendered into each frame, 2 in stereo (see SetStereo) and 1 otherwise
+    u32 GetNumViews() const noexcept {
+        return eye_separation > 0 ? 2 : 1;
+    }
+    // Of each view in the render area, the left or right half of it for the eyes in stereo
+    vk::Extent2D GetViewExtent(const vk::Extent2D& render_extent) const;
+    // Of the view of the camera for the view at the index, the eye to the left first in stereo.
+    // The projections of the eyes are those of the camera with X scaled by 2, as they cover half
+    // of the render area each.
+    glm::mat4 GetEyeView(const glm::mat4& view, u32 index) const;
 
-    std::unique_ptr<VulkanContext> context;
-    std::unique_ptr<VulkanDevice> device;
+    // Timestamps around the GPU work of each frame in flight of derived classes. The time of a
+    // frame is read back when it is next begun, and dynamic resolution adjusts the render scale
+    // by it.
+    struct FrameTime {
+        double milliseconds{};
+        double render_scale{}; // That it was rendered at
+    };
+    void BeginFrameTimer(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                         double render_scale);
+    void EndFrameTimer(const vk::raii::CommandBuffer& cmd, std::size_t frame_idx,
+                       vk::PipelineStageFlags2 stages);
+    // Of the last submission of the frame in flight, which has completed. Empty if it was not
+    // timed.
+    std::optional<FrameTime> GetFrameTime(std::size_t frame_idx) const;
+    void UpdateRenderScale(const FrameTime& time);
+    // Updates the GPU copies of the materials or transforms, which ReloadScene has changed.
+    // The device is idle.
+    virtual void OnSceneUpdated(const SceneChanges& changes) = 0;
+    // Steps the defragmentation of device memory if enabled, on frames that are idle (not
+    // loading or streaming anything), beginning one every DefragmentationInterval frames when
+    // memory is fragmented. Called by DrawFrame of derived classes before recording the frame.
+    void StepDefragmentation(bool idle);
+    // Prefetches what the camera is predicted to see over the next frames, given the view and
+    // projection of the frame being drawn. Called by DrawFrame of derived classes that stream.
+    void PrefetchStreaming(const glm::mat4& view, const glm::mat4& proj,
+                           const vk::Extent2D& render_extent);
+    static constexpr u64 DefragmentationInterval = 600;
+    // Called with the buffers the defragmentation has moved, whose new handles must be rebound,
+    // e.g. in descriptor sets. The graphics queue is idle.
+    virtual void OnBuffersMoved(const std::vector<VulkanBuffer*>& buffers);
+    // Adds what the derived class has built from the scene, e.g. its acceleration structures
+    virtual void AddSceneStats(SceneStats& stats) const;
+    // Creates the GPU copies of the scene shared by ShareScene, as LoadScene does for the scenes
+    // it loads. Throws by default, for renderers that cannot share scenes.
+    virtual void OnSceneShared();
+
+    // Spans DrawFrame of derived classes, which should not allocate from the heap once frames
+    // are steady: transient arrays come from the frame arena, which it resets. Built with
+    // ENABLE_ALLOCATION_COUNTER, the heap allocations made in between are logged.
+    class FrameScope : NonCopyable {
+    public:
+        explicit FrameScope(VulkanRenderer& renderer);
+        ~FrameScope();
+
+    private:
+        VulkanRenderer& renderer;
+        u64 allocation_count{}; // At the start
+    };
+    static constexpr std::size_t FrameArenaSize = 256 * 1024;
+
+    std::size_t num_worker_threads = 0;
+    bool compress_textures = false;
+    std::size_t texture_budget = 0;
+    std::size_t host_cache_budget = 0;
+    u32 max_texture_size = 0; // Of the texture quality
+    u32 dropped_texture_levels = 0;
+    std::size_t texture_quality_budget = 0;
+    bool lazy_textures = false;
+    bool optimize_indices = false;
+    bool pack_vertices = false;
+    std::size_t gpu_tangent_triangles = 0;
+    bool gpu_image_decode = false;
+    bool spatial_order = false;
+    double target_frame_time = 0; // Milliseconds
+    double min_render_scale = 0.5;
+    double render_scale = 1; // Of the dimensions of the display extent, before the steps
+    bool gpu_profiling = false;
+    std::size_t num_frames_in_flight = 2; // Of derived classes, and of the offscreen images
+    float exposure = 0; // Stops
+    bool tonemapping = false;
+    float eye_separation = 0;
+    VulkanSwapchain::Pacing present_pacing = VulkanSwapchain::Pacing::Throughput;
+    std::optional<std::size_t> physical_device_index;
+    bool descriptor_buffer = false;
+    bool defragmentation = false;
+    std::function<bool(MemoryCategory, vk::DeviceSize)> memory_pressure_callback;
+    std::function<void(const VulkanSwapchain::ReadbackFrame&)> frame_callback;
+    bool hdr_readback = false;
+    VulkanSwapchain::ExportCallback export_callback;
+    u32 export_image_count = VulkanSwapchain::HeadlessImageCount;
+    VulkanVideoEncoder::PacketCallback video_packet_callback;
+    VulkanVideoEncoder::Settings video_settings;
+    // Null if parallel loading is disabled. Shared with the renderers sharing the device.
+    std::shared_ptr<Common::ThreadPool> thread_pool;
+
+    std::shared_ptr<VulkanContext> context;
+    std::shared_ptr<VulkanDevice> device;
+    // Null unless enabled, and for shared devices
+    std::unique_ptr<VulkanDefragmenter> defragmenter;
+    u64 next_defragmentation_frame = 0; // When to check for fragmentation next
+    // Of the swapchain, that of the device unless it is shared. Null if headless.
+    vk::SurfaceKHR swap_chain_surface{};
+    vk::raii::SurfaceKHR shared_device_surface = nullptr; // Owned, with a shared device
     std::unique_ptr<VulkanSwapchain> swap_chain;
+    // Of the offscreen images, and the render targets of derived classes
+    std::unique_ptr<VulkanRenderTargetHeap> render_target_heap;
+    // Of the render targets, at least the extent of the swapchain, which frames render a part of.
+    // Grown with a margin and only shrunk once the swapchain is much smaller, so that resizing by
+    // small steps (e.g. dragging the edge of the window) keeps them. Derived classes size their
+    // render targets by it too.
+    vk::Extent2D render_target_extent{};
+    // Whether the last OnResized has recreated the render targets. Derived classes recreate
+    // theirs only then, keeping them (and what they have accumulated) otherwise.
+    bool render_targets_resized = false;
+    struct RetiredResource {
+        u64 frame{}; // Of num_drawn_frames when retired
+        std::shared_ptr<void> resource;
+    };
+    std::vector<RetiredResource> retired_resources; // Oldest first, see Retire
     vk::raii::RenderPass pp_render_pass = nullptr;
 
     std::unique_ptr<VulkanDescriptorSets> pp_descriptor_sets;
     struct OffscreenFrame {
-        vk::raii::Semaphore render_start_semaphore = nullptr;
+        // Signalled once the swapchain image the frame is postprocessed into is acquired
+        vk::raii::Semaphore image_available_semaphore = nullptr;
+        std::size_t render_target_slot{}; // Of the image
         std::unique_ptr<VulkanImage> image;
         vk::raii::ImageView image_view = nullptr;
+        // Host visible, grown to fit the frames captured into it, see CaptureFrame. The callback
+        // is set while the copy of one is in flight.
+        std::unique_ptr<VulkanBuffer> capture_buffer;
+        std::function<void(const VulkanSwapchain::ReadbackFrame&)> capture_callback;
+        VulkanSwapchain::ReadbackFrame capture;
     };
-    std::unique_ptr<VulkanFramesInFlight<OffscreenFrame, 2>> pp_frames;
+    std::vector<OffscreenFrame> offscreen_frames; // Per frame in flight
+    // Of the next frame drawn, see CaptureFrame
+    std::function<void(const VulkanSwapchain::ReadbackFrame&)> next_capture_callback;
     std::unique_ptr<VulkanGraphicsPipeline> pp_pipeline;
+    // Set by Init if the derived class supports it, the device can write storage images
+    // without a format and the swapchain images are storage images
+    bool fused_postprocess = false;
+    std::unique_ptr<VulkanDescriptorSets> pp_output_descriptor_sets; // Per swapchain image
+    std::unique_ptr<VulkanComputePipeline> pp_compute_pipeline;
+    vk::raii::QueryPool frame_timestamp_pool = nullptr;
+    float timestamp_period{}; // Nanoseconds per tick
+    std::vector<std::optional<double>> frame_render_scales; // Of the timed frames in flight
+    // Its slots are the frames in flight of derived classes. Null unless enabled.
+    std::unique_ptr<VulkanProfiler> gpu_profiler;
+
+    Common::FrameArena frame_arena{FrameArenaSize}; // Of the frame being drawn
+    u64 num_drawn_frames = 0;
 
-    std::unique_ptr<Scene> scene;
+    std::shared_ptr<Scene> scene; // Of other renderers too, see ShareScene
+    std::vector<const VulkanRenderer*> switch_targets; // See AddSwitchTarget
+    std::size_t sub_scene_idx = 0; // Set to the main sub scene by LoadScene
+    std::unique_ptr<GLTFSnapshot> snapshot; // Of the glTF last passed to ReloadScene
+    // Kept across calls to SetAnimationTime, indexed like the nodes of the glTF
+    std::vector<NodePose> animation_poses;
+    std::vector<glm::mat4> animation_transforms;
+    StreamingPrefetcher streaming_prefetcher;
 };
 
 } // namespace Renderer
@@ -3,12 +3,36 @@
 // Refer to the license.txt file included.
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include <getopt.h>
 #include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
 #include <spdlog/spdlog.h>
+#include <stb_image_write.h>
 
 // Need to include vulkan before GLFW
 #include <vulkan/vulkan_raii.hpp>
@@ -16,23 +40,32 @@
 #include <GLFW/glfw3.h>
 
 #include "common/common_types.h"
+#include "common/exr.h"
 #include "common/log.h"
+#include "common/remote_file.h"
 #include "common/scope_exit.h"
+#include "common/spsc_queue.h"
 #include "core/gltf/gltf_container.h"
+#include "core/hot_reload.h"
+#include "core/load_profiler.h"
+#include "core/path_tracer_compute/vulkan_path_tracer_compute.h"
+#include "core/path_tracer_cpu/vulkan_path_tracer_cpu.h"
 #include "core/path_tracer_hw/vulkan_path_tracer_hw.h"
+#include "core/path_tracer_wavefront/vulkan_path_tracer_wavefront.h"
+#include "core/meshlet/vulkan_meshlet_renderer.h"
 #include "core/rasterizer/vulkan_rasterizer.h"
 #include "core/scene.h"
+#include "core/vulkan/vulkan_context.h"
+#include "core/vulkan/vulkan_device_profile.h"
+#include "core/vulkan/vulkan_profiler.h"
 
-static bool g_should_render = true;
+// Input state below is owned by the input (main) thread, and handed to the render thread as
+// InputSnapshots
 
-static void OnFramebufferResized(GLFWwindow* window, int width, int height) {
-    g_should_render = width != 0 && height != 0;
+static std::optional<vk::Extent2D> g_resized; // Until handed over
 
-    if (g_should_render) {
-        auto* renderer =
-            reinterpret_cast<Renderer::VulkanRenderer*>(glfwGetWindowUserPointer(window));
-        renderer->OnResized({static_cast<u32>(width), static_cast<u32>(height)});
-    }
+static void OnFramebufferResized(GLFWwindow* window, int width, int height) {
+    g_resized = vk::Extent2D{static_cast<u32>(width), static_cast<u32>(height)};
 }
 
 // External camera control
@@ -41,21 +74,29 @@ static float g_camera_yaw = 0;
 static float g_camera_pitch = 0;
 static float g_camera_fov = 45.0f;
 
-static glm::vec3 GetCameraFront() {
+static glm::vec3 GetCameraFront(float yaw, float pitch) {
     // Rotate (0, 0, -1) by yaw, pitch
     glm::vec3 direction;
-    direction.x = -std::sin(glm::radians(g_camera_yaw)) * std::cos(glm::radians(g_camera_pitch));
-    direction.y = std::sin(glm::radians(g_camera_pitch));
-    direction.z = -std::cos(glm::radians(g_camera_yaw)) * std::cos(glm::radians(g_camera_pitch));
+    direction.x = -std::sin(glm::radians(yaw)) * std::cos(glm::radians(pitch));
+    direction.y = std::sin(glm::radians(pitch));
+    direction.z = -std::cos(glm::radians(yaw)) * std::cos(glm::radians(pitch));
     return glm::normalize(direction);
 }
 
-static glm::vec3 GetCameraUp() {
-    const auto front = GetCameraFront();
+static glm::vec3 GetCameraUp(float yaw, float pitch) {
+    const auto front = GetCameraFront(yaw, pitch);
     const auto right = glm::normalize(glm::cross(front, glm::vec3{0, 1, 0}));
     return glm::normalize(glm::cross(right, front));
 }
 
+static glm::vec3 GetCameraFront() {
+    return GetCameraFront(g_camera_yaw, g_camera_pitch);
+}
+
+static glm::vec3 GetCameraUp() {
+    return GetCameraUp(g_camera_yaw, g_camera_pitch);
+}
+
 static void ProcessInput(GLFWwindow* window, float delta_time) {
     static constexpr float CameraSpeed = 5.f;
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
@@ -77,7 +118,7 @@ static void ProcessInput(GLFWwindow* window, float delta_time) {
         g_camera_position +=
             glm::normalize(glm::cross(GetCameraFront(), GetCameraUp())) * CameraSpeed * delta_time;
     } else if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-        std::exit(0);
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
     }
 }
 
@@ -104,53 +145,1704 @@ static void ScrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
     SPDLOG_INFO("Current focal dist: {}", g_camera_focal);
 }
 
+// Until handed over, see InputSnapshot
+static bool g_capture_requested = false;
+static bool g_memory_report_requested = false;
+static int g_sub_scene_steps = 0;
+static std::optional<int> g_integrator; // Of the last of F1-F6 pressed, from 0
+static bool g_pick_requested = false;
+static bool g_backend_switch_requested = false;
+
+// Page Up/Down cycle through the scenes of the file, F1-F6 switch the integrator of the path
+// tracers, F7 switches between the rasterizer and the path tracer, F8 picks what the camera
+// looks at, F9 writes memory_report.json and F12 captures the next frame
+static void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (action != GLFW_PRESS) {
+        return;
+    }
+    if (key >= GLFW_KEY_F1 && key <= GLFW_KEY_F6) {
+        g_integrator = key - GLFW_KEY_F1;
+    } else if (key == GLFW_KEY_F7) {
+        g_backend_switch_requested = true;
+    } else if (key == GLFW_KEY_F8) {
+        g_pick_requested = true;
+    } else if (key == GLFW_KEY_F9) {
+        g_memory_report_requested = true;
+    } else if (key == GLFW_KEY_F12) {
+        g_capture_requested = true;
+    } else if (key == GLFW_KEY_PAGE_DOWN) {
+        g_sub_scene_steps++;
+    } else if (key == GLFW_KEY_PAGE_UP) {
+        g_sub_scene_steps--;
+    }
+}
+
+// Of the input thread, taken by the render thread each frame. The events since the previous
+// snapshot pushed are carried by the next one, should the queue be full.
+struct InputSnapshot {
+    glm::vec3 camera_position{};
+    float camera_yaw{};
+    float camera_pitch{};
+    float camera_focal{};
+    std::optional<vk::Extent2D> resized; // The latest framebuffer size
+    int sub_scene_steps{};               // Page Down presses minus Page Up ones
+    std::optional<int> integrator;       // See g_integrator
+    bool switch_backend{};
+    bool pick{};
+    bool capture{};
+    bool memory_report{};
+
+    // Of the input thread's globals, and the events since they were last taken
+    static InputSnapshot Take() {
+        InputSnapshot snapshot{
+            .camera_position = g_camera_position,
+            .camera_yaw = g_camera_yaw,
+            .camera_pitch = g_camera_pitch,
+            .camera_focal = g_camera_focal,
+            .resized = std::exchange(g_resized, std::nullopt),
+            .sub_scene_steps = std::exchange(g_sub_scene_steps, 0),
+            .integrator = std::exchange(g_integrator, std::nullopt),
+            .switch_backend = std::exchange(g_backend_switch_requested, false),
+            .pick = std::exchange(g_pick_requested, false),
+            .capture = std::exchange(g_capture_requested, false),
+            .memory_report = std::exchange(g_memory_report_requested, false),
+        };
+        return snapshot;
+    }
+
+    // Adds the camera and events of a later snapshot
+    void Merge(const InputSnapshot& later) {
+        camera_position = later.camera_position;
+        camera_yaw = later.camera_yaw;
+        camera_pitch = later.camera_pitch;
+        camera_focal = later.camera_focal;
+        if (later.resized) {
+            resized = later.resized;
+        }
+        sub_scene_steps += later.sub_scene_steps;
+        if (later.integrator) {
+            integrator = later.integrator;
+        }
+        switch_backend |= later.switch_backend;
+        pick |= later.pick;
+        capture |= later.capture;
+        memory_report |= later.memory_report;
+    }
+
+    Renderer::Camera GetCamera() const {
+        return {camera_position, GetCameraFront(camera_yaw, camera_pitch),
+                GetCameraUp(camera_yaw, camera_pitch)};
+    }
+};
+
+static u8 EncodeSRGB(float value) {
+    value = std::clamp(value, 0.0f, 1.0f);
+    value = value <= 0.0031308f ? 12.92f * value : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+    return static_cast<u8>(value * 255.0f + 0.5f);
+}
+
+// Writes a headless frame as a binary PPM, dropping alpha. The pixels are either sRGB encoded
+// RGBA8, or linear RGBA32F.
+static void WriteFrame(const std::filesystem::path& path, const vk::Extent2D& extent,
+                       vk::Format format, std::span<const u8> pixels) {
+    std::ofstream file(path, std::ios::binary);
+    file << "P6\n" << extent.width << ' ' << extent.height << "\n255\n";
+    std::vector<char> row(std::size_t{extent.width} * 3);
+    for (u32 y = 0; y < extent.height; ++y) {
+        if (format == vk::Format::eR32G32B32A32Sfloat) {
+            const u8* src = pixels.data() + std::size_t{y} * extent.width * 16;
+            for (u32 x = 0; x < extent.width; ++x) {
+                std::array<float, 4> texel;
+                std::memcpy(texel.data(), src + x * 16, sizeof(texel));
+                for (std::size_t i = 0; i < 3; ++i) {
+                    row[x * 3 + i] = static_cast<char>(EncodeSRGB(texel[i]));
+                }
+            }
+        } else {
+            const u8* src = pixels.data() + std::size_t{y} * extent.width * 4;
+            for (u32 x = 0; x < extent.width; ++x) {
+                std::copy_n(src + x * 4, 3, row.begin() + x * 3);
+            }
+        }
+        file.write(row.data(), row.size());
+    }
+    if (!file) {
+        SPDLOG_ERROR("Failed to write frame {}", path.string());
+    }
+}
+
+// Writes an accumulated RGBA32F frame as an OpenEXR file of the sum of its samples and their
+// number, dropping alpha, so that partial renders of the frame can be merged (see
+// sample_merge).
+static void WriteAccumulation(const std::filesystem::path& path, const vk::Extent2D& extent,
+                              std::span<const u8> pixels, std::size_t samples) {
+    Common::FloatImage image{
+        .width = extent.width,
+        .height = extent.height,
+        .channels = {"B", "G", "R", "samples"},
+        .pixels = std::vector<float>(std::size_t{extent.width} * extent.height * 4),
+    };
+    for (std::size_t i = 0; i < std::size_t{extent.width} * extent.height; ++i) {
+        std::array<float, 4> texel;
+        std::memcpy(texel.data(), pixels.data() + i * 16, sizeof(texel));
+        for (std::size_t channel = 0; channel < 3; ++channel) {
+            image.pixels[i * 4 + channel] = texel[2 - channel] * static_cast<float>(samples);
+        }
+        image.pixels[i * 4 + 3] = static_cast<float>(samples);
+    }
+    try {
+        Common::WriteEXR(path, image);
+    } catch (std::exception&) {
+        // Logged already, the other frames are still written
+    }
+}
+
+// Of a texel of a captured frame, in the format of the offscreen images of the renderers
+static std::array<float, 3> ReadLinearTexel(vk::Format format, const u8* texel) {
+    std::array<float, 3> rgb;
+    switch (format) {
+    case vk::Format::eR32G32B32A32Sfloat:
+        std::memcpy(rgb.data(), texel, sizeof(rgb));
+        return rgb;
+    case vk::Format::eR16G16B16A16Sfloat:
+        for (std::size_t i = 0; i < 3; ++i) {
+            u16 half;
+            std::memcpy(&half, texel + i * 2, sizeof(half));
+            rgb[i] = glm::unpackHalf1x16(half);
+        }
+        return rgb;
+    default: { // 8-bit, like the surface formats
+        const bool bgra =
+            format == vk::Format::eB8G8R8A8Srgb || format == vk::Format::eB8G8R8A8Unorm;
+        const bool srgb =
+            format == vk::Format::eB8G8R8A8Srgb || format == vk::Format::eR8G8B8A8Srgb;
+        for (std::size_t i = 0; i < 3; ++i) {
+            const float value = texel[bgra ? 2 - i : i] / 255.0f;
+            rgb[i] = !srgb              ? value
+                     : value <= 0.04045f ? value / 12.92f
+                                         : std::pow((value + 0.055f) / 1.055f, 2.4f);
+        }
+        return rgb;
+    }
+    }
+}
+
+// Writes a frame captured by VulkanRenderer::CaptureFrame, dropping alpha: as an OpenEXR file of
+// its linear values if the path ends with .exr, or as a PNG exposed and tonemapped like the
+// frames presented otherwise (without their dithering).
+static void WriteCapture(const std::filesystem::path& path, const vk::Extent2D& extent,
+                         vk::Format format, std::span<const u8> pixels, float exposure,
+                         bool tonemap) {
+    const std::size_t num_pixels = std::size_t{extent.width} * extent.height;
+    const std::size_t texel_size = pixels.size() / std::max<std::size_t>(num_pixels, 1);
+    if (path.extension() == ".exr") {
+        Common::FloatImage image{
+            .width = extent.width,
+            .height = extent.height,
+            .channels = {"B", "G", "R"},
+            .pixels = std::vector<float>(num_pixels * 3),
+        };
+        for (std::size_t i = 0; i < num_pixels; ++i) {
+            const auto rgb = ReadLinearTexel(format, pixels.data() + i * texel_size);
+            for (std::size_t channel = 0; channel < 3; ++channel) {
+                image.pixels[i * 3 + channel] = rgb[2 - channel];
+            }
+        }
+        try {
+            Common::WriteEXR(path, image);
+        } catch (std::exception&) {
+            // Logged already
+        }
+        return;
+    }
+
+    const float scale = std::exp2(exposure);
+    std::vector<u8> encoded(num_pixels * 3);
+    for (std::size_t i = 0; i < num_pixels; ++i) {
+        const auto rgb = ReadLinearTexel(format, pixels.data() + i * texel_size);
+        for (std::size_t channel = 0; channel < 3; ++channel) {
+            float value = rgb[channel] * scale;
+            if (tonemap) { // As TonemapACES of the postprocessing
+                value = (value * (2.51f * value + 0.03f)) /
+                        (value * (2.43f * value + 0.59f) + 0.14f);
+            }
+            encoded[i * 3 + channel] = EncodeSRGB(value);
+        }
+    }
+    if (!stbi_write_png(path.string().c_str(), static_cast<int>(extent.width),
+                        static_cast<int>(extent.height), 3, encoded.data(),
+                        static_cast<int>(extent.width * 3))) {
+        SPDLOG_ERROR("Failed to write capture {}", path.string());
+    }
+}
+
+// Encodes and writes headless frames on a thread of its own, so that the render thread goes on
+// to the next frame meanwhile. Frames that have not been written yet are written before the
+// destructor returns.
+class FrameWriter : NonCopyable {
+public:
+    // Frames waiting to be written. Push blocks when there are more.
+    static constexpr std::size_t MaxQueuedFrames = 4;
+
+    // Captures written as PNG are exposed and tonemapped like this, see WriteCapture
+    explicit FrameWriter(std::filesystem::path output_dir_, float exposure_ = 0,
+                         bool tonemap_ = false)
+        : output_dir(std::move(output_dir_)), exposure(exposure_), tonemap(tonemap_),
+          thread{[this](std::stop_token stop_token) { Run(stop_token); }} {}
+
+    // Of VulkanRenderer::CaptureFrame, see WriteCapture
+    void PushCapture(std::string name, const Renderer::VulkanSwapchain::ReadbackFrame& frame) {
+        Push(std::move(name), frame.extent, frame.format,
+             {frame.pixels.begin(), frame.pixels.end()}, 0, true);
+    }
+
+    // Frames with samples are accumulations written by WriteAccumulation, and must be RGBA32F
+    void Push(std::string name, const Renderer::VulkanSwapchain::ReadbackFrame& frame,
+              std::size_t samples = 0) {
+        Push(std::move(name), frame.extent, frame.format,
+             {frame.pixels.begin(), frame.pixels.end()}, samples);
+    }
+
+    void Push(std::string name, const vk::Extent2D& extent, vk::Format format,
+              std::vector<u8> pixels, std::size_t samples = 0, bool capture = false) {
+        std::unique_lock lock{mutex};
+        cv.wait(lock, [this] { return queue.size() < MaxQueuedFrames; });
+        queue.push_back({
+            .name = std::move(name),
+            .extent = extent,
+            .format = format,
+            .pixels = std::move(pixels),
+            .samples = samples,
+            .capture = capture,
+        });
+        cv.notify_all();
+    }
+
+private:
+    struct Frame {
+        std::string name;
+        vk::Extent2D extent;
+        vk::Format format{};
+        std::vector<u8> pixels;
+        std::size_t samples{};
+        bool capture{};
+    };
+
+    void Run(std::stop_token stop_token) {
+        while (true) {
+            Frame frame;
+            {
+                std::unique_lock lock{mutex};
+                cv.wait(lock, stop_token, [this] { return !queue.empty(); });
+                if (queue.empty()) { // Stop requested, and everything written
+                    return;
+                }
+                frame = std::move(queue.front());
+                queue.pop_front();
+            }
+            cv.notify_all();
+            if (frame.capture) {
+                WriteCapture(output_dir / frame.name, frame.extent, frame.format, frame.pixels,
+                             exposure, tonemap);
+            } else if (frame.samples > 0) {
+                WriteAccumulation(output_dir / frame.name, frame.extent, frame.pixels,
+                                  frame.samples);
+            } else {
+                WriteFrame(output_dir / frame.name, frame.extent, frame.format, frame.pixels);
+            }
+        }
+    }
+
+    std::filesystem::path output_dir;
+    float exposure{};
+    bool tonemap{};
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    std::deque<Frame> queue;
+    std::jthread thread; // Declared last to stop before the rest is destroyed
+};
+
+// Merges the frames of each camera of a batch rendered on several GPUs, each of which has
+// accumulated its own samples. They are averaged in linear color, weighted by their numbers of
+// samples, and written once every GPU has delivered its frame. Thread safe.
+class SampleMerger : NonCopyable {
+public:
+    // Writes the merged frames as accumulations if export_exr is set, see WriteAccumulation
+    explicit SampleMerger(FrameWriter& writer_, std::size_t num_gpus_, bool export_exr_)
+        : writer(writer_), num_gpus(num_gpus_), export_exr(export_exr_), pending(num_gpus_) {}
+
+    // Called once the GPU has drawn the frame that is read back, before it is delivered, with
+    // the number of samples of each pixel it accumulated.
+    void Expect(std::size_t gpu, std::size_t camera, std::size_t samples) {
+        std::scoped_lock lock{mutex};
+        pending[gpu].push_back({camera, samples});
+    }
+
+    // Frame callback of the GPU, whose frames must be RGBA32F.
+    void Add(std::size_t gpu, const Renderer::VulkanSwapchain::ReadbackFrame& frame) {
+        std::scoped_lock lock{mutex};
+        const auto [camera, samples] = pending[gpu].front();
+        pending[gpu].pop_front();
+
+        auto& view = views[camera];
+        const std::size_t num_values = frame.pixels.size() / sizeof(float);
+        if (view.sum.empty()) {
+            view.extent = frame.extent;
+            view.sum.assign(num_values, 0.0f);
+        }
+        std::vector<float> values(num_values);
+        std::memcpy(values.data(), frame.pixels.data(), num_values * sizeof(float));
+        for (std::size_t i = 0; i < num_values; ++i) {
+            view.sum[i] += values[i] * static_cast<float>(samples);
+        }
+        view.samples += samples;
+        if (++view.num_frames < num_gpus) {
+            return;
+        }
+
+        for (float& value : view.sum) {
+            value /= static_cast<float>(view.samples);
+        }
+        std::vector<u8> pixels(num_values * sizeof(float));
+        std::memcpy(pixels.data(), view.sum.data(), pixels.size());
+        writer.Push(fmt::format("view_{:04}.{}", camera, export_exr ? "exr" : "ppm"), view.extent,
+                    vk::Format::eR32G32B32A32Sfloat, std::move(pixels),
+                    export_exr ? view.samples : 0);
+        views.erase(camera);
+    }
+
+private:
+    struct View {
+        vk::Extent2D extent;
+        std::vector<float> sum; // Weighted by the samples
+        std::size_t samples{};
+        std::size_t num_frames{};
+    };
+
+    FrameWriter& writer;
+    std::size_t num_gpus{};
+    bool export_exr{};
+    std::mutex mutex;
+    std::vector<std::deque<std::pair<std::size_t, std::size_t>>> pending; // Camera, samples
+    std::unordered_map<std::size_t, View> views;
+};
+
+struct CameraPose {
+    glm::vec3 position;
+    glm::vec3 target; // Looked at
+    float yfov = 45.0f; // Degrees
+};
+
+// Reads camera poses, one per line: the position, the point looked at and optionally the
+// vertical field of view in degrees. Empty lines and lines starting with # are skipped.
+static std::vector<CameraPose> LoadCameraPoses(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    if (!file) {
+        SPDLOG_ERROR("Failed to open camera list {}", path.string());
+        throw std::runtime_error("Failed to open camera list");
+    }
+    std::vector<CameraPose> poses;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream stream{line};
+        CameraPose pose;
+        if (!(stream >> pose.position.x >> pose.position.y >> pose.position.z >> pose.target.x >>
+              pose.target.y >> pose.target.z)) {
+            SPDLOG_ERROR("Invalid camera pose: {}", line);
+            throw std::runtime_error("Invalid camera pose");
+        }
+        stream >> pose.yfov;
+        poses.push_back(pose);
+    }
+    return poses;
+}
+
+static std::unique_ptr<Renderer::Camera> CreateCamera(const CameraPose& pose) {
+    const auto front = glm::normalize(pose.target - pose.position);
+    const auto right = glm::normalize(glm::cross(front, glm::vec3{0, 1, 0}));
+    return std::make_unique<Renderer::Camera>(pose.position, front,
+                                              glm::normalize(glm::cross(right, front)),
+                                              glm::radians(pose.yfov));
+}
+
+// The cameras of a batch, see LoadCameraPoses
+static std::vector<std::unique_ptr<Renderer::Camera>> LoadCameraList(
+    const std::filesystem::path& path) {
+    std::vector<std::unique_ptr<Renderer::Camera>> cameras;
+    for (const auto& pose : LoadCameraPoses(path)) {
+        cameras.emplace_back(CreateCamera(pose));
+    }
+    SPDLOG_INFO("Loaded {} cameras", cameras.size());
+    return cameras;
+}
+
+// Of the poses evenly spaced along the path, linearly interpolated. t is in [0, 1].
+static CameraPose InterpolateCameraPath(std::span<const CameraPose> path, double t) {
+    const double position = std::clamp(t, 0.0, 1.0) * static_cast<double>(path.size() - 1);
+    const auto idx = std::min(static_cast<std::size_t>(position), path.size() - 1);
+    if (idx + 1 == path.size()) {
+        return path.back();
+    }
+    const auto weight = static_cast<float>(position - static_cast<double>(idx));
+    const auto& from = path[idx];
+    const auto& to = path[idx + 1];
+    return {
+        .position = glm::mix(from.position, to.position, weight),
+        .target = glm::mix(from.target, to.target, weight),
+        .yfov = glm::mix(from.yfov, to.yfov, weight),
+    };
+}
+
+// Nearest rank, of sorted values
+static double GetPercentile(std::span<const double> sorted, double percentile) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    const auto rank = static_cast<std::size_t>(
+        std::ceil(percentile / 100.0 * static_cast<double>(sorted.size())));
+    return sorted[std::clamp<std::size_t>(rank, 1, sorted.size()) - 1];
+}
+
+// Plays the camera path over the frames, and writes the wall time of each DrawFrame (which
+// includes waiting for the frame in flight), the GPU time of its profiler scopes and the device
+// memory in use to bench_frames.csv, their percentiles to bench_summary.csv, and the memory
+// report after the last frame to bench_memory.json. The renderer must profile the GPU. GPU
+// times are read back frames later, so the last pose is drawn again until those of the path
+// are in.
+static int RunBenchmark(Renderer::VulkanRenderer& renderer, GLFWwindow* window,
+                        std::span<const CameraPose> path, std::size_t num_frames,
+                        const std::filesystem::path& output_dir) {
+    struct FrameRecord {
+        double cpu_milliseconds{};
+        std::optional<double> gpu_milliseconds;
+        vk::DeviceSize device_usage{};
+        vk::DeviceSize allocated{}; // By the renderer, all categories
+    };
+    std::vector<FrameRecord> records(num_frames);
+    auto* profiler = renderer.GetGPUProfiler();
+    const auto TakeGPUTimes = [profiler, &records] {
+        for (const auto& [frame, milliseconds] : profiler->TakeFrameTimes()) {
+            if (frame < records.size()) {
+                records[frame].gpu_milliseconds = milliseconds;
+            }
+        }
+    };
+
+    const auto GetPose = [path, num_frames](std::size_t frame) {
+        const double t = num_frames > 1 ? static_cast<double>(frame) / (num_frames - 1) : 0.0;
+        return InterpolateCameraPath(path, t);
+    };
+    // Known ahead, so that streaming prefetches along it
+    std::vector<glm::mat4> views;
+    views.reserve(num_frames);
+    for (std::size_t i = 0; i < num_frames; ++i) {
+        views.emplace_back(CreateCamera(GetPose(i))->view);
+    }
+    renderer.SetCameraPath(std::move(views));
+
+    // Frames the profiler counted before, e.g. none
+    profiler->TakeFrameTimes();
+    for (std::size_t i = 0; i < num_frames; ++i) {
+        if (window) {
+            glfwPollEvents();
+            if (glfwWindowShouldClose(window)) {
+                SPDLOG_WARN("Benchmark interrupted after {} frames", i);
+                records.resize(i);
+                break;
+            }
+        }
+        const auto camera = CreateCamera(GetPose(i));
+
+        const auto start_time = std::chrono::steady_clock::now();
+        renderer.DrawFrame(*camera, true);
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start_time;
+
+        const auto usage = renderer.GetMemoryUsage();
+        auto& record = records[i];
+        record.cpu_milliseconds = elapsed.count();
+        record.device_usage = usage.device_usage;
+        for (const auto size : usage.categories) {
+            record.allocated += size;
+        }
+        TakeGPUTimes();
+    }
+    renderer.SetCameraPath({});
+    static constexpr std::size_t MaxDrainFrames = 8;
+    const auto last_camera = CreateCamera(path.back());
+    for (std::size_t i = 0; i < MaxDrainFrames && !records.empty() &&
+                            !records.back().gpu_milliseconds;
+         ++i) {
+        renderer.DrawFrame(*last_camera, true);
+        TakeGPUTimes();
+    }
+    renderer.FlushFrames();
+    const bool memory_written = renderer.WriteMemoryReport(output_dir / "bench_memory.json");
+
+    static constexpr double MiB = 1024.0 * 1024.0;
+    std::ofstream frames_file(output_dir / "bench_frames.csv");
+    frames_file << "frame,cpu_ms,gpu_ms,device_mib,allocated_mib\n";
+    std::vector<double> cpu_times, gpu_times, device_usages;
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        const auto& record = records[i];
+        frames_file << fmt::format("{},{:.3f},{},{:.1f},{:.1f}\n", i, record.cpu_milliseconds,
+                                   record.gpu_milliseconds
+                                       ? fmt::format("{:.3f}", *record.gpu_milliseconds)
+                                       : std::string{},
+                                   record.device_usage / MiB, record.allocated / MiB);
+        cpu_times.push_back(record.cpu_milliseconds);
+        if (record.gpu_milliseconds) {
+            gpu_times.push_back(*record.gpu_milliseconds);
+        }
+        device_usages.push_back(record.device_usage / MiB);
+    }
+
+    std::ofstream summary_file(output_dir / "bench_summary.csv");
+    summary_file << "metric,frames,p50,p95,p99,max\n";
+    std::string report;
+    const auto Summarize = [&summary_file, &report](std::string_view name,
+                                                    std::vector<double>& values) {
+        std::ranges::sort(values);
+        const auto p50 = GetPercentile(values, 50);
+        const auto p95 = GetPercentile(values, 95);
+        const auto p99 = GetPercentile(values, 99);
+        const auto max = values.empty() ? 0.0 : values.back();
+        summary_file << fmt::format("{},{},{:.3f},{:.3f},{:.3f},{:.3f}\n", name, values.size(),
+                                    p50, p95, p99, max);
+        report += fmt::format("{}: p50 {:.3f}, p95 {:.3f}, p99 {:.3f}, max {:.3f}\n", name, p50,
+                              p95, p99, max);
+    };
+    Summarize("cpu_ms", cpu_times);
+    Summarize("gpu_ms", gpu_times);
+    Summarize("device_mib", device_usages);
+    if (!frames_file || !summary_file || !memory_written) {
+        SPDLOG_ERROR("Failed to write benchmark results to {}", output_dir.string());
+        return 1;
+    }
+    SPDLOG_INFO("Benchmark of {} frames:\n{}", records.size(), report);
+    return 0;
+}
+
+// Measures the error of headless path traced frames against a reference image (an OpenEXR file
+// of its mean, or of the sums of its samples as written with --exr), to compare the time to
+// quality of sampling strategies and not merely their sample rates. The error is that of the
+// linear RGB channels: the RMSE, and the relative MSE (x - r)^2 / (r^2 + 0.01). Each measured
+// frame is also written as an accumulation, e.g. for the FLIP of its mean.
+class ConvergenceMeter : NonCopyable {
+public:
+    // Throws std::runtime_error if the reference has no RGB channels
+    explicit ConvergenceMeter(FrameWriter& writer_, const Common::FloatImage& image)
+        : writer(writer_), width(image.width), height(image.height) {
+        const auto FindChannel = [&image](std::string_view name) -> std::optional<std::size_t> {
+            const auto it = std::ranges::find(image.channels, name);
+            if (it == image.channels.end()) {
+                return std::nullopt;
+            }
+            return static_cast<std::size_t>(it - image.channels.begin());
+        };
+        const auto red = FindChannel("R"), green = FindChannel("G"), blue = FindChannel("B");
+        if (!red || !green || !blue) {
+            SPDLOG_ERROR("Reference image has no RGB channels");
+            throw std::runtime_error("Reference image has no RGB channels");
+        }
+        const auto samples = FindChannel("samples");
+
+        const std::size_t num_channels = image.channels.size();
+        reference.reserve(std::size_t{width} * height * 3);
+        for (std::size_t i = 0; i < image.pixels.size(); i += num_channels) {
+            const float scale =
+                samples && image.pixels[i + *samples] > 0 ? 1.0f / image.pixels[i + *samples]
+                                                          : 1.0f;
+            for (const auto channel : {*red, *green, *blue}) {
+                reference.emplace_back(image.pixels[i + channel] * scale);
+            }
+        }
+    }
+
+    // Frame callback of the renderer, whose frames must be RGBA32F
+    void Add(const Renderer::VulkanSwapchain::ReadbackFrame& frame) {
+        last_extent = frame.extent;
+        last_pixels.assign(frame.pixels.begin(), frame.pixels.end());
+    }
+
+    // Measures the frame delivered last, which accumulated the samples in the seconds spent
+    // rendering so far. Returns false if it does not match the reference.
+    bool Measure(double seconds, std::size_t samples) {
+        if (last_extent.width != width || last_extent.height != height) {
+            SPDLOG_ERROR("Frame of {}x{} does not match the reference of {}x{}",
+                         last_extent.width, last_extent.height, width, height);
+            return false;
+        }
+        double squared_error = 0, relative_squared_error = 0;
+        for (std::size_t i = 0; i < reference.size() / 3; ++i) {
+            std::array<float, 4> texel;
+            std::memcpy(texel.data(), last_pixels.data() + i * 16, sizeof(texel));
+            for (std::size_t channel = 0; channel < 3; ++channel) {
+                const double expected = reference[i * 3 + channel];
+                const double error = texel[channel] - expected;
+                squared_error += error * error;
+                relative_squared_error += error * error / (expected * expected + 0.01);
+            }
+        }
+        const auto num_values = static_cast<double>(reference.size());
+        records.push_back({
+            .seconds = seconds,
+            .samples = samples,
+            .rmse = std::sqrt(squared_error / num_values),
+            .relative_mse = relative_squared_error / num_values,
+        });
+        writer.Push(fmt::format("converge_{:02}.exr", records.size() - 1), last_extent,
+                    vk::Format::eR32G32B32A32Sfloat, std::move(last_pixels), samples);
+        last_pixels = {};
+        return true;
+    }
+
+    // Writes the error of the measured frames against the time to converge.csv
+    bool Write(const std::filesystem::path& output_dir) const {
+        std::ofstream file(output_dir / "converge.csv");
+        file << "seconds,samples,rmse,relmse\n";
+        std::string report;
+        for (const auto& record : records) {
+            const auto line = fmt::format("{:.3f},{},{:.6g},{:.6g}\n", record.seconds,
+                                          record.samples, record.rmse, record.relative_mse);
+            file << line;
+            report += line;
+        }
+        if (!file) {
+            SPDLOG_ERROR("Failed to write convergence results to {}", output_dir.string());
+            return false;
+        }
+        SPDLOG_INFO("Error against the reference:\nseconds,samples,rmse,relmse\n{}", report);
+        return true;
+    }
+
+private:
+    struct Record {
+        double seconds{};
+        std::size_t samples{};
+        double rmse{};
+        double relative_mse{};
+    };
+
+    FrameWriter& writer;
+    u32 width{};
+    u32 height{};
+    std::vector<float> reference; // Linear RGB
+    vk::Extent2D last_extent;
+    std::vector<u8> last_pixels;
+    std::vector<Record> records;
+};
+
+// Renders the camera for the time budget, measuring the error of the frame at wall times that
+// double from 1/128 of the budget up to all of it. The clock is paused while measuring, and
+// each measured frame is waited for so that the time includes tracing its samples.
+static int RunConvergence(Renderer::VulkanPathTracerHW& renderer, ConvergenceMeter& meter,
+                          const Renderer::Camera& camera, double time_budget,
+                          const std::filesystem::path& output_dir) {
+    static constexpr std::size_t NumCheckpoints = 8;
+    const auto GetCheckpointTime = [time_budget](std::size_t checkpoint) {
+        return time_budget / static_cast<double>(1u << (NumCheckpoints - 1 - checkpoint));
+    };
+
+    std::chrono::duration<double> elapsed{}; // Spent rendering
+    auto resume_time = std::chrono::steady_clock::now();
+    for (std::size_t checkpoint = 0; checkpoint < NumCheckpoints;) {
+        const std::chrono::duration<double> now = std::chrono::steady_clock::now() - resume_time;
+        const bool measure = (elapsed + now).count() >= GetCheckpointTime(checkpoint);
+        renderer.SetFrameReadback(measure);
+        renderer.DrawFrame(camera, true);
+        if (!measure) {
+            continue;
+        }
+        renderer.FlushFrames();
+        elapsed += std::chrono::steady_clock::now() - resume_time;
+        if (!meter.Measure(elapsed.count(), renderer.GetAccumulatedSamples())) {
+            return 1;
+        }
+        // Frames slower than the checkpoints are apart measure several of them
+        while (checkpoint < NumCheckpoints && elapsed.count() >= GetCheckpointTime(checkpoint)) {
+            ++checkpoint;
+        }
+        resume_time = std::chrono::steady_clock::now();
+    }
+    return meter.Write(output_dir) ? 0 : 1;
+}
+
+static std::string FormatRayStats(const Renderer::VulkanPathTracerHW::RayStats& stats) {
+    return fmt::format("{:.1f} Mrays/s, {} camera, {} bounce and {} shadow rays in {:.2f} ms, "
+                       "{:.2f} rays per path, {} Russian roulette terminations, {} NaN samples",
+                       stats.GetMraysPerSecond(), stats.camera_rays, stats.bounce_rays,
+                       stats.shadow_rays, stats.milliseconds, stats.GetAveragePathLength(),
+                       stats.roulette_terminations, stats.nan_samples);
+}
+
+// The most expensive materials measured for the cost heatmap, with their share of the cycles
+static void LogMaterialCosts(const Renderer::VulkanPathTracerHW& path_tracer) {
+    static constexpr std::size_t MaxMaterials = 16;
+    const auto costs = path_tracer.GetMaterialCosts();
+    u64 total_cycles = 0;
+    for (const auto& cost : costs) {
+        total_cycles += cost.cycles;
+    }
+    if (total_cycles == 0) {
+        return;
+    }
+    std::string report;
+    for (std::size_t i = 0; i < std::min(costs.size(), MaxMaterials); ++i) {
+        const auto& cost = costs[i];
+        report += fmt::format("{}: {:.1f}%, {} cycles per hit\n",
+                              cost.name.empty() ? "(unnamed)" : cost.name,
+                              100.0 * cost.cycles / total_cycles,
+                              cost.num_hits ? cost.cycles / cost.num_hits : 0);
+    }
+    SPDLOG_INFO("Closest hit shader cost of the materials:\n{}", report);
+}
+
+// A job of the render server, read from a line of tab separated fields: the glTF file, the
+// cameras to render it from (a file of camera poses, see LoadCameraList, or 'scene' for those
+// of the file), the directory to write their frames to, and optionally the number of frames to
+// render of each camera and the priority of the job. Relative paths are relative to the
+// working directory of the server.
+struct RenderJob {
+    u64 id{}; // Its line, which its completion is reported with
+    std::filesystem::path scene_path;
+    std::optional<std::filesystem::path> camera_list; // Empty for the cameras of the file
+    std::filesystem::path output_dir;
+    std::size_t frames_per_camera{}; // 0 for those of the server
+    // Share of the GPU against the other jobs rendered along with it on the same GPU
+    double priority = 1.0;
+    // Opened by the server to hash the scene, and loaded by the GPU unless resident
+    std::unique_ptr<GLTF::Container> gltf;
+    Renderer::SceneCache::Key scene_hash{};
+};
+
+// Empty if the line is not a job. Throws if its frame count or priority is not a number. An
+// empty frame count is the default, e.g. to only give the priority.
+static std::optional<RenderJob> ParseRenderJob(const std::string& line, u64 id) {
+    std::vector<std::string> fields;
+    std::istringstream stream{line};
+    for (std::string field; std::getline(stream, field, '\t');) {
+        fields.emplace_back(std::move(field));
+    }
+    if (fields.size() < 3 || fields.size() > 5) {
+        return std::nullopt;
+    }
+    RenderJob job{
+        .id = id,
+        .scene_path = std::filesystem::absolute(std::filesystem::u8path(fields[0])),
+        .output_dir = std::filesystem::absolute(std::filesystem::u8path(fields[2])),
+    };
+    if (fields[1] != "scene") {
+        job.camera_list = std::filesystem::absolute(std::filesystem::u8path(fields[1]));
+    }
+    if (fields.size() >= 4 && !fields[3].empty()) {
+        job.frames_per_camera = std::stoul(fields[3]);
+    }
+    if (fields.size() == 5) {
+        job.priority = std::stod(fields[4]);
+        if (job.priority <= 0) {
+            return std::nullopt;
+        }
+    }
+    return job;
+}
+
+struct ServerSettings {
+    vk::Extent2D extent;
+    std::size_t frames_per_camera{}; // 0 to render each camera until the time budget is used
+    double time_budget{};            // Seconds of GPU time for each camera, 0 for no limit
+    bool path_tracer{};
+    bool export_exr{}; // Path tracers only, see FrameWriter
+    float focal_dist{};
+    float aperture{};
+    vk::DeviceSize resident_budget{}; // Of each GPU, 0 for the budget of its device
+    std::size_t max_tenants = 1;      // Jobs rendered at once on each GPU
+};
+
+// Renders the jobs of the render server on one GPU, on a thread of its own. Scenes stay loaded
+// after their jobs, each in a renderer sharing the device of the GPU, so that later jobs of the
+// same scene skip loading it. They are keyed by the hash of their contents (see
+// GLTFSnapshot::GetHash), so the same files at other paths find them too. The least recently
+// used scenes are unloaded while the device memory in use exceeds the budget.
+// Up to max_tenants jobs of different scenes are rendered at once, each by the renderer of its
+// scene with its own accumulation and TLAS. Their frames are interleaved by fair share: the
+// next frame is of the job that has used the least time for its priority, so that a job
+// accumulating for long does not hold up the others.
+class ServerGPU : NonCopyable {
+public:
+    using CreateRenderer = std::function<std::unique_ptr<Renderer::VulkanRenderer>()>;
+    // Called from the thread of the GPU once a job is done
+    using ReportCallback = std::function<void(u64 id, bool succeeded)>;
+
+    // The device owner is an initialized renderer whose device the scenes share, and renders
+    // nothing itself. If null, one is created on the thread of the GPU. Loads hold load_mutex.
+    explicit ServerGPU(std::size_t gpu_, std::unique_ptr<Renderer::VulkanRenderer> device_owner_,
+                       CreateRenderer create_renderer_, const ServerSettings& settings_,
+                       std::mutex& load_mutex_, ReportCallback report_)
+        : gpu(gpu_), create_renderer(std::move(create_renderer_)), settings(settings_),
+          load_mutex(load_mutex_), report(std::move(report_)), frame_writer(""),
+          device_owner(std::move(device_owner_)),
+          thread{[this](std::stop_token stop_token) { Run(stop_token); }} {}
+
+    void Push(RenderJob job) {
+        std::scoped_lock lock{mutex};
+        queue.push_back(std::move(job));
+        cv.notify_all();
+    }
+
+    // Whether the scene is resident on this GPU, or will be once its queued jobs are done
+    bool HasScene(const Renderer::SceneCache::Key& hash) const {
+        std::scoped_lock lock{mutex};
+        return std::ranges::find(resident_hashes, hash) != resident_hashes.end() ||
+               std::ranges::find(queue, hash, &RenderJob::scene_hash) != queue.end();
+    }
+
+    // Jobs queued or being rendered
+    std::size_t GetLoad() const {
+        std::scoped_lock lock{mutex};
+        return queue.size() + num_active;
+    }
+
+private:
+    // Names and samples of the frames read back, in order
+    using PendingFrames = std::deque<std::pair<std::string, std::size_t>>;
+    struct ResidentScene {
+        Renderer::SceneCache::Key hash;
+        std::unique_ptr<PendingFrames> pending_frames; // Of the renderer's frame callback
+        std::unique_ptr<Renderer::VulkanRenderer> renderer;
+        bool in_use{}; // By an active job
+    };
+    struct ActiveJob {
+        RenderJob job;
+        ResidentScene* scene{};
+        std::vector<std::unique_ptr<Renderer::Camera>> loaded_cameras;
+        std::vector<const Renderer::Camera*> cameras;
+        std::size_t camera{}; // Being rendered
+        std::size_t frame{};  // Of the camera
+        double camera_time{}; // Seconds spent drawing the frames of the camera
+        double used_time{};   // Of the whole job, weighed by its priority for the fair share
+    };
+
+    void Run(std::stop_token stop_token) {
+        if (!device_owner) {
+            try {
+                auto owner = create_renderer();
+                owner->SetPhysicalDevice(gpu);
+                owner->Init(VK_NULL_HANDLE, settings.extent);
+                device_owner = std::move(owner);
+            } catch (std::exception& e) {
+                SPDLOG_ERROR("Failed to set up GPU {}: {}", gpu, e.what());
+            }
+        }
+        while (true) {
+            std::vector<RenderJob> admitted;
+            {
+                std::unique_lock lock{mutex};
+                if (active.empty()) {
+                    cv.wait(lock, stop_token, [this] { return !queue.empty(); });
+                    if (queue.empty()) { // Stop requested, and every job rendered
+                        return;
+                    }
+                }
+                admitted = Admit();
+                num_active += admitted.size();
+            }
+            for (auto& job : admitted) {
+                try {
+                    Start(std::move(job));
+                } catch (std::exception& e) {
+                    SPDLOG_ERROR("Failed to start job {} on GPU {}: {}", job.id, gpu, e.what());
+                    Finish(job.id, false);
+                }
+            }
+            if (active.empty()) {
+                continue;
+            }
+
+            const auto next = std::ranges::min_element(active, {}, &ActiveJob::used_time);
+            bool done = false, succeeded = false;
+            try {
+                done = succeeded = Step(*next);
+            } catch (std::exception& e) {
+                SPDLOG_ERROR("Failed to render job {} on GPU {}: {}", next->job.id, gpu,
+                             e.what());
+                done = true;
+            }
+            if (done) {
+                next->scene->in_use = false;
+                const u64 id = next->job.id;
+                active.erase(next);
+                Finish(id, succeeded);
+            }
+        }
+    }
+
+    // Takes the queued jobs to render along with the active ones, in order, skipping those whose
+    // scene is in use, as its renderer accumulates one view at a time. Holds the mutex.
+    std::vector<RenderJob> Admit() {
+        std::vector<RenderJob> admitted;
+        std::vector<Renderer::SceneCache::Key> in_use;
+        for (const auto& active_job : active) {
+            in_use.emplace_back(active_job.job.scene_hash);
+        }
+        for (auto it = queue.begin();
+             it != queue.end() && active.size() + admitted.size() < settings.max_tenants;) {
+            if (std::ranges::find(in_use, it->scene_hash) != in_use.end()) {
+                ++it;
+                continue;
+            }
+            in_use.emplace_back(it->scene_hash);
+            admitted.emplace_back(std::move(*it));
+            it = queue.erase(it);
+        }
+        return admitted;
+    }
+
+    void Finish(u64 id, bool succeeded) {
+        {
+            std::scoped_lock lock{mutex};
+            --num_active;
+        }
+        report(id, succeeded);
+    }
+
+    void Start(RenderJob job) {
+        if (!device_owner) {
+            throw std::runtime_error("GPU is not set up");
+        }
+        ActiveJob active_job{.scene = &GetScene(job)};
+        active_job.scene->in_use = true;
+        SCOPE_EXIT({
+            if (active_job.scene) { // Not started
+                active_job.scene->in_use = false;
+            }
+        });
+
+        if (job.camera_list) {
+            active_job.loaded_cameras = LoadCameraList(*job.camera_list);
+            for (const auto& camera : active_job.loaded_cameras) {
+                active_job.cameras.emplace_back(camera.get());
+            }
+        } else {
+            for (const auto& camera : active_job.scene->renderer->GetSubScene().cameras) {
+                active_job.cameras.emplace_back(camera.get());
+            }
+        }
+        std::filesystem::create_directories(job.output_dir);
+
+        // Joins the others where they are, rather than catching up on the time they have used
+        if (!active.empty()) {
+            active_job.used_time = std::ranges::min_element(active, {}, &ActiveJob::used_time)
+                                       ->used_time;
+        }
+        active_job.job = std::move(job);
+        active.emplace_back(std::move(active_job));
+        active_job.scene = nullptr;
+    }
+
+    // Draws the next frame of the job, and returns whether all of its cameras are rendered.
+    // Only the last frame of each camera is read back, as in batches.
+    bool Step(ActiveJob& active_job) {
+        auto& renderer = *active_job.scene->renderer;
+        auto* path_tracer =
+            settings.path_tracer ? static_cast<Renderer::VulkanPathTracerHW*>(&renderer) : nullptr;
+        if (active_job.camera < active_job.cameras.size()) {
+            if (active_job.frame == 0 && path_tracer) {
+                // An earlier job may have left it on the same view
+                path_tracer->ResetAccumulation();
+            }
+            const std::size_t frames_per_camera = active_job.job.frames_per_camera != 0
+                                                      ? active_job.job.frames_per_camera
+                                                      : settings.frames_per_camera;
+            const bool last =
+                (frames_per_camera != 0 && active_job.frame + 1 >= frames_per_camera) ||
+                (settings.time_budget > 0 && active_job.camera_time >= settings.time_budget);
+
+            const auto start_time = std::chrono::steady_clock::now();
+            renderer.SetFrameReadback(last);
+            renderer.DrawFrame(*active_job.cameras[active_job.camera], true);
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start_time;
+            active_job.camera_time += elapsed.count();
+            active_job.used_time += elapsed.count() / active_job.job.priority;
+            if (!last) {
+                ++active_job.frame;
+                return false;
+            }
+
+            const bool exr = settings.export_exr && path_tracer;
+            active_job.scene->pending_frames->push_back({
+                (active_job.job.output_dir /
+                 fmt::format("view_{:04}.{}", active_job.camera, exr ? "exr" : "ppm"))
+                    .string(),
+                exr ? path_tracer->GetAccumulatedSamples() : 0,
+            });
+            ++active_job.camera;
+            active_job.frame = 0;
+            active_job.camera_time = 0;
+            if (active_job.camera < active_job.cameras.size()) {
+                return false;
+            }
+        }
+        renderer.FlushFrames();
+        SPDLOG_INFO("Rendered job {} with {} cameras on GPU {}", active_job.job.id,
+                    active_job.cameras.size(), gpu);
+        return true;
+    }
+
+    // The scene of the job, loading it unless resident
+    ResidentScene& GetScene(RenderJob& job) {
+        const auto it = std::ranges::find(scenes, job.scene_hash, &ResidentScene::hash);
+        if (it != scenes.end()) {
+            SPDLOG_INFO("Scene {} of job {} is resident on GPU {}", job.scene_path.string(),
+                        job.id, gpu);
+            scenes.splice(scenes.begin(), scenes, it);
+            return scenes.front();
+        }
+
+        Evict(0);
+        auto renderer = create_renderer();
+        renderer->ShareDevice(*device_owner);
+        renderer->Init(VK_NULL_HANDLE, settings.extent);
+        auto pending_frames = std::make_unique<PendingFrames>();
+        renderer->SetFrameCallback(
+            [this, pending = pending_frames.get()](
+                const Renderer::VulkanSwapchain::ReadbackFrame& frame) {
+                auto [name, samples] = std::move(pending->front());
+                pending->pop_front();
+                frame_writer.Push(std::move(name), frame, samples);
+            },
+            settings.export_exr && settings.path_tracer);
+        {
+            std::scoped_lock lock{load_mutex}; // Loading changes the working directory
+            renderer->LoadScene(*job.gltf);
+        }
+        job.gltf.reset();
+        renderer->TrimHostMemory();
+        if (settings.path_tracer) {
+            static_cast<Renderer::VulkanPathTracerHW&>(*renderer).SetCameraProperties(
+                settings.focal_dist, settings.aperture);
+        }
+
+        scenes.push_front({
+            .hash = job.scene_hash,
+            .pending_frames = std::move(pending_frames),
+            .renderer = std::move(renderer),
+        });
+        {
+            std::scoped_lock lock{mutex};
+            resident_hashes.emplace_back(job.scene_hash);
+        }
+        Evict(1);
+        return scenes.front();
+    }
+
+    // Unloads the least recently used scenes that are not in use but the most recent num_kept,
+    // while the memory in use exceeds the budget
+    void Evict(std::size_t num_kept) {
+        static constexpr double MiB = 1024.0 * 1024.0;
+        while (scenes.size() > num_kept) {
+            const auto usage = device_owner->GetMemoryUsage();
+            const vk::DeviceSize budget =
+                settings.resident_budget != 0 ? settings.resident_budget : usage.device_budget;
+            if (usage.device_usage <= budget) {
+                break;
+            }
+            const auto unused = std::find_if(std::next(scenes.begin(), num_kept), scenes.end(),
+                                             [](const ResidentScene& scene) {
+                                                 return !scene.in_use;
+                                             });
+            if (unused == scenes.end()) {
+                break;
+            }
+            // The least recently used of them
+            auto evicted = unused;
+            for (auto it = unused; it != scenes.end(); ++it) {
+                if (!it->in_use) {
+                    evicted = it;
+                }
+            }
+            SPDLOG_INFO("Unloading a scene from GPU {}, {:.1f} MiB in use of {:.1f} MiB", gpu,
+                        usage.device_usage / MiB, budget / MiB);
+            {
+                std::scoped_lock lock{mutex};
+                resident_hashes.erase(std::ranges::find(resident_hashes, evicted->hash));
+            }
+            scenes.erase(evicted);
+        }
+    }
+
+    std::size_t gpu{};
+    CreateRenderer create_renderer;
+    ServerSettings settings;
+    std::mutex& load_mutex;
+    ReportCallback report;
+
+    // Declared before the renderers, which deliver frames to it until they are destroyed
+    FrameWriter frame_writer; // Of absolute paths
+    std::unique_ptr<Renderer::VulkanRenderer> device_owner; // Outlives the scenes sharing it
+    std::list<ResidentScene> scenes;                        // Most recently used first
+    std::list<ActiveJob> active; // Of the thread of the GPU, see num_active
+
+    mutable std::mutex mutex;
+    std::condition_variable_any cv;
+    std::deque<RenderJob> queue;
+    std::vector<Renderer::SceneCache::Key> resident_hashes; // Of scenes, for HasScene
+    std::size_t num_active{};
+    std::jthread thread; // Declared last to stop before the rest is destroyed
+};
+
+// Serves the render jobs read from the standard input, one per line (see RenderJob), until it
+// ends, e.g. from a pipe the jobs of a render farm are written to. Each job goes to a GPU its
+// scene is resident on or queued for, the least busy of them, or else to the least busy GPU,
+// which renders it along with its other jobs (see ServerGPU).
+// Its completion is reported on the standard output as 'done ID' or 'failed ID', ID being its
+// line. The device owner is the initialized renderer of the first GPU.
+static int RunServer(std::unique_ptr<Renderer::VulkanRenderer> device_owner,
+                     const ServerGPU::CreateRenderer& create_renderer, std::size_t num_gpus,
+                     const ServerSettings& settings) {
+    std::mutex load_mutex, report_mutex;
+    const auto Report = [&report_mutex](u64 id, bool succeeded) {
+        std::scoped_lock lock{report_mutex};
+        std::cout << (succeeded ? "done " : "failed ") << id << std::endl;
+    };
+    std::vector<std::unique_ptr<ServerGPU>> gpus;
+    for (std::size_t gpu = 0; gpu < num_gpus; ++gpu) {
+        gpus.emplace_back(std::make_unique<ServerGPU>(
+            gpu, gpu == 0 ? std::move(device_owner) : nullptr, create_renderer, settings,
+            load_mutex, Report));
+    }
+    SPDLOG_INFO("Serving render jobs on {} GPUs", num_gpus);
+
+    std::string line;
+    for (u64 id = 1; std::getline(std::cin, line); ++id) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::optional<RenderJob> job;
+        try {
+            // Relative paths are resolved against the working directory, which loads change
+            std::scoped_lock lock{load_mutex};
+            job = ParseRenderJob(line, id);
+            if (!job) {
+                SPDLOG_ERROR("Invalid render job: {}", line);
+            } else {
+                job->gltf = std::make_unique<GLTF::Container>(job->scene_path);
+                job->scene_hash = Renderer::GLTFSnapshot{*job->gltf}.GetHash();
+            }
+        } catch (std::exception& e) {
+            SPDLOG_ERROR("Failed to open the scene of job {}: {}", id, e.what());
+            job.reset();
+        }
+        if (!job) {
+            Report(id, false);
+            continue;
+        }
+
+        ServerGPU* target = nullptr;
+        for (const auto& gpu : gpus) {
+            if (gpu->HasScene(job->scene_hash) && (!target || gpu->GetLoad() < target->GetLoad())) {
+                target = gpu.get();
+            }
+        }
+        if (!target) {
+            target = std::ranges::min_element(gpus, {}, [](const auto& gpu) {
+                         return gpu->GetLoad();
+                     })->get();
+        }
+        target->Push(std::move(*job));
+    }
+    return 0; // The GPUs render the queued jobs before they are destroyed
+}
+
+// In the order of F1-F6
+static constexpr std::array<std::string_view, 6> IntegratorNames{{
+    "path",
+    "ao",
+    "direct",
+    "albedo",
+    "normals",
+    "bounces",
+}};
+
+static std::optional<Renderer::VulkanPathTracerHW::Integrator> ParseIntegrator(
+    std::string_view name) {
+    const auto it = std::ranges::find(IntegratorNames, name);
+    if (it == IntegratorNames.end()) {
+        return std::nullopt;
+    }
+    return static_cast<Renderer::VulkanPathTracerHW::Integrator>(it - IntegratorNames.begin());
+}
+
 static void PrintHelp(const char* argv0) {
     std::cout
         << "Usage: " << argv0
         << " [options] <filename>\n"
-           "-b, --backend=BACKEND Selects the renderer to use ('rasterizer' or 'path_tracer_hw')\n"
+           "-b, --backend=BACKEND Selects the renderer to use ('rasterizer', 'meshlet', "
+           "'path_tracer_hw',\n"
+           "                      'path_tracer_wavefront', 'path_tracer_hybrid', which\n"
+           "                      rasterizes the primary hits of path_tracer_wavefront, or\n"
+           "                      'path_tracer_cpu', which traces on the CPU for render nodes\n"
+           "                      without ray tracing GPUs, or 'path_tracer_compute', which\n"
+           "                      traces the same in compute shaders, or 'auto', the fastest\n"
+           "                      path tracer the device supports). Backends the device cannot\n"
+           "                      run fall back to the rasterizer or path_tracer_compute\n"
            "-r, --raytrace        Selects the 'path_tracer_hw' backend\n"
+           "    --switch-backend  Lets F7 switch between the rasterizer and path_tracer_hw\n"
+           "                      (or path_tracer_wavefront, path_tracer_hybrid), which share\n"
+           "                      the device and the scene loaded once (window only, not\n"
+           "                      with -t, -z, -l)\n"
            "-e, --ext-cam         Force external camera\n"
            "-v, --viewport        Sets viewport resolution (<width>x<height>, default 1600x1200)\n"
-           "-h, --help            Display this help and exit\n\n"
-           "path_tracer_hw Options:\n"
+           "-j, --threads         Sets number of scene loading threads (default 0 = all cores,\n"
+           "                      1 = load serially)\n"
+           "-c, --compress-textures\n"
+           "                      Block compress textures (BC4/BC5/BC7) while loading\n"
+           "-t, --texture-budget  Streams texture levels on demand within this many MiB of\n"
+           "                      device memory (default 0 = load all levels up front)\n"
+           "    --host-cache=MIB  Keeps streamed texture levels and meshes in this much host\n"
+           "                      memory, uploading them from it again once evicted (default\n"
+           "                      0 = none)\n"
+           "-l, --lazy-textures   Loads textures in the background, showing placeholders until\n"
+           "                      they are ready\n"
+           "    --max-texture-size=N Loads textures at most N texels on either side, dropping\n"
+           "                      their finer mip levels (default 0 = full size)\n"
+           "    --drop-mips=N     Drops the N finest mip levels of every texture while loading\n"
+           "    --texture-memory=MIB Drops the finer mip levels of every texture while loading\n"
+           "                      until they fit in about this many MiB (default 0 = no limit)\n"
+           "-O, --optimize-indices\n"
+           "                      Reorders triangles for the vertex cache while loading\n"
+           "    --spatial-order   Sorts triangles and instances along a Morton curve while\n"
+           "                      loading, for coherent ray tracing\n"
+           "    --pack-vertices   Stores the vertices generated while loading (e.g. with\n"
+           "                      tangents) with packed normals, texcoords and colors\n"
+           "    --gpu-tangents=N  Generates the tangents of primitives of at least N triangles\n"
+           "                      on the GPU instead of with MikkTSpace, which differ slightly\n"
+           "                      (default 0 = none)\n"
+           "    --gpu-jpeg        Finishes decoding JPEG textures on the GPU (not with -c, -t)\n"
+           "-y, --dynamic-res=MS  Lowers the resolution while frames take longer than this many\n"
+           "                      milliseconds on the GPU, upscaling them (path tracers only\n"
+           "                      while the camera moves)\n"
+           "-G, --gpu-profile     Measures the GPU time of the passes of each frame, shown in\n"
+           "                      the window title or logged once headless rendering is done\n"
+           "-x, --exposure=STOPS  Brightens the frames by this many stops, or darkens them if\n"
+           "                      negative (default 0)\n"
+           "-k, --tonemap         Tonemaps the frames with a filmic curve instead of clipping\n"
+           "                      what is brighter than white\n"
+           "    --stereo=DISTANCE Renders both eyes side by side, this far apart in scene\n"
+           "                      units, for side by side headsets and displays (rasterizer\n"
+           "                      only)\n"
+           "-I, --in-flight=N     Records up to this many frames while the GPU renders earlier\n"
+           "                      ones (default 2)\n"
+           "-u, --pacing=MODE     Presents the frames as fast as they are rendered ('throughput',\n"
+           "                      the default), in sync with the display, starting each once the\n"
+           "                      last is shown ('latency', which shows the measured latency in\n"
+           "                      the window title) or without waiting for it ('immediate')\n"
+           "    --device=ID       Renders on the GPU of this index (in enumeration order) or\n"
+           "                      UUID instead of the best one found (not with --gpus)\n"
+           "-U, --descriptor-buffer\n"
+           "                      Writes descriptors into a descriptor buffer instead of\n"
+           "                      descriptor sets, where the device supports it\n"
+           "    --defragment      Compacts device memory on idle frames once loading or\n"
+           "                      streaming has fragmented it (path tracer only)\n"
+           "    --stats=PATH      Writes the statistics of the scene once loaded to PATH as\n"
+           "                      JSON: triangles, vertex and texture bytes, draws and\n"
+           "                      acceleration structure sizes, and logs a summary\n"
+           "    --remote-cache=DIR Caches what is fetched of remote scenes (https:// or s3://\n"
+           "                      filenames, when built with ENABLE_REMOTE_SCENES) in DIR,\n"
+           "                      empty disables it (default the temporary directory)\n"
+           "-w, --watch           Reloads the scene when the file changes, only updating what\n"
+           "                      changed\n"
+           "-Y, --animate=FPS     Plays the animations of the file, in real time in the window\n"
+           "                      and at this many frames per second when headless\n"
+           "-H, --headless        Renders without a window, writing the frames as PPM files\n"
+           "    --encode=FILE     Also encodes the headless frames to H.264 on the GPU, writing\n"
+           "                      the Annex B stream to FILE (needs Vulkan Video encoding)\n"
+           "    --bitrate=KBPS    Sets bitrate of --encode in kbit/s (default 20000)\n"
+           "-B, --batch=CAMERAS   Renders one headless image per camera, from a file of camera\n"
+           "                      poses (see LoadCameraList) or 'scene' for every camera in\n"
+           "                      the scene\n"
+           "-n, --frames          Sets number of frames to render when headless, per camera in\n"
+           "                      batches (default 1, unless there is a time budget)\n"
+           "-T, --time-budget     Sets seconds to render each camera of a batch for\n"
+           "-g, --gpus            Splits the samples of a batch over this many GPUs, the first\n"
+           "                      ones enumerated (path_tracer_hw only, default 1), or the\n"
+           "                      jobs of a server\n"
+           "    --serve           Renders jobs read from stdin until it ends, one per line of\n"
+           "                      tab separated fields: the glTF file, the cameras (as for\n"
+           "                      --batch), the output directory and optionally the frames\n"
+           "                      per camera and a priority (default 1). Scenes stay loaded\n"
+           "                      on their GPU for later jobs of the same contents. Completed\n"
+           "                      jobs are reported on stdout as 'done LINE' or 'failed LINE'\n"
+           "    --resident-budget Sets MiB of device memory of each GPU to keep scenes loaded\n"
+           "                      within, unloading the least recently used (default 0 = the\n"
+           "                      budget of the device)\n"
+           "    --tenants=N       Renders up to N jobs of different scenes at once on each GPU\n"
+           "                      of a server, interleaving their frames by their priorities\n"
+           "                      (default 1)\n"
+           "-o, --output          Sets directory of the headless frames, captures and\n"
+           "                      benchmark results (default current)\n"
+           "    --capture=FORMAT  Sets format of the frames captured with F12, 'png'\n"
+           "                      (tonemapped like presented, default) or 'exr' (linear)\n"
+           "-q, --bench=PATH      Plays a camera path through the poses of a file (see\n"
+           "                      LoadCameraPoses) over --frames frames (default 600), with\n"
+           "                      fixed seeds and work per frame and without vsync, writing\n"
+           "                      the CPU and GPU time and memory of each frame and their\n"
+           "                      percentiles as CSV files, then exits\n"
+           "-V, --converge=REFERENCE\n"
+           "                      Renders headless for --time-budget seconds (default 60),\n"
+           "                      writing the RMSE and relative MSE against a reference\n"
+           "                      OpenEXR file at doubling times to converge.csv, and the\n"
+           "                      frames measured as EXR files, then exits (path tracers only)\n"
+           "-X, --exr             Writes the headless frames as OpenEXR files of the sums of\n"
+           "                      their samples and their numbers, which sample_merge merges\n"
+           "                      (path tracers only)\n"
+           "-J, --job=ID          Traces the samples of job ID, which the jobs of a frame on\n"
+           "                      other machines do not trace, so that their EXR files can be\n"
+           "                      merged. With --gpus, each GPU takes a job of its own:\n"
+           "                      ID * GPUs + GPU (path tracers only, default 0)\n"
+           "-h, --help            Display this help and exit\n"
+           "Page Up/Down switch between the scenes of the file. F1-F6 switch the integrator of\n"
+           "the path tracers, see --integrator. F7 switches between the rasterizer and\n"
+           "the path tracer, see --switch-backend. F8 logs what the center of the view hits,\n"
+           "see --picking. F9 writes the device memory in\n"
+           "use per category, its peaks and the statistics of VMA to memory_report.json. F12\n"
+           "captures the next frame as it was rendered into capture_NNNN.png in the output\n"
+           "directory, read back without stalling.\n\n"
+           "rasterizer Options:\n"
+           "-d, --depth-prepass   Draws the depth before shading, so each pixel is shaded once\n"
+           "    --visibility-buffer Draws the triangles of each pixel, then shades the pixels\n"
+           "                      in a compute pass, so each is shaded once (overrides -d)\n"
+           "    --probe-gi        Lights the pixels indirectly too, from a grid of probes that\n"
+           "                      trace a few rays each frame (needs ray queries)\n"
+           "    --variable-rate-shading Shades the smooth regions of the previous frame at\n"
+           "                      coarser rates, and alpha tested materials at the full rate\n"
+           "                      (not with --visibility-buffer)\n"
+           "-L, --lods            Generates levels of detail while loading, drawing distant\n"
+           "                      meshes with fewer triangles\n"
+           "-z, --geometry-budget Streams meshes on demand within this many MiB of device\n"
+           "                      memory, the nearest and largest on screen first (default 0 =\n"
+           "                      load all meshes up front)\n\n"
+           "path_tracer_hw, path_tracer_wavefront, path_tracer_hybrid, path_tracer_cpu and "
+           "path_tracer_compute Options:\n"
            "-i, --intensity       Sets intensity multiplier (path_tracer_hw only, default 20.0)\n"
            "-a, --ambient         Set ambient light (path_tracer_hw only, default 5.0)\n"
            "-f, --focal           Enables depth of field and sets focal length\n"
-           "-p, --aperture        Sets camera aperture (default 0.5)";
+           "-p, --aperture        Sets camera aperture (default 0.5)\n"
+           "-A, --host-builds     Builds acceleration structures on the CPU where the driver\n"
+           "                      supports it, leaving the GPU free\n"
+           "-F, --fast-builds     Builds acceleration structures for speed while loading, and\n"
+           "                      rebuilds them for tracing speed in the background\n"
+           "    --progressive-builds Shows the scene once the first meshes are built, building\n"
+           "                      the rest in the background and adding them as they are\n"
+           "    --gpu-instances   Writes the instances of the TLAS on the GPU, for scenes of\n"
+           "                      very many instances\n"
+           "    --cull-distance=M Leaves instances farther than M from the camera out of the\n"
+           "                      TLAS, rebuilding it as the camera moves (implies\n"
+           "                      --gpu-instances)\n"
+           "    --cull-size=R     Leaves instances out of the TLAS whose radius is below R times\n"
+           "                      their distance (implies --gpu-instances)\n"
+           "-E, --adaptive=ERROR  Stops tracing pixels once the relative error of their mean is\n"
+           "                      below ERROR, e.g. 0.01 (path_tracer_hw only)\n"
+           "-s, --samples         Sets samples per pixel each frame (default 8)\n"
+           "-m, --max-depth       Sets bounces of each path (default 50)\n"
+           "-R, --roulette        Sets the lowest probability of a path going on at each bounce\n"
+           "                      past the roulette depth, darker paths ending sooner, 1\n"
+           "                      disables Russian roulette (default 0.1)\n"
+           "    --roulette-depth  Sets bounces of each path before Russian roulette (default 3)\n"
+           "-P, --target-ms       Adjusts the samples of each frame so that tracing takes about\n"
+           "                      this many milliseconds, 0 disables (default 12, 0 if headless)\n"
+           "-Q, --tiles=SIZE      Traces each frame in tiles of SIZE pixels from the center\n"
+           "                      out, over submissions of about --submit-ms each\n"
+           "                      (path_tracer_hw only)\n"
+           "-K, --submit-ms       Sets milliseconds of each submission of tiles (default 8)\n"
+           "    --trace-passes=N  Traces N passes of the samples of each frame (each of about\n"
+           "                      --target-ms) before presenting it while the camera is still,\n"
+           "                      for final renders to not wait on vsync (path_tracer_hw and\n"
+           "                      wavefront only, not with --tiles, default 1, at most 16)\n"
+           "-Z, --ray-stats       Counts the rays of each frame, shown in the window title as\n"
+           "                      Mrays/s or logged once headless rendering is done\n"
+           "                      (path_tracer_hw only)\n"
+           "-C, --heatmap         Presents the clock cycles spent on each pixel instead of the\n"
+           "                      image, and logs those of the materials at exit\n"
+           "                      (path_tracer_hw only)\n"
+           "-D, --denoise         Filters the accumulated image before presenting it, guided\n"
+           "                      by the albedo and normal of the first hits\n"
+           "    --fixed-rate-denoise\n"
+           "                      Compresses the images of the denoiser at a fixed rate,\n"
+           "                      lossily, for less bandwidth where the device can\n"
+           "-W, --reproject       Reuses the accumulation where the first hits were seen\n"
+           "                      before the camera moved, instead of starting over\n"
+           "    --restir=N        Resamples the light sample of each first hit from N\n"
+           "                      candidates and those of the last frame nearby (ReSTIR),\n"
+           "                      for scenes of many lights, e.g. 8 (path_tracer_hw only)\n"
+           "    --guide           Samples bounces from the directions radiance was found to\n"
+           "                      arrive from, learned as the frames are traced, for indirect\n"
+           "                      lighting through small openings (path_tracer_hw only)\n"
+           "    --integrator=MODE Traces full paths ('path', default), or previews ending them\n"
+           "                      at the first hits: 'ao', 'direct' lighting, 'albedo' or\n"
+           "                      'normals', or full paths of 3 'bounces' at most. F1-F6\n"
+           "                      switch between them (path_tracer_hw only)\n"
+           "    --preview=MODE    Traces this --integrator instead while the camera moves,\n"
+           "                      e.g. 'direct' on large scenes (path_tracer_hw only)\n"
+           "    --picking         Lets F8 trace a ray from the free camera and log the instance\n"
+           "                      it hits, and how far (needs ray queries)\n"
+           "-M, --envmap          Lights the scene with an equirectangular HDR image (.hdr)\n"
+           "                      instead of the ambient light\n"
+           "-N, --env-intensity   Sets intensity of the environment map (default 1.0)\n"
+           "-S, --seed            Scrambles the samples with this seed, for reproducible\n"
+           "                      images (default random, 0 for jobs and GPUs of a batch)\n"
+           "    --checkpoint=FILE Writes the accumulation to FILE every --checkpoint-interval\n"
+           "                      seconds, and resumes from it where it was written for the\n"
+           "                      same scene, settings, camera and size, e.g. after the\n"
+           "                      process was stopped (not with batches or --gpus)\n"
+           "    --checkpoint-interval Sets seconds between checkpoints (default 300)\n"
+           "    --target-spp=N    Stops tracing once each pixel has N samples, or once\n"
+           "                      --adaptive stops tracing every pixel, leaving the image\n"
+           "                      presented until the camera moves or the scene changes\n"
+           "                      (window only)";
 }
 
 int main(int argc, char* argv[]) {
     Common::InitializeLogging();
 
+    // Of the options without a short one, out of the range of characters
+    constexpr int PackVerticesOption = 256;
+    constexpr int RouletteDepthOption = 257;
+    constexpr int VisibilityBufferOption = 258;
+    constexpr int ProgressiveBuildsOption = 259;
+    constexpr int CaptureOption = 260;
+    constexpr int CheckpointOption = 261;
+    constexpr int CheckpointIntervalOption = 262;
+    constexpr int TargetSamplesOption = 263;
+    constexpr int MaxTextureSizeOption = 264;
+    constexpr int DropMipsOption = 265;
+    constexpr int TextureMemoryOption = 266;
+    constexpr int DefragmentOption = 267;
+    constexpr int GPUInstancesOption = 268;
+    constexpr int CullDistanceOption = 269;
+    constexpr int CullSizeOption = 270;
+    constexpr int StatsOption = 271;
+    constexpr int ServeOption = 272;
+    constexpr int ResidentBudgetOption = 273;
+    constexpr int TenantsOption = 274;
+    constexpr int ReSTIROption = 275;
+    constexpr int GuideOption = 276;
+    constexpr int ProbeGIOption = 277;
+    constexpr int IntegratorOption = 278;
+    constexpr int PreviewOption = 279;
+    constexpr int PickingOption = 280;
+    constexpr int EncodeOption = 281;
+    constexpr int BitrateOption = 282;
+    constexpr int RemoteCacheOption = 283;
+    constexpr int GPUTangentsOption = 284;
+    constexpr int DeviceOption = 285;
+    constexpr int SpatialOrderOption = 286;
+    constexpr int VariableRateShadingOption = 287;
+    constexpr int StereoOption = 288;
+    constexpr int HostCacheOption = 289;
+    constexpr int GPUJPEGOption = 290;
+    constexpr int SwitchBackendOption = 291;
+    constexpr int TracePassesOption = 292;
+    constexpr int FixedRateDenoiseOption = 293;
     static struct option long_options[] = {
         {"backend", required_argument, 0, 'b'}, {"raytrace", no_argument, 0, 'r'},
         {"ext-cam", no_argument, 0, 'e'},       {"intensity", required_argument, 0, 'i'},
+        {"switch-backend", no_argument, 0, SwitchBackendOption},
         {"ambient", required_argument, 0, 'a'}, {"viewport", required_argument, 0, 'v'},
         {"focal", required_argument, 0, 'f'},   {"aperture", required_argument, 0, 'p'},
-        {"help", no_argument, 0, 'h'},          {0, 0, 0, 0},
+        {"threads", required_argument, 0, 'j'}, {"compress-textures", no_argument, 0, 'c'},
+        {"texture-budget", required_argument, 0, 't'}, {"lazy-textures", no_argument, 0, 'l'},
+        {"watch", no_argument, 0, 'w'},         {"headless", no_argument, 0, 'H'},
+        {"animate", required_argument, 0, 'Y'}, {"optimize-indices", no_argument, 0, 'O'},
+        {"pack-vertices", no_argument, 0, PackVerticesOption},
+        {"gpu-tangents", required_argument, 0, GPUTangentsOption},
+        {"gpu-jpeg", no_argument, 0, GPUJPEGOption},
+        {"spatial-order", no_argument, 0, SpatialOrderOption},
+        {"device", required_argument, 0, DeviceOption},
+        {"max-texture-size", required_argument, 0, MaxTextureSizeOption},
+        {"drop-mips", required_argument, 0, DropMipsOption},
+        {"texture-memory", required_argument, 0, TextureMemoryOption},
+        {"defragment", no_argument, 0, DefragmentOption},
+        {"stats", required_argument, 0, StatsOption},
+        {"serve", no_argument, 0, ServeOption},
+        {"resident-budget", required_argument, 0, ResidentBudgetOption},
+        {"tenants", required_argument, 0, TenantsOption},
+        {"restir", required_argument, 0, ReSTIROption},
+        {"guide", no_argument, 0, GuideOption},
+        {"integrator", required_argument, 0, IntegratorOption},
+        {"preview", required_argument, 0, PreviewOption},
+        {"picking", no_argument, 0, PickingOption},
+        {"encode", required_argument, 0, EncodeOption},
+        {"bitrate", required_argument, 0, BitrateOption},
+        {"remote-cache", required_argument, 0, RemoteCacheOption},
+        {"frames", required_argument, 0, 'n'},  {"output", required_argument, 0, 'o'},
+        {"batch", required_argument, 0, 'B'},   {"time-budget", required_argument, 0, 'T'},
+        {"gpus", required_argument, 0, 'g'},    {"depth-prepass", no_argument, 0, 'd'},
+        {"lods", no_argument, 0, 'L'},          {"host-builds", no_argument, 0, 'A'},
+        {"geometry-budget", required_argument, 0, 'z'},
+        {"visibility-buffer", no_argument, 0, VisibilityBufferOption},
+        {"probe-gi", no_argument, 0, ProbeGIOption},
+        {"variable-rate-shading", no_argument, 0, VariableRateShadingOption},
+        {"stereo", required_argument, 0, StereoOption},
+        {"host-cache", required_argument, 0, HostCacheOption},
+        {"fast-builds", no_argument, 0, 'F'},   {"adaptive", required_argument, 0, 'E'},
+        {"progressive-builds", no_argument, 0, ProgressiveBuildsOption},
+        {"gpu-instances", no_argument, 0, GPUInstancesOption},
+        {"cull-distance", required_argument, 0, CullDistanceOption},
+        {"cull-size", required_argument, 0, CullSizeOption},
+        {"capture", required_argument, 0, CaptureOption},
+        {"checkpoint", required_argument, 0, CheckpointOption},
+        {"checkpoint-interval", required_argument, 0, CheckpointIntervalOption},
+        {"target-spp", required_argument, 0, TargetSamplesOption},
+        {"samples", required_argument, 0, 's'}, {"max-depth", required_argument, 0, 'm'},
+        {"roulette", required_argument, 0, 'R'}, {"target-ms", required_argument, 0, 'P'},
+        {"roulette-depth", required_argument, 0, RouletteDepthOption},
+        {"denoise", no_argument, 0, 'D'},       {"envmap", required_argument, 0, 'M'},
+        {"fixed-rate-denoise", no_argument, 0, FixedRateDenoiseOption},
+        {"env-intensity", required_argument, 0, 'N'}, {"seed", required_argument, 0, 'S'},
+        {"exr", no_argument, 0, 'X'},           {"job", required_argument, 0, 'J'},
+        {"reproject", no_argument, 0, 'W'},     {"dynamic-res", required_argument, 0, 'y'},
+        {"tiles", required_argument, 0, 'Q'},   {"submit-ms", required_argument, 0, 'K'},
+        {"trace-passes", required_argument, 0, TracePassesOption},
+        {"gpu-profile", no_argument, 0, 'G'},   {"heatmap", no_argument, 0, 'C'},
+        {"ray-stats", no_argument, 0, 'Z'},     {"exposure", required_argument, 0, 'x'},
+        {"tonemap", no_argument, 0, 'k'},       {"in-flight", required_argument, 0, 'I'},
+        {"pacing", required_argument, 0, 'u'}, {"descriptor-buffer", no_argument, 0, 'U'},
+        {"bench", required_argument, 0, 'q'},   {"converge", required_argument, 0, 'V'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
     };
 
     int option_index = 0;
     std::filesystem::path file_path = u8"scene.gltf";
-    bool use_raytracing = false, force_ext_cam = false;
+    bool use_raytracing = false, use_meshlets = false, force_ext_cam = false;
+    bool use_wavefront = false;     // Of the path tracers
+    bool use_cpu = false;           // Of the path tracers
+    bool use_compute = false;       // Of the path tracers
+    bool rasterize_primary = false; // Of the wavefront path tracer
+    bool auto_backend = false;      // Of the path tracers, picked for the device
+    bool switch_backend = false;    // Between the rasterizer and the path tracer
+    std::string device_id;          // Index or UUID, empty picks the best
+    bool compress_textures = false;
+    bool lazy_textures = false, watch = false, headless = false, depth_prepass = false;
+    bool lods = false, host_builds = false, fast_builds = false, denoise = false;
+    bool reproject = false, visibility_buffer = false, progressive_builds = false;
+    bool probe_gi = false, variable_rate_shading = false;
+    bool gpu_instances = false;
+    u32 restir_candidates = 0;
+    bool path_guiding = false;
+    bool picking = false;
+    auto integrator = Renderer::VulkanPathTracerHW::Integrator::PathTracing;
+    auto motion_integrator = Renderer::VulkanPathTracerHW::Integrator::PathTracing;
+    float cull_distance = 0, cull_size = 0;
+    bool optimize_indices = false, pack_vertices = false, spatial_order = false;
+    std::size_t gpu_tangent_triangles = 0;
+    bool gpu_image_decode = false;
+    bool gpu_profile = false;
+    float exposure = 0;
+    bool tonemap = false;
+    float eye_separation = 0;
+    bool cost_heatmap = false, ray_stats = false;
+    bool export_exr = false;
+    std::string capture_format = "png";
     int width = 1600, height = 1200;
+    std::size_t num_threads = 0;
+    std::size_t num_frames = 0; // Unset
+    double time_budget = 0;     // Unset
+    std::size_t num_gpus = 1;
+    std::size_t num_frames_in_flight = 2;
+    auto present_pacing = Renderer::VulkanSwapchain::Pacing::Throughput;
+    bool descriptor_buffer = false;
+    bool defragment = false;
+    std::filesystem::path stats_path;
+    bool serve = false;
+    std::size_t resident_budget_mib = 0;
+    std::size_t max_tenants = 1;
+    std::string batch_cameras;
+    std::filesystem::path bench_path;
+    std::filesystem::path converge_reference;
+    std::filesystem::path encode_path;
+    u32 encode_bitrate_kbps = 20'000;
+    std::optional<std::filesystem::path> remote_cache; // Unset
+    std::filesystem::path checkpoint_path;
+    double checkpoint_interval = 300;
+    std::filesystem::path output_dir = u8".";
+    std::filesystem::path environment_map;
+    float environment_intensity = 1.0;
+    std::size_t texture_budget_mib = 0;
+    std::size_t host_cache_mib = 0;
+    u32 max_texture_size = 0, dropped_mips = 0;
+    std::size_t texture_memory_mib = 0;
+    std::size_t geometry_budget_mib = 0;
+    double dynamic_resolution_ms = 0;
+    double animation_fps = 0; // Not animated
 
     float intensity = 20.0, ambient = 5.0;
     float aperture = 0.5;
+    float adaptive_threshold = 0;
+    u32 samples_per_frame = 8, max_depth = 50;
+    float russian_roulette = 0.1f;
+    u32 roulette_depth = 3;
+    u32 target_samples = 0;
+    std::optional<double> target_trace_time; // Unset
+    u32 tile_size = 0;
+    double submit_time = 8;
+    u32 trace_passes = 1;
+    bool fixed_rate_denoise = false;
+    std::optional<u32> sampler_seed;         // Unset
+    u32 job = 0;
     while (optind < argc) {
-        int arg = getopt_long(argc, argv, "b:rei:a:v:f:p:h", long_options, &option_index);
+        int arg =
+            getopt_long(argc, argv,
+                        "b:rei:a:v:f:p:j:ct:ly:Gx:kI:u:Uq:V:wHn:o:B:T:g:dLAFE:s:m:R:P:Q:K:CZDWM:N:"
+                        "S:XJ:z:Y:Oh",
+                        long_options, &option_index);
         if (arg == -1) {
             file_path = std::filesystem::u8path(argv[optind]);
             optind++;
         } else {
-            switch (static_cast<char>(arg)) {
+            switch (arg) {
             case 'b': {
                 const std::string_view backend = optarg;
+                use_wavefront = false;
+                use_cpu = false;
+                use_compute = false;
+                rasterize_primary = false;
+                auto_backend = false;
                 if (backend == "rasterizer") {
                     use_raytracing = false;
+                    use_meshlets = false;
+                } else if (backend == "meshlet") {
+                    use_raytracing = false;
+                    use_meshlets = true;
                 } else if (backend == "path_tracer_hw") {
                     use_raytracing = true;
+                    use_meshlets = false;
+                } else if (backend == "path_tracer_wavefront") {
+                    use_raytracing = true;
+                    use_meshlets = false;
+                    use_wavefront = true;
+                } else if (backend == "path_tracer_hybrid") {
+                    use_raytracing = true;
+                    use_meshlets = false;
+                    use_wavefront = true;
+                    rasterize_primary = true;
+                } else if (backend == "path_tracer_cpu") {
+                    use_raytracing = true;
+                    use_meshlets = false;
+                    use_cpu = true;
+                } else if (backend == "path_tracer_compute") {
+                    use_raytracing = true;
+                    use_meshlets = false;
+                    use_compute = true;
+                } else if (backend == "auto") {
+                    use_raytracing = true;
+                    use_meshlets = false;
+                    auto_backend = true;
                 } else {
                     std::cout << "Invalid backend!" << std::endl;
                     PrintHelp(argv[0]);
@@ -160,6 +1852,15 @@ int main(int argc, char* argv[]) {
             }
             case 'r':
                 use_raytracing = true;
+                use_meshlets = false;
+                use_wavefront = false;
+                use_cpu = false;
+                use_compute = false;
+                rasterize_primary = false;
+                auto_backend = false;
+                break;
+            case SwitchBackendOption:
+                switch_backend = true;
                 break;
             case 'e':
                 force_ext_cam = true;
@@ -176,6 +1877,271 @@ int main(int argc, char* argv[]) {
             case 'p':
                 aperture = std::stof(std::string{optarg});
                 break;
+            case 'j':
+                num_threads = std::stoul(std::string{optarg});
+                break;
+            case 'c':
+                compress_textures = true;
+                break;
+            case 't':
+                texture_budget_mib = std::stoul(std::string{optarg});
+                break;
+            case 'z':
+                geometry_budget_mib = std::stoul(std::string{optarg});
+                break;
+            case HostCacheOption:
+                host_cache_mib = std::stoul(std::string{optarg});
+                break;
+            case 'y':
+                dynamic_resolution_ms = std::stod(std::string{optarg});
+                break;
+            case 'l':
+                lazy_textures = true;
+                break;
+            case 'O':
+                optimize_indices = true;
+                break;
+            case PackVerticesOption:
+                pack_vertices = true;
+                break;
+            case GPUTangentsOption:
+                gpu_tangent_triangles = std::stoul(std::string{optarg});
+                break;
+            case GPUJPEGOption:
+                gpu_image_decode = true;
+                break;
+            case SpatialOrderOption:
+                spatial_order = true;
+                break;
+            case DeviceOption:
+                device_id = optarg;
+                break;
+            case MaxTextureSizeOption:
+                max_texture_size = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case DropMipsOption:
+                dropped_mips = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case TextureMemoryOption:
+                texture_memory_mib = std::stoul(std::string{optarg});
+                break;
+            case DefragmentOption:
+                defragment = true;
+                break;
+            case StatsOption:
+                stats_path = std::filesystem::u8path(optarg);
+                break;
+            case ServeOption:
+                serve = true;
+                break;
+            case ResidentBudgetOption:
+                resident_budget_mib = std::stoul(std::string{optarg});
+                break;
+            case TenantsOption:
+                max_tenants = std::max<std::size_t>(std::stoul(std::string{optarg}), 1);
+                break;
+            case ReSTIROption:
+                restir_candidates = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case GuideOption:
+                path_guiding = true;
+                break;
+            case PickingOption:
+                picking = true;
+                break;
+            case EncodeOption:
+                encode_path = std::filesystem::u8path(optarg);
+                break;
+            case BitrateOption:
+                encode_bitrate_kbps = std::max<u32>(std::stoul(std::string{optarg}), 1);
+                break;
+            case RemoteCacheOption:
+                remote_cache = std::filesystem::u8path(optarg);
+                break;
+            case IntegratorOption:
+            case PreviewOption: {
+                const auto parsed = ParseIntegrator(optarg);
+                if (!parsed) {
+                    std::cout << "Invalid integrator!" << std::endl;
+                    PrintHelp(argv[0]);
+                    return 0;
+                }
+                (arg == IntegratorOption ? integrator : motion_integrator) = *parsed;
+                break;
+            }
+            case 'G':
+                gpu_profile = true;
+                break;
+            case 'x':
+                exposure = std::stof(std::string{optarg});
+                break;
+            case 'k':
+                tonemap = true;
+                break;
+            case StereoOption:
+                eye_separation = std::stof(std::string{optarg});
+                break;
+            case 'I':
+                num_frames_in_flight = std::stoul(std::string{optarg});
+                break;
+            case 'u': {
+                const std::string_view pacing = optarg;
+                if (pacing == "throughput") {
+                    present_pacing = Renderer::VulkanSwapchain::Pacing::Throughput;
+                } else if (pacing == "latency") {
+                    present_pacing = Renderer::VulkanSwapchain::Pacing::LowLatency;
+                } else if (pacing == "immediate") {
+                    present_pacing = Renderer::VulkanSwapchain::Pacing::Immediate;
+                } else {
+                    std::cout << "Invalid pacing!" << std::endl;
+                    PrintHelp(argv[0]);
+                    return 0;
+                }
+                break;
+            }
+            case 'U':
+                descriptor_buffer = true;
+                break;
+            case 'w':
+                watch = true;
+                break;
+            case 'Y':
+                animation_fps = std::stod(std::string{optarg});
+                break;
+            case 'H':
+                headless = true;
+                break;
+            case 'n':
+                num_frames = std::stoul(std::string{optarg});
+                break;
+            case 'o':
+                output_dir = std::filesystem::u8path(optarg);
+                break;
+            case 'q':
+                bench_path = std::filesystem::u8path(optarg);
+                break;
+            case 'V':
+                converge_reference = std::filesystem::u8path(optarg);
+                break;
+            case 'B':
+                batch_cameras = optarg;
+                headless = true;
+                break;
+            case 'T':
+                time_budget = std::stod(std::string{optarg});
+                break;
+            case 'g':
+                num_gpus = std::max<std::size_t>(std::stoul(std::string{optarg}), 1);
+                break;
+            case 'd':
+                depth_prepass = true;
+                break;
+            case VisibilityBufferOption:
+                visibility_buffer = true;
+                break;
+            case ProbeGIOption:
+                probe_gi = true;
+                break;
+            case VariableRateShadingOption:
+                variable_rate_shading = true;
+                break;
+            case 'L':
+                lods = true;
+                break;
+            case 'A':
+                host_builds = true;
+                break;
+            case 'F':
+                fast_builds = true;
+                break;
+            case ProgressiveBuildsOption:
+                progressive_builds = true;
+                break;
+            case GPUInstancesOption:
+                gpu_instances = true;
+                break;
+            case CullDistanceOption:
+                cull_distance = std::stof(std::string{optarg});
+                gpu_instances = true;
+                break;
+            case CullSizeOption:
+                cull_size = std::stof(std::string{optarg});
+                gpu_instances = true;
+                break;
+            case 'E':
+                adaptive_threshold = std::stof(std::string{optarg});
+                break;
+            case 's':
+                samples_per_frame = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case 'm':
+                max_depth = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case 'R':
+                russian_roulette = std::stof(std::string{optarg});
+                break;
+            case RouletteDepthOption:
+                roulette_depth = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case TargetSamplesOption:
+                target_samples = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case 'P':
+                target_trace_time = std::stod(std::string{optarg});
+                break;
+            case 'Q':
+                tile_size = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case 'K':
+                submit_time = std::stod(std::string{optarg});
+                break;
+            case TracePassesOption:
+                trace_passes = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case 'C':
+                cost_heatmap = true;
+                break;
+            case 'Z':
+                ray_stats = true;
+                break;
+            case 'D':
+                denoise = true;
+                break;
+            case FixedRateDenoiseOption:
+                fixed_rate_denoise = true;
+                break;
+            case 'W':
+                reproject = true;
+                break;
+            case 'M':
+                environment_map = std::filesystem::u8path(optarg);
+                break;
+            case 'N':
+                environment_intensity = std::stof(std::string{optarg});
+                break;
+            case 'S':
+                sampler_seed = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case 'X':
+                export_exr = true;
+                break;
+            case CaptureOption:
+                capture_format = optarg;
+                if (capture_format != "png" && capture_format != "exr") {
+                    std::cout << "Invalid capture format!" << std::endl;
+                    PrintHelp(argv[0]);
+                    return 0;
+                }
+                break;
+            case 'J':
+                job = static_cast<u32>(std::stoul(std::string{optarg}));
+                break;
+            case CheckpointOption:
+                checkpoint_path = std::filesystem::u8path(optarg);
+                break;
+            case CheckpointIntervalOption:
+                checkpoint_interval = std::stod(std::string{optarg});
+                break;
             case 'v': {
                 std::string str{optarg};
                 const auto pos = str.find('x');
@@ -196,47 +2162,381 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    GLFWwindow* window = glfwCreateWindow(width, height, "Border Collie", nullptr, nullptr);
+    // Benchmarks are reproducible: seeded, with the same work for each frame, and not vsynced
+    const bool benchmark = !bench_path.empty();
+    std::vector<CameraPose> bench_poses;
+    if (benchmark) {
+        try {
+            bench_poses = LoadCameraPoses(bench_path);
+        } catch (std::exception& e) {
+            SPDLOG_ERROR("Failed to load the benchmark path: {}", e.what());
+            return 1;
+        }
+        if (bench_poses.empty()) {
+            SPDLOG_ERROR("No camera poses in the benchmark path");
+            return 1;
+        }
+        if (!batch_cameras.empty()) {
+            SPDLOG_WARN("Batches are not benchmarked, playing the path headless");
+            batch_cameras.clear();
+        }
+        static constexpr std::size_t DefaultBenchmarkFrames = 600;
+        if (num_frames == 0) {
+            num_frames = DefaultBenchmarkFrames;
+        }
+        time_budget = 0;
+        gpu_profile = true;
+        if (!sampler_seed) {
+            sampler_seed = 0;
+        }
+        if (!headless) {
+            present_pacing = Renderer::VulkanSwapchain::Pacing::Immediate;
+        }
+    }
+    // Convergence is measured against the wall time of a single seeded, headless render
+    const bool converge = !converge_reference.empty();
+    std::optional<Common::FloatImage> converge_image;
+    if (converge) {
+        if (!use_raytracing) {
+            SPDLOG_ERROR("Convergence is only measured for the path tracers");
+            return 1;
+        }
+        try {
+            converge_image = Common::ReadEXR(converge_reference);
+        } catch (std::exception& e) {
+            SPDLOG_ERROR("Failed to load the reference image: {}", e.what());
+            return 1;
+        }
+        if (!batch_cameras.empty()) {
+            SPDLOG_WARN("Batches are not measured, rendering the default camera");
+            batch_cameras.clear();
+        }
+        static constexpr double DefaultConvergenceTime = 60;
+        if (time_budget <= 0) {
+            time_budget = DefaultConvergenceTime;
+        }
+        headless = true;
+        export_exr = false;
+        if (!sampler_seed) {
+            sampler_seed = 0;
+        }
+    }
+    // The jobs of a server bring their own scenes and cameras
+    if (serve) {
+        if (benchmark || converge || !batch_cameras.empty()) {
+            SPDLOG_WARN("Serving render jobs instead of rendering the scene");
+        }
+        headless = true;
+        batch_cameras.clear();
+    }
+    if (num_frames == 0 && time_budget <= 0) {
+        num_frames = 1;
+    }
+    if (num_gpus > 1 && !serve && (!use_raytracing || batch_cameras.empty())) {
+        SPDLOG_WARN("Multiple GPUs are only supported by path_tracer_hw batches, using one");
+        num_gpus = 1;
+    }
+    if (num_frames != 0 && !serve) { // Every GPU renders at least one frame of each camera
+        num_gpus = std::min(num_gpus, num_frames);
+    }
+    if (export_exr && (!use_raytracing || !headless)) {
+        SPDLOG_WARN("EXR files are only written by headless path tracers, writing PPM");
+        export_exr = false;
+    }
+    // Each renderer would write the same checkpoint, and batches move on to other cameras
+    if (!checkpoint_path.empty() &&
+        (!use_raytracing || num_gpus > 1 || !batch_cameras.empty() || benchmark || converge ||
+         serve)) {
+        SPDLOG_WARN("Checkpoints are only written by single path tracer renders, disabling them");
+        checkpoint_path.clear();
+    }
+    // Jobs and GPUs trace parts of the same sequences, see SetSampleStream
+    if (!sampler_seed && (job != 0 || num_gpus > 1)) {
+        sampler_seed = 0;
+    }
+
+    // Headless rendering needs neither a window nor any instance extensions
+    GLFWwindow* window = nullptr;
+    std::vector<const char*> extensions;
+    if (!headless) {
+        glfwInit();
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        window = glfwCreateWindow(width, height, "Border Collie", nullptr, nullptr);
+
+        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+        glfwSetCursorPosCallback(window, &MouseCallback);
+        glfwSetScrollCallback(window, &ScrollCallback);
+
+        // Query extensions required by frontend
+        u32 extension_count = 0;
+        const char** extensions_raw = glfwGetRequiredInstanceExtensions(&extension_count);
+        extensions.assign(extensions_raw, extensions_raw + extension_count);
+    }
     SCOPE_EXIT({
-        glfwDestroyWindow(window);
-        glfwTerminate();
+        if (window) {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+        }
     });
 
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-    glfwSetCursorPosCallback(window, &MouseCallback);
-    glfwSetScrollCallback(window, &ScrollCallback);
+    if (!remote_cache.has_value()) {
+        std::error_code temp_error;
+        const auto temp_directory = std::filesystem::temp_directory_path(temp_error);
+        remote_cache = temp_error ? std::filesystem::path{} : temp_directory / u8"border_collie";
+    }
+    Common::RemoteFile::SetCacheDirectory(*remote_cache);
+
+    // Declared before the renderer, which delivers frames to them until it is destroyed
+    std::unique_ptr<FrameWriter> frame_writer;
+    std::unique_ptr<SampleMerger> sample_merger;
+    std::unique_ptr<ConvergenceMeter> convergence_meter;
+    std::deque<std::string> pending_names; // Of the frames read back, in order
+    std::deque<std::size_t> pending_samples; // Of the frames read back when writing EXR files
+    std::ofstream encode_file;                // Of --encode
+    // Also writes the frames captured with F12
+    frame_writer = std::make_unique<FrameWriter>(output_dir, exposure, tonemap);
+    if (num_gpus > 1 && !serve) { // Servers render each job on one GPU
+        sample_merger = std::make_unique<SampleMerger>(*frame_writer, num_gpus, export_exr);
+    }
+    if (converge) {
+        try {
+            convergence_meter = std::make_unique<ConvergenceMeter>(*frame_writer, *converge_image);
+        } catch (std::exception&) {
+            return 1; // Logged already
+        }
+        converge_image.reset();
+    }
 
-    // Query extensions required by frontend
-    u32 extension_count = 0;
-    const char** extensions_raw = glfwGetRequiredInstanceExtensions(&extension_count);
-    std::vector<const char*> extensions{extensions_raw, extensions_raw + extension_count};
+    // The devices are probed before any renderer creates one, so that the backend can take the
+    // paths the device supports instead of failing to create it
+    std::vector<Renderer::DeviceProfile> device_profiles;
+    {
+        const Renderer::VulkanContext probe_context{false, {}};
+        device_profiles = Renderer::GetDeviceProfiles(probe_context.instance);
+    }
+    std::optional<std::size_t> device_index; // Unset picks the best
+    if (!device_id.empty()) {
+        const auto* found = Renderer::FindDevice(device_profiles, device_id);
+        if (!found) {
+            std::cout << "Invalid device!" << std::endl;
+            PrintHelp(argv[0]);
+            return 0;
+        }
+        device_index = found->index;
+    }
+    const Renderer::DeviceProfile device_profile =
+        device_profiles.empty()
+            ? Renderer::DeviceProfile{}
+            : device_profiles[device_index.value_or(Renderer::GetBestDevice(device_profiles))];
+    if (auto_backend) {
+        const auto picked = Renderer::PickPathTracer(device_profile);
+        use_wavefront = picked == Renderer::PathTracerBackend::Wavefront;
+        use_compute = picked == Renderer::PathTracerBackend::Compute;
+        SPDLOG_INFO("Picked {} for {}",
+                    use_wavefront  ? "path_tracer_wavefront"
+                    : use_compute ? "path_tracer_compute"
+                                   : "path_tracer_hw",
+                    device_profile.name);
+    } else if (use_raytracing && !use_cpu && !use_compute &&
+               !(use_wavefront ? device_profile.ray_query : device_profile.ray_tracing_pipeline)) {
+        SPDLOG_WARN("{} cannot trace rays in hardware, falling back to path_tracer_compute",
+                    device_profile.name);
+        use_wavefront = false;
+        rasterize_primary = false;
+        use_compute = true;
+    } else if (!use_raytracing && use_meshlets && !device_profile.mesh_shader) {
+        SPDLOG_WARN("{} has no mesh shaders, falling back to the rasterizer", device_profile.name);
+        use_meshlets = false;
+    }
+    if (!use_raytracing && !use_meshlets && probe_gi && !device_profile.ray_query) {
+        SPDLOG_WARN("{} has no ray queries, disabling probe GI", device_profile.name);
+        probe_gi = false;
+    }
+    // Only scenes loaded up front are shared, see VulkanRenderer::ShareScene
+    if (switch_backend &&
+        (headless || benchmark || use_meshlets || use_cpu || use_compute ||
+         texture_budget_mib > 0 || geometry_budget_mib > 0 || lazy_textures)) {
+        SPDLOG_WARN("Backends are only switched between the rasterizer and the hardware path "
+                    "tracers in a window, without streaming or lazy textures");
+        switch_backend = false;
+    } else if (switch_backend && !use_raytracing && !device_profile.ray_tracing_pipeline) {
+        SPDLOG_WARN("{} cannot trace rays in hardware, not switching backends",
+                    device_profile.name);
+        switch_backend = false;
+    }
 
-    std::unique_ptr<Renderer::VulkanRenderer> renderer;
 #ifdef NDEBUG
-    if (use_raytracing) {
-        auto path_tracer =
-            std::make_unique<Renderer::VulkanPathTracerHW>(false, std::move(extensions));
-        path_tracer->SetLightProperties(intensity, ambient);
-        renderer = std::move(path_tracer);
-    } else {
-        renderer = std::make_unique<Renderer::VulkanRasterizer>(false, std::move(extensions));
-    }
+    static constexpr bool EnableValidation = false;
 #else
-    if (use_raytracing) {
-        auto path_tracer =
-            std::make_unique<Renderer::VulkanPathTracerHW>(true, std::move(extensions));
-        path_tracer->SetLightProperties(intensity, ambient);
-        renderer = std::move(path_tracer);
-    } else {
-        renderer = std::make_unique<Renderer::VulkanRasterizer>(true, std::move(extensions));
-    }
+    static constexpr bool EnableValidation = true;
 #endif
+    // Or the other of the rasterizer and the path tracer if switched, see --switch-backend
+    const auto CreateRenderer = [&](std::vector<const char*> instance_extensions,
+                                    bool switched = false)
+        -> std::unique_ptr<Renderer::VulkanRenderer> {
+        std::unique_ptr<Renderer::VulkanRenderer> created;
+        if (use_raytracing != switched) {
+            std::unique_ptr<Renderer::VulkanPathTracerHW> path_tracer;
+            if (use_compute) {
+                path_tracer = std::make_unique<Renderer::VulkanPathTracerCompute>(
+                    EnableValidation, std::move(instance_extensions));
+            } else if (use_cpu) {
+                path_tracer = std::make_unique<Renderer::VulkanPathTracerCPU>(
+                    EnableValidation, std::move(instance_extensions));
+            } else if (use_wavefront) {
+                auto wavefront = std::make_unique<Renderer::VulkanPathTracerWavefront>(
+                    EnableValidation, std::move(instance_extensions));
+                wavefront->SetRasterizedPrimaryHits(rasterize_primary);
+                path_tracer = std::move(wavefront);
+            } else {
+                path_tracer = std::make_unique<Renderer::VulkanPathTracerHW>(
+                    EnableValidation, std::move(instance_extensions));
+            }
+            path_tracer->SetLightProperties(intensity, ambient);
+            path_tracer->SetHostBuilds(host_builds);
+            path_tracer->SetFastFirstBuilds(fast_builds);
+            // Headless frames are written out, so they wait for the whole scene
+            path_tracer->SetProgressiveBuilds(progressive_builds && !headless);
+            path_tracer->SetGPUInstances(gpu_instances, cull_distance, cull_size);
+            path_tracer->SetAdaptiveSampling(adaptive_threshold);
+            path_tracer->SetSampling(samples_per_frame, max_depth, russian_roulette,
+                                     roulette_depth);
+            path_tracer->SetReprojection(reproject);
+            path_tracer->SetReSTIR(restir_candidates);
+            path_tracer->SetPathGuiding(path_guiding);
+            path_tracer->SetIntegrator(integrator);
+            path_tracer->SetMotionIntegrator(motion_integrator);
+            if (picking && (use_cpu || use_compute)) {
+                SPDLOG_WARN("{} cannot pick, picks hit nothing",
+                            use_cpu ? "path_tracer_cpu" : "path_tracer_compute");
+            }
+            path_tracer->SetPicking(picking && !use_cpu && !use_compute);
+            path_tracer->SetDenoising(denoise, fixed_rate_denoise);
+            path_tracer->SetCostHeatmap(cost_heatmap);
+            path_tracer->SetRayStats(ray_stats);
+            path_tracer->SetEnvironmentMap(environment_map, environment_intensity);
+            if (sampler_seed) {
+                path_tracer->SetSamplerSeed(*sampler_seed);
+            }
+            path_tracer->SetSampleStream(job * static_cast<u32>(num_gpus));
+            // The window stays responsive by default, leaving time to present at 60 Hz
+            path_tracer->SetTargetTraceTime(
+                target_trace_time.value_or(headless || benchmark ? 0.0 : 12.0));
+            path_tracer->SetTiledTracing(tile_size, submit_time);
+            path_tracer->SetTracePasses(trace_passes);
+            path_tracer->SetCheckpointing(checkpoint_path, checkpoint_interval);
+            // Headless renders draw the frames they are asked for
+            path_tracer->SetConvergence(headless ? 0 : target_samples, !headless);
+            created = std::move(path_tracer);
+        } else if (use_meshlets) {
+            created = std::make_unique<Renderer::VulkanMeshletRenderer>(
+                EnableValidation, std::move(instance_extensions));
+        } else {
+            auto rasterizer = std::make_unique<Renderer::VulkanRasterizer>(
+                EnableValidation, std::move(instance_extensions));
+            rasterizer->SetDepthPrepass(depth_prepass);
+            rasterizer->SetVisibilityBuffer(visibility_buffer);
+            rasterizer->SetProbeGI(probe_gi);
+            rasterizer->SetVariableRateShading(variable_rate_shading);
+            rasterizer->SetLODs(lods);
+            rasterizer->SetGeometryBudget(geometry_budget_mib * 1024 * 1024);
+            created = std::move(rasterizer);
+        }
+        created->SetWorkerThreads(num_threads);
+        created->SetTextureCompression(compress_textures);
+        created->SetTextureBudget(texture_budget_mib * 1024 * 1024);
+        created->SetHostCacheBudget(host_cache_mib * 1024 * 1024);
+        created->SetTextureQuality(max_texture_size, dropped_mips,
+                                   texture_memory_mib * 1024 * 1024);
+        created->SetLazyTextures(lazy_textures);
+        created->SetIndexOptimization(optimize_indices);
+        created->SetVertexPacking(pack_vertices);
+        created->SetGPUTangentThreshold(gpu_tangent_triangles);
+        created->SetGPUImageDecode(gpu_image_decode);
+        created->SetSpatialReordering(spatial_order);
+        created->SetDynamicResolution(dynamic_resolution_ms);
+        created->SetGPUProfiling(gpu_profile);
+        created->SetExposure(exposure);
+        created->SetTonemapping(tonemap);
+        created->SetStereo(eye_separation);
+        created->SetFramesInFlight(num_frames_in_flight);
+        created->SetPresentPacing(present_pacing);
+        created->SetDescriptorBuffer(descriptor_buffer);
+        created->SetDefragmentation(defragment);
+        if (device_index) {
+            created->SetPhysicalDevice(*device_index);
+        }
+        return created;
+    };
+    // Each GPU of a batch has a renderer of its own, with its own copy of the scene
+    const auto SetSampleMergerCallback = [&sample_merger](Renderer::VulkanRenderer& target,
+                                                          std::size_t gpu) {
+        target.SetPhysicalDevice(gpu);
+        target.SetFrameCallback(
+            [&sample_merger, gpu](const Renderer::VulkanSwapchain::ReadbackFrame& frame) {
+                sample_merger->Add(gpu, frame);
+            },
+            true);
+    };
+
+    std::unique_ptr<Renderer::VulkanRenderer> renderer = CreateRenderer(std::move(extensions));
+    // Shares the device and the scene of the renderer, initialized once first switched to
+    std::unique_ptr<Renderer::VulkanRenderer> switch_renderer;
+    if (switch_backend) {
+        switch_renderer = CreateRenderer({}, true);
+        renderer->AddSwitchTarget(*switch_renderer);
+        switch_renderer->AddSwitchTarget(*renderer); // For its reloads
+    }
+    if (sample_merger) {
+        SetSampleMergerCallback(*renderer, 0);
+    } else if (convergence_meter) {
+        renderer->SetFrameCallback(
+            [&convergence_meter](const Renderer::VulkanSwapchain::ReadbackFrame& frame) {
+                convergence_meter->Add(frame);
+            },
+            true);
+    } else if (headless) {
+        renderer->SetFrameCallback(
+            [&frame_writer, &pending_names, &pending_samples,
+             export_exr](const Renderer::VulkanSwapchain::ReadbackFrame& frame) {
+                std::size_t samples = 0;
+                if (export_exr) {
+                    samples = pending_samples.front();
+                    pending_samples.pop_front();
+                }
+                if (pending_names.empty()) {
+                    frame_writer->Push(
+                        fmt::format("frame_{:06}.{}", frame.number, export_exr ? "exr" : "ppm"),
+                        frame, samples);
+                } else {
+                    frame_writer->Push(std::move(pending_names.front()), frame, samples);
+                    pending_names.pop_front();
+                }
+            },
+            export_exr);
+    }
+    if (!encode_path.empty() && !headless) {
+        SPDLOG_WARN("Only headless frames are encoded, ignoring --encode");
+    } else if (!encode_path.empty()) {
+        encode_file.open(encode_path, std::ios::binary);
+        if (!encode_file) {
+            SPDLOG_ERROR("Failed to open {}", encode_path.string());
+            return 1;
+        }
+        renderer->SetVideoEncoding(
+            [&encode_file](const Renderer::VulkanVideoEncoder::Packet& packet) {
+                encode_file.write(reinterpret_cast<const char*>(packet.data.data()),
+                                  packet.data.size());
+            },
+            {
+                .bitrate = encode_bitrate_kbps * 1000,
+                .frame_rate = animation_fps > 0 ? static_cast<u32>(animation_fps) : 60,
+            });
+    }
 
-    VkSurfaceKHR surface;
-    if (glfwCreateWindowSurface(*renderer->GetVulkanInstance(), window, nullptr, &surface) !=
-        VK_SUCCESS) {
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
+    if (window && glfwCreateWindowSurface(*renderer->GetVulkanInstance(), window, nullptr,
+                                          &surface) != VK_SUCCESS) {
 
         SPDLOG_ERROR("Failed to create window surface");
         return 1;
@@ -244,36 +2544,456 @@ int main(int argc, char* argv[]) {
 
     renderer->Init(surface, vk::Extent2D{static_cast<u32>(width), static_cast<u32>(height)});
 
-    try {
-        GLTF::Container gltf(file_path);
-        renderer->LoadScene(gltf);
-    } catch (std::exception& e) {
-        SPDLOG_ERROR("Failed to load glTF scene: {}", e.what());
-        return 1;
+    if (serve) {
+        return RunServer(std::move(renderer), [&CreateRenderer] { return CreateRenderer({}); },
+                         num_gpus,
+                         {
+                             .extent = {static_cast<u32>(width), static_cast<u32>(height)},
+                             .frames_per_camera = num_frames,
+                             .time_budget = time_budget,
+                             .path_tracer = use_raytracing,
+                             .export_exr = export_exr,
+                             .focal_dist = g_camera_focal,
+                             .aperture = aperture,
+                             .resident_budget = vk::DeviceSize{resident_budget_mib} * 1024 * 1024,
+                             .max_tenants = max_tenants,
+                         });
     }
 
-    glfwSetWindowUserPointer(window, renderer.get());
-    glfwSetFramebufferSizeCallback(window, &OnFramebufferResized);
+    std::error_code error;
+    auto loaded_write_time = std::filesystem::last_write_time(file_path, error);
+    const auto LoadInitialScene = [&renderer, &file_path, &stats_path, watch] {
+        try {
+            GLTF::Container gltf(file_path);
+            if (watch) {
+                renderer->ReloadScene(gltf);
+            } else {
+                renderer->LoadScene(gltf);
+            }
+        } catch (std::exception& e) {
+            SPDLOG_ERROR("Failed to load glTF scene: {}", e.what());
+            return false;
+        }
+        renderer->TrimHostMemory(); // Now that the container is gone
+        if (!stats_path.empty()) {
+            renderer->WriteSceneStats(stats_path);
+        }
+        return true;
+    };
+    // Interactively, the scene is loaded by the render thread while the window stays responsive
+    const bool threaded = window && !benchmark;
+    if (!threaded && !LoadInitialScene()) {
+        return 1;
+    }
 
-    float last_frame_time = glfwGetTime();
-    while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
+    if (benchmark) {
+        if (use_raytracing) {
+            static_cast<Renderer::VulkanPathTracerHW&>(*renderer).SetCameraProperties(
+                g_camera_focal, aperture);
+        }
+        renderer->SetFrameReadback(false);
+        return RunBenchmark(*renderer, window, bench_poses, num_frames, output_dir);
+    }
 
-        const float time = glfwGetTime();
-        ProcessInput(window, time - last_frame_time);
-        last_frame_time = time;
+    if (convergence_meter) {
+        auto& path_tracer = static_cast<Renderer::VulkanPathTracerHW&>(*renderer);
+        path_tracer.SetCameraProperties(g_camera_focal, aperture);
+        return RunConvergence(path_tracer, *convergence_meter,
+                              Renderer::Camera{g_camera_position, GetCameraFront(), GetCameraUp()},
+                              time_budget, output_dir);
+    }
 
+    if (headless) {
         if (use_raytracing) {
             static_cast<Renderer::VulkanPathTracerHW&>(*renderer).SetCameraProperties(
                 g_camera_focal, aperture);
         }
+        const auto LogGPUProfile = [&renderer, use_raytracing] {
+            if (const auto* profiler = renderer->GetGPUProfiler()) {
+                SPDLOG_INFO("GPU time of the last frames:\n{}", profiler->GetReport());
+            }
+            if (!use_raytracing) {
+                return;
+            }
+            const auto& path_tracer = static_cast<Renderer::VulkanPathTracerHW&>(*renderer);
+            if (const auto stats = path_tracer.GetRayStats(true)) {
+                SPDLOG_INFO("Rays of the frames: {}", FormatRayStats(*stats));
+            }
+            LogMaterialCosts(path_tracer);
+        };
+        if (batch_cameras.empty()) {
+            for (std::size_t i = 0; i < std::max<std::size_t>(num_frames, 1); ++i) {
+                if (animation_fps > 0) {
+                    renderer->SetAnimationTime(i / animation_fps);
+                }
+                renderer->DrawFrame(
+                    Renderer::Camera{g_camera_position, GetCameraFront(), GetCameraUp()},
+                    force_ext_cam);
+                if (export_exr) { // Delivered by a later frame at the earliest
+                    pending_samples.push_back(
+                        static_cast<Renderer::VulkanPathTracerHW&>(*renderer)
+                            .GetAccumulatedSamples());
+                }
+            }
+            renderer->FlushFrames();
+            LogGPUProfile();
+            return 0;
+        }
+
+        std::vector<std::unique_ptr<Renderer::Camera>> loaded_cameras;
+        std::vector<const Renderer::Camera*> cameras;
+        try {
+            if (batch_cameras == "scene") {
+                for (const auto& camera : renderer->GetSubScene().cameras) {
+                    cameras.emplace_back(camera.get());
+                }
+            } else {
+                loaded_cameras = LoadCameraList(std::filesystem::u8path(batch_cameras));
+                for (const auto& camera : loaded_cameras) {
+                    cameras.emplace_back(camera.get());
+                }
+            }
+        } catch (std::exception& e) {
+            SPDLOG_ERROR("Failed to load cameras: {}", e.what());
+            return 1;
+        }
+
+        if (cameras.empty()) {
+            SPDLOG_WARN("No cameras to render");
+        }
+
+        // Only the last frame of each camera is read back. Its readback and writing overlap
+        // with rendering the next camera, which resets the accumulation by itself.
+        // on_last(camera, samples) is called once it is drawn, before its readback is delivered,
+        // with the samples of each pixel it accumulated (frames for the rasterizers).
+        const auto RenderCameras = [&cameras, time_budget,
+                                    use_raytracing](Renderer::VulkanRenderer& target,
+                                                    std::size_t frames_per_camera,
+                                                    const auto& on_last) {
+            for (std::size_t i = 0; i < cameras.size(); ++i) {
+                const auto start_time = std::chrono::steady_clock::now();
+                for (std::size_t frame = 0;; ++frame) {
+                    const std::chrono::duration<double> elapsed =
+                        std::chrono::steady_clock::now() - start_time;
+                    const bool last =
+                        frame + 1 >= frames_per_camera ||
+                        (time_budget > 0 && elapsed.count() >= time_budget);
+                    target.SetFrameReadback(last);
+                    target.DrawFrame(*cameras[i], true);
+                    if (last) {
+                        on_last(i, use_raytracing
+                                       ? static_cast<Renderer::VulkanPathTracerHW&>(target)
+                                             .GetAccumulatedSamples()
+                                       : frame + 1);
+                        SPDLOG_INFO("Rendered camera {} with {} frames", i, frame + 1);
+                        break;
+                    }
+                }
+            }
+            target.FlushFrames();
+        };
+        // Without a frame count, render until the time budget is used up
+        const auto GetFramesPerCamera = [num_frames, num_gpus](std::size_t gpu) {
+            if (num_frames == 0) {
+                return std::numeric_limits<std::size_t>::max();
+            }
+            return num_frames / num_gpus + (gpu < num_frames % num_gpus ? 1 : 0);
+        };
+
+        if (num_gpus == 1) {
+            RenderCameras(*renderer, GetFramesPerCamera(0),
+                          [&pending_names, &pending_samples, export_exr](std::size_t camera,
+                                                                         std::size_t samples) {
+                              pending_names.emplace_back(fmt::format(
+                                  "view_{:04}.{}", camera, export_exr ? "exr" : "ppm"));
+                              if (export_exr) {
+                                  pending_samples.push_back(samples);
+                              }
+                          });
+            LogGPUProfile();
+            return 0;
+        }
 
-        if (g_should_render) {
-            renderer->DrawFrame(
-                Renderer::Camera{g_camera_position, GetCameraFront(), GetCameraUp()},
-                force_ext_cam);
+        // The GPUs render independent samples of every camera, on a thread each, and the
+        // frames they read back are merged on the host
+        std::vector<std::unique_ptr<Renderer::VulkanRenderer>> renderers;
+        renderers.emplace_back(std::move(renderer));
+        try {
+            for (std::size_t gpu = 1; gpu < num_gpus; ++gpu) {
+                auto& gpu_renderer = renderers.emplace_back(CreateRenderer({}));
+                SetSampleMergerCallback(*gpu_renderer, gpu);
+                gpu_renderer->Init(VK_NULL_HANDLE, vk::Extent2D{static_cast<u32>(width),
+                                                                static_cast<u32>(height)});
+                GLTF::Container gltf(file_path);
+                gpu_renderer->LoadScene(gltf);
+                auto& gpu_path_tracer = static_cast<Renderer::VulkanPathTracerHW&>(*gpu_renderer);
+                gpu_path_tracer.SetCameraProperties(g_camera_focal, aperture);
+                gpu_path_tracer.SetSampleStream(job * static_cast<u32>(num_gpus) +
+                                                static_cast<u32>(gpu));
+            }
+        } catch (std::exception& e) {
+            SPDLOG_ERROR("Failed to set up GPU {}: {}", renderers.size() - 1, e.what());
+            return 1;
+        }
+
+        std::atomic_bool failed{false};
+        {
+            std::vector<std::jthread> threads;
+            for (std::size_t gpu = 0; gpu < num_gpus; ++gpu) {
+                threads.emplace_back([&, gpu] {
+                    try {
+                        RenderCameras(*renderers[gpu], GetFramesPerCamera(gpu),
+                                      [&sample_merger, gpu](std::size_t camera,
+                                                            std::size_t samples) {
+                                          sample_merger->Expect(gpu, camera, samples);
+                                      });
+                    } catch (std::exception& e) {
+                        SPDLOG_ERROR("Failed to render on GPU {}: {}", gpu, e.what());
+                        failed = true;
+                    }
+                });
+            }
         }
+        return failed ? 1 : 0;
     }
 
-    return 0;
+    glfwSetFramebufferSizeCallback(window, &OnFramebufferResized);
+    glfwSetKeyCallback(window, &KeyCallback);
+
+    // The main thread handles the input, as GLFW requires, and hands it to the render thread,
+    // which loads the scene and draws the frames, so that neither waits for the other
+    Common::SPSCQueue<InputSnapshot, 64> input_queue;
+    std::atomic_bool loaded{false}, render_done{false}, failed{false};
+    std::mutex title_mutex;
+    std::optional<std::string> pending_title; // Set by the render thread
+    std::jthread render_thread([&, input = InputSnapshot::Take()](std::stop_token stop) mutable {
+        SCOPE_EXIT({ render_done = true; });
+        if (!LoadInitialScene()) {
+            failed = true;
+            return;
+        }
+        loaded = true;
+
+        float last_watch_time = glfwGetTime();
+        float last_title_time = last_watch_time;
+        auto pending_write_time = loaded_write_time;
+        const bool show_latency = present_pacing == Renderer::VulkanSwapchain::Pacing::LowLatency;
+        bool tracing = use_raytracing; // Whether renderer is a path tracer, see --switch-backend
+        auto* path_tracer =
+            tracing ? static_cast<Renderer::VulkanPathTracerHW*>(renderer.get()) : nullptr;
+        bool switch_initialized = false;
+        vk::Extent2D window_extent{static_cast<u32>(width), static_cast<u32>(height)};
+        bool should_render = true;
+        // Of the frame drawn last, which converged images are left as while it stays the same
+        std::optional<std::tuple<glm::vec3, float, float, float>> drawn_view;
+        while (!stop.stop_requested()) {
+            // The input is taken after waiting, so that it is as fresh as possible when displayed
+            renderer->WaitForFrameStart();
+            while (auto later = input_queue.Pop()) {
+                input.Merge(*later);
+            }
+            const float time = glfwGetTime();
+
+            if (const auto extent = std::exchange(input.resized, std::nullopt)) {
+                should_render = extent->width != 0 && extent->height != 0;
+                if (should_render) {
+                    renderer->OnResized(*extent);
+                    window_extent = *extent;
+                }
+            }
+            // The window takes one swapchain at a time, handed over to the other renderer. It
+            // shares the scene again once the renderer has reloaded it.
+            if (std::exchange(input.switch_backend, false) && switch_renderer && should_render) {
+                renderer->ReleaseSwapchain();
+                try {
+                    if (!switch_initialized) {
+                        VkSurfaceKHR switch_surface = VK_NULL_HANDLE;
+                        if (glfwCreateWindowSurface(*renderer->GetVulkanInstance(), window,
+                                                    nullptr, &switch_surface) != VK_SUCCESS) {
+                            throw std::runtime_error("Failed to create window surface");
+                        }
+                        switch_renderer->ShareDevice(*renderer);
+                        switch_renderer->Init(switch_surface, window_extent);
+                        switch_initialized = true;
+                    } else {
+                        switch_renderer->OnResized(window_extent);
+                    }
+                    if (!switch_renderer->SharesScene(*renderer)) {
+                        switch_renderer->ShareScene(*renderer);
+                    }
+                    std::swap(renderer, switch_renderer);
+                    tracing = !tracing;
+                    path_tracer = tracing ? static_cast<Renderer::VulkanPathTracerHW*>(
+                                                renderer.get())
+                                          : nullptr;
+                    drawn_view.reset();
+                    SPDLOG_INFO("Switched to the {}", tracing ? "path tracer" : "rasterizer");
+                } catch (std::exception& e) {
+                    SPDLOG_ERROR("Failed to switch backends: {}", e.what());
+                    renderer->OnResized(window_extent);
+                }
+            }
+            if (const int steps = std::exchange(input.sub_scene_steps, 0); steps != 0) {
+                const std::size_t count = renderer->GetNumSubScenes();
+                if (count >= 2) {
+                    const auto offset = steps % static_cast<std::ptrdiff_t>(count);
+                    const std::size_t next =
+                        (renderer->GetCurrentSubScene() + count + offset) % count;
+                    try {
+                        renderer->SetSubScene(next);
+                        SPDLOG_INFO("Switched to scene {}", next);
+                    } catch (std::exception& e) {
+                        SPDLOG_ERROR("Failed to switch to scene {}: {}", next, e.what());
+                    }
+                }
+            }
+            if (const auto i = std::exchange(input.integrator, std::nullopt); i && path_tracer) {
+                path_tracer->SetIntegrator(
+                    static_cast<Renderer::VulkanPathTracerHW::Integrator>(*i));
+                SPDLOG_INFO("Switched to the {} integrator", IntegratorNames[*i]);
+            }
+            if (std::exchange(input.pick, false) && path_tracer && picking) {
+                using PickHit = Renderer::VulkanPathTracerHW::PickHit;
+                path_tracer->Pick(
+                    {{
+                        .origin = input.camera_position,
+                        .direction = GetCameraFront(input.camera_yaw, input.camera_pitch),
+                    }},
+                    [](std::span<const std::optional<PickHit>> hits) {
+                        if (const auto& hit = hits[0]) {
+                            SPDLOG_INFO("Picked instance {} of mesh {} (primitive {}, triangle "
+                                        "{}) at a distance of {}",
+                                        hit->instance, hit->mesh, hit->primitive,
+                                        hit->triangle, hit->distance);
+                        } else {
+                            SPDLOG_INFO("Picked nothing");
+                        }
+                    });
+            }
+            if (std::exchange(input.memory_report, false)) {
+                renderer->WriteMemoryReport("memory_report.json");
+            }
+
+            // Reload once the file has stopped changing for a whole interval, so that it is not
+            // read while the exporter is still writing it
+            static constexpr float WatchInterval = 0.5f;
+            if (watch && time - last_watch_time >= WatchInterval) {
+                last_watch_time = time;
+                const auto write_time = std::filesystem::last_write_time(file_path, error);
+                if (!error && write_time != loaded_write_time) {
+                    if (write_time == pending_write_time) {
+                        loaded_write_time = write_time;
+                        try {
+                            GLTF::Container gltf(file_path);
+                            renderer->ReloadScene(gltf);
+                        } catch (std::exception& e) {
+                            SPDLOG_ERROR("Failed to reload glTF scene: {}", e.what());
+                        }
+                        renderer->TrimHostMemory();
+                    } else {
+                        pending_write_time = write_time;
+                    }
+                }
+            }
+
+            if (path_tracer) {
+                path_tracer->SetCameraProperties(input.camera_focal, aperture);
+            }
+
+            if (animation_fps > 0) {
+                renderer->SetAnimationTime(time);
+            }
+            // Converged images stay presented as they are, waiting for input instead of tracing
+            const auto view = std::tuple{input.camera_position, input.camera_yaw,
+                                         input.camera_pitch, input.camera_focal};
+            if (path_tracer && animation_fps <= 0 && !input.capture && drawn_view == view &&
+                path_tracer->IsConverged()) {
+                static constexpr auto IdleWait = std::chrono::milliseconds(5);
+                std::this_thread::sleep_for(IdleWait); // Still watching the file meanwhile
+                continue;
+            }
+            if (std::exchange(input.capture, false)) {
+                renderer->CaptureFrame([&frame_writer, &capture_format](const auto& frame) {
+                    frame_writer->PushCapture(
+                        fmt::format("capture_{:04}.{}", frame.number, capture_format), frame);
+                });
+            }
+            if (should_render) {
+                renderer->DrawFrame(input.GetCamera(), force_ext_cam);
+                drawn_view = view;
+            }
+
+            // The GPU time of the passes, the rays per second and the latency, for want of an
+            // overlay
+            static constexpr float TitleInterval = 0.5f;
+            const auto* profiler = renderer->GetGPUProfiler();
+            if ((profiler || ray_stats || show_latency) &&
+                time - last_title_time >= TitleInterval) {
+                last_title_time = time;
+                std::string title = "Border Collie";
+                if (const auto latency = renderer->GetPresentLatency(); show_latency && latency) {
+                    title += fmt::format(" | Latency {:.1f} ms", *latency);
+                }
+                if (profiler) {
+                    for (const auto& scope : profiler->GetStats()) {
+                        title += fmt::format(" | {} {:.2f} ms", scope.name, scope.milliseconds);
+                    }
+                }
+                if (ray_stats && path_tracer) {
+                    if (const auto stats = path_tracer->GetRayStats()) {
+                        title += fmt::format(" | {:.1f} Mrays/s", stats->GetMraysPerSecond());
+                    }
+                }
+                std::scoped_lock lock{title_mutex};
+                pending_title = std::move(title);
+            }
+        }
+        renderer->FlushFrames(); // Delivers the captures in flight
+
+        if (path_tracer) {
+            LogMaterialCosts(*path_tracer);
+        }
+    });
+
+    // Movement is sampled at this rate even without events, as keys are held down
+    static constexpr double InputInterval = 1.0 / 240;
+    static constexpr float LoadingTitleInterval = 0.25f;
+    float last_input_time = glfwGetTime();
+    float last_loading_time = last_input_time;
+    InputSnapshot pending; // Carries the events over while the queue is full
+    bool showing_progress = false;
+    while (!glfwWindowShouldClose(window) && !render_done) {
+        glfwWaitEventsTimeout(InputInterval);
+
+        const float time = glfwGetTime();
+        ProcessInput(window, time - last_input_time);
+        last_input_time = time;
+        pending.Merge(InputSnapshot::Take());
+        if (input_queue.Push(pending)) {
+            pending = {};
+        }
+
+        if (!loaded && time - last_loading_time >= LoadingTitleInterval) {
+            last_loading_time = time;
+            const auto progress = Renderer::LoadProfiler::GetProgress();
+            const auto title = fmt::format("Border Collie | Loading: {} ({} steps)",
+                                           progress.stage ? progress.stage : "Scene",
+                                           progress.completed);
+            glfwSetWindowTitle(window, title.c_str());
+            showing_progress = true;
+        } else if (loaded && std::exchange(showing_progress, false)) {
+            glfwSetWindowTitle(window, "Border Collie");
+        }
+        std::optional<std::string> title;
+        {
+            std::scoped_lock lock{title_mutex};
+            title = std::exchange(pending_title, std::nullopt);
+        }
+        if (title) {
+            glfwSetWindowTitle(window, title->c_str());
+        }
+    }
+    render_thread.request_stop();
+    render_thread.join(); // Finishing the load first, if it is still loading
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,122 @@
+// Copyright 2023 Pengfei Zhu
+// Licensed under GPLv2 or any later version
+// Refer to the license.txt file included.
+
+#include <algorithm>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <spdlog/spdlog.h>
+#include "common/common_types.h"
+#include "common/exr.h"
+#include "common/log.h"
+
+// Merges the EXR files of partial renders of a frame, written by the path tracers with --exr.
+// Each holds the sums of the samples of its pixels and their numbers, which simply add up.
+
+static void PrintHelp(const char* argv0) {
+    std::cout << "Usage: " << argv0
+              << " [options] <output> <input>...\n"
+                 "Adds up the samples of the EXR files of partial renders of a frame (written\n"
+                 "with --exr by jobs of their own, see --job) into a file of the same kind.\n"
+                 "-m, --mean            Writes the mean of the samples instead, the final image\n"
+                 "-h, --help            Display this help and exit"
+              << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    Common::InitializeLogging();
+
+    static struct option long_options[] = {
+        {"mean", no_argument, 0, 'm'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+
+    bool write_mean = false;
+    int option_index = 0;
+    while (true) {
+        const int arg = getopt_long(argc, argv, "mh", long_options, &option_index);
+        if (arg == -1) {
+            break;
+        }
+        switch (static_cast<char>(arg)) {
+        case 'm':
+            write_mean = true;
+            break;
+        case 'h':
+            PrintHelp(argv[0]);
+            return 0;
+        default:
+            PrintHelp(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        PrintHelp(argv[0]);
+        return 1;
+    }
+    const auto output_path = std::filesystem::u8path(argv[optind]);
+
+    Common::FloatImage merged;
+    std::size_t samples_channel{};
+    try {
+        for (int i = optind + 1; i < argc; ++i) {
+            const auto path = std::filesystem::u8path(argv[i]);
+            auto image = Common::ReadEXR(path);
+            if (merged.pixels.empty()) {
+                const auto it = std::find(image.channels.begin(), image.channels.end(), "samples");
+                if (it == image.channels.end()) {
+                    SPDLOG_ERROR("{} has no samples channel", path.string());
+                    return 1;
+                }
+                samples_channel = static_cast<std::size_t>(it - image.channels.begin());
+                merged = std::move(image);
+                continue;
+            }
+            if (image.width != merged.width || image.height != merged.height ||
+                image.channels != merged.channels) {
+                SPDLOG_ERROR("{} does not match the size or channels of {}", path.string(),
+                             argv[optind + 1]);
+                return 1;
+            }
+            for (std::size_t j = 0; j < merged.pixels.size(); ++j) {
+                merged.pixels[j] += image.pixels[j];
+            }
+        }
+
+        if (write_mean) {
+            const std::size_t num_channels = merged.channels.size();
+            Common::FloatImage mean{
+                .width = merged.width,
+                .height = merged.height,
+            };
+            for (std::size_t channel = 0; channel < num_channels; ++channel) {
+                if (channel != samples_channel) {
+                    mean.channels.emplace_back(merged.channels[channel]);
+                }
+            }
+            mean.pixels.reserve(std::size_t{merged.width} * merged.height * (num_channels - 1));
+            for (std::size_t j = 0; j < merged.pixels.size(); j += num_channels) {
+                const float samples = merged.pixels[j + samples_channel];
+                for (std::size_t channel = 0; channel < num_channels; ++channel) {
+                    if (channel != samples_channel) {
+                        mean.pixels.emplace_back(
+                            samples > 0 ? merged.pixels[j + channel] / samples : 0.0f);
+                    }
+                }
+            }
+            Common::WriteEXR(output_path, mean);
+        } else {
+            Common::WriteEXR(output_path, merged);
+        }
+    } catch (std::exception& e) {
+        SPDLOG_ERROR("Failed to merge samples: {}", e.what());
+        return 1;
+    }
+    SPDLOG_INFO("Merged {} files into {}", argc - optind - 1, output_path.string());
+    return 0;
+}